@@ -0,0 +1,55 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_ADAPTIVE_SAMPLING_H_
+#define TCMALLOC_ADAPTIVE_SAMPLING_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The bounds AdaptSamplingRate keeps the profile sampling rate within.
+inline constexpr int64_t kMinAdaptiveSamplingRate = 64 << 10;
+inline constexpr int64_t kMaxAdaptiveSamplingRate = int64_t{1} << 32;
+
+// Returns the profile sampling rate to use after <samples> allocations were
+// sampled at <rate> over <seconds>, so that about <target> are sampled a
+// second.  Bytes allocated per second are roughly samples * rate / seconds, so
+// the rate that would have hit the target scales with the samples observed.
+// The rate moves by at most a factor of two per call, so that a burst does not
+// swing it too far, and stays within [kMinAdaptiveSamplingRate,
+// kMaxAdaptiveSamplingRate].  A disabled (non-positive) rate or target is
+// returned unchanged.
+inline int64_t AdaptSamplingRate(int64_t rate, int64_t samples, double seconds,
+                                 double target) {
+  if (target <= 0 || rate <= 0 || seconds <= 0) return rate;
+
+  const double observed = samples / seconds;
+  const double scale = std::clamp(observed / target, 0.5, 2.0);
+  return std::clamp<int64_t>(static_cast<int64_t>(rate * scale),
+                             kMinAdaptiveSamplingRate,
+                             kMaxAdaptiveSamplingRate);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ADAPTIVE_SAMPLING_H_
@@ -0,0 +1,59 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/adaptive_sampling.h"
+
+#include <stdint.h>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr int64_t kRate = 2 << 20;
+
+TEST(AdaptSamplingRateTest, ScalesTowardsTarget) {
+  // 150 samples a second against a target of 100 raises the rate by half.
+  EXPECT_EQ(AdaptSamplingRate(kRate, 300, 2, 100), kRate * 3 / 2);
+  EXPECT_EQ(AdaptSamplingRate(kRate, 75, 1, 100), kRate * 3 / 4);
+  EXPECT_EQ(AdaptSamplingRate(kRate, 100, 1, 100), kRate);
+}
+
+TEST(AdaptSamplingRateTest, MovesAtMostTwofold) {
+  EXPECT_EQ(AdaptSamplingRate(kRate, 100000, 1, 100), kRate * 2);
+  EXPECT_EQ(AdaptSamplingRate(kRate, 1, 1, 100), kRate / 2);
+  EXPECT_EQ(AdaptSamplingRate(kRate, 0, 1, 100), kRate / 2);
+}
+
+TEST(AdaptSamplingRateTest, StaysWithinBounds) {
+  EXPECT_EQ(AdaptSamplingRate(kMinAdaptiveSamplingRate, 0, 1, 100),
+            kMinAdaptiveSamplingRate);
+  EXPECT_EQ(AdaptSamplingRate(kMaxAdaptiveSamplingRate, 100000, 1, 100),
+            kMaxAdaptiveSamplingRate);
+  // A rate set outside of the bounds is brought back within them.
+  EXPECT_EQ(AdaptSamplingRate(1, 100, 1, 100), kMinAdaptiveSamplingRate);
+}
+
+TEST(AdaptSamplingRateTest, LeavesDisabledRateAlone) {
+  EXPECT_EQ(AdaptSamplingRate(0, 100000, 1, 100), 0);
+  EXPECT_EQ(AdaptSamplingRate(-1, 100000, 1, 100), -1);
+  // So too without a target, or without time elapsed.
+  EXPECT_EQ(AdaptSamplingRate(kRate, 100000, 1, 0), kRate);
+  EXPECT_EQ(AdaptSamplingRate(kRate, 100000, 0, 100), kRate);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,167 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/allocation_counts.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/attributes.h"
+#include "absl/functional/function_ref.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "absl/time/time.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal_malloc_extension.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT PageAllocationCounts page_allocation_counts;
+
+namespace {
+
+class AllocationCountsProfile final : public ProfileBase {
+ public:
+  void Add(size_t size, int64_t count) {
+    Profile::Sample sample = {};
+    sample.count = count;
+    sample.sum = count * size;
+    sample.requested_size = size;
+    sample.allocated_size = size;
+    sample.depth = 0;
+    samples_.push_back(sample);
+  }
+
+  void Iterate(
+      absl::FunctionRef<void(const Profile::Sample&)> f) const override {
+    for (const Profile::Sample& sample : samples_) {
+      f(sample);
+    }
+  }
+
+  ProfileType Type() const override { return ProfileType::kAllocationCounts; }
+
+  absl::Duration Duration() const override { return absl::ZeroDuration(); }
+
+ private:
+  std::vector<Profile::Sample> samples_;
+};
+
+}  // namespace
+
+void AddAllocationCountProperties(
+    std::map<std::string, MallocExtension::Property>* result) {
+  if (tc_globals.CpuCacheActive()) {
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      const size_t size = tc_globals.sizemap().class_to_size(size_class);
+      if (size == 0) continue;
+      const auto flow = tc_globals.cpu_cache().GetSizeClassFlow(size_class);
+      if (flow.fetched == 0 && flow.released == 0) continue;
+      // Size classes of different NUMA partitions and access hints share
+      // sizes, so accumulate.
+      const std::string prefix =
+          absl::StrCat("tcmalloc.size_class_histogram.", size, ".");
+      (*result)[prefix + "fetched"].value += flow.fetched;
+      (*result)[prefix + "released"].value += flow.released;
+    }
+  }
+
+  for (int bucket = 0; bucket < PageAllocationCounts::kNumBuckets; ++bucket) {
+    const uint64_t allocs = page_allocation_counts.allocs(bucket);
+    const uint64_t frees = page_allocation_counts.frees(bucket);
+    if (allocs == 0 && frees == 0) continue;
+    const std::string prefix = absl::StrCat(
+        "tcmalloc.page_histogram.",
+        PageAllocationCounts::BucketStart(bucket).raw_num(), ".");
+    (*result)[prefix + "allocs"].value = allocs;
+    (*result)[prefix + "frees"].value = frees;
+  }
+}
+
+bool GetAllocationCountProperty(absl::string_view name, size_t* value) {
+  const bool is_size_class =
+      absl::ConsumePrefix(&name, "tcmalloc.size_class_histogram.");
+  if (!is_size_class &&
+      !absl::ConsumePrefix(&name, "tcmalloc.page_histogram.")) {
+    return false;
+  }
+  const size_t dot = name.find('.');
+  size_t n;
+  if (dot == absl::string_view::npos ||
+      !absl::SimpleAtoi(name.substr(0, dot), &n)) {
+    return false;
+  }
+  const absl::string_view counter = name.substr(dot + 1);
+
+  if (is_size_class) {
+    if (counter != "fetched" && counter != "released") return false;
+    *value = 0;
+    if (!tc_globals.CpuCacheActive()) return true;
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      if (tc_globals.sizemap().class_to_size(size_class) != n) continue;
+      const auto flow = tc_globals.cpu_cache().GetSizeClassFlow(size_class);
+      *value += counter == "fetched" ? flow.fetched : flow.released;
+    }
+    return true;
+  }
+
+  if (counter != "allocs" && counter != "frees") return false;
+  for (int bucket = 0; bucket < PageAllocationCounts::kNumBuckets; ++bucket) {
+    if (PageAllocationCounts::BucketStart(bucket).raw_num() != n) continue;
+    *value = counter == "allocs" ? page_allocation_counts.allocs(bucket)
+                                 : page_allocation_counts.frees(bucket);
+    return true;
+  }
+  return false;
+}
+
+std::unique_ptr<const ProfileBase> DumpAllocationCountsProfile() {
+  auto profile = std::make_unique<AllocationCountsProfile>();
+  if (tc_globals.CpuCacheActive()) {
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      const size_t size = tc_globals.sizemap().class_to_size(size_class);
+      if (size == 0) continue;
+      const uint64_t fetched =
+          tc_globals.cpu_cache().GetSizeClassFlow(size_class).fetched;
+      if (fetched == 0) continue;
+      profile->Add(size, fetched);
+    }
+  }
+
+  for (int bucket = 0; bucket < PageAllocationCounts::kNumBuckets; ++bucket) {
+    const uint64_t allocs = page_allocation_counts.allocs(bucket);
+    if (allocs == 0) continue;
+    profile->Add(PageAllocationCounts::BucketStart(bucket).in_bytes(), allocs);
+  }
+  return profile;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,99 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_ALLOCATION_COUNTS_H_
+#define TCMALLOC_ALLOCATION_COUNTS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "absl/numeric/bits.h"
+#include "absl/strings/string_view.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/pages.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Exact counts of page-level allocations and deallocations, i.e. those without
+// a size class, by length.  Bucket b holds lengths in [2^b, 2^(b+1)) pages.
+// These allocations already take the page allocator's lock (or that of the
+// large span cache), so a shared counter adds little to their cost.
+class PageAllocationCounts {
+ public:
+  static constexpr int kNumBuckets = 48;
+
+  constexpr PageAllocationCounts() = default;
+
+  static int BucketFor(Length n) {
+    ASSERT(n > Length(0));
+    const int bucket = absl::bit_width(n.raw_num()) - 1;
+    return bucket < kNumBuckets ? bucket : kNumBuckets - 1;
+  }
+
+  // The shortest length counted in <bucket>.
+  static constexpr Length BucketStart(int bucket) {
+    return Length(uintptr_t{1} << bucket);
+  }
+
+  void RecordAlloc(Length n) {
+    allocs_[BucketFor(n)].fetch_add(1, std::memory_order_relaxed);
+  }
+  void RecordFree(Length n) {
+    frees_[BucketFor(n)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint64_t allocs(int bucket) const {
+    return allocs_[bucket].load(std::memory_order_relaxed);
+  }
+  uint64_t frees(int bucket) const {
+    return frees_[bucket].load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<uint64_t> allocs_[kNumBuckets] = {};
+  std::atomic<uint64_t> frees_[kNumBuckets] = {};
+};
+
+extern PageAllocationCounts page_allocation_counts;
+
+// Adds the counts of each size class and page-level length bucket to
+// <result>, as the properties
+//   tcmalloc.size_class_histogram.<bytes>.{fetched,released}
+//   tcmalloc.page_histogram.<pages>.{allocs,frees}
+// See CpuCache::GetSizeClassFlow() for what the size class counts cover.
+void AddAllocationCountProperties(
+    std::map<std::string, MallocExtension::Property>* result);
+
+// Looks up one of the properties of AddAllocationCountProperties().  Returns
+// false if <name> is not one of them.
+bool GetAllocationCountProperty(absl::string_view name, size_t* value);
+
+// Returns a ProfileType::kAllocationCounts profile with a sample, without a
+// stack trace, per size class and page-level length bucket.
+std::unique_ptr<const ProfileBase> DumpAllocationCountsProfile();
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ALLOCATION_COUNTS_H_
@@ -0,0 +1,109 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/allocation_counts.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/pages.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(AllocationCountsTest, Buckets) {
+  EXPECT_EQ(PageAllocationCounts::BucketFor(Length(1)), 0);
+  EXPECT_EQ(PageAllocationCounts::BucketFor(Length(2)), 1);
+  EXPECT_EQ(PageAllocationCounts::BucketFor(Length(3)), 1);
+  EXPECT_EQ(PageAllocationCounts::BucketFor(Length(4)), 2);
+  EXPECT_EQ(PageAllocationCounts::BucketFor(Length(~uintptr_t{0})),
+            PageAllocationCounts::kNumBuckets - 1);
+  for (int bucket = 0; bucket < PageAllocationCounts::kNumBuckets; ++bucket) {
+    EXPECT_EQ(PageAllocationCounts::BucketFor(
+                  PageAllocationCounts::BucketStart(bucket)),
+              bucket);
+  }
+}
+
+TEST(AllocationCountsTest, CountsPageAllocations) {
+  // A power of two, so that no cache rounds it into another bucket.
+  constexpr Length kPages = Length(64);
+  const std::string prefix =
+      absl::StrCat("tcmalloc.page_histogram.", kPages.raw_num(), ".");
+  auto get = [&](const char* counter) {
+    return MallocExtension::GetNumericProperty(prefix + counter).value_or(0);
+  };
+
+  const size_t allocs = get("allocs");
+  const size_t frees = get("frees");
+  constexpr int kAllocations = 10;
+  std::vector<void*> ptrs;
+  for (int i = 0; i < kAllocations; ++i) {
+    ptrs.push_back(::operator new(kPages.in_bytes()));
+  }
+  EXPECT_EQ(get("allocs") - allocs, kAllocations);
+  for (void* ptr : ptrs) {
+    ::operator delete(ptr);
+  }
+  EXPECT_EQ(get("frees") - frees, kAllocations);
+
+  const auto properties = MallocExtension::GetProperties();
+  auto it = properties.find(prefix + "allocs");
+  ASSERT_NE(it, properties.end());
+  EXPECT_GE(it->second.value, allocs + kAllocations);
+}
+
+TEST(AllocationCountsTest, Profile) {
+  constexpr size_t kSize = 128;
+  std::vector<void*> ptrs;
+  for (int i = 0; i < 10000; ++i) {
+    ptrs.push_back(::operator new(kSize));
+  }
+  for (void* ptr : ptrs) {
+    ::operator delete(ptr);
+  }
+
+  Profile profile =
+      MallocExtension::SnapshotCurrent(ProfileType::kAllocationCounts);
+  EXPECT_EQ(profile.Type(), ProfileType::kAllocationCounts);
+  int64_t count = 0;
+  profile.Iterate([&](const Profile::Sample& s) {
+    EXPECT_EQ(s.depth, 0);
+    EXPECT_EQ(s.sum, s.count * s.requested_size);
+    if (s.requested_size == kSize) count += s.count;
+  });
+
+  const std::optional<size_t> per_cpu =
+      MallocExtension::GetNumericProperty("tcmalloc.per_cpu_caches_active");
+  if (per_cpu.value_or(0) != 0) {
+    // Allocating more objects than fit in a per-cpu cache needs refills.
+    EXPECT_GT(count, 0);
+    EXPECT_FALSE(MallocExtension::GetSizeClassesForProfile(profile).empty());
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
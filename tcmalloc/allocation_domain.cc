@@ -0,0 +1,87 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/allocation_domain.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <limits>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc::tcmalloc_internal {
+
+ABSL_CONST_INIT thread_local uint8_t current_allocation_domain = 0;
+
+ABSL_CONST_INIT AllocationDomains allocation_domains;
+
+bool AllocationDomains::TryCharge(int domain, size_t bytes,
+                                  bool* over_soft_limit) {
+  Domain& d = Get(domain);
+  const size_t usage =
+      d.usage.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  if (ABSL_PREDICT_FALSE(
+          usage > d.limits[kHard].load(std::memory_order_relaxed))) {
+    d.usage.fetch_sub(bytes, std::memory_order_relaxed);
+    d.limit_hits[kHard].fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  *over_soft_limit = usage > d.limits[kSoft].load(std::memory_order_relaxed);
+  if (ABSL_PREDICT_FALSE(*over_soft_limit)) {
+    d.limit_hits[kSoft].fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+bool AllocationDomains::Domain::active() const {
+  constexpr size_t kNoLimit = std::numeric_limits<size_t>::max();
+  return usage.load(std::memory_order_relaxed) != 0 ||
+         limits[kSoft].load(std::memory_order_relaxed) != kNoLimit ||
+         limits[kHard].load(std::memory_order_relaxed) != kNoLimit;
+}
+
+void AllocationDomains::Print(Printer* out) const {
+  out->printf("------------------------------------------------\n");
+  out->printf("Allocation domains (page-level allocations)\n");
+  out->printf("------------------------------------------------\n");
+  for (int domain = 0; domain < kMaxAllocationDomains; ++domain) {
+    if (!domains_[domain].active()) continue;
+    out->printf(
+        "allocation domain %2d: %12zu bytes in use; soft limit %zu "
+        "bytes (%lld hits); hard limit %zu bytes (%lld hits)\n",
+        domain, usage(domain), limit(domain, kSoft), limit_hits(domain, kSoft),
+        limit(domain, kHard), limit_hits(domain, kHard));
+  }
+}
+
+void AllocationDomains::PrintInPbtxt(PbtxtRegion* region) const {
+  for (int domain = 0; domain < kMaxAllocationDomains; ++domain) {
+    if (!domains_[domain].active()) continue;
+    auto entry = region->CreateSubRegion("allocation_domain");
+    entry.PrintI64("domain", domain);
+    entry.PrintI64("in_use_bytes", usage(domain));
+    entry.PrintI64("soft_limit_bytes", limit(domain, kSoft));
+    entry.PrintI64("hard_limit_bytes", limit(domain, kHard));
+    entry.PrintI64("soft_limit_hits", limit_hits(domain, kSoft));
+    entry.PrintI64("hard_limit_hits", limit_hits(domain, kHard));
+  }
+}
+
+}  // namespace tcmalloc::tcmalloc_internal
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,115 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_ALLOCATION_DOMAIN_H_
+#define TCMALLOC_ALLOCATION_DOMAIN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <limits>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc::tcmalloc_internal {
+
+inline constexpr int kMaxAllocationDomains =
+    MallocExtension::kMaxAllocationDomains;
+
+// The domain the calling thread's page-level allocations are charged to.
+extern ABSL_CONST_INIT thread_local uint8_t current_allocation_domain;
+
+inline int CurrentAllocationDomain() { return current_allocation_domain; }
+
+// Usage and limits of the page-level allocations of each allocation domain.
+//
+// Usage is charged when a page-level allocation is made and uncharged when it
+// is freed, by the domain recorded on its Span.  A domain over its hard limit
+// fails the allocation; a domain over its soft limit releases as many free
+// pages to the OS as it allocates, on its own thread.
+class AllocationDomains {
+ public:
+  enum LimitKind { kSoft, kHard, kNumLimits };
+
+  constexpr AllocationDomains() = default;
+
+  AllocationDomains(const AllocationDomains&) = delete;
+  AllocationDomains& operator=(const AllocationDomains&) = delete;
+
+  // Charges <bytes> to <domain>.  Returns false, charging nothing, if that
+  // would take the domain over its hard limit.  Otherwise sets
+  // *over_soft_limit to whether the domain is now over its soft limit.
+  bool TryCharge(int domain, size_t bytes, bool* over_soft_limit);
+
+  void Uncharge(int domain, size_t bytes) {
+    Get(domain).usage.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  size_t usage(int domain) const {
+    return Get(domain).usage.load(std::memory_order_relaxed);
+  }
+
+  size_t limit(int domain, LimitKind limit_kind) const {
+    ASSERT(limit_kind < kNumLimits);
+    return Get(domain).limits[limit_kind].load(std::memory_order_relaxed);
+  }
+
+  void set_limit(int domain, size_t limit, LimitKind limit_kind) {
+    ASSERT(limit_kind < kNumLimits);
+    Get(domain).limits[limit_kind].store(limit, std::memory_order_relaxed);
+  }
+
+  int64_t limit_hits(int domain, LimitKind limit_kind) const {
+    ASSERT(limit_kind < kNumLimits);
+    return Get(domain).limit_hits[limit_kind].load(std::memory_order_relaxed);
+  }
+
+  // Prints the domains that have usage or limits.
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  struct Domain {
+    std::atomic<size_t> usage{0};
+    std::atomic<size_t> limits[kNumLimits] = {
+        std::numeric_limits<size_t>::max(),
+        std::numeric_limits<size_t>::max()};
+    std::atomic<int64_t> limit_hits[kNumLimits] = {0, 0};
+
+    bool active() const;
+  };
+
+  Domain& Get(int domain) {
+    ASSERT(0 <= domain && domain < kMaxAllocationDomains);
+    return domains_[domain];
+  }
+  const Domain& Get(int domain) const {
+    ASSERT(0 <= domain && domain < kMaxAllocationDomains);
+    return domains_[domain];
+  }
+
+  Domain domains_[kMaxAllocationDomains];
+};
+
+extern AllocationDomains allocation_domains;
+
+}  // namespace tcmalloc::tcmalloc_internal
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ALLOCATION_DOMAIN_H_
@@ -14,15 +14,20 @@
 
 #include "tcmalloc/allocation_sample.h"
 
+#include <stdint.h>
+
+#include <algorithm>
 #include <memory>
 #include <utility>
 
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal_malloc_extension.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/stack_trace_table.h"
+#include "tcmalloc/static_vars.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc::tcmalloc_internal {
@@ -43,16 +48,104 @@ AllocationSample::~AllocationSample() {
 }
 
 Profile AllocationSample::Stop() && {
-  // We need to remove ourselves from list_ before we mutate mallocs_;
-  //
-  // A concurrent call to AllocationSampleList::ReportMalloc can access mallocs_
-  // until we remove it from list_.
+  // Our samples stay in list_'s log until we are removed from it.
   if (mallocs_) {
+    list_->CopySamples(this);
     list_->Remove(this);
     mallocs_->SetDuration(absl::Now() - start_);
   }
   return ProfileAccessor::MakeProfile(std::move(mallocs_));
 }
 
+void AllocationSampleList::Add(AllocationSample* as) {
+  AllocationGuardSpinLockHolder h(&lock_);
+  as->first_seq_ = next_seq_;
+  as->next_ = first_;
+  first_ = as;
+}
+
+// This list is very short and we're nowhere near a hot path, just walk
+void AllocationSampleList::Remove(AllocationSample* as) {
+  AllocationGuardSpinLockHolder h(&lock_);
+  AllocationSample** link = &first_;
+  AllocationSample* cur = first_;
+  while (cur != as) {
+    CHECK_CONDITION(cur != nullptr);
+    link = &cur->next_;
+    cur = cur->next_;
+  }
+  *link = as->next_;
+  TrimLocked();
+}
+
+void AllocationSampleList::ReportMalloc(const struct StackTrace& sample) {
+  AllocationGuardSpinLockHolder h(&lock_);
+  if (first_ == nullptr) {
+    return;
+  }
+
+  Entry* e;
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    e = tc_globals.sample_log_allocator().New();
+  }
+  e->trace = sample;
+  e->seq = next_seq_++;
+  e->next = nullptr;
+  if (tail_ == nullptr) {
+    head_ = e;
+  } else {
+    tail_->next = e;
+  }
+  tail_ = e;
+}
+
+void AllocationSampleList::CopySamples(AllocationSample* as) {
+  // Only the entries logged so far are read, so later ones can be appended
+  // concurrently; and none of them are freed while <as> is in the list.
+  // StackTraceTable::AddTrace takes pageheap_lock, so do not hold lock_ for
+  // the copy, which would stall sampled allocations meanwhile.
+  const Entry* e;
+  uint64_t n = 0;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    e = head_;
+    while (e != nullptr && e->seq < as->first_seq_) {
+      e = e->next;
+    }
+    if (e != nullptr) {
+      n = next_seq_ - e->seq;
+    }
+  }
+
+  for (uint64_t i = 0; i < n; ++i) {
+    as->mallocs_->AddTrace(1.0, e->trace);
+    if (i + 1 < n) {
+      e = e->next;
+    }
+  }
+}
+
+void AllocationSampleList::TrimLocked() {
+  uint64_t min_seq = next_seq_;
+  for (const AllocationSample* cur = first_; cur != nullptr;
+       cur = cur->next_) {
+    min_seq = std::min(min_seq, cur->first_seq_);
+  }
+  if (head_ == nullptr || head_->seq >= min_seq) {
+    return;
+  }
+
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  while (head_ != nullptr && head_->seq < min_seq) {
+    Entry* next = head_->next;
+    tc_globals.sample_log_allocator().Delete(head_);
+    head_ = next;
+  }
+  if (head_ == nullptr) {
+    tail_ = nullptr;
+  }
+}
+
 }  // namespace tcmalloc::tcmalloc_internal
 GOOGLE_MALLOC_SECTION_END
@@ -15,6 +15,8 @@
 #ifndef TCMALLOC_ALLOCATION_SAMPLE_H_
 #define TCMALLOC_ALLOCATION_SAMPLE_H_
 
+#include <stdint.h>
+
 #include <memory>
 
 #include "absl/base/const_init.h"
@@ -42,48 +44,64 @@ class AllocationSample final : public AllocationProfilingTokenBase {
   AllocationSampleList* list_;
   std::unique_ptr<StackTraceTable> mallocs_;
   absl::Time start_;
+  // The sequence number of the first sample in list_'s log that this session
+  // reports.
+  uint64_t first_seq_ = 0;
   AllocationSample* next_ = nullptr;
   friend class AllocationSampleList;
 };
 
+// The active allocation profiling sessions, and a log of the samples taken
+// while any of them is active.
+//
+// Each sample is appended to the log once, however many sessions are active,
+// so that concurrent sessions cost no more on the allocation path than a
+// single one.  Each session remembers where in the log it started and copies
+// out its samples when it stops.  The log is shared by all sessions: samples
+// are freed once no active session started before them.
 class AllocationSampleList {
  public:
   constexpr AllocationSampleList() = default;
 
-  void Add(AllocationSample* as) {
-    AllocationGuardSpinLockHolder h(&lock_);
-    as->next_ = first_;
-    first_ = as;
-  }
+  // Exposed for PageHeapAllocator
+  struct Entry {
+    StackTrace trace;
+    uint64_t seq;
+    Entry* next;
+  };
 
-  // This list is very short and we're nowhere near a hot path, just walk
-  void Remove(AllocationSample* as) {
-    AllocationGuardSpinLockHolder h(&lock_);
-    AllocationSample** link = &first_;
-    AllocationSample* cur = first_;
-    while (cur != as) {
-      CHECK_CONDITION(cur != nullptr);
-      link = &cur->next_;
-      cur = cur->next_;
-    }
-    *link = as->next_;
-  }
+  void Add(AllocationSample* as);
 
-  void ReportMalloc(const struct StackTrace& sample) {
-    AllocationGuardSpinLockHolder h(&lock_);
-    AllocationSample* cur = first_;
-    while (cur != nullptr) {
-      cur->mallocs_->AddTrace(1.0, sample);
-      cur = cur->next_;
-    }
+  // Unregisters <as>, freeing the samples no other session needs.
+  void Remove(AllocationSample* as);
+
+  void ReportMalloc(const struct StackTrace& sample);
+
+  // Adds the samples logged since <as> was added to its table.  <as> must
+  // still be in the list.
+  void CopySamples(AllocationSample* as);
+
+  // Acquires and releases lock_ around fork(), so that the child does not
+  // inherit it held by a thread that no longer exists.
+  void AcquireInternalLocks() ABSL_EXCLUSIVE_LOCK_FUNCTION(lock_) {
+    lock_.Lock();
   }
+  void ReleaseInternalLocks() ABSL_UNLOCK_FUNCTION(lock_) { lock_.Unlock(); }
 
  private:
+  // Frees the entries at the head of the log that no session reports.
+  void TrimLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
   // Guard against any concurrent modifications on the list of allocation
   // samples. Invoking `new` while holding this lock can lead to deadlock.
   absl::base_internal::SpinLock lock_{
       absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
   AllocationSample* first_ ABSL_GUARDED_BY(lock_) = nullptr;
+  // The log, oldest entry first.  Entries are numbered consecutively, so
+  // next_seq_ - head_->seq entries are live.
+  Entry* head_ ABSL_GUARDED_BY(lock_) = nullptr;
+  Entry* tail_ ABSL_GUARDED_BY(lock_) = nullptr;
+  uint64_t next_seq_ ABSL_GUARDED_BY(lock_) = 0;
 };
 
 }  // namespace tcmalloc::tcmalloc_internal
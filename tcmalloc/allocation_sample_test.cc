@@ -15,12 +15,16 @@
 #include "tcmalloc/allocation_sample.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <algorithm>
 #include <memory>
 #include <utility>
 #include <vector>
 
+#include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/base/internal/spinlock.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/random/bit_gen_ref.h"
 #include "absl/random/random.h"
@@ -28,6 +32,7 @@
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/testing/thread_manager.h"
 
@@ -110,7 +115,8 @@ TEST(AllocationSample, Threaded) {
         // injected.  Consult the global state to see how many allocations are
         // active.
         absl::base_internal::SpinLockHolder h(&pageheap_lock);
-        allocations = tc_globals.linked_sample_allocator().stats().in_use;
+        allocations = tc_globals.linked_sample_allocator().stats().in_use +
+                      tc_globals.sample_log_allocator().stats().in_use;
       }
       if (allocations >= kMaxAllocations) {
         return;
@@ -128,5 +134,57 @@ TEST(AllocationSample, Threaded) {
   m.Stop();
 }
 
+int64_t LoggedSamples() {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  return tc_globals.sample_log_allocator().stats().in_use;
+}
+
+std::vector<size_t> RequestedSizes(const Profile& profile) {
+  std::vector<size_t> sizes;
+  profile.Iterate([&](const Profile::Sample& sample) {
+    sizes.push_back(sample.requested_size);
+  });
+  std::sort(sizes.begin(), sizes.end());
+  return sizes;
+}
+
+TEST(AllocationSample, SharedLog) {
+  tc_globals.InitIfNecessary();
+  const int64_t logged = LoggedSamples();
+
+  AllocationSampleList list;
+  auto Report = [&](size_t size) {
+    StackTrace s{};
+    s.requested_size = size;
+    s.allocated_size = size;
+    s.weight = size;
+    list.ReportMalloc(s);
+  };
+
+  // Nothing is logged without a session.
+  Report(8);
+  EXPECT_EQ(LoggedSamples(), logged);
+
+  auto a = std::make_unique<AllocationSample>(&list, absl::Now());
+  Report(16);
+  auto b = std::make_unique<AllocationSample>(&list, absl::Now());
+  auto c = std::make_unique<AllocationSample>(&list, absl::Now());
+  Report(32);
+  Report(64);
+  // Each sample is logged once, however many sessions see it.
+  EXPECT_EQ(LoggedSamples(), logged + 3);
+
+  // Samples taken before b started are only needed by a.
+  EXPECT_THAT(RequestedSizes(std::move(*b).Stop()),
+              testing::ElementsAre(32, 64));
+  EXPECT_EQ(LoggedSamples(), logged + 3);
+  EXPECT_THAT(RequestedSizes(std::move(*a).Stop()),
+              testing::ElementsAre(16, 32, 64));
+  EXPECT_EQ(LoggedSamples(), logged + 2);
+  Report(128);
+  c.reset();
+  EXPECT_EQ(LoggedSamples(), logged);
+}
+
 }  // namespace
 }  // namespace tcmalloc::tcmalloc_internal
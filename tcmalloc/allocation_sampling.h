@@ -22,6 +22,7 @@
 #include <cstdint>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
@@ -32,15 +33,21 @@
 #include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
 #include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/huge_page_filler.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/exponential_biased.h"
+#include "tcmalloc/internal/frame_pointer_unwinder.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/internal/sample_event_ring.h"
 #include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/internal/stack_trace_depot.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/sampled_slabs.h"
 #include "tcmalloc/sampler.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stack_trace_table.h"
@@ -50,6 +57,11 @@
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc::tcmalloc_internal {
 
+// The labels set with MallocExtension::SetProfileLabels, recorded with each
+// sample taken of the calling thread's allocations.
+extern ABSL_CONST_INIT thread_local absl::Span<const ProfileLabel>
+    current_profile_labels ABSL_ATTRIBUTE_INITIAL_EXEC;
+
 // This function computes a profile that maps a live stack trace to
 // the number of bytes of central-cache memory pinned by an allocation
 // at that stack trace.
@@ -66,7 +78,7 @@ static std::unique_ptr<const ProfileBase> DumpFragmentationProfile(
   state.sampled_allocation_recorder().Iterate(
       [&state, &profile](const SampledAllocation& sampled_allocation) {
         // Compute fragmentation to charge to this sample:
-        const StackTrace& t = sampled_allocation.sampled_stack;
+        const SampleMetadata& t = sampled_allocation.sampled_stack;
         if (t.proxy == nullptr) {
           // There is just one object per-span, and neighboring spans
           // can be released back to the system, so we charge no
@@ -89,8 +101,77 @@ static std::unique_ptr<const ProfileBase> DumpFragmentationProfile(
           // Associate the memory warmth with the actual object, not the proxy.
           // The residency information (t.span_start_address) is likely not very
           // useful, but we might as well pass it along.
-          profile->AddTrace(frag, t);
+          profile->AddTrace(frag, sampled_allocation.stack_trace());
+        }
+      });
+  return profile;
+}
+
+// Hugepages of the HugePageFiller with at most this fraction of their pages
+// in use are reported by DumpHugePageFragmentationProfile.
+inline constexpr double kMaxPinnedHugePageUsage = 0.25;
+
+// This function computes a profile that maps a live stack trace to the backed
+// free memory of nearly empty filler hugepages pinned by an allocation at that
+// stack trace, i.e. memory that could be released if the few objects left on
+// the hugepage were freed.  As in DumpFragmentationProfile, the free pages of
+// a hugepage are charged evenly to the objects still using it.  A sampled
+// small object is charged for its proxy's hugepage, where it would live had it
+// not been sampled.
+template <typename State>
+static std::unique_ptr<const ProfileBase> DumpHugePageFragmentationProfile(
+    State& state) {
+  auto profile =
+      std::make_unique<StackTraceTable>(ProfileType::kHugePageFragmentation);
+  auto pinned_hugepage = [](const SampleMetadata& t) {
+    return HugePageContaining(t.proxy != nullptr ? t.proxy
+                                                 : t.span_start_address);
+  };
+
+  // Find the hugepages first, as nothing may be allocated while we hold the
+  // pageheap_lock to read their trackers.
+  std::vector<std::pair<HugePage, double>> hugepages;
+  state.sampled_allocation_recorder().Iterate(
+      [&](const SampledAllocation& sampled_allocation) {
+        hugepages.push_back(
+            {pinned_hugepage(sampled_allocation.sampled_stack), 0.0});
+      });
+  std::sort(hugepages.begin(), hugepages.end());
+  hugepages.erase(std::unique(hugepages.begin(), hugepages.end()),
+                  hugepages.end());
+
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    for (auto& [hugepage, weight] : hugepages) {
+      // Hugepages outside the filler have no tracker.
+      const PageTracker* tracker = reinterpret_cast<const PageTracker*>(
+          state.pagemap().GetHugepage(hugepage.first_page()));
+      if (tracker == nullptr) continue;
+      const Length used = tracker->used_pages();
+      if (used == Length(0) ||
+          used.raw_num() >
+              kMaxPinnedHugePageUsage * kPagesPerHugePage.raw_num()) {
+        continue;
+      }
+      const Length backed_free =
+          tracker->free_pages() - tracker->released_pages();
+      weight = static_cast<double>(backed_free.raw_num()) / used.raw_num();
+    }
+  }
+
+  state.sampled_allocation_recorder().Iterate(
+      [&](const SampledAllocation& sampled_allocation) {
+        const std::pair<HugePage, double> key = {
+            pinned_hugepage(sampled_allocation.sampled_stack), 0.0};
+        auto it = std::lower_bound(
+            hugepages.begin(), hugepages.end(), key,
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+        // Samples taken since the first pass are not charged.
+        if (it == hugepages.end() || !(it->first == key.first) ||
+            it->second <= 0) {
+          return;
         }
+        profile->AddTrace(it->second, sampled_allocation.stack_trace());
       });
   return profile;
 }
@@ -100,11 +181,52 @@ static std::unique_ptr<const ProfileBase> DumpHeapProfile(State& state) {
   auto profile = std::make_unique<StackTraceTable>(ProfileType::kHeap);
   state.sampled_allocation_recorder().Iterate(
       [&](const SampledAllocation& sampled_allocation) {
-        profile->AddTrace(1.0, sampled_allocation.sampled_stack);
+        profile->AddTrace(1.0, sampled_allocation.stack_trace());
+      });
+  return profile;
+}
+
+// Returns the live heap, aggregated by stack, of every stack whose totals
+// changed since `*cursor`, and advances `*cursor`.  Unlike DumpHeapProfile,
+// this does not visit the individual samples: the totals are maintained by
+// the stack depot as allocations are sampled and freed.
+template <typename State>
+static std::unique_ptr<const ProfileBase> DumpHeapProfileDelta(
+    State& state, uint64_t* cursor) {
+  auto profile = std::make_unique<StackTraceTable>(ProfileType::kHeap);
+  const bool full = *cursor == 0;
+  state.sampled_stack_depot().IterateChanged(
+      cursor, [&](const DepotStack& stack) {
+        const int64_t count = stack.live_count();
+        // A full profile has no earlier totals to retract.
+        if (full && count == 0) return;
+        profile->AddStack(count, stack.live_bytes(), stack.stack());
       });
   return profile;
 }
 
+// Streams an event for the sampled allocation at `ptr` to the sample event
+// ring, if it is enabled.  Allocation events carry the stack; free events only
+// its id.
+template <typename State>
+static void RecordSampleEvent(State& state, SampleEventType type,
+                              const void* ptr, const SampleMetadata& t,
+                              const DepotStack* stack, absl::Time time) {
+  if (ABSL_PREDICT_TRUE(!state.sample_event_ring().enabled())) return;
+
+  SampleEvent event = {};
+  event.address = reinterpret_cast<uintptr_t>(ptr);
+  event.requested_size = t.requested_size;
+  event.allocated_size = t.allocated_size;
+  event.weight = t.weight;
+  event.stack_id = reinterpret_cast<uintptr_t>(stack);
+  event.time_ns = absl::ToUnixNanos(time);
+  state.sample_event_ring().Record(
+      type, subtle::percpu::GetCurrentCpu(), event,
+      type == SampleEventType::kAlloc ? stack->stack()
+                                      : absl::Span<void* const>());
+}
+
 extern "C" ABSL_CONST_INIT thread_local Sampler tcmalloc_sampler
     ABSL_ATTRIBUTE_INITIAL_EXEC;
 
@@ -211,7 +333,9 @@ static GuardedAllocWithStatus TrySampleGuardedAllocation(
 
       // Ensure that successful_allocations is at least 1 (not zero).
       const size_t successful_allocations =
-          std::max(state.guardedpage_allocator().SuccessfulAllocations(), 1UL);
+          std::max(state.guardedpage_allocator().SuccessfulAllocations() +
+                       state.mte_sampled_allocator().SuccessfulAllocations(),
+                   1UL);
       const size_t current_sampled_to_guarded_ratio =
           state.total_sampled_count_.value() / successful_allocations;
       static std::atomic<bool> striving_to_guard_{true};
@@ -275,9 +399,12 @@ static GuardedAllocWithStatus TrySampleGuardedAllocation(
   // guaranteed alignment <= kPageSize
   //
   // In all cases kPageSize <= GPA::page_size_, so Allocate's preconditions
-  // are met.
+  // are met.  Memory tagging, where active, needs neither guard pages nor
+  // system calls, so it takes over from the GPA.
   GuardedAllocWithStatus alloc_with_status =
-      state.guardedpage_allocator().Allocate(size, alignment);
+      state.mte_sampled_allocator().active()
+          ? state.mte_sampled_allocator().Allocate(size, alignment)
+          : state.guardedpage_allocator().Allocate(size, alignment);
   if (Parameters::improved_guarded_sampling() &&
       alloc_with_status.status == Profile::Sample::GuardedStatus::Guarded) {
     state.stacktrace_filter().Add(stack_trace);
@@ -285,6 +412,21 @@ static GuardedAllocWithStatus TrySampleGuardedAllocation(
   return alloc_with_status;
 }
 
+// Under Parameters::profile_sampling_site_boost, allocation sites with fewer
+// than kRareSiteSamples recently kept samples keep all of theirs, and those
+// with kFrequentSiteSamples (the most StackTraceFilter counts) keep half as
+// many as they would without the boost.
+inline constexpr size_t kRareSiteSamples = 4;
+inline constexpr size_t kFrequentSiteSamples = 255;
+
+// Returns n, where one in n of the samples of an allocation site with <count>
+// recently kept samples is kept under a site boost of <boost>.
+inline int64_t SampledSiteKeepOneIn(size_t count, int64_t boost) {
+  if (count < kRareSiteSamples) return 1;
+  if (count < kFrequentSiteSamples) return boost;
+  return 2 * boost;
+}
+
 template <typename State>
 ABSL_ATTRIBUTE_NOINLINE static inline void FreeProxyObject(State& state,
                                                            void* ptr,
@@ -323,7 +465,10 @@ ABSL_ATTRIBUTE_NOINLINE static inline void FreeProxyObject(State& state,
 //
 // In case of out-of-memory condition when allocating span or
 // stacktrace struct, this function simply cheats and returns original
-// object. As if no sampling was requested.
+// object. As if no sampling was requested.  So it does for the samples thinned
+// out under Parameters::profile_sampling_site_boost, scaling the weight of
+// those kept by the inverse of the probability of keeping them, which keeps
+// profiles unbiased.
 template <typename State, typename Policy>
 static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
                                        size_t requested_size, size_t weight,
@@ -336,7 +481,34 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
   stack_trace.proxy = nullptr;
   stack_trace.requested_size = requested_size;
   // Grab the stack trace outside the heap lock.
-  stack_trace.depth = absl::GetStackTrace(stack_trace.stack, kMaxStackDepth, 0);
+  if (Parameters::frame_pointer_unwinding() && FramePointersUsable()) {
+    stack_trace.depth = GetStackTraceWithFramePointers(stack_trace.stack,
+                                                       kMaxStackDepth, 0);
+  } else {
+    stack_trace.depth =
+        absl::GetStackTrace(stack_trace.stack, kMaxStackDepth, 0);
+  }
+
+  if (const int64_t boost = Parameters::profile_sampling_site_boost();
+      ABSL_PREDICT_FALSE(boost > 1)) {
+    const int64_t keep_one_in = SampledSiteKeepOneIn(
+        state.sampled_site_filter().Count(stack_trace), boost);
+    if (keep_one_in > 1) {
+      ABSL_CONST_INIT static std::atomic<uint64_t> rnd(0);
+      const uint64_t new_rnd =
+          ExponentialBiased::NextRandom(rnd.load(std::memory_order_relaxed));
+      rnd.store(new_rnd, std::memory_order_relaxed);
+      // The low bits of the generator are the least random.
+      if ((new_rnd >> 16) % keep_one_in != 0) {
+        if (size_class != 0) {
+          return {obj, state.sizemap().class_to_size(size_class)};
+        }
+        return {span->start_address(), span->bytes_in_span()};
+      }
+      weight *= keep_one_in;
+    }
+    state.sampled_site_filter().Add(stack_trace);
+  }
 
   // requested_alignment = 1 means 'small size table alignment was used'
   // Historically this is reported as requested_alignment = 0
@@ -348,11 +520,16 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
   stack_trace.requested_size_returning = Policy::size_returning();
   stack_trace.access_hint = static_cast<uint8_t>(policy.access());
   stack_trace.weight = weight;
+  const absl::Span<const ProfileLabel> labels = current_profile_labels;
+  stack_trace.labels = labels.data();
+  stack_trace.num_labels = labels.size();
 
   GuardedAllocWithStatus alloc_with_status{
       nullptr, Profile::Sample::GuardedStatus::NotAttempted};
 
   size_t capacity = 0;
+  // Set if the sampled object shares its span with others of its size class.
+  void* packed = nullptr;
   if (size_class != 0) {
     ASSERT(size_class == state.pagemap().sizeclass(PageIdContaining(obj)));
 
@@ -366,8 +543,8 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
     if (alloc_with_status.status == Profile::Sample::GuardedStatus::Guarded) {
       ASSERT(IsSampledMemory(alloc_with_status.alloc));
       const PageId p = PageIdContaining(alloc_with_status.alloc);
+      span = Span::NewUnlocked(p, num_pages);
       AllocationGuardSpinLockHolder h(&pageheap_lock);
-      span = Span::New(p, num_pages);
       state.pagemap().Set(p, span);
       // If we report capacity back from a size returning allocation, we can not
       // report the stack_trace.allocated_size, as we guard the size to
@@ -379,6 +556,10 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
         stack_trace.allocated_size = requested_size;
       }
       capacity = requested_size;
+    } else if (SampledSlabs::Packs(stack_trace.allocated_size) &&
+               (packed = state.sampled_slabs().New(size_class, &span)) !=
+                   nullptr) {
+      capacity = stack_trace.allocated_size;
     } else if ((span = state.page_allocator().New(
                     num_pages, {1, AccessDensityPrediction::kSparse},
                     MemoryTag::kSampled)) == nullptr) {
@@ -415,7 +596,12 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
       state.sampled_alloc_handle_generator.fetch_add(
           1, std::memory_order_relaxed) +
       1;
-  stack_trace.span_start_address = span->start_address();
+  // A packed object's neighbors are not part of it.
+  stack_trace.span_start_address =
+      packed != nullptr ? packed : span->start_address();
+  void* const result = (alloc_with_status.alloc != nullptr)
+                           ? alloc_with_status.alloc
+                           : stack_trace.span_start_address;
   stack_trace.allocation_time = absl::Now();
   stack_trace.guarded_status = static_cast<int>(alloc_with_status.status);
 
@@ -438,11 +624,26 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
   // The SampledAllocation object is visible to readers after this. Readers only
   // care about its various metadata (e.g. stack trace, weight) to generate the
   // heap profile, and won't need any information from Span::Sample() next.
+  const DepotStack* interned_stack = state.sampled_stack_depot().Intern(
+      absl::MakeConstSpan(stack_trace.stack, stack_trace.depth));
+  const ProfiledObjects objects = ProfiledObjectsFor(1.0, stack_trace);
+  state.sampled_stack_depot().Account(interned_stack, objects.count,
+                                      objects.sum);
   SampledAllocation* sampled_allocation =
-      state.sampled_allocation_recorder().Register(std::move(stack_trace));
-  // No pageheap_lock required. The span is freshly allocated and no one else
-  // can access it. It is visible after we return from this allocation path.
-  span->Sample(sampled_allocation);
+      state.sampled_allocation_recorder().Register(stack_trace,
+                                                   interned_stack);
+  state.peak_heap_tracker().RecordAllocation(sampled_allocation);
+  // No pageheap_lock required. The span (or, if packed, the object's slot in
+  // it) is freshly allocated and no one else can access it. It is visible
+  // after we return from this allocation path.
+  if (packed != nullptr) {
+    span->sampled_slab()->Sample(packed, sampled_allocation);
+  } else {
+    span->Sample(sampled_allocation);
+  }
+
+  RecordSampleEvent(state, SampleEventType::kAlloc, result, stack_trace,
+                    interned_stack, stack_trace.allocation_time);
 
   state.peak_heap_tracker().MaybeSaveSample();
 
@@ -453,9 +654,7 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
     FreeProxyObject(state, obj, size_class);
   }
   ASSERT(state.pagemap().sizeclass(span->first_page()) == 0);
-  return {(alloc_with_status.alloc != nullptr) ? alloc_with_status.alloc
-                                               : span->start_address(),
-          capacity};
+  return {result, capacity};
 }
 
 template <typename State>
@@ -463,7 +662,9 @@ inline void MaybeUnsampleAllocation(State& state, void* ptr, Span* span) {
   // No pageheap_lock required. The sampled span should be unmarked and have its
   // state cleared only once. External synchronization when freeing is required;
   // otherwise, concurrent writes here would likely report a double-free.
-  if (SampledAllocation* sampled_allocation = span->Unsample()) {
+  SampledSlab* slab = span->sampled_slab();
+  if (SampledAllocation* sampled_allocation =
+          slab != nullptr ? slab->Unsample(ptr) : span->Unsample()) {
     ASSERT(state.pagemap().sizeclass(PageIdContaining(ptr)) == 0);
 
     void* const proxy = sampled_allocation->sampled_stack.proxy;
@@ -484,6 +685,17 @@ inline void MaybeUnsampleAllocation(State& state, void* ptr, Span* span) {
         static_cast<double>(weight) / (requested_size + 1);
     AllocHandle sampled_alloc_handle =
         sampled_allocation->sampled_stack.sampled_alloc_handle;
+    const absl::Time allocation_time =
+        sampled_allocation->sampled_stack.allocation_time;
+    const absl::Time now = absl::Now();
+    const ProfiledObjects objects =
+        ProfiledObjectsFor(1.0, sampled_allocation->sampled_stack);
+    state.sampled_stack_depot().Account(sampled_allocation->interned_stack,
+                                        -objects.count, -objects.sum);
+    RecordSampleEvent(state, SampleEventType::kFree, ptr,
+                      sampled_allocation->sampled_stack,
+                      sampled_allocation->interned_stack, now);
+    state.peak_heap_tracker().RecordDeallocation(sampled_allocation);
     state.sampled_allocation_recorder().Unregister(sampled_allocation);
 
     // Adjust our estimate of internal fragmentation.
@@ -511,6 +723,8 @@ inline void MaybeUnsampleAllocation(State& state, void* ptr, Span* span) {
             policy.AccessAsHot().AlignAs(alignment), allocated_size);
       }
       ASSERT(size_class == state.pagemap().sizeclass(PageIdContaining(proxy)));
+      state.size_class_lifetimes().RecordLifetime(size_class,
+                                                  now - allocation_time);
       FreeProxyObject(state, proxy, size_class);
     }
   }
@@ -30,57 +30,86 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 
 void* Arena::Alloc(size_t bytes, std::align_val_t alignment) {
+  // It is important that we use the current NUMA partition rather than always
+  // using a particular one because it's possible that any single partition we
+  // choose might only contain nodes that the process is unable to allocate
+  // from due to cgroup restrictions.
+  const auto& numa_topology = tc_globals.numa_topology();
+  const size_t numa_partition =
+      numa_topology.numa_aware() ? numa_topology.GetCurrentPartition() : 0;
+  return AllocOnPartition(numa_partition, bytes, alignment);
+}
+
+void* Arena::AllocOnPartition(size_t numa_partition, size_t bytes,
+                              std::align_val_t alignment) {
   size_t align = static_cast<size_t>(alignment);
   ASSERT(align > 0);
-  {  // First we need to move up to the correct alignment.
-    const int misalignment = reinterpret_cast<uintptr_t>(free_area_) % align;
-    const int alignment_bytes = misalignment != 0 ? align - misalignment : 0;
-    free_area_ += alignment_bytes;
-    free_avail_ -= alignment_bytes;
-    bytes_allocated_ += alignment_bytes;
-  }
+  ASSERT(numa_partition < kNumaPartitions);
+  const bool numa_aware = tc_globals.numa_topology().numa_aware();
+  if (!numa_aware) numa_partition = 0;
+  char*& free_area = free_area_[numa_partition];
+  size_t& free_avail = free_avail_[numa_partition];
+  // The bytes needed to move up to the correct alignment.
+  auto alignment_bytes = [&]() -> size_t {
+    const size_t misalignment = reinterpret_cast<uintptr_t>(free_area) % align;
+    return misalignment != 0 ? align - misalignment : 0;
+  };
   char* result;
-  if (free_avail_ < bytes) {
-    size_t ask = bytes > kAllocIncrement ? bytes : kAllocIncrement;
+  if (free_avail < alignment_bytes() + bytes) {
+    // Blocks are only page aligned, which larger alignments have to make up
+    // for.
+    const size_t need = bytes + (align > kPageSize ? align - kPageSize : 0);
+    size_t ask = need > kAllocIncrement ? need : kAllocIncrement;
     // TODO(b/171081864): Arena allocations should be made relatively
     // infrequently.  Consider tagging this memory with sampled objects which
     // are also infrequently allocated.
-    //
-    // In the meantime it is important that we use the current NUMA partition
-    // rather than always using a particular one because it's possible that any
-    // single partition we choose might only contain nodes that the process is
-    // unable to allocate from due to cgroup restrictions.
-    MemoryTag tag;
-    const auto& numa_topology = tc_globals.numa_topology();
-    if (numa_topology.numa_aware()) {
-      tag = NumaNormalTag(numa_topology.GetCurrentPartition());
-    } else {
-      tag = MemoryTag::kNormal;
-    }
+    const MemoryTag tag =
+        numa_aware ? NumaNormalTag(numa_partition) : MemoryTag::kNormal;
 
     auto [ptr, actual_size] = SystemAlloc(ask, kPageSize, tag);
-    free_area_ = reinterpret_cast<char*>(ptr);
-    if (ABSL_PREDICT_FALSE(free_area_ == nullptr)) {
+    free_area = reinterpret_cast<char*>(ptr);
+    if (ABSL_PREDICT_FALSE(free_area == nullptr)) {
       Crash(kCrash, __FILE__, __LINE__,
             "FATAL ERROR: Out of memory trying to allocate internal tcmalloc "
             "data (bytes, object-size); is something preventing mmap from "
             "succeeding (sandbox, VSS limitations)?",
             kAllocIncrement, bytes);
     }
-    SystemBack(free_area_, actual_size);
+    SystemBack(free_area, actual_size);
+    if (kAdviseHugePages) {
+      // SystemAlloc hands out whole, aligned hugepages, but we do not ask for
+      // hugepage alignment: page heap tests tell metadata allocations apart by
+      // their smaller alignment.  Advise the hugepages the block covers.
+      const uintptr_t start = reinterpret_cast<uintptr_t>(free_area);
+      const uintptr_t huge_start =
+          (start + kHugePageSize - 1) & ~(kHugePageSize - 1);
+      const uintptr_t huge_end = (start + actual_size) & ~(kHugePageSize - 1);
+      if (huge_end > huge_start &&
+          SystemAdviseHugePages(reinterpret_cast<void*>(huge_start),
+                                huge_end - huge_start)) {
+        bytes_hugepage_advised_ += huge_end - huge_start;
+      }
+    }
 
-    // We've discarded the previous free_area_, so any bytes that were
+    // We've discarded the previous free_area, so any bytes that were
     // unallocated are effectively inaccessible to future allocations.
-    bytes_unavailable_ += free_avail_;
+    bytes_unavailable_ += free_avail;
     blocks_++;
 
-    free_avail_ = actual_size;
+    free_avail = actual_size;
+  }
+
+  {  // First we need to move up to the correct alignment.
+    const size_t skip = alignment_bytes();
+    free_area += skip;
+    free_avail -= skip;
+    bytes_allocated_ += skip;
   }
 
-  ASSERT(reinterpret_cast<uintptr_t>(free_area_) % align == 0);
-  result = free_area_;
-  free_area_ += bytes;
-  free_avail_ -= bytes;
+  ASSERT(reinterpret_cast<uintptr_t>(free_area) % align == 0);
+  result = free_area;
+  free_area += bytes;
+  free_avail -= bytes;
   bytes_allocated_ += bytes;
   return reinterpret_cast<void*>(result);
 }
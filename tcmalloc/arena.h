@@ -42,6 +42,10 @@ struct ArenaStats {
   // e.g. due to the slab being resized. Note that these bytes are disjoint from
   // the ones counted in `bytes_allocated`.
   size_t bytes_nonresident;
+  // The number of bytes, allocated or not, in blocks that the kernel was asked
+  // to back with hugepages.  Metadata here, such as pagemap leaves, costs few
+  // dTLB entries to reach.
+  size_t bytes_hugepage_advised;
 
   // The number of blocks allocated by the Arena.
   size_t blocks;
@@ -55,10 +59,19 @@ class Arena {
 
   // Returns a properly aligned byte array of length "bytes".  Crashes if
   // allocation fails.  Requires pageheap_lock is held.
+  // When NUMA awareness is enabled, the memory is on the NUMA partition of the
+  // calling thread.
   ABSL_ATTRIBUTE_RETURNS_NONNULL void* Alloc(
       size_t bytes, std::align_val_t alignment = kAlignment)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Like Alloc(), but when NUMA awareness is enabled the memory is on
+  // <numa_partition>, for metadata that describes that partition's pages.
+  ABSL_ATTRIBUTE_RETURNS_NONNULL void* AllocOnPartition(
+      size_t numa_partition, size_t bytes,
+      std::align_val_t alignment = kAlignment)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Updates the stats for allocated and non-resident bytes.
   void UpdateAllocatedAndNonresident(int64_t allocated, int64_t nonresident)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
@@ -72,20 +85,32 @@ class Arena {
   ArenaStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
     ArenaStats s;
     s.bytes_allocated = bytes_allocated_;
-    s.bytes_unallocated = free_avail_;
+    s.bytes_unallocated = 0;
+    for (size_t avail : free_avail_) s.bytes_unallocated += avail;
     s.bytes_unavailable = bytes_unavailable_;
     s.bytes_nonresident = bytes_nonresident_;
+    s.bytes_hugepage_advised = bytes_hugepage_advised_;
     s.blocks = blocks_;
     return s;
   }
 
  private:
-  // How much to allocate from system at a time
-  static constexpr int kAllocIncrement = 128 << 10;
-
-  // Free area from which to carve new objects
-  char* free_area_ ABSL_GUARDED_BY(pageheap_lock) = nullptr;
-  size_t free_avail_ ABSL_GUARDED_BY(pageheap_lock) = 0;
+  // How much to allocate from system at a time.  SystemAlloc() hands out
+  // whole hugepages regardless, so outside of small-but-slow builds we ask for
+  // one and advise the kernel to back it with a hugepage: the pagemap leaves
+  // carved from it are read on every free.
+#ifdef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+  static constexpr size_t kAllocIncrement = 128 << 10;
+  static constexpr bool kAdviseHugePages = false;
+#else
+  static constexpr size_t kAllocIncrement = kHugePageSize;
+  static constexpr bool kAdviseHugePages = true;
+#endif
+
+  // Free area from which to carve new objects, by NUMA partition.  Without
+  // NUMA awareness, only that of partition 0 is used.
+  char* free_area_[kNumaPartitions] ABSL_GUARDED_BY(pageheap_lock) = {};
+  size_t free_avail_[kNumaPartitions] ABSL_GUARDED_BY(pageheap_lock) = {};
 
   // Total number of bytes allocated from this arena
   size_t bytes_allocated_ ABSL_GUARDED_BY(pageheap_lock) = 0;
@@ -95,6 +120,8 @@ class Arena {
   // The number of bytes on the arena that have been MADV_DONTNEEDed away. Note
   // that these bytes are disjoint from the ones counted in `bytes_allocated`.
   size_t bytes_nonresident_ ABSL_GUARDED_BY(pageheap_lock) = 0;
+  // The number of bytes in blocks advised to be backed with hugepages.
+  size_t bytes_hugepage_advised_ ABSL_GUARDED_BY(pageheap_lock) = 0;
   // Total number of blocks/free areas managed by this Arena.
   size_t blocks_ ABSL_GUARDED_BY(pageheap_lock) = 0;
 
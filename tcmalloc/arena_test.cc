@@ -21,6 +21,7 @@
 #include "gtest/gtest.h"
 #include "absl/base/internal/spinlock.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/static_vars.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -155,6 +156,45 @@ TEST(Arena, BytesImpending) {
   EXPECT_EQ(stats.bytes_allocated, 100);
 }
 
+TEST(Arena, HugePageAdvised) {
+  Arena arena;
+  void* ptr;
+  ArenaStats stats;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    ptr = arena.Alloc(1, Align(1));
+    stats = arena.stats();
+  }
+  EXPECT_NE(ptr, nullptr);
+
+  // Whether the kernel accepts the hint depends on its configuration, but
+  // only whole hugepages are ever advised.
+  EXPECT_EQ(stats.bytes_hugepage_advised % kHugePageSize, 0);
+  EXPECT_LE(stats.bytes_hugepage_advised,
+            stats.bytes_allocated + stats.bytes_unallocated);
+#ifndef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % kHugePageSize, 0);
+#endif
+}
+
+TEST(Arena, AllocOnPartition) {
+  Arena arena;
+  ArenaStats stats;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+      void* ptr = arena.AllocOnPartition(partition, 64, Align(64));
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % 64, 0);
+    }
+    stats = arena.stats();
+  }
+  EXPECT_EQ(stats.bytes_allocated, 64 * kNumaPartitions);
+  // Without NUMA awareness, every partition's metadata shares one block.
+  if (!tc_globals.numa_topology().numa_aware()) {
+    EXPECT_EQ(stats.blocks, 1);
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -12,31 +12,705 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <sched.h>
 
 #include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
 
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "tcmalloc/adaptive_sampling.h"
+#include "tcmalloc/background_wakeup.h"
+#include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/cpu_time_stats.h"
+#include "tcmalloc/deferred_free.h"
+#include "tcmalloc/demand_profile.h"
+#include "tcmalloc/global_stats.h"
+#include "tcmalloc/heap_telemetry.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/memory_stats.h"
 #include "tcmalloc/internal/percpu.h"
 #include "tcmalloc/internal_malloc_extension.h"
+#include "tcmalloc/large_span_cache.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameter_tuner.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/span_cache.h"
 #include "tcmalloc/static_vars.h"
+#include "tcmalloc/system-alloc.h"
+#include "tcmalloc/thread_cache.h"
 
-// Release memory to the system at a constant rate.
+// Returns how much to scale the background release rate by for the memory
+// pressure of the process' cgroup: not at all while it has plenty of headroom
+// and nothing stalls on memory, keeping free hugepages backed, and steeply as
+// it nears its limit or its tasks stall waiting for memory.
+static double CgroupPressureReleaseScale() {
+  tcmalloc::tcmalloc_internal::CgroupMemoryStats stats;
+  if (!tcmalloc::tcmalloc_internal::GetCgroupMemoryStats(&stats)) return 1;
+
+  constexpr double kStallingAvg10 = 10;
+  constexpr double kUrgentScale = 16;
+  if (stats.some_avg10 >= kStallingAvg10) return kUrgentScale;
+  if (stats.limit <= 0) return stats.some_avg10 > 0 ? 1 : 0;
+
+  const double headroom =
+      1 - static_cast<double>(stats.current) / static_cast<double>(stats.limit);
+  if (headroom < 0.05) return kUrgentScale;
+  if (headroom < 0.2) return 4;
+  if (headroom > 0.5 && stats.some_avg10 == 0) return 0;
+  return 1;
+}
+
+// Releases <bytes> to the system from the background thread.  Unlike
+// MallocExtension::ReleaseMemoryToSystem(), this leaves the spans held by the
+// span caches and the central freelists, such as those just prepopulated, to
+// age out through the Plunder() passes below.
+static void ReleaseMemoryInBackground(size_t bytes) {
+  if (&TCMalloc_Internal_ReleaseMemoryInBackground != nullptr) {
+    TCMalloc_Internal_ReleaseMemoryInBackground(bytes);
+  } else {
+    tcmalloc::MallocExtension::ReleaseMemoryToSystem(bytes);
+  }
+}
+
+// Returns whether the process is short of memory, for
+// Parameters::adaptive_madvise_free: its cgroup's tasks have stalled on memory
+// lately, it is within a fifth of its cgroup's limit, or its heap is within a
+// tenth of the soft memory limit.
+static bool UnderMemoryPressure() {
+  using tcmalloc::MallocExtension;
+
+  tcmalloc::tcmalloc_internal::CgroupMemoryStats stats;
+  if (tcmalloc::tcmalloc_internal::GetCgroupMemoryStats(&stats)) {
+    if (stats.some_avg10 > 0) return true;
+    if (stats.limit > 0 && stats.current > 0.8 * stats.limit) return true;
+  }
+
+  const size_t soft_limit =
+      MallocExtension::GetMemoryLimit(MallocExtension::LimitKind::kSoft);
+  if (soft_limit == std::numeric_limits<size_t>::max()) return false;
+  const size_t used =
+      MallocExtension::GetNumericProperty("generic.physical_memory_used")
+          .value_or(0);
+  return used > 0.9 * soft_limit;
+}
+
+// Keeps the soft memory limit at Parameters::cgroup_soft_limit_fraction of the
+// limit of the process' cgroup, following changes to either.  A soft limit set
+// by other means is left alone.
+class CgroupSoftLimit {
+ public:
+  void Update() {
+    using tcmalloc::MallocExtension;
+    using tcmalloc::tcmalloc_internal::Parameters;
+
+    const double fraction = Parameters::cgroup_soft_limit_fraction();
+    if (fraction <= 0 && applied_ == kNoLimit) return;
+
+    size_t target = kNoLimit;
+    int64_t cgroup_limit;
+    if (fraction > 0 &&
+        tcmalloc::tcmalloc_internal::GetCgroupMemoryLimit(&cgroup_limit) &&
+        cgroup_limit > 0) {
+      target = std::max<size_t>(fraction * cgroup_limit, 1);
+    }
+    if (target == applied_ ||
+        MallocExtension::GetMemoryLimit(MallocExtension::LimitKind::kSoft) !=
+            applied_) {
+      return;
+    }
+    MallocExtension::SetMemoryLimit(target, MallocExtension::LimitKind::kSoft);
+    applied_ = target;
+  }
+
+ private:
+  static constexpr size_t kNoLimit = std::numeric_limits<size_t>::max();
+
+  // The soft limit last set by Update(), or kNoLimit.
+  size_t applied_ = kNoLimit;
+};
+
+// Steers the profile sampling rate so that allocations are sampled about
+// Parameters::profile_sampling_target_per_second times a second.  Each sample
+// is weighted by the sampling period it was taken under, so profiles stay
+// unbiased as the rate moves.  A disabled (non-positive) rate is left alone.
+class AdaptiveSamplingRate {
+ public:
+  void Update(absl::Time now) {
+    using tcmalloc::tcmalloc_internal::Parameters;
+
+    const int64_t sampled = TotalSampled();
+    const int64_t rate = Parameters::profile_sampling_rate();
+    const int64_t next = tcmalloc::tcmalloc_internal::AdaptSamplingRate(
+        rate, sampled - last_sampled_,
+        absl::ToDoubleSeconds(now - last_update_),
+        Parameters::profile_sampling_target_per_second());
+    last_update_ = now;
+    last_sampled_ = sampled;
+    if (next != rate) {
+      Parameters::set_profile_sampling_rate(next);
+    }
+  }
+
+ private:
+  static int64_t TotalSampled() {
+    return tcmalloc::tcmalloc_internal::tc_globals.total_sampled_count_.value();
+  }
+
+  absl::Time last_update_ = absl::Now();
+  // The samples taken before the thread started are not counted against the
+  // first update.
+  int64_t last_sampled_ = TotalSampled();
+};
+
+// Feeds the parameter tuner while Parameters::self_tuning is set, and puts
+// back the parameter under trial once it is cleared.
+static void TuneParameters(absl::Time now) {
+  using tcmalloc::tcmalloc_internal::cpu_time_stats;
+  using tcmalloc::tcmalloc_internal::parameter_tuner;
+  using tcmalloc::tcmalloc_internal::Parameters;
+
+  if (!Parameters::self_tuning()) {
+    parameter_tuner.Stop();
+    return;
+  }
+  const double cpu_ticks = static_cast<double>(cpu_time_stats.total_ticks());
+  const double memory =
+      tcmalloc::MallocExtension::GetNumericProperty(
+          "generic.physical_memory_used")
+          .value_or(0);
+  parameter_tuner.Update(now, cpu_ticks, memory,
+                         Parameters::self_tuning_memory_weight());
+}
+
+// Finishes warm starting the process from its demand profile (see
+// WarmStart), and keeps the profile up to date for the next run.
+class DemandProfileWork {
+ public:
+  void Update(absl::Time now) {
+    using tcmalloc::tcmalloc_internal::warm_start;
+
+    if (!warm_start.active()) return;
+    if (!started_) {
+      started_ = true;
+      warm_up_end_ = now + kWarmUp;
+      if (warm_start.loaded()) Start();
+    }
+    // Until the warm-up is over, the process has not seen enough traffic for
+    // its profile to replace the one it started from.
+    if (now < warm_up_end_) return;
+    warm_start.set_prefault_hugepages(0);
+    if (now - last_save_ < kSavePeriod) return;
+    last_save_ = now;
+    Collect();
+    warm_start.Save(profile_);
+  }
+
+ private:
+  static constexpr absl::Duration kWarmUp = absl::Minutes(5);
+  static constexpr absl::Duration kSavePeriod = absl::Minutes(1);
+
+  // Grows the transfer caches to their profiled capacities and keeps the
+  // profiled peak heap prefaulted for the warm-up.
+  void Start() {
+    using tcmalloc::tcmalloc_internal::DemandProfile;
+    using tcmalloc::tcmalloc_internal::kHugePageSize;
+    using tcmalloc::tcmalloc_internal::kNumClasses;
+    using tcmalloc::tcmalloc_internal::tc_globals;
+    using tcmalloc::tcmalloc_internal::warm_start;
+
+    const DemandProfile& profile = warm_start.profile();
+#ifndef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      const DemandProfile::SizeClassDemand* demand =
+          profile.Find(tc_globals.sizemap().class_to_size(size_class));
+      if (demand == nullptr) continue;
+      while (tc_globals.transfer_cache().GetStats(size_class).capacity <
+                 demand->transfer_capacity &&
+             tc_globals.transfer_cache().IncreaseCacheCapacity(size_class)) {
+      }
+    }
+#endif
+    const size_t partitions =
+        tc_globals.numa_topology().active_partitions();
+    warm_start.set_prefault_hugepages(
+        (profile.peak_heap_bytes() / partitions + kHugePageSize - 1) /
+        kHugePageSize);
+  }
+
+  // Records the current demand into profile_.
+  void Collect() {
+    using tcmalloc::tcmalloc_internal::DemandProfile;
+    using tcmalloc::tcmalloc_internal::kNumBaseClasses;
+    using tcmalloc::tcmalloc_internal::tc_globals;
+
+    profile_.Clear();
+    profile_.set_peak_heap_bytes(
+        tc_globals.peak_heap_tracker().CurrentPeakSize());
+    const bool per_cpu = tcmalloc::MallocExtension::PerCpuCachesActive();
+    // The other NUMA partitions and memory tags repeat the base size classes.
+    for (int size_class = 1; size_class < kNumBaseClasses; ++size_class) {
+      DemandProfile::SizeClassDemand demand;
+      demand.size = tc_globals.sizemap().class_to_size(size_class);
+      demand.cpu_capacity =
+          per_cpu ? static_cast<size_t>(
+                        tc_globals.cpu_cache()
+                            .GetSizeClassCapacityStats(size_class)
+                            .avg_capacity +
+                        0.5)
+                  : 0;
+      demand.transfer_capacity =
+          tc_globals.transfer_cache().GetStats(size_class).capacity;
+      if (demand.cpu_capacity == 0 && demand.transfer_capacity == 0) continue;
+      // Configurations with fewer size classes pad the tail with zeroes.
+      if (!profile_.AddSizeClass(demand)) break;
+    }
+  }
+
+  bool started_ = false;
+  absl::Time warm_up_end_;
+  absl::Time last_save_ = absl::InfinitePast();
+  tcmalloc::tcmalloc_internal::DemandProfile profile_;
+};
+
+// Allocates spans ahead of demand for the size classes whose transfer cache is
+// running dry, so that the request thread refilling it finds a span held by
+// the central freelist rather than going to the page heap.  A transfer cache
+// is running dry when it missed on removal since the previous pass and holds
+// less than a batch of objects, no more than at the previous pass.
+class SpanPrepopulation {
+ public:
+  void Update() {
+    using tcmalloc::tcmalloc_internal::kNumClasses;
+    using tcmalloc::tcmalloc_internal::Parameters;
+    using tcmalloc::tcmalloc_internal::tc_globals;
+
+#ifndef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+    const bool enabled = Parameters::central_freelist_prepopulate();
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      const auto stats = tc_globals.transfer_cache().GetStats(size_class);
+      Sample& last = last_[size_class];
+      const size_t batch =
+          tc_globals.sizemap().num_objects_to_move(size_class);
+      if (enabled && batch > 0 && stats.remove_misses > last.remove_misses &&
+          stats.used < batch && stats.used <= last.used) {
+        tc_globals.central_freelist(size_class).Prepopulate(batch);
+      }
+      last.remove_misses = stats.remove_misses;
+      last.used = stats.used;
+    }
+#endif
+  }
+
+ private:
+  struct Sample {
+    size_t remove_misses = 0;
+    size_t used = 0;
+  };
+  Sample last_[tcmalloc::tcmalloc_internal::kNumClasses];
+};
+
+// Keeps <partition>'s pool of prefaulted hugepages at
+// Parameters::prefault_hugepages, or at the warm start's, while that is
+// larger.  <applied> is the target last set, so that one no longer wanted is
+// dropped.
+static void PrefaultHugePages(int partition, int64_t* applied) {
+  using tcmalloc::tcmalloc_internal::Parameters;
+  using tcmalloc::tcmalloc_internal::tc_globals;
+  using tcmalloc::tcmalloc_internal::warm_start;
+
+  const int64_t target = std::max<int64_t>(
+      {Parameters::prefault_hugepages(), warm_start.prefault_hugepages(), 0});
+  if (target > 0 || *applied > 0) {
+    tc_globals.page_allocator().PrefaultHugePages(
+        tcmalloc::tcmalloc_internal::NHugePages(target), partition);
+  }
+  *applied = target;
+}
+
+// The clock of the background actions in deterministic mode (see
+// Parameters::deterministic_seed).  Rather than with the wall time, it advances
+// by one sleep interval for every kStepBytes allocated, as estimated from the
+// allocation samples, so that runs allocating alike see the same releases and
+// periodic actions however long they take.
+class DeterministicClock {
+ public:
+  explicit DeterministicClock(absl::Duration step)
+      : step_(step), counted_(allocated()) {}
+
+  absl::Time now() const { return now_; }
+
+  // Advances the clock by the steps allocated since the last call.  Returns
+  // whether it moved.
+  bool Advance() {
+    const int64_t steps = (allocated() - counted_) / kStepBytes;
+    if (steps <= 0) return false;
+    counted_ += steps * kStepBytes;
+    now_ += steps * step_;
+    return true;
+  }
+
+ private:
+  static constexpr int64_t kStepBytes = int64_t{64} << 20;
+
+  static int64_t allocated() {
+    return tcmalloc::tcmalloc_internal::tc_globals.sampled_weight_allocated_
+        .value();
+  }
+
+  const absl::Duration step_;
+  absl::Time now_ = absl::Now();
+  int64_t counted_;
+};
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT BackgroundWakeup background_wakeups[kNumaPartitions];
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+// Returns whether the partitions beyond the first get background workers of
+// their own.
+static bool UseNumaBackgroundWorkers() {
+  using tcmalloc::tcmalloc_internal::Parameters;
+  using tcmalloc::tcmalloc_internal::tc_globals;
+
+  // Deterministic mode keeps all of the work on one thread.
+  return Parameters::numa_background_workers() &&
+         Parameters::deterministic_seed() == 0 &&
+         tc_globals.numa_topology().active_partitions() > 1;
+}
+
+// The background work of a NUMA partition that only touches its own cpus'
+// caches and its own page heap: reclaiming idle per-cpu caches, performing
+// deferred releases and prefaulting hugepages.  The worker of <partition>
+// runs it on the partition's cpus, on every wakeup and at least every
+// <sleep_time>.
+class NumaPartitionWork {
+ public:
+  explicit NumaPartitionWork(int partition) : partition_(partition) {}
+
+  void Run(absl::Time now, absl::Duration sleep_time) {
+    using tcmalloc::tcmalloc_internal::Parameters;
+    using tcmalloc::tcmalloc_internal::tc_globals;
+
+    if (Parameters::async_release()) {
+      tc_globals.page_allocator().ReleasePendingPages(partition_);
+    }
+    // Only the pending releases are signaled; the rest runs on its period.
+    if (now - last_run_ < sleep_time) return;
+    last_run_ = now;
+
+    // See MallocExtension_Internal_ProcessBackgroundActions for the period.
+    if (tcmalloc::MallocExtension::PerCpuCachesActive() &&
+        tcmalloc::tcmalloc_internal::subtle::percpu::IsFast() &&
+        now - last_reclaim_ >= 30 * sleep_time) {
+      tc_globals.cpu_cache().TryReclaimingCaches(partition_);
+      last_reclaim_ = now;
+    }
+
+    PrefaultHugePages(partition_, &prefault_applied_);
+  }
+
+ private:
+  const int partition_;
+  absl::Time last_run_ = absl::InfinitePast();
+  absl::Time last_reclaim_ = absl::Now();
+  int64_t prefault_applied_ = 0;
+};
+
+// Runs the background work of <partition> on its cpus until background
+// actions or the per-partition workers are disabled.
+static void NumaPartitionWorker(int partition) {
+  using tcmalloc::tcmalloc_internal::background_wakeups;
+  using tcmalloc::tcmalloc_internal::NumCPUs;
+  using tcmalloc::tcmalloc_internal::tc_globals;
+
+  tcmalloc::MallocExtension::MarkThreadIdle();
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int cpu = 0, n = NumCPUs(); cpu < n; ++cpu) {
+    if (static_cast<int>(tc_globals.numa_topology().GetCpuPartition(cpu)) ==
+        partition) {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+  // Best effort: a cpuset may not allow all of the partition's cpus, and the
+  // work is correct wherever it runs.
+  if (CPU_COUNT(&cpus) > 0) {
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+  }
+
+  const absl::Duration sleep_time =
+      tcmalloc::MallocExtension::GetBackgroundProcessSleepInterval();
+  NumaPartitionWork work(partition);
+  while (tcmalloc::MallocExtension::GetBackgroundProcessActionsEnabled() &&
+         UseNumaBackgroundWorkers()) {
+    work.Run(absl::Now(), sleep_time);
+    background_wakeups[partition].WaitFor(sleep_time);
+  }
+}
+
+// The workers of the partitions beyond the first, while
+// UseNumaBackgroundWorkers().
+class NumaBackgroundWorkers {
+ public:
+  ~NumaBackgroundWorkers() { Stop(); }
+
+  bool running() const { return !threads_.empty(); }
+
+  // Starts or stops the workers to follow UseNumaBackgroundWorkers().
+  void Update() {
+    const bool use = UseNumaBackgroundWorkers();
+    if (use && !running()) {
+      const int partitions = static_cast<int>(
+          tcmalloc::tcmalloc_internal::tc_globals.numa_topology()
+              .active_partitions());
+      for (int partition = 1; partition < partitions; ++partition) {
+        threads_.emplace_back(NumaPartitionWorker, partition);
+      }
+    } else if (!use && running()) {
+      Stop();
+    }
+  }
+
+  void Stop() {
+    // The workers exit on their own once they observe that they are disabled.
+    tcmalloc::tcmalloc_internal::WakeBackgroundWorkers();
+    for (std::thread& thread : threads_) thread.join();
+    threads_.clear();
+  }
+
+ private:
+  std::vector<std::thread> threads_;
+};
+
+// Runs the background actions in slices on allocation slow paths, for
+// processes that have no thread to call ProcessBackgroundActions() (see
+// Parameters::piggyback_background_actions).  A slow path that finds a slice
+// due runs the next action whose period has elapsed, or nothing if another
+// thread is already running one.  Slices are spaced so that they take at most
+// 1/kMaxDutyCycle of the time of the threads running them, and each releases
+// at most kMaxReleaseBytes, so that no allocation stalls for long.
+//
+// Only the actions that keep the caches and the page heap from growing are
+// run: resizing and reclaiming the per-cpu caches, returning unused objects
+// and spans from the transfer, span and central caches, and releasing memory
+// at the background release rate.  Each keeps its period, in sleep intervals,
+// from ProcessBackgroundActions().  Deterministic mode does not piggyback,
+// since slices run as the wall time passes.
+class PiggybackedBackgroundActions {
+ public:
+  constexpr PiggybackedBackgroundActions() = default;
+
+  void MaybeRun() {
+    const int64_t start = absl::base_internal::CycleClock::Now();
+    if (start < next_slice_.load(std::memory_order_relaxed) ||
+        threads_running_.load(std::memory_order_relaxed) > 0 ||
+        !lock_.TryLock()) {
+      return;
+    }
+    if (start >= next_slice_.load(std::memory_order_relaxed)) {
+      RunSlice();
+      const int64_t end = absl::base_internal::CycleClock::Now();
+      const int64_t min_gap = static_cast<int64_t>(
+          absl::ToDoubleSeconds(kSliceInterval) *
+          absl::base_internal::CycleClock::Frequency());
+      next_slice_.store(
+          end + std::max<int64_t>(min_gap, (end - start) * kMaxDutyCycle),
+          std::memory_order_relaxed);
+    }
+    lock_.Unlock();
+  }
+
+  // ProcessBackgroundActions() runs all of the actions itself, so slow paths
+  // leave them alone while a thread is in it.
+  void ThreadStarted() {
+    threads_running_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void ThreadStopped() {
+    threads_running_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+ private:
+  enum Action {
+    kRelease,
+    kPlunder,
+    kCpuCacheShuffle,
+    kCpuCacheResize,
+    kCpuCacheReclaim,
+    kTransferCacheResize,
+    kNumActions,
+  };
+
+  static constexpr absl::Duration kSliceInterval = absl::Milliseconds(10);
+  static constexpr int64_t kMaxDutyCycle = 20;
+  static constexpr size_t kMaxReleaseBytes = size_t{16} << 20;
+  static constexpr int kPeriods[kNumActions] = {1, 5, 5, 2, 30, 2};
+
+  void RunSlice() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    using tcmalloc::tcmalloc_internal::Parameters;
+
+    if (Parameters::deterministic_seed() != 0) return;
+    const absl::Time now = absl::Now();
+    if (!started_) {
+      started_ = true;
+      for (absl::Time& last : last_run_) last = now;
+      return;
+    }
+    const absl::Duration sleep_time =
+        tcmalloc::MallocExtension::GetBackgroundProcessSleepInterval();
+    for (int i = 0; i < kNumActions; ++i) {
+      const int action = (next_action_ + i) % kNumActions;
+      const absl::Duration elapsed = now - last_run_[action];
+      if (elapsed < kPeriods[action] * sleep_time) continue;
+      Run(static_cast<Action>(action), elapsed);
+      last_run_[action] = now;
+      next_action_ = (action + 1) % kNumActions;
+      return;
+    }
+  }
+
+  static void Run(Action action, absl::Duration elapsed) {
+    using tcmalloc::tcmalloc_internal::kNumClasses;
+    using tcmalloc::tcmalloc_internal::PageAllocator;
+    using tcmalloc::tcmalloc_internal::Parameters;
+    using tcmalloc::tcmalloc_internal::tc_globals;
+
+    const bool per_cpu = tcmalloc::MallocExtension::PerCpuCachesActive() &&
+                         tcmalloc::tcmalloc_internal::subtle::percpu::IsFast();
+    switch (action) {
+      case kRelease: {
+        const size_t bytes = static_cast<size_t>(std::clamp<double>(
+            static_cast<size_t>(Parameters::background_release_rate()) *
+                absl::ToDoubleSeconds(elapsed),
+            0, kMaxReleaseBytes));
+        if (bytes > 0 || Parameters::release_pages_from_huge_region()) {
+          ReleaseMemoryInBackground(bytes);
+        }
+        if (Parameters::async_release()) {
+          tc_globals.page_allocator().ReleasePendingPages(
+              PageAllocator::kAllPartitions);
+        }
+        break;
+      }
+      case kPlunder:
+        tc_globals.sharded_transfer_cache().Plunder();
+        tcmalloc::tcmalloc_internal::span_cache.Plunder();
+        tcmalloc::tcmalloc_internal::large_span_cache.Plunder();
+        for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+          tc_globals.central_freelist(size_class).PlunderEmptySpans();
+        }
+#ifndef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+        tc_globals.transfer_cache().TryPlunder();
+#endif
+        break;
+      case kCpuCacheShuffle:
+        if (per_cpu) {
+          tc_globals.cpu_cache().ShuffleCpuCaches();
+          tc_globals.cpu_cache().UpdateHandoffTargets();
+          tc_globals.cpu_cache().UpdateBatchLengths();
+        }
+        break;
+      case kCpuCacheResize:
+        if (per_cpu) {
+          if (Parameters::per_cpu_caches_autotune()) {
+            tc_globals.cpu_cache().TuneCapacities();
+          } else {
+            tc_globals.cpu_cache().ResizeSizeClasses();
+          }
+        }
+        break;
+      case kCpuCacheReclaim:
+        if (per_cpu) {
+          tc_globals.cpu_cache().TryReclaimingCaches(
+              PageAllocator::kAllPartitions);
+        }
+        break;
+      case kTransferCacheResize:
+#ifndef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+        tc_globals.transfer_cache().TryResizingCaches();
+        tc_globals.sharded_transfer_cache().UpdateActiveClasses(
+            [](int size_class) {
+              return tc_globals.transfer_cache().GetStats(size_class);
+            });
+#endif
+        break;
+      case kNumActions:
+        break;
+    }
+  }
+
+  absl::base_internal::SpinLock lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  // The CycleClock time before which no slice is due.
+  std::atomic<int64_t> next_slice_{0};
+  std::atomic<int> threads_running_{0};
+  bool started_ ABSL_GUARDED_BY(lock_) = false;
+  int next_action_ ABSL_GUARDED_BY(lock_) = 0;
+  absl::Time last_run_[kNumActions] ABSL_GUARDED_BY(lock_) = {};
+};
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT static PiggybackedBackgroundActions piggybacked_actions;
+
+void MaybeRunBackgroundSlice() {
+  if (ABSL_PREDICT_TRUE(!Parameters::piggyback_background_actions()) ||
+      !tc_globals.IsInited()) {
+    return;
+  }
+  piggybacked_actions.MaybeRun();
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+// Release memory to the system at a constant rate, or at one scaled to the
+// memory pressure of the process' cgroup with
+// Parameters::cgroup_pressure_release.
 void MallocExtension_Internal_ProcessBackgroundActions() {
+  using ::tcmalloc::tcmalloc_internal::kNumClasses;
   using ::tcmalloc::tcmalloc_internal::Parameters;
+  using ::tcmalloc::tcmalloc_internal::large_span_cache;
+  using ::tcmalloc::tcmalloc_internal::span_cache;
   using ::tcmalloc::tcmalloc_internal::tc_globals;
 
   tcmalloc::MallocExtension::MarkThreadIdle();
+  tcmalloc::tcmalloc_internal::piggybacked_actions.ThreadStarted();
+  tcmalloc::tcmalloc_internal::deferred_frees.ConsumerStarted();
 
   absl::Time prev_time = absl::Now();
   const absl::Duration kSleepTime =
       tcmalloc::MallocExtension::GetBackgroundProcessSleepInterval();
 
+  // Deterministic mode runs by allocation volume rather than by the wall
+  // time, and leaves out the actions that adapt to the wall time, to the
+  // machine, or to the timing of the threads: those that resize the caches
+  // and tune the sampling rate and other parameters.
+  const bool deterministic = Parameters::deterministic_seed() != 0;
+  DeterministicClock deterministic_clock(kSleepTime);
+  prev_time = deterministic_clock.now();
+
   // Reclaim inactive per-cpu caches once per kCpuCacheReclaimPeriod.
   //
   // We use a longer 30 sec reclaim period to make sure that caches are indeed
@@ -47,6 +721,21 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
   const absl::Duration kCpuCacheReclaimPeriod = 30 * kSleepTime;
   absl::Time last_reclaim = absl::Now();
 
+  // Under a cgroup cpu quota of fewer cpus than the process may run on, it
+  // leaves most caches idle at any time, and their capacity is only budgeted
+  // for a few (see CpuCache::UpdateCpuQuota).  Reclaim idle caches sooner
+  // then, and follow changes to the quota once per kCpuQuotaUpdatePeriod.
+  const absl::Duration kCpuCacheQuotaReclaimPeriod = 7 * kSleepTime;
+  const absl::Duration kCpuQuotaUpdatePeriod = 10 * kSleepTime;
+  absl::Time last_cpu_quota_update = absl::Now();
+
+  // In per-thread mode, reclaim the caches of threads that have not used them
+  // for a whole kThreadCacheReclaimPeriod, once per period.  Threads blocked
+  // for long would otherwise keep their caches until they call MarkThreadIdle
+  // or exit.
+  const absl::Duration kThreadCacheReclaimPeriod = 15 * kSleepTime;
+  absl::Time last_thread_cache_reclaim = absl::Now();
+
   // Shuffle per-cpu caches once per kCpuCacheShufflePeriod.
   const absl::Duration kCpuCacheShufflePeriod = 5 * kSleepTime;
   absl::Time last_shuffle = absl::Now();
@@ -59,6 +748,19 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
   const absl::Duration kCpuCacheSlabResizePeriod = 29 * kSleepTime;
   absl::Time last_slab_resize_check = absl::Now();
 
+  // Deactivate the memory of cold allocations once per kColdAdvisePeriod.
+  // Pages touched since the last pass are active again and have to be
+  // re-advised.
+  const absl::Duration kColdAdvisePeriod = 10 * kSleepTime;
+  absl::Time last_cold_advise = absl::Now();
+
+  // Release the memory of free metadata slabs once per
+  // kMetadataReleasePeriod, a bounded number of slabs at a time, since it is
+  // done under pageheap_lock.
+  const absl::Duration kMetadataReleasePeriod = 10 * kSleepTime;
+  absl::Time last_metadata_release = absl::Now();
+  constexpr size_t kMaxMetadataSlabsPerRelease = 64;
+
 #ifndef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
   // We reclaim unused objects from the transfer caches once per
   // kTransferCacheResizePeriod.
@@ -70,8 +772,35 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
   absl::Time last_transfer_cache_resize_check = absl::Now();
 #endif
 
+  CgroupSoftLimit cgroup_soft_limit;
+  AdaptiveSamplingRate adaptive_sampling_rate;
+  NumaBackgroundWorkers numa_workers;
+  DemandProfileWork demand_profile_work;
+  SpanPrepopulation span_prepopulation;
+  int64_t prefault_applied = 0;
+
   while (tcmalloc::MallocExtension::GetBackgroundProcessActionsEnabled()) {
-    absl::Time now = absl::Now();
+    absl::Time now = deterministic ? deterministic_clock.now() : absl::Now();
+
+    // With workers for the other partitions, this thread only does the
+    // partition-local work of partition 0.
+    numa_workers.Update();
+    const int local_partition =
+        numa_workers.running()
+            ? 0
+            : tcmalloc::tcmalloc_internal::PageAllocator::kAllPartitions;
+
+    // Follow the cgroup limit before anything that depends on the soft limit.
+    cgroup_soft_limit.Update();
+
+    if (!deterministic) {
+      adaptive_sampling_rate.Update(now);
+      TuneParameters(now);
+    }
+    demand_profile_work.Update(now);
+
+    // Deliver the lifetime profiling events buffered per CPU.
+    tc_globals.deallocation_samples.Flush();
 
     // We follow the cache hierarchy in TCMalloc from outermost (per-CPU) to
     // innermost (the page heap).  Freeing up objects at one layer can help aid
@@ -84,33 +813,67 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
       // threads unable to).
       CHECK_CONDITION(tcmalloc::tcmalloc_internal::subtle::percpu::IsFast());
 
+      // Reclaim the caches of cpus that we can no longer run on right away,
+      // rather than waiting for them to look idle.
+      tc_globals.cpu_cache().ReclaimDisallowedCaches();
+
+      if (!deterministic &&
+          now - last_cpu_quota_update >= kCpuQuotaUpdatePeriod) {
+        tc_globals.cpu_cache().UpdateCpuQuota();
+        last_cpu_quota_update = now;
+      }
+
       // Try to reclaim per-cpu caches once every kCpuCacheReclaimPeriod
       // when enabled.
-      if (now - last_reclaim >= kCpuCacheReclaimPeriod) {
-        tc_globals.cpu_cache().TryReclaimingCaches();
+      const absl::Duration reclaim_period =
+          tc_globals.cpu_cache().CpuQuotaBudget() > 0
+              ? kCpuCacheQuotaReclaimPeriod
+              : kCpuCacheReclaimPeriod;
+      if (!deterministic && now - last_reclaim >= reclaim_period) {
+        tc_globals.cpu_cache().TryReclaimingCaches(local_partition);
         last_reclaim = now;
       }
 
-      if (now - last_shuffle >= kCpuCacheShufflePeriod) {
+      if (!deterministic && now - last_shuffle >= kCpuCacheShufflePeriod) {
         tc_globals.cpu_cache().ShuffleCpuCaches();
+        tc_globals.cpu_cache().UpdateHandoffTargets();
+        tc_globals.cpu_cache().UpdateBatchLengths();
         last_shuffle = now;
       }
 
-      if (now - last_size_class_resize >= kSizeClassResizePeriod) {
-        tc_globals.cpu_cache().ResizeSizeClasses();
+      if (!deterministic &&
+          now - last_size_class_resize >= kSizeClassResizePeriod) {
+        if (Parameters::per_cpu_caches_autotune()) {
+          tc_globals.cpu_cache().TuneCapacities();
+        } else {
+          tc_globals.cpu_cache().ResizeSizeClasses();
+        }
         last_size_class_resize = now;
       }
 
       // See if we need to grow the slab once every kCpuCacheSlabResizePeriod
       // when enabled.
-      if (Parameters::per_cpu_caches_dynamic_slab_enabled() &&
+      if (!deterministic && !Parameters::small_footprint() &&
+          Parameters::per_cpu_caches_dynamic_slab_enabled() &&
           now - last_slab_resize_check >= kCpuCacheSlabResizePeriod) {
         tc_globals.cpu_cache().ResizeSlabIfNeeded();
         last_slab_resize_check = now;
       }
+    } else if (!deterministic &&
+               now - last_thread_cache_reclaim >= kThreadCacheReclaimPeriod) {
+      tcmalloc::tcmalloc_internal::ThreadCache::ReclaimIdleCaches();
+      last_thread_cache_reclaim = now;
     }
 
+    tcmalloc::tcmalloc_internal::deferred_frees.Drain();
     tc_globals.sharded_transfer_cache().Plunder();
+    span_cache.Plunder();
+    large_span_cache.Plunder();
+    // Spans added here are not returned by the plunder that follows.
+    span_prepopulation.Update();
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      tc_globals.central_freelist(size_class).PlunderEmptySpans();
+    }
 
 #ifndef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
     // Try to plunder and reclaim unused objects from transfer caches.
@@ -120,8 +883,13 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
       last_transfer_cache_plunder_check = now;
     }
 
-    if (now - last_transfer_cache_resize_check >= kTransferCacheResizePeriod) {
+    if (!deterministic &&
+        now - last_transfer_cache_resize_check >= kTransferCacheResizePeriod) {
       tc_globals.transfer_cache().TryResizingCaches();
+      tc_globals.sharded_transfer_cache().UpdateActiveClasses(
+          [](int size_class) {
+            return tc_globals.transfer_cache().GetStats(size_class);
+          });
       last_transfer_cache_resize_check = now;
     }
 #endif
@@ -131,16 +899,116 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
         static_cast<size_t>(Parameters::background_release_rate()) *
         absl::ToDoubleSeconds(now - prev_time);
     bytes_to_release = std::max<ssize_t>(bytes_to_release, 0);
+    if (Parameters::cgroup_pressure_release() && !deterministic) {
+      bytes_to_release *= CgroupPressureReleaseScale();
+    }
+    if (Parameters::adaptive_madvise_free() && !deterministic) {
+      tcmalloc::tcmalloc_internal::SetSystemMemoryPressure(
+          UnderMemoryPressure());
+    }
 
     // If release rate is set to 0, do not release memory to system. However, if
     // we want to release free and backed hugepages from HugeRegion,
     // ReleaseMemoryToSystem should be able to release those pages to the
     // system even with bytes_to_release = 0.
     if (bytes_to_release > 0 || Parameters::release_pages_from_huge_region()) {
-      tcmalloc::MallocExtension::ReleaseMemoryToSystem(bytes_to_release);
+      ReleaseMemoryInBackground(bytes_to_release);
+    }
+
+    // Unback hugepages whose release was deferred off the allocation path.
+    if (Parameters::async_release()) {
+      tc_globals.page_allocator().ReleasePendingPages(local_partition);
+    }
+
+    // Push the memory of cold (hot_cold_t) allocations towards reclaim, or
+    // towards a slower memory tier with demotion enabled, keeping DRAM for
+    // hot data.
+    if (Parameters::madvise_cold() &&
+        now - last_cold_advise >= kColdAdvisePeriod) {
+      tcmalloc::tcmalloc_internal::SystemAdviseCold();
+      last_cold_advise = now;
+    }
+
+    if (Parameters::release_free_metadata() &&
+        now - last_metadata_release >= kMetadataReleasePeriod) {
+      tc_globals.ReleaseFreeMetadata(kMaxMetadataSlabsPerRelease);
+      last_metadata_release = now;
+    }
+
+    // Refill the pool of prefaulted hugepages, so that allocations breaking a
+    // new hugepage do not take page faults on the request thread.
+    PrefaultHugePages(local_partition, &prefault_applied);
+
+    // Restore hugepage backing to hugepages broken by subrelease once they are
+    // fully backed again, which khugepaged may never get around to.
+    if (const int64_t collapse = Parameters::collapse_hugepages();
+        collapse > 0) {
+      tc_globals.page_allocator().CollapseRefilledHugePages(
+          tcmalloc::tcmalloc_internal::NHugePages(collapse));
+    }
+
+    if (const int64_t scan = Parameters::scan_hugepage_backing(); scan > 0) {
+      tc_globals.page_allocator().ScanHugePageBacking(scan);
+    }
+
+    if (const int64_t scan = Parameters::scan_free_page_idleness(); scan > 0) {
+      tc_globals.page_allocator().ScanFreePageIdleness(scan);
+    }
+
+    if (const int64_t scan = Parameters::release_resident_unbacked();
+        scan > 0) {
+      tc_globals.page_allocator().ReleaseResidentUnbacked(scan);
+    }
+
+    // Bound how stale the allocation trace file gets on quiet CPUs.
+    tc_globals.allocation_trace().Flush();
+
+    tcmalloc::tcmalloc_internal::heap_telemetry.Report(
+        tcmalloc::tcmalloc_internal::CurrentHeapActivity());
+
+    // Republish the stats that GetNumericProperty() can read without locks,
+    // last so that they reflect this iteration's releases.
+    if (Parameters::stats_snapshot_max_age_ms() > 0) {
+      tcmalloc::tcmalloc_internal::UpdateStatsSnapshot();
     }
+    tcmalloc::tcmalloc_internal::UpdateStatsPage();
 
     prev_time = now;
-    absl::SleepFor(kSleepTime);
+
+    // In deterministic mode, poll the allocation volume once per interval
+    // until the clock moves.
+    if (deterministic) {
+      while (tcmalloc::MallocExtension::GetBackgroundProcessActionsEnabled() &&
+             !deterministic_clock.Advance()) {
+        tcmalloc::tcmalloc_internal::background_wakeups[0].WaitFor(kSleepTime);
+        tcmalloc::tcmalloc_internal::deferred_frees.Drain();
+        if (Parameters::async_release()) {
+          tc_globals.page_allocator().ReleasePendingPages(local_partition);
+        }
+      }
+      continue;
+    }
+
+    // Sleep until the next iteration.  Slow paths wake us early for work that
+    // should not wait that long, which is all that we then do.
+    const absl::Time deadline = now + kSleepTime;
+    for (absl::Time t = absl::Now();
+         t < deadline &&
+         tcmalloc::MallocExtension::GetBackgroundProcessActionsEnabled();
+         t = absl::Now()) {
+      if (!tcmalloc::tcmalloc_internal::background_wakeups[0].WaitFor(
+              deadline - t)) {
+        break;
+      }
+      tcmalloc::tcmalloc_internal::deferred_frees.Drain();
+      if (Parameters::async_release()) {
+        tc_globals.page_allocator().ReleasePendingPages(local_partition);
+      }
+    }
   }
+
+  // Spans queued from here on are freed right away.
+  tcmalloc::tcmalloc_internal::deferred_frees.ConsumerStopped();
+  tcmalloc::tcmalloc_internal::deferred_frees.Drain();
+  tcmalloc::tcmalloc_internal::piggybacked_actions.ThreadStopped();
 }
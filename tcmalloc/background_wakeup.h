@@ -0,0 +1,105 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_BACKGROUND_WAKEUP_H_
+#define TCMALLOC_BACKGROUND_WAKEUP_H_
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/time/time.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Lets slow paths wake a background worker that would otherwise sleep until
+// its next period.  Signal() is a single load when nobody is waiting, so it is
+// cheap enough for allocation slow paths, and neither side allocates or takes
+// a lock.  Signals are not counted: any number of them before the waiter next
+// checks wake it once.
+class BackgroundWakeup {
+ public:
+  constexpr BackgroundWakeup() = default;
+
+  BackgroundWakeup(const BackgroundWakeup&) = delete;
+  BackgroundWakeup& operator=(const BackgroundWakeup&) = delete;
+
+  void Signal() {
+    if (pending_.load(std::memory_order_relaxed) != 0) return;
+    pending_.store(1, std::memory_order_seq_cst);
+    if (waiting_.load(std::memory_order_seq_cst)) {
+      syscall(SYS_futex, &pending_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr,
+              0);
+    }
+  }
+
+  // Waits until Signal() is called or <timeout> passes, and returns whether
+  // it was signaled.  Only one thread may wait at a time.
+  bool WaitFor(absl::Duration timeout) {
+    waiting_.store(true, std::memory_order_seq_cst);
+    if (pending_.load(std::memory_order_seq_cst) == 0) {
+      const timespec ts = absl::ToTimespec(timeout);
+      // Returns early on a signal, or if pending_ is no longer 0.
+      syscall(SYS_futex, &pending_, FUTEX_WAIT_PRIVATE, 0, &ts, nullptr, 0);
+    }
+    waiting_.store(false, std::memory_order_relaxed);
+    return pending_.exchange(0, std::memory_order_acquire) != 0;
+  }
+
+ private:
+  // Accessed by the futex syscalls, which need a 32-bit word.
+  std::atomic<uint32_t> pending_ = 0;
+  std::atomic<bool> waiting_ = false;
+};
+
+// The wakeups of the background workers, one per NUMA partition.  The worker
+// of partition 0, the thread calling ProcessBackgroundActions(), also does the
+// work that is not specific to a partition.
+ABSL_CONST_INIT extern BackgroundWakeup background_wakeups[kNumaPartitions];
+
+// Wakes the background worker of <partition>.
+inline void WakeBackgroundWorker(size_t partition) {
+  ASSERT(partition < kNumaPartitions);
+  background_wakeups[partition].Signal();
+}
+
+// Wakes all background workers, such as when they are being stopped.
+inline void WakeBackgroundWorkers() {
+  for (BackgroundWakeup& wakeup : background_wakeups) wakeup.Signal();
+}
+
+// Runs a slice of the background actions on the calling thread, with
+// Parameters::piggyback_background_actions, if one is due and no thread is
+// running ProcessBackgroundActions().  Called from allocation slow paths,
+// which must not hold any lock that the background actions take.
+void MaybeRunBackgroundSlice();
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_BACKGROUND_WAKEUP_H_
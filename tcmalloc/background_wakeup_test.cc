@@ -0,0 +1,57 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/background_wakeup.h"
+
+#include <thread>  // NOLINT(build/c++11)
+
+#include "gtest/gtest.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(BackgroundWakeupTest, TimesOut) {
+  BackgroundWakeup wakeup;
+  const absl::Time start = absl::Now();
+  EXPECT_FALSE(wakeup.WaitFor(absl::Milliseconds(20)));
+  EXPECT_GE(absl::Now() - start, absl::Milliseconds(10));
+}
+
+TEST(BackgroundWakeupTest, SignalBeforeWait) {
+  BackgroundWakeup wakeup;
+  wakeup.Signal();
+  wakeup.Signal();
+  // Signals are coalesced into a single wakeup.
+  EXPECT_TRUE(wakeup.WaitFor(absl::Seconds(10)));
+  EXPECT_FALSE(wakeup.WaitFor(absl::ZeroDuration()));
+}
+
+TEST(BackgroundWakeupTest, SignalWakesWaiter) {
+  BackgroundWakeup wakeup;
+  const absl::Time start = absl::Now();
+  std::thread signaler([&]() {
+    absl::SleepFor(absl::Milliseconds(10));
+    wakeup.Signal();
+  });
+  EXPECT_TRUE(wakeup.WaitFor(absl::Seconds(60)));
+  EXPECT_LT(absl::Now() - start, absl::Seconds(30));
+  signaler.join();
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -20,14 +20,19 @@
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/types/span.h"
+#include "tcmalloc/background_wakeup.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/cpu_time_stats.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/prefetch.h"
+#include "tcmalloc/latency_stats.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/pages.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/span.h"
+#include "tcmalloc/span_cache.h"
 #include "tcmalloc/static_vars.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -45,6 +50,29 @@ static MemoryTag MemoryTagFromSizeClass(size_t size_class) {
   return NumaNormalTag(size_class / kNumBaseClasses);
 }
 
+// Whether the sampled objects of <size_class> are mostly long-lived, so that
+// its spans are placed apart from short-lived ones.
+static bool PredictLongLived(size_t size_class) {
+  return Parameters::lifetime_aware_span_placement() &&
+         tc_globals.size_class_lifetimes().IsLongLived(size_class);
+}
+
+bool StaticForwarder::span_cache_coloring() {
+  return Parameters::span_cache_coloring();
+}
+
+bool StaticForwarder::empty_span_cache() {
+  return Parameters::central_freelist_empty_span_cache();
+}
+
+bool StaticForwarder::remote_frees() {
+  return Parameters::central_freelist_remote_frees();
+}
+
+bool StaticForwarder::dynamic_span_pages() {
+  return Parameters::central_freelist_dynamic_span_pages();
+}
+
 size_t StaticForwarder::class_to_size(int size_class) {
   return tc_globals.sizemap().class_to_size(size_class);
 }
@@ -67,9 +95,36 @@ void StaticForwarder::MapObjectsToSpans(absl::Span<void*> batch, Span** spans) {
 Span* StaticForwarder::AllocateSpan(int size_class,
                                     SpanAllocInfo span_alloc_info,
                                     Length pages_per_span) {
+  // Taking a new span is slow anyway, so background work may piggyback on it.
+  MaybeRunBackgroundSlice();
   const MemoryTag tag = MemoryTagFromSizeClass(size_class);
-  Span* span =
-      tc_globals.page_allocator().New(pages_per_span, span_alloc_info, tag);
+  span_alloc_info.density =
+      PredictSpanDensity(size_class, span_alloc_info.objects_per_span,
+                         PredictLongLived(size_class));
+  // The span cache would hand a region's spans to other size classes.
+  const bool use_span_cache =
+      Parameters::l3_span_cache() &&
+      SpanCache::Cacheable(tag, pages_per_span) &&
+      !tc_globals.page_allocator().size_class_regions().Has(size_class);
+  // Regions only hold spans of the size class's own length.
+  const bool use_region = pages_per_span == class_to_pages(size_class);
+  Span* span = nullptr;
+  if (use_span_cache) {
+    span = span_cache.TryGet(tag, pages_per_span, span_alloc_info.density);
+  }
+  if (span == nullptr) {
+    ScopedLatencyTimer timer(LatencyStage::kPageAllocatorNew, size_class);
+    ScopedCpuTimer cpu_timer(CpuTimePath::kPageAllocatorNew);
+    if (use_span_cache) {
+      span = span_cache.Refill(tag, pages_per_span, span_alloc_info);
+    } else if (use_region) {
+      span = tc_globals.page_allocator().NewForSizeClass(
+          size_class, pages_per_span, span_alloc_info, tag);
+    } else {
+      span = tc_globals.page_allocator().New(pages_per_span, span_alloc_info,
+                                             tag);
+    }
+  }
   if (ABSL_PREDICT_FALSE(span == nullptr)) {
     return nullptr;
   }
@@ -92,11 +147,24 @@ static void ReturnSpansToPageHeap(MemoryTag tag, absl::Span<Span*> free_spans,
 
 void StaticForwarder::DeallocateSpans(int size_class, size_t objects_per_span,
                                       absl::Span<Span*> free_spans) {
+  const MemoryTag tag = MemoryTagFromSizeClass(size_class);
+  const bool use_span_cache = Parameters::l3_span_cache();
+  const AccessDensityPrediction density = PredictSpanDensity(
+      size_class, objects_per_span, PredictLongLived(size_class));
+
   // Unregister size class doesn't require holding any locks.
+  size_t num_uncached = 0;
   for (Span* const free_span : free_spans) {
     ASSERT(IsNormalMemory(free_span->start_address()) ||
            IsColdMemory(free_span->start_address()));
     tc_globals.pagemap().UnregisterSizeClass(free_span);
+    if (use_span_cache &&
+        !tc_globals.page_allocator().size_class_regions().Contains(
+            free_span) &&
+        span_cache.TryPut(tag, free_span, density)) {
+      continue;
+    }
+    free_spans[num_uncached++] = free_span;
 
     // Before taking pageheap_lock, prefetch the PageTrackers these spans are
     // on.
@@ -112,8 +180,8 @@ void StaticForwarder::DeallocateSpans(int size_class, size_t objects_per_span,
                                       ABSL_CACHELINE_SIZE));
   }
 
-  const MemoryTag tag = MemoryTagFromSizeClass(size_class);
-  ReturnSpansToPageHeap(tag, free_spans, objects_per_span);
+  if (num_uncached == 0) return;
+  ReturnSpansToPageHeap(tag, free_spans.first(num_uncached), objects_per_span);
 }
 
 }  // namespace central_freelist_internal
@@ -18,6 +18,7 @@
 #include <stddef.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 
@@ -29,11 +30,16 @@
 #include "absl/numeric/bits.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/cpu_time_stats.h"
 #include "tcmalloc/hinted_tracker_lists.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/atomic_stats_counter.h"
+#include "tcmalloc/internal/cache_topology.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/internal/probes.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/span_stats.h"
@@ -59,15 +65,42 @@ class StaticForwarder {
   static void DeallocateSpans(int size_class, size_t objects_per_span,
                               absl::Span<Span*> free_spans)
       ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  static bool span_cache_coloring();
+  static bool empty_span_cache();
+  static bool remote_frees();
+  static bool dynamic_span_pages();
 };
 
 // Specifies number of nonempty_ lists that keep track of non-empty spans.
 static constexpr size_t kNumLists = 8;
+// Span keeps the index of its nonempty_ list in 3 bits.
+static_assert(kNumLists <= 8);
 
 // Specifies the threshold for number of objects per span. The threshold is
 // used to consider a span sparsely- vs. densely-accessed.
 static constexpr size_t kFewObjectsAllocMaxLimit = 16;
 
+// Predicts the access density of a span of <size_class> holding
+// <objects_per_span> objects.  The number of objects per span is used as a
+// proxy: spans with more than kFewObjectsAllocMaxLimit objects are assumed to
+// be densely-accessed and long-lived, and are kept apart from sparse spans in
+// the HugePageFiller.  Spans of cold (expanded) size classes are always
+// predicted sparse: they are allocated from the cold heap, where there is no
+// TLB locality to protect, so they may share hugepages with donated slack and
+// are released first.  Spans of other size classes whose objects are known to
+// be <long_lived> are kept with the dense spans however many objects they
+// hold, so that they do not pin hugepages of short-lived sparse spans.
+inline AccessDensityPrediction PredictSpanDensity(size_t size_class,
+                                                  size_t objects_per_span,
+                                                  bool long_lived = false) {
+  if (IsExpandedSizeClass(size_class)) {
+    return AccessDensityPrediction::kSparse;
+  }
+  return objects_per_span > kFewObjectsAllocMaxLimit || long_lived
+             ? AccessDensityPrediction::kDense
+             : AccessDensityPrediction::kSparse;
+}
+
 // Data kept per size-class in central cache.
 template <typename ForwarderT>
 class CentralFreeList {
@@ -96,14 +129,62 @@ class CentralFreeList {
   // REQUIRES: batch.size() > 0 && batch.size() <= kMaxObjectsToMove.
   void InsertRange(absl::Span<void*> batch) ABSL_LOCKS_EXCLUDED(lock_);
 
+  // Like InsertRange(batch), where spans[i] is the span of batch[i] as
+  // returned by Forwarder::MapObjectsToSpans.  spans is clobbered.
+  //
+  // If the forwarder enables remote frees, objects of intrusive spans are
+  // pushed onto the remote free lists of their spans instead, without taking
+  // lock_, and moved to the spans' freelists by the next caller that takes it.
+  // They count as allocated until then.
+  void InsertRange(absl::Span<void*> batch, Span** spans)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
   // Fill a prefix of batch[0..N-1] with up to N elements removed from central
   // freelist.  Return the number of elements removed.
   ABSL_MUST_USE_RESULT int RemoveRange(void** batch, int N)
       ABSL_LOCKS_EXCLUDED(lock_);
 
+  // Like RemoveRange, but only takes objects from spans already held by this
+  // freelist and never allocates a new span.
+  ABSL_MUST_USE_RESULT int TryRemoveRange(void** batch, int N)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Like TryRemoveRange, but only takes objects from <span>, which must hold a
+  // live object of this freelist's size class.
+  ABSL_MUST_USE_RESULT int RemoveFromSpan(Span* span, void** batch, int N)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Like RemoveRange, but only takes objects from a span no object of which is
+  // allocated: a held empty span or a newly allocated one.  All the objects
+  // returned come from that span.
+  ABSL_MUST_USE_RESULT int RemoveFromNewSpan(void** batch, int N)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Sets in <live> the objects of <span> that are not free in this freelist,
+  // and in <objects> the number of objects <span> holds, and returns the
+  // address of its first object (see Span::LiveObjects), if this freelist
+  // still owns <span>.  <owned> is called with lock_ held, and should check
+  // that <span> still holds objects of this size class.  Returns nullptr,
+  // leaving <live> and <objects> unset, if not.
+  template <typename F>
+  void* LiveObjects(Span* span, F owned, Span::ObjectBitmap* live,
+                    size_t* objects) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns the number of objects in a span of the size class's own length.
+  // Spans of other lengths may be allocated if the forwarder enables dynamic
+  // span pages; see ChooseSpanPages.
+  size_t objects_per_span() const { return objects_per_span_; }
+
   // Returns the number of free objects in cache.
   size_t length() const { return static_cast<size_t>(counter_.value()); }
 
+  // Returns the number of objects removed from this freelist and not yet
+  // inserted back: those in use by the application or held by the caches in
+  // front of the freelist.  Like length(), read without locking.
+  size_t allocated() const {
+    return static_cast<size_t>(std::max<int64_t>(allocated_.value(), 0));
+  }
+
   // Returns the memory overhead (internal fragmentation) attributable
   // to the freelist.  This is memory lost when the size of elements
   // in a freelist doesn't exactly divide the page-size (an 8192-byte
@@ -128,7 +209,68 @@ class CentralFreeList {
 
   Forwarder& forwarder() { return forwarder_; }
 
+  // Sets the shard recorded in spans allocated by this freelist.  See
+  // ShardedCentralFreeList.
+  void set_shard(uint8_t shard) { shard_ = shard; }
+
+  // Spans that become completely free are held (up to kMaxEmptySpans of them,
+  // and kMaxEmptySpanBytes in total) for reuse by a later Populate(), if the
+  // forwarder enables it, sparing two trips to the page heap when allocations
+  // come in bursts.  They remain allocated and their objects count as free.
+  static constexpr size_t kMaxEmptySpans = 4;
+  static constexpr size_t kMaxEmptySpanBytes = 256 << 10;
+
+  // Returns the held empty spans that have not been reused since the previous
+  // call to the forwarder, so that spans are held for one to two periods of
+  // the caller.
+  void PlunderEmptySpans() ABSL_LOCKS_EXCLUDED(lock_);
+  // Returns all held empty spans to the forwarder.
+  void FlushEmptySpans() ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Allocates a span from the forwarder ahead of demand and holds it as if it
+  // had just been emptied, so that the next Populate() need not go to the
+  // forwarder.  Does nothing if at least <min_objects> objects are free, if a
+  // span is already held, or if spans of this size class are never held.
+  // Returns whether a span was added.
+  bool Prepopulate(size_t min_objects) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns the number of empty spans held.
+  size_t num_empty_spans() ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    return num_empty_spans_;
+  }
+
+  // Acquires and releases lock_ around fork(), so that the child does not
+  // inherit it held by a thread that no longer exists.
+  void AcquireInternalLocks() ABSL_EXCLUSIVE_LOCK_FUNCTION(lock_) {
+    lock_.Lock();
+  }
+  void ReleaseInternalLocks() ABSL_UNLOCK_FUNCTION(lock_) { lock_.Unlock(); }
+
  private:
+  // Removes up to N objects from the nonempty_ spans, allocating new spans
+  // from the forwarder if populate is true.
+  int RemoveFromSpans(void** batch, int N, bool populate)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Removes up to N objects from <span>, which is on a nonempty_ list.
+  int PopFromSpan(Span* span, void** batch, int N)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Pushes <batch> onto the remote free lists of <spans>.  See InsertRange.
+  void InsertRemote(absl::Span<void*> batch, Span** spans)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Records <span>, whose remote free list just became nonempty, for
+  // DrainRemoteFrees().  Returns false if there was no room.
+  bool AddRemoteFreeSpan(Span* span) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Releases the objects on the remote free lists of the recorded spans, or of
+  // <spans>, to the spans.  May temporarily release lock_.
+  void DrainRemoteFrees() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void DrainRemoteFrees(absl::Span<Span*> spans)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
   // Release an object to spans.
   // Returns object's span if it become completely free.
   Span* ReleaseToSpans(void* object, Span* span, size_t object_size)
@@ -140,8 +282,43 @@ class CentralFreeList {
   // freelist. Returns the number of elements removed.
   int Populate(void** batch, int N) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
-  // Allocate a span from the forwarder.
-  Span* AllocateSpan();
+  // Allocate a span of <pages> from the forwarder.
+  Span* AllocateSpan(Length pages);
+
+  // Returns the length of the next span to allocate.  If the forwarder enables
+  // dynamic span pages, this is the shorter of the alternative lengths while
+  // fewer objects are allocated than such a span holds, so that a size class
+  // used by only a few objects does not leave most of a span unused, and the
+  // longer while many longer spans' worth of objects are, so that a heavily
+  // used size class populates (and returns) spans less often.  Otherwise, or
+  // if the size class has no alternative lengths, it is pages_per_span_.
+  Length ChooseSpanPages();
+
+  // Returns the number of objects <span> holds.
+  size_t ObjectsPerSpan(const Span* span) const {
+    const Length pages = span->num_pages();
+    if (ABSL_PREDICT_TRUE(pages == pages_per_span_)) return objects_per_span_;
+    return pages.in_bytes() / object_size_;
+  }
+
+  // Holds <span>, which has become completely free, for reuse.  Returns false
+  // if it should be returned to the forwarder instead.
+  bool TryHoldEmptySpan(Span* span) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Returns the oldest <n> held empty spans to the forwarder.
+  void ReleaseEmptySpans(size_t n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Adds <span> to the nonempty_[index] list (or to the nonempty_ list, for
+  // small-but-slow).  Spans on low-occupancy hugepages go behind the others on
+  // the list, so that objects are allocated from spans on fuller hugepages
+  // first and the emptier hugepages may drain completely.
+  void AddNonEmptySpan(Span* span, uint8_t index)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Moves <span>, on a nonempty_ list, to the front of it, so that objects are
+  // allocated from it before the other spans on the list.  Spans on
+  // low-occupancy hugepages stay behind the others.
+  void MoveToFront(Span* span) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // Parses nonempty_ lists and returns span from the list with the lowest
   // possible index.
@@ -184,27 +361,42 @@ class CentralFreeList {
   // is higher than that.
   size_t first_nonempty_index_;
   Length pages_per_span_;
-
-  size_t num_spans() const {
-    size_t requested = num_spans_requested_.value();
-    size_t returned = num_spans_returned_.value();
-    if (requested < returned) return 0;
-    return (requested - returned);
-  }
-
-  void RecordSpanAllocated() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
-    counter_.LossyAdd(objects_per_span_);
+  // The alternative span lengths of ChooseSpanPages (both pages_per_span_ if
+  // there are none), immutable after Init().
+  Length short_span_pages_;
+  Length long_span_pages_;
+  size_t short_span_objects_ = 0;
+  size_t long_span_objects_ = 0;
+  // Longer spans are only allocated while at least this many of them would be
+  // in use, so that at most a small fraction of their objects go unused.
+  static constexpr size_t kMinLongSpansInUse = 8;
+
+  void RecordSpanAllocated(const Span* span)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    const size_t objects = ObjectsPerSpan(span);
+    counter_.LossyAdd(objects);
+    span_objects_.LossyAdd(objects);
+    span_pages_.LossyAdd(span->num_pages().raw_num());
     num_spans_requested_.LossyAdd(1);
   }
 
-  void RecordMultiSpansDeallocated(size_t num_spans_returned)
+  void RecordMultiSpansDeallocated(absl::Span<Span* const> spans)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
-    counter_.LossyAdd(-num_spans_returned * objects_per_span_);
-    num_spans_returned_.LossyAdd(num_spans_returned);
+    int64_t objects = 0;
+    int64_t pages = 0;
+    for (const Span* span : spans) {
+      objects += ObjectsPerSpan(span);
+      pages += span->num_pages().raw_num();
+    }
+    counter_.LossyAdd(-objects);
+    span_objects_.LossyAdd(-objects);
+    span_pages_.LossyAdd(-pages);
+    num_spans_returned_.LossyAdd(spans.size());
   }
 
   void UpdateObjectCounts(int num) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
     counter_.LossyAdd(num);
+    allocated_.LossyAdd(-num);
   }
 
   // The followings are kept as a StatsCounter so that they can read without
@@ -214,9 +406,21 @@ class CentralFreeList {
 
   // Num free objects in cache entry
   StatsCounter counter_;
+  // Num objects handed out by RemoveRange and friends, net of InsertRange.
+  StatsCounter allocated_;
 
   StatsCounter num_spans_requested_;
   StatsCounter num_spans_returned_;
+  // The objects and pages of the spans allocated and not yet returned, which
+  // may differ in length.
+  StatsCounter span_objects_;
+  StatsCounter span_pages_;
+
+  // See SpanStats.
+  StatsCounter num_low_occupancy_deferrals_;
+  StatsCounter num_low_occupancy_spans_returned_;
+  StatsCounter num_empty_span_reuses_;
+  StatsCounter num_prepopulated_spans_;
 
   // Records histogram of span utilization.
   //
@@ -235,8 +439,8 @@ class CentralFreeList {
   // As the actual value of objects_per_span_ is not known at compile time, we
   // use maximum value that it can be to initialize this hashmap, and
   // kSpanUtilBucketCapacity determines this value. We also check during Init
-  // that absl::bit_width(objects_per_span_) is indeed less than or equal to
-  // kSpanUtilBucketCapacity.
+  // that absl::bit_width() of the objects of the longest span is indeed less
+  // than or equal to kSpanUtilBucketCapacity.
   //
   // We disable collection of histogram stats for TCMalloc small-but-slow due to
   // performance issues. See b/227362263.
@@ -257,6 +461,24 @@ class CentralFreeList {
   HintedTrackerLists<Span, kNumLists> nonempty_ ABSL_GUARDED_BY(lock_);
 #endif
   bool use_all_buckets_for_few_object_spans_;
+  // Recorded in each span allocated by Populate().
+  uint8_t shard_ = 0;
+
+  // Recently emptied spans, oldest first.  The first num_aged_empty_spans_ of
+  // them were already held at the last PlunderEmptySpans().
+  Span* empty_spans_[kMaxEmptySpans] ABSL_GUARDED_BY(lock_) = {};
+  uint8_t num_empty_spans_ ABSL_GUARDED_BY(lock_) = 0;
+  uint8_t num_aged_empty_spans_ ABSL_GUARDED_BY(lock_) = 0;
+  // Number of empty spans that may be held (immutable after Init()).
+  uint8_t max_empty_spans_ = 0;
+
+  // Spans with objects on their remote free lists, each recorded by the
+  // thread that pushed the first of them.  A span is recorded at most once,
+  // and its slot is cleared before the list is drained.  Threads that find no
+  // free slot drain the list themselves.
+  static constexpr size_t kMaxRemoteFreeSpans = 32;
+  std::atomic<Span*> remote_free_spans_[kMaxRemoteFreeSpans] = {};
+  std::atomic<int> num_remote_free_spans_{0};
 
   ABSL_ATTRIBUTE_NO_UNIQUE_ADDRESS Forwarder forwarder_;
 };
@@ -271,22 +493,60 @@ inline void CentralFreeList<Forwarder>::Init(
   pages_per_span_ = forwarder_.class_to_pages(size_class);
   objects_per_span_ =
       pages_per_span_.in_bytes() / (object_size_ ? object_size_ : 1);
+
+  // Spans half and twice as long are the alternatives, where they are valid
+  // for the size class: they must be bitmap-managed (see
+  // Span::IsValidSizeClass), hold more than one object (single-object spans
+  // bypass the nonempty_ lists), and, if densely accessed, not be so long
+  // that the HugePageAwareAllocator would donate their slack (see
+  // HugePageAwareAllocator::IsValidSizeClass).  The page allocators see them
+  // with the density of the size class's own spans.
+  auto valid_span_pages = [&](Length pages) {
+    if (pages == Length(0) || object_size_ == 0) return false;
+    const size_t objects = pages.in_bytes() / object_size_;
+    return Span::IsValidSizeClass(object_size_, pages.raw_num()) &&
+           objects > 1 && objects_per_span_ > 1 &&
+           absl::bit_width(objects) <= kSpanUtilBucketCapacity &&
+           (objects <= kFewObjectsAllocMaxLimit ||
+            pages <= kPagesPerHugePage / 2);
+  };
+  short_span_pages_ = long_span_pages_ = pages_per_span_;
+  if (valid_span_pages(pages_per_span_ / 2)) {
+    short_span_pages_ = pages_per_span_ / 2;
+  }
+  if (valid_span_pages(pages_per_span_ * 2)) {
+    long_span_pages_ = pages_per_span_ * 2;
+  }
+  short_span_objects_ =
+      short_span_pages_.in_bytes() / (object_size_ ? object_size_ : 1);
+  long_span_objects_ =
+      long_span_pages_.in_bytes() / (object_size_ ? object_size_ : 1);
+
   use_all_buckets_for_few_object_spans_ =
       use_all_buckets_for_few_object_spans &&
       objects_per_span_ <= 2 * kNumLists;
 
   // Records nonempty_ list index associated with the span with
-  // objects_per_span_ number of allocated objects. Refer to the comment in
-  // IndexFor(...) below for a detailed description.
+  // max_objects number of allocated objects. Refer to the comment in
+  // IndexFor(...) below for a detailed description.  The longest spans hold
+  // the most objects, and so may be on the lowest index.
+  const size_t max_objects = long_span_objects_;
   first_nonempty_index_ =
       use_all_buckets_for_few_object_spans_
-          ? (kNumLists + 1 >= objects_per_span_
-                 ? kNumLists + 1 - objects_per_span_
-                 : 0)
+          ? (kNumLists + 1 >= max_objects ? kNumLists + 1 - max_objects : 0)
           : kNumLists -
-                std::min<size_t>(absl::bit_width(objects_per_span_), kNumLists);
-
-  ASSERT(absl::bit_width(objects_per_span_) <= kSpanUtilBucketCapacity);
+                std::min<size_t>(absl::bit_width(max_objects), kNumLists);
+
+  ASSERT(absl::bit_width(max_objects) <= kSpanUtilBucketCapacity);
+
+  // Spans with a single object never reach the nonempty_ lists, and are not
+  // held either.
+  max_empty_spans_ =
+      objects_per_span_ > 1
+          ? std::clamp<size_t>(
+                kMaxEmptySpanBytes / pages_per_span_.in_bytes(), 1,
+                kMaxEmptySpans)
+          : 0;
 }
 
 template <class Forwarder>
@@ -294,13 +554,7 @@ inline Span* CentralFreeList<Forwarder>::ReleaseToSpans(void* object,
                                                         Span* span,
                                                         size_t object_size) {
   if (ABSL_PREDICT_FALSE(span->FreelistEmpty(object_size))) {
-#ifdef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
-    nonempty_.prepend(span);
-#else
-    const uint8_t index = GetFirstNonEmptyIndex();
-    nonempty_.Add(span, index);
-    span->set_nonempty_index(index);
-#endif
+    AddNonEmptySpan(span, GetFirstNonEmptyIndex());
   }
 
 #ifdef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
@@ -338,13 +592,51 @@ inline Span* CentralFreeList<Forwarder>::ReleaseToSpans(void* object,
   const uint8_t cur_index = IndexFor(cur_allocated, cur_bitwidth);
   if (cur_index != prev_index) {
     nonempty_.Remove(span, prev_index);
-    nonempty_.Add(span, cur_index);
-    span->set_nonempty_index(cur_index);
+    AddNonEmptySpan(span, cur_index);
   }
   return nullptr;
 #endif
 }
 
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::AddNonEmptySpan(Span* span,
+                                                        uint8_t index) {
+#ifdef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+  (void)index;
+  if (ABSL_PREDICT_FALSE(span->low_occupancy_hugepage()) &&
+      !nonempty_.empty()) {
+    nonempty_.append(span);
+    num_low_occupancy_deferrals_.LossyAdd(1);
+    return;
+  }
+  nonempty_.prepend(span);
+#else
+  span->set_nonempty_index(index);
+  if (ABSL_PREDICT_FALSE(span->low_occupancy_hugepage()) &&
+      !nonempty_[index].empty()) {
+    nonempty_.AddToBack(span, index);
+    num_low_occupancy_deferrals_.LossyAdd(1);
+    return;
+  }
+  nonempty_.Add(span, index);
+#endif
+}
+
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::MoveToFront(Span* span) {
+  if (ABSL_PREDICT_FALSE(span->low_occupancy_hugepage())) return;
+#ifdef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+  if (nonempty_.first() == span) return;
+  nonempty_.remove(span);
+  nonempty_.prepend(span);
+#else
+  const uint8_t index = span->nonempty_index();
+  if (nonempty_[index].first() == span) return;
+  nonempty_.Remove(span, index);
+  nonempty_.Add(span, index);
+#endif
+}
+
 template <class Forwarder>
 inline Span* CentralFreeList<Forwarder>::FirstNonEmptySpan() {
   // Scan nonempty_ lists in the range [first_nonempty_index_, kNumLists) and
@@ -423,14 +715,29 @@ inline void CentralFreeList<Forwarder>::InsertRange(absl::Span<void*> batch) {
   // First, map objects to spans and prefetch spans outside of our mutex
   // (to reduce critical section size and cache misses).
   forwarder_.MapObjectsToSpans(batch, spans);
+  InsertRange(batch, spans);
+}
 
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::InsertRange(absl::Span<void*> batch,
+                                                    Span** spans) {
+  ASSERT(!batch.empty());
+  ASSERT(batch.size() <= kMaxObjectsToMove);
   if (objects_per_span_ == 1) {
     // If there is only 1 object per span, skip CentralFreeList entirely.
+    allocated_.Add(-static_cast<int64_t>(batch.size()));
     forwarder_.DeallocateSpans(size_class_, objects_per_span_,
                                {spans, batch.size()});
     return;
   }
 
+  if (forwarder_.remote_frees() && !Span::IsNonIntrusive(object_size_)) {
+    InsertRemote(batch, spans);
+    return;
+  }
+
+  // Batches list their objects most recently freed first.
+  Span* hottest = spans[0];
   // Safe to store free spans into freed up space in span array.
   Span** free_spans = spans;
   int free_count = 0;
@@ -440,16 +747,29 @@ inline void CentralFreeList<Forwarder>::InsertRange(absl::Span<void*> batch) {
   {
     // Use local copy of variable to ensure that it is not reloaded.
     size_t object_size = object_size_;
+    const bool hold_empty_spans = forwarder_.empty_span_cache();
     absl::base_internal::SpinLockHolder h(&lock_);
     for (int i = 0; i < batch.size(); ++i) {
       Span* span = ReleaseToSpans(batch[i], spans[i], object_size);
       if (ABSL_PREDICT_FALSE(span)) {
+        if (span == hottest) hottest = nullptr;
+        if (hold_empty_spans && TryHoldEmptySpan(span)) continue;
         free_spans[free_count] = span;
         free_count++;
+        if (span->low_occupancy_hugepage()) {
+          num_low_occupancy_spans_returned_.LossyAdd(1);
+        }
       }
     }
 
-    RecordMultiSpansDeallocated(free_count);
+    // Allocate next from the span whose objects were freed last, among those
+    // as full, while its memory is likely still in cache.  Spans that became
+    // completely free have left the nonempty_ lists.
+    if (hottest != nullptr) {
+      MoveToFront(hottest);
+    }
+
+    RecordMultiSpansDeallocated({free_spans, static_cast<size_t>(free_count)});
     UpdateObjectCounts(batch.size());
   }
 
@@ -460,93 +780,273 @@ inline void CentralFreeList<Forwarder>::InsertRange(absl::Span<void*> batch) {
   }
 }
 
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::InsertRemote(absl::Span<void*> batch,
+                                                     Span** spans) {
+  // Use local copy of variable to ensure that it is not reloaded.
+  const size_t object_size = object_size_;
+  // Spans that could not be recorded for draining.  Each is pushed to empty
+  // at most once, so appears at most once.
+  size_t unrecorded = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    Span* span = spans[i];
+    if (span->RemoteFreePush(batch[i], object_size) &&
+        !AddRemoteFreeSpan(span)) {
+      spans[unrecorded++] = span;
+    }
+  }
+  if (ABSL_PREDICT_TRUE(unrecorded == 0)) return;
+
+  absl::base_internal::SpinLockHolder h(&lock_);
+  DrainRemoteFrees(absl::MakeSpan(spans, unrecorded));
+}
+
+template <class Forwarder>
+inline bool CentralFreeList<Forwarder>::AddRemoteFreeSpan(Span* span) {
+  // Start where other spans are unlikely to, to spread the contention.
+  const size_t start = reinterpret_cast<uintptr_t>(span) / sizeof(Span);
+  for (size_t i = 0; i < kMaxRemoteFreeSpans; ++i) {
+    std::atomic<Span*>& slot =
+        remote_free_spans_[(start + i) % kMaxRemoteFreeSpans];
+    Span* expected = nullptr;
+    if (slot.load(std::memory_order_relaxed) == nullptr &&
+        slot.compare_exchange_strong(expected, span, std::memory_order_release,
+                                     std::memory_order_relaxed)) {
+      num_remote_free_spans_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::DrainRemoteFrees() {
+  if (ABSL_PREDICT_TRUE(
+          num_remote_free_spans_.load(std::memory_order_relaxed) <= 0)) {
+    return;
+  }
+  Span* spans[kMaxRemoteFreeSpans];
+  size_t n = 0;
+  for (std::atomic<Span*>& slot : remote_free_spans_) {
+    if (slot.load(std::memory_order_relaxed) == nullptr) continue;
+    Span* span = slot.exchange(nullptr, std::memory_order_acquire);
+    if (span == nullptr) continue;
+    num_remote_free_spans_.fetch_sub(1, std::memory_order_relaxed);
+    spans[n++] = span;
+  }
+  DrainRemoteFrees(absl::MakeSpan(spans, n));
+}
+
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::DrainRemoteFrees(
+    absl::Span<Span*> spans) ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  // Use local copy of variable to ensure that it is not reloaded.
+  const size_t object_size = object_size_;
+  const bool hold_empty_spans = forwarder_.empty_span_cache();
+  // Safe to store free spans into the drained part of spans.
+  size_t free_count = 0;
+  int released = 0;
+  for (Span* span : spans) {
+    void* object = span->RemoteFreeTake(object_size);
+    while (object != nullptr) {
+      void* next = span->RemoteFreeNext(object, object_size);
+      ++released;
+      // Only the last object of a span can leave it completely free.
+      if (ABSL_PREDICT_FALSE(ReleaseToSpans(object, span, object_size))) {
+        ASSERT(next == nullptr);
+        if (hold_empty_spans && TryHoldEmptySpan(span)) break;
+        spans[free_count++] = span;
+        if (span->low_occupancy_hugepage()) {
+          num_low_occupancy_spans_returned_.LossyAdd(1);
+        }
+      }
+      object = next;
+    }
+  }
+  UpdateObjectCounts(released);
+  if (ABSL_PREDICT_TRUE(free_count == 0)) return;
+
+  RecordMultiSpansDeallocated(spans.first(free_count));
+  // Release central list lock while operating on pageheap.
+  lock_.Unlock();
+  forwarder_.DeallocateSpans(size_class_, objects_per_span_,
+                             spans.first(free_count));
+  lock_.Lock();
+}
+
 template <class Forwarder>
 inline int CentralFreeList<Forwarder>::RemoveRange(void** batch, int N) {
   ASSUME(N > 0);
 
   if (objects_per_span_ == 1) {
     // If there is only 1 object per span, skip CentralFreeList entirely.
-    Span* span = AllocateSpan();
+    Span* span = AllocateSpan(pages_per_span_);
     if (ABSL_PREDICT_FALSE(span == nullptr)) {
       return 0;
     }
+    allocated_.Add(1);
     batch[0] = span->start_address();
     return 1;
   }
 
-  // Use local copy of variable to ensure that it is not reloaded.
-  size_t object_size = object_size_;
+  return RemoveFromSpans(batch, N, /*populate=*/true);
+}
+
+template <class Forwarder>
+inline int CentralFreeList<Forwarder>::TryRemoveRange(void** batch, int N) {
+  ASSUME(N > 0);
+
+  // Single-object spans are never held by the CentralFreeList.
+  if (objects_per_span_ == 1) return 0;
+
+  return RemoveFromSpans(batch, N, /*populate=*/false);
+}
+
+template <class Forwarder>
+inline int CentralFreeList<Forwarder>::RemoveFromSpan(Span* span,
+                                                      void** batch, int N) {
+  ASSUME(N > 0);
+
+  // Single-object spans are never held by the CentralFreeList.
+  if (objects_per_span_ == 1) return 0;
+
+  absl::base_internal::SpinLockHolder h(&lock_);
+  DrainRemoteFrees();
+  // The live object keeps <span> from being freed or held empty, so it is on a
+  // nonempty_ list exactly when it has free objects.
+  ASSERT(span->Allocated() > 0);
+  if (span->FreelistEmpty(object_size_)) return 0;
+  const int result = PopFromSpan(span, batch, N);
+  UpdateObjectCounts(-result);
+  return result;
+}
+
+template <class Forwarder>
+inline int CentralFreeList<Forwarder>::RemoveFromNewSpan(void** batch,
+                                                         int N) {
+  ASSUME(N > 0);
+
+  if (objects_per_span_ == 1) return RemoveRange(batch, N);
+
+  absl::base_internal::SpinLockHolder h(&lock_);
+  const int result = Populate(batch, N);
+  UpdateObjectCounts(-result);
+  return result;
+}
+
+template <class Forwarder>
+template <typename F>
+inline void* CentralFreeList<Forwarder>::LiveObjects(
+    Span* span, F owned, Span::ObjectBitmap* live, size_t* objects) {
+  absl::base_internal::SpinLockHolder h(&lock_);
+  // Objects on the remote free lists are free too.
+  DrainRemoteFrees();
+  if (span->freelist_shard() != shard_ || !owned()) return nullptr;
+  *objects = ObjectsPerSpan(span);
+  return span->LiveObjects(object_size_, *objects, live);
+}
+
+template <class Forwarder>
+inline int CentralFreeList<Forwarder>::RemoveFromSpans(void** batch, int N,
+                                                       bool populate) {
   int result = 0;
   absl::base_internal::SpinLockHolder h(&lock_);
+  DrainRemoteFrees();
 
   do {
     Span* span = FirstNonEmptySpan();
     if (ABSL_PREDICT_FALSE(!span)) {
-      result += Populate(batch + result, N - result);
+      if (populate) {
+        result += Populate(batch + result, N - result);
+      }
       break;
     }
+    result += PopFromSpan(span, batch + result, N - result);
+  } while (result < N);
+  UpdateObjectCounts(-result);
+  return result;
+}
 
+template <class Forwarder>
+inline int CentralFreeList<Forwarder>::PopFromSpan(Span* span, void** batch,
+                                                   int N) {
+  // Use local copy of variable to ensure that it is not reloaded.
+  size_t object_size = object_size_;
 #ifdef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
-    // We do not collect histogram stats for small-but-slow.
-    int here = span->FreelistPopBatch(batch + result, N - result, object_size);
-    ASSERT(here > 0);
-    if (span->FreelistEmpty(object_size)) {
-      nonempty_.remove(span);
-    }
+  // We do not collect histogram stats for small-but-slow.
+  int here = span->FreelistPopBatch(batch, N, object_size);
+  ASSERT(here > 0);
+  if (span->FreelistEmpty(object_size)) {
+    nonempty_.remove(span);
+  }
 #else
-    const uint16_t prev_allocated = span->Allocated();
-    const uint8_t prev_bitwidth = absl::bit_width(prev_allocated);
-    const uint8_t prev_index = span->nonempty_index();
-    int here = span->FreelistPopBatch(batch + result, N - result, object_size);
-    ASSERT(here > 0);
-    // As the objects are being popped from the span, its utilization might
-    // change. So, we remove the stale utilization from the histogram here and
-    // add it again once we pop the objects.
-    const uint16_t cur_allocated = prev_allocated + here;
-    ASSERT(cur_allocated == span->Allocated());
-    const uint8_t cur_bitwidth = absl::bit_width(cur_allocated);
-    if (cur_bitwidth != prev_bitwidth) {
-      RecordSpanUtil(prev_bitwidth, /*increase=*/false);
-      RecordSpanUtil(cur_bitwidth, /*increase=*/true);
-    }
-    if (span->FreelistEmpty(object_size)) {
+  const uint16_t prev_allocated = span->Allocated();
+  const uint8_t prev_bitwidth = absl::bit_width(prev_allocated);
+  const uint8_t prev_index = span->nonempty_index();
+  int here = span->FreelistPopBatch(batch, N, object_size);
+  ASSERT(here > 0);
+  // As the objects are being popped from the span, its utilization might
+  // change. So, we remove the stale utilization from the histogram here and
+  // add it again once we pop the objects.
+  const uint16_t cur_allocated = prev_allocated + here;
+  ASSERT(cur_allocated == span->Allocated());
+  const uint8_t cur_bitwidth = absl::bit_width(cur_allocated);
+  if (cur_bitwidth != prev_bitwidth) {
+    RecordSpanUtil(prev_bitwidth, /*increase=*/false);
+    RecordSpanUtil(cur_bitwidth, /*increase=*/true);
+  }
+  if (span->FreelistEmpty(object_size)) {
+    nonempty_.Remove(span, prev_index);
+  } else {
+    // If span allocation changes so that it must be moved to a different
+    // nonempty_ list, we remove it from the previous list and add it to the
+    // desired list indexed by cur_index.
+    const uint8_t cur_index = IndexFor(cur_allocated, cur_bitwidth);
+    if (cur_index != prev_index) {
       nonempty_.Remove(span, prev_index);
-    } else {
-      // If span allocation changes so that it must be moved to a different
-      // nonempty_ list, we remove it from the previous list and add it to the
-      // desired list indexed by cur_index.
-      const uint8_t cur_index = IndexFor(cur_allocated, cur_bitwidth);
-      if (cur_index != prev_index) {
-        nonempty_.Remove(span, prev_index);
-        nonempty_.Add(span, cur_index);
-        span->set_nonempty_index(cur_index);
-      }
+      AddNonEmptySpan(span, cur_index);
     }
+  }
 #endif
-    result += here;
-  } while (result < N);
-  UpdateObjectCounts(-result);
-  return result;
+  return here;
 }
 
 // Fetch memory from the system and add to the central cache freelist.
 template <class Forwarder>
 inline int CentralFreeList<Forwarder>::Populate(void** batch, int N)
     ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  ScopedCpuTimer cpu_timer(CpuTimePath::kCentralFreeListPopulate);
+  const int64_t probe_start = TCMALLOC_PROBE_START(central_freelist_populate);
+  // Reuse the most recently emptied span, if any.  Its objects are still
+  // counted as free, and it is still registered with our size class.
+  Span* span = nullptr;
+  if (num_empty_spans_ > 0) {
+    span = empty_spans_[--num_empty_spans_];
+    num_aged_empty_spans_ = std::min(num_aged_empty_spans_, num_empty_spans_);
+  }
+  const bool reused = span != nullptr;
+
   // Release central list lock while operating on pageheap
   // Note, this could result in multiple calls to populate each allocating
   // a new span and the pushing those partially full spans onto nonempty.
   lock_.Unlock();
 
-  Span* span = AllocateSpan();
-  if (ABSL_PREDICT_FALSE(span == nullptr)) {
-    return 0;
+  if (!reused) {
+    span = AllocateSpan(ChooseSpanPages());
+    if (ABSL_PREDICT_FALSE(span == nullptr)) {
+      TCMALLOC_PROBE(central_freelist_populate, size_class_, 0,
+                     ProbeLatencyNs(probe_start));
+      return 0;
+    }
   }
 
-  int result = span->BuildFreelist(object_size_, objects_per_span_, batch, N);
+  span->set_freelist_shard(shard_);
+  const size_t objects = ObjectsPerSpan(span);
+  int result = span->BuildFreelist(object_size_, objects, batch, N,
+                                   forwarder_.span_cache_coloring());
   ASSERT(result > 0);
   // This is a cheaper check than using FreelistEmpty().
-  bool span_empty = result == objects_per_span_;
+  bool span_empty = result == objects;
 
   lock_.Lock();
 
@@ -554,7 +1054,7 @@ inline int CentralFreeList<Forwarder>::Populate(void** batch, int N)
   // We do not collect histogram stats for small-but-slow. Moreover, we maintain
   // a single nonempty list to which we prepend the span.
   if (!span_empty) {
-    nonempty_.prepend(span);
+    AddNonEmptySpan(span, 0);
   }
 #else
   // Update the histogram once we populate the span.
@@ -563,43 +1063,131 @@ inline int CentralFreeList<Forwarder>::Populate(void** batch, int N)
   const uint8_t bitwidth = absl::bit_width(allocated);
   RecordSpanUtil(bitwidth, /*increase=*/true);
   if (!span_empty) {
-    const uint8_t index = IndexFor(allocated, bitwidth);
-    nonempty_.Add(span, index);
-    span->set_nonempty_index(index);
+    AddNonEmptySpan(span, IndexFor(allocated, bitwidth));
   }
 #endif
-  RecordSpanAllocated();
+  if (reused) {
+    num_empty_span_reuses_.LossyAdd(1);
+  } else {
+    RecordSpanAllocated(span);
+  }
+  TCMALLOC_PROBE(central_freelist_populate, size_class_, result,
+                 ProbeLatencyNs(probe_start));
   return result;
 }
 
 template <class Forwarder>
-Span* CentralFreeList<Forwarder>::AllocateSpan() {
-  // Use number of objects per span as a proxy for estimating access density of
-  // the span. If number of objects per span is higher than
-  // kFewObjectsAllocMaxLimit threshold, we assume that the span would be
-  // long-lived.
-  const AccessDensityPrediction density =
-      objects_per_span_ > kFewObjectsAllocMaxLimit
-          ? AccessDensityPrediction::kDense
-          : AccessDensityPrediction::kSparse;
+inline bool CentralFreeList<Forwarder>::TryHoldEmptySpan(Span* span) {
+  // Spans on low-occupancy hugepages are returned, so that the hugepage may
+  // drain.
+  if (num_empty_spans_ == max_empty_spans_ || span->low_occupancy_hugepage()) {
+    return false;
+  }
+  empty_spans_[num_empty_spans_++] = span;
+  return true;
+}
+
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::ReleaseEmptySpans(size_t n)
+    ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  ASSERT(n <= num_empty_spans_);
+  if (n == 0) return;
+  Span* spans[kMaxEmptySpans];
+  std::copy_n(empty_spans_, n, spans);
+  std::copy(empty_spans_ + n, empty_spans_ + num_empty_spans_, empty_spans_);
+  num_empty_spans_ -= n;
+  num_aged_empty_spans_ = num_empty_spans_;
+  RecordMultiSpansDeallocated({spans, n});
+
+  // Release central list lock while operating on pageheap.
+  lock_.Unlock();
+  forwarder_.DeallocateSpans(size_class_, objects_per_span_,
+                             absl::MakeSpan(spans, n));
+  lock_.Lock();
+}
 
-  SpanAllocInfo info = {.objects_per_span = objects_per_span_,
-                        .density = density};
-  Span* span = forwarder_.AllocateSpan(size_class_, info, pages_per_span_);
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::PlunderEmptySpans() {
+  absl::base_internal::SpinLockHolder h(&lock_);
+  DrainRemoteFrees();
+  const size_t aged = num_aged_empty_spans_;
+  // Whatever survives this pass is returned by the next one.
+  num_aged_empty_spans_ = num_empty_spans_;
+  ReleaseEmptySpans(aged);
+}
+
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::FlushEmptySpans() {
+  absl::base_internal::SpinLockHolder h(&lock_);
+  DrainRemoteFrees();
+  ReleaseEmptySpans(num_empty_spans_);
+}
+
+template <class Forwarder>
+inline bool CentralFreeList<Forwarder>::Prepopulate(size_t min_objects) {
+  {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    if (length() >= min_objects || num_empty_spans_ > 0 ||
+        max_empty_spans_ == 0) {
+      return false;
+    }
+  }
+
+  Span* span = AllocateSpan(pages_per_span_);
+  if (ABSL_PREDICT_FALSE(span == nullptr)) return false;
+
+  {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    // Spans may have been emptied while we were allocating.
+    if (num_empty_spans_ < max_empty_spans_) {
+      empty_spans_[num_empty_spans_++] = span;
+      RecordSpanAllocated(span);
+      num_prepopulated_spans_.LossyAdd(1);
+      return true;
+    }
+  }
+  forwarder_.DeallocateSpans(size_class_, objects_per_span_, {&span, 1});
+  return false;
+}
+
+template <class Forwarder>
+Span* CentralFreeList<Forwarder>::AllocateSpan(Length pages) {
+  // Spans of every length are described by the size class's own spans, so
+  // that they are allocated and deallocated alike.
+  SpanAllocInfo info = {
+      .objects_per_span = objects_per_span_,
+      .density = PredictSpanDensity(size_class_, objects_per_span_)};
+  Span* span = forwarder_.AllocateSpan(size_class_, info, pages);
   if (ABSL_PREDICT_FALSE(span == nullptr)) {
     Log(kLog, __FILE__, __LINE__, "tcmalloc: allocation failed",
-        pages_per_span_.in_bytes());
+        pages.in_bytes());
   }
   return span;
 }
 
+template <class Forwarder>
+inline Length CentralFreeList<Forwarder>::ChooseSpanPages() {
+  if (ABSL_PREDICT_TRUE(short_span_pages_ == long_span_pages_) ||
+      !forwarder_.dynamic_span_pages()) {
+    return pages_per_span_;
+  }
+  const size_t in_use = allocated();
+  if (in_use < short_span_objects_) return short_span_pages_;
+  if (in_use >= kMinLongSpansInUse * long_span_objects_) {
+    return long_span_pages_;
+  }
+  return pages_per_span_;
+}
+
 template <class Forwarder>
 inline size_t CentralFreeList<Forwarder>::OverheadBytes() const {
   if (ABSL_PREDICT_FALSE(object_size_ == 0)) {
     return 0;
   }
-  const size_t overhead_per_span = pages_per_span_.in_bytes() % object_size_;
-  return num_spans() * overhead_per_span;
+  const int64_t bytes =
+      Length(std::max<int64_t>(span_pages_.value(), 0)).in_bytes() -
+      std::max<int64_t>(span_objects_.value(), 0) * object_size_;
+  return std::max<int64_t>(bytes, 0);
 }
 
 template <class Forwarder>
@@ -610,7 +1198,16 @@ inline SpanStats CentralFreeList<Forwarder>::GetSpanStats() const {
   }
   stats.num_spans_requested = static_cast<size_t>(num_spans_requested_.value());
   stats.num_spans_returned = static_cast<size_t>(num_spans_returned_.value());
-  stats.obj_capacity = stats.num_live_spans() * objects_per_span_;
+  stats.obj_capacity =
+      static_cast<size_t>(std::max<int64_t>(span_objects_.value(), 0));
+  stats.num_low_occupancy_deferrals =
+      static_cast<size_t>(num_low_occupancy_deferrals_.value());
+  stats.num_low_occupancy_spans_returned =
+      static_cast<size_t>(num_low_occupancy_spans_returned_.value());
+  stats.num_empty_span_reuses =
+      static_cast<size_t>(num_empty_span_reuses_.value());
+  stats.num_prepopulated_spans =
+      static_cast<size_t>(num_prepopulated_spans_.value());
   return stats;
 }
 
@@ -645,10 +1242,293 @@ inline void CentralFreeList<Forwarder>::PrintSpanUtilStatsInPbtxt(
   }
 }
 
+
+// Forwards a shard's calls to the forwarder of the owning
+// ShardedCentralFreeList, so that all shards share one forwarder.
+template <typename Forwarder>
+class ShardForwarder {
+ public:
+  void set_parent(Forwarder* parent) { parent_ = parent; }
+
+  size_t class_to_size(int size_class) {
+    return parent_->class_to_size(size_class);
+  }
+  Length class_to_pages(int size_class) {
+    return parent_->class_to_pages(size_class);
+  }
+  void MapObjectsToSpans(absl::Span<void*> batch, Span** spans) {
+    parent_->MapObjectsToSpans(batch, spans);
+  }
+  Span* AllocateSpan(int size_class, SpanAllocInfo span_alloc_info,
+                     Length pages_per_span) {
+    return parent_->AllocateSpan(size_class, span_alloc_info, pages_per_span);
+  }
+  void DeallocateSpans(int size_class, size_t objects_per_span,
+                       absl::Span<Span*> free_spans) {
+    parent_->DeallocateSpans(size_class, objects_per_span, free_spans);
+  }
+  bool span_cache_coloring() { return parent_->span_cache_coloring(); }
+  bool empty_span_cache() { return parent_->empty_span_cache(); }
+  bool remote_frees() { return parent_->remote_frees(); }
+  bool dynamic_span_pages() { return parent_->dynamic_span_pages(); }
+
+ private:
+  Forwarder* parent_ = nullptr;
+};
+
+// Maps the current CPU to its L3 cache domain.
+class L3ShardLayout {
+ public:
+  static unsigned NumShards() { return CacheTopology::Instance().l3_count(); }
+  static unsigned CurrentShard() {
+    const int cpu = subtle::percpu::GetCurrentCpu();
+    if (ABSL_PREDICT_FALSE(cpu < 0)) return 0;
+    return CacheTopology::Instance().GetL3FromCpuId(cpu);
+  }
+};
+
+// A CentralFreeList split into up to kMaxShards independent shards, one per
+// cache domain reported by ShardLayout.  Each shard has its own lock and owns
+// the spans it allocates: objects are always returned to the shard that owns
+// their span, while allocations are served from the current CPU's shard.  Only
+// when that shard holds no free objects do we steal from other shards, and
+// only when every shard is empty do we allocate a new span.
+template <typename ForwarderT, typename ShardLayout, size_t kMaxShards>
+class ShardedCentralFreeList {
+  static_assert(kMaxShards > 0 && kMaxShards <= 256);
+
+ public:
+  using Forwarder = ForwarderT;
+
+  constexpr ShardedCentralFreeList() = default;
+
+  ShardedCentralFreeList(const ShardedCentralFreeList&) = delete;
+  ShardedCentralFreeList& operator=(const ShardedCentralFreeList&) = delete;
+
+  void Init(size_t size_class, bool use_all_buckets_for_few_object_spans) {
+    size_class_ = size_class;
+    num_shards_ = std::clamp<size_t>(ShardLayout::NumShards(), 1, kMaxShards);
+    for (size_t i = 0; i < num_shards_; ++i) {
+      shards_[i].forwarder().set_parent(&forwarder_);
+      shards_[i].set_shard(i);
+      shards_[i].Init(size_class, use_all_buckets_for_few_object_spans);
+    }
+  }
+
+  // Insert batch into the owning shards of its objects.
+  // REQUIRES: batch.size() > 0 && batch.size() <= kMaxObjectsToMove.
+  void InsertRange(absl::Span<void*> batch) {
+    CHECK_CONDITION(!batch.empty());
+    CHECK_CONDITION(batch.size() <= kMaxObjectsToMove);
+    Span* spans[kMaxObjectsToMove];
+    forwarder_.MapObjectsToSpans(batch, spans);
+    if (num_shards_ == 1) {
+      shards_[0].InsertRange(batch, spans);
+      return;
+    }
+
+    // Partition the batch by owning shard, one shard at a time.  Batches
+    // rarely span more than a couple of shards.
+    size_t begin = 0;
+    while (begin < batch.size()) {
+      const uint8_t shard = spans[begin]->freelist_shard();
+      size_t end = begin + 1;
+      for (size_t i = begin + 1; i < batch.size(); ++i) {
+        if (spans[i]->freelist_shard() == shard) {
+          std::swap(batch[i], batch[end]);
+          std::swap(spans[i], spans[end]);
+          ++end;
+        }
+      }
+      ASSERT(shard < num_shards_);
+      shards_[shard].InsertRange(batch.subspan(begin, end - begin),
+                                 spans + begin);
+      begin = end;
+    }
+  }
+
+  // Fill a prefix of batch[0..N-1] with up to N elements, preferring the
+  // current CPU's shard.  Return the number of elements removed.
+  ABSL_MUST_USE_RESULT int RemoveRange(void** batch, int N) {
+    if (num_shards_ == 1) return shards_[0].RemoveRange(batch, N);
+
+    const size_t home = ShardLayout::CurrentShard() % num_shards_;
+    int got = shards_[home].TryRemoveRange(batch, N);
+    if (got > 0) return got;
+
+    for (size_t i = 1; i < num_shards_; ++i) {
+      auto& shard = shards_[(home + i) % num_shards_];
+      if (shard.length() == 0) continue;
+      got = shard.TryRemoveRange(batch, N);
+      if (got > 0) {
+        steals_.LossyAdd(1);
+        return got;
+      }
+    }
+
+    return shards_[home].RemoveRange(batch, N);
+  }
+
+  // Like RemoveRange, but only takes objects from <span>, which must hold a
+  // live object of this size class.
+  ABSL_MUST_USE_RESULT int RemoveFromSpan(Span* span, void** batch, int N) {
+    ASSERT(span->freelist_shard() < num_shards_);
+    return shards_[span->freelist_shard()].RemoveFromSpan(span, batch, N);
+  }
+
+  // Like CentralFreeList::LiveObjects, under the lock of the shard owning
+  // <span>.
+  template <typename F>
+  void* LiveObjects(Span* span, F owned, Span::ObjectBitmap* live,
+                    size_t* objects) {
+    const uint8_t shard = span->freelist_shard();
+    if (shard >= num_shards_) return nullptr;
+    return shards_[shard].LiveObjects(span, owned, live, objects);
+  }
+
+  size_t objects_per_span() const { return shards_[0].objects_per_span(); }
+
+  // Returns the number of free objects in cache.
+  size_t length() const {
+    size_t total = 0;
+    for (size_t i = 0; i < num_shards_; ++i) total += shards_[i].length();
+    return total;
+  }
+
+  size_t allocated() const {
+    size_t total = 0;
+    for (size_t i = 0; i < num_shards_; ++i) total += shards_[i].allocated();
+    return total;
+  }
+
+  // Returns the number of free objects held by the given shard.
+  size_t shard_length(size_t shard) const { return shards_[shard].length(); }
+
+  size_t num_shards() const { return num_shards_; }
+
+  // Returns the number of RemoveRange calls served from another CPU's shard.
+  size_t steals() const { return steals_.value(); }
+
+  size_t OverheadBytes() const {
+    size_t total = 0;
+    for (size_t i = 0; i < num_shards_; ++i) total += shards_[i].OverheadBytes();
+    return total;
+  }
+
+  size_t NumSpansInList(int n) {
+    size_t total = 0;
+    for (size_t i = 0; i < num_shards_; ++i) {
+      total += shards_[i].NumSpansInList(n);
+    }
+    return total;
+  }
+
+  SpanStats GetSpanStats() const {
+    SpanStats stats;
+    for (size_t i = 0; i < num_shards_; ++i) {
+      const SpanStats shard_stats = shards_[i].GetSpanStats();
+      stats.num_spans_requested += shard_stats.num_spans_requested;
+      stats.num_spans_returned += shard_stats.num_spans_returned;
+      stats.obj_capacity += shard_stats.obj_capacity;
+      stats.num_low_occupancy_deferrals +=
+          shard_stats.num_low_occupancy_deferrals;
+      stats.num_low_occupancy_spans_returned +=
+          shard_stats.num_low_occupancy_spans_returned;
+      stats.num_empty_span_reuses += shard_stats.num_empty_span_reuses;
+      stats.num_prepopulated_spans += shard_stats.num_prepopulated_spans;
+    }
+    return stats;
+  }
+
+  void PlunderEmptySpans() {
+    for (size_t i = 0; i < num_shards_; ++i) shards_[i].PlunderEmptySpans();
+  }
+
+  void FlushEmptySpans() {
+    for (size_t i = 0; i < num_shards_; ++i) shards_[i].FlushEmptySpans();
+  }
+
+  // Prepopulates each shard.  Returns whether any span was added.
+  bool Prepopulate(size_t min_objects) {
+    bool added = false;
+    for (size_t i = 0; i < num_shards_; ++i) {
+      added |= shards_[i].Prepopulate(min_objects);
+    }
+    return added;
+  }
+
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    for (size_t i = 0; i < num_shards_; ++i) shards_[i].AcquireInternalLocks();
+  }
+
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    for (size_t i = num_shards_; i > 0; --i) {
+      shards_[i - 1].ReleaseInternalLocks();
+    }
+  }
+
+  size_t num_empty_spans() {
+    size_t total = 0;
+    for (size_t i = 0; i < num_shards_; ++i) {
+      total += shards_[i].num_empty_spans();
+    }
+    return total;
+  }
+
+  size_t NumSpansWith(uint16_t bitwidth) const {
+    size_t total = 0;
+    for (size_t i = 0; i < num_shards_; ++i) {
+      total += shards_[i].NumSpansWith(bitwidth);
+    }
+    return total;
+  }
+
+  void PrintSpanUtilStats(Printer* out) {
+    out->printf("class %3d [ %8zu bytes ] : ", size_class_,
+                forwarder_.class_to_size(size_class_));
+    for (size_t i = 1; i <= kSpanUtilBucketCapacity; ++i) {
+      out->printf("%6zu < %zu", NumSpansWith(i), 1 << i);
+      if (i < kSpanUtilBucketCapacity) {
+        out->printf(",");
+      }
+    }
+    out->printf("\n");
+  }
+
+  void PrintSpanUtilStatsInPbtxt(PbtxtRegion* region) const {
+    for (size_t i = 1; i <= kSpanUtilBucketCapacity; ++i) {
+      PbtxtRegion histogram = region->CreateSubRegion("span_util_histogram");
+      histogram.PrintI64("lower_bound", 1 << (i - 1));
+      histogram.PrintI64("upper_bound", 1 << i);
+      histogram.PrintI64("value", NumSpansWith(i));
+    }
+  }
+
+  Forwarder& forwarder() { return forwarder_; }
+
+ private:
+  // Matches CentralFreeList's histogram.
+  static constexpr size_t kSpanUtilBucketCapacity = 16;
+
+  ABSL_ATTRIBUTE_NO_UNIQUE_ADDRESS Forwarder forwarder_;
+  size_t size_class_ = 0;
+  size_t num_shards_ = 1;
+  StatsCounter steals_;
+  CentralFreeList<ShardForwarder<Forwarder>> shards_[kMaxShards];
+};
+
 }  // namespace central_freelist_internal
 
+#ifdef TCMALLOC_INTERNAL_SHARDED_CENTRAL_FREELIST
+// Shard each size class's central freelist per L3 cache domain.
+inline constexpr size_t kMaxCentralFreeListShards = 8;
+using CentralFreeList = central_freelist_internal::ShardedCentralFreeList<
+    central_freelist_internal::StaticForwarder,
+    central_freelist_internal::L3ShardLayout, kMaxCentralFreeListShards>;
+#else
 using CentralFreeList = central_freelist_internal::CentralFreeList<
     central_freelist_internal::StaticForwarder>;
+#endif
 
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -21,6 +21,8 @@
 #include "absl/random/random.h"
 #include "benchmark/benchmark.h"
 #include "tcmalloc/central_freelist.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/tcmalloc_policy.h"
 
@@ -130,21 +132,34 @@ BENCHMARK(BM_MixAndReturn)
 // single object spans) spans are never allocated or freed during the
 // benchmark run. This evaluates the performance of just the span handling
 // code, and avoids timing the pageheap code.
+//
+// With the second argument set, no objects are held back and the central
+// freelist holds on to emptied spans instead: each iteration empties and
+// repopulates a single span, which is reused without touching the pageheap.
 void BM_SpanReuse(benchmark::State& state) {
   size_t object_size = state.range(0);
+  const bool empty_span_cache = state.range(1) != 0;
   size_t size_class = tc_globals.sizemap().SizeClass(CppPolicy(), object_size);
   int batch_size = tc_globals.sizemap().num_objects_to_move(size_class);
   int num_objects = 64 * 1024 * 1024 / object_size;
-  const int num_batches = num_objects / batch_size;
+  if (empty_span_cache) {
+    num_objects = tc_globals.sizemap().class_to_pages(size_class) * kPageSize /
+                  tc_globals.sizemap().class_to_size(size_class);
+  }
+  const int num_batches = std::max(num_objects / batch_size, 1);
+  const bool prev_empty_span_cache =
+      Parameters::central_freelist_empty_span_cache();
+  Parameters::set_central_freelist_empty_span_cache(empty_span_cache);
   CentralFreeList cfl;
   // Initialize the span to contain the appropriate size of object.
   cfl.Init(size_class, /*use_all_buckets_for_few_object_spans=*/false);
 
   // Array used to hold onto half of the objects
-  std::vector<void*> held_objects(2 * num_objects);
+  const int num_held = empty_span_cache ? 0 : 2 * num_objects;
+  std::vector<void*> held_objects(num_held);
   // Request twice the objects we need
-  for (int index = 0; index < 2 * num_objects;) {
-    int count = std::min(batch_size, 2 * num_objects - index);
+  for (int index = 0; index < num_held;) {
+    int count = std::min(batch_size, num_held - index);
     int got = cfl.RemoveRange(&held_objects[index], count);
     index += got;
   }
@@ -152,7 +167,7 @@ void BM_SpanReuse(benchmark::State& state) {
   // Return half of the objects. This will stop the spans from being
   // returned to the pageheap. So future operations will not touch the
   // pageheap.
-  for (int index = 0; index < 2 * num_objects; index += 2) {
+  for (int index = 0; index < num_held; index += 2) {
     cfl.InsertRange({&held_objects[index], 1});
   }
   // Allocate an array large enough to hold 64 MiB of objects.
@@ -185,15 +200,17 @@ void BM_SpanReuse(benchmark::State& state) {
   state.SetItemsProcessed(items_processed);
 
   // Return the other half of the objects.
-  for (int index = 1; index < 2 * num_objects; index += 2) {
+  for (int index = 1; index < num_held; index += 2) {
     cfl.InsertRange({&held_objects[index], 1});
   }
+  cfl.FlushEmptySpans();
+  Parameters::set_central_freelist_empty_span_cache(prev_empty_span_cache);
 }
 // Want to avoid benchmarking spans where there is a single object per span.
 BENCHMARK(BM_SpanReuse)
-    ->DenseRange(8, 64, 16)
-    ->DenseRange(64, 1024, 64)
-    ->DenseRange(1024, 4096, 512);
+    ->ArgsProduct({benchmark::CreateDenseRange(8, 64, 16), {0, 1}})
+    ->ArgsProduct({benchmark::CreateDenseRange(64, 1024, 64), {0, 1}})
+    ->ArgsProduct({benchmark::CreateDenseRange(1024, 4096, 512), {0, 1}});
 
 }  // namespace
 }  // namespace tcmalloc_internal
@@ -103,8 +103,9 @@ TEST_P(StaticForwarderTest, Simple) {
   ASSERT_NE(span, nullptr);
 
   absl::FixedArray<void*> batch(objects_per_span_);
-  size_t allocated = span->BuildFreelist(object_size_, objects_per_span_,
-                                         &batch[0], objects_per_span_);
+  size_t allocated =
+      span->BuildFreelist(object_size_, objects_per_span_, &batch[0],
+                          objects_per_span_, /*color=*/false);
   ASSERT_EQ(allocated, objects_per_span_);
 
   EXPECT_EQ(size_class_, tc_globals.pagemap().sizeclass(span->first_page()));
@@ -204,7 +205,8 @@ class StaticForwarderEnvironment {
     d->span = span;
 
     size_t allocated = span->BuildFreelist(object_size_, objects_per_span_,
-                                           d->batch, batch_size_);
+                                           d->batch, batch_size_,
+                                           /*color=*/false);
     EXPECT_LE(allocated, objects_per_span_);
 
     EXPECT_EQ(size_class_, tc_globals.pagemap().sizeclass(span->first_page()));
@@ -324,6 +326,28 @@ INSTANTIATE_TEST_SUITE_P(
                                      AccessDensityPrediction::kDense),
                      testing::Range(size_t(1), kNumClasses)));
 
+TEST(PredictSpanDensityTest, ObjectCountAndAccessHint) {
+  EXPECT_EQ(PredictSpanDensity(1, 1), AccessDensityPrediction::kSparse);
+  EXPECT_EQ(PredictSpanDensity(1, kFewObjectsAllocMaxLimit),
+            AccessDensityPrediction::kSparse);
+  EXPECT_EQ(PredictSpanDensity(1, kFewObjectsAllocMaxLimit + 1),
+            AccessDensityPrediction::kDense);
+  // Spans of long-lived objects are kept with the dense ones.
+  EXPECT_EQ(PredictSpanDensity(1, 1, /*long_lived=*/true),
+            AccessDensityPrediction::kDense);
+
+  if (!kHasExpandedClasses) {
+    GTEST_SKIP() << "Skipping cold size classes without expanded classes";
+  }
+  // Cold spans are sparse regardless of how many objects they hold.
+  EXPECT_EQ(PredictSpanDensity(kExpandedClassesStart + 1,
+                               kFewObjectsAllocMaxLimit + 1),
+            AccessDensityPrediction::kSparse);
+  EXPECT_EQ(PredictSpanDensity(kExpandedClassesStart + 1, 1,
+                               /*long_lived=*/true),
+            AccessDensityPrediction::kSparse);
+}
+
 }  // namespace central_freelist_internal
 
 namespace {
@@ -343,6 +367,8 @@ TEST_P(CentralFreeListTest, IsolatedSmoke) {
   int allocated = e.central_freelist().RemoveRange(&batch[0], e.batch_size());
   ASSERT_GT(allocated, 0);
   EXPECT_LE(allocated, e.batch_size());
+  // Single-object spans bypass the freelist but are still counted.
+  EXPECT_EQ(e.central_freelist().allocated(), allocated);
 
   // We should observe span's utilization captured in the histogram. The number
   // of spans in rest of the buckets should be zero.
@@ -370,6 +396,7 @@ TEST_P(CentralFreeListTest, IsolatedSmoke) {
   }
 
   e.central_freelist().InsertRange(absl::MakeSpan(&batch[0], allocated));
+  EXPECT_EQ(e.central_freelist().allocated(), 0);
   // Skip the check for objects_per_span = 1 since such spans skip most of the
   // central freelist's logic.
   if (e.objects_per_span() != 1) {
@@ -700,6 +727,158 @@ TEST_P(CentralFreeListTest, SpanPriority) {
   }
 }
 
+TEST_P(CentralFreeListTest, LowOccupancyHugepageSpansDeferred) {
+  TypeParam e(std::get<0>(GetParam()).size, std::get<0>(GetParam()).pages,
+              std::get<0>(GetParam()).num_to_move, std::get<1>(GetParam()));
+  const int objects_per_span = e.objects_per_span();
+  if (objects_per_span < 2) return;
+
+  // The first span is on a low-occupancy hugepage, the second is not.
+  bool low_occupancy = true;
+  EXPECT_CALL(e.forwarder(), AllocateSpan)
+      .Times(2)
+      .WillRepeatedly([&](int size_class, SpanAllocInfo span_alloc_info,
+                          Length pages_per_span) {
+        Span* span = e.forwarder().FakeStaticForwarder::AllocateSpan(
+            size_class, span_alloc_info, pages_per_span);
+        span->set_low_occupancy_hugepage(std::exchange(low_occupancy, false));
+        return span;
+      });
+
+  constexpr int kNumSpans = 2;
+  absl::FixedArray<std::vector<void*>> objects(kNumSpans);
+  void* batch[kMaxObjectsToMove];
+  for (int span = 0; span < kNumSpans; ++span) {
+    while (objects[span].size() < objects_per_span) {
+      const size_t n = objects_per_span - objects[span].size();
+      int got =
+          e.central_freelist().RemoveRange(batch, std::min(n, e.batch_size()));
+      ASSERT_GT(got, 0);
+      objects[span].insert(objects[span].end(), batch, batch + got);
+    }
+  }
+
+  // Free one object of each span, the dense one first.  Both spans land on the
+  // same nonempty_ list, where the sparse one goes behind the dense one.
+  void* freed[kNumSpans];
+  for (int span = kNumSpans - 1; span >= 0; --span) {
+    freed[span] = objects[span].back();
+    objects[span].pop_back();
+    e.central_freelist().InsertRange({&freed[span], 1});
+  }
+  EXPECT_EQ(e.central_freelist().GetSpanStats().num_low_occupancy_deferrals,
+            1);
+
+  // Without the hint, this would have come from the first span.
+  ASSERT_EQ(e.central_freelist().RemoveRange(batch, 1), 1);
+  EXPECT_EQ(batch[0], freed[1]);
+  objects[1].push_back(batch[0]);
+
+  for (int span = 0; span < kNumSpans; ++span) {
+    for (void* ptr : objects[span]) {
+      e.central_freelist().InsertRange({&ptr, 1});
+    }
+  }
+  SpanStats stats = e.central_freelist().GetSpanStats();
+  EXPECT_EQ(stats.num_spans_returned, kNumSpans);
+  EXPECT_EQ(stats.num_low_occupancy_spans_returned, 1);
+}
+
+TEST_P(CentralFreeListTest, EmptySpansHeldForReuse) {
+  TypeParam e(std::get<0>(GetParam()).size, std::get<0>(GetParam()).pages,
+              std::get<0>(GetParam()).num_to_move, std::get<1>(GetParam()));
+  const int objects_per_span = e.objects_per_span();
+  if (objects_per_span < 2) return;
+  e.forwarder().set_empty_span_cache(true);
+
+  auto fetch_span = [&](std::vector<void*>& objects) {
+    void* batch[kMaxObjectsToMove];
+    while (objects.size() < objects_per_span) {
+      const size_t n = objects_per_span - objects.size();
+      int got =
+          e.central_freelist().RemoveRange(batch, std::min(n, e.batch_size()));
+      ASSERT_GT(got, 0);
+      objects.insert(objects.end(), batch, batch + got);
+    }
+  };
+  auto free_span = [&](std::vector<void*>& objects) {
+    for (void* ptr : objects) {
+      e.central_freelist().InsertRange({&ptr, 1});
+    }
+    objects.clear();
+  };
+
+  // Only the first span comes from the forwarder; emptying it keeps it held.
+  EXPECT_CALL(e.forwarder(), AllocateSpan).Times(1);
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(0);
+  std::vector<void*> objects;
+  fetch_span(objects);
+  free_span(objects);
+  EXPECT_EQ(e.central_freelist().num_empty_spans(), 1);
+  EXPECT_EQ(e.central_freelist().length(), objects_per_span);
+
+  fetch_span(objects);
+  EXPECT_EQ(e.central_freelist().num_empty_spans(), 0);
+  EXPECT_EQ(e.central_freelist().GetSpanStats().num_empty_span_reuses, 1);
+  EXPECT_EQ(e.central_freelist().GetSpanStats().num_live_spans(), 1);
+  free_span(objects);
+  testing::Mock::VerifyAndClearExpectations(&e.forwarder());
+
+  // A held span survives one plunder, and is returned by the next.
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(0);
+  e.central_freelist().PlunderEmptySpans();
+  EXPECT_EQ(e.central_freelist().num_empty_spans(), 1);
+  testing::Mock::VerifyAndClearExpectations(&e.forwarder());
+
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(1);
+  e.central_freelist().PlunderEmptySpans();
+  EXPECT_EQ(e.central_freelist().num_empty_spans(), 0);
+  EXPECT_EQ(e.central_freelist().length(), 0);
+  EXPECT_EQ(e.central_freelist().GetSpanStats().num_live_spans(), 0);
+}
+
+TEST_P(CentralFreeListTest, Prepopulate) {
+  TypeParam e(std::get<0>(GetParam()).size, std::get<0>(GetParam()).pages,
+              std::get<0>(GetParam()).num_to_move, std::get<1>(GetParam()));
+  const int objects_per_span = e.objects_per_span();
+  if (objects_per_span < 2) return;
+
+  // The prepopulated span serves the next RemoveRange.
+  EXPECT_CALL(e.forwarder(), AllocateSpan).Times(1);
+  EXPECT_TRUE(e.central_freelist().Prepopulate(1));
+  EXPECT_EQ(e.central_freelist().num_empty_spans(), 1);
+  EXPECT_EQ(e.central_freelist().length(), objects_per_span);
+  // There are free objects, and a span is held already.
+  EXPECT_FALSE(e.central_freelist().Prepopulate(1));
+  EXPECT_FALSE(e.central_freelist().Prepopulate(objects_per_span + 1));
+
+  void* batch[kMaxObjectsToMove];
+  const int got = e.central_freelist().RemoveRange(
+      batch, std::min<int>(objects_per_span, e.batch_size()));
+  ASSERT_GT(got, 0);
+  EXPECT_EQ(e.central_freelist().num_empty_spans(), 0);
+  SpanStats stats = e.central_freelist().GetSpanStats();
+  EXPECT_EQ(stats.num_prepopulated_spans, 1);
+  EXPECT_EQ(stats.num_empty_span_reuses, 1);
+  EXPECT_EQ(stats.num_live_spans(), 1);
+  testing::Mock::VerifyAndClearExpectations(&e.forwarder());
+
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(1);
+  e.central_freelist().InsertRange({batch, static_cast<size_t>(got)});
+  testing::Mock::VerifyAndClearExpectations(&e.forwarder());
+
+  // An unused prepopulated span ages out like any other held span.
+  EXPECT_CALL(e.forwarder(), AllocateSpan).Times(1);
+  EXPECT_TRUE(e.central_freelist().Prepopulate(1));
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(0);
+  e.central_freelist().PlunderEmptySpans();
+  testing::Mock::VerifyAndClearExpectations(&e.forwarder());
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(1);
+  e.central_freelist().PlunderEmptySpans();
+  EXPECT_EQ(e.central_freelist().length(), 0);
+  EXPECT_EQ(e.central_freelist().GetSpanStats().num_live_spans(), 0);
+}
+
 TEST_P(CentralFreeListTest, MultipleSpans) {
   TypeParam e(std::get<0>(GetParam()).size, std::get<0>(GetParam()).pages,
               std::get<0>(GetParam()).num_to_move, std::get<1>(GetParam()));
@@ -808,6 +987,67 @@ TEST_P(CentralFreeListTest, PassSpanDensityToPageheap) {
   test_function(e.objects_per_span(), AccessDensityPrediction::kDense);
 }
 
+TEST_P(CentralFreeListTest, DynamicSpanPages) {
+  TypeParam e(std::get<0>(GetParam()).size, std::get<0>(GetParam()).pages,
+              std::get<0>(GetParam()).num_to_move, std::get<1>(GetParam()));
+  const size_t size = std::get<0>(GetParam()).size;
+  const Length pages = Length(std::get<0>(GetParam()).pages);
+  const size_t objects_per_span = e.objects_per_span();
+  if (objects_per_span < 2) return;
+  e.forwarder().set_dynamic_span_pages(true);
+
+  std::vector<Length> lengths;
+  EXPECT_CALL(e.forwarder(), AllocateSpan)
+      .WillRepeatedly([&](int size_class, SpanAllocInfo info, Length n) {
+        lengths.push_back(n);
+        // Spans of every length are described like the size class's own.
+        EXPECT_EQ(info.objects_per_span, objects_per_span);
+        return e.forwarder().FakeStaticForwarder::AllocateSpan(size_class,
+                                                               info, n);
+      });
+
+  // Use enough objects for the longest spans to be worthwhile.
+  std::vector<void*> objects;
+  void* batch[kMaxObjectsToMove];
+  while (objects.size() < 20 * objects_per_span) {
+    const int got = e.central_freelist().RemoveRange(batch, e.batch_size());
+    ASSERT_GT(got, 0);
+    objects.insert(objects.end(), batch, batch + got);
+  }
+
+  // Spans grow with the objects in use, amongst the lengths around the size
+  // class's own.  Only bitmap-managed spans may be longer than a page.
+  ASSERT_FALSE(lengths.empty());
+  size_t capacity = 0;
+  for (size_t i = 0; i < lengths.size(); ++i) {
+    EXPECT_THAT(lengths[i], testing::AnyOf(pages / 2, pages, pages * 2));
+    if (i > 0) EXPECT_GE(lengths[i], lengths[i - 1]);
+    capacity += lengths[i].in_bytes() / size;
+  }
+  if (Span::IsNonIntrusive(size)) {
+    if (pages > Length(1) && (pages / 2).in_bytes() / size > 1) {
+      EXPECT_EQ(lengths.front(), pages / 2);
+    }
+  } else {
+    EXPECT_EQ(lengths.front(), pages);
+    EXPECT_EQ(lengths.back(), pages);
+  }
+  SpanStats stats = e.central_freelist().GetSpanStats();
+  EXPECT_EQ(stats.num_live_spans(), lengths.size());
+  EXPECT_EQ(stats.obj_capacity, capacity);
+  EXPECT_EQ(e.central_freelist().length() + objects.size(), capacity);
+
+  for (size_t returned = 0; returned < objects.size();) {
+    const size_t n = std::min(objects.size() - returned, e.batch_size());
+    e.central_freelist().InsertRange({&objects[returned], n});
+    returned += n;
+  }
+  EXPECT_EQ(e.central_freelist().length(), 0);
+  EXPECT_EQ(e.central_freelist().GetSpanStats().num_live_spans(), 0);
+  EXPECT_EQ(e.central_freelist().GetSpanStats().obj_capacity, 0);
+  EXPECT_EQ(e.central_freelist().OverheadBytes(), 0);
+}
+
 TEST_P(CentralFreeListTest, SpanFragmentation) {
   // This test is primarily exercising Span itself to model how tcmalloc.cc uses
   // it, but this gives us a self-contained (and sanitizable) implementation of
@@ -845,6 +1085,94 @@ TEST_P(CentralFreeListTest, SpanFragmentation) {
   e.central_freelist().InsertRange(absl::MakeSpan(&initial, 1));
 }
 
+TEST_P(CentralFreeListTest, RemoveFromSpan) {
+  TypeParam e(std::get<0>(GetParam()).size, std::get<0>(GetParam()).pages,
+              std::get<0>(GetParam()).num_to_move, std::get<1>(GetParam()));
+  void* initial;
+  ASSERT_EQ(e.central_freelist().RemoveRange(&initial, 1), 1);
+  Span* const span = e.central_freelist().forwarder().MapObjectToSpan(initial);
+
+  // Drain the span one object at a time.
+  std::vector<void*> objects = {initial};
+  void* next;
+  while (e.central_freelist().RemoveFromSpan(span, &next, 1) == 1) {
+    EXPECT_EQ(e.central_freelist().forwarder().MapObjectToSpan(next), span);
+    objects.push_back(next);
+  }
+  EXPECT_EQ(objects.size(), e.objects_per_span());
+  EXPECT_EQ(e.central_freelist().length(), 0);
+
+  for (size_t i = 0; i < objects.size(); i += e.batch_size()) {
+    const size_t n = std::min(e.batch_size(), objects.size() - i);
+    e.central_freelist().InsertRange(absl::MakeSpan(&objects[i], n));
+  }
+}
+
+TEST_P(CentralFreeListTest, RemoteFrees) {
+  TypeParam e(std::get<0>(GetParam()).size, std::get<0>(GetParam()).pages,
+              std::get<0>(GetParam()).num_to_move, std::get<1>(GetParam()));
+  const int objects_per_span = e.objects_per_span();
+  if (Span::IsNonIntrusive(std::get<0>(GetParam()).size)) return;
+  e.forwarder().set_remote_frees(true);
+
+  EXPECT_CALL(e.forwarder(), AllocateSpan).Times(1);
+  std::vector<void*> objects;
+  void* batch[kMaxObjectsToMove];
+  while (objects.size() < objects_per_span) {
+    const size_t n = objects_per_span - objects.size();
+    int got =
+        e.central_freelist().RemoveRange(batch, std::min(n, e.batch_size()));
+    ASSERT_GT(got, 0);
+    objects.insert(objects.end(), batch, batch + got);
+  }
+
+  // Freed objects wait on their span, and count as allocated, until the next
+  // RemoveRange reuses them.
+  e.central_freelist().InsertRange({&objects.back(), 1});
+  EXPECT_EQ(e.central_freelist().length(), 0);
+  EXPECT_EQ(e.central_freelist().allocated(), objects_per_span);
+  ASSERT_EQ(e.central_freelist().RemoveRange(batch, 1), 1);
+  EXPECT_EQ(batch[0], objects.back());
+  testing::Mock::VerifyAndClearExpectations(&e.forwarder());
+
+  // The span is returned once all its objects have been drained.
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(0);
+  for (size_t i = 0; i < objects.size(); i += e.batch_size()) {
+    const size_t n = std::min(e.batch_size(), objects.size() - i);
+    e.central_freelist().InsertRange(absl::MakeSpan(&objects[i], n));
+  }
+  EXPECT_EQ(e.central_freelist().allocated(), objects_per_span);
+  testing::Mock::VerifyAndClearExpectations(&e.forwarder());
+
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(1);
+  e.central_freelist().PlunderEmptySpans();
+  EXPECT_EQ(e.central_freelist().allocated(), 0);
+  EXPECT_EQ(e.central_freelist().length(), 0);
+  EXPECT_EQ(e.central_freelist().GetSpanStats().num_live_spans(), 0);
+}
+
+TEST_P(CentralFreeListTest, RemoteFreesFromManyThreads) {
+  TypeParam e(std::get<0>(GetParam()).size, std::get<0>(GetParam()).pages,
+              std::get<0>(GetParam()).num_to_move, std::get<1>(GetParam()));
+  if (Span::IsNonIntrusive(std::get<0>(GetParam()).size)) return;
+  e.forwarder().set_remote_frees(true);
+
+  ThreadManager threads;
+  threads.Start(4, [&](int) {
+    void* batch[kMaxObjectsToMove];
+    const int got = e.central_freelist().RemoveRange(batch, e.batch_size());
+    ASSERT_GT(got, 0);
+    e.central_freelist().InsertRange({batch, static_cast<size_t>(got)});
+  });
+  absl::SleepFor(absl::Milliseconds(20));
+  threads.Stop();
+
+  e.central_freelist().FlushEmptySpans();
+  EXPECT_EQ(e.central_freelist().allocated(), 0);
+  EXPECT_EQ(e.central_freelist().length(), 0);
+  EXPECT_EQ(e.central_freelist().GetSpanStats().num_live_spans(), 0);
+}
+
 INSTANTIATE_TEST_SUITE_P(
     CentralFreeList, CentralFreeListTest,
     testing::Combine(
@@ -852,6 +1180,91 @@ INSTANTIATE_TEST_SUITE_P(
         testing::ValuesIn(kSizeClasses.begin() + 1, kSizeClasses.end()),
         /*use_all_buckets_for_few_object_spans=*/testing::Values(false, true)));
 
+// Lets tests choose which shard the "current CPU" belongs to.
+class FakeShardLayout {
+ public:
+  static constexpr unsigned kNumShards = 4;
+  static unsigned NumShards() { return kNumShards; }
+  static unsigned CurrentShard() { return current_shard_; }
+  static void SetCurrentShard(unsigned shard) { current_shard_ = shard; }
+
+ private:
+  static inline unsigned current_shard_ = 0;
+};
+
+class ShardedCentralFreeListTest : public testing::Test {
+ protected:
+  using Env = FakeCentralFreeListEnvironment<
+      central_freelist_internal::ShardedCentralFreeList<
+          MockStaticForwarder, FakeShardLayout, FakeShardLayout::kNumShards>>;
+
+  ShardedCentralFreeListTest()
+      : e_(/*class_size=*/64, /*pages=*/1, /*num_objects_to_move=*/32,
+           /*use_all_buckets_for_few_object_spans=*/false) {
+    FakeShardLayout::SetCurrentShard(0);
+  }
+
+  Env e_;
+};
+
+TEST_F(ShardedCentralFreeListTest, FreesReturnToOwningShard) {
+  auto& cfl = e_.central_freelist();
+  ASSERT_EQ(cfl.num_shards(), FakeShardLayout::kNumShards);
+
+  void* batch[kMaxObjectsToMove];
+  const int got = cfl.RemoveRange(batch, e_.batch_size());
+  ASSERT_GT(got, 1);
+  EXPECT_EQ(cfl.shard_length(0), e_.objects_per_span() - got);
+
+  // Freeing from another CPU returns the objects to the span's owner.
+  FakeShardLayout::SetCurrentShard(1);
+  cfl.InsertRange({batch, static_cast<size_t>(got - 1)});
+  EXPECT_EQ(cfl.shard_length(0), e_.objects_per_span() - 1);
+  EXPECT_EQ(cfl.shard_length(1), 0);
+  EXPECT_EQ(cfl.length(), e_.objects_per_span() - 1);
+  EXPECT_EQ(cfl.allocated(), 1);
+
+  cfl.InsertRange({&batch[got - 1], 1});
+  EXPECT_EQ(cfl.length(), 0);
+}
+
+TEST_F(ShardedCentralFreeListTest, StealsBeforeAllocating) {
+  auto& cfl = e_.central_freelist();
+  EXPECT_CALL(e_.forwarder(), AllocateSpan).Times(1);
+
+  void* first;
+  ASSERT_EQ(cfl.RemoveRange(&first, 1), 1);
+
+  // Shard 2 is empty, so it takes from shard 0 instead of allocating a span.
+  FakeShardLayout::SetCurrentShard(2);
+  void* batch[kMaxObjectsToMove];
+  const int got = cfl.RemoveRange(batch, e_.batch_size());
+  EXPECT_GT(got, 0);
+  EXPECT_EQ(cfl.steals(), 1);
+  EXPECT_EQ(cfl.shard_length(2), 0);
+
+  cfl.InsertRange({batch, static_cast<size_t>(got)});
+  cfl.InsertRange({&first, 1});
+}
+
+TEST_F(ShardedCentralFreeListTest, PopulatesCurrentShardWhenAllEmpty) {
+  auto& cfl = e_.central_freelist();
+  EXPECT_CALL(e_.forwarder(), AllocateSpan).Times(1);
+
+  FakeShardLayout::SetCurrentShard(3);
+  void* batch[kMaxObjectsToMove];
+  const int got = cfl.RemoveRange(batch, e_.batch_size());
+  ASSERT_GT(got, 0);
+  EXPECT_EQ(cfl.shard_length(3), e_.objects_per_span() - got);
+  EXPECT_EQ(cfl.steals(), 0);
+
+  SpanStats stats = cfl.GetSpanStats();
+  EXPECT_EQ(stats.num_spans_requested, 1);
+  EXPECT_EQ(stats.obj_capacity, e_.objects_per_span());
+
+  cfl.InsertRange({batch, static_cast<size_t>(got)});
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
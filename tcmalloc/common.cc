@@ -23,18 +23,22 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 
 absl::string_view MemoryTagToLabel(MemoryTag tag) {
+  static constexpr absl::string_view kNormalLabels[kMaxNumaPartitions] = {
+      "NORMAL",    "NORMAL_P1", "NORMAL_P2", "NORMAL_P3",
+      "NORMAL_P4", "NORMAL_P5", "NORMAL_P6", "NORMAL_P7",
+  };
+
   switch (tag) {
-    case MemoryTag::kNormal:
-      return "NORMAL";
-    case MemoryTag::kNormalP1:
-      return "NORMAL_P1";
     case MemoryTag::kSampled:
       return "SAMPLED";
     case MemoryTag::kCold:
       return "COLD";
+    case MemoryTag::kRegistered:
+      return "REGISTERED";
+    default:
+      ASSUME(IsNormalMemoryTag(tag));
+      return kNormalLabels[NumaPartitionFromTag(tag)];
   }
-
-  ASSUME(false);
 }
 
 // This only provides correct answer for TCMalloc-allocated memory,
@@ -169,14 +169,25 @@ inline constexpr size_t kDefaultProfileSamplingRate = 1 << 21;
 // Sanitizers constrain the memory layout which causes problems with the
 // enlarged tags required to represent NUMA partitions. Disable NUMA awareness
 // to avoid failing to mmap memory.
+//
+// The number of partitions defaults to 2 and may be raised for hosts with more
+// NUMA nodes by defining TCMALLOC_INTERNAL_NUMA_PARTITIONS.
 #if defined(TCMALLOC_INTERNAL_NUMA_AWARE) && \
     !defined(ABSL_HAVE_MEMORY_SANITIZER) &&  \
     !defined(ABSL_HAVE_THREAD_SANITIZER)
-inline constexpr size_t kNumaPartitions = 2;
+#ifndef TCMALLOC_INTERNAL_NUMA_PARTITIONS
+#define TCMALLOC_INTERNAL_NUMA_PARTITIONS 2
+#endif
+inline constexpr size_t kNumaPartitions = TCMALLOC_INTERNAL_NUMA_PARTITIONS;
 #else
 inline constexpr size_t kNumaPartitions = 1;
 #endif
 
+// AddressRegionFactory::UsageHint provides a hint for up to 8 partitions.
+inline constexpr size_t kMaxNumaPartitions = 8;
+static_assert(kNumaPartitions >= 1 && kNumaPartitions <= kMaxNumaPartitions,
+              "Unsupported number of NUMA partitions");
+
 // We have copies of kNumBaseClasses size classes for each NUMA node, followed
 // by any expanded classes.
 inline constexpr size_t kExpandedClassesStart =
@@ -221,17 +232,36 @@ inline constexpr int kMaxOverages = 3;
 // scavenging code will shrink it down when its contents are not in use.
 inline constexpr size_t kMaxDynamicFreeListLength = 8192;
 
+// The registered heap (see tcmalloc::registered) needs a tag bit of its own,
+// which halves the address range of every other tag, so it is only built in
+// when TCMALLOC_INTERNAL_REGISTERED_HEAP is defined.
+#ifdef TCMALLOC_INTERNAL_REGISTERED_HEAP
+inline constexpr bool kHasRegisteredHeap = true;
+#else
+inline constexpr bool kHasRegisteredHeap = false;
+#endif
+
+// Memory tags for normal memory are 1 + the NUMA partition, so we need enough
+// bits to represent [1, kNumaPartitions].  Sampled memory uses 0, and cold and
+// registered memory use the next bits up, so that none overlaps with any
+// normal tag.
+inline constexpr uintptr_t kNumaTagBits = absl::bit_width(kNumaPartitions);
+
 enum class MemoryTag : uint8_t {
   // Sampled, infrequently allocated
   kSampled = 0x0,
   // Not sampled, NUMA partition 0
   kNormalP0 = 0x1,
-  // Not sampled, NUMA partition 1
+  // Not sampled, NUMA partition 1.  Partitions beyond 1 have no named tag; use
+  // NumaNormalTag() to obtain them.
   kNormalP1 = (kNumaPartitions > 1) ? 0x2 : 0xff,
   // Not sampled
   kNormal = kNormalP0,
   // Cold
-  kCold = (kNumaPartitions > 1) ? 0x4 : 0x2,
+  kCold = 1 << kNumaTagBits,
+  // Registered for DMA by the AddressRegionFactory (see tcmalloc::registered).
+  // Without the registered heap, no memory carries this tag.
+  kRegistered = kHasRegisteredHeap ? 2 << kNumaTagBits : 0xfe,
 };
 
 // We make kNormal and kCold disjoint so that IsCold implies IsSampled.  This
@@ -243,17 +273,27 @@ static_assert((static_cast<uint8_t>(MemoryTag::kNormal) &
                static_cast<uint8_t>(MemoryTag::kCold)) == 0,
               "kNormal and kCold should have disjoint bit patterns");
 
-inline constexpr uintptr_t kTagShift = std::min(kAddressBits - 4, 42);
-inline constexpr uintptr_t kTagMask = uintptr_t{kNumaPartitions > 1 ? 0x7 : 0x3}
+// Tags for more than one partition, or for the registered heap, need more
+// bits; take them from below the baseline shift so that the highest tag bit
+// stays where it is.
+inline constexpr uintptr_t kTagBits =
+    kNumaTagBits + (kHasRegisteredHeap ? 2 : 1);
+inline constexpr uintptr_t kTagShift =
+    std::min(kAddressBits - 4, 42) - (kTagBits > 3 ? kTagBits - 3 : 0);
+inline constexpr uintptr_t kTagMask = ((uintptr_t{1} << kTagBits) - 1)
                                       << kTagShift;
 
 inline bool IsSampledMemory(const void* ptr) {
-  constexpr uintptr_t kSampledNormalMask = kNumaPartitions > 1 ? 0x3 : 0x1;
+  constexpr uintptr_t kSampledNormalMask = (uintptr_t{1} << kNumaTagBits) - 1;
 
   static_assert(static_cast<uintptr_t>(MemoryTag::kNormalP0) &
                 kSampledNormalMask);
-  static_assert(static_cast<uintptr_t>(MemoryTag::kNormalP1) &
-                kSampledNormalMask);
+  static_assert(kNumaPartitions & kSampledNormalMask);
+  static_assert((static_cast<uintptr_t>(MemoryTag::kCold) &
+                 kSampledNormalMask) == 0);
+  static_assert(!kHasRegisteredHeap ||
+                (static_cast<uintptr_t>(MemoryTag::kRegistered) &
+                 kSampledNormalMask) == 0);
 
   const uintptr_t tag =
       (reinterpret_cast<uintptr_t>(ptr) & kTagMask) >> kTagShift;
@@ -273,6 +313,14 @@ inline bool IsColdMemory(const void* ptr) {
   return r;
 }
 
+// Like cold memory, registered memory is never freed on the fast path, so that
+// IsRegisteredMemory(ptr) implies IsSampledMemory(ptr).
+inline bool IsRegisteredMemory(const void* ptr) {
+  if (!kHasRegisteredHeap) return false;
+  return (reinterpret_cast<uintptr_t>(ptr) & kTagMask) ==
+         (static_cast<uintptr_t>(MemoryTag::kRegistered) << kTagShift);
+}
+
 inline constexpr bool ColdFeatureActive() { return kHasExpandedClasses; }
 
 inline MemoryTag GetMemoryTag(const void* ptr) {
@@ -323,15 +371,22 @@ inline AllocationAccess AccessFromPointer(void* ptr) {
 }
 
 inline MemoryTag NumaNormalTag(size_t numa_partition) {
-  switch (numa_partition) {
-    case 0:
-      return MemoryTag::kNormalP0;
-    case 1:
-      return MemoryTag::kNormalP1;
-    default:
-      ASSUME(false);
-      __builtin_unreachable();
-  }
+  ASSERT(numa_partition < kNumaPartitions);
+  return static_cast<MemoryTag>(
+      static_cast<uint8_t>(MemoryTag::kNormalP0) + numa_partition);
+}
+
+// Returns true if <tag> is the tag of normal memory for some NUMA partition.
+inline constexpr bool IsNormalMemoryTag(MemoryTag tag) {
+  const uint8_t normal = static_cast<uint8_t>(MemoryTag::kNormalP0);
+  return static_cast<uint8_t>(tag) >= normal &&
+         static_cast<uint8_t>(tag) < normal + kNumaPartitions;
+}
+
+// Returns the NUMA partition of normal memory tagged with <tag>.
+inline size_t NumaPartitionFromTag(MemoryTag tag) {
+  ASSERT(IsNormalMemoryTag(tag));
+  return static_cast<uint8_t>(tag) - static_cast<uint8_t>(MemoryTag::kNormalP0);
 }
 
 inline size_t NumaPartitionFromPointer(void* ptr) {
@@ -339,12 +394,8 @@ inline size_t NumaPartitionFromPointer(void* ptr) {
     return 0;
   }
 
-  switch (GetMemoryTag(ptr)) {
-    case MemoryTag::kNormalP1:
-      return 1;
-    default:
-      return 0;
-  }
+  const MemoryTag tag = GetMemoryTag(ptr);
+  return IsNormalMemoryTag(tag) ? NumaPartitionFromTag(tag) : 0;
 }
 
 // Linker initialized, so this lock can be accessed at any time.
@@ -20,6 +20,7 @@
 #include <new>
 
 #include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
@@ -32,6 +33,8 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+ABSL_CONST_INIT thread_local bool bypass_per_cpu_caches = false;
+
 namespace cpu_cache_internal {
 ABSL_ATTRIBUTE_WEAK bool default_want_disable_wider_slabs();
 bool use_wider_slabs() {
@@ -66,7 +69,10 @@ static void ActivatePerCpuCaches() {
 
   if (Parameters::per_cpu_caches() && subtle::percpu::IsFast()) {
     tc_globals.InitIfNecessary();
+    const int64_t start = absl::base_internal::CycleClock::Now();
     tc_globals.cpu_cache().Activate();
+    tc_globals.startup_timings().cpu_cache_activate =
+        absl::base_internal::CycleClock::Now() - start;
     tc_globals.ActivateCpuCache();
     // no need for this thread cache anymore, I guess.
     ThreadCache::BecomeIdle();
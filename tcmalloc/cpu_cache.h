@@ -15,12 +15,15 @@
 #ifndef TCMALLOC_CPU_CACHE_H_
 #define TCMALLOC_CPU_CACHE_H_
 
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/mman.h>
 
 #include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <limits>
 #include <new>
 #include <tuple>
 #include <type_traits>
@@ -38,21 +41,28 @@
 #include "absl/functional/function_ref.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
+#include "tcmalloc/background_wakeup.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/cpu_time_stats.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/experiment_config.h"
 #include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/cache_topology.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/memory_stats.h"
 #include "tcmalloc/internal/numa.h"
 #include "tcmalloc/internal/optimization.h"
 #include "tcmalloc/internal/percpu.h"
 #include "tcmalloc/internal/percpu_tcmalloc.h"
+#include "tcmalloc/internal/probes.h"
 #include "tcmalloc/internal/sysinfo.h"
+#include "tcmalloc/latency_stats.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
+#include "tcmalloc/system-alloc.h"
 #include "tcmalloc/thread_cache.h"
 #include "tcmalloc/transfer_cache.h"
 
@@ -61,6 +71,11 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 class CpuCachePeer;
 
+// Set for threads of the batch allocation QoS class (see
+// MallocExtension::AllocationQoS), which keep their objects in a thread cache
+// rather than the per-CPU caches.
+extern ABSL_CONST_INIT thread_local bool bypass_per_cpu_caches;
+
 namespace cpu_cache_internal {
 template <class CpuCache>
 struct DrainHandler;
@@ -79,9 +94,37 @@ constexpr inline uint8_t kMaxBasePerCpuShift = 12;
 constexpr inline uint8_t kInitialBasePerCpuShift = 14;
 constexpr inline uint8_t kMaxBasePerCpuShift = 18;
 #endif
+
+// The per-cpu cache limit that small-footprint mode (see
+// Parameters::small_footprint) starts with, in place of kMaxCpuCacheSize.
+constexpr inline size_t kSmallFootprintMaxCpuCacheSize = 128 * 1024;
 constexpr inline uint8_t kNumPossiblePerCpuShifts =
     kMaxBasePerCpuShift - kInitialBasePerCpuShift + 1;
 
+static cpu_set_t FillActiveCpuMask() {
+  cpu_set_t allowed_cpus;
+  if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) != 0) {
+    CPU_ZERO(&allowed_cpus);
+  }
+
+#ifdef PERCPU_USE_RSEQ
+  const bool real_cpus = !subtle::percpu::UsingFlatVirtualCpus();
+#else
+  const bool real_cpus = true;
+#endif
+
+  if (real_cpus) {
+    return allowed_cpus;
+  }
+
+  const int virtual_cpu_count = CPU_COUNT(&allowed_cpus);
+  CPU_ZERO(&allowed_cpus);
+  for (int cpu = 0; cpu < virtual_cpu_count; ++cpu) {
+    CPU_SET(cpu, &allowed_cpus);
+  }
+  return allowed_cpus;
+}
+
 // StaticForwarder provides access to the SizeMap and transfer caches.
 //
 // This is a class, rather than namespaced globals, so that it can be mocked for
@@ -126,6 +169,16 @@ class StaticForwarder {
     return Parameters::per_cpu_caches_dynamic_slab_enabled();
   }
 
+  static bool per_cpu_caches_handoff() {
+    return Parameters::per_cpu_caches_handoff();
+  }
+
+  static bool small_footprint() { return Parameters::small_footprint(); }
+
+  static bool per_cpu_caches_adaptive_batches() {
+    return Parameters::per_cpu_caches_adaptive_batches();
+  }
+
   static double per_cpu_caches_dynamic_slab_grow_threshold() {
     return Parameters::per_cpu_caches_dynamic_slab_grow_threshold();
   }
@@ -150,6 +203,37 @@ class StaticForwarder {
     return tc_globals.numa_topology();
   }
 
+  static void BindMemory(void* base, size_t size, size_t partition) {
+    tcmalloc_internal::BindMemory(base, size, partition);
+  }
+
+  static int CpuCapacity(int cpu) {
+    return tcmalloc_internal::CpuCapacity(cpu);
+  }
+
+  static int SmtSiblingCount(int cpu) {
+    return CacheTopology::Instance().GetSmtSiblingCount(cpu);
+  }
+
+  static unsigned L3CacheId(int cpu) {
+    return CacheTopology::Instance().GetL3FromCpuId(cpu);
+  }
+
+  static bool per_cpu_caches_share_smt_capacity() {
+    return Parameters::per_cpu_caches_share_smt_capacity();
+  }
+
+  static cpu_set_t AllowedCpus() { return FillActiveCpuMask(); }
+
+  static double CpuQuota() {
+    double cpus;
+    return GetCgroupCpuQuota(&cpus) ? cpus : -1;
+  }
+
+  static void MaybeRunBackgroundSlice() {
+    tcmalloc_internal::MaybeRunBackgroundSlice();
+  }
+
   static ShardedTransferCacheManager& sharded_transfer_cache() {
     return tc_globals.sharded_transfer_cache();
   }
@@ -178,10 +262,28 @@ class StaticForwarder {
   static bool ConfigureSizeClassMaxCapacity() { return false; }
 };
 
+// Slab offsets are 16 bits wide, so a slab is limited to 512KiB of pointers
+// (the base 256KiB slab shifted by 1).  We grow the slab by one bit for NUMA
+// awareness, and with more than two partitions each partition's size classes
+// get a proportionally smaller share of it; see NumaCapacityShift.
+inline constexpr uint8_t kMaxNumaShift = 1;
+
 template <typename NumaTopology>
 uint8_t NumaShift(const NumaTopology& topology) {
+  // With more than two partitions compiled in, the slab headers for all of the
+  // partitions' size classes do not fit in the smallest base slab, so we widen
+  // the slab even when NUMA awareness is disabled at runtime.
+  if constexpr (kNumaPartitions > 2) return kMaxNumaShift;
+  return topology.numa_aware() ? kMaxNumaShift : 0;
+}
+
+// Returns the shift by which per-size-class capacities shrink to fit all
+// active NUMA partitions into the slab.
+template <typename NumaTopology>
+uint8_t NumaCapacityShift(const NumaTopology& topology) {
   return topology.numa_aware()
-             ? absl::bit_ceil(topology.active_partitions() - 1)
+             ? absl::bit_width(topology.active_partitions() - 1) -
+                   NumaShift(topology)
              : 0;
 }
 
@@ -246,6 +348,9 @@ class CpuCache {
     // Tracks number of misses recorded as of the end of the last per-class
     // resize interval.
     kResize,
+    // Tracks number of misses recorded as of the end of the last capacity
+    // tuning interval.
+    kTune,
     kNumTypes,
   };
 
@@ -279,6 +384,12 @@ class CpuCache {
     int max_last_overflow_cpu_id = -1;
   };
 
+  struct TunedCapacityStats {
+    size_t target = 0;
+    size_t capacity = 0;
+    size_t working_set = 0;
+  };
+
   // Sets the lower limit on the capacity that can be stolen from the cpu cache.
   static constexpr double kCacheCapacityThreshold = 0.20;
 
@@ -292,6 +403,22 @@ class CpuCache {
   // For testing
   void Deactivate();
 
+  // Acquires the per-cpu locks, and the remote free and handoff locks of
+  // populated cpus, before fork().
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS;
+  // Releases them in the parent after fork().
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS;
+  // Releases them in the child after fork().  If <slabs_wiped>, the child's
+  // slabs are zero, so every cpu is reset: it is initialized again on its
+  // first use in the child and the objects the parent had cached on it are
+  // abandoned, without the child touching the parent's slab pages.
+  void ReleaseInternalLocksInChild(bool slabs_wiped)
+      ABSL_NO_THREAD_SAFETY_ANALYSIS;
+
+  // Applies madvise <advice>, e.g. MADV_WIPEONFORK, to the slabs.  Fails while
+  // the slabs are resizing.  Requires AcquireInternalLocks().
+  bool AdviseSlabs(int advice);
+
   // Allocate an object of the given size class.
   // Returns nullptr when allocation fails.
   void* Allocate(size_t size_class);
@@ -315,8 +442,34 @@ class CpuCache {
   // when it's known that no hooks are installed.
   void DeallocateSlowNoHooks(void* ptr, size_t size_class);
 
+  // Allocates up to <count> objects of <size_class> into <batch>.  Objects are
+  // popped from the current CPU's slab first and the remainder is fetched
+  // directly from the backing transfer cache, so the per-object fast path is
+  // entered at most once.  Returns the number of objects allocated, which is
+  // less than <count> only if the backing caches are exhausted.
+  //
+  // May be called only when it's known that no hooks are installed.
+  size_t AllocateBatch(size_t size_class, void** batch, size_t count);
+
+  // Frees <count> objects of <size_class> from <batch>.  As many objects as fit
+  // are pushed into the current CPU's slab and the rest are released to the
+  // backing transfer cache.  The contents of <batch> are unspecified on
+  // return.
+  //
+  // May be called only when it's known that no hooks are installed.
+  void DeallocateBatch(size_t size_class, void** batch, size_t count);
+
+  // Frees an object of <size_class> that belongs to a NUMA partition other
+  // than the current CPU's.  The object is never handed out of the local slab,
+  // so rather than occupying its capacity until the next overflow, it is
+  // staged in a small per-CPU batch for its home partition and that batch is
+  // released to the home partition's transfer cache once full.
+  //
+  // May be called only when it's known that no hooks are installed.
+  void DeallocateRemote(void* ptr, size_t size_class);
+
   // Force all Allocate/DeallocateFast to fail in the current thread
-  // if malloc hooks are installed.
+  // if malloc hooks are installed, or the thread bypasses per-CPU caches.
   void MaybeForceSlowPath();
 
   // Give the number of bytes in <cpu>'s cache
@@ -349,6 +502,30 @@ class CpuCache {
   uint64_t CacheLimit() const;
   void SetCacheLimit(uint64_t v);
 
+  // Follows the cpu quota of the process's cgroup.  A process with a quota of
+  // fewer cpus than it may run on only runs on a few cpus at a time, but over
+  // time populates the caches of all of them.  Under such a quota, the caches
+  // populated from then on share a budget of kCpuQuotaHeadroom times the
+  // quota (rounded up) in caches, rather than starting with a whole cache
+  // each; stealing then moves capacity to the cpus in use.
+  void UpdateCpuQuota();
+
+  // Returns the number of caches' worth of capacity that all cpus share under
+  // the cgroup's cpu quota, or 0 if each cpu gets a whole cache.  Idle caches
+  // are worth reclaiming sooner while it is nonzero.
+  int CpuQuotaBudget() const {
+    return cpu_quota_budget_.load(std::memory_order_relaxed);
+  }
+
+  // Sets the capacity, in objects, that <size_class> grows to on its first
+  // miss on each cpu, rather than growing from zero a batch at a time.  Used
+  // to warm start the caches from a demand profile; 0 disables it.
+  void SetWarmCapacity(size_t size_class, size_t capacity) {
+    warm_capacity_[size_class].store(
+        std::min<size_t>(capacity, std::numeric_limits<uint16_t>::max()),
+        std::memory_order_relaxed);
+  }
+
   // Shuffles per-cpu caches using the number of underflows and overflows that
   // occurred in the prior interval. It selects the top per-cpu caches
   // with highest misses as candidates, iterates through the other per-cpu
@@ -363,7 +540,17 @@ class CpuCache {
   // populated cpu caches and reclaims the caches that:
   // (1) had same number of used bytes since the last interval,
   // (2) had no change in the number of misses since the last interval.
-  void TryReclaimingCaches();
+  // With <partition> other than -1, only the cpus of that NUMA partition are
+  // considered, so that its background worker only touches local caches.
+  // Calls for different partitions may run concurrently.
+  void TryReclaimingCaches(int partition = -1);
+
+  // Reclaims the caches of cpus that were removed from the process's affinity
+  // mask (for example, by shrinking its cpuset) since the last call, so that
+  // their objects return to the transfer caches, where the cpus still allowed
+  // can reuse them, rather than waiting to be found idle by
+  // TryReclaimingCaches().  Returns the number of bytes reclaimed.
+  uint64_t ReclaimDisallowedCaches();
 
   // Resize size classes for up to kNumCpuCachesToResize cpu caches per
   // interval.
@@ -375,6 +562,28 @@ class CpuCache {
   // size classes for up to kNumCpuCachesToResize number of per-cpu caches.
   void ResizeSizeClasses();
 
+  // Sets the capacities of all size classes within up to kNumCpuCachesToResize
+  // per-cpu caches per iteration, in a round-robin fashion.  Size classes that
+  // did not miss in the recent intervals are shrunk to their working set (the
+  // decayed peak of their sampled length) plus a batch.  The capacity freed,
+  // and any unallocated capacity, is then granted to the size classes that did
+  // miss, favoring those with the most misses per byte.  Replaces
+  // ResizeSizeClasses() when per_cpu_caches_autotune is enabled; the per-cpu
+  // budget itself is still set by ShuffleCpuCaches().
+  void TuneCapacities();
+
+  // Reports number of times TuneCapacities() has run.
+  uint64_t GetNumCapacityTunes() const {
+    return num_capacity_tunes_.load(std::memory_order_relaxed);
+  }
+
+  // Reports the capacity TuneCapacities() last aimed for <size_class> on
+  // <cpu>.
+  size_t GetTargetCapacity(int cpu, size_t size_class) const {
+    if (!HasPopulated(cpu)) return 0;
+    return resize_[cpu].tune[size_class].target.load(std::memory_order_relaxed);
+  }
+
   // Empty out the cache on <cpu>; move all objects to the central
   // cache.  (If other threads run concurrently on that cpu, we can't
   // guarantee it will be fully empty on return, but if the cpu is
@@ -394,6 +603,84 @@ class CpuCache {
   // Reports total number of times any CPU has been reclaimed.
   uint64_t GetNumReclaims() const;
 
+  // Pairs cpus that free a size class with the cpu that allocates it, for size
+  // classes that only overflow on the former and only underflow on the latter
+  // since the last call.  The overflows of each freeing cpu are then handed to
+  // its allocating cpu directly, bypassing the transfer cache, and consumed by
+  // its next refill.  Only size classes passed to RequestHandoff() are paired
+  // when per_cpu_caches_handoff is disabled.
+  // Called from a single thread.
+  void UpdateHandoffTargets();
+
+  // Makes <size_class> eligible for pairing by UpdateHandoffTargets even when
+  // per_cpu_caches_handoff is disabled.  Used for size classes whose objects
+  // are known to be freed on a different cpu than the one that allocated them,
+  // such as coroutine frames.
+  void RequestHandoff(size_t size_class) {
+    ASSERT(size_class > 0 && size_class < kNumClasses);
+    if (ABSL_PREDICT_TRUE(
+            handoff_requested_[size_class].load(std::memory_order_relaxed))) {
+      return;
+    }
+    handoff_requested_[size_class].store(true, std::memory_order_relaxed);
+    any_handoff_requested_.store(true, std::memory_order_relaxed);
+  }
+
+  // Thresholds of UpdateBatchLengths(), in misses per call.
+  static constexpr uint32_t kMissesToGrowBatch = 256;
+  static constexpr uint32_t kMissesToShrinkBatch = 4;
+
+  // Adapts the number of objects each size class moves to and from the
+  // backing caches at a time to the underflows and overflows it had since the
+  // last call.  The batch of a class that missed at least kMissesToGrowBatch
+  // times is doubled, up to the kMaxObjectsToMove that the transfer caches
+  // take in one call; that of a class that missed at most
+  // kMissesToShrinkBatch times is halved, down to a quarter of
+  // num_objects_to_move().  Batches return to num_objects_to_move() when
+  // per_cpu_caches_adaptive_batches is disabled.
+  // Called from a single thread.
+  void UpdateBatchLengths();
+
+  // Returns the number of objects <size_class> moves to and from the backing
+  // caches at a time.
+  size_t BatchLength(size_t size_class) const {
+    const size_t adapted =
+        batch_length_[size_class].load(std::memory_order_relaxed);
+    return adapted != 0 ? adapted : forwarder_.num_objects_to_move(size_class);
+  }
+
+  // Returns the cpu that <cpu> hands overflows of <size_class> to, or -1.
+  int GetHandoffTarget(int cpu, size_t size_class) const {
+    if (!HasPopulated(cpu)) return -1;
+    return resize_[cpu].handoff_cpu[size_class].load(std::memory_order_relaxed);
+  }
+
+  // Reports number of objects handed off to <cpu> by other cpus.
+  uint64_t GetNumHandoffs(int cpu) const;
+
+  // Reports total number of objects handed off between cpus.
+  uint64_t GetNumHandoffs() const;
+
+  // Reports number of objects freed on <cpu> that belonged to a remote NUMA
+  // partition.
+  uint64_t GetNumRemoteFrees(int cpu) const;
+
+  // Reports total number of objects freed to a remote NUMA partition.
+  uint64_t GetNumRemoteFrees() const;
+
+  struct SizeClassFlow {
+    // Objects fetched from the backing caches.
+    uint64_t fetched;
+    // Objects released to the backing caches.
+    uint64_t released;
+  };
+
+  // Reports the objects of <size_class> that the per-cpu caches have exchanged
+  // with the backing caches since startup.  Objects reused within a per-cpu
+  // cache are not counted, so these bound the allocations and deallocations of
+  // <size_class> from below, without adding work to the fast path.
+  SizeClassFlow GetSizeClassFlow(size_t size_class) const;
+
   // When dynamic slab size is enabled, checks if there is a need to resize
   // the slab based on miss-counts and resizes if so.
   void ResizeSlabIfNeeded();
@@ -423,6 +710,11 @@ class CpuCache {
   // maximum capacity for size class <size_class>.
   SizeClassCapacityStats GetSizeClassCapacityStats(size_t size_class) const;
 
+  // Scans through populated per-CPU caches, and reports the sum of the target
+  // capacities TuneCapacities() set for <size_class>, of its actual capacities
+  // and of its working sets.
+  TunedCapacityStats GetTunedCapacityStats(size_t size_class) const;
+
   // Reports the number of misses encountered by a <size_class> that were
   // recorded during the previous interval for the miss <type>.
   size_t GetIntervalSizeClassMisses(int cpu, size_t size_class,
@@ -463,6 +755,37 @@ class CpuCache {
     void* obj[kMaxToReturn];
   };
 
+  // Objects freed on a CPU that belong to another NUMA partition, staged until
+  // they can be returned to that partition's transfer cache in bulk.
+  static constexpr int kMaxRemoteFrees = 32;
+  struct RemoteFrees {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    int count = 0;
+    CompactSizeClass size_class[kMaxRemoteFrees];
+    void* obj[kMaxRemoteFrees];
+  };
+
+  // Objects freed on other cpus and handed to this cpu, which allocates their
+  // size classes, staged until it refills from them.  Bounded both in objects
+  // and in bytes, as the objects are not accounted to any size class's
+  // capacity.
+  static constexpr int kMaxHandoffObjects = 128;
+  static constexpr size_t kMaxHandoffBytes = 256 << 10;
+  struct ABSL_CACHELINE_ALIGNED HandoffBuffer {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    int count = 0;
+    // Bytes of the staged objects; written under lock, but read without it.
+    std::atomic<size_t> bytes = 0;
+    CompactSizeClass size_class[kMaxHandoffObjects];
+    void* obj[kMaxHandoffObjects];
+  };
+
+  // The number of successive misses of a size class in one direction for a cpu
+  // to be considered its producer (underflows) or consumer (overflows).
+  static constexpr uint32_t kMinHandoffSuccessive = 8;
+
   struct PerClassMissCounts {
     std::atomic<size_t>
         misses[static_cast<size_t>(PerClassMissType::kNumTypes)];
@@ -484,6 +807,10 @@ class CpuCache {
     bool Update(bool overflow, bool grow, uint32_t* successive);
     uint32_t Tick();
 
+    // Returns the number of successive overflows (if <overflow>) or underflows
+    // that the last miss was part of.
+    uint32_t Successive(bool overflow) const;
+
     // Records a miss. A miss occurs when size class attempts to grow it's
     // capacity on underflow/overflow, but we are already at the maximum
     // configured per-cpu cache capacity limit.
@@ -516,6 +843,17 @@ class CpuCache {
                   "size mismatch");
   };
 
+  // Per-size-class state of TuneCapacities().
+  struct TuneInfo {
+    // Misses over the recent intervals, halved every interval.
+    std::atomic<uint32_t> misses;
+    // Peak length over the recent intervals, decayed by a quarter (rounded
+    // up) every interval.
+    std::atomic<uint16_t> working_set;
+    // The capacity we last aimed for.
+    std::atomic<uint16_t> target;
+  };
+
   // Helper type so we don't need to sprinkle `static_cast`s everywhere.
   struct MissCounts {
     std::atomic<size_t> misses[static_cast<size_t>(MissCount::kNumCounts)];
@@ -525,21 +863,30 @@ class CpuCache {
     }
   };
 
-  struct ABSL_CACHELINE_ALIGNED ResizeInfo {
-    // cache space on this CPU we're not using.  Modify atomically;
-    // we don't want to lose space.
-    std::atomic<size_t> available;
-    // this is just a hint
-    std::atomic<size_t> last_steal;
+  // The state of each CPU that is set up on activation.  The rest, a CPU's
+  // ResizeInfo, is several KiB, so it is only initialized on the CPU's first
+  // use: a process confined to a few CPUs of a large machine does not pay for
+  // the others at startup.
+  struct ABSL_CACHELINE_ALIGNED CpuState {
     // Track whether we have initialized this CPU.
     absl::once_flag initialized;
-    // Track whether we have ever populated this CPU.
+    // Track whether we have ever populated this CPU.  Set once the CPU's
+    // ResizeInfo is initialized.
     std::atomic<bool> populated;
     // For cross-cpu operations. We can't allocate while holding one of these so
     // please use AllocationGuardSpinLockHolder to hold it.
     absl::base_internal::SpinLock lock ABSL_ACQUIRED_BEFORE(pageheap_lock){
         absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  };
+
+  struct ABSL_CACHELINE_ALIGNED ResizeInfo {
+    // cache space on this CPU we're not using.  Modify atomically;
+    // we don't want to lose space.
+    std::atomic<size_t> available;
+    // this is just a hint
+    std::atomic<size_t> last_steal;
     PerClassResizeInfo per_class[kNumClasses];
+    TuneInfo tune[kNumClasses];
     std::atomic<size_t> num_size_class_resizes;
     // Tracks number of underflows on allocate.
     MissCounts underflows;
@@ -556,6 +903,15 @@ class CpuCache {
     // Tracks last time this CPU was reclaimed.  If last underflow/overflow data
     // appears before this point in time, we ignore the CPU.
     std::atomic<int64_t> last_reclaim;
+    // Tracks number of objects freed on this CPU to a remote NUMA partition.
+    std::atomic<size_t> num_remote_frees;
+    // Remote frees pending release, indexed by the objects' home partition.
+    RemoteFrees remote_frees[kNumaPartitions];
+    // The cpu to hand overflows of each size class to, or -1.
+    std::atomic<int32_t> handoff_cpu[kNumClasses];
+    // Tracks number of objects handed off to this CPU by others.
+    std::atomic<size_t> num_handoffs;
+    HandoffBuffer handoff;
   };
 
   struct DynamicSlabInfo {
@@ -564,6 +920,12 @@ class CpuCache {
     std::atomic<size_t> madvise_failed_bytes;
   };
 
+  // Returns <cpu>'s ResizeInfo, initializing <cpu> on its first use.
+  ResizeInfo& GetResizeInfo(int cpu);
+
+  // Returns the cache capacity that <cpu> starts with on its first use.
+  size_t InitialCapacity(int cpu) const;
+
   // Determines how we distribute memory in the per-cpu cache to the various
   // class sizes.
   size_t MaxCapacity(size_t size_class) const;
@@ -573,6 +935,12 @@ class CpuCache {
 
   GetShiftMaxCapacity GetMaxCapacityFunctor(uint8_t shift) const;
 
+  // Lays out the slabs of the cpus populated or resized from now on with the
+  // slot arrays of the size classes in decreasing order of <use>, so that
+  // those of the busiest classes are packed next to the headers; see
+  // TcmallocSlab::SetLayoutOrder.
+  void SetLayoutOrder(absl::FunctionRef<size_t(size_t)> use);
+
   // Fetches objects from backing transfer cache.
   int FetchFromBackingCache(size_t size_class, void** batch, size_t count);
 
@@ -581,6 +949,27 @@ class CpuCache {
 
   void* Refill(int cpu, size_t size_class);
 
+  // Releases <count> objects staged by DeallocateRemote or HandOff to the
+  // transfer caches of their size classes.  <size_class> and <obj> are
+  // reordered.
+  void ReleaseRemoteFrees(CompactSizeClass* size_class, void** obj, int count);
+
+  // Releases all objects staged by DeallocateRemote on <cpu>.  Returns the
+  // number of bytes released.
+  uint64_t DrainRemoteFrees(int cpu);
+
+  // Stages up to <count> objects of <size_class> from the end of <batch> in the
+  // handoff buffer of <cpu>.  Returns the number of objects staged.
+  size_t HandOff(int cpu, size_t size_class, void** batch, size_t count);
+
+  // Moves up to <count> objects of <size_class> from the handoff buffer of
+  // <cpu> to <batch>.  Returns the number of objects moved.
+  size_t TakeHandoffs(int cpu, size_t size_class, void** batch, size_t count);
+
+  // Releases all objects staged in the handoff buffer of <cpu>.  Returns the
+  // number of bytes released.
+  uint64_t DrainHandoffs(int cpu);
+
   // Returns true if we bypass cpu cache for a <size_class>. We may bypass
   // per-cpu cache when we enable certain configurations of sharded transfer
   // cache.
@@ -641,15 +1030,30 @@ class CpuCache {
   // (3) source cpu is not the same as the destination cpu
   // (4) capacity of the source cpu/size_class is non-zero
   //
+  // Candidates sharing <cpu>'s L3 cache are tried first, then those in its
+  // NUMA partition, and only then the others (see StealLocality).
+  //
   // For a given source cpu, we iterate through the size classes to steal from
   // them. Currently, we use a similar clock-like algorithm from Steal() to
   // identify the size_class to steal from.
   void StealFromOtherCache(int cpu, int max_populated_cpu, size_t bytes);
 
+  // How close <src_cpu> is to <cpu> in the order StealFromOtherCache() takes
+  // capacity in: 0 if they share an L3 cache and NUMA partition, 1 if they
+  // only share a partition, and 2 otherwise.  Capacity moved between nearby
+  // caches follows the objects, which the two cpus refill from the same
+  // shards of the transfer cache and, across partitions, from different size
+  // classes altogether.
+  int StealLocality(int cpu, int src_cpu) const;
+  static constexpr int kNumStealLocalities = 3;
+
   // Resizes capacities of up to kMaxSizeClassesToResize size classes for a
   // single <cpu>.
   void ResizeCpuSizeClasses(int cpu);
 
+  // Sets the capacities of all size classes for a single <cpu>.
+  void TuneCpuCapacities(int cpu);
+
   // <shift_offset> is the offset of the shift in slabs_by_shift_. Note that we
   // can't calculate this from `shift` directly due to numa shift.
   // Returns the allocated slabs and the number of reused bytes.
@@ -657,9 +1061,16 @@ class CpuCache {
       absl::FunctionRef<void*(size_t, std::align_val_t)> alloc,
       subtle::percpu::Shift shift, int num_cpus, uint8_t shift_offset);
 
+  // Binds each cpu's region of <slabs> to the NUMA partition of that cpu, so
+  // that the fast path only accesses node-local memory.
+  void BindSlabsToPartitions(Freelist::Slabs* slabs,
+                             subtle::percpu::Shift shift, int num_cpus);
+
   Freelist freelist_;
 
-  // Tracking data for each CPU's cache resizing efforts.
+  CpuState* cpu_state_ = nullptr;
+  // Tracking data for each CPU's cache resizing efforts.  Only populated CPUs'
+  // entries are initialized; use GetResizeInfo().
   ResizeInfo* resize_ = nullptr;
 
   // Tracks initial and maximum slab shift bounds.
@@ -677,9 +1088,45 @@ class CpuCache {
   // round-robin fashion.
   std::atomic<int> last_cpu_size_class_resize_ = 0;
 
+  std::atomic<uint64_t> num_capacity_tunes_ = 0;
+
+  // The cpus allowed as of the last call to ReclaimDisallowedCaches(), which is
+  // only called from a single thread.
+  cpu_set_t allowed_cpus_{};
+
+  // State of UpdateHandoffTargets(), which is only called from a single
+  // thread: whether any cpus may be paired, and when it last ran.
+  bool handoff_active_ = false;
+  int64_t last_handoff_update_ = 0;
+  // Size classes passed to RequestHandoff(), and whether there are any.
+  std::atomic<bool> handoff_requested_[kNumClasses] = {};
+  std::atomic<bool> any_handoff_requested_ = false;
+
+  // Batch lengths set by UpdateBatchLengths(), or 0 for
+  // num_objects_to_move(), and the underflows and overflows of each size
+  // class since it last ran.  Misses are only counted while
+  // per_cpu_caches_adaptive_batches is enabled.
+  std::atomic<uint16_t> batch_length_[kNumClasses] = {};
+  std::atomic<uint32_t> batch_misses_[kNumClasses] = {};
+  std::atomic<uint64_t> num_batch_updates_ = 0;
+
+  // Capacities set by SetWarmCapacity().
+  std::atomic<uint16_t> warm_capacity_[kNumClasses] = {};
+
   // Per-core cache limit in bytes.
   std::atomic<uint64_t> max_per_cpu_cache_size_{kMaxCpuCacheSize};
 
+  // Threads migrate between the cpus faster than idle caches are reclaimed,
+  // so a quota of N cpus keeps more than N caches busy.
+  static constexpr int kCpuQuotaHeadroom = 2;
+  // See CpuQuotaBudget().
+  std::atomic<int> cpu_quota_budget_ = 0;
+
+  // Objects of each size class fetched from and released to the backing
+  // caches.  See GetSizeClassFlow().
+  std::atomic<uint64_t> fetched_[kNumClasses] = {};
+  std::atomic<uint64_t> released_[kNumClasses] = {};
+
   ABSL_ATTRIBUTE_NO_UNIQUE_ADDRESS Forwarder forwarder_;
 
   DynamicSlabInfo dynamic_slab_info_{};
@@ -727,35 +1174,11 @@ ABSL_ATTRIBUTE_ALWAYS_INLINE
 
 template <class Forwarder>
 void CpuCache<Forwarder>::MaybeForceSlowPath() {
-  if (ABSL_PREDICT_FALSE(Static::HaveHooks())) {
+  if (ABSL_PREDICT_FALSE(Static::HaveHooks() || bypass_per_cpu_caches)) {
     freelist_.UncacheCpuSlab();
   }
 }
 
-static cpu_set_t FillActiveCpuMask() {
-  cpu_set_t allowed_cpus;
-  if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) != 0) {
-    CPU_ZERO(&allowed_cpus);
-  }
-
-#ifdef PERCPU_USE_RSEQ
-  const bool real_cpus = !subtle::percpu::UsingFlatVirtualCpus();
-#else
-  const bool real_cpus = true;
-#endif
-
-  if (real_cpus) {
-    return allowed_cpus;
-  }
-
-  const int virtual_cpu_count = CPU_COUNT(&allowed_cpus);
-  CPU_ZERO(&allowed_cpus);
-  for (int cpu = 0; cpu < virtual_cpu_count; ++cpu) {
-    CPU_SET(cpu, &allowed_cpus);
-  }
-  return allowed_cpus;
-}
-
 template <class Forwarder>
 inline size_t CpuCache<Forwarder>::MaxCapacity(size_t size_class) const {
   // The number of size classes that are commonly used and thus should be
@@ -777,6 +1200,12 @@ inline size_t CpuCache<Forwarder>::MaxCapacity(size_t size_class) const {
   // Each Size class region in the slab is preceded by one padding pointer that
   // points to itself, because prefetch instructions of invalid pointers are
   // slow. That is accounted for by the +1 for object depths.
+  const uint8_t numa_capacity_shift =
+      NumaCapacityShift(forwarder_.numa_topology());
+  const auto numa_scaled = [numa_capacity_shift](int depth) -> uint16_t {
+    if (numa_capacity_shift == 0) return depth;
+    return std::max((depth >> numa_capacity_shift) - 3, 0);
+  };
 #if defined(TCMALLOC_INTERNAL_SMALL_BUT_SLOW)
   // With SMALL_BUT_SLOW we have 4KiB of per-cpu slab and 46 class sizes we
   // allocate:
@@ -791,16 +1220,22 @@ inline size_t CpuCache<Forwarder>::MaxCapacity(size_t size_class) const {
   //   89 * 8 + 8 * ((2048 + 1) * 10 + (152 + 1) * 78) = 254 KiB
   // For 512KiB slab, with a multiplier of 2, maximum footprint is:
   //   89 * 8 + 8 * ((4096 + 1) * 10 + (304 + 1) * 78) = 506 KiB
-  const uint16_t kSmallObjectDepth =
+  //
+  // With more than two NUMA partitions, each partition's copy of a size class
+  // gets a smaller share of the 512KiB slab.  As in GetShiftMaxCapacity, we
+  // also decrement by 3 since the per-size-class header and padding pointer
+  // do not shrink.  For 8 partitions:
+  //   712 * 8 + 8 * ((509 + 1) * 80 + (35 + 1) * 624) = 500 KiB
+  const uint16_t kSmallObjectDepth = numa_scaled(
       (ConfigureSizeClassMaxCapacity()
            ? tc_globals.sizemap().max_capacity(size_class)
            : 2048) *
-      kWiderSlabMultiplier;
-  const uint16_t kLargeObjectDepth =
+      kWiderSlabMultiplier);
+  const uint16_t kLargeObjectDepth = numa_scaled(
       (ConfigureSizeClassMaxCapacity()
            ? tc_globals.sizemap().max_capacity(size_class)
            : 152) *
-      kWiderSlabMultiplier;
+      kWiderSlabMultiplier);
 #endif
   if (size_class == 0 || size_class >= kNumClasses) {
     return 0;
@@ -825,12 +1260,13 @@ inline size_t CpuCache<Forwarder>::MaxCapacity(size_t size_class) const {
   if (ColdFeatureActive()) {
     // We reduce the number of cached objects for some sizes to fit into the
     // slab.
-    const uint16_t kLargeUninterestingObjectDepth =
+    const uint16_t kLargeUninterestingObjectDepth = numa_scaled(
         (ConfigureSizeClassMaxCapacity()
              ? tc_globals.sizemap().max_capacity(size_class)
              : 133) *
-        kWiderSlabMultiplier;
-    const uint16_t kLargeInterestingObjectDepth = 53 * kWiderSlabMultiplier;
+        kWiderSlabMultiplier);
+    const uint16_t kLargeInterestingObjectDepth =
+        numa_scaled(53 * kWiderSlabMultiplier);
 
     absl::Span<const size_t> cold = forwarder_.cold_size_classes();
     if (absl::c_binary_search(cold, size_class)) {
@@ -881,6 +1317,9 @@ inline GetShiftMaxCapacity CpuCache<Forwarder>::GetMaxCapacityFunctor(
 
 template <class Forwarder>
 inline bool CpuCache<Forwarder>::UseWiderSlabs() const {
+  // With more than two NUMA partitions compiled in, NumaShift always widens
+  // the slab, so there is no room to widen it further.
+  if constexpr (kNumaPartitions > 2) return false;
   return forwarder_.UseWiderSlabs();
 }
 
@@ -900,7 +1339,10 @@ inline void CpuCache<Forwarder>::Activate() {
 
   shift_bounds_.initial_shift = kInitialBasePerCpuShift;
   shift_bounds_.max_shift = kMaxBasePerCpuShift;
-  uint8_t per_cpu_shift = forwarder_.per_cpu_caches_dynamic_slab_enabled()
+  // In small-footprint mode, slabs start small even without dynamic slabs,
+  // and do not grow.
+  uint8_t per_cpu_shift = forwarder_.per_cpu_caches_dynamic_slab_enabled() ||
+                                  forwarder_.small_footprint()
                               ? kInitialBasePerCpuShift
                               : kMaxBasePerCpuShift;
 
@@ -946,20 +1388,28 @@ inline void CpuCache<Forwarder>::Activate() {
     }
   }
 
+  cpu_state_ = reinterpret_cast<CpuState*>(forwarder_.Alloc(
+      sizeof(CpuState) * num_cpus, std::align_val_t{alignof(CpuState)}));
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    new (&cpu_state_[cpu]) CpuState();
+  }
+  // Like the slabs, this is only touched as CPUs are first used.
   resize_ = reinterpret_cast<ResizeInfo*>(forwarder_.Alloc(
       sizeof(ResizeInfo) * num_cpus, std::align_val_t{alignof(ResizeInfo)}));
 
-  auto max_cache_size = CacheLimit();
-
-  for (int cpu = 0; cpu < num_cpus; ++cpu) {
-    new (&resize_[cpu]) ResizeInfo();
+  allowed_cpus_ = forwarder_.AllowedCpus();
+  UpdateCpuQuota();
 
-    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
-      resize_[cpu].per_class[size_class].Init();
-    }
-    resize_[cpu].available.store(max_cache_size, std::memory_order_relaxed);
-    resize_[cpu].capacity.store(max_cache_size, std::memory_order_relaxed);
-    resize_[cpu].last_steal.store(1, std::memory_order_relaxed);
+  // Without observations yet, the busiest size classes are those that a
+  // demand profile warm starts, if any.
+  bool warm = false;
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    warm |= warm_capacity_[size_class].load(std::memory_order_relaxed) != 0;
+  }
+  if (warm) {
+    SetLayoutOrder([&](size_t size_class) {
+      return warm_capacity_[size_class].load(std::memory_order_relaxed);
+    });
   }
 
   Freelist::Slabs* slabs =
@@ -984,22 +1434,90 @@ inline void CpuCache<Forwarder>::Deactivate() {
                 "ResizeInfo is expected to be trivially destructible");
   forwarder_.Dealloc(resize_, sizeof(*resize_) * num_cpus,
                      std::align_val_t{alignof(decltype(*resize_))});
+  static_assert(std::is_trivially_destructible<decltype(*cpu_state_)>::value,
+                "CpuState is expected to be trivially destructible");
+  forwarder_.Dealloc(cpu_state_, sizeof(*cpu_state_) * num_cpus,
+                     std::align_val_t{alignof(decltype(*cpu_state_))});
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::AcquireInternalLocks() {
+  const int num_cpus = NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    cpu_state_[cpu].lock.Lock();
+  }
+  // The remote free and handoff locks are never held while taking a cpu's
+  // lock, so they go last.  populated is only set under the cpu's lock, so it
+  // is stable from here on.
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    if (!HasPopulated(cpu)) continue;
+    ResizeInfo& resize = resize_[cpu];
+    for (RemoteFrees& remote : resize.remote_frees) remote.lock.Lock();
+    resize.handoff.lock.Lock();
+  }
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::ReleaseInternalLocks() {
+  const int num_cpus = NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    if (!HasPopulated(cpu)) continue;
+    ResizeInfo& resize = resize_[cpu];
+    resize.handoff.lock.Unlock();
+    for (RemoteFrees& remote : resize.remote_frees) remote.lock.Unlock();
+  }
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    cpu_state_[cpu].lock.Unlock();
+  }
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::ReleaseInternalLocksInChild(
+    bool slabs_wiped) {
+  const int num_cpus = NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    // A cpu that is not populated may have a thread of the parent, which does
+    // not exist in the child, midway through its initialization.  Restarting
+    // its CpuState also releases the lock, and the cpu's ResizeInfo, which
+    // holds the other locks, is rebuilt on the cpu's first use.
+    if (slabs_wiped || !HasPopulated(cpu)) {
+      new (&cpu_state_[cpu]) CpuState();
+      continue;
+    }
+    ResizeInfo& resize = resize_[cpu];
+    resize.handoff.lock.Unlock();
+    for (RemoteFrees& remote : resize.remote_frees) remote.lock.Unlock();
+    cpu_state_[cpu].lock.Unlock();
+  }
+}
+
+template <class Forwarder>
+inline bool CpuCache<Forwarder>::AdviseSlabs(int advice) {
+  const auto [slabs, shift] = freelist_.GetSlabsUnlessResizing();
+  if (slabs == nullptr) return false;
+  ErrnoRestorer errno_restorer;
+  return madvise(slabs, GetSlabsAllocSize(shift, NumCPUs()), advice) == 0;
 }
 
 template <class Forwarder>
 inline int CpuCache<Forwarder>::FetchFromBackingCache(size_t size_class,
                                                       void** batch,
                                                       size_t count) {
+  int got;
   if (UseBackingShardedTransferCache(size_class)) {
-    return forwarder_.sharded_transfer_cache().RemoveRange(size_class, batch,
-                                                           count);
+    got = forwarder_.sharded_transfer_cache().RemoveRange(size_class, batch,
+                                                          count);
+  } else {
+    got = forwarder_.transfer_cache().RemoveRange(size_class, batch, count);
   }
-  return forwarder_.transfer_cache().RemoveRange(size_class, batch, count);
+  fetched_[size_class].fetch_add(got, std::memory_order_relaxed);
+  return got;
 }
 
 template <class Forwarder>
 inline void CpuCache<Forwarder>::ReleaseToBackingCache(
     size_t size_class, absl::Span<void*> batch) {
+  released_[size_class].fetch_add(batch.size(), std::memory_order_relaxed);
   if (UseBackingShardedTransferCache(size_class)) {
     forwarder_.sharded_transfer_cache().InsertRange(size_class, batch);
     return;
@@ -1012,13 +1530,18 @@ template <class Forwarder>
 void* CpuCache<Forwarder>::AllocateSlow(size_t size_class) {
   void* ret = AllocateSlowNoHooks(size_class);
   MaybeForceSlowPath();
+  forwarder_.MaybeRunBackgroundSlice();
   return ret;
 }
 
 template <class Forwarder>
 void* CpuCache<Forwarder>::AllocateSlowNoHooks(size_t size_class) {
   if (BypassCpuCache(size_class)) {
-    return forwarder_.sharded_transfer_cache().Pop(size_class);
+    void* ret = forwarder_.sharded_transfer_cache().Pop(size_class);
+    if (ret != nullptr) {
+      fetched_[size_class].fetch_add(1, std::memory_order_relaxed);
+    }
+    return ret;
   }
   auto [cpu, cached] = freelist_.CacheCpuSlab();
   if (ABSL_PREDICT_FALSE(cached)) {
@@ -1042,6 +1565,9 @@ void* CpuCache<Forwarder>::AllocateSlowNoHooks(size_t size_class) {
 // return memory to the correct CPU.)
 template <class Forwarder>
 inline void* CpuCache<Forwarder>::Refill(int cpu, size_t size_class) {
+  ScopedLatencyTimer timer(LatencyStage::kCpuCacheRefill, size_class);
+  ScopedCpuTimer cpu_timer(CpuTimePath::kCpuCacheRefill);
+  const int64_t probe_start = TCMALLOC_PROBE_START(cpu_cache_refill);
   // UpdateCapacity can evict objects from other size classes as it tries to
   // increase capacity of this size class. The objects are returned in
   // to_return, we insert them into transfer cache at the end of function
@@ -1059,20 +1585,27 @@ inline void* CpuCache<Forwarder>::Refill(int cpu, size_t size_class) {
 
   do {
     const size_t want = std::min(kMaxObjectsToMove, target - total);
-    got = FetchFromBackingCache(size_class, batch, want);
+    // Objects handed off by the cpus freeing this size class come first.
+    got = TakeHandoffs(cpu, size_class, batch, want);
+    if (got < want) {
+      got += FetchFromBackingCache(size_class, batch + got, want - got);
+    }
     if (got == 0) {
       break;
     }
     total += got;
     i = got;
+    // Batches list their objects most recently freed first: return the first
+    // one, and push the rest so that the next one is on top of the slab.
+    void** objects = batch;
     if (result == nullptr) {
       i--;
-      result = batch[i];
+      result = *objects++;
     }
     if (i) {
-      i -= freelist_.PushBatch(size_class, batch, i);
+      i -= freelist_.PushBatch(size_class, objects, i);
       if (i != 0) {
-        ReleaseToBackingCache(size_class, {batch, i});
+        ReleaseToBackingCache(size_class, {objects, i});
       }
     }
   } while (got == kMaxObjectsToMove && i == 0 && total < target);
@@ -1081,6 +1614,8 @@ inline void* CpuCache<Forwarder>::Refill(int cpu, size_t size_class) {
     ReleaseToBackingCache(to_return.size_class[i], {&(to_return.obj[i]), 1});
   }
 
+  TCMALLOC_PROBE(cpu_cache_refill, size_class, total,
+                 ProbeLatencyNs(probe_start));
   return result;
 }
 
@@ -1165,24 +1700,16 @@ inline size_t CpuCache<Forwarder>::UpdateCapacity(int cpu, size_t size_class,
   // We assert that the return value, target, is non-zero, so starting from an
   // initial capacity of zero means we may be populating this core for the
   // first time.
-  absl::base_internal::LowLevelCallOnce(
-      &resize_[cpu].initialized,
-      [](CpuCache* cache, int cpu) {
-        AllocationGuardSpinLockHolder h(&cache->resize_[cpu].lock);
-        cache->freelist_.InitCpu(
-            cpu, cache->GetMaxCapacityFunctor(cache->freelist_.GetShift()));
-
-        // We update this under the lock so it's guaranteed that the populated
-        // CPUs don't change during ResizeSlabs.
-        cache->resize_[cpu].populated.store(true, std::memory_order_relaxed);
-      },
-      this, cpu);
-  size_t batch_length = forwarder_.num_objects_to_move(size_class);
-  const size_t max_capacity = GetMaxCapacity(size_class, freelist_.GetShift());
+  ResizeInfo& resize = GetResizeInfo(cpu);
+  if (forwarder_.per_cpu_caches_adaptive_batches()) {
+    batch_misses_[size_class].fetch_add(1, std::memory_order_relaxed);
+  }
+  size_t batch_length = BatchLength(size_class);
+  const size_t max_capacity =
+      GetMaxCapacity(size_class, freelist_.GetShift(cpu));
   size_t capacity = freelist_.Capacity(cpu, size_class);
   const bool grow_by_one = capacity < 2 * batch_length;
   uint32_t successive = 0;
-  ResizeInfo& resize = resize_[cpu];
   const int64_t now = absl::base_internal::CycleClock::Now();
   // TODO(ckennelly): Use a strongly typed enum.
   resize.last_miss_cycles[overflow][size_class].store(
@@ -1198,6 +1725,13 @@ inline size_t CpuCache<Forwarder>::UpdateCapacity(int cpu, size_t size_class,
       // what we want to request from transfer cache.
       increase = batch_length - capacity;
     }
+    if (capacity == 0) {
+      increase = std::max<size_t>(
+          increase,
+          std::min<size_t>(
+              warm_capacity_[size_class].load(std::memory_order_relaxed),
+              max_capacity));
+    }
     Grow(cpu, size_class, increase, to_return);
     capacity = freelist_.Capacity(cpu, size_class);
   }
@@ -1214,7 +1748,8 @@ inline void CpuCache<Forwarder>::Grow(int cpu, size_t size_class,
 
   // First, there might be unreserved slack.  Take what we can.
   for (;;) {
-    size_t before = resize_[cpu].available.load(std::memory_order_relaxed);
+    size_t before =
+        GetResizeInfo(cpu).available.load(std::memory_order_relaxed);
     // Skip atomic RMW if we have less than 6% of one object spare capacity.
     // This number is somewhat arbitrary, the idea is to avoid the RMW cost
     // if the remaining spare capacity is unlikely to help to avoid stealing.
@@ -1222,7 +1757,7 @@ inline void CpuCache<Forwarder>::Grow(int cpu, size_t size_class,
       break;
     }
     size_t can_acquire = std::min(before, desired_bytes);
-    if (resize_[cpu].available.compare_exchange_strong(
+    if (GetResizeInfo(cpu).available.compare_exchange_strong(
             before, before - can_acquire, std::memory_order_relaxed)) {
       acquired_bytes = can_acquire;
       break;
@@ -1230,7 +1765,7 @@ inline void CpuCache<Forwarder>::Grow(int cpu, size_t size_class,
   }
 
   if (acquired_bytes < desired_bytes) {
-    resize_[cpu].per_class[size_class].RecordMiss();
+    GetResizeInfo(cpu).per_class[size_class].RecordMiss();
   }
 
   // We have all the memory we could reserve.  Time to actually do the growth.
@@ -1247,12 +1782,12 @@ inline void CpuCache<Forwarder>::Grow(int cpu, size_t size_class,
   if (increased_bytes < acquired_bytes) {
     // return whatever we didn't use to the slack.
     size_t unused = acquired_bytes - increased_bytes;
-    resize_[cpu].available.fetch_add(unused, std::memory_order_relaxed);
+    GetResizeInfo(cpu).available.fetch_add(unused, std::memory_order_relaxed);
   }
 }
 
 template <class Forwarder>
-inline void CpuCache<Forwarder>::TryReclaimingCaches() {
+inline void CpuCache<Forwarder>::TryReclaimingCaches(int partition) {
   const int num_cpus = NumCPUs();
 
   for (int cpu = 0; cpu < num_cpus; ++cpu) {
@@ -1260,10 +1795,15 @@ inline void CpuCache<Forwarder>::TryReclaimingCaches() {
     if (!HasPopulated(cpu)) {
       continue;
     }
+    if (partition >= 0 &&
+        static_cast<int>(forwarder_.numa_topology().GetCpuPartition(cpu)) !=
+            partition) {
+      continue;
+    }
 
     uint64_t used_bytes = UsedBytes(cpu);
     uint64_t prev_used_bytes =
-        resize_[cpu].reclaim_used_bytes.load(std::memory_order_relaxed);
+        GetResizeInfo(cpu).reclaim_used_bytes.load(std::memory_order_relaxed);
 
     // Get reclaim miss and used bytes stats that were captured at the end of
     // the previous interval.
@@ -1283,11 +1823,31 @@ inline void CpuCache<Forwarder>::TryReclaimingCaches() {
     //
     // Reclaim occurs on a single thread. So, the relaxed store to used_bytes
     // is safe.
-    resize_[cpu].reclaim_used_bytes.store(used_bytes,
+    GetResizeInfo(cpu).reclaim_used_bytes.store(used_bytes,
                                           std::memory_order_relaxed);
   }
 }
 
+template <class Forwarder>
+inline uint64_t CpuCache<Forwarder>::ReclaimDisallowedCaches() {
+  const cpu_set_t allowed_cpus = forwarder_.AllowedCpus();
+  // An empty mask means that sched_getaffinity failed.
+  if (CPU_COUNT(&allowed_cpus) == 0 ||
+      CPU_EQUAL(&allowed_cpus, &allowed_cpus_)) {
+    return 0;
+  }
+
+  uint64_t bytes = 0;
+  const int num_cpus = NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed_cpus_) && !CPU_ISSET(cpu, &allowed_cpus)) {
+      bytes += Reclaim(cpu);
+    }
+  }
+  allowed_cpus_ = allowed_cpus;
+  return bytes;
+}
+
 struct SizeClassMissStat {
   size_t size_class;
   size_t misses;
@@ -1320,7 +1880,7 @@ inline void CpuCache<Forwarder>::ResizeSizeClasses() {
     // Record full stats in previous full stat counters so that we can collect
     // stats per interval.
     for (size_t size_class = 1; size_class < kNumClasses; ++size_class) {
-      resize_[cpu].per_class[size_class].UpdateIntervalMisses(
+      GetResizeInfo(cpu).per_class[size_class].UpdateIntervalMisses(
           PerClassMissType::kResize);
     }
 
@@ -1337,7 +1897,7 @@ void CpuCache<Forwarder>::ResizeCpuSizeClasses(int cpu) {
   for (size_t size_class = 1; size_class < kNumClasses; ++size_class) {
     miss_stats[size_class - 1] = SizeClassMissStat{
         .size_class = size_class,
-        .misses = resize_[cpu].per_class[size_class].GetIntervalMisses(
+        .misses = GetResizeInfo(cpu).per_class[size_class].GetIntervalMisses(
             PerClassMissType::kResize)};
   }
 
@@ -1367,28 +1927,27 @@ void CpuCache<Forwarder>::ResizeCpuSizeClasses(int cpu) {
     const ssize_t can_grow = max_capacity(size_class_to_grow) -
                              freelist_.Capacity(cpu, size_class_to_grow);
     // can_grow can be negative only if slabs were resized,
-    // but since we hold resize_[cpu].lock it must not happen.
+    // but since we hold cpu_state_[cpu].lock it must not happen.
     ASSERT(can_grow >= 0);
     if (can_grow <= 0) {
       continue;
     }
 
-    resize_[cpu].num_size_class_resizes.fetch_add(1, std::memory_order_relaxed);
+    GetResizeInfo(cpu).num_size_class_resizes.fetch_add(
+        1, std::memory_order_relaxed);
 
     size_t size = forwarder_.class_to_size(size_class_to_grow);
     // Get total bytes to steal from other size classes. We would like to grow
     // the capacity of the size class by a batch size.
     const size_t to_steal_bytes =
-        std::min<size_t>(can_grow,
-                         forwarder_.num_objects_to_move(size_class_to_grow)) *
-        size;
+        std::min<size_t>(can_grow, BatchLength(size_class_to_grow)) * size;
 
     size_t acquired_bytes = StealCapacityForSizeClassWithinCpu(
         cpu, size_class_to_grow, to_steal_bytes);
     size_t capacity_acquired = acquired_bytes / size;
     size_t actual_increase = 0;
     if (capacity_acquired != 0) {
-      AllocationGuardSpinLockHolder h(&resize_[cpu].lock);
+      AllocationGuardSpinLockHolder h(&cpu_state_[cpu].lock);
       actual_increase = freelist_.GrowOtherCache(
           cpu, size_class_to_grow, capacity_acquired, [&](uint8_t shift) {
             return GetMaxCapacity(size_class_to_grow, shift);
@@ -1402,7 +1961,149 @@ void CpuCache<Forwarder>::ResizeCpuSizeClasses(int cpu) {
     if (actual_increased_bytes < acquired_bytes) {
       // return whatever we didn't use to the slack.
       size_t unused = acquired_bytes - actual_increased_bytes;
-      resize_[cpu].available.fetch_add(unused, std::memory_order_relaxed);
+      GetResizeInfo(cpu).available.fetch_add(unused, std::memory_order_relaxed);
+    }
+  }
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::TuneCapacities() {
+  const int num_cpus = NumCPUs();
+  int cpu = last_cpu_size_class_resize_.load(std::memory_order_relaxed);
+  int num_cpus_tuned = 0;
+
+  for (int cpu_offset = 0; cpu_offset < num_cpus; ++cpu_offset) {
+    if (++cpu >= num_cpus) {
+      cpu = 0;
+    }
+    ASSERT(cpu >= 0);
+    ASSERT(cpu < num_cpus);
+
+    // Nothing to tune if the cache is not populated.
+    if (!HasPopulated(cpu)) {
+      continue;
+    }
+
+    TuneCpuCapacities(cpu);
+
+    if (++num_cpus_tuned >= kNumCpuCachesToResize) break;
+  }
+  last_cpu_size_class_resize_.store(cpu, std::memory_order_relaxed);
+  num_capacity_tunes_.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <class Forwarder>
+void CpuCache<Forwarder>::TuneCpuCapacities(int cpu) {
+  ResizeInfo& resize = GetResizeInfo(cpu);
+  const auto max_capacity = GetMaxCapacityFunctor(freelist_.GetShift());
+
+  struct GrowCandidate {
+    size_t size_class;
+    size_t misses;
+    size_t to_grow;
+  };
+  absl::FixedArray<GrowCandidate> candidates(kNumClasses - 1);
+  size_t num_candidates = 0;
+  size_t freed_bytes = 0;
+
+  for (size_t size_class = 1; size_class < kNumClasses; ++size_class) {
+    PerClassResizeInfo& per_class = resize.per_class[size_class];
+    TuneInfo& tune = resize.tune[size_class];
+    const size_t size = forwarder_.class_to_size(size_class);
+    const size_t batch_length = BatchLength(size_class);
+    const size_t max_cap = max_capacity(size_class);
+
+    const size_t misses = std::min<size_t>(
+        tune.misses.load(std::memory_order_relaxed) / 2 +
+            per_class.GetIntervalMisses(PerClassMissType::kTune),
+        std::numeric_limits<uint32_t>::max());
+    per_class.UpdateIntervalMisses(PerClassMissType::kTune);
+    tune.misses.store(misses, std::memory_order_relaxed);
+
+    size_t working_set = tune.working_set.load(std::memory_order_relaxed);
+    working_set = std::max(freelist_.Length(cpu, size_class),
+                           working_set - (working_set + 3) / 4);
+    tune.working_set.store(working_set, std::memory_order_relaxed);
+
+    size_t capacity = freelist_.Capacity(cpu, size_class);
+    if (misses == 0) {
+      // A class that does not miss only needs room for its working set, plus a
+      // batch so that a refill does not overflow it right away.  Close half of
+      // the gap per interval, so that a class that briefly goes idle does not
+      // lose all of its capacity at once.
+      const size_t needed =
+          std::min({capacity, max_cap,
+                    working_set == 0 ? 0 : working_set + batch_length});
+      const size_t target = capacity - (capacity - needed + 1) / 2;
+      if (target < capacity) {
+        AllocationGuardSpinLockHolder h(&cpu_state_[cpu].lock);
+        const size_t shrunk = freelist_.ShrinkOtherCache(
+            cpu, size_class, capacity - target,
+            [this](size_t size_class, void** batch, size_t count) {
+              ASSERT(count > 0);
+              ReleaseToBackingCache(size_class,
+                                    absl::Span<void*>(batch, count));
+            });
+        freed_bytes += shrunk * size;
+        capacity -= shrunk;
+      }
+      tune.target.store(capacity, std::memory_order_relaxed);
+    } else {
+      // Grow by up to a batch per recent miss.
+      constexpr size_t kMaxBatchesToGrow = 4;
+      const size_t to_grow =
+          std::min(max_cap - std::min(capacity, max_cap),
+                   batch_length * std::min(misses, kMaxBatchesToGrow));
+      tune.target.store(capacity + to_grow, std::memory_order_relaxed);
+      if (to_grow > 0) {
+        candidates[num_candidates++] = {size_class, misses, to_grow};
+      }
+    }
+  }
+  if (freed_bytes > 0) {
+    resize.available.fetch_add(freed_bytes, std::memory_order_relaxed);
+  }
+
+  // Hand out the unallocated capacity to the classes that save the most misses
+  // per byte first.
+  std::sort(candidates.begin(), candidates.begin() + num_candidates,
+            [this](const GrowCandidate& a, const GrowCandidate& b) {
+              return a.misses * forwarder_.class_to_size(b.size_class) >
+                     b.misses * forwarder_.class_to_size(a.size_class);
+            });
+  for (size_t i = 0; i < num_candidates; ++i) {
+    const GrowCandidate& candidate = candidates[i];
+    const size_t size = forwarder_.class_to_size(candidate.size_class);
+
+    size_t acquired_bytes = 0;
+    size_t available = resize.available.load(std::memory_order_relaxed);
+    while (available >= size) {
+      acquired_bytes = std::min(available / size, candidate.to_grow) * size;
+      if (resize.available.compare_exchange_weak(
+              available, available - acquired_bytes,
+              std::memory_order_relaxed)) {
+        break;
+      }
+      acquired_bytes = 0;
+    }
+    if (acquired_bytes == 0) continue;
+
+    size_t actual_increase;
+    {
+      AllocationGuardSpinLockHolder h(&cpu_state_[cpu].lock);
+      actual_increase = freelist_.GrowOtherCache(
+          cpu, candidate.size_class, acquired_bytes / size,
+          [&](uint8_t shift) {
+            return GetMaxCapacity(candidate.size_class, shift);
+          });
+    }
+    resize.num_size_class_resizes.fetch_add(1, std::memory_order_relaxed);
+
+    // Return whatever we could not use to the slack.
+    const size_t actual_increased_bytes = actual_increase * size;
+    if (actual_increased_bytes < acquired_bytes) {
+      resize.available.fetch_add(acquired_bytes - actual_increased_bytes,
+                                 std::memory_order_relaxed);
     }
   }
 }
@@ -1498,10 +2199,14 @@ inline void CpuCache<Forwarder>::StealFromOtherCache(int cpu,
   // search. The approximation prevents us from doing another pass through the
   // cpus to just find the latest populated cpu id.
   //
-  // We break from the loop once we iterate through all the cpus once, or if the
-  // total number of acquired bytes is higher than or equal to the desired bytes
-  // we want to steal.
-  for (int cpu_offset = 1; cpu_offset <= max_populated_cpu && acquired < bytes;
+  // We break from the loop once we iterate through all the cpus once per
+  // locality, nearest first (see StealLocality), or if the total number of
+  // acquired bytes is higher than or equal to the desired bytes we want to
+  // steal.  Capacity thus only leaves a more distant cache once the nearer
+  // ones have none to spare.
+  const int num_candidates = max_populated_cpu + 1;
+  for (int cpu_offset = 1;
+       cpu_offset <= kNumStealLocalities * num_candidates && acquired < bytes;
        ++cpu_offset) {
     if (--src_cpu < 0) {
       src_cpu = max_populated_cpu;
@@ -1513,6 +2218,11 @@ inline void CpuCache<Forwarder>::StealFromOtherCache(int cpu,
     // with stealing from the same CPU later.
     if (src_cpu == cpu) continue;
 
+    // Each pass over the cpus only considers those at its distance from <cpu>.
+    if (StealLocality(cpu, src_cpu) != (cpu_offset - 1) / num_candidates) {
+      continue;
+    }
+
     // We do not steal from the cache that hasn't been populated yet.
     if (!HasPopulated(src_cpu)) continue;
 
@@ -1531,7 +2241,7 @@ inline void CpuCache<Forwarder>::StealFromOtherCache(int cpu,
       continue;
 
     size_t start_size_class =
-        resize_[src_cpu].last_steal.load(std::memory_order_relaxed);
+        GetResizeInfo(src_cpu).last_steal.load(std::memory_order_relaxed);
 
     ASSERT(start_size_class < kNumClasses);
     ASSERT(0 < start_size_class);
@@ -1577,7 +2287,8 @@ inline void CpuCache<Forwarder>::StealFromOtherCache(int cpu,
       // size, because shrinking them will disable transfer cache.
       //
       // Finally, we shrink if the ticks counter is >= the score.
-      uint32_t qticks = resize_[src_cpu].per_class[source_size_class].Tick();
+      uint32_t qticks =
+          GetResizeInfo(src_cpu).per_class[source_size_class].Tick();
       uint32_t score = 0;
       // Note: the following numbers are based solely on intuition, common sense
       // and benchmarking results.
@@ -1605,7 +2316,7 @@ inline void CpuCache<Forwarder>::StealFromOtherCache(int cpu,
       // TODO(vgogte): Maybe we can steal more from a single list to avoid
       // frequent locking overhead.
       {
-        AllocationGuardSpinLockHolder h(&resize_[src_cpu].lock);
+        AllocationGuardSpinLockHolder h(&cpu_state_[src_cpu].lock);
         if (freelist_.ShrinkOtherCache(
                 src_cpu, source_size_class, 1,
                 [this](size_t size_class, void** batch, size_t count) {
@@ -1618,7 +2329,8 @@ inline void CpuCache<Forwarder>::StealFromOtherCache(int cpu,
                   }
                 }) == 1) {
           acquired += size;
-          resize_[src_cpu].capacity.fetch_sub(size, std::memory_order_relaxed);
+          GetResizeInfo(src_cpu).capacity.fetch_sub(size,
+                                                    std::memory_order_relaxed);
         }
       }
 
@@ -1626,7 +2338,8 @@ inline void CpuCache<Forwarder>::StealFromOtherCache(int cpu,
         break;
       }
     }
-    resize_[cpu].last_steal.store(source_size_class, std::memory_order_relaxed);
+    GetResizeInfo(cpu).last_steal.store(source_size_class,
+                                        std::memory_order_relaxed);
   }
   // Record the last cpu id we stole from, which would provide a hint to the
   // next time we iterate through the cpus for stealing.
@@ -1635,11 +2348,20 @@ inline void CpuCache<Forwarder>::StealFromOtherCache(int cpu,
   // Increment the capacity of the destination cpu cache by the amount of bytes
   // acquired from source caches.
   if (acquired) {
-    resize_[cpu].available.fetch_add(acquired, std::memory_order_relaxed);
-    resize_[cpu].capacity.fetch_add(acquired, std::memory_order_relaxed);
+    GetResizeInfo(cpu).available.fetch_add(acquired, std::memory_order_relaxed);
+    GetResizeInfo(cpu).capacity.fetch_add(acquired, std::memory_order_relaxed);
   }
 }
 
+template <class Forwarder>
+inline int CpuCache<Forwarder>::StealLocality(int cpu, int src_cpu) const {
+  const auto& topology = forwarder_.numa_topology();
+  if (topology.GetCpuPartition(cpu) != topology.GetCpuPartition(src_cpu)) {
+    return 2;
+  }
+  return forwarder_.L3CacheId(cpu) == forwarder_.L3CacheId(src_cpu) ? 0 : 1;
+}
+
 template <class Forwarder>
 inline bool CpuCache<Forwarder>::IsGoodCandidateForShrinking(
     int cpu, size_t size_class) {
@@ -1671,7 +2393,7 @@ inline bool CpuCache<Forwarder>::IsGoodCandidateForShrinking(
   // because shrinking them will disable transfer cache.
   //
   // Finally, we shrink if the ticks counter is >= the score.
-  uint32_t qticks = resize_[cpu].per_class[size_class].Tick();
+  uint32_t qticks = GetResizeInfo(cpu).per_class[size_class].Tick();
   uint32_t score = 0;
   // Note: the following numbers are based solely on intuition, common sense
   // and benchmarking results.
@@ -1697,7 +2419,7 @@ inline size_t CpuCache<Forwarder>::StealCapacityForSizeClassWithinCpu(
   // Steal from other sizeclasses.  Try to go in a nice circle.
   // Complicated by sizeclasses actually being 1-indexed.
   size_t acquired = 0;
-  size_t start = resize_[cpu].last_steal.load(std::memory_order_relaxed);
+  size_t start = GetResizeInfo(cpu).last_steal.load(std::memory_order_relaxed);
   ASSERT(start < kNumClasses);
   ASSERT(0 < start);
   size_t source_size_class = start;
@@ -1722,7 +2444,7 @@ inline size_t CpuCache<Forwarder>::StealCapacityForSizeClassWithinCpu(
     // first place), but for active lists it does not make sense to aggressively
     // shuffle capacity all the time.
     {
-      AllocationGuardSpinLockHolder h(&resize_[cpu].lock);
+      AllocationGuardSpinLockHolder h(&cpu_state_[cpu].lock);
       if (freelist_.ShrinkOtherCache(
               cpu, source_size_class, 1,
               [this](size_t size_class, void** batch, size_t count) {
@@ -1740,7 +2462,8 @@ inline size_t CpuCache<Forwarder>::StealCapacityForSizeClassWithinCpu(
     }
   }
   // update the hint
-  resize_[cpu].last_steal.store(source_size_class, std::memory_order_relaxed);
+  GetResizeInfo(cpu).last_steal.store(source_size_class,
+                                      std::memory_order_relaxed);
   return acquired;
 }
 // There are rather a lot of policy knobs we could tweak here.
@@ -1751,7 +2474,7 @@ inline size_t CpuCache<Forwarder>::Steal(int cpu, size_t dest_size_class,
   // Steal from other sizeclasses.  Try to go in a nice circle.
   // Complicated by sizeclasses actually being 1-indexed.
   size_t acquired = 0;
-  size_t start = resize_[cpu].last_steal.load(std::memory_order_relaxed);
+  size_t start = GetResizeInfo(cpu).last_steal.load(std::memory_order_relaxed);
   ASSERT(start < kNumClasses);
   ASSERT(0 < start);
   size_t source_size_class = start;
@@ -1803,7 +2526,8 @@ inline size_t CpuCache<Forwarder>::Steal(int cpu, size_t dest_size_class,
     }
   }
   // update the hint
-  resize_[cpu].last_steal.store(source_size_class, std::memory_order_relaxed);
+  GetResizeInfo(cpu).last_steal.store(source_size_class,
+                                      std::memory_order_relaxed);
   return acquired;
 }
 
@@ -1816,6 +2540,7 @@ void CpuCache<Forwarder>::DeallocateSlow(void* ptr, size_t size_class) {
 template <class Forwarder>
 void CpuCache<Forwarder>::DeallocateSlowNoHooks(void* ptr, size_t size_class) {
   if (BypassCpuCache(size_class)) {
+    released_[size_class].fetch_add(1, std::memory_order_relaxed);
     return forwarder_.sharded_transfer_cache().Push(size_class, ptr);
   }
   auto [cpu, cached] = freelist_.CacheCpuSlab();
@@ -1825,7 +2550,10 @@ void CpuCache<Forwarder>::DeallocateSlowNoHooks(void* ptr, size_t size_class) {
     }
   }
   RecordCacheMissStat(cpu, false);
+  const int64_t probe_start = TCMALLOC_PROBE_START(cpu_cache_overflow);
   const size_t target = UpdateCapacity(cpu, size_class, true, nullptr);
+  const int handoff_cpu = GetResizeInfo(cpu).handoff_cpu[size_class].load(
+      std::memory_order_relaxed);
   size_t total = 0;
   size_t count = 1;
   void* batch[kMaxObjectsToMove];
@@ -1838,10 +2566,327 @@ void CpuCache<Forwarder>::DeallocateSlowNoHooks(void* ptr, size_t size_class) {
     if (!count) break;
 
     total += count;
-    ReleaseToBackingCache(size_class, absl::Span<void*>(batch, count));
+    size_t release = count;
+    if (handoff_cpu >= 0) {
+      release -= HandOff(handoff_cpu, size_class, batch, count);
+    }
+    if (release != 0) {
+      ReleaseToBackingCache(size_class, absl::Span<void*>(batch, release));
+    }
     if (count != kMaxObjectsToMove) break;
     count = 0;
   } while (total < target);
+  TCMALLOC_PROBE(cpu_cache_overflow, size_class, total,
+                 ProbeLatencyNs(probe_start));
+}
+
+template <class Forwarder>
+inline size_t CpuCache<Forwarder>::AllocateBatch(size_t size_class,
+                                                 void** batch, size_t count) {
+  ASSERT(size_class > 0);
+  if (count == 0) return 0;
+  size_t got = 0;
+  if (BypassCpuCache(size_class)) {
+    for (; got < count; ++got) {
+      batch[got] = forwarder_.sharded_transfer_cache().Pop(size_class);
+      if (batch[got] == nullptr) break;
+    }
+    fetched_[size_class].fetch_add(got, std::memory_order_relaxed);
+    return got;
+  }
+
+  const int cpu = freelist_.CacheCpuSlab().first;
+  got = freelist_.PopBatch(size_class, batch, count);
+  if (got == count) return got;
+
+  // The slab could not satisfy the whole request.  Rather than refilling the
+  // slab only to drain it again, hand objects from the backing cache straight
+  // to the caller.
+  RecordCacheMissStat(cpu, true);
+  while (got < count) {
+    const size_t want = std::min(kMaxObjectsToMove, count - got);
+    const size_t fetched = FetchFromBackingCache(size_class, batch + got, want);
+    if (fetched == 0) break;
+    got += fetched;
+  }
+  return got;
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::DeallocateBatch(size_t size_class,
+                                                 void** batch, size_t count) {
+  ASSERT(size_class > 0);
+  if (count == 0) return;
+  if (BypassCpuCache(size_class)) {
+    released_[size_class].fetch_add(count, std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+      forwarder_.sharded_transfer_cache().Push(size_class, batch[i]);
+    }
+    return;
+  }
+
+  const int cpu = freelist_.CacheCpuSlab().first;
+  // PushBatch leaves the objects it could not add at the start of batch.
+  size_t remaining = count - freelist_.PushBatch(size_class, batch, count);
+  if (remaining == 0) return;
+
+  RecordCacheMissStat(cpu, false);
+  while (remaining > 0) {
+    const size_t n = std::min(kMaxObjectsToMove, remaining);
+    remaining -= n;
+    ReleaseToBackingCache(size_class, absl::Span<void*>(batch + remaining, n));
+  }
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::DeallocateRemote(void* ptr,
+                                                  size_t size_class) {
+  ASSERT(size_class > 0);
+  if (BypassCpuCache(size_class)) {
+    released_[size_class].fetch_add(1, std::memory_order_relaxed);
+    return forwarder_.sharded_transfer_cache().Push(size_class, ptr);
+  }
+
+  const size_t partition = size_class / kNumBaseClasses;
+  ASSERT(partition < kNumaPartitions);
+  const int cpu = freelist_.CacheCpuSlab().first;
+  ResizeInfo& resize = GetResizeInfo(cpu);
+  resize.num_remote_frees.store(
+      resize.num_remote_frees.load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed);
+
+  CompactSizeClass size_classes[kMaxRemoteFrees];
+  void* objs[kMaxRemoteFrees];
+  {
+    RemoteFrees& remote = resize.remote_frees[partition];
+    AllocationGuardSpinLockHolder h(&remote.lock);
+    remote.size_class[remote.count] = size_class;
+    remote.obj[remote.count] = ptr;
+    if (++remote.count < kMaxRemoteFrees) return;
+
+    // Copy the batch out so that the transfer cache lock is not acquired
+    // while holding the per-CPU lock.
+    memcpy(size_classes, remote.size_class, sizeof(size_classes));
+    memcpy(objs, remote.obj, sizeof(objs));
+    remote.count = 0;
+  }
+  ReleaseRemoteFrees(size_classes, objs, kMaxRemoteFrees);
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::ReleaseRemoteFrees(CompactSizeClass* size_class,
+                                                    void** obj, int count) {
+  // Remote frees are usually dominated by a few size classes, so group the
+  // batch by size class in place and release each group with one call.
+  while (count > 0) {
+    const CompactSizeClass current = size_class[0];
+    int same = 1;
+    for (int i = 1; i < count; ++i) {
+      if (size_class[i] != current) continue;
+      std::swap(size_class[i], size_class[same]);
+      std::swap(obj[i], obj[same]);
+      ++same;
+    }
+    released_[current].fetch_add(same, std::memory_order_relaxed);
+    const size_t batch_length = forwarder_.num_objects_to_move(current);
+    for (int i = 0; i < same; i += batch_length) {
+      const size_t n = std::min<size_t>(batch_length, same - i);
+      forwarder_.transfer_cache().InsertRange(current,
+                                              absl::Span<void*>(obj + i, n));
+    }
+    size_class += same;
+    obj += same;
+    count -= same;
+  }
+}
+
+template <class Forwarder>
+inline uint64_t CpuCache<Forwarder>::DrainRemoteFrees(int cpu) {
+  uint64_t bytes = 0;
+  for (RemoteFrees& remote : GetResizeInfo(cpu).remote_frees) {
+    CompactSizeClass size_classes[kMaxRemoteFrees];
+    void* objs[kMaxRemoteFrees];
+    int count;
+    {
+      AllocationGuardSpinLockHolder h(&remote.lock);
+      count = remote.count;
+      memcpy(size_classes, remote.size_class, count * sizeof(size_classes[0]));
+      memcpy(objs, remote.obj, count * sizeof(objs[0]));
+      remote.count = 0;
+    }
+    for (int i = 0; i < count; ++i) {
+      bytes += forwarder_.class_to_size(size_classes[i]);
+    }
+    ReleaseRemoteFrees(size_classes, objs, count);
+  }
+  return bytes;
+}
+
+template <class Forwarder>
+inline size_t CpuCache<Forwarder>::HandOff(int cpu, size_t size_class,
+                                           void** batch, size_t count) {
+  ResizeInfo& resize = GetResizeInfo(cpu);
+  HandoffBuffer& handoff = resize.handoff;
+  const size_t size = forwarder_.class_to_size(size_class);
+  AllocationGuardSpinLockHolder h(&handoff.lock);
+  const size_t bytes = handoff.bytes.load(std::memory_order_relaxed);
+  const size_t n =
+      std::min({count, static_cast<size_t>(kMaxHandoffObjects - handoff.count),
+                (kMaxHandoffBytes - std::min(bytes, kMaxHandoffBytes)) / size});
+  for (size_t i = 0; i < n; ++i) {
+    handoff.size_class[handoff.count] = size_class;
+    handoff.obj[handoff.count] = batch[count - 1 - i];
+    ++handoff.count;
+  }
+  handoff.bytes.store(bytes + n * size, std::memory_order_relaxed);
+  resize.num_handoffs.store(
+      resize.num_handoffs.load(std::memory_order_relaxed) + n,
+      std::memory_order_relaxed);
+  return n;
+}
+
+template <class Forwarder>
+inline size_t CpuCache<Forwarder>::TakeHandoffs(int cpu, size_t size_class,
+                                                void** batch, size_t count) {
+  HandoffBuffer& handoff = GetResizeInfo(cpu).handoff;
+  if (handoff.bytes.load(std::memory_order_relaxed) == 0) return 0;
+
+  size_t got = 0;
+  AllocationGuardSpinLockHolder h(&handoff.lock);
+  int kept = 0;
+  for (int i = 0; i < handoff.count; ++i) {
+    if (got < count && handoff.size_class[i] == size_class) {
+      batch[got++] = handoff.obj[i];
+      continue;
+    }
+    handoff.size_class[kept] = handoff.size_class[i];
+    handoff.obj[kept] = handoff.obj[i];
+    ++kept;
+  }
+  handoff.count = kept;
+  handoff.bytes.store(handoff.bytes.load(std::memory_order_relaxed) -
+                          got * forwarder_.class_to_size(size_class),
+                      std::memory_order_relaxed);
+  return got;
+}
+
+template <class Forwarder>
+inline uint64_t CpuCache<Forwarder>::DrainHandoffs(int cpu) {
+  HandoffBuffer& handoff = GetResizeInfo(cpu).handoff;
+  if (handoff.bytes.load(std::memory_order_relaxed) == 0) return 0;
+
+  CompactSizeClass size_classes[kMaxHandoffObjects];
+  void* objs[kMaxHandoffObjects];
+  int count;
+  uint64_t bytes;
+  {
+    AllocationGuardSpinLockHolder h(&handoff.lock);
+    count = handoff.count;
+    memcpy(size_classes, handoff.size_class, count * sizeof(size_classes[0]));
+    memcpy(objs, handoff.obj, count * sizeof(objs[0]));
+    handoff.count = 0;
+    bytes = handoff.bytes.load(std::memory_order_relaxed);
+    handoff.bytes.store(0, std::memory_order_relaxed);
+  }
+  ReleaseRemoteFrees(size_classes, objs, count);
+  return bytes;
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::UpdateBatchLengths() {
+  const bool enabled = forwarder_.per_cpu_caches_adaptive_batches();
+  for (size_t size_class = 1; size_class < kNumClasses; ++size_class) {
+    const uint32_t misses =
+        batch_misses_[size_class].exchange(0, std::memory_order_relaxed);
+    if (!enabled) {
+      batch_length_[size_class].store(0, std::memory_order_relaxed);
+      continue;
+    }
+
+    const size_t base = forwarder_.num_objects_to_move(size_class);
+    if (base == 0) continue;
+    const size_t batch_length = BatchLength(size_class);
+    size_t target = batch_length;
+    if (misses >= kMissesToGrowBatch) {
+      target = std::min(batch_length * 2, kMaxObjectsToMove);
+    } else if (misses <= kMissesToShrinkBatch) {
+      target = std::max<size_t>({batch_length / 2, base / 4, 1});
+    }
+    batch_length_[size_class].store(target == base ? 0 : target,
+                                    std::memory_order_relaxed);
+  }
+  num_batch_updates_.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::UpdateHandoffTargets() {
+  const bool enabled = forwarder_.per_cpu_caches_handoff();
+  const bool requested =
+      any_handoff_requested_.load(std::memory_order_relaxed);
+  if (!enabled && !requested && !handoff_active_) return;
+  handoff_active_ = enabled || requested;
+
+  // Only count misses since the last pass, so that pairs no longer in a
+  // producer/consumer pattern are broken up.
+  const int64_t since = last_handoff_update_;
+  last_handoff_update_ = absl::base_internal::CycleClock::Now();
+
+  const int num_cpus = NumCPUs();
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    // Find the cpu that underflowed the most, in a row, on this size class.
+    int producer = -1;
+    if (enabled || (requested && handoff_requested_[size_class].load(
+                                     std::memory_order_relaxed))) {
+      uint32_t max_successive = kMinHandoffSuccessive - 1;
+      for (int cpu = 0; cpu < num_cpus; ++cpu) {
+        if (!HasPopulated(cpu)) continue;
+        const ResizeInfo& resize = GetResizeInfo(cpu);
+        if (resize.last_miss_cycles[false][size_class].load(
+                std::memory_order_relaxed) < since) {
+          continue;
+        }
+        const uint32_t successive =
+            resize.per_class[size_class].Successive(/*overflow=*/false);
+        if (successive > max_successive) {
+          max_successive = successive;
+          producer = cpu;
+        }
+      }
+    }
+
+    // Have the cpus that have been overflowing in a row hand off to it.
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      ResizeInfo& resize = GetResizeInfo(cpu);
+      int target = -1;
+      if (producer >= 0 && cpu != producer && HasPopulated(cpu) &&
+          resize.last_miss_cycles[true][size_class].load(
+              std::memory_order_relaxed) >= since &&
+          resize.per_class[size_class].Successive(/*overflow=*/true) >=
+              kMinHandoffSuccessive) {
+        target = producer;
+      }
+      if (resize.handoff_cpu[size_class].load(std::memory_order_relaxed) !=
+          target) {
+        resize.handoff_cpu[size_class].store(target, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+template <class Forwarder>
+inline uint64_t CpuCache<Forwarder>::GetNumHandoffs(int cpu) const {
+  if (!HasPopulated(cpu)) return 0;
+  return resize_[cpu].num_handoffs.load(std::memory_order_relaxed);
+}
+
+template <class Forwarder>
+inline uint64_t CpuCache<Forwarder>::GetNumHandoffs() const {
+  uint64_t handoffs = 0;
+  const int num_cpus = NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    handoffs += GetNumHandoffs(cpu);
+  }
+  return handoffs;
 }
 
 template <class Forwarder>
@@ -1866,7 +2911,9 @@ inline uint64_t CpuCache<Forwarder>::UsedBytes(int target_cpu) const {
     return 0;
   }
 
-  uint64_t total = 0;
+  // Objects handed off to this cpu are cached for it, too.
+  uint64_t total =
+      resize_[target_cpu].handoff.bytes.load(std::memory_order_relaxed);
   for (int size_class = 1; size_class < kNumClasses; size_class++) {
     int size = forwarder_.class_to_size(size_class);
     total += size * freelist_.Length(target_cpu, size_class);
@@ -1877,7 +2924,58 @@ inline uint64_t CpuCache<Forwarder>::UsedBytes(int target_cpu) const {
 template <class Forwarder>
 inline bool CpuCache<Forwarder>::HasPopulated(int target_cpu) const {
   ASSERT(target_cpu >= 0);
-  return resize_[target_cpu].populated.load(std::memory_order_relaxed);
+  return cpu_state_[target_cpu].populated.load(std::memory_order_acquire);
+}
+
+template <class Forwarder>
+inline typename CpuCache<Forwarder>::ResizeInfo&
+CpuCache<Forwarder>::GetResizeInfo(int cpu) {
+  absl::base_internal::LowLevelCallOnce(
+      &cpu_state_[cpu].initialized,
+      [](CpuCache* cache, int cpu) {
+        AllocationGuardSpinLockHolder h(&cache->cpu_state_[cpu].lock);
+        ResizeInfo& resize = *new (&cache->resize_[cpu]) ResizeInfo();
+        for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+          resize.per_class[size_class].Init();
+        }
+        for (auto& handoff_cpu : resize.handoff_cpu) {
+          handoff_cpu.store(-1, std::memory_order_relaxed);
+        }
+        const size_t cpu_cache_size = cache->InitialCapacity(cpu);
+        resize.available.store(cpu_cache_size, std::memory_order_relaxed);
+        resize.capacity.store(cpu_cache_size, std::memory_order_relaxed);
+        resize.last_steal.store(1, std::memory_order_relaxed);
+
+        cache->freelist_.InitCpu(
+            cpu, cache->GetMaxCapacityFunctor(cache->freelist_.GetShift(cpu)));
+
+        // We update this under the lock so it's guaranteed that the populated
+        // CPUs don't change during ResizeSlabs.
+        cache->cpu_state_[cpu].populated.store(true, std::memory_order_release);
+      },
+      this, cpu);
+  return resize_[cpu];
+}
+
+template <class Forwarder>
+inline size_t CpuCache<Forwarder>::InitialCapacity(int cpu) const {
+  // On hybrid machines, less capable cpus allocate at a lower rate, so they
+  // start with a proportionally smaller share of the cache.  Stealing moves
+  // capacity between cpus from there on.
+  size_t capacity =
+      CacheLimit() * forwarder_.CpuCapacity(cpu) / kMaxCpuCapacity;
+  // Under a cgroup cpu quota, the cpus split a budget of a few caches.
+  if (const int budget = CpuQuotaBudget(); budget > 0) {
+    capacity = capacity * budget / NumCPUs();
+  }
+  // SMT siblings share their core's L1 and L2, so a cache's worth of objects
+  // per hardware thread mostly duplicates what its siblings hold.  Each slab
+  // stays private to its cpu, as restartable sequences require, but the
+  // siblings split one cpu's capacity; stealing rebalances it between them.
+  if (forwarder_.per_cpu_caches_share_smt_capacity()) {
+    capacity /= std::max(forwarder_.SmtSiblingCount(cpu), 1);
+  }
+  return capacity;
 }
 
 template <class Forwarder>
@@ -1912,11 +3010,13 @@ inline uint64_t CpuCache<Forwarder>::TotalObjectsOfClass(
 
 template <class Forwarder>
 inline uint64_t CpuCache<Forwarder>::Unallocated(int cpu) const {
+  if (!HasPopulated(cpu)) return InitialCapacity(cpu);
   return resize_[cpu].available.load(std::memory_order_relaxed);
 }
 
 template <class Forwarder>
 inline uint64_t CpuCache<Forwarder>::Capacity(int cpu) const {
+  if (!HasPopulated(cpu)) return InitialCapacity(cpu);
   return resize_[cpu].capacity.load(std::memory_order_relaxed);
 }
 
@@ -1925,6 +3025,17 @@ inline uint64_t CpuCache<Forwarder>::CacheLimit() const {
   return max_per_cpu_cache_size_.load(std::memory_order_relaxed);
 }
 
+template <class Forwarder>
+inline void CpuCache<Forwarder>::UpdateCpuQuota() {
+  const double quota = forwarder_.CpuQuota();
+  int budget = 0;
+  if (quota > 0) {
+    const double caches = std::ceil(quota) * kCpuQuotaHeadroom;
+    if (caches < NumCPUs()) budget = static_cast<int>(caches);
+  }
+  cpu_quota_budget_.store(budget, std::memory_order_relaxed);
+}
+
 template <class Forwarder>
 inline void CpuCache<Forwarder>::SetCacheLimit(uint64_t v) {
   // TODO(b/179516472): Drain cores as required.
@@ -1955,7 +3066,7 @@ struct DrainHandler {
 
 template <class Forwarder>
 inline uint64_t CpuCache<Forwarder>::Reclaim(int cpu) {
-  AllocationGuardSpinLockHolder h(&resize_[cpu].lock);
+  AllocationGuardSpinLockHolder h(&cpu_state_[cpu].lock);
 
   // If we haven't populated this core, freelist_.Drain() will touch the memory
   // (for writing) as part of its locking process.  Avoid faulting new pages as
@@ -1964,7 +3075,7 @@ inline uint64_t CpuCache<Forwarder>::Reclaim(int cpu) {
     return 0;
   }
 
-  uint64_t bytes = 0;
+  uint64_t bytes = DrainRemoteFrees(cpu) + DrainHandoffs(cpu);
   freelist_.Drain(cpu, DrainHandler<CpuCache>{*this, &bytes});
 
   // Record that the reclaim occurred for this CPU.
@@ -1978,6 +3089,7 @@ inline uint64_t CpuCache<Forwarder>::Reclaim(int cpu) {
 }
 template <class Forwarder>
 inline uint64_t CpuCache<Forwarder>::GetNumResizes(int cpu) const {
+  if (!HasPopulated(cpu)) return 0;
   return resize_[cpu].num_size_class_resizes.load(std::memory_order_relaxed);
 }
 
@@ -1985,14 +3097,13 @@ template <class Forwarder>
 inline uint64_t CpuCache<Forwarder>::GetNumResizes() const {
   uint64_t resizes = 0;
   const int num_cpus = NumCPUs();
-  for (int cpu = 0; cpu < num_cpus; ++cpu)
-    resizes +=
-        resize_[cpu].num_size_class_resizes.load(std::memory_order_relaxed);
+  for (int cpu = 0; cpu < num_cpus; ++cpu) resizes += GetNumResizes(cpu);
   return resizes;
 }
 
 template <class Forwarder>
 inline uint64_t CpuCache<Forwarder>::GetNumReclaims(int cpu) const {
+  if (!HasPopulated(cpu)) return 0;
   return resize_[cpu].num_reclaims.load(std::memory_order_relaxed);
 }
 
@@ -2000,11 +3111,33 @@ template <class Forwarder>
 inline uint64_t CpuCache<Forwarder>::GetNumReclaims() const {
   uint64_t reclaims = 0;
   const int num_cpus = NumCPUs();
-  for (int cpu = 0; cpu < num_cpus; ++cpu)
-    reclaims += resize_[cpu].num_reclaims.load(std::memory_order_relaxed);
+  for (int cpu = 0; cpu < num_cpus; ++cpu) reclaims += GetNumReclaims(cpu);
   return reclaims;
 }
 
+template <class Forwarder>
+inline uint64_t CpuCache<Forwarder>::GetNumRemoteFrees(int cpu) const {
+  if (!HasPopulated(cpu)) return 0;
+  return resize_[cpu].num_remote_frees.load(std::memory_order_relaxed);
+}
+
+template <class Forwarder>
+inline uint64_t CpuCache<Forwarder>::GetNumRemoteFrees() const {
+  uint64_t remote_frees = 0;
+  const int num_cpus = NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    remote_frees += GetNumRemoteFrees(cpu);
+  }
+  return remote_frees;
+}
+
+template <class Forwarder>
+inline auto CpuCache<Forwarder>::GetSizeClassFlow(size_t size_class) const
+    -> SizeClassFlow {
+  return {fetched_[size_class].load(std::memory_order_relaxed),
+          released_[size_class].load(std::memory_order_relaxed)};
+}
+
 template <class Forwarder>
 inline auto CpuCache<Forwarder>::AllocOrReuseSlabs(
     absl::FunctionRef<void*(size_t, std::align_val_t)> alloc,
@@ -2022,12 +3155,39 @@ inline auto CpuCache<Forwarder>::AllocOrReuseSlabs(
   } else {
     reused_slabs = static_cast<Freelist::Slabs*>(
         alloc(size, subtle::percpu::kPhysicalPageAlign));
+    // Bind before the slabs are first touched.  The policy survives the
+    // MADV_DONTNEED of slabs that are later reused.
+    BindSlabsToPartitions(reused_slabs, shift, num_cpus);
     // MSan does not see writes in assembly.
     ANNOTATE_MEMORY_IS_INITIALIZED(reused_slabs, size);
   }
   return {reused_slabs, can_reuse ? size : 0};
 }
 
+template <class Forwarder>
+void CpuCache<Forwarder>::BindSlabsToPartitions(Freelist::Slabs* slabs,
+                                                subtle::percpu::Shift shift,
+                                                int num_cpus) {
+  const auto& topology = forwarder_.numa_topology();
+  if (!topology.numa_aware()) return;
+
+  // Each cpu's region is 1 << shift bytes, a multiple of the page size.
+  // Consecutive cpus usually belong to the same partition, so we bind them in
+  // runs; this also keeps hugepages within a run backed by a single node.
+  const size_t region_size = size_t{1} << subtle::percpu::ToUint8(shift);
+  int begin = 0;
+  while (begin < num_cpus) {
+    const size_t partition = topology.GetCpuPartition(begin);
+    int end = begin + 1;
+    while (end < num_cpus && topology.GetCpuPartition(end) == partition) {
+      ++end;
+    }
+    forwarder_.BindMemory(reinterpret_cast<char*>(slabs) + begin * region_size,
+                          (end - begin) * region_size, partition);
+    begin = end;
+  }
+}
+
 template <class Forwarder>
 inline typename CpuCache<Forwarder>::DynamicSlabResize
 CpuCache<Forwarder>::ShouldResizeSlab() {
@@ -2036,6 +3196,8 @@ CpuCache<Forwarder>::ShouldResizeSlab() {
   DynamicSlabResize resize = DynamicSlabResize::kNoop;
   const bool wider_slabs_enabled = UseWiderSlabs();
   for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    // CPUs that have not been used have not missed.
+    if (!HasPopulated(cpu)) continue;
     CpuCacheMissStats misses =
         GetAndUpdateIntervalCacheMissStats(cpu, MissCount::kSlabResize);
     total_misses += misses;
@@ -2074,7 +3236,8 @@ CpuCache<Forwarder>::ShouldResizeSlab() {
 
 template <class Forwarder>
 void CpuCache<Forwarder>::ResizeSlabIfNeeded() ABSL_NO_THREAD_SAFETY_ANALYSIS {
-  uint8_t per_cpu_shift = freelist_.GetShift();
+  const uint8_t old_shift = freelist_.GetShift();
+  uint8_t per_cpu_shift = old_shift;
 
   const int num_cpus = NumCPUs();
   const DynamicSlabResize resize = ShouldResizeSlab();
@@ -2094,6 +3257,7 @@ void CpuCache<Forwarder>::ResizeSlabIfNeeded() ABSL_NO_THREAD_SAFETY_ANALYSIS {
   } else {
     return;
   }
+  const int64_t probe_start = TCMALLOC_PROBE_START(cpu_cache_resize_slab);
 
   const auto new_shift = subtle::percpu::ToShiftType(per_cpu_shift);
   const int64_t new_slabs_size =
@@ -2103,27 +3267,36 @@ void CpuCache<Forwarder>::ResizeSlabIfNeeded() ABSL_NO_THREAD_SAFETY_ANALYSIS {
   forwarder_.ArenaUpdateAllocatedAndNonresident(new_slabs_size, 0);
   forwarder_.ShrinkToUsageLimit();
 
-  for (int cpu = 0; cpu < num_cpus; ++cpu) resize_[cpu].lock.Lock();
-  ResizeSlabsInfo info;
+  Freelist::Slabs* new_slabs;
   int64_t reused_bytes;
-  {
-    // We can't allocate while holding the per-cpu spinlocks.
-    AllocationGuard enforce_no_alloc;
-
-    Freelist::Slabs* new_slabs;
-    std::tie(new_slabs, reused_bytes) = AllocOrReuseSlabs(
-        [&](size_t size, std::align_val_t align) {
-          return forwarder_.AllocReportedImpending(size, align);
-        },
-        new_shift, num_cpus,
-        ShiftOffset(per_cpu_shift, shift_bounds_.initial_shift));
-    info = freelist_.ResizeSlabs(
-        new_shift, new_slabs, &forwarder_.Alloc,
-        GetShiftMaxCapacity{max_capacity_, per_cpu_shift, shift_bounds_},
-        [this](int cpu) { return HasPopulated(cpu); },
-        DrainHandler<CpuCache>{*this, nullptr});
-  }
-  for (int cpu = 0; cpu < num_cpus; ++cpu) resize_[cpu].lock.Unlock();
+  std::tie(new_slabs, reused_bytes) = AllocOrReuseSlabs(
+      [&](size_t size, std::align_val_t align) {
+        return forwarder_.AllocReportedImpending(size, align);
+      },
+      new_shift, num_cpus,
+      ShiftOffset(per_cpu_shift, shift_bounds_.initial_shift));
+
+  // Lay the new slabs out by the capacity that the cpus have given each size
+  // class, which follows how often they miss, and so how busy they are.
+  SetLayoutOrder([&](size_t size_class) {
+    size_t capacity = 0;
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      if (HasPopulated(cpu)) capacity += freelist_.Capacity(cpu, size_class);
+    }
+    return capacity;
+  });
+
+  // Move one cpu at a time, so that the others keep hitting in their caches
+  // while it is drained.
+  freelist_.BeginResizeSlabs(new_shift, new_slabs, &forwarder_.Alloc);
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    // We can't allocate while holding the per-cpu spinlock.
+    AllocationGuardSpinLockHolder h(&cpu_state_[cpu].lock);
+    freelist_.ResizeCpuSlabs(
+        cpu, GetShiftMaxCapacity{max_capacity_, per_cpu_shift, shift_bounds_},
+        HasPopulated(cpu), DrainHandler<CpuCache>{*this, nullptr});
+  }
+  const ResizeSlabsInfo info = freelist_.FinishResizeSlabs();
 
   // madvise away the old slabs memory.  It is important that we do not
   // MADV_REMOVE the memory, since file-backed pages may SIGSEGV/SIGBUS if
@@ -2143,13 +3316,30 @@ void CpuCache<Forwarder>::ResizeSlabIfNeeded() ABSL_NO_THREAD_SAFETY_ANALYSIS {
   const int64_t old_slabs_size = info.old_slabs_size;
   forwarder_.ArenaUpdateAllocatedAndNonresident(-old_slabs_size,
                                                 old_slabs_size - reused_bytes);
+  TCMALLOC_PROBE(cpu_cache_resize_slab, old_shift, per_cpu_shift,
+                 ProbeLatencyNs(probe_start));
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::SetLayoutOrder(
+    absl::FunctionRef<size_t(size_t)> use) {
+  size_t uses[kNumClasses];
+  uint16_t order[kNumClasses];
+  for (size_t size_class = 0; size_class < kNumClasses; ++size_class) {
+    uses[size_class] = use(size_class);
+    order[size_class] = size_class;
+  }
+  std::sort(order, order + kNumClasses, [&](uint16_t a, uint16_t b) {
+    return uses[a] != uses[b] ? uses[a] > uses[b] : a < b;
+  });
+  freelist_.SetLayoutOrder(order);
 }
 
 template <class Forwarder>
 inline void CpuCache<Forwarder>::RecordCacheMissStat(const int cpu,
                                                      const bool is_alloc) {
   MissCounts& misses =
-      is_alloc ? resize_[cpu].underflows : resize_[cpu].overflows;
+      is_alloc ? GetResizeInfo(cpu).underflows : GetResizeInfo(cpu).overflows;
   auto& c = misses[MissCount::kTotal];
   c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
 }
@@ -2157,7 +3347,8 @@ inline void CpuCache<Forwarder>::RecordCacheMissStat(const int cpu,
 template <class Forwarder>
 inline typename CpuCache<Forwarder>::CpuCacheMissStats
 CpuCache<Forwarder>::GetTotalCacheMissStats(int cpu) const {
-  CpuCacheMissStats stats;
+  CpuCacheMissStats stats{};
+  if (!HasPopulated(cpu)) return stats;
   stats.underflows = resize_[cpu].underflows[MissCount::kTotal].load(
       std::memory_order_relaxed);
   stats.overflows =
@@ -2188,6 +3379,7 @@ CpuCache<Forwarder>::GetIntervalCacheMissStats(int cpu,
     // In case of a size_t overflow, we wrap around to 0.
     return total_misses > interval_misses ? total_misses - interval_misses : 0;
   };
+  if (!HasPopulated(cpu)) return {};
   return {get_safe_miss_diff(resize_[cpu].underflows),
           get_safe_miss_diff(resize_[cpu].overflows)};
 }
@@ -2201,9 +3393,9 @@ void CpuCache<Forwarder>::UpdateIntervalCacheMissStats(int cpu,
   //
   // Interval updates occur on a single thread so relaxed stores to interval
   // miss stats are safe.
-  resize_[cpu].underflows[miss_count].store(total_stats.underflows,
+  GetResizeInfo(cpu).underflows[miss_count].store(total_stats.underflows,
                                             std::memory_order_relaxed);
-  resize_[cpu].overflows[miss_count].store(total_stats.overflows,
+  GetResizeInfo(cpu).overflows[miss_count].store(total_stats.overflows,
                                            std::memory_order_relaxed);
 }
 
@@ -2222,7 +3414,23 @@ template <class Forwarder>
 size_t CpuCache<Forwarder>::GetIntervalSizeClassMisses(int cpu,
                                                        size_t size_class,
                                                        PerClassMissType type) {
-  return resize_[cpu].per_class[size_class].GetIntervalMisses(type);
+  return GetResizeInfo(cpu).per_class[size_class].GetIntervalMisses(type);
+}
+
+template <class Forwarder>
+inline typename CpuCache<Forwarder>::TunedCapacityStats
+CpuCache<Forwarder>::GetTunedCapacityStats(size_t size_class) const {
+  TunedCapacityStats stats;
+  for (int cpu = 0, num_cpus = NumCPUs(); cpu < num_cpus; ++cpu) {
+    if (!HasPopulated(cpu)) {
+      continue;
+    }
+    const TuneInfo& tune = resize_[cpu].tune[size_class];
+    stats.target += tune.target.load(std::memory_order_relaxed);
+    stats.capacity += freelist_.Capacity(cpu, size_class);
+    stats.working_set += tune.working_set.load(std::memory_order_relaxed);
+  }
+  return stats;
 }
 
 template <class Forwarder>
@@ -2309,6 +3517,9 @@ inline void CpuCache<Forwarder>::Print(Printer* out) const {
   out->printf("------------------------------------------------\n");
   out->printf("Bytes in per-CPU caches (per cpu limit: %u bytes)\n",
               CacheLimit());
+  if (const int budget = CpuQuotaBudget(); budget > 0) {
+    out->printf("CPU quota: cpus share the capacity of %d caches\n", budget);
+  }
   out->printf("------------------------------------------------\n");
 
   const cpu_set_t allowed_cpus = FillActiveCpuMask();
@@ -2353,6 +3564,38 @@ inline void CpuCache<Forwarder>::Print(Printer* out) const {
         stats.max_last_overflow_cpu_id);
   }
 
+  const uint64_t num_capacity_tunes = GetNumCapacityTunes();
+  if (num_capacity_tunes > 0) {
+    out->printf("------------------------------------------------\n");
+    out->printf("Per-CPU cache capacity tuner (%u passes)\n",
+                num_capacity_tunes);
+    out->printf("------------------------------------------------\n");
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      const TunedCapacityStats stats = GetTunedCapacityStats(size_class);
+      if (stats.target == 0 && stats.capacity == 0) continue;
+      out->printf(
+          "class %3d [ %8zu bytes ] : %8zu target, %8zu actual capacity, "
+          "%8zu working set (summed over populated caches)\n",
+          size_class, forwarder_.class_to_size(size_class), stats.target,
+          stats.capacity, stats.working_set);
+    }
+  }
+
+  if (num_batch_updates_.load(std::memory_order_relaxed) > 0) {
+    out->printf("------------------------------------------------\n");
+    out->printf("Per-CPU cache adapted batch lengths\n");
+    out->printf("------------------------------------------------\n");
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      if (batch_length_[size_class].load(std::memory_order_relaxed) == 0) {
+        continue;
+      }
+      out->printf("class %3d [ %8zu bytes ] : %4zu objects (default %4zu)\n",
+                  size_class, forwarder_.class_to_size(size_class),
+                  BatchLength(size_class),
+                  forwarder_.num_objects_to_move(size_class));
+    }
+  }
+
   out->printf("------------------------------------------------\n");
   out->printf("Number of per-CPU cache underflows, overflows, and reclaims\n");
   out->printf("------------------------------------------------\n");
@@ -2374,6 +3617,9 @@ inline void CpuCache<Forwarder>::Print(Printer* out) const {
     print_miss_stats(GetTotalCacheMissStats(cpu), GetNumReclaims(cpu),
                      GetNumResizes(cpu));
   }
+  out->printf("%12u objects freed to remote NUMA partitions\n",
+              GetNumRemoteFrees());
+  out->printf("%12u objects handed off between cpus\n", GetNumHandoffs());
 
   out->printf("------------------------------------------------\n");
   out->printf("Per-CPU cache slab resizing info:\n");
@@ -2414,8 +3660,12 @@ inline void CpuCache<Forwarder>::PrintInPbtxt(PbtxtRegion* region) const {
     entry.PrintI64("overflows", miss_stats.overflows);
     entry.PrintI64("reclaims", reclaims);
     entry.PrintI64("size_class_resizes", resizes);
+    entry.PrintI64("remote_frees", GetNumRemoteFrees(cpu));
+    entry.PrintI64("handoffs", GetNumHandoffs(cpu));
   }
 
+  region->PrintI64("cpu_quota_budget", CpuQuotaBudget());
+
   // Record size class capacity statistics.
   for (int size_class = 0; size_class < kNumClasses; ++size_class) {
     SizeClassCapacityStats stats = GetSizeClassCapacityStats(size_class);
@@ -2426,6 +3676,7 @@ inline void CpuCache<Forwarder>::PrintInPbtxt(PbtxtRegion* region) const {
     entry.PrintI64("max_capacity", stats.max_capacity);
     entry.PrintI64("max_allowed_capacity",
                    GetMaxCapacity(size_class, freelist_.GetShift()));
+    entry.PrintI64("batch_length", BatchLength(size_class));
 
     entry.PrintI64("min_last_underflow_ns",
                    absl::ToInt64Nanoseconds(stats.min_last_underflow));
@@ -2437,6 +3688,18 @@ inline void CpuCache<Forwarder>::PrintInPbtxt(PbtxtRegion* region) const {
                    absl::ToInt64Nanoseconds(stats.max_last_overflow));
   }
 
+  if (GetNumCapacityTunes() > 0) {
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      const TunedCapacityStats stats = GetTunedCapacityStats(size_class);
+      if (stats.target == 0 && stats.capacity == 0) continue;
+      PbtxtRegion entry = region->CreateSubRegion("tuned_capacity");
+      entry.PrintI64("sizeclass", forwarder_.class_to_size(size_class));
+      entry.PrintI64("target_capacity", stats.target);
+      entry.PrintI64("capacity", stats.capacity);
+      entry.PrintI64("working_set", stats.working_set);
+    }
+  }
+
   // Record dynamic slab statistics.
   region->PrintI64("dynamic_per_cpu_slab_size", 1 << freelist_.GetShift());
   for (int shift = 0; shift < kNumPossiblePerCpuShifts; ++shift) {
@@ -2487,6 +3750,15 @@ inline uint32_t CpuCache<Forwarder>::PerClassResizeInfo::Tick() {
   return state.quiescent_ticks - 1;
 }
 
+template <class Forwarder>
+inline uint32_t CpuCache<Forwarder>::PerClassResizeInfo::Successive(
+    bool overflow) const {
+  int32_t raw = state_.load(std::memory_order_relaxed);
+  State state;
+  memcpy(&state, &raw, sizeof(state));
+  return state.overflow == overflow ? state.successive : 0;
+}
+
 template <class Forwarder>
 inline void CpuCache<Forwarder>::PerClassResizeInfo::RecordMiss() {
   auto& c = misses_[PerClassMissType::kTotal];
@@ -2539,6 +3811,12 @@ inline bool UsePerCpuCache(State& state) {
     return false;
   }
 
+  // The per-CPU slabs of threads that bypass them are left uncached, so that
+  // their fast paths fail and end up here.
+  if (ABSL_PREDICT_FALSE(bypass_per_cpu_caches)) {
+    return false;
+  }
+
   if (ABSL_PREDICT_TRUE(subtle::percpu::IsFastNoInit())) {
     return true;
   }
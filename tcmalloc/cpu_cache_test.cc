@@ -14,12 +14,19 @@
 
 #include "tcmalloc/cpu_cache.h"
 
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <new>
 #include <optional>
@@ -32,8 +39,11 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/base/optimization.h"
+#include "absl/functional/function_ref.h"
 #include "absl/random/bit_gen_ref.h"
 #include "absl/random/random.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
@@ -69,15 +79,23 @@ class CpuCachePeer {
   static void ValidateSlabBytes(const CpuCache& cpu_cache) {
     cpu_cache_internal::SlabShiftBounds bounds =
         cpu_cache.GetPerCpuSlabShiftBounds();
+    // With more than two NUMA partitions compiled in, the slab is widened to
+    // hold every partition's headers, which only partition 0 uses when NUMA
+    // awareness is disabled at runtime.
+    const bool expect_full_slab =
+        kNumaPartitions <= 2 ||
+        cpu_cache.forwarder().numa_topology().numa_aware();
     for (uint8_t shift = bounds.initial_shift;
          shift <= bounds.max_shift &&
          shift > cpu_cache_internal::kInitialBasePerCpuShift;
          ++shift) {
       const auto [bytes_required, bytes_available] =
           EstimateSlabBytes(cpu_cache.GetMaxCapacityFunctor(shift));
-      EXPECT_GT(bytes_required * 10, bytes_available * 9)
-          << bytes_required << " " << bytes_available << " " << kNumaPartitions
-          << " " << kNumBaseClasses << " " << kNumClasses;
+      if (expect_full_slab) {
+        EXPECT_GT(bytes_required * 10, bytes_available * 9)
+            << bytes_required << " " << bytes_available << " "
+            << kNumaPartitions << " " << kNumBaseClasses << " " << kNumClasses;
+      }
       EXPECT_LE(bytes_required, bytes_available);
     }
   }
@@ -86,6 +104,16 @@ class CpuCachePeer {
   static size_t ResizeInfoSize() {
     return sizeof(typename CpuCache::ResizeInfo);
   }
+
+  template <typename CpuCache>
+  static int MaxRemoteFrees() {
+    return CpuCache::kMaxRemoteFrees;
+  }
+
+  template <typename CpuCache>
+  static size_t HandoffBytes(const CpuCache& cpu_cache, int cpu) {
+    return cpu_cache.resize_[cpu].handoff.bytes.load(std::memory_order_relaxed);
+  }
 };
 
 namespace {
@@ -136,6 +164,18 @@ class TestStaticForwarder {
 
   bool per_cpu_caches_dynamic_slab_enabled() { return dynamic_slab_enabled_; }
 
+  bool per_cpu_caches_handoff() const { return handoff_enabled_; }
+
+  bool small_footprint() const { return small_footprint_; }
+
+  bool per_cpu_caches_adaptive_batches() const {
+    return adaptive_batches_enabled_;
+  }
+
+  bool per_cpu_caches_share_smt_capacity() const {
+    return share_smt_capacity_enabled_;
+  }
+
   double per_cpu_caches_dynamic_slab_grow_threshold() {
     if (dynamic_slab_grow_threshold_ >= 0) return dynamic_slab_grow_threshold_;
     return dynamic_slab_ == DynamicSlab::kGrow
@@ -187,6 +227,48 @@ class TestStaticForwarder {
     return numa_topology_;
   }
 
+  // Replaces the NUMA topology, which Init() read from the host.
+  void InitNumaTopologyForTest(
+      absl::FunctionRef<int(size_t)> open_node_cpulist) {
+    numa_topology_ = {};
+    numa_topology_.InitForTest(open_node_cpulist);
+  }
+
+  // Binds as StaticForwarder does, but to the nodes of this topology.
+  void BindMemory(void* base, size_t size, size_t partition) {
+    bind_calls_.emplace_back(base, size, partition);
+    tcmalloc_internal::BindMemory(base, size,
+                                  numa_topology_.GetPartitionNodes(partition),
+                                  numa_topology_.bind_mode());
+  }
+
+  int CpuCapacity(int cpu) const {
+    return static_cast<size_t>(cpu) < cpu_capacities_.size()
+               ? cpu_capacities_[cpu]
+               : kMaxCpuCapacity;
+  }
+
+  int SmtSiblingCount(int cpu) const { return smt_sibling_count_; }
+
+  unsigned L3CacheId(int cpu) const {
+    return static_cast<size_t>(cpu) < l3_cache_ids_.size() ? l3_cache_ids_[cpu]
+                                                           : 0;
+  }
+
+  cpu_set_t AllowedCpus() const {
+    if (allowed_cpus_.has_value()) return *allowed_cpus_;
+    cpu_set_t allowed_cpus;
+    CPU_ZERO(&allowed_cpus);
+    for (int cpu = 0, num_cpus = NumCPUs(); cpu < num_cpus; ++cpu) {
+      CPU_SET(cpu, &allowed_cpus);
+    }
+    return allowed_cpus;
+  }
+
+  double CpuQuota() const { return cpu_quota_; }
+
+  void MaybeRunBackgroundSlice() {}
+
   bool UseWiderSlabs() const { return wider_slabs_enabled_; }
 
   bool ConfigureSizeClassMaxCapacity() const {
@@ -223,12 +305,23 @@ class TestStaticForwarder {
   int64_t arena_reported_impending_bytes_ = 0;
   size_t shrink_to_usage_limit_calls_ = 0;
   bool dynamic_slab_enabled_ = false;
+  bool handoff_enabled_ = false;
+  bool small_footprint_ = false;
+  bool adaptive_batches_enabled_ = false;
+  bool share_smt_capacity_enabled_ = false;
+  int smt_sibling_count_ = 1;
   double dynamic_slab_grow_threshold_ = -1;
   double dynamic_slab_shrink_threshold_ = -1;
   bool wider_slabs_enabled_ = false;
   bool configure_size_class_max_capacity_ = false;
+  std::vector<int> cpu_capacities_;
+  std::vector<unsigned> l3_cache_ids_;
+  std::optional<cpu_set_t> allowed_cpus_;
+  double cpu_quota_ = -1;
   DynamicSlab dynamic_slab_ = DynamicSlab::kNoop;
   std::optional<SizeMap> size_map_;
+  // The base, size and partition of each BindMemory() call.
+  std::vector<std::tuple<void*, size_t, size_t>> bind_calls_;
 
  private:
   NumaTopology<kNumaPartitions, kNumBaseClasses> numa_topology_;
@@ -394,7 +487,7 @@ TEST(CpuCacheTest, Metadata) {
   const size_t kSizeClass = 2;
   const size_t num_to_move = cache.forwarder().num_objects_to_move(kSizeClass);
   const size_t virtual_cpu_id_offset = subtle::percpu::UsingFlatVirtualCpus()
-                                           ? offsetof(kernel_rseq, vcpu_id)
+                                           ? offsetof(kernel_rseq, mm_cid)
                                            : offsetof(kernel_rseq, cpu_id);
   void* ptr;
   {
@@ -522,7 +615,7 @@ TEST(CpuCacheTest, CacheMissStats) {
   int allowed_cpu_id;
   const size_t kSizeClass = 2;
   const size_t virtual_cpu_id_offset = subtle::percpu::UsingFlatVirtualCpus()
-                                           ? offsetof(kernel_rseq, vcpu_id)
+                                           ? offsetof(kernel_rseq, mm_cid)
                                            : offsetof(kernel_rseq, cpu_id);
   void* ptr;
   {
@@ -704,6 +797,282 @@ TEST(CpuCacheTest, StealCpuCache) {
   cache.Deactivate();
 }
 
+TEST(CpuCacheTest, CpusInitializedOnFirstUse) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  CpuCache cache;
+  cache.Activate();
+  // CPUs take their share of the cache limit in effect when they are first
+  // used.
+  const size_t limit = 2 * cache.CacheLimit();
+  cache.SetCacheLimit(limit);
+
+  const size_t virtual_cpu_id_offset = subtle::percpu::UsingFlatVirtualCpus()
+                                           ? offsetof(kernel_rseq, mm_cid)
+                                           : offsetof(kernel_rseq, cpu_id);
+  constexpr size_t kSizeClass = 2;
+  int cpu;
+  void* ptr;
+  {
+    tcmalloc_internal::ScopedAffinityMask mask(
+        tcmalloc_internal::AllowedCpus()[0]);
+    cpu = subtle::percpu::GetCurrentVirtualCpuUnsafe(virtual_cpu_id_offset);
+    ptr = cache.Allocate(kSizeClass);
+    if (mask.Tampered() ||
+        cpu !=
+            subtle::percpu::GetCurrentVirtualCpuUnsafe(virtual_cpu_id_offset)) {
+      cache.Deallocate(ptr, kSizeClass);
+      cache.Deactivate();
+      return;
+    }
+  }
+  ASSERT_NE(ptr, nullptr);
+
+  for (int other = 0, num_cpus = NumCPUs(); other < num_cpus; ++other) {
+    EXPECT_EQ(cache.HasPopulated(other), other == cpu) << other;
+    EXPECT_EQ(cache.Capacity(other), limit) << other;
+    EXPECT_EQ(cache.Allocated(other) + cache.Unallocated(other),
+              cache.Capacity(other))
+        << other;
+    EXPECT_EQ(cache.GetNumReclaims(other), 0) << other;
+  }
+
+  cache.Deallocate(ptr, kSizeClass);
+  cache.Deactivate();
+}
+
+// Returns a file descriptor from which <cpulist> can be read, standing in for
+// /sys/devices/system/node/nodeX/cpulist.
+int SyntheticCpulist(absl::string_view cpulist) {
+  const int fd = memfd_create("cpulist", MFD_CLOEXEC);
+  CHECK_CONDITION(fd != -1);
+  CHECK_CONDITION(write(fd, cpulist.data(), cpulist.size()) == cpulist.size());
+  CHECK_CONDITION(write(fd, "\n", 1) == 1);
+  CHECK_CONDITION(lseek(fd, 0, SEEK_SET) == 0);
+  return fd;
+}
+
+// Gives <cache> a topology of two nodes, with cpus [0, split) local to node 0
+// and the others to node 1, whether or not the host has a node 1.
+void InitTwoNodeTopology(CpuCache& cache, int split, const char* bind_mode) {
+  const std::string cpulists[] = {
+      split > 0 ? absl::StrCat("0-", split - 1) : "",
+      absl::StrCat(split, "-", CPU_SETSIZE - 1),
+  };
+  setenv("TCMALLOC_NUMA_AWARE", bind_mode, 1);
+  cache.forwarder().InitNumaTopologyForTest([&](size_t node) {
+    if (node >= std::size(cpulists)) {
+      errno = ENOENT;
+      return -1;
+    }
+    return SyntheticCpulist(cpulists[node]);
+  });
+  unsetenv("TCMALLOC_NUMA_AWARE");
+}
+
+bool HostHasNode(int node) {
+  const std::string path = absl::StrCat("/sys/devices/system/node/node", node);
+  return access(path.c_str(), F_OK) == 0;
+}
+
+// Returns the NUMA policy mode of the page containing <addr>, and the nodes
+// it binds to.
+std::pair<int, uint64_t> MemoryPolicy(void* addr) {
+  int mode = -1;
+  uint64_t nodemask = 0;
+  CHECK_CONDITION(syscall(__NR_get_mempolicy, &mode, &nodemask,
+                          sizeof(nodemask) * 8, addr, MPOL_F_ADDR) == 0);
+  return {mode & ~MPOL_MODE_FLAGS, nodemask};
+}
+
+// Checks that the slabs were bound in runs of cpus of the same partition, and
+// that the kernel applied each bind that could succeed.
+void CheckSlabBinding(const CpuCache& cache) {
+  const auto& forwarder = cache.forwarder();
+  const auto& topology = forwarder.numa_topology();
+  const int num_cpus = NumCPUs();
+  ASSERT_FALSE(forwarder.bind_calls_.empty());
+
+  char* const slabs = static_cast<char*>(std::get<0>(forwarder.bind_calls_[0]));
+  size_t total = 0;
+  for (const auto& [base, size, partition] : forwarder.bind_calls_) {
+    EXPECT_EQ(base, slabs + total);
+    total += size;
+  }
+  EXPECT_EQ(total % num_cpus, 0);
+  const size_t region_size = total / num_cpus;
+
+  for (const auto& [base, size, partition] : forwarder.bind_calls_) {
+    const int begin = (static_cast<char*>(base) - slabs) / region_size;
+    const int end = begin + size / region_size;
+    for (int cpu = begin; cpu < end; ++cpu) {
+      EXPECT_EQ(topology.GetCpuPartition(cpu), partition) << cpu;
+
+      // Each partition holds the node of the same number.
+      const auto [mode, nodemask] = MemoryPolicy(slabs + cpu * region_size);
+      if (HostHasNode(partition)) {
+        EXPECT_EQ(mode, MPOL_BIND) << cpu;
+        EXPECT_EQ(nodemask, topology.GetPartitionNodes(partition)) << cpu;
+      } else {
+        // The bind failed, so the region keeps the default policy.
+        EXPECT_EQ(mode, MPOL_DEFAULT) << cpu;
+      }
+    }
+  }
+}
+
+// Allocates and frees an object on every cpu we may run on, so that each
+// touches its region of the slabs.
+void AllocateOnEachCpu(CpuCache& cache) {
+  constexpr size_t kSizeClass = 2;
+  for (int cpu : tcmalloc_internal::AllowedCpus()) {
+    tcmalloc_internal::ScopedAffinityMask mask(cpu);
+    void* ptr = cache.Allocate(kSizeClass);
+    ASSERT_NE(ptr, nullptr);
+    cache.Deallocate(ptr, kSizeClass);
+  }
+}
+
+TEST(CpuCacheTest, BindsSlabsToPartitions) {
+  if (kNumaPartitions == 1 || !subtle::percpu::IsFast()) {
+    GTEST_SKIP() << "NUMA awareness is unavailable";
+  }
+
+  // Without a node 1 on the host, binds to it fail and only log a warning.
+  CpuCache cache;
+  InitTwoNodeTopology(cache, (NumCPUs() + 1) / 2, "advisory-binding");
+  ASSERT_TRUE(cache.forwarder().numa_topology().numa_aware());
+  cache.Activate();
+
+  CheckSlabBinding(cache);
+  AllocateOnEachCpu(cache);
+  cache.Deactivate();
+}
+
+TEST(CpuCacheTest, FailedBindFallsBackToDefaultPolicy) {
+  if (kNumaPartitions == 1 || !subtle::percpu::IsFast()) {
+    GTEST_SKIP() << "NUMA awareness is unavailable";
+  }
+  if (HostHasNode(1)) {
+    GTEST_SKIP() << "Binding to node 1 would succeed";
+  }
+
+  // With every cpu local to the missing node 1, each bind fails.  Advisory
+  // binding only logs that, and the slabs remain usable.
+  CpuCache cache;
+  InitTwoNodeTopology(cache, 0, "advisory-binding");
+  ASSERT_TRUE(cache.forwarder().numa_topology().numa_aware());
+  cache.Activate();
+
+  CheckSlabBinding(cache);
+  AllocateOnEachCpu(cache);
+  cache.Deactivate();
+
+  // Strict binding crashes instead.
+  EXPECT_DEATH(
+      {
+        CpuCache strict_cache;
+        InitTwoNodeTopology(strict_cache, 0, "strict-binding");
+        strict_cache.Activate();
+      },
+      "Unable to mbind memory");
+}
+
+TEST(CpuCacheTest, HybridCpuCapacity) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  CpuCache cache;
+  TestStaticForwarder& forwarder = cache.forwarder();
+  // Alternate performance and efficiency cores.
+  const int num_cpus = NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    forwarder.cpu_capacities_.push_back(
+        cpu % 2 == 0 ? kMaxCpuCapacity : kMaxCpuCapacity / 4);
+  }
+  cache.Activate();
+
+  const size_t limit = cache.CacheLimit();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    const size_t expected = cpu % 2 == 0 ? limit : limit / 4;
+    EXPECT_EQ(cache.Capacity(cpu), expected) << cpu;
+    EXPECT_EQ(cache.Unallocated(cpu), expected) << cpu;
+  }
+
+  cache.Deactivate();
+}
+
+TEST(CpuCacheTest, CpuQuotaBudget) {
+  CpuCache cache;
+  TestStaticForwarder& forwarder = cache.forwarder();
+  const int num_cpus = NumCPUs();
+
+  cache.UpdateCpuQuota();
+  EXPECT_EQ(cache.CpuQuotaBudget(), 0);
+
+  // A quota of about as many cpus as there are leaves the caches alone.
+  forwarder.cpu_quota_ = num_cpus;
+  cache.UpdateCpuQuota();
+  EXPECT_EQ(cache.CpuQuotaBudget(), 0);
+
+  if (num_cpus < 4) {
+    GTEST_SKIP() << "Too few cpus for a quota to matter";
+  }
+  // Quotas round up to whole cpus, with headroom.
+  forwarder.cpu_quota_ = 0.5;
+  cache.UpdateCpuQuota();
+  EXPECT_EQ(cache.CpuQuotaBudget(), 2);
+
+  if (subtle::percpu::IsFast()) {
+    cache.Activate();
+    const size_t expected = cache.CacheLimit() * 2 / num_cpus;
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      EXPECT_EQ(cache.Capacity(cpu), expected) << cpu;
+    }
+    cache.Deactivate();
+  }
+
+  forwarder.cpu_quota_ = -1;
+  cache.UpdateCpuQuota();
+  EXPECT_EQ(cache.CpuQuotaBudget(), 0);
+}
+
+TEST(CpuCacheTest, ShareSmtCapacity) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  CpuCache cache;
+  TestStaticForwarder& forwarder = cache.forwarder();
+  forwarder.smt_sibling_count_ = 2;
+  cache.Activate();
+
+  // Siblings only split their capacity once sharing is enabled.
+  const size_t limit = cache.CacheLimit();
+  EXPECT_EQ(cache.Capacity(0), limit);
+  forwarder.share_smt_capacity_enabled_ = true;
+  const int num_cpus = NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    EXPECT_EQ(cache.Capacity(cpu), limit / 2) << cpu;
+    EXPECT_EQ(cache.Unallocated(cpu), limit / 2) << cpu;
+  }
+
+  // The cache populated by the allocation starts with the split capacity too.
+  const size_t kSizeClass = 1;
+  void* ptr = cache.Allocate(kSizeClass);
+  ASSERT_NE(ptr, nullptr);
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    EXPECT_EQ(cache.Capacity(cpu), limit / 2) << cpu;
+    EXPECT_EQ(cache.Allocated(cpu) + cache.Unallocated(cpu), limit / 2) << cpu;
+  }
+  cache.Deallocate(ptr, kSizeClass);
+
+  cache.Deactivate();
+}
+
 // Test that when dynamic slab is enabled, nothing goes horribly wrong and that
 // arena non-resident bytes increases as expected.
 TEST(CpuCacheTest, DynamicSlab) {
@@ -890,6 +1259,90 @@ TEST(CpuCacheTest, ResizeSizeClassesTest) {
   cache.Deactivate();
 }
 
+// In this test, we fill up the cache with a large size class and then take its
+// objects out, so that its capacity goes unused, while a small size class
+// misses.  We check that TuneCapacities() shrinks the large size class to its
+// working set once its misses have decayed, that the small size class gets the
+// capacity and stops missing, and that the overall cpu cache capacity is
+// preserved.
+TEST(CpuCacheTest, TuneCapacities) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  CpuCache cache;
+  cache.Activate();
+
+  constexpr int kCpuId = 0;
+  constexpr int kCpuId1 = 1;
+
+  const size_t max_cpu_cache_size = Parameters::max_per_cpu_cache_size();
+  constexpr int kSmallClass = 1;
+  constexpr int kLargeClass = 2;
+  const int kMaxCapacity = cache.forwarder().max_capacity(kLargeClass);
+
+  const size_t large_class_size = cache.forwarder().class_to_size(kLargeClass);
+  ASSERT_GT(large_class_size * kMaxCapacity, max_cpu_cache_size);
+
+  const size_t batch_size_small =
+      cache.forwarder().num_objects_to_move(kSmallClass);
+  const size_t batch_size_large =
+      cache.forwarder().num_objects_to_move(kLargeClass);
+
+  size_t ops = 0;
+  while (true) {
+    ops += batch_size_large;
+    if (ops > kMaxCapacity || cache.Allocated(kCpuId) == max_cpu_cache_size)
+      break;
+
+    AllocateThenDeallocate(cache, kCpuId, kLargeClass, ops);
+  }
+  EXPECT_EQ(cache.Unallocated(kCpuId), 0);
+
+  std::vector<void*> large_objects;
+  {
+    ScopedFakeCpuId fake_cpu_id(kCpuId);
+    while (cache.TotalObjectsOfClass(kLargeClass) > 0) {
+      large_objects.push_back(cache.Allocate(kLargeClass));
+    }
+  }
+
+  AllocateThenDeallocate(cache, kCpuId, kSmallClass, batch_size_small);
+  EXPECT_GT(cache.GetIntervalSizeClassMisses(kCpuId, kSmallClass,
+                                             PerClassMissType::kTune),
+            0);
+  EXPECT_EQ(cache.TotalObjectsOfClass(kSmallClass), 0);
+
+  constexpr int kPasses = 32;
+  for (int i = 0; i < kPasses; ++i) {
+    AllocateThenDeallocate(cache, kCpuId, kSmallClass, batch_size_small);
+    ScopedFakeCpuId fake_cpu_id_1(kCpuId1);
+    cache.TuneCapacities();
+  }
+  EXPECT_EQ(cache.GetNumCapacityTunes(), kPasses);
+  EXPECT_LE(cache.GetTargetCapacity(kCpuId, kLargeClass),
+            cache.TotalObjectsOfClass(kLargeClass) + batch_size_large);
+  EXPECT_GE(cache.GetTargetCapacity(kCpuId, kSmallClass), batch_size_small);
+
+  AllocateThenDeallocate(cache, kCpuId, kSmallClass, batch_size_small);
+  EXPECT_EQ(cache.GetIntervalSizeClassMisses(kCpuId, kSmallClass,
+                                             PerClassMissType::kTune),
+            0);
+  EXPECT_EQ(cache.TotalObjectsOfClass(kSmallClass), batch_size_small);
+  EXPECT_EQ(cache.Allocated(kCpuId) + cache.Unallocated(kCpuId),
+            max_cpu_cache_size);
+
+  {
+    ScopedFakeCpuId fake_cpu_id(kCpuId);
+    for (void* ptr : large_objects) {
+      cache.Deallocate(ptr, kLargeClass);
+    }
+  }
+
+  // Reclaim caches.
+  cache.Deactivate();
+}
+
 // Runs a single allocate and deallocate operation to warm up the cache. Once a
 // few objects are allocated in the cold cache, we can shuffle cpu caches to
 // steal that capacity from the cold cache to the hot cache.
@@ -1148,6 +1601,47 @@ TEST(CpuCacheTest, ColdHotCacheShuffleTest) {
   cache.Deactivate();
 }
 
+TEST(CpuCacheTest, ShuffleStealsFromSameL3First) {
+  if (!subtle::percpu::IsFast() || NumCPUs() < 3) {
+    return;
+  }
+
+  CpuCache cache;
+  // The hot cpu shares its L3 cache with near_cpu_id only.
+  constexpr int hot_cpu_id = 0;
+  constexpr int far_cpu_id = 1;
+  constexpr int near_cpu_id = 2;
+  cache.forwarder().l3_cache_ids_ = {0, 1, 0};
+  cache.Activate();
+
+  const size_t max_cpu_cache_size = Parameters::max_per_cpu_cache_size();
+  const size_t threshold =
+      CpuCache::kCacheCapacityThreshold * max_cpu_cache_size;
+  constexpr int kMaxStealTries = 1000;
+  const size_t size_class = 2;
+
+  // Both cold caches have capacity to spare alike, but each shuffle only
+  // takes from the far one what the near one cannot give.
+  for (int num_tries = 0;
+       num_tries < kMaxStealTries && cache.Capacity(near_cpu_id) > threshold;
+       ++num_tries) {
+    ColdCacheOperations(cache, far_cpu_id, size_class);
+    ColdCacheOperations(cache, near_cpu_id, size_class);
+    HotCacheOperations(cache, hot_cpu_id);
+    cache.ShuffleCpuCaches();
+
+    EXPECT_LE(cache.Capacity(near_cpu_id), cache.Capacity(far_cpu_id));
+  }
+  EXPECT_GT(cache.Capacity(hot_cpu_id), max_cpu_cache_size);
+
+  // Make sure that the total capacity is preserved.
+  EXPECT_EQ(cache.Capacity(hot_cpu_id) + cache.Capacity(far_cpu_id) +
+                cache.Capacity(near_cpu_id),
+            3 * max_cpu_cache_size);
+
+  cache.Deactivate();
+}
+
 TEST(CpuCacheTest, ReclaimCpuCache) {
   if (!subtle::percpu::IsFast()) {
     return;
@@ -1266,6 +1760,224 @@ TEST(CpuCacheTest, ReclaimCpuCache) {
   cache.Deactivate();
 }
 
+TEST(CpuCacheTest, ReclaimDisallowedCaches) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  const int num_cpus = NumCPUs();
+  if (num_cpus < 2) {
+    GTEST_SKIP() << "Need at least two cpus to evict one.";
+  }
+
+  CpuCache cache;
+  cache.Activate();
+
+  const size_t kSizeClass = 2;
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    SCOPED_TRACE(absl::StrFormat("Failed CPU: %d", cpu));
+    ColdCacheOperations(cache, cpu, kSizeClass);
+    EXPECT_GT(cache.UsedBytes(cpu), 0);
+  }
+
+  // Without a change in affinity, nothing is reclaimed.
+  EXPECT_EQ(cache.ReclaimDisallowedCaches(), 0);
+
+  // Evict every other cpu.
+  cpu_set_t allowed_cpus;
+  CPU_ZERO(&allowed_cpus);
+  for (int cpu = 1; cpu < num_cpus; cpu += 2) {
+    CPU_SET(cpu, &allowed_cpus);
+  }
+  cache.forwarder().allowed_cpus_ = allowed_cpus;
+  EXPECT_GT(cache.ReclaimDisallowedCaches(), 0);
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    SCOPED_TRACE(absl::StrFormat("Failed CPU: %d", cpu));
+    if (cpu % 2 == 0) {
+      EXPECT_EQ(cache.UsedBytes(cpu), 0);
+      EXPECT_EQ(cache.GetNumReclaims(cpu), 1);
+    } else {
+      EXPECT_GT(cache.UsedBytes(cpu), 0);
+      EXPECT_EQ(cache.GetNumReclaims(cpu), 0);
+    }
+  }
+
+  // Evicted cpus are only reclaimed once, and cpus allowed again are not
+  // reclaimed.
+  EXPECT_EQ(cache.ReclaimDisallowedCaches(), 0);
+  cache.forwarder().allowed_cpus_.reset();
+  EXPECT_EQ(cache.ReclaimDisallowedCaches(), 0);
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    EXPECT_EQ(cache.GetNumReclaims(cpu), cpu % 2 == 0 ? 1 : 0);
+  }
+
+  cache.Deactivate();
+}
+
+TEST(CpuCacheTest, HandoffToAllocatingCpu) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+  if (NumCPUs() < 2) {
+    GTEST_SKIP() << "Need at least two cpus to hand off between.";
+  }
+
+  CpuCache cache;
+  cache.forwarder().handoff_enabled_ = true;
+  cache.Activate();
+
+  constexpr int kProducer = 0;
+  constexpr int kConsumer = 1;
+  constexpr size_t kSizeClass = 1;
+  std::vector<void*> ptrs(4096);
+  auto produce = [&] {
+    ScopedFakeCpuId fake_cpu_id(kProducer);
+    for (void*& ptr : ptrs) {
+      ptr = cache.Allocate(kSizeClass);
+    }
+  };
+  auto consume = [&] {
+    ScopedFakeCpuId fake_cpu_id(kConsumer);
+    for (void* ptr : ptrs) {
+      cache.Deallocate(ptr, kSizeClass);
+    }
+  };
+
+  produce();
+  consume();
+  EXPECT_EQ(cache.GetNumHandoffs(), 0);
+
+  // The consumer only overflowed and the producer only underflowed.
+  cache.UpdateHandoffTargets();
+  EXPECT_EQ(cache.GetHandoffTarget(kConsumer, kSizeClass), kProducer);
+  EXPECT_EQ(cache.GetHandoffTarget(kProducer, kSizeClass), -1);
+  EXPECT_EQ(cache.GetHandoffTarget(kConsumer, kSizeClass + 1), -1);
+
+  produce();
+  consume();
+  EXPECT_EQ(cache.GetNumHandoffs(kConsumer), 0);
+  EXPECT_GT(cache.GetNumHandoffs(kProducer), 0);
+  const size_t staged = CpuCachePeer::HandoffBytes(cache, kProducer);
+  EXPECT_GT(staged, 0);
+  EXPECT_GE(cache.UsedBytes(kProducer), staged);
+
+  // The producer refills from what was handed off first.
+  produce();
+  EXPECT_LT(CpuCachePeer::HandoffBytes(cache, kProducer), staged);
+  consume();
+
+  // Disabling handoff unpairs the cpus.
+  cache.forwarder().handoff_enabled_ = false;
+  cache.UpdateHandoffTargets();
+  EXPECT_EQ(cache.GetHandoffTarget(kConsumer, kSizeClass), -1);
+
+  cache.Reclaim(kProducer);
+  EXPECT_EQ(CpuCachePeer::HandoffBytes(cache, kProducer), 0);
+  cache.Deactivate();
+}
+
+TEST(CpuCacheTest, RequestedHandoff) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+  if (NumCPUs() < 2) {
+    GTEST_SKIP() << "Need at least two cpus to hand off between.";
+  }
+
+  CpuCache cache;
+  cache.forwarder().handoff_enabled_ = false;
+  cache.Activate();
+
+  constexpr int kProducer = 0;
+  constexpr int kConsumer = 1;
+  constexpr size_t kSizeClass = 1;
+  std::vector<void*> ptrs(4096);
+  auto produce_and_consume = [&](size_t size_class) {
+    {
+      ScopedFakeCpuId fake_cpu_id(kProducer);
+      for (void*& ptr : ptrs) {
+        ptr = cache.Allocate(size_class);
+      }
+    }
+    ScopedFakeCpuId fake_cpu_id(kConsumer);
+    for (void* ptr : ptrs) {
+      cache.Deallocate(ptr, size_class);
+    }
+  };
+
+  // Only the requested size class is paired while handoff is disabled.
+  cache.RequestHandoff(kSizeClass);
+  produce_and_consume(kSizeClass);
+  produce_and_consume(kSizeClass + 1);
+  cache.UpdateHandoffTargets();
+  EXPECT_EQ(cache.GetHandoffTarget(kConsumer, kSizeClass), kProducer);
+  EXPECT_EQ(cache.GetHandoffTarget(kConsumer, kSizeClass + 1), -1);
+
+  produce_and_consume(kSizeClass);
+  EXPECT_GT(cache.GetNumHandoffs(kProducer), 0);
+
+  cache.Reclaim(kProducer);
+  cache.Deactivate();
+}
+
+TEST(CpuCacheTest, AdaptiveBatchLengths) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+  if (NumCPUs() < 2) {
+    GTEST_SKIP() << "Need at least two cpus to move objects between.";
+  }
+
+  CpuCache cache;
+  cache.forwarder().adaptive_batches_enabled_ = true;
+  cache.Activate();
+
+  constexpr size_t kHotClass = 1;
+  constexpr size_t kIdleClass = 2;
+  const size_t hot_base = cache.forwarder().num_objects_to_move(kHotClass);
+  const size_t idle_base = cache.forwarder().num_objects_to_move(kIdleClass);
+  EXPECT_EQ(cache.BatchLength(kHotClass), hot_base);
+
+  // Allocating on one cpu and freeing on another makes both miss at least
+  // once per round.
+  auto misses = [&] {
+    const CpuCache::CpuCacheMissStats stats = cache.GetTotalCacheMissStats();
+    return stats.underflows + stats.overflows;
+  };
+  const size_t start = misses();
+  std::vector<void*> ptrs(256);
+  for (int round = 0; round < 10000; ++round) {
+    if (misses() - start >= CpuCache::kMissesToGrowBatch) break;
+    {
+      ScopedFakeCpuId fake_cpu_id(0);
+      for (void*& ptr : ptrs) ptr = cache.Allocate(kHotClass);
+    }
+    ScopedFakeCpuId fake_cpu_id(1);
+    for (void* ptr : ptrs) cache.Deallocate(ptr, kHotClass);
+  }
+  ASSERT_GE(misses() - start, CpuCache::kMissesToGrowBatch);
+
+  cache.UpdateBatchLengths();
+  EXPECT_EQ(cache.BatchLength(kHotClass),
+            std::min(2 * hot_base, kMaxObjectsToMove));
+  EXPECT_EQ(cache.BatchLength(kIdleClass),
+            std::max<size_t>(idle_base / 2, 1));
+
+  // The idle class does not shrink below a quarter of its default.
+  for (int i = 0; i < 8; ++i) cache.UpdateBatchLengths();
+  EXPECT_EQ(cache.BatchLength(kIdleClass),
+            std::max<size_t>(idle_base / 4, 1));
+
+  // Disabling adaptation restores the defaults.
+  cache.forwarder().adaptive_batches_enabled_ = false;
+  cache.UpdateBatchLengths();
+  EXPECT_EQ(cache.BatchLength(kHotClass), hot_base);
+  EXPECT_EQ(cache.BatchLength(kIdleClass), idle_base);
+
+  for (int cpu = 0, n = NumCPUs(); cpu < n; ++cpu) cache.Reclaim(cpu);
+  cache.Deactivate();
+}
+
 TEST(CpuCacheTest, SizeClassCapacityTest) {
   if (!subtle::percpu::IsFast()) {
     return;
@@ -1601,6 +2313,90 @@ TEST(CpuCacheTest, DISABLED_ChangingSizes) {
   EXPECT_EQ(env.num_cpus() * last_cache_size, capacity);
 }
 
+TEST(CpuCacheTest, AllocateDeallocateBatch) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+  CpuCache cache;
+  cache.Activate();
+
+  constexpr size_t kSizeClass = 1;
+  // Ask for more objects than a single transfer cache batch so that the
+  // request is satisfied from both the slab and the backing cache.
+  const size_t kCount =
+      3 * cache.forwarder().num_objects_to_move(kSizeClass) + 1;
+  std::vector<void*> batch(kCount, nullptr);
+
+  for (int iteration = 0; iteration < 4; ++iteration) {
+    ASSERT_EQ(cache.AllocateBatch(kSizeClass, batch.data(), kCount), kCount);
+    std::vector<void*> sorted = batch;
+    std::sort(sorted.begin(), sorted.end());
+    EXPECT_TRUE(std::adjacent_find(sorted.begin(), sorted.end()) ==
+                sorted.end());
+    EXPECT_THAT(batch, testing::Not(testing::Contains(nullptr)));
+
+    cache.DeallocateBatch(kSizeClass, batch.data(), kCount);
+  }
+
+  EXPECT_EQ(cache.AllocateBatch(kSizeClass, batch.data(), 0), 0);
+  cache.DeallocateBatch(kSizeClass, batch.data(), 0);
+
+  for (int cpu = 0, n = NumCPUs(); cpu < n; ++cpu) {
+    cache.Reclaim(cpu);
+  }
+  cache.Deactivate();
+}
+
+TEST(CpuCacheTest, DeallocateRemote) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+  CpuCache cache;
+  cache.Activate();
+  TestStaticForwarder& forwarder = cache.forwarder();
+
+  // Remote frees are staged per CPU, so keep this thread on a single core.
+  tcmalloc_internal::ScopedAffinityMask mask(
+      tcmalloc_internal::AllowedCpus()[0]);
+
+  constexpr size_t kSizeClass = 1;
+  const int kMaxRemoteFrees = CpuCachePeer::MaxRemoteFrees<CpuCache>();
+  std::vector<void*> objs;
+  for (int i = 0; i < kMaxRemoteFrees + kMaxRemoteFrees / 2; ++i) {
+    objs.push_back(cache.Allocate(kSizeClass));
+  }
+  const size_t tc_length = forwarder.transfer_cache().tc_length(kSizeClass);
+  const size_t slab_objects = cache.TotalObjectsOfClass(kSizeClass);
+
+  // Remote frees are staged until a full batch has accumulated, and are never
+  // cached in the local slab.
+  for (int i = 0; i < kMaxRemoteFrees - 1; ++i) {
+    cache.DeallocateRemote(objs[i], kSizeClass);
+  }
+  EXPECT_EQ(forwarder.transfer_cache().tc_length(kSizeClass), tc_length);
+  EXPECT_EQ(cache.TotalObjectsOfClass(kSizeClass), slab_objects);
+  EXPECT_EQ(cache.GetNumRemoteFrees(), kMaxRemoteFrees - 1);
+
+  cache.DeallocateRemote(objs[kMaxRemoteFrees - 1], kSizeClass);
+  EXPECT_EQ(forwarder.transfer_cache().tc_length(kSizeClass),
+            tc_length + kMaxRemoteFrees);
+
+  // Reclaiming the CPU releases a partially filled batch.
+  for (int i = kMaxRemoteFrees; i < objs.size(); ++i) {
+    cache.DeallocateRemote(objs[i], kSizeClass);
+  }
+  EXPECT_EQ(forwarder.transfer_cache().tc_length(kSizeClass),
+            tc_length + kMaxRemoteFrees);
+  for (int cpu = 0, n = NumCPUs(); cpu < n; ++cpu) {
+    cache.Reclaim(cpu);
+  }
+  EXPECT_EQ(cache.GetNumRemoteFrees(), objs.size());
+  EXPECT_GE(forwarder.transfer_cache().tc_length(kSizeClass),
+            tc_length + objs.size());
+
+  cache.Deactivate();
+}
+
 TEST(CpuCacheTest, TargetOverflowRefillCount) {
   auto F = cpu_cache_internal::TargetOverflowRefillCount;
   // Args are: capacity, batch_length, successive.
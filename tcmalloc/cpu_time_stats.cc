@@ -0,0 +1,112 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/cpu_time_stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/optimization.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT CpuTimeStats cpu_time_stats;
+
+ABSL_CONST_INIT thread_local int64_t ScopedCpuTimer::nested_ticks_ = 0;
+
+const char* CpuTimeStats::PathName(CpuTimePath path) {
+  switch (path) {
+    case CpuTimePath::kAllocateFast:
+      return "allocate_fast";
+    case CpuTimePath::kCpuCacheRefill:
+      return "cpu_cache_refill";
+    case CpuTimePath::kCentralFreeListPopulate:
+      return "central_freelist_populate";
+    case CpuTimePath::kPageAllocatorNew:
+      return "page_allocator_new";
+    case CpuTimePath::kReleaseMemoryToSystem:
+      return "release_memory_to_system";
+    case CpuTimePath::kNumPaths:
+      break;
+  }
+  ASSUME(false);
+  return "";
+}
+
+uint64_t CpuTimeStats::total_ticks() const {
+  uint64_t total = 0;
+  for (int path = 0; path < kNumPaths; ++path) {
+    total += ticks(static_cast<CpuTimePath>(path));
+  }
+  return total;
+}
+
+uint64_t CpuTimeStats::TicksToNanoseconds(uint64_t ticks) {
+  const double frequency = absl::base_internal::CycleClock::Frequency();
+  if (frequency <= 0) return 0;
+  return static_cast<uint64_t>(static_cast<double>(ticks) * 1e9 / frequency);
+}
+
+bool CpuTimeStats::GetNumericProperty(absl::string_view name,
+                                      size_t* value) const {
+  constexpr absl::string_view kPrefix = "tcmalloc.allocator_cpu_ns";
+  if (!absl::ConsumePrefix(&name, kPrefix)) return false;
+  if (name.empty()) {
+    *value = TicksToNanoseconds(total_ticks());
+    return true;
+  }
+  if (!absl::ConsumePrefix(&name, ".")) return false;
+  for (int path = 0; path < kNumPaths; ++path) {
+    const CpuTimePath p = static_cast<CpuTimePath>(path);
+    if (name == PathName(p)) {
+      *value = TicksToNanoseconds(ticks(p));
+      return true;
+    }
+  }
+  return false;
+}
+
+void CpuTimeStats::Print(Printer* out) const {
+  out->printf("------------------------------------------------\n");
+  out->printf("Allocator CPU time: %llu ns\n",
+              TicksToNanoseconds(total_ticks()));
+  for (int path = 0; path < kNumPaths; ++path) {
+    const CpuTimePath p = static_cast<CpuTimePath>(path);
+    out->printf("Allocator CPU time: %-25s %14llu ns\n", PathName(p),
+                TicksToNanoseconds(ticks(p)));
+  }
+}
+
+void CpuTimeStats::PrintInPbtxt(PbtxtRegion* region) const {
+  auto cpu_time = region->CreateSubRegion("allocator_cpu_time");
+  cpu_time.PrintI64("total_ns", TicksToNanoseconds(total_ticks()));
+  for (int path = 0; path < kNumPaths; ++path) {
+    const CpuTimePath p = static_cast<CpuTimePath>(path);
+    auto entry = cpu_time.CreateSubRegion("path");
+    entry.PrintRaw("name", PathName(p));
+    entry.PrintI64("ns", TicksToNanoseconds(ticks(p)));
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,141 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_CPU_TIME_STATS_H_
+#define TCMALLOC_CPU_TIME_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/strings/string_view.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The allocator paths whose CPU time CpuTimeStats accounts for.
+enum class CpuTimePath {
+  // CpuCache::AllocateFast, estimated from the allocations that are sampled
+  // for heap profiling.  Frees are not accounted for.
+  kAllocateFast,
+  // CpuCache::Refill, less the time spent in the paths below.
+  kCpuCacheRefill,
+  // CentralFreeList::Populate, less the time spent in PageAllocator::New.
+  kCentralFreeListPopulate,
+  // PageAllocator::New, for central freelist spans and large allocations.
+  // Includes waiting for pageheap_lock.
+  kPageAllocatorNew,
+  // MallocExtension::ReleaseMemoryToSystem, including the background
+  // thread's periodic release.
+  kReleaseMemoryToSystem,
+  kNumPaths,
+};
+
+// Accounts for the CPU time spent on the allocator's paths, cheaply enough to
+// leave on in production.  Slow paths are timed on every call, with
+// ScopedCpuTimer.  The allocation fast path is too short to time on every
+// call, so it is timed only for allocations sampled for heap profiling, each
+// standing in for the fast path allocations it represents.
+//
+// Nested paths are not double counted: each path is charged its own time,
+// less that of the paths timed within it, so the paths add up to the total.
+class CpuTimeStats {
+ public:
+  static constexpr int kNumPaths = static_cast<int>(CpuTimePath::kNumPaths);
+
+  constexpr CpuTimeStats() = default;
+
+  CpuTimeStats(const CpuTimeStats&) = delete;
+  CpuTimeStats& operator=(const CpuTimeStats&) = delete;
+
+  void Record(CpuTimePath path, int64_t ticks) {
+    if (ticks <= 0) return;
+    ticks_[static_cast<int>(path)].fetch_add(ticks, std::memory_order_relaxed);
+  }
+
+  // Records a fast path allocation that took <ticks> and was sampled with
+  // <weight>, the number of allocations the sample represents.
+  void RecordSampledFastPath(int64_t ticks, size_t weight) {
+    if (ticks <= 0) return;
+    Record(CpuTimePath::kAllocateFast, ticks * static_cast<int64_t>(weight));
+  }
+
+  // The CycleClock ticks accounted to <path>.
+  uint64_t ticks(CpuTimePath path) const {
+    return ticks_[static_cast<int>(path)].load(std::memory_order_relaxed);
+  }
+
+  // The CycleClock ticks accounted to every path.
+  uint64_t total_ticks() const;
+
+  // <ticks> converted to nanoseconds.
+  static uint64_t TicksToNanoseconds(uint64_t ticks);
+
+  // Reports the CPU time of every path as tcmalloc.allocator_cpu_ns.<path>,
+  // and their total as tcmalloc.allocator_cpu_ns.  Returns false if <name>
+  // is not one of these.
+  bool GetNumericProperty(absl::string_view name, size_t* value) const;
+
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+  static const char* PathName(CpuTimePath path);
+
+ private:
+  std::atomic<uint64_t> ticks_[kNumPaths] = {};
+};
+
+extern CpuTimeStats cpu_time_stats;
+
+// Charges the CPU time of its scope to <path> in cpu_time_stats, less the
+// time charged by the ScopedCpuTimers nested within it on the same thread.
+class ScopedCpuTimer {
+ public:
+  explicit ScopedCpuTimer(CpuTimePath path)
+      : path_(path),
+        start_(absl::base_internal::CycleClock::Now()),
+        nested_start_(nested_ticks_) {}
+
+  ~ScopedCpuTimer() {
+    const int64_t elapsed = absl::base_internal::CycleClock::Now() - start_;
+    if (elapsed <= 0) return;
+    cpu_time_stats.Record(path_, elapsed - (nested_ticks_ - nested_start_));
+    // Our parent, if any, is not charged for our time.
+    nested_ticks_ = nested_start_ + elapsed;
+  }
+
+  ScopedCpuTimer(const ScopedCpuTimer&) = delete;
+  ScopedCpuTimer& operator=(const ScopedCpuTimer&) = delete;
+
+ private:
+  // The ticks spent in the timers completed on this thread, with nested
+  // timers counted only as part of the timer they are nested in.
+  ABSL_CONST_INIT static thread_local int64_t nested_ticks_;
+
+  const CpuTimePath path_;
+  const int64_t start_;
+  const int64_t nested_start_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_CPU_TIME_STATS_H_
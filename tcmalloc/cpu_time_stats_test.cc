@@ -0,0 +1,145 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/cpu_time_stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/internal/cycleclock.h"
+#include "tcmalloc/internal/logging.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Spins for at least <ticks> CycleClock ticks.
+void Spin(int64_t ticks) {
+  const int64_t start = absl::base_internal::CycleClock::Now();
+  while (absl::base_internal::CycleClock::Now() - start < ticks) {
+  }
+}
+
+class CpuTimeStatsTest : public testing::Test {
+ protected:
+  uint64_t Ticks(CpuTimePath path) const { return cpu_time_stats.ticks(path); }
+
+  void Snapshot() {
+    for (int path = 0; path < CpuTimeStats::kNumPaths; ++path) {
+      before_[path] = Ticks(static_cast<CpuTimePath>(path));
+    }
+  }
+
+  uint64_t Delta(CpuTimePath path) const {
+    return Ticks(path) - before_[static_cast<int>(path)];
+  }
+
+  uint64_t before_[CpuTimeStats::kNumPaths] = {};
+};
+
+TEST_F(CpuTimeStatsTest, NestedTimersAreNotDoubleCounted) {
+  constexpr int64_t kTicks = 1 << 20;
+  Snapshot();
+  {
+    ScopedCpuTimer outer(CpuTimePath::kCpuCacheRefill);
+    Spin(kTicks);
+    {
+      ScopedCpuTimer inner(CpuTimePath::kCentralFreeListPopulate);
+      Spin(kTicks);
+      {
+        ScopedCpuTimer innermost(CpuTimePath::kPageAllocatorNew);
+        Spin(2 * kTicks);
+      }
+    }
+  }
+  const uint64_t refill = Delta(CpuTimePath::kCpuCacheRefill);
+  const uint64_t populate = Delta(CpuTimePath::kCentralFreeListPopulate);
+  const uint64_t page_allocator = Delta(CpuTimePath::kPageAllocatorNew);
+  EXPECT_GE(refill, kTicks);
+  EXPECT_GE(populate, kTicks);
+  EXPECT_GE(page_allocator, 2 * kTicks);
+  // Tolerate the thread being descheduled, but not the inner timers being
+  // charged to the outer ones.
+  EXPECT_LT(refill, 2 * kTicks);
+  EXPECT_LT(populate, 2 * kTicks);
+  EXPECT_EQ(Delta(CpuTimePath::kAllocateFast), 0);
+  EXPECT_EQ(Delta(CpuTimePath::kReleaseMemoryToSystem), 0);
+}
+
+TEST_F(CpuTimeStatsTest, SequentialTimers) {
+  constexpr int64_t kTicks = 1 << 20;
+  Snapshot();
+  ScopedCpuTimer outer(CpuTimePath::kReleaseMemoryToSystem);
+  for (int i = 0; i < 2; ++i) {
+    ScopedCpuTimer timer(CpuTimePath::kPageAllocatorNew);
+    Spin(kTicks);
+  }
+  EXPECT_GE(Delta(CpuTimePath::kPageAllocatorNew), 2 * kTicks);
+}
+
+TEST(CpuTimeStatsStandaloneTest, SampledFastPath) {
+  CpuTimeStats stats;
+  stats.RecordSampledFastPath(20, 1000);
+  stats.RecordSampledFastPath(0, 1000);
+  EXPECT_EQ(stats.ticks(CpuTimePath::kAllocateFast), 20000);
+  stats.Record(CpuTimePath::kCpuCacheRefill, 500);
+  stats.Record(CpuTimePath::kCpuCacheRefill, -1);
+  EXPECT_EQ(stats.ticks(CpuTimePath::kCpuCacheRefill), 500);
+  EXPECT_EQ(stats.total_ticks(), 20500);
+}
+
+TEST(CpuTimeStatsStandaloneTest, Properties) {
+  CpuTimeStats stats;
+  const uint64_t second = static_cast<uint64_t>(
+      absl::base_internal::CycleClock::Frequency());
+  stats.Record(CpuTimePath::kPageAllocatorNew, second);
+  stats.Record(CpuTimePath::kReleaseMemoryToSystem, second);
+
+  size_t value;
+  ASSERT_TRUE(stats.GetNumericProperty("tcmalloc.allocator_cpu_ns", &value));
+  EXPECT_NEAR(value, 2e9, 1e3);
+  ASSERT_TRUE(stats.GetNumericProperty(
+      "tcmalloc.allocator_cpu_ns.page_allocator_new", &value));
+  EXPECT_NEAR(value, 1e9, 1e3);
+  ASSERT_TRUE(stats.GetNumericProperty(
+      "tcmalloc.allocator_cpu_ns.allocate_fast", &value));
+  EXPECT_EQ(value, 0);
+  EXPECT_FALSE(
+      stats.GetNumericProperty("tcmalloc.allocator_cpu_ns.bogus", &value));
+  EXPECT_FALSE(
+      stats.GetNumericProperty("tcmalloc.allocator_cpu_nsx", &value));
+  EXPECT_FALSE(stats.GetNumericProperty("tcmalloc.cpu_free", &value));
+}
+
+TEST(CpuTimeStatsStandaloneTest, Print) {
+  CpuTimeStats stats;
+  stats.Record(CpuTimePath::kCpuCacheRefill, 1000);
+
+  std::string buffer(1 << 12, '\0');
+  Printer printer(&buffer[0], buffer.size());
+  stats.Print(&printer);
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("Allocator CPU time: "));
+  EXPECT_THAT(buffer, testing::HasSubstr("cpu_cache_refill"));
+  EXPECT_THAT(buffer, testing::HasSubstr("release_memory_to_system"));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
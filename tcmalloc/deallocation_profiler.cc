@@ -21,7 +21,9 @@
 #include <cstring>
 #include <functional>
 #include <limits>
+#include <iterator>
 #include <memory>
+#include <new>
 #include <type_traits>
 #include <utility>
 
@@ -31,6 +33,7 @@
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/internal/sysinfo.h"
 #include "absl/base/macros.h"
+#include "absl/base/optimization.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/debugging/stacktrace.h"  // for GetStackTrace
 #include "absl/functional/function_ref.h"
@@ -43,6 +46,7 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/percpu.h"
 #include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/internal/sysinfo.h"
 #include "tcmalloc/internal_malloc_extension.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/static_vars.h"
@@ -173,6 +177,35 @@ int GetNumaId(int cpu_id) {
              : -1;
 }
 
+// Records where and by whom the calling thread allocates or deallocates.
+void RecordCurrentCpuAndThread(DeallocationSampleRecord& record) {
+  record.cpu_id = tcmalloc_internal::subtle::percpu::GetCurrentCpu();
+  record.vcpu_id = tcmalloc_internal::subtle::percpu::VirtualRseqCpuId();
+  record.l3_id = GetL3Id(record.cpu_id);
+  record.numa_id = GetNumaId(record.cpu_id);
+  record.thread_id = absl::base_internal::GetTID();
+}
+
+DeallocationSampleRecord MakeAllocationRecord(
+    const tcmalloc_internal::StackTrace& stack_trace) {
+  DeallocationSampleRecord allocation;
+  allocation.allocated_size = stack_trace.allocated_size;
+  allocation.requested_size = stack_trace.requested_size;
+  allocation.requested_alignment = stack_trace.requested_alignment;
+  allocation.depth =
+      std::min(static_cast<int64_t>(stack_trace.depth), kMaxStackDepth);
+  memcpy(allocation.stack, stack_trace.stack,
+         sizeof(void*) * allocation.depth);
+  // TODO(mmaas): Do we need to worry about b/65384231 anymore?
+  allocation.creation_time = stack_trace.allocation_time;
+  RecordCurrentCpuAndThread(allocation);
+  // We divide by the requested size to obtain the number of allocations.
+  // TODO(b/248332543): Consider using AllocatedBytes from sampler.h.
+  allocation.weight = static_cast<double>(stack_trace.weight) /
+                      (stack_trace.requested_size + 1);
+  return allocation;
+}
+
 constexpr std::pair<CpuThreadMatchingStatus, RpcMatchingStatus> kAllCases[] = {
     // clang-format off
     {CpuThreadMatchingStatus(false, false, false, false, false), RpcMatchingStatus(0, 0)},
@@ -424,6 +457,9 @@ class DeallocationProfiler {
       double variance_life_times_ns[kNumCases] = {0.0};
       double min_life_times_ns[kNumCases] = {0.0};
       double max_life_times_ns[kNumCases] = {0.0};
+      // Deallocations by lifetime, over all cases.
+      int64_t lifetime_histogram[Profile::Sample::kLifetimeHistogramBuckets] =
+          {0};
 
       Value() {
         std::fill_n(min_life_times_ns, kNumCases,
@@ -442,6 +478,11 @@ class DeallocationProfiler {
   // Keep track of allocations that are in flight
   AllocsTable allocs_;
 
+  // Deallocations delivered before their allocations.  Events are buffered
+  // per CPU, so a deallocation can overtake its allocation when both are
+  // pending in different buffers.
+  AllocsTable early_frees_;
+
   // Table to store lifetime information collected by this profiler
   std::unique_ptr<DeallocationStackTraceTable> reports_ = nullptr;
 
@@ -469,62 +510,85 @@ class DeallocationProfiler {
     return tcmalloc::Profile();
   }
 
-  void ReportMalloc(const tcmalloc_internal::StackTrace& stack_trace) {
+  void ReportMalloc(tcmalloc_internal::AllocHandle handle,
+                    const DeallocationSampleRecord& allocation) {
+    auto it = early_frees_.find(handle);
+    if (ABSL_PREDICT_FALSE(it != early_frees_.end())) {
+      DeallocationSampleRecord deallocation = it->second;
+      early_frees_.erase(it);
+      AddTrace(allocation, deallocation);
+      return;
+    }
+
     // store sampled alloc in the hashmap
-    DeallocationSampleRecord& allocation =
-        allocs_[stack_trace.sampled_alloc_handle];
-
-    allocation.allocated_size = stack_trace.allocated_size;
-    allocation.requested_size = stack_trace.requested_size;
-    allocation.requested_alignment = stack_trace.requested_alignment;
-    allocation.depth = stack_trace.depth;
-    memcpy(allocation.stack, stack_trace.stack,
-           sizeof(void*) * std::min(static_cast<int64_t>(stack_trace.depth),
-                                    kMaxStackDepth));
-    // TODO(mmaas): Do we need to worry about b/65384231 anymore?
-    allocation.creation_time = stack_trace.allocation_time;
-    allocation.cpu_id = tcmalloc_internal::subtle::percpu::GetCurrentCpu();
-    allocation.vcpu_id = tcmalloc_internal::subtle::percpu::VirtualRseqCpuId();
-    allocation.l3_id = GetL3Id(allocation.cpu_id);
-    allocation.numa_id = GetNumaId(allocation.cpu_id);
-    allocation.thread_id = absl::base_internal::GetTID();
-    // We divide by the requested size to obtain the number of allocations.
-    // TODO(b/248332543): Consider using AllocatedBytes from sampler.h.
-    allocation.weight = static_cast<double>(stack_trace.weight) /
-                        (stack_trace.requested_size + 1);
+    allocs_[handle] = allocation;
   }
 
-  void ReportFree(tcmalloc_internal::AllocHandle handle) {
+  void ReportFree(tcmalloc_internal::AllocHandle handle,
+                  const DeallocationSampleRecord& deallocation) {
     auto it = allocs_.find(handle);
 
     // Handle the case that we observed the deallocation but not the allocation
+    // (yet).
     if (it == allocs_.end()) {
+      early_frees_[handle] = deallocation;
       return;
     }
 
     DeallocationSampleRecord sample = it->second;
     allocs_.erase(it);
+    AddTrace(sample, deallocation);
+  }
 
-    DeallocationSampleRecord deallocation;
-    deallocation.allocated_size = sample.allocated_size;
-    deallocation.requested_alignment = sample.requested_alignment;
-    deallocation.requested_size = sample.requested_size;
-    deallocation.creation_time = absl::Now();
-    deallocation.cpu_id = tcmalloc_internal::subtle::percpu::GetCurrentCpu();
-    deallocation.vcpu_id =
-        tcmalloc_internal::subtle::percpu::VirtualRseqCpuId();
-    deallocation.l3_id = GetL3Id(deallocation.cpu_id);
-    deallocation.numa_id = GetNumaId(deallocation.cpu_id);
-    deallocation.thread_id = absl::base_internal::GetTID();
-    deallocation.depth =
-        absl::GetStackTrace(deallocation.stack, kMaxStackDepth, 1);
-
-    reports_->AddTrace(sample, deallocation);
+ private:
+  void AddTrace(const DeallocationSampleRecord& allocation,
+                DeallocationSampleRecord deallocation) {
+    deallocation.allocated_size = allocation.allocated_size;
+    deallocation.requested_alignment = allocation.requested_alignment;
+    deallocation.requested_size = allocation.requested_size;
+    reports_->AddTrace(allocation, deallocation);
   }
 };
 
+struct DeallocationProfilerList::PendingEvent {
+  tcmalloc_internal::AllocHandle handle;
+  bool is_free;
+  DeallocationSampleRecord record;
+};
+
+struct ABSL_CACHELINE_ALIGNED DeallocationProfilerList::PendingEvents {
+  // Sampling is sparse, so a few events per CPU suffice to make flushes,
+  // which take profilers_lock_, rare.
+  static constexpr int kCapacity = 16;
+
+  absl::base_internal::SpinLock lock{absl::kConstInit,
+                                     absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  int count = 0;
+  PendingEvent events[kCapacity];
+};
+
 void DeallocationProfilerList::Add(DeallocationProfiler* profiler) {
   AllocationGuardSpinLockHolder h(&profilers_lock_);
+  // Deliver what is pending to the running profilers only.
+  FlushLocked();
+
+  if (pending_.load(std::memory_order_relaxed) == nullptr) {
+    const int num_cpus = tcmalloc_internal::NumCPUs();
+    void* buffers;
+    {
+      AllocationGuardSpinLockHolder l(&tcmalloc_internal::pageheap_lock);
+      buffers = tcmalloc_internal::tc_globals.arena().Alloc(
+          num_cpus * sizeof(PendingEvents),
+          std::align_val_t{alignof(PendingEvents)});
+    }
+    PendingEvents* pending = static_cast<PendingEvents*>(buffers);
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      new (&pending[cpu]) PendingEvents();
+    }
+    num_pending_ = num_cpus;
+    pending_.store(pending, std::memory_order_release);
+  }
+
   profiler->next_ = first_;
   first_ = profiler;
 
@@ -532,13 +596,20 @@ void DeallocationProfilerList::Add(DeallocationProfiler* profiler) {
   tcmalloc_internal::tc_globals.sampled_allocation_recorder().Iterate(
       [profiler](
           const tcmalloc_internal::SampledAllocation& sampled_allocation) {
-        profiler->ReportMalloc(sampled_allocation.sampled_stack);
+        const tcmalloc_internal::StackTrace& stack_trace =
+            sampled_allocation.stack_trace();
+        profiler->ReportMalloc(stack_trace.sampled_alloc_handle,
+                               MakeAllocationRecord(stack_trace));
       });
+  active_.fetch_add(1, std::memory_order_relaxed);
 }
 
 // This list is very short and we're nowhere near a hot path, just walk
 void DeallocationProfilerList::Remove(DeallocationProfiler* profiler) {
   AllocationGuardSpinLockHolder h(&profilers_lock_);
+  // Give the profiler the events that happened while it was running.
+  FlushLocked();
+  active_.fetch_sub(1, std::memory_order_relaxed);
   DeallocationProfiler** link = &first_;
   DeallocationProfiler* cur = first_;
   while (cur != profiler) {
@@ -551,21 +622,74 @@ void DeallocationProfilerList::Remove(DeallocationProfiler* profiler) {
 
 void DeallocationProfilerList::ReportMalloc(
     const tcmalloc_internal::StackTrace& stack_trace) {
-  AllocationGuardSpinLockHolder h(&profilers_lock_);
-  DeallocationProfiler* cur = first_;
-  while (cur != nullptr) {
-    cur->ReportMalloc(stack_trace);
-    cur = cur->next_;
-  }
+  if (active_.load(std::memory_order_relaxed) == 0) return;
+
+  PendingEvent event;
+  event.handle = stack_trace.sampled_alloc_handle;
+  event.is_free = false;
+  event.record = MakeAllocationRecord(stack_trace);
+  Push(event);
 }
 
 void DeallocationProfilerList::ReportFree(
     tcmalloc_internal::AllocHandle handle) {
+  if (active_.load(std::memory_order_relaxed) == 0) return;
+
+  // The sizes are filled in from the allocation when the event is delivered.
+  PendingEvent event;
+  event.handle = handle;
+  event.is_free = true;
+  event.record.creation_time = absl::Now();
+  RecordCurrentCpuAndThread(event.record);
+  event.record.depth =
+      absl::GetStackTrace(event.record.stack, kMaxStackDepth, 0);
+  Push(event);
+}
+
+void DeallocationProfilerList::Push(const PendingEvent& event) {
+  PendingEvents* pending = pending_.load(std::memory_order_acquire);
+  if (pending == nullptr) return;
+  // Threads may migrate, so this only picks a buffer that is likely
+  // uncontended.
+  const int vcpu = tcmalloc_internal::subtle::percpu::VirtualRseqCpuId();
+  PendingEvents& events = pending[vcpu >= 0 ? vcpu % num_pending_ : 0];
+  while (true) {
+    {
+      AllocationGuardSpinLockHolder h(&events.lock);
+      if (events.count < PendingEvents::kCapacity) {
+        events.events[events.count++] = event;
+        return;
+      }
+    }
+    Flush();
+  }
+}
+
+void DeallocationProfilerList::Flush() {
+  // Remove() delivers the events of the last profiler to stop.
+  if (active_.load(std::memory_order_relaxed) == 0) return;
   AllocationGuardSpinLockHolder h(&profilers_lock_);
-  DeallocationProfiler* cur = first_;
-  while (cur != nullptr) {
-    cur->ReportFree(handle);
-    cur = cur->next_;
+  FlushLocked();
+}
+
+void DeallocationProfilerList::FlushLocked() {
+  PendingEvents* pending = pending_.load(std::memory_order_relaxed);
+  if (pending == nullptr) return;
+  for (int i = 0; i < num_pending_; ++i) {
+    PendingEvents& events = pending[i];
+    AllocationGuardSpinLockHolder h(&events.lock);
+    for (int j = 0; j < events.count; ++j) {
+      const PendingEvent& event = events.events[j];
+      for (DeallocationProfiler* cur = first_; cur != nullptr;
+           cur = cur->next_) {
+        if (event.is_free) {
+          cur->ReportFree(event.handle, event.record);
+        } else {
+          cur->ReportMalloc(event.handle, event.record);
+        }
+      }
+    }
+    events.count = 0;
   }
 }
 
@@ -629,6 +753,11 @@ void DeallocationProfiler::DeallocationStackTraceTable::AddTrace(
   v.max_life_times_ns[index] =
       std::max(v.max_life_times_ns[index], life_time_ns);
   v.counts[index]++;
+
+  // Censored allocations carry no deallocation stack.
+  if (dealloc_trace.depth > 0) {
+    v.lifetime_histogram[internal::LifetimeHistogramBucket(life_time_ns)]++;
+  }
 }
 
 void DeallocationProfiler::DeallocationStackTraceTable::Iterate(
@@ -641,6 +770,9 @@ void DeallocationProfiler::DeallocationStackTraceTable::Iterate(
 
     // Report total bytes that are a multiple of the object size.
     size_t allocated_size = k.alloc.allocated_size;
+    // The lifetime histogram covers all cases of the pair, so it is reported
+    // once per pair.
+    bool histogram_reported = false;
 
     for (const auto& matching_case : kAllCases) {
       const int index = ComputeIndex(matching_case.first, matching_case.second);
@@ -677,6 +809,11 @@ void DeallocationProfiler::DeallocationStackTraceTable::Iterate(
       // Only set the cpu and thread matched flags if the sample is not
       // censored.
       if (!sample.is_censored) {
+        if (!histogram_reported) {
+          std::copy(std::begin(v.lifetime_histogram),
+                    std::end(v.lifetime_histogram), sample.lifetime_histogram);
+          histogram_reported = true;
+        }
         sample.allocator_deallocator_physical_cpu_matched =
             matching_case.first.physical_cpu_matched;
         sample.allocator_deallocator_virtual_cpu_matched =
@@ -757,6 +894,17 @@ absl::Duration LifetimeNsToBucketedDuration(double lifetime_ns) {
                            1000000L);
 }
 
+int LifetimeHistogramBucket(double lifetime_ns) {
+  int bucket = 0;
+  for (double cutoff_ns = 10;
+       bucket < Profile::Sample::kLifetimeHistogramBuckets - 1 &&
+       lifetime_ns >= cutoff_ns;
+       cutoff_ns *= 10) {
+    ++bucket;
+  }
+  return bucket;
+}
+
 }  // namespace internal
 }  // namespace deallocationz
 }  // namespace tcmalloc
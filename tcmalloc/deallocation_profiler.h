@@ -15,10 +15,12 @@
 #ifndef TCMALLOC_DEALLOCATION_PROFILER_H_
 #define TCMALLOC_DEALLOCATION_PROFILER_H_
 
+#include <atomic>
 #include <memory>
 
 #include "absl/base/const_init.h"
 #include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/time/time.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
@@ -30,6 +32,9 @@ namespace deallocationz {
 
 class DeallocationProfiler;
 
+// The active lifetime profilers.  Sampled allocations and deallocations are
+// buffered per CPU while profiling, and delivered to the profilers by Flush()
+// in batches, so that reporting them takes only an uncontended lock.
 class DeallocationProfilerList {
  public:
   constexpr DeallocationProfilerList() = default;
@@ -39,10 +44,26 @@ class DeallocationProfilerList {
   void Add(DeallocationProfiler* profiler);
   void Remove(DeallocationProfiler* profiler);
 
+  // Delivers the buffered events to the profilers.  Called periodically by
+  // the background thread, and whenever a CPU's buffer fills up.
+  void Flush();
+
  private:
-  DeallocationProfiler* first_ = nullptr;
+  struct PendingEvent;
+  struct PendingEvents;
+
+  void Push(const PendingEvent& event);
+  void FlushLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(profilers_lock_);
+
   absl::base_internal::SpinLock profilers_lock_{
       absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  DeallocationProfiler* first_ ABSL_GUARDED_BY(profilers_lock_) = nullptr;
+  // Lets the reporting functions return early while nothing is profiling.
+  std::atomic<int> active_{0};
+  // Per-CPU event buffers, allocated from the arena when profiling first
+  // starts and kept thereafter.
+  std::atomic<PendingEvents*> pending_{nullptr};
+  int num_pending_ = 0;
 };
 
 class DeallocationSample final
@@ -60,6 +81,9 @@ class DeallocationSample final
 
 namespace internal {
 absl::Duration LifetimeNsToBucketedDuration(double lifetime_ns);
+
+// The bucket of Profile::Sample::lifetime_histogram counting <lifetime_ns>.
+int LifetimeHistogramBucket(double lifetime_ns);
 }  // namespace internal
 }  // namespace deallocationz
 }  // namespace tcmalloc
@@ -0,0 +1,80 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/deferred_free.h"
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/background_wakeup.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT DeferredFrees deferred_frees;
+
+void DeferredFrees::Push(Span* span) {
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    spans_.prepend(span);
+    queued_pages_.fetch_add(span->num_pages().raw_num(),
+                            std::memory_order_relaxed);
+  }
+  // Draining is the partition-independent work of the first worker.
+  WakeBackgroundWorker(0);
+}
+
+void DeferredFrees::Drain() {
+  while (queued_pages_.load(std::memory_order_relaxed) > 0) {
+    Span* spans[kBatch];
+    size_t num_spans = 0;
+    {
+      AllocationGuardSpinLockHolder h(&lock_);
+      // Oldest first.
+      while (num_spans < kBatch && !spans_.empty()) {
+        Span* span = spans_.last();
+        spans_.remove(span);
+        spans[num_spans++] = span;
+      }
+    }
+    // Another thread may be returning the last spans.
+    if (num_spans == 0) return;
+
+    size_t pages = 0;
+    {
+      AllocationGuardSpinLockHolder h(&pageheap_lock);
+      for (size_t i = 0; i < num_spans; ++i) {
+        pages += spans[i]->num_pages().raw_num();
+        // The page allocators do not use objects_per_span when freeing.
+        tc_globals.page_allocator().Delete(
+            spans[i], /*objects_per_span=*/1,
+            GetMemoryTag(spans[i]->start_address()));
+      }
+    }
+    queued_pages_.fetch_sub(pages, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,102 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_DEFERRED_FREE_H_
+#define TCMALLOC_DEFERRED_FREE_H_
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The page-level allocations freed with tcmalloc::FreeLater, whose spans are
+// returned to the page heap by the background thread rather than by the
+// freeing thread.  Returning a span of hundreds of megabytes updates the
+// filler or the HugeCache, and may release memory, all under pageheap_lock;
+// queueing it only takes a leaf lock.
+//
+// Queued spans remain allocated as far as the PageAllocator is concerned, so
+// they still count towards the memory limits, and are reported as central
+// cache free bytes.  Spans are only queued while a thread is running
+// ProcessBackgroundActions(), which drains the queue when woken and once more
+// before it stops.
+class DeferredFrees {
+ public:
+  constexpr DeferredFrees() = default;
+
+  DeferredFrees(const DeferredFrees&) = delete;
+  DeferredFrees& operator=(const DeferredFrees&) = delete;
+
+  // Called by the background thread as it starts and stops draining the queue.
+  void ConsumerStarted() {
+    consumers_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void ConsumerStopped() {
+    consumers_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Returns true if queued spans will be drained without further calls.
+  bool has_consumer() const {
+    return consumers_.load(std::memory_order_relaxed) > 0;
+  }
+
+  // Queues <span>, a page-level allocation that has been freed, and wakes the
+  // background thread.
+  void Push(Span* span) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Returns all queued spans to the page heap.
+  void Drain() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Acquires and releases lock_ around fork(), so that the child does not
+  // inherit it held by a thread that no longer exists.
+  void AcquireInternalLocks() ABSL_EXCLUSIVE_LOCK_FUNCTION(lock_) {
+    lock_.Lock();
+  }
+  void ReleaseInternalLocks() ABSL_UNLOCK_FUNCTION(lock_) { lock_.Unlock(); }
+
+  size_t queued_bytes() const {
+    return Length(queued_pages_.load(std::memory_order_relaxed)).in_bytes();
+  }
+
+ private:
+  // Spans are returned to the page heap this many at a time, so that frees
+  // queued meanwhile do not wait for the whole queue.
+  static constexpr size_t kBatch = 16;
+
+  absl::base_internal::SpinLock lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  SpanList spans_ ABSL_GUARDED_BY(lock_);
+  std::atomic<size_t> queued_pages_{0};
+  std::atomic<int> consumers_{0};
+};
+
+extern DeferredFrees deferred_frees;
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_DEFERRED_FREE_H_
@@ -0,0 +1,221 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/demand_profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "absl/base/attributes.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/string_view.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/util.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr absl::string_view kMagic = "tcmalloc_demand_profile";
+constexpr int kVersion = 1;
+
+// Large enough for kMaxSizeClasses lines of three 20-digit fields.
+constexpr size_t kMaxProfileBytes = 64 << 10;
+
+// Pops the next whitespace-separated field of <line>.
+absl::string_view ConsumeToken(absl::string_view& line) {
+  line = absl::StripLeadingAsciiWhitespace(line);
+  size_t end = 0;
+  while (end < line.size() && !absl::ascii_isspace(line[end])) ++end;
+  const absl::string_view token = line.substr(0, end);
+  line.remove_prefix(end);
+  return token;
+}
+
+bool ConsumeField(absl::string_view& line, size_t* value) {
+  return absl::SimpleAtoi(ConsumeToken(line), value);
+}
+
+}  // namespace
+
+ABSL_CONST_INIT WarmStart warm_start;
+
+bool DemandProfile::AddSizeClass(const SizeClassDemand& demand) {
+  if (num_size_classes_ == kMaxSizeClasses) return false;
+  if (num_size_classes_ > 0 &&
+      size_classes_[num_size_classes_ - 1].size >= demand.size) {
+    return false;
+  }
+  size_classes_[num_size_classes_++] = demand;
+  return true;
+}
+
+const DemandProfile::SizeClassDemand* DemandProfile::Find(size_t size) const {
+  const SizeClassDemand* end = size_classes_ + num_size_classes_;
+  const SizeClassDemand* it = std::lower_bound(
+      size_classes_, end, size,
+      [](const SizeClassDemand& d, size_t size) { return d.size < size; });
+  return it != end && it->size == size ? it : nullptr;
+}
+
+bool DemandProfile::Parse(absl::string_view text) {
+  Clear();
+  bool have_header = false;
+  while (!text.empty()) {
+    const size_t eol = std::min(text.find('\n'), text.size());
+    absl::string_view line = text.substr(0, eol);
+    text.remove_prefix(std::min(eol + 1, text.size()));
+    line = line.substr(0, std::min(line.find('#'), line.size()));
+    const absl::string_view key = ConsumeToken(line);
+    if (key.empty()) continue;
+
+    bool ok;
+    if (!have_header) {
+      size_t version;
+      ok = key == kMagic && ConsumeField(line, &version) &&
+           version == kVersion;
+      have_header = true;
+    } else if (key == "peak_heap_bytes") {
+      ok = ConsumeField(line, &peak_heap_bytes_);
+    } else if (key == "class") {
+      SizeClassDemand demand;
+      ok = ConsumeField(line, &demand.size) &&
+           ConsumeField(line, &demand.cpu_capacity) &&
+           ConsumeField(line, &demand.transfer_capacity) &&
+           AddSizeClass(demand);
+    } else {
+      ok = false;
+    }
+    if (!ok || !absl::StripAsciiWhitespace(line).empty()) {
+      Clear();
+      return false;
+    }
+  }
+  return have_header;
+}
+
+void DemandProfile::Print(Printer* out) const {
+  out->printf("%s %d\n", kMagic, kVersion);
+  out->printf("peak_heap_bytes %zu\n", peak_heap_bytes_);
+  for (const SizeClassDemand& demand : size_classes()) {
+    out->printf("class %zu %zu %zu\n", demand.size, demand.cpu_capacity,
+                demand.transfer_capacity);
+  }
+}
+
+bool WarmStart::Init(const char* path) {
+  path_ = path;
+  // The profile is loaded before anything can be allocated, so read into
+  // static storage, which pageheap_lock protects.
+  ABSL_CONST_INIT static char buf[kMaxProfileBytes];
+  const int fd = signal_safe_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      Log(kLog, __FILE__, __LINE__, "cannot open demand profile", path, errno);
+    }
+    return false;
+  }
+  size_t len = 0;
+  for (;;) {
+    const ssize_t rc =
+        signal_safe_read(fd, buf + len, sizeof(buf) - len, nullptr);
+    if (rc <= 0) {
+      if (rc < 0) len = sizeof(buf);
+      break;
+    }
+    len += rc;
+    if (len == sizeof(buf)) break;
+  }
+  signal_safe_close(fd);
+  if (len == sizeof(buf) || !profile_.Parse(absl::string_view(buf, len))) {
+    Log(kLog, __FILE__, __LINE__, "ignoring invalid demand profile", path);
+    return false;
+  }
+  loaded_ = true;
+  return true;
+}
+
+bool WarmStart::Save(const DemandProfile& profile) {
+  ASSERT(active());
+  // Only the background thread saves, so static storage suffices.
+  ABSL_CONST_INIT static char buf[kMaxProfileBytes];
+  ABSL_CONST_INIT static char tmp_path[PATH_MAX];
+
+  Printer printer(buf, sizeof(buf));
+  profile.Print(&printer);
+  const size_t len = printer.SpaceRequired();
+  bool ok = len < sizeof(buf);
+  const int n = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path_);
+  ok = ok && n > 0 && n < static_cast<int>(sizeof(tmp_path));
+
+  // Write a temporary file and rename it over the profile, so that a process
+  // starting concurrently never reads a partial profile.
+  int fd = -1;
+  if (ok) {
+    fd = signal_safe_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          0644);
+    ok = fd >= 0;
+  }
+  if (ok) {
+    ok = signal_safe_write(fd, buf, len, nullptr) == static_cast<ssize_t>(len);
+    ok = signal_safe_close(fd) == 0 && ok;
+    ok = ok && rename(tmp_path, path_) == 0;
+  }
+  if (!ok) {
+    failed_saves_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  saves_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void WarmStart::Print(Printer* out) const {
+  if (!active()) return;
+  out->printf("------------------------------------------------\n");
+  out->printf(
+      "Demand profile: %s %s (%zu size classes, %zu peak heap bytes); "
+      "%lld saves, %lld failed\n",
+      loaded_ ? "warm started from" : "cold started, saving to", path_,
+      profile_.size_classes().size(), profile_.peak_heap_bytes(),
+      saves_.load(std::memory_order_relaxed),
+      failed_saves_.load(std::memory_order_relaxed));
+  out->printf("Demand profile: %lld hugepages prefaulted per partition\n",
+              prefault_hugepages());
+}
+
+void WarmStart::PrintInPbtxt(PbtxtRegion* region) const {
+  if (!active()) return;
+  auto profile = region->CreateSubRegion("demand_profile");
+  profile.PrintBool("loaded", loaded_);
+  profile.PrintI64("size_classes", profile_.size_classes().size());
+  profile.PrintI64("peak_heap_bytes", profile_.peak_heap_bytes());
+  profile.PrintI64("saves", saves_.load(std::memory_order_relaxed));
+  profile.PrintI64("failed_saves",
+                   failed_saves_.load(std::memory_order_relaxed));
+  profile.PrintI64("prefault_hugepages", prefault_hugepages());
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
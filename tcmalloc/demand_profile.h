@@ -0,0 +1,142 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_DEMAND_PROFILE_H_
+#define TCMALLOC_DEMAND_PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// A compact summary of how much of the allocator's caches a process used,
+// which a later run of the same binary can start from instead of growing its
+// caches one miss at a time.  Size classes are keyed by object size rather
+// than by size class number, so that a profile survives size class changes:
+// sizes that no longer exist are ignored.
+//
+// The text form is:
+//
+//   tcmalloc_demand_profile 1
+//   peak_heap_bytes <bytes>
+//   class <size> <per-cpu capacity> <transfer cache capacity>
+//   ...
+//
+// with the classes in increasing order of size and '#' starting a comment.
+class DemandProfile {
+ public:
+  struct SizeClassDemand {
+    size_t size;
+    // The average capacity of the populated per-cpu caches, in objects.
+    size_t cpu_capacity;
+    // The capacity of the transfer cache, in objects.
+    size_t transfer_capacity;
+  };
+
+  static constexpr int kMaxSizeClasses = kNumBaseClasses;
+
+  constexpr DemandProfile() = default;
+
+  size_t peak_heap_bytes() const { return peak_heap_bytes_; }
+  void set_peak_heap_bytes(size_t v) { peak_heap_bytes_ = v; }
+
+  absl::Span<const SizeClassDemand> size_classes() const {
+    return {size_classes_, static_cast<size_t>(num_size_classes_)};
+  }
+
+  // Appends <demand>, which must be larger than the sizes added before it.
+  // Returns false if it is not, or if the profile is full.
+  bool AddSizeClass(const SizeClassDemand& demand);
+
+  // The demand recorded for objects of <size>, or nullptr.
+  const SizeClassDemand* Find(size_t size) const;
+
+  void Clear() {
+    peak_heap_bytes_ = 0;
+    num_size_classes_ = 0;
+  }
+
+  // Replaces the profile with the one in <text>.  Returns false, leaving the
+  // profile empty, if <text> is malformed.  Does not allocate.
+  bool Parse(absl::string_view text);
+
+  void Print(Printer* out) const;
+
+ private:
+  size_t peak_heap_bytes_ = 0;
+  int num_size_classes_ = 0;
+  SizeClassDemand size_classes_[kMaxSizeClasses] = {};
+};
+
+// The demand profile at TCMALLOC_DEMAND_PROFILE, which the process is warm
+// started from and which the background thread keeps up to date for the
+// next run.
+class WarmStart {
+ public:
+  constexpr WarmStart() = default;
+
+  WarmStart(const WarmStart&) = delete;
+  WarmStart& operator=(const WarmStart&) = delete;
+
+  // Loads the profile at <path>, which Save() later writes to.  Returns
+  // whether there was a valid profile to load; a missing file is expected on
+  // the first run.  Called once, during initialization.
+  bool Init(const char* path);
+
+  bool active() const { return path_ != nullptr; }
+  bool loaded() const { return loaded_; }
+  const DemandProfile& profile() const { return profile_; }
+
+  // The hugepages each NUMA partition keeps prefaulted for the warm start,
+  // on top of Parameters::prefault_hugepages, or 0 once it is over.
+  int64_t prefault_hugepages() const {
+    return prefault_hugepages_.load(std::memory_order_relaxed);
+  }
+  void set_prefault_hugepages(int64_t v) {
+    prefault_hugepages_.store(v, std::memory_order_relaxed);
+  }
+
+  // Writes <profile> to the path given to Init(), replacing the file
+  // atomically.  Only called from the background thread.
+  bool Save(const DemandProfile& profile);
+
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  const char* path_ = nullptr;
+  bool loaded_ = false;
+  DemandProfile profile_;
+  std::atomic<int64_t> prefault_hugepages_ = 0;
+  std::atomic<int64_t> saves_ = 0;
+  std::atomic<int64_t> failed_saves_ = 0;
+};
+
+extern WarmStart warm_start;
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_DEMAND_PROFILE_H_
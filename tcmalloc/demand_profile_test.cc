@@ -0,0 +1,109 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/demand_profile.h"
+
+#include <string.h>
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/string_view.h"
+#include "tcmalloc/internal/logging.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+std::string Print(const DemandProfile& profile) {
+  std::string buffer(1 << 16, '\0');
+  Printer printer(&buffer[0], buffer.size());
+  profile.Print(&printer);
+  buffer.resize(strlen(buffer.c_str()));
+  return buffer;
+}
+
+TEST(DemandProfileTest, RoundTrip) {
+  DemandProfile profile;
+  profile.set_peak_heap_bytes(1 << 30);
+  ASSERT_TRUE(profile.AddSizeClass({8, 2048, 512}));
+  ASSERT_TRUE(profile.AddSizeClass({64, 0, 128}));
+  ASSERT_TRUE(profile.AddSizeClass({262144, 4, 0}));
+  const std::string text = Print(profile);
+  EXPECT_EQ(text,
+            "tcmalloc_demand_profile 1\n"
+            "peak_heap_bytes 1073741824\n"
+            "class 8 2048 512\n"
+            "class 64 0 128\n"
+            "class 262144 4 0\n");
+
+  DemandProfile parsed;
+  ASSERT_TRUE(parsed.Parse(text));
+  EXPECT_EQ(parsed.peak_heap_bytes(), 1 << 30);
+  ASSERT_EQ(parsed.size_classes().size(), 3);
+  EXPECT_EQ(Print(parsed), text);
+}
+
+TEST(DemandProfileTest, Find) {
+  DemandProfile profile;
+  ASSERT_TRUE(profile.Parse(
+      "# A comment\n"
+      "tcmalloc_demand_profile 1\n"
+      "\n"
+      "class 16 10 20  # trailing comment\n"
+      "class 32 30 40\n"));
+  EXPECT_EQ(profile.peak_heap_bytes(), 0);
+  const DemandProfile::SizeClassDemand* demand = profile.Find(32);
+  ASSERT_NE(demand, nullptr);
+  EXPECT_EQ(demand->cpu_capacity, 30);
+  EXPECT_EQ(demand->transfer_capacity, 40);
+  // Sizes that are not in the profile, as after a size class change.
+  EXPECT_EQ(profile.Find(8), nullptr);
+  EXPECT_EQ(profile.Find(24), nullptr);
+  EXPECT_EQ(profile.Find(48), nullptr);
+}
+
+TEST(DemandProfileTest, RejectsMalformed) {
+  for (absl::string_view text : {
+           "",
+           "class 8 1 1\n",
+           "tcmalloc_demand_profile 2\n",
+           "tcmalloc_demand_profile 1\nclass 8 1\n",
+           "tcmalloc_demand_profile 1\nclass 8 1 1 1\n",
+           "tcmalloc_demand_profile 1\nclass 8 1 -1\n",
+           "tcmalloc_demand_profile 1\nclass 16 1 1\nclass 8 1 1\n",
+           "tcmalloc_demand_profile 1\npeak_heap_bytes lots\n",
+           "tcmalloc_demand_profile 1\nunknown_field 1\n",
+       }) {
+    DemandProfile profile;
+    EXPECT_FALSE(profile.Parse(text)) << text;
+    EXPECT_EQ(profile.size_classes().size(), 0) << text;
+  }
+}
+
+TEST(DemandProfileTest, Full) {
+  DemandProfile profile;
+  for (int i = 0; i < DemandProfile::kMaxSizeClasses; ++i) {
+    ASSERT_TRUE(profile.AddSizeClass({static_cast<size_t>(i + 1), 1, 1}));
+  }
+  EXPECT_FALSE(profile.AddSizeClass({1 << 20, 1, 1}));
+  DemandProfile parsed;
+  EXPECT_TRUE(parsed.Parse(Print(profile)));
+  EXPECT_EQ(parsed.size_classes().size(), DemandProfile::kMaxSizeClasses);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
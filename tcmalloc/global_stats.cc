@@ -14,18 +14,35 @@
 
 #include "tcmalloc/global_stats.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <optional>
+#include <type_traits>
+#include <utility>
 
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/functional/function_ref.h"
+#include "absl/base/internal/spinlock.h"
 #include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/string_view.h"
 #include "absl/strings/strip.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "tcmalloc/allocation_counts.h"
+#include "tcmalloc/allocation_domain.h"
 #include "tcmalloc/central_freelist.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/cpu_time_stats.h"
+#include "tcmalloc/deferred_free.h"
+#include "tcmalloc/demand_profile.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/experiment_config.h"
 #include "tcmalloc/guarded_page_allocator.h"
@@ -34,12 +51,21 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/memory_stats.h"
 #include "tcmalloc/internal/optimization.h"
+#include "tcmalloc/internal/page_size.h"
 #include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/internal/stats_page.h"
+#include "tcmalloc/internal/sysinfo.h"
+#include "tcmalloc/large_span_cache.h"
+#include "tcmalloc/heap_telemetry.h"
+#include "tcmalloc/latency_stats.h"
+#include "tcmalloc/mte_sampled_allocator.h"
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/pagemap.h"
+#include "tcmalloc/parameter_tuner.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/span.h"
+#include "tcmalloc/span_cache.h"
 #include "tcmalloc/span_stats.h"
 #include "tcmalloc/stack_trace_table.h"
 #include "tcmalloc/static_vars.h"
@@ -47,6 +73,7 @@
 #include "tcmalloc/system-alloc.h"
 #include "tcmalloc/thread_cache.h"
 #include "tcmalloc/transfer_cache.h"
+#include "tcmalloc/type_partitions.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -79,7 +106,8 @@ void ExtractStats(TCMallocStats* r, uint64_t* class_count,
     if (class_count) {
       // Sum the lengths of all per-class freelists, except the per-thread
       // freelists, which get counted when we call GetThreadStats(), below.
-      class_count[size_class] = length + tc_length + sharded_tc_length;
+      class_count[size_class] = length + tc_length + sharded_tc_length +
+                                type_partitions.ObjectsOfClass(size_class);
       if (UsePerCpuCache(tc_globals)) {
         class_count[size_class] +=
             tc_globals.cpu_cache().TotalObjectsOfClass(size_class);
@@ -91,12 +119,21 @@ void ExtractStats(TCMallocStats* r, uint64_t* class_count,
     }
   }
 
+  // Spans held by the span cache are free but still allocated from the page
+  // heap's point of view.
+  r->central_bytes += span_cache.cached_bytes();
+  r->central_bytes += large_span_cache.cached_bytes();
+  r->central_bytes += deferred_frees.queued_bytes();
+  // So are the objects held by the type partitions, which the central
+  // freelists count as allocated.
+  r->central_bytes += type_partitions.cached_bytes();
+
   // Add stats from per-thread heaps
   r->thread_bytes = 0;
   {  // scope
     AllocationGuardSpinLockHolder h(&pageheap_lock);
     r->tc_stats = ThreadCache::GetStats(&r->thread_bytes, class_count);
-    r->span_stats = tc_globals.span_allocator().stats();
+    r->span_stats = tc_globals.span_stats();
     r->stack_stats = tc_globals.sampledallocation_allocator().stats();
     r->linked_sample_stats = tc_globals.linked_sample_allocator().stats();
     r->metadata_bytes = tc_globals.metadata_bytes();
@@ -152,6 +189,101 @@ void ExtractTCMallocStats(TCMallocStats* r, bool report_residence) {
   ExtractStats(r, nullptr, nullptr, nullptr, nullptr, report_residence);
 }
 
+namespace {
+
+// A TCMallocStats published with a sequence lock: the writer makes the
+// sequence number odd while it copies the stats in and even again afterwards,
+// and readers retry copies that overlapped a write.  The stats are stored as
+// relaxed atomic words so that overlapping copies are not data races.
+class StatsSnapshot {
+ public:
+  constexpr StatsSnapshot() = default;
+
+  void Publish(const TCMallocStats& stats, int64_t time_ns) {
+    uint64_t words[kWords] = {};
+    memcpy(words, &stats, sizeof(stats));
+
+    // Readers that find the snapshot stale may all try to refresh it.
+    AllocationGuardSpinLockHolder h(&lock_);
+    const uint64_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; ++i) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    time_ns_.store(time_ns, std::memory_order_relaxed);
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  // Copies the snapshot into *stats if it was published at or after
+  // min_time_ns.  Returns false if it is older, was never published, or kept
+  // changing under us.
+  bool Read(TCMallocStats* stats, int64_t min_time_ns) const {
+    constexpr int kMaxAttempts = 4;
+    for (int attempt = 0; attempt < kMaxAttempts; ++attempt) {
+      const uint64_t seq = seq_.load(std::memory_order_acquire);
+      if (seq == 0) return false;
+      if (seq & 1) continue;
+
+      uint64_t words[kWords];
+      for (size_t i = 0; i < kWords; ++i) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      const int64_t time_ns = time_ns_.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq_.load(std::memory_order_relaxed) != seq) continue;
+
+      if (time_ns < min_time_ns) return false;
+      memcpy(stats, words, sizeof(*stats));
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  static_assert(std::is_trivially_copyable_v<TCMallocStats>);
+  static constexpr size_t kWords =
+      (sizeof(TCMallocStats) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  absl::base_internal::SpinLock lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  std::atomic<uint64_t> seq_{0};
+  std::atomic<int64_t> time_ns_{0};
+  std::atomic<uint64_t> words_[kWords] = {};
+};
+
+ABSL_CONST_INIT StatsSnapshot stats_snapshot;
+
+// Gets the stats without residence information for GetNumericProperty(): from
+// the snapshot if it is recent enough, otherwise live, publishing them.
+// Returns false, leaving *stats unset, if the snapshot is disabled.
+bool ReadStatsSnapshot(TCMallocStats* stats) {
+  const int64_t max_age_ms = Parameters::stats_snapshot_max_age_ms();
+  if (max_age_ms <= 0) return false;
+
+  const int64_t now_ns = absl::GetCurrentTimeNanos();
+  if (stats_snapshot.Read(stats, now_ns - max_age_ms * 1000 * 1000)) {
+    return true;
+  }
+  ExtractTCMallocStats(stats, false);
+  stats_snapshot.Publish(*stats, now_ns);
+  return true;
+}
+
+void GetPropertyStats(TCMallocStats* stats) {
+  if (!ReadStatsSnapshot(stats)) {
+    ExtractTCMallocStats(stats, false);
+  }
+}
+
+}  // namespace
+
+void UpdateStatsSnapshot() {
+  TCMallocStats stats;
+  ExtractTCMallocStats(&stats, false);
+  stats_snapshot.Publish(stats, absl::GetCurrentTimeNanos());
+}
+
 // Because different fields of stats are computed from state protected
 // by different locks, they may be inconsistent.  Prevent underflow
 // when subtracting to avoid gigantic results.
@@ -160,6 +292,29 @@ static uint64_t StatSub(uint64_t a, uint64_t b) {
 }
 
 // Return approximate number of bytes in use by app.
+void GetLiveObjectCounts(uint64_t* live) {
+  uint64_t cached[kNumClasses] = {};
+  if (!UsePerCpuCache(tc_globals)) {
+    uint64_t thread_bytes = 0;
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    ThreadCache::GetStats(&thread_bytes, cached);
+  }
+  for (int size_class = 0; size_class < kNumClasses; ++size_class) {
+    cached[size_class] +=
+        tc_globals.transfer_cache().tc_length(size_class) +
+        tc_globals.sharded_transfer_cache().TotalObjectsOfClass(size_class) +
+        type_partitions.ObjectsOfClass(size_class);
+    if (UsePerCpuCache(tc_globals)) {
+      cached[size_class] +=
+          tc_globals.cpu_cache().TotalObjectsOfClass(size_class);
+    }
+    const uint64_t allocated =
+        tc_globals.central_freelist(size_class).allocated();
+    live[size_class] =
+        allocated > cached[size_class] ? allocated - cached[size_class] : 0;
+  }
+}
+
 uint64_t InUseByApp(const TCMallocStats& stats) {
   return StatSub(stats.pageheap.system_bytes,
                  stats.thread_bytes + stats.central_bytes +
@@ -208,6 +363,58 @@ size_t SlackBytes(const BackingStats& stats) {
   return stats.free_bytes + stats.unmapped_bytes;
 }
 
+void UpdateStatsPage() {
+  if (!tc_globals.stats_page().enabled()) return;
+
+  TCMallocStats stats;
+  ExtractTCMallocStats(&stats, false);
+  PageAllocator::HugePageAwareStats hpaa;
+  {
+    AllocationGuardSpinLockHolder l(&pageheap_lock);
+    hpaa = tc_globals.page_allocator().huge_page_aware_stats();
+  }
+  const auto used = [](const BackingStats& s) {
+    return StatSub(s.system_bytes, s.free_bytes + s.unmapped_bytes);
+  };
+
+  StatsPageValues v = {};
+  v.time_ns = absl::GetCurrentTimeNanos();
+  v.current_allocated_bytes = InUseByApp(stats);
+  v.heap_size = HeapSizeBytes(stats.pageheap);
+  v.physical_memory_used = PhysicalMemoryUsed(stats);
+  v.virtual_memory_used = VirtualMemoryUsed(stats);
+  v.metadata_bytes = stats.metadata_bytes;
+  v.pageheap_free_bytes = stats.pageheap.free_bytes;
+  v.pageheap_unmapped_bytes = UnmappedBytes(stats);
+  v.peak_backed_bytes = stats.peak_stats.backed_bytes;
+  v.peak_sampled_application_bytes =
+      stats.peak_stats.sampled_application_bytes;
+  v.thread_cache_bytes = stats.thread_bytes;
+  v.per_cpu_cache_bytes = stats.per_cpu_bytes;
+  v.sharded_transfer_cache_bytes = stats.sharded_transfer_bytes;
+  v.transfer_cache_bytes = stats.transfer_bytes;
+  v.central_cache_bytes = stats.central_bytes;
+  if (UsePerCpuCache(tc_globals)) {
+    const auto misses = tc_globals.cpu_cache().GetTotalCacheMissStats();
+    v.per_cpu_cache_underflows = misses.underflows;
+    v.per_cpu_cache_overflows = misses.overflows;
+  }
+  v.filler_used_bytes = used(hpaa.filler);
+  v.filler_free_bytes = hpaa.filler.free_bytes;
+  v.filler_unmapped_bytes = hpaa.filler.unmapped_bytes;
+  v.region_used_bytes = used(hpaa.regions);
+  v.region_free_bytes = hpaa.regions.free_bytes;
+  v.region_unmapped_bytes = hpaa.regions.unmapped_bytes;
+  v.huge_cache_free_bytes = hpaa.cache.free_bytes;
+  v.huge_cache_unmapped_bytes = hpaa.cache.unmapped_bytes;
+
+  // StatsPage::Publish() needs its callers serialized.
+  ABSL_CONST_INIT static absl::base_internal::SpinLock lock(
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+  AllocationGuardSpinLockHolder h(&lock);
+  tc_globals.stats_page().Publish(v);
+}
+
 static int CountAllowedCpus() {
   cpu_set_t allowed_cpus;
   if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) != 0) {
@@ -229,6 +436,8 @@ static absl::string_view SizeClassConfigurationString(
     case SizeClassConfiguration::kLegacy:
       // TODO(b/242710633): remove this opt out.
       return "SIZE_CLASS_LEGACY";
+    case SizeClassConfiguration::kProfile:
+      return "SIZE_CLASS_PROFILE";
   }
 
   ASSUME(false);
@@ -239,13 +448,43 @@ static absl::string_view PerCpuTypeString(RseqVcpuMode mode) {
   switch (mode) {
     case RseqVcpuMode::kNone:
       return "NONE";
+    case RseqVcpuMode::kMmCid:
+      return "MM_CID";
   }
 
   ASSUME(false);
   return "NONE";
 }
 
-void DumpStats(Printer* out, int level) {
+namespace {
+
+// The heap usage of each memory tier, so that capacity can be balanced across
+// them.  Normal memory is summed over NUMA partitions.
+struct TierStats {
+  BackingStats normal;
+  BackingStats sampled;
+  BackingStats cold;
+  BackingStats registered;
+};
+
+TierStats GetTierStats() {
+  TierStats tiers;
+  AllocationGuardSpinLockHolder l(&pageheap_lock);
+  const PageAllocator& page_allocator = tc_globals.page_allocator();
+  for (size_t partition = 0;
+       partition < tc_globals.numa_topology().active_partitions();
+       ++partition) {
+    tiers.normal += page_allocator.stats(NumaNormalTag(partition));
+  }
+  tiers.sampled = page_allocator.stats(MemoryTag::kSampled);
+  tiers.cold = page_allocator.stats(MemoryTag::kCold);
+  tiers.registered = page_allocator.stats(MemoryTag::kRegistered);
+  return tiers;
+}
+
+}  // namespace
+
+static void DumpSummaryStats(Printer* out, int level) {
   TCMallocStats stats;
   uint64_t class_count[kNumClasses];
   SpanStats span_stats[kNumClasses];
@@ -303,6 +542,7 @@ void DumpStats(Printer* out, int level) {
       "MALLOC:   %12u (%7.1f MiB) per-CPU slab bytes used\n"
       "MALLOC:   %12u (%7.1f MiB) per-CPU slab resident bytes\n"
       "MALLOC:   %12u (%7.1f MiB) malloc metadata Arena non-resident bytes\n"
+      "MALLOC:   %12u (%7.1f MiB) malloc metadata Arena hugepage-advised bytes\n"
       "MALLOC:   %12u (%7.1f MiB) Actual memory used at peak\n"
       "MALLOC:   %12u (%7.1f MiB) Estimated in-use at peak\n"
       "MALLOC:   %12.4f               Realized fragmentation (%%)\n"
@@ -342,6 +582,8 @@ void DumpStats(Printer* out, int level) {
       stats.percpu_metadata_bytes / MiB,
       stats.percpu_metadata_bytes_res, stats.percpu_metadata_bytes_res / MiB,
       stats.arena.bytes_nonresident, stats.arena.bytes_nonresident / MiB,
+      stats.arena.bytes_hugepage_advised,
+      stats.arena.bytes_hugepage_advised / MiB,
       uint64_t(stats.peak_stats.backed_bytes),
       stats.peak_stats.backed_bytes / MiB,
       uint64_t(stats.peak_stats.sampled_application_bytes),
@@ -361,6 +603,30 @@ void DumpStats(Printer* out, int level) {
   });
   out->printf("\n");
 
+  const ThpSettings& thp = GetThpSettings();
+  out->printf(
+      "MALLOC TRANSPARENT HUGEPAGES: enabled=%s defrag=%s policy=%s "
+      "pmd_size=%zu system_page_size=%zu\n",
+      ThpModeName(thp.enabled), ThpModeName(thp.defrag),
+      HugePagePolicyName(GetHugePagePolicy()), thp.pmd_size, GetPageSize());
+
+  {
+    const TierStats tiers = GetTierStats();
+    for (const auto& [name, tier] :
+         {std::pair<const char*, BackingStats>{"normal", tiers.normal},
+          {"sampled", tiers.sampled},
+          {"cold", tiers.cold},
+          {"registered", tiers.registered}}) {
+      out->printf(
+          "MALLOC TIER %-10s %12u bytes from system, %12u free, %12u "
+          "unmapped\n",
+          name, tier.system_bytes, tier.free_bytes, tier.unmapped_bytes);
+    }
+  }
+
+  out->printf("MALLOC LAZY RELEASE: %zu bytes released with MADV_FREE\n",
+              SystemLazyReleasedBytes());
+
   out->printf(
       "MALLOC SAMPLED PROFILES: %zu bytes (current), %zu bytes (internal "
       "fragmentation), %zu bytes (peak), %zu count (total)\n",
@@ -382,6 +648,15 @@ void DumpStats(Printer* out, int level) {
         rss, rss / MiB, vss, vss / MiB);
     // clang-format on
   }
+  int64_t lazy_free;
+  if (GetLazyFreeBytes(&lazy_free)) {
+    out->printf("TOTAL: %12lld (%7.1f MiB) Bytes lazily freed (MADV_FREE)\n",
+                lazy_free, lazy_free / MiB);
+  }
+  int64_t vmas;
+  if (GetVmaCount(&vmas)) {
+    out->printf("TOTAL: %12lld Mappings (VMAs)\n", vmas);
+  }
 
   out->printf(
       "------------------------------------------------\n"
@@ -426,83 +701,210 @@ void DumpStats(Printer* out, int level) {
     }
 #endif
 
-    tc_globals.transfer_cache().Print(out);
-    tc_globals.sharded_transfer_cache().Print(out);
-
-    if (UsePerCpuCache(tc_globals)) {
-      tc_globals.cpu_cache().Print(out);
-    }
-
-    tc_globals.page_allocator().Print(out, MemoryTag::kNormal);
-    if (tc_globals.numa_topology().active_partitions() > 1) {
-      tc_globals.page_allocator().Print(out, MemoryTag::kNormalP1);
+    size_t low_occupancy_deferrals = 0;
+    size_t low_occupancy_spans_returned = 0;
+    size_t empty_span_reuses = 0;
+    size_t prepopulated_spans = 0;
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      low_occupancy_deferrals +=
+          span_stats[size_class].num_low_occupancy_deferrals;
+      low_occupancy_spans_returned +=
+          span_stats[size_class].num_low_occupancy_spans_returned;
+      empty_span_reuses += span_stats[size_class].num_empty_span_reuses;
+      prepopulated_spans += span_stats[size_class].num_prepopulated_spans;
     }
-    tc_globals.page_allocator().Print(out, MemoryTag::kSampled);
-    tc_globals.page_allocator().Print(out, MemoryTag::kCold);
-    tc_globals.guardedpage_allocator().Print(out);
-
-    uint64_t soft_limit_bytes =
-        tc_globals.page_allocator().limit(PageAllocator::kSoft);
-    uint64_t hard_limit_bytes =
-        tc_globals.page_allocator().limit(PageAllocator::kHard);
-    out->printf("PARAMETER desired_usage_limit_bytes %u\n", soft_limit_bytes);
-    out->printf("PARAMETER hard_usage_limit_bytes %u\n", hard_limit_bytes);
-    out->printf("Number of times soft limit was hit: %lld\n",
-                tc_globals.page_allocator().limit_hits(PageAllocator::kSoft));
-    out->printf("Number of times hard limit was hit: %lld\n",
-                tc_globals.page_allocator().limit_hits(PageAllocator::kHard));
-    out->printf("Number of times memory shrank below soft limit: %lld\n",
-                tc_globals.page_allocator().successful_shrinks_after_limit_hit(
-                    PageAllocator::kSoft));
-    out->printf("Number of times memory shrank below hard limit: %lld\n",
-                tc_globals.page_allocator().successful_shrinks_after_limit_hit(
-                    PageAllocator::kHard));
-    out->printf("PARAMETER tcmalloc_per_cpu_caches %d\n",
-                Parameters::per_cpu_caches() ? 1 : 0);
-    out->printf("PARAMETER tcmalloc_max_per_cpu_cache_size %d\n",
-                Parameters::max_per_cpu_cache_size());
-    out->printf("PARAMETER tcmalloc_max_total_thread_cache_bytes %lld\n",
-                Parameters::max_total_thread_cache_bytes());
-    out->printf("PARAMETER malloc_release_bytes_per_sec %llu\n",
-                Parameters::background_release_rate());
-    out->printf(
-        "PARAMETER tcmalloc_skip_subrelease_interval %s\n",
-        absl::FormatDuration(Parameters::filler_skip_subrelease_interval()));
-    out->printf("PARAMETER tcmalloc_skip_subrelease_short_interval %s\n",
-                absl::FormatDuration(
-                    Parameters::filler_skip_subrelease_short_interval()));
-    out->printf("PARAMETER tcmalloc_skip_subrelease_long_interval %s\n",
-                absl::FormatDuration(
-                    Parameters::filler_skip_subrelease_long_interval()));
-    out->printf("PARAMETER tcmalloc_release_partial_alloc_pages %d\n",
-                Parameters::release_partial_alloc_pages() ? 1 : 0);
-    out->printf("PARAMETER tcmalloc_release_pages_from_huge_region %d\n",
-                Parameters::release_pages_from_huge_region() ? 1 : 0);
-    out->printf("PARAMETER flat vcpus %d\n",
-                subtle::percpu::UsingFlatVirtualCpus() ? 1 : 0);
+    out->printf("------------------------------------------------\n");
     out->printf(
-        "PARAMETER tcmalloc_separate_allocs_for_few_and_many_objects_spans "
-        "%d\n",
-        Parameters::separate_allocs_for_few_and_many_objects_spans());
-    out->printf("PARAMETER tcmalloc_filler_chunks_per_alloc %d\n",
-                Parameters::chunks_per_alloc());
-    out->printf("PARAMETER tcmalloc_use_wider_slabs %d\n",
-                tc_globals.cpu_cache().UseWiderSlabs() ? 1 : 0);
-    out->printf("PARAMETER tcmalloc_configure_size_class_max_capacity %d\n",
-                tc_globals.cpu_cache().ConfigureSizeClassMaxCapacity() ? 1 : 0);
+        "Central cache freelist: %zu spans on low-occupancy hugepages "
+        "deferred, %zu such spans returned\n",
+        low_occupancy_deferrals, low_occupancy_spans_returned);
     out->printf(
-        "PARAMETER tcmalloc_use_all_buckets_for_few_object_spans %d\n",
-        Parameters::use_all_buckets_for_few_object_spans_in_cfl() ? 1 : 0);
+        "Central cache freelist: %zu empty spans reused, %zu spans "
+        "prepopulated\n",
+        empty_span_reuses, prepopulated_spans);
+  }
+}
 
-    out->printf(
-        "PARAMETER size_class_config %s\n",
-        SizeClassConfigurationString(tc_globals.size_class_configuration()));
-    out->printf("PARAMETER percpu_vcpu_type %s\n",
-                PerCpuTypeString(subtle::percpu::GetRseqVcpuMode()));
+static void DumpCacheStats(Printer* out) {
+  cpu_time_stats.Print(out);
+  latency_stats.Print(out);
+  heap_telemetry.Print(out);
+  parameter_tuner.Print(out);
+  warm_start.Print(out);
+
+  tc_globals.transfer_cache().Print(out);
+  tc_globals.sharded_transfer_cache().Print(out);
+
+  if (UsePerCpuCache(tc_globals)) {
+    tc_globals.cpu_cache().Print(out);
   }
 }
 
-void DumpStatsInPbtxt(Printer* out, int level) {
+static void DumpPageHeapStats(Printer* out) {
+  for (size_t partition = 0;
+       partition < tc_globals.numa_topology().active_partitions();
+       ++partition) {
+    tc_globals.page_allocator().Print(out, NumaNormalTag(partition));
+  }
+  tc_globals.page_allocator().Print(out, MemoryTag::kSampled);
+  tc_globals.page_allocator().Print(out, MemoryTag::kCold);
+  tc_globals.page_allocator().Print(out, MemoryTag::kRegistered);
+}
+
+static void DumpAllocatorStats(Printer* out) {
+  tc_globals.guardedpage_allocator().Print(out);
+  if (tc_globals.mte_sampled_allocator().active()) {
+    tc_globals.mte_sampled_allocator().Print(out);
+  }
+  tc_globals.sampled_slabs().Print(out);
+  allocation_domains.Print(out);
+
+  uint64_t soft_limit_bytes =
+      tc_globals.page_allocator().limit(PageAllocator::kSoft);
+  uint64_t hard_limit_bytes =
+      tc_globals.page_allocator().limit(PageAllocator::kHard);
+  out->printf("PARAMETER desired_usage_limit_bytes %u\n", soft_limit_bytes);
+  out->printf("PARAMETER hard_usage_limit_bytes %u\n", hard_limit_bytes);
+  out->printf("Number of times soft limit was hit: %lld\n",
+              tc_globals.page_allocator().limit_hits(PageAllocator::kSoft));
+  out->printf("Number of times hard limit was hit: %lld\n",
+              tc_globals.page_allocator().limit_hits(PageAllocator::kHard));
+  out->printf("Number of times memory shrank below soft limit: %lld\n",
+              tc_globals.page_allocator().successful_shrinks_after_limit_hit(
+                  PageAllocator::kSoft));
+  out->printf("Number of times memory shrank below hard limit: %lld\n",
+              tc_globals.page_allocator().successful_shrinks_after_limit_hit(
+                  PageAllocator::kHard));
+}
+
+static void DumpParameters(Printer* out) {
+  out->printf("PARAMETER tcmalloc_per_cpu_caches %d\n",
+              Parameters::per_cpu_caches() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_max_per_cpu_cache_size %d\n",
+              Parameters::max_per_cpu_cache_size());
+  out->printf("PARAMETER tcmalloc_per_cpu_caches_autotune %d\n",
+              Parameters::per_cpu_caches_autotune() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_per_cpu_caches_handoff %d\n",
+              Parameters::per_cpu_caches_handoff() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_per_cpu_caches_wipe_on_fork %d\n",
+              Parameters::per_cpu_caches_wipe_on_fork() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_per_cpu_caches_adaptive_batches %d\n",
+              Parameters::per_cpu_caches_adaptive_batches() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_per_cpu_caches_share_smt_capacity %d\n",
+              Parameters::per_cpu_caches_share_smt_capacity() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_numa_background_workers %d\n",
+              Parameters::numa_background_workers() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_piggyback_background_actions %d\n",
+              Parameters::piggyback_background_actions() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_max_total_thread_cache_bytes %lld\n",
+              Parameters::max_total_thread_cache_bytes());
+  out->printf("PARAMETER malloc_release_bytes_per_sec %llu\n",
+              Parameters::background_release_rate());
+  out->printf("PARAMETER tcmalloc_prefault_hugepages %lld\n",
+              Parameters::prefault_hugepages());
+  out->printf("PARAMETER tcmalloc_async_release %d\n",
+              Parameters::async_release() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_adaptive_madvise_free %d\n",
+              Parameters::adaptive_madvise_free() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_cgroup_pressure_release %d\n",
+              Parameters::cgroup_pressure_release() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_cgroup_soft_limit_fraction %f\n",
+              Parameters::cgroup_soft_limit_fraction());
+  out->printf("PARAMETER tcmalloc_self_tuning %d\n",
+              Parameters::self_tuning() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_self_tuning_memory_weight %f\n",
+              Parameters::self_tuning_memory_weight());
+  out->printf("PARAMETER tcmalloc_profile_sampling_target_per_second %f\n",
+              Parameters::profile_sampling_target_per_second());
+  out->printf("PARAMETER tcmalloc_profile_sampling_site_boost %lld\n",
+              Parameters::profile_sampling_site_boost());
+  out->printf("PARAMETER tcmalloc_madvise_cold %d\n",
+              Parameters::madvise_cold() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_span_cache_coloring %d\n",
+              Parameters::span_cache_coloring() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_l3_span_cache %d\n",
+              Parameters::l3_span_cache() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_filler_l3_partitions %d\n",
+              Parameters::filler_l3_partitions() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_lifetime_aware_span_placement %d\n",
+              Parameters::lifetime_aware_span_placement() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_release_free_metadata %d\n",
+              Parameters::release_free_metadata() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_large_span_cache_bytes %lld\n",
+              Parameters::large_span_cache_bytes());
+  out->printf("PARAMETER tcmalloc_central_freelist_empty_span_cache %d\n",
+              Parameters::central_freelist_empty_span_cache() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_central_freelist_remote_frees %d\n",
+              Parameters::central_freelist_remote_frees() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_central_freelist_prepopulate %d\n",
+              Parameters::central_freelist_prepopulate() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_central_freelist_dynamic_span_pages %d\n",
+              Parameters::central_freelist_dynamic_span_pages() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_auto_sharded_transfer_cache %d\n",
+              Parameters::auto_sharded_transfer_cache() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_collapse_hugepages %lld\n",
+              Parameters::collapse_hugepages());
+  out->printf("PARAMETER tcmalloc_scan_hugepage_backing %lld\n",
+              Parameters::scan_hugepage_backing());
+  out->printf("PARAMETER tcmalloc_filler_fragmentation_region_threshold %f\n",
+              Parameters::filler_fragmentation_region_threshold());
+  out->printf("PARAMETER tcmalloc_skip_subrelease_predictor %lld\n",
+              Parameters::skip_subrelease_predictor());
+  out->printf("PARAMETER tcmalloc_scan_free_page_idleness %lld\n",
+              Parameters::scan_free_page_idleness());
+  out->printf("PARAMETER tcmalloc_release_resident_unbacked %lld\n",
+              Parameters::release_resident_unbacked());
+  out->printf("PARAMETER tcmalloc_frame_pointer_unwinding %d\n",
+              Parameters::frame_pointer_unwinding() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_alloc_latency_sampling_interval %lld\n",
+              Parameters::alloc_latency_sampling_interval());
+  out->printf("PARAMETER tcmalloc_guarded_pool_bytes %lld\n",
+              Parameters::guarded_pool_bytes());
+  out->printf("PARAMETER tcmalloc_mte_guarded_sampling %d\n",
+              Parameters::mte_guarded_sampling() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_stats_snapshot_max_age_ms %lld\n",
+              Parameters::stats_snapshot_max_age_ms());
+  out->printf(
+      "PARAMETER tcmalloc_skip_subrelease_interval %s\n",
+      absl::FormatDuration(Parameters::filler_skip_subrelease_interval()));
+  out->printf("PARAMETER tcmalloc_skip_subrelease_short_interval %s\n",
+              absl::FormatDuration(
+                  Parameters::filler_skip_subrelease_short_interval()));
+  out->printf("PARAMETER tcmalloc_skip_subrelease_long_interval %s\n",
+              absl::FormatDuration(
+                  Parameters::filler_skip_subrelease_long_interval()));
+  out->printf("PARAMETER tcmalloc_release_partial_alloc_pages %d\n",
+              Parameters::release_partial_alloc_pages() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_release_pages_from_huge_region %d\n",
+              Parameters::release_pages_from_huge_region() ? 1 : 0);
+  out->printf("PARAMETER flat vcpus %d\n",
+              subtle::percpu::UsingFlatVirtualCpus() ? 1 : 0);
+  out->printf(
+      "PARAMETER tcmalloc_separate_allocs_for_few_and_many_objects_spans "
+      "%d\n",
+      Parameters::separate_allocs_for_few_and_many_objects_spans());
+  out->printf("PARAMETER tcmalloc_filler_chunks_per_alloc %d\n",
+              Parameters::chunks_per_alloc());
+  out->printf("PARAMETER tcmalloc_deterministic_seed %u\n",
+              Parameters::deterministic_seed());
+  out->printf("PARAMETER tcmalloc_small_footprint %d\n",
+              Parameters::small_footprint() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_use_wider_slabs %d\n",
+              tc_globals.cpu_cache().UseWiderSlabs() ? 1 : 0);
+  out->printf("PARAMETER tcmalloc_configure_size_class_max_capacity %d\n",
+              tc_globals.cpu_cache().ConfigureSizeClassMaxCapacity() ? 1 : 0);
+  out->printf(
+      "PARAMETER tcmalloc_use_all_buckets_for_few_object_spans %d\n",
+      Parameters::use_all_buckets_for_few_object_spans_in_cfl() ? 1 : 0);
+
+  out->printf(
+      "PARAMETER size_class_config %s\n",
+      SizeClassConfigurationString(tc_globals.size_class_configuration()));
+  out->printf("PARAMETER percpu_vcpu_type %s\n",
+              PerCpuTypeString(subtle::percpu::GetRseqVcpuMode()));
+}
+
+static void DumpSummaryStatsInPbtxt(Printer* out, int level) {
   TCMallocStats stats;
   uint64_t class_count[kNumClasses];
   SpanStats span_stats[kNumClasses];
@@ -531,6 +933,8 @@ void DumpStatsInPbtxt(Printer* out, int level) {
                   stats.arena.bytes_unavailable);
   region.PrintI64("malloc_metadata_arena_unallocated",
                   stats.arena.bytes_unallocated);
+  region.PrintI64("malloc_metadata_arena_hugepage_advised",
+                  stats.arena.bytes_hugepage_advised);
   region.PrintI64("actual_mem_used", physical_memory_used);
   region.PrintI64("unmapped", unmapped_bytes);
   region.PrintI64("virtual_address_space_used", virtual_memory_used);
@@ -538,6 +942,8 @@ void DumpStatsInPbtxt(Printer* out, int level) {
   region.PrintI64("num_spans_created", uint64_t(stats.span_stats.total));
   region.PrintI64("num_thread_heaps", uint64_t(stats.tc_stats.in_use));
   region.PrintI64("num_thread_heaps_created", uint64_t(stats.tc_stats.total));
+  region.PrintI64("num_thread_heaps_reclaimed",
+                  ThreadCache::reclaimed_caches());
   region.PrintI64("num_stack_traces", uint64_t(stats.stack_stats.in_use));
   region.PrintI64("num_stack_traces_created",
                   uint64_t(stats.stack_stats.total));
@@ -554,6 +960,30 @@ void DumpStatsInPbtxt(Printer* out, int level) {
                   stats.peak_stats.sampled_application_bytes);
   region.PrintI64("tcmalloc_page_size", uint64_t(kPageSize));
   region.PrintI64("tcmalloc_huge_page_size", uint64_t(kHugePageSize));
+  {
+    const ThpSettings& thp = GetThpSettings();
+    region.PrintRaw("thp_enabled", ThpModeName(thp.enabled));
+    region.PrintRaw("thp_defrag", ThpModeName(thp.defrag));
+    region.PrintRaw("huge_page_policy",
+                    HugePagePolicyName(GetHugePagePolicy()));
+    region.PrintI64("thp_pmd_size", thp.pmd_size);
+  }
+  region.PrintI64("system_page_size", GetPageSize());
+  {
+    const TierStats tiers = GetTierStats();
+    for (const auto& [name, tier] :
+         {std::pair<const char*, BackingStats>{"normal", tiers.normal},
+          {"sampled", tiers.sampled},
+          {"cold", tiers.cold},
+          {"registered", tiers.registered}}) {
+      PbtxtRegion entry = region.CreateSubRegion("memory_tier");
+      entry.PrintRaw("name", name);
+      entry.PrintI64("system_bytes", tier.system_bytes);
+      entry.PrintI64("free_bytes", tier.free_bytes);
+      entry.PrintI64("unmapped_bytes", tier.unmapped_bytes);
+    }
+  }
+  region.PrintI64("lazy_released_bytes", SystemLazyReleasedBytes());
   region.PrintI64("cpus_allowed", CountAllowedCpus());
   region.PrintI64("arena_blocks", stats.arena.blocks);
 
@@ -574,6 +1004,14 @@ void DumpStatsInPbtxt(Printer* out, int level) {
     region.PrintI64("total_resident", uint64_t(memstats.rss));
     region.PrintI64("total_mapped", uint64_t(memstats.vss));
   }
+  int64_t lazy_free;
+  if (GetLazyFreeBytes(&lazy_free)) {
+    region.PrintI64("total_lazy_free", lazy_free);
+  }
+  int64_t vmas;
+  if (GetVmaCount(&vmas)) {
+    region.PrintI64("total_vmas", vmas);
+  }
 
   region.PrintI64("total_sampled_count",
                   tc_globals.total_sampled_count_.value());
@@ -593,27 +1031,54 @@ void DumpStatsInPbtxt(Printer* out, int level) {
         entry.PrintI64("num_spans_returned",
                        span_stats[size_class].num_spans_returned);
         entry.PrintI64("obj_capacity", span_stats[size_class].obj_capacity);
+        entry.PrintI64("low_occupancy_deferrals",
+                       span_stats[size_class].num_low_occupancy_deferrals);
+        entry.PrintI64("low_occupancy_spans_returned",
+                       span_stats[size_class].num_low_occupancy_spans_returned);
+        entry.PrintI64("empty_span_reuses",
+                       span_stats[size_class].num_empty_span_reuses);
+        entry.PrintI64("prepopulated_spans",
+                       span_stats[size_class].num_prepopulated_spans);
         tc_globals.central_freelist(size_class)
             .PrintSpanUtilStatsInPbtxt(&entry);
       }
 #endif
     }
+  }
+}
 
-    tc_globals.transfer_cache().PrintInPbtxt(&region);
-    tc_globals.sharded_transfer_cache().PrintInPbtxt(&region);
+static void DumpCacheStatsInPbtxt(Printer* out) {
+  PbtxtRegion region(out, kTop);
+  cpu_time_stats.PrintInPbtxt(&region);
+  latency_stats.PrintInPbtxt(&region);
+  heap_telemetry.PrintInPbtxt(&region);
+  parameter_tuner.PrintInPbtxt(&region);
+  warm_start.PrintInPbtxt(&region);
 
-    if (UsePerCpuCache(tc_globals)) {
-      tc_globals.cpu_cache().PrintInPbtxt(&region);
-    }
+  tc_globals.transfer_cache().PrintInPbtxt(&region);
+  tc_globals.sharded_transfer_cache().PrintInPbtxt(&region);
+
+  if (UsePerCpuCache(tc_globals)) {
+    tc_globals.cpu_cache().PrintInPbtxt(&region);
   }
-  tc_globals.page_allocator().PrintInPbtxt(&region, MemoryTag::kNormal);
-  if (tc_globals.numa_topology().active_partitions() > 1) {
-    tc_globals.page_allocator().PrintInPbtxt(&region, MemoryTag::kNormalP1);
+}
+
+static void DumpPageHeapStatsInPbtxt(Printer* out) {
+  PbtxtRegion region(out, kTop);
+  for (size_t partition = 0;
+       partition < tc_globals.numa_topology().active_partitions();
+       ++partition) {
+    tc_globals.page_allocator().PrintInPbtxt(&region,
+                                             NumaNormalTag(partition));
   }
   tc_globals.page_allocator().PrintInPbtxt(&region, MemoryTag::kSampled);
   tc_globals.page_allocator().PrintInPbtxt(&region, MemoryTag::kCold);
+  tc_globals.page_allocator().PrintInPbtxt(&region, MemoryTag::kRegistered);
   // We do not collect tracking information in pbtxt.
+}
 
+static void DumpAllocatorStatsInPbtxt(Printer* out) {
+  PbtxtRegion region(out, kTop);
   size_t soft_limit_bytes =
       tc_globals.page_allocator().limit(PageAllocator::kSoft);
   size_t hard_limit_bytes =
@@ -633,20 +1098,104 @@ void DumpStatsInPbtxt(Printer* out, int level) {
       "successful_shrinks_after_hard_limit_hit",
       tc_globals.page_allocator().successful_shrinks_after_limit_hit(
           PageAllocator::kHard));
+  allocation_domains.PrintInPbtxt(&region);
   {
     auto gwp_asan = region.CreateSubRegion("gwp_asan");
     tc_globals.guardedpage_allocator().PrintInPbtxt(&gwp_asan);
   }
+  if (tc_globals.mte_sampled_allocator().active()) {
+    auto mte = region.CreateSubRegion("mte_sampling");
+    tc_globals.mte_sampled_allocator().PrintInPbtxt(&mte);
+  }
+  tc_globals.sampled_slabs().PrintInPbtxt(&region);
 
   region.PrintI64("memory_release_failures", SystemReleaseErrors());
+  PrintSystemCallStatsInPbtxt(&region);
+}
 
+static void DumpParametersInPbtxt(Printer* out) {
+  PbtxtRegion region(out, kTop);
   region.PrintBool("tcmalloc_per_cpu_caches", Parameters::per_cpu_caches());
   region.PrintI64("tcmalloc_max_per_cpu_cache_size",
                   Parameters::max_per_cpu_cache_size());
+  region.PrintBool("tcmalloc_per_cpu_caches_autotune",
+                   Parameters::per_cpu_caches_autotune());
+  region.PrintBool("tcmalloc_per_cpu_caches_handoff",
+                   Parameters::per_cpu_caches_handoff());
+  region.PrintBool("tcmalloc_per_cpu_caches_wipe_on_fork",
+                   Parameters::per_cpu_caches_wipe_on_fork());
+  region.PrintBool("tcmalloc_per_cpu_caches_adaptive_batches",
+                   Parameters::per_cpu_caches_adaptive_batches());
+  region.PrintBool("tcmalloc_per_cpu_caches_share_smt_capacity",
+                   Parameters::per_cpu_caches_share_smt_capacity());
+  region.PrintBool("tcmalloc_numa_background_workers",
+                   Parameters::numa_background_workers());
+  region.PrintBool("tcmalloc_piggyback_background_actions",
+                   Parameters::piggyback_background_actions());
   region.PrintI64("tcmalloc_max_total_thread_cache_bytes",
                   Parameters::max_total_thread_cache_bytes());
   region.PrintI64("malloc_release_bytes_per_sec",
                   static_cast<int64_t>(Parameters::background_release_rate()));
+  region.PrintI64("tcmalloc_prefault_hugepages",
+                  Parameters::prefault_hugepages());
+  region.PrintBool("tcmalloc_async_release", Parameters::async_release());
+  region.PrintBool("tcmalloc_adaptive_madvise_free",
+                   Parameters::adaptive_madvise_free());
+  region.PrintBool("tcmalloc_cgroup_pressure_release",
+                   Parameters::cgroup_pressure_release());
+  region.PrintDouble("tcmalloc_cgroup_soft_limit_fraction",
+                     Parameters::cgroup_soft_limit_fraction());
+  region.PrintBool("tcmalloc_self_tuning", Parameters::self_tuning());
+  region.PrintDouble("tcmalloc_self_tuning_memory_weight",
+                     Parameters::self_tuning_memory_weight());
+  region.PrintDouble("tcmalloc_profile_sampling_target_per_second",
+                     Parameters::profile_sampling_target_per_second());
+  region.PrintI64("tcmalloc_profile_sampling_site_boost",
+                  Parameters::profile_sampling_site_boost());
+  region.PrintBool("tcmalloc_madvise_cold", Parameters::madvise_cold());
+  region.PrintBool("tcmalloc_span_cache_coloring",
+                   Parameters::span_cache_coloring());
+  region.PrintBool("tcmalloc_l3_span_cache", Parameters::l3_span_cache());
+  region.PrintBool("tcmalloc_filler_l3_partitions",
+                   Parameters::filler_l3_partitions());
+  region.PrintBool("tcmalloc_lifetime_aware_span_placement",
+                   Parameters::lifetime_aware_span_placement());
+  region.PrintBool("tcmalloc_release_free_metadata",
+                   Parameters::release_free_metadata());
+  region.PrintI64("tcmalloc_large_span_cache_bytes",
+                  Parameters::large_span_cache_bytes());
+  region.PrintBool("tcmalloc_central_freelist_empty_span_cache",
+                   Parameters::central_freelist_empty_span_cache());
+  region.PrintBool("tcmalloc_central_freelist_remote_frees",
+                   Parameters::central_freelist_remote_frees());
+  region.PrintBool("tcmalloc_central_freelist_prepopulate",
+                   Parameters::central_freelist_prepopulate());
+  region.PrintBool("tcmalloc_central_freelist_dynamic_span_pages",
+                   Parameters::central_freelist_dynamic_span_pages());
+  region.PrintBool("tcmalloc_auto_sharded_transfer_cache",
+                   Parameters::auto_sharded_transfer_cache());
+  region.PrintI64("tcmalloc_collapse_hugepages",
+                  Parameters::collapse_hugepages());
+  region.PrintI64("tcmalloc_scan_hugepage_backing",
+                  Parameters::scan_hugepage_backing());
+  region.PrintDouble("tcmalloc_filler_fragmentation_region_threshold",
+                     Parameters::filler_fragmentation_region_threshold());
+  region.PrintI64("tcmalloc_skip_subrelease_predictor",
+                  Parameters::skip_subrelease_predictor());
+  region.PrintI64("tcmalloc_scan_free_page_idleness",
+                  Parameters::scan_free_page_idleness());
+  region.PrintI64("tcmalloc_release_resident_unbacked",
+                  Parameters::release_resident_unbacked());
+  region.PrintBool("tcmalloc_frame_pointer_unwinding",
+                   Parameters::frame_pointer_unwinding());
+  region.PrintI64("tcmalloc_alloc_latency_sampling_interval",
+                  Parameters::alloc_latency_sampling_interval());
+  region.PrintI64("tcmalloc_guarded_pool_bytes",
+                  Parameters::guarded_pool_bytes());
+  region.PrintBool("tcmalloc_mte_guarded_sampling",
+                   Parameters::mte_guarded_sampling());
+  region.PrintI64("tcmalloc_stats_snapshot_max_age_ms",
+                  Parameters::stats_snapshot_max_age_ms());
   region.PrintI64(
       "tcmalloc_skip_subrelease_interval_ns",
       absl::ToInt64Nanoseconds(Parameters::filler_skip_subrelease_interval()));
@@ -667,6 +1216,9 @@ void DumpStatsInPbtxt(Printer* out, int level) {
                   Parameters::separate_allocs_for_few_and_many_objects_spans());
   region.PrintI64("tcmalloc_filler_chunks_per_alloc",
                   Parameters::chunks_per_alloc());
+  region.PrintI64("tcmalloc_deterministic_seed",
+                  Parameters::deterministic_seed());
+  region.PrintBool("tcmalloc_small_footprint", Parameters::small_footprint());
   region.PrintI64("tcmalloc_use_wider_slabs",
                   tc_globals.cpu_cache().UseWiderSlabs());
   region.PrintBool("tcmalloc_configure_size_class_max_capacity",
@@ -679,6 +1231,94 @@ void DumpStatsInPbtxt(Printer* out, int level) {
       SizeClassConfigurationString(tc_globals.size_class_configuration()));
 }
 
+void DumpStatsSection(Printer* out, int level, StatsSection section) {
+  if (section == StatsSection::kSummary) {
+    DumpSummaryStats(out, level);
+    return;
+  }
+  // The text dump only goes past the summary at level 2.
+  if (level < 2) {
+    return;
+  }
+  switch (section) {
+    case StatsSection::kSummary:
+      break;
+    case StatsSection::kCaches:
+      DumpCacheStats(out);
+      break;
+    case StatsSection::kPageHeap:
+      DumpPageHeapStats(out);
+      break;
+    case StatsSection::kAllocators:
+      DumpAllocatorStats(out);
+      break;
+    case StatsSection::kParameters:
+      DumpParameters(out);
+      break;
+  }
+}
+
+void DumpStatsSectionInPbtxt(Printer* out, int level, StatsSection section) {
+  switch (section) {
+    case StatsSection::kSummary:
+      DumpSummaryStatsInPbtxt(out, level);
+      break;
+    case StatsSection::kCaches:
+      if (level >= 2) {
+        DumpCacheStatsInPbtxt(out);
+      }
+      break;
+    case StatsSection::kPageHeap:
+      DumpPageHeapStatsInPbtxt(out);
+      break;
+    case StatsSection::kAllocators:
+      DumpAllocatorStatsInPbtxt(out);
+      break;
+    case StatsSection::kParameters:
+      DumpParametersInPbtxt(out);
+      break;
+  }
+}
+
+void DumpStats(Printer* out, int level) {
+  for (StatsSection section : kStatsSections) {
+    DumpStatsSection(out, level, section);
+  }
+}
+
+void DumpStatsInPbtxt(Printer* out, int level) {
+  for (StatsSection section : kStatsSections) {
+    DumpStatsSectionInPbtxt(out, level, section);
+  }
+}
+
+void StatsWriter::WriteSection(absl::FunctionRef<void(Printer*)> format) {
+  WriteRawSection([&](absl::Span<char> buffer) {
+    Printer printer(buffer.data(), buffer.size());
+    format(&printer);
+    return printer.SpaceRequired();
+  });
+}
+
+void StatsWriter::WriteRawSection(
+    absl::FunctionRef<size_t(absl::Span<char>)> format) {
+  if (buffer_.empty()) {
+    buffer_.resize(kInitialSectionBytes);
+  }
+  while (true) {
+    const size_t required = format(absl::MakeSpan(buffer_));
+    if (required < buffer_.size()) {
+      if (required > 0) {
+        sink_(absl::string_view(buffer_.data(), required));
+      }
+      return;
+    }
+    // The section was truncated.  <format> has released its locks, so grow
+    // the buffer and gather the section again.
+    buffer_.resize(std::max(required + 1, 2 * buffer_.size()));
+  }
+}
+
 bool GetNumericProperty(const char* name_data, size_t name_size,
                         size_t* value) {
   // LINT.IfChange
@@ -694,14 +1334,14 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
 
   if (name == "generic.virtual_memory_used") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = VirtualMemoryUsed(stats);
     return true;
   }
 
   if (name == "generic.physical_memory_used") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = PhysicalMemoryUsed(stats);
     return true;
   }
@@ -709,21 +1349,21 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
   if (name == "generic.current_allocated_bytes" ||
       name == "generic.bytes_in_use_by_app") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = InUseByApp(stats);
     return true;
   }
 
   if (name == "generic.peak_memory_usage") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = static_cast<uint64_t>(stats.peak_stats.sampled_application_bytes);
     return true;
   }
 
   if (name == "generic.realized_fragmentation") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = static_cast<uint64_t>(
         100. * safe_div(stats.peak_stats.backed_bytes -
                             stats.peak_stats.sampled_application_bytes,
@@ -733,6 +1373,10 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
   }
 
   if (name == "generic.heap_size") {
+    if (TCMallocStats stats; ReadStatsSnapshot(&stats)) {
+      *value = HeapSizeBytes(stats.pageheap);
+      return true;
+    }
     AllocationGuardSpinLockHolder l(&pageheap_lock);
     BackingStats stats = tc_globals.page_allocator().stats();
     *value = HeapSizeBytes(stats);
@@ -741,21 +1385,21 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
 
   if (name == "tcmalloc.central_cache_free") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = stats.central_bytes;
     return true;
   }
 
   if (name == "tcmalloc.cpu_free") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = stats.per_cpu_bytes;
     return true;
   }
 
   if (name == "tcmalloc.sharded_transfer_cache_free") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = stats.sharded_transfer_bytes;
     return true;
   }
@@ -763,6 +1407,10 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
   if (name == "tcmalloc.slack_bytes") {
     // Kept for backwards compatibility.  Now defined externally as:
     //    pageheap_free_bytes + pageheap_unmapped_bytes.
+    if (TCMallocStats stats; ReadStatsSnapshot(&stats)) {
+      *value = SlackBytes(stats.pageheap);
+      return true;
+    }
     AllocationGuardSpinLockHolder l(&pageheap_lock);
     BackingStats stats = tc_globals.page_allocator().stats();
     *value = SlackBytes(stats);
@@ -771,6 +1419,10 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
 
   if (name == "tcmalloc.pageheap_free_bytes" ||
       name == "tcmalloc.page_heap_free") {
+    if (TCMallocStats stats; ReadStatsSnapshot(&stats)) {
+      *value = stats.pageheap.free_bytes;
+      return true;
+    }
     AllocationGuardSpinLockHolder l(&pageheap_lock);
     *value = tc_globals.page_allocator().stats().free_bytes;
     return true;
@@ -778,6 +1430,10 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
 
   if (name == "tcmalloc.pageheap_unmapped_bytes" ||
       name == "tcmalloc.page_heap_unmapped") {
+    if (TCMallocStats stats; ReadStatsSnapshot(&stats)) {
+      *value = UnmappedBytes(stats);
+      return true;
+    }
     AllocationGuardSpinLockHolder l(&pageheap_lock);
     // Arena non-resident bytes aren't on the page heap, but they are unmapped.
     *value = tc_globals.page_allocator().stats().unmapped_bytes +
@@ -805,28 +1461,28 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
   if (name == "tcmalloc.current_total_thread_cache_bytes" ||
       name == "tcmalloc.thread_cache_free") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = stats.thread_bytes;
     return true;
   }
 
   if (name == "tcmalloc.thread_cache_count") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = stats.tc_stats.in_use;
     return true;
   }
 
   if (name == "tcmalloc.local_bytes") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = LocalBytes(stats);
     return true;
   }
 
   if (name == "tcmalloc.external_fragmentation_bytes") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = ExternalBytes(stats);
     return true;
   }
@@ -840,7 +1496,7 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
 
   if (name == "tcmalloc.transfer_cache_free") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = stats.transfer_bytes;
     return true;
   }
@@ -890,7 +1546,7 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
 
   if (name == "tcmalloc.required_bytes") {
     TCMallocStats stats;
-    ExtractTCMallocStats(&stats, false);
+    GetPropertyStats(&stats);
     *value = RequiredBytes(stats);
     return true;
   }
@@ -905,6 +1561,39 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
     }
   }
 
+  if (GetAllocationCountProperty(name, value)) {
+    return true;
+  }
+
+  if (cpu_time_stats.GetNumericProperty(name, value)) {
+    return true;
+  }
+
+  const absl::string_view kLiveObjectsPrefix = "tcmalloc.live_objects.";
+  if (absl::StartsWith(name, kLiveObjectsPrefix)) {
+    size_t size;
+    if (!absl::SimpleAtoi(absl::StripPrefix(name, kLiveObjectsPrefix),
+                          &size) ||
+        size == 0) {
+      return false;
+    }
+    uint64_t live[kNumClasses];
+    GetLiveObjectCounts(live);
+    bool found = false;
+    *value = 0;
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      if (tc_globals.sizemap().class_to_size(size_class) != size) continue;
+      *value += live[size_class];
+      found = true;
+    }
+    return found;
+  }
+
+  if (name == "tcmalloc.shared_heap_base") {
+    *value = SharedHeapBase();
+    return true;
+  }
+
   // LINT.ThenChange(//depot/google3/tcmalloc/testing/malloc_extension_test.cc)
   return false;
 }
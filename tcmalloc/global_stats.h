@@ -17,7 +17,11 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <string>
 
+#include "absl/functional/function_ref.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
@@ -56,6 +60,23 @@ struct TCMallocStats {
 
 void ExtractTCMallocStats(TCMallocStats* r, bool report_residence);
 
+// Extracts stats without residence information and publishes them as the
+// snapshot that GetNumericProperty() reads, lock-free, while it is at most
+// Parameters::stats_snapshot_max_age_ms() old.  Called periodically by the
+// background thread and on demand by readers that find the snapshot stale.
+void UpdateStatsSnapshot();
+
+// Publishes the counters of Static::stats_page(), if it is enabled.  Called
+// periodically by the background thread.
+void UpdateStatsPage();
+
+// Sets live[k], which must hold kNumClasses entries, to the number of objects
+// of size class k in use by the application: the objects handed out by its
+// central freelist, less those cached in front of it.  Reads lock-free
+// counters, except with per-thread caches, which are walked under their lock.
+// Racing updates may make the counts briefly inexact, never negative.
+void GetLiveObjectCounts(uint64_t* live);
+
 uint64_t InUseByApp(const TCMallocStats& stats);
 uint64_t VirtualMemoryUsed(const TCMallocStats& stats);
 uint64_t UnmappedBytes(const TCMallocStats& stats);
@@ -66,9 +87,50 @@ size_t HeapSizeBytes(const BackingStats& stats);
 size_t LocalBytes(const TCMallocStats& stats);
 size_t SlackBytes(const BackingStats& stats);
 
+// The stats dumps are the concatenation of these sections, in this order.
+// Each section takes the locks it needs while gathering its numbers and holds
+// none once it has been printed, so output can be handed off between sections.
+enum class StatsSection {
+  kSummary,     // Totals, size class freelists
+  kCaches,      // Latency, telemetry, transfer and per-CPU caches
+  kPageHeap,    // Page allocators of every tag and partition
+  kAllocators,  // Limits, allocation domains, guarded and MTE allocators
+  kParameters,  // Current parameter values
+};
+inline constexpr StatsSection kStatsSections[] = {
+    StatsSection::kSummary, StatsSection::kCaches, StatsSection::kPageHeap,
+    StatsSection::kAllocators, StatsSection::kParameters};
+
 // WRITE stats to "out"
 void DumpStats(Printer* out, int level);
 void DumpStatsInPbtxt(Printer* out, int level);
+void DumpStatsSection(Printer* out, int level, StatsSection section);
+void DumpStatsSectionInPbtxt(Printer* out, int level, StatsSection section);
+
+// Formats stats one section at a time into a scratch buffer and passes each
+// section to a sink with no locks held, so the sink may allocate or block.  A
+// section that does not fit is formatted again into a larger buffer instead of
+// being truncated.
+class StatsWriter {
+ public:
+  explicit StatsWriter(absl::FunctionRef<void(absl::string_view)> sink)
+      : sink_(sink) {}
+
+  StatsWriter(const StatsWriter&) = delete;
+  StatsWriter& operator=(const StatsWriter&) = delete;
+
+  // Prints a section with <format>, which must not hold locks on return.
+  void WriteSection(absl::FunctionRef<void(Printer*)> format);
+  // As above, for formatters that write to a buffer and return the number of
+  // bytes they needed, like AddressRegionFactory::GetStats.
+  void WriteRawSection(absl::FunctionRef<size_t(absl::Span<char>)> format);
+
+ private:
+  static constexpr size_t kInitialSectionBytes = 16 << 10;
+
+  absl::FunctionRef<void(absl::string_view)> sink_;
+  std::string buffer_;
+};
 
 bool GetNumericProperty(const char* name_data, size_t name_size, size_t* value);
 
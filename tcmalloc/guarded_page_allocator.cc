@@ -17,6 +17,7 @@
 #include <sys/mman.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
@@ -34,6 +35,7 @@
 #include "tcmalloc/internal/exponential_biased.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/util.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/pages.h"
@@ -41,6 +43,14 @@
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/system-alloc.h"
 
+// Lightweight guard regions, from Linux 6.13.
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+#ifndef MADV_GUARD_REMOVE
+#define MADV_GUARD_REMOVE 103
+#endif
+
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -51,27 +61,28 @@ void GuardedPageAllocator::Init(size_t max_alloced_pages, size_t total_pages) {
   CHECK_CONDITION(max_alloced_pages > 0);
   CHECK_CONDITION(max_alloced_pages <= total_pages);
   CHECK_CONDITION(total_pages <= kGpaMaxPages);
-  max_alloced_pages_ = max_alloced_pages;
-  total_pages_ = total_pages;
+  max_alloced_pages_.store(max_alloced_pages, std::memory_order_relaxed);
+  total_pages_.store(total_pages, std::memory_order_relaxed);
 
   // If the system page size is larger than kPageSize, we need to use the
-  // system page size for this allocator since mprotect operates on full pages
-  // only.  This case happens on PPC.
+  // system page size for this allocator since mprotect and guard regions
+  // operate on full pages only.  This case happens on PPC.
   page_size_ = std::max(kPageSize, static_cast<size_t>(GetPageSize()));
   ASSERT(page_size_ % kPageSize == 0);
 
-  rand_ = reinterpret_cast<uint64_t>(this);  // Initialize RNG seed.
+  // Initialize RNG seed.
+  rand_.store(reinterpret_cast<uint64_t>(this), std::memory_order_relaxed);
   MapPages();
 }
 
 void GuardedPageAllocator::Destroy() {
   AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  if (initialized_) {
+  if (initialized_.load(std::memory_order_relaxed)) {
     size_t len = pages_end_addr_ - pages_base_addr_;
     int err = munmap(reinterpret_cast<void*>(pages_base_addr_), len);
     ASSERT(err != -1);
     (void)err;
-    initialized_ = false;
+    initialized_.store(false, std::memory_order_relaxed);
   }
 }
 
@@ -90,10 +101,9 @@ GuardedAllocWithStatus GuardedPageAllocator::Allocate(size_t size,
   ASSERT(alignment <= page_size_);
   ASSERT(alignment == 0 || absl::has_single_bit(alignment));
   void* result = reinterpret_cast<void*>(SlotToAddr(free_slot));
-  if (mprotect(result, page_size_, PROT_READ | PROT_WRITE) == -1) {
-    ASSERT(false && "mprotect failed");
-    AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    num_failed_allocations_++;
+  if (!UnguardPage(reinterpret_cast<uintptr_t>(result))) {
+    ASSERT(false && "unguarding page failed");
+    num_failed_allocations_.fetch_add(1, std::memory_order_relaxed);
     FreeSlot(free_slot);
     return {nullptr, Profile::Sample::GuardedStatus::MProtectFailed};
   }
@@ -102,14 +112,13 @@ GuardedAllocWithStatus GuardedPageAllocator::Allocate(size_t size,
   MaybeRightAlign(free_slot, size, alignment, &result);
 
   // Record stack trace.
-  SlotMetadata& d = data_[free_slot];
+  SlotMetadata& d = data(free_slot);
   // Count the number of pages that have been used at least once.
   if (d.allocation_start == 0) {
     AllocationGuardSpinLockHolder h(&guarded_page_lock_);
     ++total_pages_used_;
-    if (total_pages_used_ == total_pages_) {
-      alloced_page_count_when_all_used_once_ =
-          num_allocation_requests_ - num_failed_allocations_;
+    if (total_pages_used_ == total_pages_.load(std::memory_order_relaxed)) {
+      alloced_page_count_when_all_used_once_ = SuccessfulAllocations();
     }
   }
   d.dealloc_trace.depth = 0;
@@ -128,26 +137,22 @@ void GuardedPageAllocator::Deallocate(void* ptr) {
   const uintptr_t page_addr = GetPageAddr(reinterpret_cast<uintptr_t>(ptr));
   size_t slot = AddrToSlot(page_addr);
 
-  {
-    AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    if (IsFreed(slot)) {
-      double_free_detected_ = true;
-    } else if (WriteOverflowOccurred(slot)) {
-      write_overflow_detected_ = true;
-    }
-
-    CHECK_CONDITION(mprotect(reinterpret_cast<void*>(page_addr), page_size_,
-                             PROT_NONE) != -1);
+  if (IsFreed(slot)) {
+    double_free_detected_.store(true, std::memory_order_relaxed);
+  } else if (WriteOverflowOccurred(slot)) {
+    write_overflow_detected_.store(true, std::memory_order_relaxed);
   }
 
-  if (write_overflow_detected_ || double_free_detected_) {
+  CHECK_CONDITION(GuardPage(page_addr));
+
+  if (write_overflow_detected_.load(std::memory_order_relaxed) ||
+      double_free_detected_.load(std::memory_order_relaxed)) {
     *reinterpret_cast<char*>(ptr) = 'X';  // Trigger SEGV handler.
     CHECK_CONDITION(false);               // Unreachable.
   }
 
-  // Record stack trace.
-  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  GuardedAllocationsStackTrace& trace = data_[slot].dealloc_trace;
+  // Record stack trace.  Until FreeSlot() publishes the slot, only we own it.
+  GuardedAllocationsStackTrace& trace = data(slot).dealloc_trace;
   trace.depth = absl::GetStackTrace(trace.stack, kMaxStackDepth,
                                     /*skip_count=*/2);
   trace.thread_id = absl::base_internal::GetTID();
@@ -158,7 +163,7 @@ void GuardedPageAllocator::Deallocate(void* ptr) {
 size_t GuardedPageAllocator::GetRequestedSize(const void* ptr) const {
   ASSERT(PointerIsMine(ptr));
   size_t slot = AddrToSlot(GetPageAddr(reinterpret_cast<uintptr_t>(ptr)));
-  return data_[slot].requested_size;
+  return data(slot).requested_size;
 }
 
 std::pair<off_t, size_t> GuardedPageAllocator::GetAllocationOffsetAndSize(
@@ -166,7 +171,8 @@ std::pair<off_t, size_t> GuardedPageAllocator::GetAllocationOffsetAndSize(
   ASSERT(PointerIsMine(ptr));
   const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
   const size_t slot = GetNearestSlot(addr);
-  return {addr - data_[slot].allocation_start, data_[slot].requested_size};
+  const SlotMetadata& d = data(slot);
+  return {addr - d.allocation_start, d.requested_size};
 }
 
 GuardedAllocationsErrorType GuardedPageAllocator::GetStackTraces(
@@ -175,9 +181,10 @@ GuardedAllocationsErrorType GuardedPageAllocator::GetStackTraces(
   ASSERT(PointerIsMine(ptr));
   const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
   size_t slot = GetNearestSlot(addr);
-  *alloc_trace = &data_[slot].alloc_trace;
-  *dealloc_trace = &data_[slot].dealloc_trace;
-  return GetErrorType(addr, data_[slot]);
+  SlotMetadata& d = data(slot);
+  *alloc_trace = &d.alloc_trace;
+  *dealloc_trace = &d.dealloc_trace;
+  return GetErrorType(addr, d);
 }
 
 // We take guarded samples during periodic profiling samples.  Computes the
@@ -195,6 +202,7 @@ static int GetChainedRate() {
 
 void GuardedPageAllocator::Print(Printer* out) {
   AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+  const size_t total_pages = total_pages_.load(std::memory_order_relaxed);
   out->printf(
       "\n"
       "------------------------------------------------\n"
@@ -209,36 +217,47 @@ void GuardedPageAllocator::Print(Printer* out) {
       "StackTraceFilter Replacement Inserts: %zu\n"
       "Total Slots Used Once: %zu / %zu\n"
       "Allocation Count When All Slots Used Once: %zu\n"
+      "Guard Pages: %s\n"
       "PARAMETER tcmalloc_guarded_sample_parameter %d\n"
       // TODO(b/263387812): remove when experiment is finished
       "PARAMETER tcmalloc_improved_guarded_sampling %d\n",
-      num_allocation_requests_ - num_failed_allocations_,
-      num_failed_allocations_, num_alloced_pages_,
-      total_pages_ - num_alloced_pages_, num_alloced_pages_max_,
-      max_alloced_pages_, tc_globals.stacktrace_filter().max_slots_used(),
+      SuccessfulAllocations(),
+      num_failed_allocations_.load(std::memory_order_relaxed),
+      num_alloced_pages_.load(std::memory_order_relaxed),
+      total_pages - num_alloced_pages_.load(std::memory_order_relaxed),
+      num_alloced_pages_max_.load(std::memory_order_relaxed),
+      max_alloced_pages_.load(std::memory_order_relaxed),
+      tc_globals.stacktrace_filter().max_slots_used(),
       tc_globals.stacktrace_filter().replacement_inserts(), total_pages_used_,
-      total_pages_, alloced_page_count_when_all_used_once_, GetChainedRate(),
+      total_pages, alloced_page_count_when_all_used_once_,
+      use_guard_regions_ ? "guard regions" : "mprotect", GetChainedRate(),
       Parameters::improved_guarded_sampling());
 }
 
 void GuardedPageAllocator::PrintInPbtxt(PbtxtRegion* gwp_asan) {
   AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  gwp_asan->PrintI64("successful_allocations",
-                     num_allocation_requests_ - num_failed_allocations_);
-  gwp_asan->PrintI64("failed_allocations", num_failed_allocations_);
-  gwp_asan->PrintI64("current_slots_allocated", num_alloced_pages_);
+  const size_t alloced_pages =
+      num_alloced_pages_.load(std::memory_order_relaxed);
+  const size_t total_pages = total_pages_.load(std::memory_order_relaxed);
+  gwp_asan->PrintI64("successful_allocations", SuccessfulAllocations());
+  gwp_asan->PrintI64("failed_allocations",
+                     num_failed_allocations_.load(std::memory_order_relaxed));
+  gwp_asan->PrintI64("current_slots_allocated", alloced_pages);
   gwp_asan->PrintI64("current_slots_quarantined",
-                     total_pages_ - num_alloced_pages_);
-  gwp_asan->PrintI64("max_slots_allocated", num_alloced_pages_max_);
-  gwp_asan->PrintI64("allocated_slot_limit", max_alloced_pages_);
+                     total_pages - alloced_pages);
+  gwp_asan->PrintI64("max_slots_allocated",
+                     num_alloced_pages_max_.load(std::memory_order_relaxed));
+  gwp_asan->PrintI64("allocated_slot_limit",
+                     max_alloced_pages_.load(std::memory_order_relaxed));
   gwp_asan->PrintI64("stack_trace_filter_max_slots_used",
                      tc_globals.stacktrace_filter().max_slots_used());
   gwp_asan->PrintI64("stack_trace_filter_replacement_inserts",
                      tc_globals.stacktrace_filter().replacement_inserts());
   gwp_asan->PrintI64("total_pages_used", total_pages_used_);
-  gwp_asan->PrintI64("total_pages", total_pages_);
+  gwp_asan->PrintI64("total_pages", total_pages);
   gwp_asan->PrintI64("alloced_page_count_when_all_used_once",
                      alloced_page_count_when_all_used_once_);
+  gwp_asan->PrintBool("guard_regions", use_guard_regions_);
   gwp_asan->PrintI64("tcmalloc_guarded_sample_parameter", GetChainedRate());
   // TODO(b/263387812): remove when experiment is finished
   gwp_asan->PrintI64("tcmalloc_improved_guarded_sampling",
@@ -246,22 +265,54 @@ void GuardedPageAllocator::PrintInPbtxt(PbtxtRegion* gwp_asan) {
 }
 
 size_t GuardedPageAllocator::SuccessfulAllocations() {
-  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  ASSERT(num_allocation_requests_ >= num_failed_allocations_);
-  return num_allocation_requests_ - num_failed_allocations_;
+  // Load the failures first, so that a concurrent failed request cannot make
+  // them exceed the requests we read.
+  const size_t failed =
+      num_failed_allocations_.load(std::memory_order_acquire);
+  const size_t requests =
+      num_allocation_requests_.load(std::memory_order_acquire);
+  ASSERT(requests >= failed);
+  return requests - failed;
 }
 
-// Maps 2 * total_pages_ + 1 pages so that there are total_pages_ unique pages
-// we can return from Allocate with guard pages before and after them.
+// Reserves 2 * kGpaMaxPages + 1 pages so that there are kGpaMaxPages unique
+// pages we can return from Allocate with guard pages before and after them.
+// The reservation is hugepage-aligned and sized, tagged as sampled memory and
+// kept out of transparent hugepages, so guarding pages splits no hugepage of
+// the rest of the heap.
+//
+// The reservation is guarded whole with guard regions where the kernel
+// supports them, and is otherwise left PROT_NONE.
 void GuardedPageAllocator::MapPages() {
   AllocationGuardSpinLockHolder h(&guarded_page_lock_);
   ASSERT(!first_page_addr_);
   ASSERT(page_size_ % GetPageSize() == 0);
-  size_t len = (2 * total_pages_ + 1) * page_size_;
+  const size_t alignment = std::max(kHugePageSize, page_size_);
+  const size_t len =
+      (((2 * kGpaMaxPages + 1) * page_size_ + alignment - 1) / alignment) *
+      alignment;
   auto base_addr = reinterpret_cast<uintptr_t>(
-      MmapAligned(len, page_size_, MemoryTag::kSampled));
+      MmapAligned(len, alignment, MemoryTag::kSampled));
   ASSERT(base_addr);
   if (!base_addr) return;
+  {
+    // This is only advisory, so ignore the error.
+    ErrnoRestorer errno_restorer;
+    (void)madvise(reinterpret_cast<void*>(base_addr), len, MADV_NOHUGEPAGE);
+  }
+  {
+    // Older kernels reject MADV_GUARD_INSTALL with EINVAL, as they do for
+    // mlocked mappings.
+    ErrnoRestorer errno_restorer;
+    void* base = reinterpret_cast<void*>(base_addr);
+    if (mprotect(base, len, PROT_READ | PROT_WRITE) == 0) {
+      if (madvise(base, len, MADV_GUARD_INSTALL) == 0) {
+        use_guard_regions_ = true;
+      } else {
+        CHECK_CONDITION(mprotect(base, len, PROT_NONE) == 0);
+      }
+    }
+  }
 
   // Tell TCMalloc's PageMap about the memory we own.
   const PageId page = PageIdContaining(reinterpret_cast<void*>(base_addr));
@@ -271,58 +322,125 @@ void GuardedPageAllocator::MapPages() {
     return;
   }
 
-  // Allocate memory for slot metadata.
-  data_ = reinterpret_cast<SlotMetadata*>(
-      tc_globals.arena().Alloc(sizeof(*data_) * total_pages_));
-  for (size_t i = 0; i < total_pages_; ++i) {
-    new (&data_[i]) SlotMetadata;
-  }
-
   pages_base_addr_ = base_addr;
   pages_end_addr_ = pages_base_addr_ + len;
 
   // Align first page to page_size_.
   first_page_addr_ = GetPageAddr(pages_base_addr_ + page_size_);
 
-  std::fill_n(free_pages_, total_pages_, true);
-  initialized_ = true;
+  AddSlots(0, total_pages_.load(std::memory_order_relaxed));
+  initialized_.store(true, std::memory_order_release);
 }
 
-// Selects a random slot in O(total_pages_) time.
-ssize_t GuardedPageAllocator::ReserveFreeSlot() {
+void GuardedPageAllocator::AddSlots(size_t begin, size_t end) {
+  ASSERT(begin <= end);
+  ASSERT(end <= kGpaMaxPages);
+  for (size_t slot = begin; slot < end; ++slot) {
+    SlotMetadata*& chunk = data_[slot / kSlotsPerWord];
+    if (chunk == nullptr) {
+      chunk = reinterpret_cast<SlotMetadata*>(
+          tc_globals.arena().Alloc(sizeof(SlotMetadata) * kSlotsPerWord));
+      for (size_t i = 0; i < kSlotsPerWord; ++i) {
+        new (&chunk[i]) SlotMetadata;
+      }
+    }
+    free_slots_[slot / kSlotsPerWord].fetch_or(
+        uint64_t{1} << (slot % kSlotsPerWord), std::memory_order_relaxed);
+  }
+}
+
+bool GuardedPageAllocator::Grow() {
+  const size_t limit = std::min<size_t>(
+      std::max<int64_t>(Parameters::guarded_pool_bytes(), 0) / page_size_,
+      kGpaMaxPages);
+  const size_t seen = max_alloced_pages_.load(std::memory_order_relaxed);
+  if (seen >= limit) return false;
+
+  AllocationGuardSpinLockHolder l(&pageheap_lock);
   AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  if (!initialized_ || !allow_allocations_) return -1;
-  num_allocation_requests_++;
-  if (num_alloced_pages_ == max_alloced_pages_) {
-    num_failed_allocations_++;
+  const size_t max_alloced = max_alloced_pages_.load(std::memory_order_relaxed);
+  if (max_alloced != seen) {
+    // Another thread grew the pool while we waited.
+    return true;
+  }
+  const size_t new_max_alloced = std::min(limit, 2 * max_alloced);
+  // Keep at least as many slots quarantined as allocated, as Init() does by
+  // default.
+  const size_t total = total_pages_.load(std::memory_order_relaxed);
+  const size_t new_total =
+      std::max(total, std::min(kGpaMaxPages, 2 * new_max_alloced));
+  AddSlots(total, new_total);
+  total_pages_.store(new_total, std::memory_order_release);
+  max_alloced_pages_.store(new_max_alloced, std::memory_order_release);
+  return true;
+}
+
+// Selects a slot in O(total_pages_ / kSlotsPerWord) time without locking.
+ssize_t GuardedPageAllocator::ReserveFreeSlot() {
+  if (!initialized_.load(std::memory_order_acquire) ||
+      !allow_allocations_.load(std::memory_order_acquire)) {
     return -1;
   }
+  num_allocation_requests_.fetch_add(1, std::memory_order_release);
+
+  size_t alloced = num_alloced_pages_.load(std::memory_order_relaxed);
+  while (true) {
+    if (alloced >= max_alloced_pages_.load(std::memory_order_acquire)) {
+      if (!Grow()) {
+        num_failed_allocations_.fetch_add(1, std::memory_order_release);
+        return -1;
+      }
+      alloced = num_alloced_pages_.load(std::memory_order_relaxed);
+      continue;
+    }
+    if (num_alloced_pages_.compare_exchange_weak(alloced, alloced + 1,
+                                                 std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  size_t alloced_max = num_alloced_pages_max_.load(std::memory_order_relaxed);
+  while (alloced + 1 > alloced_max &&
+         !num_alloced_pages_max_.compare_exchange_weak(
+             alloced_max, alloced + 1, std::memory_order_relaxed)) {
+  }
 
-  rand_ = ExponentialBiased::NextRandom(rand_);
-  size_t num_free_pages = total_pages_ - num_alloced_pages_;
-  size_t slot = GetIthFreeSlot(rand_ % num_free_pages);
-  ASSERT(free_pages_[slot]);
-  free_pages_[slot] = false;
-  num_alloced_pages_++;
-  num_alloced_pages_max_ = std::max(num_alloced_pages_, num_alloced_pages_max_);
-  return slot;
+  const uint64_t rand =
+      ExponentialBiased::NextRandom(rand_.load(std::memory_order_relaxed));
+  rand_.store(rand, std::memory_order_relaxed);
+  return ClaimFreeSlot(rand % total_pages_.load(std::memory_order_acquire));
 }
 
-size_t GuardedPageAllocator::GetIthFreeSlot(size_t ith_free_slot) {
-  ASSERT(ith_free_slot < total_pages_ - num_alloced_pages_);
-  for (size_t free_slot_count = 0, j = 0;; j++) {
-    if (free_pages_[j]) {
-      if (free_slot_count == ith_free_slot) return j;
-      free_slot_count++;
+size_t GuardedPageAllocator::ClaimFreeSlot(size_t start) {
+  const size_t num_words =
+      (total_pages_.load(std::memory_order_acquire) + kSlotsPerWord - 1) /
+      kSlotsPerWord;
+  size_t word = start / kSlotsPerWord;
+  uint64_t mask = ~uint64_t{0} << (start % kSlotsPerWord);
+  // Our reservation leaves at least one slot free, though racing reservations
+  // may take the ones we see first.
+  while (true) {
+    uint64_t bits = free_slots_[word].load(std::memory_order_relaxed);
+    while ((bits & mask) != 0) {
+      const int bit = absl::countr_zero(bits & mask);
+      if (free_slots_[word].compare_exchange_weak(
+              bits, bits & ~(uint64_t{1} << bit), std::memory_order_acquire,
+              std::memory_order_relaxed)) {
+        return word * kSlotsPerWord + bit;
+      }
     }
+    mask = ~uint64_t{0};
+    word = word + 1 < num_words ? word + 1 : 0;
   }
 }
 
 void GuardedPageAllocator::FreeSlot(size_t slot) {
-  ASSERT(slot < total_pages_);
-  ASSERT(!free_pages_[slot]);
-  free_pages_[slot] = true;
-  num_alloced_pages_--;
+  ASSERT(slot < total_pages_.load(std::memory_order_relaxed));
+  const uint64_t slot_bit = uint64_t{1} << (slot % kSlotsPerWord);
+  const uint64_t prev = free_slots_[slot / kSlotsPerWord].fetch_or(
+      slot_bit, std::memory_order_release);
+  ASSERT((prev & slot_bit) == 0);
+  (void)prev;
+  num_alloced_pages_.fetch_sub(1, std::memory_order_relaxed);
 }
 
 uintptr_t GuardedPageAllocator::GetPageAddr(uintptr_t addr) const {
@@ -333,7 +451,8 @@ uintptr_t GuardedPageAllocator::GetPageAddr(uintptr_t addr) const {
 uintptr_t GuardedPageAllocator::GetNearestValidPage(uintptr_t addr) const {
   if (addr < first_page_addr_) return first_page_addr_;
   const uintptr_t last_page_addr =
-      first_page_addr_ + 2 * (total_pages_ - 1) * page_size_;
+      first_page_addr_ +
+      2 * (total_pages_.load(std::memory_order_relaxed) - 1) * page_size_;
   if (addr > last_page_addr) return last_page_addr;
   uintptr_t offset = addr - first_page_addr_;
 
@@ -353,14 +472,15 @@ size_t GuardedPageAllocator::GetNearestSlot(uintptr_t addr) const {
 }
 
 bool GuardedPageAllocator::IsFreed(size_t slot) const {
-  return free_pages_[slot];
+  return (free_slots_[slot / kSlotsPerWord].load(std::memory_order_relaxed) >>
+          (slot % kSlotsPerWord)) &
+         1;
 }
 
 bool GuardedPageAllocator::WriteOverflowOccurred(size_t slot) const {
   if (!ShouldRightAlign(slot)) return false;
   uint8_t magic = GetWriteOverflowMagic(slot);
-  uintptr_t alloc_end =
-      data_[slot].allocation_start + data_[slot].requested_size;
+  uintptr_t alloc_end = data(slot).allocation_start + data(slot).requested_size;
   uintptr_t page_end = SlotToAddr(slot) + page_size_;
   uintptr_t magic_end = std::min(page_end, alloc_end + kMagicSize);
   for (uintptr_t p = alloc_end; p < magic_end; ++p) {
@@ -372,8 +492,10 @@ bool GuardedPageAllocator::WriteOverflowOccurred(size_t slot) const {
 GuardedAllocationsErrorType GuardedPageAllocator::GetErrorType(
     uintptr_t addr, const SlotMetadata& d) const {
   if (!d.allocation_start) return GuardedAllocationsErrorType::kUnknown;
-  if (double_free_detected_) return GuardedAllocationsErrorType::kDoubleFree;
-  if (write_overflow_detected_)
+  if (double_free_detected_.load(std::memory_order_relaxed)) {
+    return GuardedAllocationsErrorType::kDoubleFree;
+  }
+  if (write_overflow_detected_.load(std::memory_order_relaxed))
     return GuardedAllocationsErrorType::kBufferOverflowOnDealloc;
   if (d.dealloc_trace.depth > 0) {
     return GuardedAllocationsErrorType::kUseAfterFree;
@@ -387,8 +509,26 @@ GuardedAllocationsErrorType GuardedPageAllocator::GetErrorType(
   return GuardedAllocationsErrorType::kUnknown;
 }
 
+bool GuardedPageAllocator::UnguardPage(uintptr_t addr) {
+  void* page = reinterpret_cast<void*>(addr);
+  if (use_guard_regions_) {
+    // The page reads as zeroes, as a new page would.
+    return madvise(page, page_size_, MADV_GUARD_REMOVE) == 0;
+  }
+  return mprotect(page, page_size_, PROT_READ | PROT_WRITE) == 0;
+}
+
+bool GuardedPageAllocator::GuardPage(uintptr_t addr) {
+  void* page = reinterpret_cast<void*>(addr);
+  if (use_guard_regions_) {
+    // This also returns the page's memory to the system.
+    return madvise(page, page_size_, MADV_GUARD_INSTALL) == 0;
+  }
+  return mprotect(page, page_size_, PROT_NONE) == 0;
+}
+
 uintptr_t GuardedPageAllocator::SlotToAddr(size_t slot) const {
-  ASSERT(slot < total_pages_);
+  ASSERT(slot < total_pages_.load(std::memory_order_relaxed));
   return first_page_addr_ + 2 * slot * page_size_;
 }
 
@@ -397,7 +537,7 @@ size_t GuardedPageAllocator::AddrToSlot(uintptr_t addr) const {
   ASSERT(offset % page_size_ == 0);
   ASSERT((offset / page_size_) % 2 == 0);
   int slot = offset / page_size_ / 2;
-  ASSERT(slot >= 0 && slot < total_pages_);
+  ASSERT(slot >= 0 && slot < total_pages_.load(std::memory_order_relaxed));
   return slot;
 }
 
@@ -15,6 +15,7 @@
 #ifndef TCMALLOC_GUARDED_PAGE_ALLOCATOR_H_
 #define TCMALLOC_GUARDED_PAGE_ALLOCATOR_H_
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <utility>
@@ -39,6 +40,11 @@ namespace tcmalloc_internal {
 // and any future accesses to it will also cause segfaults until the page is
 // reallocated.
 //
+// Where the kernel supports them (Linux 6.13+), pages are made inaccessible
+// with lightweight guard regions (MADV_GUARD_INSTALL), which leave the pool a
+// single mapping.  Otherwise they are protected with mprotect, which splits the
+// pool into a VMA per page and takes the process's mmap lock for writing.
+//
 // Is safe to use with static storage duration and is thread safe with the
 // exception of calls to Init() and Destroy() (see corresponding function
 // comments).
@@ -65,18 +71,19 @@ namespace tcmalloc_internal {
 //   }
 class GuardedPageAllocator {
  public:
-  // Maximum number of pages this class can allocate.
-  static constexpr size_t kGpaMaxPages = 512;
+  // Maximum number of pages this class can allocate.  Address space for this
+  // many is reserved up front, so that the pool can grow in place.
+  static constexpr size_t kGpaMaxPages = 4096;
 
   constexpr GuardedPageAllocator()
       : guarded_page_lock_(absl::kConstInit,
                            absl::base_internal::SCHEDULE_KERNEL_ONLY),
-        free_pages_{},
+        free_slots_{},
         num_alloced_pages_(0),
         num_alloced_pages_max_(0),
         num_allocation_requests_(0),
         num_failed_allocations_(0),
-        data_(nullptr),
+        data_{},
         pages_base_addr_(0),
         pages_end_addr_(0),
         first_page_addr_(0),
@@ -86,6 +93,7 @@ class GuardedPageAllocator {
         alloced_page_count_when_all_used_once_(0),
         page_size_(0),
         rand_(0),
+        use_guard_regions_(false),
         initialized_(false),
         allow_allocations_(false),
         double_free_detected_(false),
@@ -100,6 +108,9 @@ class GuardedPageAllocator {
   // time from a pool of total_pages pages, where:
   //   1 <= max_alloced_pages <= total_pages <= kGpaMaxPages
   //
+  // The pool grows beyond these when it runs out of slots and the
+  // guarded_pool_bytes parameter allows more pages to be allocated at once.
+  //
   // This method should be called non-concurrently and only once to complete
   // initialization.  Dynamic initialization is deliberately done here and not
   // in the constructor, thereby allowing the constructor to be constexpr and
@@ -168,24 +179,38 @@ class GuardedPageAllocator {
     return pages_base_addr_ <= addr && addr < pages_end_addr_;
   }
 
+  // Acquires and releases guarded_page_lock_ around fork(), so that the child
+  // does not inherit it held by a thread that no longer exists.
+  void AcquireInternalLocks() ABSL_EXCLUSIVE_LOCK_FUNCTION(guarded_page_lock_) {
+    guarded_page_lock_.Lock();
+  }
+  void ReleaseInternalLocks() ABSL_UNLOCK_FUNCTION(guarded_page_lock_) {
+    guarded_page_lock_.Unlock();
+  }
+
   // Allows Allocate() to start returning allocations.
   void AllowAllocations() ABSL_LOCKS_EXCLUDED(guarded_page_lock_) {
     AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    allow_allocations_ = true;
+    allow_allocations_.store(true, std::memory_order_release);
   }
 
   // Returns the number of pages available for allocation, based on how many are
   // currently in use.  (Should only be used in testing.)
-  size_t GetNumAvailablePages() ABSL_LOCKS_EXCLUDED(guarded_page_lock_) {
-    AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    return max_alloced_pages_ - num_alloced_pages_;
+  size_t GetNumAvailablePages() const {
+    return max_alloced_pages_.load(std::memory_order_relaxed) -
+           num_alloced_pages_.load(std::memory_order_relaxed);
   }
 
   size_t SuccessfulAllocations() ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
 
   size_t page_size() const { return page_size_; }
 
+  // Returns true if pages are guarded with guard regions rather than mprotect.
+  bool uses_guard_regions() const { return use_guard_regions_; }
+
  private:
+  static constexpr size_t kSlotsPerWord = 64;
+
   // Structure for storing data about a slot.
   struct SlotMetadata {
     GuardedAllocationsStackTrace alloc_trace;
@@ -197,22 +222,36 @@ class GuardedPageAllocator {
   // Max number of magic bytes we use to detect write-overflows at deallocation.
   static constexpr size_t kMagicSize = 32;
 
-  // Maps pages into memory.
+  // Reserves the address space for kGpaMaxPages pages and sets up the first
+  // total_pages_ of them.
   void MapPages() ABSL_LOCKS_EXCLUDED(guarded_page_lock_)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
-  // Reserves and returns a slot randomly selected from the free slots in
-  // free_pages_.  Returns -1 if no slots available, or if AllowAllocations()
-  // hasn't been called yet.
-  ssize_t ReserveFreeSlot() ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+  // Makes slots [begin, end) available for allocation.
+  void AddSlots(size_t begin, size_t end)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock, guarded_page_lock_);
+
+  // Doubles the number of pages that may be allocated at once, and the pool
+  // with it, up to the guarded_pool_bytes budget.  Returns false if the pool
+  // cannot grow.
+  bool Grow() ABSL_LOCKS_EXCLUDED(pageheap_lock, guarded_page_lock_);
+
+  SlotMetadata& data(size_t slot) const {
+    ASSERT(slot < total_pages_.load(std::memory_order_relaxed));
+    return data_[slot / kSlotsPerWord][slot % kSlotsPerWord];
+  }
+
+  // Reserves and returns a free slot, the first one at or after a random
+  // position in free_slots_.  Returns -1 if no slots available, or if
+  // AllowAllocations() hasn't been called yet.  Lock-free.
+  ssize_t ReserveFreeSlot();
 
-  // Returns the i-th free slot of free_pages_.  i must be in the range [0,
-  // total_pages_ - num_alloced_pages_).
-  size_t GetIthFreeSlot(size_t i)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(guarded_page_lock_);
+  // Claims a free slot, starting the search at slot start.  Requires a
+  // reservation against max_alloced_pages_, which guarantees one is free.
+  size_t ClaimFreeSlot(size_t start);
 
-  // Marks the specified slot as unreserved.
-  void FreeSlot(size_t slot) ABSL_EXCLUSIVE_LOCKS_REQUIRED(guarded_page_lock_);
+  // Marks the specified slot as unreserved.  Lock-free.
+  void FreeSlot(size_t slot);
 
   // Returns the address of the page that addr resides on.
   uintptr_t GetPageAddr(uintptr_t addr) const;
@@ -224,8 +263,7 @@ class GuardedPageAllocator {
   size_t GetNearestSlot(uintptr_t addr) const;
 
   // Returns true if the specified slot has already been freed.
-  bool IsFreed(size_t slot) const
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(guarded_page_lock_);
+  bool IsFreed(size_t slot) const;
 
   // Returns true if magic bytes for slot were overwritten.
   bool WriteOverflowOccurred(size_t slot) const;
@@ -252,34 +290,45 @@ class GuardedPageAllocator {
   uintptr_t SlotToAddr(size_t slot) const;
   size_t AddrToSlot(uintptr_t addr) const;
 
+  // Makes the page at addr accessible or inaccessible.  Returns false on
+  // failure.
+  bool UnguardPage(uintptr_t addr);
+  bool GuardPage(uintptr_t addr);
+
   absl::base_internal::SpinLock guarded_page_lock_;
 
-  // Maps each bool to one page.
-  // true: Free.  false: Reserved.
-  bool free_pages_[kGpaMaxPages] ABSL_GUARDED_BY(guarded_page_lock_);
+  // Maps each bit to one page.
+  // 1: Free.  0: Reserved.
+  std::atomic<uint64_t> free_slots_[kGpaMaxPages / kSlotsPerWord];
 
-  // Number of currently-allocated pages.
-  size_t num_alloced_pages_ ABSL_GUARDED_BY(guarded_page_lock_);
+  // Number of currently-allocated pages.  Incremented before a slot is claimed
+  // and decremented after it is freed, so it never undercounts the reserved
+  // bits in free_slots_.
+  std::atomic<size_t> num_alloced_pages_;
 
   // The high-water mark for num_alloced_pages_.
-  size_t num_alloced_pages_max_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<size_t> num_alloced_pages_max_;
 
   // Number of calls to Allocate.
-  size_t num_allocation_requests_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<size_t> num_allocation_requests_;
 
   // Number of times Allocate has failed.
-  size_t num_failed_allocations_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<size_t> num_failed_allocations_;
 
-  // A dynamically-allocated array of stack trace data captured when each page
-  // is allocated/deallocated.  Printed by the SEGV handler when a memory error
-  // is detected.
-  SlotMetadata* data_;
+  // Stack trace data captured when each page is allocated/deallocated, in
+  // dynamically-allocated chunks of kSlotsPerWord slots.  Printed by the SEGV
+  // handler when a memory error is detected.
+  SlotMetadata* data_[kGpaMaxPages / kSlotsPerWord];
 
   uintptr_t pages_base_addr_;  // Points to start of mapped region.
   uintptr_t pages_end_addr_;   // Points to the end of mapped region.
   uintptr_t first_page_addr_;  // Points to first page returnable by Allocate.
-  size_t max_alloced_pages_;   // Max number of pages to allocate at once.
-  size_t total_pages_;         // Size of the page pool to allocate from.
+  // Max number of pages to allocate at once.  Only grows, under
+  // guarded_page_lock_, after the pool has grown.
+  std::atomic<size_t> max_alloced_pages_;
+  // Size of the page pool to allocate from.  Only grows, under
+  // guarded_page_lock_, after the new slots are set up.
+  std::atomic<size_t> total_pages_;
   // Number of pages allocated at least once from page pool.
   size_t total_pages_used_ ABSL_GUARDED_BY(guarded_page_lock_);
   // The count of allocs when all the pages had been used at least once (i.e.
@@ -287,19 +336,24 @@ class GuardedPageAllocator {
   size_t alloced_page_count_when_all_used_once_
       ABSL_GUARDED_BY(guarded_page_lock_);
   size_t page_size_;           // Size of pages we allocate.
-  uint64_t rand_;              // RNG seed.
+  // RNG seed.  Concurrent updates may lose steps, which only costs randomness.
+  std::atomic<uint64_t> rand_;
+  // Set once by MapPages, before initialized_.
+  bool use_guard_regions_;
 
-  // True if this object has been fully initialized.
-  bool initialized_ ABSL_GUARDED_BY(guarded_page_lock_);
+  // True if this object has been fully initialized.  Only written under
+  // guarded_page_lock_.
+  std::atomic<bool> initialized_;
 
-  // Flag to control whether we can return allocations or not.
-  bool allow_allocations_ ABSL_GUARDED_BY(guarded_page_lock_);
+  // Flag to control whether we can return allocations or not.  Only written
+  // under guarded_page_lock_.
+  std::atomic<bool> allow_allocations_;
 
   // Set to true if a double free has occurred.
-  bool double_free_detected_;
+  std::atomic<bool> double_free_detected_;
 
   // Set to true if a write overflow was detected on deallocation.
-  bool write_overflow_detected_;
+  std::atomic<bool> write_overflow_detected_;
 };
 
 }  // namespace tcmalloc_internal
@@ -58,7 +58,37 @@ void BM_AllocDealloc(benchmark::State& state) {
 }
 
 BENCHMARK(BM_AllocDealloc)->Range(1, PageSize());
-BENCHMARK(BM_AllocDealloc)->Arg(1)->ThreadRange(1, kMaxGpaPages);
+BENCHMARK(BM_AllocDealloc)
+    ->Arg(1)
+    ->ThreadRange(1, 512)
+    ->UseRealTime();
+
+// Like BM_AllocDealloc, but with fewer slots than threads at the high end, so
+// that threads also contend on a full pool and some allocations fail.
+void BM_AllocDeallocFullPool(benchmark::State& state) {
+  static constexpr size_t kMaxAllocedPages = 32;
+  static GuardedPageAllocator* gpa = []() {
+    auto gpa = new GuardedPageAllocator;
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    gpa->Init(kMaxAllocedPages, kMaxGpaPages);
+    gpa->AllowAllocations();
+    return gpa;
+  }();
+  size_t failed = 0;
+  for (auto _ : state) {
+    char* ptr = reinterpret_cast<char*>(gpa->Allocate(1, 0).alloc);
+    if (ptr == nullptr) {
+      ++failed;
+      continue;
+    }
+    ptr[0] = 'X';
+    gpa->Deallocate(ptr);
+  }
+  state.counters["failed"] = benchmark::Counter(
+      failed, benchmark::Counter::kAvgIterations);
+}
+
+BENCHMARK(BM_AllocDeallocFullPool)->ThreadRange(1, 256)->UseRealTime();
 
 }  // namespace
 }  // namespace tcmalloc_internal
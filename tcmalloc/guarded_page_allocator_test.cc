@@ -16,6 +16,8 @@
 
 #include <algorithm>
 #include <array>
+#include <fstream>
+#include <iterator>
 #include <memory>
 #include <thread>  // NOLINT(build/c++11)
 #include <vector>
@@ -25,6 +27,7 @@
 #include "absl/container/flat_hash_set.h"
 #include "tcmalloc/internal/page_size.h"
 #include "tcmalloc/internal/sysinfo.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/testing/testutil.h"
 
@@ -164,6 +167,37 @@ TEST_P(GuardedPageAllocatorParamTest, AllocDeallocAllPages) {
 INSTANTIATE_TEST_SUITE_P(VaryNumPages, GuardedPageAllocatorParamTest,
                          testing::Values(1, kMaxGpaPages / 2, kMaxGpaPages));
 
+TEST(GuardedPageAllocatorGrowthTest, GrowsUpToBudget) {
+  constexpr size_t kBudgetPages = 8;
+  GuardedPageAllocator gpa;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    gpa.Init(/*max_alloced_pages=*/1, /*total_pages=*/2);
+    gpa.AllowAllocations();
+  }
+  const int64_t old_budget = Parameters::guarded_pool_bytes();
+  Parameters::set_guarded_pool_bytes(kBudgetPages * PageSize());
+
+  std::vector<void*> bufs;
+  for (size_t i = 0; i < kBudgetPages; i++) {
+    auto alloc_with_status = gpa.Allocate(1, 0);
+    EXPECT_EQ(alloc_with_status.status,
+              Profile::Sample::GuardedStatus::Guarded);
+    EXPECT_TRUE(gpa.PointerIsMine(alloc_with_status.alloc));
+    bufs.push_back(alloc_with_status.alloc);
+  }
+  EXPECT_EQ(gpa.GetNumAvailablePages(), 0);
+  auto alloc_with_status = gpa.Allocate(1, 0);
+  EXPECT_EQ(alloc_with_status.status,
+            Profile::Sample::GuardedStatus::NoAvailableSlots);
+
+  for (void* buf : bufs) {
+    gpa.Deallocate(buf);
+  }
+  Parameters::set_guarded_pool_bytes(old_budget);
+  gpa.Destroy();
+}
+
 TEST_F(GuardedPageAllocatorTest, PointerIsMine) {
   auto alloc_with_status = gpa_.Allocate(1, 0);
   EXPECT_EQ(alloc_with_status.status, Profile::Sample::GuardedStatus::Guarded);
@@ -183,6 +217,34 @@ TEST_F(GuardedPageAllocatorTest, Print) {
   EXPECT_THAT(buf, testing::ContainsRegex("GWP-ASan Status"));
 }
 
+// With guard regions, guarding pages does not split the pool into mappings.
+TEST_F(GuardedPageAllocatorTest, GuardRegionsKeepOneMapping) {
+  if (!gpa_.uses_guard_regions()) {
+    GTEST_SKIP() << "guard regions unsupported";
+  }
+  auto count_mappings = []() {
+    std::ifstream maps("/proc/self/maps");
+    return std::count(std::istreambuf_iterator<char>(maps),
+                      std::istreambuf_iterator<char>(), '\n');
+  };
+  const auto before = count_mappings();
+  std::vector<void*> allocs;
+  for (int i = 0; i < 64; ++i) {
+    auto alloc_with_status = gpa_.Allocate(1, 0);
+    ASSERT_EQ(alloc_with_status.status,
+              Profile::Sample::GuardedStatus::Guarded);
+    *static_cast<char*>(alloc_with_status.alloc) = 'A';
+    allocs.push_back(alloc_with_status.alloc);
+  }
+  // Unrelated mappings may come and go meanwhile, but not one per page.
+  EXPECT_LT(count_mappings(), before + 16);
+  char* freed = static_cast<char*>(allocs.back());
+  for (void* alloc : allocs) {
+    gpa_.Deallocate(alloc);
+  }
+  EXPECT_DEATH(*freed = 'B', "");
+}
+
 // Test that no pages are double-allocated or left unallocated, and that no
 // extra pages are allocated when there's concurrent calls to Allocate().
 TEST_F(GuardedPageAllocatorTest, ThreadedAllocCount) {
@@ -0,0 +1,144 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/heap_telemetry.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/page_allocator.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT HeapTelemetry heap_telemetry;
+
+HeapActivity CurrentHeapActivity() {
+  HeapActivity ret;
+  ret.allocated_bytes = tc_globals.sampled_weight_allocated_.value();
+  ret.freed_bytes = tc_globals.sampled_weight_freed_.value();
+  if (UsePerCpuCache(tc_globals)) {
+    const auto misses = tc_globals.cpu_cache().GetTotalCacheMissStats();
+    ret.per_cpu_cache_misses = misses.underflows + misses.overflows;
+  }
+  Length released;
+  {
+    AllocationGuardSpinLockHolder l(&pageheap_lock);
+    released = tc_globals.page_allocator().released_pages();
+  }
+  ret.released_bytes = released.in_bytes();
+  return ret;
+}
+
+namespace {
+
+// Counters only grow, but guard against a reset wrapping a delta around.
+uint64_t Delta(uint64_t now, uint64_t then) {
+  return now > then ? now - then : 0;
+}
+
+}  // namespace
+
+HeapTelemetry::Tracker& HeapTelemetry::tracker() {
+  if (!tracker_constructed_) {
+    tracker_.Construct(clock_, kEpochs * kEpochLength);
+    tracker_constructed_ = true;
+  }
+  return tracker_.get_mutable();
+}
+
+void HeapTelemetry::Report(const HeapActivity& total) {
+  AllocationGuardSpinLockHolder h(&lock_);
+  if (has_last_) {
+    HeapActivity delta;
+    delta.allocated_bytes =
+        Delta(total.allocated_bytes, last_.allocated_bytes);
+    delta.freed_bytes = Delta(total.freed_bytes, last_.freed_bytes);
+    delta.per_cpu_cache_misses =
+        Delta(total.per_cpu_cache_misses, last_.per_cpu_cache_misses);
+    delta.released_bytes = Delta(total.released_bytes, last_.released_bytes);
+    tracker().Report(delta);
+  }
+  last_ = total;
+  has_last_ = true;
+}
+
+void HeapTelemetry::ResetInChild() {
+  tracker_constructed_ = false;
+  has_last_ = false;
+  lock_.Unlock();
+}
+
+size_t HeapTelemetry::GetEpochs(Epoch epochs[kEpochs]) {
+  AllocationGuardSpinLockHolder h(&lock_);
+  Tracker& t = tracker();
+  t.UpdateTimeBase();
+  size_t n = 0;
+  t.Iter(
+      [&](size_t offset, int64_t, const Entry& e) {
+        epochs[n].epochs_ago = kEpochs - 1 - offset;
+        epochs[n].activity = e.activity;
+        ++n;
+      },
+      Tracker::kSkipEmptyEntries);
+  return n;
+}
+
+void HeapTelemetry::Print(Printer* out) {
+  Epoch epochs[kEpochs];
+  const size_t n = GetEpochs(epochs);
+
+  out->printf("------------------------------------------------\n");
+  out->printf("Heap telemetry: activity per %llds over the last %zu epochs\n",
+              absl::ToInt64Seconds(kEpochLength), kEpochs);
+  out->printf("(allocations and frees are estimated from samples)\n");
+  out->printf("------------------------------------------------\n");
+  for (size_t i = 0; i < n; ++i) {
+    const HeapActivity& a = epochs[i].activity;
+    out->printf(
+        "HeapTelemetry: %3zus ago: %12llu allocated, %12llu freed, "
+        "%10llu cpu cache misses, %12llu released\n",
+        epochs[i].epochs_ago * absl::ToInt64Seconds(kEpochLength),
+        a.allocated_bytes, a.freed_bytes, a.per_cpu_cache_misses,
+        a.released_bytes);
+  }
+}
+
+void HeapTelemetry::PrintInPbtxt(PbtxtRegion* region) {
+  Epoch epochs[kEpochs];
+  const size_t n = GetEpochs(epochs);
+
+  for (size_t i = 0; i < n; ++i) {
+    const HeapActivity& a = epochs[i].activity;
+    PbtxtRegion epoch = region->CreateSubRegion("heap_telemetry");
+    epoch.PrintI64("seconds_ago",
+                   epochs[i].epochs_ago * absl::ToInt64Seconds(kEpochLength));
+    epoch.PrintI64("allocated_bytes", a.allocated_bytes);
+    epoch.PrintI64("freed_bytes", a.freed_bytes);
+    epoch.PrintI64("per_cpu_cache_misses", a.per_cpu_cache_misses);
+    epoch.PrintI64("released_bytes", a.released_bytes);
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,134 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_HEAP_TELEMETRY_H_
+#define TCMALLOC_HEAP_TELEMETRY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/explicitly_constructed.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/timeseries_tracker.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Counts of allocator activity.
+struct HeapActivity {
+  // Estimated from the weights of sampled allocations.
+  uint64_t allocated_bytes = 0;
+  uint64_t freed_bytes = 0;
+  // Underflows plus overflows.
+  uint64_t per_cpu_cache_misses = 0;
+  uint64_t released_bytes = 0;
+
+  HeapActivity& operator+=(const HeapActivity& rhs) {
+    allocated_bytes += rhs.allocated_bytes;
+    freed_bytes += rhs.freed_bytes;
+    per_cpu_cache_misses += rhs.per_cpu_cache_misses;
+    released_bytes += rhs.released_bytes;
+    return *this;
+  }
+};
+
+// Returns the activity since startup.
+HeapActivity CurrentHeapActivity();
+
+// A rolling history of allocator activity: how much of each kind happened in
+// each of the last kEpochs seconds.  The background thread reports to it about
+// once a second.
+class HeapTelemetry {
+ public:
+  static constexpr size_t kEpochs = 60;
+  static constexpr absl::Duration kEpochLength = absl::Seconds(1);
+
+  struct Epoch {
+    // How many epochs before the current one this one is.
+    size_t epochs_ago;
+    HeapActivity activity;
+  };
+
+  constexpr HeapTelemetry()
+      : HeapTelemetry(Clock{.now = absl::base_internal::CycleClock::Now,
+                            .freq = absl::base_internal::CycleClock::Frequency}) {
+  }
+  explicit constexpr HeapTelemetry(Clock clock)
+      : clock_(clock), tracker_() {}
+
+  HeapTelemetry(const HeapTelemetry&) = delete;
+  HeapTelemetry& operator=(const HeapTelemetry&) = delete;
+
+  // Records the activity since the previous call in the current epoch, given
+  // <total>, the activity since startup.  The first call only records <total>.
+  void Report(const HeapActivity& total) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Copies the epochs with any reports, oldest first, to <epochs>.  Returns the
+  // number copied.
+  size_t GetEpochs(Epoch epochs[kEpochs]) ABSL_LOCKS_EXCLUDED(lock_);
+
+  void Print(Printer* out) ABSL_LOCKS_EXCLUDED(lock_);
+  void PrintInPbtxt(PbtxtRegion* region) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Acquires lock_ before fork() and releases it in the parent after it.
+  void AcquireInternalLocks() ABSL_EXCLUSIVE_LOCK_FUNCTION(lock_) {
+    lock_.Lock();
+  }
+  void ReleaseInternalLocks() ABSL_UNLOCK_FUNCTION(lock_) { lock_.Unlock(); }
+  // Releases lock_ in the child after fork(), forgetting the parent's reports
+  // so that a background thread started in the child reports afresh.
+  void ResetInChild() ABSL_UNLOCK_FUNCTION(lock_);
+
+ private:
+  struct Entry {
+    HeapActivity activity;
+    bool reported = false;
+
+    static Entry Nil() { return Entry(); }
+    void Report(const HeapActivity& delta) {
+      activity += delta;
+      reported = true;
+    }
+    bool empty() const { return !reported; }
+  };
+
+  using Tracker = TimeSeriesTracker<Entry, HeapActivity, kEpochs>;
+
+  // The tracker cannot be constant-initialized, so it is built on first use.
+  Tracker& tracker() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  absl::base_internal::SpinLock lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  const Clock clock_;
+  bool tracker_constructed_ ABSL_GUARDED_BY(lock_) = false;
+  ExplicitlyConstructed<Tracker> tracker_ ABSL_GUARDED_BY(lock_);
+  bool has_last_ ABSL_GUARDED_BY(lock_) = false;
+  HeapActivity last_ ABSL_GUARDED_BY(lock_);
+};
+
+extern HeapTelemetry heap_telemetry;
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_HEAP_TELEMETRY_H_
@@ -0,0 +1,163 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/heap_telemetry.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class HeapTelemetryTest : public testing::Test {
+ protected:
+  ~HeapTelemetryTest() override { now_ns_ = 0; }
+
+  static void Advance(absl::Duration d) {
+    now_ns_ += absl::ToInt64Nanoseconds(d);
+  }
+
+  static HeapActivity Activity(uint64_t allocated, uint64_t freed,
+                               uint64_t misses, uint64_t released) {
+    HeapActivity a;
+    a.allocated_bytes = allocated;
+    a.freed_bytes = freed;
+    a.per_cpu_cache_misses = misses;
+    a.released_bytes = released;
+    return a;
+  }
+
+  HeapTelemetry telemetry_{Clock{.now = GetClock, .freq = GetClockFrequency}};
+
+ private:
+  static int64_t GetClock() { return now_ns_; }
+  static double GetClockFrequency() { return 1e9; }
+
+  static int64_t now_ns_;
+};
+
+int64_t HeapTelemetryTest::now_ns_ = 0;
+
+TEST_F(HeapTelemetryTest, FirstReportIsBaseline) {
+  telemetry_.Report(Activity(1000, 500, 10, 4096));
+
+  HeapTelemetry::Epoch epochs[HeapTelemetry::kEpochs];
+  EXPECT_EQ(telemetry_.GetEpochs(epochs), 0);
+}
+
+TEST_F(HeapTelemetryTest, RecordsDeltasPerEpoch) {
+  telemetry_.Report(Activity(1000, 500, 10, 4096));
+  Advance(absl::Seconds(1));
+  telemetry_.Report(Activity(3000, 1500, 15, 4096));
+  Advance(absl::Seconds(1));
+  telemetry_.Report(Activity(3500, 3500, 25, 12288));
+
+  HeapTelemetry::Epoch epochs[HeapTelemetry::kEpochs];
+  ASSERT_EQ(telemetry_.GetEpochs(epochs), 2);
+
+  EXPECT_EQ(epochs[0].epochs_ago, 1);
+  EXPECT_EQ(epochs[0].activity.allocated_bytes, 2000);
+  EXPECT_EQ(epochs[0].activity.freed_bytes, 1000);
+  EXPECT_EQ(epochs[0].activity.per_cpu_cache_misses, 5);
+  EXPECT_EQ(epochs[0].activity.released_bytes, 0);
+
+  EXPECT_EQ(epochs[1].epochs_ago, 0);
+  EXPECT_EQ(epochs[1].activity.allocated_bytes, 500);
+  EXPECT_EQ(epochs[1].activity.freed_bytes, 2000);
+  EXPECT_EQ(epochs[1].activity.per_cpu_cache_misses, 10);
+  EXPECT_EQ(epochs[1].activity.released_bytes, 8192);
+}
+
+TEST_F(HeapTelemetryTest, ReportsWithinAnEpochAccumulate) {
+  telemetry_.Report(Activity(0, 0, 0, 0));
+  telemetry_.Report(Activity(100, 0, 0, 0));
+  Advance(absl::Milliseconds(100));
+  telemetry_.Report(Activity(300, 0, 0, 0));
+
+  HeapTelemetry::Epoch epochs[HeapTelemetry::kEpochs];
+  ASSERT_EQ(telemetry_.GetEpochs(epochs), 1);
+  EXPECT_EQ(epochs[0].activity.allocated_bytes, 300);
+}
+
+TEST_F(HeapTelemetryTest, OldEpochsExpire) {
+  telemetry_.Report(Activity(0, 0, 0, 0));
+  telemetry_.Report(Activity(100, 0, 0, 0));
+
+  HeapTelemetry::Epoch epochs[HeapTelemetry::kEpochs];
+  Advance(absl::Seconds(HeapTelemetry::kEpochs - 1));
+  ASSERT_EQ(telemetry_.GetEpochs(epochs), 1);
+  EXPECT_EQ(epochs[0].epochs_ago, HeapTelemetry::kEpochs - 1);
+
+  Advance(absl::Seconds(1));
+  EXPECT_EQ(telemetry_.GetEpochs(epochs), 0);
+}
+
+TEST_F(HeapTelemetryTest, Print) {
+  telemetry_.Report(Activity(0, 0, 0, 0));
+  telemetry_.Report(Activity(1234, 567, 89, 8192));
+
+  std::string buffer(1 << 16, '\0');
+  {
+    Printer printer(&*buffer.begin(), buffer.size());
+    telemetry_.Print(&printer);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("HeapTelemetry:   0s ago:"));
+  EXPECT_THAT(buffer, testing::HasSubstr(" 1234 allocated,"));
+  EXPECT_THAT(buffer, testing::HasSubstr(" 567 freed,"));
+  EXPECT_THAT(buffer, testing::HasSubstr(" 89 cpu cache misses,"));
+  EXPECT_THAT(buffer, testing::HasSubstr(" 8192 released\n"));
+
+  buffer.assign(1 << 16, '\0');
+  {
+    Printer printer(&*buffer.begin(), buffer.size());
+    PbtxtRegion region(&printer, kTop);
+    telemetry_.PrintInPbtxt(&region);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("heap_telemetry {"));
+  EXPECT_THAT(buffer, testing::HasSubstr("allocated_bytes: 1234"));
+  EXPECT_THAT(buffer, testing::HasSubstr("released_bytes: 8192"));
+}
+
+TEST(HeapTelemetryExtensionTest, GetHeapTelemetry) {
+  // The background thread may not be running, so just check that the epochs
+  // we get back are ordered and end no later than now.
+  const std::vector<MallocExtension::HeapTelemetryEpoch> epochs =
+      MallocExtension::GetHeapTelemetry();
+  EXPECT_LE(epochs.size(), HeapTelemetry::kEpochs);
+  for (size_t i = 1; i < epochs.size(); ++i) {
+    EXPECT_LT(epochs[i - 1].end, epochs[i].end);
+  }
+  if (!epochs.empty()) {
+    EXPECT_LE(epochs.back().end, absl::Now());
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -67,6 +67,31 @@ class HintedTrackerLists {
     return lists_[i].first();
   }
 
+  // Like GetLeast, but removes and returns the first TrackerType, in list
+  // order from index n, for which pred holds.  Gives up, returning nullptr,
+  // after looking at <limit> of them.
+  template <typename Predicate>
+  TrackerType* GetLeastMatching(const size_t n, size_t limit,
+                                const Predicate& pred) {
+    ASSERT(n < N);
+    for (size_t i = nonempty_.FindSet(n); i < N;) {
+      ASSERT(!lists_[i].empty());
+      for (TrackerType* pt : lists_[i]) {
+        if (limit == 0) return nullptr;
+        --limit;
+        if (!pred(pt)) continue;
+        if (lists_[i].remove(pt)) {
+          nonempty_.ClearBit(i);
+        }
+        --size_;
+        return pt;
+      }
+      i++;
+      if (i < N) i = nonempty_.FindSet(i);
+    }
+    return nullptr;
+  }
+
   // Adds pointer <pt> to the nonempty_[i] list.
   // REQUIRES: i < N && pt != nullptr.
   void Add(TrackerType* pt, const size_t i) {
@@ -77,6 +102,17 @@ class HintedTrackerLists {
     nonempty_.SetBit(i);
   }
 
+  // Like Add, but adds <pt> to the back of the nonempty_[i] list, so that
+  // PeekLeast and GetLeast return it after the others on that list.
+  // REQUIRES: i < N && pt != nullptr.
+  void AddToBack(TrackerType* pt, const size_t i) {
+    ASSERT(i < N);
+    ASSERT(pt != nullptr);
+    lists_[i].append(pt);
+    ++size_;
+    nonempty_.SetBit(i);
+  }
+
   // Removes pointer <pt> from the nonempty_[i] list.
   // REQUIRES: i < N && pt != nullptr.
   void Remove(TrackerType* pt, const size_t i) {
@@ -18,8 +18,10 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <tuple>
 
 #include "absl/base/internal/cycleclock.h"
+#include "absl/numeric/bits.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
@@ -112,6 +114,140 @@ void HugeAddressMap::Check() {
   CHECK_CONDITION(nodes == nranges());
   CHECK_CONDITION(size == total_mapped());
   CHECK_CONDITION(total_nodes_ == used_nodes_ + freelist_size_);
+
+  // Every node is on the free list of its length class.
+  size_t classified = 0;
+  for (size_t c = 0; c < kNumClasses; ++c) {
+    CHECK_CONDITION(nonempty_classes_.GetBit(c) == (classes_[c] != nullptr));
+    const Node* prev = nullptr;
+    for (const Node* n = classes_[c]; n != nullptr; n = n->class_next_) {
+      CHECK_CONDITION(LengthClass(n->range_.len()) == c);
+      CHECK_CONDITION(n->class_prev_ == prev);
+      prev = n;
+      ++classified;
+    }
+  }
+  CHECK_CONDITION(classified == nranges());
+
+  // Every node is on the list by age.
+  size_t aged = 0;
+  const Node* prev = nullptr;
+  for (const Node* n = oldest_; n != nullptr; n = n->newer_) {
+    CHECK_CONDITION(n->older_ == prev);
+    prev = n;
+    ++aged;
+  }
+  CHECK_CONDITION(prev == newest_);
+  CHECK_CONDITION(aged == nranges());
+}
+
+size_t HugeAddressMap::LengthClass(HugeLength n) {
+  ASSERT(n > NHugePages(0));
+  const size_t len = n.raw_num();
+  const size_t log = absl::bit_width(len) - 1;
+  // The kClassBits bits below the leading one select the class, amongst those
+  // of the power of two.
+  const size_t sub = log >= kClassBits ? len >> (log - kClassBits)
+                                       : len << (kClassBits - log);
+  return (log << kClassBits) + (sub - (size_t{1} << kClassBits));
+}
+
+HugeLength HugeAddressMap::ClassMinLength(size_t c) {
+  const size_t log = c >> kClassBits;
+  const size_t sub = (c & ((size_t{1} << kClassBits) - 1)) |
+                     (size_t{1} << kClassBits);
+  return NHugePages(log >= kClassBits ? sub << (log - kClassBits)
+                                      : sub >> (kClassBits - log));
+}
+
+void HugeAddressMap::AddToClass(Node* n) {
+  const size_t c = LengthClass(n->range_.len());
+  n->class_prev_ = nullptr;
+  n->class_next_ = classes_[c];
+  if (n->class_next_ != nullptr) {
+    n->class_next_->class_prev_ = n;
+  } else {
+    nonempty_classes_.SetBit(c);
+  }
+  classes_[c] = n;
+}
+
+void HugeAddressMap::RemoveFromClass(Node* n) {
+  const size_t c = LengthClass(n->range_.len());
+  if (n->class_prev_ != nullptr) {
+    n->class_prev_->class_next_ = n->class_next_;
+  } else {
+    ASSERT(classes_[c] == n);
+    classes_[c] = n->class_next_;
+    if (classes_[c] == nullptr) {
+      nonempty_classes_.ClearBit(c);
+    }
+  }
+  if (n->class_next_ != nullptr) {
+    n->class_next_->class_prev_ = n->class_prev_;
+  }
+}
+
+HugeAddressMap::Node* HugeAddressMap::FindFit(HugeLength n) {
+  ASSERT(n > NHugePages(0));
+  const size_t c = LengthClass(n);
+  // Every range of n's class holds n if n is the shortest of the class;
+  // otherwise, try its most recently added range before moving on.
+  if (Node* head = classes_[c];
+      head != nullptr && head->range_.len() >= n) {
+    return head;
+  }
+  if (c + 1 < kNumClasses) {
+    const size_t larger = nonempty_classes_.FindSet(c + 1);
+    if (larger < kNumClasses) {
+      return classes_[larger];
+    }
+  }
+  // Only ranges of n's own class are left to try.
+  for (Node* node = classes_[c]; node != nullptr; node = node->class_next_) {
+    if (node->range_.len() >= n) return node;
+  }
+  return nullptr;
+}
+
+HugeAddressMap::Node* HugeAddressMap::FindRecentFit(HugeLength n) {
+  Node* fit = FindFit(n);
+  if (fit == nullptr) return nullptr;
+  // Splitting a longer range than FindFit would have would fragment the map
+  // for the sake of recency, so only ranges as short as fit will do.
+  int scanned = 0;
+  for (Node* node = newest_; node != nullptr && scanned < kRecentFitScan;
+       node = node->older_, ++scanned) {
+    const HugeLength len = node->range_.len();
+    if (len >= n && len <= fit->range_.len()) return node;
+  }
+  return fit;
+}
+
+void HugeAddressMap::AddNewest(Node* n) {
+  n->older_ = newest_;
+  n->newer_ = nullptr;
+  if (newest_ != nullptr) {
+    newest_->newer_ = n;
+  } else {
+    oldest_ = n;
+  }
+  newest_ = n;
+}
+
+void HugeAddressMap::RemoveFromAge(Node* n) {
+  if (n->older_ != nullptr) {
+    n->older_->newer_ = n->newer_;
+  } else {
+    ASSERT(oldest_ == n);
+    oldest_ = n->newer_;
+  }
+  if (n->newer_ != nullptr) {
+    n->newer_->older_ = n->older_;
+  } else {
+    ASSERT(newest_ == n);
+    newest_ = n->older_;
+  }
 }
 
 size_t HugeAddressMap::nranges() const { return used_nodes_; }
@@ -153,7 +289,7 @@ HugeAddressMap::Node* HugeAddressMap::Predecessor(HugePage p) {
   return best;
 }
 
-void HugeAddressMap::Merge(Node* b, HugeRange r, Node* a) {
+void HugeAddressMap::Merge(Node* b, HugeRange r, Node* a, int64_t now) {
   auto merge_when = [](HugeRange x, int64_t x_when, HugeRange y,
                        int64_t y_when) {
     // avoid overflow with floating-point
@@ -164,16 +300,25 @@ void HugeAddressMap::Merge(Node* b, HugeRange r, Node* a) {
     return static_cast<int64_t>((x_weight + y_weight) / (x_len + y_len));
   };
 
-  int64_t when = absl::base_internal::CycleClock::Now();
+  const int64_t when = now;
+  // The merged range now holds the most recently added hugepages.
   // Two way merges are easy.
   if (a == nullptr) {
     b->when_ = merge_when(b->range_, b->when(), r, when);
+    RemoveFromClass(b);
     b->range_ = Join(b->range_, r);
+    AddToClass(b);
+    RemoveFromAge(b);
+    AddNewest(b);
     FixLongest(b);
     return;
   } else if (b == nullptr) {
     a->when_ = merge_when(r, when, a->range_, a->when());
+    RemoveFromClass(a);
     a->range_ = Join(r, a->range_);
+    AddToClass(a);
+    RemoveFromAge(a);
+    AddNewest(a);
     FixLongest(a);
     return;
   }
@@ -188,12 +333,20 @@ void HugeAddressMap::Merge(Node* b, HugeRange r, Node* a) {
   // we actually don't change lengths at all; undo that.
   total_size_ += a->range_.len();
   Remove(a);
+  RemoveFromClass(b);
   b->range_ = full;
+  AddToClass(b);
   b->when_ = full_when;
+  RemoveFromAge(b);
+  AddNewest(b);
   FixLongest(b);
 }
 
 void HugeAddressMap::Insert(HugeRange r) {
+  Insert(r, absl::base_internal::CycleClock::Now());
+}
+
+void HugeAddressMap::Insert(HugeRange r, int64_t now) {
   total_size_ += r.len();
   // First, try to merge if necessary. Note there are three possibilities:
   // we might need to merge before with r, r with after, or all three together.
@@ -203,19 +356,21 @@ void HugeAddressMap::Insert(HugeRange r) {
   CHECK_CONDITION(!after || !after->range_.intersects(r));
   if (before && before->range_.precedes(r)) {
     if (after && r.precedes(after->range_)) {
-      Merge(before, r, after);
+      Merge(before, r, after, now);
     } else {
-      Merge(before, r, nullptr);
+      Merge(before, r, nullptr, now);
     }
     return;
   } else if (after && r.precedes(after->range_)) {
-    Merge(nullptr, r, after);
+    Merge(nullptr, r, after, now);
     return;
   }
   CHECK_CONDITION(!before || !before->range_.precedes(r));
   CHECK_CONDITION(!after || !r.precedes(after->range_));
   // No merging possible; just add a new node.
-  Node* n = Get(r);
+  Node* n = Get(r, now);
+  AddToClass(n);
+  AddNewest(n);
   Node* curr = root();
   Node* parent = nullptr;
   Node** link = &root_;
@@ -283,6 +438,8 @@ void HugeAddressMap::FixLongest(HugeAddressMap::Node* n) {
 
 void HugeAddressMap::Remove(HugeAddressMap::Node* n) {
   total_size_ -= n->range_.len();
+  RemoveFromClass(n);
+  RemoveFromAge(n);
   // We need to merge the left and right children of n into one
   // treap, then glue it into place wherever n was.
   Node** link;
@@ -345,6 +502,23 @@ void HugeAddressMap::Remove(HugeAddressMap::Node* n) {
   Put(n);
 }
 
+HugeRange HugeAddressMap::TakeFirst(Node* n, HugeLength len) {
+  HugeRange taken, leftover;
+  std::tie(taken, leftover) = Split(n->range_, len);
+  if (!leftover.valid()) {
+    Remove(n);
+    return taken;
+  }
+  // Shrinking the range in place keeps it ordered by address, and keeps its
+  // age.
+  total_size_ -= len;
+  RemoveFromClass(n);
+  n->range_ = leftover;
+  AddToClass(n);
+  FixLongest(n);
+  return taken;
+}
+
 void HugeAddressMap::Put(Node* n) {
   freelist_size_++;
   used_nodes_--;
@@ -352,24 +526,24 @@ void HugeAddressMap::Put(Node* n) {
   freelist_ = n;
 }
 
-HugeAddressMap::Node* HugeAddressMap::Get(HugeRange r) {
+HugeAddressMap::Node* HugeAddressMap::Get(HugeRange r, int64_t when) {
   CHECK_CONDITION((freelist_ == nullptr) == (freelist_size_ == 0));
   used_nodes_++;
   int prio = rand_r(&seed_);
   if (freelist_size_ == 0) {
     total_nodes_++;
     Node* ret = reinterpret_cast<Node*>(meta_(sizeof(Node)));
-    return new (ret) Node(r, prio);
+    return new (ret) Node(r, prio, when);
   }
 
   freelist_size_--;
   Node* ret = freelist_;
   freelist_ = ret->left_;
-  return new (ret) Node(r, prio);
+  return new (ret) Node(r, prio, when);
 }
 
-HugeAddressMap::Node::Node(HugeRange r, int prio)
-    : range_(r), prio_(prio), when_(absl::base_internal::CycleClock::Now()) {}
+HugeAddressMap::Node::Node(HugeRange r, int prio, int64_t when)
+    : range_(r), prio_(prio), when_(when) {}
 
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
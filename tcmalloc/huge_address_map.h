@@ -21,6 +21,7 @@
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/range_tracker.h"
 #include "tcmalloc/metadata_allocator.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -32,6 +33,11 @@ namespace tcmalloc_internal {
 // augmented with the largest range in each subtree (this allows fairly simple
 // allocation algorithms from the contained ranges.
 //
+// Ranges are also indexed by length in segregated free lists, TLSF style: a
+// bitmap of the non-empty length classes finds a fitting range in constant
+// time (see FindFit), and kept in a list ordered by when they were last added
+// to, so that callers can prefer either the warmest or the coldest ranges.
+//
 // This class scales well and is *reasonably* performant, but it is not intended
 // for use on extremely hot paths.
 class HugeAddressMap {
@@ -53,6 +59,9 @@ class HugeAddressMap {
     // Iterate to the next node in address order
     const Node* next() const;
     Node* next();
+    // Iterate to the next node in order of last addition, oldest to newest.
+    const Node* newer() const;
+    Node* newer();
     // when were this node's content added (in
     // absl::base_internal::CycleClock::Now units)?
     int64_t when() const;
@@ -61,7 +70,7 @@ class HugeAddressMap {
     HugeLength longest() const;
 
    private:
-    Node(HugeRange r, int prio);
+    Node(HugeRange r, int prio, int64_t when);
     friend class HugeAddressMap;
     HugeRange range_;
     int prio_;  // chosen randomly
@@ -69,6 +78,10 @@ class HugeAddressMap {
     Node* parent_;
     HugeLength longest_;
     int64_t when_;
+    // The free list of the length class of range_.
+    Node *class_prev_, *class_next_;
+    // The list of all nodes, by when they were last added to.
+    Node *older_, *newer_;
     // Expensive, recursive consistency check.
     // Accumulates node count and range sizes into passed arguments.
     void Check(size_t* num_nodes, HugeLength* size) const;
@@ -89,6 +102,22 @@ class HugeAddressMap {
   // after p (if any).
   Node* Predecessor(HugePage p);
 
+  // Returns a node whose range holds at least n hugepages, or nullptr if there
+  // is none.  This is a good fit rather than the best fit: the range is of the
+  // smallest length class that is sure to hold n, unless only a range of n's
+  // own class does.
+  Node* FindFit(HugeLength n);
+
+  // Like FindFit, but prefers the most recently added to of the last few
+  // ranges added to, if one of them holds n hugepages and is no longer than
+  // the range FindFit returns.
+  Node* FindRecentFit(HugeLength n);
+
+  // Get the least and most recently added-to nodes.
+  Node* oldest();
+  const Node* oldest() const;
+  Node* newest();
+
   // Expensive consistency check.
   void Check();
 
@@ -98,12 +127,19 @@ class HugeAddressMap {
   void Print(Printer* out) const;
   void PrintInPbtxt(PbtxtRegion* hpaa) const;
 
-  // Add <r> to the map, merging with adjacent ranges as needed.
+  // Add <r> to the map, merging with adjacent ranges as needed.  <now> is in
+  // the units of when().
   void Insert(HugeRange r);
+  void Insert(HugeRange r, int64_t now);
 
   // Delete n from the map.
   void Remove(Node* n);
 
+  // Removes the first <len> hugepages of n's range from the map and returns
+  // them.  What is left of the range keeps its place in the order of
+  // addition.
+  HugeRange TakeFirst(Node* n, HugeLength len);
+
  private:
   // our tree
   Node* root_{nullptr};
@@ -115,13 +151,36 @@ class HugeAddressMap {
   size_t freelist_size_{0};
   // How we get more
   MetadataAllocator& meta_;
-  Node* Get(HugeRange r);
+  Node* Get(HugeRange r, int64_t when);
   void Put(Node* n);
 
   size_t total_nodes_{0};
 
-  void Merge(Node* b, HugeRange r, Node* a);
+  void Merge(Node* b, HugeRange r, Node* a, int64_t now);
   void FixLongest(Node* n);
+
+  // The length classes: 2^kClassBits per power of two, so that the lengths
+  // of a class are within 1 / 2^kClassBits of each other (and lengths below
+  // 2^(kClassBits + 1) have classes of their own).
+  static constexpr size_t kClassBits = 2;
+  static constexpr size_t kNumClasses = 64 << kClassBits;
+  static size_t LengthClass(HugeLength n);
+  // The shortest length of class c.
+  static HugeLength ClassMinLength(size_t c);
+  void AddToClass(Node* n);
+  void RemoveFromClass(Node* n);
+
+  Node* classes_[kNumClasses] = {};
+  Bitmap<kNumClasses> nonempty_classes_;
+
+  // How many of the most recently added-to ranges FindRecentFit considers.
+  static constexpr int kRecentFitScan = 8;
+  void AddNewest(Node* n);
+  void RemoveFromAge(Node* n);
+
+  Node* oldest_{nullptr};
+  Node* newest_{nullptr};
+
   // Note that we always use the same seed, currently; this isn't very random.
   // In practice we're not worried about adversarial input and this works well
   // enough.
@@ -136,8 +195,18 @@ inline HugeAddressMap::Node* HugeAddressMap::Node::left() { return left_; }
 inline HugeAddressMap::Node* HugeAddressMap::Node::right() { return right_; }
 
 inline int64_t HugeAddressMap::Node::when() const { return when_; }
+inline const HugeAddressMap::Node* HugeAddressMap::Node::newer() const {
+  return newer_;
+}
+inline HugeAddressMap::Node* HugeAddressMap::Node::newer() { return newer_; }
 inline HugeLength HugeAddressMap::Node::longest() const { return longest_; }
 
+inline HugeAddressMap::Node* HugeAddressMap::oldest() { return oldest_; }
+inline const HugeAddressMap::Node* HugeAddressMap::oldest() const {
+  return oldest_;
+}
+inline HugeAddressMap::Node* HugeAddressMap::newest() { return newest_; }
+
 inline HugeAddressMap::Node* HugeAddressMap::root() { return root_; }
 inline const HugeAddressMap::Node* HugeAddressMap::root() const {
   return root_;
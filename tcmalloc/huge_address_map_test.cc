@@ -21,6 +21,9 @@
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/mock_metadata_allocator.h"
 
 namespace tcmalloc {
@@ -68,6 +71,117 @@ TEST_F(HugeAddressMapTest, Merging) {
   EXPECT_THAT(Contents(), testing::ElementsAre(all));
 }
 
+TEST_F(HugeAddressMapTest, FindFit) {
+  // Non-adjacent ranges of assorted lengths.
+  size_t next = 0;
+  for (size_t len : {1, 3, 5, 9, 100}) {
+    map_.Insert(HugeRange::Make(hp(next), hl(len)));
+    next += len + 1;
+  }
+  map_.Check();
+
+  auto FitLength = [&](size_t n) -> size_t {
+    HugeAddressMap::Node* node = map_.FindFit(hl(n));
+    if (node == nullptr) return 0;
+    EXPECT_GE(node->range().len(), hl(n));
+    return node->range().len().raw_num();
+  };
+  EXPECT_EQ(FitLength(1), 1);
+  EXPECT_EQ(FitLength(2), 3);
+  EXPECT_EQ(FitLength(4), 5);
+  // 9 is of the next length class above 6.
+  EXPECT_EQ(FitLength(6), 9);
+  EXPECT_EQ(FitLength(100), 100);
+  // 100 shares a length class with 101 but is too short.
+  EXPECT_EQ(FitLength(101), 0);
+
+  // Removing and merging ranges moves them between classes.
+  map_.Remove(map_.FindFit(hl(1)));
+  map_.Check();
+  EXPECT_EQ(FitLength(1), 3);
+  map_.Insert(HugeRange::Make(hp(5), hl(1)));
+  map_.Check();
+  EXPECT_EQ(FitLength(6), 9);
+  EXPECT_EQ(FitLength(4), 9);
+}
+
+TEST_F(HugeAddressMapTest, AgeOrder) {
+  const HugeRange a = HugeRange::Make(hp(0), hl(4));
+  const HugeRange b = HugeRange::Make(hp(10), hl(2));
+  const HugeRange c = HugeRange::Make(hp(20), hl(4));
+  map_.Insert(a, 1);
+  map_.Insert(b, 2);
+  map_.Insert(c, 3);
+  map_.Check();
+  EXPECT_EQ(map_.oldest()->range(), a);
+  EXPECT_EQ(map_.newest()->range(), c);
+
+  // The newest range that fits wins, unless it is longer than a good fit.
+  EXPECT_EQ(map_.FindRecentFit(hl(1))->range(), b);
+  EXPECT_EQ(map_.FindRecentFit(hl(3))->range(), c);
+
+  // Merging into a range makes it the newest.
+  map_.Insert(HugeRange::Make(hp(4), hl(1)), 4);
+  map_.Check();
+  EXPECT_EQ(map_.oldest()->range(), b);
+  EXPECT_EQ(map_.newest()->range(), HugeRange::Make(hp(0), hl(5)));
+  EXPECT_EQ(map_.newest()->when(), (4 * 1 + 1 * 4) / 5);
+
+  // Taking part of a range leaves the rest in place, as old as it was.
+  EXPECT_EQ(map_.TakeFirst(map_.oldest(), hl(1)),
+            HugeRange::Make(hp(10), hl(1)));
+  map_.Check();
+  EXPECT_EQ(map_.oldest()->range(), HugeRange::Make(hp(11), hl(1)));
+  EXPECT_EQ(map_.oldest()->when(), 2);
+  EXPECT_EQ(map_.total_mapped(), hl(10));
+  EXPECT_EQ(map_.TakeFirst(map_.oldest(), hl(1)),
+            HugeRange::Make(hp(11), hl(1)));
+  map_.Check();
+  EXPECT_EQ(map_.oldest()->range(), c);
+  EXPECT_EQ(map_.oldest()->newer()->range(), HugeRange::Make(hp(0), hl(5)));
+  EXPECT_EQ(map_.oldest()->newer()->newer(), nullptr);
+}
+
+TEST_F(HugeAddressMapTest, RandomInsertRemove) {
+  absl::BitGen rng;
+  std::vector<HugeRange> allocated;
+  // Carve the address space into ranges, all initially allocated.
+  size_t next = 0;
+  for (int i = 0; i < 1000; ++i) {
+    const size_t len = absl::Uniform<size_t>(absl::IntervalClosed, rng, 1, 40);
+    allocated.push_back(HugeRange::Make(hp(next), hl(len)));
+    next += len;
+  }
+  for (int i = 0; i < 10000; ++i) {
+    if (!allocated.empty() && absl::Bernoulli(rng, 0.5)) {
+      const size_t j = absl::Uniform<size_t>(rng, 0, allocated.size());
+      map_.Insert(allocated[j]);
+      allocated[j] = allocated.back();
+      allocated.pop_back();
+    } else {
+      const HugeLength n =
+          hl(absl::Uniform<size_t>(absl::IntervalClosed, rng, 1, 80));
+      HugeAddressMap::Node* node = absl::Bernoulli(rng, 0.5)
+                                       ? map_.FindFit(n)
+                                       : map_.FindRecentFit(n);
+      if (node == nullptr) continue;
+      const HugeRange r = node->range();
+      ASSERT_GE(r.len(), n);
+      if (absl::Bernoulli(rng, 0.5)) {
+        ASSERT_EQ(map_.TakeFirst(node, n), HugeRange::Make(r.start(), n));
+      } else {
+        map_.Remove(node);
+        if (r.len() > n) {
+          map_.Insert(HugeRange::Make(r.start() + n, r.len() - n));
+        }
+      }
+      allocated.push_back(HugeRange::Make(r.start(), n));
+    }
+    if (i % 100 == 0) map_.Check();
+  }
+  map_.Check();
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -16,6 +16,10 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <optional>
+
+#include "absl/functional/function_ref.h"
 #include "tcmalloc/huge_address_map.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/config.h"
@@ -27,7 +31,8 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 
 void HugeAllocator::Print(Printer* out) {
-  out->printf("HugeAllocator: contiguous, unbacked hugepage(s)\n");
+  out->printf("HugeAllocator: contiguous, unbacked hugepage(s)%s\n",
+              gigapage_backed() ? " (gigapage backed)" : "");
   free_.Print(out);
   out->printf(
       "HugeAllocator: %zu requested - %zu in use = %zu hugepages free\n",
@@ -39,53 +44,7 @@ void HugeAllocator::PrintInPbtxt(PbtxtRegion* hpaa) const {
   free_.PrintInPbtxt(hpaa);
   hpaa->PrintI64("num_total_requested_huge_pages", from_system_.raw_num());
   hpaa->PrintI64("num_in_use_huge_pages", in_use_.raw_num());
-}
-
-HugeAddressMap::Node* HugeAllocator::Find(HugeLength n) {
-  HugeAddressMap::Node* curr = free_.root();
-  // invariant: curr != nullptr && curr->longest >= n
-  // we favor smaller gaps and lower nodes and lower addresses, in that
-  // order. The net effect is that we are neither a best-fit nor a
-  // lowest-address allocator but vaguely close to both.
-  HugeAddressMap::Node* best = nullptr;
-  while (curr && curr->longest() >= n) {
-    if (curr->range().len() >= n) {
-      if (!best || best->range().len() > curr->range().len()) {
-        best = curr;
-      }
-    }
-
-    // Either subtree could contain a better fit and we don't want to
-    // search the whole tree. Pick a reasonable child to look at.
-    auto left = curr->left();
-    auto right = curr->right();
-    if (!left || left->longest() < n) {
-      curr = right;
-      continue;
-    }
-
-    if (!right || right->longest() < n) {
-      curr = left;
-      continue;
-    }
-
-    // Here, we have a nontrivial choice.
-    if (left->range().len() == right->range().len()) {
-      if (left->longest() <= right->longest()) {
-        curr = left;
-      } else {
-        curr = right;
-      }
-    } else if (left->range().len() < right->range().len()) {
-      // Here, the longest range in both children is the same...look
-      // in the subtree with the smaller root, as that's slightly
-      // more likely to be our best.
-      curr = left;
-    } else {
-      curr = right;
-    }
-  }
-  return best;
+  hpaa->PrintBool("gigapage_backed", gigapage_backed());
 }
 
 void HugeAllocator::CheckFreelist() {
@@ -104,6 +63,14 @@ HugeRange HugeAllocator::AllocateRange(HugeLength n) {
   if (n.overflows()) return HugeRange::Nil();
   size_t bytes = n.in_bytes();
   size_t align = kHugePageSize;
+  if (gigapage_backed()) {
+    // Round up to whole gigapages; the remainder is handed out by subsequent
+    // Gets.
+    const size_t rounded = (bytes + kGigaPageSize - 1) & ~(kGigaPageSize - 1);
+    if (rounded < bytes) return HugeRange::Nil();
+    bytes = rounded;
+    align = kGigaPageSize;
+  }
   auto [ptr, actual] = allocate_(bytes, align);
   if (ptr == nullptr) {
     // OOM...
@@ -119,14 +86,14 @@ HugeRange HugeAllocator::AllocateRange(HugeLength n) {
 
 HugeRange HugeAllocator::Get(HugeLength n) {
   CHECK_CONDITION(n > NHugePages(0));
-  auto* node = Find(n);
+  auto* node = free_.FindFit(n);
   if (!node) {
     // Get more memory, then "delete" it
     HugeRange r = AllocateRange(n);
     if (!r.valid()) return r;
     in_use_ += r.len();
     Release(r);
-    node = Find(n);
+    node = free_.FindFit(n);
     CHECK_CONDITION(node != nullptr);
   }
   in_use_ += n;
@@ -156,6 +123,38 @@ void HugeAllocator::Release(HugeRange r) {
   DebugCheckFreelist();
 }
 
+size_t HugeAllocator::ReleaseResidentFree(
+    HugeLength n,
+    absl::FunctionRef<std::optional<size_t>(HugeRange)> resident_bytes,
+    absl::FunctionRef<bool(HugeRange)> release) {
+  size_t released = 0;
+  HugePage cursor = residency_cursor_;
+  HugeAddressMap::Node* node = free_.Predecessor(cursor);
+  if (node == nullptr) {
+    node = free_.first();
+  } else if (!node->range().contains(cursor)) {
+    node = node->next();
+  }
+  for (; node != nullptr && n > NHugePages(0); node = node->next()) {
+    const HugeRange r = node->range();
+    const HugePage start = std::max(r.start(), cursor);
+    const HugeLength len = std::min(n, r.len() - (start - r.start()));
+    const HugeRange chunk = HugeRange::Make(start, len);
+    n -= len;
+    cursor = start + len;
+    std::optional<size_t> bytes = resident_bytes(chunk);
+    if (bytes.has_value() && *bytes > 0 && release(chunk)) {
+      released += *bytes;
+    }
+  }
+  if (n > NHugePages(0)) {
+    // We have reached the highest free range; start over.
+    cursor = HugePage{0};
+  }
+  residency_cursor_ = cursor;
+  return released;
+}
+
 void HugeAllocator::AddSpanStats(SmallSpanStats* small,
                                  LargeSpanStats* large) const {
   for (const HugeAddressMap::Node* node = free_.first(); node != nullptr;
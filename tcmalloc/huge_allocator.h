@@ -19,7 +19,10 @@
 
 #include <stddef.h>
 
+#include <optional>
+
 #include "absl/base/attributes.h"
+#include "absl/functional/function_ref.h"
 #include "tcmalloc/huge_address_map.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/config.h"
@@ -48,6 +51,16 @@ class VirtualAllocator {
                                                        size_t align) = 0;
 };
 
+enum class HugeBackingOption : bool {
+  // Memory is requested from the system in units of hugepages and may be
+  // released to it one hugepage at a time.
+  kHugePages,
+  // Memory is requested from the system in whole, aligned 1GiB gigapages so
+  // that it can be backed by gigapages (reducing dTLB pressure for very large
+  // heaps).  HugeCache only releases memory once an entire gigapage is free.
+  kGigaPages,
+};
+
 // This tracks available ranges of hugepages and fulfills requests for
 // usable memory, allocating more from the system as needed.  All
 // hugepages are treated as (and assumed to be) unbacked.
@@ -55,8 +68,9 @@ class HugeAllocator {
  public:
   constexpr HugeAllocator(
       VirtualAllocator& allocate ABSL_ATTRIBUTE_LIFETIME_BOUND,
-      MetadataAllocator& meta_allocate ABSL_ATTRIBUTE_LIFETIME_BOUND)
-      : free_(meta_allocate), allocate_(allocate) {}
+      MetadataAllocator& meta_allocate ABSL_ATTRIBUTE_LIFETIME_BOUND,
+      HugeBackingOption backing = HugeBackingOption::kHugePages)
+      : free_(meta_allocate), allocate_(allocate), backing_(backing) {}
 
   // Obtain a range of n unbacked hugepages, distinct from all other
   // calls to Get (other than those that have been Released.)
@@ -68,11 +82,27 @@ class HugeAllocator {
   // since that Get().
   void Release(HugeRange r);
 
+  // Releases the free hugepages that are resident again, as reported by
+  // <resident_bytes> (std::nullopt if unknown), to the OS once more with
+  // <release>, which returns whether it succeeded.  Queries up to <n>
+  // hugepages, picking up where the previous call left off.  Free hugepages
+  // are assumed to be unbacked, but stray touches may fault them back in.
+  // Returns the number of resident bytes released again.
+  size_t ReleaseResidentFree(
+      HugeLength n,
+      absl::FunctionRef<std::optional<size_t>(HugeRange)> resident_bytes,
+      absl::FunctionRef<bool(HugeRange)> release);
+
   // Total memory requested from the system, whether in use or not,
   HugeLength system() const { return from_system_; }
   // Unused memory in the allocator.
   HugeLength size() const { return from_system_ - in_use_; }
 
+  // True if memory is obtained from the system in whole gigapages.
+  bool gigapage_backed() const {
+    return backing_ == HugeBackingOption::kGigaPages;
+  }
+
   void AddSpanStats(SmallSpanStats* small, LargeSpanStats* large) const;
 
   BackingStats stats() const {
@@ -94,13 +124,13 @@ class HugeAllocator {
   // * no pre-allocation.
   // * reasonable space overhead
   //
-  // We use a treap ordered on addresses to track.  This isn't the most
-  // efficient thing ever but we're about to hit 100usec+/hugepage
+  // We use a treap ordered on addresses to track, and coalesce, free ranges,
+  // along with free lists segregated by length to find them.  This isn't the
+  // most efficient thing ever but we're about to hit 100usec+/hugepage
   // backing costs if we've gotten this far; the last few bits of performance
   // don't matter, and most of the simple ideas can't hit all of the above
   // requirements.
   HugeAddressMap free_;
-  HugeAddressMap::Node* Find(HugeLength n);
 
   void CheckFreelist();
   void DebugCheckFreelist() {
@@ -111,8 +141,11 @@ class HugeAllocator {
 
   HugeLength from_system_{NHugePages(0)};
   HugeLength in_use_{NHugePages(0)};
+  // The next hugepage for ReleaseResidentFree to query.
+  HugePage residency_cursor_{0};
 
   VirtualAllocator& allocate_;
+  const HugeBackingOption backing_;
   HugeRange AllocateRange(HugeLength n);
 };
 
@@ -0,0 +1,77 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/huge_allocator.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/mock_metadata_allocator.h"
+#include "tcmalloc/mock_virtual_allocator.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Churns state.range(0) live ranges of up to 64 hugepages, as large
+// allocations do: each iteration releases a random range and gets another.
+// The free ranges left behind are fragmented, so Get has many to choose from.
+void BM_GetRelease(benchmark::State& state) {
+  const size_t num_live = state.range(0);
+  FakeVirtualAllocator vm_allocator;
+  FakeMetadataAllocator metadata_allocator;
+  // Skip the first hugepage, so that no range starts at address zero.
+  vm_allocator.backing_.resize(1);
+  HugeAllocator allocator(vm_allocator, metadata_allocator);
+
+  absl::BitGen rng;
+  auto RandomLength = [&]() {
+    return NHugePages(absl::Uniform<size_t>(absl::IntervalClosed, rng, 1, 64));
+  };
+  std::vector<HugeRange> live;
+  live.reserve(2 * num_live);
+  for (size_t i = 0; i < 2 * num_live; ++i) {
+    live.push_back(allocator.Get(RandomLength()));
+    CHECK_CONDITION(live.back().valid());
+  }
+  // Free half of them.
+  while (live.size() > num_live) {
+    const size_t i = absl::Uniform<size_t>(rng, 0, live.size());
+    allocator.Release(live[i]);
+    live[i] = live.back();
+    live.pop_back();
+  }
+
+  for (auto s : state) {
+    const size_t i = absl::Uniform<size_t>(rng, 0, live.size());
+    allocator.Release(live[i]);
+    live[i] = allocator.Get(RandomLength());
+    CHECK_CONDITION(live[i].valid());
+  }
+  state.counters["free_ranges"] = allocator.size().raw_num();
+}
+
+BENCHMARK(BM_GetRelease)->Range(64, 4096);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 
 #include <algorithm>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
@@ -282,6 +283,49 @@ TEST_P(HugeAllocatorTest, Frugal) {
   }
 }
 
+TEST_P(HugeAllocatorTest, ReleaseResidentFree) {
+  HugeRange r1 = allocator_.Get(NHugePages(4));
+  HugeRange r2 = allocator_.Get(NHugePages(4));
+  HugeRange r3 = allocator_.Get(NHugePages(4));
+  allocator_.Release(r1);
+  allocator_.Release(r3);
+
+  HugeLength queried = NHugePages(0);
+  std::vector<HugeRange> released;
+  auto Scan = [&](HugeLength n) {
+    return allocator_.ReleaseResidentFree(
+        n,
+        [&](HugeRange r) -> std::optional<size_t> {
+          // Ranges in use are not queried.
+          EXPECT_FALSE(r.intersects(r2));
+          queried += r.len();
+          // A stray touch faulted in a page of r1.
+          return r.contains(r1.start()) ? kPageSize : 0;
+        },
+        [&](HugeRange r) {
+          released.push_back(r);
+          return true;
+        });
+  };
+
+  // Up to n hugepages are queried, starting with the lowest free ones.
+  EXPECT_EQ(Scan(NHugePages(1)), r1.start() < r3.start() ? kPageSize : 0);
+  EXPECT_EQ(queried, NHugePages(1));
+  // A full pass queries every free hugepage.
+  queried = NHugePages(0);
+  EXPECT_EQ(Scan(NHugePages(1000)), r1.start() < r3.start() ? 0 : kPageSize);
+  EXPECT_EQ(queried, allocator_.size() - NHugePages(1));
+  ASSERT_EQ(released.size(), 1);
+  EXPECT_TRUE(released[0].contains(r1.start()));
+
+  // The next pass starts over.
+  queried = NHugePages(0);
+  EXPECT_EQ(Scan(NHugePages(1000)), kPageSize);
+  EXPECT_EQ(queried, allocator_.size());
+
+  allocator_.Release(r2);
+}
+
 TEST_P(HugeAllocatorTest, Stats) {
   struct Helper {
     static void Stats(const HugeAllocator* huge, size_t* num_spans,
@@ -352,6 +396,30 @@ TEST_P(HugeAllocatorTest, OOM) {
   }
 }
 
+TEST_P(HugeAllocatorTest, GigaPageBacking) {
+  HugeAllocator gigapage_allocator{vm_allocator_, metadata_allocator_,
+                                   HugeBackingOption::kGigaPages};
+  ASSERT_TRUE(gigapage_allocator.gigapage_backed());
+
+  // A single hugepage request reserves an entire, aligned gigapage.
+  HugeRange r1 = gigapage_allocator.Get(NHugePages(1));
+  ASSERT_TRUE(r1.valid());
+  EXPECT_EQ(HugePagesRequested(), kHugePagesPerGigaPage);
+  EXPECT_EQ(GigaPageInterior(HugeRange::Make(r1.start(),
+                                             kHugePagesPerGigaPage))
+                .start(),
+            r1.start());
+
+  // The remainder of the gigapage satisfies subsequent requests.
+  HugeRange r2 = gigapage_allocator.Get(kHugePagesPerGigaPage - NHugePages(1));
+  ASSERT_TRUE(r2.valid());
+  EXPECT_EQ(HugePagesRequested(), kHugePagesPerGigaPage);
+
+  gigapage_allocator.Release(r1);
+  gigapage_allocator.Release(r2);
+  EXPECT_EQ(gigapage_allocator.size(), gigapage_allocator.system());
+}
+
 INSTANTIATE_TEST_SUITE_P(
     NormalOverAlloc, HugeAllocatorTest, testing::Values(false, true),
     +[](const testing::TestParamInfo<bool>& info) {
@@ -18,7 +18,6 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
-#include <tuple>
 
 #include "absl/base/optimization.h"
 #include "absl/time/time.h"
@@ -105,8 +104,20 @@ template class MinMaxTracker<600>;
 // The logic for actually allocating from the cache or backing, and keeping
 // the hit rates specified.
 HugeRange HugeCache::DoGet(HugeLength n, bool* from_released) {
-  auto* node = Find(n);
+  // Reuse the most recently released ranges: they are the likeliest to still
+  // be warm in the TLB and caches.
+  auto* node = cache_.FindRecentFit(n);
   if (!node) {
+    // Ranges awaiting a deferred unback are still backed; taking one back
+    // saves both the madvise and the subsequent page faults.
+    node = pending_.FindRecentFit(n);
+    if (node) {
+      reclaimed_pending_ += n;
+      *from_released = false;
+      pending_size_ -= n;
+      return pending_.TakeFirst(node, n);
+    }
+
     misses_++;
     weighted_misses_ += n.raw_num();
     HugeRange res = allocator_->Get(n);
@@ -121,17 +132,13 @@ HugeRange HugeCache::DoGet(HugeLength n, bool* from_released) {
   *from_released = false;
   size_ -= n;
   UpdateSize(size());
-  HugeRange result, leftover;
-  // Put back whatever we have left (or nothing, if it's exact.)
-  std::tie(result, leftover) = Split(node->range(), n);
-  cache_.Remove(node);
-  if (leftover.valid()) {
-    cache_.Insert(leftover);
-  }
-  return result;
+  // Whatever we have left (if anything) stays cached, as old as it was.
+  return cache_.TakeFirst(node, n);
 }
 
 void HugeCache::MaybeGrowCacheLimit(HugeLength missed) {
+  if (disabled_) return;
+
   // Our goal is to make the cache size = the largest "brief dip."
   //
   // A "dip" being a case where usage shrinks, then increases back up
@@ -218,10 +225,10 @@ HugeRange HugeCache::Get(HugeLength n, bool* from_released) {
   return r;
 }
 
-void HugeCache::Release(HugeRange r) {
+void HugeCache::Release(HugeRange r, bool defer_unback) {
   DecUsage(r.len());
 
-  cache_.Insert(r);
+  cache_.Insert(r, clock_.now());
   size_ += r.len();
   if (size_ <= limit()) {
     fills_++;
@@ -233,9 +240,9 @@ void HugeCache::Release(HugeRange r) {
   // the max size.  (This could reduce the number of regions we break
   // in half to avoid overshrinking.)
   if ((clock_.now() - last_limit_change_) > (cache_time_ticks_ * 2)) {
-    total_fast_unbacked_ += MaybeShrinkCacheLimit();
+    total_fast_unbacked_ += MaybeShrinkCacheLimit(defer_unback);
   }
-  total_fast_unbacked_ += ShrinkCache(limit());
+  total_fast_unbacked_ += ShrinkCache(RetainedSize(), defer_unback);
 
   UpdateSize(size());
 }
@@ -246,7 +253,7 @@ void HugeCache::ReleaseUnbacked(HugeRange r) {
   allocator_->Release(r);
 }
 
-HugeLength HugeCache::MaybeShrinkCacheLimit() {
+HugeLength HugeCache::MaybeShrinkCacheLimit(bool defer_unback) {
   last_limit_change_ = clock_.now();
 
   const HugeLength min = size_tracker_.MinOverTime(kCacheTime * 2);
@@ -259,51 +266,131 @@ HugeLength HugeCache::MaybeShrinkCacheLimit() {
   HugeLength drop = std::max(min / 2, NHugePages(1));
   limit_ = std::max(limit() <= drop ? NHugePages(0) : limit() - drop,
                     MinCacheLimit());
-  return ShrinkCache(limit());
+  return ShrinkCache(RetainedSize(), defer_unback);
+}
+
+bool HugeCache::UnbackOrDefer(HugeRange r, bool defer_unback) {
+  if (defer_unback) {
+    pending_.Insert(r, clock_.now());
+    pending_size_ += r.len();
+    total_deferred_ += r.len();
+    return true;
+  }
+  // Note, actual unback implementation is temporarily dropping and
+  // re-acquiring the page heap lock here.
+  if (ABSL_PREDICT_FALSE(!unback_(r.start_addr(), r.byte_len()))) {
+    return false;
+  }
+  allocator_->Release(r);
+  return true;
 }
 
-HugeLength HugeCache::ShrinkCache(HugeLength target) {
+HugeLength HugeCache::ShrinkCache(HugeLength target, bool defer_unback) {
+  if (allocator_->gigapage_backed()) {
+    return ShrinkCacheGigaPages(target, defer_unback);
+  }
+
   HugeLength removed = NHugePages(0);
   while (size_ > target) {
-    // Remove smallest-ish nodes, to avoid fragmentation where possible.
-    auto* node = Find(NHugePages(1));
+    // Remove the nodes that have been idle the longest: they are the least
+    // likely to be reused soon, and the likeliest to have gone cold anyway.
+    auto* node = cache_.oldest();
     CHECK_CONDITION(node);
-    HugeRange r = node->range();
-    cache_.Remove(node);
-    // Suppose we're 10 MiB over target but the smallest available node
-    // is 100 MiB.  Don't go overboard--split up the range.
+    // Suppose we're 10 MiB over target but the oldest node is 100 MiB.  Don't
+    // go overboard--split up the range.
     // In particular - this prevents disastrous results if we've decided
     // the cache should be 99 MiB but the actual hot usage is 100 MiB
     // (and it is unfragmented).
     const HugeLength delta = size() - target;
-    if (r.len() > delta) {
-      HugeRange to_remove, leftover;
-      std::tie(to_remove, leftover) = Split(r, delta);
-      ASSERT(leftover.valid());
-      cache_.Insert(leftover);
-      r = to_remove;
-    }
+    HugeRange r = cache_.TakeFirst(node, std::min(node->range().len(), delta));
 
     size_ -= r.len();
-    // Note, actual unback implementation is temporarily dropping and
-    // re-acquiring the page heap lock here.
-    if (ABSL_PREDICT_FALSE(!unback_(r.start_addr(), r.byte_len()))) {
+    if (ABSL_PREDICT_FALSE(!UnbackOrDefer(r, defer_unback))) {
       // We failed to release r.  Retain it in the cache instead of returning it
       // to the HugeAllocator.
       size_ += r.len();
-      cache_.Insert(r);
+      cache_.Insert(r, clock_.now());
+      break;
+    }
+    removed += r.len();
+  }
+
+  return removed;
+}
+
+HugeLength HugeCache::ShrinkCacheGigaPages(HugeLength target,
+                                           bool defer_unback) {
+  HugeLength removed = NHugePages(0);
+  while (size_ > target) {
+    // Releasing part of a gigapage would shatter its mapping, so only ranges
+    // covering an entire gigapage are candidates.  The cache holds few enough
+    // ranges that a linear scan is cheap relative to the release itself.
+    HugeAddressMap::Node* node = cache_.first();
+    HugeRange r = HugeRange::Nil();
+    for (; node != nullptr; node = node->next()) {
+      r = GigaPageInterior(node->range());
+      if (r.valid()) break;
+    }
+    if (node == nullptr) break;
+
+    // Release a single gigapage at a time, even if that overshoots target.
+    r = HugeRange::Make(r.start(), kHugePagesPerGigaPage);
+    const HugeRange whole = node->range();
+    // The rest of the range stays cached, as old as it was.
+    const int64_t when = node->when();
+    cache_.Remove(node);
+    if (whole.start() < r.start()) {
+      cache_.Insert(HugeRange::Make(whole.start(), r.start() - whole.start()),
+                    when);
+    }
+    const HugePage whole_end = whole.start() + whole.len();
+    const HugePage r_end = r.start() + r.len();
+    if (r_end < whole_end) {
+      cache_.Insert(HugeRange::Make(r_end, whole_end - r_end), when);
+    }
+
+    size_ -= r.len();
+    if (ABSL_PREDICT_FALSE(!UnbackOrDefer(r, defer_unback))) {
+      size_ += r.len();
+      cache_.Insert(r, clock_.now());
       break;
     }
-    allocator_->Release(r);
     removed += r.len();
   }
 
   return removed;
 }
 
+HugeLength HugeCache::ReleasePending() {
+  HugeLength released = NHugePages(0);
+  while (HugeAddressMap::Node* node = pending_.first()) {
+    const HugeRange r = node->range();
+    pending_.Remove(node);
+    pending_size_ -= r.len();
+    // unback_ may drop the page heap lock; r is owned by neither the pending
+    // queue nor the allocator in the meantime, so concurrent Gets cannot
+    // reclaim it mid-release.
+    if (ABSL_PREDICT_FALSE(!unback_(r.start_addr(), r.byte_len()))) {
+      // Keep the still-backed range usable by returning it to the cache.
+      cache_.Insert(r, clock_.now());
+      size_ += r.len();
+      break;
+    }
+    allocator_->Release(r);
+    released += r.len();
+  }
+
+  total_pending_unbacked_ += released;
+  UpdateSize(size());
+  return released;
+}
+
 HugeLength HugeCache::ReleaseCachedPages(HugeLength n) {
+  // Explicit releases are synchronous: callers expect the memory to be
+  // returned by the time we return, so drain any deferred work first.
+  HugeLength released = ReleasePending();
   // This is a good time to check: is our cache going persistently unused?
-  HugeLength released = MaybeShrinkCacheLimit();
+  released += MaybeShrinkCacheLimit();
 
   if (released < n) {
     n -= released;
@@ -316,64 +403,57 @@ HugeLength HugeCache::ReleaseCachedPages(HugeLength n) {
   return released;
 }
 
-void HugeCache::AddSpanStats(SmallSpanStats* small,
-                             LargeSpanStats* large) const {
-  static_assert(kPagesPerHugePage >= kMaxPages);
-  for (const HugeAddressMap::Node* node = cache_.first(); node != nullptr;
-       node = node->next()) {
-    HugeLength n = node->range().len();
-    if (large != nullptr) {
-      large->spans++;
-      large->normal_pages += n.in_pages();
+HugeLength HugeCache::Prefault(HugeLength target,
+                               MemoryModifyFunction& populate) {
+  prefault_target_ = target;
+  HugeLength prefaulted = NHugePages(0);
+  while (size_ < target) {
+    HugeRange r = allocator_->Get(target - size_);
+    if (!r.valid()) break;
+    // populate may drop the page heap lock; r is owned by neither the cache
+    // nor the allocator in the meantime.
+    if (ABSL_PREDICT_FALSE(!populate(r.start_addr(), r.byte_len()))) {
+      allocator_->Release(r);
+      break;
     }
+    cache_.Insert(r, clock_.now());
+    size_ += r.len();
+    prefaulted += r.len();
   }
+
+  total_prefaulted_ += prefaulted;
+  UpdateSize(size());
+  return prefaulted;
 }
 
-HugeAddressMap::Node* HugeCache::Find(HugeLength n) {
-  HugeAddressMap::Node* curr = cache_.root();
-  // invariant: curr != nullptr && curr->longest >= n
-  // we favor smaller gaps and lower nodes and lower addresses, in that
-  // order. The net effect is that we are neither a best-fit nor a
-  // lowest-address allocator but vaguely close to both.
-  HugeAddressMap::Node* best = nullptr;
-  while (curr && curr->longest() >= n) {
-    if (curr->range().len() >= n) {
-      if (!best || best->range().len() > curr->range().len()) {
-        best = curr;
+void HugeCache::AddSpanStats(SmallSpanStats* small,
+                             LargeSpanStats* large) const {
+  static_assert(kPagesPerHugePage >= kMaxPages);
+  for (const HugeAddressMap* map : {&cache_, &pending_}) {
+    for (const HugeAddressMap::Node* node = map->first(); node != nullptr;
+         node = node->next()) {
+      HugeLength n = node->range().len();
+      if (large != nullptr) {
+        large->spans++;
+        large->normal_pages += n.in_pages();
       }
     }
+  }
+}
 
-    // Either subtree could contain a better fit and we don't want to
-    // search the whole tree. Pick a reasonable child to look at.
-    auto left = curr->left();
-    auto right = curr->right();
-    if (!left || left->longest() < n) {
-      curr = right;
-      continue;
-    }
-
-    if (!right || right->longest() < n) {
-      curr = left;
-      continue;
-    }
-
-    // Here, we have a nontrivial choice.
-    if (left->range().len() == right->range().len()) {
-      if (left->longest() <= right->longest()) {
-        curr = left;
-      } else {
-        curr = right;
-      }
-    } else if (left->range().len() < right->range().len()) {
-      // Here, the longest range in both children is the same...look
-      // in the subtree with the smaller root, as that's slightly
-      // more likely to be our best.
-      curr = left;
-    } else {
-      curr = right;
-    }
+HugeCache::CacheAge HugeCache::Age() const {
+  const int64_t now = clock_.now();
+  int64_t oldest = 0;
+  double weighted = 0;
+  for (const HugeAddressMap::Node* node = cache_.oldest(); node != nullptr;
+       node = node->newer()) {
+    const int64_t idle = std::max<int64_t>(now - node->when(), 0);
+    oldest = std::max(oldest, idle);
+    weighted += static_cast<double>(idle) * node->range().len().raw_num();
   }
-  return best;
+  const double freq = clock_.freq();
+  const double mean = size_.raw_num() > 0 ? weighted / size_.raw_num() : 0;
+  return {absl::Seconds(oldest / freq), absl::Seconds(mean / freq)};
 }
 
 void HugeCache::Print(Printer* out) {
@@ -396,13 +476,32 @@ void HugeCache::Print(Printer* out) {
       "HugeCache: %zu / %zu hugepages cached / cache limit "
       "(%.3f hit rate, %.3f overflow rate)\n",
       size_.raw_num(), limit().raw_num(), hit_rate, overflow_rate);
+  if (group_ != nullptr) {
+    out->printf(
+        "HugeCache: %zu hugepages cached across %d shared caches "
+        "(%zu baseline)\n",
+        group_->size().raw_num(), group_->members(),
+        MinCacheLimit().raw_num());
+  }
   out->printf("HugeCache: %zu MiB fast unbacked, %zu MiB periodic\n",
               total_fast_unbacked_.in_bytes() / 1024 / 1024,
               total_periodic_unbacked_.in_bytes() / 1024 / 1024);
+  out->printf("HugeCache: %zu MiB prefaulted (target %zu MiB)\n",
+              total_prefaulted_.in_mib(), prefault_target_.in_mib());
+  out->printf(
+      "HugeCache: %zu MiB pending unback, %zu MiB deferred, %zu MiB "
+      "unbacked in background, %zu MiB reclaimed before unback\n",
+      pending_size_.in_mib(), total_deferred_.in_mib(),
+      total_pending_unbacked_.in_mib(), reclaimed_pending_.in_mib());
   UpdateSize(size());
   out->printf(
       "HugeCache: %zu MiB*s cached since startup\n",
       NHugePages(regret_).in_mib() / static_cast<size_t>(clock_.freq()));
+  const CacheAge age = Age();
+  out->printf(
+      "HugeCache: %zu cached ranges, idle for %.3fs oldest, %.3fs mean\n",
+      cache_.nranges(), absl::ToDoubleSeconds(age.oldest),
+      absl::ToDoubleSeconds(age.mean));
 
   usage_tracker_.Report(usage_);
   const HugeLength usage_min = usage_tracker_.MinOverTime(kCacheTime);
@@ -446,6 +545,11 @@ void HugeCache::PrintInPbtxt(PbtxtRegion* hpaa) {
   hpaa->PrintI64("cached_huge_page_bytes", size_.in_bytes());
   // max allowed bytes in HugeCache
   hpaa->PrintI64("max_cached_huge_page_bytes", limit().in_bytes());
+  if (group_ != nullptr) {
+    // bytes cached by all caches sharing this one's baseline
+    hpaa->PrintI64("shared_cached_huge_page_bytes",
+                   group_->size().in_bytes());
+  }
   // lifetime cache hit rate
   hpaa->PrintDouble("huge_cache_hit_rate", hit_rate);
   // lifetime cache overflow rate
@@ -455,10 +559,25 @@ void HugeCache::PrintInPbtxt(PbtxtRegion* hpaa) {
   // bytes unbacked by periodic releaser thread
   hpaa->PrintI64("periodic_unbacked_bytes",
                  total_periodic_unbacked_.in_bytes());
+  // bytes prefaulted ahead of demand, and the size of that pool
+  hpaa->PrintI64("prefaulted_bytes", total_prefaulted_.in_bytes());
+  hpaa->PrintI64("prefault_target_bytes", prefault_target_.in_bytes());
+  // bytes whose unback has been deferred to the background thread
+  hpaa->PrintI64("pending_unback_bytes", pending_size_.in_bytes());
+  hpaa->PrintI64("deferred_unback_bytes", total_deferred_.in_bytes());
+  hpaa->PrintI64("background_unbacked_bytes",
+                 total_pending_unbacked_.in_bytes());
+  hpaa->PrintI64("reclaimed_pending_bytes", reclaimed_pending_.in_bytes());
   UpdateSize(size());
   // memory cached since startup (in MiB*s)
   hpaa->PrintI64("huge_cache_regret", NHugePages(regret_).in_mib() /
                                           static_cast<size_t>(clock_.freq()));
+  // how long the cached hugepages have been idle
+  const CacheAge age = Age();
+  hpaa->PrintI64("huge_cache_oldest_idle_ms",
+                 absl::ToInt64Milliseconds(age.oldest));
+  hpaa->PrintI64("huge_cache_mean_idle_ms",
+                 absl::ToInt64Milliseconds(age.mean));
 
   usage_tracker_.Report(usage_);
   const HugeLength usage_min = usage_tracker_.MinOverTime(kCacheTime);
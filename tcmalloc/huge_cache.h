@@ -25,6 +25,7 @@
 #include "absl/base/attributes.h"
 #include "absl/base/internal/cycleclock.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/huge_address_map.h"
 #include "tcmalloc/huge_allocator.h"
 #include "tcmalloc/huge_pages.h"
@@ -34,6 +35,7 @@
 #include "tcmalloc/internal/timeseries_tracker.h"
 #include "tcmalloc/metadata_allocator.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -44,6 +46,28 @@ class MemoryModifyFunction {
   virtual ~MemoryModifyFunction() = default;
 
   ABSL_MUST_USE_RESULT virtual bool operator()(void* start, size_t len) = 0;
+
+  // Applies the modification to each of <ranges> in turn, stopping at the
+  // first failure, and returns the number of ranges modified.  *calls is set
+  // to the number of underlying operations issued: implementations may batch
+  // <ranges> together, while by default each is modified separately.
+  ABSL_MUST_USE_RESULT virtual size_t ModifyRanges(
+      absl::Span<const AddressRange> ranges, size_t* calls) {
+    size_t i = 0;
+    *calls = 0;
+    for (; i < ranges.size(); ++i) {
+      ++*calls;
+      if (!(*this)(ranges[i].ptr, ranges[i].bytes)) break;
+    }
+    return i;
+  }
+
+  // The granularity of the modification, in pages.  Releasing memory only
+  // takes effect on whole base pages of the kernel, which may be larger than
+  // ours (16 KiB or 64 KiB on some aarch64 systems), so callers modifying
+  // ranges of a hugepage round them inward to multiples of this, and only
+  // account for the pages that were modified.
+  virtual Length granularity() const { return Length(1); }
 };
 
 // Track the extreme values of a HugeLength value over the past
@@ -98,6 +122,34 @@ extern template class MinMaxTracker<600>;
 template <size_t kEpochs>
 constexpr HugeLength MinMaxTracker<kEpochs>::kMaxVal;
 
+class HugeCache;
+
+// A set of HugeCaches, belonging to the page heaps of different memory tags,
+// that share one baseline cache size (see HugeCache::MinCacheLimit) rather
+// than each keeping its own.  A cached hugepage can only serve the tag it was
+// allocated for, since the tag is encoded in its address, so the members keep
+// separate contents and accounting; what they share is the floor below which
+// an idle cache's limit does not shrink.
+class HugeCacheGroup {
+ public:
+  static constexpr int kMaxMembers = 8;
+
+  constexpr HugeCacheGroup() = default;
+
+  void Join(const HugeCache* cache) {
+    CHECK_CONDITION(members_ < kMaxMembers);
+    member_[members_++] = cache;
+  }
+
+  // Backed memory cached across all members.
+  HugeLength size() const;
+  int members() const { return members_; }
+
+ private:
+  const HugeCache* member_[kMaxMembers] = {};
+  int members_ = 0;
+};
+
 class HugeCache {
  public:
   // For use in production
@@ -140,6 +192,7 @@ class HugeCache {
             Clock clock)
       : allocator_(allocator),
         cache_(meta_allocate),
+        pending_(meta_allocate),
         clock_(clock),
         cache_time_ticks_(clock_.freq() * absl::ToDoubleSeconds(kCacheTime)),
         nanoseconds_per_tick_(absl::ToInt64Nanoseconds(absl::Seconds(1)) /
@@ -157,8 +210,10 @@ class HugeCache {
   // otherwise, it is set to true (and the caller should back it.)
   HugeRange Get(HugeLength n, bool* from_released);
 
-  // Deallocate <r> (assumed to be backed by the kernel.)
-  void Release(HugeRange r);
+  // Deallocate <r> (assumed to be backed by the kernel.)  If <defer_unback>,
+  // memory evicted to keep the cache within its limit is queued rather than
+  // unbacked immediately; see ReleasePending.
+  void Release(HugeRange r, bool defer_unback = false);
   // As Release, but the range is assumed to _not_ be backed.
   void ReleaseUnbacked(HugeRange r);
 
@@ -166,6 +221,19 @@ class HugeCache {
   // the number of hugepages released.
   HugeLength ReleaseCachedPages(HugeLength n);
 
+  // Unbacks every range queued by a deferred Release, returning the number of
+  // hugepages released.  Until then, queued ranges remain backed and are
+  // handed back out by Get in preference to fresh memory.
+  HugeLength ReleasePending();
+
+  // Tops the cache up to <target> hugepages of backed memory, taking fresh
+  // hugepages from the allocator and faulting them in with <populate>, so that
+  // subsequent Gets do not take page faults.  The cache retains at least
+  // <target> hugepages when shrinking to its limit; explicit releases
+  // (ReleaseCachedPages) may still return them.  Returns the number of
+  // hugepages prefaulted.
+  HugeLength Prefault(HugeLength target, MemoryModifyFunction& populate);
+
   // Backed memory available.
   HugeLength size() const { return size_; }
   // Total memory cached (in HugeLength * nanoseconds)
@@ -174,42 +242,102 @@ class HugeCache {
   HugeLength limit() const { return limit_; }
   // Sum total of unreleased requests.
   HugeLength usage() const { return usage_; }
+  // Hugepages retained even when the cache is over its limit.
+  HugeLength prefault_target() const { return prefault_target_; }
+  // Backed memory evicted from the cache and awaiting ReleasePending.
+  HugeLength pending() const { return pending_size_; }
 
   void AddSpanStats(SmallSpanStats* small, LargeSpanStats* large) const;
 
   BackingStats stats() const {
     BackingStats s;
-    s.system_bytes = (usage() + size()).in_bytes();
-    s.free_bytes = size().in_bytes();
+    s.system_bytes = (usage() + size() + pending()).in_bytes();
+    s.free_bytes = (size() + pending()).in_bytes();
     s.unmapped_bytes = 0;
     return s;
   }
 
+  // Keeps the cache empty, but for its prefault target: released ranges are
+  // unbacked straight away.  Must be called before first use.
+  void Disable() {
+    disabled_ = true;
+    limit_ = NHugePages(0);
+  }
+  bool disabled() const { return disabled_; }
+
+  // Shares this cache's baseline size with the other members of <group>.
+  // Must be called before first use; the cache must not move afterwards.
+  void JoinGroup(HugeCacheGroup* group) {
+    CHECK_CONDITION(group_ == nullptr);
+    group_ = group;
+    group->Join(this);
+  }
+
   void Print(Printer* out);
   void PrintInPbtxt(PbtxtRegion* hpaa);
 
+  // Calls f(range, pending) for each cached range in increasing order of
+  // address, then for each range whose release is pending (see
+  // Parameters::async_release).
+  template <typename F>
+  void ForEachRange(F f) const {
+    for (const HugeAddressMap::Node* n = cache_.first(); n != nullptr;
+         n = n->next()) {
+      f(n->range(), /*pending=*/false);
+    }
+    for (const HugeAddressMap::Node* n = pending_.first(); n != nullptr;
+         n = n->next()) {
+      f(n->range(), /*pending=*/true);
+    }
+  }
+
  private:
   HugeAllocator* allocator_;
+  HugeCacheGroup* group_ = nullptr;
 
   // We just cache-missed a request for <missed> pages;
   // should we grow?
   void MaybeGrowCacheLimit(HugeLength missed);
   // Check if the cache seems consistently too big.  Returns the
   // number of pages *evicted* (not the change in limit).
-  HugeLength MaybeShrinkCacheLimit();
+  HugeLength MaybeShrinkCacheLimit(bool defer_unback = false);
 
   // Ensure the cache contains at most <target> hugepages,
   // returning the number removed.
-  HugeLength ShrinkCache(HugeLength target);
+  HugeLength ShrinkCache(HugeLength target, bool defer_unback = false);
+  // As ShrinkCache, for a gigapage-backed allocator: only whole, aligned
+  // gigapages are released, so the cache may remain above <target>.
+  HugeLength ShrinkCacheGigaPages(HugeLength target, bool defer_unback);
+  // Unbacks <r> and returns it to the allocator, or queues it on pending_ if
+  // <defer_unback>.  Returns false (and leaves <r> with the caller) if the
+  // unback fails.
+  bool UnbackOrDefer(HugeRange r, bool defer_unback);
 
   HugeRange DoGet(HugeLength n, bool* from_released);
 
-  HugeAddressMap::Node* Find(HugeLength n);
+  // How long the cached hugepages have been idle: the longest, and the mean
+  // over hugepages.
+  struct CacheAge {
+    absl::Duration oldest;
+    absl::Duration mean;
+  };
+  CacheAge Age() const;
 
   HugeAddressMap cache_;
   HugeLength size_{NHugePages(0)};
 
+  // Backed ranges evicted from cache_ whose unback has been deferred.
+  HugeAddressMap pending_;
+  HugeLength pending_size_{NHugePages(0)};
+
   HugeLength limit_{NHugePages(10)};
+  bool disabled_ = false;
+  HugeLength prefault_target_{NHugePages(0)};
+
+  // The size we shrink to when the cache overflows its limit.
+  HugeLength RetainedSize() const {
+    return std::max(limit(), prefault_target_);
+  }
   const absl::Duration kCacheTime = absl::Seconds(1);
 
   size_t hits_{0};
@@ -235,7 +363,15 @@ class HugeCache {
   // 10 hugepages is a good baseline for our cache--easily wiped away
   // by periodic release, and not that much memory on any real server.
   // However, we can go below it if we haven't used that much for 30 seconds.
-  HugeLength MinCacheLimit() const { return NHugePages(10); }
+  // In a HugeCacheGroup the baseline covers the whole group: we only keep
+  // what the other members are not already caching.
+  HugeLength MinCacheLimit() const {
+    if (disabled_) return NHugePages(0);
+    const HugeLength baseline = NHugePages(10);
+    if (group_ == nullptr) return baseline;
+    const HugeLength others = group_->size() - size();
+    return others >= baseline ? NHugePages(0) : baseline - others;
+  }
 
   uint64_t regret_{0};  // overflows if we cache 585 hugepages for 1 year
   int64_t last_regret_update_;
@@ -249,10 +385,22 @@ class HugeCache {
 
   HugeLength total_fast_unbacked_{NHugePages(0)};
   HugeLength total_periodic_unbacked_{NHugePages(0)};
+  HugeLength total_prefaulted_{NHugePages(0)};
+  HugeLength total_deferred_{NHugePages(0)};
+  HugeLength total_pending_unbacked_{NHugePages(0)};
+  HugeLength reclaimed_pending_{NHugePages(0)};
 
   MemoryModifyFunction& unback_;
 };
 
+inline HugeLength HugeCacheGroup::size() const {
+  HugeLength total = NHugePages(0);
+  for (int i = 0; i < members_; ++i) {
+    total += member_[i]->size();
+  }
+  return total;
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
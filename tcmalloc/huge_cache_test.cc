@@ -17,6 +17,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <algorithm>
 #include <memory>
@@ -150,13 +151,14 @@ TEST_F(HugeCacheTest, Release) {
   cache_.Release(r5);
 
   ASSERT_EQ(NHugePages(3), cache_.size());
-  EXPECT_CALL(mock_unback_, Unback(r5.start_addr(), kHugePageSize * 1))
+  // r1 and r2 have been cached the longest.
+  EXPECT_CALL(mock_unback_, Unback(r1.start_addr(), kHugePageSize * 1))
       .WillOnce(Return(true));
   EXPECT_EQ(NHugePages(1), cache_.ReleaseCachedPages(NHugePages(1)));
   cache_.Release(r3);
   cache_.Release(r4);
 
-  EXPECT_CALL(mock_unback_, Unback(r1.start_addr(), 4 * kHugePageSize))
+  EXPECT_CALL(mock_unback_, Unback(r2.start_addr(), 4 * kHugePageSize))
       .WillOnce(Return(true));
   EXPECT_EQ(NHugePages(4), cache_.ReleaseCachedPages(NHugePages(200)));
 }
@@ -192,7 +194,7 @@ TEST_F(HugeCacheTest, ReleaseFailure) {
   cache_.Release(r5);
 
   ASSERT_EQ(NHugePages(3), cache_.size());
-  EXPECT_CALL(mock_unback_, Unback(r5.start_addr(), 1 * kHugePageSize))
+  EXPECT_CALL(mock_unback_, Unback(r1.start_addr(), 1 * kHugePageSize))
       .WillOnce(Return(false));
   EXPECT_EQ(NHugePages(0), cache_.ReleaseCachedPages(NHugePages(1)));
   cache_.Release(r3);
@@ -203,6 +205,53 @@ TEST_F(HugeCacheTest, ReleaseFailure) {
   EXPECT_EQ(NHugePages(0), cache_.ReleaseCachedPages(NHugePages(200)));
 }
 
+TEST_F(HugeCacheTest, ReuseNewestReleaseOldest) {
+  bool from;
+  // The odd ranges stay allocated, so that the even ones are not merged once
+  // cached.
+  HugeRange r[5];
+  for (HugeRange& range : r) {
+    range = cache_.Get(NHugePages(2), &from);
+  }
+  cache_.Release(r[0]);
+  Advance(absl::Seconds(1));
+  cache_.Release(r[2]);
+  Advance(absl::Seconds(1));
+  cache_.Release(r[4]);
+
+  // The most recently released range is reused first, and what is left of it
+  // is reused next.
+  HugeRange got = cache_.Get(NHugePages(1), &from);
+  EXPECT_FALSE(from);
+  EXPECT_EQ(got.start(), r[4].start());
+  cache_.Release(got);
+  got = cache_.Get(NHugePages(2), &from);
+  EXPECT_FALSE(from);
+  EXPECT_EQ(got, r[4]);
+
+  std::string buffer(1024 * 1024, '\0');
+  {
+    Printer printer(&*buffer.begin(), buffer.size());
+    cache_.Print(&printer);
+  }
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer,
+              testing::HasSubstr("HugeCache: 2 cached ranges, idle for 2.0"));
+
+  // Release starts from the oldest range.
+  EXPECT_CALL(mock_unback_, Unback(r[0].start_addr(), r[0].byte_len()))
+      .WillOnce(Return(true));
+  EXPECT_EQ(cache_.ReleaseCachedPages(NHugePages(2)), NHugePages(2));
+  testing::Mock::VerifyAndClearExpectations(&mock_unback_);
+  EXPECT_CALL(mock_unback_, Unback(r[2].start_addr(), r[2].byte_len()))
+      .WillOnce(Return(true));
+  EXPECT_EQ(cache_.ReleaseCachedPages(NHugePages(2)), NHugePages(2));
+
+  cache_.Release(got);
+  cache_.Release(r[1]);
+  cache_.Release(r[3]);
+}
+
 TEST_F(HugeCacheTest, Regret) {
   bool from;
   HugeRange r = cache_.Get(NHugePages(20), &from);
@@ -470,6 +519,62 @@ TEST_F(HugeCacheTest, Shrink) {
   ASSERT_GE(NHugePages(25), cache_.limit());
 }
 
+TEST_F(HugeCacheTest, SharedBaseline) {
+  HugeCacheGroup group;
+  HugeCache other{&alloc_, metadata_allocator_, mock_unback_,
+                  Clock{.now = absl::base_internal::CycleClock::Now,
+                        .freq = absl::base_internal::CycleClock::Frequency}};
+  cache_.JoinGroup(&group);
+  other.JoinGroup(&group);
+  EXPECT_EQ(group.members(), 2);
+
+  // The other cache alone holds the whole baseline...
+  bool released;
+  other.Release(other.Get(NHugePages(10), &released));
+  cache_.Release(cache_.Get(NHugePages(10), &released));
+  ASSERT_EQ(other.size(), NHugePages(10));
+  ASSERT_EQ(cache_.size(), NHugePages(10));
+  EXPECT_EQ(group.size(), NHugePages(20));
+
+  // ...so an idle cache_ may shrink below it, where on its own it keeps
+  // 10 hugepages.
+  EXPECT_CALL(mock_unback_, Unback(testing::_, testing::_))
+      .WillRepeatedly(Return(true));
+  for (int i = 0; i < 10; ++i) {
+    Advance(absl::Seconds(3));
+    cache_.ReleaseCachedPages(NHugePages(0));
+  }
+  EXPECT_LT(cache_.limit(), NHugePages(10));
+  EXPECT_LT(cache_.size(), NHugePages(10));
+  EXPECT_EQ(other.size(), NHugePages(10));
+  EXPECT_EQ(group.size(), other.size() + cache_.size());
+
+  std::string buffer(1024 * 1024, '\0');
+  Printer out(&*buffer.begin(), buffer.size());
+  cache_.Print(&out);
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr("across 2 shared caches"));
+}
+
+TEST_F(HugeCacheTest, Disabled) {
+  cache_.Disable();
+  EXPECT_TRUE(cache_.disabled());
+  EXPECT_EQ(cache_.limit(), NHugePages(0));
+
+  EXPECT_CALL(mock_unback_, Unback(testing::_, testing::_))
+      .WillRepeatedly(Return(true));
+  // However often a range is reused, it is unbacked as soon as it is freed.
+  bool released;
+  for (int i = 0; i < 10; ++i) {
+    HugeRange r = cache_.Get(NHugePages(4), &released);
+    EXPECT_TRUE(released);
+    cache_.Release(r);
+    EXPECT_EQ(cache_.size(), NHugePages(0));
+    Advance(absl::Milliseconds(100));
+  }
+  EXPECT_EQ(cache_.limit(), NHugePages(0));
+}
+
 TEST_F(HugeCacheTest, Usage) {
   bool released;
 
@@ -487,6 +592,162 @@ TEST_F(HugeCacheTest, Usage) {
   EXPECT_EQ(NHugePages(0), cache_.usage());
 }
 
+TEST_F(HugeCacheTest, Prefault) {
+  class CountingPopulate : public MemoryModifyFunction {
+   public:
+    bool operator()(void* p, size_t len) override {
+      populated += HLFromBytes(len);
+      return succeed;
+    }
+
+    bool succeed = true;
+    HugeLength populated;
+  } populate;
+
+  const HugeLength kTarget = NHugePages(20);
+  ASSERT_GT(kTarget, cache_.limit());
+  EXPECT_EQ(cache_.Prefault(kTarget, populate), kTarget);
+  EXPECT_EQ(populate.populated, kTarget);
+  EXPECT_EQ(cache_.size(), kTarget);
+  EXPECT_EQ(cache_.usage(), NHugePages(0));
+
+  // Prefaulted hugepages are handed out as already backed.
+  bool from_released;
+  HugeRange r = cache_.Get(NHugePages(5), &from_released);
+  EXPECT_FALSE(from_released);
+
+  // Returning them does not shrink the cache below the prefault target, even
+  // though it exceeds the cache limit.
+  EXPECT_CALL(mock_unback_, Unback(testing::_, testing::_)).Times(0);
+  cache_.Release(r);
+  EXPECT_EQ(cache_.size(), kTarget);
+  testing::Mock::VerifyAndClearExpectations(&mock_unback_);
+
+  // Already at the target: nothing more to do.
+  EXPECT_EQ(cache_.Prefault(kTarget, populate), NHugePages(0));
+
+  // Explicit release still returns them to the system.
+  EXPECT_CALL(mock_unback_, Unback(testing::_, testing::_))
+      .WillRepeatedly(Return(true));
+  EXPECT_EQ(cache_.ReleaseCachedPages(kTarget), kTarget);
+  EXPECT_EQ(cache_.size(), NHugePages(0));
+
+  // A failure to populate leaves the cache untouched.
+  populate.succeed = false;
+  EXPECT_EQ(cache_.Prefault(kTarget, populate), NHugePages(0));
+  EXPECT_EQ(cache_.size(), NHugePages(0));
+}
+
+TEST_F(HugeCacheTest, DeferredRelease) {
+  // Fill the cache well past its limit with deferred releases: nothing is
+  // unbacked on the releasing path.
+  const HugeLength kLimit = cache_.limit();
+  const HugeLength kOver = NHugePages(5);
+  bool from_released;
+  HugeRange r = cache_.Get(kLimit + kOver, &from_released);
+  ASSERT_TRUE(r.valid());
+  EXPECT_CALL(mock_unback_, Unback(testing::_, testing::_)).Times(0);
+  cache_.Release(r, /*defer_unback=*/true);
+  EXPECT_EQ(cache_.size(), kLimit);
+  EXPECT_EQ(cache_.pending(), kOver);
+  // Pending memory is still backed and free.
+  EXPECT_EQ(cache_.stats().free_bytes, (kLimit + kOver).in_bytes());
+  testing::Mock::VerifyAndClearExpectations(&mock_unback_);
+
+  // Once the cache is exhausted, Gets reclaim pending memory as backed
+  // rather than faulting in fresh hugepages.
+  HugeRange cached = cache_.Get(kLimit, &from_released);
+  EXPECT_FALSE(from_released);
+  HugeRange reclaimed = cache_.Get(NHugePages(2), &from_released);
+  EXPECT_FALSE(from_released);
+  EXPECT_EQ(cache_.pending(), kOver - NHugePages(2));
+  cache_.ReleaseUnbacked(reclaimed);
+
+  // The background drain unbacks whatever is left.
+  EXPECT_CALL(mock_unback_, Unback(testing::_, testing::_))
+      .WillOnce(Return(true));
+  EXPECT_EQ(cache_.ReleasePending(), kOver - NHugePages(2));
+  EXPECT_EQ(cache_.pending(), NHugePages(0));
+  testing::Mock::VerifyAndClearExpectations(&mock_unback_);
+
+  // A failed unback returns the range to the cache instead of leaking it.
+  cache_.Release(cached, /*defer_unback=*/true);
+  ASSERT_EQ(cache_.pending(), NHugePages(0));
+  r = cache_.Get(kLimit + kOver, &from_released);
+  cache_.Release(r, /*defer_unback=*/true);
+  const HugeLength size = cache_.size();
+  ASSERT_GT(cache_.pending(), NHugePages(0));
+  const HugeLength pending = cache_.pending();
+  EXPECT_CALL(mock_unback_, Unback(testing::_, testing::_))
+      .WillRepeatedly(Return(false));
+  EXPECT_EQ(cache_.ReleasePending(), NHugePages(0));
+  EXPECT_EQ(cache_.size(), size + pending);
+  EXPECT_EQ(cache_.pending(), NHugePages(0));
+}
+
+class HugeCacheGigaPageTest : public testing::Test {
+ private:
+  class MockBackingInterface : public MemoryModifyFunction {
+   public:
+    MOCK_METHOD(bool, Unback, (void* p, size_t len), ());
+
+    bool operator()(void* p, size_t len) override { return Unback(p, len); }
+  };
+
+ protected:
+  HugeCacheGigaPageTest() {
+    // We don't use the first few bytes, because things might get weird
+    // given zero pointers.
+    vm_allocator_.backing_.resize(1024);
+  }
+
+  testing::NiceMock<MockBackingInterface> mock_unback_;
+  FakeVirtualAllocator vm_allocator_;
+  FakeMetadataAllocator metadata_allocator_;
+  HugeAllocator alloc_{vm_allocator_, metadata_allocator_,
+                       HugeBackingOption::kGigaPages};
+  HugeCache cache_{&alloc_, metadata_allocator_, mock_unback_};
+};
+
+TEST_F(HugeCacheGigaPageTest, ReleasesOnlyWholeGigaPages) {
+  bool from_released;
+  HugeRange r = cache_.Get(kHugePagesPerGigaPage, &from_released);
+  ASSERT_TRUE(r.valid());
+  EXPECT_TRUE(from_released);
+  ASSERT_EQ(GigaPageInterior(r), r);
+
+  HugeRange first, second;
+  std::tie(first, second) = Split(r, kHugePagesPerGigaPage / 2);
+
+  // Half a gigapage exceeds the cache limit, but cannot be released.
+  EXPECT_CALL(mock_unback_, Unback(testing::_, testing::_)).Times(0);
+  cache_.Release(first);
+  EXPECT_EQ(cache_.size(), first.len());
+  EXPECT_EQ(cache_.ReleaseCachedPages(first.len()), NHugePages(0));
+  testing::Mock::VerifyAndClearExpectations(&mock_unback_);
+
+  // Once the entire gigapage is free, it is released as a unit.
+  EXPECT_CALL(mock_unback_, Unback(r.start_addr(), kGigaPageSize))
+      .WillOnce(Return(true));
+  cache_.Release(second);
+  EXPECT_EQ(cache_.size(), NHugePages(0));
+  EXPECT_EQ(alloc_.size(), kHugePagesPerGigaPage);
+}
+
+TEST_F(HugeCacheGigaPageTest, KeepsPartialGigaPages) {
+  bool from_released;
+  HugeRange r = cache_.Get(kHugePagesPerGigaPage + NHugePages(1),
+                           &from_released);
+  ASSERT_TRUE(r.valid());
+
+  // Only the first gigapage is entirely free; the hugepage that spills into
+  // the second one must stay cached.
+  EXPECT_CALL(mock_unback_, Unback(r.start_addr(), kGigaPageSize))
+      .WillOnce(Return(true));
+  cache_.Release(r);
+  EXPECT_EQ(cache_.size(), NHugePages(1));
+}
+
 class MinMaxTrackerTest : public testing::Test {
  protected:
   void Advance(absl::Duration d) {
@@ -17,13 +17,18 @@
 #include "absl/base/attributes.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/huge_page_filler.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/huge_region.h"
+#include "tcmalloc/internal/cache_topology.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/lifetime_based_allocator.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/pages.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
 
@@ -112,6 +117,32 @@ bool use_huge_region_more_often() {
   return true;
 }
 
+extern "C" ABSL_ATTRIBUTE_WEAK bool default_want_gigapage_backing();
+
+HugeBackingOption huge_backing_option() {
+  // Gigapage backing is opt-in: it only pays off for very large, stable heaps,
+  // since memory is not returned to the system until a whole gigapage is free.
+  bool enabled = default_want_gigapage_backing != nullptr;
+
+  const char* e = thread_safe_getenv("TCMALLOC_GIGAPAGE_BACKING");
+  if (e) {
+    switch (e[0]) {
+      case '0':
+        enabled = false;
+        break;
+      case '1':
+        enabled = true;
+        break;
+      default:
+        Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+        return HugeBackingOption::kHugePages;
+    }
+  }
+
+  return enabled ? HugeBackingOption::kGigaPages
+                 : HugeBackingOption::kHugePages;
+}
+
 HugeRegionUsageOption huge_region_option() {
   // By default, we use slack to determine when to use HugeRegion. When slack is
   // greater than 64MB (to ignore small binaries), and greater than the number
@@ -127,6 +158,54 @@ HugeRegionUsageOption huge_region_option() {
              : HugeRegionUsageOption::kDefault;
 }
 
+HugeRegionAllocOption huge_region_alloc_option() {
+  // Allocating from the densest region lets sparsely used ones drain and be
+  // released, at the cost of fragmenting the dense ones further.  Opt-in while
+  // we evaluate it.
+  const char* e = thread_safe_getenv("TCMALLOC_HUGE_REGION_PREFER_DENSE");
+  if (e) {
+    switch (e[0]) {
+      case '0':
+        return HugeRegionAllocOption::kMostFragmented;
+      case '1':
+        return HugeRegionAllocOption::kDensest;
+      default:
+        Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+        return HugeRegionAllocOption::kMostFragmented;
+    }
+  }
+
+  return HugeRegionAllocOption::kMostFragmented;
+}
+
+LifetimePredictionOption lifetime_option() {
+  // Lifetime-based placement is opt-in while we gather counterfactual data.
+  const char* e = thread_safe_getenv("TCMALLOC_LIFETIME_ALLOCATOR");
+  if (e) {
+    switch (e[0]) {
+      case '0':
+        return LifetimePredictionOption::kDisabled;
+      case '1':
+        return LifetimePredictionOption::kEnabled;
+      case '2':
+        return LifetimePredictionOption::kCounterfactual;
+      default:
+        Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+        return LifetimePredictionOption::kDisabled;
+    }
+  }
+
+  return LifetimePredictionOption::kDisabled;
+}
+
+uint8_t StaticForwarder::filler_partition() {
+  if (!Parameters::filler_l3_partitions()) return kAnyFillerPartition;
+  const CacheTopology& topology = CacheTopology::Instance();
+  const int cpu = subtle::percpu::RseqCpuId();
+  if (cpu < 0 || topology.l3_count() <= 1) return kAnyFillerPartition;
+  return topology.GetL3FromCpuId(cpu) % kAnyFillerPartition;
+}
+
 Arena& StaticForwarder::arena() { return tc_globals.arena(); }
 
 void* StaticForwarder::GetHugepage(HugePage p) {
@@ -145,8 +224,8 @@ void StaticForwarder::SetHugepage(HugePage p, void* pt) {
   tc_globals.pagemap().SetHugepage(p.first_page(), pt);
 }
 
-void StaticForwarder::ShrinkToUsageLimit(Length n) {
-  tc_globals.page_allocator().ShrinkToUsageLimit(n);
+void StaticForwarder::ShrinkToUsageLimit(Length n, MemoryTag tag) {
+  tc_globals.page_allocator().ShrinkToUsageLimit(n, tag);
 }
 
 Span* StaticForwarder::NewSpan(PageId page, Length length) {
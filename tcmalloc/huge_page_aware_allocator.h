@@ -17,23 +17,37 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+#include <optional>
+
 #include "absl/base/attributes.h"
 #include "absl/base/internal/cycleclock.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/functional/function_ref.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/arena.h"
+#include "tcmalloc/background_wakeup.h"
 #include "tcmalloc/central_freelist.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_allocator.h"
 #include "tcmalloc/huge_cache.h"
 #include "tcmalloc/huge_page_filler.h"
+#include "tcmalloc/huge_page_layout.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/huge_region.h"
 #include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/clock.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/lifetime_predictions.h"
+#include "tcmalloc/internal/lifetime_tracker.h"
+#include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/pageflags.h"
 #include "tcmalloc/internal/prefetch.h"
+#include "tcmalloc/internal/residency.h"
+#include "tcmalloc/lifetime_based_allocator.h"
 #include "tcmalloc/metadata_allocator.h"
 #include "tcmalloc/page_allocator_interface.h"
 #include "tcmalloc/page_heap_allocator.h"
@@ -58,6 +72,12 @@ bool decide_subrelease();
 HugeRegionUsageOption huge_region_option();
 bool use_huge_region_more_often();
 
+HugeRegionAllocOption huge_region_alloc_option();
+
+HugeBackingOption huge_backing_option();
+
+LifetimePredictionOption lifetime_option();
+
 class StaticForwarder {
  public:
   // Runtime parameters.  This can change between calls.
@@ -70,6 +90,10 @@ class StaticForwarder {
   static absl::Duration filler_skip_subrelease_long_interval() {
     return Parameters::filler_skip_subrelease_long_interval();
   }
+  static SubreleaseDemandPredictor filler_skip_subrelease_predictor() {
+    return static_cast<SubreleaseDemandPredictor>(
+        Parameters::skip_subrelease_predictor());
+  }
 
   static bool release_partial_alloc_pages() {
     return Parameters::release_partial_alloc_pages();
@@ -77,6 +101,30 @@ class StaticForwarder {
 
   static bool hpaa_subrelease() { return Parameters::hpaa_subrelease(); }
 
+  static bool async_release() { return Parameters::async_release(); }
+
+  static bool adaptive_madvise_free() {
+    return Parameters::adaptive_madvise_free();
+  }
+
+  static double filler_fragmentation_region_threshold() {
+    return Parameters::filler_fragmentation_region_threshold();
+  }
+
+  // The HugePageFiller partition of the calling CPU's L3 cache domain, or
+  // kAnyFillerPartition unless Parameters::filler_l3_partitions().
+  static uint8_t filler_partition();
+
+  // Wakes the background worker that performs the releases of <tag>'s heap
+  // deferred by async_release().  Without per-partition workers, that is the
+  // worker of partition 0.
+  static void WakeBackgroundRelease(MemoryTag tag) {
+    WakeBackgroundWorker(Parameters::numa_background_workers() &&
+                                 IsNormalMemoryTag(tag)
+                             ? NumaPartitionFromTag(tag)
+                             : 0);
+  }
+
   // Arena state.
   static Arena& arena();
 
@@ -84,8 +132,9 @@ class StaticForwarder {
 
   // Check page heap memory limit.  `n` indicates the size of the allocation
   // currently being made, which will not be included in the sampled memory heap
-  // for realized fragmentation estimation.
-  static void ShrinkToUsageLimit(Length n)
+  // for realized fragmentation estimation.  Memory is released from <tag>'s
+  // heap first.
+  static void ShrinkToUsageLimit(Length n, MemoryTag tag)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   // PageMap state.
@@ -107,19 +156,65 @@ class StaticForwarder {
     return SystemAlloc(bytes, align, tag);
   }
   // TODO(ckennelly): Accept PageId/Length.
-  static bool ReleasePages(void* ptr, size_t size) {
-    return SystemRelease(ptr, size);
+  static bool ReleasePages(void* ptr, size_t size,
+                           ReleaseMode mode = ReleaseMode::kDefault) {
+    return SystemRelease(ptr, size, mode);
+  }
+  static size_t ReleasePagesBatch(absl::Span<const AddressRange> ranges,
+                                  size_t* syscalls,
+                                  ReleaseMode mode = ReleaseMode::kDefault) {
+    return SystemReleaseBatch(ranges, syscalls, mode);
+  }
+  static Length ReleaseGranularity() {
+    return Length(std::max<size_t>(GetPageSize() / kPageSize, 1));
+  }
+  static bool PrefaultPages(void* ptr, size_t size) {
+    return SystemPrefault(ptr, size);
+  }
+  static bool CollapsePages(void* ptr, size_t size) {
+    return SystemCollapse(ptr, size);
+  }
+  static bool BackGigaPages(void* ptr, size_t size, MemoryTag tag) {
+    return SystemBackGigaPages(ptr, size, tag);
   }
+  static bool MovePages(void* from, void* to, size_t size, MemoryTag tag) {
+    return SystemMovePages(from, to, size, tag);
+  }
+  static bool MemoryIsZeroFilled() { return SystemMemoryIsZeroFilled(); }
 };
 
 struct HugePageAwareAllocatorOptions {
   MemoryTag tag;
   HugeRegionUsageOption use_huge_region_more_often = huge_region_option();
+  HugeRegionAllocOption huge_region_alloc = huge_region_alloc_option();
   HugePageFillerAllocsOption allocs_for_sparse_and_dense_spans =
       Parameters::separate_allocs_for_few_and_many_objects_spans()
           ? HugePageFillerAllocsOption::kSeparateAllocs
           : HugePageFillerAllocsOption::kUnifiedAllocs;
   size_t chunks_per_alloc = Parameters::chunks_per_alloc();
+  HugeBackingOption backing = HugeBackingOption::kHugePages;
+  // Lifetime-based placement of large allocations (see
+  // LifetimeBasedAllocator).  Not supported with gigapage backing.
+  LifetimePredictionOption lifetime = lifetime_option();
+  absl::Duration lifetime_threshold = absl::Milliseconds(500);
+  // If set, the HugeCache shares its baseline size with the other caches in
+  // the group (see HugeCacheGroup).
+  HugeCacheGroup* cache_group = nullptr;
+  // If false, whole hugepages are unbacked as soon as they are freed rather
+  // than cached (see HugeCache::Disable).
+  bool huge_cache = !Parameters::small_footprint();
+  // The clock of the time-based policies of the filler, the HugeCache and the
+  // lifetime-based allocator.  Simulations substitute a fake one.
+  Clock clock = {.now = absl::base_internal::CycleClock::Now,
+                 .freq = absl::base_internal::CycleClock::Frequency};
+};
+
+// Where HugePageAwareAllocator::WriteLayout resumes.
+struct HugePageLayoutCursor {
+  enum Phase { kFiller, kRegions, kCache, kPendingCache, kDone };
+  Phase phase = kFiller;
+  // The first page not yet written in this phase.
+  uintptr_t next_page = 0;
 };
 
 // An implementation of the PageAllocator interface that is hugepage-efficient.
@@ -147,10 +242,39 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
       ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
 
   // As New, but the returned span is aligned to a <align>-page boundary.
-  // <align> must be a power of two.
+  // <align> must be a power of two, and at most a hugepage.  Spans of less
+  // than a hugepage start a hugepage of the filler; spans of whole hugepages
+  // are exact ranges from the HugeCache, with no slack.
   Span* NewAligned(Length n, Length align, SpanAllocInfo span_alloc_info)
       ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
 
+  // As New, for a batch of spans of "n" pages.  Small spans are taken from the
+  // filler under a single acquisition of pageheap_lock; as the filler prefers
+  // the fullest hugepage that fits, consecutive spans of a batch are usually
+  // carved from the same hugepage.
+  size_t NewBatch(Length n, SpanAllocInfo span_alloc_info,
+                  absl::Span<Span*> spans)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+
+  // Grows <span> in place by <delta> pages.  Only spans packed by the filler
+  // can grow, and only into the free pages that follow them on the same
+  // hugepage.
+  bool TryExtend(Span* span, Length delta)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+
+  // Shrinks <span> in place to at least <n> pages.  Spans packed by the
+  // filler or placed in a HugeRegion return their tail pages there.  Spans
+  // taken straight from the HugeCache keep whole hugepages, returning the
+  // ones past <n> to the cache.
+  bool TryShrink(Span* span, Length n)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+
+  // Moves the pages of <from> into <to> by remapping rather than copying them.
+  // Only spans of whole hugepages taken straight from the HugeCache can move;
+  // the old range of <from> returns to the HugeAllocator unbacked.
+  bool TryMove(Span* from, Span* to)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
@@ -178,6 +302,81 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
   Length ReleaseAtLeastNPagesBreakingHugepages(Length n)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Keeps at least <n> free hugepages backed and faulted in, ahead of demand,
+  // so that allocations breaking a new hugepage do not take page faults.
+  // Faulting happens with pageheap_lock released.  Returns the number of
+  // hugepages prefaulted by this call.
+  HugeLength PrefaultHugePages(HugeLength n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return cache_.Prefault(n, prefault_without_lock_);
+  }
+
+  // Collapses up to <n> filler hugepages, broken by subrelease and since
+  // refilled, back into hugepages (see
+  // HugePageFiller::CollapseRefilledHugePages).  Returns the number of
+  // hugepages collapsed.
+  HugeLength CollapseRefilledHugePages(HugeLength n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return filler_.CollapseRefilledHugePages(n, collapse_);
+  }
+
+  // Reads whether the kernel backs up to <n> filler hugepages with THPs from
+  // <flags> (see HugePageFiller::ScanHugePageBacking).  Returns the number of
+  // hugepages scanned.
+  size_t ScanHugePageBacking(size_t n, PageFlags& flags)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return filler_.ScanHugePageBacking(n, [&](HugePage p) {
+      return flags.IsHugePage(p.start_addr());
+    });
+  }
+
+  // Reads which free pages of up to <n> filler hugepages have gone stale from
+  // <flags> (see HugePageFiller::ScanFreePageIdleness).  Returns the number of
+  // hugepages scanned.
+  size_t ScanFreePageIdleness(size_t n, PageFlags& flags)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return filler_.ScanFreePageIdleness(
+        n, [&](PageId p, Length len) -> std::optional<size_t> {
+          std::optional<PageFlags::PageStats> stats =
+              flags.Get(p.start_addr(), len.in_bytes());
+          if (!stats.has_value()) return std::nullopt;
+          return stats->bytes_stale;
+        });
+  }
+
+  // Releases memory that is accounted as released, but that stray touches
+  // have faulted back in, to the OS once more, as reported by <residency>.
+  // Queries up to <n> hugepages each of the filler, the regions and the free
+  // ranges of alloc_ (where the cache releases hugepages to), picking up where
+  // the previous call left off.  Returns the number of bytes released again.
+  size_t ReleaseResidentUnbacked(size_t n, Residency& residency)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Unbacks hugepages whose release was deferred (see
+  // Parameters::async_release) when they were evicted from the cache.  The
+  // madvise happens with pageheap_lock released.  Returns the number of
+  // hugepages released.
+  HugeLength ReleasePendingPages()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return cache_.ReleasePending();
+  }
+
+  // Releases the memory of up to <max_slabs> slabs of free hugepage trackers
+  // (see PageHeapAllocator::ReleaseFreeSlabs).  Returns the number of bytes
+  // released.  HugeRegions are never freed, so have nothing to release.
+  size_t ReleaseFreeMetadata(size_t max_slabs)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return tracker_allocator_.ReleaseFreeSlabs(max_slabs);
+  }
+
+  // Appends layout records (see huge_page_layout.h) for the hugepages of the
+  // filler, the regions and the cache to <out>, resuming from *cursor, until
+  // <out> is full or all have been written.  <size_class> returns the size
+  // class of a used page.  Returns whether there is more to write.
+  bool WriteLayout(HugePageLayoutCursor* cursor, HugePageLayoutWriter* out,
+                   absl::FunctionRef<size_t(PageId)> size_class)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Prints stats about the page heap to *out.
   void Print(Printer* out) ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
 
@@ -193,6 +392,18 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
     return filler_.stats();
   }
 
+  SubreleaseStats FillerSubreleaseStats() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return filler_.subrelease_stats();
+  }
+
+  // Filler hugepages that subrelease has broken, and that have not been
+  // collapsed or freed since.
+  HugeLength FillerBrokenHugePages() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return filler_.previously_released_huge_pages();
+  }
+
   BackingStats RegionsStats() const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
     return regions_.stats();
@@ -221,6 +432,11 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
     return regions_;
   };
 
+  const LifetimeBasedAllocator& lifetime_allocator() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return lifetime_allocator_;
+  }
+
   // IsValidSizeClass verifies size class parameters from the HPAA perspective.
   static bool IsValidSizeClass(size_t size, size_t pages);
 
@@ -229,13 +445,35 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
  private:
   static constexpr Length kSmallAllocPages = kPagesPerHugePage / 2;
 
+  // Whether memory may be returned to the system.  Registered memory must
+  // keep its physical pages, since devices may access it directly.
+  bool CanRelease() const { return tag_ != MemoryTag::kRegistered; }
+
   class Unback final : public MemoryModifyFunction {
    public:
     explicit Unback(HugePageAwareAllocator& hpaa ABSL_ATTRIBUTE_LIFETIME_BOUND)
         : hpaa_(hpaa) {}
 
     ABSL_MUST_USE_RESULT bool operator()(void* start, size_t length) override {
-      return hpaa_.forwarder_.ReleasePages(start, length);
+      // The filler and regions release memory at (sub)hugepage granularity,
+      // which would shatter gigapage mappings.  Only HugeCache, via
+      // unback_without_lock_, returns whole gigapages.
+      if (hpaa_.alloc_.gigapage_backed() || !hpaa_.CanRelease()) return false;
+      return hpaa_.forwarder_.ReleasePages(start, length, hpaa_.release_mode_);
+    }
+
+    ABSL_MUST_USE_RESULT size_t ModifyRanges(
+        absl::Span<const AddressRange> ranges, size_t* calls) override {
+      if (hpaa_.alloc_.gigapage_backed() || !hpaa_.CanRelease()) {
+        *calls = 0;
+        return 0;
+      }
+      return hpaa_.forwarder_.ReleasePagesBatch(ranges, calls,
+                                                hpaa_.release_mode_);
+    }
+
+    Length granularity() const override {
+      return hpaa_.forwarder_.ReleaseGranularity();
     }
 
    public:
@@ -253,6 +491,7 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
 #ifndef NDEBUG
       pageheap_lock.AssertHeld();
 #endif  // NDEBUG
+      if (!hpaa_.CanRelease()) return false;
       pageheap_lock.Unlock();
       bool ret = hpaa_.forwarder_.ReleasePages(start, length);
       pageheap_lock.Lock();
@@ -263,8 +502,59 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
     HugePageAwareAllocator& hpaa_;
   };
 
+  class PrefaultWithoutLock final : public MemoryModifyFunction {
+   public:
+    explicit PrefaultWithoutLock(
+        HugePageAwareAllocator& hpaa ABSL_ATTRIBUTE_LIFETIME_BOUND)
+        : hpaa_(hpaa) {}
+
+    ABSL_MUST_USE_RESULT bool operator()(void* start, size_t length) override
+        ABSL_NO_THREAD_SAFETY_ANALYSIS {
+#ifndef NDEBUG
+      pageheap_lock.AssertHeld();
+#endif  // NDEBUG
+      pageheap_lock.Unlock();
+      bool ret = hpaa_.forwarder_.PrefaultPages(start, length);
+      pageheap_lock.Lock();
+      return ret;
+    }
+
+   public:
+    HugePageAwareAllocator& hpaa_;
+  };
+
+  class Collapse final : public MemoryModifyFunction {
+   public:
+    explicit Collapse(
+        HugePageAwareAllocator& hpaa ABSL_ATTRIBUTE_LIFETIME_BOUND)
+        : hpaa_(hpaa) {}
+
+    ABSL_MUST_USE_RESULT bool operator()(void* start, size_t length) override {
+      return hpaa_.forwarder_.CollapsePages(start, length);
+    }
+
+   public:
+    HugePageAwareAllocator& hpaa_;
+  };
+
+  // The counterfactual lifetime region is never backed, so there is nothing
+  // to unback.
+  class NilUnback final : public MemoryModifyFunction {
+   public:
+    ABSL_MUST_USE_RESULT bool operator()(void* start, size_t length) override {
+      return true;
+    }
+  };
+
   Unback unback_ ABSL_GUARDED_BY(pageheap_lock);
+  // How unback_ releases memory: kLazy while ReleaseAtLeastNPages subreleases
+  // pages the filler expects to be reused.
+  ReleaseMode release_mode_ ABSL_GUARDED_BY(pageheap_lock) =
+      ReleaseMode::kDefault;
   UnbackWithoutLock unback_without_lock_ ABSL_GUARDED_BY(pageheap_lock);
+  PrefaultWithoutLock prefault_without_lock_ ABSL_GUARDED_BY(pageheap_lock);
+  Collapse collapse_ ABSL_GUARDED_BY(pageheap_lock);
+  NilUnback nil_unback_;
 
   typedef HugePageFiller<PageTracker> FillerType;
   FillerType filler_ ABSL_GUARDED_BY(pageheap_lock);
@@ -311,6 +601,7 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
 
   void SetTracker(HugePage p, FillerType::Tracker* pt);
 
+  // Allocates address space for alloc_.  Temporarily releases pageheap_lock.
   AddressRange AllocAndReport(size_t bytes, size_t align)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
@@ -329,28 +620,56 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
   // a donating allocation is deallocated but the entire huge page has not been
   // reassembled.
   Length abandoned_pages_ ABSL_GUARDED_BY(pageheap_lock);
+  // Number of spans that fit in none of the filler's hugepages and were carved
+  // from the regions instead, since the filler was fragmented (see
+  // AllocSmall).
+  size_t region_routed_spans_ ABSL_GUARDED_BY(pageheap_lock) = 0;
+  // Number of allocations from the system that we failed to back with
+  // gigapages (e.g. because the hugetlb pool was exhausted).
+  size_t gigapage_backing_failures_ ABSL_GUARDED_BY(pageheap_lock) = 0;
+  // Bytes of released memory found resident (see ReleaseResidentUnbacked).
+  size_t resident_unbacked_bytes_ ABSL_GUARDED_BY(pageheap_lock) = 0;
+
+  LifetimeBasedAllocator lifetime_allocator_ ABSL_GUARDED_BY(pageheap_lock);
 
   void GetSpanStats(SmallSpanStats* small, LargeSpanStats* large)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Usage of the lifetime region, as accounted in stats().
+  BackingStats LifetimeRegionStats() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   PageId RefillFiller(Length n, SpanAllocInfo span_alloc_info,
                       bool* from_released)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Smallest span AllocSmall routes to the regions when the filler is
+  // fragmented.  Smaller spans nearly always fit in some filler hugepage.
+  static constexpr Length kMinRegionRoutedPages = kPagesPerHugePage / 32;
+
+  // Returns true if at least filler_fragmentation_region_threshold() of the
+  // filler's backed pages are free, so that a span finding no room there is
+  // better placed in the regions' free space than on a new hugepage.
+  bool FillerFragmented() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Allocate the first <n> from p, and contribute the rest to the filler.  If
   // "donated" is true, the contribution will be marked as coming from the
-  // tail of a multi-hugepage alloc.  Returns the allocated section.
+  // tail of a multi-hugepage alloc; otherwise p joins filler partition
+  // <partition>.  If "known_zero" is true, p is fresh from the system and its
+  // pages read as zero.  Returns the allocated section.
   PageId AllocAndContribute(HugePage p, Length n, SpanAllocInfo span_alloc_info,
-                            bool donated)
+                            bool donated, bool known_zero,
+                            uint8_t partition = kAnyFillerPartition)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   // Helpers for New().
 
   Span* LockAndAlloc(Length n, SpanAllocInfo span_alloc_info,
-                     bool* from_released);
+                     bool* from_released, std::optional<size_t> lifetime_site);
 
   Span* AllocSmall(Length n, SpanAllocInfo span_alloc_info, bool* from_released)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
-  Span* AllocLarge(Length n, SpanAllocInfo span_alloc_info, bool* from_released)
+  Span* AllocLarge(Length n, SpanAllocInfo span_alloc_info, bool* from_released,
+                   std::optional<size_t> lifetime_site)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   Span* AllocEnormous(Length n, SpanAllocInfo span_alloc_info,
                       bool* from_released)
@@ -359,18 +678,31 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
   Span* AllocRawHugepages(Length n, SpanAllocInfo span_alloc_info,
                           bool* from_released)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // As AllocRawHugepages, for requests whose slack would be donated to the
+  // filler: allocations from <lifetime_site> predicted to be short-lived are
+  // placed in the lifetime region instead.
+  Span* AllocRawHugepagesWithLifetime(Length n, SpanAllocInfo span_alloc_info,
+                                      bool* from_released,
+                                      std::optional<size_t> lifetime_site)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   bool AddRegion() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  bool AddLifetimeRegion() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   void ReleaseHugepage(FillerType::Tracker* pt)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // Returns backed hugepages to cache_, waking the background worker if their
+  // release is deferred.
+  void ReleaseToCache(HugeRange r) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   // Return an allocation from a single hugepage.
   void DeleteFromHugepage(FillerType::Tracker* pt, PageId p, Length n,
                           bool might_abandon)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   // Finish an allocation request - give it a span and mark it in the pagemap.
-  Span* Finalize(Length n, SpanAllocInfo span_alloc_info, PageId page);
+  // <known_zero> records whether [page, page + n) is known to read as zero.
+  Span* Finalize(Length n, SpanAllocInfo span_alloc_info, PageId page,
+                 bool known_zero);
 
   ABSL_ATTRIBUTE_NO_UNIQUE_ADDRESS Forwarder forwarder_;
 };
@@ -381,15 +713,30 @@ inline HugePageAwareAllocator<Forwarder>::HugePageAwareAllocator(
     : PageAllocatorInterface("HugePageAware", options.tag),
       unback_(*this),
       unback_without_lock_(*this),
-      filler_(options.allocs_for_sparse_and_dense_spans,
+      prefault_without_lock_(*this),
+      collapse_(*this),
+      filler_(options.clock, options.allocs_for_sparse_and_dense_spans,
               options.chunks_per_alloc, unback_),
-      regions_(options.use_huge_region_more_often),
+      regions_(options.use_huge_region_more_often, options.huge_region_alloc),
       vm_allocator_(*this),
       metadata_allocator_(*this),
-      alloc_(vm_allocator_, metadata_allocator_),
-      cache_(HugeCache{&alloc_, metadata_allocator_, unback_without_lock_}) {
+      alloc_(vm_allocator_, metadata_allocator_, options.backing),
+      cache_(HugeCache{&alloc_, metadata_allocator_, unback_without_lock_,
+                       options.clock}),
+      lifetime_allocator_(
+          options.backing == HugeBackingOption::kGigaPages
+              ? LifetimePredictionOption::kDisabled
+              : options.lifetime,
+          options.lifetime_threshold, options.clock) {
   tracker_allocator_.Init(&forwarder_.arena());
   region_allocator_.Init(&forwarder_.arena());
+  lifetime_allocator_.Init(&forwarder_.arena());
+  if (options.cache_group != nullptr) {
+    cache_.JoinGroup(options.cache_group);
+  }
+  if (!options.huge_cache) {
+    cache_.Disable();
+  }
 }
 
 template <class Forwarder>
@@ -409,10 +756,14 @@ inline void HugePageAwareAllocator<Forwarder>::SetTracker(
 
 template <class Forwarder>
 inline PageId HugePageAwareAllocator<Forwarder>::AllocAndContribute(
-    HugePage p, Length n, SpanAllocInfo span_alloc_info, bool donated) {
+    HugePage p, Length n, SpanAllocInfo span_alloc_info, bool donated,
+    bool known_zero, uint8_t partition) {
   CHECK_CONDITION(p.start_addr() != nullptr);
   FillerType::Tracker* pt = tracker_allocator_.New();
   new (pt) FillerType::Tracker(p, donated);
+  if (known_zero) {
+    pt->MarkZero();
+  }
   ASSERT(pt->longest_free_range() >= n);
   ASSERT(pt->was_donated() == donated);
   // if the page was donated, we track its size so that we can potentially
@@ -423,7 +774,7 @@ inline PageId HugePageAwareAllocator<Forwarder>::AllocAndContribute(
   PageId page = pt->Get(n).page;
   ASSERT(page == p.first_page());
   SetTracker(p, pt);
-  filler_.Contribute(pt, donated, span_alloc_info);
+  filler_.Contribute(pt, donated, span_alloc_info, partition);
   ASSERT(pt->was_donated() == donated);
   return page;
 }
@@ -441,44 +792,78 @@ inline PageId HugePageAwareAllocator<Forwarder>::RefillFiller(
   // pages. Otherwise, we're nearly guaranteed to release r (if n
   // isn't very large), and the next allocation will just repeat this
   // process.
-  forwarder_.ShrinkToUsageLimit(n);
-  return AllocAndContribute(r.start(), n, span_alloc_info, /*donated=*/false);
+  forwarder_.ShrinkToUsageLimit(n, tag_);
+  // Ranges fresh from the HugeAllocator have never been used (or have been
+  // released since), so they read as zero.
+  return AllocAndContribute(r.start(), n, span_alloc_info, /*donated=*/false,
+                            /*known_zero=*/*from_released,
+                            forwarder_.filler_partition());
 }
 
 template <class Forwarder>
 inline Span* HugePageAwareAllocator<Forwarder>::Finalize(
-    Length n, SpanAllocInfo span_alloc_info, PageId page)
+    Length n, SpanAllocInfo span_alloc_info, PageId page, bool known_zero)
     ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
   ASSERT(page != PageId{0});
   Span* ret = forwarder_.NewSpan(page, n);
   forwarder_.Set(page, ret);
   ASSERT(!ret->sampled());
+  ret->set_known_zero(known_zero && forwarder_.MemoryIsZeroFilled());
   info_.RecordAlloc(page, n);
-  forwarder_.ShrinkToUsageLimit(n);
+  forwarder_.ShrinkToUsageLimit(n, tag_);
   return ret;
 }
 
-// For anything <= half a huge page, we will unconditionally use the filler
-// to pack it into a single page.  If we need another page, that's fine.
+template <class Forwarder>
+inline bool HugePageAwareAllocator<Forwarder>::FillerFragmented() {
+  const double threshold = forwarder_.filler_fragmentation_region_threshold();
+  if (threshold <= 0) return false;
+  const Length backed = filler_.size().in_pages() - filler_.unmapped_pages();
+  if (backed == Length(0)) return false;
+  return filler_.free_pages().raw_num() >= threshold * backed.raw_num();
+}
+
+// For anything <= half a huge page, we will use the filler to pack it into a
+// single page.  If we need another page, that's fine, unless the filler is
+// already fragmented: then a span of more than a few pages, which its free
+// space could not hold, goes to the regions' free space if there is any,
+// rather than breaking yet another hugepage.
 template <class Forwarder>
 inline Span* HugePageAwareAllocator<Forwarder>::AllocSmall(
     Length n, SpanAllocInfo span_alloc_info, bool* from_released) {
-  auto [pt, page, released] = filler_.TryGet(n, span_alloc_info);
+  auto [pt, page, released, known_zero] =
+      filler_.TryGet(n, span_alloc_info, forwarder_.filler_partition());
   *from_released = released;
   if (ABSL_PREDICT_TRUE(pt != nullptr)) {
-    return Finalize(n, span_alloc_info, page);
+    Span* span = Finalize(n, span_alloc_info, page, known_zero);
+    span->set_low_occupancy_hugepage(pt->used_pages() <
+                                     kPagesPerHugePage / 2);
+    return span;
+  }
+
+  if (n >= kMinRegionRoutedPages && FillerFragmented()) {
+    bool region_known_zero;
+    if (regions_.MaybeGet(n, &page, from_released, &region_known_zero)) {
+      ++region_routed_spans_;
+      return Finalize(n, span_alloc_info, page, region_known_zero);
+    }
   }
 
   page = RefillFiller(n, span_alloc_info, from_released);
   if (ABSL_PREDICT_FALSE(page == PageId{0})) {
     return nullptr;
   }
-  return Finalize(n, span_alloc_info, page);
+  Span* span =
+      Finalize(n, span_alloc_info, page, /*known_zero=*/*from_released);
+  // The hugepage was just added to the filler, for this span alone.
+  span->set_low_occupancy_hugepage(n < kPagesPerHugePage / 2);
+  return span;
 }
 
 template <class Forwarder>
 inline Span* HugePageAwareAllocator<Forwarder>::AllocLarge(
-    Length n, SpanAllocInfo span_alloc_info, bool* from_released) {
+    Length n, SpanAllocInfo span_alloc_info, bool* from_released,
+    std::optional<size_t> lifetime_site) {
   // If it's an exact page multiple, just pull it from pages directly.
   HugeLength hl = HLFromPages(n);
   if (hl.in_pages() == n) {
@@ -488,17 +873,19 @@ inline Span* HugePageAwareAllocator<Forwarder>::AllocLarge(
   PageId page;
   // If we fit in a single hugepage, try the Filler first.
   if (n < kPagesPerHugePage) {
-    auto [pt, page, released] = filler_.TryGet(n, span_alloc_info);
+    auto [pt, page, released, known_zero] =
+        filler_.TryGet(n, span_alloc_info, forwarder_.filler_partition());
     *from_released = released;
     if (ABSL_PREDICT_TRUE(pt != nullptr)) {
-      return Finalize(n, span_alloc_info, page);
+      return Finalize(n, span_alloc_info, page, known_zero);
     }
   }
 
   // If we're using regions in this binary (see below comment), is
   // there currently available space there?
-  if (regions_.MaybeGet(n, &page, from_released)) {
-    return Finalize(n, span_alloc_info, page);
+  bool known_zero;
+  if (regions_.MaybeGet(n, &page, from_released, &known_zero)) {
+    return Finalize(n, span_alloc_info, page, known_zero);
   }
 
   // We have two choices here: allocate a new region or go to
@@ -516,7 +903,8 @@ inline Span* HugePageAwareAllocator<Forwarder>::AllocLarge(
       regions_.UseHugeRegionMoreOften() ? abandoned_pages_ + slack : slack;
   // Don't bother at all until the binary is reasonably sized.
   if (donated < HLFromBytes(64 * 1024 * 1024).in_pages()) {
-    return AllocRawHugepages(n, span_alloc_info, from_released);
+    return AllocRawHugepagesWithLifetime(n, span_alloc_info, from_released,
+                                         lifetime_site);
   }
 
   // In the vast majority of binaries, we have many small allocations which
@@ -527,17 +915,19 @@ inline Span* HugePageAwareAllocator<Forwarder>::AllocLarge(
   // we skip the check.
   const Length small = info_.small();
   if (slack < small && !regions_.UseHugeRegionMoreOften()) {
-    return AllocRawHugepages(n, span_alloc_info, from_released);
+    return AllocRawHugepagesWithLifetime(n, span_alloc_info, from_released,
+                                         lifetime_site);
   }
 
   // We couldn't allocate a new region. They're oversized, so maybe we'd get
   // lucky with a smaller request?
   if (!AddRegion()) {
-    return AllocRawHugepages(n, span_alloc_info, from_released);
+    return AllocRawHugepagesWithLifetime(n, span_alloc_info, from_released,
+                                         lifetime_site);
   }
 
-  CHECK_CONDITION(regions_.MaybeGet(n, &page, from_released));
-  return Finalize(n, span_alloc_info, page);
+  CHECK_CONDITION(regions_.MaybeGet(n, &page, from_released, &known_zero));
+  return Finalize(n, span_alloc_info, page, known_zero);
 }
 
 template <class Forwarder>
@@ -565,19 +955,82 @@ inline Span* HugePageAwareAllocator<Forwarder>::AllocRawHugepages(
   HugePage last = first + r.len() - NHugePages(1);
   if (slack == Length(0)) {
     SetTracker(last, nullptr);
-    return Finalize(total, span_alloc_info, r.start().first_page());
+    return Finalize(total, span_alloc_info, r.start().first_page(),
+                    /*known_zero=*/*from_released);
   }
 
   ++donated_huge_pages_;
 
   Length here = kPagesPerHugePage - slack;
   ASSERT(here > Length(0));
-  AllocAndContribute(last, here, span_alloc_info, /*donated=*/true);
-  Span* span = Finalize(n, span_alloc_info, r.start().first_page());
+  AllocAndContribute(last, here, span_alloc_info, /*donated=*/true,
+                     /*known_zero=*/*from_released);
+  Span* span = Finalize(n, span_alloc_info, r.start().first_page(),
+                        /*known_zero=*/*from_released);
   span->set_donated(/*value=*/true);
   return span;
 }
 
+template <class Forwarder>
+inline Span* HugePageAwareAllocator<Forwarder>::AllocRawHugepagesWithLifetime(
+    Length n, SpanAllocInfo span_alloc_info, bool* from_released,
+    std::optional<size_t> lifetime_site) {
+  LifetimeStats* lifetime = nullptr;
+  if (lifetime_site.has_value()) {
+    lifetime = lifetime_allocator_.LookupSite(*lifetime_site);
+  }
+  if (ABSL_PREDICT_TRUE(lifetime == nullptr)) {
+    return AllocRawHugepages(n, span_alloc_info, from_released);
+  }
+
+  using Prediction = LifetimeStats::Prediction;
+  const Prediction predicted = lifetime->Predict();
+  HugeRegionSet<HugeRegion>& lifetime_regions = lifetime_allocator_.regions();
+  PageId region_page;
+  bool region_released, region_zero;
+  bool in_region = false;
+  if (predicted == Prediction::kShortLived) {
+    in_region = lifetime_regions.MaybeGet(n, &region_page, &region_released,
+                                          &region_zero) ||
+                (AddLifetimeRegion() &&
+                 lifetime_regions.MaybeGet(n, &region_page, &region_released,
+                                           &region_zero));
+  }
+
+  if (in_region) {
+    lifetime_allocator_.RecordRegionAllocation();
+    if (!lifetime_allocator_.counterfactual()) {
+      lifetime_allocator_.tracker().AddAllocation(
+          lifetime_allocator_.AddRegionAllocation(region_page), lifetime,
+          predicted);
+      *from_released = region_released;
+      return Finalize(n, span_alloc_info, region_page, region_zero);
+    }
+  }
+
+  Span* span = AllocRawHugepages(n, span_alloc_info, from_released);
+  if (ABSL_PREDICT_FALSE(span == nullptr)) {
+    if (in_region) {
+      CHECK_CONDITION(lifetime_regions.MaybePut(region_page, n));
+    }
+    lifetime_allocator_.ReleaseSite(lifetime);
+    return nullptr;
+  }
+
+  // We only get here for requests with slack, so the tail hugepage was
+  // donated to the filler and its tracker outlives the allocation.
+  ASSERT(span->donated());
+  FillerType::Tracker* pt = GetTracker(HugePageContaining(span->last_page()));
+  ASSERT(pt != nullptr && pt->was_donated());
+  LifetimeTracker::Tracker* lt = pt->lifetime_tracker();
+  lifetime_allocator_.tracker().AddAllocation(lt, lifetime, predicted);
+  if (in_region) {
+    lt->set_counterfactual_ptr(
+        reinterpret_cast<uintptr_t>(region_page.start_addr()));
+  }
+  return span;
+}
+
 inline static void BackSpan(Span* span) {
   SystemBack(span->start_address(), span->bytes_in_span());
 }
@@ -587,8 +1040,17 @@ template <class Forwarder>
 inline Span* HugePageAwareAllocator<Forwarder>::New(
     Length n, SpanAllocInfo span_alloc_info) {
   CHECK_CONDITION(n > Length(0));
+  // Identify the allocation site of large allocations whose placement would
+  // donate slack to the filler before taking the lock, as unwinding may take
+  // locks of its own.
+  std::optional<size_t> lifetime_site;
+  if (ABSL_PREDICT_FALSE(lifetime_allocator_.enabled()) &&
+      n > kSmallAllocPages && n <= HugeRegion::size().in_pages() &&
+      HLFromPages(n).in_pages() != n) {
+    lifetime_site = LifetimeBasedAllocator::CollectAllocationSite();
+  }
   bool from_released;
-  Span* s = LockAndAlloc(n, span_alloc_info, &from_released);
+  Span* s = LockAndAlloc(n, span_alloc_info, &from_released, lifetime_site);
   if (s) {
     // Prefetch for writing, as we anticipate using the memory soon.
     PrefetchW(s->start_address());
@@ -600,7 +1062,8 @@ inline Span* HugePageAwareAllocator<Forwarder>::New(
 
 template <class Forwarder>
 inline Span* HugePageAwareAllocator<Forwarder>::LockAndAlloc(
-    Length n, SpanAllocInfo span_alloc_info, bool* from_released) {
+    Length n, SpanAllocInfo span_alloc_info, bool* from_released,
+    std::optional<size_t> lifetime_site) {
   AllocationGuardSpinLockHolder h(&pageheap_lock);
   // Our policy depends on size.  For small things, we will pack them
   // into single hugepages.
@@ -611,7 +1074,7 @@ inline Span* HugePageAwareAllocator<Forwarder>::LockAndAlloc(
   // For anything too big for the filler, we use either a direct hugepage
   // allocation, or possibly the regions if we are worried about slack.
   if (n <= HugeRegion::size().in_pages()) {
-    return AllocLarge(n, span_alloc_info, from_released);
+    return AllocLarge(n, span_alloc_info, from_released, lifetime_site);
   }
 
   // In the worst case, we just fall back to directly allocating a run
@@ -619,6 +1082,151 @@ inline Span* HugePageAwareAllocator<Forwarder>::LockAndAlloc(
   return AllocEnormous(n, span_alloc_info, from_released);
 }
 
+// public
+template <class Forwarder>
+inline size_t HugePageAwareAllocator<Forwarder>::NewBatch(
+    Length n, SpanAllocInfo span_alloc_info, absl::Span<Span*> spans) {
+  if (n > kSmallAllocPages) {
+    return PageAllocatorInterface::NewBatch(n, span_alloc_info, spans);
+  }
+  CHECK_CONDITION(n > Length(0));
+
+  // Spans that came from released memory are backed once pageheap_lock is
+  // dropped, so the batch is processed in chunks of bounded size.
+  constexpr size_t kChunk = 32;
+  size_t allocated = 0;
+  while (allocated < spans.size()) {
+    const size_t chunk = std::min(kChunk, spans.size() - allocated);
+    bool from_released[kChunk];
+    size_t got = 0;
+    {
+      AllocationGuardSpinLockHolder h(&pageheap_lock);
+      for (; got < chunk; ++got) {
+        Span* s = AllocSmall(n, span_alloc_info, &from_released[got]);
+        if (ABSL_PREDICT_FALSE(s == nullptr)) break;
+        spans[allocated + got] = s;
+      }
+    }
+    for (size_t i = 0; i < got; ++i) {
+      Span* s = spans[allocated + i];
+      PrefetchW(s->start_address());
+      if (from_released[i]) BackSpan(s);
+      ASSERT(GetMemoryTag(s->start_address()) == tag_);
+    }
+    allocated += got;
+    if (got < chunk) break;
+  }
+  return allocated;
+}
+
+// public
+template <class Forwarder>
+inline bool HugePageAwareAllocator<Forwarder>::TryExtend(Span* span,
+                                                         Length delta) {
+  ASSERT(delta > Length(0));
+  const PageId p = span->first_page();
+  const Length n = span->num_pages();
+  // Donated spans own the start of their hugepage and are accounted for by
+  // the abandonment logic at their original length.
+  if (span->donated() ||
+      HugePageContaining(p) != HugePageContaining(p + n + delta - Length(1))) {
+    return false;
+  }
+
+  bool from_released;
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    FillerType::Tracker* pt = GetTracker(HugePageContaining(p));
+    if (pt == nullptr ||
+        !filler_.TryExtend(pt, p, n, delta, &from_released)) {
+      return false;
+    }
+    info_.RecordFree(p, n);
+    info_.RecordAlloc(p, n + delta);
+    span->set_num_pages(n + delta);
+    forwarder_.ShrinkToUsageLimit(delta, tag_);
+  }
+  if (from_released) {
+    SystemBack((p + n).start_addr(), delta.in_bytes());
+  }
+  return true;
+}
+
+// public
+template <class Forwarder>
+inline bool HugePageAwareAllocator<Forwarder>::TryShrink(Span* span,
+                                                         Length n) {
+  const PageId p = span->first_page();
+  const Length old_n = span->num_pages();
+  ASSERT(Length(0) < n && n < old_n);
+  // Donated spans own the start of their hugepage and are accounted for by
+  // the abandonment logic at their original length.
+  if (span->donated()) return false;
+
+  const HugePage hp = HugePageContaining(p);
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  Length new_n = n;
+  FillerType::Tracker* pt = GetTracker(hp);
+  if (pt != nullptr) {
+    filler_.Shrink(pt, p, old_n, new_n);
+  } else if (!regions_.MaybeShrink(p, old_n, new_n)) {
+    if (lifetime_allocator_.regions().Contains(p)) return false;
+    // Straight from the HugeCache, and not donated, so a whole number of
+    // hugepages.
+    ASSERT(old_n % kPagesPerHugePage == Length(0));
+    const HugeLength keep = HLFromPages(n);
+    const HugeLength hl = HLFromPages(old_n);
+    if (keep >= hl) return false;
+    new_n = keep.in_pages();
+    ReleaseToCache({hp + keep, hl - keep});
+  }
+  info_.RecordFree(p, old_n);
+  info_.RecordAlloc(p, new_n);
+  span->set_num_pages(new_n);
+  return true;
+}
+
+// public
+template <class Forwarder>
+inline bool HugePageAwareAllocator<Forwarder>::TryMove(Span* from, Span* to) {
+  const PageId p = from->first_page();
+  const Length n = from->num_pages();
+  const HugePage hp = HugePageContaining(p);
+  const HugePage to_hp = HugePageContaining(to->first_page());
+  if (from->donated() || hp.first_page() != p ||
+      n % kPagesPerHugePage != Length(0) ||
+      to_hp.first_page() != to->first_page() || to->num_pages() < n) {
+    return false;
+  }
+
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    // Both spans must have come straight from the HugeCache.  Gigapages cannot
+    // be remapped a hugepage at a time.
+    if (alloc_.gigapage_backed() || GetTracker(hp) != nullptr ||
+        GetTracker(to_hp) != nullptr || regions_.Contains(p) ||
+        regions_.Contains(to_hp.first_page()) ||
+        lifetime_allocator_.regions().Contains(p) ||
+        lifetime_allocator_.regions().Contains(to_hp.first_page())) {
+      return false;
+    }
+  }
+
+  if (!forwarder_.MovePages(from->start_address(), to->start_address(),
+                            n.in_bytes(), tag_)) {
+    return false;
+  }
+
+  // Our old range has been replaced by fresh, unbacked memory, so bypass the
+  // cache when freeing it.
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  info_.RecordFree(p, n);
+  forwarder_.DeleteSpan(from);
+  forwarder_.Set(p, nullptr);
+  cache_.ReleaseUnbacked(HugeRange::Make(hp, HLFromPages(n)));
+  return true;
+}
+
 // public
 template <class Forwarder>
 inline Span* HugePageAwareAllocator<Forwarder>::NewAligned(
@@ -627,14 +1235,29 @@ inline Span* HugePageAwareAllocator<Forwarder>::NewAligned(
     return New(n, span_alloc_info);
   }
 
-  // we can do better than this, but...
+  // The start of a hugepage satisfies every alignment we support.
   // TODO(b/134690769): support higher align.
   CHECK_CONDITION(align <= kPagesPerHugePage);
   bool from_released;
   Span* s;
   {
     AllocationGuardSpinLockHolder h(&pageheap_lock);
-    s = AllocRawHugepages(n, span_alloc_info, &from_released);
+    if (n < kPagesPerHugePage) {
+      // Start a fresh hugepage for the filler, as AllocSmall does when no
+      // hugepage has room, so that the rest of it is packed as usual rather
+      // than donated.
+      const PageId page = RefillFiller(n, span_alloc_info, &from_released);
+      s = nullptr;
+      if (ABSL_PREDICT_TRUE(page != PageId{0})) {
+        s = Finalize(n, span_alloc_info, page, /*known_zero=*/from_released);
+        s->set_low_occupancy_hugepage(n < kPagesPerHugePage / 2);
+      }
+    } else {
+      // Whole hugepages come straight from the HugeCache as an exact
+      // HugeRange with no slack, bypassing regions; other lengths donate the
+      // slack of their last hugepage to the filler.
+      s = AllocRawHugepages(n, span_alloc_info, &from_released);
+    }
   }
   if (s && from_released) BackSpan(s);
   ASSERT(!s || GetMemoryTag(s->start_address()) == tag_);
@@ -676,6 +1299,20 @@ inline bool HugePageAwareAllocator<Forwarder>::AddRegion() {
   return true;
 }
 
+template <class Forwarder>
+inline bool HugePageAwareAllocator<Forwarder>::AddLifetimeRegion() {
+  HugeRange r = alloc_.Get(HugeRegion::size());
+  if (!r.valid()) return false;
+  HugeRegion* region = region_allocator_.New();
+  // A counterfactual region only reserves address space; it is never touched.
+  new (region) HugeRegion(
+      r, lifetime_allocator_.counterfactual()
+             ? static_cast<MemoryModifyFunction&>(nil_unback_)
+             : static_cast<MemoryModifyFunction&>(unback_));
+  lifetime_allocator_.regions().Contribute(region);
+  return true;
+}
+
 template <class Forwarder>
 inline void HugePageAwareAllocator<Forwarder>::Delete(Span* span,
                                                       size_t objects_per_span) {
@@ -691,6 +1328,27 @@ inline void HugePageAwareAllocator<Forwarder>::Delete(Span* span,
   // could trigger the check on `span != nullptr` in do_free_pages.
   forwarder_.Set(p, nullptr);
 
+  // Allocations tracked by the lifetime-based allocator outside its region
+  // keep their tracker on the hugepage their slack was donated to.
+  using Prediction = LifetimeStats::Prediction;
+  bool short_lived_donor = false;
+  Prediction donor_prediction = Prediction::kLongLived;
+  if (ABSL_PREDICT_FALSE(might_abandon && lifetime_allocator_.enabled())) {
+    LifetimeTracker::Tracker* lt =
+        GetTracker(HugePageContaining(p + n - Length(1)))->lifetime_tracker();
+    if (lt->is_tracked()) {
+      donor_prediction = lt->predicted();
+      short_lived_donor = lifetime_allocator_.RemoveAllocation(lt) ==
+                          Prediction::kShortLived;
+      if (lt->counterfactual_ptr() != 0) {
+        CHECK_CONDITION(lifetime_allocator_.regions().MaybePut(
+            PageIdContaining(reinterpret_cast<void*>(lt->counterfactual_ptr())),
+            n));
+        lt->set_counterfactual_ptr(0);
+      }
+    }
+  }
+
   // The tricky part, as with so many allocators: where did we come from?
   // There are several possibilities.
   FillerType::Tracker* pt = GetTracker(hp);
@@ -698,13 +1356,25 @@ inline void HugePageAwareAllocator<Forwarder>::Delete(Span* span,
   //    allocation to that hugepage in the filler.
   if (ABSL_PREDICT_TRUE(pt != nullptr)) {
     ASSERT(hp == HugePageContaining(p + n - Length(1)));
+    const Length abandoned_before = abandoned_pages_;
     DeleteFromHugepage(pt, p, n, might_abandon);
+    if (ABSL_PREDICT_FALSE(short_lived_donor) &&
+        abandoned_pages_ > abandoned_before) {
+      lifetime_allocator_.RecordAbandonedByShortLived(
+          abandoned_pages_ - abandoned_before, donor_prediction);
+    }
     return;
   }
 
   // b) We got put into a region, possibly crossing hugepages -
   //    return our allocation to the region.
   if (regions_.MaybePut(p, n)) return;
+  if (ABSL_PREDICT_FALSE(lifetime_allocator_.enabled() &&
+                         !lifetime_allocator_.counterfactual()) &&
+      lifetime_allocator_.regions().MaybePut(p, n)) {
+    lifetime_allocator_.RemoveRegionAllocation(p);
+    return;
+  }
 
   // c) we came straight from the HugeCache - return straight there.  (We
   //    might have had slack put into the filler - if so, return that virtual
@@ -735,6 +1405,10 @@ inline void HugePageAwareAllocator<Forwarder>::Delete(Span* span,
       // filler.
       abandoned_pages_ += pt->abandoned_count();
       pt->set_abandoned(true);
+      if (ABSL_PREDICT_FALSE(short_lived_donor)) {
+        lifetime_allocator_.RecordAbandonedByShortLived(pt->abandoned_count(),
+                                                        donor_prediction);
+      }
     } else {
       // Last page was empty - but if we sub-released it, we still
       // have to split it off and release it independently.)
@@ -754,7 +1428,16 @@ inline void HugePageAwareAllocator<Forwarder>::Delete(Span* span,
       }
     }
   }
-  cache_.Release({hp, hl});
+  ReleaseToCache({hp, hl});
+}
+
+template <class Forwarder>
+inline void HugePageAwareAllocator<Forwarder>::ReleaseToCache(HugeRange r) {
+  const bool async = forwarder_.async_release();
+  cache_.Release(r, async);
+  if (async) {
+    forwarder_.WakeBackgroundRelease(tag_);
+  }
 }
 
 template <class Forwarder>
@@ -767,7 +1450,7 @@ inline void HugePageAwareAllocator<Forwarder>::ReleaseHugepage(
   if (pt->released()) {
     cache_.ReleaseUnbacked(r);
   } else {
-    cache_.Release(r);
+    ReleaseToCache(r);
   }
 
   tracker_allocator_.Delete(pt);
@@ -781,6 +1464,7 @@ inline BackingStats HugePageAwareAllocator<Forwarder>::stats() const {
   stats += cache_.stats();
   stats += filler_.stats();
   stats += regions_.stats();
+  stats += LifetimeRegionStats();
   // the "system" (total managed) byte count is wildly double counted,
   // since it all comes from HugeAllocator but is then managed by
   // cache/regions/filler. Adjust for that.
@@ -815,9 +1499,26 @@ inline void HugePageAwareAllocator<Forwarder>::GetSpanStats(
   alloc_.AddSpanStats(small, large);
   filler_.AddSpanStats(small, large);
   regions_.AddSpanStats(small, large);
+  if (lifetime_allocator_.enabled() && !lifetime_allocator_.counterfactual()) {
+    lifetime_allocator_.regions().AddSpanStats(small, large);
+  }
   cache_.AddSpanStats(small, large);
 }
 
+template <class Forwarder>
+inline BackingStats HugePageAwareAllocator<Forwarder>::LifetimeRegionStats()
+    const {
+  if (ABSL_PREDICT_TRUE(!lifetime_allocator_.enabled())) return {};
+  BackingStats s = lifetime_allocator_.regions().stats();
+  if (lifetime_allocator_.counterfactual()) {
+    // The counterfactual region holds address space taken from alloc_, but
+    // none of it is ever backed.
+    s.free_bytes = 0;
+    s.unmapped_bytes = s.system_bytes;
+  }
+  return s;
+}
+
 // public
 template <class Forwarder>
 inline Length HugePageAwareAllocator<Forwarder>::ReleaseAtLeastNPages(
@@ -825,6 +1526,12 @@ inline Length HugePageAwareAllocator<Forwarder>::ReleaseAtLeastNPages(
   Length released;
   released += cache_.ReleaseCachedPages(HLFromPages(num_pages)).in_pages();
 
+  // Gigapages are only released by HugeCache, once wholly free.
+  if (alloc_.gigapage_backed()) {
+    info_.RecordRelease(num_pages, released);
+    return released;
+  }
+
   // Release all backed-but-free hugepages from HugeRegion.
   // TODO(b/199203282): We release all the free hugepages from HugeRegions when
   // the experiment is enabled. We can also explore releasing only a desired
@@ -840,6 +1547,12 @@ inline Length HugePageAwareAllocator<Forwarder>::ReleaseAtLeastNPages(
   // TODO(b/134690769): make this work, remove the flag guard.
   if (forwarder_.hpaa_subrelease()) {
     if (released < num_pages) {
+      // Pages that demand reached into recently are likely to be needed again;
+      // releasing them lazily spares the faults if so.
+      if (forwarder_.adaptive_madvise_free() &&
+          filler_.ReleaseLikelyReused(num_pages - released)) {
+        release_mode_ = ReleaseMode::kLazy;
+      }
       released += filler_.ReleasePages(
           num_pages - released,
           SkipSubreleaseIntervals{
@@ -847,9 +1560,11 @@ inline Length HugePageAwareAllocator<Forwarder>::ReleaseAtLeastNPages(
               .short_interval =
                   forwarder_.filler_skip_subrelease_short_interval(),
               .long_interval =
-                  forwarder_.filler_skip_subrelease_long_interval()},
+                  forwarder_.filler_skip_subrelease_long_interval(),
+              .predictor = forwarder_.filler_skip_subrelease_predictor()},
           forwarder_.release_partial_alloc_pages(),
           /*hit_limit*/ false);
+      release_mode_ = ReleaseMode::kDefault;
     }
   }
 
@@ -878,12 +1593,170 @@ inline static void BreakdownStatsInPbtxt(PbtxtRegion* hpaa,
   usage.PrintI64("unmapped", s.unmapped_bytes);
 }
 
+template <class Forwarder>
+inline bool HugePageAwareAllocator<Forwarder>::WriteLayout(
+    HugePageLayoutCursor* cursor, HugePageLayoutWriter* out,
+    absl::FunctionRef<size_t(PageId)> size_class) {
+  constexpr size_t kCells = kPagesPerHugePage.raw_num();
+  HugePageLayoutCell cells[kCells];
+  // Appends a record for <r>, with <cells> if <num_cells> is not 0.  Returns
+  // false if <out> is full.
+  auto add = [&](HugePageLayoutSource source, HugeRange r, uint8_t flags,
+                 size_t num_cells) {
+    HugePageLayoutRecord record = {};
+    record.first_page = r.start().first_page().index();
+    record.num_hugepages = r.len().raw_num();
+    record.source = source;
+    record.tag = static_cast<uint8_t>(tag_);
+    record.flags = flags;
+    if (!out->AddRecord(record, absl::MakeSpan(cells, num_cells))) {
+      return false;
+    }
+    cursor->next_page = (r.start() + r.len()).first_page().index();
+    return true;
+  };
+  auto add_size_classes = [&](HugePage hp) {
+    for (size_t i = 0; i < kCells; ++i) {
+      if (HugePageLayoutCellState(cells[i]) == HugePageLayoutPageState::kUsed) {
+        cells[i] = MakeHugePageLayoutCell(
+            HugePageLayoutPageState::kUsed,
+            size_class(hp.first_page() + Length(i)));
+      }
+    }
+  };
+
+  while (cursor->phase == HugePageLayoutCursor::kFiller) {
+    // The filler's lists are not in address order, so each pass over them
+    // picks out the next kBatch hugepages by address.
+    constexpr size_t kBatch = 64;
+    const typename FillerType::Tracker* batch[kBatch];
+    size_t n = 0;
+    auto by_location = [](const typename FillerType::Tracker* a,
+                          const typename FillerType::Tracker* b) {
+      return a->location() < b->location();
+    };
+    filler_.ForEachTracker([&](const typename FillerType::Tracker* pt) {
+      if (pt->location().first_page().index() < cursor->next_page) return;
+      if (n < kBatch) {
+        batch[n++] = pt;
+        std::push_heap(batch, batch + n, by_location);
+      } else if (by_location(pt, batch[0])) {
+        std::pop_heap(batch, batch + n, by_location);
+        batch[n - 1] = pt;
+        std::push_heap(batch, batch + n, by_location);
+      }
+    });
+    std::sort_heap(batch, batch + n, by_location);
+
+    for (size_t i = 0; i < n; ++i) {
+      const typename FillerType::Tracker* pt = batch[i];
+      const PageId first = pt->location().first_page();
+      auto mark = [&](HugePageLayoutPageState state) {
+        return [&cells, first, state](PageId p, Length len) {
+          std::fill_n(cells + (p - first).raw_num(), len.raw_num(),
+                      MakeHugePageLayoutCell(state));
+        };
+      };
+      std::fill_n(cells, kCells,
+                  MakeHugePageLayoutCell(HugePageLayoutPageState::kUsed));
+      pt->IterBackedFreeRanges(mark(HugePageLayoutPageState::kFree));
+      pt->IterReleasedRanges(mark(HugePageLayoutPageState::kReleased));
+      add_size_classes(pt->location());
+      if (!add(HugePageLayoutSource::kFiller,
+               HugeRange::Make(pt->location(), NHugePages(1)),
+               pt->donated() ? kHugePageLayoutDonated : 0, kCells)) {
+        return true;
+      }
+    }
+    if (n < kBatch) {
+      cursor->phase = HugePageLayoutCursor::kRegions;
+      cursor->next_page = 0;
+    }
+  }
+
+  while (cursor->phase == HugePageLayoutCursor::kRegions) {
+    const HugeRegion* next = nullptr;
+    regions_.ForEach([&](const HugeRegion& region) {
+      const HugeRange r = region.location();
+      if ((r.start() + r.len()).first_page().index() <= cursor->next_page) {
+        return;
+      }
+      if (next == nullptr || r.start() < next->location().start()) {
+        next = &region;
+      }
+    });
+    if (next == nullptr) {
+      cursor->phase = HugePageLayoutCursor::kCache;
+      cursor->next_page = 0;
+      break;
+    }
+
+    const HugeRange r = next->location();
+    for (size_t i = 0; i < HugeRegion::kNumHugePages; ++i) {
+      const HugePage hp = r.start() + NHugePages(i);
+      if (hp.first_page().index() < cursor->next_page) continue;
+      const bool backed = next->GetPageStates(i, cells);
+      add_size_classes(hp);
+      if (!add(HugePageLayoutSource::kRegion,
+               HugeRange::Make(hp, NHugePages(1)),
+               backed ? 0 : kHugePageLayoutUnbacked, kCells)) {
+        return true;
+      }
+    }
+  }
+
+  while (cursor->phase == HugePageLayoutCursor::kCache ||
+         cursor->phase == HugePageLayoutCursor::kPendingCache) {
+    const bool pending_phase =
+        cursor->phase == HugePageLayoutCursor::kPendingCache;
+    bool full = false;
+    cache_.ForEachRange([&](HugeRange r, bool pending) {
+      if (full || pending != pending_phase ||
+          r.start().first_page().index() < cursor->next_page) {
+        return;
+      }
+      full = !add(HugePageLayoutSource::kCache, r,
+                  pending ? kHugePageLayoutPendingRelease : 0, 0);
+    });
+    if (full) return true;
+    cursor->phase = pending_phase ? HugePageLayoutCursor::kDone
+                                  : HugePageLayoutCursor::kPendingCache;
+    cursor->next_page = 0;
+  }
+  return false;
+}
+
 // public
 template <class Forwarder>
 inline void HugePageAwareAllocator<Forwarder>::Print(Printer* out) {
   Print(out, true);
 }
 
+template <class Forwarder>
+inline size_t HugePageAwareAllocator<Forwarder>::ReleaseResidentUnbacked(
+    size_t n, Residency& residency) {
+  auto resident_bytes = [&](void* start,
+                            size_t len) -> std::optional<size_t> {
+    std::optional<Residency::Info> info = residency.Get(start, len);
+    if (!info.has_value()) return std::nullopt;
+    return info->bytes_resident;
+  };
+  size_t released = filler_.ScanReleasedResidency(
+      n, [&](PageId p, Length len) {
+        return resident_bytes(p.start_addr(), len.in_bytes());
+      });
+  released += regions_.ReleaseResidentUnbacked(
+      NHugePages(n), [&](HugeRange r) {
+        return resident_bytes(r.start_addr(), r.byte_len());
+      });
+  released += alloc_.ReleaseResidentFree(
+      NHugePages(n),
+      [&](HugeRange r) { return resident_bytes(r.start_addr(), r.byte_len()); },
+      [&](HugeRange r) { return unback_(r.start_addr(), r.byte_len()); });
+  resident_unbacked_bytes_ += released;
+  return released;
+}
+
 template <class Forwarder>
 inline void HugePageAwareAllocator<Forwarder>::Print(Printer* out,
                                                      bool everything) {
@@ -905,6 +1778,13 @@ inline void HugePageAwareAllocator<Forwarder>::Print(Printer* out,
   auto rstats = regions_.stats();
   BreakdownStats(out, rstats, "HugePageAware: region  ");
 
+  // The lifetime region is carved from alloc_ just like the regions.
+  auto lstats = LifetimeRegionStats();
+  if (lifetime_allocator_.enabled()) {
+    BreakdownStats(out, lstats, "HugePageAware: lifetime");
+  }
+  rstats += lstats;
+
   auto cstats = cache_.stats();
   // Everything in the filler came from the cache -
   // adjust the totals so we see the amount used by the mutator.
@@ -922,6 +1802,13 @@ inline void HugePageAwareAllocator<Forwarder>::Print(Printer* out,
       "HugePageAware: filler donations %zu (%zu pages from abandoned "
       "donations)\n",
       donated_huge_pages_.raw_num(), abandoned_pages_.raw_num());
+  out->printf(
+      "HugePageAware: %zu MiB of released memory found resident and released "
+      "again\n",
+      resident_unbacked_bytes_ >> 20);
+  out->printf(
+      "HugePageAware: %zu spans routed to regions from a fragmented filler\n",
+      region_routed_spans_);
 
   // Component debug output
   // Filler is by far the most important; print (some) of it
@@ -931,6 +1818,10 @@ inline void HugePageAwareAllocator<Forwarder>::Print(Printer* out,
   if (everything) {
     regions_.Print(out);
     out->printf("\n");
+    if (lifetime_allocator_.enabled()) {
+      lifetime_allocator_.Print(out);
+      out->printf("\n");
+    }
     cache_.Print(out);
     alloc_.Print(out);
     out->printf("\n");
@@ -941,8 +1832,16 @@ inline void HugePageAwareAllocator<Forwarder>::Print(Printer* out,
 
   out->printf("PARAMETER use_huge_region_more_often %d\n",
               regions_.UseHugeRegionMoreOften() ? 1 : 0);
+  out->printf("PARAMETER huge_region_prefer_dense %d\n",
+              regions_.PreferDenseRegions() ? 1 : 0);
   out->printf("PARAMETER hpaa_subrelease %d\n",
               forwarder_.hpaa_subrelease() ? 1 : 0);
+  out->printf("PARAMETER hpaa_gigapage_backing %d\n",
+              alloc_.gigapage_backed() ? 1 : 0);
+  if (alloc_.gigapage_backed()) {
+    out->printf("HugePageAware: %zu gigapage backing failures\n",
+                gigapage_backing_failures_);
+  }
 }
 
 template <class Forwarder>
@@ -959,6 +1858,7 @@ inline void HugePageAwareAllocator<Forwarder>::PrintInPbtxt(
     hpaa.PrintBool("using_hpaa_subrelease", forwarder_.hpaa_subrelease());
     hpaa.PrintBool("use_huge_region_more_often",
                    regions_.UseHugeRegionMoreOften());
+    hpaa.PrintBool("huge_region_prefer_dense", regions_.PreferDenseRegions());
 
     // Fill HPAA Usage
     auto fstats = filler_.stats();
@@ -967,6 +1867,12 @@ inline void HugePageAwareAllocator<Forwarder>::PrintInPbtxt(
     auto rstats = regions_.stats();
     BreakdownStatsInPbtxt(&hpaa, rstats, "region_usage");
 
+    auto lstats = LifetimeRegionStats();
+    if (lifetime_allocator_.enabled()) {
+      BreakdownStatsInPbtxt(&hpaa, lstats, "lifetime_region_usage");
+    }
+    rstats += lstats;
+
     auto cstats = cache_.stats();
     // Everything in the filler came from the cache -
     // adjust the totals so we see the amount used by the mutator.
@@ -982,6 +1888,9 @@ inline void HugePageAwareAllocator<Forwarder>::PrintInPbtxt(
 
     filler_.PrintInPbtxt(&hpaa);
     regions_.PrintInPbtxt(&hpaa);
+    if (lifetime_allocator_.enabled()) {
+      lifetime_allocator_.PrintInPbtxt(&hpaa);
+    }
     cache_.PrintInPbtxt(&hpaa);
     alloc_.PrintInPbtxt(&hpaa);
 
@@ -990,14 +1899,39 @@ inline void HugePageAwareAllocator<Forwarder>::PrintInPbtxt(
 
     hpaa.PrintI64("filler_donated_huge_pages", donated_huge_pages_.raw_num());
     hpaa.PrintI64("filler_abandoned_pages", abandoned_pages_.raw_num());
+    hpaa.PrintI64("gigapage_backing_failures", gigapage_backing_failures_);
+    hpaa.PrintI64("resident_unbacked_bytes", resident_unbacked_bytes_);
+    hpaa.PrintI64("region_routed_spans", region_routed_spans_);
   }
 }
 
 template <class Forwarder>
 inline AddressRange HugePageAwareAllocator<Forwarder>::AllocAndReport(
-    size_t bytes, size_t align) {
+    size_t bytes, size_t align) ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  // Growing the heap reserves address space (possibly through a custom
+  // AddressRegionFactory) and may back gigapages, none of which touches state
+  // guarded by pageheap_lock.  Drop the lock so that span allocation for small
+  // objects does not queue behind those system calls.  We are only called
+  // from HugeAllocator::Get, which looks up its free ranges again once we
+  // return, and its callers have not modified anything yet.
+#ifndef NDEBUG
+  pageheap_lock.AssertHeld();
+#endif  // NDEBUG
+  pageheap_lock.Unlock();
   auto ret = forwarder_.AllocatePages(bytes, align, tag_);
+  bool gigapage_backing_failed = false;
+  if (ret.ptr != nullptr && alloc_.gigapage_backed()) {
+    const HugeRange gigapages = GigaPageInterior(
+        HugeRange::Make(HugePageContaining(ret.ptr), HLFromBytes(ret.bytes)));
+    gigapage_backing_failed =
+        gigapages.valid() &&
+        !forwarder_.BackGigaPages(gigapages.start_addr(), gigapages.byte_len(),
+                                  tag_);
+  }
+  pageheap_lock.Lock();
+
   if (ret.ptr == nullptr) return ret;
+  if (gigapage_backing_failed) ++gigapage_backing_failures_;
   const PageId page = PageIdContaining(ret.ptr);
   const Length page_len = BytesToLengthFloor(ret.bytes);
   forwarder_.Ensure(page, page_len);
@@ -1013,6 +1947,11 @@ HugePageAwareAllocator<Forwarder>::ReleaseAtLeastNPagesBreakingHugepages(
   // filler.
 
   Length released;
+  if (alloc_.gigapage_backed()) {
+    // Breaking gigapages is not possible; the filler and regions cannot
+    // release anything (see Unback).
+    return released;
+  }
   if (regions_.UseHugeRegionMoreOften()) {
     // We try to release as many free hugepages from HugeRegion as possible.
     released += regions_.ReleasePages(/*release_fraction=*/1.0);
@@ -1024,6 +1963,10 @@ HugePageAwareAllocator<Forwarder>::ReleaseAtLeastNPagesBreakingHugepages(
   released += filler_.ReleasePages(n - released, SkipSubreleaseIntervals{},
                                    /*release_partial_alloc_pages=*/false,
                                    /*hit_limit=*/true);
+  if (released < n) {
+    // As a last resort, break up the partially used hugepages of the regions.
+    released += regions_.ReleasePartialHugepages(n - released);
+  }
   return released;
 }
 
@@ -0,0 +1,218 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/base/internal/spinlock.h"
+#include "absl/random/bit_gen_ref.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/huge_page_aware_allocator.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using huge_page_allocator_internal::HugePageAwareAllocatorOptions;
+
+// HugePageAwareAllocator can't be destroyed cleanly, so it is constructed once
+// and leaked.
+HugePageAwareAllocator& GetAllocator() {
+  static HugePageAwareAllocator* allocator = [] {
+    void* p = malloc(sizeof(HugePageAwareAllocator));
+    HugePageAwareAllocatorOptions options;
+    options.tag = MemoryTag::kNormal;
+    return new (p) HugePageAwareAllocator(options);
+  }();
+  return *allocator;
+}
+
+// Estimates how busy pageheap_lock is by trying to take it every few
+// microseconds from a thread of its own.
+class PageHeapLockProbe {
+ public:
+  PageHeapLockProbe()
+      : thread_([this] {
+          while (!stop_.load(std::memory_order_relaxed)) {
+            if (pageheap_lock.TryLock()) {
+              pageheap_lock.Unlock();
+            } else {
+              ++busy_;
+            }
+            ++samples_;
+            absl::SleepFor(absl::Microseconds(20));
+          }
+        }) {}
+
+  // Stops sampling and returns the fraction of samples that found the lock
+  // held.
+  double Stop() {
+    stop_.store(true, std::memory_order_relaxed);
+    thread_.join();
+    return samples_ > 0 ? static_cast<double>(busy_) / samples_ : 0;
+  }
+
+ private:
+  std::atomic<bool> stop_{false};
+  int64_t busy_ = 0;
+  int64_t samples_ = 0;
+  std::thread thread_;
+};
+
+// Even threads allocate and free single-page spans, as the central freelists
+// do; odd threads allocate and free spans of a few hugepages, as large
+// allocations do.  Both contend for pageheap_lock, so throughput as threads
+// are added shows how much small-object span allocation is held up by large
+// allocations.
+void BM_MixedSmallAndLarge(benchmark::State& state) {
+  const bool large = state.thread_index() % 2 == 1;
+  const int kBatch = large ? 4 : 64;
+  const Length n =
+      large ? NHugePages(2).in_pages() + Length(1) : Length(1);
+  const SpanAllocInfo info = {1, AccessDensityPrediction::kSparse};
+  HugePageAwareAllocator& allocator = GetAllocator();
+
+  std::vector<Span*> spans(kBatch);
+  for (auto s : state) {
+    for (Span*& span : spans) {
+      span = allocator.New(n, info);
+      CHECK_CONDITION(span != nullptr);
+    }
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (Span* span : spans) {
+      allocator.Delete(span, info.objects_per_span);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+
+BENCHMARK(BM_MixedSmallAndLarge)->ThreadRange(1, 64)->UseRealTime();
+
+// The span sizes of BM_NewDelete, each exercising a different path.
+enum Mix {
+  // Single pages, packed by the filler.
+  kSinglePage,
+  // The largest spans the filler takes.
+  kLargestFilled,
+  // A hugepage and a half: a run of hugepages whose tail is donated to the
+  // filler, or a region.
+  kPartialHugepages,
+  // Whole hugepages, recycled through the HugeCache.
+  kWholeHugepages,
+  // Mostly small spans with a tail of large ones, as a server's page heap
+  // sees.
+  kRealistic,
+};
+
+Length RandomLength(Mix mix, absl::BitGenRef rng) {
+  constexpr Length kMaxFilled = kPagesPerHugePage / 2;
+  switch (mix) {
+    case kSinglePage:
+      return Length(1);
+    case kLargestFilled:
+      return kMaxFilled;
+    case kPartialHugepages:
+      return kPagesPerHugePage + kPagesPerHugePage / 2;
+    case kWholeHugepages:
+      return NHugePages(4).in_pages();
+    case kRealistic:
+      break;
+  }
+  const double p = absl::Uniform(rng, 0.0, 1.0);
+  if (p < 0.9) return Length(absl::LogUniform<size_t>(rng, 1, 8));
+  if (p < 0.99) {
+    return Length(absl::LogUniform<size_t>(rng, 9, kMaxFilled.raw_num()));
+  }
+  return Length(absl::LogUniform<size_t>(
+      rng, kMaxFilled.raw_num() + 1, NHugePages(8).in_pages().raw_num()));
+}
+
+// Each thread keeps a set of live spans and, every iteration, frees a random
+// one and allocates a replacement, sized by the mix given as the argument.
+//
+// Besides throughput, reports lock_busy, the fraction of the time
+// pageheap_lock was held, and lock_hold_ns, the mean time it was held per
+// acquisition, taking each New and Delete to acquire it once.  Both are
+// estimates from sampling.
+void BM_NewDelete(benchmark::State& state) {
+  constexpr size_t kLiveSpans = 64;
+  const Mix mix = static_cast<Mix>(state.range(0));
+  const SpanAllocInfo info = {1, AccessDensityPrediction::kSparse};
+  HugePageAwareAllocator& allocator = GetAllocator();
+  absl::InsecureBitGen rng;
+
+  std::vector<Span*> live(kLiveSpans);
+  for (Span*& span : live) {
+    span = allocator.New(RandomLength(mix, rng), info);
+    CHECK_CONDITION(span != nullptr);
+  }
+
+  std::optional<PageHeapLockProbe> probe;
+  if (state.thread_index() == 0) probe.emplace();
+  const absl::Time start = absl::Now();
+  for (auto s : state) {
+    Span*& span = live[absl::Uniform<size_t>(rng, 0, kLiveSpans)];
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      allocator.Delete(span, info.objects_per_span);
+    }
+    span = allocator.New(RandomLength(mix, rng), info);
+    CHECK_CONDITION(span != nullptr);
+  }
+  if (probe.has_value()) {
+    const absl::Duration elapsed = absl::Now() - start;
+    const double busy = probe->Stop();
+    const int64_t acquisitions = 2 * state.iterations() * state.threads();
+    state.counters["lock_busy"] = busy;
+    state.counters["lock_hold_ns"] =
+        acquisitions > 0
+            ? busy * absl::ToDoubleNanoseconds(elapsed) / acquisitions
+            : 0;
+  }
+
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  for (Span* span : live) {
+    allocator.Delete(span, info.objects_per_span);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_NewDelete)
+    ->ArgName("mix")
+    ->DenseRange(kSinglePage, kRealistic)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
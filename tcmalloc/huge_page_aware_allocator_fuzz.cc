@@ -29,6 +29,7 @@
 #include "tcmalloc/huge_region.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/lifetime_based_allocator.h"
 #include "tcmalloc/mock_huge_page_static_forwarder.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/sizemap.h"
@@ -47,6 +48,7 @@ using tcmalloc::tcmalloc_internal::kNumaPartitions;
 using tcmalloc::tcmalloc_internal::kPagesPerHugePage;
 using tcmalloc::tcmalloc_internal::kTop;
 using tcmalloc::tcmalloc_internal::Length;
+using tcmalloc::tcmalloc_internal::LifetimePredictionOption;
 using tcmalloc::tcmalloc_internal::MemoryTag;
 using tcmalloc::tcmalloc_internal::pageheap_lock;
 using tcmalloc::tcmalloc_internal::PbtxtRegion;
@@ -116,7 +118,13 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
       data[5] >= 128 ? HugePageFillerAllocsOption::kUnifiedAllocs
                      : HugePageFillerAllocsOption::kSeparateAllocs;
 
-  // data[6:12] - Reserve additional bytes for any features we might want to add
+  constexpr LifetimePredictionOption kLifetimeOptions[] = {
+      LifetimePredictionOption::kDisabled, LifetimePredictionOption::kEnabled,
+      LifetimePredictionOption::kCounterfactual};
+  const LifetimePredictionOption lifetime_option =
+      kLifetimeOptions[data[6] % 3];
+
+  // data[7:12] - Reserve additional bytes for any features we might want to add
   // in the future.
   data += 13;
   size -= 13;
@@ -128,6 +136,7 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
   options.tag = tag;
   options.use_huge_region_more_often = huge_region_option;
   options.allocs_for_sparse_and_dense_spans = allocs_option;
+  options.lifetime = lifetime_option;
   HugePageAwareAllocator<FakeStaticForwarder>* allocator;
   allocator = new (p) HugePageAwareAllocator<FakeStaticForwarder>(options);
   auto& forwarder = allocator->forwarder();
@@ -34,6 +34,7 @@
 #include "gtest/gtest.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/internal/sysinfo.h"
+#include "absl/base/macros.h"
 #include "absl/base/optimization.h"
 #include "absl/container/flat_hash_map.h"
 #include "absl/flags/flag.h"
@@ -50,10 +51,15 @@
 #include "absl/time/time.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/huge_page_layout.h"
 #include "tcmalloc/huge_pages.h"
+#include "tcmalloc/huge_region.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/lifetime_predictions.h"
+#include "tcmalloc/internal/lifetime_tracker.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/lifetime_based_allocator.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/page_allocator_test_util.h"
 #include "tcmalloc/pages.h"
@@ -306,6 +312,146 @@ TEST_P(HugePageAwareAllocatorTest, JustUnderMultipleOfHugepages) {
   }
 }
 
+TEST_P(HugePageAwareAllocatorTest, NewBatch) {
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kSparse};
+  for (const Length n : {Length(2), kPagesPerHugePage + Length(1)}) {
+    Span* spans[8];
+    {
+      absl::base_internal::SpinLockHolder h(&lock_);
+      ASSERT_EQ(allocator_->NewBatch(n, kSpanInfo, absl::MakeSpan(spans)),
+                ABSL_ARRAYSIZE(spans));
+      for (Span* span : spans) {
+        EXPECT_EQ(span->num_pages(), n);
+        CHECK_CONDITION(ids_.insert({span, next_id_++}).second);
+        total_ += n;
+      }
+      CheckStats();
+    }
+    if (n <= kPagesPerHugePage / 2) {
+      // Small spans of a batch are carved from the same hugepage.
+      for (Span* span : spans) {
+        EXPECT_EQ(HugePageContaining(span->first_page()),
+                  HugePageContaining(spans[0]->first_page()));
+      }
+    }
+    for (Span* span : spans) {
+      Delete(span, kSpanInfo.objects_per_span);
+    }
+  }
+}
+
+TEST_P(HugePageAwareAllocatorTest, TryExtend) {
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kSparse};
+  Span* a = New(Length(1), kSpanInfo);
+  Span* b = New(Length(1), kSpanInfo);
+  ASSERT_EQ(b->first_page(), a->first_page() + Length(1));
+
+  auto try_extend = [&](Span* span, Length delta) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    if (!allocator_->TryExtend(span, delta)) return false;
+    total_ += delta;
+    CheckStats();
+    return true;
+  };
+
+  // a is followed by b.
+  EXPECT_FALSE(try_extend(a, Length(1)));
+  EXPECT_EQ(a->num_pages(), Length(1));
+
+  // b is followed by free pages, but only up to the end of its hugepage.
+  EXPECT_TRUE(try_extend(b, Length(3)));
+  EXPECT_EQ(b->num_pages(), Length(4));
+  EXPECT_FALSE(try_extend(b, kPagesPerHugePage));
+  EXPECT_EQ(b->num_pages(), Length(4));
+
+  // The grown pages are no longer handed out.
+  Span* c = New(Length(1), kSpanInfo);
+  EXPECT_EQ(c->first_page(), b->first_page() + Length(4));
+
+  Delete(a, kSpanInfo.objects_per_span);
+  Delete(b, kSpanInfo.objects_per_span);
+  Delete(c, kSpanInfo.objects_per_span);
+}
+
+TEST_P(HugePageAwareAllocatorTest, TryMoveRejectsPackedSpans) {
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kSparse};
+  Span* small = New(Length(1), kSpanInfo);
+  Span* donor = New(kPagesPerHugePage + Length(1), kSpanInfo);
+  Span* large = New(2 * kPagesPerHugePage, kSpanInfo);
+
+  // Only whole hugepages can be remapped, and only into a span large enough to
+  // hold them.
+  EXPECT_FALSE(allocator_->TryMove(small, large));
+  EXPECT_FALSE(allocator_->TryMove(donor, large));
+  EXPECT_FALSE(allocator_->TryMove(large, donor));
+  EXPECT_FALSE(allocator_->TryMove(large, small));
+  CheckStats();
+
+  Delete(small, kSpanInfo.objects_per_span);
+  Delete(donor, kSpanInfo.objects_per_span);
+  Delete(large, kSpanInfo.objects_per_span);
+}
+
+TEST_P(HugePageAwareAllocatorTest, NewAligned) {
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kSparse};
+  auto new_aligned = [&](Length n, Length align) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    Span* span = allocator_->NewAligned(n, align, kSpanInfo);
+    CHECK_CONDITION(span != nullptr);
+    EXPECT_EQ(span->first_page().index() % align.raw_num(), 0);
+    total_ += span->num_pages();
+    CheckStats();
+    CHECK_CONDITION(ids_.insert({span, next_id_++}).second);
+    return span;
+  };
+
+  // Whole hugepages are an exact hugepage-aligned range.
+  Span* a = new_aligned(2 * kPagesPerHugePage, kPagesPerHugePage);
+  EXPECT_EQ(a->num_pages(), 2 * kPagesPerHugePage);
+  EXPECT_FALSE(a->donated());
+
+  // Smaller spans start a hugepage, whose remainder is packed as usual.
+  Span* b = new_aligned(Length(3), kPagesPerHugePage);
+  EXPECT_EQ(b->num_pages(), Length(3));
+  EXPECT_FALSE(b->donated());
+  Span* c = New(Length(1), kSpanInfo);
+  EXPECT_EQ(c->first_page(), b->first_page() + Length(3));
+
+  Delete(a, kSpanInfo.objects_per_span);
+  Delete(b, kSpanInfo.objects_per_span);
+  Delete(c, kSpanInfo.objects_per_span);
+}
+
+TEST_P(HugePageAwareAllocatorTest, TryShrink) {
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kSparse};
+  auto try_shrink = [&](Span* span, Length n) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    const Length old_n = span->num_pages();
+    if (!allocator_->TryShrink(span, n)) return false;
+    total_ -= old_n - span->num_pages();
+    CheckStats();
+    return true;
+  };
+
+  // A span packed by the filler returns its tail pages to its hugepage.
+  Span* a = New(Length(4), kSpanInfo);
+  EXPECT_TRUE(try_shrink(a, Length(1)));
+  EXPECT_EQ(a->num_pages(), Length(1));
+  Span* b = New(Length(3), kSpanInfo);
+  EXPECT_EQ(b->first_page(), a->first_page() + Length(1));
+
+  // A span of hugepages keeps at least the hugepages covering its new length.
+  const Length large = 4 * kPagesPerHugePage;
+  Span* c = New(large, kSpanInfo);
+  EXPECT_TRUE(try_shrink(c, kPagesPerHugePage + Length(1)));
+  EXPECT_GE(c->num_pages(), kPagesPerHugePage + Length(1));
+  EXPECT_LE(c->num_pages(), 2 * kPagesPerHugePage);
+
+  Delete(a, kSpanInfo.objects_per_span);
+  Delete(b, kSpanInfo.objects_per_span);
+  Delete(c, kSpanInfo.objects_per_span);
+}
+
 TEST_P(HugePageAwareAllocatorTest, Multithreaded) {
   static const size_t kThreads = 16;
   std::vector<std::thread> threads;
@@ -390,6 +536,62 @@ TEST_P(HugePageAwareAllocatorTest, ReleasingSmall) {
       old_skip_subrelease_long_interval);
 }
 
+TEST_P(HugePageAwareAllocatorTest, AdaptiveMadviseFree) {
+  const bool old_subrelease = Parameters::hpaa_subrelease();
+  Parameters::set_hpaa_subrelease(true);
+  const bool old_adaptive = Parameters::adaptive_madvise_free();
+  Parameters::set_adaptive_madvise_free(true);
+  const absl::Duration old_skip_subrelease_interval =
+      Parameters::filler_skip_subrelease_interval();
+  Parameters::set_filler_skip_subrelease_interval(absl::ZeroDuration());
+  const absl::Duration old_skip_subrelease_short_interval =
+      Parameters::filler_skip_subrelease_short_interval();
+  Parameters::set_filler_skip_subrelease_short_interval(absl::ZeroDuration());
+  const absl::Duration old_skip_subrelease_long_interval =
+      Parameters::filler_skip_subrelease_long_interval();
+  Parameters::set_filler_skip_subrelease_long_interval(absl::ZeroDuration());
+  SetSystemMemoryPressure(false);
+
+  // Demand peaked just now at twice what remains, so what the filler releases
+  // is likely to be needed again, and is released lazily.
+  std::vector<Span*> live, dead;
+  static const size_t N = kPagesPerHugePage.raw_num() * 128;
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kSparse};
+  for (int i = 0; i < N; ++i) {
+    Span* span = New(Length(1), kSpanInfo);
+    ((i % 2 == 0) ? live : dead).push_back(span);
+  }
+  for (auto d : dead) {
+    Delete(d, kSpanInfo.objects_per_span);
+  }
+
+  const size_t lazy = SystemLazyReleasedBytes();
+  const Length released = ReleasePages(Length(1));
+  EXPECT_EQ(kPagesPerHugePage / 2, released);
+#ifdef MADV_FREE
+  EXPECT_EQ(SystemLazyReleasedBytes(), lazy + released.in_bytes());
+#endif
+
+  // Under memory pressure, releases are eager regardless.
+  SetSystemMemoryPressure(true);
+  const size_t lazy_before_pressure = SystemLazyReleasedBytes();
+  EXPECT_EQ(kPagesPerHugePage / 2, ReleasePages(Length(1)));
+  EXPECT_EQ(SystemLazyReleasedBytes(), lazy_before_pressure);
+  SetSystemMemoryPressure(false);
+
+  for (auto l : live) {
+    Delete(l, kSpanInfo.objects_per_span);
+  }
+
+  Parameters::set_hpaa_subrelease(old_subrelease);
+  Parameters::set_adaptive_madvise_free(old_adaptive);
+  Parameters::set_filler_skip_subrelease_interval(old_skip_subrelease_interval);
+  Parameters::set_filler_skip_subrelease_short_interval(
+      old_skip_subrelease_short_interval);
+  Parameters::set_filler_skip_subrelease_long_interval(
+      old_skip_subrelease_long_interval);
+}
+
 TEST_P(HugePageAwareAllocatorTest, HardReleaseSmall) {
   std::vector<Span*> live, dead;
   static const size_t N = kPagesPerHugePage.raw_num() * 128;
@@ -575,6 +777,90 @@ TEST_P(HugePageAwareAllocatorTest, UseHugeRegion) {
   }
 }
 
+TEST_P(HugePageAwareAllocatorTest, FragmentedFillerUsesRegion) {
+  // This test verifies that a mid-size span that fits in none of the filler's
+  // hugepages is placed in a region's free space rather than on a new filler
+  // hugepage, once enough of the filler is free.
+  const double old_threshold =
+      Parameters::filler_fragmentation_region_threshold();
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kSparse};
+  static constexpr Length kLargeSize = kPagesPerHugePage + Length(1);
+  static constexpr Length kMidSize = kPagesPerHugePage / 4;
+
+  auto RegionUsedBytes = [&]() {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    const BackingStats stats = allocator_->region().stats();
+    return stats.system_bytes - stats.free_bytes - stats.unmapped_bytes;
+  };
+  auto FillerHugePages = [&]() {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    return allocator_->FillerStats().system_bytes / kHugePageSize;
+  };
+
+  // With over 64MB of slack and no small allocations to fill it, the next
+  // large allocation creates a region.
+  std::vector<Span*> large_spans;
+  const Length slack_needed = HLFromBytes(64 * 1024 * 1024).in_pages();
+  Length slack;
+  while (slack <= slack_needed) {
+    large_spans.push_back(New(kLargeSize, kSpanInfo));
+    slack += kPagesPerHugePage - Length(1);
+  }
+  large_spans.push_back(New(kLargeSize, kSpanInfo));
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    ASSERT_EQ(allocator_->region().ActiveRegions(), 1);
+  }
+  for (auto l : large_spans) {
+    Delete(l, kSpanInfo.objects_per_span);
+  }
+  ASSERT_EQ(RegionUsedBytes(), 0);
+
+  // Fill a few hugepages and free every other page of them, so that half of
+  // the filler is free but no two free pages are adjacent.
+  std::vector<Span*> live, dead;
+  for (Length i; i < 4 * kPagesPerHugePage; ++i) {
+    Span* span = New(Length(1), kSpanInfo);
+    (i.raw_num() % 2 == 0 ? live : dead).push_back(span);
+  }
+  for (auto d : dead) {
+    Delete(d, kSpanInfo.objects_per_span);
+  }
+  const size_t filler_hugepages = FillerHugePages();
+
+  // Without the threshold, the filler takes a new hugepage.
+  Parameters::set_filler_fragmentation_region_threshold(0);
+  Span* filler_span = New(kMidSize, kSpanInfo);
+  EXPECT_EQ(FillerHugePages(), filler_hugepages + 1);
+  EXPECT_EQ(RegionUsedBytes(), 0);
+
+  // Once the new hugepage is full, the filler is still more than a third free.
+  Span* filler_rest = New(kPagesPerHugePage - kMidSize, kSpanInfo);
+  Parameters::set_filler_fragmentation_region_threshold(0.3);
+  Span* region_span = New(kMidSize, kSpanInfo);
+  EXPECT_EQ(FillerHugePages(), filler_hugepages + 1);
+  EXPECT_EQ(RegionUsedBytes(), kMidSize.in_bytes());
+  EXPECT_THAT(PrintInPbtxt(), HasSubstr("region_routed_spans: 1"));
+
+  // Smaller spans, which fit in the filler's free space, stay in the filler.
+  Span* small = New(Length(1), kSpanInfo);
+  EXPECT_EQ(RegionUsedBytes(), kMidSize.in_bytes());
+
+  // Beyond the threshold, the filler grows again.
+  Parameters::set_filler_fragmentation_region_threshold(0.9);
+  Span* filler_span2 = New(kMidSize, kSpanInfo);
+  EXPECT_EQ(FillerHugePages(), filler_hugepages + 2);
+  EXPECT_EQ(RegionUsedBytes(), kMidSize.in_bytes());
+
+  for (Span* s : {filler_span, filler_rest, region_span, small, filler_span2}) {
+    Delete(s, kSpanInfo.objects_per_span);
+  }
+  for (auto l : live) {
+    Delete(l, kSpanInfo.objects_per_span);
+  }
+  Parameters::set_filler_fragmentation_region_threshold(old_threshold);
+}
+
 TEST_P(HugePageAwareAllocatorTest, DonatedHugePages) {
   // This test verifies that we accurately measure the amount of RAM that we
   // donate to the huge page filler when making large allocations, including
@@ -1112,6 +1398,78 @@ TEST_P(HugePageAwareAllocatorTest, DonationAccounting) {
   EXPECT_EQ(donated, NHugePages(0));
 }
 
+TEST_P(HugePageAwareAllocatorTest, WriteLayout) {
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kSparse};
+  constexpr size_t kSizeClass = 7;
+  constexpr size_t kCells = kPagesPerHugePage.raw_num();
+
+  // Enough small spans to fill several hugepages of the filler, and a large
+  // one whose tail is donated.
+  std::vector<Span*> spans;
+  for (Length i; i < 3 * kPagesPerHugePage; ++i) {
+    spans.push_back(New(Length(1), kSpanInfo));
+  }
+  spans.push_back(New(kPagesPerHugePage + Length(1), kSpanInfo));
+
+  // A buffer with room for only one hugepage at a time, so that every record
+  // resumes from the cursor.
+  std::string buffer(sizeof(HugePageLayoutRecord) +
+                         kCells * sizeof(HugePageLayoutCell),
+                     '\0');
+  HugePageLayoutWriter out(absl::MakeSpan(buffer));
+  huge_page_allocator_internal::HugePageLayoutCursor cursor;
+  std::string dump;
+  bool more = true;
+  while (more) {
+    out.Clear();
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      more = allocator_->WriteLayout(&cursor, &out,
+                                     [](PageId) { return kSizeClass; });
+    }
+    dump.append(out.data().data(), out.data().size());
+  }
+
+  std::string header(sizeof(HugePageLayoutHeader), '\0');
+  HugePageLayoutWriter header_writer(absl::MakeSpan(header));
+  ASSERT_TRUE(header_writer.AddHeader(kPageSize, kCells));
+  dump.insert(0, header);
+
+  HugePageLayoutReader reader;
+  ASSERT_TRUE(reader.Init(dump));
+  absl::flat_hash_map<uintptr_t, std::vector<HugePageLayoutCell>> filler;
+  uintptr_t last = 0;
+  size_t donated = 0;
+  HugePageLayoutRecord record;
+  std::vector<HugePageLayoutCell> cells;
+  while (reader.Next(&record, &cells)) {
+    if (record.source != HugePageLayoutSource::kFiller) continue;
+    // Records of the filler are in address order, without repeats.
+    EXPECT_LT(last, record.first_page);
+    last = record.first_page;
+    if (record.flags & kHugePageLayoutDonated) ++donated;
+    filler[record.first_page] = cells;
+  }
+  EXPECT_TRUE(reader.ok());
+  EXPECT_GE(filler.size(), 3);
+  EXPECT_EQ(donated, 1);
+
+  for (Span* span : spans) {
+    if (span->num_pages() > kPagesPerHugePage) continue;
+    const PageId p = span->first_page();
+    auto it = filler.find(HugePageContaining(p).first_page().index());
+    ASSERT_NE(it, filler.end());
+    const HugePageLayoutCell cell =
+        it->second[(p - HugePageContaining(p).first_page()).raw_num()];
+    EXPECT_EQ(HugePageLayoutCellState(cell), HugePageLayoutPageState::kUsed);
+    EXPECT_EQ(HugePageLayoutCellSizeClass(cell), kSizeClass);
+  }
+
+  for (Span* span : spans) {
+    Delete(span, kSpanInfo.objects_per_span);
+  }
+}
+
 // We'd like to test OOM behavior but this, err, OOMs. :)
 // (Usable manually in controlled environments.
 TEST_P(HugePageAwareAllocatorTest, DISABLED_OOM) {
@@ -1510,6 +1868,140 @@ TEST_P(HugePageAwareAllocatorTest, ParallelRelease) {
   }
 }
 
+class LifetimeBasedAllocatorTest : public testing::Test {
+ protected:
+  ~LifetimeBasedAllocatorTest() override {
+    // As in HugePageAwareAllocatorTest, we leak the allocator's memory.
+    free(allocator_);
+  }
+
+  void Init(LifetimePredictionOption option, absl::Duration threshold) {
+    void* p = malloc(sizeof(HugePageAwareAllocator));
+    HugePageAwareAllocatorOptions options;
+    options.tag = MemoryTag::kNormal;
+    options.use_huge_region_more_often = HugeRegionUsageOption::kDefault;
+    options.lifetime = option;
+    options.lifetime_threshold = threshold;
+    allocator_ = new (p) HugePageAwareAllocator(options);
+  }
+
+  // Allocates <n> pages from a single allocation site.  The first
+  // <num_freed> allocations are freed immediately; the last is returned.
+  ABSL_ATTRIBUTE_NOINLINE Span* NewAfterFreeing(Length n, int num_freed) {
+    Span* span = nullptr;
+    for (int i = 0; i <= num_freed; ++i) {
+      span = allocator_->New(n, kSpanInfo);
+      CHECK_CONDITION(span != nullptr);
+      if (i < num_freed) Delete(span);
+    }
+    return span;
+  }
+
+  void Delete(Span* span) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator_->Delete(span, kSpanInfo.objects_per_span);
+  }
+
+  HugeLength DonatedHugePages() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return allocator_->DonatedHugePages();
+  }
+
+  BackingStats LifetimeRegionStats() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return allocator_->lifetime_allocator().regions().stats();
+  }
+
+  LifetimeTracker::Stats TrackerStats() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return allocator_->lifetime_allocator().tracker().stats();
+  }
+
+  std::string Print() {
+    std::string ret;
+    const size_t kSize = 1 << 20;
+    ret.resize(kSize);
+    Printer p(&ret[0], kSize);
+    allocator_->Print(&p);
+    ret.erase(p.SpaceRequired());
+    return ret;
+  }
+
+  static constexpr SpanAllocInfo kSpanInfo = {1,
+                                              AccessDensityPrediction::kSparse};
+  // Spills onto a second hugepage, so that its slack is donated.
+  static constexpr Length kLarge = kPagesPerHugePage + Length(1);
+
+  HugePageAwareAllocator* allocator_ = nullptr;
+};
+
+TEST_F(LifetimeBasedAllocatorTest, ShortLivedUsesLifetimeRegion) {
+  Init(LifetimePredictionOption::kEnabled, absl::Hours(1));
+
+  Span* span = NewAfterFreeing(kLarge, LifetimeStats::kMinSamples);
+  // The site is now known to be short-lived, so nothing was donated.
+  EXPECT_EQ(DonatedHugePages(), NHugePages(0));
+  BackingStats stats = LifetimeRegionStats();
+  EXPECT_EQ(stats.system_bytes - stats.free_bytes - stats.unmapped_bytes,
+            kLarge.in_bytes());
+
+  Delete(span);
+  stats = LifetimeRegionStats();
+  EXPECT_EQ(stats.system_bytes - stats.free_bytes - stats.unmapped_bytes, 0);
+  LifetimeTracker::Stats t = TrackerStats();
+  EXPECT_EQ(t.short_lived, LifetimeStats::kMinSamples + 1);
+  EXPECT_EQ(t.long_lived, 0);
+  EXPECT_EQ(t.active, 0);
+  EXPECT_THAT(Print(), HasSubstr("HugePageAware: lifetime region: 1 "
+                                 "allocations"));
+}
+
+TEST_F(LifetimeBasedAllocatorTest, LongLivedIsDonated) {
+  // With no threshold, every allocation is long-lived by the time it is
+  // freed.
+  Init(LifetimePredictionOption::kEnabled, absl::ZeroDuration());
+
+  Span* span = NewAfterFreeing(kLarge, LifetimeStats::kMinSamples);
+  EXPECT_EQ(DonatedHugePages(), NHugePages(1));
+  Delete(span);
+
+  LifetimeTracker::Stats t = TrackerStats();
+  EXPECT_EQ(t.short_lived, 0);
+  EXPECT_EQ(t.long_lived, LifetimeStats::kMinSamples + 1);
+  BackingStats stats = LifetimeRegionStats();
+  EXPECT_EQ(stats.system_bytes, 0);
+}
+
+TEST_F(LifetimeBasedAllocatorTest, Counterfactual) {
+  Init(LifetimePredictionOption::kCounterfactual, absl::Hours(1));
+
+  Span* span = NewAfterFreeing(kLarge, LifetimeStats::kMinSamples);
+  // Placement is unchanged, but the lifetime region shadows the allocation.
+  EXPECT_EQ(DonatedHugePages(), NHugePages(1));
+  BackingStats stats = LifetimeRegionStats();
+  EXPECT_EQ(stats.system_bytes - stats.free_bytes - stats.unmapped_bytes,
+            kLarge.in_bytes());
+
+  // Use the donated slack, so that freeing the large allocation abandons it.
+  Span* small = allocator_->New(Length(1), kSpanInfo);
+  ASSERT_NE(small, nullptr);
+  Delete(span);
+
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    const LifetimeBasedAllocator& lifetime = allocator_->lifetime_allocator();
+    EXPECT_EQ(lifetime.region_allocations(), 1);
+    EXPECT_EQ(lifetime.abandoned_predicted_short_lived(),
+              allocator_->AbandonedPages());
+    EXPECT_GT(lifetime.abandoned_predicted_short_lived(), Length(0));
+  }
+  EXPECT_THAT(Print(), HasSubstr("would have been saved"));
+
+  Delete(small);
+  stats = LifetimeRegionStats();
+  EXPECT_EQ(stats.system_bytes - stats.free_bytes - stats.unmapped_bytes, 0);
+}
+
 INSTANTIATE_TEST_SUITE_P(
     All, HugePageAwareAllocatorTest,
     testing::Values(HugeRegionUsageOption::kDefault,
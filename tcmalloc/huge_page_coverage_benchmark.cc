@@ -0,0 +1,302 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Hours of a server's page heap, simulated in minutes, for judging subrelease
+// and filler policies by how well they keep the heap on hugepages over time
+// rather than by short-run RSS.
+//
+// A HugePageAwareAllocator of its own, whose clock is advanced by the
+// simulation, serves a rolling workload: the live heap follows a cycle of
+// kCyclePeriod, most spans live for seconds and a few for hours, and memory is
+// released at the rate given as the argument (in MiB per simulated second),
+// as the background thread would.  Every page is touched when allocated, so
+// that the kernel backs the heap for real, and each simulated minute (one
+// benchmark iteration) ends with random reads across the live heap, whose dTLB
+// misses benchmark_main reports per iteration when hardware counters are
+// available.
+//
+// Every ten simulated minutes, the kernel's page flags are read to find the
+// fraction of live bytes on THP-backed hugepages.  Reported are the mean and
+// minimum of that coverage (if the page flags are readable), the mean number
+// of filler hugepages broken by subrelease, the hugepages broken over the
+// whole run, and the mean backed bytes.  Set TCMALLOC_COVERAGE_TIMESERIES to a
+// file to also append every measurement to it as CSV: release rate, minute,
+// live bytes, backed bytes, coverage (-1 if unknown) and broken hugepages.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <optional>
+#include <vector>
+
+#include "absl/base/internal/spinlock.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/huge_page_aware_allocator.h"
+#include "tcmalloc/huge_page_filler.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/pageflags.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/stats.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using huge_page_allocator_internal::HugePageAwareAllocatorOptions;
+
+constexpr int64_t kSimulatedMinutes = 8 * 60;
+constexpr int64_t kStepsPerMinute = 60;  // Of a simulated second each.
+constexpr int64_t kMeasurePeriodMinutes = 10;
+constexpr absl::Duration kCyclePeriod = absl::Hours(4);
+
+// The live heap swings between 64 and 128 MiB.
+constexpr size_t kMinLiveBytes = size_t{64} << 20;
+constexpr size_t kMaxLiveBytes = size_t{128} << 20;
+
+constexpr double kShortLived = 0.95;
+constexpr absl::Duration kShortLifetime = absl::Seconds(5);
+constexpr absl::Duration kLongLifetime = absl::Hours(1);
+
+constexpr int kReadsPerMinute = 1 << 16;
+
+// The simulated time, in nanoseconds.
+int64_t fake_now = 0;
+
+int64_t FakeNow() { return fake_now; }
+double FakeFrequency() { return 1e9; }
+
+struct LiveSpan {
+  int64_t death;
+  Span* span;
+
+  // Orders a heap by death, soonest first.
+  bool operator<(const LiveSpan& other) const { return death > other.death; }
+};
+
+// Mostly small spans with a tail of large ones, as a server's page heap sees.
+Length RandomLength(absl::BitGen& rng) {
+  constexpr Length kMaxFilled = kPagesPerHugePage / 2;
+  const double p = absl::Uniform(rng, 0.0, 1.0);
+  if (p < 0.9) return Length(absl::LogUniform<size_t>(rng, 1, 8));
+  if (p < 0.99) {
+    return Length(absl::LogUniform<size_t>(rng, 9, kMaxFilled.raw_num()));
+  }
+  return Length(absl::LogUniform<size_t>(
+      rng, kMaxFilled.raw_num() + 1, NHugePages(8).in_pages().raw_num()));
+}
+
+size_t TargetLiveBytes(int64_t now) {
+  const double phase = static_cast<double>(now) /
+                       absl::ToInt64Nanoseconds(kCyclePeriod) * 2 * M_PI;
+  return kMinLiveBytes +
+         (kMaxLiveBytes - kMinLiveBytes) * (1 - std::cos(phase)) / 2;
+}
+
+// Returns the fraction of the bytes of <live> on hugepages the kernel backs
+// with THPs, or std::nullopt if the page flags cannot be read.
+std::optional<double> ThpCoverage(const std::vector<LiveSpan>& live,
+                                  PageFlags& flags) {
+  absl::flat_hash_map<uintptr_t, bool> thp;
+  size_t total = 0, covered = 0;
+  for (const LiveSpan& l : live) {
+    const uintptr_t start =
+        reinterpret_cast<uintptr_t>(l.span->start_address());
+    const uintptr_t end = start + l.span->bytes_in_span();
+    for (uintptr_t p = start; p < end;) {
+      const HugePage hp = HugePageContaining(reinterpret_cast<void*>(p));
+      const uintptr_t hp_end =
+          reinterpret_cast<uintptr_t>(hp.start_addr()) + kHugePageSize;
+      auto [it, inserted] = thp.try_emplace(hp.index(), false);
+      if (inserted) {
+        const std::optional<bool> is_huge = flags.IsHugePage(hp.start_addr());
+        if (!is_huge.has_value()) return std::nullopt;
+        it->second = *is_huge;
+      }
+      const size_t bytes = std::min(end, hp_end) - p;
+      total += bytes;
+      if (it->second) covered += bytes;
+      p += bytes;
+    }
+  }
+  return total > 0 ? static_cast<double>(covered) / total : 0;
+}
+
+void BM_HugePageCoverage(benchmark::State& state) {
+  const size_t release_bytes_per_step = static_cast<size_t>(state.range(0))
+                                        << 20;
+  const size_t sys_page_size = GetPageSize();
+
+  // HugePageAwareAllocator can't be destroyed cleanly, so each run leaks its
+  // own.
+  fake_now = 0;
+  HugePageAwareAllocatorOptions options;
+  options.tag = MemoryTag::kNormal;
+  options.clock = Clock{.now = FakeNow, .freq = FakeFrequency};
+  HugePageAwareAllocator& allocator = *new (
+      malloc(sizeof(HugePageAwareAllocator))) HugePageAwareAllocator(options);
+  const SpanAllocInfo info = {1, AccessDensityPrediction::kSparse};
+
+  FILE* timeseries = nullptr;
+  if (const char* path = getenv("TCMALLOC_COVERAGE_TIMESERIES")) {
+    timeseries = fopen(path, "a");
+  }
+
+  absl::BitGen rng;
+  PageFlags flags;
+  std::vector<LiveSpan> live;
+  size_t live_bytes = 0;
+  int64_t minute = 0;
+  double coverage_sum = 0, coverage_min = 1;
+  double broken_sum = 0, backed_sum = 0;
+  int measurements = 0;
+  bool coverage_known = true;
+  volatile char sink = 0;
+
+  for (auto s : state) {
+    for (int64_t step = 0; step < kStepsPerMinute; ++step) {
+      fake_now += absl::ToInt64Nanoseconds(absl::Seconds(1));
+
+      while (!live.empty() && live.front().death <= fake_now) {
+        std::pop_heap(live.begin(), live.end());
+        Span* span = live.back().span;
+        live.pop_back();
+        live_bytes -= span->bytes_in_span();
+        absl::base_internal::SpinLockHolder h(&pageheap_lock);
+        allocator.Delete(span, info.objects_per_span);
+      }
+
+      const size_t target = TargetLiveBytes(fake_now);
+      while (live_bytes < target) {
+        Span* span = allocator.New(RandomLength(rng), info);
+        CHECK_CONDITION(span != nullptr);
+        char* p = static_cast<char*>(span->start_address());
+        for (size_t off = 0; off < span->bytes_in_span();
+             off += sys_page_size) {
+          p[off] = 1;
+        }
+        const absl::Duration lifetime =
+            absl::Uniform(rng, 0.0, 1.0) < kShortLived ? kShortLifetime
+                                                       : kLongLifetime;
+        const int64_t death =
+            fake_now + absl::Exponential<double>(rng) *
+                           absl::ToInt64Nanoseconds(lifetime);
+        live.push_back({death, span});
+        std::push_heap(live.begin(), live.end());
+        live_bytes += span->bytes_in_span();
+      }
+
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      if (release_bytes_per_step > 0) {
+        allocator.ReleaseAtLeastNPages(
+            BytesToLengthCeil(release_bytes_per_step));
+      }
+      if (const int64_t collapse = Parameters::collapse_hugepages();
+          collapse > 0) {
+        allocator.CollapseRefilledHugePages(NHugePages(collapse));
+      }
+    }
+
+    // The application's work: reads spread over the live heap.
+    for (int i = 0; i < kReadsPerMinute && !live.empty(); ++i) {
+      const Span* span = live[absl::Uniform<size_t>(rng, 0, live.size())].span;
+      const char* p = static_cast<const char*>(span->start_address());
+      sink = sink + p[absl::Uniform<size_t>(rng, 0, span->bytes_in_span())];
+    }
+
+    ++minute;
+    if (minute % kMeasurePeriodMinutes != 0) continue;
+
+    state.PauseTiming();
+    const std::optional<double> coverage = ThpCoverage(live, flags);
+    BackingStats stats;
+    HugeLength broken;
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      stats = allocator.stats();
+      broken = allocator.FillerBrokenHugePages();
+    }
+    const size_t backed = stats.system_bytes - stats.unmapped_bytes;
+    if (coverage.has_value()) {
+      coverage_sum += *coverage;
+      coverage_min = std::min(coverage_min, *coverage);
+    } else {
+      coverage_known = false;
+    }
+    broken_sum += broken.raw_num();
+    backed_sum += backed;
+    ++measurements;
+    if (timeseries != nullptr) {
+      fprintf(timeseries, "%lld,%lld,%zu,%zu,%.4f,%zu\n",
+              static_cast<long long>(state.range(0)),
+              static_cast<long long>(minute), live_bytes, backed,
+              coverage.value_or(-1), broken.raw_num());
+    }
+    state.ResumeTiming();
+  }
+
+  SubreleaseStats subrelease;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    subrelease = allocator.FillerSubreleaseStats();
+    for (const LiveSpan& l : live) {
+      allocator.Delete(l.span, info.objects_per_span);
+    }
+  }
+  if (timeseries != nullptr) fclose(timeseries);
+
+  state.counters["hugepages_broken"] =
+      (subrelease.total_hugepages_broken + subrelease.num_hugepages_broken)
+          .raw_num();
+
+  if (measurements > 0) {
+    // Coverage is only reported when the page flags could be read.
+    if (coverage_known) {
+      state.counters["thp_coverage"] = coverage_sum / measurements;
+      state.counters["thp_coverage_min"] = coverage_min;
+    }
+    state.counters["broken_hugepages"] = broken_sum / measurements;
+    state.counters["backed_bytes"] = backed_sum / measurements;
+  }
+  state.SetItemsProcessed(state.iterations() * kReadsPerMinute);
+}
+
+BENCHMARK(BM_HugePageCoverage)
+    ->ArgName("release_mib_per_s")
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(16)
+    ->Iterations(kSimulatedMinutes)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -20,13 +20,16 @@
 
 #include <algorithm>
 #include <array>
+#include <cmath>
 #include <limits>
+#include <optional>
 
 #include "absl/algorithm/container.h"
 #include "absl/base/attributes.h"
 #include "absl/base/internal/cycleclock.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/functional/function_ref.h"
 #include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
@@ -35,6 +38,7 @@
 #include "tcmalloc/huge_cache.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/lifetime_tracker.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/linked_list.h"
 #include "tcmalloc/internal/logging.h"
@@ -215,6 +219,103 @@ class SkippedSubreleaseCorrectnessTracker {
       tracker_;
 };
 
+// How skip subrelease estimates the demand it must keep mapped for.
+enum class SubreleaseDemandPredictor {
+  // The recent peak, or the sum of short-term fluctuations and the long-term
+  // trend, over the configured intervals.
+  kIntervals,
+  // Forecasts of the next epoch's peak demand from the per-epoch peaks:
+  // An exponentially weighted moving average, plus twice its mean deviation.
+  kEwma,
+  // The 90th percentile.
+  kQuantile,
+  // Holt's linear (level and trend) exponential smoothing, plus twice its
+  // mean forecast error.
+  kHolt,
+  kNumPredictors,
+};
+
+inline absl::string_view SubreleaseDemandPredictorName(
+    SubreleaseDemandPredictor predictor) {
+  switch (predictor) {
+    case SubreleaseDemandPredictor::kIntervals:
+      return "INTERVALS";
+    case SubreleaseDemandPredictor::kEwma:
+      return "EWMA";
+    case SubreleaseDemandPredictor::kQuantile:
+      return "QUANTILE";
+    case SubreleaseDemandPredictor::kHolt:
+      return "HOLT";
+    case SubreleaseDemandPredictor::kNumPredictors:
+      break;
+  }
+  return "UNKNOWN";
+}
+
+namespace huge_page_filler_internal {
+
+// Forecasts the peak demand in the next epoch from the peak demand of past
+// epochs, <peaks>, oldest first, using <predictor> (which must not be
+// kIntervals).  The forecast never exceeds the highest of the peaks: demand
+// has not been seen to get there, and keeping more memory around for it risks
+// OOMs.
+inline Length ForecastPeakDemand(SubreleaseDemandPredictor predictor,
+                                 absl::Span<const Length> peaks) {
+  if (peaks.empty()) return Length(0);
+  const Length highest = *absl::c_max_element(peaks);
+
+  double forecast = 0;
+  switch (predictor) {
+    case SubreleaseDemandPredictor::kEwma: {
+      constexpr double kAlpha = 0.5;
+      double mean = peaks[0].raw_num();
+      double deviation = 0;
+      for (Length peak : peaks.subspan(1)) {
+        const double x = peak.raw_num();
+        deviation = kAlpha * std::abs(x - mean) + (1 - kAlpha) * deviation;
+        mean = kAlpha * x + (1 - kAlpha) * mean;
+      }
+      forecast = mean + 2 * deviation;
+      break;
+    }
+    case SubreleaseDemandPredictor::kQuantile: {
+      constexpr size_t kMaxPeaks = 64;
+      std::array<Length, kMaxPeaks> sorted;
+      const size_t n = std::min(peaks.size(), kMaxPeaks);
+      std::copy(peaks.end() - n, peaks.end(), sorted.begin());
+      std::sort(sorted.begin(), sorted.begin() + n);
+      // Nearest rank.
+      const size_t rank = (n * 9 + 9) / 10;
+      forecast = sorted[rank - 1].raw_num();
+      break;
+    }
+    case SubreleaseDemandPredictor::kHolt: {
+      constexpr double kAlpha = 0.5;
+      constexpr double kBeta = 0.3;
+      double level = peaks[0].raw_num();
+      double trend = 0;
+      double error = 0;
+      for (Length peak : peaks.subspan(1)) {
+        const double x = peak.raw_num();
+        error = kAlpha * std::abs(x - (level + trend)) + (1 - kAlpha) * error;
+        const double last_level = level;
+        level = kAlpha * x + (1 - kAlpha) * (level + trend);
+        trend = kBeta * (level - last_level) + (1 - kBeta) * trend;
+      }
+      forecast = level + trend + 2 * error;
+      break;
+    }
+    case SubreleaseDemandPredictor::kIntervals:
+    case SubreleaseDemandPredictor::kNumPredictors:
+      ASSERT(false);
+      return highest;
+  }
+  if (forecast <= 0) return Length(0);
+  return std::min(highest, Length(static_cast<size_t>(std::ceil(forecast))));
+}
+
+}  // namespace huge_page_filler_internal
+
 struct SkipSubreleaseIntervals {
   // Interval that locates recent demand peak.
   absl::Duration peak_interval;
@@ -222,15 +323,23 @@ struct SkipSubreleaseIntervals {
   absl::Duration short_interval;
   // Interval that locates recent long-term demand trend.
   absl::Duration long_interval;
+  // If other than kIntervals, the demand is instead forecast from the history
+  // of peaks within peak_interval (or long_interval, if that is unset), or
+  // within the whole tracked window if neither is set.
+  SubreleaseDemandPredictor predictor = SubreleaseDemandPredictor::kIntervals;
   // Checks if the peak interval is set.
   bool IsPeakIntervalSet() const {
     return peak_interval != absl::ZeroDuration();
   }
+  // Checks if demand is forecast by a predictor.
+  bool IsPredictorSet() const {
+    return predictor != SubreleaseDemandPredictor::kIntervals;
+  }
   // Checks if the skip subrelease feature is enabled.
   bool SkipSubreleaseEnabled() const {
     if (peak_interval != absl::ZeroDuration() ||
         short_interval != absl::ZeroDuration() ||
-        long_interval != absl::ZeroDuration()) {
+        long_interval != absl::ZeroDuration() || IsPredictorSet()) {
       return true;
     }
     return false;
@@ -250,6 +359,16 @@ struct SubreleaseStats {
   Length total_pages_subreleased_due_to_limit;
   HugeLength total_hugepages_broken_due_to_limit{NHugePages(0)};
 
+  // Cumulative since startup: free runs unbacked, and the calls made to
+  // unback them.  Batching lets the latter run below the former.
+  size_t total_ranges_subreleased = 0;
+  size_t total_subrelease_calls = 0;
+
+  // Cumulative since startup: broken hugepages, since refilled, collapsed back
+  // into hugepages, and those whose collapse failed.
+  HugeLength total_hugepages_collapsed{NHugePages(0)};
+  HugeLength total_hugepages_collapse_failed{NHugePages(0)};
+
   void reset() {
     total_pages_subreleased += num_pages_subreleased;
     total_partial_alloc_pages_subreleased +=
@@ -368,6 +487,20 @@ class FillerStatsTracker {
     return max_demand_pages;
   }
 
+  // Returns the peak demand over the whole tracked window.  Unlike
+  // GetRecentPeak, it leaves the reported skip subrelease intervals alone.
+  Length GetWindowPeak() const {
+    Length max_demand_pages;
+    tracker_.IterBackwards(
+        [&](size_t offset, int64_t ts, const FillerStatsEntry& e) {
+          if (!e.empty() &&
+              e.stats[kStatsAtMaxDemand].num_pages > max_demand_pages) {
+            max_demand_pages = e.stats[kStatsAtMaxDemand].num_pages;
+          }
+        });
+    return max_demand_pages;
+  }
+
   // Calculates demand requirements for skip subrelease: HugePageFiller would
   // not subrelease if it has less pages than (or equal to) the required
   // amount. We report that the skipping is correct if future demand is going to
@@ -437,6 +570,35 @@ class FillerStatsTracker {
                     short_term_fluctuation_pages + long_term_trend_pages);
   }
 
+  // Forecasts the demand requirement for skip subrelease with <predictor>,
+  // from the peak demand of each epoch within <history> (the whole window if
+  // zero).  As for the other requirements, skipping is reported correct if
+  // demand reaches the forecast within the realized fragmentation interval.
+  Length GetForecastDemand(SubreleaseDemandPredictor predictor,
+                           absl::Duration history) {
+    if (history == absl::ZeroDuration()) {
+      history = epoch_length_ * kEpochs;
+    }
+    last_skip_subrelease_intervals_.predictor = predictor;
+    last_skip_subrelease_history_ = std::min(history, epoch_length_ * kEpochs);
+    int64_t num_epochs = std::clamp<int64_t>(history / epoch_length_, 1,
+                                             static_cast<int64_t>(kEpochs));
+
+    std::array<Length, kEpochs> peaks;
+    size_t num_peaks = 0;
+    tracker_.IterBackwards(
+        [&](size_t offset, int64_t ts, const FillerStatsEntry& e) {
+          if (!e.empty()) {
+            peaks[num_peaks++] = e.stats[kStatsAtMaxDemand].num_pages;
+          }
+        },
+        num_epochs);
+    // We visited the epochs newest first.
+    std::reverse(peaks.begin(), peaks.begin() + num_peaks);
+    return huge_page_filler_internal::ForecastPeakDemand(
+        predictor, absl::MakeConstSpan(peaks.data(), num_peaks));
+  }
+
   // Reports a skipped subrelease, which is evaluated by coming peaks within the
   // realized fragmentation interval. The purpose is these skipped pages would
   // only create realized fragmentation if peaks in that interval are
@@ -581,6 +743,7 @@ class FillerStatsTracker {
   // peak_interval for evaluating skipped subreleases. All for reporting and
   // debugging only.
   SkipSubreleaseIntervals last_skip_subrelease_intervals_;
+  absl::Duration last_skip_subrelease_history_;
   absl::Duration last_next_peak_interval_;
 };
 
@@ -662,6 +825,16 @@ void FillerStatsTracker<kEpochs>::Print(Printer* out) const {
       absl::ToInt64Seconds(last_skip_subrelease_intervals_.short_interval),
       absl::ToInt64Seconds(last_skip_subrelease_intervals_.long_interval));
 
+  if (last_skip_subrelease_intervals_.IsPredictorSet()) {
+    out->printf(
+        "HugePageFiller: Demand was last forecast by the %s predictor from "
+        "%ds of peaks.\n",
+        SubreleaseDemandPredictorName(
+            last_skip_subrelease_intervals_.predictor)
+            .data(),
+        absl::ToInt64Seconds(last_skip_subrelease_history_));
+  }
+
   Length skipped_pages = total_skipped().pages - pending_skipped().pages;
   double correctly_skipped_pages_percentage =
       safe_div(100.0 * correctly_skipped().pages, skipped_pages);
@@ -715,6 +888,12 @@ void FillerStatsTracker<kEpochs>::PrintInPbtxt(PbtxtRegion* hpaa) const {
         "skipped_subrelease_long_interval_ms",
         absl::ToInt64Milliseconds(
             last_skip_subrelease_intervals_.long_interval));
+    skip_subrelease.PrintRaw("skipped_subrelease_predictor",
+                             SubreleaseDemandPredictorName(
+                                 last_skip_subrelease_intervals_.predictor));
+    skip_subrelease.PrintI64(
+        "skipped_subrelease_history_ms",
+        absl::ToInt64Milliseconds(last_skip_subrelease_history_));
     skip_subrelease.PrintI64("skipped_subrelease_pages",
                              total_skipped().pages.raw_num());
     skip_subrelease.PrintI64("correctly_skipped_subrelease_pages",
@@ -784,6 +963,14 @@ inline bool IsDenseSpan(AccessDensityPrediction density) {
   return density == AccessDensityPrediction::kDense;
 }
 
+class SubreleaseBatch;
+
+// The HugePageFiller partition of a hugepage that belongs to none in
+// particular, and the partition requested by allocations that can use any
+// hugepage.  Partitions keep the spans allocated from each L3 cache domain on
+// hugepages of their own (see HugePageFiller::TryGet).
+inline constexpr uint8_t kAnyFillerPartition = 0xff;
+
 // PageTracker keeps track of the allocation status of every page in a HugePage.
 // It allows allocation and deallocation of a contiguous run of pages.
 //
@@ -795,11 +982,13 @@ class PageTracker : public TList<PageTracker>::Elem {
       : location_(p),
         released_count_(0),
         abandoned_count_(0),
+        zero_count_(0),
         donated_(false),
         was_donated_(was_donated),
         was_released_(false),
         abandoned_(false),
         unbroken_(true),
+        collapse_failed_(false),
         free_{} {
 #ifndef __ppc64__
 #if defined(__GNUC__)
@@ -834,6 +1023,8 @@ class PageTracker : public TList<PageTracker>::Elem {
   struct PageAllocation {
     PageId page;
     Length previously_unbacked;
+    // Whether every page of the range is known to read as zero.
+    bool known_zero;
   };
 
   // REQUIRES: there's a free range of at least n pages
@@ -842,9 +1033,38 @@ class PageTracker : public TList<PageTracker>::Elem {
   // [i, i+n) in previously_unbacked.
   PageAllocation Get(Length n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // REQUIRES: no pages have been allocated from this tracker yet.
+  //
+  // Records that every page of the hugepage reads as zero, as it does when
+  // fresh from the system.  Pages stay known zero until allocated, and
+  // become so again once released.
+  void MarkZero() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // REQUIRES: p was the result of a previous call to Get(n)
   void Put(PageId p, Length n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Returns true if the <delta> pages following [p, p+n) are on this hugepage
+  // and free.
+  bool CanExtend(PageId p, Length n, Length delta) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // REQUIRES: p was the result of a previous call to Get(n), and
+  // CanExtend(p, n, delta).
+  //
+  // Grows the allocation [p, p+n) by <delta> pages, returning how many of them
+  // were previously unbacked.  The allocation must be Put() with its new
+  // length.
+  Length Extend(PageId p, Length n, Length delta)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // REQUIRES: p was the result of a previous call to Get(n), and
+  // 0 < new_n < n.
+  //
+  // Returns the pages of the allocation [p, p+n) past its first <new_n> for
+  // new allocations.  The allocation must be Put() with its new length.
+  void Shrink(PageId p, Length n, Length new_n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Returns true if any unused pages have been returned-to-system.
   bool released() const { return released_count_ > 0; }
 
@@ -891,6 +1111,60 @@ class PageTracker : public TList<PageTracker>::Elem {
 
   bool unbroken() const { return unbroken_; }
 
+  // Whether collapsing this (broken) hugepage back into a hugepage failed
+  // since it was last subreleased.
+  bool collapse_failed() const { return collapse_failed_; }
+
+  // Records the outcome of collapsing the hugepage, which must be fully
+  // backed.  A successful collapse makes it unbroken again; a failed one is
+  // not retried until the hugepage is subreleased and refilled again.
+  void SetCollapsed(bool success) {
+    ASSERT(!released());
+    unbroken_ = success;
+    collapse_failed_ = !success;
+    if (success) {
+      thp_backed_ = true;
+    }
+  }
+
+  // Whether the kernel backs the hugepage with a THP, as of the last scan (see
+  // HugePageFiller::ScanHugePageBacking).  Hugepages are assumed to be backed
+  // until scanned, and not to be once subreleased.
+  bool thp_backed() const { return thp_backed_; }
+  void set_thp_backed(bool status) { thp_backed_ = status; }
+
+  // The HugePageFiller::ScanHugePageBacking pass that last scanned this
+  // hugepage.
+  uint32_t backing_scan_epoch() const { return backing_scan_epoch_; }
+  void set_backing_scan_epoch(uint32_t epoch) { backing_scan_epoch_ = epoch; }
+
+  // Whether most of the backed free pages were recently touched, as of the
+  // last scan (see HugePageFiller::ScanFreePageIdleness), and so are likely to
+  // be reused soon.  Subrelease returns the free pages of other hugepages
+  // first.
+  bool free_pages_warm() const { return free_pages_warm_; }
+  void set_free_pages_warm(bool warm) { free_pages_warm_ = warm; }
+
+  // The HugePageFiller::ScanFreePageIdleness pass that last scanned this
+  // hugepage.
+  uint32_t idle_scan_epoch() const { return idle_scan_epoch_; }
+  void set_idle_scan_epoch(uint32_t epoch) { idle_scan_epoch_ = epoch; }
+
+  // Calls f(p, n) for each run [p, p+n) of free pages that are still backed.
+  template <typename F>
+  void IterBackedFreeRanges(F f) const;
+
+  // The HugePageFiller::ScanReleasedResidency pass that last scanned this
+  // hugepage.
+  uint32_t residency_scan_epoch() const { return residency_scan_epoch_; }
+  void set_residency_scan_epoch(uint32_t epoch) {
+    residency_scan_epoch_ = epoch;
+  }
+
+  // Calls f(p, n) for each run [p, p+n) of pages released to the OS.
+  template <typename F>
+  void IterReleasedRanges(F f) const;
+
   // Returns the hugepage whose availability is being tracked.
   HugePage location() const { return location_; }
 
@@ -898,11 +1172,24 @@ class PageTracker : public TList<PageTracker>::Elem {
   // Returns the count of pages unbacked.
   Length ReleaseFree(MemoryModifyFunction& unback)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // As above, but queues the unused pages onto <batch>, so that they may be
+  // unbacked together with those of other hugepages.  Pages are marked
+  // released as the batch is flushed.
+  void ReleaseFree(SubreleaseBatch& batch)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   void AddSpanStats(SmallSpanStats* small, LargeSpanStats* large) const;
   bool HasDenseSpans() const { return has_dense_spans_; }
   void SetHasDenseSpans() { has_dense_spans_ = true; }
 
+  // The HugePageFiller partition whose spans this hugepage holds.
+  uint8_t partition() const { return partition_; }
+  void set_partition(uint8_t partition) { partition_ = partition; }
+
+  // Lifetime tracking state of the allocation that donated this hugepage (see
+  // LifetimeBasedAllocator).  Only used if was_donated().
+  LifetimeTracker::Tracker* lifetime_tracker() { return &lifetime_tracker_; }
+
  private:
   HugePage location_;
 
@@ -911,6 +1198,8 @@ class PageTracker : public TList<PageTracker>::Elem {
   // TODO(b/151663108):  Logically, this is guarded by pageheap_lock.
   uint16_t released_count_;
   uint16_t abandoned_count_;
+  // Cached value of zero_by_page_.CountBits(0, kPagesPerHugePages)
+  uint16_t zero_count_;
   bool donated_;
   bool was_donated_;
   bool was_released_;
@@ -921,6 +1210,7 @@ class PageTracker : public TList<PageTracker>::Elem {
   // reset it once we measure those pages in abandoned_count_.
   bool abandoned_;
   bool unbroken_;
+  bool collapse_failed_;
 
   RangeTracker<kPagesPerHugePage.raw_num()> free_;
   // Bitmap of pages based on them being released to the OS.
@@ -935,23 +1225,72 @@ class PageTracker : public TList<PageTracker>::Elem {
   //
   // TODO(b/151663108):  Logically, this is guarded by pageheap_lock.
   Bitmap<kPagesPerHugePage.raw_num()> released_by_page_;
+  // Bitmap of free pages known to read as zero: those never allocated from a
+  // fresh hugepage (see MarkZero), and those released to the OS.
+  Bitmap<kPagesPerHugePage.raw_num()> zero_by_page_;
 
   static_assert(kPagesPerHugePage.raw_num() <
                     std::numeric_limits<uint16_t>::max(),
                 "nallocs must be able to support kPagesPerHugePage!");
 
   bool has_dense_spans_ = false;
+  bool thp_backed_ = true;
+  uint8_t partition_ = kAnyFillerPartition;
+  uint32_t backing_scan_epoch_ = 0;
+  bool free_pages_warm_ = false;
+  uint32_t idle_scan_epoch_ = 0;
+  uint32_t residency_scan_epoch_ = 0;
 
-  ABSL_MUST_USE_RESULT bool ReleasePages(PageId p, Length n,
-                                         MemoryModifyFunction& unback) {
-    void* ptr = p.start_addr();
-    size_t byte_len = n.in_bytes();
-    bool success = unback(ptr, byte_len);
-    if (ABSL_PREDICT_TRUE(success)) {
-      unbroken_ = false;
-    }
-    return success;
+  LifetimeTracker::Tracker lifetime_tracker_;
+
+  // Records that [p, p+n), previously queued by ReleaseFree, was unbacked.
+  void MarkReleased(PageId p, Length n);
+
+  friend class SubreleaseBatch;
+};
+
+// Collects free runs of pages from PageTrackers, to be unbacked with as few
+// calls to MemoryModifyFunction::ModifyRanges as possible.  We hold
+// pageheap_lock while subreleasing and so cannot allocate; the batch is of
+// fixed size and is flushed whenever it fills up.
+class SubreleaseBatch {
+ public:
+  explicit SubreleaseBatch(
+      MemoryModifyFunction& unback ABSL_ATTRIBUTE_LIFETIME_BOUND)
+      : unback_(unback), granularity_(unback.granularity().raw_num()) {
+    ASSERT(granularity_ > 0);
+    ASSERT(kPagesPerHugePage.raw_num() % granularity_ == 0);
   }
+  ~SubreleaseBatch() { ASSERT(size_ == 0); }
+
+  SubreleaseBatch(const SubreleaseBatch&) = delete;
+  SubreleaseBatch& operator=(const SubreleaseBatch&) = delete;
+
+  // Queues [p, p+n), which must be free and backed in <pt>, rounded inward to
+  // the granularity of the release.
+  void Add(PageTracker* pt, PageId p, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Unbacks every queued range, marking those that succeed as released on
+  // their trackers.
+  void Flush() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Totals over the lifetime of the batch.
+  Length released() const { return total_released_; }
+  size_t ranges() const { return total_ranges_; }
+  size_t calls() const { return total_calls_; }
+
+ private:
+  static constexpr size_t kMaxRanges = 64;
+
+  MemoryModifyFunction& unback_;
+  const size_t granularity_;
+  size_t size_ = 0;
+  std::array<AddressRange, kMaxRanges> ranges_;
+  std::array<PageTracker*, kMaxRanges> trackers_;
+  Length total_released_;
+  size_t total_ranges_ = 0;
+  size_t total_calls_ = 0;
 };
 
 // Records number of hugepages in different types of allocs.
@@ -999,6 +1338,8 @@ class HugePageFiller {
     TrackerType* pt;
     PageId page;
     bool from_released;
+    // Whether every page of the allocation is known to read as zero.
+    bool known_zero;
   };
 
   // Our API is simple, but note that it does not include an unconditional
@@ -1009,8 +1350,12 @@ class HugePageFiller {
   // n is the number of TCMalloc pages to be allocated.  num_objects is the
   // number of individual objects that would be allocated on these n pages.
   //
+  // Unless <partition> is kAnyFillerPartition, the allocation prefers the
+  // hugepages of that partition, and the hugepage it is placed on joins it.
+  //
   // On failure, returns nullptr/PageId{0}.
-  TryGetResult TryGet(Length n, SpanAllocInfo span_alloc_info)
+  TryGetResult TryGet(Length n, SpanAllocInfo span_alloc_info,
+                      uint8_t partition = kAnyFillerPartition)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   // Marks [p, p + n) as usable by new allocations into *pt; returns pt
@@ -1020,10 +1365,29 @@ class HugePageFiller {
   TrackerType* Put(TrackerType* pt, PageId p, Length n)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Tries to grow the allocation [p, p + n) on *pt in place by the <delta>
+  // pages that follow it.  Returns false, changing nothing, if they are not
+  // all free.  Otherwise sets *from_released if any of them had been released.
+  // REQUIRES: pt is owned by this object, and {pt, p, n} was the result of a
+  // previous TryGet (possibly grown by TryExtend).
+  bool TryExtend(TrackerType* pt, PageId p, Length n, Length delta,
+                 bool* from_released)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Shrinks the allocation [p, p + n) on *pt in place to its first <new_n>
+  // pages, returning the rest for new allocations.
+  // REQUIRES: pt is owned by this object, {pt, p, n} was the result of a
+  // previous TryGet (possibly resized by TryExtend or Shrink), and
+  // 0 < new_n < n.
+  void Shrink(TrackerType* pt, PageId p, Length n, Length new_n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Contributes a tracker to the filler. If "donated," then the tracker is
   // marked as having come from the tail of a multi-hugepage allocation, which
-  // causes it to be treated slightly differently.
-  void Contribute(TrackerType* pt, bool donated, SpanAllocInfo span_alloc_info);
+  // causes it to be treated slightly differently.  Otherwise the tracker
+  // joins <partition>.
+  void Contribute(TrackerType* pt, bool donated, SpanAllocInfo span_alloc_info,
+                  uint8_t partition = kAnyFillerPartition);
 
   HugeLength size() const { return size_; }
 
@@ -1032,6 +1396,8 @@ class HugePageFiller {
     ASSERT(type < AccessDensityPrediction::kPredictionCounts);
     return pages_allocated_[type];
   }
+  // Number of hugepages TryGet moved from one partition to another.
+  size_t partition_rebalances() const { return partition_rebalances_; }
   Length pages_allocated() const {
     return pages_allocated_[AccessDensityPrediction::kSparse] +
            pages_allocated_[AccessDensityPrediction::kDense];
@@ -1088,6 +1454,12 @@ class HugePageFiller {
                                    SkipSubreleaseIntervals intervals)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Returns whether releasing <desired> pages would take the filler below the
+  // peak demand of its tracked window, so that the pages are likely to be
+  // needed again.
+  bool ReleaseLikelyReused(Length desired)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Tries to release desired pages by iteratively releasing from the emptiest
   // possible hugepage and releasing its free memory to the system. If
   // release_partial_alloc_pages is enabled, it also releases all the free
@@ -1104,6 +1476,47 @@ class HugePageFiller {
   static constexpr size_t kCandidatesForReleasingMemory =
       kPagesPerHugePage.raw_num();
 
+  // Collapses up to <n> broken hugepages that are fully backed again (see
+  // PageTracker::was_released) back into hugepages, with <collapse>.  We hold
+  // pageheap_lock throughout, as the hugepages are in use, so <n> should be
+  // small.  Returns the number of hugepages collapsed.
+  HugeLength CollapseRefilledHugePages(HugeLength n,
+                                       MemoryModifyFunction& collapse)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Updates whether the kernel backs the hugepages of up to <n> trackers with
+  // THPs, as reported by <is_huge> (std::nullopt if unknown), picking up where
+  // the previous call left off.  Subreleased hugepages are known not to be
+  // backed and are skipped.  Returns the number of trackers scanned.
+  size_t ScanHugePageBacking(
+      size_t n, absl::FunctionRef<std::optional<bool>(HugePage)> is_huge)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Updates whether the backed free pages of up to <n> trackers are warm (see
+  // PageTracker::free_pages_warm), from <stale_bytes>, which reports how many
+  // bytes of [p, p+n) have not been touched recently (std::nullopt if
+  // unknown), picking up where the previous call left off.  Trackers without
+  // backed free pages are skipped.  Returns the number of trackers scanned.
+  size_t ScanFreePageIdleness(
+      size_t n,
+      absl::FunctionRef<std::optional<size_t>(PageId, Length)> stale_bytes)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Returns released pages of up to <n> trackers that are resident again, as
+  // reported by <resident_bytes> (the resident bytes of [p, p+n), std::nullopt
+  // if unknown), to the OS, picking up where the previous call left off.
+  // Stray touches, e.g. by the application reading freed memory, fault
+  // released pages back in, leaving them resident while they are accounted as
+  // unmapped.  Trackers without released pages are skipped.  Returns the
+  // number of resident bytes released again.
+  size_t ScanReleasedResidency(
+      size_t n,
+      absl::FunctionRef<std::optional<size_t>(PageId, Length)> resident_bytes)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Used pages on hugepages backed by THPs, as of the last scans.
+  Length used_pages_in_thp_backed() const;
+
   void AddSpanStats(SmallSpanStats* small, LargeSpanStats* large) const;
 
   BackingStats stats() const;
@@ -1113,6 +1526,10 @@ class HugePageFiller {
   void Print(Printer* out, bool everything) const;
   void PrintInPbtxt(PbtxtRegion* hpaa) const;
 
+  // Calls f(pt) for each hugepage of the filler, in no particular order.
+  template <typename F>
+  void ForEachTracker(F f) const;
+
  private:
   // This class wraps an array of N TrackerLists and a Bitmap storing which
   // elements are non-empty.
@@ -1125,6 +1542,12 @@ class HugePageFiller {
   };
 
   SubreleaseStats subrelease_stats_;
+  // The current ScanHugePageBacking pass.  Trackers start out unscanned.
+  uint32_t backing_scan_epoch_ = 1;
+  // The current ScanFreePageIdleness pass.
+  uint32_t idle_scan_epoch_ = 1;
+  // The current ScanReleasedResidency pass.
+  uint32_t residency_scan_epoch_ = 1;
 
   // We group hugepages first by longest-free (as a measure of fragmentation),
   // then into chunks_per_alloc_ chunks inside there by desirability of
@@ -1137,6 +1560,9 @@ class HugePageFiller {
   // Returns index for regular_alloc_.
   size_t ListFor(Length longest, size_t chunk) const;
   static constexpr size_t kNumLists = kPagesPerHugePage.raw_num() * kChunks;
+  // How many candidate hugepages TryGet looks at for one of the requested
+  // partition, to bound the time spent under pageheap_lock.
+  static constexpr size_t kPartitionScanLimit = 16;
   const size_t chunks_per_alloc_;
 
   // List of hugepages from which no pages have been released to the OS.
@@ -1218,6 +1644,7 @@ class HugePageFiller {
   HugeLength size_;
 
   Length pages_allocated_[AccessDensityPrediction::kPredictionCounts];
+  size_t partition_rebalances_ = 0;
   Length unmapped_;
 
   // How much have we eagerly unmapped (in already released hugepages), but
@@ -1252,8 +1679,23 @@ inline typename PageTracker::PageAllocation PageTracker::Get(Length n) {
 
   ASSERT(released_by_page_.CountBits(0, kPagesPerHugePage.raw_num()) ==
          released_count_);
+
+  bool known_zero = false;
+  if (ABSL_PREDICT_FALSE(zero_count_ > 0)) {
+    const size_t zero = zero_by_page_.CountBits(index, n.raw_num());
+    known_zero = zero == n.raw_num();
+    zero_by_page_.ClearRange(index, n.raw_num());
+    ASSERT(zero_count_ >= zero);
+    zero_count_ -= zero;
+  }
   return PageAllocation{location_.first_page() + Length(index),
-                        Length(unbacked)};
+                        Length(unbacked), known_zero};
+}
+
+inline void PageTracker::MarkZero() {
+  ASSERT(free_.used() == 0);
+  zero_by_page_.SetRange(0, kPagesPerHugePage.raw_num());
+  zero_count_ = kPagesPerHugePage.raw_num();
 }
 
 inline void PageTracker::Put(PageId p, Length n) {
@@ -1261,18 +1703,55 @@ inline void PageTracker::Put(PageId p, Length n) {
   free_.Unmark(index.raw_num(), n.raw_num());
 }
 
+inline bool PageTracker::CanExtend(PageId p, Length n, Length delta) const {
+  Length index = p - location_.first_page() + n;
+  return free_.IsFree(index.raw_num(), delta.raw_num());
+}
+
+inline Length PageTracker::Extend(PageId p, Length n, Length delta) {
+  ASSERT(CanExtend(p, n, delta));
+  const size_t index = (p - location_.first_page()).raw_num();
+  free_.Extend(index, n.raw_num(), delta.raw_num());
+
+  const size_t grown = index + n.raw_num();
+  size_t unbacked = 0;
+  if (ABSL_PREDICT_FALSE(released_count_ > 0)) {
+    unbacked = released_by_page_.CountBits(grown, delta.raw_num());
+    released_by_page_.ClearRange(grown, delta.raw_num());
+    ASSERT(released_count_ >= unbacked);
+    released_count_ -= unbacked;
+  }
+  if (ABSL_PREDICT_FALSE(zero_count_ > 0)) {
+    const size_t zero = zero_by_page_.CountBits(grown, delta.raw_num());
+    zero_by_page_.ClearRange(grown, delta.raw_num());
+    ASSERT(zero_count_ >= zero);
+    zero_count_ -= zero;
+  }
+  return Length(unbacked);
+}
+
+inline void PageTracker::Shrink(PageId p, Length n, Length new_n) {
+  const size_t index = (p - location_.first_page()).raw_num();
+  free_.Shrink(index, n.raw_num(), new_n.raw_num());
+}
+
 inline Length PageTracker::ReleaseFree(MemoryModifyFunction& unback) {
-  size_t count = 0;
+  SubreleaseBatch batch(unback);
+  ReleaseFree(batch);
+  batch.Flush();
+  return batch.released();
+}
+
+template <typename F>
+inline void PageTracker::IterBackedFreeRanges(F f) const {
   size_t index = 0;
   size_t n;
   // For purposes of tracking, pages which are not yet released are "free" in
-  // the released_by_page_ bitmap.  We subrelease these pages in an iterative
-  // process:
+  // the released_by_page_ bitmap:
   //
   // 1.  Identify the next range of still backed pages.
-  // 2.  Iterate on the free_ tracker within this range.  For any free range
-  //     found, mark these as unbacked.
-  // 3.  Release the subrange to the OS.
+  // 2.  Iterate on the free_ tracker within this range, visiting any free
+  //     range found.
   while (released_by_page_.NextFreeRange(index, &index, &n)) {
     size_t free_index;
     size_t free_n;
@@ -1280,20 +1759,14 @@ inline Length PageTracker::ReleaseFree(MemoryModifyFunction& unback) {
     // Check for freed pages in this unreleased region.
     if (free_.NextFreeRange(index, &free_index, &free_n) &&
         free_index < index + n) {
-      // If there is a free range which overlaps with [index, index+n), release
+      // If there is a free range which overlaps with [index, index+n), visit
       // it.
       size_t end = std::min(free_index + free_n, index + n);
 
       // In debug builds, verify [free_index, end) is backed.
       size_t length = end - free_index;
       ASSERT(released_by_page_.CountBits(free_index, length) == 0);
-      PageId p = location_.first_page() + Length(free_index);
-
-      if (ABSL_PREDICT_TRUE(ReleasePages(p, Length(length), unback))) {
-        // Mark pages as released.  Amortize the update to release_count_.
-        released_by_page_.SetRange(free_index, length);
-        count += length;
-      }
+      f(location_.first_page() + Length(free_index), Length(length));
 
       index = end;
     } else {
@@ -1302,12 +1775,82 @@ inline Length PageTracker::ReleaseFree(MemoryModifyFunction& unback) {
       index += n;
     }
   }
+}
 
-  released_count_ += count;
+template <typename F>
+inline void PageTracker::IterReleasedRanges(F f) const {
+  if (released_count_ == 0) return;
+  size_t index = released_by_page_.FindSet(0);
+  while (index < kPagesPerHugePage.raw_num()) {
+    const size_t end = released_by_page_.FindClear(index);
+    f(location_.first_page() + Length(index), Length(end - index));
+    if (end >= kPagesPerHugePage.raw_num()) break;
+    index = released_by_page_.FindSet(end);
+  }
+}
+
+inline void PageTracker::ReleaseFree(SubreleaseBatch& batch) {
+  // Queue up the backed free pages.  Once the batch is flushed and a range
+  // released to the OS, its pages are marked unbacked (see MarkReleased).
+  IterBackedFreeRanges([&](PageId p, Length n) { batch.Add(this, p, n); });
+}
+
+inline void PageTracker::MarkReleased(PageId p, Length n) {
+  const size_t index = (p - location_.first_page()).raw_num();
+  ASSERT(released_by_page_.CountBits(index, n.raw_num()) == 0);
+  released_by_page_.SetRange(index, n.raw_num());
+  released_count_ += n.raw_num();
+  zero_count_ += n.raw_num() - zero_by_page_.CountBits(index, n.raw_num());
+  zero_by_page_.SetRange(index, n.raw_num());
+  unbroken_ = false;
+  collapse_failed_ = false;
+  // Unbacking part of a hugepage splits it.
+  thp_backed_ = false;
+  // The free pages that were scanned are gone.
+  free_pages_warm_ = false;
   ASSERT(Length(released_count_) <= kPagesPerHugePage);
   ASSERT(released_by_page_.CountBits(0, kPagesPerHugePage.raw_num()) ==
          released_count_);
-  return Length(count);
+}
+
+inline void SubreleaseBatch::Add(PageTracker* pt, PageId p, Length n) {
+  if (granularity_ > 1) {
+    // The pages sharing a base page of the kernel with used ones stay backed.
+    const size_t begin =
+        (p.index() + granularity_ - 1) / granularity_ * granularity_;
+    const size_t end = (p + n).index() / granularity_ * granularity_;
+    if (end <= begin) return;
+    p = PageId{begin};
+    n = Length(end - begin);
+  }
+  if (size_ == kMaxRanges) {
+    Flush();
+  }
+  ranges_[size_] = {p.start_addr(), n.in_bytes()};
+  trackers_[size_] = pt;
+  ++size_;
+}
+
+inline void SubreleaseBatch::Flush() {
+  size_t i = 0;
+  while (i < size_) {
+    size_t calls;
+    const size_t n = unback_.ModifyRanges(
+        absl::MakeConstSpan(ranges_.data() + i, size_ - i), &calls);
+    total_calls_ += calls;
+    for (size_t end = i + n; i < end; ++i) {
+      const Length len = Length(ranges_[i].bytes / kPageSize);
+      trackers_[i]->MarkReleased(PageIdContaining(ranges_[i].ptr), len);
+      total_released_ += len;
+    }
+    // Skip over the range that failed, if any, and carry on with the rest;
+    // the failed pages remain backed and may be retried later.
+    if (i < size_) {
+      ++i;
+    }
+  }
+  total_ranges_ += size_;
+  size_ = 0;
 }
 
 inline void PageTracker::AddSpanStats(SmallSpanStats* small,
@@ -1380,7 +1923,8 @@ inline HugePageFiller<TrackerType>::HugePageFiller(
 
 template <class TrackerType>
 inline typename HugePageFiller<TrackerType>::TryGetResult
-HugePageFiller<TrackerType>::TryGet(Length n, SpanAllocInfo span_alloc_info) {
+HugePageFiller<TrackerType>::TryGet(Length n, SpanAllocInfo span_alloc_info,
+                                    uint8_t partition) {
   ASSERT(n > Length(0));
 
   // How do we choose which hugepage to allocate from (among those with
@@ -1447,6 +1991,14 @@ HugePageFiller<TrackerType>::TryGet(Length n, SpanAllocInfo span_alloc_info) {
   // So all we have to do is find the first nonempty freelist in the regular
   // PageTrackerList that *could* support our allocation, and it will be our
   // best choice. If there is none we repeat with the donated PageTrackerList.
+  //
+  // With partitions, hugepages that hold spans are owned by the partition
+  // (L3 cache domain) that last allocated from them, and we only look at the
+  // first few candidates for one of the requested partition.  Failing that, a
+  // mostly free hugepage of another partition is rebalanced into ours before
+  // we fall back to donated and released hugepages, which belong to no
+  // partition.  Only then do we let the caller allocate a new hugepage rather
+  // than share a hugepage that another partition is filling.
   ASSUME(n < kPagesPerHugePage);
   TrackerType* pt;
 
@@ -1458,7 +2010,18 @@ HugePageFiller<TrackerType>::TryGet(Length n, SpanAllocInfo span_alloc_info) {
           ? AccessDensityPrediction::kDense
           : AccessDensityPrediction::kSparse;
   do {
-    pt = regular_alloc_[type].GetLeast(ListFor(n, 0));
+    if (ABSL_PREDICT_TRUE(partition == kAnyFillerPartition)) {
+      pt = regular_alloc_[type].GetLeast(ListFor(n, 0));
+    } else {
+      pt = regular_alloc_[type].GetLeastMatching(
+          ListFor(n, 0), kPartitionScanLimit,
+          [&](TrackerType* t) { return t->partition() == partition; });
+      if (pt == nullptr) {
+        pt = regular_alloc_[type].GetLeast(
+            ListFor(std::max(n, kPagesPerHugePage / 2), 0));
+        if (pt != nullptr) ++partition_rebalances_;
+      }
+    }
     if (pt) {
       ASSERT(!pt->donated());
       break;
@@ -1493,6 +2056,9 @@ HugePageFiller<TrackerType>::TryGet(Length n, SpanAllocInfo span_alloc_info) {
   // type == AccessDensityPrediction::kDense => pt->HasDenseSpans(). This
   // also verifies we do not end up with a donated pt on the kDense path.
   ASSERT(type == AccessDensityPrediction::kSparse || pt->HasDenseSpans());
+  if (partition != kAnyFillerPartition) {
+    pt->set_partition(partition);
+  }
   const auto page_allocation = pt->Get(n);
   AddToFillerList(pt);
   pages_allocated_[type] += n;
@@ -1510,7 +2076,49 @@ HugePageFiller<TrackerType>::TryGet(Length n, SpanAllocInfo span_alloc_info) {
   // donated by this point.
   ASSERT(!pt->donated());
   UpdateFillerStatsTracker();
-  return {pt, page_allocation.page, was_released};
+  return {pt, page_allocation.page, was_released, page_allocation.known_zero};
+}
+
+template <class TrackerType>
+inline bool HugePageFiller<TrackerType>::TryExtend(TrackerType* pt, PageId p,
+                                                   Length n, Length delta,
+                                                   bool* from_released) {
+  if (!pt->CanExtend(p, n, delta)) return false;
+
+  const AccessDensityPrediction type =
+      pt->HasDenseSpans() ? AccessDensityPrediction::kDense
+                          : AccessDensityPrediction::kSparse;
+  const bool was_released = pt->released();
+  RemoveFromFillerList(pt);
+  const Length unbacked = pt->Extend(p, n, delta);
+  AddToFillerList(pt);
+  pages_allocated_[type] += delta;
+
+  // As in TryGet, record a released hugepage becoming fully backed again.
+  if (was_released && !pt->released() && !pt->was_released()) {
+    pt->set_was_released(/*status=*/true);
+    ++n_was_released_[type];
+  }
+  ASSERT(unmapped_ >= unbacked);
+  unmapped_ -= unbacked;
+  *from_released = unbacked > Length(0);
+  UpdateFillerStatsTracker();
+  return true;
+}
+
+template <class TrackerType>
+inline void HugePageFiller<TrackerType>::Shrink(TrackerType* pt, PageId p,
+                                                Length n, Length new_n) {
+  ASSERT(Length(0) < new_n && new_n < n);
+  const AccessDensityPrediction type =
+      pt->HasDenseSpans() ? AccessDensityPrediction::kDense
+                          : AccessDensityPrediction::kSparse;
+  RemoveFromFillerList(pt);
+  pt->Shrink(p, n, new_n);
+  AddToFillerList(pt);
+  ASSERT(pages_allocated_[type] >= n - new_n);
+  pages_allocated_[type] -= n - new_n;
+  UpdateFillerStatsTracker();
 }
 
 // Marks [p, p + n) as usable by new allocations into *pt; returns pt
@@ -1575,9 +2183,11 @@ inline TrackerType* HugePageFiller<TrackerType>::Put(TrackerType* pt, PageId p,
 
 template <class TrackerType>
 inline void HugePageFiller<TrackerType>::Contribute(
-    TrackerType* pt, bool donated, SpanAllocInfo span_alloc_info) {
+    TrackerType* pt, bool donated, SpanAllocInfo span_alloc_info,
+    uint8_t partition) {
   // A contributed huge page should not yet be subreleased.
   ASSERT(pt->released_pages() == Length(0));
+  pt->set_partition(donated ? kAnyFillerPartition : partition);
 
   const AccessDensityPrediction type =
       ABSL_PREDICT_TRUE(allocs_for_sparse_and_dense_spans_ ==
@@ -1648,14 +2258,25 @@ inline int HugePageFiller<TrackerType>::SelectCandidates(
 template <class TrackerType>
 inline Length HugePageFiller<TrackerType>::ReleaseCandidates(
     absl::Span<TrackerType*> candidates, Length target) {
-  absl::c_sort(candidates, CompareForSubrelease);
+  // Return cold free pages first, keeping those recently touched (and so
+  // likely to be reused) backed.
+  absl::c_sort(candidates, [](TrackerType* a, TrackerType* b) {
+    if (a->free_pages_warm() != b->free_pages_warm()) {
+      return b->free_pages_warm();
+    }
+    return CompareForSubrelease(a, b);
+  });
 
   Length total_released;
   HugeLength total_broken = NHugePages(0);
 #ifndef NDEBUG
   Length last;
+  bool last_warm = false;
 #endif
-  for (int i = 0; i < candidates.size() && total_released < target; i++) {
+  SubreleaseBatch batch(unback_);
+  Length queued;
+  int n_queued = 0;
+  for (int i = 0; i < candidates.size() && queued < target; i++) {
     TrackerType* best = candidates[i];
     ASSERT(best != nullptr);
 
@@ -1668,6 +2289,11 @@ inline Length HugePageFiller<TrackerType>::ReleaseCandidates(
 
 #ifndef NDEBUG
     // Double check that our sorting criteria were applied correctly.
+    if (best->free_pages_warm() != last_warm) {
+      ASSERT(!last_warm);
+      last_warm = true;
+      last = Length(0);
+    }
     ASSERT(last <= best->used_pages());
     last = best->used_pages();
 #endif
@@ -1675,13 +2301,23 @@ inline Length HugePageFiller<TrackerType>::ReleaseCandidates(
     if (best->unbroken()) {
       ++total_broken;
     }
+    // Pull the tracker off its list until the batch is flushed: the list it
+    // belongs on depends on how many of its pages end up released.
     RemoveFromFillerList(best);
-    Length ret = best->ReleaseFree(unback_);
-    unmapped_ += ret;
-    ASSERT(unmapped_ >= best->released_pages());
-    total_released += ret;
-    AddToFillerList(best);
+    queued += best->free_pages() - best->released_pages();
+    best->ReleaseFree(batch);
+    ++n_queued;
+  }
+
+  batch.Flush();
+  total_released = batch.released();
+  unmapped_ += total_released;
+  for (int i = 0; i < n_queued; i++) {
+    ASSERT(unmapped_ >= candidates[i]->released_pages());
+    AddToFillerList(candidates[i]);
   }
+  subrelease_stats_.total_ranges_subreleased += batch.ranges();
+  subrelease_stats_.total_subrelease_calls += batch.calls();
 
   subrelease_stats_.num_pages_subreleased += total_released;
   subrelease_stats_.num_hugepages_broken += total_broken;
@@ -1729,7 +2365,13 @@ inline Length HugePageFiller<TrackerType>::GetDesiredSubreleasePages(
   Length required_pages;
   // As mentioned above, there are two ways to calculate the demand
   // requirement. We give priority to using the peak if peak_interval is set.
-  if (intervals.IsPeakIntervalSet()) {
+  // Alternatively, a predictor forecasts it from the history of peaks.
+  if (intervals.IsPredictorSet()) {
+    required_pages = fillerstats_tracker_.GetForecastDemand(
+        intervals.predictor, intervals.IsPeakIntervalSet()
+                                 ? intervals.peak_interval
+                                 : intervals.long_interval);
+  } else if (intervals.IsPeakIntervalSet()) {
     required_pages =
         fillerstats_tracker_.GetRecentPeak(intervals.peak_interval);
   } else {
@@ -1773,6 +2415,15 @@ inline Length HugePageFiller<TrackerType>::GetDesiredSubreleasePages(
   return desired;
 }
 
+template <class TrackerType>
+inline bool HugePageFiller<TrackerType>::ReleaseLikelyReused(Length desired) {
+  UpdateFillerStatsTracker();
+  const Length current_pages = used_pages() + free_pages();
+  const Length remaining =
+      current_pages > desired ? current_pages - desired : Length(0);
+  return fillerstats_tracker_.GetWindowPeak() > remaining;
+}
+
 // Tries to release desired pages by iteratively releasing from the emptiest
 // possible hugepage and releasing its free memory to the system. Return the
 // number of pages actually released.
@@ -1892,6 +2543,167 @@ inline Length HugePageFiller<TrackerType>::ReleasePages(
   return total_released;
 }
 
+template <class TrackerType>
+inline HugeLength HugePageFiller<TrackerType>::CollapseRefilledHugePages(
+    HugeLength n, MemoryModifyFunction& collapse) {
+  HugeLength attempted = NHugePages(0);
+  HugeLength collapsed = NHugePages(0);
+  if (previously_released_huge_pages() == NHugePages(0)) return collapsed;
+
+  // Collapsing changes none of the properties that place trackers on lists,
+  // so we can do so while iterating over them.
+  auto loop = [&](TrackerType* pt) {
+    if (attempted >= n || !pt->was_released() || pt->released() ||
+        pt->unbroken() || pt->collapse_failed()) {
+      return;
+    }
+    ++attempted;
+    const bool success = collapse(pt->location().start_addr(), kHugePageSize);
+    pt->SetCollapsed(success);
+    if (success) {
+      ++collapsed;
+    }
+  };
+  // The lists run from the fullest hugepages, which are the likeliest to stay
+  // in use.
+  for (const AccessDensityPrediction type :
+       {AccessDensityPrediction::kDense, AccessDensityPrediction::kSparse}) {
+    regular_alloc_[type].Iter(loop, 0);
+  }
+
+  subrelease_stats_.total_hugepages_collapsed += collapsed;
+  subrelease_stats_.total_hugepages_collapse_failed += attempted - collapsed;
+  return collapsed;
+}
+
+template <class TrackerType>
+inline size_t HugePageFiller<TrackerType>::ScanHugePageBacking(
+    size_t n, absl::FunctionRef<std::optional<bool>(HugePage)> is_huge) {
+  size_t scanned = 0;
+  // Scanning leaves trackers on their lists, so we can do so while iterating
+  // over them.
+  auto loop = [&](TrackerType* pt) {
+    if (scanned >= n || pt->backing_scan_epoch() == backing_scan_epoch_) {
+      return;
+    }
+    pt->set_backing_scan_epoch(backing_scan_epoch_);
+    ++scanned;
+    if (std::optional<bool> huge = is_huge(pt->location()); huge.has_value()) {
+      pt->set_thp_backed(*huge);
+    }
+  };
+  donated_alloc_.Iter(loop, 0);
+  for (const AccessDensityPrediction type :
+       {AccessDensityPrediction::kDense, AccessDensityPrediction::kSparse}) {
+    regular_alloc_[type].Iter(loop, 0);
+  }
+  if (scanned < n) {
+    // Every tracker has been scanned in this pass; start the next one.
+    ++backing_scan_epoch_;
+  }
+  return scanned;
+}
+
+template <class TrackerType>
+inline size_t HugePageFiller<TrackerType>::ScanFreePageIdleness(
+    size_t n,
+    absl::FunctionRef<std::optional<size_t>(PageId, Length)> stale_bytes) {
+  size_t scanned = 0;
+  auto loop = [&](TrackerType* pt) {
+    if (scanned >= n || pt->idle_scan_epoch() == idle_scan_epoch_ ||
+        pt->free_pages() == pt->released_pages()) {
+      return;
+    }
+    pt->set_idle_scan_epoch(idle_scan_epoch_);
+    ++scanned;
+    Length backed_free;
+    size_t stale = 0;
+    bool known = true;
+    pt->IterBackedFreeRanges([&](PageId p, Length len) {
+      if (!known) return;
+      std::optional<size_t> bytes = stale_bytes(p, len);
+      if (!bytes.has_value()) {
+        known = false;
+        return;
+      }
+      backed_free += len;
+      stale += *bytes;
+    });
+    if (known) {
+      pt->set_free_pages_warm(stale * 2 < backed_free.in_bytes());
+    }
+  };
+  // Scan the lists in the order ReleasePages subreleases from them.
+  for (const AccessDensityPrediction type :
+       {AccessDensityPrediction::kSparse, AccessDensityPrediction::kDense}) {
+    regular_alloc_partial_released_[type].Iter(loop, 0);
+  }
+  for (const AccessDensityPrediction type :
+       {AccessDensityPrediction::kSparse, AccessDensityPrediction::kDense}) {
+    regular_alloc_[type].Iter(loop, 0);
+  }
+  donated_alloc_.Iter(loop, 0);
+  if (scanned < n) {
+    // Every tracker has been scanned in this pass; start the next one.
+    ++idle_scan_epoch_;
+  }
+  return scanned;
+}
+
+template <class TrackerType>
+inline size_t HugePageFiller<TrackerType>::ScanReleasedResidency(
+    size_t n,
+    absl::FunctionRef<std::optional<size_t>(PageId, Length)> resident_bytes) {
+  size_t scanned = 0;
+  size_t rereleased = 0;
+  auto loop = [&](TrackerType* pt) {
+    if (scanned >= n || pt->residency_scan_epoch() == residency_scan_epoch_) {
+      return;
+    }
+    pt->set_residency_scan_epoch(residency_scan_epoch_);
+    ++scanned;
+    pt->IterReleasedRanges([&](PageId p, Length len) {
+      std::optional<size_t> bytes = resident_bytes(p, len);
+      if (!bytes.has_value() || *bytes == 0) return;
+      // The pages are already accounted as released, so only the OS needs to
+      // hear about them again.
+      if (unback_(p.start_addr(), len.in_bytes())) {
+        rereleased += *bytes;
+      }
+    });
+  };
+  // Only these lists hold trackers with released pages.
+  for (const AccessDensityPrediction type :
+       {AccessDensityPrediction::kSparse, AccessDensityPrediction::kDense}) {
+    regular_alloc_partial_released_[type].Iter(loop, 0);
+  }
+  for (const AccessDensityPrediction type :
+       {AccessDensityPrediction::kSparse, AccessDensityPrediction::kDense}) {
+    regular_alloc_released_[type].Iter(loop, 0);
+  }
+  if (scanned < n) {
+    // Every tracker has been scanned in this pass; start the next one.
+    ++residency_scan_epoch_;
+  }
+  return rereleased;
+}
+
+template <class TrackerType>
+inline Length HugePageFiller<TrackerType>::used_pages_in_thp_backed() const {
+  Length used;
+  auto loop = [&](const TrackerType* pt) {
+    if (pt->thp_backed()) {
+      used += pt->used_pages();
+    }
+  };
+  donated_alloc_.Iter(loop, 0);
+  for (const AccessDensityPrediction type :
+       {AccessDensityPrediction::kDense, AccessDensityPrediction::kSparse}) {
+    regular_alloc_[type].Iter(loop, 0);
+  }
+  return used;
+}
+
 template <class TrackerType>
 inline void HugePageFiller<TrackerType>::AddSpanStats(
     SmallSpanStats* small, LargeSpanStats* large) const {
@@ -2176,6 +2988,19 @@ inline HugePageFillerStats HugePageFiller<TrackerType>::GetStats() const {
   return stats;
 }
 
+template <class TrackerType>
+template <typename F>
+inline void HugePageFiller<TrackerType>::ForEachTracker(F f) const {
+  auto loop = [&](const TrackerType* pt) { f(pt); };
+  donated_alloc_.Iter(loop, 0);
+  for (const AccessDensityPrediction type :
+       {AccessDensityPrediction::kDense, AccessDensityPrediction::kSparse}) {
+    regular_alloc_[type].Iter(loop, 0);
+    regular_alloc_partial_released_[type].Iter(loop, 0);
+    regular_alloc_released_[type].Iter(loop, 0);
+  }
+}
+
 template <class TrackerType>
 inline void HugePageFiller<TrackerType>::Print(Printer* out,
                                                bool everything) const {
@@ -2248,6 +3073,8 @@ inline void HugePageFiller<TrackerType>::Print(Printer* out,
       "HugePageFiller: %zu hugepages were previously released, but "
       "later became full.\n",
       previously_released_huge_pages().raw_num());
+  out->printf("HugePageFiller: %.4f of used pages backed by THPs\n",
+              safe_div(used_pages_in_thp_backed(), used_pages()));
 
   // Subrelease
   out->printf(
@@ -2257,6 +3084,19 @@ inline void HugePageFiller<TrackerType>::Print(Printer* out,
       subrelease_stats_.total_hugepages_broken.raw_num(),
       subrelease_stats_.total_pages_subreleased_due_to_limit.raw_num(),
       subrelease_stats_.total_hugepages_broken_due_to_limit.raw_num());
+  out->printf(
+      "HugePageFiller: Since startup, %zu ranges subreleased in %zu calls "
+      "(%zu calls saved by batching)\n",
+      subrelease_stats_.total_ranges_subreleased,
+      subrelease_stats_.total_subrelease_calls,
+      subrelease_stats_.total_ranges_subreleased -
+          std::min(subrelease_stats_.total_ranges_subreleased,
+                   subrelease_stats_.total_subrelease_calls));
+  out->printf(
+      "HugePageFiller: Since startup, %zu refilled hugepages collapsed to "
+      "hugepages, %zu failed\n",
+      subrelease_stats_.total_hugepages_collapsed.raw_num(),
+      subrelease_stats_.total_hugepages_collapse_failed.raw_num());
 
   if (!everything) return;
 
@@ -2373,6 +3213,8 @@ inline void HugePageFiller<TrackerType>::PrintInPbtxt(PbtxtRegion* hpaa) const {
               pages_allocated_[AccessDensityPrediction::kDense].in_bytes())));
   hpaa->PrintI64("filler_previously_released_huge_pages",
                  previously_released_huge_pages().raw_num());
+  hpaa->PrintI64("filler_thp_backed_used_bytes",
+                 used_pages_in_thp_backed().in_bytes());
   hpaa->PrintI64("filler_num_pages_subreleased",
                  subrelease_stats_.total_pages_subreleased.raw_num());
   hpaa->PrintI64("filler_num_hugepages_broken",
@@ -2383,6 +3225,14 @@ inline void HugePageFiller<TrackerType>::PrintInPbtxt(PbtxtRegion* hpaa) const {
   hpaa->PrintI64(
       "filler_num_hugepages_broken_due_to_limit",
       subrelease_stats_.total_hugepages_broken_due_to_limit.raw_num());
+  hpaa->PrintI64("filler_num_ranges_subreleased",
+                 subrelease_stats_.total_ranges_subreleased);
+  hpaa->PrintI64("filler_num_subrelease_calls",
+                 subrelease_stats_.total_subrelease_calls);
+  hpaa->PrintI64("filler_num_hugepages_collapsed",
+                 subrelease_stats_.total_hugepages_collapsed.raw_num());
+  hpaa->PrintI64("filler_num_hugepages_collapse_failed",
+                 subrelease_stats_.total_hugepages_collapse_failed.raw_num());
   // Compute some histograms of fullness.
   using huge_page_filler_internal::UsageInfo;
   UsageInfo usage;
@@ -2535,7 +3385,13 @@ inline void HugePageFiller<TrackerType>::AddToFillerList(TrackerType* pt) {
           : AccessDensityPrediction::kSparse;
 
   if (!pt->released()) {
-    regular_alloc_[type].Add(pt, i);
+    // Dense spans hold hot small objects; among otherwise equally good
+    // hugepages, steer them to those the kernel backs with THPs.
+    if (pt->HasDenseSpans() && !pt->thp_backed()) {
+      regular_alloc_[type].AddToBack(pt, i);
+    } else {
+      regular_alloc_[type].Add(pt, i);
+    }
   } else if (pt->free_pages() <= pt->released_pages()) {
     regular_alloc_released_[type].Add(pt, i);
     n_used_released_[type] += pt->used_pages();
@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <limits>
 #include <memory>
 #include <random>
 #include <string>
@@ -45,6 +46,7 @@
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_cache.h"
 #include "tcmalloc/huge_pages.h"
@@ -54,6 +56,7 @@
 #include "tcmalloc/pages.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
 
 using tcmalloc::tcmalloc_internal::Length;
 
@@ -341,6 +344,125 @@ TEST_F(PageTrackerTest, ReleasingRetain) {
   mock_.VerifyAndClear();
 }
 
+TEST_F(PageTrackerTest, ReleasingBatched) {
+  // Unbacks every range passed to it in a single call, failing on the range
+  // at fail_at (if any).
+  class BatchingUnback final : public MemoryModifyFunction {
+   public:
+    ABSL_MUST_USE_RESULT bool operator()(void* p, size_t len) override {
+      ADD_FAILURE() << "ranges should be unbacked in batches";
+      return false;
+    }
+
+    ABSL_MUST_USE_RESULT size_t ModifyRanges(
+        absl::Span<const AddressRange> ranges, size_t* calls) override {
+      *calls = 1;
+      ++batches;
+      for (size_t i = 0; i < ranges.size(); ++i, ++seen) {
+        if (seen == fail_at) {
+          ++seen;
+          return i;
+        }
+      }
+      return ranges.size();
+    }
+
+    size_t batches = 0;
+    size_t seen = 0;
+    size_t fail_at = std::numeric_limits<size_t>::max();
+  } unback;
+
+  // Free every other page, so that each free page is its own range.
+  SpanAllocInfo info = {1, AccessDensityPrediction::kSparse};
+  std::vector<PAlloc> allocs;
+  for (Length i; i < kPagesPerHugePage; ++i) {
+    allocs.push_back(Get(Length(1), info));
+  }
+  const size_t kRanges = kPagesPerHugePage.raw_num() / 2;
+  for (size_t i = 0; i < allocs.size(); i += 2) {
+    Put(allocs[i]);
+  }
+
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    SubreleaseBatch batch(unback);
+    unback.fail_at = 3;
+    tracker_.ReleaseFree(batch);
+    batch.Flush();
+    EXPECT_EQ(batch.ranges(), kRanges);
+    EXPECT_EQ(batch.released(), Length(kRanges - 1));
+    // Far fewer calls than ranges: one per batch, plus one to resume after
+    // the failure.
+    EXPECT_EQ(batch.calls(), unback.batches);
+    EXPECT_LT(batch.calls(), kRanges);
+  }
+  EXPECT_EQ(tracker_.released_pages(), Length(kRanges - 1));
+
+  // The range that failed is retried by the next release.
+  unback.fail_at = std::numeric_limits<size_t>::max();
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    EXPECT_EQ(tracker_.ReleaseFree(unback), Length(1));
+  }
+  EXPECT_EQ(tracker_.released_pages(), Length(kRanges));
+
+  for (size_t i = 1; i < allocs.size(); i += 2) {
+    Put(allocs[i]);
+  }
+}
+
+TEST_F(PageTrackerTest, ReleasingWholeSystemPages) {
+  // Releases memory in system pages of four of our pages, recording the
+  // ranges asked for.
+  static constexpr Length kSystemPage = Length(4);
+  class CoarseUnback final : public MemoryModifyFunction {
+   public:
+    ABSL_MUST_USE_RESULT bool operator()(void* p, size_t len) override {
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % kSystemPage.in_bytes(), 0);
+      EXPECT_EQ(len % kSystemPage.in_bytes(), 0);
+      released += Length(len / kPageSize);
+      return true;
+    }
+
+    Length granularity() const override { return kSystemPage; }
+
+    Length released;
+  } unback;
+
+  // [used 3] [free 6] [used 3] [free 2] [used 2] [free ...]: only the system
+  // pages entirely within a free range can be released.
+  SpanAllocInfo info = {1, AccessDensityPrediction::kSparse};
+  PAlloc a1 = Get(Length(3), info);
+  PAlloc a2 = Get(Length(6), info);
+  PAlloc a3 = Get(Length(3), info);
+  PAlloc a4 = Get(Length(2), info);
+  PAlloc a5 = Get(Length(2), info);
+  Put(a2);
+  Put(a4);
+
+  Length released;
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    released = tracker_.ReleaseFree(unback);
+  }
+  // [3, 9) holds the system page [4, 8), [12, 14) none, and [16, end) all of
+  // its own.
+  const Length expected = Length(4) + kPagesPerHugePage - Length(16);
+  EXPECT_EQ(released, expected);
+  EXPECT_EQ(unback.released, expected);
+  EXPECT_EQ(tracker_.released_pages(), expected);
+
+  // Nothing more can be released until more pages are freed.
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    EXPECT_EQ(tracker_.ReleaseFree(unback), Length(0));
+  }
+
+  Put(a1);
+  Put(a3);
+  Put(a5);
+}
+
 TEST_F(PageTrackerTest, ReleasingRetainFailure) {
   static const Length kAllocSize = kPagesPerHugePage / 4;
   SpanAllocInfo info = {1, AccessDensityPrediction::kSparse};
@@ -380,6 +502,42 @@ TEST_F(PageTrackerTest, ReleasingRetainFailure) {
   EXPECT_EQ(tracker_.free_pages(), a1.n + a2.n + a3.n + a4.n);
 }
 
+TEST_F(PageTrackerTest, KnownZero) {
+  static const Length kAllocSize = kPagesPerHugePage / 4;
+  absl::base_internal::SpinLockHolder l(&pageheap_lock);
+  // The pages of a fresh hugepage read as zero until they are first used.
+  tracker_.MarkZero();
+  PageTracker::PageAllocation a1 = tracker_.Get(kAllocSize);
+  EXPECT_TRUE(a1.known_zero);
+  PageTracker::PageAllocation a2 = tracker_.Get(kAllocSize);
+  EXPECT_TRUE(a2.known_zero);
+
+  tracker_.Put(a1.page, kAllocSize);
+  PageTracker::PageAllocation a3 = tracker_.Get(kAllocSize);
+  EXPECT_EQ(a3.page, a1.page);
+  EXPECT_FALSE(a3.known_zero);
+  tracker_.Put(a3.page, kAllocSize);
+
+  // Releasing pages makes them known zero again.
+  mock_.Expect(a1.page.start_addr(), kAllocSize.in_bytes(), true);
+  mock_.Expect((a2.page + kAllocSize).start_addr(),
+               (kPagesPerHugePage - 2 * kAllocSize).in_bytes(), true);
+  tracker_.ReleaseFree(mock_);
+  mock_.VerifyAndClear();
+  PageTracker::PageAllocation a4 = tracker_.Get(kAllocSize);
+  EXPECT_EQ(a4.page, a1.page);
+  EXPECT_TRUE(a4.known_zero);
+
+  // An allocation is only known zero if all of its pages are.
+  tracker_.Put(a2.page, kAllocSize);
+  PageTracker::PageAllocation a5 = tracker_.Get(2 * kAllocSize);
+  EXPECT_EQ(a5.page, a2.page);
+  EXPECT_FALSE(a5.known_zero);
+
+  tracker_.Put(a4.page, kAllocSize);
+  tracker_.Put(a5.page, 2 * kAllocSize);
+}
+
 TEST_F(PageTrackerTest, Defrag) {
   absl::BitGen rng;
   const Length N = absl::GetFlag(FLAGS_page_tracker_defrag_lim);
@@ -721,6 +879,8 @@ class FillerTest : public testing::TestWithParam<
   // where the output is hardcoded, we disable randomization through the
   // variable below.
   bool randomize_density_ = true;
+  // The filler partition of new allocations.
+  uint8_t partition_ = kAnyFillerPartition;
 
   void CheckStats() {
     EXPECT_EQ(filler_.size(), hp_contained_);
@@ -814,7 +974,8 @@ class FillerTest : public testing::TestWithParam<
     ret.span_alloc_info = span_alloc_info;
     if (!donated) {  // Donated means always create a new hugepage
       absl::base_internal::SpinLockHolder l(&pageheap_lock);
-      auto [pt, page, from_released] = filler_.TryGet(n, span_alloc_info);
+      auto [pt, page, from_released, known_zero] =
+          filler_.TryGet(n, span_alloc_info, partition_);
       ret.pt = pt;
       ret.p = page;
       ret.from_released = from_released;
@@ -825,7 +986,7 @@ class FillerTest : public testing::TestWithParam<
         absl::base_internal::SpinLockHolder l(&pageheap_lock);
         ret.p = ret.pt->Get(n).page;
       }
-      filler_.Contribute(ret.pt, donated, span_alloc_info);
+      filler_.Contribute(ret.pt, donated, span_alloc_info, partition_);
       ++hp_contained_;
     }
 
@@ -1067,6 +1228,323 @@ TEST_P(FillerTest, Release) {
   EXPECT_EQ(filler_.previously_released_huge_pages(), NHugePages(0));
 }
 
+class RecordingCollapse final : public MemoryModifyFunction {
+ public:
+  ABSL_MUST_USE_RESULT bool operator()(void* p, size_t len) override {
+    EXPECT_EQ(len, kHugePageSize);
+    collapsed_.push_back(HugePageContaining(p));
+    return success_;
+  }
+
+  std::vector<HugePage> collapsed_;
+  bool success_ = true;
+};
+
+TEST_P(FillerTest, CollapseRefilledHugePages) {
+  static const Length kAlloc = kPagesPerHugePage / 2;
+  PAlloc p1 = Allocate(kAlloc);
+  PAlloc p2 = AllocateWithSpanAllocInfo(kAlloc, p1.span_alloc_info);
+  PAlloc p3 = Allocate(kAlloc - Length(1));
+  PAlloc p4 = AllocateWithSpanAllocInfo(kAlloc + Length(1), p3.span_alloc_info);
+  ASSERT_EQ(p1.pt, p2.pt);
+  ASSERT_NE(p1.pt, p3.pt);
+  RecordingCollapse collapse;
+  auto Collapse = [&](HugeLength n) {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    return filler_.CollapseRefilledHugePages(n, collapse);
+  };
+
+  // Neither hugepage was ever broken.
+  EXPECT_EQ(Collapse(NHugePages(8)), NHugePages(0));
+  EXPECT_TRUE(collapse.collapsed_.empty());
+
+  // Break p1's hugepage.  While pages are still released, it is not
+  // collapsed.
+  Delete(p1);
+  ASSERT_EQ(ReleasePages(kAlloc), kAlloc);
+  ASSERT_TRUE(p2.pt->released());
+  EXPECT_EQ(Collapse(NHugePages(8)), NHugePages(0));
+  EXPECT_TRUE(collapse.collapsed_.empty());
+
+  // Refilling it makes it a candidate.
+  PAlloc p5 = AllocateWithSpanAllocInfo(kAlloc, p2.span_alloc_info);
+  ASSERT_EQ(p5.pt, p2.pt);
+  ASSERT_FALSE(p5.pt->released());
+  EXPECT_FALSE(p5.pt->unbroken());
+  EXPECT_EQ(Collapse(NHugePages(0)), NHugePages(0));
+  EXPECT_EQ(Collapse(NHugePages(8)), NHugePages(1));
+  EXPECT_THAT(collapse.collapsed_, testing::ElementsAre(p5.pt->location()));
+  EXPECT_TRUE(p5.pt->unbroken());
+  EXPECT_EQ(filler_.subrelease_stats().total_hugepages_collapsed,
+            NHugePages(1));
+
+  // Once collapsed, it is not collapsed again.
+  EXPECT_EQ(Collapse(NHugePages(8)), NHugePages(0));
+  EXPECT_EQ(collapse.collapsed_.size(), 1);
+
+  // A failed collapse is not retried until the hugepage is subreleased and
+  // refilled again.
+  Delete(p5);
+  ASSERT_EQ(ReleasePages(kAlloc), kAlloc);
+  PAlloc p6 = AllocateWithSpanAllocInfo(kAlloc, p2.span_alloc_info);
+  ASSERT_EQ(p6.pt, p2.pt);
+  collapse.success_ = false;
+  EXPECT_EQ(Collapse(NHugePages(8)), NHugePages(0));
+  EXPECT_EQ(collapse.collapsed_.size(), 2);
+  EXPECT_FALSE(p6.pt->unbroken());
+  EXPECT_TRUE(p6.pt->collapse_failed());
+  EXPECT_EQ(Collapse(NHugePages(8)), NHugePages(0));
+  EXPECT_EQ(collapse.collapsed_.size(), 2);
+  EXPECT_EQ(filler_.subrelease_stats().total_hugepages_collapse_failed,
+            NHugePages(1));
+
+  Delete(p2);
+  Delete(p3);
+  Delete(p4);
+  Delete(p6);
+}
+
+TEST_P(FillerTest, ScanHugePageBacking) {
+  static const Length kAlloc = kPagesPerHugePage / 2;
+  PAlloc p1 = Allocate(kAlloc);
+  PAlloc p2 = AllocateWithSpanAllocInfo(kAlloc, p1.span_alloc_info);
+  PAlloc p3 = Allocate(kAlloc);
+  PAlloc p4 = AllocateWithSpanAllocInfo(kAlloc, p3.span_alloc_info);
+  ASSERT_NE(p1.pt, p3.pt);
+  EXPECT_TRUE(p1.pt->thp_backed());
+  EXPECT_TRUE(p3.pt->thp_backed());
+  EXPECT_EQ(filler_.used_pages_in_thp_backed(), 4 * kAlloc);
+
+  std::vector<HugePage> scanned;
+  auto Scan = [&](size_t n, std::optional<bool> huge) {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    return filler_.ScanHugePageBacking(n, [&](HugePage p) {
+      scanned.push_back(p);
+      return huge;
+    });
+  };
+
+  // Scanning picks up where it left off.
+  EXPECT_EQ(Scan(1, false), 1);
+  EXPECT_EQ(Scan(1, false), 1);
+  EXPECT_THAT(scanned, testing::UnorderedElementsAre(p1.pt->location(),
+                                                     p3.pt->location()));
+  EXPECT_FALSE(p1.pt->thp_backed());
+  EXPECT_FALSE(p3.pt->thp_backed());
+  EXPECT_EQ(filler_.used_pages_in_thp_backed(), Length(0));
+  // Having covered every tracker, the next call starts a new pass.
+  EXPECT_EQ(Scan(8, false), 0);
+  EXPECT_EQ(Scan(8, true), 2);
+  EXPECT_TRUE(p1.pt->thp_backed());
+  EXPECT_TRUE(p3.pt->thp_backed());
+  EXPECT_EQ(filler_.used_pages_in_thp_backed(), 4 * kAlloc);
+
+  // Unknown backing leaves the state as is.
+  EXPECT_EQ(Scan(8, std::nullopt), 2);
+  EXPECT_TRUE(p1.pt->thp_backed());
+
+  // Subreleased hugepages are known not to be backed, and not scanned.
+  Delete(p1);
+  ASSERT_EQ(ReleasePages(kAlloc), kAlloc);
+  EXPECT_FALSE(p2.pt->thp_backed());
+  EXPECT_EQ(filler_.used_pages_in_thp_backed(), 2 * kAlloc);
+  scanned.clear();
+  EXPECT_EQ(Scan(8, true), 1);
+  EXPECT_THAT(scanned, testing::ElementsAre(p3.pt->location()));
+  EXPECT_FALSE(p2.pt->thp_backed());
+
+  Delete(p2);
+  Delete(p3);
+  Delete(p4);
+}
+
+TEST_P(FillerTest, ReleasePrefersColdFreePages) {
+  static const Length kQuarter = kPagesPerHugePage / 4;
+  // Two hugepages, a with more free pages than b.
+  PAlloc a = Allocate(kQuarter);
+  PAlloc a_fill = AllocateWithSpanAllocInfo(kPagesPerHugePage - kQuarter,
+                                            a.span_alloc_info);
+  PAlloc b = AllocateWithSpanAllocInfo(2 * kQuarter, a.span_alloc_info);
+  PAlloc b_fill = AllocateWithSpanAllocInfo(2 * kQuarter, a.span_alloc_info);
+  ASSERT_EQ(a.pt, a_fill.pt);
+  ASSERT_EQ(b.pt, b_fill.pt);
+  ASSERT_NE(a.pt, b.pt);
+  Delete(a_fill);
+  Delete(b_fill);
+
+  Length scanned_pages;
+  auto Scan = [&](size_t n, auto stale_bytes) {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    return filler_.ScanFreePageIdleness(
+        n, [&](PageId p, Length len) -> std::optional<size_t> {
+          scanned_pages += len;
+          return stale_bytes(p, len);
+        });
+  };
+
+  // The free pages of a were recently touched, those of b were not.
+  EXPECT_EQ(Scan(8,
+                 [&](PageId p, Length len) -> std::optional<size_t> {
+                   return HugePageContaining(p) == a.pt->location()
+                              ? 0
+                              : len.in_bytes();
+                 }),
+            2);
+  EXPECT_EQ(scanned_pages, a.pt->free_pages() + b.pt->free_pages());
+  EXPECT_TRUE(a.pt->free_pages_warm());
+  EXPECT_FALSE(b.pt->free_pages_warm());
+
+  // Unknown staleness leaves the state as is.
+  EXPECT_EQ(Scan(8,
+                 [](PageId, Length) -> std::optional<size_t> {
+                   return std::nullopt;
+                 }),
+            2);
+  EXPECT_TRUE(a.pt->free_pages_warm());
+
+  // Though a has the most free pages, b's cold ones are released first.
+  EXPECT_EQ(ReleasePages(Length(1)), 2 * kQuarter);
+  EXPECT_EQ(a.pt->released_pages(), Length(0));
+  EXPECT_EQ(b.pt->released_pages(), 2 * kQuarter);
+  EXPECT_FALSE(b.pt->free_pages_warm());
+
+  // Hugepages without backed free pages are not scanned.
+  EXPECT_EQ(Scan(8,
+                 [](PageId, Length) -> std::optional<size_t> { return 0; }),
+            1);
+
+  Delete(a);
+  Delete(b);
+}
+
+TEST_P(FillerTest, ScanReleasedResidency) {
+  static const Length kHalf = kPagesPerHugePage / 2;
+  // Two hugepages with their second halves released.
+  PAlloc a = Allocate(kHalf);
+  PAlloc a_fill = AllocateWithSpanAllocInfo(kHalf, a.span_alloc_info);
+  PAlloc b = AllocateWithSpanAllocInfo(kHalf, a.span_alloc_info);
+  PAlloc b_fill = AllocateWithSpanAllocInfo(kHalf, a.span_alloc_info);
+  ASSERT_EQ(a.pt, a_fill.pt);
+  ASSERT_EQ(b.pt, b_fill.pt);
+  ASSERT_NE(a.pt, b.pt);
+  Delete(a_fill);
+  Delete(b_fill);
+  ASSERT_EQ(ReleasePages(2 * kHalf), 2 * kHalf);
+
+  std::vector<HugePage> scanned;
+  auto Scan = [&](size_t n, auto resident_bytes) {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    return filler_.ScanReleasedResidency(
+        n, [&](PageId p, Length len) -> std::optional<size_t> {
+          scanned.push_back(HugePageContaining(p));
+          return resident_bytes(p, len);
+        });
+  };
+
+  // One page of a was touched after it was released.
+  auto touched = [&](PageId p, Length len) -> std::optional<size_t> {
+    return HugePageContaining(p) == a.pt->location() ? kPageSize : 0;
+  };
+  EXPECT_EQ(Scan(1, touched) + Scan(1, touched), kPageSize);
+  EXPECT_THAT(scanned, testing::UnorderedElementsAre(a.pt->location(),
+                                                     b.pt->location()));
+  // The pages were already accounted as released.
+  EXPECT_EQ(a.pt->released_pages(), kHalf);
+  EXPECT_EQ(filler_.unmapped_pages(), 2 * kHalf);
+
+  // Both hugepages have been scanned in this pass.
+  scanned.clear();
+  EXPECT_EQ(Scan(1, touched), 0);
+  EXPECT_THAT(scanned, testing::IsEmpty());
+
+  // Unknown residency leaves released pages alone.
+  EXPECT_EQ(Scan(8,
+                 [](PageId, Length) -> std::optional<size_t> {
+                   return std::nullopt;
+                 }),
+            0);
+  EXPECT_EQ(scanned.size(), 2);
+
+  Delete(a);
+  Delete(b);
+}
+
+TEST_P(FillerTest, DenseSpansPreferThpBacked) {
+  if (std::get<0>(GetParam()) == HugePageFillerAllocsOption::kUnifiedAllocs) {
+    GTEST_SKIP() << "Skipping test for kUnifiedAllocs";
+  }
+  const SpanAllocInfo kDense = {.objects_per_span = 1,
+                                .density = AccessDensityPrediction::kDense};
+  // Two hugepages with a page free each, and so on the same list.
+  PAlloc a = AllocateWithSpanAllocInfo(kPagesPerHugePage - Length(1), kDense);
+  PAlloc b = AllocateWithSpanAllocInfo(kPagesPerHugePage - Length(1), kDense);
+  ASSERT_NE(a.pt, b.pt);
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    filler_.ScanHugePageBacking(2, [&](HugePage p) {
+      return std::optional<bool>(p != b.pt->location());
+    });
+  }
+  ASSERT_TRUE(a.pt->thp_backed());
+  ASSERT_FALSE(b.pt->thp_backed());
+
+  // b was added to the list last, and so is used first.  Once it is put back
+  // on the list, the THP-backed a takes precedence.
+  PAlloc c = AllocateWithSpanAllocInfo(Length(1), kDense);
+  ASSERT_EQ(c.pt, b.pt);
+  Delete(c);
+  PAlloc d = AllocateWithSpanAllocInfo(Length(1), kDense);
+  EXPECT_EQ(d.pt, a.pt);
+
+  Delete(a);
+  Delete(b);
+  Delete(d);
+}
+
+TEST_P(FillerTest, Partitions) {
+  const SpanAllocInfo kSparse = {.objects_per_span = 1,
+                                 .density = AccessDensityPrediction::kSparse};
+  const Length kMostly = kPagesPerHugePage - Length(8);
+
+  // Each partition fills a hugepage of its own, even though the other's has
+  // room.
+  partition_ = 0;
+  PAlloc a1 = AllocateWithSpanAllocInfo(kMostly, kSparse);
+  partition_ = 1;
+  PAlloc b1 = AllocateWithSpanAllocInfo(Length(1), kSparse);
+  EXPECT_NE(b1.pt, a1.pt);
+  EXPECT_EQ(a1.pt->partition(), 0);
+  EXPECT_EQ(b1.pt->partition(), 1);
+  partition_ = 0;
+  PAlloc a2 = AllocateWithSpanAllocInfo(Length(1), kSparse);
+  EXPECT_EQ(a2.pt, a1.pt);
+  partition_ = 1;
+  PAlloc b2 = AllocateWithSpanAllocInfo(Length(1), kSparse);
+  EXPECT_EQ(b2.pt, b1.pt);
+  EXPECT_EQ(filler_.partition_rebalances(), 0);
+
+  // A partition without a hugepage of its own takes over a mostly free one
+  // rather than starting another.
+  Delete(a1);
+  partition_ = 2;
+  PAlloc c = AllocateWithSpanAllocInfo(Length(1), kSparse);
+  EXPECT_TRUE(c.pt == a2.pt || c.pt == b1.pt);
+  EXPECT_EQ(c.pt->partition(), 2);
+  EXPECT_EQ(filler_.partition_rebalances(), 1);
+  EXPECT_EQ(filler_.size(), NHugePages(2));
+
+  // Without a partition, any hugepage will do.
+  partition_ = kAnyFillerPartition;
+  PAlloc d = AllocateWithSpanAllocInfo(Length(1), kSparse);
+  EXPECT_EQ(filler_.size(), NHugePages(2));
+
+  Delete(a2);
+  Delete(b1);
+  Delete(b2);
+  Delete(c);
+  Delete(d);
+}
+
 TEST_P(FillerTest, ReleaseZero) {
   // Trying to release no pages should not crash.
   EXPECT_EQ(
@@ -2294,6 +2772,33 @@ TEST_F(FillerStatsTrackerTest, ComputeRecentDemand) {
       testing::HasSubstr("short_interval <= long_interval"));
 }
 
+TEST_F(FillerStatsTrackerTest, ForecastDemand) {
+  // Demand declines steadily, by one step per epoch.
+  const absl::Duration kEpoch = kWindow / 16;
+  for (int peak = 80; peak > 0; peak -= 10) {
+    Advance(kEpoch);
+    GenerateDemandPoint(Length(peak), Length(0));
+  }
+
+  // The trend-following forecast is far below the highest peak, which the
+  // quantile retains.
+  EXPECT_EQ(tracker_.GetRecentPeak(kWindow), Length(80));
+  EXPECT_EQ(tracker_.GetForecastDemand(SubreleaseDemandPredictor::kQuantile,
+                                       absl::ZeroDuration()),
+            Length(80));
+  EXPECT_LT(tracker_.GetForecastDemand(SubreleaseDemandPredictor::kHolt,
+                                       absl::ZeroDuration()),
+            Length(20));
+  EXPECT_LT(tracker_.GetForecastDemand(SubreleaseDemandPredictor::kEwma,
+                                       absl::ZeroDuration()),
+            Length(80));
+
+  // Only the peaks of the last three epochs (30, 20 and 10) are considered.
+  EXPECT_EQ(tracker_.GetForecastDemand(SubreleaseDemandPredictor::kQuantile,
+                                       kEpoch * 3),
+            Length(30));
+}
+
 TEST_F(FillerStatsTrackerTest, TrackCorrectSubreleaseDecisions) {
   // First peak (large)
   GenerateDemandPoint(Length(1000), Length(1000));
@@ -2837,7 +3342,10 @@ HugePageFiller: 998 used pages in subreleased hugepages (0 of them in partially
 HugePageFiller: 4 hugepages partially released, 0.0254 released
 HugePageFiller: 0.7186 of used pages hugepageable
 HugePageFiller: 0 hugepages were previously released, but later became full.
+HugePageFiller: 0.7186 of used pages backed by THPs
 HugePageFiller: Since startup, 282 pages subreleased, 5 hugepages broken, (0 pages, 0 hugepages due to reaching tcmalloc limit)
+HugePageFiller: Since startup, 5 ranges subreleased in 5 calls (0 calls saved by batching)
+HugePageFiller: Since startup, 0 refilled hugepages collapsed to hugepages, 0 failed
 
 HugePageFiller: fullness histograms
 
@@ -3218,6 +3726,63 @@ INSTANTIATE_TEST_SUITE_P(
                         HugePageFillerAllocsOption::kSeparateAllocs),
         testing::Values(8, 12, 16)));
 
+TEST(ForecastPeakDemandTest, Empty) {
+  for (auto predictor :
+       {SubreleaseDemandPredictor::kEwma, SubreleaseDemandPredictor::kQuantile,
+        SubreleaseDemandPredictor::kHolt}) {
+    EXPECT_EQ(huge_page_filler_internal::ForecastPeakDemand(predictor, {}),
+              Length(0));
+  }
+}
+
+TEST(ForecastPeakDemandTest, Constant) {
+  const std::vector<Length> peaks(8, Length(50));
+  for (auto predictor :
+       {SubreleaseDemandPredictor::kEwma, SubreleaseDemandPredictor::kQuantile,
+        SubreleaseDemandPredictor::kHolt}) {
+    SCOPED_TRACE(SubreleaseDemandPredictorName(predictor));
+    EXPECT_EQ(huge_page_filler_internal::ForecastPeakDemand(predictor, peaks),
+              Length(50));
+  }
+}
+
+TEST(ForecastPeakDemandTest, OldSpikeIsForgotten) {
+  std::vector<Length> peaks(16, Length(10));
+  peaks[0] = Length(100);
+  EXPECT_EQ(huge_page_filler_internal::ForecastPeakDemand(
+                SubreleaseDemandPredictor::kEwma, peaks),
+            Length(11));
+  EXPECT_EQ(huge_page_filler_internal::ForecastPeakDemand(
+                SubreleaseDemandPredictor::kQuantile, peaks),
+            Length(10));
+  EXPECT_EQ(huge_page_filler_internal::ForecastPeakDemand(
+                SubreleaseDemandPredictor::kHolt, peaks),
+            Length(13));
+}
+
+TEST(ForecastPeakDemandTest, GrowthIsCappedAtHighestPeak) {
+  std::vector<Length> peaks;
+  for (size_t i = 1; i <= 20; ++i) {
+    peaks.push_back(Length(i));
+  }
+  EXPECT_EQ(huge_page_filler_internal::ForecastPeakDemand(
+                SubreleaseDemandPredictor::kEwma, peaks),
+            Length(20));
+  EXPECT_EQ(huge_page_filler_internal::ForecastPeakDemand(
+                SubreleaseDemandPredictor::kQuantile, peaks),
+            Length(18));
+  EXPECT_EQ(huge_page_filler_internal::ForecastPeakDemand(
+                SubreleaseDemandPredictor::kHolt, peaks),
+            Length(20));
+}
+
+TEST(SkipSubreleaseIntervalsTest, PredictorIsEnabled) {
+  SkipSubreleaseIntervals intervals;
+  intervals.predictor = SubreleaseDemandPredictor::kHolt;
+  EXPECT_TRUE(intervals.IsPredictorSet());
+  EXPECT_TRUE(intervals.SkipSubreleaseEnabled());
+}
+
 TEST(SkipSubreleaseIntervalsTest, EmptyIsNotEnabled) {
   // When we have a limit hit, we pass SkipSubreleaseIntervals{} to the
   // filler. Make sure it doesn't signal that we should skip the limit.
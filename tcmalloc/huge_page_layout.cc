@@ -0,0 +1,105 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/huge_page_layout.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+bool HugePageLayoutWriter::AddHeader(size_t page_size,
+                                     size_t pages_per_hugepage) {
+  HugePageLayoutHeader header = {};
+  memcpy(header.magic, kHugePageLayoutMagic, sizeof(header.magic));
+  header.version = kHugePageLayoutVersion;
+  header.page_size = page_size;
+  header.pages_per_hugepage = pages_per_hugepage;
+  if (buffer_.size() - size_ < sizeof(header)) return false;
+  memcpy(buffer_.data() + size_, &header, sizeof(header));
+  size_ += sizeof(header);
+  return true;
+}
+
+bool HugePageLayoutWriter::AddRecord(
+    const HugePageLayoutRecord& record,
+    absl::Span<const HugePageLayoutCell> cells) {
+  if (!HasRoom(cells.size())) return false;
+  memcpy(buffer_.data() + size_, &record, sizeof(record));
+  size_ += sizeof(record);
+  memcpy(buffer_.data() + size_, cells.data(),
+         cells.size() * sizeof(HugePageLayoutCell));
+  size_ += cells.size() * sizeof(HugePageLayoutCell);
+  return true;
+}
+
+bool HugePageLayoutReader::Init(absl::string_view data) {
+  ok_ = false;
+  if (data.size() < sizeof(header_)) return false;
+  memcpy(&header_, data.data(), sizeof(header_));
+  if (memcmp(header_.magic, kHugePageLayoutMagic, sizeof(header_.magic)) !=
+          0 ||
+      header_.version != kHugePageLayoutVersion ||
+      header_.pages_per_hugepage == 0) {
+    return false;
+  }
+  rest_ = data.substr(sizeof(header_));
+  ok_ = true;
+  return true;
+}
+
+bool HugePageLayoutReader::Next(HugePageLayoutRecord* record,
+                                std::vector<HugePageLayoutCell>* cells) {
+  if (!ok_ || rest_.empty()) return false;
+  if (rest_.size() < sizeof(*record)) {
+    ok_ = false;
+    return false;
+  }
+  memcpy(record, rest_.data(), sizeof(*record));
+  rest_.remove_prefix(sizeof(*record));
+
+  size_t num_cells;
+  switch (record->source) {
+    case HugePageLayoutSource::kFiller:
+    case HugePageLayoutSource::kRegion:
+      num_cells = header_.pages_per_hugepage;
+      break;
+    case HugePageLayoutSource::kCache:
+      num_cells = 0;
+      break;
+    default:
+      ok_ = false;
+      return false;
+  }
+  if (rest_.size() < num_cells * sizeof(HugePageLayoutCell)) {
+    ok_ = false;
+    return false;
+  }
+  cells->resize(num_cells);
+  memcpy(cells->data(), rest_.data(), num_cells * sizeof(HugePageLayoutCell));
+  rest_.remove_prefix(num_cells * sizeof(HugePageLayoutCell));
+  return true;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
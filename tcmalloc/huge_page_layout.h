@@ -0,0 +1,173 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The binary format of MallocExtension::WriteHugePageLayout().
+//
+// A dump is a HugePageLayoutHeader followed by any number of records.  Each
+// record is a HugePageLayoutRecord followed, for hugepages of the filler and
+// of regions, by header.pages_per_hugepage HugePageLayoutCells, one per page.
+// Cache records cover runs of whole free hugepages and carry no cells.  All
+// fields are in the byte order of the process that wrote the dump.
+//
+// Within each heap (tag) and source, records are in increasing order of
+// address.  The dump is gathered a chunk at a time, so hugepages may move
+// between sources, or appear twice, while it is being written.
+
+#ifndef TCMALLOC_HUGE_PAGE_LAYOUT_H_
+#define TCMALLOC_HUGE_PAGE_LAYOUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+inline constexpr char kHugePageLayoutMagic[8] = {'T', 'C', 'H', 'P',
+                                                 'L', 'A', 'Y', 'T'};
+inline constexpr uint32_t kHugePageLayoutVersion = 1;
+
+struct HugePageLayoutHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t pages_per_hugepage;
+  uint32_t reserved;
+};
+static_assert(sizeof(HugePageLayoutHeader) == 24);
+
+enum class HugePageLayoutSource : uint8_t {
+  kFiller = 1,
+  kRegion = 2,
+  kCache = 3,
+};
+
+// HugePageLayoutRecord::flags.
+// A filler hugepage donated by the tail of a large allocation.
+inline constexpr uint8_t kHugePageLayoutDonated = 1 << 0;
+// A region hugepage that is not backed; all its pages are released.
+inline constexpr uint8_t kHugePageLayoutUnbacked = 1 << 1;
+// Cached hugepages evicted from the cache whose release is still pending.
+inline constexpr uint8_t kHugePageLayoutPendingRelease = 1 << 2;
+
+struct HugePageLayoutRecord {
+  // The page number of the first page, that is its address / page_size.
+  uint64_t first_page;
+  // 1 for filler and region records.
+  uint32_t num_hugepages;
+  HugePageLayoutSource source;
+  // The MemoryTag of the heap holding the hugepages.
+  uint8_t tag;
+  uint8_t flags;
+  uint8_t reserved;
+};
+static_assert(sizeof(HugePageLayoutRecord) == 16);
+
+enum class HugePageLayoutPageState : uint8_t {
+  kFree = 0,      // Free and backed
+  kReleased = 1,  // Free and released to the OS
+  kUsed = 2,      // Allocated
+};
+
+// A page's state in the top two bits and, for used pages of small object
+// spans, the span's size class in the rest (0 for other pages).
+using HugePageLayoutCell = uint16_t;
+
+inline constexpr int kHugePageLayoutStateShift = 14;
+
+constexpr HugePageLayoutCell MakeHugePageLayoutCell(
+    HugePageLayoutPageState state, size_t size_class = 0) {
+  return static_cast<HugePageLayoutCell>(
+      static_cast<unsigned>(state) << kHugePageLayoutStateShift |
+      (size_class & ((1u << kHugePageLayoutStateShift) - 1)));
+}
+
+constexpr HugePageLayoutPageState HugePageLayoutCellState(
+    HugePageLayoutCell cell) {
+  return static_cast<HugePageLayoutPageState>(cell >>
+                                              kHugePageLayoutStateShift);
+}
+
+constexpr size_t HugePageLayoutCellSizeClass(HugePageLayoutCell cell) {
+  return cell & ((1u << kHugePageLayoutStateShift) - 1);
+}
+
+// Appends a dump to a caller-provided buffer.  Does not allocate.
+class HugePageLayoutWriter {
+ public:
+  explicit HugePageLayoutWriter(absl::Span<char> buffer)
+      : buffer_(buffer), size_(0) {}
+
+  HugePageLayoutWriter(const HugePageLayoutWriter&) = delete;
+  HugePageLayoutWriter& operator=(const HugePageLayoutWriter&) = delete;
+
+  // Appends the header of a dump of <pages_per_hugepage> pages of
+  // <page_size> bytes per hugepage.  Returns false if there is no room.
+  bool AddHeader(size_t page_size, size_t pages_per_hugepage);
+
+  // Whether a record with <num_cells> cells fits.
+  bool HasRoom(size_t num_cells) const {
+    return buffer_.size() - size_ >=
+           sizeof(HugePageLayoutRecord) +
+               num_cells * sizeof(HugePageLayoutCell);
+  }
+
+  // Appends <record> and its <cells>.  Returns false, appending nothing, if
+  // there is no room.
+  bool AddRecord(const HugePageLayoutRecord& record,
+                 absl::Span<const HugePageLayoutCell> cells);
+
+  absl::string_view data() const { return {buffer_.data(), size_}; }
+  bool empty() const { return size_ == 0; }
+  void Clear() { size_ = 0; }
+
+ private:
+  absl::Span<char> buffer_;
+  size_t size_;
+};
+
+// Reads back a dump written by HugePageLayoutWriter.  For tools and tests;
+// not for use within the allocator.
+class HugePageLayoutReader {
+ public:
+  // Reads the header at the start of <data>, which must outlive the reader.
+  // Returns false if it is missing or of an unknown version.
+  bool Init(absl::string_view data);
+
+  const HugePageLayoutHeader& header() const { return header_; }
+
+  // Reads the next record and its cells.  Returns false at the end of the
+  // dump, or if the rest of it is malformed, in which case ok() is false.
+  bool Next(HugePageLayoutRecord* record,
+            std::vector<HugePageLayoutCell>* cells);
+
+  bool ok() const { return ok_; }
+
+ private:
+  HugePageLayoutHeader header_ = {};
+  absl::string_view rest_;
+  bool ok_ = false;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_HUGE_PAGE_LAYOUT_H_
@@ -0,0 +1,145 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/huge_page_layout.h"
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/types/span.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr size_t kPages = 4;
+
+TEST(HugePageLayoutTest, Cells) {
+  constexpr HugePageLayoutCell cell =
+      MakeHugePageLayoutCell(HugePageLayoutPageState::kUsed, 171);
+  static_assert(HugePageLayoutCellState(cell) ==
+                HugePageLayoutPageState::kUsed);
+  static_assert(HugePageLayoutCellSizeClass(cell) == 171);
+  static_assert(HugePageLayoutCellState(MakeHugePageLayoutCell(
+                    HugePageLayoutPageState::kReleased)) ==
+                HugePageLayoutPageState::kReleased);
+  static_assert(HugePageLayoutCellSizeClass(
+                    MakeHugePageLayoutCell(HugePageLayoutPageState::kFree)) ==
+                0);
+}
+
+TEST(HugePageLayoutTest, RoundTrip) {
+  std::string buffer(1024, '\0');
+  HugePageLayoutWriter writer(absl::MakeSpan(buffer));
+  ASSERT_TRUE(writer.AddHeader(8192, kPages));
+
+  const HugePageLayoutCell cells[kPages] = {
+      MakeHugePageLayoutCell(HugePageLayoutPageState::kUsed, 3),
+      MakeHugePageLayoutCell(HugePageLayoutPageState::kUsed, 3),
+      MakeHugePageLayoutCell(HugePageLayoutPageState::kFree),
+      MakeHugePageLayoutCell(HugePageLayoutPageState::kReleased),
+  };
+  HugePageLayoutRecord filler = {};
+  filler.first_page = 1024;
+  filler.num_hugepages = 1;
+  filler.source = HugePageLayoutSource::kFiller;
+  filler.flags = kHugePageLayoutDonated;
+  ASSERT_TRUE(writer.AddRecord(filler, cells));
+  HugePageLayoutRecord cache = {};
+  cache.first_page = 4096;
+  cache.num_hugepages = 7;
+  cache.source = HugePageLayoutSource::kCache;
+  cache.tag = 2;
+  ASSERT_TRUE(writer.AddRecord(cache, {}));
+
+  HugePageLayoutReader reader;
+  ASSERT_TRUE(reader.Init(writer.data()));
+  EXPECT_EQ(reader.header().page_size, 8192);
+  EXPECT_EQ(reader.header().pages_per_hugepage, kPages);
+
+  HugePageLayoutRecord record;
+  std::vector<HugePageLayoutCell> read_cells;
+  ASSERT_TRUE(reader.Next(&record, &read_cells));
+  EXPECT_EQ(record.first_page, 1024);
+  EXPECT_EQ(record.source, HugePageLayoutSource::kFiller);
+  EXPECT_EQ(record.flags, kHugePageLayoutDonated);
+  EXPECT_THAT(read_cells, testing::ElementsAreArray(cells));
+
+  ASSERT_TRUE(reader.Next(&record, &read_cells));
+  EXPECT_EQ(record.first_page, 4096);
+  EXPECT_EQ(record.num_hugepages, 7);
+  EXPECT_EQ(record.source, HugePageLayoutSource::kCache);
+  EXPECT_EQ(record.tag, 2);
+  EXPECT_THAT(read_cells, testing::IsEmpty());
+
+  EXPECT_FALSE(reader.Next(&record, &read_cells));
+  EXPECT_TRUE(reader.ok());
+}
+
+TEST(HugePageLayoutTest, WriterFull) {
+  std::string buffer(sizeof(HugePageLayoutHeader) +
+                         sizeof(HugePageLayoutRecord) +
+                         kPages * sizeof(HugePageLayoutCell),
+                     '\0');
+  HugePageLayoutWriter writer(absl::MakeSpan(buffer));
+  ASSERT_TRUE(writer.AddHeader(8192, kPages));
+  const HugePageLayoutCell cells[kPages] = {};
+  HugePageLayoutRecord record = {};
+  record.source = HugePageLayoutSource::kRegion;
+  EXPECT_TRUE(writer.HasRoom(kPages));
+  EXPECT_TRUE(writer.AddRecord(record, cells));
+  EXPECT_FALSE(writer.HasRoom(0));
+  const size_t size = writer.data().size();
+  EXPECT_FALSE(writer.AddRecord(record, cells));
+  EXPECT_EQ(writer.data().size(), size);
+
+  writer.Clear();
+  EXPECT_TRUE(writer.empty());
+}
+
+TEST(HugePageLayoutTest, RejectsMalformed) {
+  std::string buffer(1024, '\0');
+  HugePageLayoutWriter writer(absl::MakeSpan(buffer));
+  ASSERT_TRUE(writer.AddHeader(8192, kPages));
+  const HugePageLayoutCell cells[kPages] = {};
+  HugePageLayoutRecord record = {};
+  record.source = HugePageLayoutSource::kFiller;
+  ASSERT_TRUE(writer.AddRecord(record, cells));
+
+  HugePageLayoutReader reader;
+  EXPECT_FALSE(reader.Init(""));
+  EXPECT_FALSE(reader.Init(std::string(sizeof(HugePageLayoutHeader), 'x')));
+
+  // A record cut short.
+  std::vector<HugePageLayoutCell> read_cells;
+  ASSERT_TRUE(reader.Init(writer.data().substr(0, writer.data().size() - 1)));
+  EXPECT_FALSE(reader.Next(&record, &read_cells));
+  EXPECT_FALSE(reader.ok());
+
+  // An unknown source.
+  std::string bad(writer.data());
+  bad[sizeof(HugePageLayoutHeader) + offsetof(HugePageLayoutRecord, source)] =
+      42;
+  ASSERT_TRUE(reader.Init(bad));
+  EXPECT_FALSE(reader.Next(&record, &read_cells));
+  EXPECT_FALSE(reader.ok());
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -132,6 +132,15 @@ inline constexpr HugeLength HLFromPages(Length pages) {
                     kPagesPerHugePage);
 }
 
+// Gigapages are the tier above hugepages.  When a HugeAllocator is configured
+// for gigapage backing, address space is obtained from (and returned to) the
+// system only in whole, aligned gigapages.
+inline constexpr size_t kGigaPageShift = 30;
+inline constexpr size_t kGigaPageSize = size_t{1} << kGigaPageShift;
+static_assert(kGigaPageSize % kHugePageSize == 0);
+inline constexpr HugeLength kHugePagesPerGigaPage =
+    NHugePages(kGigaPageSize / kHugePageSize);
+
 inline HugeLength& operator++(HugeLength& len) {  // NOLINT(runtime/references)
   len.n++;
   return len;
@@ -369,6 +378,18 @@ inline std::pair<HugeRange, HugeRange> Split(HugeRange r, HugeLength n) {
   }
 }
 
+// Returns the largest subrange of r that consists of whole, aligned
+// gigapages, or Nil if r does not cover any gigapage entirely.
+inline HugeRange GigaPageInterior(HugeRange r) {
+  const uintptr_t per_gigapage = kHugePagesPerGigaPage.raw_num();
+  const uintptr_t begin =
+      (r.start().index() + per_gigapage - 1) / per_gigapage * per_gigapage;
+  const uintptr_t end =
+      (r.start().index() + r.len().raw_num()) / per_gigapage * per_gigapage;
+  if (begin >= end) return HugeRange::Nil();
+  return HugeRange::Make(HugePage{begin}, NHugePages(end - begin));
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
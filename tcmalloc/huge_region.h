@@ -18,11 +18,14 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <optional>
 
 #include "absl/base/attributes.h"
 #include "absl/base/internal/cycleclock.h"
 #include "absl/base/optimization.h"
+#include "absl/functional/function_ref.h"
 #include "tcmalloc/huge_cache.h"
+#include "tcmalloc/huge_page_layout.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/linked_list.h"
@@ -48,6 +51,15 @@ enum class HugeRegionUsageOption : bool {
   kUseForAllLargeAllocs
 };
 
+enum class HugeRegionAllocOption : bool {
+  // Allocate from the most fragmented region (the one with the shortest
+  // longest free range) that fits.
+  kMostFragmented,
+  // Allocate from the region with the most used pages that fits, so that
+  // allocations concentrate in few regions and the others drain entirely.
+  kDensest,
+};
+
 // Track allocations from a fixed-size multiple huge page region.
 // Similar to PageTracker but a few important differences:
 // - crosses multiple hugepages
@@ -73,29 +85,63 @@ class HugeRegion : public TList<HugeRegion>::Elem {
   HugeRegion() = delete;
 
   // If available, return a range of n free pages, setting *from_released =
-  // true iff the returned range is currently unbacked.
-  // Returns false if no range available.
-  bool MaybeGet(Length n, PageId* p, bool* from_released);
+  // true iff the returned range is currently unbacked, and *known_zero = true
+  // iff every hugepage it touches was unused and unbacked (so that the range
+  // reads as zero).  Returns false if no range available.
+  bool MaybeGet(Length n, PageId* p, bool* from_released, bool* known_zero);
 
   // Return [p, p + n) for new allocations.
   // If release=true, release any hugepages made empty as a result.
   // REQUIRES: [p, p + n) was the result of a previous MaybeGet.
   void Put(PageId p, Length n, bool release);
 
+  // Shrinks the allocation [p, p + n) in place to its first <new_n> pages,
+  // returning the rest for new allocations as Put() does.
+  // REQUIRES: [p, p + n) was the result of a previous MaybeGet (possibly
+  // shrunk already), and 0 < new_n < n.
+  void Shrink(PageId p, Length n, Length new_n, bool release);
+
   // Release <release_fraction> times free-and-backed number of hugepages from
   // region. Note that this clamps release_fraction between 0 and 1 if a
   // fraction outside those bounds is specified.
   HugeLength Release(double release_fraction);
 
+  // Releases the free pages of partially used hugepages until at least <n>
+  // pages are released, or there are none left.  This breaks up those
+  // hugepages, so is only done under memory pressure.  Returns the number of
+  // pages released.
+  Length ReleasePartialHugepages(Length n);
+
+  // Releases unbacked hugepages that are resident again, as reported by
+  // <resident_bytes> (std::nullopt if unknown), to the OS once more.  Queries
+  // up to *budget hugepages, picking up where the previous call left off, and
+  // decrements *budget by the number queried.  Returns the number of resident
+  // bytes released again.
+  size_t ReleaseResidentUnbacked(
+      HugeLength* budget,
+      absl::FunctionRef<std::optional<size_t>(HugeRange)> resident_bytes);
+  // Whether ReleaseResidentUnbacked has reached the end of the region, and
+  // restarts the scan at its beginning.
+  bool residency_scan_done() const {
+    return residency_cursor_ == kNumHugePages;
+  }
+  void RestartResidencyScan() { residency_cursor_ = 0; }
+
   // Is p located in this region?
-  bool contains(PageId p) { return location_.contains(p); }
+  bool contains(PageId p) const { return location_.contains(p); }
 
   // Stats
   Length used_pages() const { return Length(tracker_.used()); }
   Length free_pages() const {
     return size().in_pages() - unmapped_pages() - used_pages();
   }
-  Length unmapped_pages() const { return (size() - nbacked_).in_pages(); }
+  Length unmapped_pages() const {
+    return (size() - nbacked_).in_pages() + subreleased_;
+  }
+  // Free pages of backed hugepages that were released (see
+  // ReleasePartialHugepages).
+  Length subreleased_pages() const { return subreleased_; }
+  Length longest_free() const { return Length(tracker_.longest_free()); }
 
   void AddSpanStats(SmallSpanStats* small, LargeSpanStats* large) const;
 
@@ -111,6 +157,13 @@ class HugeRegion : public TList<HugeRegion>::Elem {
 
   BackingStats stats() const;
 
+  HugeRange location() const { return location_; }
+
+  // Sets cells[0, kPagesPerHugePage) to the states of the pages of the <i>th
+  // hugepage of the region, with no size classes.  Returns whether the
+  // hugepage is backed.
+  bool GetPageStates(size_t i, HugePageLayoutCell* cells) const;
+
   // We don't define this as operator< because it's a rather specialized order.
   bool BetterToAllocThan(const HugeRegion* rhs) const {
     return longest_free() < rhs->longest_free();
@@ -132,12 +185,11 @@ class HugeRegion : public TList<HugeRegion>::Elem {
     return static_cast<int64_t>((aw + bw) / (a.raw_num() + b.raw_num()));
   }
 
-  Length longest_free() const { return Length(tracker_.longest_free()); }
-
   // Adjust counts of allocs-per-hugepage for [p, p + n) being added/removed.
 
-  // *from_released is set to true iff [p, p + n) is currently unbacked
-  void Inc(PageId p, Length n, bool* from_released);
+  // *from_released is set to true iff [p, p + n) is currently unbacked, and
+  // *known_zero iff every hugepage of [p, p + n) was unused and unbacked.
+  void Inc(PageId p, Length n, bool* from_released, bool* known_zero);
   // If release is true, unback any hugepage that becomes empty.
   void Dec(PageId p, Length n, bool release);
 
@@ -148,8 +200,15 @@ class HugeRegion : public TList<HugeRegion>::Elem {
   // Is this hugepage backed?
   bool backed_[kNumHugePages];
   HugeLength nbacked_;
+  // Pages released by ReleasePartialHugepages, all of which lie on backed
+  // hugepages.  They are backed again as they are allocated, or once their
+  // hugepage is unbacked as a whole.
+  Bitmap<kRegionSize.in_pages().raw_num()> released_by_page_;
+  Length subreleased_;
   int64_t last_touched_[kNumHugePages];
   HugeLength total_unbacked_{NHugePages(0)};
+  // The next hugepage for ReleaseResidentUnbacked to query.
+  size_t residency_cursor_ = 0;
 
   MemoryModifyFunction& unback_;
 };
@@ -159,17 +218,27 @@ class HugeRegion : public TList<HugeRegion>::Elem {
 template <typename Region>
 class HugeRegionSet {
  public:
-  explicit HugeRegionSet(HugeRegionUsageOption use_huge_region_more_often)
-      : n_(0), use_huge_region_more_often_(use_huge_region_more_often) {}
+  explicit HugeRegionSet(HugeRegionUsageOption use_huge_region_more_often,
+                         HugeRegionAllocOption alloc_option =
+                             HugeRegionAllocOption::kMostFragmented)
+      : n_(0),
+        use_huge_region_more_often_(use_huge_region_more_often),
+        alloc_option_(alloc_option) {}
 
   // If available, return a range of n free pages, setting *from_released =
-  // true iff the returned range is currently unbacked.
-  // Returns false if no range available.
-  bool MaybeGet(Length n, PageId* page, bool* from_released);
+  // true iff the returned range is currently unbacked, and *known_zero = true
+  // iff it reads as zero.  Returns false if no range available.
+  bool MaybeGet(Length n, PageId* page, bool* from_released, bool* known_zero);
 
   // Return an allocation to a region (if one matches!)
   bool MaybePut(PageId p, Length n);
 
+  // Shrinks an allocation of a region (if one matches!) to <new_n> pages.
+  bool MaybeShrink(PageId p, Length n, Length new_n);
+
+  // Returns true if p lies in one of the regions.
+  bool Contains(PageId p) const;
+
   // Add region to the set.
   void Contribute(Region* region);
 
@@ -179,16 +248,37 @@ class HugeRegionSet {
   // 1 if a fraction outside those bounds is specified.
   Length ReleasePages(double release_fraction);
 
+  // Releases free pages of partially used hugepages (see
+  // HugeRegion::ReleasePartialHugepages) until at least <n> pages are
+  // released.  Returns the number of pages released.
+  Length ReleasePartialHugepages(Length n);
+
+  // Releases unbacked hugepages of the regions that are resident again (see
+  // HugeRegion::ReleaseResidentUnbacked), querying up to <n> hugepages.
+  // Returns the number of resident bytes released again.
+  size_t ReleaseResidentUnbacked(
+      HugeLength n,
+      absl::FunctionRef<std::optional<size_t>(HugeRange)> resident_bytes);
+
   void Print(Printer* out) const;
   void PrintInPbtxt(PbtxtRegion* hpaa) const;
   void AddSpanStats(SmallSpanStats* small, LargeSpanStats* large) const;
   BackingStats stats() const;
   HugeLength free_backed() const;
   size_t ActiveRegions() const;
+
+  // Calls f(region) for each region, in no particular order.
+  template <typename F>
+  void ForEach(F f) const {
+    for (const Region* region : list_) f(*region);
+  }
   bool UseHugeRegionMoreOften() const {
     return use_huge_region_more_often_ ==
            HugeRegionUsageOption::kUseForAllLargeAllocs;
   }
+  bool PreferDenseRegions() const {
+    return alloc_option_ == HugeRegionAllocOption::kDensest;
+  }
 
  private:
   void Fix(Region* r) {
@@ -245,6 +335,7 @@ class HugeRegionSet {
 
   size_t n_;
   HugeRegionUsageOption use_huge_region_more_often_;
+  HugeRegionAllocOption alloc_option_;
   // Sorted by longest_free increasing.
   TList<Region> list_;
 };
@@ -256,6 +347,7 @@ inline HugeRegion::HugeRegion(HugeRange r, MemoryModifyFunction& unback)
       pages_used_{},
       backed_{},
       nbacked_(NHugePages(0)),
+      released_by_page_(),
       unback_(unback) {
   int64_t now = absl::base_internal::CycleClock::Now();
   for (int i = 0; i < kNumHugePages; ++i) {
@@ -266,7 +358,8 @@ inline HugeRegion::HugeRegion(HugeRange r, MemoryModifyFunction& unback)
   }
 }
 
-inline bool HugeRegion::MaybeGet(Length n, PageId* p, bool* from_released) {
+inline bool HugeRegion::MaybeGet(Length n, PageId* p, bool* from_released,
+                                 bool* known_zero) {
   if (n > longest_free()) return false;
   auto index = Length(tracker_.FindAndMark(n.raw_num()));
 
@@ -274,7 +367,7 @@ inline bool HugeRegion::MaybeGet(Length n, PageId* p, bool* from_released) {
   *p = page;
 
   // the last hugepage we touch
-  Inc(page, n, from_released);
+  Inc(page, n, from_released, known_zero);
   return true;
 }
 
@@ -286,6 +379,14 @@ inline void HugeRegion::Put(PageId p, Length n, bool release) {
   Dec(p, n, release);
 }
 
+inline void HugeRegion::Shrink(PageId p, Length n, Length new_n,
+                               bool release) {
+  Length index = p - location_.start().first_page();
+  tracker_.Shrink(index.raw_num(), n.raw_num(), new_n.raw_num());
+
+  Dec(p + new_n, n - new_n, release);
+}
+
 // Release hugepages that are unused but backed.
 // TODO(b/199203282): We release up to <release_fraction> times the number of
 // free but backed hugepages from the region. We can explore a more
@@ -310,6 +411,66 @@ inline HugeLength HugeRegion::Release(double release_fraction) {
   return released;
 }
 
+inline Length HugeRegion::ReleasePartialHugepages(Length n) {
+  Length released;
+  for (size_t i = 0; i < kNumHugePages && released < n; ++i) {
+    if (!backed_[i] || pages_used_[i] == Length(0) ||
+        pages_used_[i] == kPagesPerHugePage) {
+      continue;
+    }
+    const size_t end = (i + 1) * kPagesPerHugePage.raw_num();
+    size_t index = i * kPagesPerHugePage.raw_num();
+    size_t free_index, free_n;
+    while (index < end &&
+           tracker_.NextFreeRange(index, &free_index, &free_n) &&
+           free_index < end) {
+      const size_t free_end = std::min(free_index + free_n, end);
+      // Release the runs of [free_index, free_end) not yet released.
+      size_t j = free_index;
+      while (j < free_end) {
+        j = released_by_page_.FindClear(j);
+        if (j >= free_end) break;
+        const size_t k = std::min(released_by_page_.FindSet(j), free_end);
+        // Only whole base pages of the kernel can be released.
+        const size_t g = unback_.granularity().raw_num();
+        const size_t begin = (j + g - 1) / g * g;
+        const size_t stop = k / g * g;
+        const PageId p = location_.start().first_page() + Length(begin);
+        if (begin < stop &&
+            unback_(p.start_addr(), Length(stop - begin).in_bytes())) {
+          released_by_page_.SetRange(begin, stop - begin);
+          subreleased_ += Length(stop - begin);
+          released += Length(stop - begin);
+        }
+        j = k;
+      }
+      index = free_end;
+    }
+  }
+  return released;
+}
+
+inline size_t HugeRegion::ReleaseResidentUnbacked(
+    HugeLength* budget,
+    absl::FunctionRef<std::optional<size_t>(HugeRange)> resident_bytes) {
+  size_t released = 0;
+  while (*budget > NHugePages(0) && residency_cursor_ < kNumHugePages) {
+    const size_t i = residency_cursor_++;
+    // Hugepages are only unbacked once unused, and backed again as they are
+    // allocated from.
+    if (backed_[i]) continue;
+    *budget -= NHugePages(1);
+    const HugeRange r =
+        HugeRange::Make(location_.start() + NHugePages(i), NHugePages(1));
+    std::optional<size_t> bytes = resident_bytes(r);
+    if (!bytes.has_value() || *bytes == 0) continue;
+    if (unback_(r.start_addr(), r.byte_len())) {
+      released += *bytes;
+    }
+  }
+  return released;
+}
+
 inline void HugeRegion::AddSpanStats(SmallSpanStats* small,
                                      LargeSpanStats* large) const {
   size_t index = 0, n;
@@ -320,24 +481,31 @@ inline void HugeRegion::AddSpanStats(SmallSpanStats* small,
     // hugepages, we may need to truncate it so it is either a
     // *free* or a *released* range, and compute a reasonable value
     // for its "when".
-    PageId p = location_.start().first_page() + Length(index);
-    const HugePage hp = HugePageContaining(p);
-    size_t i = (hp - location_.start()) / NHugePages(1);
-    const bool backed = backed_[i];
+    // Pages are released if their hugepage is unbacked, or if they were
+    // released on their own (see ReleasePartialHugepages).
+    auto is_released = [&](size_t page) {
+      return !backed_[page / kPagesPerHugePage.raw_num()] ||
+             released_by_page_.GetBit(page);
+    };
+    const bool released = is_released(index);
+    size_t page = index;
     Length truncated;
     int64_t when = 0;
-    while (n > 0 && backed_[i] == backed) {
-      const PageId lim = (location_.start() + NHugePages(i + 1)).first_page();
-      Length here = std::min(Length(n), lim - p);
+    while (n > 0 && is_released(page) == released) {
+      const size_t i = page / kPagesPerHugePage.raw_num();
+      size_t lim = (i + 1) * kPagesPerHugePage.raw_num();
+      if (backed_[i]) {
+        lim = std::min(lim, released ? released_by_page_.FindClear(page)
+                                     : released_by_page_.FindSet(page));
+      }
+      Length here = std::min(Length(n), Length(lim - page));
       when = AverageWhens(truncated, when, here, last_touched_[i]);
       truncated += here;
       n -= here.raw_num();
-      p += here;
-      i++;
-      ASSERT(i < kNumHugePages || n == 0);
+      page += here.raw_num();
+      ASSERT(page < tracker_.size() || n == 0);
     }
     n = truncated.raw_num();
-    const bool released = !backed;
     if (released) {
       u += Length(n);
     } else {
@@ -368,6 +536,22 @@ inline void HugeRegion::AddSpanStats(SmallSpanStats* small,
   CHECK_CONDITION(u == unmapped_pages());
 }
 
+inline bool HugeRegion::GetPageStates(size_t i,
+                                      HugePageLayoutCell* cells) const {
+  ASSERT(i < kNumHugePages);
+  const size_t first = i * kPagesPerHugePage.raw_num();
+  for (size_t j = 0; j < kPagesPerHugePage.raw_num(); ++j) {
+    HugePageLayoutPageState state = HugePageLayoutPageState::kFree;
+    if (!tracker_.IsFree(first + j, 1)) {
+      state = HugePageLayoutPageState::kUsed;
+    } else if (!backed_[i] || released_by_page_.GetBit(first + j)) {
+      state = HugePageLayoutPageState::kReleased;
+    }
+    cells[j] = MakeHugePageLayoutCell(state);
+  }
+  return backed_[i];
+}
+
 inline HugeLength HugeRegion::free_backed() const {
   HugeLength r = NHugePages(0);
   for (size_t i = 0; i < kNumHugePages; ++i) {
@@ -398,9 +582,10 @@ inline void HugeRegion::Print(Printer* out) const {
   out->printf(
       "HugeRegion: %zu KiB used, %zu KiB free, "
       "%zu KiB contiguous space, %zu MiB unbacked, "
-      "%zu MiB unbacked lifetime\n",
+      "%zu MiB unbacked lifetime, %zu KiB subreleased\n",
       kib_used, kib_free, kib_longest_free, mib_unbacked,
-      total_unbacked_.in_bytes() / 1024 / 1024);
+      total_unbacked_.in_bytes() / 1024 / 1024,
+      subreleased_.in_bytes() / 1024);
 }
 
 inline void HugeRegion::PrintInPbtxt(PbtxtRegion* detail) const {
@@ -411,6 +596,7 @@ inline void HugeRegion::PrintInPbtxt(PbtxtRegion* detail) const {
   detail->PrintI64("unbacked_bytes", unbacked.in_bytes());
   detail->PrintI64("total_unbacked_bytes", total_unbacked_.in_bytes());
   detail->PrintI64("backed_fully_free_bytes", free_backed().in_bytes());
+  detail->PrintI64("subreleased_bytes", subreleased_.in_bytes());
 }
 
 inline BackingStats HugeRegion::stats() const {
@@ -421,8 +607,10 @@ inline BackingStats HugeRegion::stats() const {
   return s;
 }
 
-inline void HugeRegion::Inc(PageId p, Length n, bool* from_released) {
+inline void HugeRegion::Inc(PageId p, Length n, bool* from_released,
+                            bool* known_zero) {
   bool should_back = false;
+  bool zero = true;
   const int64_t now = absl::base_internal::CycleClock::Now();
   while (n > Length(0)) {
     const HugePage hp = HugePageContaining(p);
@@ -434,6 +622,18 @@ inline void HugeRegion::Inc(PageId p, Length n, bool* from_released) {
       should_back = true;
       ++nbacked_;
       last_touched_[i] = now;
+    } else {
+      zero = false;
+      if (ABSL_PREDICT_FALSE(subreleased_ > Length(0))) {
+        const size_t index = (p - location_.start().first_page()).raw_num();
+        const Length released =
+            Length(released_by_page_.CountBits(index, here.raw_num()));
+        if (released > Length(0)) {
+          released_by_page_.ClearRange(index, here.raw_num());
+          subreleased_ -= released;
+          should_back = true;
+        }
+      }
     }
     pages_used_[i] += here;
     ASSERT(pages_used_[i] <= kPagesPerHugePage);
@@ -441,6 +641,7 @@ inline void HugeRegion::Inc(PageId p, Length n, bool* from_released) {
     n -= here;
   }
   *from_released = should_back;
+  *known_zero = zero;
 }
 
 inline void HugeRegion::Dec(PageId p, Length n, bool release) {
@@ -492,19 +693,43 @@ inline void HugeRegion::UnbackHugepages(bool should_unback[kNumHugePages]) {
         backed_[k] = false;
         last_touched_[k] = now;
       }
+      if (ABSL_PREDICT_FALSE(subreleased_ > Length(0))) {
+        // The pages released on their own are now part of unbacked hugepages.
+        const size_t index = i * kPagesPerHugePage.raw_num();
+        const size_t len = (j - i) * kPagesPerHugePage.raw_num();
+        subreleased_ -= Length(released_by_page_.CountBits(index, len));
+        released_by_page_.ClearRange(index, len);
+      }
     }
     i = j;
   }
 }
 
 // If available, return a range of n free pages, setting *from_released =
-// true iff the returned range is currently unbacked.
-// Returns false if no range available.
+// true iff the returned range is currently unbacked, and *known_zero = true
+// iff it reads as zero.  Returns false if no range available.
 template <typename Region>
 inline bool HugeRegionSet<Region>::MaybeGet(Length n, PageId* page,
-                                            bool* from_released) {
+                                            bool* from_released,
+                                            bool* known_zero) {
+  if (PreferDenseRegions()) {
+    // Of the regions that fit, take the one with the most used pages; ties go
+    // to the most fragmented one.
+    Region* best = nullptr;
+    for (Region* region : list_) {
+      if (region->longest_free() < n) continue;
+      if (best == nullptr || region->used_pages() > best->used_pages()) {
+        best = region;
+      }
+    }
+    if (best == nullptr) return false;
+    CHECK_CONDITION(best->MaybeGet(n, page, from_released, known_zero));
+    Fix(best);
+    return true;
+  }
+
   for (Region* region : list_) {
-    if (region->MaybeGet(n, page, from_released)) {
+    if (region->MaybeGet(n, page, from_released, known_zero)) {
       Fix(region);
       return true;
     }
@@ -530,6 +755,29 @@ inline bool HugeRegionSet<Region>::MaybePut(PageId p, Length n) {
   return false;
 }
 
+template <typename Region>
+inline bool HugeRegionSet<Region>::MaybeShrink(PageId p, Length n,
+                                               Length new_n) {
+  const bool release = !UseHugeRegionMoreOften();
+  for (Region* region : list_) {
+    if (region->contains(p)) {
+      region->Shrink(p, n, new_n, release);
+      Fix(region);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+template <typename Region>
+inline bool HugeRegionSet<Region>::Contains(PageId p) const {
+  for (Region* region : list_) {
+    if (region->contains(p)) return true;
+  }
+  return false;
+}
+
 // Add region to the set.
 template <typename Region>
 inline void HugeRegionSet<Region>::Contribute(Region* region) {
@@ -546,6 +794,34 @@ inline Length HugeRegionSet<Region>::ReleasePages(double release_fraction) {
   return released;
 }
 
+template <typename Region>
+inline Length HugeRegionSet<Region>::ReleasePartialHugepages(Length n) {
+  Length released;
+  for (Region* region : list_) {
+    if (released >= n) break;
+    released += region->ReleasePartialHugepages(n - released);
+  }
+  return released;
+}
+
+template <typename Region>
+inline size_t HugeRegionSet<Region>::ReleaseResidentUnbacked(
+    HugeLength n,
+    absl::FunctionRef<std::optional<size_t>(HugeRange)> resident_bytes) {
+  size_t released = 0;
+  for (Region* region : list_) {
+    if (n == NHugePages(0)) return released;
+    released += region->ReleaseResidentUnbacked(&n, resident_bytes);
+  }
+  if (n > NHugePages(0)) {
+    // Every region has been scanned to its end; start over.
+    for (Region* region : list_) {
+      region->RestartResidencyScan();
+    }
+  }
+  return released;
+}
+
 template <typename Region>
 inline void HugeRegionSet<Region>::Print(Printer* out) const {
   out->printf("HugeRegionSet: 1 MiB+ allocations best-fit into %zu MiB slabs\n",
@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
@@ -112,8 +113,13 @@ class HugeRegionTest : public ::testing::Test {
   }
 
   Alloc Allocate(Length n, bool* from_released) {
+    bool known_zero;
+    return Allocate(n, from_released, &known_zero);
+  }
+
+  Alloc Allocate(Length n, bool* from_released, bool* known_zero) {
     Alloc ret;
-    CHECK_CONDITION(region_.MaybeGet(n, &ret.p, from_released));
+    CHECK_CONDITION(region_.MaybeGet(n, &ret.p, from_released, known_zero));
     ret.n = n;
     ret.mark = ++next_mark_;
     Mark(ret);
@@ -174,24 +180,49 @@ TEST_F(HugeRegionTest, ReqsBacking) {
   const Length n = kPagesPerHugePage;
   std::vector<Alloc> allocs;
   // should back the first page
-  bool from_released;
-  allocs.push_back(Allocate(n - Length(1), &from_released));
+  bool from_released, known_zero;
+  allocs.push_back(Allocate(n - Length(1), &from_released, &known_zero));
   EXPECT_TRUE(from_released);
+  EXPECT_TRUE(known_zero);
   // nothing
-  allocs.push_back(Allocate(Length(1), &from_released));
+  allocs.push_back(Allocate(Length(1), &from_released, &known_zero));
   EXPECT_FALSE(from_released);
+  EXPECT_FALSE(known_zero);
   // second page
-  allocs.push_back(Allocate(Length(1), &from_released));
+  allocs.push_back(Allocate(Length(1), &from_released, &known_zero));
   EXPECT_TRUE(from_released);
-  // third, fourth, fifth
-  allocs.push_back(Allocate(3 * n, &from_released));
+  EXPECT_TRUE(known_zero);
+  // third, fourth, fifth; the tail of the second page is in use already.
+  allocs.push_back(Allocate(3 * n, &from_released, &known_zero));
   EXPECT_TRUE(from_released);
+  EXPECT_FALSE(known_zero);
 
   for (auto a : allocs) {
     Delete(a);
   }
 }
 
+TEST_F(HugeRegionTest, Shrink) {
+  const Length n = kPagesPerHugePage;
+  Alloc a = Allocate(3 * n);
+  EXPECT_EQ(region_.used_pages(), 3 * n);
+
+  // The hugepages emptied by the shrink are released.
+  ExpectUnback({p_ + NHugePages(1), NHugePages(2)});
+  region_.Shrink(a.p, a.n, n / 2, true);
+  CheckMock();
+  a.n = n / 2;
+  EXPECT_EQ(region_.used_pages(), n / 2);
+  EXPECT_EQ(region_.free_backed(), NHugePages(0));
+
+  // The tail of the first hugepage is handed out again.
+  Alloc b = Allocate(n / 2);
+  EXPECT_EQ(b.p, a.p + n / 2);
+
+  Delete(a);
+  Delete(b);
+}
+
 TEST_F(HugeRegionTest, ReleaseFrac) {
   const Length n = kPagesPerHugePage;
   bool from_released;
@@ -216,6 +247,89 @@ TEST_F(HugeRegionTest, ReleaseFrac) {
   CheckMock();
 }
 
+TEST_F(HugeRegionTest, ReleaseResidentUnbacked) {
+  const Length n = kPagesPerHugePage;
+  // Back the first 4 hugepages.
+  auto a = Allocate(n * 4);
+  std::vector<HugePage> queried;
+  auto resident = [&](HugeRange r) -> std::optional<size_t> {
+    EXPECT_EQ(r.len(), NHugePages(1));
+    queried.push_back(r.start());
+    // A stray touch faulted in a page of the sixth hugepage.
+    return r.start() == p_ + NHugePages(5) ? kPageSize : 0;
+  };
+
+  // Backed hugepages are not queried.
+  HugeLength budget = NHugePages(2);
+  ExpectUnback({p_ + NHugePages(5), NHugePages(1)});
+  EXPECT_EQ(region_.ReleaseResidentUnbacked(&budget, resident), kPageSize);
+  CheckMock();
+  EXPECT_EQ(budget, NHugePages(0));
+  EXPECT_THAT(queried,
+              testing::ElementsAre(p_ + NHugePages(4), p_ + NHugePages(5)));
+  // The hugepage was already accounted as unbacked.
+  EXPECT_EQ(region_.backed(), NHugePages(4));
+  EXPECT_FALSE(region_.residency_scan_done());
+
+  // The next call picks up where this one left off.
+  queried.clear();
+  budget = NHugePages(Region::kNumHugePages);
+  EXPECT_EQ(region_.ReleaseResidentUnbacked(&budget, resident), 0);
+  EXPECT_EQ(queried.size(), Region::kNumHugePages - 6);
+  EXPECT_EQ(queried.front(), p_ + NHugePages(6));
+  EXPECT_TRUE(region_.residency_scan_done());
+
+  region_.RestartResidencyScan();
+  EXPECT_FALSE(region_.residency_scan_done());
+  Delete(a);
+}
+
+TEST_F(HugeRegionTest, ReleasePartialHugepages) {
+  const Length kQuarter = kPagesPerHugePage / 4;
+  auto a = Allocate(kQuarter);
+  auto b = Allocate(kQuarter);
+  Delete(a);
+  ASSERT_EQ(region_.backed(), NHugePages(1));
+
+  // The free pages around b are released, and stay accounted to the region.
+  auto expect_unback = [&](Length offset, Length n) {
+    void* ptr = (p_.first_page() + offset).start_addr();
+    EXPECT_CALL(*mock_, Unback(ptr, n.in_bytes())).WillOnce(Return(true));
+  };
+  expect_unback(Length(0), kQuarter);
+  expect_unback(2 * kQuarter, 2 * kQuarter);
+  EXPECT_EQ(region_.ReleasePartialHugepages(Length(1)), 3 * kQuarter);
+  CheckMock();
+  EXPECT_EQ(region_.backed(), NHugePages(1));
+  EXPECT_EQ(region_.subreleased_pages(), 3 * kQuarter);
+  EXPECT_EQ(region_.unmapped_pages(),
+            (region_.size() - NHugePages(1)).in_pages() + 3 * kQuarter);
+  EXPECT_EQ(region_.free_pages(), Length(0));
+  // Nothing is left to release.
+  EXPECT_EQ(region_.ReleasePartialHugepages(Length(1)), Length(0));
+
+  SmallSpanStats small;
+  LargeSpanStats large;
+  region_.AddSpanStats(&small, &large);
+  EXPECT_EQ(small.returned_length[kQuarter.raw_num()], 1);
+  EXPECT_EQ(small.normal_length[kQuarter.raw_num()], 0);
+
+  // Allocating released pages backs them again.
+  bool from_released, known_zero;
+  auto c = Allocate(kQuarter, &from_released, &known_zero);
+  EXPECT_TRUE(from_released);
+  EXPECT_FALSE(known_zero);
+  EXPECT_EQ(region_.subreleased_pages(), 2 * kQuarter);
+
+  // Unbacking the hugepage as a whole covers its released pages.
+  ExpectUnback({p_, NHugePages(1)});
+  DeleteUnback(b);
+  DeleteUnback(c);
+  CheckMock();
+  EXPECT_EQ(region_.subreleased_pages(), Length(0));
+  EXPECT_EQ(region_.unmapped_pages(), region_.size().in_pages());
+}
+
 TEST_F(HugeRegionTest, Release) {
   const Length n = kPagesPerHugePage;
   bool from_released;
@@ -501,14 +615,14 @@ TEST_P(HugeRegionSetTest, Release) {
   absl::BitGen rng;
   PageId p;
   constexpr Length kSize = kPagesPerHugePage + Length(1);
-  bool from_released;
-  ASSERT_FALSE(set_.MaybeGet(Length(1), &p, &from_released));
+  bool from_released, known_zero;
+  ASSERT_FALSE(set_.MaybeGet(Length(1), &p, &from_released, &known_zero));
   auto r1 = GetRegion();
   set_.Contribute(r1.get());
 
   std::vector<Alloc> allocs;
 
-  while (set_.MaybeGet(kSize, &p, &from_released)) {
+  while (set_.MaybeGet(kSize, &p, &from_released, &known_zero)) {
     allocs.push_back({p, kSize});
   }
   BackingStats stats = set_.stats();
@@ -533,12 +647,47 @@ TEST_P(HugeRegionSetTest, Release) {
   EXPECT_EQ(stats.unmapped_bytes, stats.system_bytes);
 }
 
+TEST_P(HugeRegionSetTest, PreferDense) {
+  HugeRegionSet<Region> set(GetParam(), HugeRegionAllocOption::kDensest);
+  EXPECT_TRUE(set.PreferDenseRegions());
+  EXPECT_FALSE(set_.PreferDenseRegions());
+  PageId p;
+  bool from_released, known_zero;
+
+  // r1 is half used, in one piece.
+  auto r1 = GetRegion();
+  ASSERT_TRUE(r1->MaybeGet(Region::size().in_pages() / 2, &p, &from_released,
+                           &known_zero));
+  // r2 is a quarter used, but more fragmented.
+  auto r2 = GetRegion();
+  std::vector<PageId> pages;
+  while (r2->MaybeGet(kPagesPerHugePage, &p, &from_released, &known_zero)) {
+    pages.push_back(p);
+  }
+  for (size_t i = 0; i < pages.size(); ++i) {
+    if (i % 4 != 0) r2->Put(pages[i], kPagesPerHugePage, false);
+  }
+  ASSERT_LT(r2->longest_free(), r1->longest_free());
+  ASSERT_LT(r2->used_pages(), r1->used_pages());
+  set.Contribute(r1.get());
+  set.Contribute(r2.get());
+
+  ASSERT_TRUE(set.MaybeGet(kPagesPerHugePage, &p, &from_released, &known_zero));
+  EXPECT_TRUE(r1->contains(p));
+  // Regions that do not fit are skipped.
+  ASSERT_TRUE(set.MaybeGet(r1->longest_free(), &p, &from_released,
+                           &known_zero));
+  EXPECT_TRUE(r1->contains(p));
+  ASSERT_TRUE(set.MaybeGet(kPagesPerHugePage, &p, &from_released, &known_zero));
+  EXPECT_TRUE(r2->contains(p));
+}
+
 TEST_P(HugeRegionSetTest, Set) {
   absl::BitGen rng;
   PageId p;
   constexpr Length kSize = kPagesPerHugePage + Length(1);
-  bool from_released;
-  ASSERT_FALSE(set_.MaybeGet(Length(1), &p, &from_released));
+  bool from_released, known_zero;
+  ASSERT_FALSE(set_.MaybeGet(Length(1), &p, &from_released, &known_zero));
   auto r1 = GetRegion();
   auto r2 = GetRegion();
   auto r3 = GetRegion();
@@ -551,7 +700,7 @@ TEST_P(HugeRegionSetTest, Set) {
   std::vector<Alloc> allocs;
   std::vector<Alloc> doomed;
 
-  while (set_.MaybeGet(kSize, &p, &from_released)) {
+  while (set_.MaybeGet(kSize, &p, &from_released, &known_zero)) {
     allocs.push_back({p, kSize});
   }
 
@@ -573,7 +722,7 @@ TEST_P(HugeRegionSetTest, Set) {
     auto a = allocs.back();
     ASSERT_TRUE(set_.MaybePut(a.p, a.n));
     allocs.pop_back();
-    ASSERT_TRUE(set_.MaybeGet(kSize, &p, &from_released));
+    ASSERT_TRUE(set_.MaybeGet(kSize, &p, &from_released, &known_zero));
     allocs.push_back({p, kSize});
   }
 
@@ -0,0 +1,288 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/allocation_trace.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/base/internal/cycleclock.h"
+#include "absl/functional/function_ref.h"
+#include "absl/numeric/bits.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/util.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr uint8_t kOpMask = 0x3;
+constexpr int kAlignmentShift = 2;
+
+uint64_t ZigZag(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+int64_t UnZigZag(uint64_t v) {
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+char* PutVarint(char* p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = static_cast<char>(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = static_cast<char>(v);
+  return p;
+}
+
+bool GetVarint(const char*& p, const char* end, uint64_t* v) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    const uint8_t byte = static_cast<uint8_t>(*p++);
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *v = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WriteFully(int fd, const void* buf, size_t count) {
+  size_t written = 0;
+  return signal_safe_write(fd, static_cast<const char*>(buf), count,
+                           &written) >= 0 &&
+         written == count;
+}
+
+}  // namespace
+
+bool AllocationTraceWriter::Init(int fd, char* buffers, int num_buffers,
+                                 size_t buffer_bytes) {
+  if (enabled() || fd < 0 || buffers == nullptr || num_buffers <= 0 ||
+      static_cast<size_t>(num_buffers) > kMaxBuffers ||
+      buffer_bytes < kMaxRecordBytes) {
+    return false;
+  }
+
+  AllocationTraceFileHeader header = {};
+  header.magic = kAllocationTraceMagic;
+  header.version = kAllocationTraceVersion;
+  header.cycles_per_second = absl::base_internal::CycleClock::Frequency();
+  header.start_cycles = absl::base_internal::CycleClock::Now();
+  header.start_time_ns = absl::ToUnixNanos(absl::Now());
+  if (!WriteFully(fd, &header, sizeof(header))) {
+    return false;
+  }
+
+  fd_ = fd;
+  buffers_ = buffers;
+  num_buffers_ = num_buffers;
+  buffer_bytes_ = buffer_bytes;
+  enabled_.store(true, std::memory_order_release);
+  return true;
+}
+
+bool AllocationTraceWriter::InitFromFile(const char* path, int num_buffers,
+                                         size_t buffer_bytes) {
+  const size_t bytes = num_buffers * buffer_bytes;
+  void* buffers = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers == MAP_FAILED) {
+    return false;
+  }
+  const int fd =
+      signal_safe_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    munmap(buffers, bytes);
+    return false;
+  }
+  if (!Init(fd, static_cast<char*>(buffers), num_buffers, buffer_bytes)) {
+    signal_safe_close(fd);
+    munmap(buffers, bytes);
+    return false;
+  }
+  return true;
+}
+
+void AllocationTraceWriter::WriteChunk(int buffer, Buffer& b) {
+  if (b.records == 0) {
+    return;
+  }
+
+  AllocationTraceChunkHeader header;
+  header.magic = kAllocationTraceChunkMagic;
+  header.cpu = buffer;
+  header.bytes = b.used;
+  header.records = b.records;
+  header.base_cycles = b.base_cycles;
+  bool ok;
+  {
+    AllocationGuardSpinLockHolder h(&file_lock_);
+    ok = WriteFully(fd_, &header, sizeof(header)) &&
+         WriteFully(fd_, data(buffer), b.used);
+  }
+  if (ok) {
+    chunks_written_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    records_lost_.fetch_add(b.records, std::memory_order_relaxed);
+  }
+  b.used = 0;
+  b.records = 0;
+}
+
+void AllocationTraceWriter::Record(AllocationTraceEvent event) {
+  if (!enabled()) {
+    return;
+  }
+
+  const int buffer = event.cpu >= 0 ? event.cpu % num_buffers_ : 0;
+  Buffer& b = state_[buffer];
+  AllocationGuardSpinLockHolder h(&b.lock);
+  if (b.used + kMaxRecordBytes > buffer_bytes_) {
+    WriteChunk(buffer, b);
+  }
+
+  // Take the time under the lock, so that it never goes backwards within a
+  // chunk.
+  event.cycles = absl::base_internal::CycleClock::Now();
+  if (b.records == 0) {
+    b.base_cycles = event.cycles;
+    b.last_cycles = event.cycles;
+    b.last_thread = 0;
+    b.last_object = 0;
+  }
+
+  const uint8_t alignment =
+      event.alignment == 0
+          ? 0
+          : std::min(absl::countr_zero(event.alignment) + 1, 0x3f);
+  char* const start = data(buffer) + b.used;
+  char* p = start;
+  *p++ = static_cast<char>(static_cast<uint8_t>(event.op) |
+                           (alignment << kAlignmentShift));
+  p = PutVarint(p, ZigZag(event.cycles - b.last_cycles));
+  p = PutVarint(p, ZigZag(static_cast<int32_t>(event.thread - b.last_thread)));
+  p = PutVarint(p, ZigZag(static_cast<int64_t>(event.object - b.last_object)));
+  if (event.op == AllocationTraceOp::kRealloc) {
+    p = PutVarint(p,
+                  ZigZag(static_cast<int64_t>(event.old_object - event.object)));
+  }
+  if (event.op != AllocationTraceOp::kFree) {
+    p = PutVarint(p, event.size);
+  }
+
+  b.used += p - start;
+  ++b.records;
+  b.last_cycles = event.cycles;
+  b.last_thread = event.thread;
+  b.last_object = event.object;
+}
+
+void AllocationTraceWriter::Flush() {
+  if (!enabled()) {
+    return;
+  }
+
+  for (int buffer = 0; buffer < num_buffers_; ++buffer) {
+    Buffer& b = state_[buffer];
+    AllocationGuardSpinLockHolder h(&b.lock);
+    WriteChunk(buffer, b);
+  }
+}
+
+bool ReadAllocationTrace(
+    absl::Span<const char> file, AllocationTraceFileHeader* header,
+    absl::FunctionRef<void(const AllocationTraceEvent&)> f) {
+  AllocationTraceFileHeader file_header;
+  if (file.size() < sizeof(file_header)) {
+    return false;
+  }
+  memcpy(&file_header, file.data(), sizeof(file_header));
+  if (file_header.magic != kAllocationTraceMagic ||
+      file_header.version != kAllocationTraceVersion) {
+    return false;
+  }
+  if (header != nullptr) {
+    *header = file_header;
+  }
+
+  const char* p = file.data() + sizeof(file_header);
+  const char* const file_end = file.data() + file.size();
+  while (p < file_end) {
+    AllocationTraceChunkHeader chunk;
+    if (static_cast<size_t>(file_end - p) < sizeof(chunk)) {
+      return false;
+    }
+    memcpy(&chunk, p, sizeof(chunk));
+    p += sizeof(chunk);
+    if (chunk.magic != kAllocationTraceChunkMagic ||
+        static_cast<size_t>(file_end - p) < chunk.bytes) {
+      return false;
+    }
+
+    const char* const end = p + chunk.bytes;
+    AllocationTraceEvent event = {};
+    event.cpu = chunk.cpu;
+    event.cycles = chunk.base_cycles;
+    for (uint32_t i = 0; i < chunk.records; ++i) {
+      if (p >= end) {
+        return false;
+      }
+      const uint8_t tag = static_cast<uint8_t>(*p++);
+      event.op = static_cast<AllocationTraceOp>(tag & kOpMask);
+      const int alignment = tag >> kAlignmentShift;
+      event.alignment = alignment == 0 ? 0 : uint64_t{1} << (alignment - 1);
+
+      uint64_t v;
+      if (!GetVarint(p, end, &v)) return false;
+      event.cycles += UnZigZag(v);
+      if (!GetVarint(p, end, &v)) return false;
+      event.thread += static_cast<uint32_t>(UnZigZag(v));
+      if (!GetVarint(p, end, &v)) return false;
+      event.object += static_cast<uint64_t>(UnZigZag(v));
+      event.old_object = 0;
+      event.size = 0;
+      if (event.op == AllocationTraceOp::kRealloc) {
+        if (!GetVarint(p, end, &v)) return false;
+        event.old_object = event.object + static_cast<uint64_t>(UnZigZag(v));
+      }
+      if (event.op != AllocationTraceOp::kFree) {
+        if (!GetVarint(p, end, &event.size)) return false;
+      }
+      f(event);
+    }
+    if (p != end) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,182 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A compact binary trace of every allocation, free and reallocation, for
+// replaying a workload against other allocator configurations offline.
+//
+// The file starts with an AllocationTraceFileHeader, followed by chunks.  Each
+// chunk holds the records buffered for one CPU: an AllocationTraceChunkHeader
+// followed by `bytes` bytes of records.  Chunks of different CPUs interleave,
+// so records are only ordered within a chunk; merge them by time to replay.
+//
+// Records are delta encoded against the previous record of the chunk, or the
+// chunk header for the first, and written as LEB128 varints:
+//   - one byte: the AllocationTraceOp in the low 2 bits and, above them, 0 for
+//     the default alignment or 1 + log2(alignment),
+//   - the cycles since the previous record,
+//   - the zigzag-encoded change of thread id,
+//   - the zigzag-encoded change of object address,
+//   - for kRealloc, the zigzag-encoded old address minus the new address,
+//   - for kMalloc and kRealloc, the requested size.
+
+#ifndef TCMALLOC_INTERNAL_ALLOCATION_TRACE_H_
+#define TCMALLOC_INTERNAL_ALLOCATION_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/functional/function_ref.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+inline constexpr uint64_t kAllocationTraceMagic =
+    0x4543415254434d54;  // "TMCTRACE"
+inline constexpr uint32_t kAllocationTraceVersion = 1;
+inline constexpr uint32_t kAllocationTraceChunkMagic = 0x4b4e4843;  // "CHNK"
+
+struct AllocationTraceFileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+  // Converts record timestamps, in CycleClock cycles, to Unix time.
+  double cycles_per_second;
+  int64_t start_cycles;
+  int64_t start_time_ns;
+};
+
+struct AllocationTraceChunkHeader {
+  uint32_t magic;
+  // The CPU the records were buffered on.
+  int32_t cpu;
+  uint32_t bytes;
+  uint32_t records;
+  // The base for the first record's deltas.
+  int64_t base_cycles;
+};
+
+enum class AllocationTraceOp : uint8_t {
+  kMalloc = 0,
+  kFree = 1,
+  kRealloc = 2,
+};
+
+struct AllocationTraceEvent {
+  AllocationTraceOp op;
+  int32_t cpu;
+  // Identifies the thread; ids are dense, in order of each thread's first
+  // traced operation.
+  uint32_t thread;
+  int64_t cycles;
+  // The address of the object allocated or freed; the new address for
+  // kRealloc.
+  uint64_t object;
+  // The address reallocated, for kRealloc.
+  uint64_t old_object;
+  // The requested size, for kMalloc and kRealloc.
+  uint64_t size;
+  // The requested alignment, or 0 for the default.
+  uint64_t alignment;
+};
+
+class AllocationTraceWriter {
+ public:
+  static constexpr size_t kMaxBuffers = 256;
+  static constexpr size_t kDefaultBufferBytes = 64 << 10;
+  // The most bytes a record can encode to.
+  static constexpr size_t kMaxRecordBytes = 64;
+
+  constexpr AllocationTraceWriter() = default;
+
+  AllocationTraceWriter(const AllocationTraceWriter&) = delete;
+  AllocationTraceWriter& operator=(const AllocationTraceWriter&) = delete;
+
+  // Starts tracing to `fd`, buffering the records of each of `num_buffers`
+  // CPUs in `buffer_bytes` of `buffers`, which must hold num_buffers *
+  // buffer_bytes bytes.  Writes the file header.  Returns false, leaving
+  // tracing disabled, if the arguments are invalid or the write fails.
+  bool Init(int fd, char* buffers, int num_buffers, size_t buffer_bytes);
+
+  // Creates (or truncates) the file at `path`, maps the buffers and starts
+  // tracing to it.  Returns false, leaving tracing disabled, on failure.
+  bool InitFromFile(const char* path, int num_buffers, size_t buffer_bytes);
+
+  bool enabled() const { return enabled_.load(std::memory_order_acquire); }
+
+  // Appends `event` to the buffer of `event.cpu`, writing the buffer out first
+  // if it is full.  Fills in `event.cycles`.
+  void Record(AllocationTraceEvent event);
+
+  // Writes out every buffer holding records.
+  void Flush();
+
+  // The chunks written and the records dropped because a write failed.
+  uint64_t chunks_written() const {
+    return chunks_written_.load(std::memory_order_relaxed);
+  }
+  uint64_t records_lost() const {
+    return records_lost_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Buffer {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    size_t used ABSL_GUARDED_BY(lock) = 0;
+    uint32_t records ABSL_GUARDED_BY(lock) = 0;
+    int64_t base_cycles ABSL_GUARDED_BY(lock) = 0;
+    int64_t last_cycles ABSL_GUARDED_BY(lock) = 0;
+    uint32_t last_thread ABSL_GUARDED_BY(lock) = 0;
+    uint64_t last_object ABSL_GUARDED_BY(lock) = 0;
+  };
+
+  char* data(int buffer) const { return buffers_ + buffer * buffer_bytes_; }
+
+  // Writes out the records of `b` and resets it.
+  void WriteChunk(int buffer, Buffer& b) ABSL_EXCLUSIVE_LOCKS_REQUIRED(b.lock);
+
+  std::atomic<bool> enabled_{false};
+  int fd_ = -1;
+  char* buffers_ = nullptr;
+  int num_buffers_ = 0;
+  size_t buffer_bytes_ = 0;
+  std::atomic<uint64_t> chunks_written_{0};
+  std::atomic<uint64_t> records_lost_{0};
+
+  // Keeps chunks whole in the file.
+  absl::base_internal::SpinLock file_lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  Buffer state_[kMaxBuffers];
+};
+
+// Decodes the trace in `file`, calling `f` on every record in file order.
+// `header`, if non-null, receives the file header.  Returns false if the trace
+// is malformed or truncated, after passing `f` the records before the damage.
+bool ReadAllocationTrace(
+    absl::Span<const char> file, AllocationTraceFileHeader* header,
+    absl::FunctionRef<void(const AllocationTraceEvent&)> f);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_ALLOCATION_TRACE_H_
@@ -0,0 +1,204 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/allocation_trace.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class AllocationTraceTest : public testing::Test {
+ protected:
+  AllocationTraceTest()
+      : path_(absl::StrCat(testing::TempDir(), "/allocation_trace_",
+                           getpid())) {}
+
+  ~AllocationTraceTest() override { unlink(path_.c_str()); }
+
+  void Init(int num_buffers, size_t buffer_bytes) {
+    buffers_.resize(num_buffers * buffer_bytes);
+    const int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ASSERT_GE(fd, 0);
+    ASSERT_TRUE(writer_.Init(fd, buffers_.data(), num_buffers, buffer_bytes));
+  }
+
+  std::string Contents() {
+    std::string contents;
+    const int fd = open(path_.c_str(), O_RDONLY);
+    EXPECT_GE(fd, 0);
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+      contents.append(buf, n);
+    }
+    close(fd);
+    return contents;
+  }
+
+  std::vector<AllocationTraceEvent> ReadAll(bool* ok) {
+    std::vector<AllocationTraceEvent> events;
+    const std::string contents = Contents();
+    *ok = ReadAllocationTrace(
+        absl::MakeConstSpan(contents.data(), contents.size()), nullptr,
+        [&](const AllocationTraceEvent& e) { events.push_back(e); });
+    return events;
+  }
+
+  static AllocationTraceEvent Event(AllocationTraceOp op, int cpu,
+                                    uint32_t thread, uint64_t object,
+                                    uint64_t size) {
+    AllocationTraceEvent e = {};
+    e.op = op;
+    e.cpu = cpu;
+    e.thread = thread;
+    e.object = object;
+    e.size = size;
+    return e;
+  }
+
+  std::string path_;
+  std::vector<char> buffers_;
+  AllocationTraceWriter writer_;
+};
+
+TEST_F(AllocationTraceTest, Empty) {
+  Init(1, 4096);
+  writer_.Flush();
+
+  AllocationTraceFileHeader header;
+  const std::string contents = Contents();
+  int records = 0;
+  EXPECT_TRUE(ReadAllocationTrace(
+      absl::MakeConstSpan(contents.data(), contents.size()), &header,
+      [&](const AllocationTraceEvent&) { ++records; }));
+  EXPECT_EQ(records, 0);
+  EXPECT_EQ(header.version, kAllocationTraceVersion);
+  EXPECT_GT(header.cycles_per_second, 0);
+  EXPECT_EQ(writer_.chunks_written(), 0);
+}
+
+TEST_F(AllocationTraceTest, RoundTrip) {
+  Init(2, 4096);
+
+  AllocationTraceEvent malloc_event =
+      Event(AllocationTraceOp::kMalloc, 0, 7, 0x7f0000001000, 24);
+  AllocationTraceEvent aligned_event =
+      Event(AllocationTraceOp::kMalloc, 1, 3, 0x7f0000200000, 100);
+  aligned_event.alignment = 4096;
+  AllocationTraceEvent realloc_event =
+      Event(AllocationTraceOp::kRealloc, 0, 2, 0x7f0000000040, 1 << 20);
+  realloc_event.old_object = 0x7f0000001000;
+  AllocationTraceEvent free_event =
+      Event(AllocationTraceOp::kFree, 0, 7, 0x7f0000000040, 0);
+
+  writer_.Record(malloc_event);
+  writer_.Record(aligned_event);
+  writer_.Record(realloc_event);
+  writer_.Record(free_event);
+  writer_.Flush();
+  EXPECT_EQ(writer_.chunks_written(), 2);
+
+  bool ok;
+  std::vector<AllocationTraceEvent> events = ReadAll(&ok);
+  EXPECT_TRUE(ok);
+  ASSERT_EQ(events.size(), 4);
+
+  // CPU 0's chunk is written first.
+  const AllocationTraceEvent* expected[] = {&malloc_event, &realloc_event,
+                                            &free_event, &aligned_event};
+  for (int i = 0; i < 4; ++i) {
+    SCOPED_TRACE(i);
+    EXPECT_EQ(events[i].op, expected[i]->op);
+    EXPECT_EQ(events[i].cpu, expected[i]->cpu);
+    EXPECT_EQ(events[i].thread, expected[i]->thread);
+    EXPECT_EQ(events[i].object, expected[i]->object);
+    EXPECT_EQ(events[i].old_object, expected[i]->old_object);
+    EXPECT_EQ(events[i].size, expected[i]->size);
+    EXPECT_EQ(events[i].alignment, expected[i]->alignment);
+  }
+  EXPECT_LE(events[0].cycles, events[1].cycles);
+  EXPECT_LE(events[1].cycles, events[2].cycles);
+}
+
+TEST_F(AllocationTraceTest, FullBuffersAreWrittenOut) {
+  constexpr size_t kBufferBytes = 256;
+  Init(1, kBufferBytes);
+
+  constexpr int kRecords = 1000;
+  for (int i = 0; i < kRecords; ++i) {
+    writer_.Record(
+        Event(AllocationTraceOp::kMalloc, 0, i % 3, 0x1000 + 16 * i, i));
+  }
+  EXPECT_GT(writer_.chunks_written(), 1);
+  writer_.Flush();
+
+  bool ok;
+  std::vector<AllocationTraceEvent> events = ReadAll(&ok);
+  EXPECT_TRUE(ok);
+  ASSERT_EQ(events.size(), kRecords);
+  for (int i = 0; i < kRecords; ++i) {
+    EXPECT_EQ(events[i].thread, i % 3);
+    EXPECT_EQ(events[i].object, 0x1000 + 16 * i);
+    EXPECT_EQ(events[i].size, i);
+  }
+  EXPECT_EQ(writer_.records_lost(), 0);
+}
+
+TEST_F(AllocationTraceTest, Compact) {
+  Init(1, AllocationTraceWriter::kDefaultBufferBytes);
+
+  // Nearby objects, from the same thread, take only a few bytes each.
+  constexpr int kRecords = 1000;
+  for (int i = 0; i < kRecords; ++i) {
+    writer_.Record(
+        Event(AllocationTraceOp::kMalloc, 0, 1, 0x7f0000000000 + 32 * i, 32));
+  }
+  writer_.Flush();
+  EXPECT_LT(Contents().size(),
+            sizeof(AllocationTraceFileHeader) +
+                sizeof(AllocationTraceChunkHeader) + 8 * kRecords);
+}
+
+TEST_F(AllocationTraceTest, Truncated) {
+  Init(1, 4096);
+  for (int i = 0; i < 10; ++i) {
+    writer_.Record(Event(AllocationTraceOp::kFree, 0, 0, 0x1000 + 16 * i, 0));
+  }
+  writer_.Flush();
+
+  const std::string contents = Contents();
+  int records = 0;
+  EXPECT_FALSE(ReadAllocationTrace(
+      absl::MakeConstSpan(contents.data(), contents.size() - 1), nullptr,
+      [&](const AllocationTraceEvent&) { ++records; }));
+  EXPECT_EQ(records, 0);
+  EXPECT_FALSE(ReadAllocationTrace(absl::MakeConstSpan(contents.data(), 4),
+                                   nullptr,
+                                   [&](const AllocationTraceEvent&) {}));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
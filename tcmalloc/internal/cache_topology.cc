@@ -17,8 +17,10 @@
 #include <fcntl.h>
 #include <string.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
+#include <optional>
 
 #include "absl/strings/numbers.h"
 #include "absl/strings/string_view.h"
@@ -38,6 +40,23 @@ int OpenSysfsCacheList(size_t cpu) {
            "/sys/devices/system/cpu/cpu%zu/cache/index3/shared_cpu_list", cpu);
   return signal_safe_open(path, O_RDONLY | O_CLOEXEC);
 }
+
+// Returns the number of hardware threads of <cpu>'s core, or 0 if it is
+// unknown.
+uint8_t CountSmtSiblings(size_t cpu) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%zu/topology/thread_siblings_list", cpu);
+  const int fd = signal_safe_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return 0;
+  const std::optional<cpu_set_t> siblings =
+      ParseCpulist([&](char* const buf, const size_t count) {
+        return signal_safe_read(fd, buf, count, /*bytes_read=*/nullptr);
+      });
+  signal_safe_close(fd);
+  if (!siblings.has_value()) return 0;
+  return std::min(CPU_COUNT(&*siblings), 255);
+}
 }  // namespace
 
 int BuildCpuToL3CacheMap_FindFirstNumberInBuf(absl::string_view current) {
@@ -55,6 +74,9 @@ int BuildCpuToL3CacheMap_FindFirstNumberInBuf(absl::string_view current) {
 
 void CacheTopology::Init() {
   cpu_count_ = NumCPUs();
+  for (int cpu = 0; cpu < cpu_count_; ++cpu) {
+    smt_sibling_count_[cpu] = CountSmtSiblings(cpu);
+  }
   for (int cpu = 0; cpu < cpu_count_; ++cpu) {
     const int fd = OpenSysfsCacheList(cpu);
     if (fd == -1) {
@@ -45,10 +45,19 @@ class CacheTopology {
     return l3_cache_index_[cpu];
   }
 
+  // Returns the number of hardware threads (SMT siblings, including <cpu>
+  // itself) of the core <cpu> belongs to, or 1 if it is unknown.
+  unsigned GetSmtSiblingCount(int cpu) const {
+    ASSERT(cpu >= 0);
+    ASSERT(cpu < CPU_SETSIZE);
+    return smt_sibling_count_[cpu] > 0 ? smt_sibling_count_[cpu] : 1;
+  }
+
  private:
   unsigned cpu_count_ = 0;
   unsigned l3_count_ = 0;
   uint8_t l3_cache_index_[CPU_SETSIZE] = {};
+  uint8_t smt_sibling_count_[CPU_SETSIZE] = {};
 };
 
 // Helper function exposed to permit testing it.
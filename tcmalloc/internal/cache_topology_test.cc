@@ -38,6 +38,15 @@ TEST(CacheTopology, ComputesSomethingReasonable) {
   }
 }
 
+TEST(CacheTopology, SmtSiblings) {
+  CacheTopology topology;
+  topology.Init();
+  for (int i = 0, n = NumCPUs(); i < n; ++i) {
+    EXPECT_GE(topology.GetSmtSiblingCount(i), 1) << i;
+    EXPECT_LE(topology.GetSmtSiblingCount(i), n) << i;
+  }
+}
+
 TEST(CacheTopology, FindFirstNumberInBuf) {
   using tcmalloc::tcmalloc_internal::BuildCpuToL3CacheMap_FindFirstNumberInBuf;
   EXPECT_EQ(7, BuildCpuToL3CacheMap_FindFirstNumberInBuf("7,-787"));
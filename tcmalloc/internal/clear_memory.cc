@@ -0,0 +1,96 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/clear_memory.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "absl/base/call_once.h"
+#include "tcmalloc/internal/config.h"
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+namespace {
+
+constexpr size_t kMinNonTemporalClear = size_t{1} << 20;
+
+size_t ComputeNonTemporalClearThreshold() {
+#if defined(__x86_64__)
+  // Every x86-64 CPU has SSE2's non-temporal stores.
+  size_t threshold = kMinNonTemporalClear;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  // glibc reads this from CPUID, without allocating.
+  const long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (l2 > 0) threshold = std::max(threshold, static_cast<size_t>(l2));
+#endif
+  return threshold;
+#else
+  return std::numeric_limits<size_t>::max();
+#endif
+}
+
+}  // namespace
+
+size_t NonTemporalClearThreshold() {
+  ABSL_CONST_INIT static absl::once_flag flag;
+  ABSL_CONST_INIT static size_t threshold;
+  absl::base_internal::LowLevelCallOnce(
+      &flag, [&]() { threshold = ComputeNonTemporalClearThreshold(); });
+  return threshold;
+}
+
+void ClearNonTemporal(void* ptr, size_t size) {
+#if defined(__x86_64__)
+  constexpr size_t kVector = sizeof(__m128i);
+  constexpr size_t kStep = 4 * kVector;
+  char* p = static_cast<char*>(ptr);
+  // Page-level allocations are already aligned, but other buffers may need
+  // plain stores up to the first vector boundary.
+  const size_t head =
+      std::min(size, -reinterpret_cast<uintptr_t>(p) & (kVector - 1));
+  memset(p, 0, head);
+  p += head;
+  size -= head;
+
+  const __m128i zero = _mm_setzero_si128();
+  char* const end = p + (size & ~(kStep - 1));
+  for (; p < end; p += kStep) {
+    _mm_stream_si128(reinterpret_cast<__m128i*>(p), zero);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(p + kVector), zero);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(p + 2 * kVector), zero);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(p + 3 * kVector), zero);
+  }
+  // Order the streaming stores before any store that publishes the memory.
+  _mm_sfence();
+  memset(p, 0, size & (kStep - 1));
+#else
+  memset(ptr, 0, size);
+#endif
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
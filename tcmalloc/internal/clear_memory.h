@@ -0,0 +1,52 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_CLEAR_MEMORY_H_
+#define TCMALLOC_INTERNAL_CLEAR_MEMORY_H_
+
+#include <cstddef>
+#include <cstring>
+
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Returns the size from which ClearMemory zeroes with non-temporal stores.  It
+// is the larger of the per-core L2 cache and 1 MiB, determined once from the
+// CPU, or SIZE_MAX when the CPU has no non-temporal stores we use.
+size_t NonTemporalClearThreshold();
+
+// Zeroes <size> bytes at <ptr> with non-temporal stores, which bypass the
+// caches, followed by a store fence.  Plain memset when not supported.
+void ClearNonTemporal(void* ptr, size_t size);
+
+// Zeroes <size> bytes at <ptr>.  Buffers at least NonTemporalClearThreshold()
+// bytes long, which would evict the caller's working set from the caches if
+// cleared through them, are zeroed with non-temporal stores.
+inline void ClearMemory(void* ptr, size_t size) {
+  if (ABSL_PREDICT_FALSE(size >= NonTemporalClearThreshold())) {
+    ClearNonTemporal(ptr, size);
+  } else {
+    memset(ptr, 0, size);
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_CLEAR_MEMORY_H_
@@ -0,0 +1,62 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/clear_memory.h"
+
+#include <cstddef>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr char kJunk = 0x5a;
+
+// Clears <size> bytes at <offset> in a buffer of junk and checks that exactly
+// those bytes were zeroed.
+void CheckClear(void (*clear)(void*, size_t), size_t offset, size_t size) {
+  std::vector<char> buf(offset + size + 64, kJunk);
+  clear(buf.data() + offset, size);
+  for (size_t i = 0; i < buf.size(); ++i) {
+    const bool cleared = i >= offset && i < offset + size;
+    ASSERT_EQ(buf[i], cleared ? 0 : kJunk)
+        << "offset=" << offset << " size=" << size << " i=" << i;
+  }
+}
+
+TEST(ClearMemoryTest, NonTemporal) {
+  for (size_t offset : {0, 1, 7, 15, 16, 33, 63}) {
+    for (size_t size : {0, 1, 15, 16, 63, 64, 65, 127, 4096, 65536 + 3}) {
+      CheckClear(ClearNonTemporal, offset, size);
+    }
+  }
+}
+
+TEST(ClearMemoryTest, AboveAndBelowThreshold) {
+  const size_t threshold = NonTemporalClearThreshold();
+  EXPECT_GE(threshold, size_t{1} << 20);
+  EXPECT_EQ(threshold, NonTemporalClearThreshold());
+
+  CheckClear(ClearMemory, 3, 4096);
+  if (threshold <= (size_t{64} << 20)) {
+    CheckClear(ClearMemory, 0, threshold);
+    CheckClear(ClearMemory, 5, threshold + 9);
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,121 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/frame_pointer_unwinder.h"
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/debugging/stacktrace.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+#if defined(__x86_64__) || defined(__aarch64__)
+constexpr bool kKnownFrameLayout = true;
+#else
+constexpr bool kKnownFrameLayout = false;
+#endif
+
+// Frames larger than this are taken to mean that the chain is broken, as the
+// generic unwinder does.
+constexpr uintptr_t kMaxFrameBytes = 100000;
+
+// Strips the pointer authentication code, if any, from a return address.
+inline void* StripReturnAddress(uintptr_t pc) {
+#if defined(__aarch64__)
+  // XPACLRI (hint #7) operates on x30 and is a no-op without PAC support.
+  register uintptr_t x30 __asm__("x30") = pc;
+  __asm__("hint #7" : "+r"(x30));
+  return reinterpret_cast<void*>(x30);
+#else
+  return reinterpret_cast<void*>(pc);
+#endif
+}
+
+enum class Usability : int { kUnknown, kUsable, kUnusable };
+
+ABSL_CONST_INIT std::atomic<Usability> usability{Usability::kUnknown};
+
+// Compares the two unwinders on the current stack.  The frame pointer walk
+// must not stop short of the generic unwinder.
+ABSL_ATTRIBUTE_NOINLINE bool Calibrate() {
+  constexpr int kDepth = 8;
+  void* fast[kDepth];
+  void* generic[kDepth];
+  const int fast_depth = GetStackTraceWithFramePointers(fast, kDepth, 0);
+  const int generic_depth = absl::GetStackTrace(generic, kDepth, 0);
+  if (fast_depth < 2 || fast_depth < generic_depth) return false;
+  for (int i = 0; i < generic_depth; ++i) {
+    if (fast[i] != generic[i]) return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+ABSL_ATTRIBUTE_NOINLINE int GetStackTraceWithFramePointers(void** result,
+                                                           int max_depth,
+                                                           int skip_count) {
+  if (!kKnownFrameLayout) return 0;
+
+  // Each frame record holds the caller's frame pointer, followed by the return
+  // address into the caller.  Using __builtin_frame_address forces this
+  // function to set up a frame record of its own.  As with absl, the first
+  // address recorded is the one our caller returns to.
+  const uintptr_t* fp =
+      static_cast<const uintptr_t*>(__builtin_frame_address(0));
+  ++skip_count;
+  int depth = 0;
+  while (fp != nullptr && depth < max_depth) {
+    const uintptr_t pc = fp[1];
+    if (ABSL_PREDICT_FALSE(pc == 0)) break;
+    if (skip_count > 0) {
+      --skip_count;
+    } else {
+      result[depth++] = StripReturnAddress(pc);
+    }
+
+    // The stack grows down, so callers' frames lie at higher addresses.
+    const uintptr_t next = fp[0];
+    const uintptr_t cur = reinterpret_cast<uintptr_t>(fp);
+    if (next <= cur || next - cur > kMaxFrameBytes ||
+        (next & (sizeof(uintptr_t) - 1)) != 0) {
+      break;
+    }
+    fp = reinterpret_cast<const uintptr_t*>(next);
+  }
+  return depth;
+}
+
+bool FramePointersUsable() {
+  Usability u = usability.load(std::memory_order_relaxed);
+  if (ABSL_PREDICT_FALSE(u == Usability::kUnknown)) {
+    // Racing threads may calibrate more than once, which is harmless.
+    u = kKnownFrameLayout && Calibrate() ? Usability::kUsable
+                                         : Usability::kUnusable;
+    usability.store(u, std::memory_order_relaxed);
+  }
+  return u == Usability::kUsable;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
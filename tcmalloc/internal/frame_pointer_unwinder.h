@@ -0,0 +1,42 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_FRAME_POINTER_UNWINDER_H_
+#define TCMALLOC_INTERNAL_FRAME_POINTER_UNWINDER_H_
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Like absl::GetStackTrace, but walks the chain of frame pointers directly,
+// with none of the generic unwinder's hooks and per-frame bookkeeping.  The
+// walk stops at the first frame that does not look like it was set up with a
+// frame pointer, so it is only complete in binaries built with
+// -fno-omit-frame-pointer (see FramePointersUsable).  Returns 0 on
+// architectures where the frame layout is not known.
+int GetStackTraceWithFramePointers(void** result, int max_depth,
+                                   int skip_count);
+
+// Returns whether GetStackTraceWithFramePointers agrees with
+// absl::GetStackTrace on the stack of the first call.  Callers should fall
+// back to absl::GetStackTrace otherwise.  The check is performed once.
+bool FramePointersUsable();
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_FRAME_POINTER_UNWINDER_H_
@@ -0,0 +1,59 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/frame_pointer_unwinder.h"
+
+#include "gtest/gtest.h"
+#include "absl/base/attributes.h"
+#include "absl/debugging/stacktrace.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr int kMaxDepth = 16;
+
+ABSL_ATTRIBUTE_NOINLINE void Unwind(void** fast, int* fast_depth,
+                                    void** generic, int* generic_depth,
+                                    int skip_count) {
+  *fast_depth = GetStackTraceWithFramePointers(fast, kMaxDepth, skip_count);
+  *generic_depth = absl::GetStackTrace(generic, kMaxDepth, skip_count);
+}
+
+TEST(FramePointerUnwinderTest, MatchesGenericUnwinder) {
+  if (!FramePointersUsable()) {
+    GTEST_SKIP() << "Not built with frame pointers";
+  }
+
+  void* fast[kMaxDepth];
+  void* generic[kMaxDepth];
+  int fast_depth, generic_depth;
+  Unwind(fast, &fast_depth, generic, &generic_depth, 0);
+  ASSERT_GE(fast_depth, 2);
+  ASSERT_GE(fast_depth, generic_depth);
+  for (int i = 0; i < generic_depth; ++i) {
+    EXPECT_EQ(fast[i], generic[i]) << i;
+  }
+
+  // Skipping frames drops them from the front.
+  void* skipped[kMaxDepth];
+  int skipped_depth;
+  Unwind(skipped, &skipped_depth, generic, &generic_depth, 1);
+  ASSERT_GE(skipped_depth, 1);
+  EXPECT_EQ(skipped[0], fast[1]);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,175 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_LIFETIME_PREDICTIONS_H_
+#define TCMALLOC_INTERNAL_LIFETIME_PREDICTIONS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Lifetime statistics for the allocations made from a single allocation site
+// (identified by a hash of its stack trace).  Each allocation is classified as
+// short-lived (freed before the lifetime threshold) or long-lived once its
+// lifetime is known, and the counts are used to predict the lifetime of the
+// next allocation from the same site.
+class LifetimeStats {
+ public:
+  enum class Prediction { kShortLived, kLongLived };
+
+  // Records that an allocation from this site turned out to be <outcome>.
+  void Update(Prediction outcome) {
+    uint32_t& count =
+        outcome == Prediction::kShortLived ? short_lived_ : long_lived_;
+    ++count;
+    // Decay old observations so that sites whose behavior changes over time
+    // are eventually predicted correctly.
+    if (ABSL_PREDICT_FALSE(count >= kMaxSamples)) {
+      short_lived_ /= 2;
+      long_lived_ /= 2;
+    }
+  }
+
+  // Predicts the lifetime of the next allocation from this site.  Sites we
+  // know too little about are predicted long-lived, which keeps their
+  // allocations on the regular placement path.
+  Prediction Predict() const {
+    if (short_lived_ + long_lived_ < kMinSamples) {
+      return Prediction::kLongLived;
+    }
+    return long_lived_ * kLongLivedMargin >= short_lived_
+               ? Prediction::kLongLived
+               : Prediction::kShortLived;
+  }
+
+  uint32_t short_lived() const { return short_lived_; }
+  uint32_t long_lived() const { return long_lived_; }
+
+  // Minimum number of observed lifetimes before we predict short-lived.
+  static constexpr uint32_t kMinSamples = 4;
+
+ private:
+  friend class LifetimeDatabase;
+
+  // A site is only predicted short-lived if short-lived allocations outnumber
+  // long-lived ones by this factor: mispredicting a long-lived allocation
+  // fragments the short-lived region for its entire lifetime.
+  static constexpr uint32_t kLongLivedMargin = 4;
+  static constexpr uint32_t kMaxSamples = 1 << 16;
+
+  uint64_t key_ = 0;
+  uint32_t short_lived_ = 0;
+  uint32_t long_lived_ = 0;
+  // Number of tracked allocations currently pointing at this entry; entries
+  // with outstanding references are never evicted.
+  uint32_t references_ = 0;
+  uint32_t last_used_ = 0;
+  bool in_use_ = false;
+};
+
+// A fixed-size table of LifetimeStats keyed by stack trace hash.  The table
+// never allocates: when every candidate slot for a new key is taken, the least
+// recently used entry without outstanding references is evicted.
+//
+// Not thread-safe; callers serialize access (pageheap_lock).
+class LifetimeDatabase {
+ public:
+  constexpr LifetimeDatabase() = default;
+
+  LifetimeDatabase(const LifetimeDatabase&) = delete;
+  LifetimeDatabase& operator=(const LifetimeDatabase&) = delete;
+
+  // Returns the statistics for allocation site <key>, creating them if needed,
+  // and takes a reference that must be dropped with Release().  Returns
+  // nullptr if no slot could be found, in which case the allocation is simply
+  // not tracked.
+  LifetimeStats* LookupOrAdd(uint64_t key) {
+    const size_t base = key % kEntries;
+    LifetimeStats* empty = nullptr;
+    LifetimeStats* victim = nullptr;
+    for (size_t i = 0; i < kProbes; ++i) {
+      LifetimeStats* e = &entries_[(base + i) % kEntries];
+      if (!e->in_use_) {
+        if (empty == nullptr) empty = e;
+        continue;
+      }
+      if (e->key_ == key) {
+        ++e->references_;
+        e->last_used_ = ++epoch_;
+        return e;
+      }
+      if (e->references_ == 0 &&
+          (victim == nullptr || e->last_used_ < victim->last_used_)) {
+        victim = e;
+      }
+    }
+
+    LifetimeStats* e = empty;
+    if (e == nullptr) {
+      if (victim == nullptr) {
+        ++lookup_failures_;
+        return nullptr;
+      }
+      e = victim;
+      ++evictions_;
+    } else {
+      ++size_;
+    }
+    *e = LifetimeStats();
+    e->in_use_ = true;
+    e->key_ = key;
+    e->references_ = 1;
+    e->last_used_ = ++epoch_;
+    return e;
+  }
+
+  // Drops a reference taken by LookupOrAdd().
+  void Release(LifetimeStats* stats) {
+    ASSERT(stats != nullptr);
+    ASSERT(stats->in_use_);
+    ASSERT(stats->references_ > 0);
+    --stats->references_;
+  }
+
+  // Number of allocation sites currently tracked.
+  size_t size() const { return size_; }
+  // Number of allocation sites evicted to make room for new ones.
+  size_t evictions() const { return evictions_; }
+  // Number of lookups that found no free or evictable slot.
+  size_t lookup_failures() const { return lookup_failures_; }
+
+  static constexpr size_t kEntries = 512;
+
+ private:
+  static constexpr size_t kProbes = 8;
+
+  LifetimeStats entries_[kEntries];
+  uint32_t epoch_ = 0;
+  size_t size_ = 0;
+  size_t evictions_ = 0;
+  size_t lookup_failures_ = 0;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_LIFETIME_PREDICTIONS_H_
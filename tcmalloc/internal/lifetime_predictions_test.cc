@@ -0,0 +1,120 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/lifetime_predictions.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using Prediction = LifetimeStats::Prediction;
+
+TEST(LifetimeStatsTest, PredictsLongLivedUntilEnoughSamples) {
+  LifetimeStats stats;
+  EXPECT_EQ(stats.Predict(), Prediction::kLongLived);
+  for (uint32_t i = 0; i + 1 < LifetimeStats::kMinSamples; ++i) {
+    stats.Update(Prediction::kShortLived);
+    EXPECT_EQ(stats.Predict(), Prediction::kLongLived);
+  }
+  stats.Update(Prediction::kShortLived);
+  EXPECT_EQ(stats.Predict(), Prediction::kShortLived);
+}
+
+TEST(LifetimeStatsTest, LongLivedOutweighsShortLived) {
+  LifetimeStats stats;
+  for (int i = 0; i < 16; ++i) {
+    stats.Update(Prediction::kShortLived);
+  }
+  EXPECT_EQ(stats.Predict(), Prediction::kShortLived);
+  // A minority of long-lived allocations is enough to flip the prediction.
+  for (int i = 0; i < 4; ++i) {
+    stats.Update(Prediction::kLongLived);
+  }
+  EXPECT_EQ(stats.Predict(), Prediction::kLongLived);
+}
+
+TEST(LifetimeStatsTest, Decays) {
+  LifetimeStats stats;
+  for (int i = 0; i < 1000000; ++i) {
+    stats.Update(Prediction::kLongLived);
+  }
+  // Old observations are halved as counts saturate, so a site that changes
+  // behavior does not need to overcome its entire history.
+  EXPECT_GT(stats.long_lived(), 0);
+  EXPECT_LE(stats.long_lived(), 1 << 16);
+  const uint32_t long_lived = stats.long_lived();
+  for (uint32_t i = 0; i <= long_lived * 4; ++i) {
+    stats.Update(Prediction::kShortLived);
+  }
+  EXPECT_EQ(stats.Predict(), Prediction::kShortLived);
+}
+
+TEST(LifetimeDatabaseTest, LookupReturnsSameEntry) {
+  LifetimeDatabase db;
+  LifetimeStats* a = db.LookupOrAdd(1);
+  LifetimeStats* b = db.LookupOrAdd(2);
+  ASSERT_NE(a, nullptr);
+  ASSERT_NE(b, nullptr);
+  EXPECT_NE(a, b);
+  EXPECT_EQ(db.LookupOrAdd(1), a);
+  EXPECT_EQ(db.size(), 2);
+
+  a->Update(Prediction::kShortLived);
+  db.Release(a);
+  db.Release(a);
+  db.Release(b);
+  LifetimeStats* c = db.LookupOrAdd(1);
+  EXPECT_EQ(c, a);
+  EXPECT_EQ(c->short_lived(), 1);
+  db.Release(c);
+}
+
+TEST(LifetimeDatabaseTest, EvictsUnreferenced) {
+  LifetimeDatabase db;
+  // All of these keys collide on the same probe window.
+  std::vector<LifetimeStats*> held;
+  for (uint64_t i = 0;; ++i) {
+    LifetimeStats* s = db.LookupOrAdd(i * LifetimeDatabase::kEntries);
+    if (s == nullptr) break;
+    held.push_back(s);
+  }
+  ASSERT_FALSE(held.empty());
+  EXPECT_EQ(db.lookup_failures(), 1);
+  EXPECT_EQ(db.evictions(), 0);
+
+  // Dropping a reference makes its entry evictable.
+  LifetimeStats* victim = held.front();
+  db.Release(victim);
+  LifetimeStats* s = db.LookupOrAdd(12345 * LifetimeDatabase::kEntries);
+  EXPECT_EQ(s, victim);
+  EXPECT_EQ(s->short_lived() + s->long_lived(), 0);
+  EXPECT_EQ(db.evictions(), 1);
+  EXPECT_EQ(db.size(), held.size());
+
+  db.Release(s);
+  for (size_t i = 1; i < held.size(); ++i) {
+    db.Release(held[i]);
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,169 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_LIFETIME_TRACKER_H_
+#define TCMALLOC_INTERNAL_LIFETIME_TRACKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/lifetime_predictions.h"
+#include "tcmalloc/internal/linked_list.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Observes the lifetimes of individual allocations and feeds the outcome back
+// into the LifetimeStats of their allocation site.  An allocation is
+// short-lived if it is freed within <threshold> of being allocated, and
+// long-lived otherwise.  Long-lived allocations are detected without waiting
+// for their deallocation: CheckForLifetimeExpirations() classifies every
+// tracked allocation older than <threshold>.
+//
+// Not thread-safe; callers serialize access (pageheap_lock).
+class LifetimeTracker {
+ public:
+  using Prediction = LifetimeStats::Prediction;
+
+  // Per-allocation tracking state.  This is embedded in the metadata of the
+  // allocation it tracks, so tracking never allocates.
+  class Tracker : public TList<Tracker>::Elem {
+   public:
+    constexpr Tracker() = default;
+
+    // True if this allocation is being tracked (it may already have been
+    // classified as long-lived).
+    bool is_tracked() const { return state_ != State::kUntracked; }
+    Prediction predicted() const { return predicted_; }
+
+    // Opaque location of the allocation in a counterfactual placement, if
+    // any.  Maintained by the owner of the tracker.
+    uintptr_t counterfactual_ptr() const { return counterfactual_ptr_; }
+    void set_counterfactual_ptr(uintptr_t p) { counterfactual_ptr_ = p; }
+
+   private:
+    friend class LifetimeTracker;
+
+    enum class State : uint8_t { kUntracked, kActive, kExpired };
+
+    LifetimeStats* lifetime_ = nullptr;
+    int64_t alloc_time_ = 0;
+    uintptr_t counterfactual_ptr_ = 0;
+    Prediction predicted_ = Prediction::kLongLived;
+    State state_ = State::kUntracked;
+  };
+
+  struct Stats {
+    // Allocations whose lifetime was observed, by actual outcome.
+    size_t short_lived = 0;
+    size_t long_lived = 0;
+    // Allocations whose observed lifetime differed from the prediction.
+    size_t mispredicted_short_lived = 0;  // predicted short, was long
+    size_t mispredicted_long_lived = 0;   // predicted long, was short
+    // Allocations currently tracked and not yet classified.
+    size_t active = 0;
+  };
+
+  constexpr LifetimeTracker(LifetimeDatabase* lifetime_database,
+                            absl::Duration threshold, Clock clock)
+      : lifetime_database_(*lifetime_database),
+        threshold_(threshold),
+        clock_(clock) {}
+
+  LifetimeTracker(const LifetimeTracker&) = delete;
+  LifetimeTracker& operator=(const LifetimeTracker&) = delete;
+
+  // Starts tracking an allocation from the site described by <lifetime>.
+  // Takes over the reference the caller holds on <lifetime>.
+  void AddAllocation(Tracker* tracker, LifetimeStats* lifetime,
+                     Prediction predicted) {
+    ASSERT(!tracker->is_tracked());
+    ASSERT(lifetime != nullptr);
+    tracker->lifetime_ = lifetime;
+    tracker->alloc_time_ = clock_.now();
+    tracker->predicted_ = predicted;
+    tracker->counterfactual_ptr_ = 0;
+    tracker->state_ = Tracker::State::kActive;
+    // Allocation times are monotonic, so the list stays sorted by age.
+    list_.append(tracker);
+    ++stats_.active;
+  }
+
+  // Stops tracking a deallocated allocation.  If it had not yet been
+  // classified as long-lived, it is recorded as short-lived.  Returns the
+  // observed lifetime.
+  Prediction RemoveAllocation(Tracker* tracker) {
+    ASSERT(tracker->is_tracked());
+    Prediction outcome = Prediction::kLongLived;
+    if (tracker->state_ == Tracker::State::kActive) {
+      list_.remove(tracker);
+      outcome = Prediction::kShortLived;
+      Classify(tracker, outcome);
+    }
+    tracker->state_ = Tracker::State::kUntracked;
+    return outcome;
+  }
+
+  // Classifies all tracked allocations older than the threshold as
+  // long-lived.  Cheap when there is nothing to do; called on every tracked
+  // allocation and deallocation.
+  void CheckForLifetimeExpirations() {
+    if (list_.empty()) return;
+    const int64_t now = clock_.now();
+    const int64_t threshold_ticks = static_cast<int64_t>(
+        absl::ToDoubleSeconds(threshold_) * clock_.freq());
+    while (!list_.empty()) {
+      Tracker* oldest = list_.first();
+      if (now - oldest->alloc_time_ < threshold_ticks) break;
+      list_.remove(oldest);
+      oldest->state_ = Tracker::State::kExpired;
+      Classify(oldest, Prediction::kLongLived);
+    }
+  }
+
+  absl::Duration threshold() const { return threshold_; }
+  const Stats& stats() const { return stats_; }
+
+ private:
+  void Classify(Tracker* tracker, Prediction outcome) {
+    tracker->lifetime_->Update(outcome);
+    lifetime_database_.Release(tracker->lifetime_);
+    tracker->lifetime_ = nullptr;
+    --stats_.active;
+    if (outcome == Prediction::kShortLived) {
+      ++stats_.short_lived;
+      if (tracker->predicted_ != outcome) ++stats_.mispredicted_long_lived;
+    } else {
+      ++stats_.long_lived;
+      if (tracker->predicted_ != outcome) ++stats_.mispredicted_short_lived;
+    }
+  }
+
+  LifetimeDatabase& lifetime_database_;
+  const absl::Duration threshold_;
+  const Clock clock_;
+  TList<Tracker> list_;
+  Stats stats_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_LIFETIME_TRACKER_H_
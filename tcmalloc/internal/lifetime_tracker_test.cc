@@ -0,0 +1,100 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/lifetime_tracker.h"
+
+#include <stdint.h>
+
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/lifetime_predictions.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using Prediction = LifetimeStats::Prediction;
+
+class LifetimeTrackerTest : public testing::Test {
+ protected:
+  LifetimeTrackerTest() { clock_ = 0; }
+
+  static int64_t FakeClock() { return clock_; }
+  static double GetFakeClockFrequency() {
+    return absl::ToDoubleNanoseconds(absl::Seconds(1));
+  }
+  static void Advance(absl::Duration d) {
+    clock_ += absl::ToDoubleSeconds(d) * GetFakeClockFrequency();
+  }
+
+  static inline int64_t clock_ = 0;
+
+  LifetimeDatabase db_;
+  LifetimeTracker tracker_{
+      &db_, absl::Milliseconds(500),
+      Clock{.now = FakeClock, .freq = GetFakeClockFrequency}};
+};
+
+TEST_F(LifetimeTrackerTest, ShortLived) {
+  LifetimeStats* stats = db_.LookupOrAdd(1);
+  LifetimeTracker::Tracker t;
+  EXPECT_FALSE(t.is_tracked());
+  tracker_.AddAllocation(&t, stats, Prediction::kLongLived);
+  EXPECT_TRUE(t.is_tracked());
+  EXPECT_EQ(tracker_.stats().active, 1);
+
+  Advance(absl::Milliseconds(100));
+  tracker_.CheckForLifetimeExpirations();
+  EXPECT_EQ(tracker_.RemoveAllocation(&t), Prediction::kShortLived);
+  EXPECT_FALSE(t.is_tracked());
+
+  EXPECT_EQ(stats->short_lived(), 1);
+  EXPECT_EQ(stats->long_lived(), 0);
+  EXPECT_EQ(tracker_.stats().active, 0);
+  EXPECT_EQ(tracker_.stats().short_lived, 1);
+  EXPECT_EQ(tracker_.stats().mispredicted_long_lived, 1);
+}
+
+TEST_F(LifetimeTrackerTest, LongLivedExpiresBeforeFree) {
+  LifetimeStats* stats = db_.LookupOrAdd(1);
+  db_.LookupOrAdd(1);
+  LifetimeTracker::Tracker a, b;
+  tracker_.AddAllocation(&a, stats, Prediction::kShortLived);
+  Advance(absl::Milliseconds(300));
+  tracker_.AddAllocation(&b, stats, Prediction::kShortLived);
+
+  // Only the older allocation has crossed the threshold.
+  Advance(absl::Milliseconds(300));
+  tracker_.CheckForLifetimeExpirations();
+  EXPECT_EQ(stats->long_lived(), 1);
+  EXPECT_EQ(stats->short_lived(), 0);
+  EXPECT_EQ(tracker_.stats().active, 1);
+  EXPECT_EQ(tracker_.stats().mispredicted_short_lived, 1);
+
+  // Freeing an expired allocation does not count it again.
+  EXPECT_EQ(tracker_.RemoveAllocation(&a), Prediction::kLongLived);
+  EXPECT_EQ(stats->long_lived(), 1);
+  EXPECT_EQ(tracker_.RemoveAllocation(&b), Prediction::kShortLived);
+  EXPECT_EQ(stats->short_lived(), 1);
+  EXPECT_EQ(tracker_.stats().active, 0);
+
+  // Both references were handed back to the database.
+  db_.Release(db_.LookupOrAdd(1));
+  EXPECT_EQ(db_.size(), 1);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
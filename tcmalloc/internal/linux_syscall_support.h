@@ -26,7 +26,11 @@ struct kernel_rseq {
   unsigned cpu_id;
   unsigned long long rseq_cs;
   unsigned flags;
-  unsigned padding[2];
+  unsigned node_id;
+  // Concurrency ID (Linux 6.3+): a dense ID in [0, number of CPUs), unique
+  // among the threads of the process currently running, which the kernel
+  // keeps close to the number of threads running concurrently.
+  unsigned mm_cid;
   // This is a prototype extension to the rseq() syscall.  Since a process may
   // run on only a few cores at a time, we can use a dense set of "v(irtual)
   // cpus."  This can reduce cache requirements, as we only need N caches for
@@ -58,6 +62,8 @@ static_assert(sizeof(kernel_rseq_cs) == (4 * sizeof(unsigned long long)),
 #define __NR_rseq 293
 #elif defined(__PPC__)
 #define __NR_rseq 387
+#elif defined(__riscv)
+#define __NR_rseq 293
 #endif
 #endif
 
@@ -47,6 +47,9 @@
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
+
+struct ProfileLabel;
+
 namespace tcmalloc_internal {
 
 static constexpr int kMaxStackDepth = 64;
@@ -56,7 +59,8 @@ using AllocHandle = int64_t;
 
 // size/depth are made the same size as a pointer so that some generic
 // code below can conveniently cast them back and forth to void*.
-struct StackTrace {
+// The metadata recorded for each sampled allocation, besides its stack.
+struct SampleMetadata {
   // An opaque handle used by allocator to uniquely identify the sampled
   // memory block.
   AllocHandle sampled_alloc_handle;
@@ -78,9 +82,6 @@ struct StackTrace {
   uint8_t access_hint;
   bool cold_allocated;
 
-  uintptr_t depth;  // Number of PC values stored in array below
-  void* stack[kMaxStackDepth];
-
   // weight is the expected number of *bytes* that were requested
   // between the previous sample and this one
   size_t weight;
@@ -96,6 +97,16 @@ struct StackTrace {
   // An integer representing the guarded status of the allocation.
   // The values are from the enum GuardedStatus in ../malloc_extension.h.
   int guarded_status;
+
+  // The profile labels set on the allocating thread, see
+  // MallocExtension::SetProfileLabels.
+  const ProfileLabel* labels = nullptr;
+  size_t num_labels = 0;
+};
+
+struct StackTrace : SampleMetadata {
+  uintptr_t depth;  // Number of PC values stored in array below
+  void* stack[kMaxStackDepth];
 };
 
 enum LogMode {
@@ -19,11 +19,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <climits>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
+#include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/page_size.h"
@@ -132,6 +136,251 @@ bool GetMemoryStats(MemoryStats* stats) {
   return true;
 }
 
+bool GetVmaCount(int64_t* count) {
+#if !defined(__linux__)
+  return false;
+#endif
+
+  FDCloser fd;
+  fd.fd = signal_safe_open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (fd.fd < 0) {
+    return false;
+  }
+
+  char buf[4096];
+  int64_t lines = 0;
+  ssize_t rc;
+  do {
+    rc = signal_safe_read(fd.fd, buf, sizeof(buf), nullptr);
+    if (rc < 0) {
+      return false;
+    }
+    for (ssize_t i = 0; i < rc; ++i) {
+      lines += buf[i] == '\n';
+    }
+  } while (rc > 0);
+  *count = lines;
+  return true;
+}
+
+namespace {
+
+// Reads up to <size> - 1 bytes of <path> into <buf>, returning them.
+bool ReadSmallFile(const char* path, char* buf, size_t size,
+                   absl::string_view* contents) {
+  FDCloser fd;
+  fd.fd = signal_safe_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd.fd < 0) {
+    return false;
+  }
+  ssize_t rc = signal_safe_read(fd.fd, buf, size - 1, nullptr);
+  if (rc < 0) {
+    return false;
+  }
+  buf[rc] = '\0';
+  *contents = absl::string_view(buf, rc);
+  return true;
+}
+
+// Reads the file <name> of the cgroup directory <dir>.
+bool ReadCgroupFile(absl::string_view dir, const char* name, char* buf,
+                    size_t size, absl::string_view* contents) {
+  constexpr absl::string_view kRoot = "/sys/fs/cgroup";
+  char path[PATH_MAX];
+  const size_t name_len = strlen(name);
+  if (kRoot.size() + dir.size() + 1 + name_len + 1 > sizeof(path)) {
+    return false;
+  }
+  char* p = path;
+  memcpy(p, kRoot.data(), kRoot.size());
+  p += kRoot.size();
+  memcpy(p, dir.data(), dir.size());
+  p += dir.size();
+  *p++ = '/';
+  memcpy(p, name, name_len + 1);
+  return ReadSmallFile(path, buf, size, contents);
+}
+
+}  // namespace
+
+bool ParseLazyFree(absl::string_view smaps_rollup, int64_t* bytes) {
+  // LazyFree:              0 kB
+  constexpr absl::string_view kField = "\nLazyFree:";
+  const size_t start = smaps_rollup.find(kField);
+  if (start == absl::string_view::npos) {
+    return false;
+  }
+  smaps_rollup.remove_prefix(start + kField.size());
+  absl::string_view value = smaps_rollup.substr(0, smaps_rollup.find('\n'));
+  value = absl::StripAsciiWhitespace(value);
+  int64_t kib;
+  if (!absl::ConsumeSuffix(&value, "kB") ||
+      !absl::SimpleAtoi(absl::StripAsciiWhitespace(value), &kib)) {
+    return false;
+  }
+  *bytes = kib * 1024;
+  return true;
+}
+
+bool GetLazyFreeBytes(int64_t* bytes) {
+#if !defined(__linux__)
+  return false;
+#endif
+
+  char buf[2048];
+  absl::string_view contents;
+  return ReadSmallFile("/proc/self/smaps_rollup", buf, sizeof(buf),
+                       &contents) &&
+         ParseLazyFree(contents, bytes);
+}
+
+bool ParseCgroupPath(absl::string_view proc_self_cgroup,
+                     absl::string_view* path) {
+  // Each line is "hierarchy-ID:controller-list:cgroup-path"; cgroup v2 has the
+  // ID 0 and no controllers.
+  while (!proc_self_cgroup.empty()) {
+    absl::string_view line = proc_self_cgroup;
+    const size_t end = proc_self_cgroup.find('\n');
+    if (end == absl::string_view::npos) {
+      proc_self_cgroup = absl::string_view();
+    } else {
+      line = proc_self_cgroup.substr(0, end);
+      proc_self_cgroup.remove_prefix(end + 1);
+    }
+    if (absl::ConsumePrefix(&line, "0::") && absl::StartsWith(line, "/")) {
+      *path = line;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ParseCgroupMemoryLimit(absl::string_view contents, int64_t* limit) {
+  contents = absl::StripAsciiWhitespace(contents);
+  if (contents == "max") {
+    *limit = -1;
+    return true;
+  }
+  return absl::SimpleAtoi(contents, limit);
+}
+
+bool ParseCgroupMemoryPressure(absl::string_view contents,
+                               double* some_avg10) {
+  // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+  // full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+  if (!absl::ConsumePrefix(&contents, "some avg10=")) {
+    return false;
+  }
+  const size_t end = contents.find(' ');
+  if (end == absl::string_view::npos) {
+    return false;
+  }
+  return absl::SimpleAtod(contents.substr(0, end), some_avg10);
+}
+
+bool ParseCgroupCpuMax(absl::string_view contents, double* cpus) {
+  // $MAX $PERIOD, where $MAX is "max" without a quota.
+  contents = absl::StripAsciiWhitespace(contents);
+  const size_t space = contents.find(' ');
+  if (space == absl::string_view::npos) {
+    return false;
+  }
+  const absl::string_view quota = contents.substr(0, space);
+  int64_t period;
+  if (!absl::SimpleAtoi(contents.substr(space + 1), &period) || period <= 0) {
+    return false;
+  }
+  if (quota == "max") {
+    *cpus = -1;
+    return true;
+  }
+  int64_t max;
+  if (!absl::SimpleAtoi(quota, &max) || max <= 0) {
+    return false;
+  }
+  *cpus = static_cast<double>(max) / period;
+  return true;
+}
+
+namespace {
+
+// Finds the cgroup v2 directory of the calling process, relative to the
+// cgroup mount.  <buf> holds the contents <dir> points into.
+bool FindCgroupDir(char* buf, size_t size, absl::string_view* dir) {
+  absl::string_view contents;
+  return ReadSmallFile("/proc/self/cgroup", buf, size, &contents) &&
+         ParseCgroupPath(contents, dir);
+}
+
+bool ReadCgroupMemoryLimit(absl::string_view dir, int64_t* limit) {
+  char buf[64];
+  absl::string_view contents;
+  *limit = -1;
+  for (const char* name : {"memory.high", "memory.max"}) {
+    int64_t value;
+    if (!ReadCgroupFile(dir, name, buf, sizeof(buf), &contents) ||
+        !ParseCgroupMemoryLimit(contents, &value)) {
+      return false;
+    }
+    if (value >= 0 && (*limit < 0 || value < *limit)) {
+      *limit = value;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool GetCgroupMemoryLimit(int64_t* limit) {
+#if !defined(__linux__)
+  return false;
+#endif
+
+  char cgroup_buf[1024];
+  absl::string_view dir;
+  return FindCgroupDir(cgroup_buf, sizeof(cgroup_buf), &dir) &&
+         ReadCgroupMemoryLimit(dir, limit);
+}
+
+bool GetCgroupCpuQuota(double* cpus) {
+#if !defined(__linux__)
+  return false;
+#endif
+
+  char cgroup_buf[1024];
+  absl::string_view dir;
+  char buf[64];
+  absl::string_view contents;
+  return FindCgroupDir(cgroup_buf, sizeof(cgroup_buf), &dir) &&
+         ReadCgroupFile(dir, "cpu.max", buf, sizeof(buf), &contents) &&
+         ParseCgroupCpuMax(contents, cpus);
+}
+
+bool GetCgroupMemoryStats(CgroupMemoryStats* stats) {
+#if !defined(__linux__)
+  return false;
+#endif
+
+  char cgroup_buf[1024];
+  absl::string_view dir;
+  if (!FindCgroupDir(cgroup_buf, sizeof(cgroup_buf), &dir)) {
+    return false;
+  }
+
+  char buf[256];
+  absl::string_view contents;
+  if (!ReadCgroupFile(dir, "memory.current", buf, sizeof(buf), &contents) ||
+      !absl::SimpleAtoi(absl::StripAsciiWhitespace(contents),
+                        &stats->current)) {
+    return false;
+  }
+
+  return ReadCgroupMemoryLimit(dir, &stats->limit) &&
+         ReadCgroupFile(dir, "memory.pressure", buf, sizeof(buf),
+                        &contents) &&
+         ParseCgroupMemoryPressure(contents, &stats->some_avg10);
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 
+#include "absl/strings/string_view.h"
 #include "tcmalloc/internal/config.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -34,6 +35,61 @@ struct MemoryStats {
 // Memory stats of a process
 bool GetMemoryStats(MemoryStats* stats);
 
+// Counts the mappings (VMAs) of the process, the lines of /proc/self/maps.
+// Mapping changes and page faults contend on the lock that protects them, so
+// they slow down as their number grows.  Takes time linear in the count, and
+// does not allocate.
+bool GetVmaCount(int64_t* count);
+
+// Reads the bytes of the process's memory freed with MADV_FREE that the kernel
+// has not reclaimed yet, the LazyFree field of /proc/self/smaps_rollup.  They
+// count as resident until reclaimed.  Does not allocate.
+bool GetLazyFreeBytes(int64_t* bytes);
+
+// Memory usage, limit and pressure stall information of the cgroup (v2) of a
+// process.
+struct CgroupMemoryStats {
+  // memory.current
+  int64_t current;
+  // The lower of memory.high and memory.max, or -1 if neither is set.
+  int64_t limit;
+  // The "some avg10" of memory.pressure: the percentage of the last 10
+  // seconds in which at least one task stalled waiting for memory.
+  double some_avg10;
+};
+
+// Reads the memory stats of the cgroup of the calling process.  Returns false
+// if it is not in a cgroup v2 hierarchy, or the memory controller or PSI are
+// not available.  Does not allocate.
+bool GetCgroupMemoryStats(CgroupMemoryStats* stats);
+
+// Reads the limit of the cgroup of the calling process, as
+// CgroupMemoryStats::limit, without its usage or pressure.
+bool GetCgroupMemoryLimit(int64_t* limit);
+
+// Reads the cpu quota of the cgroup of the calling process from cpu.max, in
+// cpus: the quota divided by the period.  Stores -1 if it has no quota.
+// Returns false if it is not in a cgroup v2 hierarchy or the cpu controller is
+// not enabled for it.  Does not allocate.
+bool GetCgroupCpuQuota(double* cpus);
+
+// Finds the LazyFree field of the contents of /proc/self/smaps_rollup, in
+// bytes.  Exposed for testing.
+bool ParseLazyFree(absl::string_view smaps_rollup, int64_t* bytes);
+
+// Parsers for the contents of the files read by GetCgroupMemoryStats, exposed
+// for testing.
+//
+// Finds the cgroup v2 ("0::") entry of /proc/self/cgroup.
+bool ParseCgroupPath(absl::string_view proc_self_cgroup,
+                     absl::string_view* path);
+// Parses memory.high or memory.max, storing -1 for "max".
+bool ParseCgroupMemoryLimit(absl::string_view contents, int64_t* limit);
+// Parses the "some" line of memory.pressure.
+bool ParseCgroupMemoryPressure(absl::string_view contents, double* some_avg10);
+// Parses cpu.max, storing -1 for a "max" quota.
+bool ParseCgroupCpuMax(absl::string_view contents, double* cpus);
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -19,6 +19,7 @@
 
 
 #include "gtest/gtest.h"
+#include "absl/strings/string_view.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -40,6 +41,99 @@ TEST(Stats, ValidRanges) {
   EXPECT_GT(stats.data, 0);
 }
 
+TEST(Stats, VmaCount) {
+  int64_t count;
+#if defined(__linux__)
+  ASSERT_TRUE(GetVmaCount(&count));
+#else
+  ASSERT_FALSE(GetVmaCount(&count));
+  return;
+#endif
+
+  // The executable, its stack and heap all have mappings of their own.
+  EXPECT_GT(count, 3);
+}
+
+TEST(Stats, ParseCgroupPath) {
+  absl::string_view path;
+  EXPECT_TRUE(ParseCgroupPath("0::/system.slice/foo.service\n", &path));
+  EXPECT_EQ(path, "/system.slice/foo.service");
+  // Hybrid hierarchies list the v1 controllers first.
+  EXPECT_TRUE(ParseCgroupPath("12:memory:/v1\n1:name=systemd:/v1\n0::/v2",
+                              &path));
+  EXPECT_EQ(path, "/v2");
+  EXPECT_FALSE(ParseCgroupPath("12:memory:/v1\n", &path));
+  EXPECT_FALSE(ParseCgroupPath("", &path));
+}
+
+TEST(Stats, ParseCgroupMemoryLimit) {
+  int64_t limit;
+  EXPECT_TRUE(ParseCgroupMemoryLimit("max\n", &limit));
+  EXPECT_EQ(limit, -1);
+  EXPECT_TRUE(ParseCgroupMemoryLimit("1073741824\n", &limit));
+  EXPECT_EQ(limit, 1073741824);
+  EXPECT_FALSE(ParseCgroupMemoryLimit("", &limit));
+}
+
+TEST(Stats, ParseLazyFree) {
+  int64_t bytes;
+  EXPECT_TRUE(ParseLazyFree("00400000-7ffd1f3f1000 ---p 00000000 00:00 0 "
+                            "[rollup]\n"
+                            "Rss:                1024 kB\n"
+                            "LazyFree:             12 kB\n"
+                            "Swap:                  0 kB\n",
+                            &bytes));
+  EXPECT_EQ(bytes, 12 << 10);
+  EXPECT_FALSE(ParseLazyFree("Rss:                1024 kB\n", &bytes));
+  EXPECT_FALSE(ParseLazyFree("Rss: 1 kB\nLazyFree: twelve kB\n", &bytes));
+}
+
+TEST(Stats, LazyFreeBytes) {
+  int64_t bytes;
+  if (!GetLazyFreeBytes(&bytes)) {
+    GTEST_SKIP() << "No /proc/self/smaps_rollup";
+  }
+  EXPECT_GE(bytes, 0);
+}
+
+TEST(Stats, ParseCgroupMemoryPressure) {
+  double avg10;
+  EXPECT_TRUE(ParseCgroupMemoryPressure(
+      "some avg10=12.50 avg60=3.00 avg300=0.50 total=123456\n"
+      "full avg10=1.00 avg60=0.00 avg300=0.00 total=456\n",
+      &avg10));
+  EXPECT_DOUBLE_EQ(avg10, 12.5);
+  EXPECT_FALSE(ParseCgroupMemoryPressure("full avg10=1.00 avg60=0.00", &avg10));
+  EXPECT_FALSE(ParseCgroupMemoryPressure("", &avg10));
+}
+
+TEST(Stats, ParseCgroupCpuMax) {
+  double cpus;
+  EXPECT_TRUE(ParseCgroupCpuMax("200000 100000\n", &cpus));
+  EXPECT_DOUBLE_EQ(cpus, 2);
+  EXPECT_TRUE(ParseCgroupCpuMax("50000 100000\n", &cpus));
+  EXPECT_DOUBLE_EQ(cpus, 0.5);
+  EXPECT_TRUE(ParseCgroupCpuMax("max 100000\n", &cpus));
+  EXPECT_EQ(cpus, -1);
+  EXPECT_FALSE(ParseCgroupCpuMax("max\n", &cpus));
+  EXPECT_FALSE(ParseCgroupCpuMax("100000 0\n", &cpus));
+  EXPECT_FALSE(ParseCgroupCpuMax("", &cpus));
+}
+
+TEST(Stats, CgroupMemoryStats) {
+  CgroupMemoryStats stats;
+  if (!GetCgroupMemoryStats(&stats)) {
+    GTEST_SKIP() << "No cgroup v2 memory controller";
+  }
+  EXPECT_GT(stats.current, 0);
+  EXPECT_GE(stats.some_avg10, 0);
+  EXPECT_LE(stats.some_avg10, 100);
+
+  int64_t limit;
+  ASSERT_TRUE(GetCgroupMemoryLimit(&limit));
+  EXPECT_EQ(limit, stats.limit);
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -0,0 +1,144 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/memory_tagging.h"
+
+#include <signal.h>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#elif defined(__x86_64__) && defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+#if defined(__aarch64__) && defined(__linux__)
+
+// Not all libc headers carry the MTE constants yet.
+#ifndef HWCAP2_MTE
+#define HWCAP2_MTE (1 << 18)
+#endif
+#ifndef PROT_MTE
+#define PROT_MTE 0x20
+#endif
+#ifndef PR_SET_TAGGED_ADDR_CTRL
+#define PR_SET_TAGGED_ADDR_CTRL 55
+#define PR_GET_TAGGED_ADDR_CTRL 56
+#define PR_TAGGED_ADDR_ENABLE (1UL << 0)
+#endif
+#ifndef PR_MTE_TCF_SHIFT
+#define PR_MTE_TCF_SHIFT 1
+#define PR_MTE_TCF_SYNC (1UL << PR_MTE_TCF_SHIFT)
+#define PR_MTE_TCF_ASYNC (2UL << PR_MTE_TCF_SHIFT)
+#define PR_MTE_TAG_SHIFT 3
+#endif
+#ifndef SEGV_MTEAERR
+#define SEGV_MTEAERR 8
+#define SEGV_MTESERR 9
+#endif
+
+bool MemoryTaggingSupported() {
+  static const bool supported = (getauxval(AT_HWCAP2) & HWCAP2_MTE) != 0;
+  return supported;
+}
+
+int MemoryTaggingProtFlag() {
+  return MemoryTaggingSupported() ? PROT_MTE : 0;
+}
+
+bool EnableMemoryTagChecks() {
+  if (!MemoryTaggingSupported()) return false;
+  int ctrl = prctl(PR_GET_TAGGED_ADDR_CTRL, 0, 0, 0, 0);
+  if (ctrl < 0) return false;
+  if (ctrl & PR_MTE_TCF_SYNC) return true;
+  // Let IRG pick any non-zero tag; tag 0 is left for untagged memory.
+  ctrl |= PR_TAGGED_ADDR_ENABLE | PR_MTE_TCF_ASYNC |
+          (0xfffeUL << PR_MTE_TAG_SHIFT);
+  return prctl(PR_SET_TAGGED_ADDR_CTRL, ctrl, 0, 0, 0) == 0;
+}
+
+bool EnableSizeClassTags() {
+  if (!kSizeClassTags) return false;
+  // Top-byte-ignore is always on for user addresses; the kernel only has to
+  // accept tagged pointers in system calls.
+  int ctrl = prctl(PR_GET_TAGGED_ADDR_CTRL, 0, 0, 0, 0);
+  if (ctrl < 0) return false;
+  return prctl(PR_SET_TAGGED_ADDR_CTRL, ctrl | PR_TAGGED_ADDR_ENABLE, 0, 0,
+               0) == 0;
+}
+
+bool IsTagCheckFault(int signo, int si_code, bool* fault_address_known) {
+  if (signo != SIGSEGV) return false;
+  if (si_code == SEGV_MTESERR) {
+    *fault_address_known = true;
+    return true;
+  }
+  if (si_code == SEGV_MTEAERR) {
+    *fault_address_known = false;
+    return true;
+  }
+  return false;
+}
+
+#else
+
+bool MemoryTaggingSupported() { return false; }
+
+int MemoryTaggingProtFlag() { return 0; }
+
+bool EnableMemoryTagChecks() { return false; }
+
+bool IsTagCheckFault(int signo, int si_code, bool* fault_address_known) {
+  return false;
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#ifndef ARCH_GET_UNTAG_MASK
+#define ARCH_GET_UNTAG_MASK 0x4001
+#define ARCH_ENABLE_TAGGED_ADDR 0x4002
+#endif
+
+bool EnableSizeClassTags() {
+  if (!kSizeClassTags) return false;
+  // Linear Address Masking for 57-bit addresses ignores bits 57-62.
+  if (syscall(SYS_arch_prctl, ARCH_ENABLE_TAGGED_ADDR, 6) != 0) return false;
+  uint64_t untag_mask = 0;
+  if (syscall(SYS_arch_prctl, ARCH_GET_UNTAG_MASK, &untag_mask) != 0) {
+    return false;
+  }
+  return (untag_mask & kSizeClassTagMask) == 0;
+}
+
+#else
+
+bool EnableSizeClassTags() { return false; }
+
+#endif
+
+#endif
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
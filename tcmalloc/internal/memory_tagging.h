@@ -0,0 +1,146 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Helpers for the Arm Memory Tagging Extension (MTE).  Every 16-byte granule of
+// memory mapped with PROT_MTE carries a 4-bit tag, and so do bits 56-59 of the
+// pointers that access it; with tag checking enabled, an access through a
+// pointer whose tag differs from that of the memory faults.  Elsewhere these
+// are no-ops and MemoryTaggingSupported() returns false.
+//
+// Built with -DTCMALLOC_INTERNAL_SIZE_CLASS_TAGS, pointers may instead carry
+// the size class of the object they point to in bits 57-62, which AArch64's
+// top-byte-ignore and x86-64's Linear Address Masking (for 57-bit user
+// addresses) both leave out of address translation.  The two uses of the top
+// bits overlap, so only one is active at a time.
+
+#ifndef TCMALLOC_INTERNAL_MEMORY_TAGGING_H_
+#define TCMALLOC_INTERNAL_MEMORY_TAGGING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+inline constexpr size_t kMemoryTagGranule = 16;
+inline constexpr int kAddressTagShift = 56;
+inline constexpr uint8_t kNumMemoryTags = 16;
+
+#if defined(TCMALLOC_INTERNAL_SIZE_CLASS_TAGS) && \
+    (defined(__aarch64__) || defined(__x86_64__))
+inline constexpr bool kSizeClassTags = true;
+#else
+inline constexpr bool kSizeClassTags = false;
+#endif
+inline constexpr int kSizeClassTagShift = 57;
+// Size classes from this one on do not fit in a tag.
+inline constexpr size_t kMaxTaggedSizeClass = 64;
+inline constexpr uintptr_t kSizeClassTagMask =
+    uintptr_t{kMaxTaggedSizeClass - 1} << kSizeClassTagShift;
+
+// Returns the size class <addr> is tagged with, or 0 if it is not tagged.
+// <tag_mask> is kSizeClassTagMask while size class tags are enabled and 0
+// otherwise, when the same bits may hold something else, such as an MTE tag.
+inline constexpr size_t SizeClassTagOf(uintptr_t addr, uintptr_t tag_mask) {
+  return (addr & tag_mask) >> kSizeClassTagShift;
+}
+
+// Strips the size class tag, under <tag_mask> as above, from <addr>.
+inline constexpr uintptr_t StripSizeClassTag(uintptr_t addr,
+                                             uintptr_t tag_mask) {
+  return addr & ~tag_mask;
+}
+
+// Strips the tag, or with the top-byte-ignore feature of AArch64 any other
+// bits in the top byte, from <addr>.
+inline constexpr uintptr_t UntagAddress(uintptr_t addr) {
+#if defined(__aarch64__)
+  return addr & ((uintptr_t{1} << kAddressTagShift) - 1);
+#else
+  return kSizeClassTags ? addr & ~kSizeClassTagMask : addr;
+#endif
+}
+
+inline constexpr uint8_t AddressTag(uintptr_t addr) {
+#if defined(__aarch64__)
+  return (addr >> kAddressTagShift) & (kNumMemoryTags - 1);
+#else
+  (void)addr;
+  return 0;
+#endif
+}
+
+inline void* TagAddress(void* ptr, uint8_t tag) {
+#if defined(__aarch64__)
+  return reinterpret_cast<void*>(
+      UntagAddress(reinterpret_cast<uintptr_t>(ptr)) |
+      (static_cast<uintptr_t>(tag & (kNumMemoryTags - 1)) << kAddressTagShift));
+#else
+  (void)tag;
+  return ptr;
+#endif
+}
+
+// Sets the tag of the memory in [ptr, ptr + size) to the tag of <ptr>.  <ptr>
+// and <size> must be multiples of kMemoryTagGranule, and the memory must be
+// mapped with PROT_MTE.
+inline void SetMemoryTags(void* ptr, size_t size) {
+#if defined(__aarch64__)
+  char* p = static_cast<char*>(ptr);
+  for (char* end = p + size; p < end; p += kMemoryTagGranule) {
+    __asm__ __volatile__(
+        ".arch_extension memtag\n"
+        "stg %0, [%0]"
+        :
+        : "r"(p)
+        : "memory");
+  }
+#else
+  (void)ptr;
+  (void)size;
+#endif
+}
+
+// Returns true if the CPU and kernel support MTE.
+bool MemoryTaggingSupported();
+
+// Returns the mmap/mprotect protection flag that enables tagging of a mapping,
+// or 0 if MemoryTaggingSupported() is false.
+int MemoryTaggingProtFlag();
+
+// Enables asynchronous tag checking for the calling thread and for the threads
+// it creates from now on, keeping synchronous checking if that is already
+// enabled.  Asynchronous faults are reported on the next kernel entry, without
+// the address of the access.  Returns false if MTE is not supported.
+bool EnableMemoryTagChecks();
+
+// Has the kernel let the process use pointers with size class tags, for
+// system calls too.  Returns false if kSizeClassTags is false, or the kernel
+// or hardware do not support it.  On x86-64 this must be called while the
+// process is single-threaded; on AArch64 it applies to the calling thread and
+// the threads it creates from now on.
+bool EnableSizeClassTags();
+
+// Returns true if a signal <signo> with code <si_code> is a tag check fault.
+// Sets <fault_address_known> to false for asynchronous faults.
+bool IsTagCheckFault(int signo, int si_code, bool* fault_address_known);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_MEMORY_TAGGING_H_
@@ -0,0 +1,63 @@
+// Copyright 2026 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/memory_tagging.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr uintptr_t kAddress = 0x7f12'3456'7890;
+
+uintptr_t WithSizeClassTag(uintptr_t addr, size_t size_class) {
+  return addr | (uintptr_t{size_class} << kSizeClassTagShift);
+}
+
+TEST(SizeClassTagTest, Tagged) {
+  for (size_t size_class = 1; size_class < kMaxTaggedSizeClass; ++size_class) {
+    const uintptr_t tagged = WithSizeClassTag(kAddress, size_class);
+    EXPECT_EQ(SizeClassTagOf(tagged, kSizeClassTagMask), size_class);
+    EXPECT_EQ(StripSizeClassTag(tagged, kSizeClassTagMask), kAddress);
+  }
+}
+
+TEST(SizeClassTagTest, Untagged) {
+  EXPECT_EQ(SizeClassTagOf(kAddress, kSizeClassTagMask), 0);
+  EXPECT_EQ(StripSizeClassTag(kAddress, kSizeClassTagMask), kAddress);
+}
+
+// With size class tags compiled in but not enabled at runtime, the top bits
+// are not a size class, even if something else has set them.
+TEST(SizeClassTagTest, Disabled) {
+  EXPECT_EQ(SizeClassTagOf(kAddress, 0), 0);
+  EXPECT_EQ(StripSizeClassTag(kAddress, 0), kAddress);
+
+  // An address carrying an MTE tag in bits 56-59.
+  for (uintptr_t mte_tag = 1; mte_tag < kNumMemoryTags; ++mte_tag) {
+    const uintptr_t addr = kAddress | (mte_tag << kAddressTagShift);
+    // Read under kSizeClassTagMask, most of these look like a size class.
+    EXPECT_EQ(SizeClassTagOf(addr, kSizeClassTagMask), mte_tag >> 1);
+    EXPECT_EQ(SizeClassTagOf(addr, 0), 0);
+    EXPECT_EQ(StripSizeClassTag(addr, 0), addr);
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -50,11 +50,11 @@ enum class NumaBindMode {
 
 // We use the result of RseqCpuId() in GetCurrentPartition() to avoid branching
 // in the fast path, but this means that the CPU number we look up in
-// cpu_to_scaled_partition_ might equal kCpuIdUninitialized or
-// kCpuIdUnsupported. We add this fudge factor to the value to compensate,
+// cpu_to_scaled_partition_ might equal kCpuIdUninitialized, kCpuIdUnsupported
+// or kCpuIdLocked. We add this fudge factor to the value to compensate,
 // ensuring that our accesses to the cpu_to_scaled_partition_ array are always
 // in bounds.
-static constexpr size_t kNumaCpuFudge = -subtle::percpu::kCpuIdUnsupported;
+static constexpr size_t kNumaCpuFudge = -subtle::percpu::kCpuIdLocked;
 
 // Provides information about the topology of a NUMA system.
 //
@@ -182,6 +182,20 @@ absl::StatusCode PageFlags::ReadMany(int64_t num_pages, PageStats& output) {
   return absl::StatusCode::kOk;
 }
 
+std::optional<bool> PageFlags::IsHugePage(const void* const addr) {
+  if (fd_ < 0) {
+    return std::nullopt;
+  }
+  uint64_t flags = 0;
+  bool is_huge = false;
+  const uintptr_t page = reinterpret_cast<uintptr_t>(addr) & ~(kPageSize - 1);
+  if (auto res = MaybeReadOne(page, flags, is_huge);
+      res != absl::StatusCode::kOk) {
+    return std::nullopt;
+  }
+  return is_huge && PageThp(flags);
+}
+
 std::optional<PageFlags::PageStats> PageFlags::Get(const void* const addr,
                                                    const size_t size) {
   if (fd_ < 0) {
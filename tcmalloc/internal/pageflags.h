@@ -74,6 +74,10 @@ class PageFlags {
   // use the function in places where memory allocation is prohibited.
   std::optional<PageStats> Get(const void* addr, size_t size);
 
+  // Returns whether the page containing `addr` is part of a THP hugepage, or
+  // std::nullopt if its flags could not be read.
+  std::optional<bool> IsHugePage(const void* addr);
+
  private:
   // This helper seeks the internal file to the correct location for the given
   // virtual address.
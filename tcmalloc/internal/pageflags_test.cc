@@ -62,6 +62,10 @@ class PageFlagsFriend {
     return r_.Get(std::forward<Args>(args)...);
   }
 
+  std::optional<bool> IsHugePage(const void* addr) {
+    return r_.IsHugePage(addr);
+  }
+
  private:
   PageFlags r_;
 };
@@ -369,6 +373,37 @@ TEST(PageFlagsTest, TooManyTails) {
       std::nullopt);
 }
 
+TEST(PageFlagsTest, IsHugePage) {
+  const size_t kPageSize = getpagesize();
+  const size_t kPagesPerHugePage = kHugePageSize / kPageSize;
+  // A hugepage, surrounded by native pages.
+  std::vector<uint64_t> data(3 * kPagesPerHugePage);
+  data[kPagesPerHugePage] = kPageHead | kPageThp;
+  for (size_t i = kPagesPerHugePage + 1; i < 2 * kPagesPerHugePage; ++i) {
+    data[i] = kPageTail | kPageThp;
+  }
+
+  std::string file_path = absl::StrCat(testing::TempDir(), "/is-huge-page");
+  int write_fd =
+      signal_safe_open(file_path.c_str(), O_CREAT | O_WRONLY, S_IRUSR);
+  ASSERT_NE(write_fd, -1) << errno;
+
+  size_t bytes_to_write = data.size() * sizeof(data[0]);
+  ASSERT_EQ(write(write_fd, data.data(), bytes_to_write), bytes_to_write)
+      << errno;
+  ASSERT_EQ(close(write_fd), 0) << errno;
+
+  PageFlagsFriend s(file_path.c_str());
+  EXPECT_THAT(s.IsHugePage(reinterpret_cast<char*>(0)), Optional(false));
+  EXPECT_THAT(s.IsHugePage(reinterpret_cast<char*>(kHugePageSize)),
+              Optional(true));
+  EXPECT_THAT(
+      s.IsHugePage(reinterpret_cast<char*>(kHugePageSize + 3 * kPageSize + 7)),
+      Optional(true));
+  EXPECT_THAT(s.IsHugePage(reinterpret_cast<char*>(2 * kHugePageSize)),
+              Optional(false));
+}
+
 TEST(PageFlagsTest, NotThp) {
   const size_t kPageSize = getpagesize();
   std::vector<uint64_t> data(3 * kHugePageSize / kPageSize);
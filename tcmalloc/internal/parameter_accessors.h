@@ -59,8 +59,15 @@ ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMaxTotalThreadCacheBytes(
     int64_t v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPeakSamplingHeapGrowthFraction(
     double v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPrefaultHugePages(int64_t v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPerCpuCachesEnabled(bool v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetProfileSamplingRate(int64_t v);
+ABSL_ATTRIBUTE_WEAK double TCMalloc_Internal_GetProfileSamplingTargetPerSecond();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetProfileSamplingTargetPerSecond(
+    double v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetProfileSamplingSiteBoost();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetProfileSamplingSiteBoost(
+    int64_t v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetBackgroundProcessActionsEnabled(
     bool v);
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetBackgroundProcessSleepInterval(
@@ -86,12 +93,98 @@ ABSL_ATTRIBUTE_WEAK double
 TCMalloc_Internal_GetPerCpuCachesDynamicSlabGrowThreshold();
 ABSL_ATTRIBUTE_WEAK void
 TCMalloc_Internal_SetPerCpuCachesDynamicSlabGrowThreshold(double v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPerCpuCachesAutotune();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPerCpuCachesAutotune(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPerCpuCachesHandoff();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPerCpuCachesHandoff(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPerCpuCachesWipeOnFork();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPerCpuCachesWipeOnFork(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPerCpuCachesAdaptiveBatches();
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetNumaBackgroundWorkers();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetNumaBackgroundWorkers(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPiggybackBackgroundActions();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPiggybackBackgroundActions(
+    bool v);
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPerCpuCachesAdaptiveBatches(
+    bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPerCpuCachesShareSmtCapacity();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPerCpuCachesShareSmtCapacity(
+    bool v);
 ABSL_ATTRIBUTE_WEAK double
 TCMalloc_Internal_GetPerCpuCachesDynamicSlabShrinkThreshold();
 ABSL_ATTRIBUTE_WEAK void
 TCMalloc_Internal_SetPerCpuCachesDynamicSlabShrinkThreshold(double v);
 ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetMadviseFree();
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMadviseFree(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetAdaptiveMadviseFree();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetAdaptiveMadviseFree(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetAsyncRelease();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetAsyncRelease(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetCgroupPressureRelease();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetCgroupPressureRelease(bool v);
+ABSL_ATTRIBUTE_WEAK double TCMalloc_Internal_GetCgroupSoftLimitFraction();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetCgroupSoftLimitFraction(double v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetSelfTuning();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetSelfTuning(bool v);
+ABSL_ATTRIBUTE_WEAK double TCMalloc_Internal_GetSelfTuningMemoryWeight();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetSelfTuningMemoryWeight(double v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetMadviseCold();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMadviseCold(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetSpanCacheColoring();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetSpanCacheColoring(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetL3SpanCache();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetL3SpanCache(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetFillerL3Partitions();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetFillerL3Partitions(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetLifetimeAwareSpanPlacement();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetLifetimeAwareSpanPlacement(
+    bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetReleaseFreeMetadata();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetReleaseFreeMetadata(bool v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetLargeSpanCacheBytes();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetLargeSpanCacheBytes(int64_t v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetCentralFreeListEmptySpanCache();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetCentralFreeListEmptySpanCache(
+    bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetCentralFreeListRemoteFrees();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetCentralFreeListRemoteFrees(
+    bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetCentralFreeListPrepopulate();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetCentralFreeListPrepopulate(
+    bool v);
+ABSL_ATTRIBUTE_WEAK bool
+TCMalloc_Internal_GetCentralFreeListDynamicSpanPages();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetCentralFreeListDynamicSpanPages(
+    bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetAutoShardedTransferCache();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetAutoShardedTransferCache(bool v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetCollapseHugePages();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetCollapseHugePages(int64_t v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetScanHugePageBacking();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetScanHugePageBacking(int64_t v);
+ABSL_ATTRIBUTE_WEAK double
+TCMalloc_Internal_GetFillerFragmentationRegionThreshold();
+ABSL_ATTRIBUTE_WEAK void
+TCMalloc_Internal_SetFillerFragmentationRegionThreshold(double v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetSkipSubreleasePredictor();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetSkipSubreleasePredictor(
+    int64_t v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetScanFreePageIdleness();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetScanFreePageIdleness(int64_t v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetReleaseResidentUnbacked();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetReleaseResidentUnbacked(
+    int64_t v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetFramePointerUnwinding();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetFramePointerUnwinding(bool v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetAllocLatencySamplingInterval();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetAllocLatencySamplingInterval(
+    int64_t v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetGuardedPoolBytes();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetGuardedPoolBytes(int64_t v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetMteGuardedSampling();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMteGuardedSampling(bool v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetStatsSnapshotMaxAgeMs();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetStatsSnapshotMaxAgeMs(int64_t v);
 }
 
 #endif  // TCMALLOC_INTERNAL_PARAMETER_ACCESSORS_H_
@@ -16,6 +16,7 @@
 #include <fcntl.h>
 #include <sched.h>
 #include <stdint.h>
+#include <sys/auxv.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -25,12 +26,16 @@
 #include <atomic>
 #include <cerrno>
 #include <cstddef>
+#include <cstring>
 #include <limits>
 
 #include "absl/base/attributes.h"
 #include "absl/base/call_once.h"  // IWYU pragma: keep
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
 #include "absl/base/optimization.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/linux_syscall_support.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
@@ -52,6 +57,8 @@ namespace percpu {
 enum PerCpuInitStatus {
   kFastMode,
   kSlowMode,
+  // Per-CPU operations are serialized by cpu_locks rather than rseq.
+  kLockedMode,
 };
 
 ABSL_CONST_INIT static PerCpuInitStatus init_status = kSlowMode;
@@ -87,8 +94,85 @@ static bool InitThreadPerCpu() {
   return false;
 }
 
-bool UsingFlatVirtualCpus() {
+ABSL_CONST_INIT static RseqVcpuMode rseq_vcpu_mode = RseqVcpuMode::kNone;
+
+RseqVcpuMode GetRseqVcpuMode() { return rseq_vcpu_mode; }
+
+bool UsingFlatVirtualCpus() { return rseq_vcpu_mode == RseqVcpuMode::kMmCid; }
+
+// Returns whether the kernel fills in __rseq_abi.mm_cid.
+static bool KernelProvidesMmCid() {
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
+  // Kernels that support extended rseq fields report how much of struct rseq
+  // they update via AT_RSEQ_FEATURE_SIZE; older kernels report nothing.
+  constexpr unsigned long kAT_RSEQ_FEATURE_SIZE = 27;
+  return getauxval(kAT_RSEQ_FEATURE_SIZE) >=
+         offsetof(kernel_rseq, mm_cid) + sizeof(__rseq_abi.mm_cid);
+#else
+  return false;
+#endif  // TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
+}
+
+static bool WantMmCid() {
+  const char* e = thread_safe_getenv("TCMALLOC_PERCPU_USE_MM_CID");
+  return e != nullptr && e[0] == '1';
+}
+
+// Locks of the lock-based fallback (see UsingLockedPerCpu), one per cache line
+// so that the CPUs do not contend for them.
+struct ABSL_CACHELINE_ALIGNED CpuLock {
+  absl::base_internal::SpinLock lock{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+};
+static constexpr int kMaxLockedCpus = CPU_SETSIZE;
+ABSL_CONST_INIT static CpuLock cpu_locks[kMaxLockedCpus];
+
+void LockCpu(int cpu) {
+  ASSERT(cpu >= 0 && cpu < kMaxLockedCpus);
+  cpu_locks[cpu].lock.Lock();
+}
+
+void UnlockCpu(int cpu) {
+  ASSERT(cpu >= 0 && cpu < kMaxLockedCpus);
+  cpu_locks[cpu].lock.Unlock();
+}
+
+void AcquireCpuLocks() {
+  for (CpuLock& cpu_lock : cpu_locks) cpu_lock.lock.Lock();
+}
+
+void ReleaseCpuLocks() {
+  for (CpuLock& cpu_lock : cpu_locks) cpu_lock.lock.Unlock();
+}
+
+int LockedCompareAndSwap(int target_cpu, std::atomic<intptr_t>* p,
+                         intptr_t old_val, intptr_t new_val) {
+  ScopedCpuLock lock(target_cpu);
+  // Mutations that do not take the lock, such as the header locking of
+  // TcmallocSlab, may race with us, so compare and swap atomically.
+  return p->compare_exchange_strong(old_val, new_val,
+                                    std::memory_order_relaxed)
+             ? target_cpu
+             : -1;
+}
+
+enum class LockedFallback { kNever, kWithoutRseq, kAlways };
+
+static LockedFallback WantLockedFallback() {
+  const char* e = thread_safe_getenv("TCMALLOC_PERCPU_LOCKED_FALLBACK");
+  if (e == nullptr) return LockedFallback::kNever;
+  if (strcmp(e, "force") == 0) return LockedFallback::kAlways;
+  return e[0] == '1' ? LockedFallback::kWithoutRseq : LockedFallback::kNever;
+}
+
+// The fallback finds the current CPU with sched_getcpu() and keeps the cached
+// slabs address of rseq builds permanently unset, so it needs both.
+static bool LockedFallbackAvailable() {
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(TCMALLOC_HAVE_SCHED_GETCPU)
+  return NumCPUs() <= kMaxLockedCpus;
+#else
   return false;
+#endif
 }
 
 static void InitPerCpu() {
@@ -96,9 +180,16 @@ static void InitPerCpu() {
 
   // Based on the results of successfully initializing the first thread, mark
   // init_status to initialize all subsequent threads.
-  if (InitThreadPerCpu()) {
+  const LockedFallback fallback = WantLockedFallback();
+  if (fallback != LockedFallback::kAlways && InitThreadPerCpu()) {
     init_status = kFastMode;
 
+    // Concurrency IDs are only meaningful once the thread is registered, and
+    // must be chosen before any slab records which ID it is indexed by.
+    if (WantMmCid() && KernelProvidesMmCid()) {
+      rseq_vcpu_mode = RseqVcpuMode::kMmCid;
+    }
+
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
     // See the comment about data layout in percpu.h for details.
     auto sampler_addr = reinterpret_cast<uintptr_t>(&tcmalloc_sampler);
@@ -127,6 +218,8 @@ static void InitPerCpu() {
                      kMEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0),
         std::memory_order_relaxed);
 #endif  // TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
+  } else if (fallback != LockedFallback::kNever && LockedFallbackAvailable()) {
+    init_status = kLockedMode;
   }
 }
 
@@ -173,9 +266,14 @@ bool InitFastPerCpu() {
   if (init_status == kSlowMode) {
     __rseq_abi.cpu_id = kCpuIdUnsupported;
   }
+  // Threads of the lock-based fallback are never registered with the kernel,
+  // which therefore leaves this value alone.
+  if (init_status == kLockedMode) {
+    __rseq_abi.cpu_id = kCpuIdLocked;
+  }
 #endif
 
-  return init_status == kFastMode;
+  return init_status != kSlowMode;
 }
 
 // ----------------------------------------------------------------------------
@@ -324,6 +422,13 @@ void FenceCpu(int cpu, const size_t virtual_cpu_id_offset) {
   // code that comes before FenceCpu in C++ program order.
   CompilerBarrier();
 
+  // With the lock-based fallback, threads on any CPU may be operating on
+  // <cpu>'s data; once we have held its lock, they have all finished.
+  if (ABSL_PREDICT_FALSE(init_status == kLockedMode)) {
+    ScopedCpuLock lock(cpu);
+    return;
+  }
+
   // A useful fast path: nothing needs doing at all to order us with respect
   // to our own CPU.
   if (ABSL_PREDICT_TRUE(IsFastNoInit()) &&
@@ -331,9 +436,7 @@ void FenceCpu(int cpu, const size_t virtual_cpu_id_offset) {
     return;
   }
 
-  if (virtual_cpu_id_offset == offsetof(kernel_rseq, vcpu_id)) {
-    ASSUME(false);
-
+  if (virtual_cpu_id_offset != offsetof(kernel_rseq, cpu_id)) {
     // With virtual CPUs, we cannot identify the true physical core we need to
     // interrupt.
     FenceAllCpus();
@@ -351,6 +454,12 @@ void FenceCpu(int cpu, const size_t virtual_cpu_id_offset) {
 }
 
 void FenceAllCpus() {
+  if (ABSL_PREDICT_FALSE(init_status == kLockedMode)) {
+    for (int cpu = 0, n = NumCPUs(); cpu < n; ++cpu) {
+      ScopedCpuLock lock(cpu);
+    }
+    return;
+  }
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
   if (using_upstream_fence.load(std::memory_order_relaxed)) {
     UpstreamRseqFenceCpu(-1);
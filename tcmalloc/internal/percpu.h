@@ -33,7 +33,9 @@
 
 // TCMALLOC_PERCPU_RSEQ_SUPPORTED_PLATFORM defines whether or not we have an
 // implementation for the target OS and architecture.
-#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#if defined(__linux__) &&                          \
+    (defined(__x86_64__) || defined(__aarch64__) || \
+     (defined(__riscv) && __riscv_xlen == 64))
 #define TCMALLOC_PERCPU_RSEQ_SUPPORTED_PLATFORM 1
 #else
 #define TCMALLOC_PERCPU_RSEQ_SUPPORTED_PLATFORM 0
@@ -45,6 +47,9 @@
 #define TCMALLOC_PERCPU_RSEQ_SIGNATURE 0x53053053
 #elif defined(__aarch64__)
 #define TCMALLOC_PERCPU_RSEQ_SIGNATURE 0xd428bc00
+#elif defined(__riscv)
+// "csrw mhartid, x0", which traps in user mode; matches the kernel selftests.
+#define TCMALLOC_PERCPU_RSEQ_SIGNATURE 0xf1401073
 #else
 // Rather than error, allow us to build, but with an invalid signature.
 #define TCMALLOC_PERCPU_RSEQ_SIGNATURE 0x0
@@ -71,7 +76,7 @@
 
 // TCMALLOC_INTERNAL_PERCPU_USE_RSEQ defines whether TCMalloc support for RSEQ
 // on the target architecture exists. We currently only provide RSEQ for 64-bit
-// x86, Arm binaries.
+// x86, Arm and RISC-V binaries.
 #if !defined(TCMALLOC_INTERNAL_PERCPU_USE_RSEQ)
 #if TCMALLOC_PERCPU_RSEQ_SUPPORTED_PLATFORM == 1
 #define TCMALLOC_INTERNAL_PERCPU_USE_RSEQ 1
@@ -89,6 +94,7 @@ namespace percpu {
 inline constexpr int kRseqUnregister = 1;
 
 // Internal state used for tracking initialization of RseqCpuId()
+inline constexpr int kCpuIdLocked = -3;
 inline constexpr int kCpuIdUnsupported = -2;
 inline constexpr int kCpuIdUninitialized = -1;
 inline constexpr int kCpuIdInitialized = 0;
@@ -103,6 +109,9 @@ inline constexpr int kCpuIdInitialized = 0;
 //     { kCpuIdUnsupported, kCpuIdUninitialized }
 //   Initialized, available:
 //     [0, NumCpus())    (Always updated at context-switch)
+//   Initialized, available through the lock-based fallback (see
+//   UsingLockedPerCpu):
+//     kCpuIdLocked
 //
 // CPU slabs region address caching.
 // Calculation of the address of the current CPU slabs region is needed for
@@ -142,7 +151,8 @@ inline constexpr int kCpuIdInitialized = 0;
 // at __rseq_abi-4 gives __rseq_abi[-4...3]. So the tag bit (1<<63) is
 // therefore from __rseq_abi[3]. That's also the most significant byte of
 // __rseq_abi.cpu_id_start, hence real CPU numbers can't have this bit set
-// (assuming <2^31 CPUs).
+// (assuming <2^31 CPUs). RISC-V may trap on the misaligned 8-byte load, so
+// there the fast paths load the two 4-byte halves separately instead.
 //
 // The slow path does full slabs address calculation and caches it.
 //
@@ -159,9 +169,17 @@ inline constexpr int kCpuIdInitialized = 0;
 // in the same cache line.
 // InitPerCpu contains checks that the resulting data layout is as expected.
 
+#if defined(__riscv)
+// tcmalloc_slabs is only 4-byte aligned. Say so, so that the compiler splits
+// accesses rather than relying on misaligned access emulation.
+typedef uintptr_t TcmallocSlabsWord __attribute__((aligned(4)));
+#else
+typedef uintptr_t TcmallocSlabsWord;
+#endif
+
 // Top 4 bytes of this variable overlap with __rseq_abi.cpu_id_start.
-extern "C" ABSL_CONST_INIT thread_local volatile uintptr_t tcmalloc_slabs
-    ABSL_ATTRIBUTE_INITIAL_EXEC;
+extern "C" ABSL_CONST_INIT thread_local volatile TcmallocSlabsWord
+    tcmalloc_slabs ABSL_ATTRIBUTE_INITIAL_EXEC;
 extern "C" ABSL_CONST_INIT thread_local volatile kernel_rseq __rseq_abi
     ABSL_ATTRIBUTE_INITIAL_EXEC;
 
@@ -171,19 +189,24 @@ extern "C" ABSL_CONST_INIT thread_local volatile kernel_rseq __rseq_abi
 // that the definition may come from a dynamic library and has to use
 // GOT access. When compiler sees even a weak definition, it knows the
 // declaration will be in the current module and can generate direct accesses.
-ABSL_CONST_INIT thread_local volatile uintptr_t tcmalloc_slabs
+ABSL_CONST_INIT thread_local volatile TcmallocSlabsWord tcmalloc_slabs
     ABSL_ATTRIBUTE_WEAK = {};
 ABSL_CONST_INIT thread_local volatile kernel_rseq __rseq_abi
     ABSL_ATTRIBUTE_WEAK = {
-        0,      static_cast<unsigned>(kCpuIdUninitialized),   0, 0,
-        {0, 0}, {{kCpuIdUninitialized, kCpuIdUninitialized}},
+        0,
+        static_cast<unsigned>(kCpuIdUninitialized),
+        0,
+        0,
+        0,
+        static_cast<unsigned>(kCpuIdUninitialized),
+        {{kCpuIdUninitialized, kCpuIdUninitialized}},
 };
 
 static inline int RseqCpuId() { return __rseq_abi.cpu_id; }
 
 static inline int VirtualRseqCpuId(const size_t virtual_cpu_id_offset) {
   ASSERT(virtual_cpu_id_offset == offsetof(kernel_rseq, cpu_id) ||
-         virtual_cpu_id_offset == offsetof(kernel_rseq, vcpu_id));
+         virtual_cpu_id_offset == offsetof(kernel_rseq, mm_cid));
   return *reinterpret_cast<short*>(reinterpret_cast<uintptr_t>(&__rseq_abi) +
                                    virtual_cpu_id_offset);
 }
@@ -215,8 +238,19 @@ size_t TcmallocSlab_Internal_PopBatch(size_t size_class, void** batch,
 // Return whether we are using flat virtual CPUs.
 bool UsingFlatVirtualCpus();
 
-enum class RseqVcpuMode { kNone };
-inline RseqVcpuMode GetRseqVcpuMode() { return RseqVcpuMode::kNone; }
+// kNone indexes per-CPU data by the physical CPU ID.  kMmCid indexes it by the
+// kernel's per-process concurrency ID (__rseq_abi.mm_cid), so only as many
+// caches are populated as the process has threads running at once.  kMmCid is
+// opt-in (TCMALLOC_PERCPU_USE_MM_CID=1) and needs a kernel that provides
+// mm_cid; it is decided when per-CPU mode is first initialized.
+enum class RseqVcpuMode { kNone, kMmCid };
+RseqVcpuMode GetRseqVcpuMode();
+
+// Returns the offset in __rseq_abi of the CPU ID per-CPU data is indexed by.
+inline size_t VirtualCpuIdOffset() {
+  return UsingFlatVirtualCpus() ? offsetof(kernel_rseq, mm_cid)
+                                : offsetof(kernel_rseq, cpu_id);
+}
 
 inline int GetCurrentCpuUnsafe() {
   // Use the rseq mechanism.
@@ -268,7 +302,7 @@ inline int GetCurrentVirtualCpu(const size_t virtual_cpu_id_offset) {
   }
 
   // Do not return a physical CPU ID when we expect a virtual CPU ID.
-  CHECK_CONDITION(virtual_cpu_id_offset != offsetof(kernel_rseq, vcpu_id));
+  CHECK_CONDITION(virtual_cpu_id_offset == offsetof(kernel_rseq, cpu_id));
 
 #ifdef TCMALLOC_HAVE_SCHED_GETCPU
   cpu = sched_getcpu();
@@ -279,9 +313,7 @@ inline int GetCurrentVirtualCpu(const size_t virtual_cpu_id_offset) {
 }
 
 inline int VirtualRseqCpuId() {
-  const size_t offset = UsingFlatVirtualCpus() ? offsetof(kernel_rseq, cpu_id)
-                                               : offsetof(kernel_rseq, vcpu_id);
-  return VirtualRseqCpuId(offset);
+  return VirtualRseqCpuId(VirtualCpuIdOffset());
 }
 
 bool InitFastPerCpu();
@@ -297,6 +329,8 @@ inline bool IsFast() {
     return true;
   } else if (ABSL_PREDICT_FALSE(cpu == kCpuIdUnsupported)) {
     return false;
+  } else if (cpu == kCpuIdLocked) {
+    return true;
   } else {
     // Sets 'cpu' for next time, and calls EnsureSlowModeInitialized if
     // necessary.
@@ -311,9 +345,50 @@ inline bool IsFastNoInit() {
     return false;
   }
   int cpu = RseqCpuId();
-  return ABSL_PREDICT_TRUE(cpu >= kCpuIdInitialized);
+  return ABSL_PREDICT_TRUE(cpu >= kCpuIdInitialized) || cpu == kCpuIdLocked;
+}
+
+// Whether this thread performs per-CPU operations under per-CPU locks rather
+// than with restartable sequences.  When TCMALLOC_PERCPU_LOCKED_FALLBACK=1 and
+// the kernel does not support rseq, IsFast() puts every thread in this mode:
+// the per-CPU slabs keep their layout, but a thread locates its CPU with
+// sched_getcpu() and holds that CPU's lock (see ScopedCpuLock) while it
+// touches the CPU's data.  Being migrated while holding the lock is harmless,
+// since the lock rather than the CPU we run on is what serializes access.
+// TCMALLOC_PERCPU_LOCKED_FALLBACK=force selects the mode even when rseq is
+// available, which lets it be tested anywhere.
+inline bool UsingLockedPerCpu() {
+  return TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && RseqCpuId() == kCpuIdLocked;
 }
 
+// Acquires and releases the per-CPU lock of <cpu> for the lock-based fallback.
+void LockCpu(int cpu);
+void UnlockCpu(int cpu);
+
+// Acquires and releases the locks of every CPU around fork(), so that the
+// child does not inherit one held by a thread that no longer exists.  They are
+// leaves, so they may be taken after any other lock.
+void AcquireCpuLocks();
+void ReleaseCpuLocks();
+
+class ScopedCpuLock {
+ public:
+  explicit ScopedCpuLock(int cpu) : cpu_(cpu) { LockCpu(cpu_); }
+  ~ScopedCpuLock() { UnlockCpu(cpu_); }
+
+  ScopedCpuLock(const ScopedCpuLock&) = delete;
+  ScopedCpuLock& operator=(const ScopedCpuLock&) = delete;
+
+ private:
+  const int cpu_;
+};
+
+// CompareAndSwapUnsafe for the lock-based fallback: compares and swaps *p under
+// <target_cpu>'s lock, regardless of which CPU we are running on.  Returns
+// <target_cpu> on success and -1 if *p != old_val.
+int LockedCompareAndSwap(int target_cpu, std::atomic<intptr_t>* p,
+                         intptr_t old_val, intptr_t new_val);
+
 // A barrier that prevents compiler reordering.
 inline void CompilerBarrier() {
 #if defined(__GNUC__)
@@ -374,6 +449,9 @@ inline void TSANMemoryBarrierOn(void* p) {
 inline int CompareAndSwapUnsafe(int target_cpu, std::atomic<intptr_t>* p,
                                 intptr_t old_val, intptr_t new_val,
                                 const size_t virtual_cpu_id_offset) {
+  if (ABSL_PREDICT_FALSE(UsingLockedPerCpu())) {
+    return LockedCompareAndSwap(target_cpu, p, old_val, new_val);
+  }
   TSANMemoryBarrierOn(p);
   return TcmallocSlab_Internal_PerCpuCmpxchg64(
       target_cpu, tcmalloc_internal::atomic_danger::CastToIntegral(p), old_val,
@@ -36,6 +36,7 @@
 #include "absl/base/internal/sysinfo.h"
 #include "absl/base/optimization.h"
 #include "absl/functional/function_ref.h"
+#include "absl/types/span.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/mincore.h"
 #include "tcmalloc/internal/optimization.h"
@@ -163,12 +164,43 @@ class TcmallocSlab {
   //
   // Caller must ensure that there are no concurrent calls to InitCpu,
   // ShrinkOtherCache, or Drain.
+  //
+  // Equivalent to BeginResizeSlabs, ResizeCpuSlabs for every cpu and
+  // FinishResizeSlabs.
   ABSL_MUST_USE_RESULT ResizeSlabsInfo ResizeSlabs(
       Shift new_shift, Slabs* new_slabs,
       absl::FunctionRef<void*(size_t, std::align_val_t)> alloc,
       absl::FunctionRef<size_t(size_t)> capacity,
       absl::FunctionRef<bool(size_t)> populated, DrainHandler drain_handler);
 
+  // Incremental version of ResizeSlabs.  CPUs move from the old slabs to
+  // <new_slabs> one at a time, so that only the cpu being moved misses in its
+  // cache, while the others keep using whichever slabs they are in.
+  //
+  // BeginResizeSlabs records <new_slabs>.  <alloc> is used, once, to allocate
+  // the per-cpu resize state.
+  void BeginResizeSlabs(
+      Shift new_shift, Slabs* new_slabs,
+      absl::FunctionRef<void*(size_t, std::align_val_t)> alloc);
+  // Moves <cpu> to the new slabs: if <populated>, initializes its region there
+  // and drains its old region to <drain_handler>.  Caller must ensure that
+  // there are no concurrent calls to InitCpu, ShrinkOtherCache, or Drain for
+  // <cpu>.
+  void ResizeCpuSlabs(int cpu, absl::FunctionRef<size_t(size_t)> capacity,
+                      bool populated, DrainHandler drain_handler);
+  // Switches to the new slabs once every cpu has been moved.  Returns the old
+  // slabs to be madvised away.
+  ABSL_MUST_USE_RESULT ResizeSlabsInfo FinishResizeSlabs();
+
+  // Lays out the slot arrays of the cpus initialized or resized from now on in
+  // <order>, a permutation of the size classes, rather than in size class
+  // order.  Headers stay where they are, since Push and Pop index them by size
+  // class; putting the arrays of the busiest size classes first packs the
+  // slots that they touch next to the headers.  May be called concurrently
+  // with InitCpu and ResizeCpuSlabs, which fall back to size class order if
+  // they see a partial update.
+  void SetLayoutOrder(absl::Span<const uint16_t> order);
+
   // For tests. Returns the freed slabs pointer.
   void* Destroy(absl::FunctionRef<void(void*, size_t, std::align_val_t)> free);
 
@@ -260,7 +292,11 @@ class TcmallocSlab {
   PerCPUMetadataState MetadataMemoryUsage() const;
 
   inline int GetCurrentVirtualCpuUnsafe() {
-    return VirtualRseqCpuId(virtual_cpu_id_offset_);
+    const int cpu = VirtualRseqCpuId(virtual_cpu_id_offset_);
+    if (ABSL_PREDICT_FALSE(cpu == kCpuIdLocked)) {
+      return GetCurrentVirtualCpu(virtual_cpu_id_offset_);
+    }
+    return cpu;
   }
 
   // Gets the current shift of the slabs. Intended for use by the thread that
@@ -269,6 +305,21 @@ class TcmallocSlab {
     return ToUint8(GetSlabsAndShift(std::memory_order_relaxed).second);
   }
 
+  // Gets the shift of the slabs <cpu>'s region is in, which differs from
+  // GetShift() while <cpu> has been moved by an incremental resize.
+  uint8_t GetShift(int cpu) const {
+    return ToUint8(GetCpuSlabsAndShift(cpu).second);
+  }
+
+  // Gets the current slabs and shift, or null slabs while an incremental
+  // resize is in progress, when the CPUs' regions are split between two slabs.
+  ABSL_MUST_USE_RESULT std::pair<Slabs*, Shift> GetSlabsUnlessResizing() const {
+    if (resizing_.load(std::memory_order_acquire)) {
+      return {nullptr, Shift{}};
+    }
+    return GetSlabsAndShift(std::memory_order_relaxed);
+  }
+
  private:
   // In order to support dynamic slab metadata sizes, we need to be able to
   // atomically update both the slabs pointer and the shift value so we store
@@ -355,6 +406,18 @@ class TcmallocSlab {
     return slabs_and_shift_.load(order).Get();
   }
 
+  // Returns the slabs and shift that <cpu>'s region is in: the new slabs if an
+  // incremental resize has moved <cpu> already, the current ones otherwise.
+  ABSL_MUST_USE_RESULT std::pair<Slabs*, Shift> GetCpuSlabsAndShift(
+      int cpu) const {
+    if (ABSL_PREDICT_FALSE(resizing_.load(std::memory_order_acquire)) &&
+        resize_cpu_state_[cpu].load(std::memory_order_acquire) ==
+            kCpuResizeMoved) {
+      return resize_slabs_and_shift_.load(std::memory_order_relaxed).Get();
+    }
+    return GetSlabsAndShift(std::memory_order_relaxed);
+  }
+
   static Slabs* CpuMemoryStart(Slabs* slabs, Shift shift, int cpu);
   static std::atomic<int64_t>* GetHeader(Slabs* slabs, Shift shift, int cpu,
                                          size_t size_class);
@@ -373,30 +436,53 @@ class TcmallocSlab {
   static void StopConcurrentMutations(Slabs* slabs, Shift shift, int cpu,
                                       size_t virtual_cpu_id_offset);
 
-  // Implementation of InitCpu() allowing for reuse in ResizeSlabs().
+  // Implementation of InitCpu() allowing for reuse in ResizeSlabs().  Slot
+  // arrays are laid out in <order>.
   static void InitCpuImpl(Slabs* slabs, Shift shift, int cpu,
                           size_t virtual_cpu_id_offset,
-                          absl::FunctionRef<size_t(size_t)> capacity);
+                          absl::FunctionRef<size_t(size_t)> capacity,
+                          const uint16_t* order);
+
+  // Copies the order set by SetLayoutOrder to <order>, or size class order if
+  // there is none or it is being updated.
+  void LoadLayoutOrder(uint16_t* order) const;
 
   std::pair<int, bool> CacheCpuSlabSlow(int cpu);
 
+  // Versions of PushBatch/PopBatch for threads that UsingLockedPerCpu(): they
+  // operate on the current CPU's region while holding the CPU's lock, and
+  // back the fast paths once their restartable sequences have failed.
+  size_t LockedPushBatch(size_t size_class, void** batch, size_t len);
+  size_t LockedPopBatch(size_t size_class, void** batch, size_t len);
+  // Returns the header of <size_class> in <cpu>'s current region, or nullptr
+  // if an incremental resize is moving the region.
+  // REQUIRES: <cpu>'s lock is held.
+  std::atomic<int64_t>* LockedHeader(int cpu, size_t size_class) const;
+
   // We store both a pointer to the array of slabs and the shift value together
   // so that we can atomically update both with a single store.
   std::atomic<SlabsAndShift> slabs_and_shift_{};
   // This is in units of bytes.
   size_t virtual_cpu_id_offset_ = offsetof(kernel_rseq, cpu_id);
-  // In ResizeSlabs, we need to allocate space to store begin offsets on the
-  // arena. We reuse this space here.
-  uint16_t (*resize_begins_)[NumClasses] = nullptr;
-  // ResizeSlabs is running so any Push/Pop should go to fallback
-  // overflow/underflow handler.
+  // While resizing_, the slabs and shift the CPUs are being moved to.
+  std::atomic<SlabsAndShift> resize_slabs_and_shift_{};
+  // While resizing_, where each cpu's region is: still in the old slabs, being
+  // moved (so any Push/Pop should go to fallback overflow/underflow handler),
+  // or already in the new slabs.  Allocated on the arena by the first resize
+  // and reused afterwards.
+  enum : uint8_t { kCpuResizeOld, kCpuResizeMoving, kCpuResizeMoved };
+  std::atomic<uint8_t>* resize_cpu_state_ = nullptr;
+  // A resize is in progress.
   std::atomic<bool> resizing_{false};
+  // See SetLayoutOrder.  Unless has_layout_order_, size class order.
+  std::atomic<bool> has_layout_order_{false};
+  std::atomic<uint16_t> layout_order_[NumClasses] = {};
 };
 
 template <size_t NumClasses>
 inline size_t TcmallocSlab<NumClasses>::Length(int cpu,
                                                size_t size_class) const {
-  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
   Header hdr = LoadHeader(GetHeader(slabs, shift, cpu, size_class));
   return hdr.IsLocked() ? 0 : hdr.current - hdr.begin;
 }
@@ -404,7 +490,7 @@ inline size_t TcmallocSlab<NumClasses>::Length(int cpu,
 template <size_t NumClasses>
 inline size_t TcmallocSlab<NumClasses>::Capacity(int cpu,
                                                  size_t size_class) const {
-  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
   Header hdr = LoadHeader(GetHeader(slabs, shift, cpu, size_class));
   return hdr.IsLocked() ? 0 : hdr.end - hdr.begin;
 }
@@ -413,7 +499,7 @@ template <size_t NumClasses>
 inline size_t TcmallocSlab<NumClasses>::Grow(
     int cpu, size_t size_class, size_t len,
     absl::FunctionRef<size_t(uint8_t)> max_capacity) {
-  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
   const size_t max_cap = max_capacity(ToUint8(shift));
   const size_t virtual_cpu_id_offset = virtual_cpu_id_offset_;
   std::atomic<int64_t>* hdrp = GetHeader(slabs, shift, cpu, size_class);
@@ -439,7 +525,7 @@ inline size_t TcmallocSlab<NumClasses>::Grow(
 template <size_t NumClasses>
 inline size_t TcmallocSlab<NumClasses>::Shrink(int cpu, size_t size_class,
                                                size_t len) {
-  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
   const size_t virtual_cpu_id_offset = virtual_cpu_id_offset_;
   std::atomic<int64_t>* hdrp = GetHeader(slabs, shift, cpu, size_class);
   for (;;) {
@@ -463,7 +549,7 @@ inline size_t TcmallocSlab<NumClasses>::Shrink(int cpu, size_t size_class,
 
 #if defined(__x86_64__)
 #define TCMALLOC_RSEQ_RELOC_TYPE "R_X86_64_NONE"
-#define TCMALLOC_RSEQ_JUMP "jmp"
+#define TCMALLOC_RSEQ_JUMP "jmp 3f\n"
 #if !defined(__PIC__) && !defined(__PIE__)
 #define TCMALLOC_RSEQ_SET_CS(name) \
   "movq $__rseq_cs_" #name "_%=, %[rseq_cs_addr]\n"
@@ -476,13 +562,25 @@ inline size_t TcmallocSlab<NumClasses>::Shrink(int cpu, size_t size_class,
 
 #elif defined(__aarch64__)
 #define TCMALLOC_RSEQ_RELOC_TYPE "R_AARCH64_NONE"
-#define TCMALLOC_RSEQ_JUMP "b"
+#define TCMALLOC_RSEQ_JUMP "b 3f\n"
 #define TCMALLOC_RSEQ_SET_CS(name)                     \
   "adrp %[scratch], __rseq_cs_" #name                  \
   "_%=\n"                                              \
   "add %[scratch], %[scratch], :lo12:__rseq_cs_" #name \
   "_%=\n"                                              \
   "str %[scratch], %[rseq_cs_addr]\n"
+
+#elif defined(__riscv)
+#define TCMALLOC_RSEQ_RELOC_TYPE "R_RISCV_NONE"
+// This is "tail 3f", which not all assemblers accept with a local label. It
+// clobbers t1, so RISC-V critical sections must list t1 as clobbered.
+#define TCMALLOC_RSEQ_JUMP     \
+  "auipc t1, %%pcrel_hi(3f)\n" \
+  "jr %%pcrel_lo(2b)(t1)\n"
+#define TCMALLOC_RSEQ_SET_CS(name)   \
+  "lla %[scratch], __rseq_cs_" #name \
+  "_%=\n"                            \
+  "sd %[scratch], %[rseq_cs_addr]\n"
 #endif
 
 #if !defined(__clang_major__) || __clang_major__ >= 9
@@ -537,7 +635,6 @@ inline size_t TcmallocSlab<NumClasses>::Shrink(int cpu, size_t size_class,
   "" #name                                                                    \
   "_trampoline_%=:\n"                                                         \
   "2:\n" TCMALLOC_RSEQ_JUMP                                                   \
-  " 3f\n"                                                                     \
   ".size " #name "_trampoline_%=, . - " #name                                 \
   "_trampoline_%=\n"                                                          \
   ".popsection\n"                   /* Prepare */                             \
@@ -693,6 +790,87 @@ overflow_label:
 }
 #endif  // defined (__aarch64__)
 
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(__riscv)
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE bool TcmallocSlab_Internal_Push(
+    size_t size_class, void* item) {
+  uintptr_t region_start, scratch, hdr, end;
+  // Multiply size_class by the bytesize of each header
+  size_t size_class_lsl3 = size_class * 8;
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+  asm goto(
+#else
+  // RISC-V has no flags to return, so we return overflow in a register.
+  uintptr_t overflow;
+  asm volatile(
+#endif
+      TCMALLOC_RSEQ_PROLOGUE(TcmallocSlab_Internal_Push)
+#if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      "li %[overflow], 1\n"
+#endif
+      // tcmalloc_slabs is misaligned, so we load it in two halves.
+      // scratch = __rseq_abi.cpu_id_start (top half of tcmalloc_slabs);
+      // if ((scratch & (TCMALLOC_CACHED_SLABS_MASK >> 32)) == 0) {
+      //   goto overflow_label;
+      // }
+      "lw %[scratch], %[rseq_cpu_id_start]\n"
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      "bgez %[scratch], %l[overflow_label]\n"
+#else
+      "bgez %[scratch], 5f\n"
+#endif
+      // region_start = tcmalloc_slabs & ~TCMALLOC_CACHED_SLABS_MASK;
+      "lwu %[region_start], %[rseq_slabs_addr]\n"
+      "slli %[scratch], %[scratch], 33\n"
+      "srli %[scratch], %[scratch], 1\n"
+      "or %[region_start], %[region_start], %[scratch]\n"
+      // hdr = &slab_headers[size_class]
+      "add %[hdr], %[region_start], %[size_class_lsl3]\n"
+      // scratch = hdr->current (current index)
+      "lhu %[scratch], 0(%[hdr])\n"
+      // end = hdr->end (end index)
+      "lhu %[end], 6(%[hdr])\n"
+  // if (ABSL_PREDICT_FALSE(end <= scratch)) { goto overflow_label; }
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      "bgeu %[scratch], %[end], %l[overflow_label]\n"
+#else
+      "bgeu %[scratch], %[end], 5f\n"
+#endif
+      // Temporarily use end as the address of the slot to push to.
+      "slli %[end], %[scratch], 3\n"
+      "add %[end], %[region_start], %[end]\n"
+      "sd %[item], 0(%[end])\n"
+      "addi %[scratch], %[scratch], 1\n"
+#if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      "li %[overflow], 0\n"
+#endif
+      "sh %[scratch], 0(%[hdr])\n"
+      // Commit
+      "5:\n"
+      : [hdr] "=&r"(hdr), [scratch] "=&r"(scratch), [end] "=&r"(end),
+#if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+        [overflow] "=&r"(overflow),
+#endif
+        [region_start] "=&r"(region_start)
+      : TCMALLOC_RSEQ_INPUTS,
+        [rseq_cpu_id_start] "m"(__rseq_abi.cpu_id_start),
+        [size_class_lsl3] "r"(size_class_lsl3), [item] "r"(item)
+      // t1 is clobbered by the "tail" in the abort trampoline.
+      : "t1", "memory"
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      : overflow_label
+#endif
+  );
+#if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+  if (ABSL_PREDICT_FALSE(overflow)) {
+    goto overflow_label;
+  }
+#endif
+  return true;
+overflow_label:
+  return false;
+}
+#endif  // defined(__riscv)
+
 template <size_t NumClasses>
 inline ABSL_ATTRIBUTE_ALWAYS_INLINE bool TcmallocSlab<NumClasses>::Push(
     size_t size_class, void* item) {
@@ -703,10 +881,16 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE bool TcmallocSlab<NumClasses>::Push(
   // annotation.
   TSANRelease(item);
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
-  return TcmallocSlab_Internal_Push(size_class, item);
-#else
-  return false;
+  if (ABSL_PREDICT_TRUE(TcmallocSlab_Internal_Push(size_class, item))) {
+    return true;
+  }
+  // The slabs address is never cached with the lock-based fallback, so its
+  // pushes always get here.
+  if (ABSL_PREDICT_FALSE(UsingLockedPerCpu())) {
+    return LockedPushBatch(size_class, &item, 1) == 1;
+  }
 #endif
+  return false;
 }
 
 // PrefetchNextObject provides a common code path across architectures for
@@ -804,6 +988,10 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* TcmallocSlab<NumClasses>::Pop(
   PrefetchNextObject(next);
   return AssumeNotNull(result);
 underflow_path:
+  if (ABSL_PREDICT_FALSE(UsingLockedPerCpu())) {
+    void* item;
+    return LockedPopBatch(size_class, &item, 1) == 1 ? item : nullptr;
+  }
   return nullptr;
 }
 #endif  // defined(__x86_64__)
@@ -893,10 +1081,111 @@ ABSL_ATTRIBUTE_ALWAYS_INLINE void* TcmallocSlab<NumClasses>::Pop(
   PrefetchNextObject(prefetch);
   return AssumeNotNull(result);
 underflow_path:
+  if (ABSL_PREDICT_FALSE(UsingLockedPerCpu())) {
+    void* item;
+    return LockedPopBatch(size_class, &item, 1) == 1 ? item : nullptr;
+  }
   return nullptr;
 }
 #endif  // defined(__aarch64__)
 
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(__riscv)
+template <size_t NumClasses>
+ABSL_ATTRIBUTE_ALWAYS_INLINE void* TcmallocSlab<NumClasses>::Pop(
+    size_t size_class) {
+  void* result;
+  void* prefetch;
+  uintptr_t region_start;
+  uintptr_t scratch;
+  uintptr_t hdr;
+  uintptr_t begin;
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+  asm goto(
+#else
+  // RISC-V has no flags to return, so we return underflow in a register.
+  uintptr_t underflow;
+  asm(
+#endif
+      TCMALLOC_RSEQ_PROLOGUE(TcmallocSlab_Internal_Pop)
+#if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      "li %[underflow], 1\n"
+#endif
+      // tcmalloc_slabs is misaligned, so we load it in two halves.
+      // scratch = __rseq_abi.cpu_id_start (top half of tcmalloc_slabs);
+      // if ((scratch & (TCMALLOC_CACHED_SLABS_MASK >> 32)) == 0) {
+      //   goto underflow_path;
+      // }
+      "lw %[scratch], %[rseq_cpu_id_start]\n"
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      "bgez %[scratch], %l[underflow_path]\n"
+#else
+      "bgez %[scratch], 5f\n"
+#endif
+      // region_start = tcmalloc_slabs & ~TCMALLOC_CACHED_SLABS_MASK;
+      "lwu %[region_start], %[rseq_slabs_addr]\n"
+      "slli %[scratch], %[scratch], 33\n"
+      "srli %[scratch], %[scratch], 1\n"
+      "or %[region_start], %[region_start], %[scratch]\n"
+      // hdr = &slab_headers[size_class]
+      "add %[hdr], %[region_start], %[size_class_lsl3]\n"
+      // scratch = hdr->current (current index)
+      "lhu %[scratch], 0(%[hdr])\n"
+      // begin = hdr->begin (begin index)
+      "lhu %[begin], 4(%[hdr])\n"
+  // if (ABSL_PREDICT_FALSE(begin >= scratch)) { goto underflow_path; }
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      "bgeu %[begin], %[scratch], %l[underflow_path]\n"
+#else
+      "bgeu %[begin], %[scratch], 5f\n"
+#endif
+      // scratch--
+      "addi %[scratch], %[scratch], -1\n"
+      // Temporarily use begin as the address of the slot to pop from.
+      "slli %[begin], %[scratch], 3\n"
+      "add %[begin], %[region_start], %[begin]\n"
+      "ld %[result], 0(%[begin])\n"
+      "ld %[prefetch], -8(%[begin])\n"
+#if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      "li %[underflow], 0\n"
+#endif
+      "sh %[scratch], 0(%[hdr])\n"
+      // Commit
+      "5:\n"
+      :
+#if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      [underflow] "=&r"(underflow),
+#endif
+      [result] "=&r"(result), [prefetch] "=&r"(prefetch),
+      // Temps
+      [region_start] "=&r"(region_start), [hdr] "=&r"(hdr),
+      [begin] "=&r"(begin), [scratch] "=&r"(scratch)
+      // Real inputs
+      : TCMALLOC_RSEQ_INPUTS,
+        [rseq_cpu_id_start] "m"(__rseq_abi.cpu_id_start),
+        [size_class_lsl3] "r"(size_class << 3)
+      // t1 is clobbered by the "tail" in the abort trampoline.
+      : "t1", "memory"
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+      : underflow_path
+#endif
+  );
+#if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
+  if (ABSL_PREDICT_FALSE(underflow)) {
+    goto underflow_path;
+  }
+#endif
+  TSANAcquire(result);
+  PrefetchNextObject(prefetch);
+  return AssumeNotNull(result);
+underflow_path:
+  if (ABSL_PREDICT_FALSE(UsingLockedPerCpu())) {
+    void* item;
+    return LockedPopBatch(size_class, &item, 1) == 1 ? item : nullptr;
+  }
+  return nullptr;
+}
+#endif  // defined(__riscv)
+
 #if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
 template <size_t NumClasses>
 ABSL_ATTRIBUTE_ALWAYS_INLINE void* TcmallocSlab<NumClasses>::Pop(
@@ -908,6 +1197,13 @@ ABSL_ATTRIBUTE_ALWAYS_INLINE void* TcmallocSlab<NumClasses>::Pop(
 template <size_t NumClasses>
 std::pair<int, bool> TcmallocSlab<NumClasses>::CacheCpuSlab() {
   int cpu = VirtualRseqCpuId(virtual_cpu_id_offset_);
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
+  // The lock-based fallback has no way to tell that a cached address went
+  // stale on migration, so it never caches one.
+  if (ABSL_PREDICT_FALSE(cpu == kCpuIdLocked)) {
+    return {GetCurrentVirtualCpu(virtual_cpu_id_offset_), false};
+  }
+#endif
   ASSERT(cpu >= 0);
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
   if (ABSL_PREDICT_FALSE((tcmalloc_slabs & TCMALLOC_CACHED_SLABS_MASK) == 0)) {
@@ -929,11 +1225,12 @@ void TcmallocSlab<NumClasses>::UncacheCpuSlab() {
 template <size_t NumClasses>
 ABSL_ATTRIBUTE_NOINLINE std::pair<int, bool>
 TcmallocSlab<NumClasses>::CacheCpuSlabSlow(int cpu) {
+  Slabs* start;
   for (;;) {
     intptr_t val = tcmalloc_slabs;
     ASSERT(!(val & TCMALLOC_CACHED_SLABS_MASK));
-    const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
-    Slabs* start = CpuMemoryStart(slabs, shift, cpu);
+    const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
+    start = CpuMemoryStart(slabs, shift, cpu);
     intptr_t new_val =
         reinterpret_cast<uintptr_t>(start) | TCMALLOC_CACHED_SLABS_MASK;
 #pragma GCC diagnostic push
@@ -950,15 +1247,20 @@ TcmallocSlab<NumClasses>::CacheCpuSlabSlow(int cpu) {
       cpu = new_cpu;
     }
   }
-  // If ResizeSlabs is concurrently modifying slabs_and_shift_, we may
-  // cache the offset with the shift that won't match slabs pointer used
-  // by Push/Pop operations later. To avoid this, we check resizing_ after
-  // the calculation. Coupled with setting of resizing_ and a Fence
-  // in ResizeSlabs, this prevents possibility of mismatching shift/slabs.
+  // If ResizeCpuSlabs is concurrently moving this cpu's region, we may cache
+  // the region that is being drained, or the one it has just been moved out
+  // of. To avoid this, we check the cpu's resize state after the calculation.
+  // Coupled with setting of the state and a Fence of the cpu in
+  // ResizeCpuSlabs, this prevents possibility of using a stale region.
   CompilerBarrier();
-  if (resizing_.load(std::memory_order_relaxed)) {
-    tcmalloc_slabs = 0;
-    return {cpu, false};
+  if (ABSL_PREDICT_FALSE(resizing_.load(std::memory_order_relaxed))) {
+    const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
+    if (resize_cpu_state_[cpu].load(std::memory_order_relaxed) ==
+            kCpuResizeMoving ||
+        start != CpuMemoryStart(slabs, shift, cpu)) {
+      tcmalloc_slabs = 0;
+      return {cpu, false};
+    }
   }
   return {cpu, true};
 }
@@ -975,6 +1277,9 @@ inline size_t TcmallocSlab<NumClasses>::PushBatch(size_t size_class,
   //
   // This oversynchronizes slightly, since PushBatch may succeed only partially.
   TSANReleaseBatch(batch, len);
+  if (ABSL_PREDICT_FALSE(UsingLockedPerCpu())) {
+    return LockedPushBatch(size_class, batch, len);
+  }
   return TcmallocSlab_Internal_PushBatch(size_class, batch, len);
 }
 
@@ -982,7 +1287,9 @@ template <size_t NumClasses>
 inline size_t TcmallocSlab<NumClasses>::PopBatch(size_t size_class,
                                                  void** batch, size_t len) {
   ASSERT(len != 0);
-  const size_t n = TcmallocSlab_Internal_PopBatch(size_class, batch, len);
+  const size_t n = ABSL_PREDICT_FALSE(UsingLockedPerCpu())
+                       ? LockedPopBatch(size_class, batch, len)
+                       : TcmallocSlab_Internal_PopBatch(size_class, batch, len);
   ASSERT(n <= len);
 
   // PopBatch is implemented in assembly, msan does not know that the returned
@@ -992,6 +1299,73 @@ inline size_t TcmallocSlab<NumClasses>::PopBatch(size_t size_class,
   return n;
 }
 
+template <size_t NumClasses>
+inline std::atomic<int64_t>* TcmallocSlab<NumClasses>::LockedHeader(
+    int cpu, size_t size_class) const {
+  // ResizeCpuSlabs fences <cpu>, i.e. takes its lock, after marking it as
+  // moving and before draining it, so holding the lock orders us with it.
+  if (ABSL_PREDICT_FALSE(resizing_.load(std::memory_order_acquire)) &&
+      resize_cpu_state_[cpu].load(std::memory_order_relaxed) ==
+          kCpuResizeMoving) {
+    return nullptr;
+  }
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
+  return GetHeader(slabs, shift, cpu, size_class);
+}
+
+template <size_t NumClasses>
+ABSL_ATTRIBUTE_NOINLINE size_t TcmallocSlab<NumClasses>::LockedPushBatch(
+    size_t size_class, void** batch, size_t len) {
+  const int cpu = GetCurrentVirtualCpu(virtual_cpu_id_offset_);
+  ScopedCpuLock lock(cpu);
+  std::atomic<int64_t>* hdrp = LockedHeader(cpu, size_class);
+  if (hdrp == nullptr) return 0;
+  const Header old = LoadHeader(hdrp);
+  // As in Push, a locked or uninitialized header has end == 0.
+  if (old.current >= old.end) return 0;
+  const size_t n = std::min<size_t>(len, old.end - old.current);
+  void** slots = reinterpret_cast<void**>(hdrp - size_class);
+  // Like the restartable sequence, push the last items of <batch> first.
+  for (size_t i = 0; i < n; ++i) {
+    slots[old.current + i] = batch[len - 1 - i];
+  }
+  Header hdr = old;
+  hdr.current += n;
+  // Drain and the capacity changes made from other CPUs lock the header
+  // without taking our lock; if one of them got in, nothing was pushed.
+  int64_t old_raw = absl::bit_cast<int64_t>(old);
+  if (!hdrp->compare_exchange_strong(old_raw, absl::bit_cast<int64_t>(hdr),
+                                     std::memory_order_relaxed)) {
+    return 0;
+  }
+  return n;
+}
+
+template <size_t NumClasses>
+ABSL_ATTRIBUTE_NOINLINE size_t TcmallocSlab<NumClasses>::LockedPopBatch(
+    size_t size_class, void** batch, size_t len) {
+  const int cpu = GetCurrentVirtualCpu(virtual_cpu_id_offset_);
+  ScopedCpuLock lock(cpu);
+  std::atomic<int64_t>* hdrp = LockedHeader(cpu, size_class);
+  if (hdrp == nullptr) return 0;
+  const Header old = LoadHeader(hdrp);
+  // As in Pop, a locked or uninitialized header has current <= begin.
+  if (old.current <= old.begin) return 0;
+  const size_t n = std::min<size_t>(len, old.current - old.begin);
+  void** slots = reinterpret_cast<void**>(hdrp - size_class);
+  for (size_t i = 0; i < n; ++i) {
+    batch[i] = slots[old.current - 1 - i];
+  }
+  Header hdr = old;
+  hdr.current -= n;
+  int64_t old_raw = absl::bit_cast<int64_t>(old);
+  if (!hdrp->compare_exchange_strong(old_raw, absl::bit_cast<int64_t>(hdr),
+                                     std::memory_order_relaxed)) {
+    return 0;
+  }
+  return n;
+}
+
 template <size_t NumClasses>
 inline auto TcmallocSlab<NumClasses>::CpuMemoryStart(Slabs* slabs, Shift shift,
                                                      int cpu) -> Slabs* {
@@ -1099,9 +1473,7 @@ template <size_t NumClasses>
 void TcmallocSlab<NumClasses>::Init(Slabs* slabs,
                                     absl::FunctionRef<size_t(size_t)> capacity,
                                     Shift shift) {
-  if (UsingFlatVirtualCpus()) {
-    virtual_cpu_id_offset_ = offsetof(kernel_rseq, vcpu_id);
-  }
+  virtual_cpu_id_offset_ = VirtualCpuIdOffset();
 
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
   // This is needed only for tests that create/destroy slabs,
@@ -1131,14 +1503,41 @@ void TcmallocSlab<NumClasses>::Init(Slabs* slabs,
 template <size_t NumClasses>
 void TcmallocSlab<NumClasses>::InitCpu(
     int cpu, absl::FunctionRef<size_t(size_t)> capacity) {
-  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
-  InitCpuImpl(slabs, shift, cpu, virtual_cpu_id_offset_, capacity);
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
+  uint16_t order[NumClasses];
+  LoadLayoutOrder(order);
+  InitCpuImpl(slabs, shift, cpu, virtual_cpu_id_offset_, capacity, order);
+}
+
+template <size_t NumClasses>
+void TcmallocSlab<NumClasses>::SetLayoutOrder(
+    absl::Span<const uint16_t> order) {
+  CHECK_CONDITION(order.size() == NumClasses);
+  has_layout_order_.store(false, std::memory_order_relaxed);
+  for (size_t i = 0; i < NumClasses; ++i) {
+    CHECK_CONDITION(order[i] < NumClasses);
+    layout_order_[i].store(order[i], std::memory_order_relaxed);
+  }
+  has_layout_order_.store(true, std::memory_order_release);
+}
+
+template <size_t NumClasses>
+void TcmallocSlab<NumClasses>::LoadLayoutOrder(uint16_t* order) const {
+  bool valid = has_layout_order_.load(std::memory_order_acquire);
+  bool seen[NumClasses] = {};
+  for (size_t i = 0; i < NumClasses && valid; ++i) {
+    order[i] = layout_order_[i].load(std::memory_order_relaxed);
+    valid = order[i] < NumClasses && !seen[order[i]];
+    if (valid) seen[order[i]] = true;
+  }
+  if (valid) return;
+  for (size_t i = 0; i < NumClasses; ++i) order[i] = i;
 }
 
 template <size_t NumClasses>
 void TcmallocSlab<NumClasses>::InitCpuImpl(
     Slabs* slabs, Shift shift, int cpu, size_t virtual_cpu_id_offset,
-    absl::FunctionRef<size_t(size_t)> capacity) {
+    absl::FunctionRef<size_t(size_t)> capacity, const uint16_t* order) {
   // Phase 1: stop concurrent mutations for <cpu>. Locking ensures that there
   // exists no value of current such that begin < current.
   StopConcurrentMutations(slabs, shift, cpu, virtual_cpu_id_offset);
@@ -1153,7 +1552,8 @@ void TcmallocSlab<NumClasses>::InitCpuImpl(
   // Number of free pointers is limited by uint16_t sized offsets in slab
   // header, with an additional offset value 0xffff reserved for locking.
   constexpr size_t kMaxAllowedOffset = std::numeric_limits<uint16_t>::max() - 1;
-  for (size_t size_class = 0; size_class < NumClasses; ++size_class) {
+  for (size_t i = 0; i < NumClasses; ++i) {
+    const size_t size_class = order[i];
     size_t cap = capacity(size_class);
     CHECK_CONDITION(static_cast<uint16_t>(cap) == cap);
 
@@ -1217,66 +1617,89 @@ auto TcmallocSlab<NumClasses>::ResizeSlabs(
     absl::FunctionRef<size_t(size_t)> capacity,
     absl::FunctionRef<bool(size_t)> populated, DrainHandler drain_handler)
     -> ResizeSlabsInfo {
-  // Phase 1: Initialize any cores in the new slab that have already been
-  // populated in the old slab.
-  const auto [old_slabs, old_shift] =
-      GetSlabsAndShift(std::memory_order_relaxed);
-  ASSERT(new_shift != old_shift);
-  const size_t virtual_cpu_id_offset = virtual_cpu_id_offset_;
+  BeginResizeSlabs(new_shift, new_slabs, alloc);
   const int num_cpus = NumCPUs();
-  for (size_t cpu = 0; cpu < num_cpus; ++cpu) {
-    if (populated(cpu)) {
-      InitCpuImpl(new_slabs, new_shift, cpu, virtual_cpu_id_offset, capacity);
-    }
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    ResizeCpuSlabs(cpu, capacity, populated(cpu), drain_handler);
   }
+  return FinishResizeSlabs();
+}
 
-  // Phase 2: Collect all `begin`s (these are not mutated by anybody else thanks
-  // to the cpu locks) and stop concurrent mutations for all populated CPUs and
-  // size classes by locking all the headers.
-  // Note: we can't do regular malloc here for resize_begins_ because we may be
-  // holding the CpuCache spinlocks. We allocate memory on the arena and keep
+template <size_t NumClasses>
+void TcmallocSlab<NumClasses>::BeginResizeSlabs(
+    Shift new_shift, Slabs* new_slabs,
+    absl::FunctionRef<void*(size_t, std::align_val_t)> alloc) {
+  ASSERT(new_shift != GetSlabsAndShift(std::memory_order_relaxed).second);
+  const int num_cpus = NumCPUs();
+  // Note: we can't do regular malloc here for resize_cpu_state_ because we may
+  // be holding the CpuCache spinlocks. We allocate memory on the arena and keep
   // the pointer for reuse.
-  const size_t begins_size = sizeof(uint16_t) * NumClasses * num_cpus;
-  if (resize_begins_ == nullptr) {
-    resize_begins_ = reinterpret_cast<uint16_t(*)[NumClasses]>(
-        alloc(begins_size, std::align_val_t{alignof(uint16_t)}));
+  if (resize_cpu_state_ == nullptr) {
+    resize_cpu_state_ = reinterpret_cast<std::atomic<uint8_t>*>(
+        alloc(sizeof(std::atomic<uint8_t>) * num_cpus,
+              std::align_val_t{alignof(std::atomic<uint8_t>)}));
+  }
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    resize_cpu_state_[cpu].store(kCpuResizeOld, std::memory_order_relaxed);
   }
-  // Setting resizing_ in combination with a fence on every CPU before setting
-  // new slabs_and_shift_ prevents Push/Pop fast path from using the old
-  // slab offset/shift with the new slabs pointer. After the fence all CPUs
-  // will uncache the offset and observe resizing_ on the next attempt
-  // to cache the offset.
+  resize_slabs_and_shift_.store({new_slabs, new_shift},
+                                std::memory_order_relaxed);
   CHECK_CONDITION(!resizing_.load(std::memory_order_relaxed));
-  resizing_.store(true, std::memory_order_relaxed);
-  for (size_t cpu = 0; cpu < num_cpus; ++cpu) {
-    if (!populated(cpu)) continue;
+  resizing_.store(true, std::memory_order_release);
+}
+
+template <size_t NumClasses>
+void TcmallocSlab<NumClasses>::ResizeCpuSlabs(
+    int cpu, absl::FunctionRef<size_t(size_t)> capacity, bool populated,
+    DrainHandler drain_handler) {
+  ASSERT(resizing_.load(std::memory_order_relaxed));
+  const auto [old_slabs, old_shift] =
+      GetSlabsAndShift(std::memory_order_relaxed);
+  const auto [new_slabs, new_shift] =
+      resize_slabs_and_shift_.load(std::memory_order_relaxed).Get();
+  const size_t virtual_cpu_id_offset = virtual_cpu_id_offset_;
+  std::atomic<uint8_t>& state = resize_cpu_state_[cpu];
+  ASSERT(state.load(std::memory_order_relaxed) == kCpuResizeOld);
+
+  // Phase 1: Initialize the core in the new slab if it has already been
+  // populated in the old slab. Nobody uses the new region until the state
+  // below says so.
+  if (populated) {
+    uint16_t order[NumClasses];
+    LoadLayoutOrder(order);
+    InitCpuImpl(new_slabs, new_shift, cpu, virtual_cpu_id_offset, capacity,
+                order);
+  }
+
+  // Phase 2: Collect all `begin`s (these are not mutated by anybody else thanks
+  // to the cpu lock) and stop concurrent mutations for all size classes by
+  // locking the headers. Setting the state in combination with the fence of
+  // the cpu in StopConcurrentMutations prevents Push/Pop fast path from using
+  // the old region: after the fence the cpu will uncache the offset and
+  // observe the state on the next attempt to cache it. Threads on an
+  // unpopulated cpu may have cached its old region too, so we fence it
+  // regardless.
+  uint16_t begins[NumClasses];
+  state.store(kCpuResizeMoving, std::memory_order_relaxed);
+  if (populated) {
     for (size_t size_class = 0; size_class < NumClasses; ++size_class) {
       Header header =
           LoadHeader(GetHeader(old_slabs, old_shift, cpu, size_class));
       CHECK_CONDITION(!header.IsLocked());
-      resize_begins_[cpu][size_class] = header.begin;
+      begins[size_class] = header.begin;
     }
     StopConcurrentMutations(old_slabs, old_shift, cpu, virtual_cpu_id_offset);
-  }
-
-  // Phase 3: Atomically update slabs and shift.
-  slabs_and_shift_.store({new_slabs, new_shift}, std::memory_order_relaxed);
 
-  // Phase 4: Return pointers from the old slab to the TransferCache.
-  for (size_t cpu = 0; cpu < num_cpus; ++cpu) {
-    if (!populated(cpu)) continue;
-    DrainCpu(old_slabs, old_shift, cpu, &resize_begins_[cpu][0], drain_handler);
-  }
+    // Phase 3: Return pointers from the old region to the TransferCache.
+    DrainCpu(old_slabs, old_shift, cpu, begins, drain_handler);
 
-  // Phase 5: Update all the `current` values to 0 and fence all CPUs. In RSEQ
-  // for Pop/PopBatch, we load current before loading begin so it's possible to
-  // get an interleaving of: (Thread 1) load current (>0); (Thread 2)
-  // MADVISE_DONTNEED away slabs; (Thread 1) load begin (now ==0), see
-  // begin<current so we can Pop.
-  // NOTE: we do this after DrainCpu because DrainCpu relies on headers having
-  // accurate `current` values.
-  for (size_t cpu = 0; cpu < num_cpus; ++cpu) {
-    if (!populated(cpu)) continue;
+    // Phase 4: Update the `current` values to 0 and fence the cpu. In RSEQ
+    // for Pop/PopBatch, we load current before loading begin so it's possible
+    // to get an interleaving of: (Thread 1) load current (>0); (Thread 2)
+    // MADVISE_DONTNEED away slabs; (Thread 1) load begin (now ==0), see
+    // begin<current so we can Pop.
+    // NOTE: we do this after DrainCpu because DrainCpu relies on headers
+    // having accurate `current` values.
     for (size_t size_class = 0; size_class < NumClasses; ++size_class) {
       std::atomic<int64_t>* header_ptr =
           GetHeader(old_slabs, old_shift, cpu, size_class);
@@ -1285,8 +1708,30 @@ auto TcmallocSlab<NumClasses>::ResizeSlabs(
       StoreHeader(header_ptr, header);
     }
   }
-  FenceAllCpus();
-  resizing_.store(false, std::memory_order_relaxed);
+  FenceCpu(cpu, virtual_cpu_id_offset);
+
+  // Phase 5: Switch the cpu over to the new region.
+  state.store(kCpuResizeMoved, std::memory_order_release);
+}
+
+template <size_t NumClasses>
+auto TcmallocSlab<NumClasses>::FinishResizeSlabs() -> ResizeSlabsInfo {
+  ASSERT(resizing_.load(std::memory_order_relaxed));
+  const auto [old_slabs, old_shift] =
+      GetSlabsAndShift(std::memory_order_relaxed);
+  const int num_cpus = NumCPUs();
+#ifndef NDEBUG
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    ASSERT(resize_cpu_state_[cpu].load(std::memory_order_relaxed) ==
+           kCpuResizeMoved);
+  }
+#endif
+
+  // Every cpu is in the new slabs already, so no fence is needed here.
+  slabs_and_shift_.store(
+      resize_slabs_and_shift_.load(std::memory_order_relaxed),
+      std::memory_order_relaxed);
+  resizing_.store(false, std::memory_order_release);
 
   return {old_slabs, GetSlabsAllocSize(old_shift, num_cpus)};
 }
@@ -1306,7 +1751,7 @@ size_t TcmallocSlab<NumClasses>::GrowOtherCache(
     absl::FunctionRef<size_t(uint8_t)> max_capacity) {
   ASSERT(cpu >= 0);
   ASSERT(cpu < NumCPUs());
-  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
   const size_t virtual_cpu_id_offset = virtual_cpu_id_offset_;
   const size_t max_cap = max_capacity(ToUint8(shift));
 
@@ -1342,7 +1787,7 @@ size_t TcmallocSlab<NumClasses>::ShrinkOtherCache(
     int cpu, size_t size_class, size_t len, ShrinkHandler shrink_handler) {
   ASSERT(cpu >= 0);
   ASSERT(cpu < NumCPUs());
-  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
   const size_t virtual_cpu_id_offset = virtual_cpu_id_offset_;
 
   // Phase 1: Collect begin as it will be overwritten by the lock.
@@ -1407,7 +1852,7 @@ template <size_t NumClasses>
 void TcmallocSlab<NumClasses>::Drain(int cpu, DrainHandler drain_handler) {
   CHECK_CONDITION(cpu >= 0);
   CHECK_CONDITION(cpu < NumCPUs());
-  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  const auto [slabs, shift] = GetCpuSlabsAndShift(cpu);
   const size_t virtual_cpu_id_offset = virtual_cpu_id_offset_;
 
   // Push/Pop/Grow/Shrink can be executed concurrently with Drain.
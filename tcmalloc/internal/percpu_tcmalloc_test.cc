@@ -185,6 +185,10 @@ TEST_F(TcmallocSlabTest, Unit) {
     return;
   }
 
+  if (UsingLockedPerCpu()) {
+    GTEST_SKIP() << "Faking the CPU ID needs rseq. Skipping.";
+  }
+
   // Decide if we should expect a push or pop to be the first action on the CPU
   // slab to trigger initialization.
   absl::FixedArray<bool, 0> initialized(NumCPUs(), false);
@@ -408,6 +412,55 @@ TEST_F(TcmallocSlabTest, Unit) {
   }
 }
 
+TEST_F(TcmallocSlabTest, LockedFallback) {
+  if (!IsFast() || !UsingLockedPerCpu()) {
+    GTEST_SKIP() << "Need the lock-based per-CPU fallback. Skipping.";
+  }
+
+  // Stay on one CPU, so that all of the operations below use its region.
+  const int cpu = AllowedCpus()[0];
+  ScopedAffinityMask mask(cpu);
+  constexpr size_t kSizeClass = 1;
+  slab_.InitCpu(cpu, [](size_t size_class) { return kCapacity; });
+
+  // The slabs address is never cached, so the fast paths always take the lock.
+  EXPECT_EQ(slab_.CacheCpuSlab(), std::make_pair(cpu, false));
+  EXPECT_EQ(slab_.Pop(kSizeClass), nullptr);
+
+  char storage[kCapacity];
+  void* objects[kCapacity];
+  for (int i = 0; i < kCapacity; ++i) {
+    objects[i] = &storage[i];
+  }
+  EXPECT_FALSE(slab_.Push(kSizeClass, objects[0]));
+  const auto max_capacity = [](uint8_t shift) { return kCapacity; };
+  ASSERT_EQ(slab_.Grow(cpu, kSizeClass, kCapacity, max_capacity), kCapacity);
+
+  EXPECT_TRUE(slab_.Push(kSizeClass, objects[0]));
+  EXPECT_EQ(slab_.PushBatch(kSizeClass, &objects[1], kCapacity - 1),
+            kCapacity - 1);
+  EXPECT_FALSE(slab_.Push(kSizeClass, objects[0]));
+  EXPECT_EQ(slab_.Length(cpu, kSizeClass), kCapacity);
+
+  // As with rseq, PushBatch pushes the last items of the batch first.
+  EXPECT_EQ(slab_.Pop(kSizeClass), objects[1]);
+  void* batch[kCapacity];
+  ASSERT_EQ(slab_.PopBatch(kSizeClass, batch, kCapacity), kCapacity - 1);
+  for (int i = 0; i < kCapacity - 2; ++i) {
+    EXPECT_EQ(batch[i], objects[i + 2]) << i;
+  }
+  EXPECT_EQ(batch[kCapacity - 2], objects[0]);
+  EXPECT_EQ(slab_.Length(cpu, kSizeClass), 0);
+
+  // Drain locks the headers, after which pushes fail again.
+  EXPECT_TRUE(slab_.Push(kSizeClass, objects[0]));
+  size_t drained = 0;
+  slab_.Drain(cpu, [&](int cpu_arg, size_t size_class, void** batch,
+                       size_t size, size_t cap) { drained += size; });
+  EXPECT_EQ(drained, 1);
+  EXPECT_FALSE(slab_.Push(kSizeClass, objects[0]));
+}
+
 TEST_F(TcmallocSlabTest, ShrinkEmptyCache) {
   if (MallocExtension::PerCpuCachesActive()) {
     // This test unregisters rseq temporarily, as to decrease flakiness.
@@ -434,6 +487,30 @@ TEST_F(TcmallocSlabTest, ShrinkEmptyCache) {
       0);
 }
 
+TEST_F(TcmallocSlabTest, LayoutOrder) {
+  if (MallocExtension::PerCpuCachesActive()) {
+    // This test unregisters rseq temporarily, as to decrease flakiness.
+    GTEST_SKIP() << "per-CPU TCMalloc is incompatible with unregistering rseq";
+  }
+
+  if (!IsFast()) {
+    GTEST_SKIP() << "Need fast percpu. Skipping.";
+    return;
+  }
+  const uint16_t order[kStressSlabs] = {2, 0, 3, 1};
+  slab_.SetLayoutOrder(order);
+  constexpr int kCpu = 1;
+  slab_.InitCpu(kCpu, [](size_t size_class) { return kCapacity; });
+
+  // The slot arrays follow one another in <order>.
+  void** batches[kStressSlabs] = {};
+  slab_.Drain(kCpu, [&](int cpu, size_t size_class, void** batch, size_t n,
+                        size_t cap) { batches[size_class] = batch; });
+  for (int i = 1; i < kStressSlabs; ++i) {
+    EXPECT_LT(batches[order[i - 1]], batches[order[i]]) << i;
+  }
+}
+
 TEST_F(TcmallocSlabTest, SimulatedMadviseFailure) {
   if (!IsFast()) {
     GTEST_SKIP() << "Need fast percpu. Skipping.";
@@ -463,6 +540,55 @@ TEST_F(TcmallocSlabTest, SimulatedMadviseFailure) {
   trigger_resize(kShift);
 }
 
+TEST_F(TcmallocSlabTest, IncrementalResize) {
+  if (!IsFast()) {
+    GTEST_SKIP() << "Need fast percpu. Skipping.";
+    return;
+  }
+  constexpr int kCpu = 0;
+  constexpr size_t kSizeClass = 1;
+  constexpr size_t kGrow = 7;
+  auto max_capacity = [](uint8_t shift) { return kCapacity; };
+  slab_.InitCpu(kCpu, [](size_t size_class) { return kCapacity; });
+  ASSERT_EQ(slab_.GrowOtherCache(kCpu, kSizeClass, kGrow, max_capacity),
+            kGrow);
+
+  auto alloc = [&](size_t size, std::align_val_t alignment) {
+    return ByteCountingMalloc(size, alignment);
+  };
+  const auto new_shift = subtle::percpu::ToShiftType(kShift - 1);
+  slab_.BeginResizeSlabs(new_shift, AllocSlabs(alloc, kShift - 1), alloc);
+  // Until it is moved, the cpu stays in the old slabs.
+  EXPECT_EQ(slab_.GetShift(kCpu), kShift);
+  EXPECT_EQ(slab_.Capacity(kCpu, kSizeClass), kGrow);
+
+  size_t drained_capacity = 0;
+  slab_.ResizeCpuSlabs(
+      kCpu, [](size_t) { return kCapacity; }, /*populated=*/true,
+      [&](int cpu, size_t size_class, void** batch, size_t size, size_t cap) {
+        EXPECT_EQ(cpu, kCpu);
+        EXPECT_EQ(size, 0);
+        drained_capacity += cap;
+      });
+  EXPECT_EQ(drained_capacity, kGrow);
+  // The moved cpu uses the new slabs before the resize finishes.
+  EXPECT_EQ(slab_.GetShift(kCpu), kShift - 1);
+  EXPECT_EQ(slab_.GetShift(), kShift);
+  EXPECT_EQ(slab_.Capacity(kCpu, kSizeClass), 0);
+  ASSERT_EQ(slab_.GrowOtherCache(kCpu, kSizeClass, kGrow, max_capacity),
+            kGrow);
+
+  for (int cpu = 0; cpu < NumCPUs(); ++cpu) {
+    if (cpu == kCpu) continue;
+    slab_.ResizeCpuSlabs(
+        cpu, [](size_t) { return kCapacity; }, /*populated=*/false,
+        [](int, size_t, void**, size_t, size_t) { ADD_FAILURE(); });
+  }
+  (void)slab_.FinishResizeSlabs();
+  EXPECT_EQ(slab_.GetShift(), kShift - 1);
+  EXPECT_EQ(slab_.Capacity(kCpu, kSizeClass), kGrow);
+}
+
 size_t get_capacity(size_t size_class) {
   return size_class < kStressSlabs ? kStressCapacity : 0;
 }
@@ -643,7 +769,7 @@ void StressThread(size_t thread_id, Context& ctx) {
       {
         absl::MutexLock lock(&ctx.mutexes[cpu]);
         std::optional<ScopedUnregisterRseq> scoped_rseq;
-        if (unregister) {
+        if (unregister && !UsingLockedPerCpu()) {
           scoped_rseq.emplace();
           ASSERT(!IsFastNoInit());
         }
@@ -1050,6 +1176,196 @@ void BM_PushPopBatch(benchmark::State& state) {
 }
 BENCHMARK(BM_PushPopBatch);
 
+// The benchmarks below measure operations that interrupt other cpus: the cost
+// to the caller and the stall they cause on the cpus they interrupt.  Victim
+// threads, each pinned to a cpu of its own, Push and Pop on their cpu's slab
+// and record how long each pair takes; the benchmark thread runs on a further
+// cpu.  Each benchmark's argument is the number of victims.
+class FenceVictims {
+ public:
+  static constexpr size_t kSizeClass = 0;
+
+  // Pins the calling thread to an allowed cpu, and starts <n> victims on as
+  // many others, or returns nullopt if there are not enough cpus.
+  static std::optional<FenceVictims> Start(TcmallocSlab& slab, int n) {
+    std::vector<int> allowed = AllowedCpus();
+    if (allowed.size() <= n) return std::nullopt;
+    return std::optional<FenceVictims>(std::in_place, slab, allowed, n);
+  }
+
+  FenceVictims(TcmallocSlab& slab, absl::Span<const int> allowed, int n)
+      : self_(allowed[0]), stats_(n) {
+    cpus_.assign(allowed.begin() + 1, allowed.begin() + 1 + n);
+    threads_.reserve(n);
+    for (int i = 0; i < n; ++i) {
+      threads_.emplace_back([this, &slab, i] { Run(slab, i); });
+    }
+    // Wait for the victims to have pinned themselves.
+    while (ready_.load(std::memory_order_acquire) < n) {
+      std::this_thread::yield();
+    }
+  }
+
+  FenceVictims(FenceVictims&&) = delete;
+
+  ~FenceVictims() {
+    stop_.store(true, std::memory_order_relaxed);
+    for (auto& t : threads_) t.join();
+  }
+
+  const std::vector<int>& cpus() const { return cpus_; }
+
+  // Reports the victims' Push/Pop rate and their longest stall since the
+  // benchmark started.
+  void Report(benchmark::State& state, absl::Duration elapsed) const {
+    uint64_t ops = 0;
+    int64_t max_stall_ns = 0;
+    for (const VictimStats& s : stats_) {
+      ops += s.ops.load(std::memory_order_relaxed);
+      max_stall_ns = std::max(max_stall_ns,
+                              s.max_stall_ns.load(std::memory_order_relaxed));
+    }
+    state.counters["victim_ns_per_op"] =
+        ops > 0 ? absl::ToDoubleNanoseconds(elapsed) * cpus_.size() / ops : 0.;
+    state.counters["victim_max_stall_us"] = max_stall_ns / 1000.;
+  }
+
+  bool Tampered() { return self_.Tampered(); }
+
+ private:
+  struct VictimStats {
+    alignas(ABSL_CACHELINE_SIZE) std::atomic<uint64_t> ops{0};
+    std::atomic<int64_t> max_stall_ns{0};
+  };
+
+  void Run(TcmallocSlab& slab, int i) {
+    ScopedAffinityMask mask(cpus_[i]);
+    ready_.fetch_add(1, std::memory_order_release);
+    VictimStats& stats = stats_[i];
+    void* item = &stats;
+    uint64_t ops = 0;
+    int64_t max_stall_ns = 0;
+    while (!stop_.load(std::memory_order_relaxed)) {
+      const int64_t start = absl::GetCurrentTimeNanos();
+      if (ABSL_PREDICT_FALSE(!slab.Push(kSizeClass, item))) {
+        // Our capacity was taken by a drain, shrink or resize.
+        auto [cpu, _] = slab.CacheCpuSlab();
+        slab.Grow(cpu, kSizeClass, kStressCapacity,
+                  [](uint8_t) { return kStressCapacity; });
+        continue;
+      }
+      benchmark::DoNotOptimize(slab.Pop(kSizeClass));
+      max_stall_ns =
+          std::max(max_stall_ns, absl::GetCurrentTimeNanos() - start);
+      if (++ops % 1024 == 0) {
+        stats.ops.store(ops, std::memory_order_relaxed);
+        stats.max_stall_ns.store(max_stall_ns, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  ScopedAffinityMask self_;
+  std::vector<int> cpus_;
+  std::vector<VictimStats> stats_;
+  std::vector<std::thread> threads_;
+  std::atomic<int> ready_{0};
+  std::atomic<bool> stop_{false};
+};
+
+// Runs <op>(victim cpu) once per iteration, against each victim in turn.
+void RunAgainstVictims(benchmark::State& state,
+                       absl::FunctionRef<void(TcmallocSlab&, int)> op) {
+  if (!IsFast()) {
+    state.SkipWithError("Need fast percpu");
+    return;
+  }
+  TcmallocSlab slab;
+  InitSlab(slab, allocator, get_capacity, kShift);
+  for (int cpu = 0, n = NumCPUs(); cpu < n; ++cpu) {
+    slab.InitCpu(cpu, get_capacity);
+  }
+
+  {
+    std::optional<FenceVictims> victims =
+        FenceVictims::Start(slab, state.range(0));
+    if (!victims.has_value()) {
+      state.SkipWithError("Not enough cpus");
+    } else {
+      const absl::Time start = absl::Now();
+      size_t i = 0;
+      for (auto _ : state) {
+        op(slab, victims->cpus()[i]);
+        if (++i == victims->cpus().size()) i = 0;
+      }
+      victims->Report(state, absl::Now() - start);
+      if (victims->Tampered()) {
+        state.SkipWithError("Affinity changed during the run");
+      }
+    }
+  }
+  slab.Destroy(sized_aligned_delete);
+}
+
+void BM_FenceCpu(benchmark::State& state) {
+  RunAgainstVictims(state, [](TcmallocSlab&, int cpu) {
+    FenceCpu(cpu, VirtualCpuIdOffset());
+  });
+}
+BENCHMARK(BM_FenceCpu)->RangeMultiplier(2)->Range(1, 256)->UseRealTime();
+
+void BM_FenceAllCpus(benchmark::State& state) {
+  RunAgainstVictims(state, [](TcmallocSlab&, int) { FenceAllCpus(); });
+}
+BENCHMARK(BM_FenceAllCpus)->RangeMultiplier(2)->Range(1, 256)->UseRealTime();
+
+void BM_ShrinkGrowOtherCache(benchmark::State& state) {
+  RunAgainstVictims(state, [](TcmallocSlab& slab, int cpu) {
+    slab.ShrinkOtherCache(cpu, FenceVictims::kSizeClass, 1,
+                          [](size_t, void**, size_t) {});
+    slab.GrowOtherCache(cpu, FenceVictims::kSizeClass, 1,
+                        [](uint8_t) { return kStressCapacity; });
+  });
+}
+BENCHMARK(BM_ShrinkGrowOtherCache)
+    ->RangeMultiplier(2)
+    ->Range(1, 256)
+    ->UseRealTime();
+
+void BM_Drain(benchmark::State& state) {
+  RunAgainstVictims(state, [](TcmallocSlab& slab, int cpu) {
+    slab.Drain(cpu, [](int, size_t, void**, size_t, size_t) {});
+  });
+}
+BENCHMARK(BM_Drain)->RangeMultiplier(2)->Range(1, 256)->UseRealTime();
+
+void BM_ResizeSlabs(benchmark::State& state) {
+  // As in ResizeSlabsThread, old slabs are kept for a while in case a victim
+  // still reads them.
+  std::array<std::pair<void*, size_t>, 100> old_slabs_arr{};
+  size_t old_slabs_idx = 0;
+  RunAgainstVictims(state, [&](TcmallocSlab& slab, int) {
+    const size_t shift = slab.GetShift() == kShift ? kShift - 1 : kShift;
+    const auto [old_slabs, old_slabs_size] = slab.ResizeSlabs(
+        ToShiftType(shift), AllocSlabs(allocator, shift), allocator,
+        get_capacity, [](size_t) { return true; },
+        [](int, size_t, void**, size_t, size_t) {});
+    madvise(old_slabs, old_slabs_size, MADV_DONTNEED);
+    auto& [oldest, oldest_size] = old_slabs_arr[old_slabs_idx];
+    if (oldest != nullptr) {
+      sized_aligned_delete(oldest, oldest_size,
+                           std::align_val_t{EXEC_PAGESIZE});
+    }
+    old_slabs_arr[old_slabs_idx] = {old_slabs, old_slabs_size};
+    if (++old_slabs_idx == old_slabs_arr.size()) old_slabs_idx = 0;
+  });
+  for (const auto& [old_slabs, old_slabs_size] : old_slabs_arr) {
+    if (old_slabs == nullptr) continue;
+    sized_aligned_delete(old_slabs, old_slabs_size,
+                         std::align_val_t{EXEC_PAGESIZE});
+  }
+}
+BENCHMARK(BM_ResizeSlabs)->RangeMultiplier(2)->Range(1, 256)->UseRealTime();
+
 }  // namespace
 }  // namespace percpu
 }  // namespace subtle
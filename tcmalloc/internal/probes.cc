@@ -0,0 +1,29 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/probes.h"
+
+#ifdef TCMALLOC_INTERNAL_HAVE_USDT
+
+// Tracers find the semaphores through the probes' notes, and expect them in
+// the .probes section.
+#define TCMALLOC_INTERNAL_DEFINE_PROBE(name)          \
+  __attribute__((section(".probes"))) volatile unsigned \
+      short TCMALLOC_PROBE_SEMAPHORE(name) = 0;
+extern "C" {
+TCMALLOC_INTERNAL_PROBES(TCMALLOC_INTERNAL_DEFINE_PROBE)
+}
+#undef TCMALLOC_INTERNAL_DEFINE_PROBE
+
+#endif  // TCMALLOC_INTERNAL_HAVE_USDT
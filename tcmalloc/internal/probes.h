@@ -0,0 +1,136 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// USDT (userspace statically defined tracing) probes on the allocator's slow
+// paths, for bpftrace, perf and other SDT consumers.  They are compiled in with
+// -DTCMALLOC_INTERNAL_USDT, which requires <sys/sdt.h> from systemtap;
+// otherwise they compile to nothing.
+//
+// An unattached probe is a single nop.  Tracers raise a probe's semaphore while
+// attached to it, and latencies are only measured while it is raised, so that
+// untraced probes do not read the clock.  A latency whose measurement began
+// before the tracer attached reads as 0.
+//
+// The probes, all of provider "tcmalloc", and their arguments:
+//   cpu_cache_refill(size_class, objects, latency_ns)
+//   cpu_cache_overflow(size_class, objects, latency_ns)
+//   central_freelist_populate(size_class, objects, latency_ns)
+//   page_allocator_new(tag, pages, latency_ns)
+//   page_allocator_delete(tag, pages, latency_ns)
+//   system_alloc(bytes, alignment, latency_ns)
+//   release_pages(requested_pages, released_pages, latency_ns)
+//   cpu_cache_resize_slab(old_shift, new_shift, latency_ns)
+//   shrink_to_usage_limit(limit_kind, pages, latency_ns)
+//
+// For example, to histogram refill latencies by size class:
+//
+//   bpftrace -e 'usdt:/path/to/binary:tcmalloc:cpu_cache_refill
+//                { @ns[arg0] = hist(arg2); }'
+
+#ifndef TCMALLOC_INTERNAL_PROBES_H_
+#define TCMALLOC_INTERNAL_PROBES_H_
+
+#include <stdint.h>
+
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+
+#if defined(TCMALLOC_INTERNAL_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TCMALLOC_INTERNAL_HAVE_USDT 1
+#endif
+#endif
+
+#define TCMALLOC_INTERNAL_PROBES(X) \
+  X(cpu_cache_refill)               \
+  X(cpu_cache_overflow)             \
+  X(central_freelist_populate)      \
+  X(page_allocator_new)             \
+  X(page_allocator_delete)          \
+  X(system_alloc)                   \
+  X(release_pages)                  \
+  X(cpu_cache_resize_slab)          \
+  X(shrink_to_usage_limit)
+
+#ifdef TCMALLOC_INTERNAL_HAVE_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// sys/sdt.h refers to the semaphore of probe <name> of provider tcmalloc by
+// this (unmangled) symbol.  probes.cc defines them.
+#define TCMALLOC_PROBE_SEMAPHORE(name) tcmalloc_##name##_semaphore
+#define TCMALLOC_INTERNAL_DECLARE_PROBE(name) \
+  extern "C" volatile unsigned short TCMALLOC_PROBE_SEMAPHORE(name);
+TCMALLOC_INTERNAL_PROBES(TCMALLOC_INTERNAL_DECLARE_PROBE)
+#undef TCMALLOC_INTERNAL_DECLARE_PROBE
+
+// Returns whether a tracer is attached to probe <name>.
+#define TCMALLOC_PROBE_ENABLED(name) \
+  ABSL_PREDICT_FALSE(TCMALLOC_PROBE_SEMAPHORE(name) != 0)
+
+// Fires probe <name> with the given (integer) arguments.
+#define TCMALLOC_PROBE(name, ...) STAP_PROBEV(tcmalloc, name, __VA_ARGS__)
+
+#else  // TCMALLOC_INTERNAL_HAVE_USDT
+
+#define TCMALLOC_PROBE_ENABLED(name) false
+
+// The arguments are type checked, but never evaluated.
+#define TCMALLOC_PROBE(name, ...)                                            \
+  do {                                                                       \
+    if (false) {                                                             \
+      ::tcmalloc::tcmalloc_internal::probes_internal::Ignore(__VA_ARGS__);   \
+    }                                                                        \
+  } while (0)
+
+#endif  // TCMALLOC_INTERNAL_HAVE_USDT
+
+// Returns the time to measure the latency argument of probe <name> from.
+#define TCMALLOC_PROBE_START(name) \
+  ::tcmalloc::tcmalloc_internal::ProbeStart(TCMALLOC_PROBE_ENABLED(name))
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace probes_internal {
+
+template <typename... Args>
+void Ignore(const Args&...) {}
+
+}  // namespace probes_internal
+
+// Returns the current time if <enabled>, and 0 otherwise.
+inline int64_t ProbeStart(bool enabled) {
+  if (ABSL_PREDICT_TRUE(!enabled)) return 0;
+  const int64_t now = absl::base_internal::CycleClock::Now();
+  return now != 0 ? now : 1;
+}
+
+// Returns the nanoseconds elapsed since <start>, as returned by ProbeStart, or
+// 0 if the latency was not measured.
+inline uint64_t ProbeLatencyNs(int64_t start) {
+  if (ABSL_PREDICT_TRUE(start == 0)) return 0;
+  const int64_t elapsed = absl::base_internal::CycleClock::Now() - start;
+  if (elapsed <= 0) return 0;
+  return static_cast<uint64_t>(
+      elapsed * (1e9 / absl::base_internal::CycleClock::Frequency()));
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_PROBES_H_
@@ -40,13 +40,16 @@
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "tcmalloc/internal/profile.pb.h"
 #include "absl/base/attributes.h"
 #include "absl/base/macros.h"
 #include "absl/status/status.h"
 #include "absl/strings/escaping.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/residency.h"
 
@@ -109,7 +112,8 @@ struct SampleMergedData {
 };
 
 // The equality and hash methods of Profile::Sample only use a subset of its
-// member fields.
+// member fields.  Label sets are compared by identity: they are typically
+// static, and pprof merges equal labels set from different places anyway.
 struct SampleEqWithSubFields {
   bool operator()(const Profile::Sample& a, const Profile::Sample& b) const {
     auto fields = [](const Profile::Sample& s) {
@@ -117,6 +121,10 @@ struct SampleEqWithSubFields {
                       s.requested_size_returning, s.allocated_size,
                       s.access_hint, s.access_allocated, s.guarded_status);
     };
+    if (a.labels.data() != b.labels.data() ||
+        a.labels.size() != b.labels.size()) {
+      return false;
+    }
     return fields(a) == fields(b) &&
            std::equal(a.stack, a.stack + a.depth, b.stack, b.stack + b.depth);
   }
@@ -127,7 +135,8 @@ struct SampleHashWithSubFields {
     return absl::HashOf(absl::MakeConstSpan(s.stack, s.depth), s.depth,
                         s.requested_size, s.requested_alignment,
                         s.requested_size_returning, s.allocated_size,
-                        s.access_hint, s.access_allocated, s.guarded_status);
+                        s.access_hint, s.access_allocated, s.guarded_status,
+                        s.labels.data(), s.labels.size());
   }
 };
 
@@ -254,6 +263,121 @@ std::string GetBuildId(const dl_phdr_info* const info) {
 
   return result;
 }
+
+namespace {
+
+// A loadable segment of an object, as added to profiles.
+struct CachedMapping {
+  uintptr_t memory_start;
+  uintptr_t memory_limit;
+  uintptr_t file_offset;
+  std::string filename;
+  std::string build_id;
+};
+
+// The number of objects loaded and unloaded by the dynamic linker so far.
+using LoadedObjectCounts = std::pair<unsigned long long, unsigned long long>;
+
+// Returns the counts, or nullopt if the C library does not report them.  Only
+// looks at the first object, so it is cheap however many objects are loaded.
+std::optional<LoadedObjectCounts> GetLoadedObjectCounts() {
+  std::optional<LoadedObjectCounts> counts;
+  dl_iterate_phdr(
+      +[](dl_phdr_info* info, size_t size, void* data) {
+        if (size >=
+            offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+          *static_cast<std::optional<LoadedObjectCounts>*>(data) =
+              LoadedObjectCounts(info->dlpi_adds, info->dlpi_subs);
+        }
+        // Stop after the first object.
+        return 1;
+      },
+      &counts);
+  return counts;
+}
+
+// Walks the loaded objects for their mappings.  Resolving file names and
+// reading build IDs makes this slow for processes with many objects.
+std::vector<CachedMapping> ReadCurrentMappings() {
+  auto dl_iterate_callback = +[](dl_phdr_info* info, size_t size, void* data) {
+    // Skip dummy entry introduced since glibc 2.18.
+    if (info->dlpi_phdr == nullptr && info->dlpi_phnum == 0) {
+      return 0;
+    }
+
+    auto& mappings = *static_cast<std::vector<CachedMapping>*>(data);
+    const bool is_main_executable = mappings.empty();
+
+    // Evaluate all the loadable segments.
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+      if (info->dlpi_phdr[i].p_type != PT_LOAD) {
+        continue;
+      }
+      const ElfW(Phdr)* pt_load = &info->dlpi_phdr[i];
+
+      CHECK_CONDITION(pt_load != nullptr);
+
+      // Extract data.
+      const size_t memory_start = info->dlpi_addr + pt_load->p_vaddr;
+      const size_t memory_limit = memory_start + pt_load->p_memsz;
+      const size_t file_offset = pt_load->p_offset;
+
+      // Storage for path to executable as dlpi_name isn't populated for the
+      // main executable.  +1 to allow for the null terminator that readlink
+      // does not add.
+      char self_filename[PATH_MAX + 1];
+      const char* filename = info->dlpi_name;
+      if (filename == nullptr || filename[0] == '\0') {
+        // This is either the main executable or the VDSO.  The main executable
+        // is always the first entry processed by callbacks.
+        if (is_main_executable) {
+          // This is the main executable.
+          ssize_t ret = readlink("/proc/self/exe", self_filename,
+                                 sizeof(self_filename) - 1);
+          if (ret >= 0 && ret < sizeof(self_filename)) {
+            self_filename[ret] = '\0';
+            filename = self_filename;
+          }
+        } else {
+          // This is the VDSO.
+          filename = GetSoName(info);
+        }
+      }
+
+      char resolved_path[PATH_MAX];
+      absl::string_view resolved_filename;
+      if (realpath(filename, resolved_path)) {
+        resolved_filename = resolved_path;
+      } else {
+        resolved_filename = filename;
+      }
+
+      mappings.push_back({memory_start, memory_limit, file_offset,
+                          std::string(resolved_filename), GetBuildId(info)});
+    }
+    // Keep going.
+    return 0;
+  };
+
+  std::vector<CachedMapping> mappings;
+  dl_iterate_phdr(dl_iterate_callback, &mappings);
+  return mappings;
+}
+
+// The mappings of the process as of `counts`, reused by successive profiles
+// until an object is loaded or unloaded.
+struct MappingCache {
+  absl::Mutex mu;
+  std::optional<LoadedObjectCounts> counts ABSL_GUARDED_BY(mu);
+  std::vector<CachedMapping> mappings ABSL_GUARDED_BY(mu);
+};
+
+MappingCache& GetMappingCache() {
+  static MappingCache* cache = new MappingCache();
+  return *cache;
+}
+
+}  // namespace
 #endif  // defined(__linux__)
 
 ABSL_CONST_INIT const absl::string_view kProfileDropFrames =
@@ -400,70 +524,21 @@ void ProfileBuilder::InternCallstack(absl::Span<const void* const> stack,
 
 void ProfileBuilder::AddCurrentMappings() {
 #if defined(__linux__)
-  auto dl_iterate_callback = +[](dl_phdr_info* info, size_t size, void* data) {
-    // Skip dummy entry introduced since glibc 2.18.
-    if (info->dlpi_phdr == nullptr && info->dlpi_phnum == 0) {
-      return 0;
-    }
-
-    ProfileBuilder& builder = *static_cast<ProfileBuilder*>(data);
-    const bool is_main_executable = builder.profile_->mapping_size() == 0;
-
-    // Evaluate all the loadable segments.
-    for (int i = 0; i < info->dlpi_phnum; ++i) {
-      if (info->dlpi_phdr[i].p_type != PT_LOAD) {
-        continue;
-      }
-      const ElfW(Phdr)* pt_load = &info->dlpi_phdr[i];
-
-      CHECK_CONDITION(pt_load != nullptr);
-
-      // Extract data.
-      const size_t memory_start = info->dlpi_addr + pt_load->p_vaddr;
-      const size_t memory_limit = memory_start + pt_load->p_memsz;
-      const size_t file_offset = pt_load->p_offset;
-
-      // Storage for path to executable as dlpi_name isn't populated for the
-      // main executable.  +1 to allow for the null terminator that readlink
-      // does not add.
-      char self_filename[PATH_MAX + 1];
-      const char* filename = info->dlpi_name;
-      if (filename == nullptr || filename[0] == '\0') {
-        // This is either the main executable or the VDSO.  The main executable
-        // is always the first entry processed by callbacks.
-        if (is_main_executable) {
-          // This is the main executable.
-          ssize_t ret = readlink("/proc/self/exe", self_filename,
-                                 sizeof(self_filename) - 1);
-          if (ret >= 0 && ret < sizeof(self_filename)) {
-            self_filename[ret] = '\0';
-            filename = self_filename;
-          }
-        } else {
-          // This is the VDSO.
-          filename = GetSoName(info);
-        }
-      }
-
-      char resolved_path[PATH_MAX];
-      absl::string_view resolved_filename;
-      if (realpath(filename, resolved_path)) {
-        resolved_filename = resolved_path;
-      } else {
-        resolved_filename = filename;
-      }
-
-      const std::string build_id = GetBuildId(info);
-
-      // Add to profile.
-      builder.AddMapping(memory_start, memory_limit, file_offset,
-                         resolved_filename, build_id);
-    }
-    // Keep going.
-    return 0;
-  };
+  const std::optional<LoadedObjectCounts> counts = GetLoadedObjectCounts();
+  MappingCache& cache = GetMappingCache();
+  absl::MutexLock l(&cache.mu);
+  // A dlopen or dlclose racing with the walk below leaves the cache tagged
+  // with older counts than its mappings, so it is only walked again early.
+  if (!counts.has_value() || !cache.counts.has_value() ||
+      *counts != *cache.counts) {
+    cache.mappings = ReadCurrentMappings();
+    cache.counts = counts;
+  }
 
-  dl_iterate_phdr(dl_iterate_callback, this);
+  for (const CachedMapping& mapping : cache.mappings) {
+    AddMapping(mapping.memory_start, mapping.memory_limit, mapping.file_offset,
+               mapping.filename, mapping.build_id);
+  }
 #endif  // defined(__linux__)
 }
 
@@ -527,6 +602,14 @@ static void MakeLifetimeProfileProto(const tcmalloc::Profile& profile,
   const int active_thread_id = builder->InternString("active thread");
   const int callstack_pair_id = builder->InternString("callstack-pair-id");
   const int none_id = builder->InternString("none");
+  // One label per lifetime histogram bucket, named for its lower bound.
+  int lifetime_bucket_ids[tcmalloc::Profile::Sample::kLifetimeHistogramBuckets];
+  uint64_t lower_bound_ns = 1;
+  for (int& id : lifetime_bucket_ids) {
+    id = builder->InternString(
+        absl::StrCat("lifetime_ge_", lower_bound_ns, "ns"));
+    lower_bound_ns *= 10;
+  }
 
   profile.Iterate([&](const tcmalloc::Profile::Sample& entry) {
     perftools::profiles::Sample& sample = *converted.add_sample();
@@ -576,6 +659,11 @@ static void MakeLifetimeProfileProto(const tcmalloc::Profile& profile,
                        absl::ToInt64Nanoseconds(entry.min_lifetime));
     add_positive_label(max_lifetime_id, nanoseconds_id,
                        absl::ToInt64Nanoseconds(entry.max_lifetime));
+    for (int i = 0; i < tcmalloc::Profile::Sample::kLifetimeHistogramBuckets;
+         ++i) {
+      add_positive_label(lifetime_bucket_ids[i], count_id,
+                         entry.lifetime_histogram[i]);
+    }
 
     add_optional_string_label(active_cpu_id,
                               entry.allocator_deallocator_physical_cpu_matched,
@@ -623,6 +711,50 @@ static void MakeLifetimeProfileProto(const tcmalloc::Profile& profile,
   });
 }
 
+static void MakeLockContentionProfileProto(const tcmalloc::Profile& profile,
+                                           ProfileBuilder* builder) {
+  CHECK_CONDITION(builder != nullptr);
+  perftools::profiles::Profile& converted = builder->profile();
+  perftools::profiles::ValueType* period_type = converted.mutable_period_type();
+
+  const int contentions_id = builder->InternString("contentions");
+  const int count_id = builder->InternString("count");
+  const int delay_id = builder->InternString("delay");
+  const int nanoseconds_id = builder->InternString("nanoseconds");
+  const int lock_id = builder->InternString("lock");
+
+  period_type->set_type(contentions_id);
+  period_type->set_unit(count_id);
+  converted.set_period(1);
+
+  for (const auto& [type, unit] : {std::pair{contentions_id, count_id},
+                                   {delay_id, nanoseconds_id}}) {
+    perftools::profiles::ValueType* sample_type = converted.add_sample_type();
+    sample_type->set_type(type);
+    sample_type->set_unit(unit);
+  }
+
+  converted.set_default_sample_type(delay_id);
+  converted.set_duration_nanos(absl::ToInt64Nanoseconds(profile.Duration()));
+  converted.set_drop_frames(builder->InternString(kProfileDropFrames));
+
+  profile.Iterate([&](const tcmalloc::Profile::Sample& entry) {
+    perftools::profiles::Sample& sample = *converted.add_sample();
+
+    CHECK_CONDITION(entry.depth <= ABSL_ARRAYSIZE(entry.stack));
+    builder->InternCallstack(absl::MakeSpan(entry.stack, entry.depth), sample);
+
+    sample.add_value(entry.count);
+    sample.add_value(entry.sum);
+
+    if (entry.contended_lock != nullptr) {
+      perftools::profiles::Label& label = *sample.add_label();
+      label.set_key(lock_id);
+      label.set_str(builder->InternString(entry.contended_lock));
+    }
+  });
+}
+
 std::unique_ptr<perftools::profiles::Profile> ProfileBuilder::Finalize() && {
   return std::move(profile_);
 }
@@ -638,6 +770,11 @@ absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
     return std::move(builder).Finalize();
   }
 
+  if (profile.Type() == ProfileType::kLockContention) {
+    MakeLockContentionProfileProto(profile, &builder);
+    return std::move(builder).Finalize();
+  }
+
   const int alignment_id = builder.InternString("alignment");
   const int bytes_id = builder.InternString("bytes");
   const int count_id = builder.InternString("count");
@@ -708,11 +845,13 @@ absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
   int default_sample_type_id;
   switch (profile.Type()) {
     case tcmalloc::ProfileType::kFragmentation:
+    case tcmalloc::ProfileType::kHugePageFragmentation:
     case tcmalloc::ProfileType::kHeap:
     case tcmalloc::ProfileType::kPeakHeap:
       default_sample_type_id = space_id;
       break;
     case tcmalloc::ProfileType::kAllocations:
+    case tcmalloc::ProfileType::kAllocationCounts:
       default_sample_type_id = objects_id;
       break;
     default:
@@ -763,6 +902,11 @@ absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
     add_positive_label(request_id, bytes_id, entry.requested_size);
     add_positive_label(alignment_id, bytes_id, entry.requested_alignment);
     add_positive_label(size_returning_id, 0, entry.requested_size_returning);
+    for (const ProfileLabel& l : entry.labels) {
+      perftools::profiles::Label& label = *sample.add_label();
+      label.set_key(builder.InternString(l.key));
+      label.set_str(builder.InternString(l.value));
+    }
     // TODO(b/259585789): Remove all of these when sample type rollout is
     // complete.
     if (data.resident_size.has_value()) {
@@ -95,6 +95,30 @@ TEST(ProfileBuilderTest, Mappings) {
   EXPECT_THAT(mapping_ids, Not(testing::Contains(0)));
 }
 
+TEST(ProfileBuilderTest, CachedMappings) {
+  // The second builder reuses the mappings read by the first, as nothing is
+  // loaded or unloaded in between.
+  auto mappings = [] {
+    ProfileBuilder builder;
+    builder.AddCurrentMappings();
+    auto profile = std::move(builder).Finalize();
+    std::vector<std::tuple<uint64_t, uint64_t, uint64_t, std::string,
+                           std::string>>
+        result;
+    for (const auto& mapping : profile->mapping()) {
+      result.emplace_back(mapping.memory_start(), mapping.memory_limit(),
+                          mapping.file_offset(),
+                          profile->string_table(mapping.filename()),
+                          profile->string_table(mapping.build_id()));
+    }
+    return result;
+  };
+
+  const auto first = mappings();
+  EXPECT_FALSE(first.empty());
+  EXPECT_EQ(mappings(), first);
+}
+
 TEST(ProfileBuilderTest, LocationTableNoMappings) {
   const uintptr_t kAddress = uintptr_t{0x150};
 
@@ -647,6 +671,55 @@ TEST(ProfileBuilderTest, PeakHeapProfile) {
             converted.sample(1).location_id(0));
 }
 
+TEST(ProfileBuilderTest, ProfileLabels) {
+  static constexpr ProfileLabel kLabels[] = {{"rpc_method", "Search"},
+                                             {"tenant", "test"}};
+  auto fake_profile = std::make_unique<FakeProfile>();
+  fake_profile->SetType(ProfileType::kAllocations);
+  fake_profile->SetDuration(absl::Milliseconds(1500));
+
+  // Samples that differ only in their labels are not merged.
+  std::vector<Profile::Sample> samples(2);
+  for (auto& sample : samples) {
+    sample.sum = 1024;
+    sample.count = 64;
+    sample.requested_size = 16;
+    sample.allocated_size = 16;
+    sample.depth = 3;
+    sample.stack[0] = absl::bit_cast<void*>(uintptr_t{0x12345});
+    sample.stack[1] = absl::bit_cast<void*>(uintptr_t{0x45123});
+    sample.stack[2] = reinterpret_cast<void*>(&ProfileAccessor::MakeProfile);
+    sample.access_hint = hot_cold_t{0};
+    sample.access_allocated = Profile::Sample::Access::Hot;
+  }
+  samples[0].labels = kLabels;
+
+  fake_profile->SetSamples(std::move(samples));
+  Profile profile = ProfileAccessor::MakeProfile(std::move(fake_profile));
+  auto converted_or = MakeProfileProto(profile);
+  ASSERT_TRUE(converted_or.ok());
+  const auto& converted = **converted_or;
+
+  SampleLabels extracted;
+  {
+    SCOPED_TRACE("Profile");
+    ASSERT_NO_FATAL_FAILURE(CheckAndExtractSampleLabels(converted, extracted));
+  }
+
+  EXPECT_THAT(
+      extracted,
+      UnorderedElementsAre(
+          UnorderedElementsAre(
+              Pair("bytes", 16), Pair("request", 16),
+              Pair("rpc_method", "Search"), Pair("tenant", "test"),
+              Pair("access_hint", 0), Pair("access_allocated", "hot"),
+              Pair("guarded_status", "Unknown")),
+          UnorderedElementsAre(Pair("bytes", 16), Pair("request", 16),
+                               Pair("access_hint", 0),
+                               Pair("access_allocated", "hot"),
+                               Pair("guarded_status", "Unknown"))));
+}
+
 TEST(ProfileBuilderTest, LifetimeProfile) {
   constexpr absl::Duration kDuration = absl::Milliseconds(1500);
   auto fake_profile = std::make_unique<FakeProfile>();
@@ -57,10 +57,24 @@ class Bitmap {
   // Clears the lowest set bit. Special case is faster than more flexible code.
   void ClearLowestBit();
 
+  // Clears the <n> lowest set bits (or all set bits, if there are fewer),
+  // calling f(index) for each of them in increasing order.  Returns the number
+  // of bits cleared.  Equivalent to, but faster than, repeated FindSet(0) and
+  // ClearLowestBit(): each word is scanned once, with one countr_zero per set
+  // bit.
+  template <typename F>
+  size_t ClearLowestBits(size_t n, F f);
+
   // If there is at least one free range at or after <start>,
   // put it in *index, *length and return true; else return false.
   bool NextFreeRange(size_t start, size_t* index, size_t* length) const;
 
+  // Calls f(index, length) for each maximal range of clear bits, in increasing
+  // order.  Equivalent to, but faster than, iterating with NextFreeRange: each
+  // word is scanned once, with one countr_zero per range boundary.
+  template <typename F>
+  void ForEachClearRange(F f) const;
+
   // Returns index of the first {true, false} bit >= index, or N if none.
   size_t FindSet(size_t index) const;
   size_t FindClear(size_t index) const;
@@ -121,6 +135,25 @@ class RangeTracker {
   // was the returned value from a call to FindAndMark.
   // Unmarks it.
   void Unmark(size_t index, size_t n);
+
+  // Returns true if [index, index + n) lies within the tracker and is fully
+  // unmarked.
+  bool IsFree(size_t index, size_t n) const;
+
+  // REQUIRES: [index, index + n) was returned by a call to FindAndMark (and
+  // possibly grown by Extend), and IsFree(index + n, delta).
+  //
+  // Marks the <delta> bits following the range as part of the same
+  // allocation; it must later be unmarked as [index, index + n + delta).
+  void Extend(size_t index, size_t n, size_t delta);
+
+  // REQUIRES: [index, index + n) was returned by a call to FindAndMark (and
+  // possibly grown by Extend or shrunk by Shrink), and 0 < new_n < n.
+  //
+  // Unmarks the bits of the range past its first <new_n>; the allocation must
+  // later be unmarked as [index, index + new_n).
+  void Shrink(size_t index, size_t n, size_t new_n);
+
   // If there is at least one free range at or after <start>,
   // put it in *index, *length and return true; else return false.
   bool NextFreeRange(size_t start, size_t* index, size_t* length) const;
@@ -204,10 +237,7 @@ inline size_t RangeTracker<N>::FindAndMark(size_t n) {
   // TODO(b/134691947): shortest? lowest-addressed?
   size_t best_index = N;
   size_t best_len = 2 * N;
-  // Iterate over free ranges:
-  size_t index = 0, len;
-
-  while (bits_.NextFreeRange(index, &index, &len)) {
+  bits_.ForEachClearRange([&](size_t index, size_t len) {
     if (len > longest_len) {
       second_len = longest_len;
       longest_len = len;
@@ -219,9 +249,7 @@ inline size_t RangeTracker<N>::FindAndMark(size_t n) {
       best_index = index;
       best_len = len;
     }
-
-    index += len;
-  }
+  });
 
   CHECK_CONDITION(best_index < N);
   bits_.SetRange(best_index, n);
@@ -255,6 +283,41 @@ inline void RangeTracker<N>::Unmark(size_t index, size_t n) {
   }
 }
 
+template <size_t N>
+inline bool RangeTracker<N>::IsFree(size_t index, size_t n) const {
+  ASSERT(n > 0);
+  return index < N && n <= N - index && bits_.FindSet(index) >= index + n;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::Extend(size_t index, size_t n, size_t delta) {
+  ASSERT(bits_.FindClear(index) >= index + n);
+  ASSERT(IsFree(index + n, delta));
+  bits_.SetRange(index + n, delta);
+  nused_ += delta;
+
+  // We may have shortened the longest free range; recompute it.
+  size_t longest = 0;
+  bits_.ForEachClearRange(
+      [&](size_t, size_t len) { longest = std::max(longest, len); });
+  longest_free_ = longest;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::Shrink(size_t index, size_t n, size_t new_n) {
+  ASSERT(0 < new_n && new_n < n);
+  ASSERT(bits_.FindClear(index) >= index + n);
+  bits_.ClearRange(index + new_n, n - new_n);
+  nused_ -= n - new_n;
+
+  // The freed bits may have joined the free range that follows them.
+  const size_t lim = bits_.FindSet(index + new_n);
+  const size_t freed = lim - (index + new_n);
+  if (freed > longest_free()) {
+    longest_free_ = freed;
+  }
+}
+
 // If there is at least one free range at or after <start>,
 // put it in *index, *length and return true; else return false.
 template <size_t N>
@@ -385,6 +448,22 @@ inline void Bitmap<N>::ClearLowestBit() {
   }
 }
 
+template <size_t N>
+template <typename F>
+inline size_t Bitmap<N>::ClearLowestBits(size_t n, F f) {
+  size_t count = 0;
+  for (size_t i = 0; i < kWords && count < n; ++i) {
+    size_t word = bits_[i];
+    while (word != 0 && count < n) {
+      f(i * kWordSize + absl::countr_zero(word));
+      word &= word - 1;
+      ++count;
+    }
+    bits_[i] = word;
+  }
+  return count;
+}
+
 template <size_t N>
 template <bool Value>
 inline void Bitmap<N>::SetRangeValue(size_t index, size_t n) {
@@ -416,6 +495,39 @@ inline bool Bitmap<N>::NextFreeRange(size_t start, size_t* index,
   return true;
 }
 
+template <size_t N>
+template <typename F>
+inline void Bitmap<N>::ForEachClearRange(F f) const {
+  // Bit b of a word's edges is set where a range of clear bits begins or ends
+  // (exclusive) at b: where the bit differs from the one below it, carried
+  // over from the previous word.  Edges alternate, starting with a beginning.
+  size_t carry = 0;
+  size_t start = 0;
+  bool in_range = false;
+  for (size_t i = 0; i < kWords; ++i) {
+    size_t clear = ~bits_[i];
+    if (kDeadBits > 0 && i == kWords - 1) {
+      // Treat the dead bits as set, so that the last range ends at N.
+      clear &= ~static_cast<size_t>(0) >> kDeadBits;
+    }
+    size_t edges = clear ^ ((clear << 1) | carry);
+    carry = clear >> (kWordSize - 1);
+    while (edges != 0) {
+      const size_t index = i * kWordSize + absl::countr_zero(edges);
+      if (in_range) {
+        f(start, index - start);
+      } else {
+        start = index;
+      }
+      in_range = !in_range;
+      edges &= edges - 1;
+    }
+  }
+  if (in_range) {
+    f(start, N - start);
+  }
+}
+
 template <size_t N>
 inline size_t Bitmap<N>::FindSet(size_t index) const {
   return FindValue<true>(index);
@@ -60,6 +60,7 @@ static void BM_MarkUnmark(benchmark::State& state) {
 }
 
 BENCHMARK_TEMPLATE(BM_MarkUnmark, 256);
+BENCHMARK_TEMPLATE(BM_MarkUnmark, 512);
 BENCHMARK_TEMPLATE(BM_MarkUnmark, 256 * 32);
 
 template <size_t N, size_t K>
@@ -109,6 +110,7 @@ static void BM_MarkUnmarkChunks(benchmark::State& state) {
 
 BENCHMARK_TEMPLATE(BM_MarkUnmarkChunks, 64);
 BENCHMARK_TEMPLATE(BM_MarkUnmarkChunks, 256);
+BENCHMARK_TEMPLATE(BM_MarkUnmarkChunks, 512);
 BENCHMARK_TEMPLATE(BM_MarkUnmarkChunks, 256 * 32);
 
 template <size_t N>
@@ -309,6 +311,22 @@ ABSL_ATTRIBUTE_NOINLINE size_t DoScanBenchmark(Bitmap<N>* set,
   return total;
 }
 
+// As DoScanBenchmark, with ForEachClearRange rather than NextFreeRange.
+template <size_t N>
+ABSL_ATTRIBUTE_NOINLINE size_t DoForEachBenchmark(Bitmap<N>* set,
+                                                  benchmark::State& state) {
+  size_t total = 0;
+  for (auto s : state) {
+    set->ForEachClearRange([&](size_t index, size_t len) {
+      benchmark::DoNotOptimize(index);
+      benchmark::DoNotOptimize(len);
+      total++;
+    });
+  }
+
+  return total;
+}
+
 template <size_t N>
 static void BM_ScanEmpty(benchmark::State& state) {
   Bitmap<N> set;
@@ -341,7 +359,7 @@ BENCHMARK_TEMPLATE(BM_ScanFull, 64);
 BENCHMARK_TEMPLATE(BM_ScanFull, 256);
 BENCHMARK_TEMPLATE(BM_ScanFull, 256 * 32);
 
-template <size_t N>
+template <size_t N, bool ForEach>
 static void BM_ScanRandom(benchmark::State& state) {
   Bitmap<N> set;
   volatile size_t to_set = 0;
@@ -352,15 +370,21 @@ static void BM_ScanRandom(benchmark::State& state) {
   for (int i = 0; i < N; ++i) {
     if (absl::Bernoulli(rng, 1.0 / 2)) set.SetBit(i);
   }
-  size_t total = DoScanBenchmark<N>(&set, state);
+  size_t total = ForEach ? DoForEachBenchmark<N>(&set, state)
+                         : DoScanBenchmark<N>(&set, state);
   state.SetItemsProcessed(total);
 }
 
-BENCHMARK_TEMPLATE(BM_ScanRandom, 64);
-BENCHMARK_TEMPLATE(BM_ScanRandom, 256);
-BENCHMARK_TEMPLATE(BM_ScanRandom, 256 * 32);
+BENCHMARK_TEMPLATE(BM_ScanRandom, 64, false);
+BENCHMARK_TEMPLATE(BM_ScanRandom, 256, false);
+BENCHMARK_TEMPLATE(BM_ScanRandom, 512, false);
+BENCHMARK_TEMPLATE(BM_ScanRandom, 256 * 32, false);
+BENCHMARK_TEMPLATE(BM_ScanRandom, 64, true);
+BENCHMARK_TEMPLATE(BM_ScanRandom, 256, true);
+BENCHMARK_TEMPLATE(BM_ScanRandom, 512, true);
+BENCHMARK_TEMPLATE(BM_ScanRandom, 256 * 32, true);
 
-template <size_t N>
+template <size_t N, bool ForEach>
 static void BM_ScanChunks(benchmark::State& state) {
   Bitmap<N> set;
   volatile size_t to_set = 0;
@@ -381,13 +405,19 @@ static void BM_ScanChunks(benchmark::State& state) {
     }
     index = limit;
   }
-  size_t total = DoScanBenchmark<N>(&set, state);
+  size_t total = ForEach ? DoForEachBenchmark<N>(&set, state)
+                         : DoScanBenchmark<N>(&set, state);
   state.SetItemsProcessed(total);
 }
 
-BENCHMARK_TEMPLATE(BM_ScanChunks, 64);
-BENCHMARK_TEMPLATE(BM_ScanChunks, 256);
-BENCHMARK_TEMPLATE(BM_ScanChunks, 256 * 32);
+BENCHMARK_TEMPLATE(BM_ScanChunks, 64, false);
+BENCHMARK_TEMPLATE(BM_ScanChunks, 256, false);
+BENCHMARK_TEMPLATE(BM_ScanChunks, 512, false);
+BENCHMARK_TEMPLATE(BM_ScanChunks, 256 * 32, false);
+BENCHMARK_TEMPLATE(BM_ScanChunks, 64, true);
+BENCHMARK_TEMPLATE(BM_ScanChunks, 256, true);
+BENCHMARK_TEMPLATE(BM_ScanChunks, 512, true);
+BENCHMARK_TEMPLATE(BM_ScanChunks, 256 * 32, true);
 
 }  // namespace
 }  // namespace tcmalloc_internal
@@ -17,12 +17,14 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <utility>
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/container/fixed_array.h"
+#include "absl/random/distributions.h"
 #include "absl/random/random.h"
 
 namespace tcmalloc {
@@ -121,6 +123,34 @@ TEST_F(BitmapTest, CheckClearLowestBit) {
   }
 }
 
+TEST_F(BitmapTest, ClearLowestBits) {
+  absl::BitGen rng;
+  for (int iter = 0; iter < 100; ++iter) {
+    Bitmap<253> map, expected;
+    for (size_t i = 0; i < map.size(); ++i) {
+      if (absl::Bernoulli(rng, 0.3)) {
+        map.SetBit(i);
+        expected.SetBit(i);
+      }
+    }
+    const size_t set = map.CountBits(0, map.size());
+    const size_t n = absl::Uniform<size_t>(rng, 0, map.size());
+
+    std::vector<size_t> indices;
+    const size_t cleared =
+        map.ClearLowestBits(n, [&](size_t index) { indices.push_back(index); });
+    EXPECT_EQ(cleared, std::min(n, set));
+    ASSERT_EQ(indices.size(), cleared);
+    for (size_t index : indices) {
+      EXPECT_EQ(index, expected.FindSet(0));
+      expected.ClearLowestBit();
+    }
+    for (size_t i = 0; i < map.size(); ++i) {
+      EXPECT_EQ(map.GetBit(i), expected.GetBit(i)) << i;
+    }
+  }
+}
+
 TEST_F(BitmapTest, GetBitOneSet) {
   const size_t N = 251;
   for (size_t s = 0; s < N; s++) {
@@ -250,6 +280,56 @@ TEST_F(BitmapTest, CountBitsFuzz) {
   }
 }
 
+template <size_t N>
+void CheckForEachClearRange(absl::BitGen& rng) {
+  for (int iter = 0; iter < 100; ++iter) {
+    Bitmap<N> map;
+    // Vary the density, so that we see both long and short ranges.
+    const double p = absl::Uniform(rng, 0.0, 1.0);
+    for (size_t i = 0; i < N; ++i) {
+      if (absl::Bernoulli(rng, p)) map.SetBit(i);
+    }
+
+    std::vector<std::pair<size_t, size_t>> expected, actual;
+    size_t index = 0, len;
+    while (map.NextFreeRange(index, &index, &len)) {
+      expected.push_back({index, len});
+      index += len;
+    }
+    map.ForEachClearRange(
+        [&](size_t index, size_t len) { actual.push_back({index, len}); });
+    EXPECT_EQ(expected, actual);
+  }
+}
+
+TEST_F(BitmapTest, ForEachClearRange) {
+  Bitmap<253> map;
+  std::vector<std::pair<size_t, size_t>> ranges;
+  auto record = [&](size_t index, size_t len) {
+    ranges.push_back({index, len});
+  };
+  map.ForEachClearRange(record);
+  EXPECT_THAT(ranges, ElementsAre(Pair(0, 253)));
+
+  ranges.clear();
+  map.SetBit(0);
+  map.SetRange(63, 2);
+  map.SetBit(252);
+  map.ForEachClearRange(record);
+  EXPECT_THAT(ranges, ElementsAre(Pair(1, 62), Pair(65, 187)));
+
+  ranges.clear();
+  map.SetRange(0, 253);
+  map.ForEachClearRange(record);
+  EXPECT_THAT(ranges, ElementsAre());
+
+  absl::BitGen rng;
+  CheckForEachClearRange<64>(rng);
+  CheckForEachClearRange<253>(rng);
+  CheckForEachClearRange<256>(rng);
+  CheckForEachClearRange<512>(rng);
+}
+
 class RangeTrackerTest : public ::testing::Test {
  protected:
   std::vector<std::pair<size_t, size_t>> FreeRanges() {
@@ -289,6 +369,39 @@ TEST_F(RangeTrackerTest, Trivial) {
   EXPECT_THAT(FreeRanges(), ElementsAre(Pair(0, 300)));
 }
 
+TEST_F(RangeTrackerTest, Extend) {
+  ASSERT_EQ(0, range_.FindAndMark(5));
+  ASSERT_EQ(5, range_.FindAndMark(5));
+  range_.Unmark(0, 5);
+
+  EXPECT_TRUE(range_.IsFree(0, 5));
+  EXPECT_FALSE(range_.IsFree(0, 6));
+  EXPECT_TRUE(range_.IsFree(10, kBits - 10));
+  EXPECT_FALSE(range_.IsFree(10, kBits - 9));
+
+  range_.Extend(5, 5, 100);
+  EXPECT_EQ(105, range_.used());
+  EXPECT_EQ(kBits - 110, range_.longest_free());
+  EXPECT_THAT(FreeRanges(), ElementsAre(Pair(0, 5), Pair(110, kBits - 110)));
+}
+
+TEST_F(RangeTrackerTest, Shrink) {
+  ASSERT_EQ(0, range_.FindAndMark(10));
+  ASSERT_EQ(10, range_.FindAndMark(100));
+  ASSERT_EQ(110, range_.FindAndMark(10));
+  range_.Unmark(110, 10);
+
+  range_.Shrink(10, 100, 40);
+  EXPECT_EQ(50, range_.used());
+  EXPECT_EQ(2, range_.allocs());
+  EXPECT_EQ(kBits - 50, range_.longest_free());
+  EXPECT_THAT(FreeRanges(), ElementsAre(Pair(50, kBits - 50)));
+
+  range_.Unmark(10, 40);
+  EXPECT_EQ(10, range_.used());
+  EXPECT_EQ(1, range_.allocs());
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -0,0 +1,209 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/sample_event_ring.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "absl/functional/function_ref.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/util.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+static_assert(sizeof(SampleRingFileHeader) <= SampleEventRing::kControlBytes);
+static_assert(sizeof(SampleRingControl) <= SampleEventRing::kControlBytes);
+
+size_t SampleEventRing::BytesFor(int num_rings, size_t ring_bytes) {
+  return kControlBytes + num_rings * (kControlBytes + ring_bytes);
+}
+
+bool SampleEventRing::Init(void* base, int num_rings, size_t ring_bytes) {
+  if (enabled() || num_rings <= 0 ||
+      static_cast<size_t>(num_rings) > kMaxRings || ring_bytes == 0 ||
+      ring_bytes % 8 != 0) {
+    return false;
+  }
+
+  char* const start = static_cast<char*>(base);
+  num_rings_ = num_rings;
+  ring_bytes_ = ring_bytes;
+
+  SampleRingFileHeader* header = new (start) SampleRingFileHeader{};
+  header->version = kSampleRingVersion;
+  header->num_rings = num_rings;
+  header->ring_bytes = ring_bytes;
+  header->ring_stride = kControlBytes + ring_bytes;
+  header->first_ring = kControlBytes;
+  for (int ring = 0; ring < num_rings; ++ring) {
+    new (start + header->first_ring + ring * header->ring_stride)
+        SampleRingControl{};
+  }
+
+  header->magic.store(kSampleRingMagic, std::memory_order_release);
+  header_.store(header, std::memory_order_release);
+  return true;
+}
+
+bool SampleEventRing::InitFromFile(const char* path, int num_rings,
+                                   size_t ring_bytes) {
+  const size_t bytes = BytesFor(num_rings, ring_bytes);
+  const int fd =
+      signal_safe_open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, bytes) == 0) {
+    base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  // The mapping, if any, keeps the file alive.
+  signal_safe_close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  if (!Init(base, num_rings, ring_bytes)) {
+    munmap(base, bytes);
+    return false;
+  }
+  return true;
+}
+
+SampleRingControl* SampleEventRing::control(int ring) const {
+  SampleRingFileHeader* header = header_.load(std::memory_order_relaxed);
+  return reinterpret_cast<SampleRingControl*>(
+      reinterpret_cast<char*>(header) + header->first_ring +
+      ring * header->ring_stride);
+}
+
+char* SampleEventRing::data(int ring) const {
+  return reinterpret_cast<char*>(control(ring)) + kControlBytes;
+}
+
+void SampleEventRing::Record(SampleEventType type, int cpu, SampleEvent event,
+                             absl::Span<void* const> stack) {
+  if (!enabled()) {
+    return;
+  }
+
+  const int ring = cpu >= 0 ? cpu % num_rings_ : 0;
+  const uint64_t size = sizeof(SampleEvent) + stack.size() * sizeof(uint64_t);
+  SampleRingControl* c = control(ring);
+  if (size > ring_bytes_) {
+    c->lost.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  event.header = {type, static_cast<uint32_t>(size)};
+  event.cpu = cpu;
+  event.depth = stack.size();
+
+  AllocationGuardSpinLockHolder h(&locks_[ring].lock);
+  uint64_t head = c->head.load(std::memory_order_relaxed);
+  const uint64_t tail = c->tail.load(std::memory_order_acquire);
+  const uint64_t contiguous = ring_bytes_ - head % ring_bytes_;
+  const uint64_t padding = contiguous < size ? contiguous : 0;
+  if (head + padding + size - tail > ring_bytes_) {
+    c->lost.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  char* d = data(ring);
+  if (padding > 0) {
+    const SampleRecordHeader pad = {SampleEventType::kPadding,
+                                    static_cast<uint32_t>(padding)};
+    memcpy(d + head % ring_bytes_, &pad, sizeof(pad));
+    head += padding;
+  }
+  char* out = d + head % ring_bytes_;
+  memcpy(out, &event, sizeof(event));
+  uint64_t* pcs = reinterpret_cast<uint64_t*>(out + sizeof(event));
+  for (size_t i = 0; i < stack.size(); ++i) {
+    pcs[i] = reinterpret_cast<uintptr_t>(stack[i]);
+  }
+  c->head.store(head + size, std::memory_order_release);
+}
+
+SampleEventRingReader::SampleEventRingReader(void* base)
+    : header_(static_cast<SampleRingFileHeader*>(base)) {}
+
+bool SampleEventRingReader::valid() const {
+  return header_->magic.load(std::memory_order_acquire) == kSampleRingMagic &&
+         header_->version == kSampleRingVersion;
+}
+
+int SampleEventRingReader::num_rings() const { return header_->num_rings; }
+
+SampleRingControl* SampleEventRingReader::control(int ring) const {
+  return reinterpret_cast<SampleRingControl*>(
+      reinterpret_cast<char*>(header_) + header_->first_ring +
+      ring * header_->ring_stride);
+}
+
+const char* SampleEventRingReader::data(int ring) const {
+  return reinterpret_cast<const char*>(control(ring)) +
+         SampleEventRing::kControlBytes;
+}
+
+size_t SampleEventRingReader::Read(
+    int ring, absl::FunctionRef<void(const SampleEvent& event,
+                                     absl::Span<const uint64_t> stack)>
+                  f) {
+  SampleRingControl* c = control(ring);
+  const char* d = data(ring);
+  const uint64_t ring_bytes = header_->ring_bytes;
+  uint64_t tail = c->tail.load(std::memory_order_relaxed);
+  const uint64_t head = c->head.load(std::memory_order_acquire);
+
+  size_t events = 0;
+  while (tail < head) {
+    const char* record = d + tail % ring_bytes;
+    SampleRecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    if (header.size == 0) {
+      // Corrupted; drop the rest rather than spin.
+      tail = head;
+      break;
+    }
+    if (header.type != SampleEventType::kPadding) {
+      const SampleEvent& event = *reinterpret_cast<const SampleEvent*>(record);
+      f(event, {reinterpret_cast<const uint64_t*>(record + sizeof(SampleEvent)),
+                event.depth});
+      ++events;
+    }
+    tail += header.size;
+  }
+  c->tail.store(tail, std::memory_order_release);
+  return events;
+}
+
+uint64_t SampleEventRingReader::lost(int ring) const {
+  return control(ring)->lost.load(std::memory_order_relaxed);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
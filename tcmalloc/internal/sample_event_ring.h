@@ -0,0 +1,186 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Per-CPU rings of sampled allocation and deallocation events, laid out in
+// shared memory so that a profiling agent in another process can consume them
+// without copying, in the manner of perf_event's mmap ring buffers.
+//
+// The memory starts with a SampleRingFileHeader, followed by `num_rings` rings
+// spaced `ring_stride` bytes apart from offset `first_ring`.  Each ring is a
+// SampleRingControl page followed by `ring_bytes` bytes of data.
+//
+// The producer appends records at `head` and the consumer releases them by
+// advancing `tail`; both only ever increase and are taken modulo `ring_bytes`
+// to index the data.  Records never wrap around the end of the data: if one
+// does not fit, the producer fills the rest of the ring with a padding record.
+// When the consumer falls behind, new records are dropped and counted in
+// `lost` rather than overwriting unread ones.
+
+#ifndef TCMALLOC_INTERNAL_SAMPLE_EVENT_RING_H_
+#define TCMALLOC_INTERNAL_SAMPLE_EVENT_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/functional/function_ref.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+inline constexpr uint64_t kSampleRingMagic = 0x474e495253434d54;  // "TMCSRING"
+inline constexpr uint32_t kSampleRingVersion = 1;
+
+struct SampleRingFileHeader {
+  // Written last, with release semantics, once the rings are ready.
+  std::atomic<uint64_t> magic;
+  uint32_t version;
+  uint32_t num_rings;
+  uint64_t ring_bytes;
+  uint64_t ring_stride;
+  uint64_t first_ring;
+};
+
+struct SampleRingControl {
+  // Written by the producer only.
+  alignas(64) std::atomic<uint64_t> head;
+  // Records dropped because the ring was full.
+  std::atomic<uint64_t> lost;
+  // Written by the consumer only.
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+enum class SampleEventType : uint32_t {
+  // Fills the end of the ring; skip `size` bytes.
+  kPadding = 0,
+  kAlloc = 1,
+  kFree = 2,
+};
+
+// Every record starts with this header.  `size` includes the header and is a
+// multiple of 8.
+struct SampleRecordHeader {
+  SampleEventType type;
+  uint32_t size;
+};
+
+struct SampleEvent {
+  SampleRecordHeader header;
+  // The CPU the event was recorded on, or -1 if unknown.
+  int32_t cpu;
+  // The number of program counters, each a uint64_t, following an allocation
+  // event.  Free events carry no stack.
+  uint32_t depth;
+  uint64_t address;
+  uint64_t requested_size;
+  uint64_t allocated_size;
+  // The expected number of bytes requested since the previous sample.
+  uint64_t weight;
+  // Identifies the stack of the allocation; the same for all events of
+  // allocations with equal stacks, and for their frees.
+  uint64_t stack_id;
+  // Unix time in nanoseconds.
+  int64_t time_ns;
+};
+
+static_assert(sizeof(SampleEvent) % 8 == 0);
+
+class SampleEventRing {
+ public:
+  static constexpr size_t kMaxRings = 256;
+  static constexpr size_t kControlBytes = 4096;
+  static constexpr size_t kDefaultRingBytes = 256 << 10;
+
+  constexpr SampleEventRing() = default;
+
+  SampleEventRing(const SampleEventRing&) = delete;
+  SampleEventRing& operator=(const SampleEventRing&) = delete;
+
+  // The bytes of memory needed for `num_rings` rings of `ring_bytes` each.
+  static size_t BytesFor(int num_rings, size_t ring_bytes);
+
+  // Lays out `num_rings` rings of `ring_bytes` each over `base`, which must be
+  // at least BytesFor(num_rings, ring_bytes) bytes and page-aligned.
+  // `ring_bytes` must be a multiple of 8.  Returns false, leaving the rings
+  // disabled, if the arguments are invalid.
+  bool Init(void* base, int num_rings, size_t ring_bytes);
+
+  // Creates (or truncates) the file at `path`, maps it shared and lays out the
+  // rings over it.  Returns false, leaving the rings disabled, on failure.
+  bool InitFromFile(const char* path, int num_rings, size_t ring_bytes);
+
+  bool enabled() const {
+    return header_.load(std::memory_order_acquire) != nullptr;
+  }
+
+  // Appends `event` and the program counters in `stack` to the ring of `cpu`,
+  // filling in the header, cpu and depth of the event.
+  void Record(SampleEventType type, int cpu, SampleEvent event,
+              absl::Span<void* const> stack);
+
+ private:
+  SampleRingControl* control(int ring) const;
+  char* data(int ring) const;
+
+  std::atomic<SampleRingFileHeader*> header_{nullptr};
+  int num_rings_ = 0;
+  uint64_t ring_bytes_ = 0;
+
+  // Serializes producers on the same ring, since threads may migrate between
+  // picking a ring and writing to it.
+  struct RingLock {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  };
+  RingLock locks_[kMaxRings];
+};
+
+// A consumer of the rings laid out over `base`, for agents and tests.
+class SampleEventRingReader {
+ public:
+  explicit SampleEventRingReader(void* base);
+
+  // Returns false if the rings at `base` are not initialized or are of an
+  // unknown version.
+  bool valid() const;
+  int num_rings() const;
+
+  // Calls `f` on every unread record of `ring`, then releases them.  Returns
+  // the number of events read.
+  size_t Read(int ring,
+              absl::FunctionRef<void(const SampleEvent& event,
+                                     absl::Span<const uint64_t> stack)>
+                  f);
+
+  // The number of events dropped by `ring` because it was full.
+  uint64_t lost(int ring) const;
+
+ private:
+  SampleRingControl* control(int ring) const;
+  const char* data(int ring) const;
+
+  SampleRingFileHeader* const header_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_SAMPLE_EVENT_RING_H_
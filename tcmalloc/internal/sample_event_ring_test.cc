@@ -0,0 +1,199 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/sample_event_ring.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using testing::ElementsAre;
+using testing::IsEmpty;
+
+class SampleEventRingTest : public testing::Test {
+ protected:
+  void* Map(int num_rings, size_t ring_bytes) {
+    bytes_ = SampleEventRing::BytesFor(num_rings, ring_bytes);
+    base_ = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    EXPECT_NE(base_, MAP_FAILED);
+    return base_;
+  }
+
+  ~SampleEventRingTest() override {
+    if (base_ != nullptr) munmap(base_, bytes_);
+  }
+
+  struct Read {
+    SampleEvent event;
+    std::vector<uint64_t> stack;
+  };
+
+  static std::vector<Read> ReadAll(SampleEventRingReader& reader, int ring) {
+    std::vector<Read> reads;
+    reader.Read(ring, [&](const SampleEvent& e, absl::Span<const uint64_t> s) {
+      reads.push_back({e, std::vector<uint64_t>(s.begin(), s.end())});
+    });
+    return reads;
+  }
+
+  static SampleEvent MakeEvent(uint64_t address) {
+    SampleEvent e = {};
+    e.address = address;
+    e.requested_size = 100;
+    e.allocated_size = 128;
+    e.weight = 2 << 20;
+    e.stack_id = 0x1234;
+    e.time_ns = 42;
+    return e;
+  }
+
+  void* base_ = nullptr;
+  size_t bytes_ = 0;
+};
+
+TEST_F(SampleEventRingTest, Disabled) {
+  SampleEventRing ring;
+  EXPECT_FALSE(ring.enabled());
+  // Recording without rings is a no-op.
+  ring.Record(SampleEventType::kAlloc, 0, MakeEvent(1), {});
+
+  void* base = Map(1, 4096);
+  EXPECT_FALSE(ring.Init(base, 0, 4096));
+  EXPECT_FALSE(ring.Init(base, 1, 4095));
+  EXPECT_FALSE(ring.enabled());
+  EXPECT_FALSE(SampleEventRingReader(base).valid());
+}
+
+TEST_F(SampleEventRingTest, RoundTrip) {
+  SampleEventRing ring;
+  void* base = Map(2, 4096);
+  ASSERT_TRUE(ring.Init(base, 2, 4096));
+  EXPECT_TRUE(ring.enabled());
+
+  SampleEventRingReader reader(base);
+  ASSERT_TRUE(reader.valid());
+  EXPECT_EQ(reader.num_rings(), 2);
+
+  void* stack[] = {reinterpret_cast<void*>(0x10), reinterpret_cast<void*>(0x20),
+                   reinterpret_cast<void*>(0x30)};
+  ring.Record(SampleEventType::kAlloc, 1, MakeEvent(0x1000), stack);
+  ring.Record(SampleEventType::kFree, 3, MakeEvent(0x1000), {});
+
+  EXPECT_THAT(ReadAll(reader, 0), IsEmpty());
+  // CPU 3 maps onto ring 1 as well.
+  std::vector<Read> reads = ReadAll(reader, 1);
+  ASSERT_EQ(reads.size(), 2);
+  EXPECT_EQ(reads[0].event.header.type, SampleEventType::kAlloc);
+  EXPECT_EQ(reads[0].event.cpu, 1);
+  EXPECT_EQ(reads[0].event.address, 0x1000);
+  EXPECT_EQ(reads[0].event.requested_size, 100);
+  EXPECT_EQ(reads[0].event.allocated_size, 128);
+  EXPECT_EQ(reads[0].event.weight, 2 << 20);
+  EXPECT_EQ(reads[0].event.stack_id, 0x1234);
+  EXPECT_EQ(reads[0].event.time_ns, 42);
+  EXPECT_THAT(reads[0].stack, ElementsAre(0x10, 0x20, 0x30));
+  EXPECT_EQ(reads[1].event.header.type, SampleEventType::kFree);
+  EXPECT_EQ(reads[1].event.cpu, 3);
+  EXPECT_THAT(reads[1].stack, IsEmpty());
+
+  // Records are only read once.
+  EXPECT_THAT(ReadAll(reader, 1), IsEmpty());
+  EXPECT_EQ(reader.lost(1), 0);
+}
+
+TEST_F(SampleEventRingTest, DropsWhenFull) {
+  constexpr size_t kRingBytes = 4 * sizeof(SampleEvent);
+  SampleEventRing ring;
+  void* base = Map(1, kRingBytes);
+  ASSERT_TRUE(ring.Init(base, 1, kRingBytes));
+  SampleEventRingReader reader(base);
+
+  for (int i = 0; i < 6; ++i) {
+    ring.Record(SampleEventType::kAlloc, 0, MakeEvent(i), {});
+  }
+  EXPECT_EQ(reader.lost(0), 2);
+
+  // The oldest records are kept.
+  std::vector<Read> reads = ReadAll(reader, 0);
+  ASSERT_EQ(reads.size(), 4);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(reads[i].event.address, i);
+  }
+}
+
+TEST_F(SampleEventRingTest, Wraps) {
+  constexpr size_t kRingBytes = 4 * sizeof(SampleEvent);
+  SampleEventRing ring;
+  void* base = Map(1, kRingBytes);
+  ASSERT_TRUE(ring.Init(base, 1, kRingBytes));
+  SampleEventRingReader reader(base);
+
+  void* stack[] = {reinterpret_cast<void*>(0x10)};
+  uint64_t address = 0;
+  for (int round = 0; round < 10; ++round) {
+    // Odd-sized records eventually leave a gap at the end of the ring, which
+    // is filled with padding.
+    ring.Record(SampleEventType::kAlloc, 0, MakeEvent(address), stack);
+    ring.Record(SampleEventType::kFree, 0, MakeEvent(address), {});
+    std::vector<Read> reads = ReadAll(reader, 0);
+    ASSERT_EQ(reads.size(), 2);
+    EXPECT_EQ(reads[0].event.address, address);
+    EXPECT_THAT(reads[0].stack, ElementsAre(0x10));
+    EXPECT_EQ(reads[1].event.address, address);
+    ++address;
+  }
+  EXPECT_EQ(reader.lost(0), 0);
+}
+
+TEST_F(SampleEventRingTest, SharedFile) {
+  const std::string path = absl::StrCat(testing::TempDir(), "/sample_ring");
+  SampleEventRing ring;
+  ASSERT_TRUE(ring.InitFromFile(path.c_str(), 2, 4096));
+  ring.Record(SampleEventType::kAlloc, 0, MakeEvent(0x2000), {});
+
+  // Another mapping of the file, as an agent would create, sees the records.
+  const int fd = open(path.c_str(), O_RDWR);
+  ASSERT_GE(fd, 0);
+  const size_t bytes = SampleEventRing::BytesFor(2, 4096);
+  void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  ASSERT_NE(base, MAP_FAILED);
+
+  SampleEventRingReader reader(base);
+  ASSERT_TRUE(reader.valid());
+  std::vector<Read> reads = ReadAll(reader, 0);
+  ASSERT_EQ(reads.size(), 1);
+  EXPECT_EQ(reads[0].event.address, 0x2000);
+  munmap(base, bytes);
+  unlink(path.c_str());
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
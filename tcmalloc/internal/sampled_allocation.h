@@ -15,10 +15,14 @@
 #ifndef TCMALLOC_INTERNAL_SAMPLED_ALLOCATION_H_
 #define TCMALLOC_INTERNAL_SAMPLED_ALLOCATION_H_
 
-#include <utility>
+#include <algorithm>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/sampled_allocation_recorder.h"
+#include "tcmalloc/internal/stack_trace_depot.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -35,8 +39,8 @@ struct SampledAllocation : public tcmalloc_internal::Sample<SampledAllocation> {
   // When no object is available on the freelist, we allocate for a new
   // SampledAllocation object and invoke this constructor with
   // `PrepareForSampling()`.
-  explicit SampledAllocation(StackTrace&& stack_trace) {
-    PrepareForSampling(std::move(stack_trace));
+  SampledAllocation(const SampleMetadata& metadata, const DepotStack* stack) {
+    PrepareForSampling(metadata, stack);
   }
 
   SampledAllocation(const SampledAllocation&) = delete;
@@ -47,13 +51,39 @@ struct SampledAllocation : public tcmalloc_internal::Sample<SampledAllocation> {
 
   // Prepares the state of the object. It is invoked when either a new sampled
   // allocation is constructed or when an object is revived from the freelist.
-  void PrepareForSampling(StackTrace&& stack_trace)
+  void PrepareForSampling(const SampleMetadata& metadata,
+                          const DepotStack* stack)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock) {
-    sampled_stack = std::move(stack_trace);
+    sampled_stack = metadata;
+    interned_stack = stack;
+    peak_copy = nullptr;
+    peak_prev = nullptr;
+    peak_next = nullptr;
   }
 
-  // The stack trace of the sampled allocation.
-  StackTrace sampled_stack = {};
+  // Returns the full stack trace of the sampled allocation.
+  StackTrace stack_trace() const {
+    StackTrace t;
+    static_cast<SampleMetadata&>(t) = sampled_stack;
+    absl::Span<void* const> stack = interned_stack->stack();
+    t.depth = stack.size();
+    std::copy(stack.begin(), stack.end(), t.stack);
+    return t;
+  }
+
+  // The metadata of the sampled allocation.
+  SampleMetadata sampled_stack = {};
+  // The stack of the sampled allocation, shared with other samples taken at
+  // the same stack.
+  const DepotStack* interned_stack = nullptr;
+
+  // Maintained by PeakHeapTracker, under its lock.  For a live sample, its
+  // copy in the current peak snapshot, if it has one.
+  SampledAllocation* peak_copy = nullptr;
+  // For a live sample without a copy, its links in the list of samples to add
+  // at the next peak.  For a copy, its link in the list of copies to drop.
+  SampledAllocation* peak_prev = nullptr;
+  SampledAllocation* peak_next = nullptr;
 };
 
 }  // namespace tcmalloc_internal
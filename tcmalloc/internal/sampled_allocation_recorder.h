@@ -93,6 +93,15 @@ class SampleRecorder {
   // Iterates over all the registered samples.
   void Iterate(const absl::FunctionRef<void(const T& sample)>& f);
 
+  // Acquires and releases the graveyard's lock around fork(), so that the
+  // child can still register and unregister samples.
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    graveyard_.lock.Lock();
+  }
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    graveyard_.lock.Unlock();
+  }
+
  private:
   void PushNew(T* sample);
   void PushDead(T* sample);
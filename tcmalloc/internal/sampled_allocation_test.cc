@@ -14,18 +14,31 @@
 
 #include "tcmalloc/internal/sampled_allocation.h"
 
+#include <stddef.h>
+
+#include <new>
+
 #include "gtest/gtest.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/debugging/stacktrace.h"
+#include "absl/types/span.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/stack_trace_depot.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
 namespace {
 
-StackTrace PrepareStackTrace() {
-  StackTrace st;
-  st.depth = absl::GetStackTrace(st.stack, kMaxStackDepth, /* skip_count= */ 0);
+class TestAllocator {
+ public:
+  void* Alloc(size_t bytes) { return ::operator new(bytes); }
+};
+
+TestAllocator allocator;
+StackTraceDepot<TestAllocator> depot(&allocator);
+
+SampleMetadata PrepareMetadata() {
+  SampleMetadata st = {};
   st.requested_size = 8;
   st.requested_alignment = 4;
   st.allocated_size = 8;
@@ -35,12 +48,17 @@ StackTrace PrepareStackTrace() {
 }
 
 TEST(SampledAllocationTest, PrepareForSampling) {
+  void* stack[kMaxStackDepth];
+  const int depth =
+      absl::GetStackTrace(stack, kMaxStackDepth, /* skip_count= */ 0);
+  const DepotStack* interned = depot.Intern(absl::MakeConstSpan(stack, depth));
+
   // PrepareForSampling() invoked in the constructor.
-  SampledAllocation sampled_allocation(PrepareStackTrace());
+  SampledAllocation sampled_allocation(PrepareMetadata(), interned);
   absl::base_internal::SpinLockHolder sample_lock(&sampled_allocation.lock);
 
   // Now verify some fields.
-  EXPECT_GT(sampled_allocation.sampled_stack.depth, 0);
+  EXPECT_EQ(sampled_allocation.interned_stack, interned);
   EXPECT_EQ(sampled_allocation.sampled_stack.requested_size, 8);
   EXPECT_EQ(sampled_allocation.sampled_stack.requested_alignment, 4);
   EXPECT_EQ(sampled_allocation.sampled_stack.allocated_size, 8);
@@ -48,7 +66,7 @@ TEST(SampledAllocationTest, PrepareForSampling) {
   EXPECT_EQ(sampled_allocation.sampled_stack.weight, 4);
 
   // Set them to different values.
-  sampled_allocation.sampled_stack.depth = 0;
+  sampled_allocation.interned_stack = nullptr;
   sampled_allocation.sampled_stack.requested_size = 0;
   sampled_allocation.sampled_stack.requested_alignment = 0;
   sampled_allocation.sampled_stack.allocated_size = 0;
@@ -56,13 +74,21 @@ TEST(SampledAllocationTest, PrepareForSampling) {
   sampled_allocation.sampled_stack.weight = 0;
 
   // Call PrepareForSampling() again and check the fields.
-  sampled_allocation.PrepareForSampling(PrepareStackTrace());
-  EXPECT_GT(sampled_allocation.sampled_stack.depth, 0);
+  sampled_allocation.PrepareForSampling(PrepareMetadata(), interned);
+  EXPECT_EQ(sampled_allocation.interned_stack, interned);
   EXPECT_EQ(sampled_allocation.sampled_stack.requested_size, 8);
   EXPECT_EQ(sampled_allocation.sampled_stack.requested_alignment, 4);
   EXPECT_EQ(sampled_allocation.sampled_stack.allocated_size, 8);
   EXPECT_EQ(sampled_allocation.sampled_stack.access_hint, 1);
   EXPECT_EQ(sampled_allocation.sampled_stack.weight, 4);
+
+  // The full stack trace is reassembled from both.
+  const StackTrace t = sampled_allocation.stack_trace();
+  EXPECT_EQ(t.requested_size, 8);
+  ASSERT_EQ(t.depth, depth);
+  for (int i = 0; i < depth; ++i) {
+    EXPECT_EQ(t.stack[i], stack[i]);
+  }
 }
 
 }  // namespace
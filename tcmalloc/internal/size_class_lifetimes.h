@@ -0,0 +1,98 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_SIZE_CLASS_LIFETIMES_H_
+#define TCMALLOC_INTERNAL_SIZE_CLASS_LIFETIMES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/time/time.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Classifies size classes as long- or short-lived from the lifetimes of their
+// sampled objects.  Spans of a size class whose objects mostly outlive
+// kLongLived pin the hugepages they are placed on, so they are better kept
+// apart from spans of short-lived objects, whose hugepages can then drain and
+// be released whole.
+//
+// Each size class keeps a count of its recent samples and of the long-lived
+// ones among them, both halved whenever the count reaches kWindow, so the
+// classification follows changes in the workload.  Only freed samples are
+// counted: objects that are never freed do not contribute.
+template <size_t kNumClasses>
+class SizeClassLifetimes {
+ public:
+  // Sampled objects that live at least this long count as long-lived.  This
+  // is on the order of the interval at which free memory is released.
+  static constexpr absl::Duration kLongLived = absl::Seconds(1);
+  // The fewest samples of a size class we classify it from.
+  static constexpr uint32_t kMinSamples = 8;
+  static constexpr uint32_t kWindow = 64;
+
+  constexpr SizeClassLifetimes() = default;
+
+  // Records that a sampled object of <size_class> was freed after
+  // <lifetime>.
+  void RecordLifetime(size_t size_class, absl::Duration lifetime) {
+    ASSERT(size_class < kNumClasses);
+    std::atomic<uint32_t>& counts = counts_[size_class];
+    const uint32_t long_lived = lifetime >= kLongLived ? 1 : 0;
+    uint32_t old = counts.load(std::memory_order_relaxed);
+    uint32_t next;
+    do {
+      uint32_t samples = Samples(old) + 1;
+      uint32_t long_samples = LongSamples(old) + long_lived;
+      if (samples >= kWindow) {
+        samples /= 2;
+        long_samples /= 2;
+      }
+      next = Pack(samples, long_samples);
+    } while (!counts.compare_exchange_weak(old, next,
+                                           std::memory_order_relaxed));
+  }
+
+  // Returns true if at least three quarters of the recent samples of
+  // <size_class> were long-lived.
+  bool IsLongLived(size_t size_class) const {
+    ASSERT(size_class < kNumClasses);
+    const uint32_t counts = counts_[size_class].load(std::memory_order_relaxed);
+    const uint32_t samples = Samples(counts);
+    return samples >= kMinSamples && LongSamples(counts) * 4 >= samples * 3;
+  }
+
+ private:
+  static constexpr uint32_t Samples(uint32_t counts) { return counts & 0xffff; }
+  static constexpr uint32_t LongSamples(uint32_t counts) {
+    return counts >> 16;
+  }
+  static constexpr uint32_t Pack(uint32_t samples, uint32_t long_samples) {
+    return (long_samples << 16) | samples;
+  }
+
+  std::atomic<uint32_t> counts_[kNumClasses] = {};
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_SIZE_CLASS_LIFETIMES_H_
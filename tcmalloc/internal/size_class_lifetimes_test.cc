@@ -0,0 +1,73 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/size_class_lifetimes.h"
+
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using Lifetimes = SizeClassLifetimes<4>;
+
+TEST(SizeClassLifetimesTest, NeedsSamples) {
+  Lifetimes lifetimes;
+  for (int i = 0; i < Lifetimes::kMinSamples - 1; ++i) {
+    lifetimes.RecordLifetime(1, absl::Minutes(1));
+  }
+  EXPECT_FALSE(lifetimes.IsLongLived(1));
+  lifetimes.RecordLifetime(1, absl::Minutes(1));
+  EXPECT_TRUE(lifetimes.IsLongLived(1));
+  // Other size classes are unaffected.
+  EXPECT_FALSE(lifetimes.IsLongLived(0));
+  EXPECT_FALSE(lifetimes.IsLongLived(2));
+}
+
+TEST(SizeClassLifetimesTest, Mixed) {
+  Lifetimes lifetimes;
+  // Half of the samples long-lived is not enough.
+  for (int i = 0; i < 20; ++i) {
+    lifetimes.RecordLifetime(1, absl::Minutes(1));
+    lifetimes.RecordLifetime(1, absl::Milliseconds(1));
+  }
+  EXPECT_FALSE(lifetimes.IsLongLived(1));
+
+  for (int i = 0; i < 20; ++i) {
+    lifetimes.RecordLifetime(2, Lifetimes::kLongLived);
+    lifetimes.RecordLifetime(2, Lifetimes::kLongLived);
+    lifetimes.RecordLifetime(2, Lifetimes::kLongLived);
+    lifetimes.RecordLifetime(2, absl::ZeroDuration());
+  }
+  EXPECT_TRUE(lifetimes.IsLongLived(2));
+}
+
+TEST(SizeClassLifetimesTest, FollowsWorkload) {
+  Lifetimes lifetimes;
+  for (int i = 0; i < 1000; ++i) {
+    lifetimes.RecordLifetime(3, absl::Hours(1));
+  }
+  EXPECT_TRUE(lifetimes.IsLongLived(3));
+
+  // Older samples decay away once the workload turns short-lived.
+  for (int i = 0; i < 2 * Lifetimes::kWindow; ++i) {
+    lifetimes.RecordLifetime(3, absl::Microseconds(10));
+  }
+  EXPECT_FALSE(lifetimes.IsLongLived(3));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
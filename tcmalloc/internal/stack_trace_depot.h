@@ -0,0 +1,229 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A hash-consed store of the stacks of sampled allocations.
+
+#ifndef TCMALLOC_INTERNAL_STACK_TRACE_DEPOT_H_
+#define TCMALLOC_INTERNAL_STACK_TRACE_DEPOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/functional/function_ref.h"
+#include "absl/hash/hash.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// An interned, immutable stack.  Its program counters are stored immediately
+// after it.  Alongside the stack, the depot maintains the totals of the live
+// objects allocated at it.
+class DepotStack {
+ public:
+  absl::Span<void* const> stack() const {
+    return {reinterpret_cast<void* const*>(this + 1), depth_};
+  }
+
+  // The number of live objects, and their bytes, accounted to this stack.
+  int64_t live_count() const {
+    return live_count_.load(std::memory_order_relaxed);
+  }
+  int64_t live_bytes() const {
+    return live_bytes_.load(std::memory_order_relaxed);
+  }
+
+  // The depot generation at which the live totals last changed.
+  uint64_t generation() const {
+    return generation_.load(std::memory_order_acquire);
+  }
+
+ private:
+  template <typename Allocator>
+  friend class StackTraceDepot;
+
+  DepotStack(size_t hash, absl::Span<void* const> stack)
+      : hash_(hash), depth_(stack.size()) {
+    std::copy_n(stack.data(), stack.size(), reinterpret_cast<void**>(this + 1));
+  }
+
+  static size_t BytesFor(size_t depth) {
+    return sizeof(DepotStack) + depth * sizeof(void*);
+  }
+
+  bool Equals(size_t hash, absl::Span<void* const> stack) const {
+    return hash_ == hash && depth_ == stack.size() &&
+           memcmp(this + 1, stack.data(), stack.size() * sizeof(void*)) == 0;
+  }
+
+  const DepotStack* next_ = nullptr;
+  const size_t hash_;
+  const size_t depth_;
+
+  // Written by StackTraceDepot::Account under its accounting lock.
+  mutable std::atomic<int64_t> live_count_{0};
+  mutable std::atomic<int64_t> live_bytes_{0};
+  mutable std::atomic<uint64_t> generation_{0};
+};
+
+// Deduplicates stacks, so that samples taken at the same stack share a single
+// copy of it.  Stacks are never removed: like the sampled stacks themselves,
+// the number of distinct ones is small.
+//
+// Lookups of stacks already in the depot are lock-free.  Insertions of new
+// ones are serialized among themselves, but never block lookups.
+//
+// Allocator must provide `void* Alloc(size_t bytes)`, returning memory aligned
+// for DepotStack.
+template <typename Allocator>
+class StackTraceDepot {
+ public:
+  constexpr explicit StackTraceDepot(Allocator* allocator)
+      : allocator_(allocator) {}
+
+  StackTraceDepot(const StackTraceDepot&) = delete;
+  StackTraceDepot& operator=(const StackTraceDepot&) = delete;
+
+  // Returns the interned copy of `stack`.
+  const DepotStack* Intern(absl::Span<void* const> stack)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // The number of distinct stacks interned.
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  // Adds `count` objects of `bytes` total bytes to the live totals of `stack`.
+  // Both are negative when the objects are freed.
+  void Account(const DepotStack* stack, int64_t count, int64_t bytes)
+      ABSL_LOCKS_EXCLUDED(accounting_lock_);
+
+  // Calls `f` on every stack whose live totals changed after generation
+  // `*cursor`, then advances `*cursor` past the changes reported.  A cursor of
+  // zero visits every stack that has ever been accounted to.
+  //
+  // `f` is called without holding any depot lock, so it may allocate.  A stack
+  // changed concurrently may be visited with its newer totals, and is visited
+  // again on the next call.
+  void IterateChanged(uint64_t* cursor,
+                      absl::FunctionRef<void(const DepotStack&)> f) const
+      ABSL_LOCKS_EXCLUDED(accounting_lock_);
+
+  // Acquires and releases both locks around fork(), so that the child does not
+  // inherit one held by a thread that no longer exists.
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    lock_.Lock();
+    accounting_lock_.Lock();
+  }
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    accounting_lock_.Unlock();
+    lock_.Unlock();
+  }
+
+ private:
+  static constexpr size_t kBuckets = 4096;
+
+  static const DepotStack* Find(const DepotStack* head, size_t hash,
+                                absl::Span<void* const> stack) {
+    for (; head != nullptr; head = head->next_) {
+      if (head->Equals(hash, stack)) return head;
+    }
+    return nullptr;
+  }
+
+  // Entries are pushed to the front of their bucket with a release store, so
+  // that readers following the chain see them fully constructed.
+  std::atomic<const DepotStack*> buckets_[kBuckets] = {};
+  std::atomic<size_t> size_{0};
+
+  absl::base_internal::SpinLock lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  Allocator* const allocator_;
+
+  // Serializes updates of the live totals with the generation they are stamped
+  // with, so that a cursor read under it covers every completed update.
+  mutable absl::base_internal::SpinLock accounting_lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  uint64_t generation_ ABSL_GUARDED_BY(accounting_lock_) = 0;
+};
+
+template <typename Allocator>
+const DepotStack* StackTraceDepot<Allocator>::Intern(
+    absl::Span<void* const> stack) {
+  const size_t hash = absl::HashOf(stack);
+  std::atomic<const DepotStack*>& bucket = buckets_[hash % kBuckets];
+  const DepotStack* head = bucket.load(std::memory_order_acquire);
+  if (const DepotStack* found = Find(head, hash, stack)) {
+    return found;
+  }
+
+  AllocationGuardSpinLockHolder h(&lock_);
+  // Another thread may have inserted the stack since we looked.
+  const DepotStack* current = bucket.load(std::memory_order_relaxed);
+  for (const DepotStack* s = current; s != head; s = s->next_) {
+    if (s->Equals(hash, stack)) return s;
+  }
+
+  DepotStack* s = new (allocator_->Alloc(DepotStack::BytesFor(stack.size())))
+      DepotStack(hash, stack);
+  s->next_ = current;
+  bucket.store(s, std::memory_order_release);
+  size_.fetch_add(1, std::memory_order_relaxed);
+  return s;
+}
+
+template <typename Allocator>
+void StackTraceDepot<Allocator>::Account(const DepotStack* stack,
+                                         int64_t count, int64_t bytes) {
+  AllocationGuardSpinLockHolder h(&accounting_lock_);
+  stack->live_count_.fetch_add(count, std::memory_order_relaxed);
+  stack->live_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  stack->generation_.store(++generation_, std::memory_order_release);
+}
+
+template <typename Allocator>
+void StackTraceDepot<Allocator>::IterateChanged(
+    uint64_t* cursor, absl::FunctionRef<void(const DepotStack&)> f) const {
+  const uint64_t since = *cursor;
+  uint64_t until;
+  {
+    AllocationGuardSpinLockHolder h(&accounting_lock_);
+    until = generation_;
+  }
+  if (until == since) return;
+
+  for (const std::atomic<const DepotStack*>& bucket : buckets_) {
+    for (const DepotStack* s = bucket.load(std::memory_order_acquire);
+         s != nullptr; s = s->next_) {
+      if (s->generation() > since) f(*s);
+    }
+  }
+  *cursor = until;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_STACK_TRACE_DEPOT_H_
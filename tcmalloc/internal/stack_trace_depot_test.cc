@@ -0,0 +1,169 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/stack_trace_depot.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/types/span.h"
+#include "tcmalloc/testing/thread_manager.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class TestAllocator {
+ public:
+  void* Alloc(size_t bytes) {
+    allocated_.fetch_add(1, std::memory_order_relaxed);
+    // Leaked, as the depot never frees its stacks.
+    return malloc(bytes);
+  }
+
+  int allocated() const { return allocated_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int> allocated_{0};
+};
+
+std::vector<void*> MakeStack(uintptr_t start, int depth) {
+  std::vector<void*> stack;
+  for (int i = 0; i < depth; ++i) {
+    stack.push_back(reinterpret_cast<void*>(start + i));
+  }
+  return stack;
+}
+
+TEST(StackTraceDepotTest, Deduplicates) {
+  TestAllocator allocator;
+  StackTraceDepot<TestAllocator> depot(&allocator);
+
+  const std::vector<void*> a = MakeStack(0x1000, 5);
+  const std::vector<void*> b = MakeStack(0x2000, 5);
+  const std::vector<void*> prefix = MakeStack(0x1000, 4);
+
+  const DepotStack* interned_a = depot.Intern(a);
+  const DepotStack* interned_b = depot.Intern(b);
+  const DepotStack* interned_prefix = depot.Intern(prefix);
+  EXPECT_THAT(interned_a->stack(), testing::ElementsAreArray(a));
+  EXPECT_THAT(interned_b->stack(), testing::ElementsAreArray(b));
+  EXPECT_THAT(interned_prefix->stack(), testing::ElementsAreArray(prefix));
+  EXPECT_NE(interned_a, interned_b);
+  EXPECT_NE(interned_a, interned_prefix);
+
+  // Equal stacks are interned once.
+  EXPECT_EQ(depot.Intern(std::vector<void*>(a)), interned_a);
+  EXPECT_EQ(depot.Intern(b), interned_b);
+  EXPECT_EQ(depot.size(), 3);
+  EXPECT_EQ(allocator.allocated(), 3);
+
+  const DepotStack* empty = depot.Intern({});
+  EXPECT_TRUE(empty->stack().empty());
+  EXPECT_EQ(depot.Intern({}), empty);
+}
+
+TEST(StackTraceDepotTest, IterateChanged) {
+  TestAllocator allocator;
+  StackTraceDepot<TestAllocator> depot(&allocator);
+
+  const DepotStack* a = depot.Intern(MakeStack(0x1000, 3));
+  const DepotStack* b = depot.Intern(MakeStack(0x2000, 3));
+  const DepotStack* c = depot.Intern(MakeStack(0x3000, 3));
+
+  auto changed = [&](uint64_t* cursor) {
+    std::vector<const DepotStack*> stacks;
+    depot.IterateChanged(cursor,
+                         [&](const DepotStack& s) { stacks.push_back(&s); });
+    return stacks;
+  };
+
+  uint64_t cursor = 0;
+  EXPECT_THAT(changed(&cursor), testing::IsEmpty());
+
+  depot.Account(a, 1, 16);
+  depot.Account(a, 2, 64);
+  depot.Account(b, 1, 1024);
+  EXPECT_THAT(changed(&cursor), testing::UnorderedElementsAre(a, b));
+  EXPECT_EQ(a->live_count(), 3);
+  EXPECT_EQ(a->live_bytes(), 80);
+  EXPECT_EQ(b->live_count(), 1);
+  EXPECT_EQ(b->live_bytes(), 1024);
+  EXPECT_EQ(c->live_count(), 0);
+
+  // Nothing changed since the last call.
+  const uint64_t unchanged = cursor;
+  EXPECT_THAT(changed(&cursor), testing::IsEmpty());
+  EXPECT_EQ(cursor, unchanged);
+
+  // Freeing everything at a stack reports it with empty totals.
+  depot.Account(b, -1, -1024);
+  depot.Account(c, 1, 8);
+  EXPECT_THAT(changed(&cursor), testing::UnorderedElementsAre(b, c));
+  EXPECT_EQ(b->live_count(), 0);
+  EXPECT_EQ(b->live_bytes(), 0);
+
+  // A fresh cursor sees every stack accounted to.
+  uint64_t fresh = 0;
+  EXPECT_THAT(changed(&fresh), testing::UnorderedElementsAre(a, b, c));
+  EXPECT_EQ(fresh, cursor);
+}
+
+TEST(StackTraceDepotTest, Concurrent) {
+  TestAllocator allocator;
+  StackTraceDepot<TestAllocator> depot(&allocator);
+
+  constexpr int kThreads = 8;
+  constexpr int kStacks = 1000;
+  std::vector<std::vector<void*>> stacks;
+  for (int i = 0; i < kStacks; ++i) {
+    stacks.push_back(MakeStack(i * 0x100, 1 + i % 16));
+  }
+  std::vector<std::vector<const DepotStack*>> interned(
+      kThreads, std::vector<const DepotStack*>(kStacks));
+
+  ThreadManager threads;
+  std::atomic<int> passes[kThreads] = {};
+  threads.Start(kThreads, [&](int thread) {
+    for (int i = 0; i < kStacks; ++i) {
+      // Stagger the threads over the stacks.
+      const int j = (i + thread * kStacks / kThreads) % kStacks;
+      interned[thread][j] = depot.Intern(stacks[j]);
+    }
+    passes[thread].fetch_add(1, std::memory_order_relaxed);
+  });
+  for (const std::atomic<int>& p : passes) {
+    while (p.load(std::memory_order_relaxed) == 0) {
+    }
+  }
+  threads.Stop();
+
+  EXPECT_EQ(depot.size(), kStacks);
+  EXPECT_EQ(allocator.allocated(), kStacks);
+  for (int i = 0; i < kStacks; ++i) {
+    EXPECT_THAT(interned[0][i]->stack(), testing::ElementsAreArray(stacks[i]));
+    for (int thread = 1; thread < kThreads; ++thread) {
+      EXPECT_EQ(interned[thread][i], interned[0][i]);
+    }
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -29,8 +29,9 @@ class TcMallocTest;
 namespace tcmalloc_internal {
 
 // This class maintains a small collection of StackTrace hashes which are used
-// to inform the selection of allocations to be guarded. It provides two
-// functions:
+// to inform the selection of allocations to be guarded, and of the profiling
+// samples to keep when Parameters::profile_sampling_site_boost is set. It
+// provides two functions:
 //    - Count: returns the number of times the location has
 //      been Add-ed (represents guards placed on allocation from stack trace).
 //    - Add: which adds the provided StackTrace to the filter, for use when
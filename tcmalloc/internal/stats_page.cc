@@ -0,0 +1,158 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/stats_page.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/util.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr size_t kValuesOffset = 64;
+constexpr size_t kWords = sizeof(StatsPageValues) / sizeof(uint64_t);
+
+static_assert(sizeof(StatsPageHeader) <= kValuesOffset);
+static_assert(kValuesOffset + sizeof(StatsPageValues) <= StatsPage::kBytes);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+int CreateMemfd() {
+#ifdef __NR_memfd_create
+  constexpr unsigned int kMfdCloexec = 1;  // MFD_CLOEXEC
+  return syscall(__NR_memfd_create, "tcmalloc_stats", kMfdCloexec);
+#else
+  return -1;
+#endif
+}
+
+const std::atomic<uint64_t>* Words(const StatsPageHeader* header) {
+  return reinterpret_cast<const std::atomic<uint64_t>*>(
+      reinterpret_cast<const char*>(header) + header->values_offset);
+}
+
+}  // namespace
+
+bool StatsPage::Init(void* base) {
+  if (enabled()) {
+    return false;
+  }
+
+  char* const start = static_cast<char*>(base);
+  StatsPageHeader* header = new (start) StatsPageHeader{};
+  header->version = kStatsPageVersion;
+  header->values_size = sizeof(StatsPageValues);
+  header->values_offset = kValuesOffset;
+  new (start + kValuesOffset) std::atomic<uint64_t>[kWords]{};
+
+  header->magic.store(kStatsPageMagic, std::memory_order_release);
+  header_.store(header, std::memory_order_release);
+  return true;
+}
+
+bool StatsPage::InitFromFile(const char* path) {
+  const bool memfd = strcmp(path, "memfd") == 0;
+  const int fd =
+      memfd ? CreateMemfd()
+            : signal_safe_open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                               0600);
+  if (fd < 0) {
+    return false;
+  }
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, kBytes) == 0) {
+    base = mmap(nullptr, kBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (base == MAP_FAILED || !memfd) {
+    // A named file is kept alive by the mapping, if any.
+    signal_safe_close(fd);
+  }
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  if (!Init(base)) {
+    munmap(base, kBytes);
+    if (memfd) signal_safe_close(fd);
+    return false;
+  }
+  return true;
+}
+
+void StatsPage::Publish(const StatsPageValues& values) {
+  StatsPageHeader* header = header_.load(std::memory_order_acquire);
+  if (header == nullptr) {
+    return;
+  }
+
+  uint64_t words[kWords];
+  memcpy(words, &values, sizeof(values));
+  auto* out = const_cast<std::atomic<uint64_t>*>(Words(header));
+
+  const uint64_t seq = header->sequence.load(std::memory_order_relaxed);
+  header->sequence.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (size_t i = 0; i < kWords; ++i) {
+    out[i].store(words[i], std::memory_order_relaxed);
+  }
+  header->sequence.store(seq + 2, std::memory_order_release);
+}
+
+StatsPageReader::StatsPageReader(const void* base)
+    : header_(static_cast<const StatsPageHeader*>(base)) {}
+
+bool StatsPageReader::valid() const {
+  return header_->magic.load(std::memory_order_acquire) == kStatsPageMagic &&
+         header_->version == kStatsPageVersion;
+}
+
+bool StatsPageReader::Read(StatsPageValues* values) const {
+  const size_t words_to_read =
+      std::min<size_t>(header_->values_size / sizeof(uint64_t), kWords);
+  const std::atomic<uint64_t>* in = Words(header_);
+
+  constexpr int kMaxAttempts = 100;
+  for (int attempt = 0; attempt < kMaxAttempts; ++attempt) {
+    const uint64_t seq = header_->sequence.load(std::memory_order_acquire);
+    if (seq == 0) return false;
+    if (seq & 1) continue;
+
+    uint64_t words[kWords] = {};
+    for (size_t i = 0; i < words_to_read; ++i) {
+      words[i] = in[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->sequence.load(std::memory_order_relaxed) != seq) continue;
+
+    memcpy(values, words, sizeof(*values));
+    return true;
+  }
+  return false;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
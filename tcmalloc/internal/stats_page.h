@@ -0,0 +1,144 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A page of key allocator counters, laid out in shared memory so that agents
+// in another process can scrape them without calling into the process.
+//
+// The page starts with a StatsPageHeader; the StatsPageValues follow at
+// `values_offset`, as 64-bit words.  They are published with a sequence lock:
+// `sequence` is odd while the publisher writes them and even otherwise, so a
+// reader copies the values between two reads of an even, unchanged `sequence`
+// and retries otherwise.  Fields are only ever appended to StatsPageValues;
+// readers use the first `values_size` bytes.
+
+#ifndef TCMALLOC_INTERNAL_STATS_PAGE_H_
+#define TCMALLOC_INTERNAL_STATS_PAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+inline constexpr uint64_t kStatsPageMagic = 0x5354415453434d54;  // "TMCSTATS"
+inline constexpr uint32_t kStatsPageVersion = 1;
+
+struct StatsPageHeader {
+  // Written last, with release semantics, once the page is laid out.
+  std::atomic<uint64_t> magic;
+  uint32_t version;
+  uint32_t values_size;
+  uint64_t values_offset;
+  // Zero until the first values are published.
+  std::atomic<uint64_t> sequence;
+};
+
+// In bytes unless noted otherwise.
+struct StatsPageValues {
+  // Unix time in nanoseconds of the update.
+  int64_t time_ns;
+
+  // As the generic.* and tcmalloc.* properties of the same names.
+  uint64_t current_allocated_bytes;
+  uint64_t heap_size;
+  uint64_t physical_memory_used;
+  uint64_t virtual_memory_used;
+  uint64_t metadata_bytes;
+  uint64_t pageheap_free_bytes;
+  uint64_t pageheap_unmapped_bytes;
+  uint64_t peak_backed_bytes;
+  uint64_t peak_sampled_application_bytes;
+
+  // Free bytes in each cache tier.
+  uint64_t thread_cache_bytes;
+  uint64_t per_cpu_cache_bytes;
+  uint64_t sharded_transfer_cache_bytes;
+  uint64_t transfer_cache_bytes;
+  uint64_t central_cache_bytes;
+
+  // Counts of per-CPU cache misses since startup.
+  uint64_t per_cpu_cache_underflows;
+  uint64_t per_cpu_cache_overflows;
+
+  // Usage of the components of the hugepage-aware page heap.
+  uint64_t filler_used_bytes;
+  uint64_t filler_free_bytes;
+  uint64_t filler_unmapped_bytes;
+  uint64_t region_used_bytes;
+  uint64_t region_free_bytes;
+  uint64_t region_unmapped_bytes;
+  uint64_t huge_cache_free_bytes;
+  uint64_t huge_cache_unmapped_bytes;
+};
+
+static_assert(sizeof(StatsPageValues) % sizeof(uint64_t) == 0);
+
+class StatsPage {
+ public:
+  static constexpr size_t kBytes = 4096;
+
+  constexpr StatsPage() = default;
+
+  StatsPage(const StatsPage&) = delete;
+  StatsPage& operator=(const StatsPage&) = delete;
+
+  // Lays out the page over `base`, which must be at least kBytes bytes and
+  // page-aligned.  Returns false if the page is already enabled.
+  bool Init(void* base);
+
+  // Maps the file at `path`, created or truncated, or an anonymous memfd named
+  // "tcmalloc_stats" if `path` is "memfd", shared and lays out the page over
+  // it.  The memfd stays open so that other processes can map it through
+  // /proc/<pid>/fd.  Returns false, leaving the page disabled, on failure.
+  bool InitFromFile(const char* path);
+
+  bool enabled() const {
+    return header_.load(std::memory_order_acquire) != nullptr;
+  }
+
+  // Publishes `values`.  Concurrent calls must be serialized by the caller.
+  void Publish(const StatsPageValues& values);
+
+ private:
+  std::atomic<StatsPageHeader*> header_{nullptr};
+};
+
+// A reader of the page laid out over `base`, for agents and tests.
+class StatsPageReader {
+ public:
+  explicit StatsPageReader(const void* base);
+
+  // Returns false if the page at `base` is not initialized or is of an unknown
+  // version.
+  bool valid() const;
+
+  // Copies the latest values into `values`, zeroing fields the publisher does
+  // not know about.  Returns false if none were published yet or they kept
+  // changing while we copied them.
+  bool Read(StatsPageValues* values) const;
+
+ private:
+  const StatsPageHeader* const header_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_STATS_PAGE_H_
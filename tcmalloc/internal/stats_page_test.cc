@@ -0,0 +1,144 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/stats_page.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class StatsPageTest : public testing::Test {
+ protected:
+  void* Map() {
+    base_ = mmap(nullptr, StatsPage::kBytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    EXPECT_NE(base_, MAP_FAILED);
+    return base_;
+  }
+
+  ~StatsPageTest() override {
+    if (base_ != nullptr) munmap(base_, StatsPage::kBytes);
+  }
+
+  void* base_ = nullptr;
+};
+
+TEST_F(StatsPageTest, NothingPublished) {
+  StatsPage page;
+  ASSERT_TRUE(page.Init(Map()));
+  EXPECT_FALSE(page.Init(base_));
+
+  StatsPageReader reader(base_);
+  EXPECT_TRUE(reader.valid());
+  StatsPageValues values;
+  EXPECT_FALSE(reader.Read(&values));
+}
+
+TEST_F(StatsPageTest, ReadsLatestValues) {
+  StatsPage page;
+  ASSERT_TRUE(page.Init(Map()));
+  StatsPageReader reader(base_);
+
+  for (uint64_t i = 1; i <= 3; ++i) {
+    StatsPageValues values = {};
+    values.time_ns = i;
+    values.current_allocated_bytes = i << 20;
+    values.huge_cache_unmapped_bytes = i << 30;
+    page.Publish(values);
+
+    StatsPageValues read;
+    ASSERT_TRUE(reader.Read(&read));
+    EXPECT_EQ(read.time_ns, i);
+    EXPECT_EQ(read.current_allocated_bytes, i << 20);
+    EXPECT_EQ(read.huge_cache_unmapped_bytes, i << 30);
+  }
+}
+
+TEST_F(StatsPageTest, ReadsAreConsistent) {
+  StatsPage page;
+  ASSERT_TRUE(page.Init(Map()));
+  StatsPageReader reader(base_);
+
+  // Every field of each update holds the same value, so a torn read would
+  // show up as a mismatch.
+  std::atomic<bool> done = false;
+  std::thread publisher([&] {
+    for (uint64_t i = 1; !done.load(std::memory_order_relaxed); ++i) {
+      StatsPageValues values;
+      memset(&values, static_cast<int>(i & 0xff), sizeof(values));
+      page.Publish(values);
+    }
+  });
+
+  for (int i = 0; i < 100000; ++i) {
+    StatsPageValues values;
+    if (!reader.Read(&values)) continue;
+    EXPECT_EQ(values.current_allocated_bytes, values.huge_cache_unmapped_bytes);
+    EXPECT_EQ(values.time_ns,
+              static_cast<int64_t>(values.current_allocated_bytes));
+  }
+  done = true;
+  publisher.join();
+}
+
+TEST(StatsPageFileTest, SharedWithOtherMappings) {
+  const std::string path =
+      absl::StrCat(testing::TempDir(), "/stats_page_", getpid());
+  StatsPage page;
+  ASSERT_TRUE(page.InitFromFile(path.c_str()));
+
+  StatsPageValues values = {};
+  values.heap_size = 12345;
+  page.Publish(values);
+
+  // Map the file as an external reader would.
+  const int fd = open(path.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  void* base = mmap(nullptr, StatsPage::kBytes, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  ASSERT_NE(base, MAP_FAILED);
+
+  StatsPageReader reader(base);
+  ASSERT_TRUE(reader.valid());
+  StatsPageValues read;
+  ASSERT_TRUE(reader.Read(&read));
+  EXPECT_EQ(read.heap_size, 12345);
+  munmap(base, StatsPage::kBytes);
+  unlink(path.c_str());
+}
+
+TEST(StatsPageFileTest, Memfd) {
+  StatsPage page;
+  if (!page.InitFromFile("memfd")) {
+    GTEST_SKIP() << "memfd_create is not supported";
+  }
+  EXPECT_TRUE(page.enabled());
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
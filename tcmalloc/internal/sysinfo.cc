@@ -16,6 +16,7 @@
 
 #include <fcntl.h>
 #include <sched.h>
+#include <stdio.h>
 
 #include <algorithm>
 #include <array>
@@ -23,8 +24,10 @@
 #include <cstring>
 #include <optional>
 
+#include "absl/base/call_once.h"
 #include "absl/base/optimization.h"
 #include "absl/functional/function_ref.h"
+#include "absl/strings/ascii.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/string_view.h"
 #include "tcmalloc/internal/config.h"
@@ -107,6 +110,26 @@ std::optional<cpu_set_t> ParseCpulist(
 
 namespace sysinfo_internal {
 
+std::optional<int> ParseSysfsNumber(
+    absl::FunctionRef<ssize_t(char* buf, size_t count)> read) {
+  char buf[32];
+  size_t len = 0;
+  for (;;) {
+    const ssize_t rc = read(buf + len, sizeof(buf) - len);
+    if (rc < 0) return std::nullopt;
+    if (rc == 0) break;
+    len += rc;
+    if (len == sizeof(buf)) return std::nullopt;
+  }
+  int value;
+  if (!absl::SimpleAtoi(absl::StripAsciiWhitespace(absl::string_view(buf, len)),
+                        &value) ||
+      value < 0) {
+    return std::nullopt;
+  }
+  return value;
+}
+
 int NumPossibleCPUsNoCache() {
   int fd = signal_safe_open("/sys/devices/system/cpu/possible",
                             O_RDONLY | O_CLOEXEC);
@@ -133,6 +156,139 @@ int NumPossibleCPUsNoCache() {
 
 }  // namespace sysinfo_internal
 
+namespace {
+
+// Returns the cpus of the cpu_atom PMU, which only exists on Intel hybrid
+// machines.
+const std::optional<cpu_set_t>& AtomCpus() {
+  ABSL_CONST_INIT static absl::once_flag flag;
+  ABSL_CONST_INIT static std::optional<cpu_set_t> result;
+  absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    const int fd =
+        signal_safe_open("/sys/devices/cpu_atom/cpus", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    result = ParseCpulist([&](char* const buf, const size_t count) {
+      return signal_safe_read(fd, buf, count, /*bytes_read=*/nullptr);
+    });
+    signal_safe_close(fd);
+  });
+  return result;
+}
+
+}  // namespace
+
+int CpuCapacity(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpu_capacity",
+           cpu);
+  const int fd = signal_safe_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    const std::optional<int> capacity =
+        sysinfo_internal::ParseSysfsNumber(
+            [&](char* const buf, const size_t count) {
+              return signal_safe_read(fd, buf, count, /*bytes_read=*/nullptr);
+            });
+    signal_safe_close(fd);
+    if (capacity.has_value()) {
+      return std::min(*capacity, kMaxCpuCapacity);
+    }
+  }
+
+  const std::optional<cpu_set_t>& atom_cpus = AtomCpus();
+  if (atom_cpus.has_value() && IsInBounds(cpu) && CPU_ISSET(cpu, &*atom_cpus)) {
+    return kMaxCpuCapacity / 2;
+  }
+  return kMaxCpuCapacity;
+}
+
+const char* ThpModeName(ThpMode mode) {
+  switch (mode) {
+    case ThpMode::kAlways:
+      return "always";
+    case ThpMode::kDefer:
+      return "defer";
+    case ThpMode::kDeferMadvise:
+      return "defer+madvise";
+    case ThpMode::kMadvise:
+      return "madvise";
+    case ThpMode::kNever:
+      return "never";
+    case ThpMode::kUnknown:
+      break;
+  }
+  return "unknown";
+}
+
+namespace sysinfo_internal {
+
+ThpMode ParseThpMode(absl::FunctionRef<ssize_t(char* buf, size_t count)> read) {
+  char buf[64];
+  size_t len = 0;
+  for (;;) {
+    const ssize_t rc = read(buf + len, sizeof(buf) - len);
+    if (rc < 0) return ThpMode::kUnknown;
+    if (rc == 0) break;
+    len += rc;
+    if (len == sizeof(buf)) return ThpMode::kUnknown;
+  }
+  const absl::string_view contents(buf, len);
+  const size_t open = contents.find('[');
+  const size_t close = contents.find(']', open);
+  if (open == absl::string_view::npos || close == absl::string_view::npos) {
+    return ThpMode::kUnknown;
+  }
+  const absl::string_view selected =
+      contents.substr(open + 1, close - open - 1);
+  for (ThpMode mode : {ThpMode::kAlways, ThpMode::kDefer,
+                       ThpMode::kDeferMadvise, ThpMode::kMadvise,
+                       ThpMode::kNever}) {
+    if (selected == ThpModeName(mode)) return mode;
+  }
+  return ThpMode::kUnknown;
+}
+
+}  // namespace sysinfo_internal
+
+namespace {
+
+ThpMode ReadThpMode(const char* path) {
+  const int fd = signal_safe_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return ThpMode::kUnknown;
+  const ThpMode mode = sysinfo_internal::ParseThpMode(
+      [&](char* const buf, const size_t count) {
+        return signal_safe_read(fd, buf, count, /*bytes_read=*/nullptr);
+      });
+  signal_safe_close(fd);
+  return mode;
+}
+
+size_t ReadPmdSize() {
+  const int fd =
+      signal_safe_open("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size",
+                       O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  const std::optional<int> size = sysinfo_internal::ParseSysfsNumber(
+      [&](char* const buf, const size_t count) {
+        return signal_safe_read(fd, buf, count, /*bytes_read=*/nullptr);
+      });
+  signal_safe_close(fd);
+  return size.value_or(0);
+}
+
+}  // namespace
+
+const ThpSettings& GetThpSettings() {
+  ABSL_CONST_INIT static absl::once_flag flag;
+  ABSL_CONST_INIT static ThpSettings result;
+  absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    result.enabled =
+        ReadThpMode("/sys/kernel/mm/transparent_hugepage/enabled");
+    result.defrag = ReadThpMode("/sys/kernel/mm/transparent_hugepage/defrag");
+    result.pmd_size = ReadPmdSize();
+  });
+  return result;
+}
+
 #endif  // __linux__
 
 }  // namespace tcmalloc_internal
@@ -45,8 +45,59 @@ namespace tcmalloc_internal {
 std::optional<cpu_set_t> ParseCpulist(
     absl::FunctionRef<ssize_t(char* buf, size_t count)> read);
 
+// The compute capacity of the most capable CPUs of the machine, as in the
+// kernel's cpu_capacity.
+inline constexpr int kMaxCpuCapacity = 1024;
+
+// Returns the compute capacity of <cpu> relative to kMaxCpuCapacity, which
+// differs from it only on heterogeneous ("hybrid" or big.LITTLE) machines.
+// The capacity comes from /sys/devices/system/cpu/cpu<N>/cpu_capacity where
+// the kernel provides it.  Otherwise, on Intel hybrid machines, the efficiency
+// cores (those of the cpu_atom PMU) are taken to have half the capacity of the
+// performance cores.
+int CpuCapacity(int cpu);
+
+// A transparent hugepage mode, as selected in
+// /sys/kernel/mm/transparent_hugepage/enabled or .../defrag.  kDefer and
+// kDeferMadvise are only valid for defrag.
+enum class ThpMode {
+  kUnknown,
+  kAlways,
+  kDefer,
+  kDeferMadvise,
+  kMadvise,
+  kNever,
+};
+
+// Returns the name of <mode> as it appears in sysfs, or "unknown".
+const char* ThpModeName(ThpMode mode);
+
+struct ThpSettings {
+  // Which ranges the kernel backs with transparent hugepages.
+  ThpMode enabled = ThpMode::kUnknown;
+  // When the kernel stalls page faults to compact memory for a hugepage.
+  ThpMode defrag = ThpMode::kUnknown;
+  // The size of the kernel's transparent hugepages, which is 2 MiB on x86 but
+  // follows the base page size on aarch64 (32 MiB with 16 KiB pages, 512 MiB
+  // with 64 KiB pages), or 0 if unknown.
+  size_t pmd_size = 0;
+};
+
+// Returns the system's transparent hugepage settings, read on the first call.
+const ThpSettings& GetThpSettings();
+
 namespace sysinfo_internal {
 
+// Parses the selected mode of a transparent hugepage setting read by <read>,
+// the one in brackets, as in "always [madvise] never".  Returns
+// ThpMode::kUnknown on error.
+ThpMode ParseThpMode(absl::FunctionRef<ssize_t(char* buf, size_t count)> read);
+
+// Parses the non-negative decimal number read by <read>, as found in sysfs
+// files.  Returns std::nullopt on error.
+std::optional<int> ParseSysfsNumber(
+    absl::FunctionRef<ssize_t(char* buf, size_t count)> read);
+
 // Returns the number of possible CPUs on the machine, including currently
 // offline CPUs.
 //
@@ -154,6 +154,76 @@ TEST(NumCPUs, Cached) {
   EXPECT_EQ(NumCPUs(), absl::base_internal::NumCPUs());
 }
 
+std::optional<int> ParseNumber(absl::string_view contents) {
+  return sysinfo_internal::ParseSysfsNumber(
+      [&](char* const buf, const size_t count) -> ssize_t {
+        const size_t to_copy = std::min(count, contents.size());
+        memcpy(buf, contents.data(), to_copy);
+        contents.remove_prefix(to_copy);
+        return to_copy;
+      });
+}
+
+TEST(ParseSysfsNumberTest, Valid) {
+  EXPECT_THAT(ParseNumber("1024\n"), testing::Optional(1024));
+  EXPECT_THAT(ParseNumber("0"), testing::Optional(0));
+}
+
+TEST(ParseSysfsNumberTest, Invalid) {
+  EXPECT_EQ(ParseNumber(""), std::nullopt);
+  EXPECT_EQ(ParseNumber("-1\n"), std::nullopt);
+  EXPECT_EQ(ParseNumber("capacity\n"), std::nullopt);
+  EXPECT_EQ(ParseNumber(std::string(64, '1')), std::nullopt);
+  EXPECT_EQ(sysinfo_internal::ParseSysfsNumber(
+                [](char*, size_t) -> ssize_t { return -1; }),
+            std::nullopt);
+}
+
+ThpMode ParseMode(absl::string_view contents) {
+  return sysinfo_internal::ParseThpMode(
+      [&](char* const buf, const size_t count) -> ssize_t {
+        const size_t to_copy = std::min(count, contents.size());
+        memcpy(buf, contents.data(), to_copy);
+        contents.remove_prefix(to_copy);
+        return to_copy;
+      });
+}
+
+TEST(ParseThpModeTest, Valid) {
+  EXPECT_EQ(ParseMode("[always] madvise never\n"), ThpMode::kAlways);
+  EXPECT_EQ(ParseMode("always [madvise] never\n"), ThpMode::kMadvise);
+  EXPECT_EQ(ParseMode("always madvise [never]\n"), ThpMode::kNever);
+  EXPECT_EQ(ParseMode("always defer [defer+madvise] madvise never\n"),
+            ThpMode::kDeferMadvise);
+  EXPECT_EQ(ParseMode("always [defer] defer+madvise madvise never\n"),
+            ThpMode::kDefer);
+}
+
+TEST(ParseThpModeTest, Invalid) {
+  EXPECT_EQ(ParseMode(""), ThpMode::kUnknown);
+  EXPECT_EQ(ParseMode("always madvise never\n"), ThpMode::kUnknown);
+  EXPECT_EQ(ParseMode("[sometimes] never\n"), ThpMode::kUnknown);
+  EXPECT_EQ(ParseMode("[always"), ThpMode::kUnknown);
+  EXPECT_EQ(ParseMode(std::string(128, '[')), ThpMode::kUnknown);
+  EXPECT_EQ(sysinfo_internal::ParseThpMode(
+                [](char*, size_t) -> ssize_t { return -1; }),
+            ThpMode::kUnknown);
+}
+
+TEST(ThpSettingsTest, Named) {
+  const ThpSettings& settings = GetThpSettings();
+  EXPECT_NE(ThpModeName(settings.enabled), nullptr);
+  EXPECT_NE(ThpModeName(settings.defrag), nullptr);
+}
+
+TEST(CpuCapacityTest, InRange) {
+  for (int cpu = 0; cpu < NumCPUs(); ++cpu) {
+    const int capacity = CpuCapacity(cpu);
+    EXPECT_GE(capacity, 0);
+    EXPECT_LE(capacity, kMaxCpuCapacity);
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -26,9 +26,13 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/base/attributes.h"
+#include "absl/functional/function_ref.h"
+#include "absl/strings/string_view.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/malloc_extension.h"
 
 namespace tcmalloc {
@@ -60,6 +64,11 @@ class ProfileAccessor {
 extern "C" {
 
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_ForceCpuCacheActivation();
+// Like MallocExtension_Internal_ReleaseMemoryToSystem, for the background
+// thread, which leaves the span caches and the central freelists' empty spans
+// to age out.
+ABSL_ATTRIBUTE_WEAK size_t TCMalloc_Internal_ReleaseMemoryInBackground(
+    size_t bytes);
 
 ABSL_ATTRIBUTE_WEAK tcmalloc::AddressRegionFactory*
 MallocExtension_Internal_GetRegionFactory();
@@ -68,15 +77,21 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetRegionFactory(
 
 ABSL_ATTRIBUTE_WEAK const tcmalloc::tcmalloc_internal::ProfileBase*
 MallocExtension_Internal_SnapshotCurrent(tcmalloc::ProfileType type);
+ABSL_ATTRIBUTE_WEAK const tcmalloc::tcmalloc_internal::ProfileBase*
+MallocExtension_Internal_SnapshotHeapDelta(uint64_t* cursor);
 
 ABSL_ATTRIBUTE_WEAK tcmalloc::tcmalloc_internal::AllocationProfilingTokenBase*
 MallocExtension_Internal_StartAllocationProfiling();
 ABSL_ATTRIBUTE_WEAK tcmalloc::tcmalloc_internal::AllocationProfilingTokenBase*
 MallocExtension_Internal_StartLifetimeProfiling();
+ABSL_ATTRIBUTE_WEAK tcmalloc::tcmalloc_internal::AllocationProfilingTokenBase*
+MallocExtension_Internal_StartLockContentionProfiling();
 
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_ActivateGuardedSampling();
 ABSL_ATTRIBUTE_WEAK tcmalloc::MallocExtension::Ownership
 MallocExtension_Internal_GetOwnership(const void* ptr);
+ABSL_ATTRIBUTE_WEAK bool MallocExtension_Internal_IsOnSparseHugepage(
+    const void* ptr);
 ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_GetMemoryLimit(
     tcmalloc::MallocExtension::LimitKind limit_kind);
 ABSL_ATTRIBUTE_WEAK bool MallocExtension_Internal_GetNumericProperty(
@@ -96,6 +111,11 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetSkipSubreleaseLongInterval(
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetProperties(
     std::map<std::string, tcmalloc::MallocExtension::Property>* ret);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetStats(std::string* ret);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_WriteStats(
+    tcmalloc::MallocExtension::StatsFormat format,
+    absl::FunctionRef<void(absl::string_view)> sink);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_WriteHugePageLayout(
+    absl::FunctionRef<void(absl::string_view)> sink);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetMaxPerCpuCacheSize(
     int32_t value);
 ABSL_ATTRIBUTE_WEAK void
@@ -112,11 +132,50 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetSkipSubreleaseLongInterval(
 ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_ReleaseCpuMemory(int cpu);
 ABSL_ATTRIBUTE_WEAK size_t
 MallocExtension_Internal_ReleaseMemoryToSystem(size_t bytes);
+ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_Prewarm(
+    size_t bytes, const tcmalloc::MallocExtension::PrewarmSize* sizes,
+    size_t n);
+ABSL_ATTRIBUTE_WEAK bool MallocExtension_Internal_PartitionAllocToken(
+    size_t token);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetMemoryLimit(
     size_t limit, tcmalloc::MallocExtension::LimitKind limit_kind);
+ABSL_ATTRIBUTE_WEAK int MallocExtension_Internal_GetAllocationDomain();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetAllocationDomain(
+    int domain);
+ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_GetAllocationDomainLimit(
+    int domain, tcmalloc::MallocExtension::LimitKind limit_kind);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetAllocationDomainLimit(
+    int domain, size_t limit, tcmalloc::MallocExtension::LimitKind limit_kind);
+ABSL_ATTRIBUTE_WEAK size_t
+MallocExtension_Internal_GetAllocationDomainUsage(int domain);
+ABSL_ATTRIBUTE_WEAK tcmalloc::MallocExtension::AllocationQoS
+MallocExtension_Internal_GetThreadAllocationQoS();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetThreadAllocationQoS(
+    tcmalloc::MallocExtension::AllocationQoS qos);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetThreadAllocatedBytes(
+    tcmalloc::MallocExtension::ThreadAllocatedBytes* bytes);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetProfileLabels(
+    absl::Span<const tcmalloc::ProfileLabel>* labels);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetProfileLabels(
+    const tcmalloc::ProfileLabel* labels, size_t n);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetSizeClassesForProfile(
+    const tcmalloc::Profile* profile, std::string* ret);
 
 ABSL_ATTRIBUTE_WEAK size_t
 MallocExtension_Internal_GetAllocatedSize(const void* ptr);
+ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_TryResizeInPlace(
+    void* ptr, size_t min_size, size_t max_size);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_FreeLater(void* ptr,
+                                                        size_t size);
+ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_AllocateBatch(size_t size,
+                                                              size_t n,
+                                                              void** batch);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_FreeBatch(void** batch,
+                                                        size_t n, size_t size);
+ABSL_ATTRIBUTE_WEAK tcmalloc::sized_ptr_t
+MallocExtension_Internal_AllocateRegionChunk(size_t size);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_FreeRegionChunk(void* ptr,
+                                                              size_t size);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_MarkThreadBusy();
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_MarkThreadIdle();
 
@@ -144,6 +203,18 @@ ABSL_ATTRIBUTE_WEAK int64_t
 MallocExtension_Internal_GetMaxTotalThreadCacheBytes();
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetMaxTotalThreadCacheBytes(
     int64_t value);
+
+ABSL_ATTRIBUTE_WEAK int64_t MallocExtension_Internal_GetPrefaultHugePages();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetPrefaultHugePages(
+    int64_t value);
+
+ABSL_ATTRIBUTE_WEAK int64_t
+MallocExtension_Internal_GetAllocLatencySamplingInterval();
+ABSL_ATTRIBUTE_WEAK void
+MallocExtension_Internal_SetAllocLatencySamplingInterval(int64_t value);
+
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetHeapTelemetry(
+    std::vector<tcmalloc::MallocExtension::HeapTelemetryEpoch>* ret);
 }
 
 #endif
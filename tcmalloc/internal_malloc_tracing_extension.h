@@ -21,6 +21,8 @@
 #define TCMALLOC_INTERNAL_MALLOC_TRACING_EXTENSION_H_
 
 #include "absl/base/attributes.h"
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "tcmalloc/malloc_tracing_extension.h"
 
@@ -30,6 +32,13 @@ ABSL_ATTRIBUTE_WEAK
 absl::StatusOr<tcmalloc::malloc_tracing_extension::AllocatedAddressRanges>
 MallocTracingExtension_Internal_GetAllocatedAddressRanges();
 
+ABSL_ATTRIBUTE_WEAK absl::Status
+MallocTracingExtension_Internal_ForEachLiveObject(
+    absl::FunctionRef<
+        void(const tcmalloc::malloc_tracing_extension::LiveObject&)>
+        callback,
+    int partition, int num_partitions);
+
 #endif
 
 #endif  // TCMALLOC_INTERNAL_MALLOC_TRACING_EXTENSION_H_
@@ -0,0 +1,186 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/large_span_cache.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/cache_topology.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT LargeSpanCache large_span_cache;
+
+bool LargeSpanCache::enabled() {
+  return Parameters::large_span_cache_bytes() > 0;
+}
+
+LargeSpanCache::Shard& LargeSpanCache::CurrentShard() {
+  const CacheTopology& topology = CacheTopology::Instance();
+  const int cpu = subtle::percpu::RseqCpuId();
+  if (cpu < 0 || topology.l3_count() == 0) return shards_[0];
+  return shards_[topology.GetL3FromCpuId(cpu) % kMaxShards];
+}
+
+bool LargeSpanCache::TryReserve(Length n) {
+  const size_t budget =
+      BytesToLengthFloor(Parameters::large_span_cache_bytes()).raw_num();
+  const size_t cached =
+      cached_pages_.fetch_add(n.raw_num(), std::memory_order_relaxed);
+  if (cached + n.raw_num() > budget) {
+    cached_pages_.fetch_sub(n.raw_num(), std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+Span* LargeSpanCache::TryGet(MemoryTag tag, Length n) {
+  Shard& shard = CurrentShard();
+  AllocationGuardSpinLockHolder h(&shard.lock);
+  Bin& bin = GetBin(shard, tag, n);
+  bin.used = true;
+  if (bin.count == 0) return nullptr;
+  Span* span = bin.spans.first();
+  bin.spans.remove(span);
+  --bin.count;
+  cached_pages_.fetch_sub(n.raw_num(), std::memory_order_relaxed);
+  // Cached spans were used before, so calloc must clear them.
+  span->set_known_zero(false);
+  return span;
+}
+
+Span* LargeSpanCache::Refill(MemoryTag tag, Length n) {
+  ASSERT(Cacheable(tag, n));
+  Span* spans[kRefillBatch];
+  const size_t allocated = tc_globals.page_allocator().NewBatch(
+      n, {1, AccessDensityPrediction::kSparse}, tag, absl::MakeSpan(spans));
+  if (ABSL_PREDICT_FALSE(allocated == 0)) return nullptr;
+
+  size_t uncached = 1;
+  {
+    Shard& shard = CurrentShard();
+    AllocationGuardSpinLockHolder h(&shard.lock);
+    Bin& bin = GetBin(shard, tag, n);
+    for (size_t i = 1; i < allocated; ++i) {
+      if (bin.count < kCapacity && TryReserve(n)) {
+        bin.spans.prepend(spans[i]);
+        ++bin.count;
+      } else {
+        spans[uncached++] = spans[i];
+      }
+    }
+  }
+  Delete(&spans[1], uncached - 1);
+  return spans[0];
+}
+
+void LargeSpanCache::Put(MemoryTag tag, Span* span) {
+  const Length n = span->num_pages();
+  ASSERT(Cacheable(tag, n));
+  ASSERT(GetMemoryTag(span->start_address()) == tag);
+  // The span keeps known_zero from its first allocation, but it has been
+  // written to since.
+  span->set_known_zero(false);
+  if (!TryReserve(n)) {
+    Delete(&span, 1);
+    return;
+  }
+
+  Span* spans[kCapacity / 2 + 1];
+  size_t num_spans = 0;
+  {
+    Shard& shard = CurrentShard();
+    AllocationGuardSpinLockHolder h(&shard.lock);
+    Bin& bin = GetBin(shard, tag, n);
+    if (bin.count < kCapacity) {
+      bin.spans.prepend(span);
+      ++bin.count;
+      return;
+    }
+    // Keep the most recently freed span, which is likely still in cache, and
+    // drain the oldest ones.
+    while (num_spans < kCapacity / 2) {
+      Span* last = bin.spans.last();
+      bin.spans.remove(last);
+      --bin.count;
+      spans[num_spans++] = last;
+    }
+    bin.spans.prepend(span);
+    ++bin.count;
+  }
+  cached_pages_.fetch_sub(num_spans * n.raw_num(), std::memory_order_relaxed);
+  Delete(spans, num_spans);
+}
+
+void LargeSpanCache::Delete(Span** spans, size_t num_spans) {
+  if (num_spans == 0) return;
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  for (size_t i = 0; i < num_spans; ++i) {
+    // The page allocators do not use objects_per_span when freeing.
+    tc_globals.page_allocator().Delete(spans[i], /*objects_per_span=*/1,
+                                       GetMemoryTag(spans[i]->start_address()));
+  }
+}
+
+void LargeSpanCache::Drain(bool only_unused) {
+  constexpr size_t kSpansPerShard = kNumaPartitions * kNumBins * kCapacity;
+  for (Shard& shard : shards_) {
+    Span* spans[kSpansPerShard];
+    size_t num_spans = 0;
+    {
+      AllocationGuardSpinLockHolder h(&shard.lock);
+      for (auto& partition : shard.bins) {
+        for (Bin& bin : partition) {
+          const bool drain = !only_unused || !bin.used;
+          bin.used = false;
+          if (!drain) continue;
+          while (bin.count > 0) {
+            Span* span = bin.spans.first();
+            bin.spans.remove(span);
+            --bin.count;
+            cached_pages_.fetch_sub(span->num_pages().raw_num(),
+                                    std::memory_order_relaxed);
+            spans[num_spans++] = span;
+          }
+        }
+      }
+    }
+    Delete(spans, num_spans);
+  }
+}
+
+void LargeSpanCache::Plunder() { Drain(/*only_unused=*/true); }
+
+void LargeSpanCache::Flush() { Drain(/*only_unused=*/false); }
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,195 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_LARGE_SPAN_CACHE_H_
+#define TCMALLOC_LARGE_SPAN_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/numeric/bits.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Lengths in (2^b, 2^(b+1)] pages are rounded up to a multiple of 2^b / <bins>
+// (or of 1, for small b), giving <bins> lengths per power of two.
+constexpr size_t LargeSpanBinStep(size_t pages, size_t bins) {
+  const size_t base = size_t{1} << (absl::bit_width(pages - 1) - 1);
+  return base / bins > 0 ? base / bins : 1;
+}
+
+constexpr size_t LargeSpanBinLength(size_t pages, size_t bins) {
+  const size_t step = LargeSpanBinStep(pages, bins);
+  return (pages + step - 1) / step * step;
+}
+
+constexpr size_t LargeSpanBinIndex(size_t pages, size_t bins) {
+  const size_t log = absl::bit_width(pages - 1) - 1;
+  const size_t base = size_t{1} << log;
+  return log * bins +
+         (LargeSpanBinLength(pages, bins) - base) /
+             LargeSpanBinStep(pages, bins) -
+         1;
+}
+
+// A cache of free spans of page-level allocations just above kMaxSize, sharded
+// by L3 cache.  Allocations of up to kMaxBytes are rounded up to one of
+// kBinsPerDoubling lengths per power-of-two page count, so that freed spans
+// can be reused by later allocations of similar size without acquiring
+// pageheap_lock.  On a miss, the cache is refilled with a batch of spans
+// allocated under a single acquisition of pageheap_lock; a full bin is drained
+// in a batch likewise.
+//
+// The cache holds at most a budget of bytes (the large_span_cache_bytes
+// parameter), across all shards; a budget of 0 disables it.  Cached spans
+// remain allocated as far as the PageAllocator is concerned, and are reported
+// as central cache free bytes.  Bins that saw no allocations between two calls
+// to Plunder() are returned to the page heap, as is the whole cache on
+// Flush().
+//
+// The shard locks are leaves: pageheap_lock is never acquired while holding
+// one.
+class LargeSpanCache {
+ public:
+  static constexpr size_t kMaxBytes = size_t{1} << 20;
+  static constexpr size_t kBinsPerDoubling = 4;
+  static constexpr size_t kCapacity = 4;
+  static constexpr size_t kRefillBatch = 2;
+  static constexpr size_t kMaxShards = 32;
+
+  // Page counts in (kMinPages, kMaxPages] are cached.
+  static constexpr size_t kMinPages = kMaxSize >> kPageShift;
+  static constexpr size_t kMaxPages = kMaxBytes >> kPageShift;
+  static_assert(kMaxPages > kMinPages);
+
+  constexpr LargeSpanCache() = default;
+
+  LargeSpanCache(const LargeSpanCache&) = delete;
+  LargeSpanCache& operator=(const LargeSpanCache&) = delete;
+
+  // Returns true if allocations of <n> pages of memory tagged <tag> can be
+  // cached.
+  static bool Cacheable(MemoryTag tag, Length n) {
+    return IsNormalMemoryTag(tag) && n > Length(kMinPages) &&
+           n <= Length(kMaxPages);
+  }
+
+  // Returns the length, at most 1/kBinsPerDoubling larger than <n>, that
+  // cacheable allocations of <n> pages are rounded up to.
+  static constexpr Length RoundUp(Length n) {
+    return Length(LargeSpanBinLength(n.raw_num(), kBinsPerDoubling));
+  }
+
+  // Returns true if the cache has a nonzero budget.
+  static bool enabled();
+
+  // Returns a cached span of <n> pages of memory tagged <tag>, or nullptr.  <n>
+  // must have been rounded up.  The span is registered in the pagemap but not
+  // with a size class, as if it had just been returned by PageAllocator::New(),
+  // except that it is never known to be zero.
+  Span* TryGet(MemoryTag tag, Length n) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Allocates a batch of spans of <n> pages from the PageAllocator, returning
+  // one and caching as many of the others as the budget allows.  Returns nullptr
+  // if out of memory.
+  Span* Refill(MemoryTag tag, Length n) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Caches <span>, a cacheable page-level allocation that has been freed.  If
+  // its bin is full, the span is returned to the page heap together with half
+  // of the bin; if the budget is exhausted, it is returned alone.
+  void Put(MemoryTag tag, Span* span) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Returns the spans of bins that were not allocated from since the last call
+  // to the page heap.
+  void Plunder() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // Returns all cached spans to the page heap.
+  void Flush() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Acquires and releases the shard locks around fork(), so that the child
+  // does not inherit one held by a thread that no longer exists.
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    for (Shard& shard : shards_) shard.lock.Lock();
+  }
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    for (Shard& shard : shards_) shard.lock.Unlock();
+  }
+
+  size_t cached_bytes() const {
+    return Length(cached_pages_.load(std::memory_order_relaxed)).in_bytes();
+  }
+
+ private:
+  static constexpr size_t kFirstBin =
+      LargeSpanBinIndex(kMinPages + 1, kBinsPerDoubling);
+  static constexpr size_t kNumBins =
+      LargeSpanBinIndex(kMaxPages, kBinsPerDoubling) - kFirstBin + 1;
+
+  struct Bin {
+    SpanList spans;
+    uint8_t count = 0;
+    bool used = false;
+  };
+
+  struct Shard {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    Bin bins[kNumaPartitions][kNumBins] ABSL_GUARDED_BY(lock);
+  };
+
+  static Bin& GetBin(Shard& shard, MemoryTag tag, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(shard.lock) {
+    ASSERT(Cacheable(tag, n));
+    ASSERT(RoundUp(n) == n);
+    return shard.bins[NumaPartitionFromTag(tag)]
+                     [LargeSpanBinIndex(n.raw_num(), kBinsPerDoubling) -
+                      kFirstBin];
+  }
+
+  Shard& CurrentShard();
+
+  // Reserves room for <n> pages within the budget.
+  bool TryReserve(Length n);
+
+  // Returns <spans> to the page heap.
+  static void Delete(Span** spans, size_t num_spans)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Returns every span of every bin (or only of the unused ones) to the page
+  // heap.
+  void Drain(bool only_unused) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  Shard shards_[kMaxShards];
+  std::atomic<size_t> cached_pages_{0};
+};
+
+extern LargeSpanCache large_span_cache;
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_LARGE_SPAN_CACHE_H_
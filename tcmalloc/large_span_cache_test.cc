@@ -0,0 +1,154 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/large_span_cache.h"
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/affinity.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr Length kLength =
+    LargeSpanCache::RoundUp(Length(LargeSpanCache::kMinPages + 1));
+
+class LargeSpanCacheTest : public ::testing::Test {
+ protected:
+  // Spans are cached per L3 cache, so stay on one CPU.
+  LargeSpanCacheTest() : mask_(AllowedCpus()[0]) {
+    tc_globals.InitIfNecessary();
+    Parameters::set_large_span_cache_bytes(kBudget);
+  }
+
+  ~LargeSpanCacheTest() override {
+    cache_.Flush();
+    Parameters::set_large_span_cache_bytes(0);
+  }
+
+  static Span* NewSpan(Length n) {
+    Span* span = tc_globals.page_allocator().New(
+        n, {1, AccessDensityPrediction::kSparse}, MemoryTag::kNormal);
+    CHECK_CONDITION(span != nullptr);
+    return span;
+  }
+
+  static constexpr size_t kBudget = 64 << 20;
+
+  ScopedAffinityMask mask_;
+  LargeSpanCache cache_;
+};
+
+TEST_F(LargeSpanCacheTest, RoundUp) {
+  for (size_t n = LargeSpanCache::kMinPages + 1; n <= LargeSpanCache::kMaxPages;
+       ++n) {
+    const Length rounded = LargeSpanCache::RoundUp(Length(n));
+    EXPECT_GE(rounded, Length(n));
+    EXPECT_LE(rounded, Length(LargeSpanCache::kMaxPages));
+    EXPECT_LE((rounded - Length(n)).raw_num() * LargeSpanCache::kBinsPerDoubling,
+              n);
+    EXPECT_EQ(LargeSpanCache::RoundUp(rounded), rounded);
+  }
+}
+
+TEST_F(LargeSpanCacheTest, Cacheable) {
+  EXPECT_FALSE(LargeSpanCache::Cacheable(MemoryTag::kNormal,
+                                         Length(LargeSpanCache::kMinPages)));
+  EXPECT_TRUE(LargeSpanCache::Cacheable(MemoryTag::kNormal, kLength));
+  EXPECT_TRUE(LargeSpanCache::Cacheable(MemoryTag::kNormal,
+                                        Length(LargeSpanCache::kMaxPages)));
+  EXPECT_FALSE(LargeSpanCache::Cacheable(
+      MemoryTag::kNormal, Length(LargeSpanCache::kMaxPages + 1)));
+  EXPECT_FALSE(LargeSpanCache::Cacheable(MemoryTag::kSampled, kLength));
+  EXPECT_FALSE(LargeSpanCache::Cacheable(MemoryTag::kCold, kLength));
+}
+
+TEST_F(LargeSpanCacheTest, RefillAndReuse) {
+  Span* span = cache_.Refill(MemoryTag::kNormal, kLength);
+  ASSERT_NE(span, nullptr);
+  EXPECT_EQ(span->num_pages(), kLength);
+  EXPECT_EQ(cache_.cached_bytes(),
+            (LargeSpanCache::kRefillBatch - 1) * kLength.in_bytes());
+
+  cache_.Put(MemoryTag::kNormal, span);
+  EXPECT_EQ(cache_.cached_bytes(),
+            LargeSpanCache::kRefillBatch * kLength.in_bytes());
+  // The most recently freed span is reused first.
+  EXPECT_EQ(cache_.TryGet(MemoryTag::kNormal, kLength), span);
+  cache_.Put(MemoryTag::kNormal, span);
+}
+
+TEST_F(LargeSpanCacheTest, ReusedSpansAreNotKnownZero) {
+  Span* span = NewSpan(kLength);
+  span->set_known_zero(true);
+  cache_.Put(MemoryTag::kNormal, span);
+  ASSERT_EQ(cache_.TryGet(MemoryTag::kNormal, kLength), span);
+  EXPECT_FALSE(span->known_zero());
+  cache_.Put(MemoryTag::kNormal, span);
+}
+
+TEST_F(LargeSpanCacheTest, FullBinDrainsInBatch) {
+  std::vector<Span*> spans;
+  for (size_t i = 0; i <= LargeSpanCache::kCapacity; ++i) {
+    spans.push_back(NewSpan(kLength));
+  }
+  for (Span* span : spans) {
+    cache_.Put(MemoryTag::kNormal, span);
+  }
+  // The last span overflowed the bin, returning half of it.
+  EXPECT_EQ(cache_.cached_bytes(),
+            (LargeSpanCache::kCapacity - LargeSpanCache::kCapacity / 2 + 1) *
+                kLength.in_bytes());
+  EXPECT_EQ(cache_.TryGet(MemoryTag::kNormal, kLength), spans.back());
+  cache_.Put(MemoryTag::kNormal, spans.back());
+}
+
+TEST_F(LargeSpanCacheTest, Budget) {
+  Parameters::set_large_span_cache_bytes(kLength.in_bytes());
+  cache_.Put(MemoryTag::kNormal, NewSpan(kLength));
+  cache_.Put(MemoryTag::kNormal, NewSpan(kLength));
+  EXPECT_EQ(cache_.cached_bytes(), kLength.in_bytes());
+}
+
+TEST_F(LargeSpanCacheTest, PlunderKeepsUsedBins) {
+  const Length other = LargeSpanCache::RoundUp(kLength + Length(1));
+  ASSERT_NE(other, kLength);
+  cache_.Put(MemoryTag::kNormal, NewSpan(kLength));
+  cache_.Put(MemoryTag::kNormal, NewSpan(other));
+  Span* span = cache_.TryGet(MemoryTag::kNormal, kLength);
+  ASSERT_NE(span, nullptr);
+  cache_.Put(MemoryTag::kNormal, span);
+
+  // The other bin was never allocated from, so it is returned.
+  cache_.Plunder();
+  EXPECT_EQ(cache_.cached_bytes(), kLength.in_bytes());
+
+  // Without further allocations, the next pass returns the rest.
+  cache_.Plunder();
+  EXPECT_EQ(cache_.cached_bytes(), 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
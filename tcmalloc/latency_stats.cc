@@ -0,0 +1,101 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/latency_stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/parameters.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT LatencyStats latency_stats;
+
+const char* LatencyStats::StageName(int stage) {
+  switch (static_cast<LatencyStage>(stage)) {
+    case LatencyStage::kCpuCacheRefill:
+      return "CPU_CACHE_REFILL";
+    case LatencyStage::kTransferCacheRemove:
+      return "TRANSFER_CACHE_REMOVE";
+    case LatencyStage::kPageAllocatorNew:
+      return "PAGE_ALLOCATOR_NEW";
+    case LatencyStage::kNumStages:
+      break;
+  }
+  ASSUME(false);
+  return "";
+}
+
+uint64_t LatencyStats::Total(int stage, size_t size_class) const {
+  uint64_t total = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    total += counts_[stage][size_class][i].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+void LatencyStats::Print(Printer* out) const {
+  out->printf("------------------------------------------------\n");
+  out->printf(
+      "Allocation slow path latency: sampled 1 in %lld operations\n"
+      "Non-cumulative number of samples taking < N cycles\n",
+      Parameters::alloc_latency_sampling_interval());
+  out->printf("------------------------------------------------\n");
+  for (int stage = 0; stage < kNumStages; ++stage) {
+    for (size_t size_class = 0; size_class < kNumClasses; ++size_class) {
+      const uint64_t total = Total(stage, size_class);
+      if (total == 0) continue;
+      out->printf("%-21s class %3zu : %8llu samples;", StageName(stage),
+                  size_class, total);
+      for (int i = 0; i < kBuckets; ++i) {
+        const uint64_t n =
+            counts_[stage][size_class][i].load(std::memory_order_relaxed);
+        if (n == 0) continue;
+        out->printf(" %llu < %llu", n, BucketLimit(i));
+      }
+      out->printf("\n");
+    }
+  }
+}
+
+void LatencyStats::PrintInPbtxt(PbtxtRegion* region) const {
+  for (int stage = 0; stage < kNumStages; ++stage) {
+    for (size_t size_class = 0; size_class < kNumClasses; ++size_class) {
+      if (Total(stage, size_class) == 0) continue;
+      PbtxtRegion entry = region->CreateSubRegion("alloc_latency");
+      entry.PrintRaw("stage", StageName(stage));
+      entry.PrintI64("size_class", size_class);
+      for (int i = 0; i < kBuckets; ++i) {
+        const uint64_t n =
+            counts_[stage][size_class][i].load(std::memory_order_relaxed);
+        if (n == 0) continue;
+        PbtxtRegion histogram = entry.CreateSubRegion("latency_histogram");
+        histogram.PrintI64("lower_bound", i == 0 ? 0 : BucketLimit(i - 1));
+        histogram.PrintI64("upper_bound", BucketLimit(i));
+        histogram.PrintI64("value", n);
+      }
+    }
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,163 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_LATENCY_STATS_H_
+#define TCMALLOC_LATENCY_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/optimization.h"
+#include "absl/numeric/bits.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/parameters.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The allocation slow paths timed by LatencyStats.  Later stages are nested
+// inside earlier ones, so comparing their histograms tells where slow
+// allocations spend their time.
+enum class LatencyStage {
+  // CpuCache::Refill: a per-CPU cache miss, served from the transfer caches.
+  kCpuCacheRefill,
+  // TransferCacheManager::RemoveRange: served by the transfer cache, or by
+  // the central freelist on a transfer cache miss.
+  kTransferCacheRemove,
+  // PageAllocator::New for a central freelist span, or for a large
+  // allocation (recorded as size class 0).  Includes waiting for
+  // pageheap_lock and any system allocation.
+  kPageAllocatorNew,
+  kNumStages,
+};
+
+// Log-bucketed histograms of the CycleClock ticks taken by a sampled subset of
+// allocation slow path operations, per stage and size class.  Sampling is
+// controlled by Parameters::alloc_latency_sampling_interval(): on average one
+// in that many operations is timed, and zero disables timing altogether.
+class LatencyStats {
+ public:
+  // Bucket i counts operations taking [2^(i + kMinShift), 2^(i + 1 +
+  // kMinShift)) ticks.  The first and last buckets are open-ended.
+  static constexpr int kMinShift = 6;
+  static constexpr int kBuckets = 24;
+
+  constexpr LatencyStats() = default;
+
+  LatencyStats(const LatencyStats&) = delete;
+  LatencyStats& operator=(const LatencyStats&) = delete;
+
+  // Returns the start time of an operation to time, or 0 if this operation is
+  // not sampled.
+  static int64_t MaybeStart() {
+    const int64_t interval = Parameters::alloc_latency_sampling_interval();
+    if (ABSL_PREDICT_TRUE(interval <= 0)) return 0;
+    const int64_t now = absl::base_internal::CycleClock::Now();
+    // The cycle counter is effectively random with respect to the
+    // allocation pattern, so hashing it gives a stateless sampling decision.
+    // Hashing guards against clocks whose low bits do not change.
+    const uint64_t hash =
+        (static_cast<uint64_t>(now) * 0x9E3779B97F4A7C15) >> 32;
+    if (hash % static_cast<uint64_t>(interval) != 0) return 0;
+    return now != 0 ? now : 1;
+  }
+
+  void Record(LatencyStage stage, size_t size_class, int64_t start) {
+    ASSERT(size_class < kNumClasses);
+    const int64_t elapsed = absl::base_internal::CycleClock::Now() - start;
+    counts_[static_cast<int>(stage)][size_class][BucketFor(elapsed)].fetch_add(
+        1, std::memory_order_relaxed);
+    if (elapsed > 0) {
+      ticks_[static_cast<int>(stage)].fetch_add(elapsed,
+                                                std::memory_order_relaxed);
+    }
+  }
+
+  // The CycleClock ticks taken by the sampled operations of <stage>, summed
+  // over all size classes.
+  uint64_t ticks(LatencyStage stage) const {
+    return ticks_[static_cast<int>(stage)].load(std::memory_order_relaxed);
+  }
+
+  uint64_t count(LatencyStage stage, size_t size_class, int bucket) const {
+    return counts_[static_cast<int>(stage)][size_class][bucket].load(
+        std::memory_order_relaxed);
+  }
+
+  // Upper bound (exclusive) of <bucket>, in CycleClock ticks.
+  static constexpr uint64_t BucketLimit(int bucket) {
+    return uint64_t{1} << (bucket + kMinShift + 1);
+  }
+
+  static int BucketFor(int64_t ticks) {
+    if (ticks <= 0) return 0;
+    const int bucket =
+        absl::bit_width(static_cast<uint64_t>(ticks)) - 1 - kMinShift;
+    if (bucket < 0) return 0;
+    if (bucket >= kBuckets) return kBuckets - 1;
+    return bucket;
+  }
+
+  // Prints a row for every stage and size class with samples.  Size class 0
+  // holds large allocations.
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  static constexpr int kNumStages = static_cast<int>(LatencyStage::kNumStages);
+
+  static const char* StageName(int stage);
+  uint64_t Total(int stage, size_t size_class) const;
+
+  std::atomic<uint32_t> counts_[kNumStages][kNumClasses][kBuckets] = {};
+  std::atomic<uint64_t> ticks_[kNumStages] = {};
+};
+
+extern LatencyStats latency_stats;
+
+// Times its scope into latency_stats if the operation is sampled.
+class ScopedLatencyTimer {
+ public:
+  ScopedLatencyTimer(LatencyStage stage, size_t size_class)
+      : start_(LatencyStats::MaybeStart()),
+        stage_(stage),
+        size_class_(size_class) {}
+
+  ~ScopedLatencyTimer() {
+    if (ABSL_PREDICT_FALSE(start_ != 0)) {
+      latency_stats.Record(stage_, size_class_, start_);
+    }
+  }
+
+  ScopedLatencyTimer(const ScopedLatencyTimer&) = delete;
+  ScopedLatencyTimer& operator=(const ScopedLatencyTimer&) = delete;
+
+ private:
+  const int64_t start_;
+  const LatencyStage stage_;
+  const size_t size_class_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_LATENCY_STATS_H_
@@ -0,0 +1,99 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/latency_stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/internal/cycleclock.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/parameters.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(LatencyStatsTest, Buckets) {
+  EXPECT_EQ(LatencyStats::BucketFor(0), 0);
+  EXPECT_EQ(LatencyStats::BucketFor(1), 0);
+  EXPECT_EQ(LatencyStats::BucketFor(LatencyStats::BucketLimit(0) - 1), 0);
+  for (int i = 1; i < LatencyStats::kBuckets; ++i) {
+    EXPECT_EQ(LatencyStats::BucketFor(LatencyStats::BucketLimit(i - 1)), i);
+    EXPECT_EQ(LatencyStats::BucketFor(LatencyStats::BucketLimit(i) - 1), i);
+  }
+  EXPECT_EQ(LatencyStats::BucketFor(int64_t{1} << 62),
+            LatencyStats::kBuckets - 1);
+}
+
+TEST(LatencyStatsTest, Record) {
+  auto stats = std::make_unique<LatencyStats>();
+  constexpr size_t kSizeClass = 3;
+  stats->Record(LatencyStage::kTransferCacheRemove, kSizeClass,
+                absl::base_internal::CycleClock::Now());
+
+  uint64_t total = 0;
+  for (int i = 0; i < LatencyStats::kBuckets; ++i) {
+    total += stats->count(LatencyStage::kTransferCacheRemove, kSizeClass, i);
+    EXPECT_EQ(stats->count(LatencyStage::kCpuCacheRefill, kSizeClass, i), 0);
+    EXPECT_EQ(
+        stats->count(LatencyStage::kTransferCacheRemove, kSizeClass + 1, i),
+        0);
+  }
+  EXPECT_EQ(total, 1);
+
+  std::string buffer(64 * 1024, '\0');
+  {
+    Printer printer(&*buffer.begin(), buffer.size());
+    stats->Print(&printer);
+    buffer.erase(printer.SpaceRequired());
+  }
+  EXPECT_THAT(buffer, testing::HasSubstr("TRANSFER_CACHE_REMOVE class   3 : "
+                                         "       1 samples;"));
+  EXPECT_THAT(buffer, testing::Not(testing::HasSubstr("CPU_CACHE_REFILL")));
+
+  // Ticks are summed across size classes.
+  EXPECT_EQ(stats->ticks(LatencyStage::kCpuCacheRefill), 0);
+  const uint64_t before = stats->ticks(LatencyStage::kTransferCacheRemove);
+  stats->Record(LatencyStage::kTransferCacheRemove, kSizeClass + 1,
+                absl::base_internal::CycleClock::Now() - 1000);
+  EXPECT_GE(stats->ticks(LatencyStage::kTransferCacheRemove), before + 1000);
+}
+
+TEST(LatencyStatsTest, Sampling) {
+  const int64_t old = Parameters::alloc_latency_sampling_interval();
+
+  Parameters::set_alloc_latency_sampling_interval(0);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(LatencyStats::MaybeStart(), 0);
+  }
+
+  // An interval of 1 times every operation.
+  Parameters::set_alloc_latency_sampling_interval(1);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_NE(LatencyStats::MaybeStart(), 0);
+  }
+
+  Parameters::set_alloc_latency_sampling_interval(old);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,261 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_LIFETIME_BASED_ALLOCATOR_H_
+#define TCMALLOC_LIFETIME_BASED_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/debugging/stacktrace.h"
+#include "absl/hash/hash.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/arena.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/huge_region.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/lifetime_predictions.h"
+#include "tcmalloc/internal/lifetime_tracker.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/page_heap_allocator.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/stats.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+enum class LifetimePredictionOption {
+  kDisabled,
+  // Allocations predicted to be short-lived are placed in a dedicated
+  // HugeRegionSet instead of donating their slack to the filler.
+  kEnabled,
+  // Predictions are made and tracked, and short-lived allocations are placed
+  // in a lifetime region backed only by virtual address space, but the real
+  // allocation still takes the regular path.  Used to estimate the benefit of
+  // kEnabled without changing placement.
+  kCounterfactual,
+};
+
+// State for lifetime-based placement of large (multi-hugepage or
+// hugepage-crossing) allocations.  See docs/lifetime-based-allocator.md.
+//
+// Allocations whose slack would otherwise be donated to the filler are
+// tagged with a hash of their allocation stack.  The lifetimes observed for
+// each stack are used to predict whether the next allocation from it will be
+// short-lived; short-lived allocations are steered into a separate set of
+// HugeRegions so that they cannot strand long-lived, partially-used hugepages
+// in the filler once they are freed.
+//
+// The owning HugePageAwareAllocator creates the HugeRegions (it owns the
+// HugeAllocator they are carved from) and holds pageheap_lock around every
+// call except CollectAllocationSite().
+class LifetimeBasedAllocator {
+ public:
+  using Prediction = LifetimeStats::Prediction;
+
+  LifetimeBasedAllocator(LifetimePredictionOption option,
+                         absl::Duration threshold, Clock clock)
+      : option_(option),
+        tracker_(&database_, threshold, clock),
+        regions_(HugeRegionUsageOption::kDefault) {}
+
+  LifetimeBasedAllocator(const LifetimeBasedAllocator&) = delete;
+  LifetimeBasedAllocator& operator=(const LifetimeBasedAllocator&) = delete;
+
+  void Init(Arena* arena) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    region_allocation_allocator_.Init(arena);
+  }
+
+  bool enabled() const {
+    return option_ != LifetimePredictionOption::kDisabled;
+  }
+  bool counterfactual() const {
+    return option_ == LifetimePredictionOption::kCounterfactual;
+  }
+  LifetimePredictionOption option() const { return option_; }
+
+  // Returns a hash identifying the calling allocation site.  Unwinding may
+  // take locks, so this must be called without pageheap_lock held.
+  ABSL_ATTRIBUTE_NOINLINE static size_t CollectAllocationSite()
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    void* stack[kStackDepth];
+    int depth = absl::GetStackTrace(stack, kStackDepth, /*skip_count=*/1);
+    return absl::HashOf(absl::Span<void* const>(stack, depth));
+  }
+
+  // Returns the lifetime statistics of <site> with a reference held, or
+  // nullptr if the site cannot be tracked.  The reference is handed to
+  // tracker().AddAllocation() or dropped with ReleaseSite().
+  LifetimeStats* LookupSite(size_t site) {
+    tracker_.CheckForLifetimeExpirations();
+    return database_.LookupOrAdd(site);
+  }
+  void ReleaseSite(LifetimeStats* lifetime) { database_.Release(lifetime); }
+
+  LifetimeTracker& tracker() { return tracker_; }
+  const LifetimeTracker& tracker() const { return tracker_; }
+
+  // The short-lived region.  In counterfactual mode its memory is never
+  // backed and it only shadows the placement that kEnabled would make.
+  HugeRegionSet<HugeRegion>& regions() { return regions_; }
+  const HugeRegionSet<HugeRegion>& regions() const { return regions_; }
+
+  // Stops tracking a deallocated allocation, returning its observed
+  // lifetime.
+  Prediction RemoveAllocation(LifetimeTracker::Tracker* t) {
+    // Classify anything that expired since the last operation first, so that a
+    // long-lived allocation is not mistaken for a short-lived one.
+    tracker_.CheckForLifetimeExpirations();
+    return tracker_.RemoveAllocation(t);
+  }
+
+  // Trackers for allocations living in regions(), keyed by their first page.
+  LifetimeTracker::Tracker* AddRegionAllocation(PageId p)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    RegionAllocation* a = region_allocation_allocator_.New();
+    new (a) RegionAllocation();
+    a->page = p;
+    RegionAllocation*& bucket = buckets_[BucketFor(p)];
+    a->next = bucket;
+    bucket = a;
+    return &a->tracker;
+  }
+
+  // Stops tracking the region allocation starting at <p>, which must have
+  // been added by AddRegionAllocation().  Returns the observed lifetime.
+  Prediction RemoveRegionAllocation(PageId p)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    RegionAllocation** link = &buckets_[BucketFor(p)];
+    while ((*link)->page != p) {
+      link = &(*link)->next;
+      CHECK_CONDITION(*link != nullptr);
+    }
+    RegionAllocation* a = *link;
+    *link = a->next;
+    const Prediction outcome = RemoveAllocation(&a->tracker);
+    region_allocation_allocator_.Delete(a);
+    return outcome;
+  }
+
+  // Records an allocation placed in regions() (or, in counterfactual mode,
+  // one that would have been).
+  void RecordRegionAllocation() { ++region_allocations_; }
+  // Records a short-lived allocation that was placed in the regular
+  // hierarchy and left <n> pages abandoned in the filler when freed.  In
+  // counterfactual mode, those predicted short-lived are the pages the
+  // lifetime region would have saved.
+  void RecordAbandonedByShortLived(Length n, Prediction predicted) {
+    abandoned_by_short_lived_ += n;
+    if (predicted == Prediction::kShortLived) {
+      abandoned_predicted_short_lived_ += n;
+    }
+  }
+
+  size_t region_allocations() const { return region_allocations_; }
+  Length abandoned_by_short_lived() const { return abandoned_by_short_lived_; }
+  Length abandoned_predicted_short_lived() const {
+    return abandoned_predicted_short_lived_;
+  }
+
+  void Print(Printer* out) const {
+    const LifetimeTracker::Stats& t = tracker_.stats();
+    const BackingStats r = regions_.stats();
+    out->printf(
+        "HugePageAware: lifetime-based allocator %s, threshold %.0f ms\n",
+        counterfactual() ? "(counterfactual)" : "(enabled)",
+        absl::ToDoubleMilliseconds(tracker_.threshold()));
+    out->printf(
+        "HugePageAware: lifetime predictions: %zu short-lived, %zu "
+        "long-lived, %zu active; %zu mispredicted short-lived, %zu "
+        "mispredicted long-lived\n",
+        t.short_lived, t.long_lived, t.active, t.mispredicted_short_lived,
+        t.mispredicted_long_lived);
+    out->printf(
+        "HugePageAware: lifetime sites: %zu tracked, %zu evicted, %zu "
+        "untracked lookups\n",
+        database_.size(), database_.evictions(), database_.lookup_failures());
+    out->printf(
+        "HugePageAware: lifetime region: %zu allocations, %zu regions, "
+        "%6.1f MiB used, %6.1f MiB free%s\n",
+        region_allocations_, regions_.ActiveRegions(),
+        (r.system_bytes - r.free_bytes - r.unmapped_bytes) / 1048576.0,
+        r.free_bytes / 1048576.0, counterfactual() ? " (virtual)" : "");
+    out->printf(
+        "HugePageAware: lifetime: %zu pages abandoned by short-lived "
+        "allocations outside the region (%zu %s)\n",
+        abandoned_by_short_lived_.raw_num(),
+        abandoned_predicted_short_lived_.raw_num(),
+        counterfactual() ? "would have been saved"
+                         : "predicted short-lived");
+  }
+
+  void PrintInPbtxt(PbtxtRegion* hpaa) const {
+    const LifetimeTracker::Stats& t = tracker_.stats();
+    const BackingStats r = regions_.stats();
+    auto lifetime = hpaa->CreateSubRegion("lifetime_based_allocator");
+    lifetime.PrintBool("counterfactual", counterfactual());
+    lifetime.PrintI64("threshold_ms",
+                      absl::ToInt64Milliseconds(tracker_.threshold()));
+    lifetime.PrintI64("short_lived", t.short_lived);
+    lifetime.PrintI64("long_lived", t.long_lived);
+    lifetime.PrintI64("active", t.active);
+    lifetime.PrintI64("mispredicted_short_lived", t.mispredicted_short_lived);
+    lifetime.PrintI64("mispredicted_long_lived", t.mispredicted_long_lived);
+    lifetime.PrintI64("tracked_sites", database_.size());
+    lifetime.PrintI64("evicted_sites", database_.evictions());
+    lifetime.PrintI64("region_allocations", region_allocations_);
+    lifetime.PrintI64("region_used_bytes",
+                      r.system_bytes - r.free_bytes - r.unmapped_bytes);
+    lifetime.PrintI64("region_free_bytes", r.free_bytes);
+    lifetime.PrintI64("abandoned_by_short_lived_pages",
+                      abandoned_by_short_lived_.raw_num());
+    lifetime.PrintI64("abandoned_predicted_short_lived_pages",
+                      abandoned_predicted_short_lived_.raw_num());
+  }
+
+ private:
+  static constexpr int kStackDepth = 32;
+  static constexpr size_t kBuckets = 256;
+
+  struct RegionAllocation {
+    LifetimeTracker::Tracker tracker;
+    PageId page;
+    RegionAllocation* next = nullptr;
+  };
+
+  static size_t BucketFor(PageId p) { return p.index() % kBuckets; }
+
+  const LifetimePredictionOption option_;
+  LifetimeDatabase database_;
+  LifetimeTracker tracker_;
+  HugeRegionSet<HugeRegion> regions_;
+
+  PageHeapAllocator<RegionAllocation> region_allocation_allocator_;
+  RegionAllocation* buckets_[kBuckets] = {};
+
+  size_t region_allocations_ = 0;
+  Length abandoned_by_short_lived_;
+  Length abandoned_predicted_short_lived_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_LIFETIME_BASED_ALLOCATOR_H_
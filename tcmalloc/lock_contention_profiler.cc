@@ -0,0 +1,201 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/lock_contention_profiler.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/debugging/stacktrace.h"
+#include "absl/functional/function_ref.h"
+#include "absl/hash/hash.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal_malloc_extension.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc::tcmalloc_internal {
+
+ABSL_CONST_INIT LockContentionProfilerList lock_contention_profilers;
+
+namespace {
+
+void ReportSpinLockContention(const void* lock, int64_t wait_cycles) {
+  lock_contention_profilers.Report(lock, wait_cycles);
+}
+
+}  // namespace
+
+const char* ContendedLockName(ContendedLock lock) {
+  switch (lock) {
+    case ContendedLock::kPageHeap:
+      return "pageheap_lock";
+    case ContendedLock::kTransferCache:
+      return "transfer_cache";
+    case ContendedLock::kCentralFreeList:
+      return "central_freelist";
+    case ContendedLock::kOther:
+      return "other";
+  }
+  ASSUME(false);
+  return "";
+}
+
+ContendedLock ClassifyContendedLock(const void* lock) {
+  if (lock == &pageheap_lock) return ContendedLock::kPageHeap;
+
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(lock);
+  auto within = [addr](const auto& object) {
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(&object);
+    return addr >= begin && addr < begin + sizeof(object);
+  };
+  // The central freelists are embedded in the transfer cache manager, so
+  // check them first.
+  for (int size_class = 0; size_class < kNumClasses; ++size_class) {
+    if (within(tc_globals.central_freelist(size_class))) {
+      return ContendedLock::kCentralFreeList;
+    }
+  }
+  if (within(tc_globals.transfer_cache())) return ContendedLock::kTransferCache;
+  return ContendedLock::kOther;
+}
+
+void LockContentionProfile::Add(ContendedLock lock,
+                                absl::Span<void* const> stack,
+                                int64_t wait_cycles) {
+  constexpr size_t kProbes = 32;
+  const size_t hash = absl::HashOf(lock, stack);
+  for (size_t i = 0; i < kProbes; ++i) {
+    Entry& e = entries_[(hash + i) % kEntries];
+    if (e.count == 0) {
+      e.hash = hash;
+      e.lock = lock;
+      e.depth = stack.size();
+      std::copy(stack.begin(), stack.end(), e.stack);
+    } else if (e.hash != hash || e.lock != lock ||
+               absl::MakeConstSpan(e.stack, e.depth) != stack) {
+      continue;
+    }
+    ++e.count;
+    e.wait_cycles += wait_cycles;
+    return;
+  }
+  ++dropped_;
+}
+
+void LockContentionProfile::Iterate(
+    absl::FunctionRef<void(const Profile::Sample&)> func) const {
+  const double ns_per_cycle =
+      1e9 / absl::base_internal::CycleClock::Frequency();
+  for (const Entry& e : entries_) {
+    if (e.count == 0) continue;
+    Profile::Sample sample = {};
+    sample.sum = static_cast<int64_t>(e.wait_cycles * ns_per_cycle);
+    sample.count = e.count;
+    sample.depth = e.depth;
+    std::copy(e.stack, e.stack + e.depth, sample.stack);
+    sample.contended_lock = ContendedLockName(e.lock);
+    func(sample);
+  }
+}
+
+LockContentionSample::LockContentionSample(LockContentionProfilerList* list,
+                                           absl::Time start)
+    : list_(list),
+      profile_(std::make_unique<LockContentionProfile>()),
+      start_(start) {
+  list->Add(this);
+}
+
+LockContentionSample::~LockContentionSample() {
+  if (profile_ == nullptr) {
+    return;
+  }
+
+  // deleted before ending profile, do it for them
+  list_->Remove(this);
+}
+
+Profile LockContentionSample::Stop() && {
+  // A concurrent Report() can write to profile_ until we are removed from
+  // list_.
+  if (profile_) {
+    list_->Remove(this);
+    profile_->SetDuration(absl::Now() - start_);
+  }
+  return ProfileAccessor::MakeProfile(std::move(profile_));
+}
+
+void LockContentionProfilerList::Add(LockContentionSample* s) {
+  absl::base_internal::RegisterSpinLockProfiler(&ReportSpinLockContention);
+
+  AllocationGuardSpinLockHolder h(&lock_);
+  s->next_ = first_;
+  first_ = s;
+  active_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LockContentionProfilerList::Remove(LockContentionSample* s) {
+  AllocationGuardSpinLockHolder h(&lock_);
+  LockContentionSample** link = &first_;
+  LockContentionSample* cur = first_;
+  while (cur != s) {
+    CHECK_CONDITION(cur != nullptr);
+    link = &cur->next_;
+    cur = cur->next_;
+  }
+  *link = s->next_;
+  active_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void LockContentionProfilerList::Report(const void* lock,
+                                        int64_t wait_cycles) {
+  if (ABSL_PREDICT_TRUE(active_.load(std::memory_order_relaxed) == 0)) return;
+
+  // Releasing lock_ after contending for it reports back into Report().
+  ABSL_CONST_INIT static thread_local bool reporting = false;
+  if (reporting) return;
+  reporting = true;
+
+  void* stack[Profile::Sample::kMaxStackDepth];
+  const int depth =
+      absl::GetStackTrace(stack, Profile::Sample::kMaxStackDepth,
+                          /*skip_count=*/2);
+  const ContendedLock kind = ClassifyContendedLock(lock);
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    for (LockContentionSample* s = first_; s != nullptr; s = s->next_) {
+      s->profile_->Add(kind, absl::MakeConstSpan(stack, depth), wait_cycles);
+    }
+  }
+  reporting = false;
+}
+
+}  // namespace tcmalloc::tcmalloc_internal
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,139 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_LOCK_CONTENTION_PROFILER_H_
+#define TCMALLOC_LOCK_CONTENTION_PROFILER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/functional/function_ref.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc::tcmalloc_internal {
+
+// The locks attributed by the lock contention profile.
+enum class ContendedLock : uint8_t {
+  kPageHeap,
+  kTransferCache,
+  kCentralFreeList,
+  // Any other absl::base_internal::SpinLock in the process, including those
+  // of the sharded transfer caches.
+  kOther,
+};
+
+const char* ContendedLockName(ContendedLock lock);
+
+// Returns which of TCMalloc's locks <lock> is.
+ContendedLock ClassifyContendedLock(const void* lock);
+
+// Contention events aggregated by lock and stack trace.  The table has a
+// fixed size and is preallocated, so that recording never allocates or takes
+// any other lock: contention is reported while arbitrary TCMalloc locks may be
+// held.  Once the table is full, contention from new call sites is dropped.
+class LockContentionProfile final : public ProfileBase {
+ public:
+  LockContentionProfile() = default;
+
+  void Iterate(
+      absl::FunctionRef<void(const Profile::Sample&)> func) const override;
+
+  ProfileType Type() const override { return ProfileType::kLockContention; }
+
+  void SetDuration(absl::Duration duration) { duration_ = duration; }
+  absl::Duration Duration() const override { return duration_; }
+
+  // Records one contended acquisition of <lock> that waited <wait_cycles>
+  // CycleClock ticks.
+  void Add(ContendedLock lock, absl::Span<void* const> stack,
+           int64_t wait_cycles);
+
+  // Number of contention events that did not fit in the table.
+  int64_t dropped() const { return dropped_; }
+
+  static constexpr size_t kEntries = 512;
+
+ private:
+  struct Entry {
+    int64_t count;
+    int64_t wait_cycles;
+    size_t hash;
+    ContendedLock lock;
+    int depth;
+    void* stack[Profile::Sample::kMaxStackDepth];
+  };
+
+  Entry entries_[kEntries] = {};
+  int64_t dropped_ = 0;
+  absl::Duration duration_ = absl::ZeroDuration();
+};
+
+class LockContentionProfilerList;
+
+class LockContentionSample final : public AllocationProfilingTokenBase {
+ public:
+  LockContentionSample(LockContentionProfilerList* list, absl::Time start);
+  ~LockContentionSample() override;
+
+  Profile Stop() && override;
+
+ private:
+  LockContentionProfilerList* list_;
+  std::unique_ptr<LockContentionProfile> profile_;
+  absl::Time start_;
+  LockContentionSample* next_ = nullptr;
+  friend class LockContentionProfilerList;
+};
+
+// The active lock contention profiling sessions.  The first session registers
+// Report() as the process-wide SpinLock contention hook.  The hook runs on the
+// thread that waited for the lock, as it releases it, so stack traces point at
+// the critical section that stalled.
+class LockContentionProfilerList {
+ public:
+  constexpr LockContentionProfilerList() = default;
+
+  void Add(LockContentionSample* s);
+  void Remove(LockContentionSample* s);
+
+  // Records that the calling thread waited <wait_cycles> to acquire <lock>.
+  void Report(const void* lock, int64_t wait_cycles);
+
+ private:
+  // Leaf lock: nothing else is acquired, and nothing is allocated, while it is
+  // held.
+  absl::base_internal::SpinLock lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  LockContentionSample* first_ ABSL_GUARDED_BY(lock_) = nullptr;
+  // Lets Report() skip the stack trace when nothing is profiling.
+  std::atomic<int> active_{0};
+};
+
+extern LockContentionProfilerList lock_contention_profilers;
+
+}  // namespace tcmalloc::tcmalloc_internal
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_LOCK_CONTENTION_PROFILER_H_
@@ -0,0 +1,106 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/lock_contention_profiler.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+
+#include "gtest/gtest.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/static_vars.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(LockContentionProfilerTest, Classify) {
+  EXPECT_EQ(ClassifyContendedLock(&pageheap_lock), ContendedLock::kPageHeap);
+  EXPECT_EQ(ClassifyContendedLock(&tc_globals.central_freelist(1)),
+            ContendedLock::kCentralFreeList);
+
+  absl::base_internal::SpinLock lock;
+  EXPECT_EQ(ClassifyContendedLock(&lock), ContendedLock::kOther);
+}
+
+TEST(LockContentionProfilerTest, AggregatesByLockAndStack) {
+  LockContentionProfilerList list;
+  LockContentionSample token(&list, absl::Now());
+  for (int i = 0; i < 3; ++i) {
+    list.Report(&pageheap_lock, 1000);
+  }
+
+  Profile profile = std::move(token).Stop();
+  EXPECT_EQ(profile.Type(), ProfileType::kLockContention);
+
+  int samples = 0;
+  int64_t count = 0;
+  profile.Iterate([&](const Profile::Sample& s) {
+    ++samples;
+    count += s.count;
+    EXPECT_STREQ(s.contended_lock, "pageheap_lock");
+    EXPECT_GE(s.sum, 0);
+  });
+  // All three reports come from the same call site.
+  EXPECT_EQ(samples, 1);
+  EXPECT_EQ(count, 3);
+
+  // Reports after Stop() are not recorded.
+  list.Report(&pageheap_lock, 1000);
+}
+
+TEST(LockContentionProfilerTest, RecordsRealContention) {
+  ABSL_CONST_INIT static absl::base_internal::SpinLock lock(
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+
+  auto token = MallocExtension::StartLockContentionProfiling();
+
+  std::atomic<bool> held{false};
+  std::thread holder([&]() {
+    lock.Lock();
+    held = true;
+    absl::SleepFor(absl::Milliseconds(50));
+    lock.Unlock();
+  });
+  while (!held) {
+  }
+  // Waits for holder, then reports the wait as it releases the lock.
+  lock.Lock();
+  lock.Unlock();
+  holder.join();
+
+  Profile profile = std::move(token).Stop();
+  int64_t other_count = 0;
+  int64_t other_delay = 0;
+  profile.Iterate([&](const Profile::Sample& s) {
+    if (std::string(s.contended_lock) == "other") {
+      other_count += s.count;
+      other_delay += s.sum;
+    }
+  });
+  EXPECT_GE(other_count, 1);
+  EXPECT_GT(other_delay, 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -17,6 +17,7 @@
 #include <assert.h>
 #include <string.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <cstdlib>
@@ -222,6 +223,28 @@ std::string MallocExtension::GetStats() {
   return "";
 }
 
+void MallocExtension::WriteStats(
+    StatsFormat format, absl::FunctionRef<void(absl::string_view)> sink) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_WriteStats != nullptr) {
+    MallocExtension_Internal_WriteStats(format, sink);
+    return;
+  }
+#endif
+  if (format == StatsFormat::kText) {
+    sink(GetStats());
+  }
+}
+
+void MallocExtension::WriteHugePageLayout(
+    absl::FunctionRef<void(absl::string_view)> sink) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_WriteHugePageLayout != nullptr) {
+    MallocExtension_Internal_WriteHugePageLayout(sink);
+  }
+#endif
+}
+
 void MallocExtension::ReleaseMemoryToSystem(size_t num_bytes) {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (&MallocExtension_Internal_ReleaseMemoryToSystem != nullptr) {
@@ -230,6 +253,26 @@ void MallocExtension::ReleaseMemoryToSystem(size_t num_bytes) {
 #endif
 }
 
+size_t MallocExtension::Prewarm(size_t bytes,
+                                absl::Span<const PrewarmSize> size_histogram) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_Prewarm != nullptr) {
+    return MallocExtension_Internal_Prewarm(bytes, size_histogram.data(),
+                                            size_histogram.size());
+  }
+#endif
+  return 0;
+}
+
+bool MallocExtension::PartitionAllocToken(size_t token) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_PartitionAllocToken != nullptr) {
+    return MallocExtension_Internal_PartitionAllocToken(token);
+  }
+#endif
+  return false;
+}
+
 AddressRegionFactory* MallocExtension::GetRegionFactory() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (&MallocExtension_Internal_GetRegionFactory == nullptr) {
@@ -267,6 +310,20 @@ Profile MallocExtension::SnapshotCurrent(tcmalloc::ProfileType type) {
 #endif
 }
 
+Profile MallocExtension::SnapshotHeapDelta(uint64_t* cursor) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SnapshotHeapDelta == nullptr) {
+    return Profile();
+  }
+
+  return tcmalloc_internal::ProfileAccessor::MakeProfile(
+      std::unique_ptr<const tcmalloc_internal::ProfileBase>(
+          MallocExtension_Internal_SnapshotHeapDelta(cursor)));
+#else
+  return Profile();
+#endif
+}
+
 MallocExtension::AllocationProfilingToken
 MallocExtension::StartAllocationProfiling() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
@@ -297,6 +354,21 @@ MallocExtension::StartLifetimeProfiling() {
 #endif
 }
 
+MallocExtension::AllocationProfilingToken
+MallocExtension::StartLockContentionProfiling() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_StartLockContentionProfiling == nullptr) {
+    return {};
+  }
+
+  return tcmalloc_internal::AllocationProfilingTokenAccessor::MakeToken(
+      std::unique_ptr<tcmalloc_internal::AllocationProfilingTokenBase>(
+          MallocExtension_Internal_StartLockContentionProfiling()));
+#else
+  return {};
+#endif
+}
+
 void MallocExtension::MarkThreadIdle() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (&MallocExtension_Internal_MarkThreadIdle == nullptr) {
@@ -355,6 +427,112 @@ void MallocExtension::SetMemoryLimit(const size_t limit, LimitKind limit_kind) {
 #endif
 }
 
+int MallocExtension::GetAllocationDomain() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetAllocationDomain != nullptr) {
+    return MallocExtension_Internal_GetAllocationDomain();
+  }
+#endif
+  return 0;
+}
+
+void MallocExtension::SetAllocationDomain(int domain) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetAllocationDomain != nullptr) {
+    MallocExtension_Internal_SetAllocationDomain(domain);
+  }
+#endif
+}
+
+size_t MallocExtension::GetAllocationDomainLimit(int domain,
+                                                 LimitKind limit_kind) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetAllocationDomainLimit != nullptr) {
+    return MallocExtension_Internal_GetAllocationDomainLimit(domain,
+                                                             limit_kind);
+  }
+#endif
+  return 0;
+}
+
+void MallocExtension::SetAllocationDomainLimit(int domain, size_t limit,
+                                               LimitKind limit_kind) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetAllocationDomainLimit != nullptr) {
+    // limit == 0 implies no limit.
+    const size_t new_limit =
+        (limit > 0) ? limit : std::numeric_limits<size_t>::max();
+    MallocExtension_Internal_SetAllocationDomainLimit(domain, new_limit,
+                                                      limit_kind);
+  }
+#endif
+}
+
+size_t MallocExtension::GetAllocationDomainUsage(int domain) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetAllocationDomainUsage != nullptr) {
+    return MallocExtension_Internal_GetAllocationDomainUsage(domain);
+  }
+#endif
+  return 0;
+}
+
+MallocExtension::AllocationQoS MallocExtension::GetThreadAllocationQoS() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetThreadAllocationQoS != nullptr) {
+    return MallocExtension_Internal_GetThreadAllocationQoS();
+  }
+#endif
+  return AllocationQoS::kLatencyCritical;
+}
+
+void MallocExtension::SetThreadAllocationQoS(AllocationQoS qos) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetThreadAllocationQoS != nullptr) {
+    MallocExtension_Internal_SetThreadAllocationQoS(qos);
+  }
+#endif
+}
+
+MallocExtension::ThreadAllocatedBytes
+MallocExtension::GetThreadAllocatedBytes() {
+  ThreadAllocatedBytes bytes;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetThreadAllocatedBytes != nullptr) {
+    MallocExtension_Internal_GetThreadAllocatedBytes(&bytes);
+  }
+#endif
+  return bytes;
+}
+
+absl::Span<const ProfileLabel> MallocExtension::GetProfileLabels() {
+  absl::Span<const ProfileLabel> labels;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetProfileLabels != nullptr) {
+    MallocExtension_Internal_GetProfileLabels(&labels);
+  }
+#endif
+  return labels;
+}
+
+void MallocExtension::SetProfileLabels(absl::Span<const ProfileLabel> labels) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetProfileLabels != nullptr) {
+    MallocExtension_Internal_SetProfileLabels(labels.data(), labels.size());
+  }
+#endif
+}
+
+std::string MallocExtension::GetSizeClassesForProfile(const Profile& profile) {
+  std::string ret;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetSizeClassesForProfile != nullptr) {
+    MallocExtension_Internal_GetSizeClassesForProfile(&profile, &ret);
+  }
+#endif
+  return ret;
+}
+
 int64_t MallocExtension::GetProfileSamplingRate() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (&MallocExtension_Internal_GetProfileSamplingRate != nullptr) {
@@ -541,6 +719,54 @@ void MallocExtension::SetBackgroundProcessActionsEnabled(bool value) {
 #endif
 }
 
+int64_t MallocExtension::GetPrefaultHugePages() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_GetPrefaultHugePages == nullptr) {
+    return 0;
+  }
+
+  return MallocExtension_Internal_GetPrefaultHugePages();
+#else
+  return 0;
+#endif
+}
+
+void MallocExtension::SetPrefaultHugePages(int64_t value) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_SetPrefaultHugePages == nullptr) {
+    return;
+  }
+
+  MallocExtension_Internal_SetPrefaultHugePages(value);
+#else
+  (void)value;
+#endif
+}
+
+int64_t MallocExtension::GetAllocLatencySamplingInterval() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_GetAllocLatencySamplingInterval == nullptr) {
+    return 0;
+  }
+
+  return MallocExtension_Internal_GetAllocLatencySamplingInterval();
+#else
+  return 0;
+#endif
+}
+
+void MallocExtension::SetAllocLatencySamplingInterval(int64_t value) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_SetAllocLatencySamplingInterval == nullptr) {
+    return;
+  }
+
+  MallocExtension_Internal_SetAllocLatencySamplingInterval(value);
+#else
+  (void)value;
+#endif
+}
+
 absl::Duration MallocExtension::GetBackgroundProcessSleepInterval() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (MallocExtension_Internal_GetBackgroundProcessSleepInterval == nullptr) {
@@ -685,6 +911,53 @@ std::optional<size_t> MallocExtension::GetAllocatedSize(const void* p) {
   return std::nullopt;
 }
 
+size_t TryResizeInPlace(void* p, size_t min_size, size_t max_size) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_TryResizeInPlace != nullptr) {
+    return MallocExtension_Internal_TryResizeInPlace(p, min_size, max_size);
+  }
+#endif
+  return 0;
+}
+
+void FreeLater(void* p) { FreeLater(p, 0); }
+
+void FreeLater(void* p, size_t size) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_FreeLater != nullptr) {
+    MallocExtension_Internal_FreeLater(p, size);
+    return;
+  }
+#endif
+  free(p);
+}
+
+size_t MallocExtension::AllocateBatch(size_t size, size_t n, void** batch) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_AllocateBatch != nullptr) {
+    return MallocExtension_Internal_AllocateBatch(size, n, batch);
+  }
+#endif
+  size_t i = 0;
+  for (; i < n; ++i) {
+    batch[i] = malloc(size);
+    if (batch[i] == nullptr) break;
+  }
+  return i;
+}
+
+void MallocExtension::FreeBatch(void** batch, size_t n, size_t size) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_FreeBatch != nullptr) {
+    MallocExtension_Internal_FreeBatch(batch, n, size);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; ++i) {
+    free(batch[i]);
+  }
+}
+
 MallocExtension::Ownership MallocExtension::GetOwnership(const void* p) {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (MallocExtension_Internal_GetOwnership != nullptr) {
@@ -699,6 +972,15 @@ MallocExtension::Ownership MallocExtension::GetOwnership(const void* p) {
   return MallocExtension::Ownership::kUnknown;
 }
 
+bool MallocExtension::IsOnSparseHugepage(const void* p) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_IsOnSparseHugepage != nullptr) {
+    return MallocExtension_Internal_IsOnSparseHugepage(p);
+  }
+#endif
+  return false;
+}
+
 std::map<std::string, MallocExtension::Property>
 MallocExtension::GetProperties() {
   std::map<std::string, MallocExtension::Property> ret;
@@ -774,6 +1056,100 @@ void MallocExtension::SetBackgroundReleaseRate(BytesPerSecond rate) {
 #endif
 }
 
+std::vector<MallocExtension::HeapTelemetryEpoch>
+MallocExtension::GetHeapTelemetry() {
+  std::vector<HeapTelemetryEpoch> ret;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetHeapTelemetry != nullptr) {
+    MallocExtension_Internal_GetHeapTelemetry(&ret);
+  }
+#endif
+  return ret;
+}
+
+Region::Region(size_t chunk_size) : chunk_size_(chunk_size) {}
+
+Region::~Region() { Reset(); }
+
+void* Region::Allocate(size_t size, size_t alignment) {
+  assert(alignment != 0 && (alignment & (alignment - 1)) == 0);
+  if (cursor_ != nullptr) {
+    const uintptr_t cursor = reinterpret_cast<uintptr_t>(cursor_);
+    const uintptr_t aligned = (cursor + alignment - 1) & ~(alignment - 1);
+    const uintptr_t limit = reinterpret_cast<uintptr_t>(limit_);
+    if (aligned >= cursor && aligned <= limit && size <= limit - aligned) {
+      cursor_ = reinterpret_cast<char*>(aligned + size);
+      allocated_bytes_ += size;
+      return reinterpret_cast<void*>(aligned);
+    }
+  }
+
+  // Reserve enough slack that the object can be aligned anywhere in the
+  // chunk.
+  if (size > std::numeric_limits<size_t>::max() - alignment - sizeof(Chunk)) {
+    return nullptr;
+  }
+  const size_t payload = size + alignment;
+  // Objects too large for a regular chunk get a chunk of their own, so that
+  // the remainder of the current chunk stays usable.
+  const bool dedicated = sizeof(Chunk) + payload > chunk_size_;
+  Chunk* chunk = NewChunk(payload, /*make_current=*/!dedicated);
+  if (chunk == nullptr) return nullptr;
+
+  const uintptr_t start = reinterpret_cast<uintptr_t>(chunk + 1);
+  const uintptr_t aligned = (start + alignment - 1) & ~(alignment - 1);
+  if (!dedicated) {
+    cursor_ = reinterpret_cast<char*>(aligned + size);
+  }
+  allocated_bytes_ += size;
+  return reinterpret_cast<void*>(aligned);
+}
+
+Region::Chunk* Region::NewChunk(size_t payload, bool make_current) {
+  const size_t bytes = std::max(chunk_size_, sizeof(Chunk) + payload);
+  sized_ptr_t res = {nullptr, 0};
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_AllocateRegionChunk != nullptr) {
+    res = MallocExtension_Internal_AllocateRegionChunk(bytes);
+  } else
+#endif
+  {
+    res.p = malloc(bytes);
+    res.n = res.p != nullptr ? bytes : 0;
+  }
+  if (res.p == nullptr) return nullptr;
+
+  Chunk* chunk = new (res.p) Chunk{chunks_, res.n};
+  chunks_ = chunk;
+  reserved_bytes_ += res.n;
+  if (make_current) {
+    cursor_ = reinterpret_cast<char*>(chunk + 1);
+    limit_ = static_cast<char*>(res.p) + res.n;
+  }
+  return chunk;
+}
+
+void Region::Reset() {
+  Chunk* chunk = chunks_;
+  while (chunk != nullptr) {
+    Chunk* next = chunk->next;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+    if (&MallocExtension_Internal_FreeRegionChunk != nullptr) {
+      MallocExtension_Internal_FreeRegionChunk(chunk, chunk->size);
+    } else
+#endif
+    {
+      free(chunk);
+    }
+    chunk = next;
+  }
+  chunks_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  allocated_bytes_ = 0;
+  reserved_bytes_ = 0;
+}
+
 }  // namespace tcmalloc
 
 // Default implementation just returns size. The expectation is that
@@ -819,6 +1195,16 @@ tcmalloc_size_returning_operator_new_hot_cold_nothrow(
   return {p, p ? size : 0};
 }
 
+ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE void* tcmalloc_allocate_fixed(
+    size_t size, size_t) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE void tcmalloc_deallocate_fixed(
+    void* ptr, size_t, size_t) noexcept {
+  ::operator delete(ptr);
+}
+
 #if defined(_LIBCPP_VERSION) && defined(__cpp_aligned_new)
 
 ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE tcmalloc::sized_ptr_t
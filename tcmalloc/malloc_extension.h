@@ -32,6 +32,7 @@
 #include <optional>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/base/attributes.h"
 #include "absl/functional/function_ref.h"
@@ -56,6 +57,80 @@ namespace tcmalloc {
 // as is.
 using hot_cold_t = __hot_cold_t;
 
+// Tag type selecting the registered heap, whose memory the application's
+// AddressRegionFactory registers for DMA (see
+// AddressRegionFactory::UsageHint::kRegistered):
+//
+//   char* buf = new (tcmalloc::registered) char[64 << 10];
+//   ...
+//   delete[] buf;
+struct registered_t {
+  explicit registered_t() = default;
+};
+inline constexpr registered_t registered{};
+
+// Hint that an allocation will be linked to the live allocation <ptr>, such as
+// a tree node to its parent.  TCMalloc places the new object on the same span
+// as <ptr> when both share a size class and the span has room:
+//
+//   Node* child = new (tcmalloc::near_t{parent}) Node;
+struct near_t {
+  explicit constexpr near_t(const void* ptr) : ptr(ptr) {}
+
+  const void* ptr;
+};
+
+// Tag type requesting an object that shares no cache line with any other
+// allocation, for data written concurrently from several CPUs such as counters
+// and lock-free list nodes.  The object is aligned to a cache line and its size
+// rounded up to whole lines:
+//
+//   Counter* c = new (tcmalloc::exclusive_line) Counter;
+//   ...
+//   ::operator delete(c);
+//
+// Because the allocation is larger than requested, it must be freed with
+// unsized ::operator delete, or with a sized delete of the rounded-up size.
+struct exclusive_line_t {
+  explicit exclusive_line_t() = default;
+};
+inline constexpr exclusive_line_t exclusive_line{};
+
+// Tag type requesting an object on a densely used span, for objects being
+// moved off sparse hugepages (see MallocExtension::IsOnSparseHugepage):
+//
+//   if (tcmalloc::MallocExtension::IsOnSparseHugepage(entry)) {
+//     Entry* moved = new (tcmalloc::dense) Entry(std::move(*entry));
+//     delete entry;
+//     entry = moved;
+//   }
+//
+// The object is taken from the fullest spans of its size class, bypassing the
+// per-CPU caches, which would otherwise hand back the objects just freed from
+// sparse hugepages.  This is slower than a plain allocation.
+struct dense_t {
+  explicit dense_t() = default;
+};
+inline constexpr dense_t dense{};
+
+// Tag type carrying a token that identifies the type of the allocated object,
+// like those Clang passes to the __alloc_token_* entry points (see
+// new_extension.h).  Objects whose token was given a partition by
+// MallocExtension::PartitionAllocToken are placed on spans of their own, apart
+// from other types of their size class, so that objects which are traversed
+// together share cache lines and pages:
+//
+//   tcmalloc::MallocExtension::PartitionAllocToken(kNodeToken);
+//   ...
+//   Node* node = new (tcmalloc::alloc_token_t{kNodeToken}) Node;
+//
+// Allocations with other tokens are plain allocations.
+struct alloc_token_t {
+  explicit constexpr alloc_token_t(size_t token) : token(token) {}
+
+  size_t token;
+};
+
 }  // namespace tcmalloc
 
 inline bool AbslParseFlag(absl::string_view text, tcmalloc::hot_cold_t* hotness,
@@ -103,11 +178,34 @@ enum class ProfileType {
   // Lifetimes of sampled objects that are live during the profiling session.
   kLifetimes,
 
+  // Time spent waiting for TCMalloc's locks (pageheap_lock, transfer caches
+  // and central freelists) from the start of lock contention profiling until
+  // the profile was terminated with Stop().
+  kLockContention,
+
+  // Exact counts, without stack traces, of the objects of each size class that
+  // the per-CPU caches exchanged with the rest of TCMalloc, and of page-level
+  // allocations by power-of-two length.  Sizes are those of the size class or
+  // of the shortest length in the bucket.
+  kAllocationCounts,
+
+  // Live objects that keep mostly free hugepages from being released, charged
+  // with the free memory of their hugepage.  Complements kFragmentation, which
+  // charges objects for the free space of their spans.
+  kHugePageFragmentation,
+
   // Only present to prevent switch statements without a default clause so that
   // we can extend this enumeration without breaking code.
   kDoNotUse,
 };
 
+// A pprof-style label attached to profile samples, such as
+// {"rpc_method", "Search"}.  See MallocExtension::SetProfileLabels.
+struct ProfileLabel {
+  const char* key;
+  const char* value;
+};
+
 class Profile final {
  public:
   Profile() = default;
@@ -167,6 +265,14 @@ class Profile final {
     absl::Duration min_lifetime;
     absl::Duration max_lifetime;
 
+    // Sampled deallocations of the callstack pair, over all of its matching
+    // cases below, by lifetime: bucket i counts lifetimes in [10^i, 10^(i+1))
+    // ns, with shorter lifetimes in the first bucket and longer ones in the
+    // last.  Set on one pair of samples per callstack pair, and empty on the
+    // others and on right-censored observations.
+    static constexpr int kLifetimeHistogramBuckets = 13;
+    int64_t lifetime_histogram[kLifetimeHistogramBuckets] = {};
+
     // For the *_matched vars below we use true = "same", false = "different".
     // When the value is unavailable the profile contains "none". For
     // right-censored observations, CPU and thread matched values are "none".
@@ -193,7 +299,8 @@ class Profile final {
       TooSmall = -4,
       // Too many samples are already guarded.
       NoAvailableSlots = -5,
-      // Perhaps the only true error, when the mprotect call fails.
+      // Perhaps the only true error, when making the page accessible (with
+      // mprotect or by removing its guard region) fails.
       MProtectFailed = -6,
       // Used in an improved guarding selection algorithm.
       Filtered = -7,
@@ -218,6 +325,16 @@ class Profile final {
     // The start address of the sampled allocation, used to calculate the
     // residency info for the objects represented by this sampled allocation.
     void* span_start_address;
+
+    // Used by the lock contention profile, where sum is the total time spent
+    // waiting in nanoseconds and count the number of contended acquisitions:
+    // the name of the contended lock.
+    const char* contended_lock = nullptr;
+
+    // The labels set on the allocating thread when the sample was taken, see
+    // MallocExtension::SetProfileLabels.  Only heap, peak heap, fragmentation
+    // and allocation profiles carry labels.
+    absl::Span<const ProfileLabel> labels;
   };
 
   void Iterate(absl::FunctionRef<void(const Sample&)> f) const;
@@ -259,11 +376,27 @@ class AddressRegionFactory {
     kInfrequent ABSL_DEPRECATED("Use kInfrequentAllocation") =
         kInfrequentAllocation,
     kInfrequentAccess,  // TCMalloc places cold allocations in these regions.
+                        // Suitable for a slower memory tier; the default
+                        // factory prefers TCMALLOC_COLD_NUMA_NODE, if set.
     // Usage of the below implies numa_aware is enabled. tcmalloc will mbind the
     // address region to the hinted socket, but also passes the hint in case
     // mbind is not sufficient (e.g. when dealing with pre-faulted memory).
     kNormalNumaAwareS0,  // Normal usage intended for NUMA S0 under numa_aware.
     kNormalNumaAwareS1,  // Normal usage intended for NUMA S1 under numa_aware.
+    // Builds with more than two NUMA partitions use the following hints for
+    // partitions 2 through 7.
+    kNormalNumaAwareS2,
+    kNormalNumaAwareS3,
+    kNormalNumaAwareS4,
+    kNormalNumaAwareS5,
+    kNormalNumaAwareS6,
+    kNormalNumaAwareS7,
+    // TCMalloc places allocations made with tcmalloc::registered in these
+    // regions, and never releases their memory.  The region's Alloc() is
+    // called once per run of hugepages the registered heap grows by, so a
+    // factory can register each run (e.g. with ibv_reg_mr) as it is handed
+    // out.
+    kRegistered,
   };
 
   AddressRegionFactory() {}
@@ -315,6 +448,31 @@ class MallocExtension final {
   // statistics.
   static std::string GetStats();
 
+  enum class StatsFormat {
+    kText,   // The format of GetStats()
+    kPbtxt,  // Text protobuf
+  };
+
+  // Writes the current state of the malloc data structures to <sink> a
+  // section at a time, without requiring a buffer large enough for all of
+  // them.  Each section's numbers are gathered under the allocator's locks,
+  // but <sink> is called with none of them held and may allocate.
+  //
+  // The concatenation of what <sink> receives for kText matches GetStats().
+  static void WriteStats(StatsFormat format,
+                         absl::FunctionRef<void(absl::string_view)> sink);
+
+  // Writes a binary dump of the layout of the hugepages held by the
+  // hugepage-aware allocator to <sink>: for each page, whether it is used,
+  // free or released to the OS, and the size class of the span using it.
+  // The format is described in tcmalloc/huge_page_layout.h.  The dump is
+  // gathered a chunk at a time, holding the page heap lock only while each
+  // chunk is, and <sink> is called with no locks held.
+  //
+  // Writes nothing if the malloc implementation does not support this.
+  static void WriteHugePageLayout(
+      absl::FunctionRef<void(absl::string_view)> sink);
+
   // -------------------------------------------------------------------
   // Control operations for getting malloc implementation specific parameters.
   // Some currently useful properties:
@@ -418,6 +576,38 @@ class MallocExtension final {
   //   back in.
   static void ReleaseMemoryToSystem(size_t num_bytes);
 
+  // One entry of the size distribution given to Prewarm: objects of <size>
+  // bytes make up <weight> of the heap, relative to the other entries.
+  struct PrewarmSize {
+    size_t size;
+    double weight;
+  };
+
+  // Warms the heap up for a workload about to start, for example before a
+  // server takes traffic, so that its first allocations take neither page
+  // faults nor slow-path refills.  Allocates and touches about <bytes> of
+  // objects, sized as <size_histogram> describes, and then frees them.  This
+  // backs the hugepages they occupy, grows the transfer caches of their size
+  // classes and fills them, and fills the calling thread's per-CPU cache,
+  // growing its capacities.  With an empty histogram, <bytes> of whole
+  // hugepages are backed instead.
+  //
+  // Returns the number of bytes warmed, which falls short of <bytes> if
+  // allocation fails, for example at the memory limit.  Only the caches of
+  // the calling CPU are filled; call this from threads on other CPUs to warm
+  // theirs.  Warmed memory is free memory, and may be released to the OS
+  // like any other (see SetBackgroundReleaseRate).
+  static size_t Prewarm(size_t bytes,
+                        absl::Span<const PrewarmSize> size_histogram);
+
+  // Gives allocations carrying the type token <token> (see alloc_token_t) a
+  // partition of the heap, whose objects are taken from spans holding no other
+  // type.  Meant for a few hot types, such as the nodes of large linked data
+  // structures: partitioned allocations bypass the per-CPU caches, and are
+  // slower than plain ones.  Returns false if all partitions are taken, or if
+  // TCMalloc is not in use.  Partitions are never released.
+  static bool PartitionAllocToken(size_t token);
+
   enum class LimitKind { kSoft, kHard };
 
   // Make a best effort attempt to prevent more than limit bytes of memory
@@ -460,6 +650,127 @@ class MallocExtension final {
   // Deprecated compatibility shim.
   ABSL_DEPRECATED("Use LimitKind version") static MemoryLimit GetMemoryLimit();
 
+  // Allocation domains partition the page-level allocations (those too large
+  // for the per-CPU caches) of a process, e.g. between the tenants of a
+  // multi-tenant server.  Each thread charges its page-level allocations to
+  // its current domain, 0 unless set otherwise.  A domain may be given limits
+  // independent of the process-wide ones: an allocation that would take a
+  // domain over its hard limit fails, and one that takes it over its soft
+  // limit releases as much free memory to the OS as it allocates, so that the
+  // cost falls on the domain's own threads.  Smaller allocations are cached
+  // for, and shared by, all domains.
+  static constexpr int kMaxAllocationDomains = 16;
+
+  // Gets or sets the calling thread's current allocation domain.
+  // REQUIRES: 0 <= domain < kMaxAllocationDomains
+  static int GetAllocationDomain();
+  static void SetAllocationDomain(int domain);
+
+  // Sets the calling thread's current allocation domain for its lifetime.
+  class ScopedAllocationDomain {
+   public:
+    explicit ScopedAllocationDomain(int domain)
+        : previous_(GetAllocationDomain()) {
+      SetAllocationDomain(domain);
+    }
+    ~ScopedAllocationDomain() { SetAllocationDomain(previous_); }
+
+    ScopedAllocationDomain(const ScopedAllocationDomain&) = delete;
+    ScopedAllocationDomain& operator=(const ScopedAllocationDomain&) = delete;
+
+   private:
+    int previous_;
+  };
+
+  // Gets or sets a limit on the page-level allocations of <domain>.  A limit
+  // of 0 removes it.
+  static size_t GetAllocationDomainLimit(int domain, LimitKind limit_kind);
+  static void SetAllocationDomainLimit(int domain, size_t limit,
+                                       LimitKind limit_kind);
+
+  // Returns the bytes of page-level allocations charged to <domain>.
+  static size_t GetAllocationDomainUsage(int domain);
+
+  // Allocation QoS classes.  The per-CPU caches are shared by all threads
+  // running on a CPU, so batch or background threads churning through objects
+  // can drain the capacity that latency-critical threads rely on, sending them
+  // down the refill slow path.  kBatch threads keep their objects in a cache of
+  // their own instead, at some cost to their own allocation speed.  Threads
+  // are kLatencyCritical unless set otherwise.  The class has no effect when
+  // per-CPU caches are not active.
+  enum class AllocationQoS { kLatencyCritical = 0, kBatch = 1 };
+
+  // Gets or sets the calling thread's allocation QoS class.
+  static AllocationQoS GetThreadAllocationQoS();
+  static void SetThreadAllocationQoS(AllocationQoS qos);
+
+  // Sets the calling thread's allocation QoS class for its lifetime.
+  class ScopedAllocationQoS {
+   public:
+    explicit ScopedAllocationQoS(AllocationQoS qos)
+        : previous_(GetThreadAllocationQoS()) {
+      SetThreadAllocationQoS(qos);
+    }
+    ~ScopedAllocationQoS() { SetThreadAllocationQoS(previous_); }
+
+    ScopedAllocationQoS(const ScopedAllocationQoS&) = delete;
+    ScopedAllocationQoS& operator=(const ScopedAllocationQoS&) = delete;
+
+   private:
+    AllocationQoS previous_;
+  };
+
+  // Cumulative bytes allocated and freed by a thread, each object counted at
+  // its allocated size (see GetAllocatedSize).  Frees are charged to the
+  // thread that frees, so the difference is not the thread's live heap.
+  struct ThreadAllocatedBytes {
+    uint64_t allocated = 0;
+    uint64_t freed = 0;
+  };
+
+  // Returns the calling thread's counters, e.g. to charge the allocations of
+  // a request to it by differencing readings taken at its start and end.
+  // The counters are updated without atomics on the allocation and free fast
+  // paths, so reading them is a couple of loads of thread-local storage.
+  static ThreadAllocatedBytes GetThreadAllocatedBytes();
+
+  // Gets or sets the labels attached to the samples taken of the calling
+  // thread's allocations, e.g. the RPC method or tenant the thread is serving,
+  // so that profiles can be broken down by them.  An empty set clears them.
+  // Taking a sample reads them from thread-local storage.
+  //
+  // The labels are not copied: <labels> and the strings it points to must
+  // outlive the allocations sampled under them and any profile holding their
+  // samples, so they are typically static.
+  static absl::Span<const ProfileLabel> GetProfileLabels();
+  static void SetProfileLabels(absl::Span<const ProfileLabel> labels);
+
+  // Sets the calling thread's profile labels for its lifetime.
+  class ScopedProfileLabels {
+   public:
+    explicit ScopedProfileLabels(absl::Span<const ProfileLabel> labels)
+        : previous_(GetProfileLabels()) {
+      SetProfileLabels(labels);
+    }
+    ~ScopedProfileLabels() { SetProfileLabels(previous_); }
+
+    ScopedProfileLabels(const ScopedProfileLabels&) = delete;
+    ScopedProfileLabels& operator=(const ScopedProfileLabels&) = delete;
+
+   private:
+    absl::Span<const ProfileLabel> previous_;
+  };
+
+  // Returns a size class configuration that reduces the internal
+  // fragmentation of the allocations in <profile> (e.g. from
+  // SnapshotCurrent(ProfileType::kHeap), or ProfileType::kAllocationCounts to
+  // weigh the current size classes by exact counts), or an empty string if
+  // unsupported.
+  // Naming a file with this configuration in the TCMALLOC_SIZE_CLASSES_FILE
+  // environment variable makes TCMalloc use it from startup; an invalid
+  // configuration is ignored.
+  static std::string GetSizeClassesForProfile(const Profile& profile);
+
   // Gets the sampling rate.  Returns a value < 0 if unknown.
   static int64_t GetProfileSamplingRate();
   // Sets the sampling rate for heap profiles.  TCMalloc samples approximately
@@ -502,6 +813,21 @@ class MallocExtension final {
   static bool GetBackgroundProcessActionsEnabled();
   static void SetBackgroundProcessActionsEnabled(bool value);
 
+  // Gets and sets the number of free hugepages that background actions (see
+  // ProcessBackgroundActions) keep backed and faulted in ahead of demand, per
+  // NUMA partition.  This takes first-touch page faults off the allocation
+  // path for requests that need a fresh hugepage, at the cost of that much
+  // extra resident memory.  Zero (the default) disables prefaulting.
+  static int64_t GetPrefaultHugePages();
+  static void SetPrefaultHugePages(int64_t value);
+
+  // Gets and sets the sampling interval of allocation slow path timing.  On
+  // average one in <value> CPU cache refills, transfer cache removals and page
+  // allocations is timed into per-size-class latency histograms, reported by
+  // GetStats().  Zero (the default) disables timing.
+  static int64_t GetAllocLatencySamplingInterval();
+  static void SetAllocLatencySamplingInterval(int64_t value);
+
   // Gets and sets background process sleep time. This controls the interval
   // granularity at which the actions are invoked.
   static absl::Duration GetBackgroundProcessSleepInterval();
@@ -541,6 +867,21 @@ class MallocExtension final {
   // null.
   static std::optional<size_t> GetAllocatedSize(const void* p);
 
+  // Allocates <n> objects of at least <size> bytes each, storing them in
+  // batch[0, n).  This is equivalent to calling malloc(size) <n> times, but
+  // the size class lookup and per-CPU cache access are done once for the whole
+  // batch.  Returns the number of objects allocated, which is less than <n>
+  // only on allocation failure.
+  static size_t AllocateBatch(size_t size, size_t n, void** batch);
+
+  // Frees the <n> objects in batch[0, n), all of which must have been
+  // allocated with a request of <size> bytes (for example, by AllocateBatch).
+  // A <size> of 0 means the sizes are unknown; such batches may mix objects of
+  // any size, and are freed faster than by calling free() on each object, as
+  // their size lookups are overlapped and objects of the same size class are
+  // freed together.  The contents of <batch> are unspecified on return.
+  static void FreeBatch(void** batch, size_t n, size_t size);
+
   // Returns
   // * kOwned if TCMalloc allocated the memory pointed to by p, or
   // * kNotOwned if allocated elsewhere or p is null.
@@ -553,6 +894,14 @@ class MallocExtension final {
   enum class Ownership { kUnknown = 0, kOwned, kNotOwned };
   static Ownership GetOwnership(const void* p);
 
+  // Returns true if p, a live allocation, is a small object on a nearly empty
+  // hugepage, of which at most a quarter is in use.  Applications that can
+  // move their objects may move such objects to allocations made with
+  // tcmalloc::dense, so that the hugepage drains and can be returned to the OS
+  // whole.  Always false for large and sampled allocations, and for memory not
+  // allocated by TCMalloc.
+  static bool IsOnSparseHugepage(const void* p);
+
   // Type used by GetProperties.  See comment on GetProperties.
   struct Property {
     size_t value;
@@ -580,6 +929,20 @@ class MallocExtension final {
 
   static Profile SnapshotCurrent(tcmalloc::ProfileType type);
 
+  // Returns the changes to the heap profile since `*cursor`, and advances
+  // `*cursor` for the next call.  Start with a cursor of zero.
+  //
+  // Samples are aggregated by stack: each reported sample carries the current
+  // count, sum and stack of the live sampled allocations at one stack, and
+  // replaces whatever was last reported for that stack.  A count of zero means
+  // that no sampled allocation at the stack is live anymore.  Stacks whose
+  // totals did not change are not reported.  The other fields of the samples
+  // are not set.
+  //
+  // The cost of a call does not grow with the number of live samples, so this
+  // suits continuous profiling better than SnapshotCurrent(kHeap).
+  static Profile SnapshotHeapDelta(uint64_t* cursor);
+
   // AllocationProfilingToken tracks an active profiling session started with
   // StartAllocationProfiling.  Profiling continues until Stop() is called.
   class AllocationProfilingToken {
@@ -615,6 +978,11 @@ class MallocExtension final {
   // session. Returns null if the implementation does not support profiling.
   static AllocationProfilingToken StartLifetimeProfiling();
 
+  // Start recording time spent waiting for TCMalloc's internal locks, with the
+  // stack trace of the waiting thread.  Returns null if the implementation
+  // does not support profiling.
+  static AllocationProfilingToken StartLockContentionProfiling();
+
   // Runs housekeeping actions for the allocator off of the main allocation path
   // of new/delete.  As of 2020, this includes:
   // * Inspecting the current CPU mask and releasing memory from inaccessible
@@ -641,6 +1009,25 @@ class MallocExtension final {
   // Specifies the release rate from the page heap.  ProcessBackgroundActions
   // must be called for this to be operative.
   static void SetBackgroundReleaseRate(BytesPerSecond rate);
+
+  // Allocator activity during one second.
+  struct HeapTelemetryEpoch {
+    // The end of the second.
+    absl::Time end;
+    // Bytes allocated and freed by the application, estimated from sampled
+    // allocations (see GetProfileSamplingRate()).
+    size_t allocated_bytes = 0;
+    size_t freed_bytes = 0;
+    // Underflows and overflows of the per-CPU caches.
+    size_t per_cpu_cache_misses = 0;
+    // Bytes released to the OS by the page heap.
+    size_t released_bytes = 0;
+  };
+
+  // Returns the allocator activity of each of the last 60 seconds, oldest
+  // first, as recorded by ProcessBackgroundActions.  Seconds in which it did
+  // not run are missing.  Empty if ProcessBackgroundActions is not running.
+  static std::vector<HeapTelemetryEpoch> GetHeapTelemetry();
 };
 
 }  // namespace tcmalloc
@@ -730,13 +1117,140 @@ tcmalloc_size_returning_operator_new_aligned_hot_cold_nothrow(
 
 #endif  // __cpp_aligned_new
 
+// Allocate and free <size> bytes, given the index of <size> in TCMalloc's size
+// class table.  Use tcmalloc::AllocateFixed and tcmalloc::DeallocateFixed
+// rather than calling these directly.
+//
+// The default weak implementations call ::operator new and ::operator delete.
+void* tcmalloc_allocate_fixed(size_t size, size_t index);
+void tcmalloc_deallocate_fixed(void* ptr, size_t size, size_t index) noexcept;
+
 }  // extern "C"
 
+namespace tcmalloc {
+
+namespace tcmalloc_internal {
+
+// Returns the index of <size> in TCMalloc's size class table, which maps sizes
+// to size classes in steps of 8 bytes up to 1024 bytes and of 128 bytes above.
+// Must match SizeMap::ClassIndexMaybe.
+constexpr size_t FixedSizeIndex(size_t size) {
+  return size <= 1024 ? (size + 7) >> 3 : (size + 127 + (120 << 7)) >> 7;
+}
+
+}  // namespace tcmalloc_internal
+
+// Allocates <N> bytes, as ::operator new(N) would, for objects whose size is
+// known at compile time (e.g. the nodes of node-based containers).  The
+// object's entry in the size class table is resolved at compile time, so the
+// allocation skips the size class computation on the fast path.
+//
+// The memory must be freed with DeallocateFixed<N> or ::operator delete.
+template <size_t N>
+void* AllocateFixed() {
+  static_assert(N > 0, "AllocateFixed requires a non-zero size");
+  constexpr size_t kIndex = tcmalloc_internal::FixedSizeIndex(N);
+  return tcmalloc_allocate_fixed(N, kIndex);
+}
+
+// Frees <ptr>, which must have been allocated with a request of <N> bytes (for
+// example, by AllocateFixed<N>).  <ptr> may be null.
+template <size_t N>
+void DeallocateFixed(void* ptr) noexcept {
+  constexpr size_t kIndex = tcmalloc_internal::FixedSizeIndex(N);
+  tcmalloc_deallocate_fixed(ptr, N, kIndex);
+}
+
+// Tries to resize the allocation at <p> in place so that it holds at least
+// <min_size> bytes, growing it up to <max_size> bytes when the memory that
+// follows is free, or shrinking it towards <max_size> when it is larger.  The
+// allocation never moves.  Returns its usable size afterwards, which is less
+// than <min_size> if it could not be grown; containers can then fall back to
+// allocating and copying.
+//
+// Objects of a size class cannot change size and report their class's full
+// capacity.  Returns 0 when the allocator does not support resizing in place.
+//
+// REQUIRES: <p> is non-null and owned by TCMalloc, and min_size <= max_size.
+size_t TryResizeInPlace(void* p, size_t min_size, size_t max_size);
+
+// Frees <p>, deferring the return of its pages to the page heap to the thread
+// running ProcessBackgroundActions(), so that freeing a buffer of hundreds of
+// megabytes does not stall the caller on page heap bookkeeping and release.
+// Deferred memory remains allocated, counting towards the memory limits, until
+// the background thread gets to it.  Small and sampled allocations, and all
+// allocations while no background thread is running, are freed right away.
+// The second form takes the size that <p> was allocated with, as for sized
+// delete.
+//
+// REQUIRES: <p> is null or was allocated with malloc() or, when linked against
+// TCMalloc, with any of its allocation functions.
+void FreeLater(void* p);
+void FreeLater(void* p, size_t size);
+
+}  // namespace tcmalloc
+
 #ifndef MALLOCX_LG_ALIGN
 #define MALLOCX_LG_ALIGN(la) (la)
 #endif
 
 namespace tcmalloc {
+
+// Region is a bump-pointer arena for objects that share a lifetime, such as
+// request-scoped data.  Objects are carved out of large chunks of memory and
+// are never freed individually: all chunks are returned to the allocator at
+// once when the Region is destroyed or Reset() is called.
+//
+// When linked against TCMalloc, chunks are whole, hugepage-aligned hugepages
+// obtained directly from the hugepage cache.  They are never packed into
+// hugepages shared with other allocations, and returning them requires no
+// per-object bookkeeping.
+//
+// Region is not thread-safe.
+class Region final {
+ public:
+  static constexpr size_t kDefaultChunkSize = 2 << 20;
+
+  // <chunk_size> is the minimum number of bytes requested from the allocator
+  // each time the Region runs out of space.
+  explicit Region(size_t chunk_size = kDefaultChunkSize);
+  Region(const Region&) = delete;
+  Region& operator=(const Region&) = delete;
+  ~Region();
+
+  // Returns <size> bytes aligned to <alignment>, or nullptr if memory could
+  // not be obtained.  <alignment> must be a power of two.  The memory remains
+  // valid until the Region is destroyed or reset.
+  void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+  // Returns all memory obtained by this Region to the allocator.
+  void Reset();
+
+  // Returns the number of bytes handed out by Allocate since the last Reset.
+  size_t allocated_bytes() const { return allocated_bytes_; }
+
+  // Returns the number of bytes currently obtained from the allocator.
+  size_t reserved_bytes() const { return reserved_bytes_; }
+
+ private:
+  // Chunks are threaded through a header at their start.
+  struct Chunk {
+    Chunk* next;
+    size_t size;
+  };
+
+  // Obtains a chunk with room for at least <payload> bytes after its header.
+  // The chunk becomes the current bump-pointer target if <make_current>.
+  Chunk* NewChunk(size_t payload, bool make_current);
+
+  size_t chunk_size_;
+  Chunk* chunks_ = nullptr;
+  char* cursor_ = nullptr;
+  char* limit_ = nullptr;
+  size_t allocated_bytes_ = 0;
+  size_t reserved_bytes_ = 0;
+};
+
 namespace tcmalloc_internal {
 
 // AllocationProfilingTokenBase tracks an on-going profiling session of sampled
@@ -37,5 +37,21 @@ absl::StatusOr<AllocatedAddressRanges> GetAllocatedAddressRanges() {
       "malloc_tracing_extension routines not exported by the current malloc.");
 }
 
+absl::Status ForEachLiveObject(
+    absl::FunctionRef<void(const LiveObject&)> callback, int partition,
+    int num_partitions) {
+  if (num_partitions <= 0 || partition < 0 || partition >= num_partitions) {
+    return absl::InvalidArgumentError("partition out of range");
+  }
+#if ABSL_HAVE_ATTRIBUTE_WEAK && !defined(__APPLE__) && !defined(__EMSCRIPTEN__)
+  if (&MallocTracingExtension_Internal_ForEachLiveObject != nullptr) {
+    return MallocTracingExtension_Internal_ForEachLiveObject(
+        callback, partition, num_partitions);
+  }
+#endif
+  return absl::UnimplementedError(
+      "malloc_tracing_extension routines not exported by the current malloc.");
+}
+
 }  // namespace malloc_tracing_extension
 }  // namespace tcmalloc
@@ -24,6 +24,8 @@
 #include <cstdint>
 #include <vector>
 
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 
 namespace tcmalloc {
@@ -48,6 +50,31 @@ struct AllocatedAddressRanges {
 // Returns the address ranges currently allocated by TCMalloc.
 absl::StatusOr<AllocatedAddressRanges> GetAllocatedAddressRanges();
 
+// An object passed to ForEachLiveObject's callback.
+struct LiveObject {
+  uintptr_t start_addr;
+  // As for SpanDetails::object_size, the size-class bytes of objects that fit
+  // into some size-class.  Larger objects are reported with the size of their
+  // whole span.
+  size_t size;
+};
+
+// Calls <callback> for each object currently allocated by TCMalloc, without
+// building a list of them first.  Objects of a size class are found from the
+// freelists of their spans, so objects (and spans) that are free but held in
+// TCMalloc's caches are reported as well: the result errs on the side of
+// liveness, as a conservative collector needs.  Objects allocated or freed
+// during the call may or may not be reported.
+//
+// The spans are split into <num_partitions> sets, by hugepage, and only the
+// objects of set <partition> are reported, so that several threads can walk
+// the heap in parallel, each calling with its own partition.  Locks are only
+// held for a bounded number of spans at a time, and never while calling
+// <callback>, which may allocate.
+absl::Status ForEachLiveObject(
+    absl::FunctionRef<void(const LiveObject&)> callback, int partition = 0,
+    int num_partitions = 1);
+
 }  // namespace malloc_tracing_extension
 }  // namespace tcmalloc
 
@@ -0,0 +1,83 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/memory_resource.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <memory_resource>
+#include <new>
+
+#include "absl/base/config.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/declarations.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace {
+
+// Whether ::operator new(bytes) already provides <alignment>.
+bool IsDefaultAlignment(size_t alignment) {
+  return alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+}
+
+}  // namespace
+
+size_t MemoryResource::allocate_batch(size_t bytes, size_t n, void** batch) {
+  return MallocExtension::AllocateBatch(bytes, n, batch);
+}
+
+void MemoryResource::deallocate_batch(void** batch, size_t n, size_t bytes) {
+  MallocExtension::FreeBatch(batch, n, bytes);
+}
+
+void* MemoryResource::do_allocate(size_t bytes, size_t alignment) {
+  if (ABSL_PREDICT_TRUE(IsDefaultAlignment(alignment))) {
+    return ::operator new(bytes);
+  }
+  return ::operator new(bytes, static_cast<std::align_val_t>(alignment));
+}
+
+void MemoryResource::do_deallocate(void* p, size_t bytes, size_t alignment) {
+  if (ABSL_PREDICT_TRUE(IsDefaultAlignment(alignment))) {
+    ::operator delete(p, bytes);
+    return;
+  }
+  ::operator delete(p, bytes, static_cast<std::align_val_t>(alignment));
+}
+
+bool MemoryResource::do_is_equal(
+    const std::pmr::memory_resource& other) const noexcept {
+  return dynamic_cast<const MemoryResource*>(&other) != nullptr;
+}
+
+MemoryResource* GetMemoryResource() {
+  static MemoryResource* const resource = new MemoryResource;
+  return resource;
+}
+
+void* MonotonicMemoryResource::do_allocate(size_t bytes, size_t alignment) {
+  void* p = region_.Allocate(bytes, alignment);
+  if (ABSL_PREDICT_FALSE(p == nullptr)) {
+#ifdef ABSL_HAVE_EXCEPTIONS
+    throw std::bad_alloc();
+#else
+    abort();
+#endif
+  }
+  return p;
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,92 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// std::pmr::memory_resource implementations backed by TCMalloc.
+
+#ifndef TCMALLOC_MEMORY_RESOURCE_H_
+#define TCMALLOC_MEMORY_RESOURCE_H_
+
+#include <stddef.h>
+
+#include <memory_resource>
+
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+
+// A memory_resource that allocates directly from TCMalloc.  Unlike
+// std::pmr::new_delete_resource(), deallocation always passes the size and
+// alignment on, so TCMalloc finds the object's size class without looking up
+// the pointer.
+//
+// All MemoryResource instances are interchangeable; use GetMemoryResource()
+// rather than creating new ones.
+class MemoryResource final : public std::pmr::memory_resource {
+ public:
+  // Allocates <n> objects of <bytes> bytes each, with the default alignment
+  // of ::operator new, storing them in batch[0, n).  The size class lookup
+  // and per-CPU cache access are done once for the whole batch, which suits
+  // node allocators that reserve nodes ahead of use.  Returns the number of
+  // objects allocated, which is less than <n> only on allocation failure.
+  //
+  // The objects may be returned individually with deallocate(p, bytes), or
+  // together with deallocate_batch.
+  size_t allocate_batch(size_t bytes, size_t n, void** batch);
+
+  // Frees the <n> objects of <bytes> bytes in batch[0, n), all allocated with
+  // the default alignment.  The contents of <batch> are unspecified on return.
+  void deallocate_batch(void** batch, size_t n, size_t bytes);
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// Returns the process-wide MemoryResource.  Like
+// std::pmr::new_delete_resource(), it is never destroyed.
+MemoryResource* GetMemoryResource();
+
+// A memory_resource that carves objects out of a tcmalloc::Region, for
+// objects that share a lifetime.  Deallocation does nothing; all memory is
+// returned to TCMalloc by release() or on destruction.  Like
+// std::pmr::monotonic_buffer_resource, it is not thread-safe.
+class MonotonicMemoryResource final : public std::pmr::memory_resource {
+ public:
+  // <chunk_size> is the minimum number of bytes requested from TCMalloc each
+  // time the resource runs out of space.
+  explicit MonotonicMemoryResource(
+      size_t chunk_size = Region::kDefaultChunkSize)
+      : region_(chunk_size) {}
+
+  // Returns all memory allocated from this resource to TCMalloc.
+  void release() { region_.Reset(); }
+
+  const Region& region() const { return region_; }
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void*, size_t, size_t) override {}
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+
+  Region region_;
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_MEMORY_RESOURCE_H_
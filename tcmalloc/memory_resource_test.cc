@@ -0,0 +1,113 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/memory_resource.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <list>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace {
+
+TEST(MemoryResource, Containers) {
+  std::pmr::vector<std::pmr::string> strings(GetMemoryResource());
+  for (int i = 0; i < 1000; ++i) {
+    strings.emplace_back(100 + i % 50, 'x');
+  }
+  for (const std::pmr::string& s : strings) {
+    EXPECT_EQ(s.get_allocator().resource(), GetMemoryResource());
+  }
+
+  std::pmr::list<int> list(GetMemoryResource());
+  for (int i = 0; i < 1000; ++i) list.push_back(i);
+  EXPECT_EQ(list.size(), 1000);
+}
+
+TEST(MemoryResource, Alignment) {
+  std::pmr::memory_resource* resource = GetMemoryResource();
+  for (size_t alignment : {1, 8, 16, 64, 4096}) {
+    for (size_t bytes : {1, 24, 100, 5000}) {
+      void* p = resource->allocate(bytes, alignment);
+      ASSERT_NE(p, nullptr);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % alignment, 0);
+      EXPECT_THAT(MallocExtension::GetAllocatedSize(p),
+                  testing::Optional(testing::Ge(bytes)));
+      memset(p, 0xef, bytes);
+      resource->deallocate(p, bytes, alignment);
+    }
+  }
+}
+
+TEST(MemoryResource, Batch) {
+  constexpr size_t kCount = 64;
+  void* batch[kCount];
+  for (size_t bytes : {8, 100, 4096}) {
+    ASSERT_EQ(GetMemoryResource()->allocate_batch(bytes, kCount, batch),
+              kCount);
+    for (void* p : batch) {
+      ASSERT_NE(p, nullptr);
+      memset(p, 0xef, bytes);
+    }
+    // Return half individually, and the rest together.
+    for (size_t i = 0; i < kCount / 2; ++i) {
+      GetMemoryResource()->deallocate(batch[i], bytes);
+    }
+    GetMemoryResource()->deallocate_batch(batch + kCount / 2, kCount / 2,
+                                          bytes);
+  }
+}
+
+TEST(MemoryResource, IsEqual) {
+  MemoryResource other;
+  EXPECT_TRUE(GetMemoryResource()->is_equal(other));
+  EXPECT_FALSE(
+      GetMemoryResource()->is_equal(*std::pmr::new_delete_resource()));
+
+  MonotonicMemoryResource monotonic;
+  EXPECT_TRUE(monotonic.is_equal(monotonic));
+  EXPECT_FALSE(monotonic.is_equal(*GetMemoryResource()));
+}
+
+TEST(MonotonicMemoryResource, AllocateAndRelease) {
+  MonotonicMemoryResource resource;
+  {
+    std::pmr::list<std::pmr::string> list(&resource);
+    for (int i = 0; i < 10000; ++i) {
+      list.emplace_back(64, 'x');
+    }
+    EXPECT_GT(resource.region().allocated_bytes(), 10000 * 64);
+    EXPECT_GE(resource.region().reserved_bytes(),
+              resource.region().allocated_bytes());
+  }
+
+  void* p = resource.allocate(100, 64);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % 64, 0);
+
+  resource.release();
+  EXPECT_EQ(resource.region().allocated_bytes(), 0);
+  EXPECT_EQ(resource.region().reserved_bytes(), 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc
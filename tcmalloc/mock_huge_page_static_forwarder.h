@@ -28,8 +28,10 @@
 #include "absl/hash/hash.h"
 #include "absl/numeric/bits.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/huge_page_filler.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
@@ -54,8 +56,19 @@ class FakeStaticForwarder {
   absl::Duration filler_skip_subrelease_long_interval() {
     return long_interval_;
   }
+  SubreleaseDemandPredictor filler_skip_subrelease_predictor() {
+    return predictor_;
+  }
   bool release_partial_alloc_pages() { return release_partial_alloc_pages_; }
   bool hpaa_subrelease() { return hpaa_subrelease_; }
+  bool async_release() { return async_release_; }
+  bool adaptive_madvise_free() { return adaptive_madvise_free_; }
+  double filler_fragmentation_region_threshold() {
+    return filler_fragmentation_region_threshold_;
+  }
+  uint8_t filler_partition() { return filler_partition_; }
+  void WakeBackgroundRelease(MemoryTag tag) { ++background_wakeups_; }
+  size_t background_wakeups() const { return background_wakeups_; }
 
   void set_filler_skip_subrelease_interval(absl::Duration v) {
     subrelease_interval_ = v;
@@ -66,10 +79,21 @@ class FakeStaticForwarder {
   void set_filler_skip_subrelease_long_interval(absl::Duration v) {
     long_interval_ = v;
   }
+  void set_filler_skip_subrelease_predictor(SubreleaseDemandPredictor v) {
+    predictor_ = v;
+  }
   void set_release_partial_alloc_pages(bool v) {
     release_partial_alloc_pages_ = v;
   }
   void set_hpaa_subrelease(bool v) { hpaa_subrelease_ = v; }
+  void set_async_release(bool v) { async_release_ = v; }
+  void set_adaptive_madvise_free(bool v) { adaptive_madvise_free_ = v; }
+  void set_filler_fragmentation_region_threshold(double v) {
+    filler_fragmentation_region_threshold_ = v;
+  }
+  // Bytes passed to ReleasePages with ReleaseMode::kLazy.
+  size_t lazy_released_bytes() const { return lazy_released_bytes_; }
+  void set_filler_partition(uint8_t v) { filler_partition_ = v; }
   bool release_succeeds() const { return release_succeeds_; }
   void set_release_succeeds(bool v) { release_succeeds_ = v; }
 
@@ -81,7 +105,7 @@ class FakeStaticForwarder {
   // Check page heap memory limit.  `n` indicates the size of the allocation
   // currently being made, which will not be included in the sampled memory heap
   // for realized fragmentation estimation.
-  void ShrinkToUsageLimit(Length n)
+  void ShrinkToUsageLimit(Length n, MemoryTag tag)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {}
 
   // PageMap state.
@@ -132,13 +156,35 @@ class FakeStaticForwarder {
     return ret;
   }
   // TODO(ckennelly): Accept PageId/Length.
-  bool ReleasePages(void* ptr, size_t size) {
+  bool ReleasePages(void* ptr, size_t size,
+                    ReleaseMode mode = ReleaseMode::kDefault) {
     const uintptr_t start = reinterpret_cast<uintptr_t>(ptr) & ~kTagMask;
     const uintptr_t end = start + size;
     CHECK_CONDITION(end <= fake_allocation_);
 
+    if (release_succeeds_ && mode == ReleaseMode::kLazy) {
+      lazy_released_bytes_ += size;
+    }
     return release_succeeds_;
   }
+  size_t ReleasePagesBatch(absl::Span<const AddressRange> ranges,
+                           size_t* syscalls,
+                           ReleaseMode mode = ReleaseMode::kDefault) {
+    *syscalls = ranges.empty() ? 0 : 1;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      if (!ReleasePages(ranges[i].ptr, ranges[i].bytes, mode)) return i;
+    }
+    return ranges.size();
+  }
+  Length ReleaseGranularity() const { return release_granularity_; }
+  void set_release_granularity(Length n) { release_granularity_ = n; }
+  bool PrefaultPages(void* ptr, size_t size) { return true; }
+  bool CollapsePages(void* ptr, size_t size) { return true; }
+  bool BackGigaPages(void* ptr, size_t size, MemoryTag tag) { return true; }
+  bool MovePages(void* from, void* to, size_t size, MemoryTag tag) {
+    return true;
+  }
+  bool MemoryIsZeroFilled() { return true; }
 
  private:
   static absl::base_internal::LowLevelAlloc::Arena* ll_arena() {
@@ -152,8 +198,16 @@ class FakeStaticForwarder {
   }
 
   absl::Duration subrelease_interval_, short_interval_, long_interval_;
+  SubreleaseDemandPredictor predictor_ = SubreleaseDemandPredictor::kIntervals;
   bool release_partial_alloc_pages_ = false;
   bool hpaa_subrelease_ = true;
+  bool async_release_ = false;
+  bool adaptive_madvise_free_ = false;
+  double filler_fragmentation_region_threshold_ = 0;
+  size_t lazy_released_bytes_ = 0;
+  Length release_granularity_ = Length(1);
+  uint8_t filler_partition_ = kAnyFillerPartition;
+  size_t background_wakeups_ = 0;
   bool release_succeeds_ = true;
   Arena arena_;
 
@@ -39,6 +39,14 @@ class FakeStaticForwarder {
   size_t class_to_size(int size_class) const { return class_size_; }
   Length class_to_pages(int size_class) const { return pages_; }
   size_t num_objects_to_move() const { return num_objects_to_move_; }
+  bool span_cache_coloring() const { return span_cache_coloring_; }
+  void set_span_cache_coloring(bool v) { span_cache_coloring_ = v; }
+  bool empty_span_cache() const { return empty_span_cache_; }
+  void set_empty_span_cache(bool v) { empty_span_cache_ = v; }
+  bool remote_frees() const { return remote_frees_; }
+  void set_remote_frees(bool v) { remote_frees_ = v; }
+  bool dynamic_span_pages() const { return dynamic_span_pages_; }
+  void set_dynamic_span_pages(bool v) { dynamic_span_pages_ = v; }
 
   void MapObjectsToSpans(absl::Span<void*> batch, Span** spans) {
     for (size_t i = 0; i < batch.size(); ++i) {
@@ -106,6 +114,10 @@ class FakeStaticForwarder {
   size_t class_size_;
   Length pages_;
   size_t num_objects_to_move_;
+  bool span_cache_coloring_ = false;
+  bool empty_span_cache_ = false;
+  bool remote_frees_ = false;
+  bool dynamic_span_pages_ = false;
 };
 
 class RawMockStaticForwarder : public FakeStaticForwarder {
@@ -24,5 +24,7 @@ ABSL_CONST_INIT bool FakeShardedTransferCacheManager::enable_generic_cache_(
 ABSL_CONST_INIT bool
     FakeShardedTransferCacheManager::enable_cache_for_large_classes_only_(
         false);
+ABSL_CONST_INIT bool FakeShardedTransferCacheManager::auto_configure_classes_(
+    false);
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -125,10 +125,15 @@ class FakeShardedTransferCacheManager
   static void SetCacheForLargeClassesOnly(bool value) {
     enable_cache_for_large_classes_only_ = value;
   }
+  static bool AutoConfigureClasses() { return auto_configure_classes_; }
+  static void SetAutoConfigureClasses(bool value) {
+    auto_configure_classes_ = value;
+  }
 
  private:
   static bool enable_generic_cache_;
   static bool enable_cache_for_large_classes_only_;
+  static bool auto_configure_classes_;
 };
 
 // Wires up a largely functional TransferCache + TransferCacheManager +
@@ -57,7 +57,7 @@ inline AddressRange FakeVirtualAllocator::operator()(size_t bytes,
   align /= kHugePageSize;
   size_t index = backing_.size();
   if (index % align != 0) {
-    index += (align - (index & align));
+    index += (align - (index % align));
   }
   if (index + bytes > kMaxBacking) return {nullptr, 0};
   backing_.resize(index + bytes);
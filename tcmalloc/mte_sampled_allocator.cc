@@ -0,0 +1,265 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/mte_sampled_allocator.h"
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/internal/sysinfo.h"
+#include "absl/debugging/stacktrace.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/exponential_biased.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/memory_tagging.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/system-alloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+static_assert(MteSampledAllocator::kNumSlots <= UINT16_MAX + 1);
+
+bool MteSampledAllocator::Activate() {
+  if (active()) return true;
+  if (!MemoryTaggingSupported()) return false;
+
+  {
+    AllocationGuardSpinLockHolder l(&pageheap_lock);
+    AllocationGuardSpinLockHolder h(&lock_);
+    if (base_addr_ != 0) return active();
+
+    const size_t len = (kNumSlots + 1) * kPageSize;
+    auto base_addr = reinterpret_cast<uintptr_t>(
+        MmapAligned(len, kPageSize, MemoryTag::kSampled));
+    if (!base_addr) return false;
+    if (mprotect(reinterpret_cast<void*>(base_addr + kPageSize),
+                 len - kPageSize,
+                 PROT_READ | PROT_WRITE | MemoryTaggingProtFlag()) != 0) {
+      munmap(reinterpret_cast<void*>(base_addr), len);
+      return false;
+    }
+
+    // Tell TCMalloc's PageMap about the memory we own.
+    if (!tc_globals.pagemap().Ensure(
+            PageIdContaining(reinterpret_cast<void*>(base_addr)),
+            BytesToLengthFloor(len))) {
+      munmap(reinterpret_cast<void*>(base_addr), len);
+      return false;
+    }
+
+    data_ = reinterpret_cast<SlotMetadata*>(
+        tc_globals.arena().Alloc(sizeof(SlotMetadata) * kNumSlots));
+    free_ring_ = reinterpret_cast<uint16_t*>(
+        tc_globals.arena().Alloc(sizeof(uint16_t) * kNumSlots));
+    for (size_t slot = 0; slot < kNumSlots; ++slot) {
+      new (&data_[slot]) SlotMetadata;
+      free_ring_[slot] = slot;
+    }
+    free_head_ = 0;
+    num_free_ = kNumSlots;
+    rand_ = reinterpret_cast<uint64_t>(this);
+
+    base_addr_ = base_addr;
+    end_addr_ = base_addr + len;
+    first_slot_addr_ = base_addr + kPageSize;
+  }
+
+  if (!EnableMemoryTagChecks()) return false;
+  active_.store(true, std::memory_order_release);
+  return true;
+}
+
+GuardedAllocWithStatus MteSampledAllocator::Allocate(size_t size,
+                                                     size_t alignment) {
+  if (!active()) {
+    return {nullptr, Profile::Sample::GuardedStatus::Disabled};
+  }
+  if (size == 0) {
+    return {nullptr, Profile::Sample::GuardedStatus::TooSmall};
+  }
+  ASSERT(size <= kPageSize);
+  ASSERT(alignment <= kPageSize);
+
+  size_t slot;
+  uint64_t rand;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    if (num_free_ == 0) {
+      num_failed_allocations_.fetch_add(1, std::memory_order_relaxed);
+      return {nullptr, Profile::Sample::GuardedStatus::NoAvailableSlots};
+    }
+    slot = free_ring_[free_head_];
+    free_head_ = (free_head_ + 1) % kNumSlots;
+    --num_free_;
+    rand_ = ExponentialBiased::NextRandom(rand_);
+    rand = rand_;
+  }
+
+  // Until Deallocate() returns the slot to the ring, only we own it.
+  SlotMetadata& d = data_[slot];
+  // Tags are non-zero, and differ from the slot's previous one so that stale
+  // pointers to it keep faulting.
+  uint8_t tag = 1 + (rand >> 32) % (kNumMemoryTags - 1);
+  if (tag == d.tag) tag = tag % (kNumMemoryTags - 1) + 1;
+
+  void* result = TagAddress(reinterpret_cast<void*>(SlotToAddr(slot)), tag);
+  SetMemoryTags(result, (size + kMemoryTagGranule - 1) &
+                            ~(kMemoryTagGranule - 1));
+
+  d.alloc_trace.depth = absl::GetStackTrace(d.alloc_trace.stack,
+                                            kMaxStackDepth, /*skip_count=*/3);
+  d.alloc_trace.thread_id = absl::base_internal::GetTID();
+  d.dealloc_trace.depth = 0;
+  d.requested_size = size;
+  d.allocation_start = SlotToAddr(slot);
+  d.tag = tag;
+  d.allocated = true;
+
+  num_successful_allocations_.fetch_add(1, std::memory_order_relaxed);
+  return {result, Profile::Sample::GuardedStatus::Guarded};
+}
+
+void MteSampledAllocator::Deallocate(void* ptr) {
+  ASSERT(PointerIsMine(ptr));
+  const uintptr_t addr = UntagAddress(reinterpret_cast<uintptr_t>(ptr));
+  const size_t slot = AddrToSlot(addr);
+  SlotMetadata& d = data_[slot];
+
+  if (!d.allocated || AddressTag(reinterpret_cast<uintptr_t>(ptr)) != d.tag) {
+    double_free_slot_.store(slot, std::memory_order_relaxed);
+    *reinterpret_cast<volatile char*>(base_addr_) = 'X';  // Trigger SEGV.
+    CHECK_CONDITION(false);                                // Unreachable.
+  }
+
+  SetMemoryTags(reinterpret_cast<void*>(d.allocation_start),
+                (d.requested_size + kMemoryTagGranule - 1) &
+                    ~(kMemoryTagGranule - 1));
+
+  d.dealloc_trace.depth = absl::GetStackTrace(
+      d.dealloc_trace.stack, kMaxStackDepth, /*skip_count=*/2);
+  d.dealloc_trace.thread_id = absl::base_internal::GetTID();
+  d.allocated = false;
+
+  AllocationGuardSpinLockHolder h(&lock_);
+  free_ring_[(free_head_ + num_free_) % kNumSlots] = slot;
+  ++num_free_;
+}
+
+size_t MteSampledAllocator::SlotForAccess(const void* ptr) const {
+  const uintptr_t addr = UntagAddress(reinterpret_cast<uintptr_t>(ptr));
+  if (addr < first_slot_addr_ || addr >= end_addr_) return kNumSlots;
+  const size_t slot = AddrToSlot(addr);
+  const uint8_t tag = AddressTag(reinterpret_cast<uintptr_t>(ptr));
+  if (tag != data_[slot].tag && slot + 1 < kNumSlots &&
+      data_[slot + 1].allocated && tag == data_[slot + 1].tag) {
+    return slot + 1;
+  }
+  return slot;
+}
+
+size_t MteSampledAllocator::GetRequestedSize(const void* ptr) const {
+  ASSERT(PointerIsMine(ptr));
+  return data_[AddrToSlot(UntagAddress(reinterpret_cast<uintptr_t>(ptr)))]
+      .requested_size;
+}
+
+std::pair<off_t, size_t> MteSampledAllocator::GetAllocationOffsetAndSize(
+    const void* ptr) const {
+  const size_t slot = SlotForAccess(ptr);
+  if (slot == kNumSlots) return {0, 0};
+  const SlotMetadata& d = data_[slot];
+  return {UntagAddress(reinterpret_cast<uintptr_t>(ptr)) - d.allocation_start,
+          d.requested_size};
+}
+
+GuardedAllocationsErrorType MteSampledAllocator::GetStackTraces(
+    const void* ptr, GuardedAllocationsStackTrace** alloc_trace,
+    GuardedAllocationsStackTrace** dealloc_trace) const {
+  ASSERT(PointerIsMine(ptr));
+  size_t slot = double_free_slot_.load(std::memory_order_relaxed);
+  const bool double_free = slot != kNumSlots;
+  if (!double_free) slot = SlotForAccess(ptr);
+  if (slot == kNumSlots) return GuardedAllocationsErrorType::kUnknown;
+
+  const SlotMetadata& d = data_[slot];
+  if (!d.allocation_start) return GuardedAllocationsErrorType::kUnknown;
+  *alloc_trace = const_cast<GuardedAllocationsStackTrace*>(&d.alloc_trace);
+  *dealloc_trace = const_cast<GuardedAllocationsStackTrace*>(&d.dealloc_trace);
+  if (double_free) return GuardedAllocationsErrorType::kDoubleFree;
+  if (AddressTag(reinterpret_cast<uintptr_t>(ptr)) != d.tag) {
+    return GuardedAllocationsErrorType::kUnknown;
+  }
+  if (!d.allocated) return GuardedAllocationsErrorType::kUseAfterFree;
+
+  const uintptr_t addr = UntagAddress(reinterpret_cast<uintptr_t>(ptr));
+  if (addr < d.allocation_start) {
+    return GuardedAllocationsErrorType::kBufferUnderflow;
+  }
+  if (addr >= d.allocation_start + d.requested_size) {
+    return GuardedAllocationsErrorType::kBufferOverflow;
+  }
+  return GuardedAllocationsErrorType::kUnknown;
+}
+
+void MteSampledAllocator::Print(Printer* out) {
+  size_t num_free;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    num_free = num_free_;
+  }
+  out->printf(
+      "\n"
+      "------------------------------------------------\n"
+      "MTE sampling: %s\n"
+      "------------------------------------------------\n"
+      "Successful Allocations: %zu\n"
+      "Failed Allocations: %zu\n"
+      "Slots Currently Allocated: %zu\n"
+      "Total Slots: %zu\n",
+      active() ? "active" : "inactive", SuccessfulAllocations(),
+      num_failed_allocations_.load(std::memory_order_relaxed),
+      active() ? kNumSlots - num_free : 0, kNumSlots);
+}
+
+void MteSampledAllocator::PrintInPbtxt(PbtxtRegion* mte) {
+  size_t num_free;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    num_free = num_free_;
+  }
+  mte->PrintBool("active", active());
+  mte->PrintI64("successful_allocations", SuccessfulAllocations());
+  mte->PrintI64("failed_allocations",
+                num_failed_allocations_.load(std::memory_order_relaxed));
+  mte->PrintI64("current_slots_allocated",
+                active() ? kNumSlots - num_free : 0);
+  mte->PrintI64("total_slots", kNumSlots);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
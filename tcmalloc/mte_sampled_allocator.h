@@ -0,0 +1,156 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_MTE_SAMPLED_ALLOCATOR_H_
+#define TCMALLOC_MTE_SAMPLED_ALLOCATOR_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/memory_tagging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// A backend for guarded sampling that detects memory errors with the Arm
+// Memory Tagging Extension rather than guard pages.  Each allocation gets a
+// page-sized slot; the granules it covers get a random non-zero tag, which the
+// returned pointer carries, and the rest of the slot keeps tag 0.  Freeing
+// retags the allocation with 0.  Tag check faults then catch overflows and
+// underflows, to the next 16-byte granule, and uses after free, without the
+// guard pages and mprotect calls of GuardedPageAllocator.
+//
+// Tag checks run asynchronously: faults are raised on the next kernel entry
+// without the address of the access, so they are reported with the current
+// stack only.  Threads that enabled synchronous checks themselves get reports
+// that name the allocation, as GuardedPageAllocator's do.
+//
+// Is safe to use with static storage duration and is thread safe.
+class MteSampledAllocator {
+ public:
+  // Number of slots.  Address space for them is only reserved by Activate().
+  static constexpr size_t kNumSlots = 4096;
+
+  constexpr MteSampledAllocator()
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY) {}
+
+  MteSampledAllocator(const MteSampledAllocator&) = delete;
+  MteSampledAllocator& operator=(const MteSampledAllocator&) = delete;
+
+  ~MteSampledAllocator() = default;
+
+  // Maps the slots and enables asynchronous tag checks for the calling thread
+  // and the threads it creates from now on.  Returns false, leaving this
+  // allocator inactive, if the system does not support MTE.
+  bool Activate() ABSL_LOCKS_EXCLUDED(pageheap_lock, lock_);
+
+  bool active() const { return active_.load(std::memory_order_acquire); }
+
+  // As GuardedPageAllocator::Allocate.  The returned pointer is tagged.
+  //
+  // Precondition:  size and alignment <= kPageSize
+  GuardedAllocWithStatus Allocate(size_t size, size_t alignment)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Deallocates memory pointed to by ptr, which must have been returned by
+  // Allocate().  Double frees are reported through the SEGV handler.
+  void Deallocate(void* ptr) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // As the GuardedPageAllocator functions of the same names.
+  size_t GetRequestedSize(const void* ptr) const;
+  std::pair<off_t, size_t> GetAllocationOffsetAndSize(const void* ptr) const;
+  GuardedAllocationsErrorType GetStackTraces(
+      const void* ptr, GuardedAllocationsStackTrace** alloc_trace,
+      GuardedAllocationsStackTrace** dealloc_trace) const;
+
+  void Print(Printer* out) ABSL_LOCKS_EXCLUDED(lock_);
+  void PrintInPbtxt(PbtxtRegion* mte) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns true if ptr, ignoring its tag, points to memory managed by this
+  // class.
+  inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+  PointerIsMine(const void* ptr) const {
+    const uintptr_t addr = UntagAddress(reinterpret_cast<uintptr_t>(ptr));
+    return base_addr_ <= addr && addr < end_addr_;
+  }
+
+  size_t SuccessfulAllocations() const {
+    return num_successful_allocations_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct SlotMetadata {
+    GuardedAllocationsStackTrace alloc_trace;
+    GuardedAllocationsStackTrace dealloc_trace;
+    size_t requested_size = 0;
+    // Zero until the slot is first allocated.
+    uintptr_t allocation_start = 0;
+    uint8_t tag = 0;
+    bool allocated = false;
+  };
+
+  uintptr_t SlotToAddr(size_t slot) const {
+    return first_slot_addr_ + slot * kPageSize;
+  }
+  size_t AddrToSlot(uintptr_t addr) const {
+    return (addr - first_slot_addr_) / kPageSize;
+  }
+
+  // Returns the slot of the allocation an access through ptr was meant for:
+  // the slot holding the untagged address or, for an underflow, the slot after
+  // it if the pointer carries that slot's tag.  Returns kNumSlots if none.
+  size_t SlotForAccess(const void* ptr) const;
+
+  absl::base_internal::SpinLock lock_;
+
+  // Free slots in the order they were freed, so that freed memory stays
+  // untagged for as long as possible before it is reused.
+  uint16_t* free_ring_ ABSL_GUARDED_BY(lock_) = nullptr;
+  size_t free_head_ ABSL_GUARDED_BY(lock_) = 0;
+  size_t num_free_ ABSL_GUARDED_BY(lock_) = 0;
+  uint64_t rand_ ABSL_GUARDED_BY(lock_) = 0;
+
+  SlotMetadata* data_ = nullptr;
+
+  // The first page of [base_addr_, end_addr_) is left inaccessible; double
+  // frees touch it to enter the SEGV handler.
+  uintptr_t base_addr_ = 0;
+  uintptr_t end_addr_ = 0;
+  uintptr_t first_slot_addr_ = 0;
+
+  std::atomic<size_t> num_successful_allocations_{0};
+  std::atomic<size_t> num_failed_allocations_{0};
+  // The slot freed twice, or kNumSlots.
+  std::atomic<size_t> double_free_slot_{kNumSlots};
+  std::atomic<bool> active_{false};
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_MTE_SAMPLED_ALLOCATOR_H_
@@ -0,0 +1,111 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/mte_sampled_allocator.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/memory_tagging.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(MemoryTaggingTest, TagRoundTrip) {
+  int x;
+  void* tagged = TagAddress(&x, 5);
+  EXPECT_EQ(UntagAddress(reinterpret_cast<uintptr_t>(tagged)),
+            reinterpret_cast<uintptr_t>(&x));
+#if defined(__aarch64__)
+  EXPECT_EQ(AddressTag(reinterpret_cast<uintptr_t>(tagged)), 5);
+#else
+  EXPECT_EQ(tagged, &x);
+#endif
+}
+
+MteSampledAllocator& TestAllocator() {
+  static MteSampledAllocator* mte = new MteSampledAllocator;
+  return *mte;
+}
+
+TEST(MteSampledAllocatorTest, InactiveWithoutMte) {
+  if (MemoryTaggingSupported()) {
+    GTEST_SKIP() << "MTE is supported";
+  }
+  MteSampledAllocator& mte = TestAllocator();
+  EXPECT_FALSE(mte.Activate());
+  EXPECT_FALSE(mte.active());
+  EXPECT_EQ(mte.Allocate(8, 0).status,
+            Profile::Sample::GuardedStatus::Disabled);
+}
+
+TEST(MteSampledAllocatorTest, AllocDealloc) {
+  if (!MemoryTaggingSupported()) {
+    GTEST_SKIP() << "MTE is not supported";
+  }
+  MteSampledAllocator& mte = TestAllocator();
+  ASSERT_TRUE(mte.Activate());
+
+  const size_t successful = mte.SuccessfulAllocations();
+  std::vector<void*> ptrs;
+  for (size_t size : {size_t{1}, size_t{16}, size_t{100}, kPageSize}) {
+    auto alloc_with_status = mte.Allocate(size, 0);
+    ASSERT_EQ(alloc_with_status.status,
+              Profile::Sample::GuardedStatus::Guarded);
+    void* ptr = alloc_with_status.alloc;
+    EXPECT_TRUE(mte.PointerIsMine(ptr));
+    EXPECT_NE(AddressTag(reinterpret_cast<uintptr_t>(ptr)), 0);
+    EXPECT_EQ(mte.GetRequestedSize(ptr), size);
+    memset(ptr, 'A', size);
+    ptrs.push_back(ptr);
+  }
+  EXPECT_EQ(mte.SuccessfulAllocations(), successful + ptrs.size());
+  for (void* ptr : ptrs) {
+    mte.Deallocate(ptr);
+  }
+}
+
+TEST(MteSampledAllocatorTest, ReusedSlotsGetNewTags) {
+  if (!MemoryTaggingSupported()) {
+    GTEST_SKIP() << "MTE is not supported";
+  }
+  MteSampledAllocator& mte = TestAllocator();
+  ASSERT_TRUE(mte.Activate());
+
+  // Cycle through every slot so that the next allocation reuses the first.
+  std::vector<uint8_t> tags(MteSampledAllocator::kNumSlots);
+  std::vector<uintptr_t> addrs(MteSampledAllocator::kNumSlots);
+  for (size_t i = 0; i < MteSampledAllocator::kNumSlots; ++i) {
+    void* ptr = mte.Allocate(8, 0).alloc;
+    ASSERT_NE(ptr, nullptr);
+    tags[i] = AddressTag(reinterpret_cast<uintptr_t>(ptr));
+    addrs[i] = UntagAddress(reinterpret_cast<uintptr_t>(ptr));
+    mte.Deallocate(ptr);
+  }
+  void* ptr = mte.Allocate(8, 0).alloc;
+  ASSERT_NE(ptr, nullptr);
+  EXPECT_EQ(UntagAddress(reinterpret_cast<uintptr_t>(ptr)), addrs[0]);
+  EXPECT_NE(AddressTag(reinterpret_cast<uintptr_t>(ptr)), tags[0]);
+  mte.Deallocate(ptr);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
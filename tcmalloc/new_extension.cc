@@ -15,6 +15,7 @@
 #include "tcmalloc/new_extension.h"
 
 #include <cstddef>
+#include <cstdlib>
 #include <new>
 
 #include "absl/base/attributes.h"
@@ -66,3 +67,141 @@ ABSL_ATTRIBUTE_WEAK void* operator new[](
   return ::operator new[](size, alignment, std::nothrow);
 }
 #endif  // __cpp_aligned_new
+
+ABSL_ATTRIBUTE_WEAK void* operator new(
+    size_t size, tcmalloc::registered_t) noexcept(false) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(size_t size, const std::nothrow_t&,
+                                       tcmalloc::registered_t) noexcept {
+  return ::operator new(size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, tcmalloc::registered_t) noexcept(false) {
+  return ::operator new[](size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, const std::nothrow_t&, tcmalloc::registered_t) noexcept {
+  return ::operator new[](size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(size_t size,
+                                       tcmalloc::near_t near) noexcept(false) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(size_t size, const std::nothrow_t&,
+                                       tcmalloc::near_t near) noexcept {
+  return ::operator new(size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, tcmalloc::near_t near) noexcept(false) {
+  return ::operator new[](size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](size_t size, const std::nothrow_t&,
+                                         tcmalloc::near_t near) noexcept {
+  return ::operator new[](size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(
+    size_t size, tcmalloc::exclusive_line_t) noexcept(false) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(size_t size, const std::nothrow_t&,
+                                       tcmalloc::exclusive_line_t) noexcept {
+  return ::operator new(size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, tcmalloc::exclusive_line_t) noexcept(false) {
+  return ::operator new[](size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, const std::nothrow_t&, tcmalloc::exclusive_line_t) noexcept {
+  return ::operator new[](size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(size_t size,
+                                       tcmalloc::dense_t) noexcept(false) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(size_t size, const std::nothrow_t&,
+                                       tcmalloc::dense_t) noexcept {
+  return ::operator new(size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](size_t size,
+                                         tcmalloc::dense_t) noexcept(false) {
+  return ::operator new[](size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](size_t size, const std::nothrow_t&,
+                                         tcmalloc::dense_t) noexcept {
+  return ::operator new[](size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(
+    size_t size, tcmalloc::alloc_token_t token) noexcept(false) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(size_t size, const std::nothrow_t&,
+                                       tcmalloc::alloc_token_t token) noexcept {
+  return ::operator new(size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, tcmalloc::alloc_token_t token) noexcept(false) {
+  return ::operator new[](size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, const std::nothrow_t&,
+    tcmalloc::alloc_token_t token) noexcept {
+  return ::operator new[](size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE void*
+tcmalloc_allocate_coroutine_frame(size_t size) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE void
+tcmalloc_deallocate_coroutine_frame(void* ptr, size_t) noexcept {
+  ::operator delete(ptr);
+}
+
+ABSL_ATTRIBUTE_WEAK void* __alloc_token_malloc(size_t size, size_t) noexcept {
+  return malloc(size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* __alloc_token_calloc(size_t n, size_t size,
+                                               size_t) noexcept {
+  return calloc(n, size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* __alloc_token__Znwm(size_t size, size_t) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* __alloc_token__Znam(size_t size, size_t) {
+  return ::operator new[](size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* __alloc_token__ZnwmRKSt9nothrow_t(
+    size_t size, const std::nothrow_t&, size_t) noexcept {
+  return ::operator new(size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* __alloc_token__ZnamRKSt9nothrow_t(
+    size_t size, const std::nothrow_t&, size_t) noexcept {
+  return ::operator new[](size, std::nothrow);
+}
@@ -41,4 +41,89 @@ void* operator new[](size_t size, std::align_val_t alignment,
                      tcmalloc::hot_cold_t hot_cold) noexcept;
 #endif  // __cpp_aligned_new
 
+// Allocations from the registered heap are whole TCMalloc pages, so they suit
+// I/O buffers rather than small objects.  They are freed with ::operator
+// delete.
+void* operator new(size_t size, tcmalloc::registered_t) noexcept(false);
+void* operator new(size_t size, const std::nothrow_t&,
+                   tcmalloc::registered_t) noexcept;
+void* operator new[](size_t size, tcmalloc::registered_t) noexcept(false);
+void* operator new[](size_t size, const std::nothrow_t&,
+                     tcmalloc::registered_t) noexcept;
+
+void* operator new(size_t size, tcmalloc::near_t near) noexcept(false);
+void* operator new(size_t size, const std::nothrow_t&,
+                   tcmalloc::near_t near) noexcept;
+void* operator new[](size_t size, tcmalloc::near_t near) noexcept(false);
+void* operator new[](size_t size, const std::nothrow_t&,
+                     tcmalloc::near_t near) noexcept;
+
+void* operator new(size_t size, tcmalloc::exclusive_line_t) noexcept(false);
+void* operator new(size_t size, const std::nothrow_t&,
+                   tcmalloc::exclusive_line_t) noexcept;
+void* operator new[](size_t size, tcmalloc::exclusive_line_t) noexcept(false);
+void* operator new[](size_t size, const std::nothrow_t&,
+                     tcmalloc::exclusive_line_t) noexcept;
+
+void* operator new(size_t size, tcmalloc::dense_t) noexcept(false);
+void* operator new(size_t size, const std::nothrow_t&,
+                   tcmalloc::dense_t) noexcept;
+void* operator new[](size_t size, tcmalloc::dense_t) noexcept(false);
+void* operator new[](size_t size, const std::nothrow_t&,
+                     tcmalloc::dense_t) noexcept;
+
+void* operator new(size_t size, tcmalloc::alloc_token_t token) noexcept(false);
+void* operator new(size_t size, const std::nothrow_t&,
+                   tcmalloc::alloc_token_t token) noexcept;
+void* operator new[](size_t size,
+                     tcmalloc::alloc_token_t token) noexcept(false);
+void* operator new[](size_t size, const std::nothrow_t&,
+                     tcmalloc::alloc_token_t token) noexcept;
+
+extern "C" {
+
+// Allocates and frees C++20 coroutine frames.  Frames are typically allocated
+// on one thread and freed shortly after on another, so TCMalloc pairs the
+// cpus doing each and hands freed frames directly to the cpu that allocates
+// them.  Frames must be freed with the <size> they were allocated with.
+void* tcmalloc_allocate_coroutine_frame(size_t size);
+void tcmalloc_deallocate_coroutine_frame(void* ptr, size_t size) noexcept;
+
+// Typed allocation entry points, which Clang calls in place of malloc, calloc
+// and the plain and nothrow ::operator new and new[] when building with
+// -fsanitize=alloc-token, passing the token of the allocated type last.  They
+// behave as the operator new overloads taking tcmalloc::alloc_token_t.  The
+// objects are freed as usual.
+void* __alloc_token_malloc(size_t size, size_t token) noexcept;
+void* __alloc_token_calloc(size_t n, size_t size, size_t token) noexcept;
+void* __alloc_token__Znwm(size_t size, size_t token);
+void* __alloc_token__Znam(size_t size, size_t token);
+void* __alloc_token__ZnwmRKSt9nothrow_t(size_t size, const std::nothrow_t&,
+                                        size_t token) noexcept;
+void* __alloc_token__ZnamRKSt9nothrow_t(size_t size, const std::nothrow_t&,
+                                        size_t token) noexcept;
+
+}  // extern "C"
+
+namespace tcmalloc {
+
+// A base class for coroutine promise types, which makes the compiler allocate
+// the frames of coroutines using that promise with
+// tcmalloc_allocate_coroutine_frame:
+//
+//   struct Task {
+//     struct promise_type : tcmalloc::CoroutineFrameAllocator { ... };
+//   };
+class CoroutineFrameAllocator {
+ public:
+  static void* operator new(size_t size) {
+    return tcmalloc_allocate_coroutine_frame(size);
+  }
+  static void operator delete(void* ptr, size_t size) noexcept {
+    tcmalloc_deallocate_coroutine_frame(ptr, size);
+  }
+};
+
+}  // namespace tcmalloc
+
 #endif  // TCMALLOC_NEW_EXTENSION_H_
@@ -16,17 +16,22 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <algorithm>
 #include <limits>
 #include <new>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
 #include <vector>
 
 #include "benchmark/benchmark.h"
+#include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/base/optimization.h"
 #include "absl/numeric/bits.h"
+#include "absl/random/distributions.h"
 #include "absl/random/random.h"
 #include "tcmalloc/internal/page_size.h"
 #include "tcmalloc/malloc_extension.h"
@@ -483,5 +488,177 @@ TEST(HotColdNew, OperatorNewArrayAlignedNothrow) {
 }
 #endif  // __cpp_aligned_new
 
+// Stands in for the promise type of a coroutine; the compiler calls its
+// operator new and sized operator delete for the coroutine's frame.
+struct Promise : CoroutineFrameAllocator {};
+
+TEST(CoroutineFrame, FreeOnAnotherThread) {
+  absl::BitGen rand;
+  std::vector<std::pair<void*, size_t>> frames;
+  for (int i = 0; i < 10000; ++i) {
+    const size_t size = absl::Uniform<size_t>(rand, 1, 4096);
+    void* ptr = Promise::operator new(size);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_THAT(MallocExtension::GetAllocatedSize(ptr),
+                testing::Optional(testing::Ge(size)));
+    memset(ptr, 0xef, size);
+    frames.emplace_back(ptr, size);
+  }
+
+  std::thread([&] {
+    for (auto [ptr, size] : frames) {
+      Promise::operator delete(ptr, size);
+    }
+  }).join();
+}
+
+TEST(NearNew, SharesSpanWithParent) {
+  // TCMalloc's spans never straddle a boundary of this size.
+  constexpr uintptr_t kMaxPageSize = 256 << 10;
+  constexpr int kChildren = 16;
+
+  void* parent = ::operator new(64);
+  std::vector<void*> children;
+  int nearby = 0;
+  for (int i = 0; i < kChildren; ++i) {
+    void* child = ::operator new(64, tcmalloc::near_t{parent});
+    ASSERT_NE(child, nullptr);
+    memset(child, 0xef, 64);
+    if (reinterpret_cast<uintptr_t>(child) / kMaxPageSize ==
+        reinterpret_cast<uintptr_t>(parent) / kMaxPageSize) {
+      ++nearby;
+    }
+    children.push_back(child);
+  }
+  EXPECT_GE(nearby, kChildren / 2);
+
+  void* array = ::operator new[](1000, std::nothrow, tcmalloc::near_t{parent});
+  ASSERT_NE(array, nullptr);
+  ::operator delete[](array);
+
+  for (void* child : children) {
+    ::operator delete(child, 64);
+  }
+  ::operator delete(parent, 64);
+}
+
+TEST(ExclusiveLineNew, ObjectsDoNotShareLines) {
+  constexpr size_t kLine = ABSL_CACHELINE_SIZE;
+  std::vector<void*> objects;
+  for (size_t size : {size_t{1}, size_t{8}, size_t{24}, kLine, kLine + 1}) {
+    for (int i = 0; i < 8; ++i) {
+      void* ptr = ::operator new(size, tcmalloc::exclusive_line);
+      ASSERT_NE(ptr, nullptr);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % kLine, 0);
+      size_t allocated = MallocExtension::GetAllocatedSize(ptr).value_or(0);
+      EXPECT_GE(allocated, std::max(size, kLine));
+      EXPECT_EQ(allocated % kLine, 0);
+      memset(ptr, 0xef, allocated);
+      objects.push_back(ptr);
+    }
+  }
+
+  void* array = ::operator new[](10, std::nothrow, tcmalloc::exclusive_line);
+  ASSERT_NE(array, nullptr);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(array) % kLine, 0);
+  ::operator delete[](array);
+
+  for (void* ptr : objects) {
+    ::operator delete(ptr);
+  }
+}
+
+TEST(DenseNew, AllocatesUsableObjects) {
+  std::vector<std::pair<void*, size_t>> objects;
+  for (size_t size : {size_t{8}, size_t{100}, size_t{4096}, size_t{1 << 20}}) {
+    for (int i = 0; i < 8; ++i) {
+      void* ptr = ::operator new(size, tcmalloc::dense);
+      ASSERT_NE(ptr, nullptr);
+      EXPECT_GE(MallocExtension::GetAllocatedSize(ptr).value_or(0), size);
+      memset(ptr, 0xef, size);
+      objects.push_back({ptr, size});
+    }
+  }
+
+  void* array = ::operator new[](1000, std::nothrow, tcmalloc::dense);
+  ASSERT_NE(array, nullptr);
+  ::operator delete[](array);
+
+  for (auto [ptr, size] : objects) {
+    ::operator delete(ptr, size);
+  }
+}
+
+TEST(AllocTokenNew, PartitionedTypesShareSpans) {
+  // TCMalloc's spans never straddle a boundary of this size.
+  constexpr uintptr_t kMaxPageSize = 256 << 10;
+  constexpr size_t kToken = 0x5eed;
+  constexpr size_t kSize = 64;
+  constexpr int kObjects = 16;
+
+  ASSERT_TRUE(MallocExtension::PartitionAllocToken(kToken));
+  EXPECT_TRUE(MallocExtension::PartitionAllocToken(kToken));
+
+  // The typed objects stay together on their partition's spans, although
+  // plain allocations of their size class are interleaved with them.
+  std::vector<void*> typed, plain;
+  for (int i = 0; i < kObjects; ++i) {
+    void* ptr = ::operator new(kSize, tcmalloc::alloc_token_t{kToken});
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, 0xef, kSize);
+    typed.push_back(ptr);
+    plain.push_back(::operator new(kSize));
+  }
+  const auto [lo, hi] = std::minmax_element(typed.begin(), typed.end());
+  EXPECT_LT(reinterpret_cast<uintptr_t>(*hi) / kMaxPageSize -
+                reinterpret_cast<uintptr_t>(*lo) / kMaxPageSize,
+            2);
+
+  // Tokens without a partition, and the entry points Clang calls, allocate
+  // usable objects too.
+  void* array =
+      ::operator new[](1000, std::nothrow, tcmalloc::alloc_token_t{kToken + 1});
+  ASSERT_NE(array, nullptr);
+  ::operator delete[](array);
+  void* ptr = __alloc_token__Znwm(kSize, kToken);
+  ASSERT_NE(ptr, nullptr);
+  ::operator delete(ptr, kSize);
+  ptr = __alloc_token_calloc(4, kSize, kToken);
+  ASSERT_NE(ptr, nullptr);
+  for (size_t i = 0; i < 4 * kSize; ++i) {
+    ASSERT_EQ(static_cast<char*>(ptr)[i], 0);
+  }
+  free(ptr);
+
+  for (int i = 0; i < kObjects; ++i) {
+    ::operator delete(typed[i], kSize);
+    ::operator delete(plain[i], kSize);
+  }
+}
+
+TEST(IsOnSparseHugepage, OnlySmallObjects) {
+  EXPECT_FALSE(MallocExtension::IsOnSparseHugepage(nullptr));
+  int local;
+  EXPECT_FALSE(MallocExtension::IsOnSparseHugepage(&local));
+
+  // Large allocations are not moved to make room for small objects.
+  void* large = ::operator new(4 << 20);
+  EXPECT_FALSE(MallocExtension::IsOnSparseHugepage(large));
+  ::operator delete(large);
+
+  // Objects filling whole hugepages are not on sparse ones.
+  constexpr size_t kSize = 1024;
+  constexpr size_t kBytes = 4 << 20;
+  std::vector<void*> objects;
+  for (size_t i = 0; i < kBytes / kSize; ++i) {
+    objects.push_back(::operator new(kSize));
+  }
+  void* middle = objects[objects.size() / 2];
+  EXPECT_FALSE(MallocExtension::IsOnSparseHugepage(middle));
+  for (void* ptr : objects) {
+    ::operator delete(ptr, kSize);
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc
@@ -16,20 +16,28 @@
 
 #include <cstddef>
 #include <limits>
+#include <string>
 
 #include "absl/base/attributes.h"
 #include "absl/base/call_once.h"
 #include "absl/base/optimization.h"
+#include "absl/functional/function_ref.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_page_aware_allocator.h"
+#include "tcmalloc/huge_page_layout.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/probes.h"
 #include "tcmalloc/page_heap.h"
+#include "tcmalloc/pagemap.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -98,29 +106,46 @@ PageAllocator::PageAllocator() {
   const bool kUseHPAA = want_hpaa();
   has_cold_impl_ = ColdFeatureActive();
   if (kUseHPAA) {
-    normal_impl_[0] = new (&choices_[0].hpaa) HugePageAwareAllocator(
-        HugePageAwareAllocatorOptions{MemoryTag::kNormal});
-    if (tc_globals.numa_topology().numa_aware()) {
-      normal_impl_[1] = new (&choices_[1].hpaa) HugePageAwareAllocator(
-          HugePageAwareAllocatorOptions{MemoryTag::kNormalP1});
+    // With a single NUMA partition, the normal heap is not bound to a node
+    // either, so it shares its cache's baseline too.
+    HugeCacheGroup* normal_group =
+        active_numa_partitions() == 1 ? &cache_group_ : nullptr;
+    for (int partition = 0; partition < active_numa_partitions();
+         partition++) {
+      normal_impl_[partition] = new (&choices_[partition].hpaa)
+          HugePageAwareAllocator(HugePageAwareAllocatorOptions{
+              .tag = NumaNormalTag(partition),
+              .backing = huge_page_allocator_internal::huge_backing_option(),
+              .cache_group = normal_group});
     }
     sampled_impl_ =
         new (&choices_[kNumaPartitions + 0].hpaa) HugePageAwareAllocator(
-            HugePageAwareAllocatorOptions{MemoryTag::kSampled});
+            HugePageAwareAllocatorOptions{.tag = MemoryTag::kSampled,
+                                          .cache_group = &cache_group_});
     if (has_cold_impl_) {
       cold_impl_ =
           new (&choices_[kNumaPartitions + 1].hpaa) HugePageAwareAllocator(
-              HugePageAwareAllocatorOptions{MemoryTag::kCold});
+              HugePageAwareAllocatorOptions{.tag = MemoryTag::kCold,
+                                            .cache_group = &cache_group_});
     } else {
       cold_impl_ = normal_impl_[0];
     }
+    if constexpr (kHasRegisteredHeap) {
+      registered_impl_ =
+          new (&choices_[kNumaPartitions + 2].hpaa) HugePageAwareAllocator(
+              HugePageAwareAllocatorOptions{.tag = MemoryTag::kRegistered,
+                                            .cache_group = &cache_group_});
+    } else {
+      registered_impl_ = nullptr;
+    }
     alg_ = HPAA;
   } else {
 #if defined(TCMALLOC_INTERNAL_SMALL_BUT_SLOW) || \
     defined(TCMALLOC_INTERNAL_32K_PAGES)
-    normal_impl_[0] = new (&choices_[0].ph) PageHeap(MemoryTag::kNormal);
-    if (tc_globals.numa_topology().numa_aware()) {
-      normal_impl_[1] = new (&choices_[1].ph) PageHeap(MemoryTag::kNormalP1);
+    for (int partition = 0; partition < active_numa_partitions();
+         partition++) {
+      normal_impl_[partition] =
+          new (&choices_[partition].ph) PageHeap(NumaNormalTag(partition));
     }
     sampled_impl_ =
         new (&choices_[kNumaPartitions + 0].ph) PageHeap(MemoryTag::kSampled);
@@ -130,15 +155,35 @@ PageAllocator::PageAllocator() {
     } else {
       cold_impl_ = normal_impl_[0];
     }
+    if constexpr (kHasRegisteredHeap) {
+      registered_impl_ = new (&choices_[kNumaPartitions + 2].ph)
+          PageHeap(MemoryTag::kRegistered);
+    } else {
+      registered_impl_ = nullptr;
+    }
     alg_ = PAGE_HEAP;
 #else
     static_assert(huge_page_allocator_internal::kUnconditionalHPAA);
     CHECK_CONDITION(false && "unreachable");
 #endif
   }
+
+  // A region's spans carry no NUMA partition, so the regions are only used
+  // with a single one.
+  if (thread_safe_getenv("TCMALLOC_SIZE_CLASS_REGIONS") != nullptr &&
+      active_numa_partitions() == 1) {
+    AddressRange range = SystemAlloc(SizeClassRegions::kReservedBytes,
+                                     kMinSystemAlloc, MemoryTag::kNormal);
+    if (range.ptr != nullptr) {
+      size_class_regions_.Init(range);
+    } else {
+      Log(kLog, __FILE__, __LINE__,
+          "Couldn't reserve address space for size class regions");
+    }
+  }
 }
 
-void PageAllocator::ShrinkToUsageLimit(Length n) {
+void PageAllocator::ShrinkToUsageLimit(Length n, MemoryTag tag) {
   BackingStats s = stats();
   const size_t backed =
       s.system_bytes - s.unmapped_bytes + tc_globals.metadata_bytes();
@@ -168,13 +213,20 @@ void PageAllocator::ShrinkToUsageLimit(Length n) {
     // We're already fine.
     return;
   }
+  // Lazily freed pages would still count against the limit.  The background
+  // thread clears this once usage falls well below it.
+  SetSystemMemoryPressure(true);
 
   ++limit_hits_[kSoft];
   if (limits_[kHard] < backed) ++limit_hits_[kHard];
 
   const size_t overage = backed - limits_[kSoft];
   const Length pages = LengthFromBytes(overage + kPageSize - 1);
-  if (ShrinkHardBy(pages, kSoft)) {
+  const int64_t probe_start = TCMALLOC_PROBE_START(shrink_to_usage_limit);
+  const bool shrunk = ShrinkHardBy(pages, kSoft, tag);
+  TCMALLOC_PROBE(shrink_to_usage_limit, static_cast<int>(kSoft),
+                 pages.raw_num(), ProbeLatencyNs(probe_start));
+  if (shrunk) {
     ++successful_shrinks_after_limit_hit_[kSoft];
     return;
   }
@@ -191,7 +243,11 @@ void PageAllocator::ShrinkToUsageLimit(Length n) {
     }
     const size_t overage = backed - limits_[kHard];
     const Length pages = LengthFromBytes(overage + kPageSize - 1);
-    if (ShrinkHardBy(pages, kHard)) {
+    const int64_t probe_start = TCMALLOC_PROBE_START(shrink_to_usage_limit);
+    const bool shrunk = ShrinkHardBy(pages, kHard, tag);
+    TCMALLOC_PROBE(shrink_to_usage_limit, static_cast<int>(kHard),
+                   pages.raw_num(), ProbeLatencyNs(probe_start));
+    if (shrunk) {
       ++successful_shrinks_after_limit_hit_[kHard];
       ASSERT(successful_shrinks_after_limit_hit_[kHard] == limit_hits_[kHard]);
       return;
@@ -215,8 +271,9 @@ void PageAllocator::ShrinkToUsageLimit(Length n) {
       limits_[kSoft], "and OOM is likely to follow.");
 }
 
-bool PageAllocator::ShrinkHardBy(Length pages, LimitKind limit_kind) {
-  Length ret = ReleaseAtLeastNPages(pages);
+bool PageAllocator::ShrinkHardBy(Length pages, LimitKind limit_kind,
+                                 MemoryTag tag) {
+  Length ret = ReleaseAtLeastNPages(pages, tag);
   if (alg_ == HPAA) {
     if (pages <= ret) {
       // We released target amount.
@@ -235,26 +292,81 @@ bool PageAllocator::ShrinkHardBy(Length pages, LimitKind limit_kind) {
           limit, "without breaking hugepages - performance will drop");
       warned_hugepages = true;
     }
-    if (has_cold_impl_) {
-      ret += static_cast<HugePageAwareAllocator*>(cold_impl_)
-                 ->ReleaseAtLeastNPagesBreakingHugepages(pages - ret);
-      if (ret >= pages) {
-        return true;
-      }
+    ret += BreakHugepages(pages - ret, tag);
+  }
+  // Return "true", if we got back under the limit.
+  return (pages <= ret);
+}
+
+Length PageAllocator::ReleaseAtLeastNPagesBreakingHugepages(Length num_pages) {
+  Length released = ReleaseAtLeastNPages(num_pages);
+  if (alg_ == HPAA && released < num_pages) {
+    released += BreakHugepages(num_pages - released, MemoryTag::kNormal);
+  }
+  return released;
+}
+
+Length PageAllocator::BreakHugepages(Length pages, MemoryTag tag) {
+  ASSERT(alg_ == HPAA);
+  Length ret;
+  if (has_cold_impl_) {
+    ret += static_cast<HugePageAwareAllocator*>(cold_impl_)
+               ->ReleaseAtLeastNPagesBreakingHugepages(pages - ret);
+    if (ret >= pages) {
+      return ret;
     }
-    for (int partition = 0; partition < active_numa_partitions(); partition++) {
-      ret += static_cast<HugePageAwareAllocator*>(normal_impl_[partition])
-                 ->ReleaseAtLeastNPagesBreakingHugepages(pages - ret);
-      if (ret >= pages) {
-        return true;
-      }
+  }
+  for (int i = 0; i < active_numa_partitions(); i++) {
+    ret += static_cast<HugePageAwareAllocator*>(
+               normal_impl_[ReleaseOrder(tag, i)])
+               ->ReleaseAtLeastNPagesBreakingHugepages(pages - ret);
+    if (ret >= pages) {
+      return ret;
     }
+  }
 
-    ret += static_cast<HugePageAwareAllocator*>(sampled_impl_)
-               ->ReleaseAtLeastNPagesBreakingHugepages(pages - ret);
+  ret += static_cast<HugePageAwareAllocator*>(sampled_impl_)
+             ->ReleaseAtLeastNPagesBreakingHugepages(pages - ret);
+  return ret;
+}
+
+void PageAllocator::WriteHugePageLayout(
+    absl::FunctionRef<void(absl::string_view)> sink) {
+  // Large enough for 120 hugepages of the filler, while short enough to bound
+  // the time pageheap_lock is held.
+  constexpr size_t kChunkBytes = 64 << 10;
+  std::string buffer(kChunkBytes, '\0');
+  HugePageLayoutWriter out(absl::MakeSpan(buffer));
+  CHECK_CONDITION(out.HasRoom(kPagesPerHugePage.raw_num()));
+  out.AddHeader(kPageSize, kPagesPerHugePage.raw_num());
+  sink(out.data());
+  if (alg_ != HPAA) return;
+
+  auto write = [&](Interface* impl) {
+    auto* hpaa = static_cast<HugePageAwareAllocator*>(impl);
+    huge_page_allocator_internal::HugePageLayoutCursor cursor;
+    bool more = true;
+    while (more) {
+      out.Clear();
+      {
+        AllocationGuardSpinLockHolder h(&pageheap_lock);
+        more = hpaa->WriteLayout(&cursor, &out, [](PageId p) -> size_t {
+          return tc_globals.pagemap().sizeclass(p);
+        });
+      }
+      if (!out.empty()) sink(out.data());
+    }
+  };
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    write(normal_impl_[partition]);
+  }
+  write(sampled_impl_);
+  if (has_cold_impl_) {
+    write(cold_impl_);
+  }
+  if (kHasRegisteredHeap) {
+    write(registered_impl_);
   }
-  // Return "true", if we got back under the limit.
-  return (pages <= ret);
 }
 
 size_t PageAllocator::active_numa_partitions() const {
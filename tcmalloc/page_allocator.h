@@ -23,16 +23,24 @@
 
 #include "absl/base/attributes.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/functional/function_ref.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/huge_cache.h"
 #include "tcmalloc/huge_page_aware_allocator.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
+#include "tcmalloc/internal/pageflags.h"
+#include "tcmalloc/internal/probes.h"
+#include "tcmalloc/internal/residency.h"
 #include "tcmalloc/page_allocator_interface.h"
 #include "tcmalloc/page_heap.h"
 #include "tcmalloc/pages.h"
+#include "tcmalloc/size_class_regions.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stats.h"
 
@@ -40,6 +48,14 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+// Returns the <i>th of <partitions> NUMA partitions to release from on behalf
+// of <tag>: a normal tag's own partition first, then the others in turn.
+// Other tags start from partition 0.
+inline size_t NumaReleaseOrder(MemoryTag tag, size_t i, size_t partitions) {
+  const size_t first = IsNormalMemoryTag(tag) ? NumaPartitionFromTag(tag) : 0;
+  return (first + i) % partitions;
+}
+
 class PageAllocator {
  public:
   PageAllocator();
@@ -53,11 +69,36 @@ class PageAllocator {
   Span* New(Length n, SpanAllocInfo span_alloc_info, MemoryTag tag)
       ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
+  // As New, for a span of objects of <size_class>.  The span comes from the
+  // size class's region if it has one.
+  Span* NewForSizeClass(size_t size_class, Length n,
+                        SpanAllocInfo span_alloc_info, MemoryTag tag)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
   // As New, but the returned span is aligned to a <align>-page boundary.
   // <align> must be a power of two.
   Span* NewAligned(Length n, Length align, SpanAllocInfo span_alloc_info,
                    MemoryTag tag) ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
+  // As New, but allocates up to spans.size() spans of "n" pages into <spans>.
+  // Returns the number of spans allocated.
+  size_t NewBatch(Length n, SpanAllocInfo span_alloc_info, MemoryTag tag,
+                  absl::Span<Span*> spans) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Tries to grow <span>, allocated with <tag>, in place by <delta> pages.
+  bool TryExtend(Span* span, Length delta, MemoryTag tag)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Tries to shrink <span>, allocated with <tag>, in place to at least <n>
+  // pages.
+  bool TryShrink(Span* span, Length n, MemoryTag tag)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Tries to move the contents of <from> into <to>, both allocated with <tag>,
+  // without copying them, deleting <from>.
+  bool TryMove(Span* from, Span* to, MemoryTag tag)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() with the same value of
   //           "tag" and has not yet been deleted.
@@ -66,6 +107,25 @@ class PageAllocator {
 
   BackingStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // The usage of the heap for <tag> alone.  Normal tags cover just their NUMA
+  // partition.  All zero for kCold when there is no separate cold heap.
+  BackingStats stats(MemoryTag tag) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  struct HugePageAwareStats {
+    BackingStats filler;
+    BackingStats regions;
+    BackingStats cache;
+  };
+
+  // The usage of the components of the normal heaps, summed over NUMA
+  // partitions.  All zero unless HPAA is in use.
+  HugePageAwareStats huge_page_aware_stats() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Total pages released to the OS by all heaps since startup.
+  Length released_pages() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   void GetSmallSpanStats(SmallSpanStats* result)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
@@ -78,9 +138,66 @@ class PageAllocator {
   // may also be larger than num_pages since page_heap might decide to
   // release one large range instead of fragmenting it into two
   // smaller released and unreleased ranges.
-  Length ReleaseAtLeastNPages(Length num_pages)
+  //
+  // The normal heaps are released from starting with that of <tag>'s NUMA
+  // partition, if it is one, so that demand on one node first gives up that
+  // node's free memory rather than another's.
+  Length ReleaseAtLeastNPages(Length num_pages,
+                              MemoryTag tag = MemoryTag::kNormal)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // As ReleaseAtLeastNPages, but if that falls short, breaks up hugepages
+  // that are partially in use to release their free pages too.  For callers
+  // that explicitly asked for memory back, such as malloc_trim.
+  Length ReleaseAtLeastNPagesBreakingHugepages(Length num_pages)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Passed as <partition> to work on the heaps of every NUMA partition.  The
+  // background worker of a partition passes its own to only touch local heaps;
+  // the cold and sampled heaps go with partition 0.
+  static constexpr int kAllPartitions = -1;
+
+  // Keeps at least n free hugepages backed and faulted in by each of the
+  // normal (per NUMA partition) heaps.  Only supported by HPAA.
+  void PrefaultHugePages(HugeLength n, int partition = kAllPartitions)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Collapses up to <n> hugepages per NUMA partition that were broken by
+  // subrelease and have since been refilled back into hugepages.  Only HPAA
+  // subreleases.
+  void CollapseRefilledHugePages(HugeLength n)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Reads whether the kernel backs up to <n> hugepages per NUMA partition with
+  // THPs, so that hot allocations prefer those that are.
+  void ScanHugePageBacking(size_t n) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Reads which free pages of up to <n> hugepages per NUMA partition have gone
+  // stale, so that subrelease returns those first.
+  void ScanFreePageIdleness(size_t n) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Releases memory accounted as released that has been faulted back in,
+  // querying the residency of up to <n> hugepages per component and NUMA
+  // partition, so that unmapped bytes match what the OS reports.
+  void ReleaseResidentUnbacked(size_t n) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Performs the unbacking deferred by Parameters::async_release.  Only HPAA
+  // defers releases.  Returns the number of hugepages released.
+  HugeLength ReleasePendingPages(int partition = kAllPartitions)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Releases the memory of up to <max_slabs> slabs of free page heap metadata
+  // per component and NUMA partition.  Returns the number of bytes released.
+  size_t ReleaseFreeMetadata(size_t max_slabs)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Writes a dump of the layout of every hugepage (see huge_page_layout.h) to
+  // <sink>, a chunk at a time.  pageheap_lock is held while each chunk is
+  // gathered, but not while <sink> is called.  Without HPAA, the dump holds
+  // no records.
+  void WriteHugePageLayout(absl::FunctionRef<void(absl::string_view)> sink)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
   // Prints stats about the page heap to *out.
   void Print(Printer* out, MemoryTag tag) ABSL_LOCKS_EXCLUDED(pageheap_lock);
   void PrintInPbtxt(PbtxtRegion* region, MemoryTag tag)
@@ -102,8 +219,8 @@ class PageAllocator {
       ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
   // If we have a usage limit set, ensure we're not violating it from our latest
-  // allocation.
-  void ShrinkToUsageLimit(Length n)
+  // allocation, of <n> pages of <tag>.
+  void ShrinkToUsageLimit(Length n, MemoryTag tag = MemoryTag::kNormal)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   const PageAllocInfo& info(MemoryTag tag) const
@@ -116,6 +233,12 @@ class PageAllocator {
 
   Algorithm algorithm() const { return alg_; }
 
+  // The address space partitioned by size class, enabled by the
+  // TCMALLOC_SIZE_CLASS_REGIONS environment variable.
+  const SizeClassRegions& size_class_regions() const {
+    return size_class_regions_;
+  }
+
   struct PeakStats {
     size_t backed_bytes;
     size_t sampled_application_bytes;
@@ -126,9 +249,19 @@ class PageAllocator {
   }
 
  private:
-  bool ShrinkHardBy(Length page, LimitKind limit_kind)
+  bool ShrinkHardBy(Length page, LimitKind limit_kind, MemoryTag tag)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Releases up to <pages> from the free pages of partially used hugepages,
+  // in release order for <tag>.  Only for HPAA.
+  Length BreakHugepages(Length pages, MemoryTag tag)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Returns the <i>th NUMA partition to release from on behalf of <tag>.
+  size_t ReleaseOrder(MemoryTag tag, size_t i) const {
+    return NumaReleaseOrder(tag, i, active_numa_partitions());
+  }
+
   using Interface =
       std::conditional<huge_page_allocator_internal::kUnconditionalHPAA,
                        HugePageAwareAllocator, PageAllocatorInterface>::type;
@@ -137,7 +270,8 @@ class PageAllocator {
 
   size_t active_numa_partitions() const;
 
-  static constexpr size_t kNumHeaps = kNumaPartitions + 2;
+  static constexpr size_t kNumHeaps =
+      kNumaPartitions + (kHasRegisteredHeap ? 3 : 2);
 
   union Choices {
     Choices() : dummy(0) {}
@@ -146,11 +280,18 @@ class PageAllocator {
     PageHeap ph;
     HugePageAwareAllocator hpaa;
   } choices_[kNumHeaps];
+  // The hugepage caches of heaps not bound to a NUMA node share one baseline
+  // size, rather than each holding its own.
+  HugeCacheGroup cache_group_;
   std::array<Interface*, kNumaPartitions> normal_impl_;
   Interface* sampled_impl_;
   Interface* cold_impl_;
+  // Memory registered for DMA must keep its physical pages, so this heap is
+  // never asked to release memory.  nullptr unless kHasRegisteredHeap.
+  Interface* registered_impl_;
   Algorithm alg_;
   bool has_cold_impl_;
+  SizeClassRegions size_class_regions_;
 
   // Max size of backed spans we will attempt to maintain.
   // Crash if we can't maintain below limits_[kHard], which is guaranteed to be
@@ -182,23 +323,39 @@ inline PageAllocator::Interface* PageAllocator::impl(MemoryTag tag) const {
   }
 
   switch (tag) {
-    case MemoryTag::kNormalP0:
-      return normal_impl_[0];
-    case MemoryTag::kNormalP1:
-      return normal_impl_[1];
     case MemoryTag::kSampled:
       return sampled_impl_;
     case MemoryTag::kCold:
       return cold_impl_;
+    case MemoryTag::kRegistered:
+      ASSERT(kHasRegisteredHeap);
+      return registered_impl_;
     default:
-      ASSUME(false);
-      __builtin_unreachable();
+      ASSUME(IsNormalMemoryTag(tag));
+      return normal_impl_[NumaPartitionFromTag(tag)];
   }
 }
 
 inline Span* PageAllocator::New(Length n, SpanAllocInfo span_alloc_info,
                                 MemoryTag tag) {
-  return impl(tag)->New(n, span_alloc_info);
+  const int64_t probe_start = TCMALLOC_PROBE_START(page_allocator_new);
+  Span* span = impl(tag)->New(n, span_alloc_info);
+  TCMALLOC_PROBE(page_allocator_new, static_cast<int>(tag), n.raw_num(),
+                 ProbeLatencyNs(probe_start));
+  return span;
+}
+
+inline Span* PageAllocator::NewForSizeClass(size_t size_class, Length n,
+                                            SpanAllocInfo span_alloc_info,
+                                            MemoryTag tag) {
+  if (size_class_regions_.Has(size_class)) {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    if (Span* span = size_class_regions_.New(size_class, n)) {
+      ShrinkToUsageLimit(n, tag);
+      return span;
+    }
+  }
+  return New(n, span_alloc_info, tag);
 }
 
 inline Span* PageAllocator::NewAligned(Length n, Length align,
@@ -207,9 +364,34 @@ inline Span* PageAllocator::NewAligned(Length n, Length align,
   return impl(tag)->NewAligned(n, align, span_alloc_info);
 }
 
+inline size_t PageAllocator::NewBatch(Length n, SpanAllocInfo span_alloc_info,
+                                      MemoryTag tag, absl::Span<Span*> spans) {
+  return impl(tag)->NewBatch(n, span_alloc_info, spans);
+}
+
+inline bool PageAllocator::TryExtend(Span* span, Length delta, MemoryTag tag) {
+  return impl(tag)->TryExtend(span, delta);
+}
+
+inline bool PageAllocator::TryShrink(Span* span, Length n, MemoryTag tag) {
+  return impl(tag)->TryShrink(span, n);
+}
+
+inline bool PageAllocator::TryMove(Span* from, Span* to, MemoryTag tag) {
+  return impl(tag)->TryMove(from, to);
+}
+
 inline void PageAllocator::Delete(Span* span, size_t objects_per_span,
                                   MemoryTag tag) {
-  impl(tag)->Delete(span, objects_per_span);
+  const int64_t probe_start = TCMALLOC_PROBE_START(page_allocator_delete);
+  const Length n = span->num_pages();
+  if (ABSL_PREDICT_FALSE(size_class_regions_.Contains(span))) {
+    size_class_regions_.Delete(span);
+  } else {
+    impl(tag)->Delete(span, objects_per_span);
+  }
+  TCMALLOC_PROBE(page_allocator_delete, static_cast<int>(tag), n.raw_num(),
+                 ProbeLatencyNs(probe_start));
 }
 
 inline BackingStats PageAllocator::stats() const {
@@ -221,6 +403,47 @@ inline BackingStats PageAllocator::stats() const {
   if (has_cold_impl_) {
     ret += cold_impl_->stats();
   }
+  if (kHasRegisteredHeap) {
+    ret += registered_impl_->stats();
+  }
+  ret += size_class_regions_.stats();
+  return ret;
+}
+
+inline BackingStats PageAllocator::stats(MemoryTag tag) const {
+  if (tag == MemoryTag::kCold && !has_cold_impl_) return BackingStats();
+  if (tag == MemoryTag::kRegistered && !kHasRegisteredHeap) {
+    return BackingStats();
+  }
+  return impl(tag)->stats();
+}
+
+inline Length PageAllocator::released_pages() const {
+  Length ret = sampled_impl_->info().released();
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    ret += normal_impl_[partition]->info().released();
+  }
+  if (has_cold_impl_) {
+    ret += cold_impl_->info().released();
+  }
+  if (kHasRegisteredHeap) {
+    ret += registered_impl_->info().released();
+  }
+  return ret;
+}
+
+inline PageAllocator::HugePageAwareStats PageAllocator::huge_page_aware_stats()
+    const {
+  HugePageAwareStats ret;
+  if (alg_ != HPAA) return ret;
+
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    const auto* hpaa =
+        static_cast<const HugePageAwareAllocator*>(normal_impl_[partition]);
+    ret.filler += hpaa->FillerStats();
+    ret.regions += hpaa->RegionsStats();
+    ret.cache += hpaa->cache()->stats();
+  }
   return ret;
 }
 
@@ -238,6 +461,11 @@ inline void PageAllocator::GetSmallSpanStats(SmallSpanStats* result) {
     cold_impl_->GetSmallSpanStats(&cold);
     *result += cold;
   }
+  if (kHasRegisteredHeap) {
+    SmallSpanStats registered;
+    registered_impl_->GetSmallSpanStats(&registered);
+    *result += registered;
+  }
 }
 
 inline void PageAllocator::GetLargeSpanStats(LargeSpanStats* result) {
@@ -254,22 +482,131 @@ inline void PageAllocator::GetLargeSpanStats(LargeSpanStats* result) {
     cold_impl_->GetLargeSpanStats(&cold);
     *result = *result + cold;
   }
+  if (kHasRegisteredHeap) {
+    LargeSpanStats registered;
+    registered_impl_->GetLargeSpanStats(&registered);
+    *result = *result + registered;
+  }
 }
 
-inline Length PageAllocator::ReleaseAtLeastNPages(Length num_pages) {
+inline Length PageAllocator::ReleaseAtLeastNPages(Length num_pages,
+                                                  MemoryTag tag) {
+  const int64_t probe_start = TCMALLOC_PROBE_START(release_pages);
   Length released;
   // TODO(ckennelly): Refine this policy.  Cold data should be the most
   // resilient to not being on huge pages.
   if (has_cold_impl_) {
     released = cold_impl_->ReleaseAtLeastNPages(num_pages);
   }
-  for (int partition = 0; partition < active_numa_partitions(); partition++) {
-    released += normal_impl_[partition]->ReleaseAtLeastNPages(
+  for (int i = 0; i < active_numa_partitions(); i++) {
+    released += normal_impl_[ReleaseOrder(tag, i)]->ReleaseAtLeastNPages(
         num_pages > released ? num_pages - released : Length(0));
   }
 
   released += sampled_impl_->ReleaseAtLeastNPages(
       num_pages > released ? num_pages - released : Length(0));
+  if (num_pages > released) {
+    released += size_class_regions_.ReleaseAtLeastNPages(num_pages - released);
+  }
+  TCMALLOC_PROBE(release_pages, num_pages.raw_num(), released.raw_num(),
+                 ProbeLatencyNs(probe_start));
+  return released;
+}
+
+inline void PageAllocator::PrefaultHugePages(HugeLength n, int partition) {
+  if (alg_ != HPAA) return;
+
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  for (int i = 0; i < active_numa_partitions(); i++) {
+    if (partition != kAllPartitions && partition != i) continue;
+    static_cast<HugePageAwareAllocator*>(normal_impl_[i])
+        ->PrefaultHugePages(n);
+  }
+}
+
+inline void PageAllocator::CollapseRefilledHugePages(HugeLength n) {
+  if (alg_ != HPAA) return;
+
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    static_cast<HugePageAwareAllocator*>(normal_impl_[partition])
+        ->CollapseRefilledHugePages(n);
+  }
+}
+
+inline void PageAllocator::ScanHugePageBacking(size_t n) {
+  if (alg_ != HPAA) return;
+
+  PageFlags flags;
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    static_cast<HugePageAwareAllocator*>(normal_impl_[partition])
+        ->ScanHugePageBacking(n, flags);
+  }
+}
+
+inline void PageAllocator::ScanFreePageIdleness(size_t n) {
+  if (alg_ != HPAA) return;
+
+  PageFlags flags;
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    static_cast<HugePageAwareAllocator*>(normal_impl_[partition])
+        ->ScanFreePageIdleness(n, flags);
+  }
+}
+
+inline void PageAllocator::ReleaseResidentUnbacked(size_t n) {
+  if (alg_ != HPAA) return;
+
+  Residency residency;
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    static_cast<HugePageAwareAllocator*>(normal_impl_[partition])
+        ->ReleaseResidentUnbacked(n, residency);
+  }
+}
+
+inline HugeLength PageAllocator::ReleasePendingPages(int partition) {
+  HugeLength released = NHugePages(0);
+  if (alg_ != HPAA) return released;
+
+  const bool shared = partition == kAllPartitions || partition == 0;
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  if (has_cold_impl_ && shared) {
+    released +=
+        static_cast<HugePageAwareAllocator*>(cold_impl_)->ReleasePendingPages();
+  }
+  for (int i = 0; i < active_numa_partitions(); i++) {
+    if (partition != kAllPartitions && partition != i) continue;
+    released += static_cast<HugePageAwareAllocator*>(normal_impl_[i])
+                    ->ReleasePendingPages();
+  }
+  if (shared) {
+    released += static_cast<HugePageAwareAllocator*>(sampled_impl_)
+                    ->ReleasePendingPages();
+  }
+  return released;
+}
+
+inline size_t PageAllocator::ReleaseFreeMetadata(size_t max_slabs) {
+  if (alg_ != HPAA) return 0;
+
+  size_t released = 0;
+  if (has_cold_impl_) {
+    released += static_cast<HugePageAwareAllocator*>(cold_impl_)
+                    ->ReleaseFreeMetadata(max_slabs);
+  }
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    released += static_cast<HugePageAwareAllocator*>(normal_impl_[partition])
+                    ->ReleaseFreeMetadata(max_slabs);
+  }
+  released += static_cast<HugePageAwareAllocator*>(sampled_impl_)
+                  ->ReleaseFreeMetadata(max_slabs);
+  if (kHasRegisteredHeap) {
+    released += static_cast<HugePageAwareAllocator*>(registered_impl_)
+                    ->ReleaseFreeMetadata(max_slabs);
+  }
   return released;
 }
 
@@ -277,12 +614,20 @@ inline void PageAllocator::Print(Printer* out, MemoryTag tag) {
   if (tag == MemoryTag::kCold && !has_cold_impl_) {
     return;
   }
+  // Most processes never use the registered heap.
+  if (tag == MemoryTag::kRegistered &&
+      (!kHasRegisteredHeap || registered_impl_->stats().system_bytes == 0)) {
+    return;
+  }
 
   const absl::string_view label = MemoryTagToLabel(tag);
   if (tag != MemoryTag::kNormal) {
     out->printf("\n>>>>>>> Begin %s page allocator <<<<<<<\n", label);
   }
   impl(tag)->Print(out);
+  if (tag == MemoryTag::kNormal) {
+    size_class_regions_.Print(out);
+  }
   if (tag != MemoryTag::kNormal) {
     out->printf(">>>>>>> End %s page allocator <<<<<<<\n", label);
   }
@@ -292,10 +637,17 @@ inline void PageAllocator::PrintInPbtxt(PbtxtRegion* region, MemoryTag tag) {
   if (tag == MemoryTag::kCold && !has_cold_impl_) {
     return;
   }
+  if (tag == MemoryTag::kRegistered &&
+      (!kHasRegisteredHeap || registered_impl_->stats().system_bytes == 0)) {
+    return;
+  }
 
   PbtxtRegion pa = region->CreateSubRegion("page_allocator");
   pa.PrintRaw("tag", MemoryTagToLabel(tag));
   impl(tag)->PrintInPbtxt(&pa);
+  if (tag == MemoryTag::kNormal) {
+    size_class_regions_.PrintInPbtxt(&pa);
+  }
 }
 
 inline void PageAllocator::set_limit(size_t limit, LimitKind limit_kind) {
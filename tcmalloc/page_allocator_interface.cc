@@ -19,6 +19,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "absl/types/span.h"
+
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
@@ -40,6 +42,26 @@ PageAllocatorInterface::~PageAllocatorInterface() {
   Crash(kCrash, __FILE__, __LINE__, "should never destroy this");
 }
 
+size_t PageAllocatorInterface::NewBatch(Length n,
+                                        SpanAllocInfo span_alloc_info,
+                                        absl::Span<Span*> spans) {
+  size_t allocated = 0;
+  for (Span*& span : spans) {
+    span = New(n, span_alloc_info);
+    if (span == nullptr) break;
+    ++allocated;
+  }
+  return allocated;
+}
+
+bool PageAllocatorInterface::TryExtend(Span* span, Length delta) {
+  return false;
+}
+
+bool PageAllocatorInterface::TryShrink(Span* span, Length n) { return false; }
+
+bool PageAllocatorInterface::TryMove(Span* from, Span* to) { return false; }
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
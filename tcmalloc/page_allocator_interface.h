@@ -18,6 +18,7 @@
 #include <stddef.h>
 
 #include "absl/base/thread_annotations.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
@@ -49,6 +50,39 @@ class PageAllocatorInterface {
                            SpanAllocInfo span_alloc_info)
       ABSL_LOCKS_EXCLUDED(pageheap_lock) = 0;
 
+  // Allocates up to spans.size() runs of "n" pages each, as if by repeated
+  // calls to New(), and stores them in the prefix of <spans>.  Returns the
+  // number of spans allocated, which is less than spans.size() only if out of
+  // memory.  The default implementation just calls New(); allocators that can
+  // do better amortize pageheap_lock over the batch.
+  virtual size_t NewBatch(Length n, SpanAllocInfo span_alloc_info,
+                          absl::Span<Span*> spans)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Tries to grow <span> in place by the <delta> pages that follow it.  On
+  // success, span->num_pages() is updated and the new pages are backed.
+  // Returns false, leaving <span> unchanged, if those pages are not free.  The
+  // default implementation never grows spans.
+  virtual bool TryExtend(Span* span, Length delta)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Tries to shrink <span> in place to at least <n> pages, returning the pages
+  // that follow for new allocations.  On success, span->num_pages() is
+  // updated; it may stay above <n> where the allocator only frees whole
+  // hugepages.  Returns false, leaving <span> unchanged, if nothing can be
+  // freed.  The default implementation never shrinks spans.
+  // REQUIRES: 0 < n < span->num_pages()
+  virtual bool TryShrink(Span* span, Length n)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Tries to move the contents of <from> to the start of <to> without copying
+  // them.  On success, <from> is deleted.  Returns false, leaving both spans
+  // unchanged, if the memory of <from> cannot be moved.  The default
+  // implementation never moves spans.
+  // REQUIRES: <from> is not sampled.
+  virtual bool TryMove(Span* from, Span* to)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
@@ -27,6 +27,7 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/base/internal/spinlock.h"
+#include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/malloc_extension.h"
@@ -142,6 +143,32 @@ TEST_F(PageAllocatorTest, PrintIt) {
   EXPECT_THAT(output, testing::ContainsRegex("stats on allocation sizes"));
 }
 
+// Usage limits are enforced by releasing from the NUMA partition that is
+// allocating first, then from the others in their usual order.
+TEST(NumaReleaseOrderTest, StartsWithAllocatingPartition) {
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    const MemoryTag tag = NumaNormalTag(partition);
+    std::vector<size_t> order;
+    for (size_t i = 0; i < kNumaPartitions; ++i) {
+      order.push_back(NumaReleaseOrder(tag, i, kNumaPartitions));
+    }
+    std::vector<size_t> expected;
+    for (size_t i = partition; i < kNumaPartitions; ++i) expected.push_back(i);
+    for (size_t i = 0; i < partition; ++i) expected.push_back(i);
+    EXPECT_THAT(order, testing::ElementsAreArray(expected)) << partition;
+  }
+
+  // Other tags, and a single active partition, keep the usual order.
+  for (MemoryTag tag : {MemoryTag::kSampled, MemoryTag::kCold}) {
+    for (size_t i = 0; i < kNumaPartitions; ++i) {
+      EXPECT_EQ(NumaReleaseOrder(tag, i, kNumaPartitions), i);
+    }
+  }
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    EXPECT_EQ(NumaReleaseOrder(NumaNormalTag(partition), 0, 1), 0);
+  }
+}
+
 TEST_F(PageAllocatorTest, ShrinkFailureTest) {
   // Turn off subrelease so that we take the ShrinkHardBy path.
   const bool old_subrelease = Parameters::hpaa_subrelease();
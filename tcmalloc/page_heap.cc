@@ -57,24 +57,29 @@ Span* PageHeap::SearchFreeAndLargeLists(Length n, bool* from_returned) {
   ASSERT(n > Length(0));
 
   // Find first size >= n that has a non-empty list
-  for (Length s = n; s < kMaxPages; ++s) {
-    SpanList* ll = &free_[s.raw_num()].normal;
-    // If we're lucky, ll is non-empty, meaning it has a suitable span.
-    if (!ll->empty()) {
-      ASSERT(ll->first()->location() == Span::ON_NORMAL_FREELIST);
+  int index = FindNonEmptyList(ListIndex(n));
+  if (index < kMaxPages.raw_num()) {
+    // Any span in a small list fits.  Prefer a normal span to a returned one.
+    SpanListPair* list = &free_[index];
+    if (!list->normal.empty()) {
+      ASSERT(list->normal.first()->location() == Span::ON_NORMAL_FREELIST);
       *from_returned = false;
-      return Carve(ll->first(), n);
-    }
-    // Alternatively, maybe there's a usable returned span.
-    ll = &free_[s.raw_num()].returned;
-    if (!ll->empty()) {
-      ASSERT(ll->first()->location() == Span::ON_RETURNED_FREELIST);
-      *from_returned = true;
-      return Carve(ll->first(), n);
+      return Carve(list->normal.first(), n);
     }
+    ASSERT(list->returned.first()->location() == Span::ON_RETURNED_FREELIST);
+    *from_returned = true;
+    return Carve(list->returned.first(), n);
+  }
+
+  // No luck in free lists, our last chance is in a larger class.  Only the
+  // bucket n falls in can hold spans that are too short: every span in a
+  // later bucket fits.
+  while (index < kNumLists) {
+    Span* span = AllocLarge(index, n, from_returned);
+    if (span != nullptr) return span;
+    index = FindNonEmptyList(index + 1);
   }
-  // No luck in free lists, our last chance is in a larger class.
-  return AllocLarge(n, from_returned);  // May be NULL
+  return nullptr;
 }
 
 Span* PageHeap::AllocateSpan(Length n, bool* from_returned) {
@@ -193,13 +198,14 @@ Span* PageHeap::NewAligned(Length n, Length align,
   return span;
 }
 
-Span* PageHeap::AllocLarge(Length n, bool* from_returned) {
+Span* PageHeap::AllocLarge(int index, Length n, bool* from_returned) {
+  ASSERT(index >= kMaxPages.raw_num());
   // find the best span (closest to n in size).
   // The following loops implements address-ordered best-fit.
   Span* best = nullptr;
 
   // Search through normal list
-  for (Span* span : large_.normal) {
+  for (Span* span : free_[index].normal) {
     ASSERT(span->location() == Span::ON_NORMAL_FREELIST);
     if (IsSpanBetter(span, best, n)) {
       best = span;
@@ -208,7 +214,7 @@ Span* PageHeap::AllocLarge(Length n, bool* from_returned) {
   }
 
   // Search through released list in case it has a better fit
-  for (Span* span : large_.returned) {
+  for (Span* span : free_[index].returned) {
     ASSERT(span->location() == Span::ON_RETURNED_FREELIST);
     if (IsSpanBetter(span, best, n)) {
       best = span;
@@ -316,29 +322,31 @@ void PageHeap::MergeIntoFreeList(Span* span) {
 
 void PageHeap::PrependToFreeList(Span* span) {
   ASSERT(span->location() != Span::IN_USE);
-  SpanListPair* list = (span->num_pages() < kMaxPages)
-                           ? &free_[span->num_pages().raw_num()]
-                           : &large_;
+  const int index = ListIndex(span->num_pages());
+  SpanListPair* list = &free_[index];
   if (span->location() == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes += span->bytes_in_span();
     list->normal.prepend(span);
+    normal_nonempty_.SetBit(index);
   } else {
     stats_.unmapped_bytes += span->bytes_in_span();
     list->returned.prepend(span);
+    returned_nonempty_.SetBit(index);
   }
 }
 
 void PageHeap::RemoveFromFreeList(Span* span) {
   ASSERT(span->location() != Span::IN_USE);
-  SpanListPair* list = (span->num_pages() < kMaxPages)
-                           ? &free_[span->num_pages().raw_num()]
-                           : &large_;
+  const int index = ListIndex(span->num_pages());
+  SpanListPair* list = &free_[index];
   if (span->location() == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes -= span->bytes_in_span();
     list->normal.remove(span);
+    if (list->normal.empty()) normal_nonempty_.ClearBit(index);
   } else {
     stats_.unmapped_bytes -= span->bytes_in_span();
     list->returned.remove(span);
+    if (list->returned.empty()) returned_nonempty_.ClearBit(index);
   }
 }
 
@@ -395,16 +403,16 @@ Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
     }
     prev_released_pages = released_pages;
 
-    for (int i = 0; i < kMaxPages.raw_num() + 1 && released_pages < num_pages;
-         i++, release_index_++) {
-      if (release_index_ > kMaxPages.raw_num()) release_index_ = 0;
-      SpanListPair* slist = (release_index_ == kMaxPages.raw_num())
-                                ? &large_
-                                : &free_[release_index_];
-      if (!slist->normal.empty()) {
-        Length released_len = ReleaseLastNormalSpan(slist);
-        released_pages += released_len;
+    for (int i = 0; i < kNumLists && released_pages < num_pages; i++) {
+      // Skip straight to the next list with a normal span to release.
+      size_t index = normal_nonempty_.FindSet(release_index_);
+      if (index == kNumLists) {
+        index = normal_nonempty_.FindSet(0);
+        if (index == kNumLists) break;
       }
+      Length released_len = ReleaseLastNormalSpan(&free_[index]);
+      released_pages += released_len;
+      release_index_ = (index + 1) % kNumLists;
     }
   }
   info_.RecordRelease(num_pages, released_pages);
@@ -422,13 +430,15 @@ void PageHeap::GetLargeSpanStats(LargeSpanStats* result) {
   result->spans = 0;
   result->normal_pages = Length(0);
   result->returned_pages = Length(0);
-  for (Span* s : large_.normal) {
-    result->normal_pages += s->num_pages();
-    result->spans++;
-  }
-  for (Span* s : large_.returned) {
-    result->returned_pages += s->num_pages();
-    result->spans++;
+  for (int index = kMaxPages.raw_num(); index < kNumLists; ++index) {
+    for (Span* s : free_[index].normal) {
+      result->normal_pages += s->num_pages();
+      result->spans++;
+    }
+    for (Span* s : free_[index].returned) {
+      result->returned_pages += s->num_pages();
+      result->spans++;
+    }
   }
 }
 
@@ -472,6 +482,8 @@ bool PageHeap::GrowHeap(Length n) {
 bool PageHeap::Check() {
   ASSERT(free_[0].normal.empty());
   ASSERT(free_[0].returned.empty());
+  ASSERT(!normal_nonempty_.GetBit(0));
+  ASSERT(!returned_nonempty_.GetBit(0));
   return true;
 }
 
@@ -15,12 +15,15 @@
 #ifndef TCMALLOC_PAGE_HEAP_H_
 #define TCMALLOC_PAGE_HEAP_H_
 
+#include <algorithm>
 #include <cstddef>
 
 #include "absl/base/thread_annotations.h"
+#include "absl/numeric/bits.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/range_tracker.h"
 #include "tcmalloc/page_allocator_interface.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/span.h"
@@ -98,15 +101,42 @@ class PageHeap final : public PageAllocatorInterface {
     SpanList returned;
   };
 
-  // List of free spans of length >= kMaxPages
-  SpanListPair large_ ABSL_GUARDED_BY(pageheap_lock);
+  // Spans shorter than kMaxPages have a list per length.  Longer ones are
+  // bucketed by powers of two: bucket b holds lengths in
+  // [kMaxPages << b, kMaxPages << (b + 1)), and the last bucket everything
+  // longer.
+  static constexpr int kNumLargeBuckets = 32;
+  static constexpr int kNumLists = kMaxPages.raw_num() + kNumLargeBuckets;
+
+  // The index into free_ of the list for spans of length <n>.
+  static int ListIndex(Length n) {
+    ASSERT(n > Length(0));
+    if (n < kMaxPages) return n.raw_num();
+    const int bucket = absl::bit_width(n.raw_num()) -
+                       absl::bit_width(kMaxPages.raw_num());
+    return kMaxPages.raw_num() + std::min(bucket, kNumLargeBuckets - 1);
+  }
 
   // Array mapping from span length to a doubly linked list of free spans
-  SpanListPair free_[kMaxPages.raw_num()] ABSL_GUARDED_BY(pageheap_lock);
+  SpanListPair free_[kNumLists] ABSL_GUARDED_BY(pageheap_lock);
+
+  // Which of free_'s normal and returned lists are non-empty, so that the
+  // smallest list that can satisfy a request is found with a bit scan rather
+  // than by walking the lists.
+  Bitmap<kNumLists> normal_nonempty_ ABSL_GUARDED_BY(pageheap_lock);
+  Bitmap<kNumLists> returned_nonempty_ ABSL_GUARDED_BY(pageheap_lock);
 
   // Statistics on system, free, and unmapped bytes
   BackingStats stats_ ABSL_GUARDED_BY(pageheap_lock);
 
+  // Returns the index of the first non-empty list at or after <index>, or
+  // kNumLists if there is none.
+  int FindNonEmptyList(int index) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return static_cast<int>(std::min(normal_nonempty_.FindSet(index),
+                                     returned_nonempty_.FindSet(index)));
+  }
+
   Span* SearchFreeAndLargeLists(Length n, bool* from_returned)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
@@ -122,9 +152,10 @@ class PageHeap final : public PageAllocatorInterface {
   Span* Carve(Span* span, Length n)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
-  // Allocate a large span of length == n.  If successful, returns a
-  // span of exactly the specified length.  Else, returns NULL.
-  Span* AllocLarge(Length n, bool* from_returned)
+  // Allocate a large span of length == n from the large list at <index>.
+  // If the list has a span of at least n pages, returns a span of exactly
+  // the specified length.  Else, returns NULL.
+  Span* AllocLarge(int index, Length n, bool* from_returned)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   // Coalesce span with neighboring spans if possible, prepend to
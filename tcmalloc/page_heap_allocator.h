@@ -16,16 +16,25 @@
 #define TCMALLOC_PAGE_HEAP_ALLOCATOR_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <algorithm>
 #include <new>
 
 #include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
 #include "absl/base/dynamic_annotations.h"
+#include "absl/base/internal/spinlock.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/numeric/bits.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/system-alloc.h"
 
 #ifdef ABSL_HAVE_ADDRESS_SANITIZER
 #include <sanitizer/asan_interface.h>
@@ -44,11 +53,17 @@ struct AllocatorStats {
 
 // Simple allocator for objects of a specified type.  External locking
 // is required before accessing one of these objects.
+//
+// Objects are carved from slabs of SlabBytes(), aligned to their size so that
+// the slab of an object is found by masking its address.  New() prefers slabs
+// that are already partly in use, so that after a spike in demand the freed
+// objects gather in fewer slabs.  ReleaseFreeSlabs() returns the memory of
+// slabs whose objects are all free to the system, but for the page holding
+// the slab's header, and reuses them once they are needed again.
 template <class T>
 class PageHeapAllocator {
  public:
-  constexpr PageHeapAllocator()
-      : arena_(nullptr), free_list_(nullptr), stats_{0, 0} {}
+  constexpr PageHeapAllocator() = default;
 
   // We use an explicit Init function because these variables are statically
   // allocated and their constructors might not have run by the time some
@@ -59,37 +74,64 @@ class PageHeapAllocator {
     Delete(New());
   }
 
+  // Like Init(), but slabs are carved from the arena's memory on
+  // <numa_partition> rather than on that of the calling thread.
+  void Init(Arena* arena, size_t numa_partition)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    partitioned_ = true;
+    numa_partition_ = numa_partition;
+    Init(arena);
+  }
+
   ABSL_ATTRIBUTE_RETURNS_NONNULL T* New()
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
-    // Consult free list
-    T* result = free_list_;
-    stats_.in_use++;
-    if (ABSL_PREDICT_FALSE(result == nullptr)) {
-      stats_.total++;
-      result = reinterpret_cast<T*>(
-          arena_->Alloc(sizeof(T), static_cast<std::align_val_t>(alignof(T))));
-      ABSL_ANNOTATE_MEMORY_IS_UNINITIALIZED(result, sizeof(*result));
-      return result;
-    } else {
+    Slab* slab = partial_;
+    if (ABSL_PREDICT_FALSE(slab == nullptr)) {
+      slab = NewSlab();
+      Push(&partial_, slab);
+    }
+    T* result;
+    if (slab->free_list != nullptr) {
+      result = slab->free_list;
 #ifdef ABSL_HAVE_ADDRESS_SANITIZER
       // Unpoison the object on the freelist.
       ASAN_UNPOISON_MEMORY_REGION(result, sizeof(*result));
 #endif
+      slab->free_list = *(reinterpret_cast<T**>(result));
+    } else {
+      result = reinterpret_cast<T*>(reinterpret_cast<char*>(slab) +
+                                    ObjectsOffset() +
+                                    slab->carved * sizeof(T));
+      slab->carved++;
+      stats_.total++;
+    }
+    if (--slab->free == 0) {
+      Unlink(&partial_, slab);
     }
-    free_list_ = *(reinterpret_cast<T**>(free_list_));
+    stats_.in_use++;
     ABSL_ANNOTATE_MEMORY_IS_UNINITIALIZED(result, sizeof(*result));
     return result;
   }
 
   void Delete(T* p) ABSL_ATTRIBUTE_NONNULL()
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
-    *(reinterpret_cast<void**>(p)) = free_list_;
+    Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(p) &
+                                         ~(SlabBytes() - 1));
+    *(reinterpret_cast<T**>(p)) = slab->free_list;
 #ifdef ABSL_HAVE_ADDRESS_SANITIZER
     // Poison the object on the freelist.  We do not dereference it after this
     // point.
     ASAN_POISON_MEMORY_REGION(p, sizeof(*p));
 #endif
-    free_list_ = p;
+    slab->free_list = p;
+    const bool was_full = slab->free++ == 0;
+    if (slab->free == ObjectsPerSlab()) {
+      if (!was_full) Unlink(&partial_, slab);
+      Push(&empty_, slab);
+      empty_slabs_++;
+    } else if (was_full) {
+      Push(&partial_, slab);
+    }
     stats_.in_use--;
   }
 
@@ -97,14 +139,277 @@ class PageHeapAllocator {
     return stats_;
   }
 
+  // Releases the memory of up to <max_slabs> slabs whose objects are all
+  // free, keeping kRetainedEmptySlabs of them to absorb churn.  Returns the
+  // number of bytes released.
+  size_t ReleaseFreeSlabs(size_t max_slabs)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    size_t released = 0;
+    for (; max_slabs > 0 && empty_slabs_ > kRetainedEmptySlabs; --max_slabs) {
+      // The slabs emptied most recently are the likeliest to be reused.
+      Slab* slab = empty_;
+      for (size_t i = 0; i < kRetainedEmptySlabs; ++i) slab = slab->next;
+      // Only whole system pages are released, which leaves the header be.
+      const size_t page = GetPageSize();
+      const uintptr_t begin =
+          (reinterpret_cast<uintptr_t>(slab) + sizeof(Slab) + page - 1) &
+          ~(page - 1);
+      const uintptr_t end = reinterpret_cast<uintptr_t>(slab) + SlabBytes();
+      if (begin >= end) break;
+      if (!SystemRelease(reinterpret_cast<void*>(begin), end - begin)) break;
+      Unlink(&empty_, slab);
+      empty_slabs_--;
+      slab->released_bytes = end - begin;
+      arena_->UpdateAllocatedAndNonresident(
+          -static_cast<int64_t>(slab->released_bytes), slab->released_bytes);
+      stats_.total -= slab->carved;
+      slab->carved = 0;
+      slab->free_list = nullptr;
+      Push(&released_, slab);
+      released += slab->released_bytes;
+    }
+    return released;
+  }
+
+  // The size and alignment of the slabs objects are carved from.
+  static constexpr size_t SlabBytes() {
+    return std::max(kMinSlabBytes, absl::bit_ceil(ObjectsOffset() + sizeof(T)));
+  }
+
  private:
-  // Arena from which to allocate memory
-  Arena* arena_;
+  struct Slab {
+    // Links in the list of partial_, empty_ or released_ slabs; full slabs
+    // are in none.
+    Slab* prev;
+    Slab* next;
+    // Objects freed since they were carved.
+    T* free_list;
+    // Free objects, whether carved or not.
+    uint32_t free;
+    // Objects carved, at the start of the slab, since it was last backed.
+    uint32_t carved;
+    // The bytes ReleaseFreeSlabs() released, accounted as non-resident until
+    // the slab is reused.
+    size_t released_bytes;
+  };
+
+#ifdef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+  static constexpr size_t kMinSlabBytes = 16 << 10;
+#else
+  static constexpr size_t kMinSlabBytes = 64 << 10;
+#endif
+  static constexpr size_t kRetainedEmptySlabs = 1;
+
+  static constexpr size_t ObjectsOffset() {
+    return (sizeof(Slab) + alignof(T) - 1) & ~(alignof(T) - 1);
+  }
 
-  // Free list of already carved objects
-  T* free_list_ ABSL_GUARDED_BY(pageheap_lock);
+  static constexpr uint32_t ObjectsPerSlab() {
+    return (SlabBytes() - ObjectsOffset()) / sizeof(T);
+  }
+
+  // A slab to allocate from once partial_ is exhausted: the first of the
+  // empty_ slabs, of the released_ ones or a new one, in that order.
+  Slab* NewSlab() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    Slab* slab = empty_;
+    if (slab != nullptr) {
+      Unlink(&empty_, slab);
+      empty_slabs_--;
+      return slab;
+    }
+    slab = released_;
+    if (slab != nullptr) {
+      Unlink(&released_, slab);
+      // The released pages are faulted back in as objects are carved.
+      arena_->UpdateAllocatedAndNonresident(
+          slab->released_bytes, -static_cast<int64_t>(slab->released_bytes));
+      slab->released_bytes = 0;
+      return slab;
+    }
+    const auto alignment = static_cast<std::align_val_t>(SlabBytes());
+    slab = reinterpret_cast<Slab*>(
+        partitioned_
+            ? arena_->AllocOnPartition(numa_partition_, SlabBytes(), alignment)
+            : arena_->Alloc(SlabBytes(), alignment));
+    slab->prev = slab->next = nullptr;
+    slab->free_list = nullptr;
+    slab->free = ObjectsPerSlab();
+    slab->carved = 0;
+    slab->released_bytes = 0;
+    return slab;
+  }
+
+  static void Push(Slab** list, Slab* slab) {
+    slab->prev = nullptr;
+    slab->next = *list;
+    if (*list != nullptr) (*list)->prev = slab;
+    *list = slab;
+  }
+
+  static void Unlink(Slab** list, Slab* slab) {
+    if (slab->prev != nullptr) {
+      slab->prev->next = slab->next;
+    } else {
+      *list = slab->next;
+    }
+    if (slab->next != nullptr) slab->next->prev = slab->prev;
+    slab->prev = slab->next = nullptr;
+  }
+
+  // Arena from which to allocate memory, and the NUMA partition to allocate it
+  // on if partitioned_.
+  Arena* arena_ = nullptr;
+  bool partitioned_ = false;
+  size_t numa_partition_ = 0;
+
+  // Slabs with both free and allocated objects.
+  Slab* partial_ ABSL_GUARDED_BY(pageheap_lock) = nullptr;
+  // Slabs whose objects are all free, and how many of them there are.
+  Slab* empty_ ABSL_GUARDED_BY(pageheap_lock) = nullptr;
+  size_t empty_slabs_ ABSL_GUARDED_BY(pageheap_lock) = 0;
+  // Slabs released by ReleaseFreeSlabs().
+  Slab* released_ ABSL_GUARDED_BY(pageheap_lock) = nullptr;
+
+  AllocatorStats stats_ ABSL_GUARDED_BY(pageheap_lock) = {0, 0};
+};
+
+// PageHeapAllocator fronted by small caches of free objects, one per CPU
+// (modulo kShards).  Callers that already hold pageheap_lock use New() and
+// Delete(), which go straight to the backing allocator.  Callers that do not
+// use NewUnlocked() and DeleteUnlocked(), which only take a shard's lock and
+// touch pageheap_lock when the shard must be refilled or drained, moving
+// kBatch objects at a time.
+template <class T>
+class CpuCachedPageHeapAllocator {
+ public:
+  static constexpr int kShards = 32;
+  static constexpr int kCapacity = 32;
+  static constexpr int kBatch = kCapacity / 2;
+
+  constexpr CpuCachedPageHeapAllocator() = default;
+
+  void Init(Arena* arena) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    backing_.Init(arena);
+  }
+
+  void Init(Arena* arena, size_t numa_partition)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    backing_.Init(arena, numa_partition);
+  }
+
+  ABSL_ATTRIBUTE_RETURNS_NONNULL T* New()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return backing_.New();
+  }
+
+  void Delete(T* p) ABSL_ATTRIBUTE_NONNULL()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    backing_.Delete(p);
+  }
+
+  ABSL_ATTRIBUTE_RETURNS_NONNULL T* NewUnlocked()
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    Shard& shard = CurrentShard();
+    {
+      absl::base_internal::SpinLockHolder h(&shard.lock);
+      if (ABSL_PREDICT_TRUE(shard.count > 0)) {
+        return Unpoison(shard.objects[--shard.count]);
+      }
+    }
+
+    T* batch[kBatch];
+    {
+      AllocationGuardSpinLockHolder h(&pageheap_lock);
+      for (T*& p : batch) p = backing_.New();
+    }
+    // Keep batch[0] for the caller.  The shard may have been refilled by
+    // another thread meanwhile, in which case the overflow goes back.
+    int n = kBatch - 1;
+    {
+      absl::base_internal::SpinLockHolder h(&shard.lock);
+      while (n > 0 && shard.count < kCapacity) {
+        shard.objects[shard.count++] = Poison(batch[n--]);
+      }
+    }
+    if (ABSL_PREDICT_FALSE(n > 0)) {
+      AllocationGuardSpinLockHolder h(&pageheap_lock);
+      for (; n > 0; --n) backing_.Delete(batch[n]);
+    }
+    return batch[0];
+  }
+
+  void DeleteUnlocked(T* p) ABSL_ATTRIBUTE_NONNULL()
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    Shard& shard = CurrentShard();
+    T* batch[kBatch];
+    {
+      absl::base_internal::SpinLockHolder h(&shard.lock);
+      if (ABSL_PREDICT_TRUE(shard.count < kCapacity)) {
+        shard.objects[shard.count++] = Poison(p);
+        return;
+      }
+      shard.count -= kBatch;
+      std::copy_n(&shard.objects[shard.count], kBatch, batch);
+      shard.objects[shard.count++] = Poison(p);
+    }
+
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    for (T* q : batch) backing_.Delete(Unpoison(q));
+  }
+
+  // Objects held by the shards count as in use, and are not released.
+  size_t ReleaseFreeSlabs(size_t max_slabs)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return backing_.ReleaseFreeSlabs(max_slabs);
+  }
+
+  // Objects held by the shards count as free.
+  AllocatorStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    AllocatorStats stats = backing_.stats();
+    stats.in_use -= cached();
+    return stats;
+  }
+
+  // Returns the number of objects held by the shards.
+  size_t cached() const {
+    size_t n = 0;
+    for (const Shard& shard : shards_) {
+      absl::base_internal::SpinLockHolder h(&shard.lock);
+      n += shard.count;
+    }
+    return n;
+  }
+
+ private:
+  struct alignas(ABSL_CACHELINE_SIZE) Shard {
+    mutable absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    int count ABSL_GUARDED_BY(lock) = 0;
+    T* objects[kCapacity] ABSL_GUARDED_BY(lock) = {};
+  };
+
+  Shard& CurrentShard() {
+    const int cpu = subtle::percpu::GetCurrentCpu();
+    return shards_[static_cast<unsigned>(cpu) % kShards];
+  }
+
+  static T* Poison(T* p) {
+#ifdef ABSL_HAVE_ADDRESS_SANITIZER
+    ASAN_POISON_MEMORY_REGION(p, sizeof(*p));
+#endif
+    return p;
+  }
+
+  static T* Unpoison(T* p) {
+#ifdef ABSL_HAVE_ADDRESS_SANITIZER
+    ASAN_UNPOISON_MEMORY_REGION(p, sizeof(*p));
+#endif
+    ABSL_ANNOTATE_MEMORY_IS_UNINITIALIZED(p, sizeof(*p));
+    return p;
+  }
 
-  AllocatorStats stats_ ABSL_GUARDED_BY(pageheap_lock);
+  Shard shards_[kShards];
+  PageHeapAllocator<T> backing_ ABSL_GUARDED_BY(pageheap_lock);
 };
 
 }  // namespace tcmalloc_internal
@@ -0,0 +1,218 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/page_heap_allocator.h"
+
+#include <stdint.h>
+
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/base/internal/spinlock.h"
+#include "tcmalloc/arena.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/page_size.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+struct Object {
+  uint64_t payload[6];
+};
+
+using Allocator = CpuCachedPageHeapAllocator<Object>;
+using SlabAllocator = PageHeapAllocator<Object>;
+
+constexpr size_t kObjectsPerSlab = SlabAllocator::SlabBytes() / sizeof(Object);
+
+// Wraps a PageHeapAllocator, taking pageheap_lock for each call so that
+// nothing else (the test itself included) allocates while it is held.
+class PageHeapAllocatorTest : public testing::Test {
+ protected:
+  PageHeapAllocatorTest() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator_.Init(&arena_);
+  }
+
+  Object* New() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return allocator_.New();
+  }
+
+  void Delete(Object* p) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator_.Delete(p);
+  }
+
+  size_t ReleaseFreeSlabs(size_t max_slabs) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return allocator_.ReleaseFreeSlabs(max_slabs);
+  }
+
+  AllocatorStats stats() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return allocator_.stats();
+  }
+
+  ArenaStats arena_stats() {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    return arena_.stats();
+  }
+
+  Arena arena_;
+  SlabAllocator allocator_;
+};
+
+TEST_F(PageHeapAllocatorTest, ObjectsFromTheSameSlab) {
+  Object* a = New();
+  Object* b = New();
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(a) / SlabAllocator::SlabBytes(),
+            reinterpret_cast<uintptr_t>(b) / SlabAllocator::SlabBytes());
+  // A freed object is the next one reused.
+  Delete(a);
+  EXPECT_EQ(New(), a);
+  Delete(a);
+  Delete(b);
+  EXPECT_EQ(stats().in_use, 0);
+}
+
+TEST_F(PageHeapAllocatorTest, ReleaseFreeSlabs) {
+  // Fill several slabs, then free all but one object.
+  std::vector<Object*> objects;
+  for (int i = 0; i < 8 * kObjectsPerSlab; ++i) {
+    Object* p = New();
+    p->payload[0] = i;
+    objects.push_back(p);
+  }
+  const AllocatorStats peak = stats();
+  for (int i = 1; i < objects.size(); ++i) Delete(objects[i]);
+  const size_t allocated = arena_stats().bytes_allocated;
+
+  // All but one of the free slabs are released, and nothing else: the slab
+  // of the remaining object is untouched.
+  const size_t released = ReleaseFreeSlabs(100);
+  EXPECT_GE(released, 6 * (SlabAllocator::SlabBytes() - GetPageSize()));
+  EXPECT_LE(released, 7 * SlabAllocator::SlabBytes());
+  EXPECT_EQ(ReleaseFreeSlabs(100), 0);
+  EXPECT_EQ(arena_stats().bytes_nonresident, released);
+  EXPECT_EQ(arena_stats().bytes_allocated, allocated - released);
+  EXPECT_LT(stats().total, peak.total);
+  EXPECT_EQ(stats().in_use, 1);
+  EXPECT_EQ(objects[0]->payload[0], 0);
+
+  // Released slabs are reused, rather than allocating more from the arena.
+  objects.resize(1);
+  for (int i = 1; i < 8 * kObjectsPerSlab; ++i) {
+    objects.push_back(New());
+  }
+  EXPECT_EQ(arena_stats().bytes_nonresident, 0);
+  EXPECT_EQ(arena_stats().bytes_allocated, allocated);
+  EXPECT_EQ(stats().total, peak.total);
+  for (Object* p : objects) Delete(p);
+}
+
+TEST_F(PageHeapAllocatorTest, ReleaseBoundedBySlabs) {
+  std::vector<Object*> objects;
+  for (int i = 0; i < 4 * kObjectsPerSlab; ++i) {
+    objects.push_back(New());
+  }
+  for (Object* p : objects) Delete(p);
+  EXPECT_GT(ReleaseFreeSlabs(1), 0);
+  EXPECT_GT(ReleaseFreeSlabs(1), 0);
+  EXPECT_GT(ReleaseFreeSlabs(100), 0);
+  // The one empty slab retained is reused, and is not released while it has
+  // an object in use.
+  Object* p = New();
+  EXPECT_EQ(ReleaseFreeSlabs(100), 0);
+  Delete(p);
+}
+
+AllocatorStats Stats(const Allocator& allocator) {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  return allocator.stats();
+}
+
+TEST(CpuCachedPageHeapAllocatorTest, UnlockedObjectsAreCached) {
+  Arena arena;
+  static Allocator allocator;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator.Init(&arena);
+  }
+  const AllocatorStats before = Stats(allocator);
+
+  std::vector<Object*> objects;
+  for (int i = 0; i < 3 * Allocator::kCapacity; ++i) {
+    objects.push_back(allocator.NewUnlocked());
+  }
+  EXPECT_EQ(Stats(allocator).in_use, before.in_use + objects.size());
+  for (Object* p : objects) allocator.DeleteUnlocked(p);
+
+  // Deletions beyond a shard's capacity go back to the backing allocator,
+  // and what stays in the shards is not reported as in use.
+  EXPECT_EQ(Stats(allocator).in_use, before.in_use);
+  EXPECT_LE(allocator.cached(), Allocator::kShards * Allocator::kCapacity);
+  EXPECT_GT(allocator.cached(), 0);
+
+  // Locked and unlocked objects come from the same pool.
+  Object* p;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    p = allocator.New();
+  }
+  EXPECT_EQ(Stats(allocator).in_use, before.in_use + 1);
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator.Delete(p);
+  }
+  EXPECT_EQ(Stats(allocator).in_use, before.in_use);
+}
+
+TEST(CpuCachedPageHeapAllocatorTest, Threads) {
+  Arena arena;
+  static Allocator allocator;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    allocator.Init(&arena);
+  }
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([]() {
+      std::vector<Object*> objects;
+      for (int i = 0; i < 10000; ++i) {
+        if (objects.size() < 100 && (i % 3) != 0) {
+          Object* p = allocator.NewUnlocked();
+          p->payload[0] = reinterpret_cast<uintptr_t>(p);
+          objects.push_back(p);
+        } else if (!objects.empty()) {
+          Object* p = objects.back();
+          objects.pop_back();
+          ASSERT_EQ(p->payload[0], reinterpret_cast<uintptr_t>(p));
+          allocator.DeleteUnlocked(p);
+        }
+      }
+      for (Object* p : objects) allocator.DeleteUnlocked(p);
+    });
+  }
+  for (auto& t : threads) t.join();
+
+  EXPECT_EQ(Stats(allocator).in_use, 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,100 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "absl/base/internal/spinlock.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/page_heap.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Churns state.range(0) live spans: each iteration deletes a random span and
+// allocates another.  state.range(1) is the percentage of spans that are at
+// least kMaxPages long, which are best fit from the large lists rather than
+// taken from the exact-length ones.  The spans freed are fragmented, so there
+// are many free lists to search.
+void BM_NewDelete(benchmark::State& state) {
+  const size_t num_live = state.range(0);
+  const double large_fraction = state.range(1) / 100.;
+  tc_globals.InitIfNecessary();
+  // Share one heap between runs, so that later runs reuse the memory earlier
+  // ones grew the heap by.
+  static PageMap* pagemap = new PageMap;
+  static PageHeap* heap = new PageHeap(pagemap, MemoryTag::kNormal);
+
+  absl::BitGen rng;
+  constexpr SpanAllocInfo kSpanAllocInfo = {1,
+                                            AccessDensityPrediction::kDense};
+  auto New = [&]() {
+    const Length n =
+        absl::Bernoulli(rng, large_fraction)
+            ? Length(absl::Uniform<size_t>(rng, kMaxPages.raw_num(),
+                                           4 * kMaxPages.raw_num()))
+            : Length(absl::Uniform<size_t>(rng, 1, kMaxPages.raw_num()));
+    Span* span = heap->New(n, kSpanAllocInfo);
+    CHECK_CONDITION(span != nullptr);
+    return span;
+  };
+  auto Delete = [&](Span* span) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    heap->Delete(span, kSpanAllocInfo.objects_per_span);
+  };
+
+  std::vector<Span*> live;
+  live.reserve(2 * num_live);
+  for (size_t i = 0; i < 2 * num_live; ++i) {
+    live.push_back(New());
+  }
+  // Free half of them.
+  while (live.size() > num_live) {
+    const size_t i = absl::Uniform<size_t>(rng, 0, live.size());
+    Delete(live[i]);
+    live[i] = live.back();
+    live.pop_back();
+  }
+
+  for (auto s : state) {
+    const size_t i = absl::Uniform<size_t>(rng, 0, live.size());
+    Delete(live[i]);
+    live[i] = New();
+  }
+
+  for (Span* span : live) {
+    Delete(span);
+  }
+}
+
+BENCHMARK(BM_NewDelete)
+    ->ArgsProduct({{64, 512, 2048}, {0, 10, 50}})
+    ->ArgNames({"live", "large_pct"});
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
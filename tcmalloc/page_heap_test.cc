@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <new>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "absl/base/internal/spinlock.h"
@@ -108,6 +109,87 @@ TEST_F(PageHeapTest, Stats) {
   free(memory);
 }
 
+// Spans at least kMaxPages long are kept in lists bucketed by size.  Best fit
+// must still pick the shortest span that fits, whichever bucket it is in,
+// and pass over the spans in the request's own bucket that are too short.
+TEST_F(PageHeapTest, LargeBestFit) {
+  auto pagemap = std::make_unique<PageMap>();
+  void* memory = calloc(1, sizeof(PageHeap));
+  PageHeap* ph = new (memory) PageHeap(pagemap.get(), MemoryTag::kNormal);
+  constexpr SpanAllocInfo kSpanAllocInfo = {1, AccessDensityPrediction::kDense};
+
+  // Free spans of these lengths, kept apart by allocated single pages.
+  const Length lengths[] = {kMaxPages * 3, kMaxPages + Length(2),
+                            kMaxPages + Length(8), kMaxPages * 2 - Length(1)};
+  Length total;
+  for (Length n : lengths) total += n + Length(1);
+  // Carve them all out of one span, with the rest of the heap in use, so
+  // that no other free span can be picked.
+  Span* all = ph->New(total, kSpanAllocInfo);
+  Length rest;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    rest = BytesToLengthFloor(ph->stats().free_bytes +
+                              ph->stats().unmapped_bytes);
+  }
+  Span* filler = rest > Length(0) ? ph->New(rest, kSpanAllocInfo) : nullptr;
+  Delete(ph, all, kSpanAllocInfo.objects_per_span);
+
+  struct Range {
+    PageId first;
+    Length n;
+  };
+  std::vector<Range> ranges;
+  std::vector<Span*> spans, separators;
+  for (Length n : lengths) {
+    spans.push_back(ph->New(n, kSpanAllocInfo));
+    separators.push_back(ph->New(Length(1), kSpanAllocInfo));
+    ranges.push_back({spans.back()->first_page(), n});
+  }
+  for (Span* s : spans) {
+    Delete(ph, s, kSpanAllocInfo.objects_per_span);
+  }
+  auto Contains = [](const Range& r, const Span* s) {
+    return r.first <= s->first_page() && s->last_page() < r.first + r.n;
+  };
+
+  // kMaxPages + 2 is too short; kMaxPages + 8 is the best fit.
+  Span* s1 = ph->New(kMaxPages + Length(4), kSpanAllocInfo);
+  EXPECT_TRUE(Contains(ranges[2], s1));
+  // Only spans in larger buckets fit now.
+  Span* s2 = ph->New(kMaxPages + Length(16), kSpanAllocInfo);
+  EXPECT_TRUE(Contains(ranges[3], s2));
+  // The leftovers of carving a large span are found again.
+  Span* s3 = ph->New(kMaxPages * 2, kSpanAllocInfo);
+  EXPECT_TRUE(Contains(ranges[0], s3));
+  Span* s4 = ph->New(kMaxPages - Length(1), kSpanAllocInfo);
+  EXPECT_TRUE(Contains(ranges[0], s4));
+
+  for (Span* s : {s1, s2, s3, s4, filler}) {
+    if (s == nullptr) continue;
+    Delete(ph, s, kSpanAllocInfo.objects_per_span);
+  }
+  for (Span* s : separators) {
+    Delete(ph, s, kSpanAllocInfo.objects_per_span);
+  }
+
+  // Everything coalesces back, and can be released.
+  BackingStats stats;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    stats = ph->stats();
+  }
+  EXPECT_EQ(stats.free_bytes + stats.unmapped_bytes, stats.system_bytes);
+  Release(ph, Length::max());
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    stats = ph->stats();
+  }
+  EXPECT_EQ(stats.free_bytes, 0);
+
+  free(memory);
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -72,8 +72,12 @@ void PageMap::MapRootWithSmallPages() {
   }
 }
 
-void* MetaDataAlloc(size_t bytes) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
-  return tc_globals.arena().Alloc(bytes);
+// Leaves are placed on the NUMA partition of the pages they map, which is
+// where the CPUs looking them up run.
+void* MetaDataAlloc(size_t bytes, uintptr_t key)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  return tc_globals.arena().AllocOnPartition(
+      NumaPartitionFromPointer(PageId(key).start_addr()), bytes);
 }
 
 }  // namespace tcmalloc_internal
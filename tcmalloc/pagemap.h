@@ -38,6 +38,7 @@
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/prefetch.h"
 #include "tcmalloc/malloc_tracing_extension.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/span.h"
@@ -47,9 +48,11 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+// Allocates <bytes> of a node of the radix tree whose first key is <key>.
+typedef void* (*PagemapAllocator)(size_t bytes, uintptr_t key);
+void* MetaDataAlloc(size_t bytes, uintptr_t key);
+
 // Two-level radix tree
-typedef void* (*PagemapAllocator)(size_t);
-void* MetaDataAlloc(size_t bytes);
 
 template <int BITS, PagemapAllocator Allocator>
 class PageMap2 {
@@ -74,7 +77,9 @@ class PageMap2 {
     // size class; another span pointers; the last hugepage-related
     // information.  The size class information is kept segregated
     // since small object deallocations are so frequent and do not
-    // need the other information kept in a Span.
+    // need the other information kept in a Span.  With one-byte size
+    // classes, a 64-byte cacheline of it covers 64 pages of heap, so unsized
+    // frees touch only this array and the (sparse, hot) root.
     CompactSizeClass sizeclass[kLeafLength];
     Span* span[kLeafLength];
     void* hugepage[kLeafHugepages];
@@ -133,6 +138,17 @@ class PageMap2 {
     return root_[i1]->sizeclass[i2];
   }
 
+  // Starts loading the size class of page k, for a subsequent sizeclass(k).
+  // REQUIRES: Must be a valid page number previously Ensure()d.
+  void ABSL_ATTRIBUTE_ALWAYS_INLINE
+  PrefetchSizeClass(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> kLeafBits;
+    const Number i2 = k & (kLeafLength - 1);
+    ASSERT((k >> BITS) == 0);
+    ASSERT(root_[i1] != nullptr);
+    PrefetchT0(&root_[i1]->sizeclass[i2]);
+  }
+
   void set(Number k, Span* s) {
     ASSERT(k >> BITS == 0);
     const Number i1 = k >> kLeafBits;
@@ -182,7 +198,8 @@ class PageMap2 {
 
       // Make 2nd level node if necessary
       if (root_[i1] == nullptr) {
-        Leaf* leaf = reinterpret_cast<Leaf*>(Allocator(sizeof(Leaf)));
+        Leaf* leaf = reinterpret_cast<Leaf*>(
+            Allocator(sizeof(Leaf), i1 << kLeafBits));
         if (leaf == nullptr) return false;
         bytes_used_ += sizeof(Leaf);
         memset(leaf, 0, sizeof(*leaf));
@@ -235,7 +252,9 @@ class PageMap3 {
     // size class; another span pointers; the last hugepage-related
     // information.  The size class information is kept segregated
     // since small object deallocations are so frequent and do not
-    // need the other information kept in a Span.
+    // need the other information kept in a Span.  With one-byte size
+    // classes, a 64-byte cacheline of it covers 64 pages of heap, so unsized
+    // frees touch only this array and the (sparse, hot) root.
     CompactSizeClass sizeclass[kLeafLength];
     Span* span[kLeafLength];
     void* hugepage[kLeafHugepages];
@@ -310,6 +329,19 @@ class PageMap3 {
     return root_[i1]->leafs[i2]->sizeclass[i3];
   }
 
+  // Starts loading the size class of page k, for a subsequent sizeclass(k).
+  // REQUIRES: Must be a valid page number previously Ensure()d.
+  void ABSL_ATTRIBUTE_ALWAYS_INLINE
+  PrefetchSizeClass(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> (kLeafBits + kMidBits);
+    const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
+    const Number i3 = k & (kLeafLength - 1);
+    ASSERT((k >> BITS) == 0);
+    ASSERT(root_[i1] != nullptr);
+    ASSERT(root_[i1]->leafs[i2] != nullptr);
+    PrefetchT0(&root_[i1]->leafs[i2]->sizeclass[i3]);
+  }
+
   void set(Number k, Span* s) {
     ASSERT(k >> BITS == 0);
     const Number i1 = k >> (kLeafBits + kMidBits);
@@ -366,7 +398,8 @@ class PageMap3 {
 
       // Allocate Node if necessary
       if (root_[i1] == nullptr) {
-        Node* node = reinterpret_cast<Node*>(Allocator(sizeof(Node)));
+        Node* node = reinterpret_cast<Node*>(
+            Allocator(sizeof(Node), i1 << (kLeafBits + kMidBits)));
         if (node == nullptr) return false;
         bytes_used_ += sizeof(Node);
         memset(node, 0, sizeof(*node));
@@ -375,7 +408,8 @@ class PageMap3 {
 
       // Allocate Leaf if necessary
       if (root_[i1]->leafs[i2] == nullptr) {
-        Leaf* leaf = reinterpret_cast<Leaf*>(Allocator(sizeof(Leaf)));
+        Leaf* leaf = reinterpret_cast<Leaf*>(
+            Allocator(sizeof(Leaf), key >> kLeafBits << kLeafBits));
         if (leaf == nullptr) return false;
         bytes_used_ += sizeof(Leaf);
         memset(leaf, 0, sizeof(*leaf));
@@ -408,6 +442,10 @@ class PageMap {
     return map_.sizeclass(p.index());
   }
 
+  // Starts loading the size class of p, so that several lookups' cache misses
+  // can overlap.
+  void PrefetchSizeClass(PageId p) const { map_.PrefetchSizeClass(p.index()); }
+
   void Set(PageId p, Span* span) { map_.set(p.index(), span); }
 
   bool Ensure(PageId p, Length n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
@@ -467,19 +505,7 @@ class PageMap {
                       SpanDetails>& allocated_spans) {
     AllocationGuardSpinLockHolder h(&pageheap_lock);
     int allocated_span_count = 0;
-    for (std::optional<uintptr_t> i = 0; i.has_value();
-         i = map_.get_next_set_page(i.value())) {
-      PageId page_id = PageId{i.value()};
-      Span* s = GetDescriptor(page_id);
-      if (s == nullptr) {
-        // The value returned by get_next_set_page should belong to a Span.
-        ASSERT(i == 0);
-        continue;
-      }
-      // Free'd up Span that's not yet removed from PageMap.
-      if (page_id < s->first_page() || s->last_page() < page_id) continue;
-      CompactSizeClass size_class = sizeclass(page_id);
-      ASSERT(s->first_page().index() == i);
+    ForEachSpan(PageId{0}, [&](Span* s, CompactSizeClass size_class) {
       // As documented, GetAllocatedSpans wants to avoid allocating more memory
       // for the output vector while holding the pageheap_lock. So, we stop
       // adding more entries after we reach its existing capacity. Note that the
@@ -490,9 +516,34 @@ class PageMap {
              Static::sizemap().class_to_size(size_class)});
       }
       ++allocated_span_count;
+      return true;
+    });
+    return allocated_span_count;
+  }
+
+  // Calls f(span, size_class) for each allocated span starting at or after
+  // <start>, in address order, until f returns false.  Returns the page after
+  // the span for which f returned false, to resume from, or std::nullopt if f
+  // was called for every span.
+  template <typename F>
+  std::optional<PageId> ForEachSpan(PageId start, F f)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    for (std::optional<uintptr_t> i = start.index(); i.has_value();
+         i = map_.get_next_set_page(i.value())) {
+      PageId page_id = PageId{i.value()};
+      Span* s = GetDescriptor(page_id);
+      if (s == nullptr) {
+        // The value returned by get_next_set_page should belong to a Span.
+        ASSERT(i == start.index());
+        continue;
+      }
+      // Free'd up Span that's not yet removed from PageMap, or one that
+      // <start> falls inside, allocated since the caller's last call.
+      if (s->first_page() != page_id) continue;
+      if (!f(s, sizeclass(page_id))) return s->last_page() + Length(1);
       i = s->last_page().index();
     }
-    return allocated_span_count;
+    return std::nullopt;
   }
 
  private:
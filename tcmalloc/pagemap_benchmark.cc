@@ -0,0 +1,188 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <chrono>  // NOLINT(build/c++11)
+#include <new>
+#include <vector>
+
+#include "absl/random/random.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/pagemap.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// The populated heap is made of chunks of this many pages, each covered by a
+// leaf of its own and scattered across the address space, so that lookups
+// walk the upper levels of the map as they would for a fragmented heap.
+constexpr uintptr_t kChunkPages = uintptr_t{1} << 15;
+constexpr size_t kMaxHeapMiB = 16 << 10;
+constexpr size_t kMaxChunks = (size_t{kMaxHeapMiB} << 20) /
+                              (kChunkPages << kPageShift);
+
+// Lookups are made in batches, timed together.
+constexpr size_t kBatch = 4096;
+
+void* Alloc(size_t n, uintptr_t) {
+  void* ptr = mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK_CONDITION(ptr != MAP_FAILED);
+  return ptr;
+}
+
+// A map of <kBits>-bit addresses, populated with kMaxChunks chunks of pages.
+template <typename Map, int kBits>
+class PopulatedMap {
+ public:
+  static PopulatedMap& Get() {
+    static PopulatedMap* map = new PopulatedMap();
+    return *map;
+  }
+
+  Map& map() { return *map_; }
+
+  // Returns the first page of the i-th chunk.
+  uintptr_t chunk(size_t i) const { return chunks_[i]; }
+
+ private:
+  PopulatedMap() : map_(new (Alloc(sizeof(Map))) Map()) {
+    constexpr uintptr_t kChunkSlots =
+        (uintptr_t{1} << (kBits - kPageShift)) / kChunkPages;
+    absl::InsecureBitGen rng;
+    while (chunks_.size() < kMaxChunks) {
+      const uintptr_t first =
+          absl::Uniform<uintptr_t>(rng, 0, kChunkSlots) * kChunkPages;
+      if (std::find(chunks_.begin(), chunks_.end(), first) != chunks_.end()) {
+        continue;
+      }
+      chunks_.push_back(first);
+      CHECK_CONDITION(map_->Ensure(first, kChunkPages));
+      for (uintptr_t page = first; page < first + kChunkPages; ++page) {
+        map_->set_with_sizeclass(page, reinterpret_cast<Span*>(page),
+                                 page % kNumClasses);
+      }
+    }
+  }
+
+  Map* map_;
+  std::vector<uintptr_t> chunks_;
+};
+
+enum Pattern {
+  // Consecutive pages, as when freeing a run of objects allocated together.
+  kSequential,
+  // Random pages of the heap; warm whenever the map of the heap fits in
+  // cache.
+  kRandom,
+  // Random pages of the heap, with caches flushed before each batch.
+  kRandomCold,
+};
+
+// Evicts the map from the caches by writing over a buffer larger than the
+// last level cache.
+void FlushCaches() {
+  static constexpr size_t kFlushBytes = 128 << 20;
+  static char* buffer = static_cast<char*>(Alloc(kFlushBytes));
+  static char value = 0;
+  memset(buffer, ++value, kFlushBytes);
+  benchmark::ClobberMemory();
+}
+
+// Returns the pages looked up by each iteration.
+template <typename Map, int kBits>
+std::vector<uintptr_t> Pages(PopulatedMap<Map, kBits>& map, size_t heap_mib,
+                             Pattern pattern) {
+  const size_t chunks = std::max<size_t>(
+      1, kMaxChunks * heap_mib / kMaxHeapMiB);
+  const size_t heap_pages = chunks * kChunkPages;
+  absl::InsecureBitGen rng;
+  std::vector<uintptr_t> pages(kBatch);
+  size_t index = absl::Uniform<size_t>(rng, 0, heap_pages);
+  for (uintptr_t& page : pages) {
+    if (pattern == kSequential) {
+      index = (index + 1) % heap_pages;
+    } else {
+      index = absl::Uniform<size_t>(rng, 0, heap_pages);
+    }
+    page = map.chunk(index / kChunkPages) + index % kChunkPages;
+  }
+  return pages;
+}
+
+// Looks up the size class, as sized and unsized frees of small objects do, or
+// the span, as frees of large objects do, of kBatch pages per iteration.
+//
+// Arguments: the heap size in MiB, the Pattern and whether to look up spans
+// rather than size classes.
+template <typename Map, int kBits>
+void BM_Lookup(benchmark::State& state) {
+  auto& map = PopulatedMap<Map, kBits>::Get();
+  const size_t heap_mib = state.range(0);
+  const Pattern pattern = static_cast<Pattern>(state.range(1));
+  const bool spans = state.range(2) != 0;
+  const std::vector<uintptr_t> pages = Pages(map, heap_mib, pattern);
+
+  for (auto s : state) {
+    if (pattern == kRandomCold) FlushCaches();
+    const auto start = std::chrono::steady_clock::now();
+    if (spans) {
+      for (uintptr_t page : pages) {
+        benchmark::DoNotOptimize(map.map().get(page));
+      }
+    } else {
+      for (uintptr_t page : pages) {
+        benchmark::DoNotOptimize(map.map().sizeclass(page));
+      }
+    }
+    const auto end = std::chrono::steady_clock::now();
+    state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+  state.counters["map_MiB"] = map.map().bytes_used() / 1048576.;
+}
+
+void LookupArgs(benchmark::internal::Benchmark* b) {
+  b->ArgNames({"heap_MiB", "pattern", "spans"});
+  for (int64_t heap_mib : {int64_t{256}, int64_t{4 << 10}, int64_t{16 << 10}}) {
+    for (int pattern : {kSequential, kRandom, kRandomCold}) {
+      for (int spans : {0, 1}) {
+        b->Args({heap_mib, pattern, spans});
+      }
+    }
+  }
+  b->UseManualTime();
+}
+
+// PageMap2 covers 48-bit address spaces.  With 57 bits its root alone would
+// take gigabytes, so larger address spaces need PageMap3.
+BENCHMARK_TEMPLATE(BM_Lookup, PageMap2<48 - kPageShift, Alloc>, 48)
+    ->Apply(LookupArgs);
+BENCHMARK_TEMPLATE(BM_Lookup, PageMap3<48 - kPageShift, Alloc>, 48)
+    ->Apply(LookupArgs);
+BENCHMARK_TEMPLATE(BM_Lookup, PageMap3<57 - kPageShift, Alloc>, 57)
+    ->Apply(LookupArgs);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
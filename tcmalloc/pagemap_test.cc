@@ -64,7 +64,7 @@ class PageMapTest : public ::testing::TestWithParam<int> {
     return ret;
   }
 
-  static void* alloc(size_t n) {
+  static void* alloc(size_t n, uintptr_t) {
     void* ptr = ::operator new(n);
     ptrs()->push_back(ptr);
     return ptr;
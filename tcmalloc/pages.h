@@ -27,6 +27,7 @@
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/memory_tagging.h"
 #include "tcmalloc/internal/optimization.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -224,9 +225,10 @@ inline constexpr Length operator-(PageId lhs, PageId rhs) {
   return Length(lhs.pn_ - rhs.pn_);
 }
 
+// Ignores the tags of pointers returned by MteSampledAllocator.
 TCMALLOC_ATTRIBUTE_CONST
 inline PageId PageIdContaining(const void* p) {
-  return PageId(reinterpret_cast<uintptr_t>(p) >> kPageShift);
+  return PageId(UntagAddress(reinterpret_cast<uintptr_t>(p)) >> kPageShift);
 }
 
 TCMALLOC_ATTRIBUTE_CONST
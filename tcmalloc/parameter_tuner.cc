@@ -0,0 +1,225 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/parameter_tuner.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "absl/base/macros.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+double GetBackgroundReleaseRate() {
+  return static_cast<double>(Parameters::background_release_rate());
+}
+
+void SetBackgroundReleaseRate(double v) {
+  Parameters::set_background_release_rate(
+      static_cast<MallocExtension::BytesPerSecond>(v));
+}
+
+double GetSkipSubreleaseInterval() {
+  return absl::ToDoubleSeconds(Parameters::filler_skip_subrelease_interval());
+}
+
+void SetSkipSubreleaseInterval(double v) {
+  Parameters::set_filler_skip_subrelease_interval(absl::Seconds(v));
+}
+
+double GetSkipSubreleaseShortInterval() {
+  return absl::ToDoubleSeconds(
+      Parameters::filler_skip_subrelease_short_interval());
+}
+
+void SetSkipSubreleaseShortInterval(double v) {
+  Parameters::set_filler_skip_subrelease_short_interval(absl::Seconds(v));
+}
+
+double GetSkipSubreleaseLongInterval() {
+  return absl::ToDoubleSeconds(
+      Parameters::filler_skip_subrelease_long_interval());
+}
+
+void SetSkipSubreleaseLongInterval(double v) {
+  Parameters::set_filler_skip_subrelease_long_interval(absl::Seconds(v));
+}
+
+double GetMaxPerCpuCacheSize() { return Parameters::max_per_cpu_cache_size(); }
+
+void SetMaxPerCpuCacheSize(double v) {
+  Parameters::set_max_per_cpu_cache_size(static_cast<int32_t>(v));
+}
+
+double GetDynamicSlabGrowThreshold() {
+  return Parameters::per_cpu_caches_dynamic_slab_grow_threshold();
+}
+
+void SetDynamicSlabGrowThreshold(double v) {
+  Parameters::set_per_cpu_caches_dynamic_slab_grow_threshold(v);
+}
+
+double GetDynamicSlabShrinkThreshold() {
+  return Parameters::per_cpu_caches_dynamic_slab_shrink_threshold();
+}
+
+void SetDynamicSlabShrinkThreshold(double v) {
+  Parameters::set_per_cpu_caches_dynamic_slab_shrink_threshold(v);
+}
+
+// The bounds keep each parameter within the range it is run with in practice.
+constexpr TunableParameter kTunableParameters[] = {
+    {"background_release_rate", GetBackgroundReleaseRate,
+     SetBackgroundReleaseRate, 1 << 20, 1 << 30, 2},
+    {"filler_skip_subrelease_interval_s", GetSkipSubreleaseInterval,
+     SetSkipSubreleaseInterval, 1, 600, 2},
+    {"filler_skip_subrelease_short_interval_s", GetSkipSubreleaseShortInterval,
+     SetSkipSubreleaseShortInterval, 1, 600, 2},
+    {"filler_skip_subrelease_long_interval_s", GetSkipSubreleaseLongInterval,
+     SetSkipSubreleaseLongInterval, 1, 3600, 2},
+    {"max_per_cpu_cache_size", GetMaxPerCpuCacheSize, SetMaxPerCpuCacheSize,
+     64 << 10, 64 << 20, 2},
+    {"per_cpu_caches_dynamic_slab_grow_threshold",
+     GetDynamicSlabGrowThreshold, SetDynamicSlabGrowThreshold, 0.5, 1, 1.1},
+    {"per_cpu_caches_dynamic_slab_shrink_threshold",
+     GetDynamicSlabShrinkThreshold, SetDynamicSlabShrinkThreshold, 0.1, 0.8,
+     1.25},
+};
+
+static_assert(ABSL_ARRAYSIZE(kTunableParameters) <=
+              ParameterTuner::kMaxParameters);
+
+// <value> relative to <baseline>, or 1 without a baseline to compare to.
+double Relative(double value, double baseline) {
+  return baseline > 0 ? value / baseline : 1;
+}
+
+}  // namespace
+
+ABSL_CONST_INIT ParameterTuner parameter_tuner(kTunableParameters);
+
+void ParameterTuner::StartPeriod(absl::Time now, double cpu_ticks) {
+  measuring_ = true;
+  period_start_ = now;
+  period_start_cpu_ = cpu_ticks;
+  memory_sum_ = 0;
+  memory_samples_ = 0;
+}
+
+bool ParameterTuner::StartTrial() {
+  const int n = static_cast<int>(parameters_.size());
+  for (int i = 0; i < n; ++i) {
+    const int index = next_;
+    next_ = (next_ + 1) % n;
+    const TunableParameter& p = parameters_[index];
+    const double value = p.get();
+    if (value < p.min || value > p.max) continue;
+
+    const int first = direction_[index] < 0 ? -1 : 1;
+    for (const int direction : {first, -first}) {
+      const double next = std::clamp(
+          direction > 0 ? value * p.step : value / p.step, p.min, p.max);
+      if (next == value) continue;
+      p.set(next);
+      trial_ = index;
+      trial_old_value_ = value;
+      trial_value_ = p.get();
+      direction_[index] = direction;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ParameterTuner::EndTrial(bool keep) {
+  ASSERT(trial_ >= 0);
+  const TunableParameter& p = parameters_[trial_];
+  trials_.fetch_add(1, std::memory_order_relaxed);
+  if (keep) {
+    kept_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    // A value set by other means since the trial began is left alone.
+    if (p.get() == trial_value_) {
+      p.set(trial_old_value_);
+    }
+    direction_[trial_] = -direction_[trial_];
+  }
+  trial_ = -1;
+}
+
+void ParameterTuner::Update(absl::Time now, double cpu_ticks, double memory,
+                            double memory_weight) {
+  if (!measuring_) {
+    StartPeriod(now, cpu_ticks);
+  }
+  memory_sum_ += memory;
+  ++memory_samples_;
+  if (now - period_start_ < kPeriod) return;
+
+  const double seconds = absl::ToDoubleSeconds(now - period_start_);
+  const double cpu = (cpu_ticks - period_start_cpu_) / seconds;
+  const double average_memory = memory_sum_ / memory_samples_;
+  const double w = std::clamp(memory_weight, 0.0, 1.0);
+
+  bool have_baseline = true;
+  if (trial_ >= 0) {
+    const double cost = (1 - w) * Relative(cpu, baseline_cpu_) +
+                        w * Relative(average_memory, baseline_memory_);
+    const bool keep = cost < 1 - kMinGain;
+    EndTrial(keep);
+    // Once reverted, the old baseline no longer describes the workload as
+    // well as a fresh one would.
+    have_baseline = keep;
+  }
+  if (have_baseline) {
+    baseline_cpu_ = cpu;
+    baseline_memory_ = average_memory;
+    StartTrial();
+  }
+  StartPeriod(now, cpu_ticks);
+}
+
+void ParameterTuner::Stop() {
+  if (trial_ >= 0) {
+    EndTrial(/*keep=*/false);
+  }
+  measuring_ = false;
+}
+
+void ParameterTuner::Print(Printer* out) const {
+  out->printf("------------------------------------------------\n");
+  out->printf("Self-tuning: %lld parameter changes tried, %lld kept\n",
+              trials(), kept());
+}
+
+void ParameterTuner::PrintInPbtxt(PbtxtRegion* region) const {
+  auto tuner = region->CreateSubRegion("self_tuning");
+  tuner.PrintI64("trials", trials());
+  tuner.PrintI64("kept", kept());
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,128 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_PARAMETER_TUNER_H_
+#define TCMALLOC_PARAMETER_TUNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// A parameter that ParameterTuner may adjust.
+struct TunableParameter {
+  const char* name;
+  double (*get)();
+  void (*set)(double);
+  // The tuner keeps the parameter within [min, max], and leaves it alone
+  // while it is set outside of them (for example, disabled with zero).
+  double min;
+  double max;
+  // Each trial multiplies or divides the parameter by step.
+  double step;
+};
+
+// Tunes allocator parameters online, to the workload at hand.  The background
+// thread calls Update() about once a second while Parameters::self_tuning() is
+// set.
+//
+// The tuner alternates between measuring a baseline and a trial, each over
+// kPeriod.  For a trial, it moves one parameter by its step, in the direction
+// that last helped, and keeps the new value if the objective improved on the
+// baseline by more than kMinGain.  Otherwise it restores the old value and
+// tries the other direction next time.  Parameters are tried in turn.
+//
+// The objective weighs the CPU time spent in the allocator (see CpuTimeStats)
+// against the memory in use, each relative to the baseline:
+//
+//   (1 - memory_weight) * cpu / baseline cpu + memory_weight * memory /
+//   baseline memory
+//
+// so that neither needs units.
+class ParameterTuner {
+ public:
+  static constexpr absl::Duration kPeriod = absl::Seconds(30);
+  static constexpr double kMinGain = 0.02;
+  static constexpr int kMaxParameters = 8;
+
+  constexpr explicit ParameterTuner(
+      absl::Span<const TunableParameter> parameters)
+      : parameters_(parameters) {}
+
+  ParameterTuner(const ParameterTuner&) = delete;
+  ParameterTuner& operator=(const ParameterTuner&) = delete;
+
+  // Reports the cumulative <cpu_ticks> spent in the allocator and the
+  // <memory> in use at <now>, concluding the current baseline or trial once it has run
+  // for kPeriod.
+  void Update(absl::Time now, double cpu_ticks, double memory,
+              double memory_weight);
+
+  // Restores the parameter under trial, if any, and starts afresh with a
+  // baseline on the next Update().
+  void Stop();
+
+  int64_t trials() const { return trials_.load(std::memory_order_relaxed); }
+  int64_t kept() const { return kept_.load(std::memory_order_relaxed); }
+
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  void StartPeriod(absl::Time now, double cpu_ticks);
+  // Moves the next parameter that can move.  Returns false if none can.
+  bool StartTrial();
+  void EndTrial(bool keep);
+
+  const absl::Span<const TunableParameter> parameters_;
+
+  bool measuring_ = false;
+  absl::Time period_start_ = absl::InfinitePast();
+  double period_start_cpu_ = 0;
+  double memory_sum_ = 0;
+  int64_t memory_samples_ = 0;
+
+  double baseline_cpu_ = 0;
+  double baseline_memory_ = 0;
+
+  // The parameter under trial and its value before the trial, or -1.
+  int trial_ = -1;
+  double trial_old_value_ = 0;
+  double trial_value_ = 0;
+  // The next parameter to try.
+  int next_ = 0;
+  // The direction each parameter is tried in next, +1 or -1 (0 is +1).
+  int8_t direction_[kMaxParameters] = {};
+
+  std::atomic<int64_t> trials_{0};
+  std::atomic<int64_t> kept_{0};
+};
+
+// Tunes the parameters listed in parameter_tuner.cc.
+extern ParameterTuner parameter_tuner;
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_PARAMETER_TUNER_H_
@@ -0,0 +1,112 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/parameter_tuner.h"
+
+#include <cmath>
+
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+double cache_size;
+double release_interval;
+
+double GetCacheSize() { return cache_size; }
+void SetCacheSize(double v) { cache_size = v; }
+double GetReleaseInterval() { return release_interval; }
+void SetReleaseInterval(double v) { release_interval = v; }
+
+constexpr TunableParameter kParameters[] = {
+    {"cache_size", GetCacheSize, SetCacheSize, 1, 1024, 2},
+    {"release_interval", GetReleaseInterval, SetReleaseInterval, 1, 64, 2},
+};
+
+class ParameterTunerTest : public testing::Test {
+ protected:
+  ParameterTunerTest() {
+    cache_size = 16;
+    release_interval = 8;
+  }
+
+  // Runs the tuner for about <periods> periods against a workload whose slow
+  // paths take cpu() ticks a second and that uses memory().
+  template <typename Cpu, typename Memory>
+  void Run(int periods, Cpu cpu, Memory memory, double memory_weight) {
+    for (int i = 0; i < periods * 30; ++i) {
+      now_ += absl::Seconds(1);
+      cpu_ticks_ += cpu();
+      tuner_.Update(now_, cpu_ticks_, memory(), memory_weight);
+    }
+  }
+
+  ParameterTuner tuner_{kParameters};
+  absl::Time now_ = absl::UnixEpoch();
+  double cpu_ticks_ = 0;
+};
+
+TEST_F(ParameterTunerTest, ConvergesOnCpu) {
+  // Slow paths get cheaper as the cache grows, up to 256.
+  auto cpu = []() {
+    return 1000 + 100 * std::abs(std::log2(cache_size / 256));
+  };
+  auto memory = []() { return 1000.0; };
+  Run(100, cpu, memory, /*memory_weight=*/0);
+  tuner_.Stop();
+  EXPECT_EQ(cache_size, 256);
+  // The release interval made no difference, so it was left where it was.
+  EXPECT_EQ(release_interval, 8);
+  EXPECT_GT(tuner_.trials(), 0);
+  EXPECT_EQ(tuner_.kept(), 4);
+}
+
+TEST_F(ParameterTunerTest, WeighsMemory) {
+  // A larger cache saves a little CPU but costs a lot of memory.
+  auto cpu = []() { return 2000 / std::pow(cache_size, 0.1); };
+  auto memory = []() { return 100 + 100 * cache_size; };
+  Run(100, cpu, memory, /*memory_weight=*/0.5);
+  tuner_.Stop();
+  EXPECT_EQ(cache_size, 1);
+  Run(100, cpu, memory, /*memory_weight=*/0);
+  tuner_.Stop();
+  EXPECT_EQ(cache_size, 1024);
+}
+
+TEST_F(ParameterTunerTest, LeavesDisabledParametersAlone) {
+  cache_size = 0;
+  auto cpu = []() { return 100 + 100 * release_interval; };
+  auto memory = []() { return 1000.0; };
+  Run(100, cpu, memory, /*memory_weight=*/0);
+  tuner_.Stop();
+  EXPECT_EQ(cache_size, 0);
+  EXPECT_EQ(release_interval, 1);
+}
+
+TEST_F(ParameterTunerTest, StopRestores) {
+  auto cpu = []() { return 1000.0; };
+  auto memory = []() { return 1000.0; };
+  // The first period measures a baseline, and the second tries a change.
+  Run(2, cpu, memory, 0);
+  EXPECT_NE(cache_size, 16);
+  tuner_.Stop();
+  EXPECT_EQ(cache_size, 16);
+  EXPECT_EQ(tuner_.kept(), 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -13,6 +13,7 @@
 // limitations under the License.
 #include "tcmalloc/parameters.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
@@ -22,7 +23,9 @@
 #include "absl/base/call_once.h"
 #include "absl/base/const_init.h"
 #include "absl/base/internal/spinlock.h"
+#include "absl/strings/numbers.h"
 #include "absl/time/time.h"
+#include "tcmalloc/background_wakeup.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
 #include "tcmalloc/experiment.h"
@@ -85,6 +88,8 @@ static std::atomic<int64_t>& skip_subrelease_interval_ns() {
   ABSL_CONST_INIT static absl::once_flag flag;
   ABSL_CONST_INIT static std::atomic<int64_t> v{0};
   absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    // Small-footprint mode does not skip subrelease.
+    if (Parameters::small_footprint()) return;
     // clang-format off
     v.store(absl::ToInt64Nanoseconds(
 #if defined(TCMALLOC_INTERNAL_SMALL_BUT_SLOW)
@@ -109,6 +114,8 @@ static std::atomic<int64_t>& skip_subrelease_short_interval_ns() {
   ABSL_CONST_INIT static absl::once_flag flag;
   ABSL_CONST_INIT static std::atomic<int64_t> v{0};
   absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    // Small-footprint mode does not skip subrelease.
+    if (Parameters::small_footprint()) return;
     // clang-format off
     v.store(absl::ToInt64Nanoseconds(
 #if defined(TCMALLOC_INTERNAL_SMALL_BUT_SLOW)
@@ -130,6 +137,8 @@ static std::atomic<int64_t>& skip_subrelease_long_interval_ns() {
   ABSL_CONST_INIT static absl::once_flag flag;
   ABSL_CONST_INIT static std::atomic<int64_t> v{0};
   absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    // Small-footprint mode does not skip subrelease.
+    if (Parameters::small_footprint()) return;
     // clang-format off
     v.store(absl::ToInt64Nanoseconds(
 #if defined(TCMALLOC_INTERNAL_SMALL_BUT_SLOW)
@@ -196,6 +205,7 @@ ABSL_CONST_INIT std::atomic<int64_t> Parameters::max_total_thread_cache_bytes_(
     kDefaultOverallThreadCacheSize);
 ABSL_CONST_INIT std::atomic<double>
     Parameters::peak_sampling_heap_growth_fraction_(1.1);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::prefault_hugepages_(0);
 ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_enabled_(
 #if defined(TCMALLOC_DEPRECATED_PERTHREAD)
     false
@@ -206,15 +216,68 @@ ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_enabled_(
 ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_dynamic_slab_(
     true);
 ABSL_CONST_INIT std::atomic<bool> Parameters::madvise_free_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::adaptive_madvise_free_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::async_release_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::cgroup_pressure_release_(false);
+ABSL_CONST_INIT std::atomic<double> Parameters::cgroup_soft_limit_fraction_(0);
+ABSL_CONST_INIT std::atomic<bool> Parameters::self_tuning_(false);
+ABSL_CONST_INIT std::atomic<double> Parameters::self_tuning_memory_weight_(
+    0.5);
+ABSL_CONST_INIT std::atomic<bool> Parameters::madvise_cold_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::span_cache_coloring_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::l3_span_cache_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::filler_l3_partitions_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::lifetime_aware_span_placement_(
+    false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::release_free_metadata_(false);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::large_span_cache_bytes_(0);
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::central_freelist_empty_span_cache_(false);
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::central_freelist_remote_frees_(false);
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::central_freelist_prepopulate_(false);
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::central_freelist_dynamic_span_pages_(false);
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::auto_sharded_transfer_cache_(false);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::collapse_hugepages_(0);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::scan_hugepage_backing_(0);
+ABSL_CONST_INIT std::atomic<double>
+    Parameters::filler_fragmentation_region_threshold_(0);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::skip_subrelease_predictor_(0);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::scan_free_page_idleness_(0);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::release_resident_unbacked_(0);
+ABSL_CONST_INIT std::atomic<bool> Parameters::frame_pointer_unwinding_(false);
+ABSL_CONST_INIT std::atomic<int64_t>
+    Parameters::alloc_latency_sampling_interval_(0);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::guarded_pool_bytes_(0);
+ABSL_CONST_INIT std::atomic<bool> Parameters::mte_guarded_sampling_(false);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::stats_snapshot_max_age_ms_(0);
 ABSL_CONST_INIT std::atomic<tcmalloc::hot_cold_t>
     Parameters::min_hot_access_hint_(static_cast<tcmalloc::hot_cold_t>(128));
 ABSL_CONST_INIT std::atomic<double>
     Parameters::per_cpu_caches_dynamic_slab_grow_threshold_(0.9);
 ABSL_CONST_INIT std::atomic<double>
     Parameters::per_cpu_caches_dynamic_slab_shrink_threshold_(0.4);
+ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_autotune_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_handoff_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_wipe_on_fork_(
+    false);
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::per_cpu_caches_adaptive_batches_(false);
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::per_cpu_caches_share_smt_capacity_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::numa_background_workers_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::piggyback_background_actions_(
+    false);
 
 ABSL_CONST_INIT std::atomic<int64_t> Parameters::profile_sampling_rate_(
     kDefaultProfileSamplingRate);
+ABSL_CONST_INIT std::atomic<double>
+    Parameters::profile_sampling_target_per_second_(0);
+ABSL_CONST_INIT std::atomic<int64_t>
+    Parameters::profile_sampling_site_boost_(0);
 
 bool Parameters::background_process_actions_enabled() {
   return background_process_actions_enabled_ptr().load(
@@ -291,6 +354,40 @@ size_t Parameters::chunks_per_alloc() {
   return v.load(std::memory_order_relaxed);
 }
 
+uint64_t Parameters::deterministic_seed() {
+  ABSL_CONST_INIT static absl::once_flag flag;
+  ABSL_CONST_INIT static std::atomic<uint64_t> v{0};
+  absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    const char* e = thread_safe_getenv("TCMALLOC_DETERMINISTIC");
+    if (e == nullptr) return;
+    uint64_t seed;
+    if (!absl::SimpleAtoi(e, &seed) || seed == 0) {
+      Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+    }
+    v.store(seed, std::memory_order_relaxed);
+  });
+  return v.load(std::memory_order_relaxed);
+}
+
+bool Parameters::small_footprint() {
+  ABSL_CONST_INIT static absl::once_flag flag;
+  ABSL_CONST_INIT static std::atomic<bool> v{false};
+  absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    const char* e = thread_safe_getenv("TCMALLOC_SMALL_FOOTPRINT");
+    if (e == nullptr) return;
+    switch (e[0]) {
+      case '0':
+        break;
+      case '1':
+        v.store(true, std::memory_order_relaxed);
+        break;
+      default:
+        Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+    }
+  });
+  return v.load(std::memory_order_relaxed);
+}
+
 int32_t Parameters::max_per_cpu_cache_size() {
   return tc_globals.cpu_cache().CacheLimit();
 }
@@ -349,6 +446,22 @@ void MallocExtension_Internal_SetMaxTotalThreadCacheBytes(int64_t value) {
   Parameters::set_max_total_thread_cache_bytes(value);
 }
 
+int64_t MallocExtension_Internal_GetPrefaultHugePages() {
+  return Parameters::prefault_hugepages();
+}
+
+void MallocExtension_Internal_SetPrefaultHugePages(int64_t value) {
+  Parameters::set_prefault_hugepages(value);
+}
+
+int64_t MallocExtension_Internal_GetAllocLatencySamplingInterval() {
+  return Parameters::alloc_latency_sampling_interval();
+}
+
+void MallocExtension_Internal_SetAllocLatencySamplingInterval(int64_t value) {
+  Parameters::set_alloc_latency_sampling_interval(value);
+}
+
 bool MallocExtension_Internal_GetBackgroundProcessActionsEnabled() {
   return Parameters::background_process_actions_enabled();
 }
@@ -485,6 +598,11 @@ void TCMalloc_Internal_SetMaxPerCpuCacheSize(int32_t v) {
   tcmalloc::tcmalloc_internal::tc_globals.cpu_cache().SetCacheLimit(v);
 }
 
+void TCMalloc_Internal_SetPrefaultHugePages(int64_t v) {
+  Parameters::prefault_hugepages_.store(std::max<int64_t>(v, 0),
+                                        std::memory_order_relaxed);
+}
+
 void TCMalloc_Internal_SetMaxTotalThreadCacheBytes(int64_t v) {
   Parameters::max_total_thread_cache_bytes_.store(v, std::memory_order_relaxed);
 
@@ -515,6 +633,24 @@ void TCMalloc_Internal_SetProfileSamplingRate(int64_t v) {
   Parameters::profile_sampling_rate_.store(v, std::memory_order_relaxed);
 }
 
+double TCMalloc_Internal_GetProfileSamplingTargetPerSecond() {
+  return Parameters::profile_sampling_target_per_second();
+}
+
+void TCMalloc_Internal_SetProfileSamplingTargetPerSecond(double v) {
+  Parameters::profile_sampling_target_per_second_.store(
+      v, std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetProfileSamplingSiteBoost() {
+  return Parameters::profile_sampling_site_boost();
+}
+
+void TCMalloc_Internal_SetProfileSamplingSiteBoost(int64_t v) {
+  Parameters::profile_sampling_site_boost_.store(std::max<int64_t>(v, 0),
+                                                 std::memory_order_relaxed);
+}
+
 void TCMalloc_Internal_GetHugePageFillerSkipSubreleaseInterval(
     absl::Duration* v) {
   *v = Parameters::filler_skip_subrelease_interval();
@@ -523,6 +659,8 @@ void TCMalloc_Internal_GetHugePageFillerSkipSubreleaseInterval(
 void TCMalloc_Internal_SetBackgroundProcessActionsEnabled(bool v) {
   tcmalloc::tcmalloc_internal::background_process_actions_enabled_ptr().store(
       v, std::memory_order_relaxed);
+  // Stop the workers now rather than after their current sleep.
+  tcmalloc::tcmalloc_internal::WakeBackgroundWorkers();
 }
 
 void TCMalloc_Internal_SetBackgroundProcessSleepInterval(absl::Duration v) {
@@ -587,12 +725,312 @@ void TCMalloc_Internal_SetPerCpuCachesDynamicSlabShrinkThreshold(double v) {
       v, std::memory_order_relaxed);
 }
 
+bool TCMalloc_Internal_GetPerCpuCachesAutotune() {
+  return Parameters::per_cpu_caches_autotune();
+}
+
+void TCMalloc_Internal_SetPerCpuCachesAutotune(bool v) {
+  Parameters::per_cpu_caches_autotune_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetPerCpuCachesHandoff() {
+  return Parameters::per_cpu_caches_handoff();
+}
+
+void TCMalloc_Internal_SetPerCpuCachesHandoff(bool v) {
+  Parameters::per_cpu_caches_handoff_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetNumaBackgroundWorkers() {
+  return Parameters::numa_background_workers();
+}
+
+void TCMalloc_Internal_SetNumaBackgroundWorkers(bool v) {
+  Parameters::numa_background_workers_.store(v, std::memory_order_relaxed);
+  tcmalloc::tcmalloc_internal::WakeBackgroundWorkers();
+}
+
+bool TCMalloc_Internal_GetPiggybackBackgroundActions() {
+  return Parameters::piggyback_background_actions();
+}
+
+void TCMalloc_Internal_SetPiggybackBackgroundActions(bool v) {
+  Parameters::piggyback_background_actions_.store(v,
+                                                  std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetPerCpuCachesAdaptiveBatches() {
+  return Parameters::per_cpu_caches_adaptive_batches();
+}
+
+void TCMalloc_Internal_SetPerCpuCachesAdaptiveBatches(bool v) {
+  Parameters::per_cpu_caches_adaptive_batches_.store(v,
+                                                     std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetPerCpuCachesShareSmtCapacity() {
+  return Parameters::per_cpu_caches_share_smt_capacity();
+}
+
+void TCMalloc_Internal_SetPerCpuCachesShareSmtCapacity(bool v) {
+  Parameters::per_cpu_caches_share_smt_capacity_.store(
+      v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetPerCpuCachesWipeOnFork() {
+  return Parameters::per_cpu_caches_wipe_on_fork();
+}
+
+void TCMalloc_Internal_SetPerCpuCachesWipeOnFork(bool v) {
+  Parameters::per_cpu_caches_wipe_on_fork_.store(v, std::memory_order_relaxed);
+}
+
 bool TCMalloc_Internal_GetMadviseFree() { return Parameters::madvise_free(); }
 
 void TCMalloc_Internal_SetMadviseFree(bool v) {
   Parameters::madvise_free_.store(v, std::memory_order_relaxed);
 }
 
+bool TCMalloc_Internal_GetAdaptiveMadviseFree() {
+  return Parameters::adaptive_madvise_free();
+}
+
+void TCMalloc_Internal_SetAdaptiveMadviseFree(bool v) {
+  Parameters::adaptive_madvise_free_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetAsyncRelease() { return Parameters::async_release(); }
+
+void TCMalloc_Internal_SetAsyncRelease(bool v) {
+  Parameters::async_release_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetCgroupPressureRelease() {
+  return Parameters::cgroup_pressure_release();
+}
+
+void TCMalloc_Internal_SetCgroupPressureRelease(bool v) {
+  Parameters::cgroup_pressure_release_.store(v, std::memory_order_relaxed);
+}
+
+double TCMalloc_Internal_GetCgroupSoftLimitFraction() {
+  return Parameters::cgroup_soft_limit_fraction();
+}
+
+void TCMalloc_Internal_SetCgroupSoftLimitFraction(double v) {
+  Parameters::cgroup_soft_limit_fraction_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetSelfTuning() { return Parameters::self_tuning(); }
+
+void TCMalloc_Internal_SetSelfTuning(bool v) {
+  Parameters::self_tuning_.store(v, std::memory_order_relaxed);
+}
+
+double TCMalloc_Internal_GetSelfTuningMemoryWeight() {
+  return Parameters::self_tuning_memory_weight();
+}
+
+void TCMalloc_Internal_SetSelfTuningMemoryWeight(double v) {
+  Parameters::self_tuning_memory_weight_.store(std::clamp(v, 0.0, 1.0),
+                                               std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetMadviseCold() { return Parameters::madvise_cold(); }
+
+void TCMalloc_Internal_SetMadviseCold(bool v) {
+  Parameters::madvise_cold_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetSpanCacheColoring() {
+  return Parameters::span_cache_coloring();
+}
+
+void TCMalloc_Internal_SetSpanCacheColoring(bool v) {
+  Parameters::span_cache_coloring_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetL3SpanCache() { return Parameters::l3_span_cache(); }
+
+void TCMalloc_Internal_SetL3SpanCache(bool v) {
+  Parameters::l3_span_cache_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetFillerL3Partitions() {
+  return Parameters::filler_l3_partitions();
+}
+
+void TCMalloc_Internal_SetFillerL3Partitions(bool v) {
+  Parameters::filler_l3_partitions_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetLifetimeAwareSpanPlacement() {
+  return Parameters::lifetime_aware_span_placement();
+}
+
+void TCMalloc_Internal_SetLifetimeAwareSpanPlacement(bool v) {
+  Parameters::lifetime_aware_span_placement_.store(v,
+                                                   std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetReleaseFreeMetadata() {
+  return Parameters::release_free_metadata();
+}
+
+void TCMalloc_Internal_SetReleaseFreeMetadata(bool v) {
+  Parameters::release_free_metadata_.store(v, std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetLargeSpanCacheBytes() {
+  return Parameters::large_span_cache_bytes();
+}
+
+void TCMalloc_Internal_SetLargeSpanCacheBytes(int64_t v) {
+  Parameters::large_span_cache_bytes_.store(std::max<int64_t>(v, 0),
+                                            std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetCentralFreeListEmptySpanCache() {
+  return Parameters::central_freelist_empty_span_cache();
+}
+
+void TCMalloc_Internal_SetCentralFreeListEmptySpanCache(bool v) {
+  Parameters::central_freelist_empty_span_cache_.store(
+      v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetCentralFreeListRemoteFrees() {
+  return Parameters::central_freelist_remote_frees();
+}
+
+void TCMalloc_Internal_SetCentralFreeListRemoteFrees(bool v) {
+  Parameters::central_freelist_remote_frees_.store(v,
+                                                   std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetCentralFreeListPrepopulate() {
+  return Parameters::central_freelist_prepopulate();
+}
+
+void TCMalloc_Internal_SetCentralFreeListPrepopulate(bool v) {
+  Parameters::central_freelist_prepopulate_.store(v,
+                                                  std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetCentralFreeListDynamicSpanPages() {
+  return Parameters::central_freelist_dynamic_span_pages();
+}
+
+void TCMalloc_Internal_SetCentralFreeListDynamicSpanPages(bool v) {
+  Parameters::central_freelist_dynamic_span_pages_.store(
+      v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetAutoShardedTransferCache() {
+  return Parameters::auto_sharded_transfer_cache();
+}
+
+void TCMalloc_Internal_SetAutoShardedTransferCache(bool v) {
+  Parameters::auto_sharded_transfer_cache_.store(v, std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetCollapseHugePages() {
+  return Parameters::collapse_hugepages();
+}
+
+void TCMalloc_Internal_SetCollapseHugePages(int64_t v) {
+  Parameters::collapse_hugepages_.store(std::max<int64_t>(v, 0),
+                                        std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetScanHugePageBacking() {
+  return Parameters::scan_hugepage_backing();
+}
+
+void TCMalloc_Internal_SetScanHugePageBacking(int64_t v) {
+  Parameters::scan_hugepage_backing_.store(std::max<int64_t>(v, 0),
+                                           std::memory_order_relaxed);
+}
+
+double TCMalloc_Internal_GetFillerFragmentationRegionThreshold() {
+  return Parameters::filler_fragmentation_region_threshold();
+}
+
+void TCMalloc_Internal_SetFillerFragmentationRegionThreshold(double v) {
+  Parameters::filler_fragmentation_region_threshold_.store(
+      std::clamp(v, 0.0, 1.0), std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetSkipSubreleasePredictor() {
+  return Parameters::skip_subrelease_predictor();
+}
+
+void TCMalloc_Internal_SetSkipSubreleasePredictor(int64_t v) {
+  Parameters::skip_subrelease_predictor_.store(std::clamp<int64_t>(v, 0, 3),
+                                               std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetScanFreePageIdleness() {
+  return Parameters::scan_free_page_idleness();
+}
+
+void TCMalloc_Internal_SetScanFreePageIdleness(int64_t v) {
+  Parameters::scan_free_page_idleness_.store(std::max<int64_t>(v, 0),
+                                             std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetReleaseResidentUnbacked() {
+  return Parameters::release_resident_unbacked();
+}
+
+void TCMalloc_Internal_SetReleaseResidentUnbacked(int64_t v) {
+  Parameters::release_resident_unbacked_.store(std::max<int64_t>(v, 0),
+                                               std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetFramePointerUnwinding() {
+  return Parameters::frame_pointer_unwinding();
+}
+
+void TCMalloc_Internal_SetFramePointerUnwinding(bool v) {
+  Parameters::frame_pointer_unwinding_.store(v, std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetAllocLatencySamplingInterval() {
+  return Parameters::alloc_latency_sampling_interval();
+}
+
+void TCMalloc_Internal_SetAllocLatencySamplingInterval(int64_t v) {
+  Parameters::alloc_latency_sampling_interval_.store(
+      std::max<int64_t>(v, 0), std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetGuardedPoolBytes() {
+  return Parameters::guarded_pool_bytes();
+}
+
+void TCMalloc_Internal_SetGuardedPoolBytes(int64_t v) {
+  Parameters::guarded_pool_bytes_.store(std::max<int64_t>(v, 0),
+                                        std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetMteGuardedSampling() {
+  return Parameters::mte_guarded_sampling();
+}
+
+void TCMalloc_Internal_SetMteGuardedSampling(bool v) {
+  Parameters::mte_guarded_sampling_.store(v, std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetStatsSnapshotMaxAgeMs() {
+  return Parameters::stats_snapshot_max_age_ms();
+}
+
+void TCMalloc_Internal_SetStatsSnapshotMaxAgeMs(int64_t v) {
+  Parameters::stats_snapshot_max_age_ms_.store(std::max<int64_t>(v, 0),
+                                               std::memory_order_relaxed);
+}
+
 uint8_t TCMalloc_Internal_GetMinHotAccessHint() {
   return static_cast<uint8_t>(Parameters::min_hot_access_hint());
 }
@@ -86,6 +86,308 @@ class Parameters {
     TCMalloc_Internal_SetMadviseFree(value);
   }
 
+  // Release free pages that recent demand suggests will be reused with
+  // MADV_FREE alone, rather than MADV_DONTNEED, while the process is not short
+  // of memory.
+  static bool adaptive_madvise_free() {
+    return adaptive_madvise_free_.load(std::memory_order_relaxed);
+  }
+
+  static void set_adaptive_madvise_free(bool value) {
+    TCMalloc_Internal_SetAdaptiveMadviseFree(value);
+  }
+
+  static bool async_release() {
+    return async_release_.load(std::memory_order_relaxed);
+  }
+
+  static void set_async_release(bool value) {
+    TCMalloc_Internal_SetAsyncRelease(value);
+  }
+
+  // Scale background release to the memory pressure of the process' cgroup.
+  static bool cgroup_pressure_release() {
+    return cgroup_pressure_release_.load(std::memory_order_relaxed);
+  }
+
+  static void set_cgroup_pressure_release(bool value) {
+    TCMalloc_Internal_SetCgroupPressureRelease(value);
+  }
+
+  // If positive, keep the soft memory limit at this fraction of the limit of
+  // the process' cgroup.
+  static double cgroup_soft_limit_fraction() {
+    return cgroup_soft_limit_fraction_.load(std::memory_order_relaxed);
+  }
+
+  static void set_cgroup_soft_limit_fraction(double value) {
+    TCMalloc_Internal_SetCgroupSoftLimitFraction(value);
+  }
+
+  // Let the background thread tune parameters to the workload online; see
+  // ParameterTuner.
+  static bool self_tuning() {
+    return self_tuning_.load(std::memory_order_relaxed);
+  }
+
+  static void set_self_tuning(bool value) {
+    TCMalloc_Internal_SetSelfTuning(value);
+  }
+
+  // The weight of memory use against allocator CPU time, in [0, 1], in the
+  // objective that self-tuning minimizes.
+  static double self_tuning_memory_weight() {
+    return self_tuning_memory_weight_.load(std::memory_order_relaxed);
+  }
+
+  static void set_self_tuning_memory_weight(double value) {
+    TCMalloc_Internal_SetSelfTuningMemoryWeight(value);
+  }
+
+  static bool madvise_cold() {
+    return madvise_cold_.load(std::memory_order_relaxed);
+  }
+
+  static void set_madvise_cold(bool value) {
+    TCMalloc_Internal_SetMadviseCold(value);
+  }
+
+  static int64_t alloc_latency_sampling_interval() {
+    return alloc_latency_sampling_interval_.load(std::memory_order_relaxed);
+  }
+
+  static void set_alloc_latency_sampling_interval(int64_t value) {
+    TCMalloc_Internal_SetAllocLatencySamplingInterval(value);
+  }
+
+  // Byte budget, in guarded pages, up to which the GWP-ASan pool grows when
+  // all of its slots are in use; 0 keeps the pool at its initial size.  See
+  // GuardedPageAllocator::Grow.
+  static int64_t guarded_pool_bytes() {
+    return guarded_pool_bytes_.load(std::memory_order_relaxed);
+  }
+
+  static void set_guarded_pool_bytes(int64_t value) {
+    TCMalloc_Internal_SetGuardedPoolBytes(value);
+  }
+
+  // Whether MallocExtension::ActivateGuardedSampling() also activates the Arm
+  // MTE backend, which then takes guarded samples instead of the
+  // GuardedPageAllocator.  Ignored where MTE is not supported.  See
+  // MteSampledAllocator.
+  static bool mte_guarded_sampling() {
+    return mte_guarded_sampling_.load(std::memory_order_relaxed);
+  }
+
+  static void set_mte_guarded_sampling(bool value) {
+    TCMalloc_Internal_SetMteGuardedSampling(value);
+  }
+
+  // How old, in milliseconds, the published stats snapshot may be for
+  // GetNumericProperty() to answer from it rather than taking pageheap_lock;
+  // 0 always reads live stats.  See UpdateStatsSnapshot.
+  static int64_t stats_snapshot_max_age_ms() {
+    return stats_snapshot_max_age_ms_.load(std::memory_order_relaxed);
+  }
+
+  static void set_stats_snapshot_max_age_ms(int64_t value) {
+    TCMalloc_Internal_SetStatsSnapshotMaxAgeMs(value);
+  }
+
+  static bool span_cache_coloring() {
+    return span_cache_coloring_.load(std::memory_order_relaxed);
+  }
+
+  static void set_span_cache_coloring(bool value) {
+    TCMalloc_Internal_SetSpanCacheColoring(value);
+  }
+
+  static bool l3_span_cache() {
+    return l3_span_cache_.load(std::memory_order_relaxed);
+  }
+
+  static void set_l3_span_cache(bool value) {
+    TCMalloc_Internal_SetL3SpanCache(value);
+  }
+
+  // Keep the small-object spans of each L3 cache domain on hugepages of their
+  // own in the HugePageFiller.
+  static bool filler_l3_partitions() {
+    return filler_l3_partitions_.load(std::memory_order_relaxed);
+  }
+
+  static void set_filler_l3_partitions(bool value) {
+    TCMalloc_Internal_SetFillerL3Partitions(value);
+  }
+
+  // Place the spans of size classes whose sampled objects are mostly
+  // long-lived with the densely-accessed spans in the HugePageFiller, away
+  // from short-lived ones.
+  static bool lifetime_aware_span_placement() {
+    return lifetime_aware_span_placement_.load(std::memory_order_relaxed);
+  }
+
+  static void set_lifetime_aware_span_placement(bool value) {
+    TCMalloc_Internal_SetLifetimeAwareSpanPlacement(value);
+  }
+
+  // Release the memory of metadata slabs (spans, hugepage trackers, sampled
+  // allocation records, ...) whose objects are all free from the background
+  // thread.  See PageHeapAllocator::ReleaseFreeSlabs.
+  static bool release_free_metadata() {
+    return release_free_metadata_.load(std::memory_order_relaxed);
+  }
+
+  static void set_release_free_metadata(bool value) {
+    TCMalloc_Internal_SetReleaseFreeMetadata(value);
+  }
+
+  // Byte budget of the cache of page-level allocations just above kMaxSize;
+  // 0 disables it.  See LargeSpanCache.
+  static int64_t large_span_cache_bytes() {
+    return large_span_cache_bytes_.load(std::memory_order_relaxed);
+  }
+
+  static void set_large_span_cache_bytes(int64_t value) {
+    TCMalloc_Internal_SetLargeSpanCacheBytes(value);
+  }
+
+  // Whether central freelists hold on to a few recently emptied spans, for
+  // reuse by later allocations, rather than returning them right away.  See
+  // CentralFreeList::PlunderEmptySpans.
+  static bool central_freelist_empty_span_cache() {
+    return central_freelist_empty_span_cache_.load(std::memory_order_relaxed);
+  }
+
+  static void set_central_freelist_empty_span_cache(bool value) {
+    TCMalloc_Internal_SetCentralFreeListEmptySpanCache(value);
+  }
+
+  // Whether objects freed to central freelists are pushed onto remote free
+  // lists of their spans, without locking, rather than released under the
+  // freelist's lock.  See CentralFreeList::InsertRange.
+  static bool central_freelist_remote_frees() {
+    return central_freelist_remote_frees_.load(std::memory_order_relaxed);
+  }
+
+  static void set_central_freelist_remote_frees(bool value) {
+    TCMalloc_Internal_SetCentralFreeListRemoteFrees(value);
+  }
+
+  // Whether the background thread allocates spans ahead of demand for size
+  // classes whose transfer cache is running dry.  See
+  // CentralFreeList::Prepopulate.
+  static bool central_freelist_prepopulate() {
+    return central_freelist_prepopulate_.load(std::memory_order_relaxed);
+  }
+
+  static void set_central_freelist_prepopulate(bool value) {
+    TCMalloc_Internal_SetCentralFreeListPrepopulate(value);
+  }
+
+  // Whether central freelists size each new span to the demand for their
+  // size class, amongst a few lengths around the size class's own.  See
+  // CentralFreeList::ChooseSpanPages.
+  static bool central_freelist_dynamic_span_pages() {
+    return central_freelist_dynamic_span_pages_.load(
+        std::memory_order_relaxed);
+  }
+
+  static void set_central_freelist_dynamic_span_pages(bool value) {
+    TCMalloc_Internal_SetCentralFreeListDynamicSpanPages(value);
+  }
+
+  // Whether the size classes using the sharded transfer cache are chosen at
+  // runtime from their cross-L3 traffic.  See
+  // ShardedTransferCacheManagerBase::UpdateActiveClasses.
+  static bool auto_sharded_transfer_cache() {
+    return auto_sharded_transfer_cache_.load(std::memory_order_relaxed);
+  }
+
+  static void set_auto_sharded_transfer_cache(bool value) {
+    TCMalloc_Internal_SetAutoShardedTransferCache(value);
+  }
+
+  // Maximum number of subreleased hugepages, since refilled, that the
+  // background thread collapses back into hugepages (with MADV_COLLAPSE) per
+  // pass.  0 disables collapsing.
+  static int64_t collapse_hugepages() {
+    return collapse_hugepages_.load(std::memory_order_relaxed);
+  }
+
+  static void set_collapse_hugepages(int64_t value) {
+    TCMalloc_Internal_SetCollapseHugePages(value);
+  }
+
+  // Maximum number of filler hugepages per background pass whose THP backing
+  // is read from /proc/self/pageflags, to steer hot allocations to hugepages
+  // the kernel actually backs with THPs.  0 disables scanning.
+  static int64_t scan_hugepage_backing() {
+    return scan_hugepage_backing_.load(std::memory_order_relaxed);
+  }
+
+  static void set_scan_hugepage_backing(int64_t value) {
+    TCMalloc_Internal_SetScanHugePageBacking(value);
+  }
+
+  // If positive, a span of a few pages up to half a hugepage that fits in none
+  // of the filler's hugepages is carved from free space in the HugeRegions,
+  // rather than from a new filler hugepage, while at least this fraction of
+  // the filler's backed pages is free.  0 disables this routing.
+  static double filler_fragmentation_region_threshold() {
+    return filler_fragmentation_region_threshold_.load(
+        std::memory_order_relaxed);
+  }
+
+  static void set_filler_fragmentation_region_threshold(double value) {
+    TCMalloc_Internal_SetFillerFragmentationRegionThreshold(value);
+  }
+
+  // How skip subrelease estimates the demand to keep mapped: 0 for the
+  // configured intervals; 1, 2 or 3 to forecast the next peak from recent
+  // peaks with an EWMA, the 90th percentile or Holt's linear smoothing (see
+  // SubreleaseDemandPredictor).
+  static int64_t skip_subrelease_predictor() {
+    return skip_subrelease_predictor_.load(std::memory_order_relaxed);
+  }
+
+  static void set_skip_subrelease_predictor(int64_t value) {
+    TCMalloc_Internal_SetSkipSubreleasePredictor(value);
+  }
+
+  // Maximum number of filler hugepages per background pass whose free pages
+  // are checked for staleness in /proc/self/pageflags, so that subrelease
+  // returns the coldest free pages first.  0 disables scanning.
+  static int64_t scan_free_page_idleness() {
+    return scan_free_page_idleness_.load(std::memory_order_relaxed);
+  }
+
+  static void set_scan_free_page_idleness(int64_t value) {
+    TCMalloc_Internal_SetScanFreePageIdleness(value);
+  }
+
+  // Maximum number of hugepages per component and background pass whose
+  // residency is checked in /proc/self/pagemap, so that released memory faulted
+  // back in by stray touches is released again.  0 disables scanning.
+  static int64_t release_resident_unbacked() {
+    return release_resident_unbacked_.load(std::memory_order_relaxed);
+  }
+
+  static void set_release_resident_unbacked(int64_t value) {
+    TCMalloc_Internal_SetReleaseResidentUnbacked(value);
+  }
+
+  // Whether sampled allocations capture their stack trace by walking frame
+  // pointers, which is cheaper than the generic unwinder.  Falls back to the
+  // generic unwinder unless the binary is found to keep frame pointers.
+  static bool frame_pointer_unwinding() {
+    return frame_pointer_unwinding_.load(std::memory_order_relaxed);
+  }
+
+  static void set_frame_pointer_unwinding(bool value) {
+    TCMalloc_Internal_SetFramePointerUnwinding(value);
+  }
+
   static tcmalloc::hot_cold_t min_hot_access_hint() {
     return min_hot_access_hint_.load(std::memory_order_relaxed);
   }
@@ -98,6 +400,14 @@ class Parameters {
     TCMalloc_Internal_SetMaxTotalThreadCacheBytes(value);
   }
 
+  static int64_t prefault_hugepages() {
+    return prefault_hugepages_.load(std::memory_order_relaxed);
+  }
+
+  static void set_prefault_hugepages(int64_t value) {
+    TCMalloc_Internal_SetPrefaultHugePages(value);
+  }
+
   static double peak_sampling_heap_growth_fraction() {
     return peak_sampling_heap_growth_fraction_.load(std::memory_order_relaxed);
   }
@@ -139,6 +449,29 @@ class Parameters {
     TCMalloc_Internal_SetProfileSamplingRate(value);
   }
 
+  // If positive, the background thread adjusts profile_sampling_rate so that
+  // about this many allocations are sampled per second.
+  static double profile_sampling_target_per_second() {
+    return profile_sampling_target_per_second_.load(std::memory_order_relaxed);
+  }
+
+  static void set_profile_sampling_target_per_second(double value) {
+    TCMalloc_Internal_SetProfileSamplingTargetPerSecond(value);
+  }
+
+  // If greater than 1, allocations are sampled this many times as often, and
+  // the samples of allocation sites already sampled recently are thinned back
+  // out (see SampleifyAllocation), so that rare sites are sampled up to this
+  // many times more often than profile_sampling_rate, and the most frequent
+  // ones less often.  The weights of kept samples are scaled to match.
+  static int64_t profile_sampling_site_boost() {
+    return profile_sampling_site_boost_.load(std::memory_order_relaxed);
+  }
+
+  static void set_profile_sampling_site_boost(int64_t value) {
+    TCMalloc_Internal_SetProfileSamplingSiteBoost(value);
+  }
+
   static void set_filler_skip_subrelease_interval(absl::Duration value) {
     TCMalloc_Internal_SetHugePageFillerSkipSubreleaseInterval(value);
   }
@@ -183,9 +516,91 @@ class Parameters {
     TCMalloc_Internal_SetPerCpuCachesDynamicSlabShrinkThreshold(value);
   }
 
+  // Set per-cpu cache size class capacities with CpuCache::TuneCapacities()
+  // rather than CpuCache::ResizeSizeClasses().
+  static bool per_cpu_caches_autotune() {
+    return per_cpu_caches_autotune_.load(std::memory_order_relaxed);
+  }
+  static void set_per_cpu_caches_autotune(bool value) {
+    TCMalloc_Internal_SetPerCpuCachesAutotune(value);
+  }
+
+  // Hand objects freed on one cpu directly to the cpu that allocates them,
+  // for size classes in a producer/consumer pattern between cpus.
+  static bool per_cpu_caches_handoff() {
+    return per_cpu_caches_handoff_.load(std::memory_order_relaxed);
+  }
+  static void set_per_cpu_caches_handoff(bool value) {
+    TCMalloc_Internal_SetPerCpuCachesHandoff(value);
+  }
+
+  // Run the node-local background work of each NUMA partition beyond the
+  // first on a worker thread of its own, bound to the partition's cpus.
+  static bool numa_background_workers() {
+    return numa_background_workers_.load(std::memory_order_relaxed);
+  }
+  static void set_numa_background_workers(bool value) {
+    TCMalloc_Internal_SetNumaBackgroundWorkers(value);
+  }
+
+  // Run slices of the background actions on allocation slow paths while no
+  // thread is running ProcessBackgroundActions(), for processes that cannot
+  // spare one.
+  static bool piggyback_background_actions() {
+    return piggyback_background_actions_.load(std::memory_order_relaxed);
+  }
+  static void set_piggyback_background_actions(bool value) {
+    TCMalloc_Internal_SetPiggybackBackgroundActions(value);
+  }
+
+  // Adapt the number of objects each size class moves between the per-cpu
+  // caches and the transfer caches to how often it misses, rather than
+  // always moving SizeMap::num_objects_to_move().
+  static bool per_cpu_caches_adaptive_batches() {
+    return per_cpu_caches_adaptive_batches_.load(std::memory_order_relaxed);
+  }
+  static void set_per_cpu_caches_adaptive_batches(bool value) {
+    TCMalloc_Internal_SetPerCpuCachesAdaptiveBatches(value);
+  }
+
+  // Have the SMT siblings of a core split one cpu's worth of per-cpu cache
+  // capacity between them, rather than each starting with a full share.  It
+  // applies to caches populated after it is set.
+  static bool per_cpu_caches_share_smt_capacity() {
+    return per_cpu_caches_share_smt_capacity_.load(std::memory_order_relaxed);
+  }
+  static void set_per_cpu_caches_share_smt_capacity(bool value) {
+    TCMalloc_Internal_SetPerCpuCachesShareSmtCapacity(value);
+  }
+
+  // Mark the per-cpu slabs MADV_WIPEONFORK, so that a forked child starts
+  // with empty per-cpu caches rather than copies of the parent's.
+  static bool per_cpu_caches_wipe_on_fork() {
+    return per_cpu_caches_wipe_on_fork_.load(std::memory_order_relaxed);
+  }
+  static void set_per_cpu_caches_wipe_on_fork(bool value) {
+    TCMalloc_Internal_SetPerCpuCachesWipeOnFork(value);
+  }
+
   static bool separate_allocs_for_few_and_many_objects_spans();
   static size_t chunks_per_alloc();
 
+  // The seed of deterministic mode, from env TCMALLOC_DETERMINISTIC, or 0 when
+  // it is off.  In deterministic mode, the samplers and the mmap hints are
+  // seeded from it, and the background thread runs its actions by allocation
+  // volume rather than by wall time, leaving cache capacities where they
+  // start; see "Deterministic Mode" in docs/tuning.md.
+  static uint64_t deterministic_seed();
+
+  // Whether small-footprint mode is on, from env TCMALLOC_SMALL_FOOTPRINT=1.
+  // It makes at runtime the kinds of trade-offs that small-but-slow builds
+  // make at compile time: small per-cpu slabs and caches, small transfer
+  // caches, no HugeCache, and eager release; see "Small-Footprint Mode" in
+  // docs/tuning.md.
+  static bool small_footprint();
+  // The background release rate small-footprint mode starts with.
+  static constexpr size_t kSmallFootprintReleaseRate = 8 << 20;
+
  private:
   friend void ::TCMalloc_Internal_SetBackgroundReleaseRate(size_t v);
   friend void ::TCMalloc_Internal_SetGuardedSamplingRate(int64_t v);
@@ -197,6 +612,7 @@ class Parameters {
   friend void ::TCMalloc_Internal_SetMaxPerCpuCacheSize(int32_t v);
   friend void ::TCMalloc_Internal_SetMaxTotalThreadCacheBytes(int64_t v);
   friend void ::TCMalloc_Internal_SetPeakSamplingHeapGrowthFraction(double v);
+  friend void ::TCMalloc_Internal_SetPrefaultHugePages(int64_t v);
   friend void ::TCMalloc_Internal_SetPerCpuCachesEnabled(bool v);
   friend void ::TCMalloc_Internal_SetProfileSamplingRate(int64_t v);
 
@@ -211,10 +627,49 @@ class Parameters {
       double v);
   friend void ::TCMalloc_Internal_SetPerCpuCachesDynamicSlabShrinkThreshold(
       double v);
+  friend void ::TCMalloc_Internal_SetPerCpuCachesAutotune(bool v);
+  friend void ::TCMalloc_Internal_SetPerCpuCachesHandoff(bool v);
+  friend void ::TCMalloc_Internal_SetPerCpuCachesWipeOnFork(bool v);
+  friend void ::TCMalloc_Internal_SetPerCpuCachesAdaptiveBatches(bool v);
+  friend void ::TCMalloc_Internal_SetPerCpuCachesShareSmtCapacity(bool v);
+  friend void ::TCMalloc_Internal_SetNumaBackgroundWorkers(bool v);
+  friend void ::TCMalloc_Internal_SetPiggybackBackgroundActions(bool v);
 
   friend void TCMalloc_Internal_SetLifetimeAllocatorOptions(
       absl::string_view s);
   friend void ::TCMalloc_Internal_SetMadviseFree(bool v);
+  friend void ::TCMalloc_Internal_SetAdaptiveMadviseFree(bool v);
+  friend void ::TCMalloc_Internal_SetAsyncRelease(bool v);
+  friend void ::TCMalloc_Internal_SetCgroupPressureRelease(bool v);
+  friend void ::TCMalloc_Internal_SetCgroupSoftLimitFraction(double v);
+  friend void ::TCMalloc_Internal_SetSelfTuning(bool v);
+  friend void ::TCMalloc_Internal_SetSelfTuningMemoryWeight(double v);
+  friend void ::TCMalloc_Internal_SetProfileSamplingTargetPerSecond(double v);
+  friend void ::TCMalloc_Internal_SetProfileSamplingSiteBoost(int64_t v);
+  friend void ::TCMalloc_Internal_SetMadviseCold(bool v);
+  friend void ::TCMalloc_Internal_SetSpanCacheColoring(bool v);
+  friend void ::TCMalloc_Internal_SetL3SpanCache(bool v);
+  friend void ::TCMalloc_Internal_SetFillerL3Partitions(bool v);
+  friend void ::TCMalloc_Internal_SetLifetimeAwareSpanPlacement(bool v);
+  friend void ::TCMalloc_Internal_SetReleaseFreeMetadata(bool v);
+  friend void ::TCMalloc_Internal_SetLargeSpanCacheBytes(int64_t v);
+  friend void ::TCMalloc_Internal_SetCentralFreeListEmptySpanCache(bool v);
+  friend void ::TCMalloc_Internal_SetCentralFreeListRemoteFrees(bool v);
+  friend void ::TCMalloc_Internal_SetCentralFreeListPrepopulate(bool v);
+  friend void ::TCMalloc_Internal_SetCentralFreeListDynamicSpanPages(bool v);
+  friend void ::TCMalloc_Internal_SetAutoShardedTransferCache(bool v);
+  friend void ::TCMalloc_Internal_SetCollapseHugePages(int64_t v);
+  friend void ::TCMalloc_Internal_SetScanHugePageBacking(int64_t v);
+  friend void ::TCMalloc_Internal_SetFillerFragmentationRegionThreshold(
+      double v);
+  friend void ::TCMalloc_Internal_SetSkipSubreleasePredictor(int64_t v);
+  friend void ::TCMalloc_Internal_SetScanFreePageIdleness(int64_t v);
+  friend void ::TCMalloc_Internal_SetReleaseResidentUnbacked(int64_t v);
+  friend void ::TCMalloc_Internal_SetFramePointerUnwinding(bool v);
+  friend void ::TCMalloc_Internal_SetAllocLatencySamplingInterval(int64_t v);
+  friend void ::TCMalloc_Internal_SetGuardedPoolBytes(int64_t v);
+  friend void ::TCMalloc_Internal_SetMteGuardedSampling(bool v);
+  friend void ::TCMalloc_Internal_SetStatsSnapshotMaxAgeMs(int64_t v);
   friend void ::TCMalloc_Internal_SetMinHotAccessHint(uint8_t v);
 
   static std::atomic<MallocExtension::BytesPerSecond> background_release_rate_;
@@ -224,15 +679,54 @@ class Parameters {
   static std::atomic<int32_t> max_per_cpu_cache_size_;
   static std::atomic<int64_t> max_total_thread_cache_bytes_;
   static std::atomic<double> peak_sampling_heap_growth_fraction_;
+  static std::atomic<int64_t> prefault_hugepages_;
   static std::atomic<bool> per_cpu_caches_enabled_;
   static std::atomic<bool> release_partial_alloc_pages_;
   static std::atomic<bool> release_pages_from_huge_region_;
   static std::atomic<int64_t> profile_sampling_rate_;
+  static std::atomic<double> profile_sampling_target_per_second_;
+  static std::atomic<int64_t> profile_sampling_site_boost_;
   static std::atomic<bool> per_cpu_caches_dynamic_slab_;
   static std::atomic<bool> madvise_free_;
+  static std::atomic<bool> adaptive_madvise_free_;
+  static std::atomic<bool> async_release_;
+  static std::atomic<bool> cgroup_pressure_release_;
+  static std::atomic<double> cgroup_soft_limit_fraction_;
+  static std::atomic<bool> self_tuning_;
+  static std::atomic<double> self_tuning_memory_weight_;
+  static std::atomic<bool> madvise_cold_;
+  static std::atomic<bool> span_cache_coloring_;
+  static std::atomic<bool> l3_span_cache_;
+  static std::atomic<bool> filler_l3_partitions_;
+  static std::atomic<bool> lifetime_aware_span_placement_;
+  static std::atomic<bool> release_free_metadata_;
+  static std::atomic<int64_t> large_span_cache_bytes_;
+  static std::atomic<bool> central_freelist_empty_span_cache_;
+  static std::atomic<bool> central_freelist_remote_frees_;
+  static std::atomic<bool> central_freelist_prepopulate_;
+  static std::atomic<bool> central_freelist_dynamic_span_pages_;
+  static std::atomic<bool> auto_sharded_transfer_cache_;
+  static std::atomic<int64_t> collapse_hugepages_;
+  static std::atomic<int64_t> scan_hugepage_backing_;
+  static std::atomic<double> filler_fragmentation_region_threshold_;
+  static std::atomic<int64_t> skip_subrelease_predictor_;
+  static std::atomic<int64_t> scan_free_page_idleness_;
+  static std::atomic<int64_t> release_resident_unbacked_;
+  static std::atomic<bool> frame_pointer_unwinding_;
+  static std::atomic<int64_t> alloc_latency_sampling_interval_;
+  static std::atomic<int64_t> guarded_pool_bytes_;
+  static std::atomic<bool> mte_guarded_sampling_;
+  static std::atomic<int64_t> stats_snapshot_max_age_ms_;
   static std::atomic<tcmalloc::hot_cold_t> min_hot_access_hint_;
   static std::atomic<double> per_cpu_caches_dynamic_slab_grow_threshold_;
   static std::atomic<double> per_cpu_caches_dynamic_slab_shrink_threshold_;
+  static std::atomic<bool> per_cpu_caches_autotune_;
+  static std::atomic<bool> per_cpu_caches_handoff_;
+  static std::atomic<bool> per_cpu_caches_wipe_on_fork_;
+  static std::atomic<bool> per_cpu_caches_adaptive_batches_;
+  static std::atomic<bool> per_cpu_caches_share_smt_capacity_;
+  static std::atomic<bool> numa_background_workers_;
+  static std::atomic<bool> piggyback_background_actions_;
 };
 
 }  // namespace tcmalloc_internal
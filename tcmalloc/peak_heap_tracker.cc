@@ -40,6 +40,40 @@ bool PeakHeapTracker::IsNewPeak() {
           current_peak_size * Parameters::peak_sampling_heap_growth_fraction());
 }
 
+void PeakHeapTracker::RecordAllocation(SampledAllocation* sample) {
+  AllocationGuardSpinLockHolder h(&recorder_lock_);
+  sample->peak_copy = nullptr;
+  sample->peak_prev = nullptr;
+  sample->peak_next = added_;
+  if (added_ != nullptr) {
+    added_->peak_prev = sample;
+  }
+  added_ = sample;
+}
+
+void PeakHeapTracker::RecordDeallocation(SampledAllocation* sample) {
+  AllocationGuardSpinLockHolder h(&recorder_lock_);
+  if (SampledAllocation* copy = sample->peak_copy) {
+    // The copy stays in the snapshot until the next peak replaces it.
+    sample->peak_copy = nullptr;
+    copy->peak_next = removed_;
+    removed_ = copy;
+    return;
+  }
+
+  if (sample->peak_prev != nullptr) {
+    sample->peak_prev->peak_next = sample->peak_next;
+  } else {
+    ASSERT(added_ == sample);
+    added_ = sample->peak_next;
+  }
+  if (sample->peak_next != nullptr) {
+    sample->peak_next->peak_prev = sample->peak_prev;
+  }
+  sample->peak_prev = nullptr;
+  sample->peak_next = nullptr;
+}
+
 void PeakHeapTracker::MaybeSaveSample() {
   if (Parameters::peak_sampling_heap_growth_fraction() <= 0 || !IsNewPeak()) {
     return;
@@ -54,15 +88,20 @@ void PeakHeapTracker::MaybeSaveSample() {
   }
   SetCurrentPeakSize(tc_globals.sampled_objects_size_.value());
 
-  // Guaranteed to have no live sample after this call since we are doing this
-  // under `recorder_lock_`.
-  peak_heap_recorder_.get_mutable().UnregisterAll();
-  tc_globals.sampled_allocation_recorder().Iterate(
-      [this](const SampledAllocation& sampled_allocation) {
-        recorder_lock_.AssertHeld();
-        StackTrace st = sampled_allocation.sampled_stack;
-        peak_heap_recorder_.get_mutable().Register(std::move(st));
-      });
+  // The samples are only linked or unlinked under `recorder_lock_`, so the
+  // snapshot plus these changes are exactly the live samples.
+  PeakHeapRecorder& recorder = peak_heap_recorder_.get_mutable();
+  while (SampledAllocation* copy = removed_) {
+    removed_ = copy->peak_next;
+    recorder.Unregister(copy);
+  }
+  while (SampledAllocation* sample = added_) {
+    added_ = sample->peak_next;
+    sample->peak_prev = nullptr;
+    sample->peak_next = nullptr;
+    sample->peak_copy =
+        recorder.Register(sample->sampled_stack, sample->interned_stack);
+  }
 }
 
 std::unique_ptr<ProfileBase> PeakHeapTracker::DumpSample() {
@@ -71,7 +110,7 @@ std::unique_ptr<ProfileBase> PeakHeapTracker::DumpSample() {
   AllocationGuardSpinLockHolder h(&recorder_lock_);
   peak_heap_recorder_.get_mutable().Iterate(
       [&profile](const SampledAllocation& peak_heap_record) {
-        profile->AddTrace(1.0, peak_heap_record.sampled_stack);
+        profile->AddTrace(1.0, peak_heap_record.stack_trace());
       });
   return profile;
 }
@@ -36,6 +36,10 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+// Keeps a copy of the sampled allocations live at the high-water mark of the
+// sampled heap.  Rather than copying every live sample at each new peak, it
+// logs the samples allocated and the snapshotted samples freed since the last
+// peak, so that taking a new peak only applies those changes.
 class PeakHeapTracker {
  public:
   constexpr PeakHeapTracker()
@@ -51,15 +55,36 @@ class PeakHeapTracker {
     peak_heap_recorder_.get_mutable().Init();
   }
 
+  // Records that <sample> was registered, before it becomes visible to the
+  // deallocation path.
+  void RecordAllocation(SampledAllocation* sample)
+      ABSL_LOCKS_EXCLUDED(recorder_lock_);
+
+  // Records that <sample> is being freed, before it is unregistered.
+  void RecordDeallocation(SampledAllocation* sample)
+      ABSL_LOCKS_EXCLUDED(recorder_lock_);
+
   // Possibly save high-water-mark allocation stack traces for peak-heap
   // profile. Should be called immediately after sampling an allocation. If
   // the heap has grown by a sufficient amount since the last high-water-mark,
-  // it will save a copy of the sample profile.
+  // it will bring the saved samples up to date with the live ones, at a cost
+  // proportional to the samples allocated and freed since.
   void MaybeSaveSample() ABSL_LOCKS_EXCLUDED(recorder_lock_);
 
   // Return the saved high-water-mark heap profile, if any.
   std::unique_ptr<ProfileBase> DumpSample() ABSL_LOCKS_EXCLUDED(recorder_lock_);
 
+  // Acquires and releases recorder_lock_, and the lock of the recorder it
+  // guards, around fork().
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    recorder_lock_.Lock();
+    peak_heap_recorder_.get_mutable().AcquireInternalLocks();
+  }
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    peak_heap_recorder_.get_mutable().ReleaseInternalLocks();
+    recorder_lock_.Unlock();
+  }
+
   size_t CurrentPeakSize() const {
     return do_not_access_directly_peak_sampled_heap_size_.load(
         std::memory_order_relaxed);
@@ -90,6 +115,13 @@ class PeakHeapTracker {
   ExplicitlyConstructed<PeakHeapRecorder> peak_heap_recorder_
       ABSL_GUARDED_BY(recorder_lock_);
 
+  // Live samples without a copy in `peak_heap_recorder_`, linked through
+  // `peak_prev` and `peak_next`.
+  SampledAllocation* added_ ABSL_GUARDED_BY(recorder_lock_) = nullptr;
+  // Copies in `peak_heap_recorder_` whose samples have since been freed,
+  // linked through `peak_next`.
+  SampledAllocation* removed_ ABSL_GUARDED_BY(recorder_lock_) = nullptr;
+
   // Sampled heap size last time peak_heap_recorder_ was saved. Only written
   // under `recorder_lock_`; may be read without it.
   std::atomic<int64_t> do_not_access_directly_peak_sampled_heap_size_{0};
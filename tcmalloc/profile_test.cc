@@ -353,5 +353,43 @@ TEST(FragmentationzTest, Accuracy) {
       << " requested = " << requested_size << " count = " << count;
 }
 
+TEST(FragmentationzTest, PinnedHugePages) {
+  ScopedProfileSamplingRate ps(512 * 1024);
+  ScopedGuardedSamplingRate gs(-1);
+
+  // Too large for a size class, but small enough to share hugepages.  An odd
+  // size lets us find our records in the profile.
+  static const size_t kItemSize = (300 << 10) + 13;
+  static const size_t kNumItems = 1024;
+
+  // Keep every 8th allocation, so that the hugepages they were packed onto
+  // are left at most about a sixth full.
+  std::vector<void*> keep;
+  std::vector<void*> drop;
+  for (int i = 0; i < kNumItems; ++i) {
+    void* ptr = ::operator new(kItemSize);
+    benchmark::DoNotOptimize(ptr);
+    (i % 8 == 0 ? keep : drop).push_back(ptr);
+  }
+  for (void* ptr : drop) {
+    ::operator delete(ptr);
+  }
+
+  auto profile =
+      MallocExtension::SnapshotCurrent(ProfileType::kHugePageFragmentation);
+  EXPECT_EQ(profile.Type(), ProfileType::kHugePageFragmentation);
+  size_t sum = 0;
+  profile.Iterate([&](const Profile::Sample& e) {
+    if (e.requested_size != kItemSize) return;
+    sum += e.sum;
+  });
+  // Each kept allocation pins several times its size in free pages.
+  EXPECT_GT(sum, keep.size() * kItemSize);
+
+  for (void* ptr : keep) {
+    ::operator delete(ptr);
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc
@@ -15,7 +15,7 @@
 #ifndef TCMALLOC_SAMPLED_ALLOCATION_ALLOCATOR_H_
 #define TCMALLOC_SAMPLED_ALLOCATION_ALLOCATOR_H_
 
-#include <utility>
+#include <stddef.h>
 
 #include "absl/base/thread_annotations.h"
 #include "tcmalloc/arena.h"
@@ -24,6 +24,7 @@
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/internal/stack_trace_depot.h"
 #include "tcmalloc/page_heap_allocator.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -45,14 +46,15 @@ class SampledAllocationAllocator {
     allocator_.Init(arena);
   }
 
-  SampledAllocation* New(StackTrace stack_trace)
+  SampledAllocation* New(const SampleMetadata& metadata,
+                         const DepotStack* stack)
       ABSL_LOCKS_EXCLUDED(pageheap_lock) {
     SampledAllocation* s;
     {
       AllocationGuardSpinLockHolder h(&pageheap_lock);
       s = allocator_.New();
     }
-    return new (s) SampledAllocation(std::move(stack_trace));
+    return new (s) SampledAllocation(metadata, stack);
   }
 
   void Delete(SampledAllocation* s) ABSL_LOCKS_EXCLUDED(pageheap_lock) {
@@ -64,11 +66,37 @@ class SampledAllocationAllocator {
     return allocator_.stats();
   }
 
+  size_t ReleaseFreeSlabs(size_t max_slabs)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return allocator_.ReleaseFreeSlabs(max_slabs);
+  }
+
  private:
   PageHeapAllocator<SampledAllocation> allocator_
       ABSL_GUARDED_BY(pageheap_lock);
 };
 
+// Allocates the stacks of a StackTraceDepot from TCMalloc's arena.  They are
+// never freed.
+class DepotStackAllocator {
+ public:
+  constexpr DepotStackAllocator() = default;
+
+  void Init(Arena* arena) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    arena_ = arena;
+  }
+
+  void* Alloc(size_t bytes) ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    return arena_->Alloc(bytes);
+  }
+
+ private:
+  Arena* arena_ ABSL_GUARDED_BY(pageheap_lock) = nullptr;
+};
+
+using SampledStackDepot = StackTraceDepot<DepotStackAllocator>;
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -16,6 +16,7 @@
 
 #include "gtest/gtest.h"
 #include "absl/debugging/stacktrace.h"
+#include "absl/types/span.h"
 #include "tcmalloc/internal/logging.h"
 
 namespace tcmalloc {
@@ -29,12 +30,22 @@ TEST(SampledAllocationAllocatorTest, AllocAndDealloc) {
     absl::base_internal::SpinLockHolder h(&pageheap_lock);
     allocator.Init(&arena);
   }
-  StackTrace st;
-  st.depth = absl::GetStackTrace(st.stack, kMaxStackDepth, /* skip_count= */ 0);
-  st.requested_size = 8;
-  st.allocated_size = 8;
-  SampledAllocation* sampled_allocation = allocator.New(st);
-  EXPECT_GT(sampled_allocation->sampled_stack.depth, 0);
+  DepotStackAllocator depot_allocator;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    depot_allocator.Init(&arena);
+  }
+  SampledStackDepot depot(&depot_allocator);
+
+  void* stack[kMaxStackDepth];
+  const int depth =
+      absl::GetStackTrace(stack, kMaxStackDepth, /* skip_count= */ 0);
+  SampleMetadata metadata = {};
+  metadata.requested_size = 8;
+  metadata.allocated_size = 8;
+  SampledAllocation* sampled_allocation =
+      allocator.New(metadata, depot.Intern(absl::MakeConstSpan(stack, depth)));
+  EXPECT_EQ(sampled_allocation->stack_trace().depth, depth);
   EXPECT_EQ(sampled_allocation->sampled_stack.requested_size, 8);
   EXPECT_EQ(sampled_allocation->sampled_stack.allocated_size, 8);
   allocator.Delete(sampled_allocation);
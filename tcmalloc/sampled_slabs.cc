@@ -0,0 +1,148 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/sampled_slabs.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "absl/numeric/bits.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+void SampledSlab::Sample(const void* ptr,
+                         SampledAllocation* sampled_allocation) {
+  SampledAllocation*& entry = samples_[Index(ptr)];
+  CHECK_CONDITION(entry == nullptr && sampled_allocation != nullptr);
+  entry = sampled_allocation;
+  Span::AddSampledAllocation(sampled_allocation);
+}
+
+SampledAllocation* SampledSlab::Unsample(const void* ptr) {
+  SampledAllocation*& entry = samples_[Index(ptr)];
+  SampledAllocation* sampled_allocation = entry;
+  if (sampled_allocation == nullptr) return nullptr;
+  entry = nullptr;
+  Span::RemoveSampledAllocation(sampled_allocation);
+  return sampled_allocation;
+}
+
+void* SampledSlabs::New(size_t size_class, Span** span) {
+  ASSERT(size_class != 0 && size_class < kNumClasses);
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    if (!partial_[size_class].empty()) {
+      return Take(partial_[size_class].first(), span);
+    }
+  }
+
+  const size_t object_size = tc_globals.sizemap().class_to_size(size_class);
+  ASSERT(Packs(object_size));
+  Span* s = tc_globals.page_allocator().New(
+      Length(1), {1, AccessDensityPrediction::kSparse}, MemoryTag::kSampled);
+  if (s == nullptr) return nullptr;
+
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  SampledSlab* slab = allocator_.New();
+  slab->span_ = s;
+  slab->object_size_ = object_size;
+  slab->size_class_ = size_class;
+  slab->objects_ =
+      std::min(SampledSlab::kMaxObjects, s->bytes_in_span() / object_size);
+  ASSERT(slab->objects_ > 1);
+  slab->free_ = slab->objects_ == SampledSlab::kMaxObjects
+                    ? ~uint64_t{0}
+                    : (uint64_t{1} << slab->objects_) - 1;
+  memset(slab->samples_, 0, sizeof(slab->samples_));
+  s->set_sampled_slab(slab);
+  partial_[size_class].prepend(slab);
+  ++stats_.slabs;
+  return Take(slab, span);
+}
+
+void* SampledSlabs::Take(SampledSlab* slab, Span** span) {
+  ASSERT(slab->free_ != 0);
+  const size_t index = absl::countr_zero(slab->free_);
+  slab->free_ &= slab->free_ - 1;
+  if (slab->free_ == 0) {
+    partial_[slab->size_class_].remove(slab);
+  }
+  ++stats_.objects;
+  *span = slab->span_;
+  return static_cast<char*>(slab->span_->start_address()) +
+         index * slab->object_size_;
+}
+
+void SampledSlabs::Delete(Span* span, const void* ptr) {
+  SampledSlab* slab = span->sampled_slab();
+  ASSERT(slab != nullptr && slab->span_ == span);
+  const uint64_t bit = uint64_t{1} << slab->Index(ptr);
+
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  CHECK_CONDITION((slab->free_ & bit) == 0 && "Possible double free detected");
+  const bool was_full = slab->free_ == 0;
+  slab->free_ |= bit;
+  --stats_.objects;
+  if (absl::popcount(slab->free_) != slab->objects_) {
+    if (was_full) partial_[slab->size_class_].prepend(slab);
+    return;
+  }
+
+  if (!was_full) partial_[slab->size_class_].remove(slab);
+  span->set_sampled_slab(nullptr);
+  allocator_.Delete(slab);
+  --stats_.slabs;
+  tc_globals.page_allocator().Delete(span, /*objects_per_span=*/1,
+                                     MemoryTag::kSampled);
+}
+
+void SampledSlabs::Print(Printer* out) const {
+  Stats s;
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    s = stats();
+  }
+  out->printf(
+      "------------------------------------------------\n"
+      "Sampled slabs: %zu objects packed into %zu slabs of up to %zu\n",
+      s.objects, s.slabs, SampledSlab::kMaxObjects);
+}
+
+void SampledSlabs::PrintInPbtxt(PbtxtRegion* region) const {
+  Stats s;
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    s = stats();
+  }
+  PbtxtRegion entry = region->CreateSubRegion("sampled_slabs");
+  entry.PrintI64("slabs", s.slabs);
+  entry.PrintI64("objects", s.objects);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
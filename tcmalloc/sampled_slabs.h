@@ -0,0 +1,146 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_SAMPLED_SLABS_H_
+#define TCMALLOC_SAMPLED_SLABS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/arena.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/linked_list.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/page_heap_allocator.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The sampled objects of a size class that share a span.  Object i of the slab
+// starts i * object_size() bytes into the span.
+class SampledSlab : public TList<SampledSlab>::Elem {
+ public:
+  static constexpr size_t kMaxObjects = 64;
+
+  size_t object_size() const { return object_size_; }
+
+  // Returns a mask with bit i set while object i is allocated.
+  uint64_t allocated() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    const uint64_t all =
+        objects_ == kMaxObjects ? ~uint64_t{0} : (uint64_t{1} << objects_) - 1;
+    return ~free_ & all;
+  }
+
+  // Records <sampled_allocation> for the object at <ptr>, and counts it in the
+  // global counters on sampled allocations.  Like Span::Sample(), this needs no
+  // pageheap_lock: an object's entry only changes while it is allocated or
+  // freed, which the caller is doing.
+  void Sample(const void* ptr, SampledAllocation* sampled_allocation);
+
+  // Clears and returns the sampled allocation recorded for the object at
+  // <ptr>, or returns nullptr if there is none.
+  SampledAllocation* Unsample(const void* ptr);
+
+ private:
+  friend class SampledSlabs;
+
+  size_t Index(const void* ptr) const {
+    const uintptr_t offset =
+        static_cast<const char*>(ptr) -
+        static_cast<const char*>(span_->start_address());
+    ASSERT(offset % object_size_ == 0);
+    return offset / object_size_;
+  }
+
+  Span* span_;
+  uint32_t object_size_;
+  uint16_t size_class_;
+  uint16_t objects_;
+  // Bit i is set while object i is free.  Guarded by pageheap_lock.
+  uint64_t free_;
+  SampledAllocation* samples_[kMaxObjects];
+};
+
+// Sampled objects are given spans of their own, apart from the spans of the
+// central free lists, so that freeing one finds its sampled allocation.  A
+// small object would then take up a whole page, so that at high sampling rates
+// most of the sampled memory would be padding.  Instead, objects of up to
+// kMaxObjectSize bytes are packed into single-page spans shared by the sampled
+// objects of their size class.  The pagemap still leads from an object to its
+// span, and the span to its slab, so that looking up a sampled object's
+// allocation takes a division more than before.
+//
+// A slab's span is returned to the page allocator once its last object is
+// freed.
+class SampledSlabs {
+ public:
+  static constexpr size_t kMaxObjectSize = kPageSize / 2;
+
+  constexpr SampledSlabs() = default;
+
+  SampledSlabs(const SampledSlabs&) = delete;
+  SampledSlabs& operator=(const SampledSlabs&) = delete;
+
+  void Init(Arena* arena) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    allocator_.Init(arena);
+  }
+
+  // Returns true if sampled objects of <object_size> bytes are packed.
+  static bool Packs(size_t object_size) {
+    return object_size <= kMaxObjectSize;
+  }
+
+  // Returns a free object of <size_class> and sets *span to the span holding
+  // it, or returns nullptr if out of memory.
+  // REQUIRES: Packs(class_to_size(size_class)).
+  void* New(size_t size_class, Span** span) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Frees the object at <ptr> of the slab of <span>, and <span> itself if that
+  // was the slab's last object.
+  // REQUIRES: span->sampled_slab() != nullptr.
+  void Delete(Span* span, const void* ptr) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  struct Stats {
+    size_t slabs = 0;
+    size_t objects = 0;
+  };
+  Stats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return stats_;
+  }
+
+  void Print(Printer* out) const ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  void PrintInPbtxt(PbtxtRegion* region) const
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+ private:
+  void* Take(SampledSlab* slab, Span** span)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Slabs with free objects, by size class.
+  TList<SampledSlab> partial_[kNumClasses] ABSL_GUARDED_BY(pageheap_lock);
+  PageHeapAllocator<SampledSlab> allocator_ ABSL_GUARDED_BY(pageheap_lock);
+  Stats stats_ ABSL_GUARDED_BY(pageheap_lock);
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SAMPLED_SLABS_H_
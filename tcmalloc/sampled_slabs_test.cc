@@ -0,0 +1,149 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/sampled_slabs.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/tcmalloc_policy.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class SampledSlabsTest : public ::testing::Test {
+ protected:
+  SampledSlabsTest() {
+    tc_globals.InitIfNecessary();
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    slabs_.Init(&tc_globals.arena());
+  }
+
+  static size_t SizeClassFor(size_t size) {
+    uint32_t size_class;
+    CHECK_CONDITION(
+        tc_globals.sizemap().GetSizeClass(CppPolicy(), size, &size_class));
+    return size_class;
+  }
+
+  SampledSlabs::Stats stats() {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    return slabs_.stats();
+  }
+
+  SampledSlabs slabs_;
+};
+
+TEST_F(SampledSlabsTest, PacksObjectsIntoOneSpan) {
+  const size_t size_class = SizeClassFor(64);
+  const size_t size = tc_globals.sizemap().class_to_size(size_class);
+  ASSERT_TRUE(SampledSlabs::Packs(size));
+
+  Span* first_span;
+  char* first = static_cast<char*>(slabs_.New(size_class, &first_span));
+  ASSERT_NE(first, nullptr);
+  EXPECT_TRUE(IsSampledMemory(first));
+  EXPECT_EQ(first, first_span->start_address());
+  ASSERT_NE(first_span->sampled_slab(), nullptr);
+  EXPECT_FALSE(first_span->sampled());
+  EXPECT_EQ(first_span->sampled_slab()->object_size(), size);
+  EXPECT_EQ(tc_globals.pagemap().GetDescriptor(PageIdContaining(first)),
+            first_span);
+
+  Span* span;
+  char* second = static_cast<char*>(slabs_.New(size_class, &span));
+  EXPECT_EQ(span, first_span);
+  EXPECT_EQ(second, first + size);
+  EXPECT_EQ(stats().slabs, 1);
+  EXPECT_EQ(stats().objects, 2);
+
+  slabs_.Delete(span, second);
+  EXPECT_EQ(stats().objects, 1);
+  // The freed object is the next one handed out.
+  EXPECT_EQ(slabs_.New(size_class, &span), second);
+
+  slabs_.Delete(span, first);
+  slabs_.Delete(span, second);
+  EXPECT_EQ(stats().slabs, 0);
+  EXPECT_EQ(stats().objects, 0);
+}
+
+TEST_F(SampledSlabsTest, FullSlabsStartAnother) {
+  const size_t size_class = SizeClassFor(16);
+  const size_t size = tc_globals.sizemap().class_to_size(size_class);
+  const size_t per_slab =
+      std::min(SampledSlab::kMaxObjects, kPageSize / size);
+
+  std::vector<void*> objects;
+  std::vector<Span*> spans;
+  for (size_t i = 0; i < per_slab + 1; ++i) {
+    Span* span;
+    void* ptr = slabs_.New(size_class, &span);
+    ASSERT_NE(ptr, nullptr);
+    objects.push_back(ptr);
+    spans.push_back(span);
+  }
+  EXPECT_EQ(stats().slabs, 2);
+  EXPECT_EQ(spans[per_slab - 1], spans[0]);
+  EXPECT_NE(spans[per_slab], spans[0]);
+
+  // A full slab that gets a free object is used again.
+  slabs_.Delete(spans[3], objects[3]);
+  Span* span;
+  EXPECT_EQ(slabs_.New(size_class, &span), objects[3]);
+  EXPECT_EQ(span, spans[0]);
+
+  for (size_t i = 0; i < objects.size(); ++i) {
+    slabs_.Delete(spans[i], objects[i]);
+  }
+  EXPECT_EQ(stats().slabs, 0);
+  EXPECT_EQ(stats().objects, 0);
+}
+
+TEST_F(SampledSlabsTest, SamplesEachObject) {
+  const size_t size_class = SizeClassFor(128);
+  Span* span;
+  void* a = slabs_.New(size_class, &span);
+  void* b = slabs_.New(size_class, &span);
+  ASSERT_NE(a, nullptr);
+  ASSERT_NE(b, nullptr);
+  SampledSlab* slab = span->sampled_slab();
+  ASSERT_NE(slab, nullptr);
+
+  SampledAllocation sample_a, sample_b;
+  slab->Sample(a, &sample_a);
+  slab->Sample(b, &sample_b);
+  EXPECT_EQ(slab->Unsample(b), &sample_b);
+  EXPECT_EQ(slab->Unsample(b), nullptr);
+  EXPECT_EQ(slab->Unsample(a), &sample_a);
+
+  slabs_.Delete(span, a);
+  slabs_.Delete(span, b);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
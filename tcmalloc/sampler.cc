@@ -42,7 +42,14 @@ namespace tcmalloc_internal {
 constexpr ssize_t kIntervalOffset = 1;
 
 ssize_t Sampler::GetSamplePeriod() {
-  return Parameters::profile_sampling_rate();
+  const int64_t rate = Parameters::profile_sampling_rate();
+  // SampleifyAllocation thins the extra samples of common allocation sites
+  // back out.  A period of 1 samples everything, which needs no boost.
+  if (const int64_t boost = Parameters::profile_sampling_site_boost();
+      ABSL_PREDICT_FALSE(boost > 1) && rate > 1) {
+    return std::max<int64_t>(rate / boost, 2);
+  }
+  return rate;
 }
 
 // Run this before using your sampler
@@ -142,7 +149,13 @@ size_t Sampler::RecordAllocationSlow(size_t k) {
     initialized_ = true;
     uint64_t global_seed =
         global_randomness.fetch_add(1, std::memory_order_relaxed);
-    Init(reinterpret_cast<uintptr_t>(this) ^ global_seed);
+    // In deterministic mode, the nth sampler to start is seeded the same on
+    // every run, wherever it happens to live.
+    if (const uint64_t seed = Parameters::deterministic_seed(); seed != 0) {
+      Init(std::max<uint64_t>(seed + global_seed, 1));
+    } else {
+      Init(reinterpret_cast<uintptr_t>(this) ^ global_seed);
+    }
     // Avoid missampling 0.
     bytes_until_sample_ -= k + 1;
     if (ABSL_PREDICT_TRUE(bytes_until_sample_ >= 0)) {
@@ -166,7 +179,7 @@ size_t Sampler::RecordAllocationSlow(size_t k) {
   return GetSamplePeriod() <= 0 ? 0 : weight;
 }
 
-double AllocatedBytes(const StackTrace& stack) {
+double AllocatedBytes(const SampleMetadata& stack) {
   return static_cast<double>(stack.weight) * stack.allocated_size /
          (stack.requested_size + 1);
 }
@@ -224,7 +224,7 @@ Sampler::ShouldSampleGuardedAllocation() {
 
 // Returns the approximate number of bytes that would have been allocated to
 // obtain this sample.
-double AllocatedBytes(const StackTrace& stack);
+double AllocatedBytes(const SampleMetadata& stack);
 
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -32,7 +32,9 @@
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/memory_tagging.h"
 #include "tcmalloc/internal/optimization.h"
+#include "tcmalloc/mte_sampled_allocator.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
 
@@ -211,26 +213,16 @@ GuardedAllocationsErrorType RefineErrorTypeBasedOnContext(
   return RefineErrorTypeBasedOnWriteFlag(error, write_flag);
 }
 
-// A SEGV handler that prints stack traces for the allocation and deallocation
-// of relevant memory as well as the location of the memory error.
-void SegvHandler(int signo, siginfo_t* info, void* context) {
-  if (signo != SIGSEGV) return;
-  void* fault = info->si_addr;
-  if (!tc_globals.guardedpage_allocator().PointerIsMine(fault)) return;
-
-
-  GuardedAllocationsStackTrace *alloc_trace, *dealloc_trace;
-  GuardedAllocationsErrorType error =
-      tc_globals.guardedpage_allocator().GetStackTraces(fault, &alloc_trace,
-                                                        &dealloc_trace);
-  if (error == GuardedAllocationsErrorType::kUnknown) return;
+// Prints stack traces for the allocation and deallocation of the memory at
+// <fault>, as well as the location of the memory error.  Shared by the guarded
+// sampling backends.
+static void ReportMemoryError(GuardedAllocationsErrorType error,
+                              GuardedAllocationsStackTrace* alloc_trace,
+                              GuardedAllocationsStackTrace* dealloc_trace,
+                              off_t offset, size_t size, void* context) {
   WriteFlag write_flag = ExtractWriteFlagFromContext(context);
   error = RefineErrorTypeBasedOnWriteFlag(error, write_flag);
   pid_t current_thread = absl::base_internal::GetTID();
-  off_t offset;
-  size_t size;
-  std::tie(offset, size) =
-      tc_globals.guardedpage_allocator().GetAllocationOffsetAndSize(fault);
 
   Log(kLog, __FILE__, __LINE__,
       "*** GWP-ASan "
@@ -299,6 +291,63 @@ void SegvHandler(int signo, siginfo_t* info, void* context) {
       "improved_guarded_sampling:", Parameters::improved_guarded_sampling());
 }
 
+// Reports the memory error at <fault> if <allocator> owns it.  Returns false
+// otherwise.
+template <typename Allocator>
+static bool MaybeReportMemoryError(const Allocator& allocator, void* fault,
+                                   void* context) {
+  if (!allocator.PointerIsMine(fault)) return false;
+
+  GuardedAllocationsStackTrace *alloc_trace, *dealloc_trace;
+  GuardedAllocationsErrorType error =
+      allocator.GetStackTraces(fault, &alloc_trace, &dealloc_trace);
+  if (error == GuardedAllocationsErrorType::kUnknown) return false;
+  off_t offset;
+  size_t size;
+  std::tie(offset, size) = allocator.GetAllocationOffsetAndSize(fault);
+  ReportMemoryError(error, alloc_trace, dealloc_trace, offset, size, context);
+  return true;
+}
+
+// Asynchronous tag check faults carry no address, so all we know is that an
+// access through a tagged pointer went wrong shortly before this point.
+static void ReportAsyncTagCheckFault(void* context) {
+  Log(kLog, __FILE__, __LINE__,
+      "*** GWP-ASan "
+      "(https://google.github.io/tcmalloc/gwp-asan.html)  "
+      "has detected a memory error ***");
+  Log(kLog, __FILE__, __LINE__,
+      ">>> Asynchronous MTE tag check fault in thread",
+      absl::base_internal::GetTID(),
+      "; the faulting access precedes the stack below.  Enable synchronous "
+      "tag checks to identify the allocation.");
+  RecordCrash("mte-tag-check-fault");
+  PrintStackTraceFromSignalHandler(context);
+}
+
+// A SEGV handler that prints stack traces for the allocation and deallocation
+// of relevant memory as well as the location of the memory error.
+void SegvHandler(int signo, siginfo_t* info, void* context) {
+  if (signo != SIGSEGV) return;
+  void* fault = info->si_addr;
+  if (MaybeReportMemoryError(tc_globals.guardedpage_allocator(), fault,
+                             context)) {
+    return;
+  }
+
+  const MteSampledAllocator& mte = tc_globals.mte_sampled_allocator();
+  if (!mte.active()) return;
+  bool fault_address_known = true;
+  if (IsTagCheckFault(signo, info->si_code, &fault_address_known) &&
+      !fault_address_known) {
+    ReportAsyncTagCheckFault(context);
+    return;
+  }
+  // Synchronous tag check faults, and the double frees the MTE backend
+  // reports by touching its inaccessible first page.
+  MaybeReportMemoryError(mte, fault, context);
+}
+
 static struct sigaction old_sa;
 
 static void ForwardSignal(int signo, siginfo_t* info, void* context) {
@@ -332,6 +381,11 @@ extern "C" void MallocExtension_Internal_ActivateGuardedSampling() {
     action.sa_flags = SA_SIGINFO;
     sigaction(SIGSEGV, &action, &old_sa);
     tc_globals.guardedpage_allocator().AllowAllocations();
+    // MTE tags and size class tags share the top bits of pointers.
+    if (Parameters::mte_guarded_sampling() &&
+        tc_globals.size_class_tag_mask() == 0) {
+      tc_globals.mte_sampled_allocator().Activate();
+    }
   });
 }
 
@@ -0,0 +1,224 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/size_class_generator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_format.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/size_class_info.h"
+#include "tcmalloc/sizemap.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// SizeMap::ClassIndexMaybe requires 128-byte alignment above
+// SizeMap::kMaxSmallSize.
+constexpr size_t kMaxSmallSize = 1024;
+
+size_t Alignment(size_t size) {
+  return size <= kMaxSmallSize ? static_cast<size_t>(kAlignment) : 128;
+}
+
+size_t AlignUp(size_t size) {
+  const size_t alignment = Alignment(size);
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Returns the pages per span for objects of <size>: those of <like>, the
+// baseline class holding it, if it has the same size, or else the fewest pages
+// that waste at most an eighth of the span.
+size_t ChoosePages(size_t size, const SizeClassInfo& like) {
+  if (size == like.size) return like.pages;
+  const size_t min_pages = (size + kPageSize - 1) / kPageSize;
+  for (size_t pages = min_pages;; ++pages) {
+    const size_t span_bytes = pages << kPageShift;
+    if ((span_bytes % size) * 8 <= span_bytes) return pages;
+  }
+}
+
+struct Candidate {
+  SizeClassInfo info;
+  // Objects of the histogram that this class holds, i.e. of sizes between the
+  // previous class and this one.
+  double count;
+  size_t prev;
+  size_t next;
+};
+
+}  // namespace
+
+std::vector<SizeCount> SizeHistogram(const Profile& profile) {
+  std::map<size_t, double> counts;
+  profile.Iterate([&](const Profile::Sample& sample) {
+    if (sample.requested_size == 0 || sample.requested_size > kMaxSize) {
+      return;
+    }
+    counts[sample.requested_size] += sample.count;
+  });
+
+  std::vector<SizeCount> histogram;
+  histogram.reserve(counts.size());
+  for (const auto& [size, count] : counts) {
+    histogram.push_back({size, count});
+  }
+  return histogram;
+}
+
+std::vector<SizeClassInfo> GenerateSizeClasses(
+    absl::Span<const SizeCount> histogram,
+    absl::Span<const SizeClassInfo> baseline, size_t max_classes) {
+  CHECK_CONDITION(baseline.size() > 1);
+  CHECK_CONDITION(baseline.back().size == kMaxSize);
+  CHECK_CONDITION(max_classes > 1);
+
+  // Returns the smallest class of the baseline holding <size>.
+  auto baseline_class = [&](size_t size) -> const SizeClassInfo& {
+    return *std::lower_bound(
+        baseline.begin() + 1, baseline.end(), size,
+        [](const SizeClassInfo& info, size_t size) { return info.size < size; });
+  };
+
+  // Gather the candidate sizes, in increasing order.
+  std::vector<size_t> sizes;
+  sizes.reserve(baseline.size() + histogram.size());
+  for (const SizeClassInfo& info : baseline.subspan(1)) {
+    sizes.push_back(info.size);
+  }
+  for (const SizeCount& entry : histogram) {
+    if (entry.size == 0 || entry.size > kMaxSize) continue;
+    sizes.push_back(AlignUp(entry.size));
+  }
+  std::sort(sizes.begin(), sizes.end());
+  sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+  std::vector<Candidate> candidates;
+  candidates.reserve(sizes.size());
+  for (size_t size : sizes) {
+    const SizeClassInfo& like = baseline_class(size);
+    const size_t pages = ChoosePages(size, like);
+    if (size != like.size &&
+        (pages > std::numeric_limits<uint8_t>::max() ||
+         !SizeMap::IsValidSizeClass(size, pages, like.num_to_move))) {
+      continue;
+    }
+    candidates.push_back({{static_cast<uint32_t>(size),
+                           static_cast<uint8_t>(pages), like.num_to_move,
+                           like.max_capacity},
+                          0,
+                          candidates.size() - 1,
+                          candidates.size() + 1});
+  }
+  for (const SizeCount& entry : histogram) {
+    if (entry.size == 0 || entry.size > kMaxSize) continue;
+    auto it = std::lower_bound(candidates.begin(), candidates.end(),
+                               entry.size,
+                               [](const Candidate& c, size_t size) {
+                                 return c.info.size < size;
+                               });
+    it->count += entry.count;
+  }
+
+  // Greedily merge away the classes whose removal adds the least internal
+  // fragmentation: the objects of a removed class round up to the next one.
+  // The last class covers kMaxSize and is kept.
+  size_t live = candidates.size();
+  const size_t last = candidates.size() - 1;
+  std::vector<bool> removed(candidates.size(), false);
+  while (live > max_classes - 1) {
+    size_t victim = last;
+    double victim_cost = std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < last; ++i) {
+      if (removed[i]) continue;
+      const Candidate& c = candidates[i];
+      const double cost =
+          c.count * (candidates[c.next].info.size - c.info.size);
+      if (cost < victim_cost) {
+        victim = i;
+        victim_cost = cost;
+      }
+    }
+    ASSERT(victim != last);
+    Candidate& c = candidates[victim];
+    candidates[c.next].count += c.count;
+    candidates[c.next].prev = c.prev;
+    if (c.prev < candidates.size()) candidates[c.prev].next = c.next;
+    removed[victim] = true;
+    --live;
+  }
+
+  std::vector<SizeClassInfo> result;
+  result.reserve(live + 1);
+  result.push_back({0, 0, 0, 0});
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (!removed[i]) result.push_back(candidates[i].info);
+  }
+  return result;
+}
+
+std::string FormatSizeClasses(absl::Span<const SizeClassInfo> size_classes) {
+  std::string out = "# bytes pages batch cap\n";
+  for (const SizeClassInfo& info : size_classes.subspan(1)) {
+    absl::StrAppendFormat(&out, "%u %u %u %u\n", info.size, info.pages,
+                          info.num_to_move, info.max_capacity);
+  }
+  return out;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+using ::tcmalloc::tcmalloc_internal::FormatSizeClasses;
+using ::tcmalloc::tcmalloc_internal::GenerateSizeClasses;
+using ::tcmalloc::tcmalloc_internal::kNumBaseClasses;
+using ::tcmalloc::tcmalloc_internal::SizeClassInfo;
+using ::tcmalloc::tcmalloc_internal::SizeHistogram;
+using ::tcmalloc::tcmalloc_internal::tc_globals;
+
+extern "C" void MallocExtension_Internal_GetSizeClassesForProfile(
+    const tcmalloc::Profile* profile, std::string* ret) {
+  tc_globals.InitIfNecessary();
+  // The current size classes serve as the baseline.
+  std::vector<SizeClassInfo> baseline = {{0, 0, 0, 0}};
+  for (int size_class = 1; size_class < kNumBaseClasses; ++size_class) {
+    const size_t size = tc_globals.sizemap().class_to_size(size_class);
+    if (size == 0) break;
+    baseline.push_back({static_cast<uint32_t>(size),
+                        static_cast<uint8_t>(
+                            tc_globals.sizemap().class_to_pages(size_class)),
+                        static_cast<uint8_t>(
+                            tc_globals.sizemap().num_objects_to_move(
+                                size_class)),
+                        static_cast<uint32_t>(
+                            tc_globals.sizemap().max_capacity(size_class))});
+  }
+  *ret = FormatSizeClasses(GenerateSizeClasses(
+      SizeHistogram(*profile), baseline, kNumBaseClasses));
+}
@@ -0,0 +1,63 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_SIZE_CLASS_GENERATOR_H_
+#define TCMALLOC_SIZE_CLASS_GENERATOR_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/size_class_info.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The estimated number of live (or allocated) objects of a requested size.
+struct SizeCount {
+  size_t size;
+  double count;
+};
+
+// Returns the histogram of requested sizes of the samples in <profile>,
+// typically a kHeap or kAllocations profile, sorted by size.
+std::vector<SizeCount> SizeHistogram(const Profile& profile);
+
+// Returns a size class configuration with at most <max_classes> size classes
+// (including size class 0) that minimizes the internal fragmentation of
+// <histogram>, the bytes lost to rounding requested sizes up to their size
+// class.
+//
+// Size classes are chosen among the (suitably aligned) sizes of <histogram>
+// and those of <baseline>, which must be a valid configuration; each takes
+// its batch size and capacity from the smallest class of <baseline> that
+// holds it.  Every size class is checked with SizeMap::IsValidSizeClass, so
+// the result passes SizeMap::ValidSizeClasses.
+std::vector<SizeClassInfo> GenerateSizeClasses(
+    absl::Span<const SizeCount> histogram,
+    absl::Span<const SizeClassInfo> baseline, size_t max_classes);
+
+// Formats <size_classes> for SizeMap::ParseSizeClasses, omitting size class 0.
+std::string FormatSizeClasses(absl::Span<const SizeClassInfo> size_classes);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SIZE_CLASS_GENERATOR_H_
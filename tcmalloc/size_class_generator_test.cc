@@ -0,0 +1,119 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/size_class_generator.h"
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/size_class_info.h"
+#include "tcmalloc/sizemap.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using ::testing::HasSubstr;
+
+// Returns the bytes lost to rounding the sizes of <histogram> up to their
+// size classes.
+double InternalFragmentation(absl::Span<const SizeCount> histogram,
+                             absl::Span<const SizeClassInfo> size_classes) {
+  double waste = 0;
+  for (const SizeCount& entry : histogram) {
+    for (const SizeClassInfo& info : size_classes.subspan(1)) {
+      if (info.size >= entry.size) {
+        waste += entry.count * (info.size - entry.size);
+        break;
+      }
+    }
+  }
+  return waste;
+}
+
+TEST(SizeClassGeneratorTest, ReducesInternalFragmentation) {
+  // Sizes just above classes of the baseline.
+  const std::vector<SizeCount> histogram = {
+      {17, 1000}, {65, 5000}, {260, 300}, {1100, 100}, {5000, 20}};
+  const std::vector<SizeClassInfo> size_classes =
+      GenerateSizeClasses(histogram, kSizeClasses, kNumBaseClasses);
+
+  ASSERT_LE(size_classes.size(), kNumBaseClasses);
+  EXPECT_EQ(size_classes.back().size, kMaxSize);
+  EXPECT_LT(InternalFragmentation(histogram, size_classes),
+            InternalFragmentation(histogram, kSizeClasses));
+
+  // The result is a valid configuration.
+  std::vector<SizeClassInfo> parsed(kNumBaseClasses);
+  EXPECT_EQ(SizeMap::ParseSizeClasses(FormatSizeClasses(size_classes),
+                                      absl::MakeSpan(parsed)),
+            size_classes.size());
+}
+
+TEST(SizeClassGeneratorTest, FewClasses) {
+  const std::vector<SizeCount> histogram = {
+      {24, 1000}, {100, 10}, {4096, 500}, {10000, 1}};
+  constexpr size_t kMaxClasses = 4;
+  const std::vector<SizeClassInfo> size_classes =
+      GenerateSizeClasses(histogram, kSizeClasses, kMaxClasses);
+
+  ASSERT_EQ(size_classes.size(), kMaxClasses);
+  // The most popular sizes get exact size classes.
+  EXPECT_EQ(size_classes[1].size, 24);
+  EXPECT_EQ(size_classes[2].size, 4096);
+  EXPECT_EQ(size_classes[3].size, kMaxSize);
+
+  std::vector<SizeClassInfo> parsed(kNumBaseClasses);
+  EXPECT_EQ(SizeMap::ParseSizeClasses(FormatSizeClasses(size_classes),
+                                      absl::MakeSpan(parsed)),
+            kMaxClasses);
+}
+
+TEST(SizeClassGeneratorTest, EmptyHistogramKeepsBaseline) {
+  const std::vector<SizeClassInfo> size_classes =
+      GenerateSizeClasses({}, kSizeClasses, kNumBaseClasses);
+  ASSERT_EQ(size_classes.size(), kSizeClasses.size());
+  for (size_t i = 0; i < size_classes.size(); ++i) {
+    EXPECT_EQ(size_classes[i].size, kSizeClasses[i].size);
+    EXPECT_EQ(size_classes[i].pages, kSizeClasses[i].pages);
+  }
+}
+
+TEST(SizeClassGeneratorTest, FromProfile) {
+  std::vector<void*> ptrs;
+  for (int i = 0; i < 1000; ++i) {
+    ptrs.push_back(::operator new(3000));
+  }
+  const std::string size_classes = MallocExtension::GetSizeClassesForProfile(
+      MallocExtension::SnapshotCurrent(ProfileType::kHeap));
+  for (void* ptr : ptrs) {
+    ::operator delete(ptr);
+  }
+
+  // 3000 bytes, rounded up to 128-byte alignment.
+  EXPECT_THAT(size_classes, HasSubstr("\n3072 "));
+  std::vector<SizeClassInfo> parsed(kNumBaseClasses);
+  EXPECT_GT(SizeMap::ParseSizeClasses(size_classes, absl::MakeSpan(parsed)), 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
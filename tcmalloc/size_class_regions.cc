@@ -0,0 +1,161 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/size_class_regions.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+void SizeClassRegions::Init(AddressRange range) {
+  ASSERT(!enabled());
+  ASSERT(range.bytes >= kReservedBytes);
+  base_ = reinterpret_cast<uintptr_t>(range.ptr) - kRegionBytes;
+  size_ = kMaxClasses * kRegionBytes;
+  for (size_t size_class = 1; size_class < kMaxClasses; ++size_class) {
+    Region& r = regions_[size_class];
+    r.next = PageIdContaining(
+        reinterpret_cast<void*>(base_ + size_class * kRegionBytes));
+    r.limit = r.next + BytesToLengthFloor(kRegionBytes);
+  }
+}
+
+Span* SizeClassRegions::New(size_t size_class, Length n) {
+  ASSERT(Has(size_class));
+  Region& r = regions_[size_class];
+  Span* span;
+  if (!r.backed.empty()) {
+    span = r.backed.first();
+    r.backed.remove(span);
+    r.backed_free -= n;
+  } else if (!r.released.empty()) {
+    span = r.released.first();
+    r.released.remove(span);
+    r.released_free -= n;
+  } else {
+    if (r.limit - r.next < n || !tc_globals.pagemap().Ensure(r.next, n)) {
+      ++r.exhausted;
+      return nullptr;
+    }
+    span = Span::New(r.next, n);
+    span->set_known_zero(SystemMemoryIsZeroFilled());
+    r.next += n;
+    r.carved += n;
+    tc_globals.pagemap().Set(span->first_page(), span);
+    return span;
+  }
+  ASSERT(span->num_pages() == n);
+  span->Init(span->first_page(), n);
+  tc_globals.pagemap().Set(span->first_page(), span);
+  return span;
+}
+
+void SizeClassRegions::Delete(Span* span) {
+  const size_t size_class = SizeClass(span->start_address());
+  ASSERT(Has(size_class));
+  Region& r = regions_[size_class];
+  tc_globals.pagemap().Set(span->first_page(), nullptr);
+  r.backed.prepend(span);
+  r.backed_free += span->num_pages();
+}
+
+Length SizeClassRegions::ReleaseAtLeastNPages(Length n) {
+  Length released;
+  for (size_t size_class = 1; size_class < kMaxClasses && enabled() &&
+                              released < n;
+       ++size_class) {
+    Region& r = regions_[size_class];
+    while (!r.backed.empty() && released < n) {
+      // Spans are reused most recently freed first, so release the others.
+      Span* span = r.backed.last();
+      if (!SystemRelease(span->start_address(), span->bytes_in_span())) {
+        break;
+      }
+      r.backed.remove(span);
+      r.released.append(span);
+      r.backed_free -= span->num_pages();
+      r.released_free += span->num_pages();
+      released += span->num_pages();
+    }
+  }
+  return released;
+}
+
+BackingStats SizeClassRegions::stats() const {
+  BackingStats s;
+  for (size_t size_class = 1; size_class < kMaxClasses && enabled();
+       ++size_class) {
+    const Region& r = regions_[size_class];
+    s.system_bytes += r.carved.in_bytes();
+    s.free_bytes += r.backed_free.in_bytes();
+    s.unmapped_bytes += r.released_free.in_bytes();
+  }
+  return s;
+}
+
+void SizeClassRegions::Print(Printer* out) const {
+  if (!enabled()) return;
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  const BackingStats s = stats();
+  out->printf(
+      "------------------------------------------------\n"
+      "Size class regions: %zu classes, %zu MiB of address space each\n"
+      "Size class regions: %12.1f MiB carved, %12.1f MiB free, "
+      "%12.1f MiB released\n",
+      kMaxClasses - 1, kRegionBytes >> 20, s.system_bytes / 1048576.0,
+      s.free_bytes / 1048576.0, s.unmapped_bytes / 1048576.0);
+  for (size_t size_class = 1; size_class < kMaxClasses; ++size_class) {
+    const Region& r = regions_[size_class];
+    if (r.carved == Length(0)) continue;
+    out->printf(
+        "class %3zu [ %8zu bytes ] : %8zu pages carved, %8zu free, "
+        "%8zu released, %8zu exhausted\n",
+        size_class, tc_globals.sizemap().class_to_size(size_class),
+        r.carved.raw_num(), r.backed_free.raw_num(), r.released_free.raw_num(),
+        r.exhausted);
+  }
+}
+
+void SizeClassRegions::PrintInPbtxt(PbtxtRegion* region) const {
+  if (!enabled()) return;
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  for (size_t size_class = 1; size_class < kMaxClasses; ++size_class) {
+    const Region& r = regions_[size_class];
+    if (r.carved == Length(0)) continue;
+    PbtxtRegion entry = region->CreateSubRegion("size_class_region");
+    entry.PrintI64("sizeclass", size_class);
+    entry.PrintI64("carved_bytes", r.carved.in_bytes());
+    entry.PrintI64("free_bytes", r.backed_free.in_bytes());
+    entry.PrintI64("released_bytes", r.released_free.in_bytes());
+    entry.PrintI64("exhausted", r.exhausted);
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,134 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_SIZE_CLASS_REGIONS_H_
+#define TCMALLOC_SIZE_CLASS_REGIONS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "absl/base/attributes.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/stats.h"
+#include "tcmalloc/system-alloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Gives each of the first kMaxClasses size classes a range of address space of
+// its own, kRegionBytes long, that only ever holds spans of that class.  The
+// size class of an object in a region follows from its address alone, so that
+// unsized frees need not look it up in the pagemap.
+//
+// Spans freed back to a region stay there, for reuse by the same class: a
+// region's address space is never given to another class.  Free spans are
+// released to the OS like those of the page heap.  When a class runs out of
+// address space, its spans come from the page heap instead, and are looked up
+// in the pagemap as usual.
+class SizeClassRegions {
+ public:
+  static constexpr size_t kMaxClasses = std::min<size_t>(64, kNumBaseClasses);
+  // All regions are mapped read-write at once, so they are kept small enough
+  // that together they count for little against overcommit limits.
+  static constexpr int kRegionShift = 25;
+  static constexpr size_t kRegionBytes = size_t{1} << kRegionShift;
+
+  // The bytes of address space to pass to Init().  Size class 0 is never
+  // allocated, so it gets no region.
+  static constexpr size_t kReservedBytes = (kMaxClasses - 1) * kRegionBytes;
+
+  constexpr SizeClassRegions() = default;
+
+  SizeClassRegions(const SizeClassRegions&) = delete;
+  SizeClassRegions& operator=(const SizeClassRegions&) = delete;
+
+  // Carves the regions out of <range>, kReservedBytes long.
+  void Init(AddressRange range) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  bool enabled() const { return size_ != 0; }
+
+  // Returns true if spans of <size_class> come from its region.
+  bool Has(size_t size_class) const {
+    return enabled() && size_class != 0 && size_class < kMaxClasses;
+  }
+
+  // Returns the size class whose region holds <ptr>, or 0 if <ptr> is in none.
+  ABSL_ATTRIBUTE_ALWAYS_INLINE size_t SizeClass(const void* ptr) const {
+    const uintptr_t offset = reinterpret_cast<uintptr_t>(ptr) - base_;
+    return ABSL_PREDICT_TRUE(offset >= size_) ? 0 : offset >> kRegionShift;
+  }
+
+  // Returns true if <span> came from a region.
+  bool Contains(const Span* span) const {
+    return SizeClass(span->start_address()) != 0;
+  }
+
+  // Returns a span of <n> pages from the region of <size_class>, registered in
+  // the pagemap, or nullptr if the region has run out.
+  // REQUIRES: Has(size_class), and <n> is the same on every call for
+  // <size_class>.
+  Span* New(size_t size_class, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Returns <span> to its region.
+  // REQUIRES: Contains(span).
+  void Delete(Span* span) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Releases free spans to the OS until at least <n> pages are released, or
+  // none are left.  Returns the number of pages released.
+  Length ReleaseAtLeastNPages(Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // system_bytes counts the address space carved into spans so far.
+  BackingStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  void Print(Printer* out) const ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  void PrintInPbtxt(PbtxtRegion* region) const
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+ private:
+  struct Region {
+    // Pages in [next, limit) have not been carved into spans yet.
+    PageId next;
+    PageId limit;
+    // Free spans whose memory is backed, and released.
+    SpanList backed;
+    SpanList released;
+    Length carved;
+    Length backed_free;
+    Length released_free;
+    // Spans that could not be allocated for lack of address space.
+    size_t exhausted = 0;
+  };
+
+  // base_ is where the (nonexistent) region of size class 0 would start, so
+  // that the region of class c starts at base_ + c * kRegionBytes.
+  uintptr_t base_ = 0;
+  size_t size_ = 0;
+  Region regions_[kMaxClasses];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SIZE_CLASS_REGIONS_H_
@@ -0,0 +1,155 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/size_class_regions.h"
+
+#include <stddef.h>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/system-alloc.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class SizeClassRegionsTest : public ::testing::Test {
+ protected:
+  SizeClassRegionsTest() {
+    tc_globals.InitIfNecessary();
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    AddressRange range = SystemAlloc(SizeClassRegions::kReservedBytes,
+                                     kMinSystemAlloc, MemoryTag::kNormal);
+    CHECK_CONDITION(range.ptr != nullptr);
+    regions_.Init(range);
+  }
+
+  Span* New(size_t size_class, Length n) {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    return regions_.New(size_class, n);
+  }
+
+  void Delete(Span* span) {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    regions_.Delete(span);
+  }
+
+  BackingStats stats() {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    return regions_.stats();
+  }
+
+  SizeClassRegions regions_;
+};
+
+TEST(SizeClassRegionsDisabledTest, OwnsNothing) {
+  SizeClassRegions regions;
+  int local;
+  EXPECT_FALSE(regions.enabled());
+  EXPECT_FALSE(regions.Has(1));
+  EXPECT_EQ(regions.SizeClass(&local), 0);
+  EXPECT_EQ(regions.SizeClass(nullptr), 0);
+}
+
+TEST_F(SizeClassRegionsTest, SizeClassFollowsFromAddress) {
+  EXPECT_FALSE(regions_.Has(0));
+  EXPECT_FALSE(regions_.Has(SizeClassRegions::kMaxClasses));
+  for (size_t size_class :
+       {size_t{1}, size_t{7}, SizeClassRegions::kMaxClasses - 1}) {
+    ASSERT_TRUE(regions_.Has(size_class));
+    Span* span = New(size_class, Length(2));
+    ASSERT_NE(span, nullptr);
+    EXPECT_EQ(span->num_pages(), Length(2));
+    EXPECT_EQ(tc_globals.pagemap().GetDescriptor(span->first_page()), span);
+    EXPECT_TRUE(regions_.Contains(span));
+
+    char* start = static_cast<char*>(span->start_address());
+    EXPECT_EQ(regions_.SizeClass(start), size_class);
+    EXPECT_EQ(regions_.SizeClass(start + span->bytes_in_span() - 1),
+              size_class);
+    Delete(span);
+  }
+
+  int local;
+  EXPECT_EQ(regions_.SizeClass(&local), 0);
+}
+
+TEST_F(SizeClassRegionsTest, ReusesFreedSpans) {
+  Span* a = New(3, Length(1));
+  Span* b = New(3, Length(1));
+  ASSERT_NE(a, nullptr);
+  ASSERT_NE(b, nullptr);
+  EXPECT_EQ(b->first_page(), a->first_page() + Length(1));
+  EXPECT_EQ(stats().system_bytes, Length(2).in_bytes());
+
+  void* freed = a->start_address();
+  Delete(a);
+  EXPECT_EQ(tc_globals.pagemap().GetDescriptor(PageIdContaining(freed)),
+            nullptr);
+  EXPECT_EQ(stats().free_bytes, Length(1).in_bytes());
+
+  // The freed span is reused before any more address space is carved.
+  Span* c = New(3, Length(1));
+  ASSERT_NE(c, nullptr);
+  EXPECT_EQ(c->start_address(), freed);
+  EXPECT_EQ(stats().system_bytes, Length(2).in_bytes());
+  EXPECT_EQ(stats().free_bytes, 0);
+
+  Delete(b);
+  Delete(c);
+}
+
+TEST_F(SizeClassRegionsTest, ReleasesFreeSpans) {
+  Span* span = New(5, Length(4));
+  ASSERT_NE(span, nullptr);
+  void* start = span->start_address();
+  Delete(span);
+
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    EXPECT_EQ(regions_.ReleaseAtLeastNPages(Length(1)), Length(4));
+    EXPECT_EQ(regions_.ReleaseAtLeastNPages(Length(1)), Length(0));
+  }
+  BackingStats s = stats();
+  EXPECT_EQ(s.free_bytes, 0);
+  EXPECT_EQ(s.unmapped_bytes, Length(4).in_bytes());
+
+  span = New(5, Length(4));
+  ASSERT_NE(span, nullptr);
+  EXPECT_EQ(span->start_address(), start);
+  EXPECT_EQ(stats().unmapped_bytes, 0);
+  Delete(span);
+}
+
+TEST_F(SizeClassRegionsTest, RunsOutOfAddressSpace) {
+  const Length half =
+      BytesToLengthFloor(SizeClassRegions::kRegionBytes) / 2 + Length(1);
+  Span* span = New(9, half);
+  ASSERT_NE(span, nullptr);
+  EXPECT_EQ(New(9, half), nullptr);
+  // Other classes are unaffected.
+  Span* other = New(10, half);
+  ASSERT_NE(other, nullptr);
+  Delete(span);
+  Delete(other);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
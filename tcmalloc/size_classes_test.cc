@@ -401,6 +401,27 @@ TEST(SizeMapTest, GetSizeClassWithAlignment) {
   }
 }
 
+TEST(SizeMapTest, GetSizeClassWithDedicatedAlignment) {
+  SizeMap m;
+  m.Init(kSizeClasses);
+
+  for (size_t alignment : {size_t{64}, size_t{4096}}) {
+    for (size_t size = 0; size <= kMaxSize; size += 8) {
+      uint32_t size_class;
+      ASSERT_TRUE(
+          m.GetSizeClass(CppPolicy().AlignAs(alignment), size, &size_class))
+          << size << " " << alignment;
+      // The lookup finds the smallest suitably aligned class holding size.
+      uint32_t expected = 1;
+      while (m.class_to_size(expected) < size ||
+             m.class_to_size(expected) % alignment != 0) {
+        ++expected;
+      }
+      ASSERT_EQ(size_class, expected) << size << " " << alignment;
+    }
+  }
+}
+
 TEST(SizeMapTest, SizeClass) {
   absl::BitGen rng;
   constexpr int kTrials = 1000;
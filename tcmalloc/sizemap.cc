@@ -14,17 +14,26 @@
 
 #include "tcmalloc/sizemap.h"
 
+#include <errno.h>
+#include <fcntl.h>
+
 #include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <new>
 
+#include "absl/base/attributes.h"
 #include "absl/base/macros.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_page_aware_allocator.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/util.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/size_class_info.h"
 #include "tcmalloc/span.h"
@@ -175,6 +184,79 @@ bool SizeMap::ValidSizeClasses(absl::Span<const SizeClassInfo> size_classes) {
   return true;
 }
 
+// Pops the next whitespace-separated field of <line> into <value>.
+static bool ConsumeField(absl::string_view& line, uint32_t* value) {
+  line = absl::StripLeadingAsciiWhitespace(line);
+  size_t end = 0;
+  while (end < line.size() && !absl::ascii_isspace(line[end])) ++end;
+  if (end == 0 || !absl::SimpleAtoi(line.substr(0, end), value)) {
+    return false;
+  }
+  line.remove_prefix(end);
+  return true;
+}
+
+size_t SizeMap::ParseSizeClasses(absl::string_view text,
+                                 absl::Span<SizeClassInfo> out) {
+  if (out.empty()) return 0;
+  out[0] = {0, 0, 0, 0};
+  size_t num_classes = 1;
+  while (!text.empty()) {
+    const size_t eol = std::min(text.find('\n'), text.size());
+    absl::string_view line = text.substr(0, eol);
+    text.remove_prefix(std::min(eol + 1, text.size()));
+    line = line.substr(0, std::min(line.find('#'), line.size()));
+    if (absl::StripAsciiWhitespace(line).empty()) continue;
+
+    uint32_t size, pages, num_to_move, max_capacity;
+    if (!ConsumeField(line, &size) || !ConsumeField(line, &pages) ||
+        !ConsumeField(line, &num_to_move) ||
+        !ConsumeField(line, &max_capacity) ||
+        !absl::StripAsciiWhitespace(line).empty() || pages > UINT8_MAX ||
+        num_to_move > UINT8_MAX) {
+      Log(kLog, __FILE__, __LINE__, "malformed size class", num_classes);
+      return 0;
+    }
+    if (num_classes == out.size()) {
+      Log(kLog, __FILE__, __LINE__, "too many size classes", out.size());
+      return 0;
+    }
+    out[num_classes++] = {size, static_cast<uint8_t>(pages),
+                          static_cast<uint8_t>(num_to_move), max_capacity};
+  }
+  if (!ValidSizeClasses(out.first(num_classes))) return 0;
+  return num_classes;
+}
+
+size_t SizeMap::LoadSizeClasses(const char* path,
+                                absl::Span<SizeClassInfo> out) {
+  // Size classes are loaded before anything can be allocated, so read into
+  // static storage, which pageheap_lock protects.
+  ABSL_CONST_INIT static char buf[16 << 10];
+  const int fd = signal_safe_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    Log(kLog, __FILE__, __LINE__, "cannot open size class file", path, errno);
+    return 0;
+  }
+  size_t len = 0;
+  for (;;) {
+    const ssize_t rc =
+        signal_safe_read(fd, buf + len, sizeof(buf) - len, nullptr);
+    if (rc <= 0) {
+      if (rc < 0) len = sizeof(buf);
+      break;
+    }
+    len += rc;
+    if (len == sizeof(buf)) break;
+  }
+  signal_safe_close(fd);
+  if (len == sizeof(buf)) {
+    Log(kLog, __FILE__, __LINE__, "cannot read size class file", path);
+    return 0;
+  }
+  return ParseSizeClasses(absl::string_view(buf, len), out);
+}
+
 // Initialize the mapping arrays
 bool SizeMap::Init(absl::Span<const SizeClassInfo> size_classes) {
   // Do some sanity checking on add_amount[]/shift_amount[]/class_array[]
@@ -207,6 +289,23 @@ bool SizeMap::Init(absl::Span<const SizeClassInfo> size_classes) {
     }
   }
 
+  // Since kMaxSize is a multiple of kPageSize, the search for a suitably
+  // aligned class always terminates within the base classes.
+  static_assert(kMaxSize % kPageSize == 0);
+  static_assert(kDedicatedAlignments[kNumDedicatedAlignments - 1] <=
+                kPageSize);
+  for (size_t i = 0; i < kNumDedicatedAlignments; ++i) {
+    const size_t align = kDedicatedAlignments[i];
+    for (size_t idx = 0; idx < kClassArraySize; ++idx) {
+      size_t c = class_array_[idx];
+      while (class_to_size_[c] & (align - 1)) {
+        ++c;
+      }
+      CHECK_CONDITION(c < kNumBaseClasses);
+      aligned_class_array_[i][idx] = c;
+    }
+  }
+
   if (!ColdFeatureActive()) {
     return true;
   }
@@ -22,7 +22,9 @@
 #include "absl/base/attributes.h"
 #include "absl/base/dynamic_annotations.h"
 #include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/numeric/bits.h"
+#include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
@@ -160,6 +162,27 @@ class SizeMap {
   // Mapping from size class to max size storable in that class
   uint32_t class_to_size_[kNumClasses] = {0};
 
+  // Alignments common enough (cache lines and pages) that GetSizeClass looks
+  // up their smallest suitably aligned class directly, rather than searching
+  // upwards from the class of the unaligned size.
+  static constexpr size_t kDedicatedAlignments[] = {64, 4096};
+  static constexpr size_t kNumDedicatedAlignments =
+      sizeof(kDedicatedAlignments) / sizeof(kDedicatedAlignments[0]);
+
+  ABSL_ATTRIBUTE_ALWAYS_INLINE static inline bool DedicatedAlignmentIndex(
+      size_t align, size_t& i) {
+    for (i = 0; i < kNumDedicatedAlignments; ++i) {
+      if (align == kDedicatedAlignments[i]) return true;
+    }
+    return false;
+  }
+
+  // Like the lower register of class_array_, but indexed by the dedicated
+  // alignment as well, and only holding classes whose size is a multiple of
+  // it.
+  CompactSizeClass aligned_class_array_[kNumDedicatedAlignments]
+                                       [kClassArraySize] = {{0}};
+
  protected:
   // Set the give size classes to be used by TCMalloc.
   bool SetSizeClasses(absl::Span<const SizeClassInfo> size_classes);
@@ -178,6 +201,19 @@ class SizeMap {
   // Initialize the mapping arrays.  Returns true on success.
   bool Init(absl::Span<const SizeClassInfo> size_classes);
 
+  // Parses <text>, a size class configuration with one size class per line
+  // ("bytes pages batch cap", as in size_classes.cc, with '#' starting a
+  // comment), into <out>, after the implicit size class 0.  Returns the number
+  // of size classes, including size class 0, or 0 if <text> is malformed, does
+  // not fit into <out> or fails ValidSizeClasses.  Does not allocate.
+  static size_t ParseSizeClasses(absl::string_view text,
+                                 absl::Span<SizeClassInfo> out);
+
+  // Like ParseSizeClasses, with the contents of the file at <path>.
+  static size_t LoadSizeClasses(const char* path,
+                                absl::Span<SizeClassInfo> out)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Returns the size class for size `size` respecting the alignment
   // & access requirements of `policy`.
   //
@@ -210,9 +246,20 @@ class SizeMap {
       ABSL_ANNOTATE_MEMORY_IS_UNINITIALIZED(size_class, sizeof(*size_class));
       return false;
     }
-    if (kHasExpandedClasses && IsColdHint(policy.access())) {
+    const bool cold = kHasExpandedClasses && IsColdHint(policy.access());
+    if (cold) {
       *size_class = class_array_[idx + kClassArraySize];
     } else {
+      // Cache line and page aligned requests (e.g. alignas(64) types with
+      // operator new) are common, so look them up without searching.
+      size_t i;
+      if (!(__builtin_constant_p(align) &&
+            align <= static_cast<size_t>(kAlignment)) &&
+          DedicatedAlignmentIndex(align, i)) {
+        *size_class =
+            aligned_class_array_[i][idx] + policy.scaled_numa_partition();
+        return true;
+      }
       *size_class = class_array_[idx] + policy.scaled_numa_partition();
     }
 
@@ -253,6 +300,22 @@ class SizeMap {
     return ret;
   }
 
+  // Like GetSizeClass for the default alignment and access, but for a size
+  // whose index into class_array_ was computed ahead of time (at compile time
+  // by tcmalloc::AllocateFixed).  Returns false if the size exceeds the
+  // maximum size class size.
+  template <typename Policy>
+  ABSL_ATTRIBUTE_ALWAYS_INLINE inline bool GetSizeClassAtIndex(
+      Policy policy, size_t size, size_t idx, uint32_t* size_class) const {
+    if (ABSL_PREDICT_FALSE(size > kMaxSize)) {
+      ABSL_ANNOTATE_MEMORY_IS_UNINITIALIZED(size_class, sizeof(*size_class));
+      return false;
+    }
+    ASSERT(idx == ClassIndex(size));
+    *size_class = class_array_[idx] + policy.scaled_numa_partition();
+    return true;
+  }
+
   // Get the byte-size for a specified class. REQUIRES: size_class <=
   // kNumClasses.
   ABSL_ATTRIBUTE_ALWAYS_INLINE inline size_t class_to_size(
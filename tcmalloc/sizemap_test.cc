@@ -16,11 +16,16 @@
 
 #include <algorithm>
 #include <cstddef>
+#include <fstream>
+#include <string>
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/size_class_info.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
@@ -108,4 +113,97 @@ TEST(ColdSizeClassTest, VerifyAllocationFullRange) {
   }
 }
 
+std::string FormatLines(absl::Span<const SizeClassInfo> size_classes) {
+  std::string text;
+  for (const SizeClassInfo& info : size_classes.subspan(1)) {
+    absl::StrAppend(&text, info.size, " ", info.pages, " ", info.num_to_move,
+                    " ", info.max_capacity, "\n");
+  }
+  return text;
+}
+
+TEST(SizeMapTest, FixedSizeIndexMatchesGetSizeClass) {
+  SizeMap size_map;
+  ASSERT_TRUE(size_map.Init(kSizeClasses));
+  for (size_t size = 0; size <= kMaxSize; ++size) {
+    uint32_t expected, actual;
+    ASSERT_TRUE(size_map.GetSizeClass(CppPolicy(), size, &expected));
+    ASSERT_TRUE(size_map.GetSizeClassAtIndex(
+        CppPolicy(), size, FixedSizeIndex(size), &actual))
+        << size;
+    EXPECT_EQ(actual, expected) << size;
+  }
+  uint32_t size_class;
+  EXPECT_FALSE(size_map.GetSizeClassAtIndex(
+      CppPolicy(), kMaxSize + 1, FixedSizeIndex(kMaxSize + 1), &size_class));
+}
+
+TEST(ParseSizeClassesTest, RoundTrip) {
+  std::vector<SizeClassInfo> parsed(kNumBaseClasses);
+  const std::string text =
+      absl::StrCat("# bytes pages batch cap\n\n", FormatLines(kSizeClasses));
+  ASSERT_EQ(SizeMap::ParseSizeClasses(text, absl::MakeSpan(parsed)),
+            kSizeClasses.size());
+  for (size_t i = 0; i < kSizeClasses.size(); ++i) {
+    EXPECT_EQ(parsed[i].size, kSizeClasses[i].size);
+    EXPECT_EQ(parsed[i].pages, kSizeClasses[i].pages);
+    EXPECT_EQ(parsed[i].num_to_move, kSizeClasses[i].num_to_move);
+    EXPECT_EQ(parsed[i].max_capacity, kSizeClasses[i].max_capacity);
+  }
+
+  SizeMap size_map;
+  EXPECT_TRUE(size_map.Init(absl::MakeSpan(parsed).first(kSizeClasses.size())));
+}
+
+TEST(ParseSizeClassesTest, Invalid) {
+  std::vector<SizeClassInfo> parsed(kNumBaseClasses);
+  const std::string valid = FormatLines(kSizeClasses);
+  const std::string last_class =
+      absl::StrCat(kMaxSize, " ", kSizeClasses.back().pages, " 2 8\n");
+
+  EXPECT_EQ(SizeMap::ParseSizeClasses("", absl::MakeSpan(parsed)), 0);
+  // Malformed lines.
+  EXPECT_EQ(SizeMap::ParseSizeClasses(absl::StrCat("8 1 32\n", last_class),
+                                      absl::MakeSpan(parsed)),
+            0);
+  EXPECT_EQ(SizeMap::ParseSizeClasses(
+                absl::StrCat("8 1 32 2024 7\n", last_class),
+                absl::MakeSpan(parsed)),
+            0);
+  EXPECT_EQ(SizeMap::ParseSizeClasses(absl::StrCat("8 one 32 8\n", last_class),
+                                      absl::MakeSpan(parsed)),
+            0);
+  // Misaligned, decreasing, not covering kMaxSize.
+  EXPECT_EQ(SizeMap::ParseSizeClasses(absl::StrCat("12 1 32 8\n", last_class),
+                                      absl::MakeSpan(parsed)),
+            0);
+  EXPECT_EQ(SizeMap::ParseSizeClasses(
+                absl::StrCat("16 1 32 8\n8 1 32 8\n", last_class),
+                absl::MakeSpan(parsed)),
+            0);
+  EXPECT_EQ(SizeMap::ParseSizeClasses("8 1 32 8\n", absl::MakeSpan(parsed)), 0);
+  // Too many classes for the output.
+  EXPECT_EQ(SizeMap::ParseSizeClasses(valid, absl::MakeSpan(parsed).first(2)),
+            0);
+
+  EXPECT_EQ(SizeMap::ParseSizeClasses(last_class, absl::MakeSpan(parsed)), 2);
+}
+
+TEST(ParseSizeClassesTest, LoadFromFile) {
+  const std::string path = absl::StrCat(testing::TempDir(), "/size_classes");
+  std::ofstream(path) << FormatLines(kSizeClasses);
+  const std::string missing = absl::StrCat(path, ".missing");
+
+  std::vector<SizeClassInfo> parsed(kNumBaseClasses);
+  size_t loaded, not_loaded;
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    loaded = SizeMap::LoadSizeClasses(path.c_str(), absl::MakeSpan(parsed));
+    not_loaded =
+        SizeMap::LoadSizeClasses(missing.c_str(), absl::MakeSpan(parsed));
+  }
+  EXPECT_EQ(loaded, kSizeClasses.size());
+  EXPECT_EQ(not_loaded, 0);
+}
+
 }  // namespace tcmalloc::tcmalloc_internal
@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstddef>
 
@@ -36,16 +37,10 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 
 void Span::Sample(SampledAllocation* sampled_allocation) {
-  CHECK_CONDITION(!sampled_ && sampled_allocation);
+  CHECK_CONDITION(!sampled_ && !sampled_slab_ && sampled_allocation);
   sampled_ = 1;
   sampled_allocation_ = sampled_allocation;
-
-  // The cast to value matches Unsample.
-  tcmalloc_internal::StatsCounter::Value allocated_bytes =
-      static_cast<tcmalloc_internal::StatsCounter::Value>(
-          AllocatedBytes(sampled_allocation->sampled_stack));
-  tc_globals.sampled_objects_size_.Add(allocated_bytes);
-  tc_globals.total_sampled_count_.Add(1);
+  AddSampledAllocation(sampled_allocation);
 }
 
 SampledAllocation* Span::Unsample() {
@@ -56,14 +51,30 @@ SampledAllocation* Span::Unsample() {
   sampled_ = 0;
   SampledAllocation* sampled_allocation = sampled_allocation_;
   sampled_allocation_ = nullptr;
+  RemoveSampledAllocation(sampled_allocation);
+  return sampled_allocation;
+}
 
+void Span::AddSampledAllocation(const SampledAllocation* sampled_allocation) {
+  // The cast to value matches RemoveSampledAllocation.
+  tcmalloc_internal::StatsCounter::Value allocated_bytes =
+      static_cast<tcmalloc_internal::StatsCounter::Value>(
+          AllocatedBytes(sampled_allocation->sampled_stack));
+  tc_globals.sampled_objects_size_.Add(allocated_bytes);
+  tc_globals.total_sampled_count_.Add(1);
+  tc_globals.sampled_weight_allocated_.Add(
+      sampled_allocation->sampled_stack.weight);
+}
+
+void Span::RemoveSampledAllocation(
+    const SampledAllocation* sampled_allocation) {
   // The cast to Value ensures no funny business happens during the negation if
   // sizeof(size_t) != sizeof(Value).
   tcmalloc_internal::StatsCounter::Value neg_allocated_bytes =
       -static_cast<tcmalloc_internal::StatsCounter::Value>(
           AllocatedBytes(sampled_allocation->sampled_stack));
   tc_globals.sampled_objects_size_.Add(neg_allocated_bytes);
-  return sampled_allocation;
+  tc_globals.sampled_weight_freed_.Add(sampled_allocation->sampled_stack.weight);
 }
 
 double Span::Fragmentation(size_t object_size) const {
@@ -136,16 +147,13 @@ size_t Span::BitmapPopBatch(void** __restrict batch, size_t N, size_t size) {
   size_t before = bitmap_.CountBits(0, bitmap_.size());
 #endif  // NDEBUG
 
-  size_t count = 0;
   // Want to fill the batch either with N objects, or the number of objects
   // remaining in the span.
-  while (!bitmap_.IsZero() && count < N) {
-    size_t offset = bitmap_.FindSet(0);
+  void** out = batch;
+  const size_t count = bitmap_.ClearLowestBits(N, [&](size_t offset) {
     ASSERT(offset < bitmap_.size());
-    batch[count] = BitmapIdxToPtr(offset, size);
-    bitmap_.ClearLowestBit();
-    count++;
-  }
+    *out++ = BitmapIdxToPtr(offset, size);
+  });
 
   ASSERT(bitmap_.CountBits(0, bitmap_.size()) + count == before);
   allocated_.store(allocated_.load(std::memory_order_relaxed) + count,
@@ -219,6 +227,53 @@ size_t Span::ListPopBatch(void** __restrict batch, size_t N, size_t size) {
   return result;
 }
 
+void* Span::LiveObjects(size_t size, size_t count, ObjectBitmap* live) const {
+  ASSERT(count <= kMaxObjects);
+  live->Clear();
+  live->SetRange(0, count);
+  if (UseBitmapForSize(size)) {
+    for (size_t i = 0; i < count; ++i) {
+      if (bitmap_.GetBit(i)) live->ClearBit(i);
+    }
+    return start_address();
+  }
+
+  // Freelist indices count kAlignment units from the start of the span; map
+  // them back to object numbers, and stop at the first that is not one.
+  const uintptr_t start = first_page_.start_uintptr();
+  const size_t offset = colored_ ? ColorOffset(first_page_, size, count) : 0;
+  void* const first = reinterpret_cast<void*>(start + offset);
+  auto mark_free = [&](ObjIdx idx) {
+    const size_t off = static_cast<size_t>(idx) << kAlignmentShift;
+    if (off < offset || (off - offset) % size != 0) return false;
+    const size_t i = (off - offset) / size;
+    if (i >= count) return false;
+    live->ClearBit(i);
+    return true;
+  };
+
+  for (size_t i = 0; i < std::min<size_t>(cache_size_, kCacheSize); ++i) {
+    if (!mark_free(cache_[i])) return first;
+  }
+  // Each object on the list holds the link to the next in its first slot,
+  // followed by embed_count_ (for the first) or all (for the rest) of the
+  // slots it has room for.  Bound the walk by count in case of a cycle.
+  const size_t max_embed = size / sizeof(ObjIdx) - 1;
+  size_t embed = std::min<size_t>(embed_count_, max_embed);
+  ObjIdx idx = freelist_;
+  for (size_t n = 0; idx != kListEnd && n < count; ++n) {
+    if (!mark_free(idx)) return first;
+    const ObjIdx* host = reinterpret_cast<const ObjIdx*>(
+        start + (static_cast<uintptr_t>(idx) << kAlignmentShift));
+    for (size_t j = 1; j <= embed; ++j) {
+      if (!mark_free(host[j])) return first;
+    }
+    idx = host[0];
+    embed = max_embed;
+  }
+  return first;
+}
+
 uint32_t Span::CalcReciprocal(size_t size) {
   // Calculate scaling factor. We want to avoid dividing by the size of the
   // object. Instead we'll multiply by a scaled version of the reciprocal.
@@ -239,28 +294,48 @@ void Span::BuildBitmap(size_t size, size_t count) {
   ASSERT(bitmap_.CountBits(0, bitmap_.size()) == count);
 }
 
-int Span::BuildFreelist(size_t size, size_t count, void** batch, int N) {
+int Span::BuildFreelist(size_t size, size_t count, void** batch, int N,
+                        bool color) {
   ASSERT(count > 0);
   freelist_ = kListEnd;
 
   if (UseBitmapForSize(size)) {
+    // A fresh span hands out its leading objects, so fill the batch directly
+    // and only record the remainder in the bitmap.
+    const size_t result = N <= count ? N : count;
     BuildBitmap(size, count);
-    return BitmapPopBatch(batch, N, size);
+    if (result > 0) {
+      bitmap_.ClearRange(0, result);
+    }
+    for (size_t i = 0; i < result; ++i) {
+      batch[i] = BitmapIdxToPtr(i, size);
+    }
+    allocated_.store(result, std::memory_order_relaxed);
+    return result;
   }
 
+  remote_free_.store(0, std::memory_order_relaxed);
+
+  // Freelist indices are offsets from the start of the span, so a colored
+  // span simply starts its objects further into the page.
+  colored_ = color;
+  const size_t offset = color ? ColorOffset(first_page_, size, count) : 0;
+  ASSERT(offset % static_cast<size_t>(kAlignment) == 0);
+
   // First, push as much as we can into the batch.
   const uintptr_t start = first_page_.start_uintptr();
-  char* ptr = reinterpret_cast<char*>(start);
+  char* const ptr = reinterpret_cast<char*>(start + offset);
   int result = N <= count ? N : count;
   for (int i = 0; i < result; ++i) {
-    batch[i] = ptr;
-    ptr += size;
+    batch[i] = ptr + i * size;
   }
   allocated_.store(result, std::memory_order_relaxed);
 
   const ObjIdx idxStep = size / static_cast<size_t>(kAlignment);
-  // Valid objects are {0, idxStep, idxStep * 2, ..., idxStep * (count - 1)}.
-  ObjIdx idx = idxStep * result;
+  const ObjIdx idxStart = offset / static_cast<size_t>(kAlignment);
+  // Valid objects are {idxStart, idxStart + idxStep, ...,
+  // idxStart + idxStep * (count - 1)}.
+  ObjIdx idx = idxStart + idxStep * result;
 
   // Verify that the end of the useful portion of the span (and the beginning of
   // the span waste) has an index that doesn't overflow or risk confusion with
@@ -268,10 +343,10 @@ int Span::BuildFreelist(size_t size, size_t count, void** batch, int N) {
   // PtrToIdx for that) but rules out some bugs and weakening it wouldn't
   // actually help. One example of the potential bugs that are ruled out is the
   // possibility of idxEnd (below) overflowing.
-  ASSERT(count * idxStep < kListEnd);
+  ASSERT(idxStart + count * idxStep < kListEnd);
 
   // The index of the end of the useful portion of the span.
-  ObjIdx idxEnd = count * idxStep;
+  ObjIdx idxEnd = idxStart + count * idxStep;
 
   // Then, push as much as we can into the cache_.
   int cache_size = 0;
@@ -285,26 +360,30 @@ int Span::BuildFreelist(size_t size, size_t count, void** batch, int N) {
   // Note: we take freelist objects from the beginning and stacked objects
   // from the end. This has a nice property of not paging in whole span at once
   // and not draining whole cache.
-  ObjIdx* host = nullptr;  // cached first object on freelist
   const size_t max_embed = size / sizeof(ObjIdx) - 1;
-  int embed_count = 0;
-  while (idx < idxEnd) {
+  size_t remaining = count - result - cache_size;
+  size_t embed_count = 0;
+  while (remaining > 0) {
     // Check the no idx can be confused with kListEnd.
     ASSERT(idx != kListEnd);
-    if (host && embed_count != max_embed) {
-      // Push onto first object on the freelist.
-      embed_count++;
-      idxEnd -= idxStep;
-      host[embed_count] = idxEnd;
-    } else {
-      // The first object is full, push new object onto freelist.
-      host = IdxToPtr(idx, size, start);
-      host[0] = freelist_;
-      freelist_ = idx;
-      embed_count = 0;
-      idx += idxStep;
+    // Push a new object onto the freelist.
+    ObjIdx* host = IdxToPtr(idx, size, start);
+    host[0] = freelist_;
+    freelist_ = idx;
+    idx += idxStep;
+    --remaining;
+
+    // Stack as many of the remaining objects as fit onto it.  The indices
+    // form an arithmetic sequence, computed without a dependency between
+    // slots so that the compiler can vectorize the loop.
+    embed_count = std::min(remaining, max_embed);
+    for (size_t i = 1; i <= embed_count; ++i) {
+      host[i] = idxEnd - i * idxStep;
     }
+    idxEnd -= embed_count * idxStep;
+    remaining -= embed_count;
   }
+  ASSERT(idx == idxEnd);
   embed_count_ = embed_count;
   return result;
 }
@@ -21,9 +21,11 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <limits>
 
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
@@ -76,6 +78,9 @@ struct SpanAllocInfo {
 //  - SAMPLED: the span holds a single sampled object.
 //    The span can be considered to be owner by user until the object is freed.
 //    location_ == IN_USE && sampled_ == 1.
+//  - SAMPLED_SLAB: the span holds several sampled objects of one size class,
+//    which share its pages (see sampled_slabs.h).
+//    location_ == IN_USE && sampled_slab_ == 1.
 //  - ON_NORMAL_FREELIST: the span has no allocated objects, owned by PageHeap
 //    and is on normal PageHeap list.
 //    location_ == ON_NORMAL_FREELIST.
@@ -84,8 +89,9 @@ struct SpanAllocInfo {
 //    location_ == ON_RETURNED_FREELIST.
 class Span;
 typedef TList<Span> SpanList;
+class SampledSlab;
 
-class Span : public SpanList::Elem {
+class alignas(16) Span : public SpanList::Elem {
  public:
   // Allocator/deallocator for spans. Note that these functions are defined
   // in static_vars.h, which is weird: see there for why.
@@ -93,6 +99,13 @@ class Span : public SpanList::Elem {
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   static void Delete(Span* span) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // As above, for callers that do not hold pageheap_lock.  These draw on
+  // per-CPU caches of span metadata and only take pageheap_lock to refill or
+  // drain them.
+  static Span* NewUnlocked(PageId p, Length len)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  static void DeleteUnlocked(Span* span) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
   // locations used to track what list a span resides on.
   enum Location {
     IN_USE,                // not on PageHeap lists
@@ -131,8 +144,43 @@ class Span : public SpanList::Elem {
   // that sampling state can't be changed concurrently.
   bool sampled() const;
 
+  // Update the global counters on sampled allocations for
+  // <sampled_allocation> becoming, or ceasing to be, sampled.  Sample() and
+  // Unsample() call these; so do sampled slabs for each of their objects.
+  static void AddSampledAllocation(const SampledAllocation* sampled_allocation);
+  static void RemoveSampledAllocation(
+      const SampledAllocation* sampled_allocation);
+
+  // Returns the slab of sampled objects this span holds, or nullptr if this is
+  // not a SAMPLED_SLAB span.  Like sampled(), this is not guarded by
+  // pageheap_lock: a span only changes state while it is unreachable by other
+  // threads.
+  SampledSlab* sampled_slab() const;
+  // Puts this span in, or with nullptr takes it out of, the SAMPLED_SLAB state.
+  void set_sampled_slab(SampledSlab* slab);
+
   bool donated() const { return is_donated_; }
   void set_donated(bool value) { is_donated_ = value; }
+
+  // Were all the pages of this span known to read as zero when the page heap
+  // handed it out?  Only meaningful immediately after allocation, and only for
+  // page-level allocations.
+  bool known_zero() const { return known_zero_; }
+  void set_known_zero(bool value) { known_zero_ = value; }
+
+  // Was the hugepage of this span less than half used when the page heap
+  // handed the span out?  A hint for CentralFreeList, which allocates from
+  // spans on fuller hugepages first so that emptier ones may drain.
+  bool low_occupancy_hugepage() const { return low_occupancy_hugepage_; }
+  void set_low_occupancy_hugepage(bool value) {
+    low_occupancy_hugepage_ = value;
+  }
+
+  // The allocation domain this page-level allocation is charged to, or
+  // kUnchargedDomain.  Not meaningful for SMALL_OBJECT spans.
+  static constexpr uint8_t kUnchargedDomain = 0xff;
+  uint8_t allocation_domain() const { return allocation_domain_; }
+  void set_allocation_domain(uint8_t domain) { allocation_domain_ = domain; }
   // ---------------------------------------------------------------------------
   // Span memory range.
   // ---------------------------------------------------------------------------
@@ -172,6 +220,12 @@ class Span : public SpanList::Elem {
   // Records an index of the non-empty list associated with this span.
   void set_nonempty_index(uint8_t index) { nonempty_index_ = index; }
 
+  // Shard of the sharded CentralFreeList that owns this span.  Always 0 when
+  // the central freelist is not sharded.
+  uint8_t freelist_shard() const { return freelist_shard_; }
+
+  void set_freelist_shard(uint8_t shard) { freelist_shard_ = shard; }
+
   // ---------------------------------------------------------------------------
   // Freelist management.
   // Used for spans in CentralFreelist to manage free objects.
@@ -193,13 +247,61 @@ class Span : public SpanList::Elem {
   // Returns number of objects actually popped.
   size_t FreelistPopBatch(void** batch, size_t N, size_t size);
 
+  // The most objects a span holds: freelist-managed spans are a single page
+  // of objects of at least kAlignment bytes, and bitmap-managed spans hold at
+  // most kBitmapSize objects.
+  static constexpr size_t kMaxObjects = kPageSize >> kAlignmentShift;
+  using ObjectBitmap = Bitmap<kMaxObjects>;
+
+  // Sets bit i of <live> for each object i of the <count> objects of <size>
+  // bytes that is not on the freelist, clears the rest, and returns the
+  // address of object 0.  Objects on the remote free list count as live.
+  // Requires the lock of the owning CentralFreeList, but tolerates a freelist
+  // being built concurrently: that may give a wrong answer, but never reads
+  // outside the span's pages.
+  void* LiveObjects(size_t size, size_t count, ObjectBitmap* live) const;
+
+  // ---------------------------------------------------------------------------
+  // Remote free list.
+  // Objects freed by threads that do not hold the CentralFreeList lock may be
+  // pushed onto the remote free list of their span without locking, to be
+  // moved to the freelist later by the lock holder.  Objects on the list hold
+  // its links, so these methods REQUIRE a SMALL_OBJECT span of objects of
+  // <size>, with !IsNonIntrusive(size).
+  // ---------------------------------------------------------------------------
+
+  // Pushes <ptr> onto the remote free list.  Returns true if the list was
+  // empty before.
+  bool RemoteFreePush(void* ptr, size_t size);
+
+  // Empties the remote free list, and returns its first object, or nullptr if
+  // it was empty.  The objects on it remain linked for RemoteFreeNext().
+  void* RemoteFreeTake(size_t size);
+
+  // Returns the object after <ptr> on a list taken by RemoteFreeTake(), or
+  // nullptr if <ptr> is the last.  Call before pushing <ptr> to the freelist.
+  void* RemoteFreeNext(void* ptr, size_t size) const;
+
   // Reset a Span object to track the range [p, p + n).
   void Init(PageId p, Length n);
 
   // Initialize freelist to contain all objects in the span.
   // Pops up to N objects from the freelist and returns them in the batch array.
   // Returns number of objects actually popped.
-  int BuildFreelist(size_t size, size_t count, void** batch, int N);
+  //
+  // If <color> is true, the objects of a freelist-managed span start at
+  // ColorOffset() instead of at the start of the span.
+  int BuildFreelist(size_t size, size_t count, void** batch, int N,
+                    bool color);
+
+  // Returns the cache coloring offset of the first object in a span starting
+  // at <p> holding <count> objects of <size> bytes.  Offsets rotate with the
+  // span's page through the slack left past the last object, in steps of a
+  // cacheline (or of the objects' natural alignment, if larger), so that the
+  // first objects of different spans do not all map to the same cache sets.
+  // Only freelist-managed spans can be colored: bitmap indices are relative to
+  // the start of the span.
+  static size_t ColorOffset(PageId p, size_t size, size_t count);
 
   // Prefetch cacheline containing most important span information.
   void Prefetch();
@@ -228,6 +330,13 @@ class Span : public SpanList::Elem {
   // represent available objects, the reciprocal of the object size is
   // stored to enable conversion from the offset of an object within a
   // span to the index of the object.
+  //
+  // The fields that CentralFreeList touches for every batch it moves (the
+  // freelist or bitmap, allocated_, the shard and list index, and
+  // first_page_) are packed into bytes [16, 48), right after the list links,
+  // and Span is kept at 48 bytes and 16-byte aligned.  Spans are allocated
+  // back to back, so the hot fields of three in four spans share a single
+  // cache line.
   union {
     struct {
       uint16_t embed_count_;
@@ -237,12 +346,31 @@ class Span : public SpanList::Elem {
   };
   std::atomic<uint16_t> allocated_;  // Number of non-free objects
   uint8_t cache_size_;
-  uint8_t nonempty_index_ : 4;  // The nonempty_ list index for this span.
+  uint8_t nonempty_index_ : 3;  // The nonempty_ list index for this span.
   uint8_t location_ : 2;  // Is the span on a freelist, and if so, which?
   uint8_t sampled_ : 1;   // Sampled object?
+  uint8_t sampled_slab_ : 1;  // Sampled objects sharing the span?
   // Has this span allocation resulted in a donation to the filler in the page
   // heap? This is used by page heap to compute abandoned pages.
   uint8_t is_donated_ : 1;
+  uint8_t freelist_shard_;  // Owning CentralFreeList shard.
+  uint8_t low_occupancy_hugepage_ : 1;  // See low_occupancy_hugepage().
+  // Do the objects of this freelist-managed span start at ColorOffset()?
+  uint8_t colored_ : 1;
+  union {
+    // Used only for page-level allocations.
+    struct {
+      uint8_t known_zero_;         // See known_zero().
+      uint8_t allocation_domain_;  // See allocation_domain().
+    };
+    // Used only for SMALL_OBJECT spans: one more than the index of the first
+    // object on the remote free list, or 0 if it is empty.  The objects on the
+    // list link to the next one the same way.
+    std::atomic<ObjIdx> remote_free_;
+  };
+  // Number of pages in span.  A span lies within the address range of a single
+  // MemoryTag, so this fits in 32 bits (see the static_assert below).
+  uint32_t num_pages_;
 
   static constexpr size_t kCacheSize = 4;
   static constexpr size_t kBitmapSize = 8 * sizeof(ObjIdx) * kCacheSize;
@@ -259,10 +387,12 @@ class Span : public SpanList::Elem {
 
     // Used only for sampled spans (SAMPLED state).
     SampledAllocation* sampled_allocation_;
+
+    // Used only for SAMPLED_SLAB spans.
+    SampledSlab* slab_;
   };
 
   PageId first_page_;  // Starting page number.
-  Length num_pages_;   // Number of pages in span.
 
   // Returns true if Span will use bitmap for objects of size <size>.
   static bool UseBitmapForSize(size_t size);
@@ -304,7 +434,7 @@ class Span : public SpanList::Elem {
 
 inline Span::ObjIdx* Span::IdxToPtr(ObjIdx idx, size_t size,
                                     uintptr_t start) const {
-  ASSERT(num_pages_ == Length(1));
+  ASSERT(num_pages() == Length(1));
   ASSERT(start == first_page_.start_uintptr());
   ASSERT(idx != kListEnd);
   uintptr_t off = start + (static_cast<uintptr_t>(idx) << kAlignmentShift);
@@ -318,7 +448,7 @@ inline Span::ObjIdx Span::PtrToIdx(void* ptr, size_t size) const {
   uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
   // Classes that use freelist must also use 1 page per span,
   // so don't load first_page_ (may be on a different cache line).
-  ASSERT(num_pages_ == Length(1));
+  ASSERT(num_pages() == Length(1));
   ASSERT(PageIdContaining(ptr) == first_page_);
   uintptr_t off = (p & (kPageSize - 1)) >> kAlignmentShift;
   ObjIdx idx = static_cast<ObjIdx>(off);
@@ -397,6 +527,31 @@ inline bool Span::BitmapPush(void* ptr, size_t size) {
   return true;
 }
 
+inline bool Span::RemoteFreePush(void* ptr, size_t size) {
+  ASSERT(!IsNonIntrusive(size));
+  const ObjIdx idx = PtrToIdx(ptr, size) + 1;
+  ObjIdx head = remote_free_.load(std::memory_order_relaxed);
+  do {
+    *reinterpret_cast<ObjIdx*>(ptr) = head;
+  } while (!remote_free_.compare_exchange_weak(
+      head, idx, std::memory_order_release, std::memory_order_relaxed));
+  return head == 0;
+}
+
+inline void* Span::RemoteFreeTake(size_t size) {
+  ASSERT(!IsNonIntrusive(size));
+  const ObjIdx head = remote_free_.exchange(0, std::memory_order_acquire);
+  if (head == 0) return nullptr;
+  return IdxToPtr(head - 1, size, first_page_.start_uintptr());
+}
+
+inline void* Span::RemoteFreeNext(void* ptr, size_t size) const {
+  const ObjIdx next = *reinterpret_cast<ObjIdx*>(ptr);
+  if (next == 0) return nullptr;
+  const uintptr_t start = reinterpret_cast<uintptr_t>(ptr) & ~(kPageSize - 1);
+  return IdxToPtr(next - 1, size, start);
+}
+
 inline Span::Location Span::location() const {
   return static_cast<Location>(location_);
 }
@@ -412,10 +567,20 @@ inline SampledAllocation* Span::sampled_allocation() const {
 
 inline bool Span::sampled() const { return sampled_; }
 
+inline SampledSlab* Span::sampled_slab() const {
+  return sampled_slab_ ? slab_ : nullptr;
+}
+
+inline void Span::set_sampled_slab(SampledSlab* slab) {
+  ASSERT(!sampled_);
+  sampled_slab_ = slab != nullptr;
+  slab_ = slab;
+}
+
 inline PageId Span::first_page() const { return first_page_; }
 
 inline PageId Span::last_page() const {
-  return first_page_ + num_pages_ - Length(1);
+  return first_page_ + num_pages() - Length(1);
 }
 
 inline void Span::set_first_page(PageId p) {
@@ -428,11 +593,18 @@ inline void* Span::start_address() const {
   return first_page_.start_addr();
 }
 
-inline Length Span::num_pages() const { return num_pages_; }
+static_assert(((uintptr_t{1} << kTagShift) >> kPageShift) <=
+                  std::numeric_limits<uint32_t>::max(),
+              "Span::num_pages_ is too narrow");
 
-inline void Span::set_num_pages(Length len) { num_pages_ = len; }
+inline Length Span::num_pages() const { return Length(num_pages_); }
 
-inline size_t Span::bytes_in_span() const { return num_pages_.in_bytes(); }
+inline void Span::set_num_pages(Length len) {
+  ASSERT(len.raw_num() <= std::numeric_limits<uint32_t>::max());
+  num_pages_ = len.raw_num();
+}
+
+inline size_t Span::bytes_in_span() const { return num_pages().in_bytes(); }
 
 inline bool Span::FreelistEmpty(size_t size) const {
   if (UseBitmapForSize(size)) {
@@ -443,14 +615,10 @@ inline bool Span::FreelistEmpty(size_t size) const {
 }
 
 inline void Span::Prefetch() {
-  // TODO(b/304135905): Will revisit this.
-  // The first 16 bytes of a Span are the next and previous pointers
-  // for when it is stored in a linked list. Since the sizeof(Span) is
-  // 48 bytes, spans fit into 2 cache lines 50% of the time, with either
-  // the first 16-bytes or the last 16-bytes in a different cache line.
-  // Prefetch the cacheline that contains the most frequestly accessed
-  // data by offseting into the middle of the Span.
-  static_assert(sizeof(Span) <= 64, "Update span prefetch offset");
+  // The first 16 bytes of a Span are the next and previous pointers for when
+  // it is stored in a linked list.  The fields CentralFreeList uses most
+  // follow them, so prefetch from there.
+  static_assert(sizeof(Span) <= 48, "Update span prefetch offset");
   PrefetchT0(&this->allocated_);
 }
 
@@ -462,11 +630,17 @@ inline void Span::Init(PageId p, Length n) {
   new (this) Span();
 #endif
   first_page_ = p;
-  num_pages_ = n;
+  set_num_pages(n);
   location_ = IN_USE;
   sampled_ = 0;
+  sampled_slab_ = 0;
   nonempty_index_ = 0;
   is_donated_ = 0;
+  freelist_shard_ = 0;
+  known_zero_ = 0;
+  low_occupancy_hugepage_ = 0;
+  colored_ = 0;
+  allocation_domain_ = kUnchargedDomain;
 }
 
 inline bool Span::IsValidSizeClass(size_t size, size_t pages) {
@@ -478,6 +652,17 @@ inline bool Span::IsValidSizeClass(size_t size, size_t pages) {
   }
 }
 
+inline size_t Span::ColorOffset(PageId p, size_t size, size_t count) {
+  if (UseBitmapForSize(size)) return 0;
+  ASSERT(count * size <= kPageSize);
+  const size_t slack = kPageSize - count * size;
+  // Preserve the alignment guaranteed for objects of this size.
+  const size_t step =
+      std::max<size_t>(ABSL_CACHELINE_SIZE, size & (~size + 1));
+  const size_t colors = slack / step + 1;
+  return (p.index() % colors) * step;
+}
+
 inline bool Span::UseBitmapForSize(size_t size) {
   // Can fit kBitmapSize objects into a bitmap, so determine what the minimum
   // object size needs to be in order for that to work. This makes the
@@ -44,7 +44,7 @@ class RawSpan {
     int res = posix_memalign(&mem, kPageSize, npages.in_bytes());
     CHECK_CONDITION(res == 0);
     span_.Init(PageIdContaining(mem), npages);
-    span_.BuildFreelist(size, objects_per_span, nullptr, 0);
+    span_.BuildFreelist(size, objects_per_span, nullptr, 0, /*color=*/false);
   }
 
   ~RawSpan() { free(span_.start_address()); }
@@ -152,6 +152,48 @@ BENCHMARK(BM_single_span_fulldrain)
     ->Arg(40)
     ->Arg(80);
 
+// BM_BuildFreelist repeatedly rebuilds the freelist of a span, filling a batch
+// of num_objects_to_move(size_class) objects as CentralFreeList::Populate
+// does.
+void BM_BuildFreelist(benchmark::State& state) {
+  const int size_class = state.range(0);
+
+  size_t size = tc_globals.sizemap().class_to_size(size_class);
+  CHECK_CONDITION(size > 0);
+  size_t npages = tc_globals.sizemap().class_to_pages(size_class);
+  size_t batch_size = tc_globals.sizemap().num_objects_to_move(size_class);
+  size_t objects_per_span = npages * kPageSize / size;
+  RawSpan raw_span;
+  raw_span.Init(size_class);
+  Span& span = raw_span.span();
+
+  void* batch[kMaxObjectsToMove];
+
+  for (auto s : state) {
+    int n = span.BuildFreelist(size, objects_per_span, batch, batch_size,
+                               /*color=*/false);
+    benchmark::DoNotOptimize(n);
+    benchmark::DoNotOptimize(batch);
+  }
+
+  state.SetItemsProcessed(state.iterations() * objects_per_span);
+}
+
+BENCHMARK(BM_BuildFreelist)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(3)
+    ->Arg(4)
+    ->Arg(5)
+    ->Arg(7)
+    ->Arg(10)
+    ->Arg(12)
+    ->Arg(16)
+    ->Arg(20)
+    ->Arg(30)
+    ->Arg(40)
+    ->Arg(80);
+
 void BM_NewDelete(benchmark::State& state) {
   constexpr SpanAllocInfo kSpanInfo = {/*objects_per_span=*/7,
                                        AccessDensityPrediction::kSparse};
@@ -0,0 +1,143 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/span_cache.h"
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/cache_topology.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT SpanCache span_cache;
+
+SpanCache::Shard& SpanCache::CurrentShard() {
+  const CacheTopology& topology = CacheTopology::Instance();
+  const int cpu = subtle::percpu::RseqCpuId();
+  if (cpu < 0 || topology.l3_count() == 0) return shards_[0];
+  return shards_[topology.GetL3FromCpuId(cpu) % kMaxShards];
+}
+
+Span* SpanCache::TryGet(MemoryTag tag, Length n,
+                        AccessDensityPrediction density) {
+  if (!Cacheable(tag, n)) return nullptr;
+  Shard& shard = CurrentShard();
+  AllocationGuardSpinLockHolder h(&shard.lock);
+  Bucket& bucket = GetBucket(shard, tag, n, density);
+  bucket.used = true;
+  if (bucket.count == 0) return nullptr;
+  Span* span = bucket.spans.first();
+  bucket.spans.remove(span);
+  --bucket.count;
+  cached_pages_.fetch_sub(n.raw_num(), std::memory_order_relaxed);
+  return span;
+}
+
+Span* SpanCache::Refill(MemoryTag tag, Length n,
+                        SpanAllocInfo span_alloc_info) {
+  ASSERT(Cacheable(tag, n));
+  Span* spans[kCapacity];
+  const size_t allocated = tc_globals.page_allocator().NewBatch(
+      n, span_alloc_info, tag, absl::MakeSpan(spans));
+  if (ABSL_PREDICT_FALSE(allocated == 0)) return nullptr;
+
+  size_t uncached = 1;
+  for (size_t i = 1; i < allocated; ++i) {
+    if (!TryPut(tag, spans[i], span_alloc_info.density)) {
+      spans[uncached++] = spans[i];
+    }
+  }
+  if (uncached > 1) {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    for (size_t i = 1; i < uncached; ++i) {
+      tc_globals.page_allocator().Delete(spans[i],
+                                         span_alloc_info.objects_per_span, tag);
+    }
+  }
+  return spans[0];
+}
+
+bool SpanCache::TryPut(MemoryTag tag, Span* span,
+                       AccessDensityPrediction density) {
+  const Length n = span->num_pages();
+  if (!Cacheable(tag, n)) return false;
+  ASSERT(GetMemoryTag(span->start_address()) == tag);
+  Shard& shard = CurrentShard();
+  AllocationGuardSpinLockHolder h(&shard.lock);
+  Bucket& bucket = GetBucket(shard, tag, n, density);
+  if (bucket.count >= kCapacity) return false;
+  bucket.spans.prepend(span);
+  ++bucket.count;
+  cached_pages_.fetch_add(n.raw_num(), std::memory_order_relaxed);
+  return true;
+}
+
+void SpanCache::Drain(bool only_unused) {
+  constexpr size_t kSpansPerShard = kNumaPartitions * kMaxPages * 2 * kCapacity;
+  for (Shard& shard : shards_) {
+    Span* spans[kSpansPerShard];
+    size_t num_spans = 0;
+    {
+      AllocationGuardSpinLockHolder h(&shard.lock);
+      for (auto& partition : shard.buckets) {
+        for (auto& length : partition) {
+          for (Bucket& bucket : length) {
+            const bool drain = !only_unused || !bucket.used;
+            bucket.used = false;
+            if (!drain) continue;
+            while (bucket.count > 0) {
+              Span* span = bucket.spans.first();
+              bucket.spans.remove(span);
+              --bucket.count;
+              cached_pages_.fetch_sub(span->num_pages().raw_num(),
+                                      std::memory_order_relaxed);
+              spans[num_spans++] = span;
+            }
+          }
+        }
+      }
+    }
+    if (num_spans == 0) continue;
+
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    for (size_t i = 0; i < num_spans; ++i) {
+      // The page allocators do not use objects_per_span when freeing.
+      tc_globals.page_allocator().Delete(spans[i], /*objects_per_span=*/1,
+                                         GetMemoryTag(spans[i]->start_address()));
+    }
+  }
+}
+
+void SpanCache::Plunder() { Drain(/*only_unused=*/true); }
+
+void SpanCache::Flush() { Drain(/*only_unused=*/false); }
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,142 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_SPAN_CACHE_H_
+#define TCMALLOC_SPAN_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// A small cache of free few-page spans sitting between the central freelists
+// and the PageAllocator, sharded by L3 cache.  Spans released by a central
+// freelist are kept here instead of being returned to the page heap, and the
+// next central freelist needing a span of the same length, NUMA partition and
+// access density takes one without acquiring pageheap_lock.  On a miss, the
+// cache is refilled with a batch of spans allocated under a single acquisition
+// of pageheap_lock.
+//
+// Cached spans remain allocated as far as the PageAllocator is concerned, and
+// are reported as central cache free bytes.  Buckets that saw no allocations
+// between two calls to Plunder() are returned to the page heap, as is the
+// whole cache on Flush().
+//
+// The shard locks are leaves: pageheap_lock is never acquired while holding
+// one.
+class SpanCache {
+ public:
+  static constexpr size_t kMaxPages = 4;
+  static constexpr size_t kCapacity = 4;
+  static constexpr size_t kMaxShards = 32;
+
+  constexpr SpanCache() = default;
+
+  SpanCache(const SpanCache&) = delete;
+  SpanCache& operator=(const SpanCache&) = delete;
+
+  // Returns true if spans of <n> pages of memory tagged <tag> can be cached.
+  static bool Cacheable(MemoryTag tag, Length n) {
+    return IsNormalMemoryTag(tag) && n > Length(0) &&
+           n <= Length(kMaxPages);
+  }
+
+  // Returns a cached span of <n> pages of memory tagged <tag>, or nullptr.
+  // The span is registered in the pagemap but not with a size class, as if
+  // it had just been returned by PageAllocator::New().
+  Span* TryGet(MemoryTag tag, Length n, AccessDensityPrediction density)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Allocates a batch of spans of <n> pages from the PageAllocator, returning
+  // one and caching as many of the others as fit.  Returns nullptr if out of
+  // memory.
+  Span* Refill(MemoryTag tag, Length n, SpanAllocInfo span_alloc_info)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Caches <span>, which must not be registered with a size class.  Returns
+  // false if there is no room, in which case the caller keeps ownership.
+  bool TryPut(MemoryTag tag, Span* span, AccessDensityPrediction density)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Returns the spans of buckets that were not allocated from since the last
+  // call to the page heap.
+  void Plunder() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // Returns all cached spans to the page heap.
+  void Flush() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Acquires and releases the shard locks around fork(), so that the child
+  // does not inherit one held by a thread that no longer exists.
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    for (Shard& shard : shards_) shard.lock.Lock();
+  }
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    for (Shard& shard : shards_) shard.lock.Unlock();
+  }
+
+  size_t cached_bytes() const {
+    return Length(cached_pages_.load(std::memory_order_relaxed)).in_bytes();
+  }
+
+ private:
+  struct Bucket {
+    SpanList spans;
+    uint8_t count = 0;
+    bool used = false;
+  };
+
+  struct Shard {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    Bucket buckets[kNumaPartitions][kMaxPages][2] ABSL_GUARDED_BY(lock);
+  };
+
+  static Bucket& GetBucket(Shard& shard, MemoryTag tag, Length n,
+                           AccessDensityPrediction density)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(shard.lock) {
+    ASSERT(Cacheable(tag, n));
+    return shard.buckets[NumaPartitionFromTag(tag)][n.raw_num() - 1]
+                        [density == AccessDensityPrediction::kDense];
+  }
+
+  Shard& CurrentShard();
+
+  // Returns every span of every bucket (or only of the unused ones) to the
+  // page heap.
+  void Drain(bool only_unused) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  Shard shards_[kMaxShards];
+  std::atomic<size_t> cached_pages_{0};
+};
+
+extern SpanCache span_cache;
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SPAN_CACHE_H_
@@ -0,0 +1,146 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/span_cache.h"
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/affinity.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class SpanCacheTest : public ::testing::Test {
+ protected:
+  // Spans are cached per L3 cache, so stay on one CPU.
+  SpanCacheTest() : mask_(AllowedCpus()[0]) { tc_globals.InitIfNecessary(); }
+
+  ~SpanCacheTest() override { cache_.Flush(); }
+
+  static Span* NewSpan(Length n) {
+    Span* span = tc_globals.page_allocator().New(
+        n, {1, AccessDensityPrediction::kSparse}, MemoryTag::kNormal);
+    CHECK_CONDITION(span != nullptr);
+    return span;
+  }
+
+  static void DeleteSpan(Span* span) {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    tc_globals.page_allocator().Delete(span, 1, MemoryTag::kNormal);
+  }
+
+  ScopedAffinityMask mask_;
+  SpanCache cache_;
+};
+
+TEST_F(SpanCacheTest, Cacheable) {
+  EXPECT_TRUE(SpanCache::Cacheable(MemoryTag::kNormal, Length(1)));
+  EXPECT_TRUE(
+      SpanCache::Cacheable(MemoryTag::kNormal, Length(SpanCache::kMaxPages)));
+  EXPECT_FALSE(SpanCache::Cacheable(MemoryTag::kNormal,
+                                    Length(SpanCache::kMaxPages + 1)));
+  EXPECT_FALSE(SpanCache::Cacheable(MemoryTag::kSampled, Length(1)));
+  EXPECT_FALSE(SpanCache::Cacheable(MemoryTag::kCold, Length(1)));
+}
+
+TEST_F(SpanCacheTest, ReusesMatchingSpans) {
+  constexpr auto kSparse = AccessDensityPrediction::kSparse;
+  constexpr auto kDense = AccessDensityPrediction::kDense;
+
+  Span* span = NewSpan(Length(2));
+  ASSERT_TRUE(cache_.TryPut(MemoryTag::kNormal, span, kSparse));
+  EXPECT_EQ(cache_.cached_bytes(), Length(2).in_bytes());
+
+  // Only a request for the same length and density is served.
+  EXPECT_EQ(cache_.TryGet(MemoryTag::kNormal, Length(1), kSparse), nullptr);
+  EXPECT_EQ(cache_.TryGet(MemoryTag::kNormal, Length(2), kDense), nullptr);
+  EXPECT_EQ(cache_.TryGet(MemoryTag::kNormal, Length(2), kSparse), span);
+  EXPECT_EQ(cache_.cached_bytes(), 0);
+  EXPECT_EQ(cache_.TryGet(MemoryTag::kNormal, Length(2), kSparse), nullptr);
+
+  DeleteSpan(span);
+}
+
+TEST_F(SpanCacheTest, Capacity) {
+  constexpr auto kSparse = AccessDensityPrediction::kSparse;
+
+  std::vector<Span*> spans;
+  for (size_t i = 0; i < SpanCache::kCapacity; ++i) {
+    spans.push_back(NewSpan(Length(1)));
+    ASSERT_TRUE(cache_.TryPut(MemoryTag::kNormal, spans.back(), kSparse));
+  }
+  Span* extra = NewSpan(Length(1));
+  EXPECT_FALSE(cache_.TryPut(MemoryTag::kNormal, extra, kSparse));
+  DeleteSpan(extra);
+
+  EXPECT_EQ(cache_.cached_bytes(), Length(SpanCache::kCapacity).in_bytes());
+  cache_.Flush();
+  EXPECT_EQ(cache_.cached_bytes(), 0);
+  EXPECT_EQ(cache_.TryGet(MemoryTag::kNormal, Length(1), kSparse), nullptr);
+}
+
+TEST_F(SpanCacheTest, RefillCachesRestOfBatch) {
+  const SpanAllocInfo kSpanInfo = {1, AccessDensityPrediction::kDense};
+
+  Span* span = cache_.Refill(MemoryTag::kNormal, Length(2), kSpanInfo);
+  ASSERT_NE(span, nullptr);
+  EXPECT_EQ(span->num_pages(), Length(2));
+  EXPECT_EQ(cache_.cached_bytes(),
+            Length(2 * (SpanCache::kCapacity - 1)).in_bytes());
+
+  for (size_t i = 0; i < SpanCache::kCapacity - 1; ++i) {
+    Span* cached =
+        cache_.TryGet(MemoryTag::kNormal, Length(2), kSpanInfo.density);
+    ASSERT_NE(cached, nullptr);
+    EXPECT_NE(cached, span);
+    DeleteSpan(cached);
+  }
+  EXPECT_EQ(cache_.cached_bytes(), 0);
+  DeleteSpan(span);
+}
+
+TEST_F(SpanCacheTest, PlunderKeepsUsedBuckets) {
+  constexpr auto kSparse = AccessDensityPrediction::kSparse;
+
+  ASSERT_TRUE(cache_.TryPut(MemoryTag::kNormal, NewSpan(Length(1)), kSparse));
+  ASSERT_TRUE(cache_.TryPut(MemoryTag::kNormal, NewSpan(Length(3)), kSparse));
+  // A miss still marks the bucket as in use.
+  EXPECT_EQ(cache_.TryGet(MemoryTag::kNormal, Length(1),
+                          AccessDensityPrediction::kDense),
+            nullptr);
+  Span* span = cache_.TryGet(MemoryTag::kNormal, Length(1), kSparse);
+  ASSERT_NE(span, nullptr);
+  ASSERT_TRUE(cache_.TryPut(MemoryTag::kNormal, span, kSparse));
+
+  // The 3-page bucket was never allocated from, so it is returned.
+  cache_.Plunder();
+  EXPECT_EQ(cache_.cached_bytes(), Length(1).in_bytes());
+
+  // Without further allocations, the next pass returns the rest.
+  cache_.Plunder();
+  EXPECT_EQ(cache_.cached_bytes(), 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
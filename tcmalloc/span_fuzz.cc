@@ -56,7 +56,8 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
   CHECK_CONDITION(res == 0);
   Span span;
   span.Init(PageIdContaining(mem), pages);
-  span.BuildFreelist(object_size, objects_per_span, nullptr, 0);
+  span.BuildFreelist(object_size, objects_per_span, nullptr, 0,
+                     /*color=*/false);
 
   CHECK_CONDITION(span.Allocated() == 0);
 
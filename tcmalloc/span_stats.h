@@ -28,6 +28,17 @@ struct SpanStats {
   size_t num_spans_requested = 0;
   size_t num_spans_returned = 0;
   size_t obj_capacity = 0;  // cap of number of objs that could be live anywhere
+  // Times a span on a low-occupancy hugepage was put behind others that would
+  // otherwise have been allocated from next.
+  size_t num_low_occupancy_deferrals = 0;
+  // Returned spans that were on low-occupancy hugepages.
+  size_t num_low_occupancy_spans_returned = 0;
+  // Spans populated from the cache of recently emptied spans instead of being
+  // allocated anew.
+  size_t num_empty_span_reuses = 0;
+  // Spans allocated ahead of demand by the background thread.  See
+  // CentralFreeList::Prepopulate.
+  size_t num_prepopulated_spans = 0;
 
   size_t num_live_spans() {
     if (num_spans_requested < num_spans_returned) {
@@ -18,16 +18,20 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include "gtest/gtest.h"
 #include "absl/base/internal/spinlock.h"
+#include "absl/base/optimization.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/random/random.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/pages.h"
 #include "tcmalloc/static_vars.h"
 
 namespace tcmalloc {
@@ -36,7 +40,7 @@ namespace {
 
 class RawSpan {
  public:
-  void Init(size_t size_class) {
+  void Init(size_t size_class, bool color) {
     size_t size = tc_globals.sizemap().class_to_size(size_class);
     auto npages = Length(tc_globals.sizemap().class_to_pages(size_class));
     size_t objects_per_span = npages.in_bytes() / size;
@@ -44,7 +48,7 @@ class RawSpan {
     int res = posix_memalign(&mem_, kPageSize, npages.in_bytes());
     CHECK_CONDITION(res == 0);
     span_.Init(PageIdContaining(mem_), npages);
-    span_.BuildFreelist(size, objects_per_span, nullptr, 0);
+    span_.BuildFreelist(size, objects_per_span, nullptr, 0, color);
   }
 
   ~RawSpan() { free(mem_); }
@@ -56,18 +60,21 @@ class RawSpan {
   Span span_;
 };
 
-class SpanTest : public testing::TestWithParam<size_t> {
+class SpanTest : public testing::TestWithParam<std::tuple<size_t, bool>> {
  protected:
   size_t size_class_;
   size_t size_;
   size_t npages_;
   size_t batch_size_;
   size_t objects_per_span_;
+  // Offset of the first object from the start of the span.
+  size_t offset_;
   RawSpan raw_span_;
 
  private:
   void SetUp() override {
-    size_class_ = GetParam();
+    size_class_ = std::get<0>(GetParam());
+    const bool color = std::get<1>(GetParam());
     size_ = tc_globals.sizemap().class_to_size(size_class_);
     if (size_ == 0) {
       GTEST_SKIP() << "Skipping empty size class.";
@@ -77,7 +84,10 @@ class SpanTest : public testing::TestWithParam<size_t> {
     batch_size_ = tc_globals.sizemap().num_objects_to_move(size_class_);
     objects_per_span_ = npages_ * kPageSize / size_;
 
-    raw_span_.Init(size_class_);
+    raw_span_.Init(size_class_, color);
+    offset_ = color ? Span::ColorOffset(raw_span_.span().first_page(), size_,
+                                        objects_per_span_)
+                    : 0;
   }
 
   void TearDown() override {}
@@ -90,7 +100,7 @@ TEST_P(SpanTest, FreelistBasic) {
   void* batch[kMaxObjectsToMove];
   size_t popped = 0;
   size_t want = 1;
-  char* start = static_cast<char*>(span_.start_address());
+  char* start = static_cast<char*>(span_.start_address()) + offset_;
   std::vector<bool> objects(objects_per_span_);
   for (size_t x = 0; x < 2; ++x) {
     // Pop all objects in batches of varying size and ensure that we've got
@@ -107,7 +117,7 @@ TEST_P(SpanTest, FreelistBasic) {
       for (size_t i = 0; i < n; ++i) {
         void* p = batch[i];
         uintptr_t off = reinterpret_cast<char*>(p) - start;
-        EXPECT_LT(off, span_.bytes_in_span());
+        EXPECT_LT(offset_ + off, span_.bytes_in_span());
         EXPECT_EQ(off % size_, 0);
         size_t idx = off / size_;
         EXPECT_FALSE(objects[idx]);
@@ -146,7 +156,7 @@ TEST_P(SpanTest, FreelistBasic) {
 TEST_P(SpanTest, FreelistRandomized) {
   Span& span_ = raw_span_.span();
 
-  char* start = static_cast<char*>(span_.start_address());
+  char* start = static_cast<char*>(span_.start_address()) + offset_;
 
   // Do a bunch of random pushes/pops with random batch size.
   absl::BitGen rng;
@@ -186,12 +196,84 @@ TEST_P(SpanTest, FreelistRandomized) {
   EXPECT_EQ(objects.size(), objects_per_span_);
   for (void* p : objects) {
     uintptr_t off = reinterpret_cast<char*>(p) - start;
-    EXPECT_LT(off, span_.bytes_in_span());
+    EXPECT_LT(offset_ + off, span_.bytes_in_span());
     EXPECT_EQ(off % size_, 0);
   }
 }
 
-INSTANTIATE_TEST_SUITE_P(All, SpanTest, testing::Range(size_t(1), kNumClasses));
+TEST_P(SpanTest, LiveObjects) {
+  Span& span_ = raw_span_.span();
+
+  char* start = static_cast<char*>(span_.start_address()) + offset_;
+  Span::ObjectBitmap live;
+  EXPECT_EQ(span_.LiveObjects(size_, objects_per_span_, &live), start);
+  EXPECT_EQ(live.CountBits(0, live.size()), 0);
+
+  // Pop and push objects at random, leaving at least one allocated so that
+  // every push succeeds, and compare against the objects we hold.
+  absl::BitGen rng;
+  absl::flat_hash_set<void*> objects;
+  void* batch[kMaxObjectsToMove];
+  for (size_t x = 0; x < 1000; ++x) {
+    if (objects.size() > 1 && absl::Bernoulli(rng, 1.0 / 2)) {
+      void* p = *objects.begin();
+      ASSERT_TRUE(span_.FreelistPush(p, size_));
+      objects.erase(objects.begin());
+    } else {
+      size_t want = absl::Uniform<int32_t>(rng, 0, batch_size_) + 1;
+      size_t n = span_.FreelistPopBatch(batch, want, size_);
+      objects.insert(batch, batch + n);
+    }
+
+    EXPECT_EQ(span_.LiveObjects(size_, objects_per_span_, &live), start);
+    EXPECT_EQ(live.CountBits(0, live.size()), objects.size());
+    for (void* p : objects) {
+      const size_t idx = (static_cast<char*>(p) - start) / size_;
+      EXPECT_TRUE(live.GetBit(idx));
+    }
+  }
+}
+
+TEST(SpanColorTest, ColorOffset) {
+  for (size_t size = static_cast<size_t>(kAlignment);
+       !Span::IsNonIntrusive(size); size += static_cast<size_t>(kAlignment)) {
+    const size_t count = kPageSize / size;
+    const size_t slack = kPageSize - count * size;
+    const size_t alignment = size & (~size + 1);
+    absl::flat_hash_set<size_t> offsets;
+    for (uintptr_t p = 0; p < 64; ++p) {
+      const size_t offset = Span::ColorOffset(PageId(p), size, count);
+      EXPECT_LE(offset, slack) << size;
+      EXPECT_EQ(offset % alignment, 0) << size;
+      EXPECT_EQ(offset % ABSL_CACHELINE_SIZE, 0) << size;
+      offsets.insert(offset);
+    }
+    // Consecutive spans rotate through every available color.
+    const size_t step = std::max<size_t>(ABSL_CACHELINE_SIZE, alignment);
+    EXPECT_EQ(offsets.size(), std::min<size_t>(slack / step + 1, 64)) << size;
+  }
+
+  // Bitmap-managed spans are never colored.
+  EXPECT_EQ(Span::ColorOffset(PageId(1), kPageSize / 3, 3), 0);
+}
+
+TEST(SpanLayoutTest, LargestSpan) {
+  // The largest span covers all of a MemoryTag's address range.
+  const Length largest = Length((uintptr_t{1} << kTagShift) >> kPageShift);
+  Span span;
+  span.Init(PageId(1), largest);
+  EXPECT_EQ(span.num_pages(), largest);
+  EXPECT_EQ(span.last_page(), PageId(1) + largest - Length(1));
+  EXPECT_EQ(span.bytes_in_span(), largest.in_bytes());
+
+  span.set_num_pages(Length(3));
+  EXPECT_EQ(span.num_pages(), Length(3));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    All, SpanTest,
+    testing::Combine(testing::Range(size_t(1), kNumClasses),
+                     /*color=*/testing::Bool()));
 
 }  // namespace
 }  // namespace tcmalloc_internal
@@ -20,6 +20,8 @@
 #include <cstdint>
 
 #include "absl/functional/function_ref.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
@@ -50,6 +52,22 @@ StackTraceTable::~StackTraceTable() {
   all_ = nullptr;
 }
 
+ProfiledObjects ProfiledObjectsFor(double sample_weight,
+                                   const SampleMetadata& t) {
+  // Report total bytes that are a multiple of the object size.
+  const size_t allocated_size = t.allocated_size;
+  uintptr_t bytes = sample_weight * AllocatedBytes(t) + 0.5;
+  // We want sum to be a multiple of allocated_size; pick the nearest
+  // multiple rather than always rounding up or down.
+  //
+  // TODO(b/215362992): Revisit this assertion when GWP-ASan guards
+  // zero-byte allocations.
+  ASSERT(allocated_size > 0);
+  // The reported count of samples, with possible rounding up for unsample.
+  const int64_t count = (bytes + allocated_size / 2) / allocated_size;
+  return {count, static_cast<int64_t>(count * allocated_size)};
+}
+
 void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t) {
   depth_total_ += t.depth;
   // Note this makes a copy of the information from the stack trace and users
@@ -70,20 +88,12 @@ void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t) {
   }
   s = new (s) LinkedSample;
 
-  // Report total bytes that are a multiple of the object size.
   size_t allocated_size = t.allocated_size;
   size_t requested_size = t.requested_size;
 
-  uintptr_t bytes = sample_weight * AllocatedBytes(t) + 0.5;
-  // We want sum to be a multiple of allocated_size; pick the nearest
-  // multiple rather than always rounding up or down.
-  //
-  // TODO(b/215362992): Revisit this assertion when GWP-ASan guards
-  // zero-byte allocations.
-  ASSERT(allocated_size > 0);
-  // The reported count of samples, with possible rounding up for unsample.
-  s->sample.count = (bytes + allocated_size / 2) / allocated_size;
-  s->sample.sum = s->sample.count * allocated_size;
+  const ProfiledObjects objects = ProfiledObjectsFor(sample_weight, t);
+  s->sample.count = objects.count;
+  s->sample.sum = objects.sum;
   s->sample.requested_size = requested_size;
   s->sample.requested_alignment = t.requested_alignment;
   s->sample.requested_size_returning = t.requested_size_returning;
@@ -97,6 +107,7 @@ void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t) {
   s->sample.span_start_address = t.span_start_address;
   s->sample.guarded_status =
       static_cast<Profile::Sample::GuardedStatus>(t.guarded_status);
+  s->sample.labels = absl::MakeConstSpan(t.labels, t.num_labels);
 
   static_assert(kMaxStackDepth <= Profile::Sample::kMaxStackDepth,
                 "Profile stack size smaller than internal stack sizes");
@@ -107,6 +118,36 @@ void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t) {
   all_ = s;
 }
 
+void StackTraceTable::AddStack(int64_t count, int64_t sum,
+                               absl::Span<void* const> stack) {
+  depth_total_ += stack.size();
+  LinkedSample* s;
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    s = tc_globals.linked_sample_allocator().New();
+  }
+  s = new (s) LinkedSample;
+
+  s->sample.count = count;
+  s->sample.sum = sum;
+  s->sample.requested_size = 0;
+  s->sample.requested_alignment = 0;
+  s->sample.requested_size_returning = false;
+  s->sample.allocated_size = 0;
+  s->sample.access_hint = static_cast<hot_cold_t>(0);
+  s->sample.access_allocated = Profile::Sample::Access::Hot;
+  s->sample.depth = stack.size();
+  s->sample.allocation_time = absl::InfinitePast();
+  s->sample.span_start_address = nullptr;
+
+  ASSERT(stack.size() <= Profile::Sample::kMaxStackDepth);
+  memcpy(s->sample.stack, stack.data(),
+         sizeof(s->sample.stack[0]) * s->sample.depth);
+
+  s->next = all_;
+  all_ = s;
+}
+
 void StackTraceTable::Iterate(
     absl::FunctionRef<void(const Profile::Sample&)> func) const {
   LinkedSample* cur = all_;
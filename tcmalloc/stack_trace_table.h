@@ -21,6 +21,7 @@
 
 #include "absl/base/thread_annotations.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
@@ -30,6 +31,15 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+// The number of objects, and their bytes, that a profile reports for a sample
+// with the given weight.
+struct ProfiledObjects {
+  int64_t count;
+  int64_t sum;
+};
+ProfiledObjects ProfiledObjectsFor(double sample_weight,
+                                   const SampleMetadata& t);
+
 class StackTraceTable final : public ProfileBase {
  public:
   StackTraceTable(ProfileType type) ABSL_LOCKS_EXCLUDED(pageheap_lock);
@@ -52,6 +62,11 @@ class StackTraceTable final : public ProfileBase {
   void AddTrace(double sample_weight, const StackTrace& t)
       ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
+  // Adds the totals of all the samples taken at `stack`.  Only the count, sum
+  // and stack of the reported sample are set.
+  void AddStack(int64_t count, int64_t sum, absl::Span<void* const> stack)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
   // Exposed for PageHeapAllocator
   struct LinkedSample {
     Profile::Sample sample;
@@ -16,10 +16,12 @@
 
 #include <stddef.h>
 
+#include <algorithm>
 #include <atomic>
 
 #include "absl/base/attributes.h"
 #include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/optimization.h"
 #include "absl/types/span.h"
@@ -28,23 +30,31 @@
 #include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
 #include "tcmalloc/deallocation_profiler.h"
+#include "tcmalloc/demand_profile.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/experiment_config.h"
 #include "tcmalloc/guarded_page_allocator.h"
 #include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/allocation_trace.h"
 #include "tcmalloc/internal/atomic_stats_counter.h"
 #include "tcmalloc/internal/cache_topology.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/explicitly_constructed.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/memory_tagging.h"
 #include "tcmalloc/internal/mincore.h"
 #include "tcmalloc/internal/numa.h"
+#include "tcmalloc/internal/sample_event_ring.h"
+#include "tcmalloc/internal/stats_page.h"
 #include "tcmalloc/internal/stacktrace_filter.h"
 #include "tcmalloc/internal/sysinfo.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/mte_sampled_allocator.h"
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/pagemap.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/peak_heap_tracker.h"
 #include "tcmalloc/sampled_allocation_allocator.h"
 #include "tcmalloc/size_class_info.h"
@@ -74,7 +84,15 @@ ABSL_CONST_INIT ShardedTransferCacheManager
     Static::sharded_transfer_cache_(nullptr, nullptr);
 ABSL_CONST_INIT CpuCache ABSL_CACHELINE_ALIGNED Static::cpu_cache_;
 ABSL_CONST_INIT SampledAllocationAllocator Static::sampledallocation_allocator_;
-ABSL_CONST_INIT PageHeapAllocator<Span> Static::span_allocator_;
+ABSL_CONST_INIT DepotStackAllocator Static::depot_stack_allocator_;
+ABSL_CONST_INIT SampledSlabs Static::sampled_slabs_;
+ABSL_CONST_INIT SampledStackDepot Static::sampled_stack_depot_(
+    &depot_stack_allocator_);
+ABSL_CONST_INIT SampleEventRing Static::sample_event_ring_;
+ABSL_CONST_INIT StatsPage Static::stats_page_;
+ABSL_CONST_INIT AllocationTraceWriter Static::allocation_trace_;
+ABSL_CONST_INIT CpuCachedPageHeapAllocator<Span>
+    Static::span_allocator_[kNumaPartitions];
 ABSL_CONST_INIT PageHeapAllocator<ThreadCache> Static::threadcache_allocator_;
 ABSL_CONST_INIT ExplicitlyConstructed<SampledAllocationRecorder>
     Static::sampled_allocation_recorder_;
@@ -82,20 +100,31 @@ ABSL_CONST_INIT tcmalloc_internal::StatsCounter Static::sampled_objects_size_;
 ABSL_CONST_INIT tcmalloc_internal::StatsCounter
     Static::sampled_internal_fragmentation_;
 ABSL_CONST_INIT tcmalloc_internal::StatsCounter Static::total_sampled_count_;
+ABSL_CONST_INIT tcmalloc_internal::StatsCounter
+    Static::sampled_weight_allocated_;
+ABSL_CONST_INIT tcmalloc_internal::StatsCounter Static::sampled_weight_freed_;
 ABSL_CONST_INIT AllocationSampleList Static::allocation_samples;
 ABSL_CONST_INIT deallocationz::DeallocationProfilerList
     Static::deallocation_samples;
 ABSL_CONST_INIT std::atomic<AllocHandle> Static::sampled_alloc_handle_generator{
     0};
 ABSL_CONST_INIT PeakHeapTracker Static::peak_heap_tracker_;
+ABSL_CONST_INIT SizeClassLifetimes<kNumClasses> Static::size_class_lifetimes_;
 ABSL_CONST_INIT PageHeapAllocator<StackTraceTable::LinkedSample>
     Static::linked_sample_allocator_;
+ABSL_CONST_INIT PageHeapAllocator<AllocationSampleList::Entry>
+    Static::sample_log_allocator_;
 ABSL_CONST_INIT std::atomic<bool> Static::inited_{false};
 ABSL_CONST_INIT std::atomic<bool> Static::cpu_cache_active_{false};
+ABSL_CONST_INIT std::atomic<bool> Static::profiled_size_classes_{false};
+ABSL_CONST_INIT StartupTimings Static::startup_timings_;
+ABSL_CONST_INIT Static::FastPathState Static::fast_path_;
 ABSL_CONST_INIT Static::PageAllocatorStorage Static::page_allocator_;
 ABSL_CONST_INIT PageMap Static::pagemap_;
 ABSL_CONST_INIT GuardedPageAllocator Static::guardedpage_allocator_;
+ABSL_CONST_INIT MteSampledAllocator Static::mte_sampled_allocator_;
 ABSL_CONST_INIT StackTraceFilter Static::stacktrace_filter_;
+ABSL_CONST_INIT StackTraceFilter Static::sampled_site_filter_;
 ABSL_CONST_INIT NumaTopology<kNumaPartitions, kNumBaseClasses>
     Static::numa_topology_;
 // LINT.ThenChange(:static_vars_size)
@@ -115,14 +144,26 @@ size_t Static::metadata_bytes() {
       sizeof(pageheap_lock) + sizeof(arena_) + sizeof(sizemap_) +
       sizeof(sharded_transfer_cache_) + sizeof(transfer_cache_) +
       sizeof(cpu_cache_) + sizeof(sampledallocation_allocator_) +
-      sizeof(span_allocator_) + +sizeof(threadcache_allocator_) +
+      sizeof(depot_stack_allocator_) + sizeof(sampled_slabs_) +
+      sizeof(sampled_stack_depot_) +
+      sizeof(sample_event_ring_) + sizeof(stats_page_) +
+      sizeof(allocation_trace_) +
+      sizeof(span_allocator_) +
+      +sizeof(threadcache_allocator_) +
       sizeof(sampled_allocation_recorder_) + sizeof(linked_sample_allocator_) +
-      sizeof(inited_) + sizeof(cpu_cache_active_) + sizeof(page_allocator_) +
+      sizeof(sample_log_allocator_) +
+      sizeof(inited_) + sizeof(cpu_cache_active_) +
+      sizeof(profiled_size_classes_) + sizeof(startup_timings_) +
+      sizeof(fast_path_) +
+      sizeof(page_allocator_) +
       sizeof(pagemap_) + sizeof(sampled_objects_size_) +
       sizeof(sampled_internal_fragmentation_) + sizeof(total_sampled_count_) +
+      sizeof(sampled_weight_allocated_) + sizeof(sampled_weight_freed_) +
       sizeof(allocation_samples) + sizeof(deallocation_samples) +
       sizeof(sampled_alloc_handle_generator) + sizeof(peak_heap_tracker_) +
-      sizeof(guardedpage_allocator_) + sizeof(stacktrace_filter_) +
+      sizeof(size_class_lifetimes_) + sizeof(guardedpage_allocator_) +
+      sizeof(mte_sampled_allocator_) +
+      sizeof(stacktrace_filter_) + sizeof(sampled_site_filter_) +
       sizeof(numa_topology_) + sizeof(CacheTopology::Instance());
   // LINT.ThenChange(:static_vars)
 
@@ -131,6 +172,29 @@ size_t Static::metadata_bytes() {
   return allocated + static_var_size;
 }
 
+size_t Static::ReleaseFreeMetadata(size_t max_slabs) {
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  size_t released = 0;
+  for (auto& span_allocator : span_allocator_) {
+    released += span_allocator.ReleaseFreeSlabs(max_slabs);
+  }
+  return released + threadcache_allocator_.ReleaseFreeSlabs(max_slabs) +
+         sampledallocation_allocator_.ReleaseFreeSlabs(max_slabs) +
+         linked_sample_allocator_.ReleaseFreeSlabs(max_slabs) +
+         sample_log_allocator_.ReleaseFreeSlabs(max_slabs) +
+         page_allocator().ReleaseFreeMetadata(max_slabs);
+}
+
+AllocatorStats Static::span_stats() {
+  AllocatorStats stats = {0, 0};
+  for (const auto& span_allocator : span_allocator_) {
+    const AllocatorStats s = span_allocator.stats();
+    stats.in_use += s.in_use;
+    stats.total += s.total;
+  }
+  return stats;
+}
+
 size_t Static::pagemap_residence() {
   // Determine residence of the root node of the pagemap.
   size_t total = MInCore::residence(&pagemap_, sizeof(pagemap_));
@@ -140,7 +204,9 @@ size_t Static::pagemap_residence() {
 int ABSL_ATTRIBUTE_WEAK default_want_legacy_size_classes();
 
 SizeClassConfiguration Static::size_class_configuration() {
-  if (IsExperimentActive(Experiment::TEST_ONLY_TCMALLOC_POW2_SIZECLASS)) {
+  if (profiled_size_classes_.load(std::memory_order_relaxed)) {
+    return SizeClassConfiguration::kProfile;
+  } else if (IsExperimentActive(Experiment::TEST_ONLY_TCMALLOC_POW2_SIZECLASS)) {
     return SizeClassConfiguration::kPow2Only;
   } else if (default_want_legacy_size_classes != nullptr &&
              default_want_legacy_size_classes() > 0) {
@@ -159,8 +225,26 @@ ABSL_ATTRIBUTE_COLD ABSL_ATTRIBUTE_NOINLINE void Static::SlowInitIfNecessary() {
 
   // double-checked locking
   if (!inited_.load(std::memory_order_acquire)) {
+    const int64_t start = absl::base_internal::CycleClock::Now();
     absl::Span<const SizeClassInfo> size_classes;
 
+    // A size class configuration generated from an allocation profile takes
+    // precedence over the compiled-in ones, if it is valid.
+    ABSL_CONST_INIT static SizeClassInfo profiled_size_classes[kNumBaseClasses];
+    if (const char* path = thread_safe_getenv("TCMALLOC_SIZE_CLASSES_FILE");
+        path != nullptr) {
+      const size_t num_classes =
+          SizeMap::LoadSizeClasses(path, profiled_size_classes);
+      if (num_classes > 0) {
+        size_classes = absl::MakeConstSpan(profiled_size_classes, num_classes);
+        profiled_size_classes_.store(true, std::memory_order_relaxed);
+      } else {
+        Log(kLog, __FILE__, __LINE__,
+            "ignoring invalid size classes from TCMALLOC_SIZE_CLASSES_FILE",
+            path);
+      }
+    }
+
     switch (Static::size_class_configuration()) {
       case SizeClassConfiguration::kPow2Below64:
         size_classes = kSizeClasses;
@@ -175,22 +259,93 @@ ABSL_ATTRIBUTE_COLD ABSL_ATTRIBUTE_NOINLINE void Static::SlowInitIfNecessary() {
         // TODO(b/242710633): remove this opt out.
         size_classes = kLegacySizeClasses;
         break;
+      case SizeClassConfiguration::kProfile:
+        break;
     }
 
+    const int64_t size_map_start = absl::base_internal::CycleClock::Now();
     CHECK_CONDITION(sizemap_.Init(size_classes));
+    startup_timings_.size_map_init =
+        absl::base_internal::CycleClock::Now() - size_map_start;
+    if (kSizeClassTags && EnableSizeClassTags()) {
+      fast_path_.size_class_tag_mask = kSizeClassTagMask;
+    }
     // Verify we can determine the number of CPUs now, since we will need it
     // later for per-CPU caches and initializing the cache topology.
     (void)NumCPUs();
+    const int64_t numa_start = absl::base_internal::CycleClock::Now();
     numa_topology_.Init();
+    startup_timings_.numa_topology_init =
+        absl::base_internal::CycleClock::Now() - numa_start;
+    fast_path_.numa_aware = numa_topology_.numa_aware();
     CacheTopology::Instance().Init();
     sampledallocation_allocator_.Init(&arena_);
+    depot_stack_allocator_.Init(&arena_);
+    sampled_slabs_.Init(&arena_);
     sampled_allocation_recorder_.Construct(&sampledallocation_allocator_);
     sampled_allocation_recorder().Init();
+    if (const char* path = thread_safe_getenv("TCMALLOC_SAMPLE_EVENT_RING");
+        path != nullptr) {
+      const int num_rings =
+          std::min<int>(NumCPUs(), SampleEventRing::kMaxRings);
+      if (!sample_event_ring_.InitFromFile(
+              path, num_rings, SampleEventRing::kDefaultRingBytes)) {
+        Log(kLog, __FILE__, __LINE__,
+            "failed to map TCMALLOC_SAMPLE_EVENT_RING", path);
+      }
+    }
+    if (const char* path = thread_safe_getenv("TCMALLOC_STATS_PAGE");
+        path != nullptr) {
+      if (!stats_page_.InitFromFile(path)) {
+        Log(kLog, __FILE__, __LINE__, "failed to map TCMALLOC_STATS_PAGE",
+            path);
+      }
+    }
+    if (const char* path = thread_safe_getenv("TCMALLOC_ALLOCATION_TRACE");
+        path != nullptr) {
+      const int num_buffers =
+          std::min<int>(NumCPUs(), AllocationTraceWriter::kMaxBuffers);
+      if (!allocation_trace_.InitFromFile(
+              path, num_buffers, AllocationTraceWriter::kDefaultBufferBytes)) {
+        Log(kLog, __FILE__, __LINE__,
+            "failed to open TCMALLOC_ALLOCATION_TRACE", path);
+      }
+    }
+    // Per-cpu caches are populated on first use, possibly before the
+    // background thread starts, so their warm start has to be in place now.
+    // The background thread applies the rest of the profile.
+    if (const char* path = thread_safe_getenv("TCMALLOC_DEMAND_PROFILE");
+        path != nullptr && warm_start.Init(path)) {
+      for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+        const DemandProfile::SizeClassDemand* demand =
+            warm_start.profile().Find(sizemap_.class_to_size(size_class));
+        if (demand != nullptr) {
+          cpu_cache_.SetWarmCapacity(size_class, demand->cpu_capacity);
+        }
+      }
+    }
+    // Small-footprint mode starts out with small per-cpu caches and releases
+    // memory in the background, unless these were configured already.
+    if (Parameters::small_footprint()) {
+      if (cpu_cache_.CacheLimit() == kMaxCpuCacheSize) {
+        cpu_cache_.SetCacheLimit(
+            std::min(kMaxCpuCacheSize,
+                     cpu_cache_internal::kSmallFootprintMaxCpuCacheSize));
+      }
+      if (static_cast<size_t>(Parameters::background_release_rate()) == 0) {
+        Parameters::set_background_release_rate(
+            MallocExtension::BytesPerSecond{
+                Parameters::kSmallFootprintReleaseRate});
+      }
+    }
     peak_heap_tracker_.Init(&arena_);
-    span_allocator_.Init(&arena_);
-    span_allocator_.New();  // Reduce cache conflicts
-    span_allocator_.New();  // Reduce cache conflicts
+    for (size_t i = 0; i < kNumaPartitions; ++i) {
+      span_allocator_[i].Init(&arena_, i);
+      span_allocator_[i].New();  // Reduce cache conflicts
+      span_allocator_[i].New();  // Reduce cache conflicts
+    }
     linked_sample_allocator_.Init(&arena_);
+    sample_log_allocator_.Init(&arena_);
     // Do a bit of sanitizing: make sure central_cache is aligned properly
     CHECK_CONDITION((sizeof(transfer_cache_) % ABSL_CACHELINE_SIZE) == 0);
     transfer_cache_.Init();
@@ -201,6 +356,8 @@ ABSL_ATTRIBUTE_COLD ABSL_ATTRIBUTE_NOINLINE void Static::SlowInitIfNecessary() {
     threadcache_allocator_.Init(&arena_);
     pagemap_.MapRootWithSmallPages();
     guardedpage_allocator_.Init(/*max_alloced_pages=*/64, /*total_pages=*/128);
+    startup_timings_.globals_init =
+        absl::base_internal::CycleClock::Now() - start;
     inited_.store(true, std::memory_order_release);
   }
 }
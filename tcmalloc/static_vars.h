@@ -32,20 +32,26 @@
 #include "tcmalloc/common.h"
 #include "tcmalloc/deallocation_profiler.h"
 #include "tcmalloc/guarded_page_allocator.h"
+#include "tcmalloc/internal/allocation_trace.h"
 #include "tcmalloc/internal/atomic_stats_counter.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/explicitly_constructed.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/numa.h"
 #include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/internal/sample_event_ring.h"
+#include "tcmalloc/internal/stats_page.h"
 #include "tcmalloc/internal/sampled_allocation.h"
 #include "tcmalloc/internal/sampled_allocation_recorder.h"
+#include "tcmalloc/internal/size_class_lifetimes.h"
 #include "tcmalloc/internal/stacktrace_filter.h"
+#include "tcmalloc/mte_sampled_allocator.h"
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/peak_heap_tracker.h"
 #include "tcmalloc/sampled_allocation_allocator.h"
+#include "tcmalloc/sampled_slabs.h"
 #include "tcmalloc/sizemap.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stack_trace_table.h"
@@ -68,6 +74,22 @@ enum class SizeClassConfiguration {
   kPow2Only = 2,
   kLowFrag = 3,
   kLegacy = 4,
+  // Loaded from the file named by TCMALLOC_SIZE_CLASSES_FILE at startup.
+  kProfile = 5,
+};
+
+// How long TCMalloc's one-time startup steps took, in CycleClock ticks, for
+// judging its share of a process's cold start.  Steps not yet taken read 0.
+// Each is written once, by the thread taking the step.
+struct StartupTimings {
+  // All of Static::InitIfNecessary, including the two steps that follow.
+  int64_t globals_init = 0;
+  int64_t size_map_init = 0;
+  int64_t numa_topology_init = 0;
+  // CpuCache::Activate, once the globals are initialized.
+  int64_t cpu_cache_activate = 0;
+  // The first SystemAlloc, which sets up the system allocator.
+  int64_t first_system_alloc = 0;
 };
 
 class Static final {
@@ -99,6 +121,10 @@ class Static final {
 
   static PeakHeapTracker& peak_heap_tracker() { return peak_heap_tracker_; }
 
+  static SizeClassLifetimes<kNumClasses>& size_class_lifetimes() {
+    return size_class_lifetimes_;
+  }
+
   static NumaTopology<kNumaPartitions, kNumBaseClasses>& numa_topology() {
     return numa_topology_;
   }
@@ -120,13 +146,46 @@ class Static final {
     return guardedpage_allocator_;
   }
 
+  static MteSampledAllocator& mte_sampled_allocator() {
+    return mte_sampled_allocator_;
+  }
+
   static StackTraceFilter& stacktrace_filter() { return stacktrace_filter_; }
+  // The allocation sites recently sampled for profiling, for
+  // Parameters::profile_sampling_site_boost.
+  static StackTraceFilter& sampled_site_filter() {
+    return sampled_site_filter_;
+  }
 
   static SampledAllocationAllocator& sampledallocation_allocator() {
     return sampledallocation_allocator_;
   }
 
-  static PageHeapAllocator<Span>& span_allocator() { return span_allocator_; }
+  static SampledSlabs& sampled_slabs() { return sampled_slabs_; }
+
+  static SampledStackDepot& sampled_stack_depot() {
+    return sampled_stack_depot_;
+  }
+
+  static SampleEventRing& sample_event_ring() { return sample_event_ring_; }
+
+  static StatsPage& stats_page() { return stats_page_; }
+
+  static AllocationTraceWriter& allocation_trace() {
+    return allocation_trace_;
+  }
+
+  // Spans are allocated on the NUMA partition of the pages they describe.
+  static CpuCachedPageHeapAllocator<Span>& span_allocator(
+      size_t numa_partition) {
+    ASSERT(numa_partition < kNumaPartitions);
+    return span_allocator_[numa_partition];
+  }
+  static CpuCachedPageHeapAllocator<Span>& span_allocator(PageId p) {
+    return span_allocator(NumaPartitionFromPointer(p.start_addr()));
+  }
+  static AllocatorStats span_stats()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   static PageHeapAllocator<ThreadCache>& threadcache_allocator() {
     return threadcache_allocator_;
@@ -146,6 +205,11 @@ class Static final {
   // total_sampled_count_ tracks the total number of allocations that are
   // sampled.
   ABSL_CONST_INIT static tcmalloc_internal::StatsCounter total_sampled_count_;
+  // The total weight of the sampled allocations made and freed so far: the
+  // estimated number of bytes allocated and freed since startup.
+  ABSL_CONST_INIT static tcmalloc_internal::StatsCounter
+      sampled_weight_allocated_;
+  ABSL_CONST_INIT static tcmalloc_internal::StatsCounter sampled_weight_freed_;
 
   ABSL_CONST_INIT static AllocationSampleList allocation_samples;
 
@@ -162,6 +226,11 @@ class Static final {
     return linked_sample_allocator_;
   }
 
+  static PageHeapAllocator<AllocationSampleList::Entry>&
+  sample_log_allocator() {
+    return sample_log_allocator_;
+  }
+
   static bool ABSL_ATTRIBUTE_ALWAYS_INLINE CpuCacheActive() {
     return cpu_cache_active_.load(std::memory_order_acquire);
   }
@@ -169,18 +238,42 @@ class Static final {
     cpu_cache_active_.store(true, std::memory_order_release);
   }
 
+  // The bits of the pointers to small objects that carry their size class, or
+  // 0 if objects are not tagged (see EnableSizeClassTags).  Set before
+  // initialization completes.
+  static uintptr_t ABSL_ATTRIBUTE_ALWAYS_INLINE size_class_tag_mask() {
+    return fast_path_.size_class_tag_mask;
+  }
+
+  // Whether the free fast path must look out for objects of other NUMA
+  // partitions: numa_topology().numa_aware(), copied next to
+  // size_class_tag_mask() once the topology is known.
+  static bool ABSL_ATTRIBUTE_ALWAYS_INLINE numa_aware_fast_path() {
+    return fast_path_.numa_aware;
+  }
+
+  // Allocation tracing is our only hook: while it is on, every allocation and
+  // free takes the slow path, which records it.
   static bool ABSL_ATTRIBUTE_ALWAYS_INLINE HaveHooks() {
-    return false;
+    return allocation_trace_.enabled();
   }
 
   static size_t metadata_bytes() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Releases the memory of up to <max_slabs> slabs of free metadata objects
+  // per allocator (see PageHeapAllocator::ReleaseFreeSlabs).  Returns the
+  // number of bytes released.
+  static size_t ReleaseFreeMetadata(size_t max_slabs)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
   // The root of the pagemap is potentially a large poorly utilized
   // structure, so figure out how much of it is actually resident.
   static size_t pagemap_residence();
 
   static SizeClassConfiguration size_class_configuration();
 
+  static StartupTimings& startup_timings() { return startup_timings_; }
+
  private:
 #if defined(__clang__)
   __attribute__((preserve_most))
@@ -200,15 +293,44 @@ class Static final {
   ABSL_CONST_INIT static ShardedTransferCacheManager sharded_transfer_cache_;
   static CpuCache cpu_cache_;
   ABSL_CONST_INIT static GuardedPageAllocator guardedpage_allocator_;
+  ABSL_CONST_INIT static MteSampledAllocator mte_sampled_allocator_;
   ABSL_CONST_INIT static StackTraceFilter stacktrace_filter_;
+  ABSL_CONST_INIT static StackTraceFilter sampled_site_filter_;
   static SampledAllocationAllocator sampledallocation_allocator_;
-  static PageHeapAllocator<Span> span_allocator_;
+  static DepotStackAllocator depot_stack_allocator_;
+  // Packs small sampled objects into shared spans.
+  static SampledSlabs sampled_slabs_;
+  // Interns the stacks of sampled allocations.
+  static SampledStackDepot sampled_stack_depot_;
+  // Streams sampled allocation events to the file named by
+  // TCMALLOC_SAMPLE_EVENT_RING, if set.
+  static SampleEventRing sample_event_ring_;
+  // Publishes key counters to the file named by TCMALLOC_STATS_PAGE, if set.
+  static StatsPage stats_page_;
+  // Records every allocation and free to the file named by
+  // TCMALLOC_ALLOCATION_TRACE, if set.
+  static AllocationTraceWriter allocation_trace_;
+  static CpuCachedPageHeapAllocator<Span> span_allocator_[kNumaPartitions];
   static PageHeapAllocator<ThreadCache> threadcache_allocator_;
   static PageHeapAllocator<StackTraceTable::LinkedSample>
       linked_sample_allocator_;
+  static PageHeapAllocator<AllocationSampleList::Entry> sample_log_allocator_;
   ABSL_CONST_INIT static std::atomic<bool> inited_;
   ABSL_CONST_INIT static std::atomic<bool> cpu_cache_active_;
+  ABSL_CONST_INIT static std::atomic<bool> profiled_size_classes_;
+  ABSL_CONST_INIT static StartupTimings startup_timings_;
+  // The configuration the fast paths branch on, chosen once during
+  // initialization and kept on a cache line of its own.
+  struct alignas(ABSL_CACHELINE_SIZE) FastPathState {
+    uintptr_t size_class_tag_mask = 0;
+    bool numa_aware = false;
+  };
+  ABSL_CONST_INIT static FastPathState fast_path_;
   ABSL_CONST_INIT static PeakHeapTracker peak_heap_tracker_;
+  // Lifetimes of sampled objects by size class, used to place the spans of
+  // long-lived size classes apart from short-lived ones.
+  ABSL_CONST_INIT static SizeClassLifetimes<kNumClasses>
+      size_class_lifetimes_;
   ABSL_CONST_INIT static NumaTopology<kNumaPartitions, kNumBaseClasses>
       numa_topology_;
 
@@ -250,17 +372,34 @@ inline void Static::InitIfNecessary() {
 // TODO(b/134687001): move span_allocator to Span, getting rid of the need for
 // this.
 inline Span* Span::New(PageId p, Length len) {
-  Span* result = Static::span_allocator().New();
+  Span* result = Static::span_allocator(p).New();
   result->Init(p, len);
   return result;
 }
 
 inline void Span::Delete(Span* span) {
+  // Spans never move between NUMA partitions, so the first page leads back to
+  // the allocator.
+  auto& allocator = Static::span_allocator(span->first_page());
 #ifndef NDEBUG
   // In debug mode, trash the contents of deleted Spans
   memset(static_cast<void*>(span), 0x3f, sizeof(*span));
 #endif
-  Static::span_allocator().Delete(span);
+  allocator.Delete(span);
+}
+
+inline Span* Span::NewUnlocked(PageId p, Length len) {
+  Span* result = Static::span_allocator(p).NewUnlocked();
+  result->Init(p, len);
+  return result;
+}
+
+inline void Span::DeleteUnlocked(Span* span) {
+  auto& allocator = Static::span_allocator(span->first_page());
+#ifndef NDEBUG
+  memset(static_cast<void*>(span), 0x3f, sizeof(*span));
+#endif
+  allocator.DeleteUnlocked(span);
 }
 
 }  // namespace tcmalloc_internal
@@ -278,7 +278,9 @@ void PageAllocInfo::RecordFree(PageId p, Length n) {
   }
 }
 
-void PageAllocInfo::RecordRelease(Length n, Length got) {}
+void PageAllocInfo::RecordRelease(Length n, Length got) {
+  total_released_ += got;
+}
 
 const PageAllocInfo::Counts& PageAllocInfo::counts_for(Length n) const {
   if (n <= kMaxPages) {
@@ -115,6 +115,8 @@ class PageAllocInfo {
   // and didn't use the rest.)
   // Return the total slack of all non-small allocations.
   Length slack() const { return total_slack_; }
+  // Total pages released to the OS by ReleaseAtLeastNPages.
+  Length released() const { return total_released_; }
 
   const Counts& counts_for(Length n) const;
 
@@ -124,6 +126,7 @@ class PageAllocInfo {
  private:
   Length total_small_;
   Length total_slack_;
+  Length total_released_;
 
   Length largest_seen_;
 
@@ -16,11 +16,16 @@
 
 #include <asm/unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -35,21 +40,28 @@
 #include "absl/base/attributes.h"
 #include "absl/base/call_once.h"
 #include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/numeric/bits.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_format.h"
 #include "absl/types/optional.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/exponential_biased.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/numa.h"
 #include "tcmalloc/internal/optimization.h"
 #include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/pageflags.h"
+#include "tcmalloc/internal/probes.h"
+#include "tcmalloc/internal/sysinfo.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
@@ -71,6 +83,36 @@
 #define PR_SET_VMA_ANON_NAME 0
 #endif
 
+// MADV_POPULATE_WRITE was added in Linux 5.14; older headers lack it.
+#if defined(__linux__) && !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// MADV_COLLAPSE was added in Linux 6.1; older headers lack it.
+#if defined(__linux__) && !defined(MADV_COLLAPSE)
+#define MADV_COLLAPSE 25
+#endif
+
+// process_madvise was added in Linux 5.10, and releasing the caller's own memory
+// with it (via PIDFD_SELF) in Linux 6.13.  Older headers lack both.
+#if defined(__linux__) && !defined(SYS_process_madvise)
+#define SYS_process_madvise 440
+#endif
+
+#if defined(__linux__) && !defined(PIDFD_SELF)
+#define PIDFD_SELF -10000
+#endif
+
+// MADV_COLD was added in Linux 5.4; older headers lack it.
+#if defined(__linux__) && !defined(MADV_COLD)
+#define MADV_COLD 20
+#endif
+
+// Older <sys/mman.h> headers may lack the hugetlb page size encoding.
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_1GB)
+#define MAP_HUGE_1GB (30 << 26)
+#endif
+
 // Solaris has a bug where it doesn't declare madvise() for C++.
 //    http://www.opensolaris.org/jive/thread.jspa?threadID=21035&tstart=0
 #if defined(__sun) && defined(__SVR4)
@@ -87,6 +129,183 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 namespace {
 
+// Counts, and times into log-bucketed histograms, the system calls made by
+// this file.  System calls are slow enough that every one is timed.
+class SystemCallStats {
+ public:
+  // Bucket i counts calls taking [2^(i + kMinShift), 2^(i + 1 + kMinShift))
+  // CycleClock ticks.  The first and last buckets are open-ended.
+  static constexpr int kMinShift = 10;
+  static constexpr int kBuckets = 20;
+  static constexpr int kNumCalls = static_cast<int>(SystemCall::kNumCalls);
+
+  constexpr SystemCallStats() = default;
+
+  void Record(SystemCall call, int64_t start) {
+    const int64_t elapsed = absl::base_internal::CycleClock::Now() - start;
+    const int c = static_cast<int>(call);
+    counts_[c][BucketFor(elapsed)].fetch_add(1, std::memory_order_relaxed);
+    if (elapsed > 0) ticks_[c].fetch_add(elapsed, std::memory_order_relaxed);
+  }
+
+  uint64_t Total(SystemCall call) const {
+    uint64_t total = 0;
+    for (const auto& count : counts_[static_cast<int>(call)]) {
+      total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  static constexpr uint64_t BucketLimit(int bucket) {
+    return uint64_t{1} << (bucket + kMinShift + 1);
+  }
+
+  static int BucketFor(int64_t ticks) {
+    if (ticks <= 0) return 0;
+    const int bucket =
+        absl::bit_width(static_cast<uint64_t>(ticks)) - 1 - kMinShift;
+    return std::clamp(bucket, 0, kBuckets - 1);
+  }
+
+  static const char* Name(int call);
+
+  // The total time taken by calls of <call>, in milliseconds.
+  double Millis(int call) const {
+    return ticks_[call].load(std::memory_order_relaxed) * 1e3 /
+           absl::base_internal::CycleClock::Frequency();
+  }
+
+  std::atomic<uint64_t> counts_[kNumCalls][kBuckets] = {};
+  std::atomic<uint64_t> ticks_[kNumCalls] = {};
+};
+
+const char* SystemCallStats::Name(int call) {
+  switch (static_cast<SystemCall>(call)) {
+    case SystemCall::kMmap:
+      return "MMAP";
+    case SystemCall::kMunmap:
+      return "MUNMAP";
+    case SystemCall::kMremap:
+      return "MREMAP";
+    case SystemCall::kMprotect:
+      return "MPROTECT";
+    case SystemCall::kMadvise:
+      return "MADVISE";
+    case SystemCall::kProcessMadvise:
+      return "PROCESS_MADVISE";
+    case SystemCall::kMbind:
+      return "MBIND";
+    case SystemCall::kNumCalls:
+      break;
+  }
+  ASSUME(false);
+  return "";
+}
+
+void SystemCallStats::Print(Printer* out) const {
+  out->printf("System calls: non-cumulative number taking < N cycles\n");
+  for (int call = 0; call < kNumCalls; ++call) {
+    const uint64_t total = Total(static_cast<SystemCall>(call));
+    if (total == 0) continue;
+    out->printf("%-15s : %8llu calls, %10.3f ms;", Name(call), total,
+                Millis(call));
+    for (int i = 0; i < kBuckets; ++i) {
+      const uint64_t n = counts_[call][i].load(std::memory_order_relaxed);
+      if (n == 0) continue;
+      out->printf(" %llu < %llu", n, BucketLimit(i));
+    }
+    out->printf("\n");
+  }
+}
+
+void SystemCallStats::PrintInPbtxt(PbtxtRegion* region) const {
+  for (int call = 0; call < kNumCalls; ++call) {
+    const uint64_t total = Total(static_cast<SystemCall>(call));
+    if (total == 0) continue;
+    PbtxtRegion entry = region->CreateSubRegion("system_calls");
+    entry.PrintRaw("call", Name(call));
+    entry.PrintI64("count", total);
+    entry.PrintDouble("total_ms", Millis(call));
+    for (int i = 0; i < kBuckets; ++i) {
+      const uint64_t n = counts_[call][i].load(std::memory_order_relaxed);
+      if (n == 0) continue;
+      PbtxtRegion histogram = entry.CreateSubRegion("latency_histogram");
+      histogram.PrintI64("lower_bound", i == 0 ? 0 : BucketLimit(i - 1));
+      histogram.PrintI64("upper_bound", BucketLimit(i));
+      histogram.PrintI64("value", n);
+    }
+  }
+}
+
+ABSL_CONST_INIT SystemCallStats system_call_stats;
+
+// Times its scope into system_call_stats.
+class ScopedSystemCallTimer {
+ public:
+  explicit ScopedSystemCallTimer(SystemCall call)
+      : call_(call), start_(absl::base_internal::CycleClock::Now()) {}
+  ~ScopedSystemCallTimer() { system_call_stats.Record(call_, start_); }
+
+  ScopedSystemCallTimer(const ScopedSystemCallTimer&) = delete;
+  ScopedSystemCallTimer& operator=(const ScopedSystemCallTimer&) = delete;
+
+ private:
+  const SystemCall call_;
+  const int64_t start_;
+};
+
+// The system calls of this file, counted and timed.  None of them changes
+// errno beyond what the system call itself does.
+void* Mmap(void* addr, size_t length, int prot, int flags, int fd,
+           off_t offset) {
+  ScopedSystemCallTimer timer(SystemCall::kMmap);
+  return mmap(addr, length, prot, flags, fd, offset);
+}
+
+int Munmap(void* addr, size_t length) {
+  ScopedSystemCallTimer timer(SystemCall::kMunmap);
+  return munmap(addr, length);
+}
+
+#if defined(__linux__) && defined(MREMAP_FIXED)
+void* Mremap(void* old_addr, size_t old_length, size_t new_length, int flags,
+             void* new_addr) {
+  ScopedSystemCallTimer timer(SystemCall::kMremap);
+  return mremap(old_addr, old_length, new_length, flags, new_addr);
+}
+#endif  // __linux__ && MREMAP_FIXED
+
+int Mprotect(void* addr, size_t length, int prot) {
+  ScopedSystemCallTimer timer(SystemCall::kMprotect);
+  return mprotect(addr, length, prot);
+}
+
+int Madvise(void* addr, size_t length, int advice) {
+  ScopedSystemCallTimer timer(SystemCall::kMadvise);
+#if defined(__sun) && defined(__SVR4)
+  return madvise(static_cast<caddr_t>(addr), length, advice);
+#else
+  return madvise(addr, length, advice);
+#endif
+}
+
+long Mbind(void* addr, size_t length, int mode, const uint64_t* nodemask,
+           unsigned long maxnode, unsigned flags) {  // NOLINT(runtime/int)
+  ScopedSystemCallTimer timer(SystemCall::kMbind);
+  return syscall(__NR_mbind, addr, length, mode, nodemask, maxnode, flags);
+}
+
+#if defined(__linux__) && defined(MADV_DONTNEED)
+long ProcessMadvise(const struct iovec* iov, size_t n, int advice) {
+  ScopedSystemCallTimer timer(SystemCall::kProcessMadvise);
+  return syscall(SYS_process_madvise, PIDFD_SELF, iov, n, advice, 0);
+}
+#endif  // __linux__ && MADV_DONTNEED
+
 // Check that no bit is set at position ADDRESS_BITS or higher.
 template <int ADDRESS_BITS>
 void CheckAddressBits(uintptr_t ptr) {
@@ -120,6 +339,52 @@ ABSL_CONST_INIT size_t preferred_alignment ABSL_GUARDED_BY(spinlock) = 0;
 ABSL_CONST_INIT AddressRegionFactory* region_factory ABSL_GUARDED_BY(spinlock) =
     nullptr;
 
+// The address space each memory tag reserves at a time.  When
+// TCMALLOC_RESERVE_REGION_BYTES raises it above kMinMmapAlloc, the default
+// factory's reservations are made accessible (and advised) whole, up front,
+// so that carving memory from them changes no protections.  A tag's heap then
+// stays a single mapping, rather than alternating accessible and PROT_NONE
+// ones, which keeps the process's VMA count down.
+ABSL_CONST_INIT size_t region_reservation ABSL_GUARDED_BY(spinlock) =
+    kMinMmapAlloc;
+
+// NUMA node that memory for cold allocations is preferentially placed on, or -1
+// to place it like any other memory.  Set from TCMALLOC_COLD_NUMA_NODE, which
+// typically names a CPU-less node backed by slower (e.g. CXL) memory.
+ABSL_CONST_INIT int cold_numa_node ABSL_GUARDED_BY(spinlock) = -1;
+
+// File that memory for cold allocations is mapped from, or -1 to use anonymous
+// memory.  Set from TCMALLOC_COLD_DAX_FILE, which names a file (or a directory
+// to create one in) on a DAX filesystem, or a device DAX node, backed by a
+// cheaper memory tier such as persistent memory or a CXL memory expander.
+ABSL_CONST_INIT int cold_dax_fd ABSL_GUARDED_BY(spinlock) = -1;
+// Offset of the next mapping of cold_dax_fd.  Cold memory is never unmapped,
+// so offsets are never reused.
+ABSL_CONST_INIT off_t cold_dax_offset ABSL_GUARDED_BY(spinlock) = 0;
+ABSL_CONST_INIT std::atomic<size_t> cold_dax_bytes(0);
+ABSL_CONST_INIT std::atomic<size_t> cold_dax_fallback_bytes(0);
+
+// File that the registered heap is mapped from, so that other processes can
+// map its objects too, or -1 to use anonymous memory.  Set from
+// TCMALLOC_SHARED_HEAP_FILE.  Offset x of the file is mapped at
+// kSharedHeapBase + x, in every process that shares it.
+ABSL_CONST_INIT int shared_heap_fd ABSL_GUARDED_BY(spinlock) = -1;
+// Set along with shared_heap_fd, for MmapAligned().
+ABSL_CONST_INIT std::atomic<bool> shared_heap(false);
+ABSL_CONST_INIT std::atomic<size_t> shared_heap_bytes(0);
+// The start of the address range of registered memory, which is the same in
+// every process using the same build of TCMalloc.
+constexpr uintptr_t kSharedHeapBase =
+    static_cast<uintptr_t>(MemoryTag::kRegistered) << kTagShift;
+
+// Ranges handed out for MemoryTag::kCold, which SystemAdviseCold() deactivates.
+// Regions are carved from the top down, so consecutive allocations are usually
+// adjacent and coalesce into a single range.
+constexpr size_t kMaxColdRanges = 64;
+ABSL_CONST_INIT std::array<AddressRange, kMaxColdRanges> cold_ranges
+    ABSL_GUARDED_BY(spinlock){};
+ABSL_CONST_INIT size_t num_cold_ranges ABSL_GUARDED_BY(spinlock) = 0;
+
 // Rounds size down to a multiple of alignment.
 size_t RoundDown(const size_t size, const size_t alignment) {
   // Checks that the alignment has only one bit set.
@@ -132,10 +397,216 @@ size_t RoundUp(const size_t size, const size_t alignment) {
   return RoundDown(size + alignment - 1, alignment);
 }
 
+size_t RegionReservationFromEnv() {
+  const char* e = thread_safe_getenv("TCMALLOC_RESERVE_REGION_BYTES");
+  if (e == nullptr) return kMinMmapAlloc;
+  constexpr size_t kTagFree = size_t{1} << kTagShift;
+  size_t bytes;
+  if (!absl::SimpleAtoi(e, &bytes) || bytes == 0 || bytes > kTagFree) {
+    Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+  }
+  return std::max(RoundUp(bytes, kMinMmapAlloc), kMinMmapAlloc);
+}
+
+int ColdNumaNodeFromEnv() {
+  const char* e = thread_safe_getenv("TCMALLOC_COLD_NUMA_NODE");
+  if (e == nullptr) return -1;
+  int node;
+  if (!absl::SimpleAtoi(e, &node) || node < 0 || node >= 64) {
+    Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+  }
+  return node;
+}
+
+// Prefers the cold NUMA node, if any, for the pages of [base, base + size).
+// Unlike BindMemory this is only a preference: cold allocations fall back to
+// other nodes rather than fail when the slow tier is full.
+void BindColdMemory(void* const base, const size_t size)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock) {
+#ifdef __linux__
+  if (cold_numa_node < 0) return;
+  const uint64_t nodemask = uint64_t{1} << cold_numa_node;
+  ErrnoRestorer errno_restorer;
+  if (Mbind(base, size, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0) !=
+      0) {
+    Log(kLogWithStack, __FILE__, __LINE__,
+        "Warning: Unable to mbind cold memory (errno, base, node)", errno,
+        base, cold_numa_node);
+  }
+#endif  // __linux__
+}
+
+// Adds [start, start + size) to the first n entries of <ranges>, merging it
+// with an adjacent range where possible.  Returns false if it is out of slots.
+template <size_t N>
+bool RecordRange(std::array<AddressRange, N>& ranges, size_t& n,
+                 void* const start, const size_t size) {
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(start);
+  const uintptr_t end = begin + size;
+  for (size_t i = 0; i < n; ++i) {
+    AddressRange& r = ranges[i];
+    const uintptr_t r_begin = reinterpret_cast<uintptr_t>(r.ptr);
+    if (end == r_begin) {
+      r = {start, r.bytes + size};
+      return true;
+    }
+    if (r_begin + r.bytes == begin) {
+      r.bytes += size;
+      return true;
+    }
+  }
+  if (n == N) return false;
+  ranges[n++] = {start, size};
+  return true;
+}
+
+int ColdDaxFileFromEnv() {
+  const char* e = thread_safe_getenv("TCMALLOC_COLD_DAX_FILE");
+  if (e == nullptr) return -1;
+  int fd = open(e, O_RDWR | O_CLOEXEC);
+  if (fd < 0 && errno == EISDIR) {
+    char path[PATH_MAX];
+    if (absl::SNPrintF(path, sizeof(path), "%s/tcmalloc.XXXXXX", e) >=
+        sizeof(path)) {
+      Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+    }
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0) unlink(path);
+  }
+  if (fd < 0) {
+    Crash(kCrash, __FILE__, __LINE__, "Unable to open DAX file (errno, path)",
+          errno, e);
+  }
+  return fd;
+}
+
+int SharedHeapFileFromEnv() {
+  const char* e = thread_safe_getenv("TCMALLOC_SHARED_HEAP_FILE");
+  if (e == nullptr) return -1;
+  if (!kHasRegisteredHeap) {
+    Log(kLog, __FILE__, __LINE__,
+        "Ignoring TCMALLOC_SHARED_HEAP_FILE without the registered heap", e);
+    return -1;
+  }
+  // Cooperating processes name the same file, typically on /dev/shm, or a
+  // memfd passed down as /proc/self/fd/N.  Unlike the cold DAX file, it is not
+  // unlinked: outliving us is the point.
+  int fd = open(e, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    Crash(kCrash, __FILE__, __LINE__,
+          "Unable to open shared heap file (errno, path)", errno, e);
+  }
+  return fd;
+}
+
+// Maps the fresh registered memory [base, base + size) from the shared heap
+// file, at the offset that corresponds to its address.  Returns false if it
+// could not, leaving the range reserved but inaccessible.
+bool PlaceSharedMemory(void* const base, const size_t size)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock) {
+#ifdef __linux__
+  ErrnoRestorer errno_restorer;
+  const off_t offset = reinterpret_cast<uintptr_t>(base) - kSharedHeapBase;
+  const off_t end = offset + size;
+  struct stat st;
+  // The file grows sparsely: only pages that are touched take up memory.
+  bool placed = fstat(shared_heap_fd, &st) == 0 &&
+                (st.st_size >= end || ftruncate(shared_heap_fd, end) == 0);
+  if (placed) {
+    placed = Mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                  shared_heap_fd, offset) == base;
+  }
+  if (placed) {
+    shared_heap_bytes.fetch_add(size, std::memory_order_relaxed);
+    return true;
+  }
+  Log(kLogWithStack, __FILE__, __LINE__,
+      "Unable to map shared heap file (errno, base, size)", errno, base, size);
+  // Falling back to private memory would silently stop sharing, so put the
+  // reservation back instead.
+  void* result = Mmap(base, size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  CHECK_CONDITION(result == base);
+#endif  // __linux__
+  return false;
+}
+
+// Maps the fresh cold memory [base, base + size) from the DAX file, if there is
+// one.  Otherwise, or once the file (or device) is full, the memory stays
+// anonymous and prefers the cold NUMA node.
+void PlaceColdMemory(void* const base, const size_t size)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock) {
+#ifdef __linux__
+  if (cold_dax_fd >= 0) {
+    ErrnoRestorer errno_restorer;
+    // Files on a DAX filesystem grow on demand; device DAX has a fixed size.
+    const off_t end = cold_dax_offset + size;
+    struct stat st;
+    if (fstat(cold_dax_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size < end) {
+      (void)ftruncate(cold_dax_fd, end);
+    }
+    // DAX only supports shared mappings: a private one would copy each
+    // written page into DRAM.
+    void* result = Mmap(base, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, cold_dax_fd, cold_dax_offset);
+    if (result == base) {
+      cold_dax_offset = end;
+      cold_dax_bytes.fetch_add(size, std::memory_order_relaxed);
+      return;
+    }
+    // The failed mmap may already have unmapped the range.
+    result = Mmap(base, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    CHECK_CONDITION(result == base);
+    (void)Madvise(base, size, MADV_NOHUGEPAGE);
+    cold_dax_fallback_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+#endif  // __linux__
+  BindColdMemory(base, size);
+}
+
+void RecordColdRange(void* const start, const size_t size)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock) {
+  // Once out of slots, further cold memory is simply never advised.
+  (void)RecordRange(cold_ranges, num_cold_ranges, start, size);
+}
+
+// Ranges backed by pages from the hugetlb pool (see HugetlbRegionFactory).
+// SystemRelease refuses these: a released hugetlb page goes back to the pool,
+// and should the pool be exhausted by the time it is touched again, the fault
+// raises SIGBUS.
+constexpr size_t kMaxHugetlbRanges = 64;
+ABSL_CONST_INIT std::array<AddressRange, kMaxHugetlbRanges> hugetlb_ranges
+    ABSL_GUARDED_BY(spinlock){};
+ABSL_CONST_INIT size_t num_hugetlb_ranges ABSL_GUARDED_BY(spinlock) = 0;
+// Set once hugetlb_ranges is nonempty, so that releases need not take spinlock
+// otherwise.
+ABSL_CONST_INIT std::atomic<bool> any_hugetlb_ranges(false);
+
+// Returns whether [start, start + size) overlaps a hugetlb range.
+bool OverlapsHugetlbRange(void* const start, const size_t size) {
+  if (!any_hugetlb_ranges.load(std::memory_order_acquire)) return false;
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(start);
+  const uintptr_t end = begin + size;
+  AllocationGuardSpinLockHolder lock_holder(&spinlock);
+  for (size_t i = 0; i < num_hugetlb_ranges; ++i) {
+    const AddressRange& r = hugetlb_ranges[i];
+    const uintptr_t r_begin = reinterpret_cast<uintptr_t>(r.ptr);
+    if (begin < r_begin + r.bytes && r_begin < end) {
+      return true;
+    }
+  }
+  return false;
+}
+
 class MmapRegion final : public AddressRegion {
  public:
-  MmapRegion(uintptr_t start, size_t size, AddressRegionFactory::UsageHint hint)
-      : start_(start), free_size_(size), hint_(hint) {}
+  // <committed> regions are already accessible and advised as their hint
+  // asks; see MmapRegionFactory::CreateCommitted.
+  MmapRegion(uintptr_t start, size_t size, AddressRegionFactory::UsageHint hint,
+             bool committed = false)
+      : start_(start), free_size_(size), hint_(hint), committed_(committed) {}
   std::pair<void*, size_t> Alloc(size_t size, size_t alignment) override
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock);
   ~MmapRegion() override = default;
@@ -144,6 +615,7 @@ class MmapRegion final : public AddressRegion {
   const uintptr_t start_;
   size_t free_size_;
   const AddressRegionFactory::UsageHint hint_;
+  const bool committed_;
 };
 
 class MmapRegionFactory final : public AddressRegionFactory {
@@ -153,12 +625,76 @@ class MmapRegionFactory final : public AddressRegionFactory {
   size_t GetStatsInPbtxt(absl::Span<char> buffer) override;
   ~MmapRegionFactory() override = default;
 
+  // Like Create, but first makes all of [start, start + size) accessible and
+  // advises it for <hint> with one call each, so that allocations from the
+  // region need neither.  Returns nullptr if that fails.
+  AddressRegion* CreateCommitted(void* start, size_t size, UsageHint hint)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock);
+
  private:
+  AddressRegion* CreateRegion(void* start, size_t size, UsageHint hint,
+                              bool committed);
+
   std::atomic<size_t> bytes_reserved_{0};
 };
 ABSL_CONST_INIT std::aligned_storage<sizeof(MmapRegionFactory),
                                      alignof(MmapRegionFactory)>::type
     mmap_space ABSL_GUARDED_BY(spinlock){};
+// The default factory, constructed in mmap_space, if it is in use.
+ABSL_CONST_INIT MmapRegionFactory* mmap_factory ABSL_GUARDED_BY(spinlock) =
+    nullptr;
+
+// Backs memory with pages from the system's hugetlb pool, mapped either with
+// MAP_HUGETLB or from a file on a hugetlbfs mount.  Unlike transparent
+// hugepages, these are reserved when mapped, so backing depends on neither
+// khugepaged nor defragmentation.  Once the pool is exhausted, memory falls
+// back to ordinary anonymous mappings.
+//
+// Cold and sampled memory wants small pages (see MmapRegion::Alloc), so only
+// normal and registered regions are backed.
+class HugetlbRegionFactory final : public AddressRegionFactory {
+ public:
+  // fd is an unlinked file on a hugetlbfs mount, or -1 to use MAP_HUGETLB.
+  explicit HugetlbRegionFactory(int fd) : fd_(fd) {}
+
+  AddressRegion* Create(void* start, size_t size, UsageHint hint) override;
+  size_t GetStats(absl::Span<char> buffer) override;
+  size_t GetStatsInPbtxt(absl::Span<char> buffer) override;
+  ~HugetlbRegionFactory() override = default;
+
+  // Replaces the freshly carved [ptr, ptr + size) of a region with hint <hint>
+  // by hugetlb pages, falling back to anonymous memory if the pool cannot
+  // supply them.
+  void Back(void* ptr, size_t size, UsageHint hint)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock);
+
+ private:
+  const int fd_;
+  // Offset of the next mapping of fd_.  Mappings are never torn down, so
+  // offsets are never reused.
+  off_t next_offset_ ABSL_GUARDED_BY(spinlock) = 0;
+  std::atomic<size_t> bytes_reserved_{0};
+  std::atomic<size_t> bytes_hugetlb_{0};
+  std::atomic<size_t> bytes_fallback_{0};
+};
+ABSL_CONST_INIT std::aligned_storage<sizeof(HugetlbRegionFactory),
+                                     alignof(HugetlbRegionFactory)>::type
+    hugetlb_space ABSL_GUARDED_BY(spinlock){};
+
+class HugetlbRegion final : public AddressRegion {
+ public:
+  HugetlbRegion(HugetlbRegionFactory* factory, uintptr_t start, size_t size,
+                AddressRegionFactory::UsageHint hint)
+      : factory_(factory), mmap_(start, size, hint), hint_(hint) {}
+  std::pair<void*, size_t> Alloc(size_t size, size_t alignment) override
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock);
+  ~HugetlbRegion() override = default;
+
+ private:
+  HugetlbRegionFactory* const factory_;
+  MmapRegion mmap_;
+  const AddressRegionFactory::UsageHint hint_;
+};
 
 class RegionManager {
  public:
@@ -169,6 +705,7 @@ class RegionManager {
     std::fill(normal_region_.begin(), normal_region_.end(), nullptr);
     sampled_region_ = nullptr;
     cold_region_ = nullptr;
+    registered_region_ = nullptr;
   }
 
  private:
@@ -182,6 +719,7 @@ class RegionManager {
   std::array<AddressRegion*, kNumaPartitions> normal_region_{{nullptr}};
   AddressRegion* sampled_region_{nullptr};
   AddressRegion* cold_region_{nullptr};
+  AddressRegion* registered_region_{nullptr};
 };
 ABSL_CONST_INIT
 std::aligned_storage<sizeof(RegionManager), alignof(RegionManager)>::type
@@ -189,6 +727,25 @@ std::aligned_storage<sizeof(RegionManager), alignof(RegionManager)>::type
 ABSL_CONST_INIT RegionManager* region_manager ABSL_GUARDED_BY(spinlock) =
     nullptr;
 
+// Advises the kernel whether to back [ptr, ptr + size), of a region with hint
+// <hint>, with hugepages.
+void AdviseHugepages(void* ptr, size_t size,
+                     AddressRegionFactory::UsageHint hint) {
+  // For cold regions (kInfrequentAccess) and sampled regions
+  // (kInfrequentAllocation), we want as granular of access telemetry as
+  // possible; this hint means we can get 4kiB granularity instead of 2MiB.
+  if (hint == AddressRegionFactory::UsageHint::kInfrequentAccess ||
+      hint == AddressRegionFactory::UsageHint::kInfrequentAllocation) {
+    // This is only advisory, so ignore the error.
+    ErrnoRestorer errno_restorer;
+    (void)Madvise(ptr, size, MADV_NOHUGEPAGE);
+  } else if (GetHugePagePolicy() == HugePagePolicy::kAdvise) {
+    // Without this, the kernel would back none of our memory with hugepages.
+    ErrnoRestorer errno_restorer;
+    (void)Madvise(ptr, size, MADV_HUGEPAGE);
+  }
+}
+
 std::pair<void*, size_t> MmapRegion::Alloc(size_t request_size,
                                            size_t alignment) {
   // Align on kMinSystemAlloc boundaries to reduce external fragmentation for
@@ -208,32 +765,87 @@ std::pair<void*, size_t> MmapRegion::Alloc(size_t request_size,
 
   ASSERT(result % GetPageSize() == 0);
   void* result_ptr = reinterpret_cast<void*>(result);
-  if (mprotect(result_ptr, actual_size, PROT_READ | PROT_WRITE) != 0) {
-    Log(kLogWithStack, __FILE__, __LINE__,
-        "mprotect() region failed (ptr, size, error)", result_ptr, actual_size,
-        strerror(errno));
-    return {nullptr, 0};
+  if (!committed_) {
+    if (Mprotect(result_ptr, actual_size, PROT_READ | PROT_WRITE) != 0) {
+      Log(kLogWithStack, __FILE__, __LINE__,
+          "mprotect() region failed (ptr, size, error)", result_ptr,
+          actual_size, strerror(errno));
+      return {nullptr, 0};
+    }
+    AdviseHugepages(result_ptr, actual_size, hint_);
   }
-  // For cold regions (kInfrequentAccess) and sampled regions
-  // (kInfrequentAllocation), we want as granular of access telemetry as
-  // possible; this hint means we can get 4kiB granularity instead of 2MiB.
-  if (hint_ == AddressRegionFactory::UsageHint::kInfrequentAccess ||
-      hint_ == AddressRegionFactory::UsageHint::kInfrequentAllocation) {
-    // This is only advisory, so ignore the error.
-    ErrnoRestorer errno_restorer;
-    (void)madvise(result_ptr, actual_size, MADV_NOHUGEPAGE);
+  // Cold allocations belong on the slow memory tier, if there is one.  The
+  // range has not been touched yet, so no pages need to be migrated.
+  if (hint_ == AddressRegionFactory::UsageHint::kInfrequentAccess) {
+    PlaceColdMemory(result_ptr, actual_size);
+  }
+  if (hint_ == AddressRegionFactory::UsageHint::kRegistered &&
+      shared_heap_fd >= 0 && !PlaceSharedMemory(result_ptr, actual_size)) {
+    return {nullptr, 0};
   }
   free_size_ -= actual_size;
   return {result_ptr, actual_size};
 }
 
+static void PrintColdDaxStats(Printer& printer) {
+  const size_t dax = cold_dax_bytes.load(std::memory_order_relaxed);
+  const size_t fallback =
+      cold_dax_fallback_bytes.load(std::memory_order_relaxed);
+  if (dax == 0 && fallback == 0) return;
+  constexpr double MiB = 1048576.0;
+  printer.printf(
+      "ColdDaxFile: %zu bytes (%.1f MiB) mapped, %zu bytes (%.1f MiB) fell "
+      "back to anonymous memory\n",
+      dax, dax / MiB, fallback, fallback / MiB);
+}
+
+static void PrintColdDaxStatsInPbtxt(Printer& printer) {
+  const size_t dax = cold_dax_bytes.load(std::memory_order_relaxed);
+  const size_t fallback =
+      cold_dax_fallback_bytes.load(std::memory_order_relaxed);
+  if (dax == 0 && fallback == 0) return;
+  printer.printf(" cold_dax_bytes: %lld\n", dax);
+  printer.printf(" cold_dax_fallback_bytes: %lld\n", fallback);
+}
+
+static void PrintSharedHeapStats(Printer& printer) {
+  const size_t bytes = shared_heap_bytes.load(std::memory_order_relaxed);
+  if (bytes == 0) return;
+  printer.printf("SharedHeapFile: %zu bytes (%.1f MiB) mapped at %p\n", bytes,
+                 bytes / 1048576.0, reinterpret_cast<void*>(kSharedHeapBase));
+}
+
+static void PrintSharedHeapStatsInPbtxt(Printer& printer) {
+  const size_t bytes = shared_heap_bytes.load(std::memory_order_relaxed);
+  if (bytes == 0) return;
+  printer.printf(" shared_heap_bytes: %lld\n", bytes);
+}
+
 AddressRegion* MmapRegionFactory::Create(void* start, size_t size,
                                          UsageHint hint) {
+  return CreateRegion(start, size, hint, /*committed=*/false);
+}
+
+AddressRegion* MmapRegionFactory::CreateCommitted(void* start, size_t size,
+                                                  UsageHint hint) {
+  if (Mprotect(start, size, PROT_READ | PROT_WRITE) != 0) {
+    Log(kLogWithStack, __FILE__, __LINE__,
+        "mprotect() reservation failed (ptr, size, error)", start, size,
+        strerror(errno));
+    return nullptr;
+  }
+  AdviseHugepages(start, size, hint);
+  return CreateRegion(start, size, hint, /*committed=*/true);
+}
+
+AddressRegion* MmapRegionFactory::CreateRegion(void* start, size_t size,
+                                               UsageHint hint,
+                                               bool committed) {
   void* region_space = MallocInternal(sizeof(MmapRegion));
   if (!region_space) return nullptr;
   bytes_reserved_.fetch_add(size, std::memory_order_relaxed);
   return new (region_space)
-      MmapRegion(reinterpret_cast<uintptr_t>(start), size, hint);
+      MmapRegion(reinterpret_cast<uintptr_t>(start), size, hint, committed);
 }
 
 size_t MmapRegionFactory::GetStats(absl::Span<char> buffer) {
@@ -242,6 +854,8 @@ size_t MmapRegionFactory::GetStats(absl::Span<char> buffer) {
   constexpr double MiB = 1048576.0;
   printer.printf("MmapSysAllocator: %zu bytes (%.1f MiB) reserved\n", allocated,
                  allocated / MiB);
+  PrintColdDaxStats(printer);
+  PrintSharedHeapStats(printer);
 
   return printer.SpaceRequired();
 }
@@ -250,34 +864,158 @@ size_t MmapRegionFactory::GetStatsInPbtxt(absl::Span<char> buffer) {
   Printer printer(buffer.data(), buffer.size());
   size_t allocated = bytes_reserved_.load(std::memory_order_relaxed);
   printer.printf(" mmap_sys_allocator: %lld\n", allocated);
+  PrintColdDaxStatsInPbtxt(printer);
+  PrintSharedHeapStatsInPbtxt(printer);
+
+  return printer.SpaceRequired();
+}
+
+std::pair<void*, size_t> HugetlbRegion::Alloc(size_t size, size_t alignment) {
+  std::pair<void*, size_t> result = mmap_.Alloc(size, alignment);
+  if (result.first != nullptr) {
+    factory_->Back(result.first, result.second, hint_);
+  }
+  return result;
+}
+
+AddressRegion* HugetlbRegionFactory::Create(void* start, size_t size,
+                                            UsageHint hint) {
+  void* region_space = MallocInternal(sizeof(HugetlbRegion));
+  if (!region_space) return nullptr;
+  bytes_reserved_.fetch_add(size, std::memory_order_relaxed);
+  return new (region_space)
+      HugetlbRegion(this, reinterpret_cast<uintptr_t>(start), size, hint);
+}
+
+void HugetlbRegionFactory::Back(void* ptr, size_t size, UsageHint hint) {
+  std::optional<size_t> partition;
+  switch (hint) {
+    case UsageHint::kRegistered:
+      // The shared heap file already backs the range.
+      if (shared_heap_fd >= 0) return;
+      break;
+    case UsageHint::kNormal:
+      break;
+    case UsageHint::kNormalNumaAwareS0:
+    case UsageHint::kNormalNumaAwareS1:
+    case UsageHint::kNormalNumaAwareS2:
+    case UsageHint::kNormalNumaAwareS3:
+    case UsageHint::kNormalNumaAwareS4:
+    case UsageHint::kNormalNumaAwareS5:
+    case UsageHint::kNormalNumaAwareS6:
+    case UsageHint::kNormalNumaAwareS7:
+      partition = static_cast<size_t>(hint) -
+                  static_cast<size_t>(UsageHint::kNormalNumaAwareS0);
+      break;
+    default:
+      return;
+  }
+#if defined(__linux__) && defined(MAP_HUGETLB)
+  if (reinterpret_cast<uintptr_t>(ptr) % kHugePageSize != 0 ||
+      size % kHugePageSize != 0) {
+    return;
+  }
+
+  ErrnoRestorer errno_restorer;
+  // A private mapping reserves its pages from the pool up front, so it fails
+  // here (rather than raising SIGBUS on first touch) if the pool is short.
+  void* result =
+      fd_ < 0 ? Mmap(ptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1,
+                     0)
+              : Mmap(ptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_FIXED, fd_, next_offset_);
+  bool backed = result == ptr;
+  if (backed && !RecordRange(hugetlb_ranges, num_hugetlb_ranges, ptr, size)) {
+    // Without a record of the range, SystemRelease could not protect it.
+    backed = false;
+  }
+  if (backed) {
+    if (fd_ >= 0) next_offset_ += size;
+    any_hugetlb_ranges.store(true, std::memory_order_release);
+    bytes_hugetlb_.fetch_add(size, std::memory_order_relaxed);
+  } else {
+    // Depending on the kernel, the failed mmap may already have unmapped the
+    // range, so restore an ordinary mapping in its place.
+    result = Mmap(ptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    CHECK_CONDITION(result == ptr);
+    if (GetHugePagePolicy() == HugePagePolicy::kAdvise) {
+      (void)Madvise(ptr, size, MADV_HUGEPAGE);
+    }
+    bytes_fallback_.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  // A new mapping carries neither the NUMA policy nor the name of the one it
+  // replaced.
+  if (partition.has_value()) {
+    BindMemory(ptr, size, *partition);
+  }
+  prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, ptr, size,
+        backed ? "tcmalloc_region_hugetlb" : "tcmalloc_region_normal");
+#else
+  bytes_fallback_.fetch_add(size, std::memory_order_relaxed);
+#endif  // defined(__linux__) && defined(MAP_HUGETLB)
+}
+
+size_t HugetlbRegionFactory::GetStats(absl::Span<char> buffer) {
+  Printer printer(buffer.data(), buffer.size());
+  const size_t reserved = bytes_reserved_.load(std::memory_order_relaxed);
+  const size_t hugetlb = bytes_hugetlb_.load(std::memory_order_relaxed);
+  const size_t fallback = bytes_fallback_.load(std::memory_order_relaxed);
+  constexpr double MiB = 1048576.0;
+  printer.printf("HugetlbSysAllocator: %zu bytes (%.1f MiB) reserved\n",
+                 reserved, reserved / MiB);
+  printer.printf("HugetlbSysAllocator: %zu bytes (%.1f MiB) hugetlb-backed\n",
+                 hugetlb, hugetlb / MiB);
+  printer.printf(
+      "HugetlbSysAllocator: %zu bytes (%.1f MiB) fell back to anonymous "
+      "memory\n",
+      fallback, fallback / MiB);
+  PrintColdDaxStats(printer);
+  PrintSharedHeapStats(printer);
+
+  return printer.SpaceRequired();
+}
+
+size_t HugetlbRegionFactory::GetStatsInPbtxt(absl::Span<char> buffer) {
+  Printer printer(buffer.data(), buffer.size());
+  printer.printf(" hugetlb_sys_allocator: %lld\n",
+                 bytes_reserved_.load(std::memory_order_relaxed));
+  printer.printf(" hugetlb_backed_bytes: %lld\n",
+                 bytes_hugetlb_.load(std::memory_order_relaxed));
+  printer.printf(" hugetlb_fallback_bytes: %lld\n",
+                 bytes_fallback_.load(std::memory_order_relaxed));
+  PrintColdDaxStatsInPbtxt(printer);
+  PrintSharedHeapStatsInPbtxt(printer);
 
   return printer.SpaceRequired();
 }
 
 static AddressRegionFactory::UsageHint TagToHint(MemoryTag tag) {
   using UsageHint = AddressRegionFactory::UsageHint;
+  static constexpr UsageHint kNumaAwareHints[kMaxNumaPartitions] = {
+      UsageHint::kNormalNumaAwareS0, UsageHint::kNormalNumaAwareS1,
+      UsageHint::kNormalNumaAwareS2, UsageHint::kNormalNumaAwareS3,
+      UsageHint::kNormalNumaAwareS4, UsageHint::kNormalNumaAwareS5,
+      UsageHint::kNormalNumaAwareS6, UsageHint::kNormalNumaAwareS7,
+  };
+
   switch (tag) {
-    case MemoryTag::kNormal:
-      if (tc_globals.numa_topology().numa_aware()) {
-        return UsageHint::kNormalNumaAwareS0;
-      }
-      return UsageHint::kNormal;
-      break;
-    case MemoryTag::kNormalP1:
-      if (tc_globals.numa_topology().numa_aware()) {
-        return UsageHint::kNormalNumaAwareS1;
-      }
-      return UsageHint::kNormal;
-      break;
     case MemoryTag::kSampled:
       return UsageHint::kInfrequentAllocation;
       break;
     case MemoryTag::kCold:
       return UsageHint::kInfrequentAccess;
+    case MemoryTag::kRegistered:
+      return UsageHint::kRegistered;
+    default:
+      ASSUME(IsNormalMemoryTag(tag));
+      if (tc_globals.numa_topology().numa_aware()) {
+        return kNumaAwareHints[NumaPartitionFromTag(tag)];
+      }
+      return UsageHint::kNormal;
   }
-
-  ASSUME(false);
-  __builtin_unreachable();
 }
 
 std::pair<void*, size_t> RegionManager::Alloc(size_t request_size,
@@ -292,7 +1030,7 @@ std::pair<void*, size_t> RegionManager::Alloc(size_t request_size,
   // If we are dealing with large sizes, or large alignments we do not
   // want to throw away the existing reserved region, so instead we
   // return a new region specifically targeted for the request.
-  if (request_size > kMinMmapAlloc || alignment > kMinMmapAlloc) {
+  if (request_size > region_reservation || alignment > kMinMmapAlloc) {
     // Align on kMinSystemAlloc boundaries to reduce external fragmentation for
     // future allocations.
     size_t size = RoundUp(request_size, kMinSystemAlloc);
@@ -304,7 +1042,7 @@ std::pair<void*, size_t> RegionManager::Alloc(size_t request_size,
     const auto region_type = TagToHint(tag);
     AddressRegion* region = region_factory->Create(ptr, size, region_type);
     if (!region) {
-      munmap(ptr, size);
+      Munmap(ptr, size);
       return {nullptr, 0};
     }
     std::pair<void*, size_t> result = region->Alloc(size, alignment);
@@ -323,18 +1061,16 @@ std::pair<void*, size_t> RegionManager::Allocate(size_t size, size_t alignment,
                                                  const MemoryTag tag) {
   AddressRegion*& region = *[&]() {
     switch (tag) {
-      case MemoryTag::kNormal:
-        return &normal_region_[0];
-      case MemoryTag::kNormalP1:
-        return &normal_region_[1];
       case MemoryTag::kSampled:
         return &sampled_region_;
       case MemoryTag::kCold:
         return &cold_region_;
+      case MemoryTag::kRegistered:
+        return &registered_region_;
+      default:
+        ASSUME(IsNormalMemoryTag(tag));
+        return &normal_region_[NumaPartitionFromTag(tag)];
     }
-
-    ASSUME(false);
-    __builtin_unreachable();
   }();
   // For sizes that fit in our reserved range first of all check if we can
   // satisfy the request from what we have available.
@@ -345,18 +1081,54 @@ std::pair<void*, size_t> RegionManager::Allocate(size_t size, size_t alignment,
 
   // Allocation failed so we need to reserve more memory.
   // Reserve new region and try allocation again.
-  void* ptr = MmapAligned(kMinMmapAlloc, kMinMmapAlloc, tag);
+  const size_t reservation = region_reservation;
+  void* ptr = MmapAligned(reservation, kMinMmapAlloc, tag);
   if (!ptr) return {nullptr, 0};
 
   const auto region_type = TagToHint(tag);
-  region = region_factory->Create(ptr, kMinMmapAlloc, region_type);
+  region = nullptr;
+  if (reservation > kMinMmapAlloc && region_factory == mmap_factory) {
+    region = mmap_factory->CreateCommitted(ptr, reservation, region_type);
+  }
+  if (!region) {
+    region = region_factory->Create(ptr, reservation, region_type);
+  }
   if (!region) {
-    munmap(ptr, kMinMmapAlloc);
+    Munmap(ptr, reservation);
     return {nullptr, 0};
   }
   return region->Alloc(size, alignment);
 }
 
+// Returns the factory selected by TCMALLOC_HUGETLB_POOL, or nullptr if it is
+// unset.  "anon" maps pages with MAP_HUGETLB, and an absolute path names a
+// hugetlbfs mount to map them from.
+AddressRegionFactory* HugetlbRegionFactoryFromEnv()
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock) {
+  const char* e = thread_safe_getenv("TCMALLOC_HUGETLB_POOL");
+  if (e == nullptr) return nullptr;
+  int fd = -1;
+  if (e[0] == '/') {
+    char path[PATH_MAX];
+    if (absl::SNPrintF(path, sizeof(path), "%s/tcmalloc.XXXXXX", e) >=
+        sizeof(path)) {
+      Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+    }
+    // The file only names the pages we map from it, so it need not outlive
+    // us.
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0) {
+      Crash(kCrash, __FILE__, __LINE__,
+            "Unable to create file on hugetlbfs mount (errno, mount)", errno,
+            e);
+    }
+    unlink(path);
+  } else if (strcmp(e, "anon") != 0) {
+    Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+  }
+  return new (&hugetlb_space) HugetlbRegionFactory(fd);
+}
+
 void InitSystemAllocatorIfNecessary() ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock) {
   if (region_factory) return;
   // Sets the preferred alignment to be the largest of either the alignment
@@ -364,27 +1136,54 @@ void InitSystemAllocatorIfNecessary() ABSL_EXCLUSIVE_LOCKS_REQUIRED(spinlock) {
   // size is usually a multiple of page size, but this need not be true for
   // SMALL_BUT_SLOW where we do not allocate in units of huge pages.
   preferred_alignment = std::max(GetPageSize(), kMinSystemAlloc);
+  cold_numa_node = ColdNumaNodeFromEnv();
+  cold_dax_fd = ColdDaxFileFromEnv();
+  shared_heap_fd = SharedHeapFileFromEnv();
+  shared_heap.store(shared_heap_fd >= 0, std::memory_order_relaxed);
+  region_reservation = RegionReservationFromEnv();
   region_manager = new (&region_manager_space) RegionManager();
-  region_factory = new (&mmap_space) MmapRegionFactory();
+  region_factory = HugetlbRegionFactoryFromEnv();
+  if (region_factory == nullptr) {
+    mmap_factory = new (&mmap_space) MmapRegionFactory();
+    region_factory = mmap_factory;
+  }
 }
 
-// Bind the memory region spanning `size` bytes starting from `base` to NUMA
-// nodes assigned to `partition`. Returns zero upon success, or a standard
-// error code upon failure.
+ABSL_CONST_INIT std::atomic<int> system_release_errors(0);
+
+// See SetSystemMemoryPressure.
+ABSL_CONST_INIT std::atomic<bool> system_memory_pressure(false);
+// Bytes released with MADV_FREE alone, which may be reused uncleared.
+ABSL_CONST_INIT std::atomic<size_t> lazy_released_bytes(0);
+
+// Set once a custom AddressRegionFactory is installed.  Its regions (which
+// remain part of the heap) need not be anonymous memory, so they may read as
+// nonzero when fresh or after release.
+ABSL_CONST_INIT std::atomic<bool> custom_region_factory(false);
+
+}  // namespace
+
 void BindMemory(void* const base, const size_t size, const size_t partition) {
   auto& topology = tc_globals.numa_topology();
 
-  // If NUMA awareness is unavailable or disabled, or the user requested that
-  // we don't bind memory then do nothing.
-  const NumaBindMode bind_mode = topology.bind_mode();
-  if (!topology.numa_aware() || bind_mode == NumaBindMode::kNone) {
+  // If NUMA awareness is unavailable or disabled then do nothing.
+  if (!topology.numa_aware()) {
     return;
   }
 
-  const uint64_t nodemask = topology.GetPartitionNodes(partition);
-  int err =
-      syscall(__NR_mbind, base, size, MPOL_BIND | MPOL_F_STATIC_NODES,
-              &nodemask, sizeof(nodemask) * 8, MPOL_MF_STRICT | MPOL_MF_MOVE);
+  BindMemory(base, size, topology.GetPartitionNodes(partition),
+             topology.bind_mode());
+}
+
+void BindMemory(void* const base, const size_t size, const uint64_t nodemask,
+                const NumaBindMode bind_mode) {
+  // If the user requested that we don't bind memory then do nothing.
+  if (bind_mode == NumaBindMode::kNone) {
+    return;
+  }
+
+  int err = Mbind(base, size, MPOL_BIND | MPOL_F_STATIC_NODES, &nodemask,
+                  sizeof(nodemask) * 8, MPOL_MF_STRICT | MPOL_MF_MOVE);
   if (err == 0) {
     return;
   }
@@ -402,10 +1201,6 @@ void BindMemory(void* const base, const size_t size, const size_t partition) {
         nodemask);
 }
 
-ABSL_CONST_INIT std::atomic<int> system_release_errors(0);
-
-}  // namespace
-
 AddressRange SystemAlloc(size_t bytes, size_t alignment, const MemoryTag tag) {
   // If default alignment is set request the minimum alignment provided by
   // the system.
@@ -414,21 +1209,105 @@ AddressRange SystemAlloc(size_t bytes, size_t alignment, const MemoryTag tag) {
   // Discard requests that overflow
   if (bytes + alignment < bytes) return {nullptr, 0};
 
+  const int64_t probe_start = TCMALLOC_PROBE_START(system_alloc);
   AllocationGuardSpinLockHolder lock_holder(&spinlock);
+  StartupTimings& timings = tc_globals.startup_timings();
+  const int64_t first_start = timings.first_system_alloc == 0
+                                  ? absl::base_internal::CycleClock::Now()
+                                  : 0;
 
   InitSystemAllocatorIfNecessary();
 
   auto [result, actual_bytes] = region_manager->Alloc(bytes, alignment, tag);
+  if (ABSL_PREDICT_FALSE(first_start != 0)) {
+    // At least one tick, so that the first call is recorded only once.
+    timings.first_system_alloc = std::max<int64_t>(
+        absl::base_internal::CycleClock::Now() - first_start, 1);
+  }
 
   if (result != nullptr) {
     CheckAddressBits<kAddressBits>(reinterpret_cast<uintptr_t>(result) +
                                    actual_bytes - 1);
     ASSERT(GetMemoryTag(result) == tag);
+    if (tag == MemoryTag::kCold) {
+      RecordColdRange(result, actual_bytes);
+    }
   }
+  TCMALLOC_PROBE(system_alloc, bytes, alignment, ProbeLatencyNs(probe_start));
   return {result, actual_bytes};
 }
 
-static bool ReleasePages(void* start, size_t length) {
+HugePagePolicy GetHugePagePolicy() {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  // Transparent hugepages larger than ours, as with 64 KiB base pages on
+  // aarch64, never back them.
+  if (GetThpSettings().pmd_size > kHugePageSize) {
+    return HugePagePolicy::kNone;
+  }
+  switch (GetThpSettings().enabled) {
+    case ThpMode::kAlways:
+      return HugePagePolicy::kKernel;
+    case ThpMode::kMadvise:
+      return HugePagePolicy::kAdvise;
+    default:
+      return HugePagePolicy::kNone;
+  }
+#else
+  return HugePagePolicy::kNone;
+#endif
+}
+
+const char* HugePagePolicyName(HugePagePolicy policy) {
+  switch (policy) {
+    case HugePagePolicy::kKernel:
+      return "kernel";
+    case HugePagePolicy::kAdvise:
+      return "advise";
+    case HugePagePolicy::kNone:
+      break;
+  }
+  return "none";
+}
+
+bool SystemAdviseHugePages(void* start, size_t length) {
+  ASSERT(reinterpret_cast<uintptr_t>(start) % kHugePageSize == 0);
+  ASSERT(length % kHugePageSize == 0);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  ErrnoRestorer errno_restorer;
+  return Madvise(start, length, MADV_HUGEPAGE) == 0;
+#else
+  return false;
+#endif
+}
+
+size_t SystemAdviseCold() {
+#if defined(__linux__) && defined(MADV_COLD)
+  std::array<AddressRange, kMaxColdRanges> ranges;
+  size_t n;
+  {
+    AllocationGuardSpinLockHolder lock_holder(&spinlock);
+    n = num_cold_ranges;
+    std::copy_n(cold_ranges.begin(), n, ranges.begin());
+  }
+
+  ErrnoRestorer errno_restorer;
+  size_t advised = 0;
+  for (size_t i = 0; i < n; ++i) {
+    int ret;
+    do {
+      ret = Madvise(ranges[i].ptr, ranges[i].bytes, MADV_COLD);
+    } while (ret == -1 && errno == EAGAIN);
+    // EINVAL means the kernel predates MADV_COLD; nothing else will work.
+    if (ret != 0 && errno == EINVAL) break;
+    if (ret == 0) advised += ranges[i].bytes;
+  }
+  return advised;
+#else
+  return 0;
+#endif
+}
+
+static bool ReleasePages(void* start, size_t length, bool lazy) {
   ErrnoRestorer errno_restorer;
 
   int ret;
@@ -440,7 +1319,7 @@ static bool ReleasePages(void* start, size_t length) {
   // MADV_REMOVE deletes any backing storage for tmpfs or anonymous shared
   // memory.
   do {
-    ret = madvise(start, length, MADV_REMOVE);
+    ret = Madvise(start, length, MADV_REMOVE);
   } while (ret == -1 && errno == EAGAIN);
 
   if (ret == 0) {
@@ -448,9 +1327,19 @@ static bool ReleasePages(void* start, size_t length) {
   }
 #endif
 #ifdef MADV_FREE
+  if (lazy) {
+    do {
+      ret = Madvise(start, length, MADV_FREE);
+    } while (ret == -1 && errno == EAGAIN);
+
+    if (ret == 0) {
+      lazy_released_bytes.fetch_add(length, std::memory_order_relaxed);
+      return true;
+    }
+  }
   if (Parameters::madvise_free()) {
     do {
-      ret = madvise(start, length, MADV_FREE);
+      ret = Madvise(start, length, MADV_FREE);
     } while (ret == -1 && errno == EAGAIN);
 
     // We deliberately fall through to use MADV_DONTNEED.
@@ -459,7 +1348,7 @@ static bool ReleasePages(void* start, size_t length) {
 #ifdef MADV_DONTNEED
   // MADV_DONTNEED drops page table info and any anonymous pages.
   do {
-    ret = madvise(start, length, MADV_DONTNEED);
+    ret = Madvise(start, length, MADV_DONTNEED);
   } while (ret == -1 && errno == EAGAIN);
 
   if (ret == 0) {
@@ -474,11 +1363,137 @@ int SystemReleaseErrors() {
   return system_release_errors.load(std::memory_order_relaxed);
 }
 
-bool SystemRelease(void* start, size_t length) {
+uint64_t SystemCallCount(SystemCall call) {
+  return system_call_stats.Total(call);
+}
+
+void PrintSystemCallStats(Printer* out) { system_call_stats.Print(out); }
+
+void PrintSystemCallStatsInPbtxt(PbtxtRegion* region) {
+  system_call_stats.PrintInPbtxt(region);
+}
+
+void SetSystemMemoryPressure(bool pressure) {
+  system_memory_pressure.store(pressure, std::memory_order_relaxed);
+}
+
+size_t SystemLazyReleasedBytes() {
+  return lazy_released_bytes.load(std::memory_order_relaxed);
+}
+
+bool SystemMemoryIsZeroFilled() {
+  // SystemRelease only releases whole system pages, and a failed release may
+  // leave stale contents in memory that is otherwise accounted as unbacked.
+  // Nor is memory mapped from a DAX file (or device) cleared when it is
+  // released, or necessarily when it is first mapped.
+  // Lazily freed pages keep their contents if reused before the kernel
+  // reclaims them.
+  return !custom_region_factory.load(std::memory_order_relaxed) &&
+         cold_dax_bytes.load(std::memory_order_relaxed) == 0 &&
+         lazy_released_bytes.load(std::memory_order_relaxed) == 0 &&
+         GetPageSize() <= kPageSize &&
+         system_release_errors.load(std::memory_order_relaxed) == 0;
+}
+
+#if defined(__linux__) && defined(MADV_DONTNEED)
+// Set once process_madvise has been found not to work for us, so that we do
+// not try (and fail) it again on every batch.
+ABSL_CONST_INIT static std::atomic<bool> process_madvise_unsupported(false);
+
+// Releases a prefix of <ranges> with process_madvise(MADV_DONTNEED), returning
+// the number of ranges fully released.  *syscalls is incremented for each
+// call made.
+static size_t ProcessMadviseRelease(absl::Span<const AddressRange> ranges,
+                                    size_t* syscalls) {
+  if (process_madvise_unsupported.load(std::memory_order_relaxed)) {
+    return 0;
+  }
+  // MADV_FREE and the munlock fallback are only implemented by the per-range
+  // path.
+  if (Parameters::madvise_free()) {
+    return 0;
+  }
+
+  const uintptr_t pagemask = GetPageSize() - 1;
+  constexpr size_t kMaxIov = 1024;  // UIO_MAXIOV
+  std::array<iovec, 64> iov;
+  size_t released = 0;
+  while (released < ranges.size()) {
+    const size_t n = std::min({ranges.size() - released, iov.size(), kMaxIov});
+    for (size_t i = 0; i < n; ++i) {
+      const AddressRange& r = ranges[released + i];
+      // Unaligned ranges are rounded by SystemRelease; leave those to it.
+      if (((reinterpret_cast<uintptr_t>(r.ptr) | r.bytes) & pagemask) != 0) {
+        return released;
+      }
+      iov[i] = {r.ptr, r.bytes};
+    }
+
+    ssize_t ret;
+    do {
+      ret = ProcessMadvise(iov.data(), n, MADV_DONTNEED);
+      ++*syscalls;
+    } while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+    if (ret == -1) {
+      // ENOSYS: no process_madvise.  EBADF: no PIDFD_SELF.  EINVAL: the
+      // kernel does not accept MADV_DONTNEED here.  EPERM: a seccomp or LSM
+      // policy forbids the call.  None of these will change, so stop trying.
+      if (errno == ENOSYS || errno == EBADF || errno == EINVAL ||
+          errno == EPERM) {
+        process_madvise_unsupported.store(true, std::memory_order_relaxed);
+      }
+      return released;
+    }
+
+    // The kernel stops at the first range it fails on; count the ranges it
+    // finished.
+    size_t done = 0;
+    for (size_t bytes = ret; done < n && iov[done].iov_len <= bytes; ++done) {
+      bytes -= iov[done].iov_len;
+    }
+    released += done;
+    if (done < n) {
+      return released;
+    }
+  }
+  return released;
+}
+#endif  // __linux__ && MADV_DONTNEED
+
+size_t SystemReleaseBatch(absl::Span<const AddressRange> ranges,
+                          size_t* syscalls, ReleaseMode mode) {
+  ErrnoRestorer errno_restorer;
+  *syscalls = 0;
+  size_t released = 0;
+#if defined(__linux__) && defined(MADV_DONTNEED)
+  // Only SystemRelease knows to leave hugetlb ranges alone.  process_madvise
+  // does not take MADV_FREE.
+  if (!any_hugetlb_ranges.load(std::memory_order_relaxed) &&
+      mode == ReleaseMode::kDefault) {
+    released = ProcessMadviseRelease(ranges, syscalls);
+  }
+#endif
+
+  // Fall back to madvise, one range at a time, for whatever is left.
+  for (; released < ranges.size(); ++released) {
+    ++*syscalls;
+    if (!SystemRelease(ranges[released].ptr, ranges[released].bytes, mode)) {
+      break;
+    }
+  }
+  return released;
+}
+
+bool SystemRelease(void* start, size_t length, ReleaseMode mode) {
   bool result = false;
 
+  // Hugetlb pages stay with us; the caller keeps accounting them as backed.
+  if (OverlapsHugetlbRange(start, length)) return false;
+
 #if defined(MADV_DONTNEED) || defined(MADV_REMOVE)
   ErrnoRestorer errno_restorer;
+  const bool lazy = mode == ReleaseMode::kLazy &&
+                    !system_memory_pressure.load(std::memory_order_relaxed);
   const size_t pagemask = GetPageSize() - 1;
 
   size_t new_start = reinterpret_cast<size_t>(start);
@@ -499,14 +1514,14 @@ bool SystemRelease(void* start, size_t length) {
     void* new_ptr = reinterpret_cast<void*>(new_start);
     size_t new_length = new_end - new_start;
 
-    if (!ReleasePages(new_ptr, new_length)) {
+    if (!ReleasePages(new_ptr, new_length, lazy)) {
       // Try unlocking.
       int ret;
       do {
         ret = munlock(reinterpret_cast<char*>(new_start), new_end - new_start);
       } while (ret == -1 && errno == EAGAIN);
 
-      if (ret != 0 || !ReleasePages(new_ptr, new_length)) {
+      if (ret != 0 || !ReleasePages(new_ptr, new_length, lazy)) {
         // If we fail to munlock *or* fail our second attempt at madvise,
         // increment our failure count.
         system_release_errors.fetch_add(1, std::memory_order_relaxed);
@@ -522,17 +1537,189 @@ bool SystemRelease(void* start, size_t length) {
   return result;
 }
 
+bool SystemPrefault(void* start, size_t length) {
+  ErrnoRestorer errno_restorer;
+#ifdef __linux__
+  int ret;
+  do {
+    ret = Madvise(start, length, MADV_POPULATE_WRITE);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == 0) {
+    return true;
+  }
+  // EINVAL means the kernel predates MADV_POPULATE_WRITE; anything else (e.g.
+  // ENOMEM, EFAULT) is a genuine failure to back the range.
+  if (errno != EINVAL) {
+    return false;
+  }
+#endif  // __linux__
+
+  // Fall back to touching every page.  The range is not in use, so clobbering
+  // its contents is harmless.
+  const size_t page_size = GetPageSize();
+  for (uintptr_t p = reinterpret_cast<uintptr_t>(start),
+                 end = reinterpret_cast<uintptr_t>(start) + length;
+       p < end; p += page_size) {
+    *reinterpret_cast<volatile char*>(p) = 0;
+  }
+  return true;
+}
+
+bool SystemCollapse(void* start, size_t length) {
+  ErrnoRestorer errno_restorer;
+#ifdef __linux__
+  // Our hugepages are too small for the kernel's to fit.
+  if (GetThpSettings().pmd_size > kHugePageSize) {
+    return false;
+  }
+
+  // Set once the kernel has told us it does not support MADV_COLLAPSE, so
+  // that we stop asking.
+  ABSL_CONST_INIT static std::atomic<bool> unsupported(false);
+  if (unsupported.load(std::memory_order_relaxed)) {
+    return false;
+  }
+
+  int ret;
+  do {
+    ret = Madvise(start, length, MADV_COLLAPSE);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == 0) {
+    // Confirm that the range is now backed by a hugepage, where the kernel
+    // lets us look.
+    return PageFlags().IsHugePage(start).value_or(true);
+  }
+  // EINVAL means the kernel predates MADV_COLLAPSE (or THP is disabled for the
+  // mapping); EAGAIN and ENOMEM are transient failures to find a hugepage.
+  if (errno == EINVAL) {
+    unsupported.store(true, std::memory_order_relaxed);
+  }
+#endif  // __linux__
+  return false;
+}
+
+bool SystemBackGigaPages(void* start, size_t length, const MemoryTag tag) {
+#if defined(__linux__) && defined(MAP_HUGETLB)
+  ASSERT(reinterpret_cast<uintptr_t>(start) % kGigaPageSize == 0);
+  ASSERT(length % kGigaPageSize == 0);
+
+  {
+    // Address space from a custom AddressRegionFactory may not be anonymous
+    // memory, so we must not replace its mapping.
+    AllocationGuardSpinLockHolder lock_holder(&spinlock);
+    if (region_factory !=
+        reinterpret_cast<AddressRegionFactory*>(&mmap_space)) {
+      return false;
+    }
+  }
+
+  ErrnoRestorer errno_restorer;
+  // The range is freshly reserved and untouched, so replacing its mapping
+  // loses nothing.
+  void* result = Mmap(start, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB |
+                          MAP_HUGE_1GB,
+                      -1, 0);
+  const bool backed = result == start;
+  if (!backed) {
+    // The hugetlb pool is exhausted (or not configured).  Depending on the
+    // kernel, the failed mmap may already have unmapped the range, so restore
+    // an ordinary mapping in its place.
+    result = Mmap(start, length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    CHECK_CONDITION(result == start);
+  }
+
+  // A new mapping carries neither the NUMA policy nor the name of the one it
+  // replaced.
+  if (IsNormalMemoryTag(tag)) {
+    BindMemory(start, length, NumaPartitionFromTag(tag));
+  }
+  char name[256];
+  absl::SNPrintF(name, sizeof(name), "tcmalloc_region_%s%s",
+                 MemoryTagToLabel(tag), backed ? "_1G" : "");
+  prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, start, length, name);
+  return backed;
+#else
+  return false;
+#endif  // defined(__linux__) && defined(MAP_HUGETLB)
+}
+
+bool SystemMovePages(void* from, void* to, size_t length, const MemoryTag tag) {
+#if defined(__linux__) && defined(MREMAP_FIXED)
+  ASSERT(reinterpret_cast<uintptr_t>(from) % kHugePageSize == 0);
+  ASSERT(reinterpret_cast<uintptr_t>(to) % kHugePageSize == 0);
+  ASSERT(length % kHugePageSize == 0);
+
+  {
+    // As in SystemBackGigaPages, only anonymous memory we mapped ourselves can
+    // be remapped.
+    AllocationGuardSpinLockHolder lock_holder(&spinlock);
+    if (region_factory !=
+        reinterpret_cast<AddressRegionFactory*>(&mmap_space)) {
+      return false;
+    }
+  }
+
+  ErrnoRestorer errno_restorer;
+  void* result =
+      Mremap(from, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, to);
+  if (result != to) {
+    // The kernel may have unmapped the destination before failing, so restore
+    // an ordinary mapping there.  The source is left intact.
+    result = Mmap(to, length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    CHECK_CONDITION(result == to);
+    return false;
+  }
+
+  // The pages carried their mapping's NUMA policy and name with them, but
+  // [from, from + length) is now a hole in our address space.
+  result = Mmap(from, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  CHECK_CONDITION(result == from);
+  if (IsNormalMemoryTag(tag)) {
+    BindMemory(from, length, NumaPartitionFromTag(tag));
+  }
+  char name[256];
+  absl::SNPrintF(name, sizeof(name), "tcmalloc_region_%s",
+                 MemoryTagToLabel(tag));
+  prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, from, length, name);
+  return true;
+#else
+  return false;
+#endif  // defined(__linux__) && defined(MREMAP_FIXED)
+}
+
 AddressRegionFactory* GetRegionFactory() {
   AllocationGuardSpinLockHolder lock_holder(&spinlock);
   InitSystemAllocatorIfNecessary();
   return region_factory;
 }
 
+uintptr_t SharedHeapBase() {
+  AllocationGuardSpinLockHolder lock_holder(&spinlock);
+  InitSystemAllocatorIfNecessary();
+  return shared_heap_fd >= 0 ? kSharedHeapBase : 0;
+}
+
 void SetRegionFactory(AddressRegionFactory* factory) {
   AllocationGuardSpinLockHolder lock_holder(&spinlock);
   InitSystemAllocatorIfNecessary();
   region_manager->DiscardMappedRegions();
   region_factory = factory;
+  if (factory != reinterpret_cast<AddressRegionFactory*>(&mmap_space) &&
+      factory != reinterpret_cast<AddressRegionFactory*>(&hugetlb_space)) {
+    custom_region_factory.store(true, std::memory_order_relaxed);
+  }
+}
+
+void AcquireSystemAllocLock() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  spinlock.Lock();
+}
+
+void ReleaseSystemAllocLock() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  spinlock.Unlock();
 }
 
 static uintptr_t RandomMmapHint(size_t size, size_t alignment,
@@ -542,14 +1729,18 @@ static uintptr_t RandomMmapHint(size_t size, size_t alignment,
   ABSL_CONST_INIT static absl::once_flag flag;
 
   absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    if (const uint64_t seed = Parameters::deterministic_seed(); seed != 0) {
+      rnd = seed;
+      return;
+    }
     void* seed =
-        mmap(nullptr, kPageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        Mmap(nullptr, kPageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (seed == MAP_FAILED) {
       Crash(kCrash, __FILE__, __LINE__,
             "Initial mmap() reservation failed (errno, size)", errno,
             kPageSize);
     }
-    munmap(seed, kPageSize);
+    Munmap(seed, kPageSize);
     rnd = reinterpret_cast<uintptr_t>(seed);
   });
 
@@ -593,29 +1784,42 @@ void* MmapAligned(size_t size, size_t alignment, const MemoryTag tag) {
   static uintptr_t next_sampled_addr = 0;
   static std::array<uintptr_t, kNumaPartitions> next_normal_addr = {0};
   static uintptr_t next_cold_addr = 0;
+  static uintptr_t next_registered_addr = 0;
 
   std::optional<int> numa_partition;
   uintptr_t& next_addr = *[&]() {
     switch (tag) {
       case MemoryTag::kSampled:
         return &next_sampled_addr;
-      case MemoryTag::kNormalP0:
-        numa_partition = 0;
-        return &next_normal_addr[0];
-      case MemoryTag::kNormalP1:
-        numa_partition = 1;
-        return &next_normal_addr[1];
       case MemoryTag::kCold:
         return &next_cold_addr;
+      case MemoryTag::kRegistered:
+        return &next_registered_addr;
+      default:
+        ASSUME(IsNormalMemoryTag(tag));
+        numa_partition = NumaPartitionFromTag(tag);
+        return &next_normal_addr[*numa_partition];
     }
-
-    ASSUME(false);
-    __builtin_unreachable();
   }();
 
+  // The shared heap is laid out from kSharedHeapBase up, at the addresses
+  // the processes sharing it agree on.
+  const bool fixed = tag == MemoryTag::kRegistered &&
+                     shared_heap.load(std::memory_order_relaxed);
+  if (fixed && !next_addr) {
+    next_addr = kSharedHeapBase;
+  }
+  if (fixed && next_addr & (alignment - 1)) {
+    next_addr = (next_addr | (alignment - 1)) + 1;
+  }
   if (!next_addr || next_addr & (alignment - 1) ||
       GetMemoryTag(reinterpret_cast<void*>(next_addr)) != tag ||
       GetMemoryTag(reinterpret_cast<void*>(next_addr + size - 1)) != tag) {
+    if (fixed) {
+      Log(kLogWithStack, __FILE__, __LINE__,
+          "Shared heap address range exhausted (size)", size);
+      return nullptr;
+    }
     next_addr = RandomMmapHint(size, alignment, tag);
   }
   void* hint;
@@ -624,7 +1828,7 @@ void* MmapAligned(size_t size, size_t alignment, const MemoryTag tag) {
     ASSERT(GetMemoryTag(hint) == tag);
     // TODO(b/140190055): Use MAP_FIXED_NOREPLACE once available.
     void* result =
-        mmap(hint, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        Mmap(hint, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (result == hint) {
       if (numa_partition.has_value()) {
         BindMemory(result, size, *numa_partition);
@@ -660,11 +1864,17 @@ void* MmapAligned(size_t size, size_t alignment, const MemoryTag tag) {
           strerror(errno));
       return nullptr;
     }
-    if (int err = munmap(result, size)) {
+    if (int err = Munmap(result, size)) {
       Log(kLogWithStack, __FILE__, __LINE__, "munmap() failed (error)",
           strerror(errno));
       ASSERT(err == 0);
     }
+    if (fixed) {
+      // Something else holds the agreed range, and it cannot move.
+      Log(kLogWithStack, __FILE__, __LINE__,
+          "Shared heap address range in use (hint, size)", hint, size);
+      return nullptr;
+    }
     next_addr = RandomMmapHint(size, alignment, tag);
   }
 
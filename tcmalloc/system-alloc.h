@@ -19,10 +19,14 @@
 #define TCMALLOC_SYSTEM_ALLOC_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "absl/base/attributes.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/numa.h"
 #include "tcmalloc/malloc_extension.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -34,6 +38,17 @@ struct AddressRange {
   size_t bytes;
 };
 
+// How SystemRelease returns pages to the OS.
+enum class ReleaseMode {
+  // MADV_DONTNEED, preceded by MADV_FREE if Parameters::madvise_free().  The
+  // pages leave the process at once, and fault back in zeroed.
+  kDefault,
+  // MADV_FREE alone, for pages likely to be reused soon.  The kernel only
+  // reclaims them when it needs the memory; until then they remain resident,
+  // and reusing them takes no page faults, but they are not cleared.
+  kLazy,
+};
+
 // REQUIRES: "alignment" is a power of two or "0" to indicate default alignment
 // REQUIRES: "alignment" and "size" <= kTagMask
 //
@@ -54,6 +69,43 @@ AddressRange SystemAlloc(size_t bytes, size_t alignment, MemoryTag tag);
 // call to SystemRelease.
 int SystemReleaseErrors();
 
+// The system calls made on behalf of the functions in this file.  These are
+// the calls that stall when the process's mmap_lock is contended.
+enum class SystemCall {
+  kMmap,
+  kMunmap,
+  kMremap,
+  kMprotect,
+  kMadvise,
+  kProcessMadvise,
+  kMbind,
+  kNumCalls,
+};
+
+// Returns the number of <call> system calls made so far.
+uint64_t SystemCallCount(SystemCall call);
+
+// Prints the number of system calls of each kind, their total time and a
+// log-bucketed histogram of their latencies.
+void PrintSystemCallStats(Printer* out);
+void PrintSystemCallStatsInPbtxt(PbtxtRegion* region);
+
+// Returns true if memory returned by SystemAlloc reads as zero until first
+// written, and again once released by SystemRelease.  This holds for the
+// default (anonymous mmap) region factory only, and only until the first lazy
+// release.
+bool SystemMemoryIsZeroFilled();
+
+// Binds the memory region spanning `size` bytes starting from `base` to the
+// NUMA nodes assigned to `partition`, as the NUMA bind mode allows.  Does
+// nothing if NUMA awareness is disabled.
+void BindMemory(void* base, size_t size, size_t partition);
+
+// Like BindMemory() above, but binds to the nodes in `nodemask` as `bind_mode`
+// allows, whatever TCMalloc's own NUMA topology.
+void BindMemory(void* base, size_t size, uint64_t nodemask,
+                NumaBindMode bind_mode);
+
 // This call is a hint to the operating system that the pages
 // contained in the specified range of memory will not be used for a
 // while, and can be released for use by other processes or the OS.
@@ -65,7 +117,30 @@ int SystemReleaseErrors();
 // be released, partial pages will not.)
 //
 // Returns true on success.
-ABSL_MUST_USE_RESULT bool SystemRelease(void* start, size_t length);
+//
+// With ReleaseMode::kLazy, the pages are released with MADV_FREE alone, unless
+// the process is under memory pressure (see SetSystemMemoryPressure).
+ABSL_MUST_USE_RESULT bool SystemRelease(
+    void* start, size_t length, ReleaseMode mode = ReleaseMode::kDefault);
+
+// As SystemRelease, for each of <ranges> in turn, stopping at the first
+// failure.  Where the kernel supports it, ranges are released together with
+// process_madvise(2) rather than with one madvise(2) apiece.  Returns the
+// number of ranges released, and sets *syscalls to the number of system calls
+// issued.
+ABSL_MUST_USE_RESULT size_t SystemReleaseBatch(
+    absl::Span<const AddressRange> ranges, size_t* syscalls,
+    ReleaseMode mode = ReleaseMode::kDefault);
+
+// Records whether the process is short of memory, in which case SystemRelease
+// treats ReleaseMode::kLazy as kDefault: lazily freed pages count towards the
+// process's memory usage (and its cgroup's) until the kernel reclaims them.
+void SetSystemMemoryPressure(bool pressure);
+
+// Returns the number of bytes SystemRelease has released with MADV_FREE alone.
+// They stay resident, and uncleared, until the kernel reclaims them or they
+// are written again.
+size_t SystemLazyReleasedBytes();
 
 // This call is the inverse of SystemRelease: the pages in this range
 // are in use and should be faulted in.  (In principle this is a
@@ -80,12 +155,85 @@ inline void SystemBack(void* start, size_t length) {
   // that routinely make large mallocs they never touch (sigh).
 }
 
+// How TCMalloc asks for transparent hugepages, given the system's settings
+// (see GetThpSettings()).
+enum class HugePagePolicy {
+  // Transparent hugepages are disabled, their settings are unknown, or they
+  // are larger than our hugepages, so that none of these can be backed by one.
+  kNone,
+  // The kernel backs all suitable anonymous memory with hugepages.  We do not
+  // advise MADV_HUGEPAGE, as that would also opt into the stalls of
+  // defrag=madvise.
+  kKernel,
+  // The kernel only backs madvised memory with hugepages, so the default
+  // region factory advises MADV_HUGEPAGE on the memory it hands out for normal
+  // use, which the page heap allocates in whole hugepages.
+  kAdvise,
+};
+
+// Returns the policy for this system, decided on the first call.
+HugePagePolicy GetHugePagePolicy();
+
+// Returns the name of <policy> for stats.
+const char* HugePagePolicyName(HugePagePolicy policy);
+
+// Hints that [start, start + length) should be backed by transparent hugepages
+// as it is faulted in.  Returns false if the kernel did not accept the hint.
+// REQUIRES: [start, start + length) is aligned to kHugePageSize.
+bool SystemAdviseHugePages(void* start, size_t length);
+
+// Faults in (and zero-fills) the pages in [start, start + length) so that
+// subsequent accesses do not take page faults.  Returns false if the range
+// could not be populated.
+// REQUIRES: [start, start + length) is a range aligned to 4KiB boundaries,
+// which is not currently in use.
+ABSL_MUST_USE_RESULT bool SystemPrefault(void* start, size_t length);
+
+// Asks the kernel to back [start, start + length), which is in use, with
+// hugepages again (MADV_COLLAPSE), preserving its contents.  Returns false if
+// the range could not be collapsed, including when the kernel lacks support,
+// or if /proc/self/pageflags is available and shows it was not.
+// REQUIRES: [start, start + length) is a range aligned to hugepage boundaries.
+ABSL_MUST_USE_RESULT bool SystemCollapse(void* start, size_t length);
+
+// Replaces the (unused) memory in [start, start + length) with anonymous memory
+// backed by 1GiB hugetlb pages.  Returns false if the system could not provide
+// gigapages, in which case the range remains ordinary (zeroed) memory.
+// REQUIRES: [start, start + length) was returned by SystemAlloc and is aligned
+// to kGigaPageSize.
+bool SystemBackGigaPages(void* start, size_t length, MemoryTag tag);
+
+// Moves the pages of [from, from + length) to [to, to + length) by remapping
+// them, without copying their contents, and replaces [from, from + length)
+// with fresh, unbacked memory.  Whatever was mapped at <to> is discarded.
+// Returns false, leaving <from> untouched, if the pages could not be moved.
+// REQUIRES: both ranges were returned by SystemAlloc for <tag>, are aligned to
+// kHugePageSize and do not overlap.
+bool SystemMovePages(void* from, void* to, size_t length, MemoryTag tag);
+
+// Deactivates the resident pages of all memory allocated for MemoryTag::kCold
+// with madvise(MADV_COLD), so that under memory pressure the kernel reclaims
+// them (or demotes them to a slower memory tier) ahead of hot memory.  The
+// memory stays mapped and its contents are preserved.  Returns the number of
+// bytes advised.
+size_t SystemAdviseCold();
+
 // Returns the current address region factory.
 AddressRegionFactory* GetRegionFactory();
 
 // Sets the current address region factory to factory.
 void SetRegionFactory(AddressRegionFactory* factory);
 
+// Acquires and releases the system allocator's lock around fork(), so that the
+// child does not inherit it held by a thread that no longer exists.
+void AcquireSystemAllocLock();
+void ReleaseSystemAllocLock();
+
+// Returns the address that offset zero of TCMALLOC_SHARED_HEAP_FILE maps to in
+// every process sharing it, or 0 if the registered heap is not shared.  Only
+// the built-in address region factories share the heap.
+uintptr_t SharedHeapBase();
+
 // Reserves using mmap() a region of memory of the requested size and alignment,
 // with the bits specified by kTagMask set according to tag.
 //
@@ -49,12 +49,14 @@
 #include "tcmalloc/tcmalloc.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -63,13 +65,17 @@
 #include <map>
 #include <memory>
 #include <new>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "absl/base/attributes.h"
 #include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/optimization.h"
+#include "absl/functional/function_ref.h"
 #include "absl/numeric/bits.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
@@ -77,16 +83,25 @@
 #include "absl/strings/string_view.h"
 #include "absl/time/clock.h"
 #include "absl/types/span.h"
+#include "tcmalloc/allocation_counts.h"
+#include "tcmalloc/allocation_domain.h"
 #include "tcmalloc/allocation_sample.h"
 #include "tcmalloc/allocation_sampling.h"
+#include "tcmalloc/background_wakeup.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/cpu_time_stats.h"
 #include "tcmalloc/deallocation_profiler.h"
+#include "tcmalloc/deferred_free.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/global_stats.h"
 #include "tcmalloc/guarded_allocations.h"
 #include "tcmalloc/guarded_page_allocator.h"
+#include "tcmalloc/heap_telemetry.h"
+#include "tcmalloc/huge_page_filler.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/clear_memory.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
@@ -94,24 +109,32 @@
 #include "tcmalloc/internal/page_size.h"
 #include "tcmalloc/internal/percpu.h"
 #include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/internal/sysinfo.h"
 #include "tcmalloc/internal_malloc_extension.h"
+#include "tcmalloc/large_span_cache.h"
+#include "tcmalloc/latency_stats.h"
+#include "tcmalloc/lock_contention_profiler.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/malloc_tracing_extension.h"
+#include "tcmalloc/mte_sampled_allocator.h"
 #include "tcmalloc/new_extension.h"
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/sampled_slabs.h"
 #include "tcmalloc/sampler.h"
 #include "tcmalloc/segv_handler.h"
 #include "tcmalloc/span.h"
+#include "tcmalloc/span_cache.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/stats.h"
 #include "tcmalloc/system-alloc.h"
 #include "tcmalloc/tcmalloc_policy.h"
 #include "tcmalloc/thread_cache.h"
 #include "tcmalloc/transfer_cache.h"
+#include "tcmalloc/type_partitions.h"
 
 #if defined(TCMALLOC_HAVE_STRUCT_MALLINFO) || \
     defined(TCMALLOC_HAVE_STRUCT_MALLINFO2)
@@ -202,6 +225,7 @@ extern "C" size_t TCMalloc_Internal_GetStats(char* buffer,
 
   printer.printf("\nLow-level allocator stats:\n");
   printer.printf("Memory Release Failures: %d\n", SystemReleaseErrors());
+  PrintSystemCallStats(&printer);
 
   size_t n = printer.SpaceRequired();
 
@@ -214,6 +238,43 @@ extern "C" size_t TCMalloc_Internal_GetStats(char* buffer,
   return n;
 }
 
+extern "C" void MallocExtension_Internal_WriteStats(
+    MallocExtension::StatsFormat format,
+    absl::FunctionRef<void(absl::string_view)> sink) {
+  const bool pbtxt = format == MallocExtension::StatsFormat::kPbtxt;
+  StatsWriter writer(sink);
+  for (StatsSection section : kStatsSections) {
+    writer.WriteSection([&](Printer* out) {
+      if (pbtxt) {
+        DumpStatsSectionInPbtxt(out, 2, section);
+      } else {
+        DumpStatsSection(out, 2, section);
+      }
+    });
+  }
+
+  if (pbtxt) {
+    writer.WriteRawSection([](absl::Span<char> buffer) {
+      AllocationGuardSpinLockHolder h(&pageheap_lock);
+      return GetRegionFactory()->GetStatsInPbtxt(buffer);
+    });
+    return;
+  }
+  writer.WriteSection([](Printer* out) {
+    out->printf("\nLow-level allocator stats:\n");
+    out->printf("Memory Release Failures: %d\n", SystemReleaseErrors());
+    PrintSystemCallStats(out);
+  });
+  writer.WriteRawSection([](absl::Span<char> buffer) {
+    return GetRegionFactory()->GetStats(buffer);
+  });
+}
+
+extern "C" void MallocExtension_Internal_WriteHugePageLayout(
+    absl::FunctionRef<void(absl::string_view)> sink) {
+  tc_globals.page_allocator().WriteHugePageLayout(sink);
+}
+
 extern "C" const ProfileBase* MallocExtension_Internal_SnapshotCurrent(
     ProfileType type) {
   switch (type) {
@@ -221,13 +282,22 @@ extern "C" const ProfileBase* MallocExtension_Internal_SnapshotCurrent(
       return DumpHeapProfile(tc_globals).release();
     case ProfileType::kFragmentation:
       return DumpFragmentationProfile(tc_globals).release();
+    case ProfileType::kHugePageFragmentation:
+      return DumpHugePageFragmentationProfile(tc_globals).release();
     case ProfileType::kPeakHeap:
       return tc_globals.peak_heap_tracker().DumpSample().release();
+    case ProfileType::kAllocationCounts:
+      return DumpAllocationCountsProfile().release();
     default:
       return nullptr;
   }
 }
 
+extern "C" const ProfileBase* MallocExtension_Internal_SnapshotHeapDelta(
+    uint64_t* cursor) {
+  return DumpHeapProfileDelta(tc_globals, cursor).release();
+}
+
 extern "C" AllocationProfilingTokenBase*
 MallocExtension_Internal_StartAllocationProfiling() {
   return new AllocationSample(&tc_globals.allocation_samples, absl::Now());
@@ -239,6 +309,11 @@ MallocExtension_Internal_StartLifetimeProfiling() {
       &tc_globals.deallocation_samples);
 }
 
+extern "C" tcmalloc_internal::AllocationProfilingTokenBase*
+MallocExtension_Internal_StartLockContentionProfiling() {
+  return new LockContentionSample(&lock_contention_profilers, absl::Now());
+}
+
 MallocExtension::Ownership GetOwnership(const void* ptr) {
   const PageId p = PageIdContaining(ptr);
   return tc_globals.pagemap().GetDescriptor(p)
@@ -246,17 +321,79 @@ MallocExtension::Ownership GetOwnership(const void* ptr) {
              : MallocExtension::Ownership::kNotOwned;
 }
 
+// A small object is on a sparse hugepage if its hugepage would be reported by
+// the hugepage fragmentation profile: one of the filler's, with at most
+// kMaxPinnedHugePageUsage of its pages in use.
+static bool IsOnSparseHugepage(const void* ptr) {
+  const PageId p = PageIdContaining(ptr);
+  // Large and sampled allocations have no size class.
+  if (tc_globals.pagemap().GetDescriptor(p) == nullptr ||
+      tc_globals.pagemap().sizeclass(p) == 0) {
+    return false;
+  }
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  // Hugepages outside the filler have no tracker.
+  const PageTracker* tracker = reinterpret_cast<const PageTracker*>(
+      tc_globals.pagemap().GetHugepage(HugePageContaining(p).first_page()));
+  return tracker != nullptr &&
+         tracker->used_pages().raw_num() <=
+             kMaxPinnedHugePageUsage * kPagesPerHugePage.raw_num();
+}
+
 extern "C" bool MallocExtension_Internal_GetNumericProperty(
     const char* name_data, size_t name_size, size_t* value) {
   return GetNumericProperty(name_data, name_size, value);
 }
 
 // Make sure the two definitions are in sync.
+extern "C" tcmalloc::MallocExtension::AllocationQoS
+MallocExtension_Internal_GetThreadAllocationQoS() {
+  return bypass_per_cpu_caches
+             ? tcmalloc::MallocExtension::AllocationQoS::kBatch
+             : tcmalloc::MallocExtension::AllocationQoS::kLatencyCritical;
+}
+
+extern "C" void MallocExtension_Internal_SetThreadAllocationQoS(
+    tcmalloc::MallocExtension::AllocationQoS qos) {
+  const bool bypass = qos == tcmalloc::MallocExtension::AllocationQoS::kBatch;
+  if (bypass == bypass_per_cpu_caches) return;
+  bypass_per_cpu_caches = bypass;
+  if (!tc_globals.CpuCacheActive()) return;
+  if (bypass) {
+    // Sends the thread's fast paths to the slow path, which routes it to its
+    // thread cache from then on.
+    tc_globals.cpu_cache().MaybeForceSlowPath();
+  } else {
+    // Returns the thread cache's objects; the per-CPU slab is cached again on
+    // the next slow path.
+    ThreadCache::BecomeIdle();
+  }
+}
+
 static_assert(static_cast<int>(tcmalloc::MallocExtension::LimitKind::kSoft) ==
               PageAllocator::kSoft);
 static_assert(static_cast<int>(tcmalloc::MallocExtension::LimitKind::kHard) ==
               PageAllocator::kHard);
 
+extern "C" void MallocExtension_Internal_GetHeapTelemetry(
+    std::vector<MallocExtension::HeapTelemetryEpoch>* ret) {
+  // Copy the epochs out first: we can't allocate under the tracker's lock.
+  HeapTelemetry::Epoch epochs[HeapTelemetry::kEpochs];
+  const size_t n = heap_telemetry.GetEpochs(epochs);
+  const absl::Time now = absl::Now();
+
+  ret->clear();
+  ret->reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    MallocExtension::HeapTelemetryEpoch& e = ret->emplace_back();
+    e.end = now - epochs[i].epochs_ago * HeapTelemetry::kEpochLength;
+    e.allocated_bytes = epochs[i].activity.allocated_bytes;
+    e.freed_bytes = epochs[i].activity.freed_bytes;
+    e.per_cpu_cache_misses = epochs[i].activity.per_cpu_cache_misses;
+    e.released_bytes = epochs[i].activity.released_bytes;
+  }
+}
+
 extern "C" size_t MallocExtension_Internal_GetMemoryLimit(
     tcmalloc::MallocExtension::LimitKind limit_kind) {
   return tc_globals.page_allocator().limit(
@@ -272,6 +409,78 @@ extern "C" void MallocExtension_Internal_SetMemoryLimit(
       limit, static_cast<PageAllocator::LimitKind>(limit_kind));
 }
 
+// The calling thread's cumulative allocated and freed bytes.  Only the owning
+// thread writes them, so they are plain integers.
+struct ThreadAllocatedBytes {
+  uint64_t allocated;
+  uint64_t freed;
+};
+ABSL_CONST_INIT static thread_local ThreadAllocatedBytes thread_allocated_bytes
+    ABSL_ATTRIBUTE_INITIAL_EXEC = {0, 0};
+
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void CountThreadAllocated(
+    size_t bytes) {
+  thread_allocated_bytes.allocated += bytes;
+}
+
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void CountThreadFreed(
+    size_t bytes) {
+  thread_allocated_bytes.freed += bytes;
+}
+
+extern "C" void MallocExtension_Internal_GetThreadAllocatedBytes(
+    tcmalloc::MallocExtension::ThreadAllocatedBytes* bytes) {
+  bytes->allocated = thread_allocated_bytes.allocated;
+  bytes->freed = thread_allocated_bytes.freed;
+}
+
+ABSL_CONST_INIT thread_local absl::Span<const ProfileLabel>
+    current_profile_labels ABSL_ATTRIBUTE_INITIAL_EXEC;
+
+extern "C" void MallocExtension_Internal_GetProfileLabels(
+    absl::Span<const ProfileLabel>* labels) {
+  *labels = current_profile_labels;
+}
+
+extern "C" void MallocExtension_Internal_SetProfileLabels(
+    const ProfileLabel* labels, size_t n) {
+  current_profile_labels = absl::MakeConstSpan(labels, n);
+}
+
+extern "C" int MallocExtension_Internal_GetAllocationDomain() {
+  return CurrentAllocationDomain();
+}
+
+extern "C" void MallocExtension_Internal_SetAllocationDomain(int domain) {
+  CHECK_CONDITION(0 <= domain && domain < kMaxAllocationDomains);
+  current_allocation_domain = domain;
+}
+
+static_assert(static_cast<int>(tcmalloc::MallocExtension::LimitKind::kSoft) ==
+              AllocationDomains::kSoft);
+static_assert(static_cast<int>(tcmalloc::MallocExtension::LimitKind::kHard) ==
+              AllocationDomains::kHard);
+
+extern "C" size_t MallocExtension_Internal_GetAllocationDomainLimit(
+    int domain, tcmalloc::MallocExtension::LimitKind limit_kind) {
+  CHECK_CONDITION(0 <= domain && domain < kMaxAllocationDomains);
+  return allocation_domains.limit(
+      domain, static_cast<AllocationDomains::LimitKind>(limit_kind));
+}
+
+extern "C" void MallocExtension_Internal_SetAllocationDomainLimit(
+    int domain, size_t limit, tcmalloc::MallocExtension::LimitKind limit_kind) {
+  CHECK_CONDITION(0 <= domain && domain < kMaxAllocationDomains);
+  allocation_domains.set_limit(
+      domain, limit, static_cast<AllocationDomains::LimitKind>(limit_kind));
+}
+
+extern "C" size_t MallocExtension_Internal_GetAllocationDomainUsage(
+    int domain) {
+  CHECK_CONDITION(0 <= domain && domain < kMaxAllocationDomains);
+  return allocation_domains.usage(domain);
+}
+
 extern "C" void MallocExtension_Internal_MarkThreadIdle() {
   ThreadCache::BecomeIdle();
 }
@@ -293,8 +502,10 @@ extern "C" void MallocExtension_Internal_SetRegionFactory(
 ABSL_CONST_INIT static absl::base_internal::SpinLock release_lock(
     absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
 
-extern "C" size_t MallocExtension_Internal_ReleaseMemoryToSystem(
-    size_t num_bytes) {
+// Releases num_bytes from the page heap, less any excess released by earlier
+// calls.  Returns the number of bytes released.
+static size_t ReleasePageHeapMemory(size_t num_bytes)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(release_lock) {
   // ReleaseMemoryToSystem() might release more than the requested bytes because
   // the page heap releases at the span granularity, and spans are of wildly
   // different sizes.  This keeps track of the extra bytes bytes released so
@@ -302,8 +513,6 @@ extern "C" size_t MallocExtension_Internal_ReleaseMemoryToSystem(
   // memory at a constant rate.
   ABSL_CONST_INIT static size_t extra_bytes_released;
 
-  AllocationGuardSpinLockHolder rh(&release_lock);
-
   AllocationGuardSpinLockHolder h(&pageheap_lock);
   if (num_bytes <= extra_bytes_released) {
     // We released too much on a prior call, so don't release any
@@ -335,6 +544,129 @@ extern "C" size_t MallocExtension_Internal_ReleaseMemoryToSystem(
   return bytes_released;
 }
 
+extern "C" size_t MallocExtension_Internal_ReleaseMemoryToSystem(
+    size_t num_bytes) {
+  ScopedCpuTimer cpu_timer(CpuTimePath::kReleaseMemoryToSystem);
+  AllocationGuardSpinLockHolder rh(&release_lock);
+
+  // Give cached spans back to the page heap so that they can be released.
+  span_cache.Flush();
+  large_span_cache.Flush();
+  deferred_frees.Drain();
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    tc_globals.central_freelist(size_class).FlushEmptySpans();
+  }
+
+  return ReleasePageHeapMemory(num_bytes);
+}
+
+// The background thread's release leaves the spans held by the span caches and
+// the central freelists' empty spans, which include those it prepopulated, to
+// age out through the Plunder() passes it runs on its own schedule.
+extern "C" size_t TCMalloc_Internal_ReleaseMemoryInBackground(
+    size_t num_bytes) {
+  ScopedCpuTimer cpu_timer(CpuTimePath::kReleaseMemoryToSystem);
+  AllocationGuardSpinLockHolder rh(&release_lock);
+
+  deferred_frees.Drain();
+
+  return ReleasePageHeapMemory(num_bytes);
+}
+
+// fork() only copies the calling thread, so a lock held by any other thread
+// would stay held forever in the child.  We take the locks of the allocation
+// path before fork(), in lock order, and release them on both sides after it.
+//
+// The child otherwise keeps the parent's caches, which it shares copy-on-write.
+// With per_cpu_caches_wipe_on_fork, the child gets zero-filled slabs instead,
+// so its per-cpu caches start empty, and are set up again as each cpu is
+// first used, without faulting in copies of the parent's slabs.
+//
+// The background thread does not survive fork() either.  The child must call
+// ProcessBackgroundActions() again if it wants background actions.
+ABSL_CONST_INIT static bool fork_locked = false;
+ABSL_CONST_INIT static bool fork_cpu_cache_locked = false;
+ABSL_CONST_INIT static bool fork_slabs_wiped = false;
+
+static void PrepareFork() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  fork_locked = tc_globals.IsInited();
+  if (!fork_locked) return;
+
+  heap_telemetry.AcquireInternalLocks();
+  // The sampling locks are not nested in one another, except for the peak heap
+  // tracker's own, and come before pageheap_lock.
+  tc_globals.peak_heap_tracker().AcquireInternalLocks();
+  tc_globals.sampled_allocation_recorder().AcquireInternalLocks();
+  tc_globals.allocation_samples.AcquireInternalLocks();
+  tc_globals.sampled_stack_depot().AcquireInternalLocks();
+  fork_cpu_cache_locked = tc_globals.CpuCacheActive();
+  if (fork_cpu_cache_locked) {
+    tc_globals.cpu_cache().AcquireInternalLocks();
+  }
+  type_partitions.AcquireInternalLocks();
+  tc_globals.sharded_transfer_cache().AcquireInternalLocks();
+  tc_globals.transfer_cache().AcquireInternalLocks();
+  release_lock.Lock();
+  pageheap_lock.Lock();
+  tc_globals.guardedpage_allocator().AcquireInternalLocks();
+  AcquireSystemAllocLock();
+  // The remaining locks are leaves.
+  span_cache.AcquireInternalLocks();
+  large_span_cache.AcquireInternalLocks();
+  deferred_frees.AcquireInternalLocks();
+  subtle::percpu::AcquireCpuLocks();
+
+  fork_slabs_wiped = false;
+#ifdef MADV_WIPEONFORK
+  if (fork_cpu_cache_locked && Parameters::per_cpu_caches_wipe_on_fork()) {
+    fork_slabs_wiped = tc_globals.cpu_cache().AdviseSlabs(MADV_WIPEONFORK);
+  }
+#endif  // MADV_WIPEONFORK
+}
+
+static void ReleaseForkLocks(bool child) ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  if (!fork_locked) return;
+
+#ifdef MADV_WIPEONFORK
+  // Later forks must not wipe the slabs unless they ask to.
+  if (fork_slabs_wiped) {
+    tc_globals.cpu_cache().AdviseSlabs(MADV_KEEPONFORK);
+  }
+#endif  // MADV_WIPEONFORK
+
+  subtle::percpu::ReleaseCpuLocks();
+  deferred_frees.ReleaseInternalLocks();
+  large_span_cache.ReleaseInternalLocks();
+  span_cache.ReleaseInternalLocks();
+  ReleaseSystemAllocLock();
+  tc_globals.guardedpage_allocator().ReleaseInternalLocks();
+  pageheap_lock.Unlock();
+  release_lock.Unlock();
+  tc_globals.transfer_cache().ReleaseInternalLocks();
+  tc_globals.sharded_transfer_cache().ReleaseInternalLocks();
+  type_partitions.ReleaseInternalLocks();
+  if (fork_cpu_cache_locked) {
+    if (child) {
+      tc_globals.cpu_cache().ReleaseInternalLocksInChild(fork_slabs_wiped);
+    } else {
+      tc_globals.cpu_cache().ReleaseInternalLocks();
+    }
+  }
+  tc_globals.sampled_stack_depot().ReleaseInternalLocks();
+  tc_globals.allocation_samples.ReleaseInternalLocks();
+  tc_globals.sampled_allocation_recorder().ReleaseInternalLocks();
+  tc_globals.peak_heap_tracker().ReleaseInternalLocks();
+  if (child) {
+    heap_telemetry.ResetInChild();
+  } else {
+    heap_telemetry.ReleaseInternalLocks();
+  }
+}
+
+static void ForkParent() { ReleaseForkLocks(/*child=*/false); }
+
+static void ForkChild() { ReleaseForkLocks(/*child=*/true); }
+
 // nallocx slow path.
 // Moved to a separate function because size_class_with_alignment is not inlined
 // which would cause nallocx to become non-leaf function with stack frame and
@@ -378,6 +710,10 @@ extern "C" MallocExtension::Ownership MallocExtension_Internal_GetOwnership(
   return GetOwnership(ptr);
 }
 
+extern "C" bool MallocExtension_Internal_IsOnSparseHugepage(const void* ptr) {
+  return IsOnSparseHugepage(ptr);
+}
+
 extern "C" void MallocExtension_Internal_GetProperties(
     std::map<std::string, MallocExtension::Property>* result) {
   TCMallocStats stats;
@@ -486,6 +822,29 @@ extern "C" void MallocExtension_Internal_GetProperties(
   WalkExperiments([&](absl::string_view name, bool active) {
     (*result)[absl::StrCat("tcmalloc.experiment.", name)].value = active;
   });
+
+  (*result)["tcmalloc.shared_heap_base"].value = SharedHeapBase();
+
+  (*result)["tcmalloc.allocator_cpu_ns"].value =
+      CpuTimeStats::TicksToNanoseconds(cpu_time_stats.total_ticks());
+  for (int path = 0; path < CpuTimeStats::kNumPaths; ++path) {
+    const CpuTimePath p = static_cast<CpuTimePath>(path);
+    (*result)[absl::StrCat("tcmalloc.allocator_cpu_ns.",
+                           CpuTimeStats::PathName(p))]
+        .value = CpuTimeStats::TicksToNanoseconds(cpu_time_stats.ticks(p));
+  }
+
+  uint64_t live[kNumClasses];
+  GetLiveObjectCounts(live);
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    const size_t size = tc_globals.sizemap().class_to_size(size_class);
+    if (size == 0) continue;
+    // Classes of the same size in other partitions share a property.
+    (*result)[absl::StrCat("tcmalloc.live_objects.", size)].value +=
+        live[size_class];
+  }
+
+  AddAllocationCountProperties(result);
 }
 
 extern "C" size_t MallocExtension_Internal_ReleaseCpuMemory(int cpu) {
@@ -508,12 +867,29 @@ inline size_t GetLargeSize(const void* ptr, const PageId p) {
     if (tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
       return tc_globals.guardedpage_allocator().GetRequestedSize(ptr);
     }
+    if (tc_globals.mte_sampled_allocator().PointerIsMine(ptr)) {
+      return tc_globals.mte_sampled_allocator().GetRequestedSize(ptr);
+    }
     return span->sampled_allocation()->sampled_stack.allocated_size;
+  } else if (const SampledSlab* slab = span->sampled_slab()) {
+    return slab->object_size();
   } else {
     return span->bytes_in_span();
   }
 }
 
+// Returns the size the per-thread counters count the sampled object on <span>
+// at, on allocation and on free alike: its sample's allocated size, which for
+// a guarded sample is the requested size only if that was returned to the
+// caller, or the size of its slot in a packed span.
+inline size_t SampledCountedSize(const Span* span) {
+  if (span->sampled()) {
+    return span->sampled_allocation()->sampled_stack.allocated_size;
+  }
+  ASSERT(span->sampled_slab() != nullptr);
+  return span->sampled_slab()->object_size();
+}
+
 inline size_t GetSize(const void* ptr) {
   if (ptr == nullptr) return 0;
   const PageId p = PageIdContaining(ptr);
@@ -525,9 +901,175 @@ inline size_t GetSize(const void* ptr) {
   }
 }
 
+// Returns the pages of <span>, about to be freed, to its allocation domain.
+inline void UnchargeAllocationDomain(Span* span) {
+  if (span->allocation_domain() == Span::kUnchargedDomain) return;
+  allocation_domains.Uncharge(span->allocation_domain(),
+                              span->bytes_in_span());
+}
+
+// Tries to grow the page-level allocation at <ptr> in place so that it holds at
+// least <size> bytes.  Only unsampled, normal-memory allocations without a size
+// class qualify, and only when the page allocator has the pages following the
+// span free.
+inline bool TryGrowPagesInPlace(void* ptr, size_t size) {
+  if (Static::HaveHooks() || !IsNormalMemory(ptr)) return false;
+  const PageId p = PageIdContaining(ptr);
+  if (tc_globals.pagemap().sizeclass(p) != 0) return false;
+  Span* span = tc_globals.pagemap().GetExistingDescriptor(p);
+  // Sampled page-level allocations live in normal memory too, but their
+  // recorded size must stay that of the sampled request.
+  if (span->sampled()) return false;
+  ASSERT(span->start_address() == ptr);
+  const Length n = span->num_pages();
+  const Length want = BytesToLengthCeil(size);
+  if (want <= n) return true;
+  const int domain = span->allocation_domain();
+  if (domain != Span::kUnchargedDomain) {
+    // Growing in place is only an optimization, so is not worth releasing
+    // memory for when over the soft limit.
+    bool over_soft_limit;
+    if (!allocation_domains.TryCharge(domain, (want - n).in_bytes(),
+                                      &over_soft_limit)) {
+      return false;
+    }
+  }
+  if (tc_globals.page_allocator().TryExtend(span, want - n,
+                                            GetMemoryTag(ptr))) {
+    // Count the allocation as reallocated at its new length.
+    page_allocation_counts.RecordFree(n);
+    page_allocation_counts.RecordAlloc(want);
+    return true;
+  }
+  if (domain != Span::kUnchargedDomain) {
+    allocation_domains.Uncharge(domain, (want - n).in_bytes());
+  }
+  return false;
+}
+
+// Tries to shrink the page-level allocation at <ptr> in place to hold <size>
+// bytes, returning the pages that follow for reuse.  The same allocations as
+// in TryGrowPagesInPlace qualify.
+inline bool TryShrinkPagesInPlace(void* ptr, size_t size) {
+  if (Static::HaveHooks() || !IsNormalMemory(ptr)) return false;
+  const PageId p = PageIdContaining(ptr);
+  if (tc_globals.pagemap().sizeclass(p) != 0) return false;
+  Span* span = tc_globals.pagemap().GetExistingDescriptor(p);
+  if (span->sampled()) return false;
+  ASSERT(span->start_address() == ptr);
+  const Length n = span->num_pages();
+  const Length want = BytesToLengthCeil(size);
+  if (want >= n ||
+      !tc_globals.page_allocator().TryShrink(span, want, GetMemoryTag(ptr))) {
+    return false;
+  }
+  const Length shrunk = span->num_pages();
+  const int domain = span->allocation_domain();
+  if (domain != Span::kUnchargedDomain) {
+    allocation_domains.Uncharge(domain, (n - shrunk).in_bytes());
+  }
+  // Count the allocation as reallocated at its new length.
+  page_allocation_counts.RecordFree(n);
+  page_allocation_counts.RecordAlloc(shrunk);
+  return true;
+}
+
+// Tries to move the contents of the page-level allocation <from> into the
+// page-level allocation <to> without copying them, freeing <from>.  Only
+// normal-memory allocations without a size class qualify.
+inline bool TryMovePages(void* from, void* to) {
+  if (Static::HaveHooks() || !IsNormalMemory(from) || !IsNormalMemory(to) ||
+      GetMemoryTag(from) != GetMemoryTag(to)) {
+    return false;
+  }
+  const PageId from_page = PageIdContaining(from);
+  const PageId to_page = PageIdContaining(to);
+  if (tc_globals.pagemap().sizeclass(from_page) != 0 ||
+      tc_globals.pagemap().sizeclass(to_page) != 0) {
+    return false;
+  }
+  Span* from_span = tc_globals.pagemap().GetExistingDescriptor(from_page);
+  Span* to_span = tc_globals.pagemap().GetExistingDescriptor(to_page);
+  if (to_span->start_address() != to) return false;
+  ASSERT(from_span->start_address() == from);
+  // <from> is freed whether or not it moves, so it can be unsampled first.
+  MaybeUnsampleAllocation(tc_globals, from, from_span);
+  const uint8_t from_domain = from_span->allocation_domain();
+  const size_t from_bytes = from_span->bytes_in_span();
+  if (!tc_globals.page_allocator().TryMove(from_span, to_span,
+                                           GetMemoryTag(from))) {
+    return false;
+  }
+  if (from_domain != Span::kUnchargedDomain) {
+    allocation_domains.Uncharge(from_domain, from_bytes);
+  }
+  page_allocation_counts.RecordFree(BytesToLengthCeil(from_bytes));
+  return true;
+}
+
+// Returns true if the <size> byte allocation <ptr>, just allocated, is known to
+// read as zero.  Only page-level allocations in normal memory qualify, and
+// only when the page allocator handed out pages that were never used or had
+// been released since.
+inline bool IsKnownZero(void* ptr, size_t size) {
+  if (size <= kMaxSize || !IsNormalMemory(ptr)) return false;
+  const PageId p = PageIdContaining(ptr);
+  if (tc_globals.pagemap().sizeclass(p) != 0) return false;
+  const Span* span = tc_globals.pagemap().GetExistingDescriptor(p);
+  return span->start_address() == ptr && span->known_zero();
+}
+
+// The id of the calling thread in allocation traces, or 0 before its first
+// traced operation.
+ABSL_CONST_INIT static thread_local uint32_t allocation_trace_thread = 0;
+ABSL_CONST_INIT static std::atomic<uint32_t> allocation_trace_threads{0};
+// Set while the calling thread reallocates, so that the allocation and free it
+// does are traced as a single kRealloc.
+ABSL_CONST_INIT static thread_local bool allocation_trace_suppressed = false;
+
+// Records an operation in the allocation trace.  Only called when
+// Static::HaveHooks().
+ABSL_ATTRIBUTE_NOINLINE static void TraceAllocationOp(AllocationTraceOp op,
+                                                      const void* ptr,
+                                                      const void* old_ptr,
+                                                      size_t size,
+                                                      size_t alignment) {
+  if (allocation_trace_suppressed) return;
+  if (ABSL_PREDICT_FALSE(allocation_trace_thread == 0)) {
+    allocation_trace_thread =
+        allocation_trace_threads.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  AllocationTraceEvent event = {};
+  event.op = op;
+  event.cpu = subtle::percpu::GetCurrentCpu();
+  event.thread = allocation_trace_thread;
+  event.object = reinterpret_cast<uintptr_t>(ptr);
+  event.old_object = reinterpret_cast<uintptr_t>(old_ptr);
+  event.size = size;
+  event.alignment = alignment > alignof(std::max_align_t) ? alignment : 0;
+  tc_globals.allocation_trace().Record(event);
+}
+
+template <typename Policy>
+static inline void TraceAllocation(Policy policy, const void* ptr,
+                                   size_t size) {
+  if (ABSL_PREDICT_FALSE(Static::HaveHooks())) {
+    TraceAllocationOp(AllocationTraceOp::kMalloc, ptr, nullptr, size,
+                      policy.align());
+  }
+}
+
+static inline void TraceFree(const void* ptr) {
+  if (ABSL_PREDICT_FALSE(Static::HaveHooks())) {
+    TraceAllocationOp(AllocationTraceOp::kFree, ptr, nullptr, 0, 0);
+  }
+}
+
 // This slow path also handles delete hooks and non-per-cpu mode.
 ABSL_ATTRIBUTE_NOINLINE static void FreeWithHooksOrPerThread(
     void* ptr, size_t size_class) {
+  TraceFree(ptr);
   if (ABSL_PREDICT_TRUE(UsePerCpuCache(tc_globals))) {
     tc_globals.cpu_cache().DeallocateSlow(ptr, size_class);
   } else if (ThreadCache* cache = ThreadCache::GetCacheIfPresent();
@@ -558,13 +1100,82 @@ FreeSmallSlow(void* ptr, size_t size_class) {
   tc_globals.cpu_cache().DeallocateSlowNoHooks(ptr, size_class);
 }
 
+// Frees an object whose home NUMA partition differs from the current CPU's.
+ABSL_ATTRIBUTE_NOINLINE static void FreeSmallRemote(void* ptr,
+                                                    size_t size_class) {
+  if (ABSL_PREDICT_FALSE(Static::HaveHooks()) ||
+      ABSL_PREDICT_FALSE(!UsePerCpuCache(tc_globals))) {
+    return FreeWithHooksOrPerThread(ptr, size_class);
+  }
+  tc_globals.cpu_cache().DeallocateRemote(ptr, size_class);
+}
+
+// Returns true if <size_class> belongs to a NUMA partition other than that of
+// the current CPU.  The pagemap already encodes the home partition of each
+// object in its size class, so no additional lookup is required.
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE bool IsRemoteNumaSizeClass(
+    size_t size_class) {
+  if constexpr (kNumaPartitions == 1) {
+    return false;
+  } else {
+    if (ABSL_PREDICT_TRUE(!Static::numa_aware_fast_path()) ||
+        IsExpandedSizeClass(size_class)) {
+      return false;
+    }
+    return size_class - tc_globals.numa_topology().GetCurrentScaledPartition() >=
+           kNumBaseClasses;
+  }
+}
+
+// Returns <ptr>, an object of <size_class>, tagged with its size class if
+// size class tags are enabled and it fits.
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* TagSizeClass(
+    void* ptr, size_t size_class) {
+  if constexpr (!kSizeClassTags) {
+    return ptr;
+  } else {
+    if (size_class >= kMaxTaggedSizeClass) return ptr;
+    return reinterpret_cast<void*>(
+        reinterpret_cast<uintptr_t>(ptr) |
+        ((uintptr_t{size_class} << kSizeClassTagShift) &
+         Static::size_class_tag_mask()));
+  }
+}
+
+// Returns the size class <ptr> is tagged with, or 0 if it is not tagged.
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE size_t
+SizeClassTag(const void* ptr) {
+  if constexpr (!kSizeClassTags) {
+    return 0;
+  } else {
+    return SizeClassTagOf(reinterpret_cast<uintptr_t>(ptr),
+                          Static::size_class_tag_mask());
+  }
+}
+
+// Strips any size class tag from <ptr>, before it is linked into the caches.
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* UntagSizeClass(void* ptr) {
+  if constexpr (!kSizeClassTags) {
+    return ptr;
+  } else {
+    return reinterpret_cast<void*>(StripSizeClassTag(
+        reinterpret_cast<uintptr_t>(ptr), Static::size_class_tag_mask()));
+  }
+}
+
 static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void FreeSmall(void* ptr,
                                                           size_t size_class) {
+  ptr = UntagSizeClass(ptr);
   if (!IsExpandedSizeClass(size_class)) {
     ASSERT(IsNormalMemory(ptr));
   } else {
     ASSERT(IsColdMemory(ptr));
   }
+  CountThreadFreed(tc_globals.sizemap().class_to_size(size_class));
+
+  if (ABSL_PREDICT_FALSE(IsRemoteNumaSizeClass(size_class))) {
+    return FreeSmallRemote(ptr, size_class);
+  }
 
   // DeallocateFast may fail if:
   //  - the cpu cache is full
@@ -580,20 +1191,55 @@ static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void FreeSmall(void* ptr,
 namespace {
 
 template <typename Policy>
-inline sized_ptr_t do_malloc_pages(size_t size, size_t weight, Policy policy) {
+inline sized_ptr_t do_malloc_pages(size_t size, size_t weight, Policy policy,
+                                   MemoryTag tag) {
   // Page allocator does not deal well with num_pages = 0.
   Length num_pages = std::max<Length>(BytesToLengthCeil(size), Length(1));
 
-  MemoryTag tag = MemoryTag::kNormal;
-  if (IsColdHint(policy.access())) {
-    tag = MemoryTag::kCold;
-  } else if (tc_globals.numa_topology().numa_aware()) {
-    tag = NumaNormalTag(policy.numa_partition());
+  // Sampled allocations need a span of their own, rather than a cached one.
+  const bool use_large_span_cache =
+      weight == 0 && policy.align() <= kPageSize &&
+      LargeSpanCache::Cacheable(tag, num_pages) && LargeSpanCache::enabled();
+  if (use_large_span_cache) {
+    num_pages = LargeSpanCache::RoundUp(num_pages);
+  }
+
+  const int domain = CurrentAllocationDomain();
+  bool over_soft_limit;
+  if (ABSL_PREDICT_FALSE(!allocation_domains.TryCharge(
+          domain, num_pages.in_bytes(), &over_soft_limit))) {
+    return {nullptr, 0};
+  }
+  if (ABSL_PREDICT_FALSE(over_soft_limit)) {
+    // Make the domain pay for its own growth rather than let it push the heap
+    // into the process-wide limits, which would have whichever thread
+    // allocates next release memory.
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    tc_globals.page_allocator().ReleaseAtLeastNPages(num_pages);
+  }
+
+  Span* span;
+  {
+    // Large allocations are recorded as size class 0.
+    ScopedLatencyTimer timer(LatencyStage::kPageAllocatorNew, 0);
+    ScopedCpuTimer cpu_timer(CpuTimePath::kPageAllocatorNew);
+    if (use_large_span_cache) {
+      span = large_span_cache.TryGet(tag, num_pages);
+      if (span == nullptr) {
+        span = large_span_cache.Refill(tag, num_pages);
+      }
+    } else {
+      span = tc_globals.page_allocator().NewAligned(
+          num_pages, BytesToLengthCeil(policy.align()),
+          {1, AccessDensityPrediction::kSparse}, tag);
+    }
+  }
+  if (span == nullptr) {
+    allocation_domains.Uncharge(domain, num_pages.in_bytes());
+    return {nullptr, 0};
   }
-  Span* span = tc_globals.page_allocator().NewAligned(
-      num_pages, BytesToLengthCeil(policy.align()),
-      {1, AccessDensityPrediction::kSparse}, tag);
-  if (span == nullptr) return {nullptr, 0};
+  span->set_allocation_domain(domain);
+  page_allocation_counts.RecordAlloc(num_pages);
 
   // Set capacity to the exact size for a page allocation.  This needs to be
   // revisited if we introduce gwp-asan sampling / guarded allocations to
@@ -609,12 +1255,28 @@ inline sized_ptr_t do_malloc_pages(size_t size, size_t weight, Policy policy) {
   return res;
 }
 
+template <typename Policy>
+inline sized_ptr_t do_malloc_pages(size_t size, size_t weight, Policy policy) {
+  MemoryTag tag = MemoryTag::kNormal;
+  if (IsColdHint(policy.access())) {
+    tag = MemoryTag::kCold;
+  } else if (tc_globals.numa_topology().numa_aware()) {
+    tag = NumaNormalTag(policy.numa_partition());
+  }
+  return do_malloc_pages(size, weight, policy, tag);
+}
+
 // Handles freeing object that doesn't have size class, i.e. which
 // is either large or sampled. We explicitly prevent inlining it to
 // keep it out of fast-path. This helps avoid expensive
 // prologue/epilogue for fast-path freeing functions.
+//
+// With <defer>, for a page-level allocation that has not been sampled, the
+// span is queued for the background thread rather than returned to the page
+// heap (see tcmalloc::FreeLater).
 ABSL_ATTRIBUTE_NOINLINE
-static void InvokeHooksAndFreePages(void* ptr) {
+static void InvokeHooksAndFreePages(void* ptr, bool defer = false) {
+  TraceFree(ptr);
   const PageId p = PageIdContaining(ptr);
 
   Span* span = tc_globals.pagemap().GetExistingDescriptor(p);
@@ -622,22 +1284,72 @@ static void InvokeHooksAndFreePages(void* ptr) {
   // Prefetch now to avoid a stall accessing *span while under the lock.
   span->Prefetch();
 
+  // Sampled small objects live in spans of their own, which are not
+  // page-level allocations.
+  if (!IsSampledMemory(ptr) || IsRegisteredMemory(ptr)) {
+    page_allocation_counts.RecordFree(span->num_pages());
+  }
+  SampledSlab* slab = span->sampled_slab();
+  if (span->sampled() || slab != nullptr) {
+    CountThreadFreed(SampledCountedSize(span));
+  } else {
+    CountThreadFreed(span->bytes_in_span());
+  }
   MaybeUnsampleAllocation(tc_globals, ptr, span);
+  // Packed sampled objects share their span, which goes once all are freed.
+  if (slab != nullptr) {
+    tc_globals.sampled_slabs().Delete(span, ptr);
+    return;
+  }
+  UnchargeAllocationDomain(span);
+
+  // Only spans of the rounded lengths the cache allocates fit in its bins.
+  if (!IsSampledMemory(ptr) && LargeSpanCache::enabled()) {
+    const MemoryTag tag = GetMemoryTag(ptr);
+    const Length n = span->num_pages();
+    if (LargeSpanCache::Cacheable(tag, n) && LargeSpanCache::RoundUp(n) == n) {
+      large_span_cache.Put(tag, span);
+      return;
+    }
+  }
+
+  if (defer) {
+    ASSERT(!IsSampledMemory(ptr));
+    ASSERT(span->first_page() == p);
+    deferred_frees.Push(span);
+    return;
+  }
+
+  // Guarded and MTE-sampled allocations hand their pages back themselves:
+  // Deallocate() makes a system call or collects a stack trace, and only the
+  // span's metadata is left to free, neither of which needs pageheap_lock.
+  if (IsSampledMemory(ptr)) {
+    if (tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
+      ASSERT(span->first_page() == p);
+      tc_globals.guardedpage_allocator().Deallocate(ptr);
+      Span::DeleteUnlocked(span);
+      return;
+    }
+    if (tc_globals.mte_sampled_allocator().PointerIsMine(ptr)) {
+      ASSERT(span->first_page() == p);
+      tc_globals.mte_sampled_allocator().Deallocate(ptr);
+      Span::DeleteUnlocked(span);
+      return;
+    }
+  }
 
   {
     AllocationGuardSpinLockHolder h(&pageheap_lock);
     ASSERT(span->first_page() == p);
     if (IsSampledMemory(ptr)) {
-      if (tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
-        // Release lock while calling Deallocate() since it does a system call.
-        pageheap_lock.Unlock();
-        tc_globals.guardedpage_allocator().Deallocate(ptr);
-        pageheap_lock.Lock();
-        Span::Delete(span);
-      } else if (IsColdMemory(ptr)) {
+      if (IsColdMemory(ptr)) {
         ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
         tc_globals.page_allocator().Delete(span, /*objects_per_span=*/1,
                                            MemoryTag::kCold);
+      } else if (IsRegisteredMemory(ptr)) {
+        ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
+        tc_globals.page_allocator().Delete(span, /*objects_per_span=*/1,
+                                           MemoryTag::kRegistered);
       } else {
         ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
         tc_globals.page_allocator().Delete(span, /*objects_per_span=*/1,
@@ -682,6 +1394,20 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free(void* ptr) {
   // therefore static initialization must have already occurred.
   ASSERT(tc_globals.IsInited());
 
+  // A tagged pointer spares the pagemap lookup.
+  if (const size_t tag = SizeClassTag(ptr); tag != 0) {
+    ASSERT(tag == GetSizeClass(ptr));
+    return FreeSmall(ptr, tag);
+  }
+
+  // So does an address in a size class's region.
+  const size_t region_class =
+      tc_globals.page_allocator().size_class_regions().SizeClass(ptr);
+  if (region_class != 0) {
+    ASSERT(region_class == GetSizeClass(ptr));
+    return FreeSmall(ptr, region_class);
+  }
+
   size_t size_class = tc_globals.pagemap().sizeclass(PageIdContaining(ptr));
   if (ABSL_PREDICT_TRUE(size_class != 0)) {
     ASSERT(size_class == GetSizeClass(ptr));
@@ -755,6 +1481,92 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free_with_size(void* ptr,
   FreeSmall(ptr, size_class);
 }
 
+// Like do_free_with_size, for a size whose index into the size class table was
+// computed at compile time by tcmalloc::DeallocateFixed.
+inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free_fixed(void* ptr, size_t size,
+                                                       size_t index) {
+  ASSERT(CorrectSize(ptr, size, DefaultAlignPolicy()));
+
+  if (ABSL_PREDICT_FALSE(IsSampledMemory(ptr))) {
+    if (ABSL_PREDICT_TRUE(ptr == nullptr)) return;
+    return free_sampled(ptr, size, DefaultAlignPolicy());
+  }
+
+  ASSERT(ptr != nullptr);
+
+  uint32_t size_class;
+  if (ABSL_PREDICT_FALSE(!tc_globals.sizemap().GetSizeClassAtIndex(
+          CppPolicy().InSameNumaPartitionAs(ptr), size, index, &size_class))) {
+    return InvokeHooksAndFreePages(ptr);
+  }
+
+  FreeSmall(ptr, size_class);
+}
+
+// Frees <ptr> like do_free(), or like do_free_with_size() given its <size>,
+// except that the pages of a page-level allocation too large for the
+// large_span_cache are returned to the page heap by the background thread.
+// Sampled allocations are freed as usual, and so is everything while no
+// thread runs ProcessBackgroundActions() to drain the queue.
+static void free_later(void* ptr, size_t size) {
+  if (ABSL_PREDICT_FALSE(ptr == nullptr)) return;
+  if (IsSampledMemory(ptr) || !deferred_frees.has_consumer() ||
+      SizeClassTag(ptr) != 0 ||
+      tc_globals.pagemap().sizeclass(PageIdContaining(ptr)) != 0) {
+    if (size == 0) return do_free(ptr);
+    return do_free_with_size(ptr, size, DefaultAlignPolicy());
+  }
+  ASSERT(size == 0 || CorrectSize(ptr, size, DefaultAlignPolicy()));
+  InvokeHooksAndFreePages(ptr, /*defer=*/true);
+}
+
+// Handles the cases that the coroutine frame free path in
+// do_free_coroutine_frame cannot.
+ABSL_ATTRIBUTE_NOINLINE static void FreeCoroutineFrameSlow(void* ptr,
+                                                           size_t size_class) {
+  if (ABSL_PREDICT_FALSE(Static::HaveHooks()) ||
+      ABSL_PREDICT_FALSE(!UsePerCpuCache(tc_globals))) {
+    return FreeWithHooksOrPerThread(ptr, size_class);
+  }
+  // Frames are usually freed on a different cpu than the one that allocated
+  // them.  Once this cpu overflows, let the background thread pair it with the
+  // allocating cpu, so that further overflows are handed to that cpu directly
+  // rather than round-tripping through the transfer cache.
+  tc_globals.cpu_cache().RequestHandoff(size_class);
+  tc_globals.cpu_cache().DeallocateSlowNoHooks(ptr, size_class);
+}
+
+// Like do_free_with_size, for a coroutine frame allocated by
+// tcmalloc_allocate_coroutine_frame.
+inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free_coroutine_frame(void* ptr,
+                                                                 size_t size) {
+  ASSERT(CorrectSize(ptr, size, DefaultAlignPolicy()));
+
+  if (ABSL_PREDICT_FALSE(IsSampledMemory(ptr))) {
+    if (ABSL_PREDICT_TRUE(ptr == nullptr)) return;
+    return free_sampled(ptr, size, DefaultAlignPolicy());
+  }
+
+  ASSERT(ptr != nullptr);
+
+  uint32_t size_class;
+  if (ABSL_PREDICT_FALSE(!tc_globals.sizemap().GetSizeClass(
+          CppPolicy().InSameNumaPartitionAs(ptr), size, &size_class))) {
+    return InvokeHooksAndFreePages(ptr);
+  }
+
+  ASSERT(IsNormalMemory(ptr));
+  CountThreadFreed(tc_globals.sizemap().class_to_size(size_class));
+  ptr = UntagSizeClass(ptr);
+  if (ABSL_PREDICT_FALSE(IsRemoteNumaSizeClass(size_class))) {
+    return FreeSmallRemote(ptr, size_class);
+  }
+  if (ABSL_PREDICT_FALSE(
+          !tc_globals.cpu_cache().DeallocateFast(ptr, size_class))) {
+    FreeCoroutineFrameSlow(ptr, size_class);
+  }
+}
+
 // Checks that an asserted object size for <ptr> is valid.
 template <typename AlignPolicy>
 bool CorrectSize(void* ptr, size_t size, AlignPolicy align) {
@@ -764,7 +1576,8 @@ bool CorrectSize(void* ptr, size_t size, AlignPolicy align) {
   if (ptr == nullptr) return true;
   uint32_t size_class = 0;
   // Round-up passed in size to how much tcmalloc allocates for that size.
-  if (tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
+  if (tc_globals.guardedpage_allocator().PointerIsMine(ptr) ||
+      tc_globals.mte_sampled_allocator().PointerIsMine(ptr)) {
     // For guarded allocations we recorded the actual requested size.
   } else if (tc_globals.sizemap().GetSizeClass(
                  CppPolicy().AlignAs(align.align()), size, &size_class)) {
@@ -804,10 +1617,50 @@ bool CorrectAlignment(void* ptr, std::align_val_t alignment) {
 
 inline void do_malloc_stats() { PrintStats(1); }
 
+// Returns as much memory to the OS as can be, keeping <pad> bytes of free
+// memory backed.  Unlike ReleaseMemoryToSystem, which only releases pages
+// that are already free, the caches are emptied first, so that the spans
+// their objects came from can be freed too, and hugepages that are partially
+// in use are broken up.  Returns 1 if any memory was released, as glibc does.
+//
+// Per-cpu caches can only be reclaimed from a thread with restartable
+// sequences (subtle::percpu::IsFast()).  From any other thread they are left
+// as they are, and their objects are only returned once the background thread,
+// if any, reclaims idle caches.
 inline int do_malloc_trim(size_t pad) {
-  // We ignore pad for now and just do a best effort release of pages.
-  static_cast<void>(pad);
-  return MallocExtension_Internal_ReleaseMemoryToSystem(0) != 0 ? 1 : 0;
+  ScopedCpuTimer cpu_timer(CpuTimePath::kReleaseMemoryToSystem);
+  if (tc_globals.CpuCacheActive()) {
+    if (subtle::percpu::IsFast()) {
+      // Each cpu has its own lock, so this only contends with trims of the
+      // same cpu by the background thread.
+      const int num_cpus = NumCPUs();
+      for (int cpu = 0; cpu < num_cpus; ++cpu) {
+        tc_globals.cpu_cache().Reclaim(cpu);
+      }
+    }
+  } else {
+    // Other threads' caches can only be emptied by their owners.
+    ThreadCache::BecomeIdle();
+  }
+  // The sharded caches drain into the non-sharded ones.
+  tc_globals.sharded_transfer_cache().Drain();
+  tc_globals.transfer_cache().Drain();
+
+  AllocationGuardSpinLockHolder rh(&release_lock);
+  span_cache.Flush();
+  large_span_cache.Flush();
+  deferred_frees.Drain();
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    tc_globals.central_freelist(size_class).FlushEmptySpans();
+  }
+
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  const size_t free_bytes = tc_globals.page_allocator().stats().free_bytes;
+  if (free_bytes <= pad) return 0;
+  const Length released =
+      tc_globals.page_allocator().ReleaseAtLeastNPagesBreakingHugepages(
+          BytesToLengthFloor(free_bytes - pad));
+  return released > Length(0) ? 1 : 0;
 }
 
 inline int do_mallopt(int cmd, int value) {
@@ -891,10 +1744,16 @@ alloc_small_sampled_hooks_or_perthread(size_t size, uint32_t size_class,
     ASSERT(tc_globals.IsInited());
     tc_globals.sizemap().GetSizeClass(policy, size, &size_class);
   }
-  void* res;
-  // If we are here because of sampling, try AllocateFast first.
-  if (ABSL_PREDICT_TRUE(weight == 0) ||
-      (res = tc_globals.cpu_cache().AllocateFast(size_class)) == nullptr) {
+  void* res = nullptr;
+  // If we are here because of sampling, try AllocateFast first.  Timing it
+  // accounts for the fast path allocations this sample stands for.
+  if (ABSL_PREDICT_FALSE(weight != 0)) {
+    const int64_t start = absl::base_internal::CycleClock::Now();
+    res = tc_globals.cpu_cache().AllocateFast(size_class);
+    cpu_time_stats.RecordSampledFastPath(
+        absl::base_internal::CycleClock::Now() - start, weight);
+  }
+  if (res == nullptr) {
     if (UsePerCpuCache(tc_globals)) {
       res = tc_globals.cpu_cache().AllocateSlow(size_class);
     } else {
@@ -904,11 +1763,21 @@ alloc_small_sampled_hooks_or_perthread(size_t size, uint32_t size_class,
   }
   tcmalloc::sized_ptr_t ptr = {res,
                                tc_globals.sizemap().class_to_size(size_class)};
+  size_t counted_size = ptr.n;
   if (ABSL_PREDICT_FALSE(weight != 0)) {
     ptr = SampleSmallAllocation(tc_globals, policy, size, weight, size_class,
                                 ptr);
+    // Count the size the free path will find, unless sampling fell back to
+    // the object of the size class.
+    const PageId p = PageIdContaining(ptr.p);
+    if (tc_globals.pagemap().sizeclass(p) == 0) {
+      counted_size =
+          SampledCountedSize(tc_globals.pagemap().GetExistingDescriptor(p));
+    }
   }
+  CountThreadAllocated(counted_size);
   if (Policy::invoke_hooks()) {
+    TraceAllocation(policy, ptr.p, size);
   }
   return Policy::as_pointer(ptr.p, ptr.n);
 }
@@ -936,35 +1805,59 @@ slow_alloc_small(size_t size, uint32_t size_class, Policy policy) {
 
   void* res = tc_globals.cpu_cache().AllocateSlowNoHooks(size_class);
   if (ABSL_PREDICT_FALSE(res == nullptr)) return policy.handle_oom(size);
-  return Policy::to_pointer(res, size_class);
+  CountThreadAllocated(tc_globals.sizemap().class_to_size(size_class));
+  return Policy::to_pointer(TagSizeClass(res, size_class), size_class);
 }
 
 template <typename Policy>
 ABSL_ATTRIBUTE_NOINLINE static typename Policy::pointer_type slow_alloc_large(
     size_t size, Policy policy) {
+  MaybeRunBackgroundSlice();
   size_t weight = GetThreadSampler()->RecordAllocation(size);
   tcmalloc::sized_ptr_t res = do_malloc_pages(size, weight, policy);
   if (ABSL_PREDICT_FALSE(res.p == nullptr)) return policy.handle_oom(size);
+  CountThreadAllocated(res.n);
 
   if (Policy::invoke_hooks()) {
+    TraceAllocation(policy, res.p, size);
   }
   return Policy::as_pointer(res.p, res.n);
 }
 
-template <typename Policy, typename Pointer = typename Policy::pointer_type>
-static inline Pointer ABSL_ATTRIBUTE_ALWAYS_INLINE fast_alloc(Policy policy,
-                                                              size_t size) {
-  // If size is larger than kMaxSize, it's not fast-path anymore. In
-  // such case, GetSizeClass will return false, and we'll delegate to the slow
-  // path. If malloc is not yet initialized, we may end up with size_class == 0
-  // (regardless of size), but in this case should also delegate to the slow
-  // path by the fast path check further down.
-  uint32_t size_class;
-  bool is_small = tc_globals.sizemap().GetSizeClass(policy, size, &size_class);
-  if (ABSL_PREDICT_FALSE(!is_small)) {
-    return slow_alloc_large(size, policy);
+// Allocates <size> bytes of memory registered for DMA by the
+// AddressRegionFactory.  Registered allocations are whole pages from a page
+// allocator of their own, and are never sampled.  Without the registered heap,
+// they are ordinary page-level allocations, as they are when TCMalloc is not
+// linked in.
+template <typename Policy>
+ABSL_ATTRIBUTE_NOINLINE static typename Policy::pointer_type alloc_registered(
+    Policy policy, size_t size) {
+  tc_globals.InitIfNecessary();
+  tcmalloc::sized_ptr_t res =
+      kHasRegisteredHeap
+          ? do_malloc_pages(size, /*weight=*/0, policy, MemoryTag::kRegistered)
+          : do_malloc_pages(size, /*weight=*/0, policy);
+  if (ABSL_PREDICT_FALSE(res.p == nullptr)) return policy.handle_oom(size);
+  CountThreadAllocated(res.n);
+
+  if (Policy::invoke_hooks()) {
+    TraceAllocation(policy, res.p, size);
   }
+  return Policy::as_pointer(res.p, res.n);
+}
 
+// The fast paths test no process-wide configuration of their own.  Hooks,
+// threads that bypass the per-CPU caches, and per-CPU caches that are not
+// active leave the thread's slab pointer uncached, so that the per-CPU push
+// or pop fails.  Flat virtual CPUs only matter once the slab is cached.
+// Sampling, guarded sampling included, is folded into the sampler's byte
+// count.  What remains is read from Static::fast_path_, fixed at startup.
+//
+// Allocates <size> bytes of <size_class> from the per-CPU cache, or takes the
+// slow path if that is not possible.
+template <typename Policy, typename Pointer>
+static inline Pointer ABSL_ATTRIBUTE_ALWAYS_INLINE
+fast_alloc_small(Policy policy, size_t size, uint32_t size_class) {
   // TryRecordAllocationFast() returns true if no extra logic is required, e.g.:
   // - this allocation does not need to be sampled
   // - no new/delete hooks need to be invoked
@@ -987,7 +1880,351 @@ static inline Pointer ABSL_ATTRIBUTE_ALWAYS_INLINE fast_alloc(Policy policy,
   }
 
   ASSERT(ret != nullptr);
-  return Policy::to_pointer(ret, size_class);
+  CountThreadAllocated(tc_globals.sizemap().class_to_size(size_class));
+  return Policy::to_pointer(TagSizeClass(ret, size_class), size_class);
+}
+
+template <typename Policy, typename Pointer = typename Policy::pointer_type>
+static inline Pointer ABSL_ATTRIBUTE_ALWAYS_INLINE fast_alloc(Policy policy,
+                                                              size_t size) {
+  // If size is larger than kMaxSize, it's not fast-path anymore. In
+  // such case, GetSizeClass will return false, and we'll delegate to the slow
+  // path. If malloc is not yet initialized, we may end up with size_class == 0
+  // (regardless of size), but in this case should also delegate to the slow
+  // path by the fast path check further down.
+  uint32_t size_class;
+  bool is_small = tc_globals.sizemap().GetSizeClass(policy, size, &size_class);
+  if (ABSL_PREDICT_FALSE(!is_small)) {
+    return slow_alloc_large(size, policy);
+  }
+  return fast_alloc_small<Policy, Pointer>(policy, size, size_class);
+}
+
+// Like fast_alloc, for a size whose index into the size class table was
+// computed at compile time by tcmalloc::AllocateFixed.
+template <typename Policy, typename Pointer = typename Policy::pointer_type>
+static inline Pointer ABSL_ATTRIBUTE_ALWAYS_INLINE
+fast_alloc_fixed(Policy policy, size_t size, size_t index) {
+  uint32_t size_class;
+  if (ABSL_PREDICT_FALSE(!tc_globals.sizemap().GetSizeClassAtIndex(
+          policy, size, index, &size_class))) {
+    return slow_alloc_large(size, policy);
+  }
+  return fast_alloc_small<Policy, Pointer>(policy, size, size_class);
+}
+
+// Allocates <size> bytes, preferring a free object on the span holding <near>,
+// a live allocation, when that span has the same size class.  Like
+// batch_alloc, allocations that are sampled or observed by hooks take the
+// regular path.
+template <typename Policy>
+static typename Policy::pointer_type alloc_near(Policy policy, size_t size,
+                                                const void* near) {
+  uint32_t size_class;
+  if (near != nullptr &&
+      tc_globals.sizemap().GetSizeClass(policy, size, &size_class) &&
+      size_class != 0 &&
+      tc_globals.pagemap().sizeclass(PageIdContaining(near)) == size_class &&
+      ABSL_PREDICT_TRUE(!Static::HaveHooks()) &&
+      ABSL_PREDICT_TRUE(!GetThreadSampler()->WillRecordAllocation(size + 1))) {
+    Span* span =
+        tc_globals.pagemap().GetExistingDescriptor(PageIdContaining(near));
+    void* ret;
+    if (tc_globals.central_freelist(size_class).RemoveFromSpan(span, &ret,
+                                                               1) == 1) {
+      const bool recorded = GetThreadSampler()->TryRecordAllocationFast(size);
+      ASSERT(recorded);
+      (void)recorded;
+      CountThreadAllocated(tc_globals.sizemap().class_to_size(size_class));
+      return Policy::to_pointer(TagSizeClass(ret, size_class),
+                                size_class);
+    }
+  }
+  return fast_alloc(policy, size);
+}
+
+// Allocates <size> bytes from the fullest spans of its size class, which the
+// central freelist hands out first, rather than from the per-CPU cache.  Like
+// alloc_near, allocations that are sampled or observed by hooks take the
+// regular path.
+template <typename Policy>
+static typename Policy::pointer_type alloc_dense(Policy policy, size_t size) {
+  uint32_t size_class;
+  if (tc_globals.sizemap().GetSizeClass(policy, size, &size_class) &&
+      size_class != 0 && ABSL_PREDICT_TRUE(!Static::HaveHooks()) &&
+      ABSL_PREDICT_TRUE(!GetThreadSampler()->WillRecordAllocation(size + 1))) {
+    void* ret;
+    if (tc_globals.central_freelist(size_class).RemoveRange(&ret, 1) == 1) {
+      const bool recorded = GetThreadSampler()->TryRecordAllocationFast(size);
+      ASSERT(recorded);
+      (void)recorded;
+      CountThreadAllocated(tc_globals.sizemap().class_to_size(size_class));
+      return Policy::to_pointer(TagSizeClass(ret, size_class),
+                                size_class);
+    }
+  }
+  return fast_alloc(policy, size);
+}
+
+// Allocates <size> bytes for an object of the type identified by <token>,
+// taking it from the partition of <token>, if it has one (see TypePartitions).
+// Like alloc_dense, allocations that are sampled or observed by hooks take the
+// regular path, as do those of other tokens.
+template <typename Policy>
+static typename Policy::pointer_type alloc_typed(Policy policy, size_t size,
+                                                 size_t token) {
+  const int partition = type_partitions.Find(token);
+  uint32_t size_class;
+  if (ABSL_PREDICT_FALSE(partition >= 0) &&
+      tc_globals.sizemap().GetSizeClass(policy, size, &size_class) &&
+      size_class != 0 && ABSL_PREDICT_TRUE(!Static::HaveHooks()) &&
+      ABSL_PREDICT_TRUE(!GetThreadSampler()->WillRecordAllocation(size + 1))) {
+    void* ret = type_partitions.Pop(partition, size_class);
+    if (ret != nullptr) {
+      const bool recorded = GetThreadSampler()->TryRecordAllocationFast(size);
+      ASSERT(recorded);
+      (void)recorded;
+      CountThreadAllocated(tc_globals.sizemap().class_to_size(size_class));
+      return Policy::to_pointer(TagSizeClass(ret, size_class),
+                                size_class);
+    }
+  }
+  return fast_alloc(policy, size);
+}
+
+// Allocates <size> bytes in cache lines of their own: the object is aligned to
+// a line and its size rounded up to whole lines, so that objects written from
+// different CPUs never share a line.
+template <typename Policy>
+static typename Policy::pointer_type alloc_exclusive_line(Policy policy,
+                                                          size_t size) {
+  constexpr size_t kLine = ABSL_CACHELINE_SIZE;
+  // Sizes this large fail to allocate regardless, so are left as they are
+  // rather than wrapped around.
+  if (ABSL_PREDICT_TRUE(size <= ~size_t{0} - kLine)) {
+    size = (size + kLine - 1) & ~(kLine - 1);
+  }
+  return fast_alloc(policy.AlignAs(kLine), size);
+}
+
+// Allocates <n> objects of <size> bytes into <batch>, returning the number of
+// objects allocated.  The size class is resolved once and, when no individual
+// allocation needs to be sampled or observed by hooks, the whole batch is
+// served by a single CpuCache::AllocateBatch call.
+template <typename Policy>
+static size_t batch_alloc(Policy policy, size_t size, void** batch, size_t n) {
+  if (ABSL_PREDICT_FALSE(n == 0)) return 0;
+
+  size_t got = 0;
+  uint32_t size_class;
+  size_t total;
+  // Each allocation is accounted for as size + 1 bytes by the sampler.
+  if (ABSL_PREDICT_TRUE(
+          tc_globals.sizemap().GetSizeClass(policy, size, &size_class)) &&
+      ABSL_PREDICT_TRUE(size_class != 0) &&
+      ABSL_PREDICT_TRUE(!MultiplyOverflow(n, size + 1, &total)) &&
+      ABSL_PREDICT_TRUE(!Static::HaveHooks()) &&
+      ABSL_PREDICT_TRUE(UsePerCpuCache(tc_globals)) &&
+      ABSL_PREDICT_TRUE(!GetThreadSampler()->WillRecordAllocation(total))) {
+    const bool recorded =
+        GetThreadSampler()->TryRecordAllocationFast(total - 1);
+    ASSERT(recorded);
+    (void)recorded;
+    got = tc_globals.cpu_cache().AllocateBatch(size_class, batch, n);
+    CountThreadAllocated(got * tc_globals.sizemap().class_to_size(size_class));
+  }
+
+  // Anything not covered by the batch path (large or sampled allocations, an
+  // uninitialized allocator, or a depleted backing cache) takes the regular
+  // per-object path.
+  for (; got < n; ++got) {
+    batch[got] = fast_alloc(policy, size);
+    if (ABSL_PREDICT_FALSE(batch[got] == nullptr)) break;
+  }
+  return got;
+}
+
+// Frees the <n> objects of unknown size in <batch>, a window at a time.  The
+// pagemap entries of a window are all prefetched before any is read, so their
+// cache misses overlap instead of each free waiting on its own.  The window is
+// then grouped by size class, and each group is returned to the per-CPU cache
+// with a single CpuCache::DeallocateBatch call, which spills to the transfer
+// cache.  nullptr and page-level objects (size class 0, which includes sampled
+// objects) are freed individually.
+static void batch_free_unsized(void** batch, size_t n) {
+  constexpr size_t kWindow = 64;
+  std::pair<uint32_t, void*> objects[kWindow];
+  void* group[kWindow];
+
+  for (size_t start = 0; start < n; start += kWindow) {
+    const size_t end = std::min(n, start + kWindow);
+    for (size_t i = start; i < end; ++i) {
+      if (ABSL_PREDICT_TRUE(batch[i] != nullptr)) {
+        tc_globals.pagemap().PrefetchSizeClass(PageIdContaining(batch[i]));
+      }
+    }
+
+    size_t count = 0;
+    for (size_t i = start; i < end; ++i) {
+      void* ptr = batch[i];
+      if (ABSL_PREDICT_FALSE(ptr == nullptr)) continue;
+      size_t size_class =
+          tc_globals.page_allocator().size_class_regions().SizeClass(ptr);
+      if (size_class == 0) {
+        size_class = tc_globals.pagemap().sizeclass(PageIdContaining(ptr));
+      }
+      if (ABSL_PREDICT_FALSE(size_class == 0)) {
+        InvokeHooksAndFreePages(ptr);
+        continue;
+      }
+      objects[count++] = {static_cast<uint32_t>(size_class),
+                          UntagSizeClass(ptr)};
+    }
+
+    std::sort(objects, objects + count,
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (size_t i = 0; i < count;) {
+      const uint32_t size_class = objects[i].first;
+      size_t grouped = 0;
+      for (; i < count && objects[i].first == size_class; ++i) {
+        group[grouped++] = objects[i].second;
+      }
+      CountThreadFreed(grouped *
+                       tc_globals.sizemap().class_to_size(size_class));
+      tc_globals.cpu_cache().DeallocateBatch(size_class, group, grouped);
+    }
+  }
+}
+
+// Frees the <n> objects of <size> bytes in <batch>.  Objects that are sampled
+// are freed individually, the rest are returned to the per-CPU cache with a
+// single CpuCache::DeallocateBatch call.  <batch> is clobbered.
+static void batch_free(void** batch, size_t n, size_t size) {
+  const bool batchable = !tc_globals.numa_topology().numa_aware() &&
+                         !Static::HaveHooks() && UsePerCpuCache(tc_globals);
+  if (ABSL_PREDICT_TRUE(batchable) && size == 0) {
+    return batch_free_unsized(batch, n);
+  }
+
+  uint32_t size_class;
+  if (ABSL_PREDICT_FALSE(!batchable) || ABSL_PREDICT_FALSE(size == 0) ||
+      ABSL_PREDICT_FALSE(!tc_globals.sizemap().GetSizeClass(
+          CppPolicy().AlignAs(MallocAlignPolicy().align()), size,
+          &size_class))) {
+    for (size_t i = 0; i < n; ++i) {
+      if (size == 0) {
+        do_free(batch[i]);
+      } else {
+        do_free_with_size(batch[i], size, MallocAlignPolicy());
+      }
+    }
+    return;
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = batch[i];
+    // nullptr is reported as sampled memory, which do_free_with_size handles.
+    if (ABSL_PREDICT_FALSE(IsSampledMemory(ptr))) {
+      do_free_with_size(ptr, size, MallocAlignPolicy());
+      continue;
+    }
+    ASSERT(CorrectSize(ptr, size, MallocAlignPolicy()));
+    ASSERT(IsNormalMemory(ptr));
+    batch[count++] = UntagSizeClass(ptr);
+  }
+  CountThreadFreed(count * tc_globals.sizemap().class_to_size(size_class));
+  tc_globals.cpu_cache().DeallocateBatch(size_class, batch, count);
+}
+
+// Warms the heap up for about <bytes> of objects, sized as the <n> entries of
+// <sizes> describe (see MallocExtension::Prewarm).  Returns the number of bytes
+// allocated and touched.
+static size_t prewarm(size_t bytes, const MallocExtension::PrewarmSize* sizes,
+                      size_t n) {
+  tc_globals.InitIfNecessary();
+
+  double total_weight = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (sizes[i].size > 0 && sizes[i].weight > 0) {
+      total_weight += sizes[i].weight;
+    }
+  }
+
+  // Every object is held until all have been allocated, so that freeing them
+  // grows the caches to hold all of them, rather than recycling a few.  They
+  // are threaded through a list in their first words, which faults in their
+  // first pages; the rest of the pages of larger objects are touched as well.
+  constexpr size_t kBatch = 64;
+  void* list = nullptr;
+  size_t warmed = 0;
+  const size_t page_size = GetPageSize();
+  auto hold = [&](void* ptr, size_t size) {
+    for (size_t offset = page_size; offset < size; offset += page_size) {
+      static_cast<volatile char*>(ptr)[offset] = 0;
+    }
+    *static_cast<void**>(ptr) = list;
+    list = ptr;
+    warmed += size;
+  };
+
+  if (total_weight == 0) {
+    // Without a size distribution, only back whole hugepages, which return to
+    // the HugeCache when freed.
+    while (bytes - warmed >= kHugePageSize) {
+      void* ptr =
+          fast_alloc(MallocPolicy().AlignAs(kHugePageSize), kHugePageSize);
+      if (ptr == nullptr) break;
+      hold(ptr, kHugePageSize);
+    }
+  }
+  for (size_t i = 0; i < n && total_weight > 0; ++i) {
+    if (sizes[i].size == 0 || !(sizes[i].weight > 0)) continue;
+    const size_t size = std::max(sizes[i].size, sizeof(void*));
+    size_t count = static_cast<size_t>(
+        static_cast<double>(bytes) * (sizes[i].weight / total_weight) / size);
+
+#ifndef TCMALLOC_INTERNAL_SMALL_BUT_SLOW
+    // Grow the transfer cache up front, so that it keeps the objects that
+    // the per-CPU cache spills (see DemandProfileWork::Start).
+    uint32_t size_class;
+    if (tc_globals.sizemap().GetSizeClass(MallocPolicy(), size, &size_class) &&
+        size_class != 0) {
+      while (tc_globals.transfer_cache().GetStats(size_class).capacity <
+                 count &&
+             tc_globals.transfer_cache().IncreaseCacheCapacity(size_class)) {
+      }
+    }
+#endif
+
+    void* batch[kBatch];
+    while (count > 0) {
+      const size_t want = std::min(count, kBatch);
+      const size_t got = batch_alloc(MallocPolicy(), size, batch, want);
+      for (size_t j = 0; j < got; ++j) hold(batch[j], size);
+      if (got < want) {
+        total_weight = 0;
+        break;
+      }
+      count -= got;
+    }
+  }
+
+  // Freeing fills the calling CPU's cache, growing its capacities as it
+  // overflows, then the transfer caches; what they do not keep returns to the
+  // page heap, still backed.
+  void* batch[kBatch];
+  size_t count = 0;
+  while (list != nullptr) {
+    batch[count++] = list;
+    list = *static_cast<void**>(list);
+    if (count == kBatch) {
+      batch_free(batch, count, 0);
+      count = 0;
+    }
+  }
+  batch_free(batch, count, 0);
+  return warmed;
 }
 
 }  // namespace tcmalloc_internal
@@ -996,6 +2233,10 @@ GOOGLE_MALLOC_SECTION_END
 
 using tcmalloc::tcmalloc_internal::GetOwnership;
 using tcmalloc::tcmalloc_internal::GetSize;
+using tcmalloc::tcmalloc_internal::IsKnownZero;
+using tcmalloc::tcmalloc_internal::TryGrowPagesInPlace;
+using tcmalloc::tcmalloc_internal::TryShrinkPagesInPlace;
+using tcmalloc::tcmalloc_internal::TryMovePages;
 
 extern "C" size_t MallocExtension_Internal_GetAllocatedSize(const void* ptr) {
   ASSERT(!ptr ||
@@ -1003,6 +2244,74 @@ extern "C" size_t MallocExtension_Internal_GetAllocatedSize(const void* ptr) {
   return GetSize(ptr);
 }
 
+extern "C" size_t MallocExtension_Internal_TryResizeInPlace(void* ptr,
+                                                           size_t min_size,
+                                                           size_t max_size) {
+  ASSERT(ptr != nullptr);
+  ASSERT(min_size <= max_size);
+  const size_t size = GetSize(ptr);
+  if (size < min_size) {
+    // Only page-level allocations can grow; objects of a size class already
+    // report their class's full capacity.
+    if (TryGrowPagesInPlace(ptr, max_size) ||
+        (min_size != max_size && TryGrowPagesInPlace(ptr, min_size))) {
+      return GetSize(ptr);
+    }
+  } else if (size > max_size && max_size > 0) {
+    if (TryShrinkPagesInPlace(ptr, max_size)) return GetSize(ptr);
+  }
+  return size;
+}
+
+extern "C" void MallocExtension_Internal_FreeLater(void* ptr, size_t size) {
+  tcmalloc::tcmalloc_internal::free_later(ptr, size);
+}
+
+extern "C" size_t MallocExtension_Internal_AllocateBatch(size_t size, size_t n,
+                                                         void** batch) {
+  return tcmalloc::tcmalloc_internal::batch_alloc(
+      tcmalloc::tcmalloc_internal::MallocPolicy(), size, batch, n);
+}
+
+extern "C" void MallocExtension_Internal_FreeBatch(void** batch, size_t n,
+                                                   size_t size) {
+  tcmalloc::tcmalloc_internal::batch_free(batch, n, size);
+}
+
+extern "C" size_t MallocExtension_Internal_Prewarm(
+    size_t bytes, const tcmalloc::MallocExtension::PrewarmSize* sizes,
+    size_t n) {
+  return tcmalloc::tcmalloc_internal::prewarm(bytes, sizes, n);
+}
+
+extern "C" bool MallocExtension_Internal_PartitionAllocToken(size_t token) {
+  return tcmalloc::tcmalloc_internal::type_partitions.Register(token);
+}
+
+extern "C" tcmalloc::sized_ptr_t MallocExtension_Internal_AllocateRegionChunk(
+    size_t size) {
+  // Region chunks are whole, hugepage-aligned hugepages.  These are served
+  // straight from the HugeCache and returned there when freed, so they never
+  // share a hugepage with other allocations in the filler.
+  using tcmalloc::tcmalloc_internal::kHugePageSize;
+  if (ABSL_PREDICT_FALSE(size > std::numeric_limits<size_t>::max() -
+                                    (kHugePageSize - 1))) {
+    return {nullptr, 0};
+  }
+  size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  return tcmalloc::tcmalloc_internal::fast_alloc(
+      tcmalloc::tcmalloc_internal::MallocPolicy()
+          .AlignAs(kHugePageSize)
+          .SizeReturning(),
+      size);
+}
+
+extern "C" void MallocExtension_Internal_FreeRegionChunk(void* ptr,
+                                                         size_t size) {
+  ASSERT(size % tcmalloc::tcmalloc_internal::kHugePageSize == 0);
+  tcmalloc::tcmalloc_internal::do_free(ptr);
+}
+
 extern "C" void MallocExtension_Internal_MarkThreadBusy() {
   tc_globals.InitIfNecessary();
 
@@ -1025,7 +2334,7 @@ MallocTracingExtension_Internal_GetAllocatedAddressRanges() {
     {
       AllocationGuardSpinLockHolder l(
           &tcmalloc::tcmalloc_internal::pageheap_lock);
-      estimated_span_count = tc_globals.span_allocator().stats().total;
+      estimated_span_count = tc_globals.span_stats().total;
     }
     // We need to avoid allocation events during GetAllocatedSpans, as that may
     // cause a deadlock on pageheap_lock. To this end, we ensure that the result
@@ -1044,18 +2353,116 @@ MallocTracingExtension_Internal_GetAllocatedAddressRanges() {
       "output vector.");
 }
 
+absl::Status MallocTracingExtension_Internal_ForEachLiveObject(
+    absl::FunctionRef<
+        void(const tcmalloc::malloc_tracing_extension::LiveObject&)>
+        callback,
+    int partition, int num_partitions) {
+  using tcmalloc::tcmalloc_internal::CompactSizeClass;
+  using tcmalloc::tcmalloc_internal::HugePageContaining;
+  using tcmalloc::tcmalloc_internal::PageId;
+  using tcmalloc::tcmalloc_internal::pageheap_lock;
+  using tcmalloc::tcmalloc_internal::SampledSlab;
+  using tcmalloc::tcmalloc_internal::Span;
+
+  // The number of spans visited under one acquisition of pageheap_lock.
+  constexpr size_t kSpansPerBatch = 64;
+  struct SpanRef {
+    Span* span;
+    PageId first_page;
+    size_t size_class;
+    // For spans without a size class, recorded under pageheap_lock: the size
+    // of their objects, and a mask of those allocated.
+    size_t object_size;
+    uint64_t allocated;
+  };
+
+  tc_globals.InitIfNecessary();
+  std::optional<PageId> next = PageId{0};
+  while (next.has_value()) {
+    SpanRef spans[kSpansPerBatch];
+    size_t n = 0;
+    {
+      AllocationGuardSpinLockHolder h(&pageheap_lock);
+      size_t visited = 0;
+      next = tc_globals.pagemap().ForEachSpan(
+          *next, [&](Span* s, CompactSizeClass size_class) {
+            if (s->location() == Span::IN_USE &&
+                HugePageContaining(s->first_page()).index() % num_partitions ==
+                    partition) {
+              SpanRef& ref = spans[n++];
+              ref = {s, s->first_page(), size_class, 0, 0};
+              if (size_class != 0) {
+                // Found below, under the lock of its central freelist.
+              } else if (const SampledSlab* slab = s->sampled_slab()) {
+                ref.object_size = slab->object_size();
+                ref.allocated = slab->allocated();
+              } else {
+                ref.object_size = s->bytes_in_span();
+                ref.allocated = 1;
+              }
+            }
+            return ++visited < kSpansPerBatch;
+          });
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      const SpanRef& ref = spans[i];
+      if (ref.size_class == 0) {
+        const uintptr_t start = ref.first_page.start_uintptr();
+        for (uint64_t a = ref.allocated; a != 0; a &= a - 1) {
+          callback({start + absl::countr_zero(a) * ref.object_size,
+                    ref.object_size});
+        }
+        continue;
+      }
+
+      auto& freelist =
+          tc_globals.transfer_cache().central_freelist(ref.size_class);
+      // The span may have been freed, or even reused, since we saw it.
+      auto owned = [&]() {
+        return tc_globals.pagemap().GetDescriptor(ref.first_page) ==
+                   ref.span &&
+               ref.span->first_page() == ref.first_page &&
+               tc_globals.pagemap().sizeclass(ref.first_page) ==
+                   ref.size_class;
+      };
+      Span::ObjectBitmap live;
+      size_t count;
+      const char* first = static_cast<char*>(
+          freelist.LiveObjects(ref.span, owned, &live, &count));
+      if (first == nullptr) continue;
+      const size_t object_size =
+          tc_globals.sizemap().class_to_size(ref.size_class);
+      for (size_t j = 0; j < count; ++j) {
+        if (!live.GetBit(j)) continue;
+        callback({reinterpret_cast<uintptr_t>(first + j * object_size),
+                  object_size});
+      }
+    }
+  }
+  return absl::OkStatus();
+}
+
 //-------------------------------------------------------------------
 // Exported routines
 //-------------------------------------------------------------------
 
 using tcmalloc::tcmalloc_internal::AlignAsPolicy;
+using tcmalloc::tcmalloc_internal::allocation_trace_suppressed;
+using tcmalloc::tcmalloc_internal::AllocationTraceOp;
+using tcmalloc::tcmalloc_internal::ClearMemory;
 using tcmalloc::tcmalloc_internal::CorrectAlignment;
 using tcmalloc::tcmalloc_internal::DefaultAlignPolicy;
 using tcmalloc::tcmalloc_internal::do_free;
+using tcmalloc::tcmalloc_internal::do_free_coroutine_frame;
+using tcmalloc::tcmalloc_internal::do_free_fixed;
 using tcmalloc::tcmalloc_internal::do_free_with_size;
 using tcmalloc::tcmalloc_internal::GetPageSize;
 using tcmalloc::tcmalloc_internal::MallocAlignPolicy;
 using tcmalloc::tcmalloc_internal::MultiplyOverflow;
+using tcmalloc::tcmalloc_internal::Static;
+using tcmalloc::tcmalloc_internal::TraceAllocationOp;
 
 // depends on TCMALLOC_HAVE_STRUCT_MALLINFO, so needs to come after that.
 #ifndef TCMALLOC_INTERNAL_METHODS_ONLY
@@ -1085,6 +2492,26 @@ extern "C" ABSL_CACHELINE_ALIGNED ABSL_ATTRIBUTE_SECTION(google_malloc)
   return fast_alloc(CppPolicy().SizeReturning(), size);
 }
 
+extern "C" ABSL_CACHELINE_ALIGNED ABSL_ATTRIBUTE_SECTION(google_malloc) void*
+tcmalloc_allocate_fixed(size_t size, size_t index) {
+  return fast_alloc_fixed(CppPolicy(), size, index);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED ABSL_ATTRIBUTE_SECTION(google_malloc) void
+tcmalloc_deallocate_fixed(void* ptr, size_t size, size_t index) noexcept {
+  do_free_fixed(ptr, size, index);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED ABSL_ATTRIBUTE_SECTION(google_malloc) void*
+tcmalloc_allocate_coroutine_frame(size_t size) {
+  return fast_alloc(CppPolicy(), size);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED ABSL_ATTRIBUTE_SECTION(google_malloc) void
+tcmalloc_deallocate_coroutine_frame(void* ptr, size_t size) noexcept {
+  do_free_coroutine_frame(ptr, size);
+}
+
 extern "C" ABSL_CACHELINE_ALIGNED ABSL_ATTRIBUTE_SECTION(
     google_malloc) tcmalloc::sized_ptr_t
     tcmalloc_size_returning_operator_new_aligned(size_t size,
@@ -1143,14 +2570,17 @@ extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalCalloc(
     return MallocPolicy::handle_oom(std::numeric_limits<size_t>::max());
   }
   void* result = fast_alloc(MallocPolicy(), size);
-  if (ABSL_PREDICT_TRUE(result != nullptr)) {
-    memset(result, 0, size);
+  // Pages fresh from the system (or released to it since last used) are
+  // already zero, and clearing them would needlessly fault them all in.
+  // Recycled buffers larger than the L2 cache are cleared around the caches.
+  if (ABSL_PREDICT_TRUE(result != nullptr) && !IsKnownZero(result, size)) {
+    ClearMemory(result, size);
   }
   return result;
 }
 
-static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* do_realloc(void* old_ptr,
-                                                            size_t new_size) {
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* do_realloc_untraced(
+    void* old_ptr, size_t new_size) {
   tc_globals.InitIfNecessary();
   // Get the size of the old entry
   const size_t old_size = GetSize(old_ptr);
@@ -1183,9 +2613,28 @@ static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* do_realloc(void* old_ptr,
   const bool will_sample =
       alloc_size <= tcmalloc::tcmalloc_internal::kMaxSize &&
       GetThreadSampler()->WillRecordAllocation(alloc_size);
+  // Page-level allocations shrinking to another page-level size can return
+  // their tail pages without a copy, so they shrink by as little as they would
+  // grow.
+  if (new_size < old_size - min_growth &&
+      new_size > tcmalloc::tcmalloc_internal::kMaxSize && !will_sample &&
+      TryShrinkPagesInPlace(old_ptr, new_size)) {
+    return old_ptr;
+  }
   if ((new_size > old_size) || (new_size < upper_bound_to_shrink) ||
       will_sample ||
-      tc_globals.guardedpage_allocator().PointerIsMine(old_ptr)) {
+      tc_globals.guardedpage_allocator().PointerIsMine(old_ptr) ||
+      tc_globals.mte_sampled_allocator().PointerIsMine(old_ptr)) {
+    // Page-level allocations may be able to grow into the pages that follow
+    // them, avoiding both a new allocation and the copy.  As when
+    // reallocating, prefer the hysteresis-adjusted size.
+    if (new_size > old_size &&
+        old_size > tcmalloc::tcmalloc_internal::kMaxSize && !will_sample &&
+        (TryGrowPagesInPlace(old_ptr, alloc_size) ||
+         (alloc_size != new_size && TryGrowPagesInPlace(old_ptr, new_size)))) {
+      return old_ptr;
+    }
+
     // Need to reallocate.
     void* new_ptr = nullptr;
 
@@ -1210,6 +2659,13 @@ static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* do_realloc(void* old_ptr,
     if (new_ptr == nullptr) {
       return nullptr;
     }
+    // Allocations of whole hugepages can have their pages remapped into the
+    // new allocation rather than copied.
+    if (new_size > old_size &&
+        old_size > tcmalloc::tcmalloc_internal::kMaxSize &&
+        TryMovePages(old_ptr, new_ptr)) {
+      return new_ptr;
+    }
     memcpy(new_ptr, old_ptr, ((old_size < new_size) ? old_size : new_size));
     // We could use a variant of do_free() that leverages the fact
     // that we already know the sizeclass of old_ptr.  The benefit
@@ -1221,6 +2677,28 @@ static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* do_realloc(void* old_ptr,
   }
 }
 
+// Traces the reallocation as a whole, rather than as the allocation and free
+// it may do.
+ABSL_ATTRIBUTE_NOINLINE static void* do_realloc_traced(void* old_ptr,
+                                                       size_t new_size) {
+  allocation_trace_suppressed = true;
+  void* new_ptr = do_realloc_untraced(old_ptr, new_size);
+  allocation_trace_suppressed = false;
+  if (new_ptr != nullptr) {
+    TraceAllocationOp(AllocationTraceOp::kRealloc, new_ptr, old_ptr, new_size,
+                      0);
+  }
+  return new_ptr;
+}
+
+static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* do_realloc(void* old_ptr,
+                                                            size_t new_size) {
+  if (ABSL_PREDICT_FALSE(Static::HaveHooks())) {
+    return do_realloc_traced(old_ptr, new_size);
+  }
+  return do_realloc_untraced(old_ptr, new_size);
+}
+
 extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalRealloc(
     void* ptr, size_t size) noexcept {
   if (ptr == nullptr) {
@@ -1501,6 +2979,7 @@ class TCMallocGuard {
     TCMallocInternalFree(TCMallocInternalMalloc(1));
     ThreadCache::InitTSD();
     TCMallocInternalFree(TCMallocInternalMalloc(1));
+    pthread_atfork(PrepareFork, ForkParent, ForkChild);
   }
 };
 
@@ -1595,4 +3074,144 @@ ABSL_CACHELINE_ALIGNED void* operator new[](
                       size);
   }
 }
+
+ABSL_CACHELINE_ALIGNED void* operator new(
+    size_t size, tcmalloc::registered_t) noexcept(false) {
+  return alloc_registered(CppPolicy(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(size_t size, const std::nothrow_t&,
+                                          tcmalloc::registered_t) noexcept {
+  return alloc_registered(CppPolicy().Nothrow(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](
+    size_t size, tcmalloc::registered_t) noexcept(false) {
+  return alloc_registered(CppPolicy(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](size_t size, const std::nothrow_t&,
+                                            tcmalloc::registered_t) noexcept {
+  return alloc_registered(CppPolicy().Nothrow(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(
+    size_t size, tcmalloc::near_t near) noexcept(false) {
+  return alloc_near(CppPolicy(), size, near.ptr);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(size_t size, const std::nothrow_t&,
+                                          tcmalloc::near_t near) noexcept {
+  return alloc_near(CppPolicy().Nothrow(), size, near.ptr);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](
+    size_t size, tcmalloc::near_t near) noexcept(false) {
+  return alloc_near(CppPolicy(), size, near.ptr);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](size_t size, const std::nothrow_t&,
+                                            tcmalloc::near_t near) noexcept {
+  return alloc_near(CppPolicy().Nothrow(), size, near.ptr);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(
+    size_t size, tcmalloc::exclusive_line_t) noexcept(false) {
+  return alloc_exclusive_line(CppPolicy(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(size_t size, const std::nothrow_t&,
+                                          tcmalloc::exclusive_line_t) noexcept {
+  return alloc_exclusive_line(CppPolicy().Nothrow(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](
+    size_t size, tcmalloc::exclusive_line_t) noexcept(false) {
+  return alloc_exclusive_line(CppPolicy(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](
+    size_t size, const std::nothrow_t&, tcmalloc::exclusive_line_t) noexcept {
+  return alloc_exclusive_line(CppPolicy().Nothrow(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(size_t size,
+                                          tcmalloc::dense_t) noexcept(false) {
+  return alloc_dense(CppPolicy(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(size_t size, const std::nothrow_t&,
+                                          tcmalloc::dense_t) noexcept {
+  return alloc_dense(CppPolicy().Nothrow(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](size_t size,
+                                            tcmalloc::dense_t) noexcept(false) {
+  return alloc_dense(CppPolicy(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](size_t size, const std::nothrow_t&,
+                                            tcmalloc::dense_t) noexcept {
+  return alloc_dense(CppPolicy().Nothrow(), size);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(
+    size_t size, tcmalloc::alloc_token_t token) noexcept(false) {
+  return alloc_typed(CppPolicy(), size, token.token);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new(
+    size_t size, const std::nothrow_t&,
+    tcmalloc::alloc_token_t token) noexcept {
+  return alloc_typed(CppPolicy().Nothrow(), size, token.token);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](
+    size_t size, tcmalloc::alloc_token_t token) noexcept(false) {
+  return alloc_typed(CppPolicy(), size, token.token);
+}
+
+ABSL_CACHELINE_ALIGNED void* operator new[](
+    size_t size, const std::nothrow_t&,
+    tcmalloc::alloc_token_t token) noexcept {
+  return alloc_typed(CppPolicy().Nothrow(), size, token.token);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* __alloc_token_malloc(
+    size_t size, size_t token) noexcept {
+  return alloc_typed(MallocPolicy(), size, token);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* __alloc_token_calloc(
+    size_t n, size_t elem_size, size_t token) noexcept {
+  size_t size;
+  if (ABSL_PREDICT_FALSE(MultiplyOverflow(n, elem_size, &size))) {
+    return MallocPolicy::handle_oom(std::numeric_limits<size_t>::max());
+  }
+  void* result = alloc_typed(MallocPolicy(), size, token);
+  if (ABSL_PREDICT_TRUE(result != nullptr) && !IsKnownZero(result, size)) {
+    ClearMemory(result, size);
+  }
+  return result;
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* __alloc_token__Znwm(size_t size,
+                                                            size_t token) {
+  return alloc_typed(CppPolicy(), size, token);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* __alloc_token__Znam(size_t size,
+                                                            size_t token) {
+  return alloc_typed(CppPolicy(), size, token);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* __alloc_token__ZnwmRKSt9nothrow_t(
+    size_t size, const std::nothrow_t&, size_t token) noexcept {
+  return alloc_typed(CppPolicy().Nothrow(), size, token);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* __alloc_token__ZnamRKSt9nothrow_t(
+    size_t size, const std::nothrow_t&, size_t token) noexcept {
+  return alloc_typed(CppPolicy().Nothrow(), size, token);
+}
 #endif  // !TCMALLOC_INTERNAL_METHODS_ONLY
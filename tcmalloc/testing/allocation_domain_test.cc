@@ -0,0 +1,153 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <new>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace {
+
+using ::testing::HasSubstr;
+
+constexpr size_t kMiB = size_t{1} << 20;
+
+TEST(AllocationDomainTest, Scoped) {
+  EXPECT_EQ(MallocExtension::GetAllocationDomain(), 0);
+  {
+    MallocExtension::ScopedAllocationDomain d1(1);
+    EXPECT_EQ(MallocExtension::GetAllocationDomain(), 1);
+    {
+      MallocExtension::ScopedAllocationDomain d2(2);
+      EXPECT_EQ(MallocExtension::GetAllocationDomain(), 2);
+      // The domain is per thread.
+      std::thread([] {
+        EXPECT_EQ(MallocExtension::GetAllocationDomain(), 0);
+      }).join();
+    }
+    EXPECT_EQ(MallocExtension::GetAllocationDomain(), 1);
+  }
+  EXPECT_EQ(MallocExtension::GetAllocationDomain(), 0);
+}
+
+TEST(AllocationDomainTest, Usage) {
+  constexpr int kDomain = 3;
+  const size_t other_before = MallocExtension::GetAllocationDomainUsage(0);
+  ASSERT_EQ(MallocExtension::GetAllocationDomainUsage(kDomain), 0);
+
+  std::vector<void*> ptrs;
+  {
+    MallocExtension::ScopedAllocationDomain d(kDomain);
+    for (int i = 0; i < 10; ++i) {
+      ptrs.push_back(::operator new(kMiB));
+    }
+    // Small allocations are not attributed.
+    ::operator delete(::operator new(64));
+  }
+  EXPECT_EQ(MallocExtension::GetAllocationDomainUsage(kDomain), 10 * kMiB);
+
+  EXPECT_THAT(MallocExtension::GetStats(),
+              HasSubstr("allocation domain  3:     10485760 bytes in use"));
+
+  // Freeing uncharges the allocating domain, whichever thread frees.
+  std::thread([&] {
+    for (void* ptr : ptrs) {
+      ::operator delete(ptr);
+    }
+  }).join();
+  EXPECT_EQ(MallocExtension::GetAllocationDomainUsage(kDomain), 0);
+  EXPECT_EQ(MallocExtension::GetAllocationDomainUsage(0), other_before);
+}
+
+TEST(AllocationDomainTest, HardLimit) {
+  constexpr int kDomain = 4;
+  MallocExtension::SetAllocationDomainLimit(
+      kDomain, 4 * kMiB, MallocExtension::LimitKind::kHard);
+  EXPECT_EQ(MallocExtension::GetAllocationDomainLimit(
+                kDomain, MallocExtension::LimitKind::kHard),
+            4 * kMiB);
+
+  void* fits;
+  {
+    MallocExtension::ScopedAllocationDomain d(kDomain);
+    fits = ::operator new(3 * kMiB, std::nothrow);
+    ASSERT_NE(fits, nullptr);
+    EXPECT_EQ(::operator new(2 * kMiB, std::nothrow), nullptr);
+  }
+  // Other domains are unaffected.
+  void* other = ::operator new(2 * kMiB, std::nothrow);
+  EXPECT_NE(other, nullptr);
+  ::operator delete(other);
+
+  ::operator delete(fits);
+  MallocExtension::SetAllocationDomainLimit(kDomain, 0,
+                                            MallocExtension::LimitKind::kHard);
+  {
+    MallocExtension::ScopedAllocationDomain d(kDomain);
+    void* ptr = ::operator new(8 * kMiB, std::nothrow);
+    EXPECT_NE(ptr, nullptr);
+    ::operator delete(ptr);
+  }
+  EXPECT_EQ(MallocExtension::GetAllocationDomainUsage(kDomain), 0);
+}
+
+TEST(AllocationDomainTest, SoftLimit) {
+  constexpr int kDomain = 5;
+  MallocExtension::SetAllocationDomainLimit(
+      kDomain, kMiB, MallocExtension::LimitKind::kSoft);
+
+  {
+    // Exceeding the soft limit does not fail allocations.
+    MallocExtension::ScopedAllocationDomain d(kDomain);
+    std::vector<void*> ptrs;
+    for (int i = 0; i < 4; ++i) {
+      ptrs.push_back(::operator new(kMiB));
+    }
+    EXPECT_EQ(MallocExtension::GetAllocationDomainUsage(kDomain), 4 * kMiB);
+    for (void* ptr : ptrs) {
+      ::operator delete(ptr);
+    }
+  }
+  EXPECT_EQ(MallocExtension::GetAllocationDomainUsage(kDomain), 0);
+  MallocExtension::SetAllocationDomainLimit(kDomain, 0,
+                                            MallocExtension::LimitKind::kSoft);
+}
+
+TEST(AllocationDomainTest, Realloc) {
+  constexpr int kDomain = 6;
+  {
+    MallocExtension::ScopedAllocationDomain d(kDomain);
+    void* ptr = malloc(kMiB);
+    ASSERT_NE(ptr, nullptr);
+    // Grow in place where possible, and by moving or copying otherwise.
+    for (size_t size = 2 * kMiB; size <= 16 * kMiB; size += kMiB) {
+      ptr = realloc(ptr, size);
+      ASSERT_NE(ptr, nullptr);
+      EXPECT_GE(MallocExtension::GetAllocationDomainUsage(kDomain), size);
+    }
+    free(ptr);
+  }
+  EXPECT_EQ(MallocExtension::GetAllocationDomainUsage(kDomain), 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc
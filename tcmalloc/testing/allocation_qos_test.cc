@@ -0,0 +1,78 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+
+#include <new>
+#include <optional>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace {
+
+using AllocationQoS = MallocExtension::AllocationQoS;
+
+TEST(AllocationQoSTest, Scoped) {
+  EXPECT_EQ(MallocExtension::GetThreadAllocationQoS(),
+            AllocationQoS::kLatencyCritical);
+  {
+    MallocExtension::ScopedAllocationQoS batch(AllocationQoS::kBatch);
+    EXPECT_EQ(MallocExtension::GetThreadAllocationQoS(), AllocationQoS::kBatch);
+    {
+      MallocExtension::ScopedAllocationQoS critical(
+          AllocationQoS::kLatencyCritical);
+      EXPECT_EQ(MallocExtension::GetThreadAllocationQoS(),
+                AllocationQoS::kLatencyCritical);
+    }
+    EXPECT_EQ(MallocExtension::GetThreadAllocationQoS(), AllocationQoS::kBatch);
+  }
+  EXPECT_EQ(MallocExtension::GetThreadAllocationQoS(),
+            AllocationQoS::kLatencyCritical);
+}
+
+// Batch threads keep the objects they free in a cache of their own, and give
+// them back once they are latency-critical again.
+TEST(AllocationQoSTest, BatchThreadsBypassPerCpuCaches) {
+  auto thread_cache_free = []() {
+    std::optional<size_t> bytes =
+        MallocExtension::GetNumericProperty("tcmalloc.thread_cache_free");
+    return bytes.value_or(0);
+  };
+
+  {
+    MallocExtension::ScopedAllocationQoS batch(AllocationQoS::kBatch);
+    std::vector<void*> ptrs;
+    for (int i = 0; i < 1000; ++i) {
+      ptrs.push_back(::operator new(64));
+    }
+    for (void* ptr : ptrs) {
+      ::operator delete(ptr);
+    }
+    if (MallocExtension::PerCpuCachesActive()) {
+      EXPECT_GT(thread_cache_free(), 0);
+    }
+  }
+
+  if (MallocExtension::PerCpuCachesActive()) {
+    EXPECT_EQ(thread_cache_free(), 0);
+  }
+  // Allocation works as before.
+  ::operator delete(::operator new(64));
+}
+
+}  // namespace
+}  // namespace tcmalloc
@@ -0,0 +1,194 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Measures allocation latency while TCMalloc's background thread releases
+// memory, shuffles cpu caches and subreleases from the filler.  Worker threads
+// churn through a working set of objects of varied sizes, timing each
+// allocation, while the background thread runs every <interval> and releases
+// at <rate>.  Each run reports the p50, p99 and p99.9 allocation latency
+// across all workers.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/base/call_once.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace {
+
+using absl::base_internal::CycleClock;
+
+void StartBackgroundThread() {
+  static absl::once_flag once;
+  absl::call_once(once, [] {
+    if (!MallocExtension::NeedsProcessBackgroundActions()) return;
+    std::thread(MallocExtension::ProcessBackgroundActions).detach();
+  });
+}
+
+// Sets the background thread's sleep interval and release rate for the
+// lifetime of the object.
+class ScopedBackgroundConfig {
+ public:
+  ScopedBackgroundConfig(absl::Duration interval,
+                         MallocExtension::BytesPerSecond rate)
+      : interval_(MallocExtension::GetBackgroundProcessSleepInterval()),
+        rate_(MallocExtension::GetBackgroundReleaseRate()) {
+    MallocExtension::SetBackgroundProcessSleepInterval(interval);
+    MallocExtension::SetBackgroundReleaseRate(rate);
+  }
+
+  ~ScopedBackgroundConfig() {
+    MallocExtension::SetBackgroundProcessSleepInterval(interval_);
+    MallocExtension::SetBackgroundReleaseRate(rate_);
+  }
+
+ private:
+  absl::Duration interval_;
+  MallocExtension::BytesPerSecond rate_;
+};
+
+class Worker {
+ public:
+  // Every kSampleEvery-th allocation is timed; the latest kMaxSamples are
+  // kept.
+  static constexpr size_t kSampleEvery = 4;
+  static constexpr size_t kMaxSamples = 1 << 18;
+
+  Worker() : samples_(kMaxSamples) {
+    absl::InsecureBitGen rng;
+    // Mostly small objects, with a tail large enough to churn the pageheap.
+    for (size_t& size : sizes_) {
+      size = absl::LogUniform<size_t>(rng, 8, 64 << 10);
+    }
+  }
+
+  void Run(const std::atomic<bool>& stop) {
+    void* live[kLiveObjects] = {};
+    size_t i = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      const size_t size = sizes_[i % kNumSizes];
+      const int64_t start = CycleClock::Now();
+      void* ptr = ::operator new(size);
+      const int64_t end = CycleClock::Now();
+      if (i % kSampleEvery == 0) {
+        samples_[num_samples_++ % kMaxSamples] = end - start;
+      }
+      // Back the memory, so that releasing it has work to do.
+      memset(ptr, 0, size);
+
+      void*& slot = live[i % kLiveObjects];
+      ::operator delete(slot);
+      slot = ptr;
+      ++i;
+    }
+    for (void* ptr : live) ::operator delete(ptr);
+    allocations_ = i;
+  }
+
+  size_t allocations() const { return allocations_; }
+
+  // Appends the recorded latencies, in cycles, to <out>.
+  void AppendSamples(std::vector<int64_t>& out) const {
+    out.insert(out.end(), samples_.begin(),
+               samples_.begin() + std::min(num_samples_, kMaxSamples));
+  }
+
+ private:
+  static constexpr size_t kNumSizes = 4096;
+  static constexpr size_t kLiveObjects = 4096;
+
+  size_t sizes_[kNumSizes];
+  std::vector<int64_t> samples_;
+  size_t num_samples_ = 0;
+  size_t allocations_ = 0;
+};
+
+// Arguments: release rate in MiB/s, background interval in ms, worker
+// threads.
+void BM_AllocationLatencyUnderRelease(benchmark::State& state) {
+  StartBackgroundThread();
+  const ScopedBackgroundConfig config(
+      absl::Milliseconds(state.range(1)),
+      static_cast<MallocExtension::BytesPerSecond>(state.range(0) << 20));
+  const int num_workers = state.range(2);
+
+  std::atomic<bool> stop(false);
+  std::vector<Worker> workers;
+  workers.reserve(num_workers);
+  for (int i = 0; i < num_workers; ++i) workers.emplace_back();
+  std::vector<std::thread> threads;
+  threads.reserve(num_workers);
+  for (Worker& w : workers) {
+    threads.emplace_back([&w, &stop] { w.Run(stop); });
+  }
+
+  // Each iteration is a window in which the workers allocate.
+  for (auto _ : state) {
+    absl::SleepFor(absl::Milliseconds(100));
+  }
+  stop.store(true, std::memory_order_relaxed);
+  for (std::thread& t : threads) t.join();
+
+  std::vector<int64_t> samples;
+  size_t allocations = 0;
+  for (const Worker& w : workers) {
+    w.AppendSamples(samples);
+    allocations += w.allocations();
+  }
+  if (samples.empty()) {
+    state.SkipWithError("No allocations were timed");
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  const double ns_per_cycle = 1e9 / CycleClock::Frequency();
+  auto percentile = [&](double p) {
+    const size_t i = std::min<size_t>(p * samples.size(), samples.size() - 1);
+    return samples[i] * ns_per_cycle;
+  };
+  state.SetItemsProcessed(allocations);
+  state.counters["p50_ns"] = percentile(0.5);
+  state.counters["p99_ns"] = percentile(0.99);
+  state.counters["p99.9_ns"] = percentile(0.999);
+}
+
+BENCHMARK(BM_AllocationLatencyUnderRelease)
+    ->ArgNames({"release_MiBps", "interval_ms", "workers"})
+    // Baseline: the background thread runs rarely and does not release.
+    ->Args({0, 1000, 4})
+    ->Args({16, 1000, 4})
+    ->Args({256, 100, 4})
+    ->Args({1024, 10, 4})
+    ->Args({1024, 10, 16})
+    // Long enough for several passes at the longest interval.
+    ->MinTime(5)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace tcmalloc
@@ -12,20 +12,35 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <malloc.h>
 #include <stddef.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include <atomic>
+#include <limits>
 #include <thread>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/deferred_free.h"
+#include "tcmalloc/internal/parameter_accessors.h"
+#include "tcmalloc/internal_malloc_extension.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/span_cache.h"
+#include "tcmalloc/static_vars.h"
 #include "tcmalloc/testing/test_allocator_harness.h"
 #include "tcmalloc/testing/testutil.h"
 #include "tcmalloc/testing/thread_manager.h"
 
+#if !defined(__GLIBC__)
+extern "C" int malloc_trim(size_t pad);
+#endif
+
 namespace tcmalloc {
 namespace {
 
@@ -65,6 +80,177 @@ TEST(BackgroundTest, Stress) {
   background.join();
 }
 
+TEST(BackgroundTest, PiggybackedOnSlowPaths) {
+  constexpr size_t kSize = 1 << 20;
+  constexpr size_t kBlocks = 64;
+
+  ScopedBackgroundProcessSleepInterval sleep_time(absl::Milliseconds(1));
+  const MallocExtension::BytesPerSecond rate =
+      MallocExtension::GetBackgroundReleaseRate();
+  MallocExtension::SetBackgroundReleaseRate(
+      MallocExtension::BytesPerSecond{1 << 30});
+  TCMalloc_Internal_SetPiggybackBackgroundActions(true);
+  // Release whatever is free, however recently it was in use.
+  const absl::Duration skip_subrelease[] = {
+      MallocExtension::GetSkipSubreleaseInterval(),
+      MallocExtension::GetSkipSubreleaseShortInterval(),
+      MallocExtension::GetSkipSubreleaseLongInterval()};
+  MallocExtension::SetSkipSubreleaseInterval(absl::ZeroDuration());
+  MallocExtension::SetSkipSubreleaseShortInterval(absl::ZeroDuration());
+  MallocExtension::SetSkipSubreleaseLongInterval(absl::ZeroDuration());
+
+  // Leave free memory in the page heap for the release to find, and nothing
+  // else that it might be slow to release.
+  MallocExtension::ReleaseMemoryToSystem(std::numeric_limits<size_t>::max());
+  std::vector<void*> blocks;
+  for (size_t i = 0; i < kBlocks; ++i) {
+    blocks.push_back(::operator new(kSize));
+    memset(blocks.back(), 0xef, kSize);
+  }
+  for (void* block : blocks) {
+    ::operator delete(block, kSize);
+  }
+  auto unmapped = [] {
+    return MallocExtension::GetNumericProperty(
+               "tcmalloc.pageheap_unmapped_bytes")
+        .value_or(0);
+  };
+  const size_t unmapped_before = unmapped();
+  const size_t released =
+      MallocExtension::GetNumericProperty("tcmalloc.pageheap_free_bytes")
+          .value_or(0) /
+      2;
+
+  // No thread processes the background actions, so the large allocations
+  // made here have to release the memory.
+  const absl::Time deadline = absl::Now() + absl::Seconds(30);
+  while (unmapped() < unmapped_before + released && absl::Now() < deadline) {
+    ::operator delete(::operator new(kSize), kSize);
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_GE(unmapped(), unmapped_before + released);
+
+  MallocExtension::SetSkipSubreleaseInterval(skip_subrelease[0]);
+  MallocExtension::SetSkipSubreleaseShortInterval(skip_subrelease[1]);
+  MallocExtension::SetSkipSubreleaseLongInterval(skip_subrelease[2]);
+  TCMalloc_Internal_SetPiggybackBackgroundActions(false);
+  MallocExtension::SetBackgroundReleaseRate(rate);
+}
+
+TEST(BackgroundTest, FreeLater) {
+  constexpr size_t kSize = 64 << 20;
+
+  auto central_free = [] {
+    return MallocExtension::GetNumericProperty("tcmalloc.central_cache_free")
+        .value_or(0);
+  };
+
+  // Without a background thread, the pages are freed right away.
+  FreeLater(nullptr);
+  size_t before = central_free();
+  FreeLater(::operator new(kSize));
+  EXPECT_LT(central_free(), before + kSize / 2);
+
+  struct ProcessActions {
+    static void Go() {
+      ScopedBackgroundProcessSleepInterval sleep_time(absl::Seconds(10));
+      MallocExtension::ProcessBackgroundActions();
+    }
+  };
+  std::thread background(ProcessActions::Go);
+  // Let the thread start before queueing work for it.
+  absl::SleepFor(absl::Milliseconds(100));
+
+  // Freeing wakes the thread well before its next interval.
+  before = central_free();
+  const absl::Time start = absl::Now();
+  FreeLater(::operator new(kSize), kSize);
+  FreeLater(::operator new(kSize));
+  while (central_free() >= before + kSize / 2 &&
+         absl::Now() < start + absl::Seconds(5)) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_LT(central_free(), before + kSize / 2);
+
+  ScopedBackgroundProcessActionsEnabled background_process_enabled(
+      /*value=*/false);
+  background.join();
+}
+
+TEST(BackgroundTest, MallocTrimDrainsFreeLater) {
+  using tcmalloc_internal::deferred_frees;
+  constexpr size_t kSize = 64 << 20;
+
+  // Sampled allocations are not queued.
+  ScopedNeverSample never_sample;
+  // Stand in for a background thread that has yet to get to the queue.
+  deferred_frees.ConsumerStarted();
+  FreeLater(::operator new(kSize));
+  EXPECT_GE(deferred_frees.queued_bytes(), kSize);
+
+  malloc_trim(0);
+  EXPECT_EQ(deferred_frees.queued_bytes(), 0);
+  deferred_frees.ConsumerStopped();
+}
+
+TEST(BackgroundTest, ReleaseKeepsPrepopulatedSpans) {
+  using tcmalloc_internal::kNumClasses;
+  using tcmalloc_internal::tc_globals;
+
+  ASSERT_NE(&TCMalloc_Internal_ReleaseMemoryInBackground, nullptr);
+  // Prepopulate the largest size class that can hold a span, as the background
+  // thread does for classes whose transfer cache runs dry.
+  int size_class = kNumClasses - 1;
+  for (; size_class > 0; --size_class) {
+    const size_t batch = tc_globals.sizemap().num_objects_to_move(size_class);
+    if (batch > 0 &&
+        tc_globals.central_freelist(size_class).Prepopulate(batch)) {
+      break;
+    }
+  }
+  if (size_class == 0) {
+    GTEST_SKIP() << "No size class could be prepopulated";
+  }
+  auto& central_freelist = tc_globals.central_freelist(size_class);
+  ASSERT_GT(central_freelist.num_empty_spans(), 0);
+
+  // The background thread's release leaves the span for Populate().
+  TCMalloc_Internal_ReleaseMemoryInBackground(size_t{1} << 30);
+  EXPECT_GT(central_freelist.num_empty_spans(), 0);
+
+  // An explicit release still returns it to the page heap.
+  MallocExtension::ReleaseMemoryToSystem(0);
+  EXPECT_EQ(central_freelist.num_empty_spans(), 0);
+}
+
+TEST(BackgroundTest, ReleaseKeepsCachedSpans) {
+  using tcmalloc_internal::AccessDensityPrediction;
+  using tcmalloc_internal::Length;
+  using tcmalloc_internal::MemoryTag;
+  using tcmalloc_internal::Span;
+  using tcmalloc_internal::span_cache;
+
+  ASSERT_NE(&TCMalloc_Internal_ReleaseMemoryInBackground, nullptr);
+  MallocExtension::ReleaseMemoryToSystem(0);
+  ASSERT_EQ(span_cache.cached_bytes(), 0);
+
+  Span* span = span_cache.Refill(MemoryTag::kNormal, Length(1),
+                                 {1, AccessDensityPrediction::kSparse});
+  ASSERT_NE(span, nullptr);
+  ASSERT_TRUE(span_cache.TryPut(MemoryTag::kNormal, span,
+                                AccessDensityPrediction::kSparse));
+  const size_t cached_bytes = span_cache.cached_bytes();
+  ASSERT_GT(cached_bytes, 0);
+
+  // The background thread's release leaves the cached spans to Plunder().
+  TCMalloc_Internal_ReleaseMemoryInBackground(size_t{1} << 30);
+  EXPECT_EQ(span_cache.cached_bytes(), cached_bytes);
+
+  // An explicit release still returns them to the page heap.
+  MallocExtension::ReleaseMemoryToSystem(0);
+  EXPECT_EQ(span_cache.cached_bytes(), 0);
+}
+
 }  // namespace
 }  // namespace tcmalloc
 
@@ -12,10 +12,195 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "benchmark/benchmark.h"
 
+namespace {
+
+// Hardware counters for the whole process, including threads started after
+// they are opened.  A thread's counts are added to the process's when it
+// exits, which benchmark threads have by the time their runs are reported.
+class PerfCounters {
+ public:
+  struct Event {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+  };
+
+  static constexpr Event kEvents[] = {
+      {"CYCLES", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {"INSTRUCTIONS", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {"L1D_MISSES", PERF_TYPE_HW_CACHE,
+       PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+      {"DTLB_MISSES", PERF_TYPE_HW_CACHE,
+       PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  };
+  static constexpr int kNumEvents = sizeof(kEvents) / sizeof(kEvents[0]);
+
+  // Returns null if the counters cannot be opened, e.g. because
+  // perf_event_paranoid forbids it.
+  static std::unique_ptr<PerfCounters> Open() {
+    std::unique_ptr<PerfCounters> counters(new PerfCounters);
+    for (int i = 0; i < kNumEvents; ++i) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = kEvents[i].type;
+      attr.config = kEvents[i].config;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      counters->fds_[i] =
+          syscall(SYS_perf_event_open, &attr, /*pid=*/0, /*cpu=*/-1,
+                  /*group_fd=*/-1, PERF_FLAG_FD_CLOEXEC);
+      if (counters->fds_[i] < 0) {
+        fprintf(stderr, "Hardware counters unavailable: %s: %s\n",
+                kEvents[i].name, strerror(errno));
+        return nullptr;
+      }
+    }
+    return counters;
+  }
+
+  ~PerfCounters() {
+    for (int fd : fds_) {
+      if (fd >= 0) close(fd);
+    }
+  }
+
+  // Reads the counts so far into `values`.
+  void Read(uint64_t values[kNumEvents]) const {
+    for (int i = 0; i < kNumEvents; ++i) {
+      if (read(fds_[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+        values[i] = 0;
+      }
+    }
+  }
+
+ private:
+  PerfCounters() { std::fill(fds_, fds_ + kNumEvents, -1); }
+
+  int fds_[kNumEvents];
+};
+
+double ProcessCpuSeconds() {
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Adds per-iteration hardware counters to each run before passing it on.
+//
+// The counters cannot be started and stopped with a benchmark's timer, so
+// they are read between reports and cover all of a benchmark's runs, including
+// the ones that estimate the iteration count.  They are scaled to the reported
+// run by CPU time, which is accurate as long as the timed loop dominates.
+class PerfCounterReporter : public benchmark::BenchmarkReporter {
+ public:
+  PerfCounterReporter(std::unique_ptr<PerfCounters> counters,
+                      std::unique_ptr<benchmark::BenchmarkReporter> reporter)
+      : counters_(std::move(counters)), reporter_(std::move(reporter)) {}
+
+  bool ReportContext(const Context& context) override {
+    reporter_->SetOutputStream(&GetOutputStream());
+    reporter_->SetErrorStream(&GetErrorStream());
+    Checkpoint(last_counts_, &last_cpu_seconds_);
+    return reporter_->ReportContext(context);
+  }
+
+  void ReportRuns(const std::vector<Run>& runs) override {
+    uint64_t counts[PerfCounters::kNumEvents];
+    double cpu_seconds;
+    Checkpoint(counts, &cpu_seconds);
+    const double elapsed = cpu_seconds - last_cpu_seconds_;
+
+    std::vector<Run> annotated = runs;
+    for (Run& run : annotated) {
+      if (run.run_type != Run::RT_Iteration || run.error_occurred ||
+          run.iterations == 0 || elapsed <= 0) {
+        continue;
+      }
+      const double scale =
+          run.cpu_accumulated_time / run.iterations / elapsed;
+      for (int i = 0; i < PerfCounters::kNumEvents; ++i) {
+        run.counters[PerfCounters::kEvents[i].name] =
+            (counts[i] - last_counts_[i]) * scale;
+      }
+    }
+    reporter_->ReportRuns(annotated);
+
+    // Exclude the time spent reporting from the next benchmark.
+    Checkpoint(last_counts_, &last_cpu_seconds_);
+  }
+
+  void Finalize() override { reporter_->Finalize(); }
+
+ private:
+  void Checkpoint(uint64_t counts[PerfCounters::kNumEvents],
+                  double* cpu_seconds) const {
+    counters_->Read(counts);
+    *cpu_seconds = ProcessCpuSeconds();
+  }
+
+  std::unique_ptr<PerfCounters> counters_;
+  std::unique_ptr<benchmark::BenchmarkReporter> reporter_;
+  uint64_t last_counts_[PerfCounters::kNumEvents] = {};
+  double last_cpu_seconds_ = 0;
+};
+
+// Returns the reporter for --benchmark_format, which Initialize consumes.
+std::unique_ptr<benchmark::BenchmarkReporter> CreateDisplayReporter(
+    int argc, char* argv[]) {
+  std::string format = "console";
+  for (int i = 1; i < argc; ++i) {
+    constexpr char kFlag[] = "--benchmark_format=";
+    if (strncmp(argv[i], kFlag, strlen(kFlag)) == 0) {
+      format = argv[i] + strlen(kFlag);
+    }
+  }
+  if (format == "json") {
+    return std::make_unique<benchmark::JSONReporter>();
+  } else if (format == "csv") {
+    return std::make_unique<benchmark::CSVReporter>();
+  }
+  return std::make_unique<benchmark::ConsoleReporter>(
+      isatty(STDOUT_FILENO) ? benchmark::ConsoleReporter::OO_Defaults
+                            : benchmark::ConsoleReporter::OO_Tabular);
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
+  // Report hardware counters per iteration, unless disabled with
+  // TCMALLOC_BENCHMARK_PERF_COUNTERS=0.
+  std::unique_ptr<benchmark::BenchmarkReporter> reporter;
+  const char* enable = getenv("TCMALLOC_BENCHMARK_PERF_COUNTERS");
+  if (enable == nullptr || strcmp(enable, "0") != 0) {
+    if (std::unique_ptr<PerfCounters> counters = PerfCounters::Open()) {
+      reporter = std::make_unique<PerfCounterReporter>(
+          std::move(counters), CreateDisplayReporter(argc, argv));
+    }
+  }
+
   benchmark::Initialize(&argc, argv);
-  benchmark::RunSpecifiedBenchmarks();
+  benchmark::RunSpecifiedBenchmarks(reporter.get());
   return 0;
 }
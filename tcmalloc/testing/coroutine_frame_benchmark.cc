@@ -0,0 +1,159 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Models the lifetime of coroutine frames in an asynchronous RPC stack: each
+// frame is allocated on one cpu and freed shortly after on another.  The
+// benchmark thread allocates frames and passes them through a bounded queue to
+// a consumer thread on a different cpu, which frees them.
+
+#include <sched.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <new>
+#include <thread>  // NOLINT(build/c++11)
+
+#include "absl/base/call_once.h"
+#include "absl/base/optimization.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/new_extension.h"
+
+namespace tcmalloc {
+namespace {
+
+// Pairing the producing and consuming cpus is done by TCMalloc's background
+// thread, so make sure it runs.
+void StartBackgroundThread() {
+  static absl::once_flag once;
+  absl::call_once(once, [] {
+    if (!MallocExtension::NeedsProcessBackgroundActions()) return;
+    std::thread(MallocExtension::ProcessBackgroundActions).detach();
+  });
+}
+
+// Restricts the calling thread to the <n>th cpu it may run on, if there are
+// at least two such cpus.
+void PinToNthCpu(int n) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ||
+      CPU_COUNT(&allowed) < 2) {
+    return;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed) || n-- > 0) continue;
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    sched_setaffinity(0, sizeof(pinned), &pinned);
+    return;
+  }
+}
+
+// A single-producer, single-consumer queue of frames.
+class FrameQueue {
+ public:
+  static constexpr size_t kCapacity = 1024;
+
+  void Push(void* frame) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    while (tail - head_.load(std::memory_order_acquire) == kCapacity) {
+      std::this_thread::yield();
+    }
+    frames_[tail % kCapacity] = frame;
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  // Returns nullptr once the queue is empty and closed.
+  void* Pop() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    while (head == tail_.load(std::memory_order_acquire)) {
+      if (closed_.load(std::memory_order_acquire) &&
+          head == tail_.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      std::this_thread::yield();
+    }
+    void* frame = frames_[head % kCapacity];
+    head_.store(head + 1, std::memory_order_release);
+    return frame;
+  }
+
+  void Close() { closed_.store(true, std::memory_order_release); }
+
+ private:
+  void* frames_[kCapacity];
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> head_{0};
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> tail_{0};
+  std::atomic<bool> closed_{false};
+};
+
+struct OperatorNew {
+  static void* Allocate(size_t size) { return ::operator new(size); }
+  static void Free(void* ptr, size_t size) { ::operator delete(ptr, size); }
+};
+
+struct CoroutineFrame {
+  static void* Allocate(size_t size) {
+    return tcmalloc_allocate_coroutine_frame(size);
+  }
+  static void Free(void* ptr, size_t size) {
+    tcmalloc_deallocate_coroutine_frame(ptr, size);
+  }
+};
+
+template <typename Path>
+void BM_CrossCpuFrames(benchmark::State& state) {
+  StartBackgroundThread();
+  const size_t size = state.range(0);
+
+  // The consumer inherits our affinity, so it is started before we pin
+  // ourselves.
+  FrameQueue queue;
+  std::thread consumer([&] {
+    PinToNthCpu(1);
+    while (void* frame = queue.Pop()) {
+      Path::Free(frame, size);
+    }
+  });
+  cpu_set_t saved;
+  const bool restore = sched_getaffinity(0, sizeof(saved), &saved) == 0;
+  PinToNthCpu(0);
+
+  for (auto s : state) {
+    void* frame = Path::Allocate(size);
+    benchmark::DoNotOptimize(frame);
+    queue.Push(frame);
+  }
+  queue.Close();
+  consumer.join();
+  if (restore) {
+    sched_setaffinity(0, sizeof(saved), &saved);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_CrossCpuFrames, OperatorNew)
+    ->Arg(64)
+    ->Arg(256)
+    ->Arg(1024)
+    ->Arg(4096);
+BENCHMARK_TEMPLATE(BM_CrossCpuFrames, CoroutineFrame)
+    ->Arg(64)
+    ->Arg(256)
+    ->Arg(1024)
+    ->Arg(4096);
+
+}  // namespace
+}  // namespace tcmalloc
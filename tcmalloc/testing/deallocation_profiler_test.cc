@@ -742,6 +742,54 @@ TEST(LifetimeProfiler, RecordCensoredAllocations) {
   EXPECT_EQ(alloc_frames, 2 * (kAllocFrames + 1));
 }
 
+TEST(LifetimeProfiler, LifetimeHistogram) {
+  if (CheckerIsActive()) {
+    return;
+  }
+
+  const int64_t kMallocSize = 4 * 1024 * 1024;
+  const int kNumAllocations = 20;
+  tcmalloc::ScopedProfileSamplingRate test_sample_rate(1);
+
+  auto token = tcmalloc::MallocExtension::StartLifetimeProfiling();
+  for (int i = 0; i < kNumAllocations; i++) {
+    void *ptr = SingleAlloc(2, kMallocSize);
+    absl::SleepFor(absl::Microseconds(100));
+    SingleDealloc(2, ptr);
+  }
+  const tcmalloc::Profile profile = std::move(token).Stop();
+
+  int64_t histogram[tcmalloc::Profile::Sample::kLifetimeHistogramBuckets] = {};
+  profile.Iterate([&](const tcmalloc::Profile::Sample &e) {
+    if (e.count >= 0 || e.requested_size != kMallocSize) return;
+    for (int i = 0; i < tcmalloc::Profile::Sample::kLifetimeHistogramBuckets;
+         ++i) {
+      histogram[i] += e.lifetime_histogram[i];
+    }
+  });
+
+  // Every deallocation is counted once, with a lifetime of at least 100us.
+  int64_t total = 0;
+  for (int i = 0; i < tcmalloc::Profile::Sample::kLifetimeHistogramBuckets;
+       ++i) {
+    total += histogram[i];
+    if (i < 5) EXPECT_EQ(histogram[i], 0) << i;
+  }
+  EXPECT_EQ(total, kNumAllocations);
+}
+
+TEST(LifetimeProfiler, LifetimeHistogramBucket) {
+  using deallocationz::internal::LifetimeHistogramBucket;
+
+  EXPECT_EQ(LifetimeHistogramBucket(0), 0);
+  EXPECT_EQ(LifetimeHistogramBucket(9), 0);
+  EXPECT_EQ(LifetimeHistogramBucket(10), 1);
+  EXPECT_EQ(LifetimeHistogramBucket(4245), 3);
+  EXPECT_EQ(LifetimeHistogramBucket(1e12), 12);
+  EXPECT_EQ(LifetimeHistogramBucket(1e20),
+            tcmalloc::Profile::Sample::kLifetimeHistogramBuckets - 1);
+}
+
 TEST(LifetimeProfiler, LifetimeBucketing) {
   using deallocationz::internal::LifetimeNsToBucketedDuration;
 
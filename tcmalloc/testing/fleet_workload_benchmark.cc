@@ -0,0 +1,341 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Synthetic workloads shaped like fleet applications, for judging cache and
+// page heap policies under representative load rather than single-size loops.
+// Each workload draws sizes from a mixture of log-normal distributions and
+// lifetimes from a short/long bimodal distribution, hands some objects to
+// another thread to free, and periodically allocates a burst of short-lived
+// objects.
+//
+// Besides the throughput, each benchmark samples the physical memory used while
+// it runs and reports its peak and the mean and peak fragmentation: how much
+// more memory that is than the bytes live at the time.  Set
+// TCMALLOC_WORKLOAD_TIMESERIES to a file to also append every sample to it as
+// CSV.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <new>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/random/discrete_distribution.h"
+#include "absl/random/random.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace {
+
+struct SizeComponent {
+  double weight;
+  // The median size of the component, in bytes.
+  double median;
+  // The standard deviation of log(size).
+  double sigma;
+};
+
+struct Workload {
+  const char* name;
+  SizeComponent sizes[3];
+  // The fraction of objects that are short-lived, and the mean lifetimes of
+  // short- and long-lived objects, in steps of the thread that frees them.
+  double short_lived;
+  double short_lifetime;
+  double long_lifetime;
+  // The fraction of objects handed to the next thread to free.
+  double cross_thread;
+  // Every `burst_period` steps, a thread allocates `burst_size` objects that
+  // live for `burst_lifetime` steps.  No bursts if `burst_period` is 0.
+  int burst_period;
+  int burst_size;
+  int burst_lifetime;
+};
+
+// An RPC server: mostly small, short-lived request state, some buffers, and a
+// long tail of connection state; some responses are freed by another thread.
+constexpr Workload kRpcServer = {
+    .name = "rpc_server",
+    .sizes = {{0.70, 48, 1.0}, {0.25, 1024, 1.2}, {0.05, 64 << 10, 1.0}},
+    .short_lived = 0.9,
+    .short_lifetime = 64,
+    .long_lifetime = 32 << 10,
+    .cross_thread = 0.2,
+    .burst_period = 4 << 10,
+    .burst_size = 256,
+    .burst_lifetime = 128,
+};
+
+// A cache server: mostly long-lived entries of widely varying sizes.
+constexpr Workload kCacheServer = {
+    .name = "cache_server",
+    .sizes = {{0.50, 256, 1.5}, {0.45, 4096, 1.0}, {0.05, 256 << 10, 0.5}},
+    .short_lived = 0.3,
+    .short_lifetime = 32,
+    .long_lifetime = 64 << 10,
+    .cross_thread = 0.05,
+    .burst_period = 0,
+    .burst_size = 0,
+    .burst_lifetime = 0,
+};
+
+// A pipeline: stages produce messages that the next stage consumes.
+constexpr Workload kPipeline = {
+    .name = "pipeline",
+    .sizes = {{0.60, 128, 0.8}, {0.35, 2048, 0.8}, {0.05, 32 << 10, 0.5}},
+    .short_lived = 0.8,
+    .short_lifetime = 128,
+    .long_lifetime = 16 << 10,
+    .cross_thread = 0.8,
+    .burst_period = 0,
+    .burst_size = 0,
+    .burst_lifetime = 0,
+};
+
+// A batch job: steady background work with large periodic bursts.
+constexpr Workload kBatch = {
+    .name = "batch",
+    .sizes = {{0.80, 64, 1.0}, {0.15, 8192, 1.0}, {0.05, 1 << 20, 0.5}},
+    .short_lived = 0.95,
+    .short_lifetime = 16,
+    .long_lifetime = 8 << 10,
+    .cross_thread = 0.1,
+    .burst_period = 1 << 10,
+    .burst_size = 4096,
+    .burst_lifetime = 512,
+};
+
+constexpr int kStepsPerIteration = 64 << 10;
+constexpr size_t kMaxSize = 16 << 20;
+constexpr absl::Duration kSamplePeriod = absl::Milliseconds(10);
+
+struct Object {
+  int64_t expiry;
+  void* ptr;
+  size_t size;
+
+  bool operator>(const Object& other) const { return expiry > other.expiry; }
+};
+
+struct alignas(ABSL_CACHELINE_SIZE) Mailbox {
+  absl::Mutex mu;
+  // Objects handed over by another thread, with their lifetimes rather than
+  // expiries in `expiry`.
+  std::vector<Object> objects ABSL_GUARDED_BY(mu);
+};
+
+struct alignas(ABSL_CACHELINE_SIZE) ThreadStats {
+  std::atomic<int64_t> live_bytes{0};
+  int64_t ops = 0;
+};
+
+class WorkloadThread {
+ public:
+  WorkloadThread(const Workload& w, Mailbox& inbox, Mailbox& outbox,
+                 ThreadStats& stats)
+      : w_(w), inbox_(inbox), outbox_(outbox), stats_(stats) {
+    std::vector<double> weights;
+    for (const SizeComponent& c : w_.sizes) weights.push_back(c.weight);
+    component_ = absl::discrete_distribution<int>(weights.begin(),
+                                                  weights.end());
+  }
+
+  void Run(int steps) {
+    for (int i = 0; i < steps; ++i, ++step_) {
+      if (w_.burst_period > 0 && step_ % w_.burst_period == 0) {
+        for (int j = 0; j < w_.burst_size; ++j) {
+          Allocate(w_.burst_lifetime, /*cross_thread=*/false);
+        }
+      }
+      const bool short_lived = absl::Bernoulli(rng_, w_.short_lived);
+      Allocate(absl::Exponential<double>(
+                   rng_, 1 / (short_lived ? w_.short_lifetime
+                                          : w_.long_lifetime)),
+               absl::Bernoulli(rng_, w_.cross_thread));
+      ReceiveHandedOver();
+      FreeExpired(step_);
+    }
+  }
+
+  // Frees every object still live, and any handed over since.
+  void FreeAll() {
+    ReceiveHandedOver();
+    FreeExpired(INT64_MAX);
+  }
+
+ private:
+  size_t SampleSize() {
+    const SizeComponent& c = w_.sizes[component_(rng_)];
+    const double size =
+        std::exp(absl::Gaussian<double>(rng_, std::log(c.median), c.sigma));
+    return std::clamp<size_t>(size, 1, kMaxSize);
+  }
+
+  void Allocate(double lifetime, bool cross_thread) {
+    const size_t size = SampleSize();
+    Object o = {static_cast<int64_t>(lifetime), ::operator new(size), size};
+    // Touch the object, as a real application would.
+    static_cast<char*>(o.ptr)[0] = 0;
+    stats_.live_bytes.fetch_add(size, std::memory_order_relaxed);
+    ++stats_.ops;
+    if (cross_thread) {
+      absl::MutexLock l(&outbox_.mu);
+      outbox_.objects.push_back(o);
+    } else {
+      o.expiry += step_;
+      live_.push(o);
+    }
+  }
+
+  void ReceiveHandedOver() {
+    {
+      absl::MutexLock l(&inbox_.mu);
+      received_.swap(inbox_.objects);
+    }
+    for (Object& o : received_) {
+      o.expiry += step_;
+      live_.push(o);
+    }
+    received_.clear();
+  }
+
+  void FreeExpired(int64_t now) {
+    while (!live_.empty() && live_.top().expiry <= now) {
+      const Object& o = live_.top();
+      ::operator delete(o.ptr, o.size);
+      stats_.live_bytes.fetch_sub(o.size, std::memory_order_relaxed);
+      ++stats_.ops;
+      live_.pop();
+    }
+  }
+
+  const Workload& w_;
+  Mailbox& inbox_;
+  Mailbox& outbox_;
+  ThreadStats& stats_;
+  absl::BitGen rng_;
+  absl::discrete_distribution<int> component_;
+  int64_t step_ = 0;
+  std::priority_queue<Object, std::vector<Object>, std::greater<Object>> live_;
+  std::vector<Object> received_;
+};
+
+size_t PhysicalMemoryUsed() {
+  return MallocExtension::GetNumericProperty("generic.physical_memory_used")
+      .value_or(0);
+}
+
+void BM_fleet_workload(benchmark::State& state, const Workload& w) {
+  const int num_threads = state.range(0);
+
+  FILE* timeseries = nullptr;
+  if (const char* path = getenv("TCMALLOC_WORKLOAD_TIMESERIES");
+      path != nullptr) {
+    timeseries = fopen(path, "a");
+  }
+
+  std::vector<Mailbox> mailboxes(num_threads);
+  std::vector<ThreadStats> stats(num_threads);
+  std::vector<WorkloadThread> workers;
+  workers.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    workers.emplace_back(w, mailboxes[i], mailboxes[(i + 1) % num_threads],
+                         stats[i]);
+  }
+
+  const absl::Time start = absl::Now();
+  size_t peak_rss = 0;
+  double fragmentation_sum = 0, peak_fragmentation = 0;
+  int64_t samples = 0;
+
+  for (auto s : state) {
+    std::atomic<int> running = num_threads;
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      threads.emplace_back([&, i] {
+        workers[i].Run(kStepsPerIteration);
+        running.fetch_sub(1, std::memory_order_release);
+      });
+    }
+
+    while (running.load(std::memory_order_acquire) > 0) {
+      const size_t rss = PhysicalMemoryUsed();
+      int64_t live = 0;
+      for (const ThreadStats& t : stats) {
+        live += t.live_bytes.load(std::memory_order_relaxed);
+      }
+      peak_rss = std::max(peak_rss, rss);
+      if (rss > 0 && live > 0) {
+        const double fragmentation = static_cast<double>(rss) / live - 1;
+        fragmentation_sum += fragmentation;
+        peak_fragmentation = std::max(peak_fragmentation, fragmentation);
+        ++samples;
+      }
+      if (timeseries != nullptr) {
+        fprintf(timeseries, "%s,%d,%lld,%zu,%lld\n", w.name, num_threads,
+                static_cast<long long>(absl::ToInt64Milliseconds(
+                    absl::Now() - start)),
+                rss, static_cast<long long>(live));
+      }
+      absl::SleepFor(kSamplePeriod);
+    }
+    for (std::thread& t : threads) t.join();
+  }
+
+  // Objects still live carry over between iterations, as they would in a long
+  // running process; free them once we are done.
+  for (WorkloadThread& worker : workers) worker.FreeAll();
+  if (timeseries != nullptr) fclose(timeseries);
+
+  int64_t ops = 0;
+  for (const ThreadStats& t : stats) ops += t.ops;
+  state.SetItemsProcessed(ops);
+  state.counters["peak_rss_bytes"] = peak_rss;
+  if (samples > 0) {
+    state.counters["mean_fragmentation"] = fragmentation_sum / samples;
+    state.counters["peak_fragmentation"] = peak_fragmentation;
+  }
+}
+
+#define FLEET_WORKLOAD_BENCHMARK(workload)                  \
+  BENCHMARK_CAPTURE(BM_fleet_workload, workload, k##workload) \
+      ->ArgName("threads")                                  \
+      ->Arg(2)                                              \
+      ->Arg(8)                                              \
+      ->UseRealTime()                                       \
+      ->Unit(benchmark::kMillisecond)
+
+FLEET_WORKLOAD_BENCHMARK(RpcServer);
+FLEET_WORKLOAD_BENCHMARK(CacheServer);
+FLEET_WORKLOAD_BENCHMARK(Pipeline);
+FLEET_WORKLOAD_BENCHMARK(Batch);
+
+}  // namespace
+}  // namespace tcmalloc
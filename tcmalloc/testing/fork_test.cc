@@ -0,0 +1,182 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <optional>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/random/random.h"
+#include "tcmalloc/internal/parameter_accessors.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/new_extension.h"
+#include "tcmalloc/testing/testutil.h"
+
+namespace tcmalloc {
+namespace {
+
+// Allocates and frees objects of assorted sizes.
+void Churn(absl::BitGen& rng, int iterations) {
+  std::vector<void*> ptrs;
+  for (int i = 0; i < iterations; ++i) {
+    ptrs.push_back(::operator new(absl::Uniform<size_t>(rng, 1, 4096)));
+    if (ptrs.size() > 64) {
+      for (void* ptr : ptrs) ::operator delete(ptr);
+      ptrs.clear();
+    }
+  }
+  for (void* ptr : ptrs) ::operator delete(ptr);
+}
+
+// Forks and returns the child's exit status, which is the result of <child>.
+template <typename F>
+int ForkAndWait(F child) {
+  const pid_t pid = fork();
+  if (pid == 0) {
+    _exit(child());
+  }
+  EXPECT_GT(pid, 0);
+  int status;
+  EXPECT_EQ(waitpid(pid, &status, 0), pid);
+  EXPECT_TRUE(WIFEXITED(status));
+  return WEXITSTATUS(status);
+}
+
+TEST(ForkTest, ChildAllocatesWhileParentThreadsAllocate) {
+  std::atomic<bool> done = false;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&]() {
+      absl::BitGen rng;
+      while (!done.load(std::memory_order_relaxed)) Churn(rng, 1000);
+    });
+  }
+
+  for (int i = 0; i < 20; ++i) {
+    // Any lock that another thread held at fork() would deadlock the child.
+    EXPECT_EQ(ForkAndWait([]() {
+                absl::BitGen rng;
+                Churn(rng, 10000);
+                return 0;
+              }),
+              0);
+  }
+
+  done = true;
+  for (auto& t : threads) t.join();
+}
+
+// Allocates and frees page-level objects, which go through the span caches,
+// and objects of a partitioned type.
+void ChurnSpans(absl::BitGen& rng, int iterations) {
+  constexpr size_t kToken = 0x5eed;
+  MallocExtension::PartitionAllocToken(kToken);
+  for (int i = 0; i < iterations; ++i) {
+    void* large = ::operator new(absl::Uniform<size_t>(rng, 1, 4 << 20));
+    void* typed = ::operator new(absl::Uniform<size_t>(rng, 1, 1024),
+                                 alloc_token_t{kToken});
+    ::operator delete(typed);
+    FreeLater(large);
+  }
+}
+
+TEST(ForkTest, ChildAllocatesSpansWhileParentThreadsDo) {
+  // Most of these allocations would be sampled, and sampling reads absl's
+  // clock, whose lock is not ours to take around fork().
+  ScopedNeverSample never_sample;
+  std::atomic<bool> done = false;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&]() {
+      absl::BitGen rng;
+      while (!done.load(std::memory_order_relaxed)) ChurnSpans(rng, 100);
+    });
+  }
+
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_EQ(ForkAndWait([]() {
+                absl::BitGen rng;
+                ChurnSpans(rng, 1000);
+                // The span caches are handed back under the locks of the
+                // release path.
+                MallocExtension::ReleaseMemoryToSystem(0);
+                return 0;
+              }),
+              0);
+  }
+
+  done = true;
+  for (auto& t : threads) t.join();
+}
+
+bool WipeOnForkSupported() {
+#ifdef MADV_WIPEONFORK
+  const size_t size = getpagesize();
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return false;
+  const bool supported = madvise(p, size, MADV_WIPEONFORK) == 0;
+  munmap(p, size);
+  return supported;
+#else
+  return false;
+#endif
+}
+
+TEST(ForkTest, WipeOnForkEmptiesChildCpuCaches) {
+  if (!MallocExtension::PerCpuCachesActive()) {
+    GTEST_SKIP() << "per-CPU caches are not active";
+  }
+  if (!WipeOnForkSupported()) {
+    GTEST_SKIP() << "MADV_WIPEONFORK is not supported";
+  }
+
+  auto CpuFree = []() {
+    std::optional<size_t> bytes =
+        MallocExtension::GetNumericProperty("tcmalloc.cpu_free");
+    return bytes.value_or(0);
+  };
+
+  TCMalloc_Internal_SetPerCpuCachesWipeOnFork(true);
+  absl::BitGen rng;
+  Churn(rng, 10000);
+  ASSERT_GT(CpuFree(), 0);
+
+  EXPECT_EQ(ForkAndWait([&]() {
+              if (CpuFree() != 0) return 1;
+              // The child's caches are set up again on their first use.
+              absl::BitGen child_rng;
+              Churn(child_rng, 10000);
+              return CpuFree() > 0 ? 0 : 2;
+            }),
+            0);
+
+  // The parent keeps its caches, and later forks do not wipe them unless
+  // asked to.
+  EXPECT_GT(CpuFree(), 0);
+  TCMalloc_Internal_SetPerCpuCachesWipeOnFork(false);
+  Churn(rng, 10000);
+  EXPECT_EQ(ForkAndWait([&]() { return CpuFree() > 0 ? 0 : 1; }), 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc
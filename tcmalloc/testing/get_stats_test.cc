@@ -255,6 +255,42 @@ TEST_F(GetStatsTest, Parameters) {
   }
 }
 
+TEST_F(GetStatsTest, NumericPropertySnapshot) {
+  constexpr size_t kSize = 64 << 20;
+  const auto bytes = [] {
+    return *MallocExtension::GetNumericProperty(
+        "generic.current_allocated_bytes");
+  };
+
+  // With the snapshot enabled, reads reuse the stats published by the first.
+  Parameters::set_stats_snapshot_max_age_ms(3600 * 1000);
+  const size_t before = bytes();
+  auto ptr = std::make_unique<char[]>(kSize);
+  ASSERT_GE(MallocExtension::GetAllocatedSize(ptr.get()), kSize);
+  EXPECT_EQ(bytes(), before);
+
+  // Disabling it reads live stats again.
+  Parameters::set_stats_snapshot_max_age_ms(0);
+  EXPECT_GE(bytes(), before + kSize);
+}
+
+TEST_F(GetStatsTest, MemoryTiers) {
+  constexpr size_t kSize = 1 << 20;
+  auto ptr = std::make_unique<char[]>(kSize);
+  ASSERT_GE(MallocExtension::GetAllocatedSize(ptr.get()), kSize);
+
+  const std::string buf = MallocExtension::GetStats();
+  EXPECT_THAT(buf, ContainsRegex(R"(MALLOC TIER normal +[1-9][0-9]* bytes)"));
+  EXPECT_THAT(buf, HasSubstr("MALLOC TIER sampled"));
+  EXPECT_THAT(buf, HasSubstr("MALLOC TIER cold"));
+  EXPECT_THAT(buf, HasSubstr("MALLOC TIER registered"));
+
+  const std::string pbtxt = GetStatsInPbTxt();
+  EXPECT_THAT(pbtxt, HasSubstr("memory_tier {"));
+  EXPECT_THAT(pbtxt, HasSubstr("name: cold"));
+  EXPECT_THAT(pbtxt, ContainsRegex(R"(system_bytes: [1-9][0-9]*)"));
+}
+
 TEST_F(GetStatsTest, StackDepth) {
   // We run a thread with a limited stack size to confirm that we do not use too
   // much stack space gathering statistics.
@@ -308,5 +344,37 @@ TEST_F(GetStatsTest, StackDepth) {
   ASSERT_EQ(pthread_attr_destroy(&thread_attributes), 0);
 }
 
+TEST_F(GetStatsTest, WriteStats) {
+  // The sink allocates, which it may only do while no locks are held.
+  auto write = [](MallocExtension::StatsFormat format, int* sections) {
+    std::string out;
+    MallocExtension::WriteStats(format, [&](absl::string_view section) {
+      EXPECT_FALSE(section.empty());
+      ++*sections;
+      absl::StrAppend(&out, section);
+    });
+    return out;
+  };
+
+  int sections = 0;
+  const std::string pbtxt =
+      write(MallocExtension::StatsFormat::kPbtxt, &sections);
+  EXPECT_GT(sections, 1);
+  EXPECT_THAT(pbtxt, ContainsRegex(R"(in_use_by_app: [0-9]+)"));
+  EXPECT_THAT(pbtxt, AnyOf(HasSubstr(R"(page_heap {)"),
+                           HasSubstr(R"(huge_page_aware {)")));
+  EXPECT_THAT(pbtxt, HasSubstr(R"(gwp_asan {)"));
+  EXPECT_THAT(pbtxt, HasSubstr("tcmalloc_per_cpu_caches: "));
+  EXPECT_THAT(pbtxt, ContainsRegex(R"(mmap_sys_allocator: [0-9]*)"));
+
+  sections = 0;
+  const std::string text =
+      write(MallocExtension::StatsFormat::kText, &sections);
+  EXPECT_GT(sections, 1);
+  EXPECT_THAT(text, HasSubstr("MALLOC:"));
+  EXPECT_THAT(text, HasSubstr("PARAMETER tcmalloc_per_cpu_caches "));
+  EXPECT_THAT(text, HasSubstr("Low-level allocator stats:"));
+}
+
 }  // namespace
 }  // namespace tcmalloc
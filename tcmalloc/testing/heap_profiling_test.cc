@@ -21,6 +21,7 @@
 #include <memory>
 #include <optional>
 #include <string>
+#include <vector>
 
 #include "tcmalloc/internal/profile.pb.h"
 #include "gtest/gtest.h"
@@ -96,6 +97,58 @@ INSTANTIATE_TEST_SUITE_P(SamplingRates, HeapProfilingTest,
                          testing::Values(1, 1 << 7, 1 << 14, 1 << 21),
                          testing::PrintToStringParamName());
 
+TEST(HeapProfilingTest, HeapDelta) {
+  ScopedProfileSamplingRate s(1);
+  constexpr int kNumAllocations = 100;
+  constexpr size_t kSize = (1 << 19) + 1;
+
+  uint64_t cursor = 0;
+  MallocExtension::SnapshotHeapDelta(&cursor);
+  const uint64_t start = cursor;
+
+  void* allocations[kNumAllocations];
+  for (int i = 0; i < kNumAllocations; i++) {
+    allocations[i] = ::operator new(kSize);
+  }
+
+  // Every allocation was sampled at the same stack, so they are reported in a
+  // single sample.
+  std::optional<std::vector<void*>> stack;
+  MallocExtension::SnapshotHeapDelta(&cursor).Iterate(
+      [&](const Profile::Sample& s) {
+        if (s.count < kNumAllocations || s.sum < kNumAllocations * kSize) {
+          return;
+        }
+        EXPECT_FALSE(stack.has_value());
+        stack.emplace(s.stack, s.stack + s.depth);
+      });
+  ASSERT_TRUE(stack.has_value());
+  EXPECT_GT(cursor, start);
+
+  for (int i = 0; i < kNumAllocations; i++) {
+    ::operator delete(allocations[i]);
+  }
+
+  // The stack is reported again, now with nothing live.
+  bool found = false;
+  MallocExtension::SnapshotHeapDelta(&cursor).Iterate(
+      [&](const Profile::Sample& s) {
+        if (std::vector<void*>(s.stack, s.stack + s.depth) != *stack) return;
+        found = true;
+        EXPECT_EQ(s.count, 0);
+        EXPECT_EQ(s.sum, 0);
+      });
+  EXPECT_TRUE(found);
+
+  // A fresh cursor only reports stacks with live allocations.
+  uint64_t fresh = 0;
+  MallocExtension::SnapshotHeapDelta(&fresh).Iterate(
+      [&](const Profile::Sample& s) {
+        EXPECT_GT(s.count, 0);
+        EXPECT_NE(std::vector<void*>(s.stack, s.stack + s.depth), *stack);
+      });
+}
+
 TEST(HeapProfilingTest, AllocateDifferentSizes) {
   const int num_allocations = 1000;
   const size_t requested_size1 = (1 << 19) + 1;
@@ -0,0 +1,136 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/huge_page_layout.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/numeric/bits.h"
+#include "absl/strings/string_view.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/testing/testutil.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+struct Layout {
+  HugePageLayoutHeader header;
+  // The cells of each filler and region hugepage, by first page.
+  std::map<uint64_t, std::vector<HugePageLayoutCell>> hugepages;
+  size_t cache_hugepages = 0;
+};
+
+Layout ReadLayout() {
+  std::string dump;
+  MallocExtension::WriteHugePageLayout([&](absl::string_view chunk) {
+    dump.append(chunk.data(), chunk.size());
+  });
+
+  Layout layout;
+  HugePageLayoutReader reader;
+  EXPECT_TRUE(reader.Init(dump));
+  layout.header = reader.header();
+
+  // Within each heap and source, records are in address order.
+  std::map<std::pair<uint8_t, HugePageLayoutSource>, uint64_t> last;
+  HugePageLayoutRecord record;
+  std::vector<HugePageLayoutCell> cells;
+  while (reader.Next(&record, &cells)) {
+    auto [it, inserted] = last.insert({{record.tag, record.source}, 0});
+    EXPECT_TRUE(inserted || it->second < record.first_page);
+    it->second = record.first_page;
+
+    if (record.source == HugePageLayoutSource::kCache) {
+      layout.cache_hugepages += record.num_hugepages;
+    } else {
+      EXPECT_EQ(record.num_hugepages, 1);
+      layout.hugepages[record.first_page] = cells;
+    }
+  }
+  EXPECT_TRUE(reader.ok());
+  return layout;
+}
+
+bool IsHPAA() {
+  return MallocExtension::GetNumericProperty("tcmalloc.page_algorithm") == 1;
+}
+
+// Returns the cell of the page holding <ptr>, if the dump covers it.
+std::optional<HugePageLayoutCell> FindCell(const Layout& layout,
+                                           const void* ptr) {
+  const uint64_t page =
+      reinterpret_cast<uintptr_t>(ptr) / layout.header.page_size;
+  auto it = layout.hugepages.upper_bound(page);
+  if (it == layout.hugepages.begin()) return std::nullopt;
+  --it;
+  if (page - it->first >= it->second.size()) return std::nullopt;
+  return it->second[page - it->first];
+}
+
+TEST(HugePageLayoutTest, Header) {
+  const Layout layout = ReadLayout();
+  EXPECT_TRUE(absl::has_single_bit(layout.header.page_size));
+  EXPECT_TRUE(absl::has_single_bit(layout.header.pages_per_hugepage));
+  if (!IsHPAA()) {
+    EXPECT_TRUE(layout.hugepages.empty());
+    EXPECT_EQ(layout.cache_hugepages, 0);
+  }
+}
+
+TEST(HugePageLayoutTest, UsedPages) {
+  if (!IsHPAA()) {
+    GTEST_SKIP() << "Only the hugepage-aware allocator has a layout";
+  }
+  // Sampled objects get spans of their own, without a size class.
+  ScopedNeverSample never_sample;
+
+  constexpr size_t kSmall = 64;
+  std::vector<void*> small;
+  for (int i = 0; i < 10000; ++i) {
+    small.push_back(::operator new(kSmall));
+  }
+  // Larger than any size class.
+  void* large = ::operator new(1 << 20);
+
+  const Layout layout = ReadLayout();
+  EXPECT_FALSE(layout.hugepages.empty());
+  for (void* ptr : small) {
+    std::optional<HugePageLayoutCell> cell = FindCell(layout, ptr);
+    ASSERT_TRUE(cell.has_value()) << ptr;
+    EXPECT_EQ(HugePageLayoutCellState(*cell), HugePageLayoutPageState::kUsed);
+    EXPECT_NE(HugePageLayoutCellSizeClass(*cell), 0);
+  }
+  std::optional<HugePageLayoutCell> cell = FindCell(layout, large);
+  ASSERT_TRUE(cell.has_value()) << large;
+  EXPECT_EQ(HugePageLayoutCellState(*cell), HugePageLayoutPageState::kUsed);
+  EXPECT_EQ(HugePageLayoutCellSizeClass(*cell), 0);
+
+  ::operator delete(large);
+  for (void* ptr : small) {
+    ::operator delete(ptr);
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,161 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Renders a dump written by MallocExtension::WriteHugePageLayout() as text:
+//
+//   huge_page_layout_viewer <dump>
+//
+// Each hugepage of the filler and of regions is a line of one character per
+// page: '.' for free, '_' for released, '#' for pages of large allocations and
+// a letter or digit, cycling with the size class, for pages of small object
+// spans.  Runs of cached hugepages are a line each.  A summary of page counts
+// per heap and source follows.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tcmalloc/huge_page_layout.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+const char* SourceName(HugePageLayoutSource source) {
+  switch (source) {
+    case HugePageLayoutSource::kFiller:
+      return "filler";
+    case HugePageLayoutSource::kRegion:
+      return "region";
+    case HugePageLayoutSource::kCache:
+      return "cache";
+  }
+  return "unknown";
+}
+
+char CellChar(HugePageLayoutCell cell) {
+  static constexpr char kSizeClassChars[] =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  switch (HugePageLayoutCellState(cell)) {
+    case HugePageLayoutPageState::kFree:
+      return '.';
+    case HugePageLayoutPageState::kReleased:
+      return '_';
+    case HugePageLayoutPageState::kUsed:
+      break;
+  }
+  const size_t size_class = HugePageLayoutCellSizeClass(cell);
+  if (size_class == 0) return '#';
+  return kSizeClassChars[(size_class - 1) % (sizeof(kSizeClassChars) - 1)];
+}
+
+struct Summary {
+  size_t hugepages = 0;
+  size_t used = 0;
+  size_t free = 0;
+  size_t released = 0;
+};
+
+int Run(const char* path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return 1;
+  }
+  const std::string dump((std::istreambuf_iterator<char>(file)),
+                         std::istreambuf_iterator<char>());
+
+  HugePageLayoutReader reader;
+  if (!reader.Init(dump)) {
+    fprintf(stderr, "%s is not a hugepage layout dump\n", path);
+    return 1;
+  }
+  const HugePageLayoutHeader& header = reader.header();
+  printf("page size %u, %u pages per hugepage\n", header.page_size,
+         header.pages_per_hugepage);
+
+  std::map<std::pair<uint8_t, HugePageLayoutSource>, Summary> summaries;
+  HugePageLayoutRecord record;
+  std::vector<HugePageLayoutCell> cells;
+  std::string line;
+  while (reader.Next(&record, &cells)) {
+    Summary& summary = summaries[{record.tag, record.source}];
+    summary.hugepages += record.num_hugepages;
+    const uint64_t address = record.first_page * header.page_size;
+    if (record.source == HugePageLayoutSource::kCache) {
+      summary.free += record.num_hugepages * header.pages_per_hugepage;
+      printf("%#014llx tag %u cache %u hugepages%s\n",
+             static_cast<unsigned long long>(address), record.tag,
+             record.num_hugepages,
+             record.flags & kHugePageLayoutPendingRelease
+                 ? " (pending release)"
+                 : "");
+      continue;
+    }
+
+    line.clear();
+    for (HugePageLayoutCell cell : cells) {
+      switch (HugePageLayoutCellState(cell)) {
+        case HugePageLayoutPageState::kFree:
+          ++summary.free;
+          break;
+        case HugePageLayoutPageState::kReleased:
+          ++summary.released;
+          break;
+        case HugePageLayoutPageState::kUsed:
+          ++summary.used;
+          break;
+      }
+      line.push_back(CellChar(cell));
+    }
+    printf("%#014llx tag %u %s%s%s %s\n",
+           static_cast<unsigned long long>(address), record.tag,
+           SourceName(record.source),
+           record.flags & kHugePageLayoutDonated ? " donated" : "",
+           record.flags & kHugePageLayoutUnbacked ? " unbacked" : "",
+           line.c_str());
+  }
+  if (!reader.ok()) {
+    fprintf(stderr, "%s is truncated or malformed\n", path);
+  }
+
+  printf("\n");
+  for (const auto& [key, summary] : summaries) {
+    printf(
+        "tag %u %-6s: %8zu hugepages, %10zu used, %10zu free, "
+        "%10zu released pages\n",
+        key.first, SourceName(key.second), summary.hugepages, summary.used,
+        summary.free, summary.released);
+  }
+  return reader.ok() ? 0 : 1;
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <dump>\n", argv[0]);
+    return 2;
+  }
+  return tcmalloc::tcmalloc_internal::Run(argv[1]);
+}
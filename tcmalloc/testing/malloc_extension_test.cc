@@ -17,17 +17,27 @@
 #include "tcmalloc/malloc_extension.h"
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <map>
 #include <optional>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/notification.h"
 #include "absl/time/time.h"
 #include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/internal/logging.h"
 #include "tcmalloc/static_vars.h"
+#include "tcmalloc/testing/testutil.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -84,6 +94,17 @@ TEST(MallocExtension, SkipSubreleaseIntervals) {
             absl::ZeroDuration());
 }
 
+TEST(MallocExtension, PrefaultHugePages) {
+  EXPECT_EQ(MallocExtension::GetPrefaultHugePages(), 0);
+
+  MallocExtension::SetPrefaultHugePages(16);
+  EXPECT_EQ(MallocExtension::GetPrefaultHugePages(), 16);
+
+  // Negative values disable prefaulting.
+  MallocExtension::SetPrefaultHugePages(-1);
+  EXPECT_EQ(MallocExtension::GetPrefaultHugePages(), 0);
+}
+
 TEST(MallocExtension, Properties) {
   // Verify that every property under GetProperties also works with
   // GetNumericProperty.
@@ -107,6 +128,8 @@ TEST(MallocExtension, Properties) {
       "generic.physical_memory_used",
       "generic.realized_fragmentation",
       "generic.virtual_memory_used",
+      "tcmalloc.allocator_cpu_ns",
+      "tcmalloc.allocator_cpu_ns.cpu_cache_refill",
       "tcmalloc.central_cache_free",
       "tcmalloc.cpu_free",
       "tcmalloc.current_total_thread_cache_bytes",
@@ -114,6 +137,7 @@ TEST(MallocExtension, Properties) {
       "tcmalloc.external_fragmentation_bytes",
       "tcmalloc.hard_limit_hits",
       "tcmalloc.hard_usage_limit_bytes",
+      "tcmalloc.live_objects.8",
       "tcmalloc.local_bytes",
       "tcmalloc.max_total_thread_cache_bytes",
       "tcmalloc.metadata_bytes",
@@ -125,6 +149,7 @@ TEST(MallocExtension, Properties) {
       "tcmalloc.per_cpu_caches_active",
       "tcmalloc.required_bytes",
       "tcmalloc.sampled_internal_fragmentation",
+      "tcmalloc.shared_heap_base",
       "tcmalloc.sharded_transfer_cache_free",
       "tcmalloc.slack_bytes",
       "tcmalloc.soft_limit_hits",
@@ -145,6 +170,239 @@ TEST(MallocExtension, Properties) {
   }
 }
 
+TEST(MallocExtension, LiveObjects) {
+  const size_t size = MallocExtension::GetEstimatedAllocatedSize(1000);
+  const std::string property = absl::StrCat("tcmalloc.live_objects.", size);
+  auto live = [&]() {
+    std::optional<size_t> value = MallocExtension::GetNumericProperty(property);
+    CHECK_CONDITION(value.has_value());
+    return *value;
+  };
+
+  constexpr size_t kCount = 10000;
+  std::vector<void*> ptrs;
+  ptrs.reserve(kCount);
+  const size_t before = live();
+  for (size_t i = 0; i < kCount; ++i) {
+    ptrs.push_back(::operator new(size));
+  }
+  const size_t during = live();
+  // Allow for the test framework allocating objects of the same size.
+  EXPECT_GE(during, before + kCount * 9 / 10);
+  EXPECT_LE(during, before + kCount * 11 / 10);
+
+  for (void* ptr : ptrs) {
+    ::operator delete(ptr);
+  }
+  // Freed objects held by the caches are not live.
+  EXPECT_LE(live(), before + kCount / 10);
+
+  EXPECT_EQ(MallocExtension::GetNumericProperty("tcmalloc.live_objects.0"),
+            std::nullopt);
+  EXPECT_EQ(MallocExtension::GetNumericProperty("tcmalloc.live_objects.x"),
+            std::nullopt);
+}
+
+TEST(MallocExtension, AllocateAndFreeBatch) {
+  constexpr size_t kSizes[] = {0, 8, 100, 4096, 300000};
+  constexpr size_t kCount = 200;
+  std::vector<void*> batch(kCount, nullptr);
+
+  for (size_t size : kSizes) {
+    for (bool sized_free : {false, true}) {
+      ASSERT_EQ(MallocExtension::AllocateBatch(size, kCount, batch.data()),
+                kCount);
+      for (void* ptr : batch) {
+        ASSERT_NE(ptr, nullptr);
+        EXPECT_THAT(MallocExtension::GetAllocatedSize(ptr),
+                    testing::Optional(testing::Ge(size)));
+        memset(ptr, 0xef, size);
+      }
+      MallocExtension::FreeBatch(batch.data(), kCount, sized_free ? size : 0);
+    }
+  }
+
+  EXPECT_EQ(MallocExtension::AllocateBatch(64, 0, batch.data()), 0);
+  MallocExtension::FreeBatch(batch.data(), 0, 64);
+}
+
+TEST(MallocExtension, FreeBatchOfMixedSizes) {
+  // Mix small objects of many size classes with nullptr and page-level
+  // objects, spanning several prefetch windows.
+  constexpr size_t kSizes[] = {8, 24, 100, 1000, 4096, 40000, 300000};
+  constexpr size_t kCount = 1000;
+  std::vector<void*> batch;
+  for (size_t i = 0; i < kCount; ++i) {
+    if (i % 97 == 0) {
+      batch.push_back(nullptr);
+      continue;
+    }
+    const size_t size = kSizes[i % (sizeof(kSizes) / sizeof(kSizes[0]))];
+    void* ptr = malloc(size);
+    ASSERT_NE(ptr, nullptr);
+    memset(ptr, 0xef, size);
+    batch.push_back(ptr);
+  }
+  MallocExtension::FreeBatch(batch.data(), batch.size(), 0);
+}
+
+TEST(MallocExtension, Prewarm) {
+  constexpr size_t kBytes = 16 << 20;
+  const MallocExtension::PrewarmSize kSizes[] = {
+      {16, 1}, {200, 2}, {5000, 1}, {300000, 1}, {0, 1}, {64, 0}};
+  size_t max_rounding = 0;
+  for (const auto& [size, weight] : kSizes) max_rounding += size;
+
+  const size_t warmed = MallocExtension::Prewarm(kBytes, kSizes);
+  EXPECT_LE(warmed, kBytes);
+  EXPECT_GE(warmed, kBytes - max_rounding);
+
+  // Without a size distribution, whole hugepages are warmed.
+  EXPECT_GT(MallocExtension::Prewarm(kBytes, {}), 0);
+  EXPECT_LE(MallocExtension::Prewarm(kBytes, {}), kBytes);
+  EXPECT_EQ(MallocExtension::Prewarm(0, kSizes), 0);
+}
+
+TEST(MallocExtension, ThreadAllocatedBytes) {
+  // The counters count a guarded sample at its size class's size, rather than
+  // the requested size that GetAllocatedSize() reports.
+  ScopedGuardedSamplingRate gs(-1);
+  constexpr size_t kSizes[] = {8, 100, 4096, 40000, 300000};
+  constexpr size_t kCount = 100;
+  std::vector<void*> objects;
+  objects.reserve(kCount * (sizeof(kSizes) / sizeof(kSizes[0])));
+
+  const MallocExtension::ThreadAllocatedBytes before =
+      MallocExtension::GetThreadAllocatedBytes();
+  size_t expected = 0;
+  for (size_t size : kSizes) {
+    for (size_t i = 0; i < kCount; ++i) {
+      void* ptr = ::operator new(size);
+      expected += *MallocExtension::GetAllocatedSize(ptr);
+      objects.push_back(ptr);
+    }
+  }
+  const MallocExtension::ThreadAllocatedBytes allocated =
+      MallocExtension::GetThreadAllocatedBytes();
+  for (void* ptr : objects) {
+    ::operator delete(ptr);
+  }
+  const MallocExtension::ThreadAllocatedBytes freed =
+      MallocExtension::GetThreadAllocatedBytes();
+
+  EXPECT_EQ(allocated.allocated - before.allocated, expected);
+  EXPECT_EQ(allocated.freed, before.freed);
+  EXPECT_EQ(freed.allocated, allocated.allocated);
+  EXPECT_EQ(freed.freed - allocated.freed, expected);
+
+  // Another thread's allocations are its own.
+  absl::Notification allocating, done;
+  std::thread t([&] {
+    const MallocExtension::ThreadAllocatedBytes start =
+        MallocExtension::GetThreadAllocatedBytes();
+    allocating.Notify();
+    ::operator delete(::operator new(1000));
+    const MallocExtension::ThreadAllocatedBytes end =
+        MallocExtension::GetThreadAllocatedBytes();
+    EXPECT_GE(end.allocated - start.allocated, 1000u);
+    EXPECT_GE(end.freed - start.freed, 1000u);
+    done.Notify();
+  });
+  allocating.WaitForNotification();
+  const MallocExtension::ThreadAllocatedBytes mine =
+      MallocExtension::GetThreadAllocatedBytes();
+  done.WaitForNotification();
+  const MallocExtension::ThreadAllocatedBytes still_mine =
+      MallocExtension::GetThreadAllocatedBytes();
+  t.join();
+  EXPECT_EQ(still_mine.allocated, mine.allocated);
+  EXPECT_EQ(still_mine.freed, mine.freed);
+}
+
+TEST(MallocExtension, ThreadAllocatedBytesOfSamples) {
+  // Sampled objects, guarded or not, are freed at the size they were counted
+  // at when allocated.
+  ScopedAlwaysSample always_sample;
+  for (size_t size : {8, 100, 4096, 40000, 300000}) {
+    SCOPED_TRACE(size);
+    const MallocExtension::ThreadAllocatedBytes before =
+        MallocExtension::GetThreadAllocatedBytes();
+    ::operator delete(::operator new(size));
+    ::operator delete(tcmalloc_size_returning_operator_new(size).p);
+    const MallocExtension::ThreadAllocatedBytes after =
+        MallocExtension::GetThreadAllocatedBytes();
+    EXPECT_GE(after.allocated - before.allocated, 2 * size);
+    EXPECT_EQ(after.freed - before.freed, after.allocated - before.allocated);
+  }
+}
+
+template <size_t N>
+void AllocateAndFreeFixed() {
+  constexpr int kCount = 100;
+  std::vector<void*> objects;
+  for (int i = 0; i < kCount; ++i) {
+    void* ptr = AllocateFixed<N>();
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_THAT(MallocExtension::GetAllocatedSize(ptr),
+                testing::Optional(testing::Ge(N)));
+    memset(ptr, 0xef, N);
+    objects.push_back(ptr);
+  }
+  // Objects from AllocateFixed may also be freed by operator delete.
+  ::operator delete(objects.back());
+  objects.pop_back();
+  for (void* ptr : objects) {
+    DeallocateFixed<N>(ptr);
+  }
+  DeallocateFixed<N>(nullptr);
+}
+
+TEST(MallocExtension, AllocateAndFreeFixed) {
+  AllocateAndFreeFixed<1>();
+  AllocateAndFreeFixed<8>();
+  AllocateAndFreeFixed<100>();
+  AllocateAndFreeFixed<1025>();
+  AllocateAndFreeFixed<4096>();
+  AllocateAndFreeFixed<300000>();
+}
+
+TEST(MallocExtension, Region) {
+  Region region;
+  EXPECT_EQ(region.allocated_bytes(), 0);
+  EXPECT_EQ(region.reserved_bytes(), 0);
+
+  size_t requested = 0;
+  for (size_t alignment : {1, 8, 16, 64, 4096}) {
+    for (int i = 0; i < 1000; ++i) {
+      const size_t size = 1 + i % 200;
+      void* ptr = region.Allocate(size, alignment);
+      ASSERT_NE(ptr, nullptr);
+      EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % alignment, 0);
+      memset(ptr, 0xef, size);
+      requested += size;
+    }
+  }
+
+  // Larger than a chunk: served from a dedicated chunk.
+  const size_t kLarge = 3 * Region::kDefaultChunkSize;
+  void* large = region.Allocate(kLarge);
+  ASSERT_NE(large, nullptr);
+  memset(large, 0xef, kLarge);
+  requested += kLarge;
+
+  EXPECT_EQ(region.allocated_bytes(), requested);
+  EXPECT_GE(region.reserved_bytes(), requested);
+  // Chunks are whole hugepages when backed by TCMalloc.
+  EXPECT_EQ(region.reserved_bytes() % kHugePageSize, 0);
+
+  region.Reset();
+  EXPECT_EQ(region.allocated_bytes(), 0);
+  EXPECT_EQ(region.reserved_bytes(), 0);
+
+  // The region is usable again after Reset.
+  EXPECT_NE(region.Allocate(64), nullptr);
+}
+
 // Test that when we resize the slab repeatedly, the metadata metric is
 // positive.
 TEST(MallocExtension, DynamicSlabMallocMetadata) {
@@ -20,7 +20,10 @@
 #include "tcmalloc/malloc_tracing_extension.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
+#include <utility>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "absl/status/status.h"
@@ -29,6 +32,8 @@
 #ifndef MALLOC_TRACING_EXTENSION_NOT_SUPPORTED
 #include "gmock/gmock.h"
 #include "absl/cleanup/cleanup.h"
+#include "absl/container/flat_hash_map.h"
+#include "tcmalloc/testing/testutil.h"
 #endif
 
 namespace {
@@ -44,6 +49,12 @@ TEST(MallocTracingExtension, GetAllocatedAddressRanges) {
   ASSERT_FALSE(allocated.ok());
   EXPECT_EQ(allocated.status().code(), absl::StatusCode::kUnimplemented);
 }
+
+TEST(MallocTracingExtension, ForEachLiveObject) {
+  absl::Status status = tcmalloc::malloc_tracing_extension::ForEachLiveObject(
+      [](const tcmalloc::malloc_tracing_extension::LiveObject&) {});
+  EXPECT_EQ(status.code(), absl::StatusCode::kUnimplemented);
+}
 #else
 
 using ::tcmalloc::malloc_tracing_extension::AllocatedAddressRanges;
@@ -107,6 +118,58 @@ TEST(MallocTracingExtension, GetAllocatedAddressRanges) {
     }
   }
 }
+
+TEST(MallocTracingExtension, ForEachLiveObject) {
+  using ::tcmalloc::malloc_tracing_extension::ForEachLiveObject;
+  using ::tcmalloc::malloc_tracing_extension::LiveObject;
+
+  // Guarded objects have no spans of their own.
+  tcmalloc::ScopedGuardedSamplingRate gs(-1);
+
+  // Objects of a few size classes, and a large one.
+  const size_t kSizes[] = {8, 64, 1000, 1000000};
+  std::vector<std::pair<void*, size_t>> objects;
+  for (size_t size : kSizes) {
+    for (int i = 0; i < 100; ++i) {
+      objects.push_back({::operator new(size), size});
+    }
+  }
+  absl::Cleanup cleanup = [&objects] {
+    for (auto [ptr, size] : objects) ::operator delete(ptr);
+  };
+
+  // Each object is reported by exactly one of the partitions.  Reports are
+  // not made into allocations, so that the callback does not change what it
+  // is walking.
+  constexpr int kPartitions = 3;
+  std::vector<LiveObject> reported;
+  reported.reserve(1 << 20);
+  for (int partition = 0; partition < kPartitions; ++partition) {
+    ASSERT_TRUE(ForEachLiveObject(
+                    [&](const LiveObject& object) {
+                      if (reported.size() < reported.capacity()) {
+                        reported.push_back(object);
+                      }
+                    },
+                    partition, kPartitions)
+                    .ok());
+  }
+  ASSERT_LT(reported.size(), reported.capacity());
+
+  absl::flat_hash_map<uintptr_t, size_t> sizes;
+  for (const LiveObject& object : reported) {
+    EXPECT_TRUE(sizes.insert({object.start_addr, object.size}).second)
+        << "reported twice: " << object.start_addr;
+  }
+  for (auto [ptr, size] : objects) {
+    auto it = sizes.find(reinterpret_cast<uintptr_t>(ptr));
+    ASSERT_NE(it, sizes.end()) << "not reported: " << size << " bytes";
+    EXPECT_GE(it->second, size);
+  }
+
+  EXPECT_EQ(ForEachLiveObject([](const LiveObject&) {}, 1, 1).code(),
+            absl::StatusCode::kInvalidArgument);
+}
 #endif
 
 }  // namespace
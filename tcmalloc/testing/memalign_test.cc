@@ -238,6 +238,21 @@ TEST(MemalignTest, PosixMemalign) {
   }
 }
 
+TEST(MemalignTest, PosixMemalignHugepages) {
+  // Whole hugepages at hugepage alignment are served exactly, with no slack.
+  constexpr size_t kHugepage = 2 << 20;
+  for (size_t n = 1; n <= 4; ++n) {
+    const size_t s = n * kHugepage;
+    void* ptr;
+    ASSERT_EQ(0, posix_memalign(&ptr, kHugepage, s));
+    CheckAlignment(ptr, kHugepage);
+    EXPECT_EQ(malloc_usable_size(ptr), s);
+    Fill(ptr, s, 'x');
+    ASSERT_TRUE(Valid(ptr, s, 'x'));
+    free(ptr);
+  }
+}
+
 TEST(MemalignTest, PosixMemalignFailure) {
   void* ptr;
   ASSERT_EQ(posix_memalign(&ptr, 0, 1), EINVAL);
@@ -0,0 +1,196 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Measures the cost of allocating on one NUMA partition and freeing on
+// another.  The benchmark thread, pinned to a cpu of one partition, allocates
+// objects and passes them through a bounded queue to a consumer thread pinned
+// to a cpu of another partition, which frees them.
+//
+// Besides throughput, each run reports:
+//   remote_ratio: the fraction of sampled allocations backed by memory of a
+//     partition other than the producer's, found with move_pages.
+//   rss_growth_MiB: the growth of tcmalloc's physical memory use over the run.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/affinity.h"
+#include "tcmalloc/internal/numa.h"
+#include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/static_vars.h"
+
+namespace tcmalloc::tcmalloc_internal {
+namespace {
+
+// A single-producer, single-consumer queue of objects.
+class ObjectQueue {
+ public:
+  static constexpr size_t kCapacity = 4096;
+
+  void Push(void* ptr) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    while (tail - head_.load(std::memory_order_acquire) == kCapacity) {
+      std::this_thread::yield();
+    }
+    objects_[tail % kCapacity] = ptr;
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  // Returns nullptr once the queue is empty and closed.
+  void* Pop() {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    while (head == tail_.load(std::memory_order_acquire)) {
+      if (closed_.load(std::memory_order_acquire) &&
+          head == tail_.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      std::this_thread::yield();
+    }
+    void* ptr = objects_[head % kCapacity];
+    head_.store(head + 1, std::memory_order_release);
+    return ptr;
+  }
+
+  void Close() { closed_.store(true, std::memory_order_release); }
+
+ private:
+  void* objects_[kCapacity];
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> head_{0};
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> tail_{0};
+  std::atomic<bool> closed_{false};
+};
+
+// Returns a cpu we may run on in each of two different NUMA partitions, or
+// nullopt if there are no such cpus.
+std::optional<std::pair<int, int>> CpusInDifferentPartitions() {
+  const auto& topology = tc_globals.numa_topology();
+  if (!topology.numa_aware()) return std::nullopt;
+  const std::vector<int> allowed = AllowedCpus();
+  for (int a : allowed) {
+    for (int b : allowed) {
+      if (topology.GetCpuPartition(a) != topology.GetCpuPartition(b)) {
+        return std::make_pair(a, b);
+      }
+    }
+  }
+  return std::nullopt;
+}
+
+// Looks up the nodes backing <pages>, adding the number found to *backed and
+// the number of those outside <partition> to *remote.  Pages that have been
+// unmapped or released since they were sampled are skipped.
+void CountRemote(std::vector<void*>& pages, size_t partition, size_t* backed,
+                 size_t* remote) {
+  std::vector<int> status(pages.size(), -1);
+  if (syscall(__NR_move_pages, /*pid=*/0, pages.size(), pages.data(),
+              /*nodes=*/nullptr, status.data(), /*flags=*/0) != 0) {
+    return;
+  }
+  for (int node : status) {
+    if (node < 0) continue;
+    ++*backed;
+    if (NodeToPartition(node, kNumaPartitions) != partition) ++*remote;
+  }
+}
+
+size_t PhysicalMemoryUsed() {
+  return MallocExtension::GetNumericProperty("generic.physical_memory_used")
+      .value_or(0);
+}
+
+void BM_CrossNumaProducerConsumer(benchmark::State& state) {
+  const std::optional<std::pair<int, int>> cpus = CpusInDifferentPartitions();
+  if (!cpus.has_value()) {
+    state.SkipWithError("Needs NUMA awareness and cpus on two partitions");
+    return;
+  }
+  const auto [producer_cpu, consumer_cpu] = *cpus;
+  const size_t size = state.range(0);
+  const size_t producer_partition =
+      tc_globals.numa_topology().GetCpuPartition(producer_cpu);
+
+  ObjectQueue queue;
+  std::thread consumer([&] {
+    ScopedAffinityMask mask(consumer_cpu);
+    while (void* ptr = queue.Pop()) {
+      ::operator delete(ptr, size);
+    }
+  });
+  ScopedAffinityMask mask(producer_cpu);
+
+  // Every kSampleEvery-th allocation has the page holding its first byte
+  // checked, kSampleBatch at a time.
+  constexpr size_t kSampleEvery = 64;
+  constexpr size_t kSampleBatch = 256;
+  static const uintptr_t page_mask = ~(uintptr_t{GetPageSize()} - 1);
+  std::vector<void*> sampled;
+  sampled.reserve(kSampleBatch);
+  size_t samples = 0, remote = 0, n = 0;
+
+  const size_t rss_before = PhysicalMemoryUsed();
+  for (auto s : state) {
+    void* ptr = ::operator new(size);
+    // Touch the object, as the producer of a real message would, so that the
+    // page is backed where the producer runs.
+    memset(ptr, 0, 1);
+    if (ABSL_PREDICT_FALSE(++n % kSampleEvery == 0)) {
+      const uintptr_t page = reinterpret_cast<uintptr_t>(ptr) & page_mask;
+      sampled.push_back(reinterpret_cast<void*>(page));
+      if (sampled.size() == kSampleBatch) {
+        CountRemote(sampled, producer_partition, &samples, &remote);
+        sampled.clear();
+      }
+    }
+    queue.Push(ptr);
+  }
+  queue.Close();
+  consumer.join();
+  const size_t rss_after = PhysicalMemoryUsed();
+
+  if (mask.Tampered()) {
+    state.SkipWithError("Affinity changed during the run");
+    return;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * size);
+  state.counters["remote_ratio"] =
+      samples > 0 ? static_cast<double>(remote) / samples : 0.;
+  state.counters["rss_growth_MiB"] =
+      rss_after > rss_before ? (rss_after - rss_before) / 1048576. : 0.;
+}
+
+BENCHMARK(BM_CrossNumaProducerConsumer)
+    ->Arg(64)
+    ->Arg(1024)
+    ->Arg(32 << 10)
+    ->Arg(1 << 20)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace tcmalloc::tcmalloc_internal
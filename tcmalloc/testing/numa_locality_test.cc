@@ -128,12 +128,13 @@ class FakeNumaAwareRegionFactory final : public tcmalloc::AddressRegionFactory {
         ++found;
         // Ignore "special" hints, e.x. kInfrequentAllocation and
         // kInfrequentAccess.
-        if (hint != UsageHint::kNormalNumaAwareS0 &&
-            hint != UsageHint::kNormalNumaAwareS1) {
+        if (hint < UsageHint::kNormalNumaAwareS0 ||
+            hint > UsageHint::kNormalNumaAwareS7) {
           return;
         }
         const int hinted_partition =
-            hint == UsageHint::kNormalNumaAwareS1 ? 1 : 0;
+            static_cast<int>(hint) -
+            static_cast<int>(UsageHint::kNormalNumaAwareS0);
         EXPECT_EQ(expected_partition, hinted_partition);
         return;
       }
@@ -135,6 +135,9 @@ TEST(PeakHeapProfilingTest, PeakHeapTracking) {
   }
   EXPECT_GT(ProfileSize(ProfileType::kPeakHeap), peak_after_third);
   EXPECT_GT(PeakMemoryUsage(), peak_after_third);
+  // The new peak no longer holds the allocations freed since the last one.
+  EXPECT_LT(ProfileSize(ProfileType::kPeakHeap),
+            start_peak_sz + (456 << 20) + (20 << 20));
 
   ::operator delete(fourth);
   ::operator delete(fifth);
@@ -22,6 +22,7 @@
 #include <utility>
 
 #include "gtest/gtest.h"
+#include "tcmalloc/malloc_extension.h"
 
 namespace tcmalloc {
 namespace {
@@ -96,5 +97,89 @@ TEST(ReallocTest, AlignedAllocRealloc) {
   }
 }
 
+TEST(ReallocTest, GrowLargeAllocation) {
+  // Page-level allocations may be grown in place; the contents must be
+  // preserved either way.
+  constexpr size_t kStart = 300 << 10;
+  constexpr size_t kStep = 20 << 10;
+  constexpr size_t kEnd = kStart + 100 * kStep;
+
+  auto buf = static_cast<unsigned char*>(malloc(kStart));
+  Fill(buf, kStart);
+  for (size_t size = kStart + kStep; size <= kEnd; size += kStep) {
+    buf = static_cast<unsigned char*>(realloc(buf, size));
+    ASSERT_NE(buf, nullptr);
+    ExpectValid(buf, size - kStep);
+    Fill(buf, size);
+  }
+  ExpectValid(buf, kEnd);
+  free(buf);
+}
+
+TEST(ReallocTest, ShrinkLargeAllocation) {
+  // Page-level allocations may be shrunk in place, returning their tail
+  // pages; the contents must be preserved either way.
+  constexpr size_t kStart = 64 << 20;
+  constexpr size_t kEnd = 300 << 10;
+
+  auto buf = static_cast<unsigned char*>(malloc(kStart));
+  Fill(buf, kStart);
+  size_t size = kStart;
+  while (size > kEnd) {
+    size = std::max(kEnd, size / 8 * 5);
+    buf = static_cast<unsigned char*>(realloc(buf, size));
+    ASSERT_NE(buf, nullptr);
+    ExpectValid(buf, size);
+  }
+  free(buf);
+}
+
+TEST(ReallocTest, GrowHugeAllocation) {
+  // Allocations of whole hugepages may have their pages moved rather than
+  // copied.
+  constexpr size_t kStart = 4 << 20;
+  constexpr size_t kEnd = 64 << 20;
+
+  auto buf = static_cast<unsigned char*>(malloc(kStart));
+  Fill(buf, kStart);
+  for (size_t size = 2 * kStart; size <= kEnd; size *= 2) {
+    buf = static_cast<unsigned char*>(realloc(buf, size));
+    ASSERT_NE(buf, nullptr);
+    ExpectValid(buf, size / 2);
+    Fill(buf, size);
+  }
+  free(buf);
+}
+
+TEST(ReallocTest, TryResizeInPlace) {
+  // Objects of a size class report their class's capacity.
+  void* small = malloc(100);
+  const size_t capacity = *MallocExtension::GetAllocatedSize(small);
+  EXPECT_EQ(TryResizeInPlace(small, 1, 1), capacity);
+  EXPECT_EQ(TryResizeInPlace(small, capacity + 1, 2 * capacity), capacity);
+  free(small);
+
+  // Page-level allocations may grow or shrink, but never move.
+  constexpr size_t kStart = 1 << 20;
+  auto buf = static_cast<unsigned char*>(malloc(kStart));
+  Fill(buf, kStart);
+  size_t size = *MallocExtension::GetAllocatedSize(buf);
+  const size_t grown = TryResizeInPlace(buf, 2 * kStart, 4 * kStart);
+  if (grown >= 2 * kStart) {
+    EXPECT_LE(grown, 4 * kStart);
+    size = grown;
+  } else {
+    EXPECT_EQ(grown, size);
+  }
+  EXPECT_EQ(*MallocExtension::GetAllocatedSize(buf), size);
+  Fill(buf, size);
+
+  const size_t shrunk = TryResizeInPlace(buf, kStart / 4, kStart / 2);
+  EXPECT_GE(shrunk, kStart / 4);
+  EXPECT_EQ(*MallocExtension::GetAllocatedSize(buf), shrunk);
+  ExpectValid(buf, std::min(shrunk, size));
+  free(buf);
+}
+
 }  // namespace
 }  // namespace tcmalloc
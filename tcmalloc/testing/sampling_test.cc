@@ -23,7 +23,9 @@
 
 #include <new>
 #include <optional>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "benchmark/benchmark.h"
@@ -36,6 +38,7 @@
 #include "absl/random/random.h"
 #include "absl/types/optional.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/parameter_accessors.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/testing/testutil.h"
 
@@ -137,6 +140,61 @@ INSTANTIATE_TEST_SUITE_P(SampleParameters, SamplingTest,
                          testing::Values(0, 100000),
                          testing::PrintToStringParamName());
 
+// Allocates from one of kRareSites distinct allocation sites, told apart by
+// their stack depth.
+ABSL_ATTRIBUTE_NOINLINE ABSL_ATTRIBUTE_NO_TAIL_CALL static void* RareSite(
+    int site) {
+  void* p = site > 0 ? RareSite(site - 1) : malloc(2000);
+  benchmark::DoNotOptimize(p);
+  return p;
+}
+
+TEST(Sampling, SiteBoost) {
+  ScopedGuardedSamplingRate gs(-1);
+  ScopedProfileSamplingRate s(64 << 10);
+  const int64_t previous_boost =
+      TCMalloc_Internal_GetProfileSamplingSiteBoost();
+  TCMalloc_Internal_SetProfileSamplingSiteBoost(16);
+
+  // Use up the sampling interval drawn under the previous rate.
+  for (int i = 0; i < 64; ++i) {
+    free(malloc(1 << 20));
+  }
+
+  // Each rare site has a ~3% chance of being sampled without the boost, and
+  // ~39% with it.
+  constexpr int kRareSites = 32;
+  std::vector<void*> allocs;
+  for (int site = 0; site < kRareSites; ++site) {
+    allocs.push_back(RareSite(site));
+  }
+  // The frequent site is thinned to below its unboosted rate, with its
+  // weights scaled to match.
+  constexpr int kFrequent = 8000;
+  for (int i = 0; i < kFrequent; ++i) {
+    allocs.push_back(AllocateAllocate(false));
+  }
+
+  Profile profile = MallocExtension::SnapshotCurrent(ProfileType::kHeap);
+  TCMalloc_Internal_SetProfileSamplingSiteBoost(previous_boost);
+
+  std::set<int> rare_sites_sampled;
+  profile.Iterate([&](const Profile::Sample& e) {
+    if (StackMatches("RareSite", e.stack, e.depth)) {
+      rare_sites_sampled.insert(e.depth);
+    }
+  });
+  EXPECT_GE(rare_sites_sampled.size(), 5);
+  const size_t frequent_bytes =
+      CountMatchingBytes<true>("AllocateAllocate", std::move(profile));
+  EXPECT_LE(0.8 * kFrequent * 10000, frequent_bytes);
+  EXPECT_GE(1.2 * kFrequent * 10000, frequent_bytes);
+
+  for (void* p : allocs) {
+    free(p);
+  }
+}
+
 ABSL_ATTRIBUTE_NOINLINE static void* AllocateZeroByte() {
   void* p = ::operator new(0);
   ::benchmark::DoNotOptimize(p);
@@ -167,6 +225,71 @@ TEST(Sampling, AlwaysSampling) {
   }
 }
 
+TEST(Sampling, FramePointerUnwinding) {
+  ScopedGuardedSamplingRate gs(-1);
+  ScopedProfileSamplingRate s(1);
+  const bool previous = TCMalloc_Internal_GetFramePointerUnwinding();
+  TCMalloc_Internal_SetFramePointerUnwinding(true);
+
+  // Whichever unwinder is used, the samples are attributed to their caller.
+  static const size_t kIters = 1000;
+  std::vector<void*> allocs;
+  allocs.reserve(kIters);
+  for (int i = 0; i < kIters; ++i) {
+    allocs.push_back(AllocateZeroByte());
+  }
+  TCMalloc_Internal_SetFramePointerUnwinding(previous);
+  const absl::optional<size_t> alloc_size =
+      MallocExtension::GetAllocatedSize(allocs[0]);
+  ASSERT_THAT(alloc_size, testing::Ne(std::nullopt));
+
+  size_t bytes = CountMatchingBytes<false>(
+      "AllocateZeroByte", MallocExtension::SnapshotCurrent(ProfileType::kHeap));
+  EXPECT_EQ(*alloc_size * kIters, bytes);
+
+  for (void* p : allocs) {
+    ::operator delete(p);
+  }
+}
+
+TEST(Sampling, ProfileLabels) {
+  ScopedGuardedSamplingRate gs(-1);
+  ScopedProfileSamplingRate s(1);
+  static constexpr ProfileLabel kLabels[] = {{"rpc_method", "Search"},
+                                             {"tenant", "test"}};
+  constexpr size_t kSize = 123457;
+
+  void* labeled;
+  {
+    MallocExtension::ScopedProfileLabels l(kLabels);
+    EXPECT_EQ(MallocExtension::GetProfileLabels().data(), kLabels);
+    labeled = ::operator new(kSize);
+  }
+  EXPECT_TRUE(MallocExtension::GetProfileLabels().empty());
+  void* unlabeled = ::operator new(kSize);
+
+  int labeled_samples = 0, unlabeled_samples = 0;
+  MallocExtension::SnapshotCurrent(ProfileType::kHeap)
+      .Iterate([&](const Profile::Sample& e) {
+        if (e.requested_size != kSize) return;
+        if (e.labels.empty()) {
+          ++unlabeled_samples;
+          return;
+        }
+        ++labeled_samples;
+        ASSERT_EQ(e.labels.size(), 2);
+        EXPECT_STREQ(e.labels[0].key, "rpc_method");
+        EXPECT_STREQ(e.labels[0].value, "Search");
+        EXPECT_STREQ(e.labels[1].key, "tenant");
+        EXPECT_STREQ(e.labels[1].value, "test");
+      });
+  EXPECT_EQ(labeled_samples, 1);
+  EXPECT_EQ(unlabeled_samples, 1);
+
+  ::operator delete(labeled);
+  ::operator delete(unlabeled);
+}
+
 ABSL_ATTRIBUTE_NOINLINE static void* AllocateRandomBytes() {
   absl::BitGen rng;
   return ::operator new(absl::LogUniform<size_t>(rng, 1, 1 << 21));
@@ -0,0 +1,97 @@
+// Copyright 2026 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/internal/memory_tagging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/new_extension.h"
+#include "tcmalloc/static_vars.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr size_t kMaxSize = 4096;
+
+// Allocates small objects of many sizes and frees them with <free_fn>.
+// While size class tags are enabled, each pointer may carry the tag of a size
+// class large enough for it; otherwise, as in builds that have the tags
+// compiled in but could not turn them on, none carries any.
+template <typename FreeFn>
+void AllocateAndFree(FreeFn free_fn) {
+  std::vector<std::pair<void*, size_t>> objects;
+  for (int round = 0; round < 4; ++round) {
+    for (size_t size = 1; size <= kMaxSize; size += size / 8 + 1) {
+      void* ptr = ::operator new(size);
+      memset(ptr, 0x5a, size);
+      const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+      const uintptr_t mask = tc_globals.size_class_tag_mask();
+      EXPECT_EQ(addr & kSizeClassTagMask & ~mask, 0) << size;
+      if (const size_t tag = SizeClassTagOf(addr, mask); tag != 0) {
+        EXPECT_GE(tc_globals.sizemap().class_to_size(tag), size);
+      }
+      EXPECT_GE(MallocExtension::GetAllocatedSize(ptr), size);
+      objects.emplace_back(ptr, size);
+    }
+  }
+  for (auto [ptr, size] : objects) {
+    free_fn(ptr, size);
+  }
+}
+
+TEST(SizeClassTagsTest, UnsizedFree) {
+  AllocateAndFree([](void* ptr, size_t) { ::operator delete(ptr); });
+}
+
+TEST(SizeClassTagsTest, SizedFree) {
+  AllocateAndFree([](void* ptr, size_t size) { ::operator delete(ptr, size); });
+}
+
+// Allocations near a live object may come from its span rather than from the
+// per-CPU cache, and carry the tag of their size class all the same.
+TEST(SizeClassTagsTest, NearAllocations) {
+  const uintptr_t mask = tc_globals.size_class_tag_mask();
+  for (size_t size = 1; size <= kMaxSize; size += size / 8 + 1) {
+    void* parent = ::operator new(size);
+    std::vector<void*> children;
+    for (int i = 0; i < 16; ++i) {
+      void* ptr = ::operator new(size, near_t{parent});
+      memset(ptr, 0x5a, size);
+      const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+      EXPECT_EQ(addr & kSizeClassTagMask & ~mask, 0) << size;
+      EXPECT_EQ(SizeClassTagOf(addr, mask),
+                SizeClassTagOf(reinterpret_cast<uintptr_t>(parent), mask))
+          << size;
+      EXPECT_GE(MallocExtension::GetAllocatedSize(ptr), size);
+      children.push_back(ptr);
+    }
+    for (void* ptr : children) {
+      ::operator delete(ptr, size);
+    }
+    ::operator delete(parent, size);
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,192 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Measures what TCMalloc adds to a process's cold start.  Each iteration
+// spawns a fresh copy of this binary, so that TCMalloc starts from scratch
+// with cold cpu caches and TLBs, and waits for it to exit.  The child, from its
+// earliest static initializer, times its first kFirstAllocations allocations
+// of varied sizes, reads the one-time startup steps TCMalloc timed for itself
+// (Static::startup_timings()) and reports them over a pipe before exiting.
+//
+// Each run reports, in nanoseconds and averaged over the children:
+//   exec_to_exit: from spawning the child to reaping it.
+//   globals_init: Static::InitIfNecessary, including
+//     size_map_init: SizeMap::Init, and
+//     numa_init: NumaTopology::Init.
+//   cpu_cache_activate: CpuCache::Activate (0 if per-cpu caches are off).
+//   first_system_alloc: the first SystemAlloc.
+//   first_alloc: the child's first allocation.
+//   first_n_allocs: all of the child's first kFirstAllocations allocations.
+//   max_alloc: the slowest of them, in any child.
+//
+// The runtime may allocate before the child's initializer runs, in which case
+// TCMalloc is already initialized by the child's first allocation; its own
+// startup timings are recorded either way.  The benchmark does not drop the
+// page cache, so the binary itself is warm after the first iteration.
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/base/internal/cycleclock.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/static_vars.h"
+
+extern char** environ;
+
+namespace tcmalloc::tcmalloc_internal {
+namespace {
+
+// Names the pipe a child writes its StartupReport to.
+constexpr char kReportFdEnv[] = "TCMALLOC_STARTUP_LATENCY_REPORT_FD";
+
+constexpr int kFirstAllocations = 1000;
+
+// In nanoseconds.
+struct StartupReport {
+  double globals_init;
+  double size_map_init;
+  double numa_init;
+  double cpu_cache_activate;
+  double first_system_alloc;
+  double first_alloc;
+  double first_n_allocs;
+  double max_alloc;
+};
+
+// Sizes the way a starting program allocates: mostly small objects, with the
+// occasional buffer.
+size_t AllocationSize(int i) {
+  if (i % 100 == 99) return 256 << 10;
+  if (i % 10 == 9) return 4096;
+  return 8 << (i % 6);
+}
+
+// Runs in the child, before any other static initializer of this binary, and
+// never returns.
+void ReportStartup(int fd) {
+  const double ns_per_cycle =
+      1e9 / absl::base_internal::CycleClock::Frequency();
+  // No containers, so that only the timed allocations allocate.
+  static void* ptrs[kFirstAllocations];
+  int64_t first = 0, total = 0, slowest = 0;
+  for (int i = 0; i < kFirstAllocations; ++i) {
+    const int64_t start = absl::base_internal::CycleClock::Now();
+    ptrs[i] = ::operator new(AllocationSize(i));
+    const int64_t elapsed = absl::base_internal::CycleClock::Now() - start;
+    if (i == 0) first = elapsed;
+    total += elapsed;
+    slowest = std::max(slowest, elapsed);
+  }
+  for (void* ptr : ptrs) {
+    ::operator delete(ptr);
+  }
+
+  const StartupTimings& timings = tc_globals.startup_timings();
+  const StartupReport report = {
+      .globals_init = timings.globals_init * ns_per_cycle,
+      .size_map_init = timings.size_map_init * ns_per_cycle,
+      .numa_init = timings.numa_topology_init * ns_per_cycle,
+      .cpu_cache_activate = timings.cpu_cache_activate * ns_per_cycle,
+      .first_system_alloc = timings.first_system_alloc * ns_per_cycle,
+      .first_alloc = first * ns_per_cycle,
+      .first_n_allocs = total * ns_per_cycle,
+      .max_alloc = slowest * ns_per_cycle,
+  };
+  const bool written = write(fd, &report, sizeof(report)) == sizeof(report);
+  _exit(written ? 0 : 1);
+}
+
+__attribute__((constructor(101))) void MaybeReportStartup() {
+  if (const char* fd = getenv(kReportFdEnv)) {
+    ReportStartup(atoi(fd));
+  }
+}
+
+void BM_StartupLatency(benchmark::State& state) {
+  int fds[2];
+  CHECK_CONDITION(pipe2(fds, O_CLOEXEC) == 0);
+  // Only the write end is inherited.
+  CHECK_CONDITION(fcntl(fds[1], F_SETFD, 0) == 0);
+
+  std::vector<std::string> env = {absl::StrCat(kReportFdEnv, "=", fds[1])};
+  for (char** e = environ; *e != nullptr; ++e) {
+    if (strncmp(*e, kReportFdEnv, strlen(kReportFdEnv)) != 0) {
+      env.push_back(*e);
+    }
+  }
+  std::vector<char*> envp;
+  for (std::string& e : env) {
+    envp.push_back(e.data());
+  }
+  envp.push_back(nullptr);
+  char path[] = "/proc/self/exe";
+  char* argv[] = {path, nullptr};
+
+  StartupReport sum = {};
+  double exec_to_exit = 0;
+  for (auto s : state) {
+    const absl::Time start = absl::Now();
+    pid_t pid;
+    CHECK_CONDITION(posix_spawn(&pid, path, nullptr, nullptr, argv,
+                                envp.data()) == 0);
+    int status;
+    CHECK_CONDITION(waitpid(pid, &status, 0) == pid);
+    exec_to_exit += absl::ToDoubleNanoseconds(absl::Now() - start);
+    CHECK_CONDITION(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    StartupReport report;
+    CHECK_CONDITION(read(fds[0], &report, sizeof(report)) == sizeof(report));
+    sum.globals_init += report.globals_init;
+    sum.size_map_init += report.size_map_init;
+    sum.numa_init += report.numa_init;
+    sum.cpu_cache_activate += report.cpu_cache_activate;
+    sum.first_system_alloc += report.first_system_alloc;
+    sum.first_alloc += report.first_alloc;
+    sum.first_n_allocs += report.first_n_allocs;
+    sum.max_alloc = std::max(sum.max_alloc, report.max_alloc);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  const double n = state.iterations();
+  state.counters["exec_to_exit"] = exec_to_exit / n;
+  state.counters["globals_init"] = sum.globals_init / n;
+  state.counters["size_map_init"] = sum.size_map_init / n;
+  state.counters["numa_init"] = sum.numa_init / n;
+  state.counters["cpu_cache_activate"] = sum.cpu_cache_activate / n;
+  state.counters["first_system_alloc"] = sum.first_system_alloc / n;
+  state.counters["first_alloc"] = sum.first_alloc / n;
+  state.counters["first_n_allocs"] = sum.first_n_allocs / n;
+  state.counters["max_alloc"] = sum.max_alloc;
+}
+
+BENCHMARK(BM_StartupLatency)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+}  // namespace
+}  // namespace tcmalloc::tcmalloc_internal
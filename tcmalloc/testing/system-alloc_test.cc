@@ -14,24 +14,34 @@
 
 #include "tcmalloc/system-alloc.h"
 
+#include <linux/mempolicy.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <cstring>
+#include <iterator>
 #include <limits>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "benchmark/benchmark.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/strings/str_format.h"
+#include "absl/strings/string_view.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/numa.h"
+#include "tcmalloc/internal/page_size.h"
 #include "tcmalloc/internal/proc_maps.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/new_extension.h"
 
 #ifndef PR_SET_VMA
 #define PR_SET_VMA 0x53564d41
@@ -122,6 +132,192 @@ TEST_F(MmapAlignedTest, LargeSizeSmallAlignment) {
   MmapAndCheck(uintptr_t{1} << kTagShift, kPageSize);
 }
 
+TEST(MmapAligned, NumaPartitionTags) {
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    SCOPED_TRACE(partition);
+    const MemoryTag tag = NumaNormalTag(partition);
+    EXPECT_TRUE(IsNormalMemoryTag(tag));
+    EXPECT_EQ(NumaPartitionFromTag(tag), partition);
+
+    void* p = MmapAligned(kMinSystemAlloc, kMinSystemAlloc, tag);
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(GetMemoryTag(p), tag);
+    EXPECT_TRUE(IsNormalMemory(p));
+    EXPECT_FALSE(IsColdMemory(p));
+    EXPECT_EQ(NumaPartitionFromPointer(p), partition);
+    EXPECT_EQ(munmap(p, kMinSystemAlloc), 0);
+  }
+  EXPECT_FALSE(IsNormalMemoryTag(MemoryTag::kSampled));
+  EXPECT_FALSE(IsNormalMemoryTag(MemoryTag::kCold));
+}
+
+TEST(SystemReleaseBatch, ReleasesEachRange) {
+  constexpr size_t kPages = 16;
+  const size_t page_size = GetPageSize();
+  const size_t size = kPages * page_size;
+  char* p = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(p, MAP_FAILED);
+  memset(p, 0xAB, size);
+
+  // Release every other page, so that no two ranges are contiguous.
+  std::vector<AddressRange> ranges;
+  for (size_t i = 0; i < kPages; i += 2) {
+    ranges.push_back({p + i * page_size, page_size});
+  }
+  size_t syscalls;
+  EXPECT_EQ(SystemReleaseBatch(ranges, &syscalls), ranges.size());
+  EXPECT_GE(syscalls, 1);
+  EXPECT_LE(syscalls, ranges.size());
+
+  for (size_t i = 0; i < kPages; ++i) {
+    SCOPED_TRACE(i);
+    EXPECT_EQ(p[i * page_size], i % 2 == 0 ? 0 : static_cast<char>(0xAB));
+  }
+
+  EXPECT_EQ(SystemReleaseBatch({}, &syscalls), 0);
+  EXPECT_EQ(syscalls, 0);
+  EXPECT_EQ(munmap(p, size), 0);
+}
+
+TEST(SystemRelease, LazyUnlessUnderPressure) {
+  constexpr size_t kPages = 16;
+  const size_t size = kPages * GetPageSize();
+  char* p = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  ASSERT_NE(p, MAP_FAILED);
+
+  // Under pressure, lazy releases are made eagerly.
+  SetSystemMemoryPressure(true);
+  memset(p, 0xAB, size);
+  size_t lazy = SystemLazyReleasedBytes();
+  EXPECT_TRUE(SystemRelease(p, size, ReleaseMode::kLazy));
+  EXPECT_EQ(SystemLazyReleasedBytes(), lazy);
+  EXPECT_EQ(p[0], 0);
+
+  SetSystemMemoryPressure(false);
+  memset(p, 0xAB, size);
+  EXPECT_TRUE(SystemRelease(p, size, ReleaseMode::kLazy));
+#ifdef MADV_FREE
+  EXPECT_EQ(SystemLazyReleasedBytes(), lazy + size);
+  // The pages may be reused before they are reclaimed.
+  EXPECT_FALSE(SystemMemoryIsZeroFilled());
+#endif
+
+  EXPECT_EQ(munmap(p, size), 0);
+}
+
+TEST(SystemCallCount, CountsEachCall) {
+  // SystemAlloc carves its ranges out of larger reservations, so it need not
+  // map anything itself; those reservations were mapped at startup.
+  AddressRange r =
+      SystemAlloc(kMinSystemAlloc, kMinSystemAlloc, MemoryTag::kNormal);
+  ASSERT_NE(r.ptr, nullptr);
+  EXPECT_GT(SystemCallCount(SystemCall::kMmap), 0);
+
+  const uint64_t madvises = SystemCallCount(SystemCall::kMadvise);
+  EXPECT_TRUE(SystemRelease(r.ptr, r.bytes, ReleaseMode::kDefault));
+  EXPECT_GT(SystemCallCount(SystemCall::kMadvise), madvises);
+
+  char buf[4096];
+  Printer printer(buf, sizeof(buf));
+  PrintSystemCallStats(&printer);
+  const absl::string_view stats(buf);
+  EXPECT_THAT(stats, testing::HasSubstr("MMAP"));
+  EXPECT_THAT(stats, testing::HasSubstr("MADVISE"));
+}
+
+TEST(SystemAdviseCold, PreservesColdMemory) {
+  AddressRange r = SystemAlloc(kMinSystemAlloc, kMinSystemAlloc,
+                               MemoryTag::kCold);
+  ASSERT_NE(r.ptr, nullptr);
+  ASSERT_GE(r.bytes, kMinSystemAlloc);
+  memset(r.ptr, 0xAB, r.bytes);
+
+  // Deactivating the pages does not discard them.
+  EXPECT_GE(SystemAdviseCold(), r.bytes);
+  const char* p = static_cast<const char*>(r.ptr);
+  for (size_t i = 0; i < r.bytes; i += GetPageSize()) {
+    ASSERT_EQ(p[i], static_cast<char>(0xAB));
+  }
+}
+
+TEST(SystemMovePages, MovesContents) {
+  constexpr size_t kSize = 2 * kHugePageSize;
+  AddressRange from = SystemAlloc(kSize, kHugePageSize, MemoryTag::kNormal);
+  AddressRange to = SystemAlloc(kSize, kHugePageSize, MemoryTag::kNormal);
+  ASSERT_NE(from.ptr, nullptr);
+  ASSERT_NE(to.ptr, nullptr);
+  memset(from.ptr, 0xAB, kSize);
+  memset(to.ptr, 0xCD, kSize);
+
+  ASSERT_TRUE(SystemMovePages(from.ptr, to.ptr, kSize, MemoryTag::kNormal));
+  // The destination holds the pages of the source, which is left usable but
+  // unbacked.
+  const char* dst = static_cast<const char*>(to.ptr);
+  char* src = static_cast<char*>(from.ptr);
+  for (size_t i = 0; i < kSize; i += GetPageSize()) {
+    ASSERT_EQ(dst[i], static_cast<char>(0xAB));
+    ASSERT_EQ(src[i], 0);
+  }
+  memset(from.ptr, 0xEF, kSize);
+}
+
+// Returns the NUMA policy mode of the page containing <addr>, and the nodes
+// it binds to.
+std::pair<int, uint64_t> MemoryPolicy(void* addr) {
+  int mode = -1;
+  uint64_t nodemask = 0;
+  CHECK_CONDITION(syscall(__NR_get_mempolicy, &mode, &nodemask,
+                          sizeof(nodemask) * 8, addr, MPOL_F_ADDR) == 0);
+  return {mode & ~MPOL_MODE_FLAGS, nodemask};
+}
+
+void* MapPages(size_t size) {
+  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK_CONDITION(ptr != MAP_FAILED);
+  return ptr;
+}
+
+TEST(BindMemory, BindsToNodes) {
+  const size_t size = 4 * GetPageSize();
+  void* ptr = MapPages(size);
+  ASSERT_EQ(MemoryPolicy(ptr).first, MPOL_DEFAULT);
+
+  BindMemory(ptr, size, /*nodemask=*/uint64_t{1} << 0, NumaBindMode::kNone);
+  EXPECT_EQ(MemoryPolicy(ptr).first, MPOL_DEFAULT);
+
+  // Every host has a node 0.
+  BindMemory(ptr, size, /*nodemask=*/uint64_t{1} << 0, NumaBindMode::kStrict);
+  const auto [mode, nodemask] = MemoryPolicy(ptr);
+  EXPECT_EQ(mode, MPOL_BIND);
+  EXPECT_EQ(nodemask, uint64_t{1} << 0);
+  memset(ptr, 0xAB, size);
+  munmap(ptr, size);
+}
+
+TEST(BindMemory, FailedBindFallsBack) {
+  constexpr int kMissingNode = 63;
+  if (access(absl::StrFormat("/sys/devices/system/node/node%d", kMissingNode)
+                 .c_str(),
+             F_OK) == 0) {
+    GTEST_SKIP() << "Host has node " << kMissingNode;
+  }
+  constexpr uint64_t kNodemask = uint64_t{1} << kMissingNode;
+  const size_t size = 4 * GetPageSize();
+  void* ptr = MapPages(size);
+
+  // An advisory bind leaves the memory as it was, with the default policy.
+  BindMemory(ptr, size, kNodemask, NumaBindMode::kAdvisory);
+  EXPECT_EQ(MemoryPolicy(ptr).first, MPOL_DEFAULT);
+  memset(ptr, 0xAB, size);
+
+  EXPECT_DEATH(BindMemory(ptr, size, kNodemask, NumaBindMode::kStrict),
+               "Unable to mbind memory");
+  munmap(ptr, size);
+}
+
 // Was SimpleRegion::Alloc invoked at least once?
 static bool simple_region_alloc_invoked = false;
 
@@ -172,6 +368,79 @@ TEST(Basic, InvokedTest) {
   ASSERT_TRUE(simple_region_alloc_invoked);
 }
 
+// Ranges handed out by regions created for UsageHint::kRegistered, standing in
+// for registration with a device.
+static AddressRange registered_ranges[64];
+static int num_registered_ranges = 0;
+
+class RegisteringRegion : public AddressRegion {
+ public:
+  explicit RegisteringRegion(AddressRegion* region) : region_(region) {}
+
+  std::pair<void*, size_t> Alloc(size_t size, size_t alignment) override {
+    auto [ptr, actual_size] = region_->Alloc(size, alignment);
+    if (ptr != nullptr) {
+      CHECK_CONDITION(num_registered_ranges < std::size(registered_ranges));
+      registered_ranges[num_registered_ranges++] = {ptr, actual_size};
+    }
+    return {ptr, actual_size};
+  }
+
+ private:
+  AddressRegion* region_;
+};
+
+class RegisteringRegionFactory : public AddressRegionFactory {
+ public:
+  AddressRegion* Create(void* start, size_t size, UsageHint hint) override {
+    AddressRegion* region = f.Create(start, size, hint);
+    if (hint != UsageHint::kRegistered) return region;
+    void* region_space = MallocInternal(sizeof(RegisteringRegion));
+    CHECK_CONDITION(region_space != nullptr);
+    return new (region_space) RegisteringRegion(region);
+  }
+};
+RegisteringRegionFactory registering_factory;
+
+bool IsRegistered(const void* ptr, size_t size) {
+  const uintptr_t start = reinterpret_cast<uintptr_t>(ptr);
+  for (int i = 0; i < num_registered_ranges; ++i) {
+    const uintptr_t range = reinterpret_cast<uintptr_t>(registered_ranges[i].ptr);
+    if (range <= start && start + size <= range + registered_ranges[i].bytes) {
+      return true;
+    }
+  }
+  return false;
+}
+
+TEST(Registered, AllocatesFromRegisteredRegions) {
+  if (!kHasRegisteredHeap) {
+    GTEST_SKIP() << "Built without the registered heap";
+  }
+  MallocExtension::SetRegionFactory(&registering_factory);
+
+  constexpr size_t kSize = 64 << 10;
+  std::vector<char*> buffers;
+  for (int i = 0; i < 64; ++i) {
+    char* buffer = new (tcmalloc::registered) char[kSize];
+    ASSERT_NE(buffer, nullptr);
+    EXPECT_TRUE(IsRegisteredMemory(buffer));
+    EXPECT_TRUE(IsRegistered(buffer, kSize));
+    memset(buffer, 0xef, kSize);
+    buffers.push_back(buffer);
+  }
+  // Runs of hugepages are registered, rather than individual buffers.
+  EXPECT_LT(num_registered_ranges, buffers.size());
+  for (char* buffer : buffers) {
+    delete[] buffer;
+  }
+
+  void* ptr = ::operator new(kSize);
+  benchmark::DoNotOptimize(ptr);
+  EXPECT_FALSE(IsRegisteredMemory(ptr));
+  ::operator delete(ptr);
+}
+
 TEST(Basic, RetryFailTest) {
   // Check with the allocator still works after a failed allocation.
   //
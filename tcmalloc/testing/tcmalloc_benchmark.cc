@@ -33,7 +33,9 @@
 #include "benchmark/benchmark.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/declarations.h"
+#include "tcmalloc/internal/parameter_accessors.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/new_extension.h"
 
 extern "C" ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetStats(
     std::string* ret);
@@ -73,6 +75,18 @@ static void BM_size_returning_new_delete(benchmark::State& state) {
 }
 BENCHMARK(BM_size_returning_new_delete)->Range(1, 1 << 20);
 
+template <size_t N>
+static void BM_allocate_fixed(benchmark::State& state) {
+  for (auto s : state) {
+    void* ptr = AllocateFixed<N>();
+    DeallocateFixed<N>(ptr);
+  }
+}
+BENCHMARK_TEMPLATE(BM_allocate_fixed, 8);
+BENCHMARK_TEMPLATE(BM_allocate_fixed, 64);
+BENCHMARK_TEMPLATE(BM_allocate_fixed, 512);
+BENCHMARK_TEMPLATE(BM_allocate_fixed, 4096);
+
 static void BM_nallocx_new_sized_delete(benchmark::State& state) {
   const int arg = state.range(0);
 
@@ -94,7 +108,48 @@ static void BM_aligned_new(benchmark::State& state) {
     operator delete(ptr, size, static_cast<std::align_val_t>(alignment));
   }
 }
-BENCHMARK(BM_aligned_new)->RangePair(1, 1 << 20, 8, 64)->ArgPair(65, 64);
+BENCHMARK(BM_aligned_new)
+    ->RangePair(1, 1 << 20, 8, 64)
+    ->ArgPair(65, 64)
+    ->RangePair(1 << 10, 1 << 16, 4096, 4096)
+    ->ArgPair(4097, 4096);
+
+// Has one thread per counter increment its own counter.  The counters are
+// allocated back to back, so without tcmalloc::exclusive_line they share cache
+// lines and the threads contend for them.
+template <bool kExclusiveLine>
+static void BM_false_sharing(benchmark::State& state) {
+  constexpr int kIncrements = 1 << 16;
+  const int threads = state.range(0);
+
+  std::vector<std::atomic<int64_t>*> counters;
+  for (int i = 0; i < threads; ++i) {
+    counters.push_back(kExclusiveLine
+                           ? new (exclusive_line) std::atomic<int64_t>(0)
+                           : new std::atomic<int64_t>(0));
+  }
+
+  for (auto s : state) {
+    std::vector<std::thread> workers;
+    for (std::atomic<int64_t>* counter : counters) {
+      workers.emplace_back([counter]() {
+        for (int i = 0; i < kIncrements; ++i) {
+          counter->fetch_add(1, std::memory_order_relaxed);
+        }
+      });
+    }
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * threads * kIncrements);
+
+  for (std::atomic<int64_t>* counter : counters) {
+    ::operator delete(counter);
+  }
+}
+BENCHMARK_TEMPLATE(BM_false_sharing, false)->Arg(2)->Arg(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_false_sharing, true)->Arg(2)->Arg(4)->UseRealTime();
 
 static void BM_new_delete_slow_path(benchmark::State& state) {
   // The benchmark is intended to cover CpuCache overflow/underflow paths,
@@ -263,9 +318,17 @@ BENCHMARK(BM_get_stats_internal)
     ->Range(1, 1 << 20)
     ->Unit(benchmark::kMillisecond);
 
+// How the background thread of BM_get_stats_pageheap_lock reads stats.
+enum class StatsReader {
+  kGetStats,
+  kNumericProperty,
+  kNumericPropertySnapshot,
+};
+
 static void BM_get_stats_pageheap_lock(benchmark::State& state) {
   std::vector<std::unique_ptr<char[]>> allocations;
   const int num_allocations = state.range(0);
+  const auto reader = static_cast<StatsReader>(state.range(1));
   allocations.reserve(num_allocations);
 
   // Perform randomly sized allocations which will be kept live whilst we
@@ -277,15 +340,27 @@ static void BM_get_stats_pageheap_lock(benchmark::State& state) {
     allocations.emplace_back(new char[size]);
   }
 
+  // Let property reads use a snapshot up to a second old, as a metrics
+  // exporter polling every second would.
+  const int64_t prev_max_age_ms = TCMalloc_Internal_GetStatsSnapshotMaxAgeMs();
+  TCMalloc_Internal_SetStatsSnapshotMaxAgeMs(
+      reader == StatsReader::kNumericPropertySnapshot ? 1000 : 0);
+
   // Create a background thread which busy-loops calling
-  // MallocExtension::GetStats().
+  // MallocExtension::GetStats() or reading a property.
   absl::Notification done;
   std::atomic<size_t> counter = 0;
   std::thread stats_thread([&] {
     while (!done.HasBeenNotified()) {
-      const std::string stats = MallocExtension::GetStats();
+      if (reader == StatsReader::kGetStats) {
+        const std::string stats = MallocExtension::GetStats();
+        benchmark::DoNotOptimize(stats);
+      } else {
+        const auto bytes = MallocExtension::GetNumericProperty(
+            "generic.current_allocated_bytes");
+        benchmark::DoNotOptimize(bytes);
+      }
       counter.fetch_add(1, std::memory_order_seq_cst);
-      benchmark::DoNotOptimize(stats);
     }
   });
 
@@ -313,9 +388,13 @@ static void BM_get_stats_pageheap_lock(benchmark::State& state) {
   // End the background stats_thread.
   done.Notify();
   stats_thread.join();
+  TCMalloc_Internal_SetStatsSnapshotMaxAgeMs(prev_max_age_ms);
 }
 BENCHMARK(BM_get_stats_pageheap_lock)
-    ->Range(1, 1 << 20)
+    ->ArgsProduct({benchmark::CreateRange(1, 1 << 20, 8),
+                   {static_cast<int>(StatsReader::kGetStats),
+                    static_cast<int>(StatsReader::kNumericProperty),
+                    static_cast<int>(StatsReader::kNumericPropertySnapshot)}})
     ->UseRealTime()
     ->Unit(benchmark::kMillisecond);
 
@@ -430,6 +509,31 @@ static void BM_get_heap_profile(benchmark::State& state) {
 }
 BENCHMARK(BM_get_heap_profile)->Range(1, 1 << 20);
 
+static void BM_get_heap_profile_delta(benchmark::State& state) {
+  std::vector<std::unique_ptr<char[]>> allocations;
+  const int num_allocations = state.range(0);
+  allocations.reserve(num_allocations);
+
+  // Perform randomly sized allocations which will be kept live while we collect
+  // the heap profile deltas.
+  absl::BitGen rand;
+  for (int i = 0; i < num_allocations; i++) {
+    const size_t size = absl::Uniform<size_t>(rand, 1, 1 << 20);
+    allocations.emplace_back(new char[size]);
+  }
+
+  uint64_t cursor = 0;
+  MallocExtension::SnapshotHeapDelta(&cursor);
+  for (auto s : state) {
+    // Replace one live allocation per iteration, so that each delta reports
+    // a little churn.
+    const int i = absl::Uniform<int>(rand, 0, num_allocations);
+    allocations[i].reset(new char[absl::Uniform<size_t>(rand, 1, 1 << 20)]);
+    MallocExtension::SnapshotHeapDelta(&cursor);
+  }
+}
+BENCHMARK(BM_get_heap_profile_delta)->Range(1, 1 << 20);
+
 static void BM_get_heap_profile_while_allocating(benchmark::State& state) {
   std::vector<std::unique_ptr<char[]>> allocations;
   const int num_allocations = state.range(0);
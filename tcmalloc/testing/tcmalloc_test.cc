@@ -185,6 +185,70 @@ TEST(TcmallocTest, Calloc) {
   }
 }
 
+TEST(TcmallocTest, CallocAfterFreeWithLargeSpanCache) {
+  // Spans reused from the large span cache were written to by their previous
+  // owner, however they were first allocated.
+  using tcmalloc_internal::Parameters;
+
+  const int64_t old_bytes = Parameters::large_span_cache_bytes();
+  Parameters::set_large_span_cache_bytes(64 << 20);
+  constexpr size_t kSize = 400 << 10;
+  for (int i = 0; i < 50; ++i) {
+    char* p = static_cast<char*>(calloc(kSize, 1));
+    ASSERT_NE(p, nullptr);
+    for (size_t j = 0; j < kSize; j += 512) {
+      ASSERT_EQ(p[j], 0) << i << " " << j;
+    }
+    ASSERT_EQ(p[kSize - 1], 0) << i;
+    memset(p, 0xff, kSize);
+    free(p);
+  }
+  Parameters::set_large_span_cache_bytes(old_bytes);
+  MallocExtension::ReleaseMemoryToSystem(std::numeric_limits<size_t>::max());
+}
+
+TEST(TcmallocTest, CallocReusedPages) {
+  // calloc() skips clearing pages that are known to be zero; make sure pages
+  // dirtied by an earlier allocation never qualify, whether or not they were
+  // released in between.
+  absl::BitGen rng;
+  std::vector<std::pair<void*, size_t>> ptrs;
+  for (int i = 0; i < 200; ++i) {
+    const size_t size = absl::LogUniform<size_t>(
+        rng, tcmalloc_internal::kMaxSize + 1, 8 << 20);
+    if (absl::Bernoulli(rng, 0.5)) {
+      char* p = static_cast<char*>(calloc(size, 1));
+      ASSERT_NE(p, nullptr);
+      for (size_t j = 0; j < size; j += 512) {
+        ASSERT_EQ(p[j], 0) << size << " " << j;
+      }
+      ASSERT_EQ(p[size - 1], 0) << size;
+      memset(p, 0xff, size);
+      ptrs.emplace_back(p, size);
+    } else {
+      void* p = malloc(size);
+      ASSERT_NE(p, nullptr);
+      memset(p, 0xff, size);
+      ptrs.emplace_back(p, size);
+    }
+
+    if (absl::Bernoulli(rng, 0.5)) {
+      const size_t index = absl::Uniform<size_t>(rng, 0, ptrs.size());
+      std::swap(ptrs[index], ptrs.back());
+      free(ptrs.back().first);
+      ptrs.pop_back();
+    }
+    if (absl::Bernoulli(rng, 0.1)) {
+      MallocExtension::ReleaseMemoryToSystem(
+          absl::Uniform<size_t>(rng, 0, 16 << 20));
+    }
+  }
+
+  for (const auto& alloc : ptrs) {
+    free(alloc.first);
+  }
+}
+
 TEST(TcmallocTest, Realloc) {
   // Test that realloc doesn't always reallocate and copy memory.
   constexpr int kLargeSize = (1 << 20) - (1 << 10);
@@ -474,7 +538,41 @@ TEST(TCMallocTest, ReleaseMemoryToSystem) {
   EXPECT_EQ(starting_bytes + 2 * MB, GetUnmappedBytes());
 }
 
-TEST(TCMallocTest, MallocTrim) { malloc_trim(0); }
+static size_t GetProperty(absl::string_view name) {
+  std::optional<size_t> value = MallocExtension::GetNumericProperty(name);
+  CHECK_CONDITION(value.has_value());
+  return *value;
+}
+
+TEST(TCMallocTest, MallocTrim) {
+  // Leave free objects in the caches and free pages in the page heap.
+  constexpr int kObjects = 1 << 16;
+  std::vector<void*> ptrs;
+  ptrs.reserve(kObjects);
+  for (int i = 0; i < kObjects; ++i) {
+    ptrs.push_back(::operator new(64));
+  }
+  void* large = ::operator new(16 << 20);
+  for (void* p : ptrs) {
+    ::operator delete(p);
+  }
+  ::operator delete(large);
+  ptrs.clear();
+  ptrs.shrink_to_fit();
+
+  // A pad larger than the heap keeps all of the free memory backed.
+  EXPECT_EQ(malloc_trim(std::numeric_limits<size_t>::max() / 2), 0);
+
+  const size_t unmapped = GetUnmappedBytes();
+  malloc_trim(0);
+  EXPECT_GE(GetUnmappedBytes(), unmapped);
+  // Caches the trim drained may have been refilled by allocations since, but
+  // not by anywhere near the objects freed above.
+  EXPECT_LT(GetProperty("tcmalloc.transfer_cache_free"), 64 * kObjects / 4);
+  EXPECT_LT(GetProperty("tcmalloc.sharded_transfer_cache_free"),
+            64 * kObjects / 4);
+  EXPECT_EQ(malloc_trim(std::numeric_limits<size_t>::max() / 2), 0);
+}
 
 TEST(TCMallocTest, NothrowSizedDelete) {
   struct Foo {
@@ -764,6 +862,31 @@ TEST(TCMallocTest, SampleAllocatedSize) {
   }
 }
 
+// Small sampled objects share their pages.
+TEST(TCMallocTest, SampledSmallObjectsSharePages) {
+  ScopedAlwaysSample always_sample;
+  ScopedGuardedSamplingRate gs(-1);
+
+  std::vector<void*> ptrs;
+  for (size_t i = 0; i < 16; ++i) {
+    void* ptr = ::operator new(32);
+    ASSERT_TRUE(tcmalloc_internal::IsSampledMemory(ptr));
+    ASSERT_EQ(MallocExtension::GetAllocatedSize(ptr), 32);
+    memset(ptr, i, 32);
+    ptrs.push_back(ptr);
+  }
+  absl::flat_hash_set<uintptr_t> pages;
+  for (void* ptr : ptrs) {
+    pages.insert(reinterpret_cast<uintptr_t>(ptr) >>
+                 tcmalloc_internal::kPageShift);
+  }
+  EXPECT_LT(pages.size(), ptrs.size());
+  for (size_t i = 0; i < ptrs.size(); ++i) {
+    EXPECT_EQ(static_cast<char*>(ptrs[i])[31], static_cast<char>(i));
+    ::operator delete(ptrs[i], 32);
+  }
+}
+
 // Ensure that nallocx works before main.
 struct GlobalNallocx {
   GlobalNallocx() { CHECK_CONDITION(nallocx(99, 0) >= 99); }
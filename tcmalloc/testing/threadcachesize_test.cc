@@ -104,5 +104,36 @@ TEST(ThreadCache, MaxCacheHonored) {
   }
 }
 
+// Exiting threads return their budget, and new threads reuse their caches,
+// without exceeding the limit.
+TEST(ThreadCache, MaxCacheHonoredAcrossThreadChurn) {
+  MallocExtension::SetMaxTotalThreadCacheBytes(kTotalThreadCacheSize);
+  const size_t thread_caches =
+      MallocExtension::GetNumericProperty("tcmalloc.thread_cache_count")
+          .value_or(0);
+
+  constexpr int kRounds = 5;
+  for (int round = 0; round < kRounds; ++round) {
+    absl::Barrier startfill(kNumThreads + 1);
+    absl::Barrier filled(kNumThreads + 1);
+
+    std::vector<std::thread> threads;
+    threads.reserve(kNumThreads);
+    for (int i = 0; i < kNumThreads; i++) {
+      threads.push_back(std::thread(Filler, &startfill, &filled));
+    }
+    startfill.Block();
+    filled.Block();
+    for (std::thread& t : threads) {
+      t.join();
+    }
+  }
+
+  ASSERT_LT(max_cache_size, kTotalThreadCacheSize + kTotalThreadCacheSize / 5);
+  EXPECT_EQ(MallocExtension::GetNumericProperty("tcmalloc.thread_cache_count")
+                .value_or(0),
+            thread_caches);
+}
+
 }  // namespace
 }  // namespace tcmalloc
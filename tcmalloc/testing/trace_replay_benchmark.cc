@@ -0,0 +1,366 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Replays an allocation trace, as recorded with TCMALLOC_ALLOCATION_TRACE, with
+// one thread per traced thread.  Each build variant of this benchmark replays
+// the trace against a different allocator configuration.
+//
+// Set TCMALLOC_REPLAY_TRACE to the trace to replay; without it, a synthetic
+// trace is replayed.  Besides the throughput, the benchmark reports per-op
+// latency percentiles, the peak physical memory used and the fragmentation:
+// how much more memory that is than the peak bytes requested by the trace.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/base/internal/cycleclock.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/random/random.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/internal/allocation_trace.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace {
+
+using tcmalloc_internal::AllocationTraceEvent;
+using tcmalloc_internal::AllocationTraceOp;
+using tcmalloc_internal::ReadAllocationTrace;
+
+// An operation of a replayed thread.  Objects are named by dense slots rather
+// than by address, so that replay needs no lookups.
+struct ReplayOp {
+  AllocationTraceOp op;
+  // The object allocated or freed; the new object for kRealloc.
+  uint32_t slot;
+  // The object reallocated, for kRealloc.
+  uint32_t old_slot;
+  size_t size;
+  size_t alignment;
+};
+
+struct ReplayTrace {
+  std::vector<std::vector<ReplayOp>> threads;
+  size_t slots = 0;
+  size_t ops = 0;
+  // The most bytes the trace requested at once.
+  size_t peak_requested_bytes = 0;
+};
+
+// Orders `events` by time and resolves their addresses to slots.  Frees of
+// objects allocated before the trace started are dropped, and reallocations
+// of such objects replayed as allocations.
+ReplayTrace PrepareTrace(std::vector<AllocationTraceEvent> events) {
+  std::stable_sort(events.begin(), events.end(),
+                   [](const AllocationTraceEvent& a,
+                      const AllocationTraceEvent& b) {
+                     return a.cycles < b.cycles;
+                   });
+
+  ReplayTrace trace;
+  absl::flat_hash_map<uint32_t, size_t> thread_index;
+  absl::flat_hash_map<uint64_t, std::pair<uint32_t, size_t>> live;
+  size_t requested = 0;
+
+  auto allocate = [&](uint64_t object, size_t size) {
+    const uint32_t slot = trace.slots++;
+    live[object] = {slot, size};
+    requested += size;
+    trace.peak_requested_bytes =
+        std::max(trace.peak_requested_bytes, requested);
+    return slot;
+  };
+  auto release = [&](uint64_t object) -> std::optional<uint32_t> {
+    auto it = live.find(object);
+    if (it == live.end()) return std::nullopt;
+    const uint32_t slot = it->second.first;
+    requested -= it->second.second;
+    live.erase(it);
+    return slot;
+  };
+
+  for (const AllocationTraceEvent& e : events) {
+    auto [it, inserted] =
+        thread_index.try_emplace(e.thread, trace.threads.size());
+    if (inserted) trace.threads.emplace_back();
+    std::vector<ReplayOp>& ops = trace.threads[it->second];
+
+    ReplayOp op = {};
+    op.op = e.op;
+    op.alignment = e.alignment;
+    switch (e.op) {
+      case AllocationTraceOp::kMalloc:
+        op.size = e.size;
+        op.slot = allocate(e.object, e.size);
+        break;
+      case AllocationTraceOp::kFree:
+        if (std::optional<uint32_t> slot = release(e.object)) {
+          op.slot = *slot;
+        } else {
+          continue;
+        }
+        break;
+      case AllocationTraceOp::kRealloc:
+        op.size = e.size;
+        if (std::optional<uint32_t> slot = release(e.old_object)) {
+          op.old_slot = *slot;
+        } else {
+          op.op = AllocationTraceOp::kMalloc;
+        }
+        op.slot = allocate(e.object, e.size);
+        break;
+    }
+    ops.push_back(op);
+    ++trace.ops;
+  }
+  return trace;
+}
+
+// A trace of `kThreads` threads allocating objects of mixed sizes and freeing
+// or reallocating each other's.
+std::vector<AllocationTraceEvent> SyntheticTrace() {
+  constexpr int kThreads = 4;
+  constexpr int kSteps = 1 << 20;
+  constexpr size_t kMaxLive = 1 << 14;
+
+  absl::BitGen rng;
+  std::vector<AllocationTraceEvent> events;
+  std::vector<uint64_t> live;
+  uint64_t next_object = 1;
+  for (int step = 0; step < kSteps; ++step) {
+    AllocationTraceEvent e = {};
+    e.thread = step % kThreads;
+    e.cycles = step;
+    const bool allocate =
+        live.empty() ||
+        (live.size() < kMaxLive && absl::Bernoulli(rng, 0.5));
+    if (allocate) {
+      e.op = AllocationTraceOp::kMalloc;
+      e.object = next_object++;
+      // Mostly small objects, with a long tail.
+      e.size = std::min<size_t>(
+          std::exp(absl::Gaussian<double>(rng, 4.0, 1.5)), 1 << 20);
+      if (absl::Bernoulli(rng, 0.01)) e.alignment = 64;
+      live.push_back(e.object);
+    } else {
+      const size_t i = absl::Uniform<size_t>(rng, 0, live.size());
+      if (absl::Bernoulli(rng, 0.1)) {
+        e.op = AllocationTraceOp::kRealloc;
+        e.old_object = live[i];
+        e.object = next_object++;
+        e.size = absl::Uniform<size_t>(rng, 1, 4096);
+        live[i] = e.object;
+      } else {
+        e.op = AllocationTraceOp::kFree;
+        e.object = live[i];
+        live[i] = live.back();
+        live.pop_back();
+      }
+    }
+    events.push_back(e);
+  }
+  return events;
+}
+
+const ReplayTrace& GetTrace() {
+  static const ReplayTrace* trace = [] {
+    std::vector<AllocationTraceEvent> events;
+    if (const char* path = getenv("TCMALLOC_REPLAY_TRACE"); path != nullptr) {
+      std::ifstream file(path, std::ios::binary);
+      const std::string contents((std::istreambuf_iterator<char>(file)),
+                                 std::istreambuf_iterator<char>());
+      if (!ReadAllocationTrace(
+              absl::MakeConstSpan(contents.data(), contents.size()), nullptr,
+              [&](const AllocationTraceEvent& e) { events.push_back(e); })) {
+        fprintf(stderr, "%s is damaged; replaying its first %zu records\n",
+                path, events.size());
+      }
+    } else {
+      events = SyntheticTrace();
+    }
+    return new ReplayTrace(PrepareTrace(std::move(events)));
+  }();
+  return *trace;
+}
+
+// Counts latencies in buckets a quarter of a power of two wide.
+class LatencyHistogram {
+ public:
+  void Record(int64_t cycles) {
+    const double v = std::max<int64_t>(cycles, 1);
+    const int bucket =
+        std::min<int>(std::log2(v) * kBucketsPerDoubling, kBuckets - 1);
+    ++counts_[bucket];
+    ++total_;
+  }
+
+  void Merge(const LatencyHistogram& other) {
+    for (int i = 0; i < kBuckets; ++i) counts_[i] += other.counts_[i];
+    total_ += other.total_;
+  }
+
+  // Returns the upper bound of the bucket holding the `p`th percentile.
+  double Percentile(double p) const {
+    const uint64_t rank = std::ceil(total_ * p / 100);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank && seen > 0) {
+        return std::exp2(static_cast<double>(i + 1) / kBucketsPerDoubling);
+      }
+    }
+    return 0;
+  }
+
+ private:
+  static constexpr int kBucketsPerDoubling = 4;
+  static constexpr int kBuckets = 64 * kBucketsPerDoubling;
+
+  uint64_t counts_[kBuckets] = {};
+  uint64_t total_ = 0;
+};
+
+void* Allocate(const ReplayOp& op) {
+  if (op.alignment == 0) return malloc(op.size);
+  void* ptr = nullptr;
+  return posix_memalign(&ptr, op.alignment, op.size) == 0 ? ptr : nullptr;
+}
+
+// Waits for another thread to allocate `slot`, if it has not yet, and takes
+// the object.
+void* Take(std::atomic<void*>& slot) {
+  void* ptr;
+  while ((ptr = slot.exchange(nullptr, std::memory_order_acquire)) ==
+         nullptr) {
+    std::this_thread::yield();
+  }
+  return ptr;
+}
+
+void ReplayThread(absl::Span<const ReplayOp> ops,
+                  std::vector<std::atomic<void*>>& slots,
+                  LatencyHistogram& latency) {
+  for (const ReplayOp& op : ops) {
+    void* ptr;
+    int64_t start;
+    switch (op.op) {
+      case AllocationTraceOp::kMalloc:
+        start = absl::base_internal::CycleClock::Now();
+        ptr = Allocate(op);
+        latency.Record(absl::base_internal::CycleClock::Now() - start);
+        // Objects of size zero may be null; free them as a non-null marker
+        // instead.
+        slots[op.slot].store(ptr != nullptr ? ptr : &slots[op.slot],
+                             std::memory_order_release);
+        break;
+      case AllocationTraceOp::kFree:
+        ptr = Take(slots[op.slot]);
+        if (ptr == &slots[op.slot]) break;
+        start = absl::base_internal::CycleClock::Now();
+        free(ptr);
+        latency.Record(absl::base_internal::CycleClock::Now() - start);
+        break;
+      case AllocationTraceOp::kRealloc: {
+        void* old = Take(slots[op.old_slot]);
+        if (old == &slots[op.old_slot]) old = nullptr;
+        start = absl::base_internal::CycleClock::Now();
+        ptr = realloc(old, std::max<size_t>(op.size, 1));
+        latency.Record(absl::base_internal::CycleClock::Now() - start);
+        slots[op.slot].store(ptr, std::memory_order_release);
+        break;
+      }
+    }
+  }
+}
+
+size_t PhysicalMemoryUsed() {
+  return MallocExtension::GetNumericProperty("generic.physical_memory_used")
+      .value_or(0);
+}
+
+void BM_ReplayTrace(benchmark::State& state) {
+  const ReplayTrace& trace = GetTrace();
+  if (trace.ops == 0) {
+    state.SkipWithError("the trace is empty");
+    return;
+  }
+
+  const double ns_per_cycle =
+      1e9 / absl::base_internal::CycleClock::Frequency();
+  LatencyHistogram latency;
+  size_t peak_rss = 0;
+
+  for (auto s : state) {
+    state.PauseTiming();
+    std::vector<std::atomic<void*>> slots(trace.slots);
+    std::vector<LatencyHistogram> thread_latency(trace.threads.size());
+    std::atomic<size_t> running = trace.threads.size();
+    state.ResumeTiming();
+
+    std::vector<std::thread> threads;
+    threads.reserve(trace.threads.size());
+    for (size_t i = 0; i < trace.threads.size(); ++i) {
+      threads.emplace_back([&, i] {
+        ReplayThread(trace.threads[i], slots, thread_latency[i]);
+        running.fetch_sub(1, std::memory_order_release);
+      });
+    }
+    while (running.load(std::memory_order_acquire) > 0) {
+      peak_rss = std::max(peak_rss, PhysicalMemoryUsed());
+      absl::SleepFor(absl::Milliseconds(1));
+    }
+    for (std::thread& t : threads) t.join();
+
+    state.PauseTiming();
+    for (const LatencyHistogram& h : thread_latency) latency.Merge(h);
+    // Free what the trace left live, for the next iteration.
+    for (std::atomic<void*>& slot : slots) {
+      void* ptr = slot.load(std::memory_order_relaxed);
+      if (ptr != nullptr && ptr != &slot) free(ptr);
+    }
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(state.iterations() * trace.ops);
+  state.counters["threads"] = trace.threads.size();
+  state.counters["p50_ns"] = latency.Percentile(50) * ns_per_cycle;
+  state.counters["p99_ns"] = latency.Percentile(99) * ns_per_cycle;
+  state.counters["p99.9_ns"] = latency.Percentile(99.9) * ns_per_cycle;
+  state.counters["peak_rss_bytes"] = peak_rss;
+  state.counters["peak_requested_bytes"] = trace.peak_requested_bytes;
+  state.counters["fragmentation"] =
+      peak_rss > 0 && trace.peak_requested_bytes > 0
+          ? static_cast<double>(peak_rss) / trace.peak_requested_bytes - 1
+          : 0;
+}
+BENCHMARK(BM_ReplayTrace)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace tcmalloc
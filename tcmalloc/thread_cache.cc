@@ -14,11 +14,16 @@
 
 #include "tcmalloc/thread_cache.h"
 
+#include <sched.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <new>
 
 #include "absl/base/attributes.h"
+#include "absl/base/internal/spinlock.h"
 #include "absl/base/macros.h"
 #include "absl/base/optimization.h"
 #include "absl/types/span.h"
@@ -36,34 +41,42 @@ namespace tcmalloc_internal {
 
 size_t ThreadCache::per_thread_cache_size_ = kMaxThreadCacheSize;
 size_t ThreadCache::overall_thread_cache_size_ = kDefaultOverallThreadCacheSize;
-int64_t ThreadCache::unclaimed_cache_space_ = kDefaultOverallThreadCacheSize;
+ABSL_CONST_INIT std::atomic<int64_t> ThreadCache::unclaimed_cache_space_(
+    kDefaultOverallThreadCacheSize);
+ABSL_CONST_INIT absl::base_internal::SpinLock ThreadCache::threadcache_lock_(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
 ThreadCache* ThreadCache::thread_heaps_ = nullptr;
 int ThreadCache::thread_heap_count_ = 0;
-ThreadCache* ThreadCache::next_memory_steal_ = nullptr;
+ThreadCache* ThreadCache::free_heaps_ = nullptr;
+ABSL_CONST_INIT std::atomic<ThreadCache*> ThreadCache::all_heaps_(nullptr);
+ABSL_CONST_INIT std::atomic<ThreadCache*> ThreadCache::next_memory_steal_(
+    nullptr);
+ABSL_CONST_INIT std::atomic<size_t> ThreadCache::reclaimed_caches_(0);
 ABSL_CONST_INIT thread_local ThreadCache* ThreadCache::thread_local_data_
     ABSL_ATTRIBUTE_INITIAL_EXEC = nullptr;
 ABSL_CONST_INIT bool ThreadCache::tsd_inited_ = false;
 pthread_key_t ThreadCache::heap_key_;
 
-ThreadCache::ThreadCache(pthread_t tid) {
+void ThreadCache::Init(pthread_t tid) {
   size_ = 0;
 
-  max_size_ = 0;
-  IncreaseCacheLimitLocked();
-  if (max_size_ == 0) {
+  max_size_.store(0, std::memory_order_relaxed);
+  IncreaseCacheLimit();
+  if (max_size_.load(std::memory_order_relaxed) == 0) {
     // There isn't enough memory to go around.  Just give the minimum to
     // this thread.
-    max_size_ = kMinThreadCacheSize;
+    max_size_.store(kMinThreadCacheSize, std::memory_order_relaxed);
 
     // Take unclaimed_cache_space_ negative.
-    unclaimed_cache_space_ -= kMinThreadCacheSize;
-    ASSERT(unclaimed_cache_space_ < 0);
+    unclaimed_cache_space_.fetch_sub(kMinThreadCacheSize,
+                                     std::memory_order_relaxed);
   }
 
   next_ = nullptr;
   prev_ = nullptr;
   tid_ = tid;
   in_setspecific_ = false;
+  state_.store(kUsed, std::memory_order_relaxed);
   for (size_t size_class = 0; size_class < kNumClasses; ++size_class) {
     list_[size_class].Init();
   }
@@ -204,6 +217,7 @@ void ThreadCache::Scavenge() {
     list->clear_lowwatermark();
   }
 
+  CollectStolenBudget();
   IncreaseCacheLimit();
 }
 
@@ -211,43 +225,141 @@ void ThreadCache::DeallocateSlow(void* ptr, FreeList* list, size_t size_class) {
   if (ABSL_PREDICT_FALSE(list->length() > list->max_length())) {
     ListTooLong(list, size_class);
   }
-  if (size_ >= max_size_) {
+  if (size_ >= max_size_.load(std::memory_order_relaxed)) {
     Scavenge();
   }
 }
 
 void ThreadCache::IncreaseCacheLimit() {
-  AllocationGuardSpinLockHolder h(&pageheap_lock);
-  IncreaseCacheLimitLocked();
-}
-
-void ThreadCache::IncreaseCacheLimitLocked() {
-  if (unclaimed_cache_space_ > 0) {
+  const size_t max_size = max_size_.load(std::memory_order_relaxed);
+  int64_t unclaimed = unclaimed_cache_space_.load(std::memory_order_relaxed);
+  while (unclaimed > 0) {
     // Possibly make unclaimed_cache_space_ negative.
-    unclaimed_cache_space_ -= kStealAmount;
-    max_size_ += kStealAmount;
-    return;
+    if (unclaimed_cache_space_.compare_exchange_weak(
+            unclaimed, unclaimed - kStealAmount, std::memory_order_relaxed)) {
+      max_size_.store(max_size + kStealAmount, std::memory_order_relaxed);
+      return;
+    }
   }
-  // Don't hold pageheap_lock too long.  Try to steal from 10 other
-  // threads before giving up.  The i < 10 condition also prevents an
-  // infinite loop in case none of the existing thread heaps are
-  // suitable places to steal from.
-  for (int i = 0; i < 10; ++i, next_memory_steal_ = next_memory_steal_->next_) {
+  // Try to steal from 10 other threads before giving up.  The i < 10
+  // condition also prevents an infinite loop in case none of the existing
+  // thread heaps are suitable places to steal from.
+  for (int i = 0; i < 10; ++i) {
+    ThreadCache* victim = next_memory_steal_.load(std::memory_order_acquire);
     // Reached the end of the linked list.  Start at the beginning.
-    if (next_memory_steal_ == nullptr) {
-      ASSERT(thread_heaps_ != nullptr);
-      next_memory_steal_ = thread_heaps_;
+    if (victim == nullptr) {
+      victim = all_heaps_.load(std::memory_order_acquire);
+      if (victim == nullptr) return;
     }
-    if (next_memory_steal_ == this ||
-        next_memory_steal_->max_size_ <= kMinThreadCacheSize) {
+    // Racing threads may skip or revisit a heap; that only affects fairness.
+    next_memory_steal_.store(victim->next_allocated_,
+                             std::memory_order_release);
+    if (victim == this || !victim->TryStealBudget()) {
       continue;
     }
-    next_memory_steal_->max_size_ -= kStealAmount;
-    max_size_ += kStealAmount;
+    max_size_.store(max_size + kStealAmount, std::memory_order_relaxed);
+    return;
+  }
+}
+
+bool ThreadCache::TryStealBudget() {
+  const size_t max_size = max_size_.load(std::memory_order_relaxed);
+  size_t stolen = stolen_bytes_.load(std::memory_order_relaxed);
+  do {
+    if (max_size < stolen + kStealAmount + kMinThreadCacheSize) {
+      return false;
+    }
+  } while (!stolen_bytes_.compare_exchange_weak(
+      stolen, stolen + kStealAmount, std::memory_order_relaxed));
+  return true;
+}
 
-    next_memory_steal_ = next_memory_steal_->next_;
+void ThreadCache::CollectStolenBudget() {
+  if (ABSL_PREDICT_TRUE(stolen_bytes_.load(std::memory_order_relaxed) == 0)) {
     return;
   }
+  const size_t stolen = stolen_bytes_.exchange(0, std::memory_order_relaxed);
+  size_t max_size = max_size_.load(std::memory_order_relaxed);
+  if (max_size < stolen + kMinThreadCacheSize) {
+    // A thief raced with our previous collection (or with the exit of the
+    // thread that last used this heap object).  Cover the shortfall from the
+    // unclaimed space, possibly making it negative.
+    unclaimed_cache_space_.fetch_sub(stolen + kMinThreadCacheSize - max_size,
+                                     std::memory_order_relaxed);
+    max_size = kMinThreadCacheSize;
+  } else {
+    max_size -= stolen;
+  }
+  max_size_.store(max_size, std::memory_order_relaxed);
+}
+
+void ThreadCache::EnterSlow() {
+  uint8_t state = state_.load(std::memory_order_relaxed);
+  do {
+    ASSERT(state != kBusy);
+    // Reclaiming only returns the cache's objects to the transfer cache, so is
+    // not worth blocking for.
+    while (state == kReclaiming) {
+      sched_yield();
+      state = state_.load(std::memory_order_relaxed);
+    }
+  } while (!state_.compare_exchange_weak(state, kBusy,
+                                         std::memory_order_acquire,
+                                         std::memory_order_relaxed));
+}
+
+void ThreadCache::Reclaim() {
+  Cleanup();
+  for (size_t size_class = 0; size_class < kNumClasses; ++size_class) {
+    list_[size_class].Init();
+  }
+  // Return the budget beyond the minimum, as DeleteCache does all of it.
+  CollectStolenBudget();
+  const size_t max_size = max_size_.load(std::memory_order_relaxed);
+  if (max_size > kMinThreadCacheSize) {
+    max_size_.store(kMinThreadCacheSize, std::memory_order_relaxed);
+    unclaimed_cache_space_.fetch_add(max_size - kMinThreadCacheSize,
+                                     std::memory_order_relaxed);
+  }
+}
+
+void ThreadCache::ReclaimIdleCaches() {
+  // Returning objects to the transfer cache may take pageheap_lock, inside
+  // which threadcache_lock_ nests, so caches are emptied outside of it, a
+  // batch at a time.  A cache in kReclaiming is not deleted meanwhile, as its
+  // owner cannot enter it.
+  constexpr int kBatch = 64;
+  ThreadCache* idle[kBatch];
+  int n;
+  do {
+    n = 0;
+    {
+      AllocationGuardSpinLockHolder l(&threadcache_lock_);
+      for (ThreadCache* h = thread_heaps_; h != nullptr && n < kBatch;
+           h = h->next_) {
+        uint8_t state = kIdle;
+        if (h->state_.compare_exchange_strong(state, kReclaiming,
+                                              std::memory_order_acquire,
+                                              std::memory_order_relaxed)) {
+          idle[n++] = h;
+        }
+      }
+    }
+    for (int i = 0; i < n; ++i) {
+      idle[i]->Reclaim();
+      idle[i]->state_.store(kReclaimed, std::memory_order_release);
+    }
+    reclaimed_caches_.fetch_add(n, std::memory_order_relaxed);
+  } while (n == kBatch);
+
+  // Caches used since the previous call are reclaimed by the next one, unless
+  // they are used again before then.
+  AllocationGuardSpinLockHolder l(&threadcache_lock_);
+  for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+    uint8_t state = kUsed;
+    h->state_.compare_exchange_strong(state, kIdle, std::memory_order_relaxed,
+                                      std::memory_order_relaxed);
+  }
 }
 
 void ThreadCache::InitTSD() {
@@ -269,25 +381,23 @@ ThreadCache* ThreadCache::CreateCacheIfNecessary() {
     }
   }
 
-  {
-    AllocationGuardSpinLockHolder h(&pageheap_lock);
-    const pthread_t me = pthread_self();
-
-    // This may be a recursive malloc call from pthread_setspecific()
-    // In that case, the heap for this thread has already been created
-    // and added to the linked list.  So we search for that first.
-    if (maybe_reentrant) {
-      for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
-        if (h->tid_ == me) {
-          heap = h;
-          break;
-        }
+  const pthread_t me = pthread_self();
+
+  // This may be a recursive malloc call from pthread_setspecific()
+  // In that case, the heap for this thread has already been created
+  // and added to the linked list.  So we search for that first.
+  if (maybe_reentrant) {
+    AllocationGuardSpinLockHolder h(&threadcache_lock_);
+    for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+      if (h->tid_ == me) {
+        heap = h;
+        break;
       }
     }
+  }
 
-    if (heap == nullptr) {
-      heap = NewHeap(me);
-    }
+  if (heap == nullptr) {
+    heap = NewHeap(me);
   }
 
   // We call pthread_setspecific() outside the lock because it may
@@ -305,17 +415,35 @@ ThreadCache* ThreadCache::CreateCacheIfNecessary() {
 }
 
 ThreadCache* ThreadCache::NewHeap(pthread_t tid) {
-  // Create the heap and add it to the linked list
-  ThreadCache* heap = tc_globals.threadcache_allocator().New();
-  new (heap) ThreadCache(tid);
+  // Reuse the heap of an exited thread if possible.
+  ThreadCache* heap;
+  {
+    AllocationGuardSpinLockHolder h(&threadcache_lock_);
+    heap = free_heaps_;
+    if (heap != nullptr) free_heaps_ = heap->next_;
+  }
+  if (heap == nullptr) {
+    {
+      AllocationGuardSpinLockHolder h(&pageheap_lock);
+      heap = tc_globals.threadcache_allocator().New();
+    }
+    new (heap) ThreadCache();
+    // Publish the heap for stealing.  It is never unlinked.
+    ThreadCache* head = all_heaps_.load(std::memory_order_relaxed);
+    do {
+      heap->next_allocated_ = head;
+    } while (!all_heaps_.compare_exchange_weak(head, heap,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+  }
+  heap->Init(tid);
+
+  // Add it to the linked list
+  AllocationGuardSpinLockHolder h(&threadcache_lock_);
   heap->next_ = thread_heaps_;
   heap->prev_ = nullptr;
   if (thread_heaps_ != nullptr) {
     thread_heaps_->prev_ = heap;
-  } else {
-    // This is the only thread heap at the moment.
-    ASSERT(next_memory_steal_ == nullptr);
-    next_memory_steal_ = heap;
   }
   thread_heaps_ = heap;
   thread_heap_count_++;
@@ -354,24 +482,38 @@ void ThreadCache::DestroyThreadCache(void* ptr) {
 }
 
 void ThreadCache::DeleteCache(ThreadCache* heap) {
+  // Keep ReclaimIdleCaches away from the heap until it is off thread_heaps_.
+  // Init readies it for the next owner.
+  heap->Enter();
+
   // Remove all memory from heap
   heap->Cleanup();
 
-  // Remove from linked list
-  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  // Return the budget.  Clearing max_size_ first stops further steals; a
+  // thief that raced with us leaves its claim in stolen_bytes_, which the next
+  // user of this heap object collects.
+  const size_t max_size =
+      heap->max_size_.exchange(0, std::memory_order_relaxed);
+  const size_t stolen =
+      heap->stolen_bytes_.exchange(0, std::memory_order_relaxed);
+  unclaimed_cache_space_.fetch_add(
+      static_cast<int64_t>(max_size) - static_cast<int64_t>(stolen),
+      std::memory_order_relaxed);
+
+  // Move from the linked list to the free list
+  AllocationGuardSpinLockHolder h(&threadcache_lock_);
   if (heap->next_ != nullptr) heap->next_->prev_ = heap->prev_;
   if (heap->prev_ != nullptr) heap->prev_->next_ = heap->next_;
   if (thread_heaps_ == heap) thread_heaps_ = heap->next_;
   thread_heap_count_--;
 
-  if (next_memory_steal_ == heap) next_memory_steal_ = heap->next_;
-  if (next_memory_steal_ == nullptr) next_memory_steal_ = thread_heaps_;
-  unclaimed_cache_space_ += heap->max_size_;
-
-  tc_globals.threadcache_allocator().Delete(heap);
+  heap->prev_ = nullptr;
+  heap->next_ = free_heaps_;
+  free_heaps_ = heap;
 }
 
 void ThreadCache::RecomputePerThreadCacheSize() {
+  AllocationGuardSpinLockHolder h(&threadcache_lock_);
   // Divide available space across threads
   int n = thread_heap_count_ > 0 ? thread_heap_count_ : 1;
   size_t space = overall_thread_cache_size_ / n;
@@ -381,21 +523,25 @@ void ThreadCache::RecomputePerThreadCacheSize() {
   if (space > kMaxThreadCacheSize) space = kMaxThreadCacheSize;
 
   double ratio = space / std::max<double>(1, per_thread_cache_size_);
-  size_t claimed = 0;
-  for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
-    // Increasing the total cache size should not circumvent the
-    // slow-start growth of max_size_.
-    if (ratio < 1.0) {
-      h->max_size_ *= ratio;
+  // Increasing the total cache size should not circumvent the
+  // slow-start growth of max_size_.
+  if (ratio < 1.0) {
+    for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
+      // Shrink through the mailbox, as max_size_ belongs to the owner.
+      const size_t max_size = h->max_size_.load(std::memory_order_relaxed);
+      const size_t stolen = h->stolen_bytes_.load(std::memory_order_relaxed);
+      if (max_size <= stolen) continue;
+      const size_t shrink = (max_size - stolen) * (1.0 - ratio);
+      h->stolen_bytes_.fetch_add(shrink, std::memory_order_relaxed);
+      unclaimed_cache_space_.fetch_add(shrink, std::memory_order_relaxed);
     }
-    claimed += h->max_size_;
   }
-  unclaimed_cache_space_ = overall_thread_cache_size_ - claimed;
   per_thread_cache_size_ = space;
 }
 
 AllocatorStats ThreadCache::GetStats(uint64_t* total_bytes,
                                      uint64_t* class_count) {
+  AllocationGuardSpinLockHolder l(&threadcache_lock_);
   for (ThreadCache* h = thread_heaps_; h != nullptr; h = h->next_) {
     *total_bytes += h->size_;
     if (class_count) {
@@ -404,12 +550,20 @@ AllocatorStats ThreadCache::GetStats(uint64_t* total_bytes,
       }
     }
   }
-  return tc_globals.threadcache_allocator().stats();
+  // Heap objects of exited threads are kept on free_heaps_ rather than
+  // returned to the allocator.
+  AllocatorStats stats = tc_globals.threadcache_allocator().stats();
+  stats.in_use = thread_heap_count_;
+  return stats;
 }
 
 void ThreadCache::set_overall_thread_cache_size(size_t new_size) {
   // Clip the value to a reasonable minimum
   if (new_size < kMinThreadCacheSize) new_size = kMinThreadCacheSize;
+  unclaimed_cache_space_.fetch_add(static_cast<int64_t>(new_size) -
+                                       static_cast<int64_t>(
+                                           overall_thread_cache_size_),
+                                   std::memory_order_relaxed);
   overall_thread_cache_size_ = new_size;
 
   RecomputePerThreadCacheSize();
@@ -20,7 +20,10 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include <atomic>
+
 #include "absl/base/attributes.h"
+#include "absl/base/internal/spinlock.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
 #include "tcmalloc/common.h"
@@ -39,8 +42,6 @@ namespace tcmalloc_internal {
 
 class ThreadCache {
  public:
-  explicit ThreadCache(pthread_t tid)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   void Cleanup();
 
   // Allocate an object of the given size class.
@@ -71,6 +72,18 @@ class ThreadCache {
     return overall_thread_cache_size_;
   }
 
+  // Empties the caches of threads that have not allocated or freed through
+  // them since the previous call, and shrinks their budget to
+  // kMinThreadCacheSize, without the cooperation of the threads (see state_).
+  // Called periodically by the background thread.
+  static void ReclaimIdleCaches()
+      ABSL_LOCKS_EXCLUDED(threadcache_lock_, pageheap_lock);
+
+  // The number of caches ReclaimIdleCaches() has emptied.
+  static size_t reclaimed_caches() {
+    return reclaimed_caches_.load(std::memory_order_relaxed);
+  }
+
  private:
   // We inherit rather than include the list as a data structure to reduce
   // compiler padding.  Without inheritance, the compiler pads the list
@@ -136,16 +149,38 @@ class ThreadCache {
   void ReleaseToTransferCache(FreeList* src, size_t size_class, int N);
 
   // Increase max_size_ by reducing unclaimed_cache_space_ or by
-  // reducing the max_size_ of some other thread.  In both cases,
-  // the delta is kStealAmount.
+  // stealing from the mailbox of some other thread.  In both cases,
+  // the delta is kStealAmount.  Does not take any locks.
   void IncreaseCacheLimit();
 
-  // Same as above but called with pageheap_lock held.
-  void IncreaseCacheLimitLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  // Called by another thread to take kStealAmount of this cache's budget by
+  // posting it to stolen_bytes_.  Returns false if this cache is already at
+  // (or, for exited threads, below) kMinThreadCacheSize.
+  bool TryStealBudget();
+
+  // Deducts the budget posted to stolen_bytes_ by other threads from
+  // max_size_.
+  void CollectStolenBudget();
 
   void Scavenge();
   static ThreadCache* CreateCacheIfNecessary();
 
+  // The states of state_.  The owner moves kUsed, kIdle or kReclaimed to kBusy
+  // when it starts to use its cache, and kBusy to kUsed when done.
+  // ReclaimIdleCaches() moves kUsed to kIdle, and kIdle, which the owner has
+  // not left since the previous call, to kReclaiming and, once it has emptied
+  // the cache, to kReclaimed.
+  enum State : uint8_t { kUsed, kIdle, kBusy, kReclaiming, kReclaimed };
+
+  // Brackets every use of this cache by its owner.
+  void Enter();
+  void Leave() { state_.store(kUsed, std::memory_order_release); }
+  // Waits out a reclaim of this cache in progress.
+  void EnterSlow();
+
+  // Empties this cache on behalf of its owner, which is idle.
+  void Reclaim();
+
   // If TLS is available, we also store a copy of the per-thread object
   // in a __thread variable since __thread variables are faster to read
   // than pthread_getspecific().  We still need pthread_setspecific()
@@ -170,15 +205,31 @@ class ThreadCache {
   static bool tsd_inited_;
   static pthread_key_t heap_key_;
 
-  // Linked list of heap objects.
-  static ThreadCache* thread_heaps_ ABSL_GUARDED_BY(pageheap_lock);
-  static int thread_heap_count_ ABSL_GUARDED_BY(pageheap_lock);
+  // Protects the lists of live and free heap objects.  Thread creation and
+  // exit take only this lock (and pageheap_lock when a heap object must be
+  // carved from the arena).  Nests inside pageheap_lock.
+  ABSL_CONST_INIT static absl::base_internal::SpinLock threadcache_lock_;
+
+  // Linked list of heap objects of live threads.
+  static ThreadCache* thread_heaps_ ABSL_GUARDED_BY(threadcache_lock_);
+  static int thread_heap_count_ ABSL_GUARDED_BY(threadcache_lock_);
+
+  // Heap objects of exited threads, linked through next_, for reuse by new
+  // threads.  Heap objects are never returned to threadcache_allocator(), so
+  // a pointer to one stays valid forever.
+  static ThreadCache* free_heaps_ ABSL_GUARDED_BY(threadcache_lock_);
 
-  // A pointer to one of the objects in thread_heaps_.  Represents
-  // the next ThreadCache from which a thread over its max_size_ should
-  // steal memory limit.  Round-robin through all of the objects in
-  // thread_heaps_.
-  static ThreadCache* next_memory_steal_ ABSL_GUARDED_BY(pageheap_lock);
+  // Every heap object ever allocated, live or free, linked through
+  // next_allocated_.  Threads walk this list without locking to find threads
+  // to steal cache budget from.
+  ABSL_CONST_INIT static std::atomic<ThreadCache*> all_heaps_;
+
+  // A pointer to one of the objects in all_heaps_.  Represents the next
+  // ThreadCache from which a thread over its max_size_ should steal memory
+  // limit.  Round-robin through all of the objects in all_heaps_.
+  ABSL_CONST_INIT static std::atomic<ThreadCache*> next_memory_steal_;
+
+  ABSL_CONST_INIT static std::atomic<size_t> reclaimed_caches_;
 
   // Overall thread cache size.
   static size_t overall_thread_cache_size_ ABSL_GUARDED_BY(pageheap_lock);
@@ -186,24 +237,33 @@ class ThreadCache {
   // Global per-thread cache size.
   static size_t per_thread_cache_size_ ABSL_GUARDED_BY(pageheap_lock);
 
-  // Represents overall_thread_cache_size_ minus the sum of max_size_
-  // across all ThreadCaches.
-  static int64_t unclaimed_cache_space_ ABSL_GUARDED_BY(pageheap_lock);
+  // Represents overall_thread_cache_size_ minus the sum of max_size_ -
+  // stolen_bytes_ across all ThreadCaches.
+  ABSL_CONST_INIT static std::atomic<int64_t> unclaimed_cache_space_;
+
+  ThreadCache() = default;
+
+  // Resets this heap object for use by thread <tid>.
+  void Init(pthread_t tid);
 
   // This class is laid out with the most frequently used fields
   // first so that hot elements are placed on the same cache line.
 
   FreeList list_[kNumClasses];  // Array indexed by size-class
 
-  size_t size_;      // Combined size of data
-  size_t max_size_;  // size_ > max_size_ --> Scavenge()
+  size_t size_;  // Combined size of data
+  // size_ > max_size_ --> Scavenge().  Only written by the owning thread, but
+  // read by threads looking for budget to steal.
+  std::atomic<size_t> max_size_;
 
   pthread_t tid_;
   bool in_setspecific_;
+  // Lets the background thread empty the cache of an idle owner: see State.
+  std::atomic<uint8_t> state_{kUsed};
 
   // Allocate a new heap.
   static ThreadCache* NewHeap(pthread_t tid)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+      ABSL_LOCKS_EXCLUDED(threadcache_lock_);
 
   // Use only as pthread thread-specific destructor function.
   static void DestroyThreadCache(void* ptr);
@@ -216,31 +276,52 @@ class ThreadCache {
   ThreadCache* next_;
   ThreadCache* prev_;
 
+  // Immutable once this heap object is published to all_heaps_.
+  ThreadCache* next_allocated_;
+
+  // Mailbox of budget stolen by other threads, not yet deducted from
+  // max_size_.  Kept on its own cache line so thieves do not contend with the
+  // owner's fast path.
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> stolen_bytes_;
+
   // Ensure that two instances of this class are never on the same cache line.
   // This is critical for performance, as false sharing would negate many of
   // the benefits of a per-thread cache.
   char padding_[ABSL_CACHELINE_SIZE];
 };
 
+inline ABSL_ATTRIBUTE_ALWAYS_INLINE void ThreadCache::Enter() {
+  uint8_t state = kUsed;
+  if (ABSL_PREDICT_FALSE(!state_.compare_exchange_strong(
+          state, kBusy, std::memory_order_acquire,
+          std::memory_order_relaxed))) {
+    EnterSlow();
+  }
+}
+
 inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* ThreadCache::Allocate(
     size_t size_class) {
   const size_t allocated_size = tc_globals.sizemap().class_to_size(size_class);
 
+  Enter();
   FreeList* list = &list_[size_class];
   void* ret;
   if (ABSL_PREDICT_TRUE(list->TryPop(&ret))) {
     size_ -= allocated_size;
-    return ret;
+  } else {
+    ret = FetchFromTransferCache(size_class, allocated_size);
   }
-
-  return FetchFromTransferCache(size_class, allocated_size);
+  Leave();
+  return ret;
 }
 
 inline void ABSL_ATTRIBUTE_ALWAYS_INLINE
 ThreadCache::Deallocate(void* ptr, size_t size_class) {
+  Enter();
   FreeList* list = &list_[size_class];
   size_ += tc_globals.sizemap().class_to_size(size_class);
-  ssize_t size_headroom = max_size_ - size_ - 1;
+  ssize_t size_headroom =
+      max_size_.load(std::memory_order_relaxed) - size_ - 1;
 
   list->Push(ptr);
   ssize_t list_headroom =
@@ -252,6 +333,7 @@ ThreadCache::Deallocate(void* ptr, size_t size_class) {
   if ((list_headroom | size_headroom) < 0) {
     DeallocateSlow(ptr, list, size_class);
   }
+  Leave();
 }
 
 inline ThreadCache* ABSL_ATTRIBUTE_ALWAYS_INLINE
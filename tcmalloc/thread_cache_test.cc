@@ -20,12 +20,16 @@
 #include <unistd.h>
 
 #include <limits>
+#include <optional>
 #include <string>
 #include <thread>  // NOLINT(build/c++11)
+#include <vector>
 
 #include "benchmark/benchmark.h"
 #include "gtest/gtest.h"
 #include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/memory_stats.h"
@@ -132,5 +136,55 @@ TEST_F(ThreadCacheTest, NoLeakOnThreadDestruction) {
       << "Before: " << start_size << " After: " << end_size;
 }
 
+// The background thread empties the caches of threads that stay idle, without
+// their cooperation.
+TEST_F(ThreadCacheTest, ReclaimsCachesOfIdleThreads) {
+  // Test only valid in per-thread mode
+  ASSERT_FALSE(MallocExtension::PerCpuCachesActive());
+
+  absl::Notification filled, done;
+  std::thread idle([&]() {
+    std::vector<void*> ptrs;
+    for (int i = 0; i < 1000; ++i) {
+      ptrs.push_back(::operator new(64));
+    }
+    for (void* ptr : ptrs) {
+      ::operator delete(ptr);
+    }
+    filled.Notify();
+    done.WaitForNotification();
+    // The reclaimed cache is usable again.
+    ::operator delete(::operator new(64));
+  });
+  filled.WaitForNotification();
+
+  auto thread_cache_free = []() {
+    std::optional<size_t> bytes =
+        MallocExtension::GetNumericProperty("tcmalloc.thread_cache_free");
+    CHECK_CONDITION(bytes.has_value());
+    return *bytes;
+  };
+  const size_t before = thread_cache_free();
+  ASSERT_GT(before, 0);
+
+  const absl::Duration sleep_interval =
+      MallocExtension::GetBackgroundProcessSleepInterval();
+  MallocExtension::SetBackgroundProcessSleepInterval(absl::Milliseconds(1));
+  std::thread background(MallocExtension::ProcessBackgroundActions);
+  const absl::Time deadline = absl::Now() + absl::Seconds(30);
+  while (thread_cache_free() >= before && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  EXPECT_LT(thread_cache_free(), before);
+
+  MallocExtension::SetBackgroundProcessActionsEnabled(false);
+  background.join();
+  MallocExtension::SetBackgroundProcessActionsEnabled(true);
+  MallocExtension::SetBackgroundProcessSleepInterval(sleep_interval);
+
+  done.Notify();
+  idle.join();
+}
+
 }  // namespace
 }  // namespace tcmalloc
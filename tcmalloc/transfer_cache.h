@@ -38,6 +38,7 @@
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/latency_stats.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/transfer_cache_stats.h"
 
@@ -93,6 +94,10 @@ class ShardedStaticForwarder : public StaticForwarder {
     return enable_cache_for_large_classes_only_;
   }
 
+  static bool AutoConfigureClasses() {
+    return Parameters::auto_sharded_transfer_cache();
+  }
+
  private:
   static bool use_generic_cache_;
   static bool enable_cache_for_large_classes_only_;
@@ -101,7 +106,8 @@ class ShardedStaticForwarder : public StaticForwarder {
 class ProdCpuLayout {
  public:
   static unsigned NumShards() { return CacheTopology::Instance().l3_count(); }
-  static int CurrentCpu() { return subtle::percpu::RseqCpuId(); }
+  // GetCurrentCpu also covers threads on the lock-based per-CPU fallback.
+  static int CurrentCpu() { return subtle::percpu::GetCurrentCpu(); }
   static unsigned CpuShard(int cpu) {
     return CacheTopology::Instance().GetL3FromCpuId(cpu);
   }
@@ -116,6 +122,9 @@ class BackingTransferCache {
   void InsertRange(absl::Span<void *> batch) const;
   ABSL_MUST_USE_RESULT int RemoveRange(void **batch, int n) const;
   int size_class() const { return size_class_; }
+  // The unsharded TransferCache's locks are acquired on their own.
+  void AcquireInternalLocks() {}
+  void ReleaseInternalLocks() {}
 
  private:
   int size_class_ = -1;
@@ -123,7 +132,13 @@ class BackingTransferCache {
 
 // This transfer-cache is set up to be sharded per L3 cache. It is backed by
 // the non-sharded "normal" TransferCacheManager.
-template <typename Manager, typename CpuLayout, typename FreeList>
+//
+// ShardCache selects the per-shard cache implementation.  The default, lock
+// based TransferCache may be replaced by LockFreeTransferCache, which avoids
+// taking a per-shard spinlock on every InsertRange/RemoveRange.
+template <typename Manager, typename CpuLayout, typename FreeList,
+          template <typename, typename> class ShardCache =
+              internal_transfer_cache::TransferCache>
 class ShardedTransferCacheManagerBase {
  public:
   constexpr ShardedTransferCacheManagerBase(Manager *owner,
@@ -138,6 +153,15 @@ class ShardedTransferCacheManagerBase {
   // node. kMinShardsAllowed is a workaround for now that hardcodes this.
   static constexpr int kMinShardsAllowed = 3;
 
+  // With auto-configuration, the generic sharded transfer cache may be used
+  // whenever there is more than one cache domain; UpdateActiveClasses picks
+  // the size classes that benefit.
+  static constexpr int kMinShardsForAutoConfiguration = 2;
+
+  // Size classes are sharded when an estimated kMinCrossShardTransfers batches
+  // per UpdateActiveClasses() pass would cross cache domains otherwise.
+  static constexpr uint64_t kMinCrossShardTransfers = 256;
+
   void Init() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
     owner_->Init();
     num_shards_ = cpu_layout_->NumShards();
@@ -162,13 +186,75 @@ class ShardedTransferCacheManagerBase {
       bool use_sharded_cache =
           UseCacheForLargeClassesOnly() ||
           (UseGenericCache() && (num_shards_ >= kMinShardsAllowed));
-      active_for_class_[size_class] =
-          use_sharded_cache && size_per_object >= min_size;
+      active_for_class_[size_class].store(
+          use_sharded_cache && size_per_object >= min_size,
+          std::memory_order_relaxed);
+      eligible_for_class_[size_class] =
+          should_use(size_class) ||
+          (UseGenericCache() && !UseCacheForLargeClassesOnly() &&
+           num_shards_ >= kMinShardsForAutoConfiguration &&
+           size_per_object > 0);
     }
   }
 
   bool should_use(int size_class) const {
-    return active_for_class_[size_class];
+    return active_for_class_[size_class].load(std::memory_order_relaxed);
+  }
+
+  // With auto-configuration enabled, chooses the size classes that use the
+  // generic sharded transfer cache from their traffic since the previous call.
+  // <backing_stats> returns the cumulative stats of the unsharded transfer
+  // cache for a size class.
+  //
+  // Without sharding, objects freed in one cache domain are as likely to be
+  // reused in any other, so a fraction (n-1)/n of the unsharded transfer cache
+  // operations of a size class cross domains.  With sharding, only the misses
+  // of the shards do.  A size class is sharded once its estimated cross-domain
+  // traffic reaches kMinCrossShardTransfers, and unsharded again once it cools
+  // to half of that or its shards miss more often than they hit.  The objects
+  // of a size class that is no longer sharded are returned by Plunder().
+  template <typename BackingStats>
+  void UpdateActiveClasses(BackingStats backing_stats) {
+    if (!Manager::AutoConfigureClasses() || !UseGenericCache() ||
+        UseCacheForLargeClassesOnly() ||
+        num_shards_ < kMinShardsForAutoConfiguration) {
+      return;
+    }
+    const double cross_fraction =
+        static_cast<double>(num_shards_ - 1) / num_shards_;
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      if (!eligible_for_class_[size_class]) continue;
+      TrafficSample &last = last_traffic_[size_class];
+      const TransferCacheStats backing = backing_stats(size_class);
+      const TransferCacheStats sharded = GetStats(size_class);
+      const uint64_t backing_ops = backing.insert_hits + backing.insert_misses +
+                                   backing.remove_hits + backing.remove_misses;
+      const uint64_t hits = sharded.insert_hits + sharded.remove_hits;
+      const uint64_t misses = sharded.insert_misses + sharded.remove_misses;
+      const uint64_t new_backing_ops = backing_ops - last.backing_ops;
+      const uint64_t new_hits = hits - last.sharded_hits;
+      const uint64_t new_misses = misses - last.sharded_misses;
+      last = {backing_ops, hits, misses};
+
+      if (!should_use(size_class)) {
+        if (new_backing_ops * cross_fraction >= kMinCrossShardTransfers) {
+          active_for_class_[size_class].store(true, std::memory_order_relaxed);
+        }
+      } else if ((new_hits + new_misses) * cross_fraction <
+                     kMinCrossShardTransfers / 2 ||
+                 new_hits < new_misses) {
+        active_for_class_[size_class].store(false, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Returns the number of size classes currently using the sharded cache.
+  int NumActiveClasses() const {
+    int active = 0;
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      active += should_use(size_class);
+    }
+    return active;
   }
 
   size_t TotalBytes() const {
@@ -221,6 +307,8 @@ class ShardedTransferCacheManagerBase {
                     : "INACTIVE");
     out->printf("Number of active sharded transfer caches: %3d\n",
                 NumActiveShards());
+    out->printf("Number of size classes using sharded transfer caches: %3d\n",
+                NumActiveClasses());
     out->printf("------------------------------------------------\n");
     uint64_t sharded_cumulative_bytes = 0;
     static constexpr double MiB = 1048576.0;
@@ -256,6 +344,7 @@ class ShardedTransferCacheManagerBase {
       entry.PrintI64("max_capacity", stats.max_capacity);
     }
     region->PrintI64("active_sharded_transfer_caches", NumActiveShards());
+    region->PrintI64("sharded_transfer_cache_classes", NumActiveClasses());
   }
 
   // Returns cumulative stats over all the shards of the sharded transfer cache.
@@ -278,6 +367,7 @@ class ShardedTransferCacheManagerBase {
   }
 
   int RemoveRange(int size_class, void **batch, size_t count) {
+    ScopedLatencyTimer timer(LatencyStage::kTransferCacheRemove, size_class);
     return get_cache(size_class).RemoveRange(size_class, batch, count);
   }
 
@@ -298,6 +388,42 @@ class ShardedTransferCacheManagerBase {
     }
   }
 
+  // Returns every object in the initialized shards to the non-sharded
+  // TransferCache.
+  void Drain() {
+    if (shards_ == nullptr || num_shards_ == 0) return;
+    for (int shard = 0; shard < num_shards_; ++shard) {
+      if (!shard_initialized(shard)) continue;
+      for (int size_class = 0; size_class < kNumClasses; ++size_class) {
+        TransferCache &cache = shards_[shard].transfer_caches[size_class];
+        cache.Drain(cache.freelist().size_class());
+      }
+    }
+  }
+
+  // Acquires and releases the locks of the initialized shards around fork().
+  void AcquireInternalLocks() {
+    if (shards_ == nullptr) return;
+    for (int shard = 0; shard < num_shards_; ++shard) {
+      if (!shard_initialized(shard)) continue;
+      for (int size_class = 0; size_class < kNumClasses; ++size_class) {
+        shards_[shard].transfer_caches[size_class].AcquireInternalLocks();
+      }
+      shards_[shard].locked_for_fork = true;
+    }
+  }
+
+  void ReleaseInternalLocks() {
+    if (shards_ == nullptr) return;
+    for (int shard = num_shards_ - 1; shard >= 0; --shard) {
+      if (!shards_[shard].locked_for_fork) continue;
+      shards_[shard].locked_for_fork = false;
+      for (int size_class = kNumClasses - 1; size_class >= 0; --size_class) {
+        shards_[shard].transfer_caches[size_class].ReleaseInternalLocks();
+      }
+    }
+  }
+
   int tc_length(int cpu, int size_class) const {
     if (shards_ == nullptr) return 0;
     const uint8_t shard = cpu_layout_->CpuShard(cpu);
@@ -321,8 +447,7 @@ class ShardedTransferCacheManagerBase {
   }
 
  private:
-  using TransferCache =
-      internal_transfer_cache::TransferCache<FreeList, Manager>;
+  using TransferCache = ShardCache<FreeList, Manager>;
 
   // Store the transfer cache pointers and information about whether they are
   // initialized next to each other.
@@ -337,6 +462,9 @@ class ShardedTransferCacheManagerBase {
     // We need to be able to tell whether a given shard is initialized, which
     // the `once_flag` API doesn't offer.
     std::atomic<bool> initialized;
+    // Whether AcquireInternalLocks() locked this shard, which may have been
+    // initialized since.
+    bool locked_for_fork = false;
   };
 
   struct Capacity {
@@ -352,7 +480,12 @@ class ShardedTransferCacheManagerBase {
   }
 
   Capacity ScaledCacheCapacity(size_t size_class) const {
-    if (!should_use(size_class)) return {0, 0};
+    // With auto-configuration, size classes may become sharded after the
+    // shard is initialized.
+    if (!should_use(size_class) &&
+        !(eligible_for_class_[size_class] && Manager::AutoConfigureClasses())) {
+      return {0, 0};
+    }
     auto [capacity, max_capacity] = TransferCache::CapacityNeeded(size_class);
     return {capacity, max_capacity};
   }
@@ -392,10 +525,20 @@ class ShardedTransferCacheManagerBase {
     return shard.transfer_caches[size_class];
   }
 
+  // Cumulative traffic of a size class seen by the last UpdateActiveClasses.
+  struct TrafficSample {
+    uint64_t backing_ops;
+    uint64_t sharded_hits;
+    uint64_t sharded_misses;
+  };
+
   Shard *shards_ = nullptr;
   int num_shards_ = 0;
   std::atomic<int> active_shards_ = 0;
-  bool active_for_class_[kNumClasses] = {false};
+  std::atomic<bool> active_for_class_[kNumClasses] = {};
+  // Whether auto-configuration may shard the size class.
+  bool eligible_for_class_[kNumClasses] = {false};
+  TrafficSample last_traffic_[kNumClasses] = {};
   Manager *const owner_;
   CpuLayout *const cpu_layout_;
 };
@@ -428,6 +571,7 @@ class TransferCacheManager : public StaticForwarder {
   }
 
   ABSL_MUST_USE_RESULT int RemoveRange(int size_class, void **batch, int n) {
+    ScopedLatencyTimer timer(LatencyStage::kTransferCacheRemove, size_class);
     return cache_[size_class].tc.RemoveRange(size_class, batch, n);
   }
 
@@ -470,10 +614,36 @@ class TransferCacheManager : public StaticForwarder {
     }
   }
 
+  // Returns every object in the transfer caches to the central free lists.
+  void Drain() {
+    for (int size_class = 0; size_class < kNumClasses; ++size_class) {
+      cache_[size_class].tc.Drain(size_class);
+    }
+  }
+
+  // Acquires and releases the locks of every size class around fork().
+  void AcquireInternalLocks() {
+    for (int size_class = 0; size_class < kNumClasses; ++size_class) {
+      cache_[size_class].tc.AcquireInternalLocks();
+    }
+  }
+
+  void ReleaseInternalLocks() {
+    for (int size_class = kNumClasses - 1; size_class >= 0; --size_class) {
+      cache_[size_class].tc.ReleaseInternalLocks();
+    }
+  }
+
   void InitCaches() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
     for (int i = 0; i < kNumClasses; ++i) {
-      new (&cache_[i].tc) TransferCache(
-          this, i, Parameters::use_all_buckets_for_few_object_spans_in_cfl());
+      if (Parameters::small_footprint()) {
+        new (&cache_[i].tc) TransferCache(
+            this, i, TransferCache::SmallFootprintCapacityNeeded(i),
+            Parameters::use_all_buckets_for_few_object_spans_in_cfl());
+      } else {
+        new (&cache_[i].tc) TransferCache(
+            this, i, Parameters::use_all_buckets_for_few_object_spans_in_cfl());
+      }
     }
   }
 
@@ -563,6 +733,7 @@ class TransferCacheManager {
   }
 
   ABSL_MUST_USE_RESULT int RemoveRange(int size_class, void** batch, int n) {
+    ScopedLatencyTimer timer(LatencyStage::kTransferCacheRemove, size_class);
     return freelist_[size_class].RemoveRange(batch, n);
   }
 
@@ -578,6 +749,18 @@ class TransferCacheManager {
     return freelist_[size_class];
   }
 
+  static constexpr void Drain() {}
+
+  void AcquireInternalLocks() {
+    for (int i = 0; i < kNumClasses; ++i) freelist_[i].AcquireInternalLocks();
+  }
+
+  void ReleaseInternalLocks() {
+    for (int i = kNumClasses - 1; i >= 0; --i) {
+      freelist_[i].ReleaseInternalLocks();
+    }
+  }
+
   void Print(Printer* out) const {}
   void PrintInPbtxt(PbtxtRegion* region) const {}
 
@@ -598,6 +781,9 @@ struct ShardedTransferCacheManager {
   static constexpr void InsertRange(int size_class, absl::Span<void*> batch) {}
   static constexpr size_t TotalBytes() { return 0; }
   static constexpr void Plunder() {}
+  static constexpr void Drain() {}
+  static constexpr void AcquireInternalLocks() {}
+  static constexpr void ReleaseInternalLocks() {}
   static int tc_length(int cpu, int size_class) { return 0; }
   static int TotalObjectsOfClass(int size_class) { return 0; }
   static constexpr TransferCacheStats GetStats(int size_class) { return {}; }
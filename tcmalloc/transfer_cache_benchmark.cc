@@ -35,6 +35,9 @@ using TransferCacheWithRealCFLEnv =
 using TransferCacheEnv =
     FakeTransferCacheEnvironment<internal_transfer_cache::TransferCache<
         MinimalFakeCentralFreeList, FakeTransferCacheManager>>;
+using LockFreeTransferCacheEnv =
+    FakeTransferCacheEnvironment<internal_transfer_cache::LockFreeTransferCache<
+        MinimalFakeCentralFreeList, FakeTransferCacheManager>>;
 static constexpr int kSizeClass = 0;
 
 template <typename Env>
@@ -226,12 +229,17 @@ void BM_RealisticHitRate(benchmark::State& state) {
       static_cast<double>(stats.remove_misses) / total_removes;
 }
 
-BENCHMARK_TEMPLATE(BM_CrossThread, TransferCacheEnv)->ThreadRange(2, 64);
+BENCHMARK_TEMPLATE(BM_CrossThread, TransferCacheEnv)->ThreadRange(1, 64);
+BENCHMARK_TEMPLATE(BM_CrossThread, LockFreeTransferCacheEnv)
+    ->ThreadRange(1, 64);
 BENCHMARK_TEMPLATE(BM_InsertRange, TransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RemoveRange, TransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RealisticBatchNonBatchMutations, TransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RealisticHitRate, TransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RealisticHitRate, TransferCacheWithRealCFLEnv);
+BENCHMARK_TEMPLATE(BM_InsertRange, LockFreeTransferCacheEnv);
+BENCHMARK_TEMPLATE(BM_RemoveRange, LockFreeTransferCacheEnv);
+BENCHMARK_TEMPLATE(BM_RealisticHitRate, LockFreeTransferCacheEnv);
 
 }  // namespace
 }  // namespace tcmalloc_internal
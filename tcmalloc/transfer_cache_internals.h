@@ -24,11 +24,14 @@
 #include <atomic>
 #include <cstddef>
 #include <cstring>
+#include <new>
+#include <utility>
 
 #include "absl/base/attributes.h"
 #include "absl/base/const_init.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/optimization.h"
+#include "absl/numeric/bits.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
@@ -47,6 +50,9 @@ struct alignas(8) SizeInfo {
 };
 static constexpr int kMaxCapacityInBatches = 64;
 static constexpr int kInitialCapacityInBatches = 16;
+// The limits of small-footprint mode (see Parameters::small_footprint).
+static constexpr int kSmallFootprintMaxCapacityInBatches = 4;
+static constexpr int kSmallFootprintInitialCapacityInBatches = 1;
 
 // Records counters for different types of misses.
 class MissCounts {
@@ -98,14 +104,27 @@ class TransferCache {
       : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
         low_water_mark_(0),
         slot_info_(SizeInfo({0, capacity.capacity})),
-        slots_(nullptr),
+        blocks_(nullptr),
         freelist_do_not_access_directly_(),
         owner_(owner),
         max_capacity_(capacity.max_capacity) {
     freelist().Init(size_class, use_all_buckets_for_few_object_spans);
-    slots_ = max_capacity_ != 0 ? reinterpret_cast<void **>(owner_->Alloc(
-                                      max_capacity_ * sizeof(void *)))
-                                : nullptr;
+    if (max_capacity_ == 0) return;
+
+    block_size_ = Manager::num_objects_to_move(size_class);
+    ASSERT(block_size_ > 0);
+    const size_t num_blocks = (max_capacity_ + block_size_ - 1) / block_size_;
+    blocks_ = reinterpret_cast<void ***>(
+        owner_->Alloc(num_blocks * sizeof(void **)));
+    void **storage = reinterpret_cast<void **>(owner_->Alloc(
+        (num_blocks + kSpareBlocks) * block_size_ * sizeof(void *)));
+    for (size_t i = 0; i < num_blocks; ++i) {
+      blocks_[i] = storage + i * block_size_;
+    }
+    for (int i = 0; i < kSpareBlocks; ++i) {
+      spare_blocks_[i].store(storage + (num_blocks + i) * block_size_,
+                             std::memory_order_relaxed);
+    }
   }
 
   TransferCache(const TransferCache &) = delete;
@@ -146,6 +165,18 @@ class TransferCache {
     return {capacity, max_capacity};
   }
 
+  // As CapacityNeeded, with the smaller limits of small-footprint mode.
+  static Capacity SmallFootprintCapacityNeeded(size_t size_class) {
+    auto [capacity, max_capacity] = CapacityNeeded(size_class);
+    if (max_capacity == 0) return {0, 0};
+    const int objs_to_move = Manager::num_objects_to_move(size_class);
+    max_capacity = std::min(
+        max_capacity, kSmallFootprintMaxCapacityInBatches * objs_to_move);
+    capacity = std::min(
+        capacity, kSmallFootprintInitialCapacityInBatches * objs_to_move);
+    return {capacity, max_capacity};
+  }
+
   // These methods all do internal locking.
 
   // Insert the specified batch into the transfer cache.  N is the number of
@@ -156,6 +187,8 @@ class TransferCache {
     ASSERT(0 < N && N <= kMaxObjectsToMove);
     auto info = slot_info_.load(std::memory_order_relaxed);
     if (info.capacity > info.used) {
+      if (N == block_size_ && InsertBlock(batch)) return;
+
       AllocationGuardSpinLockHolder h(&lock_);
       // As caches are resized in the background, we do not attempt to grow
       // them here. Instead, we just check if they have spare free capacity.
@@ -164,8 +197,7 @@ class TransferCache {
       if (got > 0) {
         info.used += got;
         SetSlotInfo(info);
-        void **entry = GetSlot(info.used - got);
-        memcpy(entry, batch.data(), sizeof(void *) * got);
+        CopyToSlots(info.used - got, batch.data(), got);
         insert_hits_.LossyAdd(1);
         if (got == N) {
           return;
@@ -187,6 +219,8 @@ class TransferCache {
     ASSERT(0 < N && N <= kMaxObjectsToMove);
     auto info = slot_info_.load(std::memory_order_relaxed);
     if (info.used) {
+      if (N == block_size_ && RemoveBlock(batch)) return N;
+
       AllocationGuardSpinLockHolder h(&lock_);
       // Refetch with the lock
       info = slot_info_.load(std::memory_order_relaxed);
@@ -194,8 +228,7 @@ class TransferCache {
       if (got) {
         info.used -= got;
         SetSlotInfo(info);
-        void **entry = GetSlot(info.used);
-        memcpy(batch, entry, sizeof(void *) * got);
+        CopyFromSlots(info.used, batch, got);
         remove_hits_.LossyAdd(1);
         low_water_mark_ = std::min(low_water_mark_, info.used);
         return got;
@@ -228,8 +261,7 @@ class TransferCache {
       if (num_to_move == 0) break;
 
       void *buf[kMaxObjectsToMove];
-      void **const entry = GetSlot(info.used - num_to_move);
-      memcpy(buf, entry, sizeof(void *) * num_to_move);
+      CopyFromSlots(info.used - num_to_move, buf, num_to_move);
       info.used -= num_to_move;
       to_return -= num_to_move;
       low_water_mark_ = info.used;
@@ -241,6 +273,26 @@ class TransferCache {
     }
     lock_.Unlock();
   }
+  // Returns every object in the transfer cache to the freelist.
+  void Drain(int size_class) ABSL_LOCKS_EXCLUDED(lock_) {
+    const int B = Manager::num_objects_to_move(size_class);
+    while (true) {
+      void *buf[kMaxObjectsToMove];
+      int n;
+      {
+        AllocationGuardSpinLockHolder h(&lock_);
+        SizeInfo info = GetSlotInfo();
+        n = std::min(B, info.used);
+        if (n == 0) break;
+        info.used -= n;
+        CopyFromSlots(info.used, buf, n);
+        low_water_mark_ = std::min(low_water_mark_, info.used);
+        SetSlotInfo(info);
+      }
+      freelist().InsertRange({buf, static_cast<size_t>(n)});
+    }
+  }
+
   // Returns the number of free objects in the transfer cache.
   size_t tc_length() const {
     return static_cast<size_t>(slot_info_.load(std::memory_order_relaxed).used);
@@ -334,7 +386,7 @@ class TransferCache {
       low_water_mark_ = std::min(low_water_mark_, info.used);
       // Our internal slot array may get overwritten as soon as we drop the
       // lock, so copy the items to free to an on stack buffer.
-      memcpy(to_free, GetSlot(info.used), sizeof(void *) * num_to_free);
+      CopyFromSlots(info.used, to_free, num_to_free);
     }
 
     // Access the freelist without holding the lock.
@@ -350,10 +402,135 @@ class TransferCache {
 
   int32_t max_capacity() const { return max_capacity_; }
 
+  // Acquires and releases lock_ and the central freelist's locks around
+  // fork().
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    lock_.Lock();
+    freelist().AcquireInternalLocks();
+  }
+
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    freelist().ReleaseInternalLocks();
+    lock_.Unlock();
+  }
+
  private:
-  // Returns first object of the i-th slot.
-  void **GetSlot(size_t i) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
-    return slots_ + i;
+  // Spare blocks, for handing whole batches over without copying them under
+  // the lock.  Calls that find none left copy under the lock instead.
+  static constexpr int kSpareBlocks = 2;
+
+  // Calls f(slot) for each of slots [first, first + n), from the top down.
+  template <typename F>
+  void ForEachSlotFromTop(size_t first, size_t n, F f)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    size_t end = first + n;
+    while (end > first) {
+      const size_t block = (end - 1) / block_size_;
+      const size_t begin = std::max(first, block * block_size_);
+      void **entry = blocks_[block] + (end - block * block_size_);
+      for (size_t i = begin; i < end; ++i) f(*--entry);
+      end = begin;
+    }
+  }
+
+  // The slots are a stack of objects, the most recently inserted on top.
+  // Batches list their objects most recently freed first, as they come off the
+  // per-cpu slabs, so they are stored reversed: a batch removed from the top
+  // then starts with the objects most likely to still be in cache, even when
+  // it is smaller than the batch that was inserted.
+  //
+  // Copies <batch> to slots [first, first + n).
+  void CopyToSlots(size_t first, void *const *batch, size_t n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    ForEachSlotFromTop(first, n, [&](void *&slot) { slot = *batch++; });
+  }
+
+  // Copies slots [first, first + n) to <batch>, the top one first.
+  void CopyFromSlots(size_t first, void **batch, size_t n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    ForEachSlotFromTop(first, n, [&](void *&slot) { *batch++ = slot; });
+  }
+
+  // The slots are kept in blocks of block_size_, so that a whole batch can be
+  // handed over by swapping the block that holds it with a spare one: the
+  // objects are copied outside the lock, to or from a block that the caller
+  // owns while it does so.  This needs the stack to end on a block boundary;
+  // otherwise the batch is copied under the lock as usual.
+
+  // Inserts <batch>, of block_size_ objects, as a block.  Returns false if it
+  // did not, and the batch is left to the caller.
+  bool InsertBlock(absl::Span<void *const> batch) ABSL_LOCKS_EXCLUDED(lock_) {
+    void **block = TakeSpareBlock();
+    if (block == nullptr) return false;
+    void **entry = block + block_size_;
+    for (void *object : batch) *--entry = object;
+
+    bool inserted;
+    {
+      AllocationGuardSpinLockHolder h(&lock_);
+      SizeInfo info = GetSlotInfo();
+      inserted = info.capacity - info.used >= block_size_ &&
+                 info.used % block_size_ == 0;
+      if (inserted) {
+        std::swap(blocks_[info.used / block_size_], block);
+        info.used += block_size_;
+        SetSlotInfo(info);
+        insert_hits_.LossyAdd(1);
+      }
+    }
+    ReturnSpareBlock(block);
+    return inserted;
+  }
+
+  // Removes a block of block_size_ objects into <batch>.  Returns false if it
+  // did not.
+  bool RemoveBlock(void **batch) ABSL_LOCKS_EXCLUDED(lock_) {
+    void **block = TakeSpareBlock();
+    if (block == nullptr) return false;
+
+    bool removed;
+    {
+      AllocationGuardSpinLockHolder h(&lock_);
+      SizeInfo info = GetSlotInfo();
+      removed = info.used >= block_size_ && info.used % block_size_ == 0;
+      if (removed) {
+        info.used -= block_size_;
+        std::swap(blocks_[info.used / block_size_], block);
+        SetSlotInfo(info);
+        remove_hits_.LossyAdd(1);
+        low_water_mark_ = std::min(low_water_mark_, info.used);
+      }
+    }
+    if (removed) {
+      void **entry = block + block_size_;
+      for (int i = 0; i < block_size_; ++i) batch[i] = *--entry;
+    }
+    ReturnSpareBlock(block);
+    return removed;
+  }
+
+  void **TakeSpareBlock() {
+    for (auto &spare : spare_blocks_) {
+      if (spare.load(std::memory_order_relaxed) == nullptr) continue;
+      void **block = spare.exchange(nullptr, std::memory_order_acquire);
+      if (block != nullptr) return block;
+    }
+    return nullptr;
+  }
+
+  // There are as many places for spare blocks as there are spare blocks, so
+  // the caller finds one free.
+  void ReturnSpareBlock(void **block) {
+    while (true) {
+      for (auto &spare : spare_blocks_) {
+        void **expected = nullptr;
+        if (spare.compare_exchange_strong(expected, block,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+          return;
+        }
+      }
+    }
   }
 
   void SetSlotInfo(SizeInfo info) {
@@ -384,14 +561,16 @@ class TransferCache {
   StatsCounter insert_hits_;
   StatsCounter remove_hits_;
 
-  // Number of currently used and available cached entries in slots_. This
+  // Number of currently used and available cached entries in the slots. This
   // variable is updated under a lock but can be read without one.
   // INVARIANT: [0 <= slot_info_.used <= slot_info.capacity <= max_cache_slots_]
   std::atomic<SizeInfo> slot_info_;
 
-  // Pointer to array of free objects.  Use GetSlot() to get pointers to
-  // entries.
-  void **slots_ ABSL_GUARDED_BY(lock_);
+  // The blocks of block_size_ slots that hold the free objects, bottom
+  // first.  Use ForEachSlotFromTop() to get at the slots.
+  void ***blocks_ ABSL_GUARDED_BY(lock_);
+  int32_t block_size_ = 0;
+  std::atomic<void **> spare_blocks_[kSpareBlocks] = {};
 
   FreeList freelist_do_not_access_directly_;
 
@@ -412,6 +591,399 @@ class TransferCache {
   MissCounts remove_object_misses_;
 } ABSL_CACHELINE_ALIGNED;
 
+// LockFreeTransferCache is a drop-in alternative to TransferCache that avoids
+// taking a lock on InsertRange and RemoveRange.  Objects are kept in a bounded
+// multi-producer multi-consumer ring of batches (after Vyukov's bounded MPMC
+// queue): each cell holds up to num_objects_to_move(size_class) objects, and
+// producers and consumers claim cells with a single CAS on the enqueue or
+// dequeue position.  Capacity accounting is done with CAS on slot_info_, which
+// always counts at least the objects that are present in the ring.
+//
+// The ring is sized for twice the number of full batches that fit in
+// max_capacity, so that partial batches do not exhaust the cells before the
+// object capacity is reached.  Objects are handed out in FIFO order of
+// batches rather than LIFO.
+template <typename CentralFreeList, typename TransferCacheManager>
+class LockFreeTransferCache {
+ public:
+  using Manager = TransferCacheManager;
+  using FreeList = CentralFreeList;
+  using Capacity =
+      typename TransferCache<CentralFreeList, TransferCacheManager>::Capacity;
+
+  LockFreeTransferCache(Manager *owner, int size_class,
+                        bool use_all_buckets_for_few_object_spans)
+      : LockFreeTransferCache(owner, size_class, CapacityNeeded(size_class),
+                              use_all_buckets_for_few_object_spans) {}
+
+  LockFreeTransferCache(Manager *owner, int size_class, Capacity capacity,
+                        bool use_all_buckets_for_few_object_spans)
+      : low_water_mark_(0),
+        slot_info_(SizeInfo({0, capacity.capacity})),
+        freelist_do_not_access_directly_(),
+        owner_(owner),
+        max_capacity_(capacity.max_capacity) {
+    freelist().Init(size_class, use_all_buckets_for_few_object_spans);
+    if (max_capacity_ == 0) return;
+
+    batch_size_ = Manager::num_objects_to_move(size_class);
+    ASSERT(batch_size_ > 0);
+    size_t batches = (max_capacity_ + batch_size_ - 1) / batch_size_;
+    num_cells_ = size_t{1} << absl::bit_width(2 * batches - 1);
+    cells_ = reinterpret_cast<Cell *>(owner_->Alloc(num_cells_ * sizeof(Cell)));
+    slots_ = reinterpret_cast<void **>(
+        owner_->Alloc(num_cells_ * batch_size_ * sizeof(void *)));
+    for (size_t i = 0; i < num_cells_; ++i) {
+      new (&cells_[i]) Cell;
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  LockFreeTransferCache(const LockFreeTransferCache &) = delete;
+  LockFreeTransferCache &operator=(const LockFreeTransferCache &) = delete;
+
+  static Capacity CapacityNeeded(size_t size_class) {
+    return TransferCache<CentralFreeList,
+                         TransferCacheManager>::CapacityNeeded(size_class);
+  }
+
+  // Insert the specified batch into the transfer cache.  N is the number of
+  // elements in the range.  RemoveRange() is the opposite operation.
+  void InsertRange(int size_class, absl::Span<void *> batch) {
+    const int N = batch.size();
+    ASSERT(0 < N && N <= kMaxObjectsToMove);
+    const int reserved = Reserve(N);
+    if (reserved > 0) {
+      int inserted = 0;
+      while (inserted < reserved) {
+        const int n = std::min(batch_size_, reserved - inserted);
+        if (!Enqueue({batch.data() + inserted, static_cast<size_t>(n)})) break;
+        inserted += n;
+      }
+      if (inserted < reserved) Release(reserved - inserted);
+      if (inserted > 0) {
+        insert_hits_.LossyAdd(1);
+        if (inserted == N) return;
+        batch = {batch.data() + inserted, batch.size() - inserted};
+      }
+    }
+
+    insert_misses_.LossyAdd(1);
+    insert_object_misses_.Inc(batch.size());
+
+    freelist().InsertRange(batch);
+  }
+
+  // Returns the actual number of fetched elements and stores elements in the
+  // batch.
+  ABSL_MUST_USE_RESULT int RemoveRange(int size_class, void **batch, int N) {
+    ASSERT(0 < N && N <= kMaxObjectsToMove);
+    if (GetSlotInfo().used > 0) {
+      const int got = DequeueObjects(batch, N);
+      if (got > 0) {
+        Release(got);
+        remove_hits_.LossyAdd(1);
+        return got;
+      }
+    }
+
+    remove_misses_.LossyAdd(1);
+    remove_object_misses_.Inc(N);
+    return freelist().RemoveRange(batch, N);
+  }
+
+  // Returns the objects that stayed below the low water mark since the last
+  // call to the freelist.  See TransferCache::TryPlunder.
+  void TryPlunder(int size_class) {
+    if (max_capacity_ == 0) return;
+
+    int to_return = low_water_mark_.exchange(GetSlotInfo().used,
+                                             std::memory_order_relaxed);
+    while (to_return > 0) {
+      void *buf[kMaxObjectsToMove];
+      const int got = DequeueObjects(buf, std::min(batch_size_, to_return));
+      if (got == 0) break;
+      Release(got);
+      to_return -= got;
+      freelist().InsertRange({buf, static_cast<size_t>(got)});
+    }
+  }
+
+  // Returns every object in the transfer cache to the freelist.
+  void Drain(int size_class) {
+    while (true) {
+      void *buf[kMaxObjectsToMove];
+      const int got = DequeueObjects(buf, batch_size_);
+      if (got == 0) break;
+      Release(got);
+      freelist().InsertRange({buf, static_cast<size_t>(got)});
+    }
+    low_water_mark_.store(0, std::memory_order_relaxed);
+  }
+
+  // Returns the number of free objects in the transfer cache.
+  size_t tc_length() const {
+    return static_cast<size_t>(slot_info_.load(std::memory_order_relaxed).used);
+  }
+
+  // Fetches the misses for the latest interval and commits them to the total.
+  size_t FetchCommitIntervalMisses() {
+    return insert_object_misses_.Commit() + remove_object_misses_.Commit();
+  }
+
+  // Returns the number of transfer cache insert/remove hits/misses.
+  TransferCacheStats GetStats() const {
+    TransferCacheStats stats;
+
+    stats.insert_hits = insert_hits_.value();
+    stats.remove_hits = remove_hits_.value();
+    stats.insert_misses = insert_misses_.value();
+    stats.insert_object_misses = insert_object_misses_.Total();
+    stats.remove_misses = remove_misses_.value();
+    stats.remove_object_misses = remove_object_misses_.Total();
+
+    auto info = slot_info_.load(std::memory_order_relaxed);
+    stats.used = info.used;
+    stats.capacity = info.capacity;
+    stats.max_capacity = max_capacity_;
+
+    return stats;
+  }
+
+  SizeInfo GetSlotInfo() const {
+    return slot_info_.load(std::memory_order_relaxed);
+  }
+
+  // Increases capacity of the cache by a batch size. Returns true if it
+  // succeeded at growing the cache by a batch size. Else, returns false.
+  bool IncreaseCacheCapacity(int size_class) {
+    const int n = Manager::num_objects_to_move(size_class);
+    SizeInfo info = GetSlotInfo();
+    do {
+      if (info.capacity + n > max_capacity_) return false;
+    } while (!slot_info_.compare_exchange_weak(
+        info, SizeInfo({info.used, info.capacity + n}),
+        std::memory_order_relaxed));
+    return true;
+  }
+
+  // Checks if the cache capacity may be increased by a batch size.
+  bool CanIncreaseCapacity(int size_class) const {
+    int n = Manager::num_objects_to_move(size_class);
+    auto info = GetSlotInfo();
+    return max_capacity_ - info.capacity >= n;
+  }
+
+  // Checks if the cache has at least batch size number of free slots. Returns
+  // false if (capacity - used) slots is less than the batch size.
+  bool HasSpareCapacity(int size_class) const {
+    int n = Manager::num_objects_to_move(size_class);
+    auto info = GetSlotInfo();
+    return info.capacity - info.used >= n;
+  }
+
+  // Tries to shrink the Cache by a batch size.  Return false if it failed to
+  // shrink the cache.
+  bool ShrinkCache(int size_class) {
+    const int N = Manager::num_objects_to_move(size_class);
+
+    SizeInfo info = GetSlotInfo();
+    while (info.capacity > N && info.capacity - info.used >= N) {
+      if (slot_info_.compare_exchange_weak(
+              info, SizeInfo({info.used, info.capacity - N}),
+              std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    if (info.capacity <= N) return false;
+
+    // Evict enough objects to make room, then give back the capacity.  If we
+    // raced with a RemoveRange, we may have evicted fewer objects than asked
+    // for; capacity never drops below the number of used objects.
+    void *to_free[kMaxObjectsToMove];
+    const int num_to_free =
+        DequeueObjects(to_free, N - (info.capacity - info.used));
+    SizeInfo next;
+    info = GetSlotInfo();
+    do {
+      next.used = info.used - num_to_free;
+      next.capacity = std::max(info.capacity - N, next.used);
+    } while (!slot_info_.compare_exchange_weak(info, next,
+                                               std::memory_order_relaxed));
+    UpdateLowWaterMark(next.used);
+
+    if (num_to_free > 0) {
+      freelist().InsertRange({to_free, static_cast<size_t>(num_to_free)});
+    }
+    return next.capacity < info.capacity;
+  }
+
+  // This is a thin wrapper for the CentralFreeList.
+  ABSL_ATTRIBUTE_ALWAYS_INLINE FreeList &freelist() {
+    return freelist_do_not_access_directly_;
+  }
+
+  int32_t max_capacity() const { return max_capacity_; }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    int32_t count;
+  };
+
+  void **GetCellSlots(size_t pos) {
+    return slots_ + (pos & (num_cells_ - 1)) * batch_size_;
+  }
+
+  // Pushes a batch of at most batch_size_ objects onto the ring.  Returns
+  // false if the ring has no free cell.
+  bool Enqueue(absl::Span<void *> batch) {
+    ASSERT(batch.size() <= batch_size_);
+    if (num_cells_ == 0) return false;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells_[pos & (num_cells_ - 1)];
+      const size_t seq = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->count = batch.size();
+    memcpy(GetCellSlots(pos), batch.data(), sizeof(void *) * batch.size());
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pops one batch off the ring into `batch`, which must have room for
+  // batch_size_ objects.  Returns the number of objects popped.
+  int Dequeue(void **batch) {
+    if (num_cells_ == 0) return 0;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &cells_[pos & (num_cells_ - 1)];
+      const size_t seq = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return 0;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    const int count = cell->count;
+    memcpy(batch, GetCellSlots(pos), sizeof(void *) * count);
+    cell->sequence.store(pos + num_cells_, std::memory_order_release);
+    return count;
+  }
+
+  // Takes up to N objects off the ring without updating slot_info_.  Objects
+  // of a partially consumed batch are pushed back onto the ring, or handed to
+  // the freelist (and released) if the ring has since filled up.
+  int DequeueObjects(void **batch, int N) {
+    int got = 0;
+    while (got < N) {
+      void *buf[kMaxObjectsToMove];
+      const int count = Dequeue(buf);
+      if (count == 0) break;
+      const int take = std::min(count, N - got);
+      memcpy(batch + got, buf, sizeof(void *) * take);
+      got += take;
+      if (take < count) {
+        absl::Span<void *> rest = {buf + take,
+                                   static_cast<size_t>(count - take)};
+        if (!Enqueue(rest)) {
+          Release(rest.size());
+          freelist().InsertRange(rest);
+        }
+      }
+    }
+    return got;
+  }
+
+  // Reserves room for up to N objects.  Returns the number reserved.
+  int Reserve(int N) {
+    SizeInfo info = GetSlotInfo();
+    int got;
+    do {
+      got = std::min(N, info.capacity - info.used);
+      if (got <= 0) return 0;
+    } while (!slot_info_.compare_exchange_weak(
+        info, SizeInfo({info.used + got, info.capacity}),
+        std::memory_order_relaxed));
+    return got;
+  }
+
+  // Releases N objects that have left the cache.
+  void Release(int N) {
+    SizeInfo info = GetSlotInfo();
+    SizeInfo next;
+    do {
+      ASSERT(info.used >= N);
+      next = SizeInfo({info.used - N, info.capacity});
+    } while (!slot_info_.compare_exchange_weak(info, next,
+                                               std::memory_order_relaxed));
+    UpdateLowWaterMark(next.used);
+  }
+
+  void UpdateLowWaterMark(int used) {
+    int mark = low_water_mark_.load(std::memory_order_relaxed);
+    while (used < mark && !low_water_mark_.compare_exchange_weak(
+                              mark, used, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Producers and consumers claim cells through these positions; keep them on
+  // separate cachelines.
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> enqueue_pos_ = 0;
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> dequeue_pos_ = 0;
+
+  // Lowest value of "slot_info_.used" since last call to TryPlunder.
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<int> low_water_mark_;
+
+  // Number of currently used and available cached entries.  used counts
+  // objects reserved by in-flight inserts, so it is never less than the
+  // number of objects in the ring.
+  // INVARIANT: [0 <= slot_info_.used <= slot_info.capacity <= max_capacity_]
+  std::atomic<SizeInfo> slot_info_;
+
+  Cell *cells_ = nullptr;
+  void **slots_ = nullptr;
+  size_t num_cells_ = 0;
+  int batch_size_ = 0;
+
+  FreeList freelist_do_not_access_directly_;
+
+  Manager *const owner_;
+
+  // Maximum size of the cache.
+  const int32_t max_capacity_;
+
+  // For these we are deliberately fast-and-loose. Some increments may be lost.
+  StatsCounter insert_hits_;
+  StatsCounter remove_hits_;
+  StatsCounter insert_misses_;
+  StatsCounter remove_misses_;
+
+  MissCounts insert_object_misses_;
+  MissCounts remove_object_misses_;
+} ABSL_CACHELINE_ALIGNED;
+
 template <typename Manager>
 void ResizeCaches(Manager &manager, int start_size_class) {
   ASSERT(start_size_class >= 0);
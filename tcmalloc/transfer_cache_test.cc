@@ -662,12 +662,149 @@ TEST(ShardedTransferCacheManagerTest, ShardsOnDemand) {
   }
 }
 
+TEST(ShardedTransferCacheManagerTest, AutoConfiguresClasses) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  using ShardedManager = FakeShardedTransferCacheEnvironment::ShardedManager;
+  // Fewer domains than the fixed rule shards for.
+  constexpr int kNumShards = ShardedManager::kMinShardsForAutoConfiguration;
+  static_assert(kNumShards < ShardedManager::kMinShardsAllowed);
+  FakeShardedTransferCacheManager::SetCacheForLargeClassesOnly(false);
+  FakeShardedTransferCacheManager::SetAutoConfigureClasses(true);
+  FakeShardedTransferCacheEnvironment env(kNumShards,
+                                          /*use_generic_cache=*/true);
+  ShardedManager& manager = env.sharded_manager();
+  env.transfer_cache_manager().SetPartialLegacyTransferCache(true);
+  EXPECT_FALSE(manager.should_use(kSizeClass));
+
+  // Heavy traffic at the unsharded transfer cache shards the size class.
+  TransferCacheStats backing = {};
+  auto backing_stats = [&](int size_class) {
+    return size_class == kSizeClass ? backing : TransferCacheStats{};
+  };
+  backing.insert_misses = 2 * ShardedManager::kMinCrossShardTransfers;
+  backing.remove_misses = 2 * ShardedManager::kMinCrossShardTransfers;
+  manager.UpdateActiveClasses(backing_stats);
+  EXPECT_TRUE(manager.should_use(kSizeClass));
+  EXPECT_FALSE(manager.should_use(kSizeClass + 1));
+  EXPECT_EQ(manager.NumActiveClasses(), 1);
+
+  // The shards are sized for the size class.
+  void* ptr;
+  env.central_freelist().AllocateBatch(&ptr, 1);
+  env.SetCurrentCpu(0);
+  manager.Push(kSizeClass, ptr);
+  EXPECT_EQ(manager.tc_length(0, kSizeClass), 1);
+
+  // Without further traffic, it is unsharded again.
+  manager.UpdateActiveClasses(backing_stats);
+  EXPECT_FALSE(manager.should_use(kSizeClass));
+
+  // Without auto-configuration, the configuration is fixed.
+  FakeShardedTransferCacheManager::SetAutoConfigureClasses(false);
+  backing.insert_misses += 4 * ShardedManager::kMinCrossShardTransfers;
+  manager.UpdateActiveClasses(backing_stats);
+  EXPECT_FALSE(manager.should_use(kSizeClass));
+}
+
 namespace unit_tests {
 using Env = FakeTransferCacheEnvironment<internal_transfer_cache::TransferCache<
     MockCentralFreeList, FakeTransferCacheManager>>;
 INSTANTIATE_TYPED_TEST_SUITE_P(TransferCache, TransferCacheTest,
                                ::testing::Types<Env>);
 
+using LockFreeEnv =
+    FakeTransferCacheEnvironment<internal_transfer_cache::LockFreeTransferCache<
+        MockCentralFreeList, FakeTransferCacheManager>>;
+INSTANTIATE_TYPED_TEST_SUITE_P(LockFreeTransferCache, TransferCacheTest,
+                               ::testing::Types<LockFreeEnv>);
+
+// Batches list their objects most recently freed first, and the transfer cache
+// hands them out in that order, even in smaller batches.
+TEST(TransferCacheOrderTest, HandsOutMostRecentlyFreedFirst) {
+  const int batch_size = Env::kBatchSize;
+  ASSERT_GE(batch_size, 2);
+  Env e;
+  EXPECT_CALL(e.central_freelist(), InsertRange).Times(0);
+  EXPECT_CALL(e.central_freelist(), RemoveRange).Times(0);
+
+  char storage[kMaxObjectsToMove];
+  void* objects[kMaxObjectsToMove];
+  for (int i = 0; i < batch_size; ++i) objects[i] = &storage[i];
+  e.transfer_cache().InsertRange(kSizeClass, {objects, size_t(batch_size)});
+
+  const int half = batch_size / 2;
+  void* got[kMaxObjectsToMove];
+  ASSERT_EQ(e.transfer_cache().RemoveRange(kSizeClass, got, half), half);
+  for (int i = 0; i < half; ++i) EXPECT_EQ(got[i], objects[i]);
+  const int rest = batch_size - half;
+  ASSERT_EQ(e.transfer_cache().RemoveRange(kSizeClass, got, rest), rest);
+  for (int i = 0; i < rest; ++i) EXPECT_EQ(got[i], objects[half + i]);
+}
+
+// Whole batches are handed over as blocks when the cache ends on a batch
+// boundary, and copied otherwise, with the same results either way.
+TEST(TransferCacheOrderTest, WholeBatchesKeepTheirOrder) {
+  const int batch_size = Env::kBatchSize;
+  ASSERT_GE(batch_size, 2);
+  Env e;
+  EXPECT_CALL(e.central_freelist(), InsertRange).Times(0);
+  EXPECT_CALL(e.central_freelist(), RemoveRange).Times(0);
+
+  char storage[2 * kMaxObjectsToMove];
+  void* objects[2 * kMaxObjectsToMove];
+  for (int i = 0; i < 2 * batch_size; ++i) objects[i] = &storage[i];
+  const int half = batch_size / 2;
+  void* got[kMaxObjectsToMove];
+
+  // Aligned: both batches are inserted and removed as blocks.
+  e.transfer_cache().InsertRange(kSizeClass, {objects, size_t(batch_size)});
+  e.transfer_cache().InsertRange(kSizeClass,
+                                 {objects + batch_size, size_t(batch_size)});
+  EXPECT_EQ(e.transfer_cache().tc_length(), 2 * batch_size);
+  ASSERT_EQ(e.transfer_cache().RemoveRange(kSizeClass, got, batch_size),
+            batch_size);
+  for (int i = 0; i < batch_size; ++i) {
+    EXPECT_EQ(got[i], objects[batch_size + i]);
+  }
+
+  // Unaligned: the second batch straddles two blocks.
+  e.transfer_cache().InsertRange(kSizeClass,
+                                 {objects + batch_size, size_t(half)});
+  e.transfer_cache().InsertRange(kSizeClass,
+                                 {objects + batch_size, size_t(batch_size)});
+  ASSERT_EQ(e.transfer_cache().RemoveRange(kSizeClass, got, batch_size),
+            batch_size);
+  for (int i = 0; i < batch_size; ++i) {
+    EXPECT_EQ(got[i], objects[batch_size + i]);
+  }
+  ASSERT_EQ(e.transfer_cache().RemoveRange(kSizeClass, got, half), half);
+  for (int i = 0; i < half; ++i) EXPECT_EQ(got[i], objects[batch_size + i]);
+  ASSERT_EQ(e.transfer_cache().RemoveRange(kSizeClass, got, batch_size),
+            batch_size);
+  for (int i = 0; i < batch_size; ++i) EXPECT_EQ(got[i], objects[i]);
+  EXPECT_EQ(e.transfer_cache().tc_length(), 0);
+}
+
+TEST(TransferCacheCapacityTest, SmallFootprint) {
+  using TransferCache = Env::TransferCache;
+  const auto normal = TransferCache::CapacityNeeded(kSizeClass);
+  const auto small = TransferCache::SmallFootprintCapacityNeeded(kSizeClass);
+  const int batch_size = Env::kBatchSize;
+  const int max_batches =
+      internal_transfer_cache::kSmallFootprintMaxCapacityInBatches;
+  EXPECT_EQ(small.capacity, std::min(normal.capacity, batch_size));
+  EXPECT_EQ(small.max_capacity,
+            std::min(normal.max_capacity, max_batches * batch_size));
+  EXPECT_LT(small.max_capacity, normal.max_capacity);
+
+  const auto none = TransferCache::SmallFootprintCapacityNeeded(0);
+  EXPECT_EQ(none.capacity, 0);
+  EXPECT_EQ(none.max_capacity, 0);
+}
+
 }  // namespace unit_tests
 
 namespace fuzz_tests {
@@ -678,6 +815,12 @@ using Env = FakeTransferCacheEnvironment<internal_transfer_cache::TransferCache<
     MockCentralFreeList, FakeTransferCacheManager>>;
 INSTANTIATE_TYPED_TEST_SUITE_P(TransferCache, FuzzTest, ::testing::Types<Env>);
 
+using LockFreeEnv =
+    FakeTransferCacheEnvironment<internal_transfer_cache::LockFreeTransferCache<
+        MockCentralFreeList, FakeTransferCacheManager>>;
+INSTANTIATE_TYPED_TEST_SUITE_P(LockFreeTransferCache, FuzzTest,
+                               ::testing::Types<LockFreeEnv>);
+
 }  // namespace fuzz_tests
 
 namespace resize_tests {
@@ -0,0 +1,138 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/type_partitions.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT TypePartitions type_partitions;
+
+bool TypePartitions::Register(uint64_t token) {
+  // The stored value token + 1 must not wrap around to the free marker.
+  if (token == ~uint64_t{0}) return false;
+  if (Find(token) >= 0) return true;
+
+  AllocationGuardSpinLockHolder h(&register_lock_);
+  int free = -1;
+  for (int i = 0; i < kNumPartitions; ++i) {
+    const uint64_t stored = tokens_[i].load(std::memory_order_relaxed);
+    if (stored == token + 1) return true;
+    if (stored == 0 && free < 0) free = i;
+  }
+  if (free < 0) return false;
+  tokens_[free].store(token + 1, std::memory_order_release);
+  num_tokens_.fetch_add(1, std::memory_order_release);
+  return true;
+}
+
+void* TypePartitions::Pop(int partition, size_t size_class) {
+  ASSERT(partition >= 0 && partition < kNumPartitions);
+  ASSERT(size_class > 0 && size_class < kNumClasses);
+  Slot& slot = slots_[partition][size_class];
+  AllocationGuardSpinLockHolder h(&slot.lock);
+  if (slot.count.load(std::memory_order_relaxed) <= 1) {
+    Refill(slot, size_class);
+  }
+  void* ret = slot.head;
+  if (ABSL_PREDICT_FALSE(ret == nullptr)) return nullptr;
+  slot.head = *static_cast<void**>(ret);
+  slot.count.store(slot.count.load(std::memory_order_relaxed) - 1,
+                   std::memory_order_relaxed);
+  cached_bytes_.fetch_sub(tc_globals.sizemap().class_to_size(size_class),
+                          std::memory_order_relaxed);
+  return ret;
+}
+
+void TypePartitions::Refill(Slot& slot, size_t size_class) {
+  auto& freelist = tc_globals.central_freelist(size_class);
+  const size_t size = tc_globals.sizemap().class_to_size(size_class);
+  const int max_objects = std::max<size_t>(kMaxBytes / size, 1);
+  void* batch[kBatch];
+  int total = 0;
+  auto push = [&](int n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(slot.lock) {
+    for (int i = 0; i < n; ++i) {
+      *static_cast<void**>(batch[i]) = slot.head;
+      slot.head = batch[i];
+    }
+    total += n;
+  };
+  // Takes the free objects of <span>, one of whose objects we hold, before
+  // other size class users get them.
+  auto take_span = [&](Span* span) ABSL_EXCLUSIVE_LOCKS_REQUIRED(slot.lock) {
+    while (total < max_objects) {
+      const int n = freelist.RemoveFromSpan(
+          span, batch, std::min(kBatch, max_objects - total));
+      if (n == 0) break;
+      push(n);
+    }
+  };
+
+  // The last object held keeps the span it came from allocated, so the rest
+  // of that span can be taken before starting a new one.  It is kept at the
+  // tail of the list, behind the objects taken from its span.
+  void* anchor = slot.head;
+  if (anchor != nullptr) {
+    take_span(
+        tc_globals.pagemap().GetExistingDescriptor(PageIdContaining(anchor)));
+  }
+  if (total == 0) {
+    // The first object of a new span becomes the tail, and <anchor>, whose
+    // span is used up, is handed out first.
+    slot.head = nullptr;
+    const int n =
+        freelist.RemoveFromNewSpan(batch, std::min(kBatch, max_objects));
+    push(n);
+    if (n > 0) {
+      take_span(tc_globals.pagemap().GetExistingDescriptor(
+          PageIdContaining(batch[0])));
+    }
+    if (anchor != nullptr) {
+      *static_cast<void**>(anchor) = slot.head;
+      slot.head = anchor;
+    }
+  }
+  slot.count.store(slot.count.load(std::memory_order_relaxed) + total,
+                   std::memory_order_relaxed);
+  cached_bytes_.fetch_add(total * size, std::memory_order_relaxed);
+}
+
+size_t TypePartitions::ObjectsOfClass(size_t size_class) const {
+  size_t total = 0;
+  for (int i = 0; i < kNumPartitions; ++i) {
+    total += slots_[i][size_class].count.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
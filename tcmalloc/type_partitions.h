@@ -0,0 +1,132 @@
+// Copyright 2024 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_TYPE_PARTITIONS_H_
+#define TCMALLOC_TYPE_PARTITIONS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Partitions of the small-object heap for allocations carrying the type
+// tokens registered with MallocExtension::PartitionAllocToken.  Each partition
+// takes its objects from spans it starts on itself, rather than from the
+// per-CPU caches, so that objects of one type are packed together on their
+// own spans even when other types share their size class.
+//
+// A partition keeps a list of free objects per size class, refilled with the
+// free objects of the span its last object came from and, once that span is
+// used up, of a new span (up to kMaxBytes at a time).  Objects are freed as
+// usual, so a freed object may be reused by any type; the partitioning only
+// decides where new objects are placed.  The objects held in these lists count
+// as allocated by the central freelists, and are reported as central cache
+// free bytes.
+class TypePartitions {
+ public:
+  static constexpr int kNumPartitions = 8;
+  // Objects are taken from the central freelists kBatch at a time, up to
+  // kMaxBytes of them per refill.
+  static constexpr int kBatch = 32;
+  static constexpr size_t kMaxBytes = 32 << 10;
+
+  constexpr TypePartitions() = default;
+
+  TypePartitions(const TypePartitions&) = delete;
+  TypePartitions& operator=(const TypePartitions&) = delete;
+
+  // Assigns a partition to <token>, if it has none.  Returns false if every
+  // partition is taken by another token.
+  bool Register(uint64_t token);
+
+  // Returns the partition of <token>, or -1 if it has none.
+  int Find(uint64_t token) const {
+    if (ABSL_PREDICT_TRUE(num_tokens_.load(std::memory_order_acquire) == 0)) {
+      return -1;
+    }
+    for (int i = 0; i < kNumPartitions; ++i) {
+      if (tokens_[i].load(std::memory_order_acquire) == token + 1) return i;
+    }
+    return -1;
+  }
+
+  // Returns a free object of <size_class> from <partition>, or nullptr if out
+  // of memory.
+  void* Pop(int partition, size_t size_class);
+
+  size_t cached_bytes() const {
+    return cached_bytes_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the number of free objects of <size_class> held in all
+  // partitions.
+  size_t ObjectsOfClass(size_t size_class) const;
+
+  // Acquires and releases every lock around fork(), so that the child does not
+  // inherit one held by a thread that no longer exists.  A slot's lock is held
+  // while refilling from the central freelists, so these come before theirs.
+  void AcquireInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    register_lock_.Lock();
+    for (auto& partition : slots_) {
+      for (Slot& slot : partition) slot.lock.Lock();
+    }
+  }
+  void ReleaseInternalLocks() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    for (auto& partition : slots_) {
+      for (Slot& slot : partition) slot.lock.Unlock();
+    }
+    register_lock_.Unlock();
+  }
+
+ private:
+  struct Slot {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    void* head ABSL_GUARDED_BY(lock) = nullptr;
+    std::atomic<uint32_t> count{0};
+  };
+
+  // Refills <slot>, which holds at most one object, with objects of
+  // <size_class>.
+  void Refill(Slot& slot, size_t size_class)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(slot.lock);
+
+  absl::base_internal::SpinLock register_lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+  // Tokens are stored plus one, so that zero marks a free partition.
+  std::atomic<uint64_t> tokens_[kNumPartitions] = {};
+  std::atomic<int> num_tokens_{0};
+  std::atomic<size_t> cached_bytes_{0};
+  Slot slots_[kNumPartitions][kNumClasses];
+};
+
+extern TypePartitions type_partitions;
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_TYPE_PARTITIONS_H_
@@ -44,6 +44,18 @@ build_variants = [
         "name": "256k_pages_numa_aware",
         "copts": ["-DTCMALLOC_INTERNAL_256K_PAGES", "-DTCMALLOC_INTERNAL_NUMA_AWARE"],
     },
+    {
+        "name": "sharded_central_freelist",
+        "copts": ["-DTCMALLOC_INTERNAL_8K_PAGES", "-DTCMALLOC_INTERNAL_SHARDED_CENTRAL_FREELIST"],
+    },
+    {
+        "name": "numa_aware_8_partitions",
+        "copts": ["-DTCMALLOC_INTERNAL_8K_PAGES", "-DTCMALLOC_INTERNAL_NUMA_AWARE", "-DTCMALLOC_INTERNAL_NUMA_PARTITIONS=8"],
+    },
+    {
+        "name": "registered_heap",
+        "copts": ["-DTCMALLOC_INTERNAL_8K_PAGES", "-DTCMALLOC_INTERNAL_REGISTERED_HEAP"],
+    },
 ]
 
 test_variants = [
@@ -109,6 +121,18 @@ test_variants = [
         ],
         "copts": ["-DTCMALLOC_INTERNAL_256K_PAGES", "-DTCMALLOC_INTERNAL_NUMA_AWARE"],
     },
+    {
+        "name": "numa_aware_8_partitions",
+        "malloc": "//tcmalloc:tcmalloc_numa_aware_8_partitions",
+        "deps": [
+            "//tcmalloc:common_numa_aware_8_partitions",
+            "//tcmalloc:want_numa_aware",
+        ],
+        "copts": [
+            "-DTCMALLOC_INTERNAL_NUMA_AWARE",
+            "-DTCMALLOC_INTERNAL_NUMA_PARTITIONS=8",
+        ],
+    },
     {
         "name": "256k_pages_pow2_sharded_transfer_cache",
         "malloc": "//tcmalloc:tcmalloc_256k_pages",
@@ -213,6 +237,14 @@ test_variants = [
         ],
         "env": {"PERCPU_VCPU_MODE": "none"},
     },
+    {
+        "name": "locked_cpu_caches",
+        "malloc": "//tcmalloc",
+        "deps": [
+            "//tcmalloc:common_8k_pages",
+        ],
+        "env": {"TCMALLOC_PERCPU_LOCKED_FALLBACK": "force"},
+    },
 ]
 
 def create_tcmalloc_library(